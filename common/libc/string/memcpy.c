@@ -47,39 +47,59 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
+	long *dl;
+	const long *sl;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speedy copying, if both pointers are equally far from a
+	 * word boundary, copy bytes until they're both word-aligned,
+	 * then copy words four at a time, then any words left, and
+	 * finish off with bytes. Otherwise, copy by bytes; there's no
+	 * portable way to do unaligned word loads or stores. (On MIPS
+	 * this function is replaced by an assembler version, which
+	 * does have them and so copies by words either way; see
+	 * common/libc/arch/mips/memcpy.S.)
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (((uintptr_t)d ^ (uintptr_t)s) % sizeof(long) == 0 &&
+	    len >= 4*sizeof(long)) {
 
-		long *d = dst;
-		const long *s = src;
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		dl = (long *)d;
+		sl = (const long *)s;
+		while (len >= 4*sizeof(long)) {
+			dl[0] = sl[0];
+			dl[1] = sl[1];
+			dl[2] = sl[2];
+			dl[3] = sl[3];
+			dl += 4;
+			sl += 4;
+			len -= 4*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*dl++ = *sl++;
+			len -= sizeof(long);
 		}
+		d = (char *)dl;
+		s = (const char *)sl;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
@@ -48,7 +48,10 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
+	long *dl;
+	const long *sl;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +87,44 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copy by words in the common case, from the top down. Look in
+	 * memcpy.c for more information. Working downwards, each store
+	 * only overwrites source bytes that have already been copied.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (((uintptr_t)d ^ (uintptr_t)s) % sizeof(long) == 0 &&
+	    len >= 4*sizeof(long)) {
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		dl = (long *)d;
+		sl = (const long *)s;
+		while (len >= 4*sizeof(long)) {
+			dl -= 4;
+			sl -= 4;
+			dl[3] = sl[3];
+			dl[2] = sl[2];
+			dl[1] = sl[1];
+			dl[0] = sl[0];
+			len -= 4*sizeof(long);
 		}
+		while (len >= sizeof(long)) {
+			*--dl = *--sl;
+			len -= sizeof(long);
+		}
+		d = (char *)dl;
+		s = (const char *)sl;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -31,6 +31,7 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
@@ -42,10 +43,48 @@ void *
 memset(void *ptr, int ch, size_t len)
 {
 	char *p = ptr;
-	size_t i;
+	unsigned long pattern;
+	unsigned long *pl;
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	/*
+	 * For long blocks, write bytes up to a word boundary, then
+	 * write words (four at a time) holding four or eight copies of
+	 * the byte, then the bytes left over. See memcpy.c.
+	 */
+
+	if (len >= 4*sizeof(long)) {
+		while ((uintptr_t)p % sizeof(long) != 0) {
+			*p++ = ch;
+			len--;
+		}
+
+		pattern = (unsigned char)ch;
+		pattern |= pattern << 8;
+		pattern |= pattern << 16;
+		if (sizeof(long) > 4) {
+			/* two shifts, so it's not an overflow on 32-bit */
+			pattern |= (pattern << 16) << 16;
+		}
+
+		pl = (unsigned long *)p;
+		while (len >= 4*sizeof(long)) {
+			pl[0] = pattern;
+			pl[1] = pattern;
+			pl[2] = pattern;
+			pl[3] = pattern;
+			pl += 4;
+			len -= 4*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*pl++ = pattern;
+			len -= sizeof(long);
+		}
+		p = (char *)pl;
+	}
+
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
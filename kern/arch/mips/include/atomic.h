@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic counters, with LL/SC. See include/atomic.h for the
+ * interface, and machine/spinlock.h for how LL/SC works.
+ *
+ * The barrier before each LL/SC loop orders it after what came
+ * before, and the one after orders what comes after, as the spinlock
+ * code does around its own LL/SC.
+ */
+
+#include <membar.h>
+
+/*
+ * Reading a plain 32-bit value is one instruction, and instructions
+ * are atomic with respect to memory.
+ */
+ATOMIC_INLINE
+unsigned
+atomic_get(volatile unsigned *p)
+{
+	return *p;
+}
+
+/*
+ * Add DELTA to *P unless *P is UNLESS; return whether we did. Retries
+ * the LL/SC until the SC succeeds or *P is found to be UNLESS.
+ */
+ATOMIC_INLINE
+bool
+atomic_add_unless(volatile unsigned *p, int delta, unsigned unless)
+{
+	unsigned x;
+	unsigned y;
+
+	membar_any_any();
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slots */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"beq %0, %4, 2f;"	/*   give up if x == unless */
+		" addu %1, %0, %3;"	/*   (delay slot) y = x + delta */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   retry on failure */
+		" nop;"			/*   (delay slot) */
+		"2:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (delta), "r" (unless)
+		: "memory");
+	membar_any_any();
+	return x != unless;
+}
+
+ATOMIC_INLINE
+void
+atomic_inc(volatile unsigned *p)
+{
+	unsigned x;
+	unsigned y;
+
+	membar_any_any();
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slot */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addiu %1, %0, 1;"	/*   y = x + 1 */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   retry on failure */
+		" nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (p) : "memory");
+	membar_any_any();
+}
+
+ATOMIC_INLINE
+bool
+atomic_inc_not_zero(volatile unsigned *p)
+{
+	return atomic_add_unless(p, 1, 0);
+}
+
+ATOMIC_INLINE
+bool
+atomic_dec_and_test(volatile unsigned *p)
+{
+	unsigned x;
+	unsigned y;
+
+	membar_any_any();
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slot */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addiu %1, %0, -1;"	/*   y = x - 1 */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   retry on failure */
+		" nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (p) : "memory");
+	membar_any_any();
+	return x == 1;
+}
+
+#endif /* _MIPS_ATOMIC_H_ */
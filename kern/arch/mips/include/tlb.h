@@ -37,13 +37,18 @@
  *        into a "random" TLB slot chosen by the processor.
  *
  *        IMPORTANT NOTE: never write more than one TLB entry with the
- *        same virtual page field.
+ *        same virtual page and PID fields.
  *
  *   tlb_write: same as tlb_random, but you choose the slot.
  *
  *   tlb_read: read a TLB entry out of the TLB into ENTRYHI and ENTRYLO.
  *        INDEX specifies which one to get.
  *
+ *   tlb_setasid: load ENTRYHI into c0_entryhi, for the sake of its
+ *        PID field, which is what translations are matched against.
+ *        tlb_random, tlb_write, tlb_read and tlb_probe all change
+ *        c0_entryhi, so code that uses them must put the PID back.
+ *
  *   tlb_probe: look for an entry matching the virtual page in ENTRYHI.
  *        Returns the index, or a negative number if no matching entry
  *        was found. ENTRYLO is not actually used, but must be set; 0
@@ -58,15 +63,18 @@
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
+void tlb_setasid(uint32_t entryhi);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * The MIPS has support for a 6-bit address space ID: an entry only
+ * matches when its TLBHI_PID field equals the one in c0_entryhi. The
+ * VM system tags user translations with it (see vm_machdep.c) so
+ * they survive switches between address spaces; dumbvm leaves it
+ * zero. TLBLO_GLOBAL, which matches regardless of the PID, isn't
+ * used, nor are the bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +86,9 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+#define NUM_ASID      64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -36,6 +36,7 @@
  */
 
 #define PAGE_SIZE  4096         /* size of VM page */
+#define CACHELINE_SIZE 64       /* for laying out shared data; see cpu.h */
 #define PAGE_FRAME 0xfffff000   /* mask for getting page number from addr */
 
 /*
@@ -67,6 +68,9 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/* And the reverse, for kseg0 addresses only. */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -110,17 +114,100 @@ paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
+/*
+ * Interface to the MMU for the VM code.
+ *
+ * Each address space has a struct mmu_ctx, which holds the ASID its
+ * translations are tagged with on each CPU. ASIDs are handed out per
+ * CPU, in generations: when a CPU runs out, it flushes its TLB and
+ * starts a new generation, and every ASID from the old one becomes
+ * stale. So entries stay in the TLB when another address space is
+ * activated, and are still good when this one comes back.
+ *
+ * The TLB refill handler in exception-mips1.S walks the page table
+ * of the context last activated on each CPU without calling into C,
+ * and falls back to vm_fault for pages that aren't resident.
+ *
+ * mmu_ctx_init sets up an mmu_ctx with no ASIDs, for page table PT,
+ * which may be NULL if the refill handler shouldn't use one.
+ *
+ * mmu_ctx_destroy makes sure no CPU's refill handler still uses
+ * CTX's page table, before it's freed.
+ *
+ * mmu_activate makes CTX's translations the ones the current CPU
+ * uses, giving it an ASID there if it hasn't a current one.
+ *
+ * mmu_deactivate stops the current CPU's refill handler from using
+ * the page table of whatever context was active.
+ *
+ * mmu_ctx_loaded returns whether CTX may have translations in the
+ * TLB of cpu C. It reads C's state without synchronizing: a CPU that
+ * gives CTX an ASID after the caller looks finds no translations
+ * under it, so the caller must already have changed the page table.
+ *
+ * mmu_map loads a translation for the page containing VA into the
+ * MMU of the current CPU for the active context, replacing any
+ * existing translation for it. If WRITEABLE is false, writes will
+ * fault with VM_FAULT_READONLY. When the TLB is full, entries are
+ * replaced round-robin.
+ *
+ * mmu_unmap drops the current CPU's translation for VA in CTX, if
+ * any.
+ *
+ * mmu_flush_ctx drops all of CTX's translations on the current CPU,
+ * by retiring its ASID there.
+ *
+ * mmu_flush drops all of the current CPU's user translations, in
+ * every context.
+ *
+ * mmu_refill_hold makes the refill handler leave every miss to
+ * vm_fault until the matching mmu_refill_release. The refill handler
+ * doesn't check for pinned pages, so pageout holds it off between
+ * shooting down a page's translations and changing its page table
+ * entry. Holds nest and may be taken on several CPUs at once.
+ *
+ * mmu_printstats prints the per-CPU TLB miss/refill counters, and
+ * mmu_kstat adds them to a kstat snapshot.
+ */
+
+#define MMU_MAXCPUS	32
+
+struct cpu;
+struct pagetable;
+struct kstat;
+
+struct mmu_ctx {
+	/* Per cpu: ASID generation | ASID, or 0 */
+	uint32_t mc_asid[MMU_MAXCPUS];
+	/* For the refill handler */
+	struct pagetable *mc_pt;
+};
+
+void mmu_ctx_init(struct mmu_ctx *ctx, struct pagetable *pt);
+void mmu_ctx_destroy(struct mmu_ctx *ctx);
+void mmu_activate(struct mmu_ctx *ctx);
+void mmu_deactivate(void);
+void mmu_refill_hold(void);
+void mmu_refill_release(void);
+bool mmu_ctx_loaded(const struct mmu_ctx *ctx, const struct cpu *c);
+void mmu_map(vaddr_t va, paddr_t pa, bool writeable);
+void mmu_unmap(struct mmu_ctx *ctx, vaddr_t va);
+void mmu_printstats(void);
+void mmu_kstat(struct kstat *ks);
+void mmu_flush_ctx(struct mmu_ctx *ctx);
+void mmu_flush(void);
+
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Each one covers a range of pages.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct mmu_ctx *ts_ctx;	/* whose translations */
+	vaddr_t ts_vaddr;	/* first page to drop */
+	unsigned ts_npages;	/* number of pages */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -38,6 +38,8 @@
 #include <current.h>
 #include <vm.h>
 #include <mainbus.h>
+#include <softint.h>
+#include <proc.h>
 #include <syscall.h>
 
 
@@ -46,6 +48,7 @@ extern __DEAD void asm_usermode(struct trapframe *tf);
 
 /* called only from assembler, so not declared in a header */
 void mips_trap(struct trapframe *tf);
+void mips_fastsyscall(struct trapframe *tf);
 
 
 /* Names for trap codes */
@@ -149,6 +152,11 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/* The time since we left the kernel was the user's. */
+	if (!iskern) {
+		thread_charge(true);
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
@@ -187,7 +195,27 @@ mips_trap(struct trapframe *tf)
 
 		mainbus_interrupt(tf);
 
+		if (doadjust && !softint_active()) {
+			/*
+			 * The interrupt came in at spl 0, so finish
+			 * off the handlers' work with interrupts on.
+			 * Then if that woke something that should run
+			 * before the thread it interrupted, switch now
+			 * rather than at the next hardclock. (Not from
+			 * an interrupt that came in during softints:
+			 * the ones running will see to its softints,
+			 * and they can't be switched away from.)
+			 */
+			if (softint_run(true) &&
+			    curthread->t_rcu_nest == 0) {
+				thread_yield();
+			}
+			else {
+				thread_preempt_irq();
+			}
+		}
 		if (doadjust) {
+
 			KASSERT(curthread->t_curspl == IPL_HIGH);
 			KASSERT(curthread->t_iplhigh_count == 1);
 			curthread->t_iplhigh_count--;
@@ -195,6 +223,19 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * A thread that never makes a syscall still has to
+		 * notice when another one is waiting for it to go
+		 * (see proc_single). The timer interrupt is its
+		 * chance.
+		 */
+		if (!iskern && proc_mustexit()) {
+			spl = splhigh();
+			splx(spl);
+			proc_checkexit();
+			cpu_irqoff();
+		}
 		goto done2;
 	}
 
@@ -237,11 +278,13 @@ mips_trap(struct trapframe *tf)
 		}
 		break;
 	case EX_TLBL:
+		curcpu->c_tlb_misses++;
 		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBS:
+		curcpu->c_tlb_misses++;
 		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
 			goto done;
 		}
@@ -332,6 +375,10 @@ mips_trap(struct trapframe *tf)
 		return;
 	}
 
+	if (!iskern) {
+		thread_charge(false);
+	}
+
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
@@ -347,6 +394,46 @@ mips_trap(struct trapframe *tf)
 	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
 }
 
+/*
+ * Syscall handling for the fast path in exception-*.S, which takes
+ * every syscall but fork and vfork. This is what mips_trap does for
+ * EX_SYS, without the rest. The trapframe only has the registers
+ * syscall() and the syscall stubs use (arguments, results, sp, epc,
+ * status and cause) plus ra, gp and s7; the other slots hold junk,
+ * which is why fork and vfork, whose children start from a copy of
+ * it, go the slow way.
+ */
+void
+mips_fastsyscall(struct trapframe *tf)
+{
+	int spl;
+
+	KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
+	KASSERT((vaddr_t)tf < (vaddr_t)(curthread->t_stack + STACK_SIZE));
+
+	/* The time since we left the kernel was the user's. */
+	thread_charge(true);
+
+	/* Interrupts back on, as in mips_trap. */
+	spl = splhigh();
+	splx(spl);
+
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	DEBUG(DB_SYSCALL, "syscall: #%d, args %x %x %x %x\n",
+	      tf->tf_v0, tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3);
+
+	syscall(tf);
+
+	cpu_irqoff();
+	thread_charge(false);
+
+	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
+	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
+	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+}
+
 /*
  * Function for entering user mode.
  *
@@ -377,6 +464,8 @@ mips_usermode(struct trapframe *tf)
 	spl0();
 	cpu_irqoff();
 
+	thread_charge(false);
+
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
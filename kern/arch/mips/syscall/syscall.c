@@ -31,12 +31,491 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <mips/specialreg.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <syscall.h>
+#include <kevent.h>
+#include <pcpu.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <kstat.h>
+#include "opt-net.h"
 
 
+static struct pcpu_counter syscall_count =
+	PCPU_COUNTER_INITIALIZER("syscall.calls");
+
+/*
+ * Argument marshalling. Each SYSCALLn(name, types...) defines a stub
+ * sc_name that takes the arguments for sys_name out of the trapframe
+ * and casts them to the given types. The R variants also pass the
+ * address of the return value; the X variant is for calls that don't
+ * return. The O variant is for calls with three 32-bit arguments and
+ * then a 64-bit one; a3 can't hold half a 64-bit value, so it goes on
+ * the user stack, at sp+16. Anything else is written out by hand, as
+ * with sc_lseek.
+ */
+
+#define SYSCALL0X(name) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)tf; \
+		(void)retval; \
+		sys_##name(); \
+		panic("Returning from " #name "\n"); \
+	}
+
+#define SYSCALL0R(name) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)tf; \
+		return sys_##name(retval); \
+	}
+
+#define SYSCALL1(name, t0) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)retval; \
+		return sys_##name((t0)tf->tf_a0); \
+	}
+
+#define SYSCALL1R(name, t0) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		return sys_##name((t0)tf->tf_a0, retval); \
+	}
+
+#define SYSCALL1X(name, t0) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)retval; \
+		sys_##name((t0)tf->tf_a0); \
+		panic("Returning from " #name "\n"); \
+	}
+
+#define SYSCALL2(name, t0, t1) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)retval; \
+		return sys_##name((t0)tf->tf_a0, (t1)tf->tf_a1); \
+	}
+
+#define SYSCALL2R(name, t0, t1) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		return sys_##name((t0)tf->tf_a0, (t1)tf->tf_a1, retval); \
+	}
+
+#define SYSCALL3(name, t0, t1, t2) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		(void)retval; \
+		return sys_##name((t0)tf->tf_a0, (t1)tf->tf_a1, \
+				  (t2)tf->tf_a2); \
+	}
+
+#define SYSCALL3R(name, t0, t1, t2) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		return sys_##name((t0)tf->tf_a0, (t1)tf->tf_a1, \
+				  (t2)tf->tf_a2, retval); \
+	}
+
+#define SYSCALL3RO(name, t0, t1, t2) \
+	static int sc_##name(struct trapframe *tf, int32_t *retval) \
+	{ \
+		off_t pos; \
+		int result; \
+		result = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, \
+				sizeof(pos)); \
+		if (result) { \
+			return result; \
+		} \
+		return sys_##name((t0)tf->tf_a0, (t1)tf->tf_a1, \
+				  (t2)tf->tf_a2, pos, retval); \
+	}
+
+SYSCALL0R(getpid)
+SYSCALL0R(getppid)
+SYSCALL3R(waitpid, pid_t, userptr_t, int)
+SYSCALL1(reboot, int)
+SYSCALL3R(open, const_userptr_t, int, mode_t)
+SYSCALL2(execv, const_userptr_t, const_userptr_t)
+SYSCALL1R(sbrk, intptr_t)
+SYSCALL2(munmap, userptr_t, size_t)
+SYSCALL3(madvise, userptr_t, size_t, int)
+SYSCALL3(mincore, userptr_t, size_t, userptr_t)
+SYSCALL2(mlock, userptr_t, size_t)
+SYSCALL2(munlock, userptr_t, size_t)
+SYSCALL2R(dup2, int, int)
+SYSCALL1(close, int)
+SYSCALL1(pipe, userptr_t)
+SYSCALL3R(read, int, userptr_t, size_t)
+SYSCALL3R(write, int, userptr_t, size_t)
+SYSCALL3RO(pread, int, userptr_t, size_t)
+SYSCALL3RO(pwrite, int, userptr_t, size_t)
+SYSCALL3R(readv, int, const_userptr_t, int)
+SYSCALL3R(writev, int, const_userptr_t, int)
+SYSCALL3RO(preadv, int, const_userptr_t, int)
+SYSCALL3RO(pwritev, int, const_userptr_t, int)
+SYSCALL3R(copyfile, int, int, size_t)
+SYSCALL2(fstat, int, userptr_t)
+SYSCALL3R(getdirentry, int, userptr_t, size_t)
+SYSCALL3R(getdirentries, int, userptr_t, size_t)
+SYSCALL3(ioctl, int, int, userptr_t)
+SYSCALL2(__time, userptr_t, userptr_t)
+SYSCALL0R(__timepage)
+SYSCALL2(nanosleep, const_userptr_t, userptr_t)
+SYSCALL2(getrusage, int, userptr_t)
+SYSCALL2R(getpriority, int, int)
+SYSCALL3(setpriority, int, int, int)
+SYSCALL2(setaffinity, pid_t, uint32_t)
+SYSCALL2(getaffinity, pid_t, userptr_t)
+SYSCALL3R(uprof, int, userptr_t, size_t)
+SYSCALL3(futex_wait, userptr_t, int, const_userptr_t)
+SYSCALL2R(futex_wake, userptr_t, int)
+SYSCALL0X(lwp_exit)
+SYSCALL1X(_exit, int)
+
+/*
+ * fork and vfork need the whole trapframe, to give the child.
+ */
+static
+int
+sc_fork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_fork(tf, retval);
+}
+
+static
+int
+sc_vfork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_vfork(tf, retval);
+}
+
+/*
+ * lwp_create only wants gp out of it (the rest comes from the
+ * arguments), so it can use the fast path's partial trapframe.
+ */
+static
+int
+sc_lwp_create(struct trapframe *tf, int32_t *retval)
+{
+	return sys_lwp_create(tf, retval);
+}
+
+/*
+ * lseek is the odd one out: the offset is 64-bit, so it goes in the
+ * a2/a3 pair, pushing whence onto the user stack, and the result
+ * comes back in v0/v1. We put the high half in *retval, which the
+ * dispatcher puts in v0, and the low half in v1 ourselves.
+ */
+static
+int
+sc_lseek(struct trapframe *tf, int32_t *retval)
+{
+	off_t pos, newpos;
+	int whence;
+	int result;
+
+	pos = ((off_t)tf->tf_a2 << 32) | tf->tf_a3;
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), &whence,
+			sizeof(whence));
+	if (result) {
+		return result;
+	}
+	result = sys_lseek(tf->tf_a0, pos, whence, &newpos);
+	if (result) {
+		return result;
+	}
+	*retval = (uint64_t)newpos >> 32;
+	tf->tf_v1 = (uint32_t)newpos;
+	return 0;
+}
+
+/*
+ * mmap has six arguments, one of them 64-bit: the fd is on the user
+ * stack at sp+16 and the offset, 8-aligned, at sp+24. The address
+ * hint in a0 is ignored. Both come in with one copyinv.
+ */
+static
+int
+sc_mmap(struct trapframe *tf, int32_t *retval)
+{
+	int32_t fd;
+	off_t pos;
+	struct copyinvec vec[2];
+	int result;
+
+	vec[0].ci_src = (const_userptr_t)(tf->tf_sp + 16);
+	vec[0].ci_dest = &fd;
+	vec[0].ci_len = sizeof(fd);
+	vec[1].ci_src = (const_userptr_t)(tf->tf_sp + 24);
+	vec[1].ci_dest = &pos;
+	vec[1].ci_len = sizeof(pos);
+	result = copyinv(vec, 2);
+	if (result) {
+		return result;
+	}
+	return sys_mmap(tf->tf_a1, tf->tf_a2, tf->tf_a3, fd, pos, retval);
+}
+
+#if OPT_NET
+SYSCALL3R(socket, int, int, int)
+SYSCALL3(bind, int, const_userptr_t, socklen_t)
+SYSCALL3(connect, int, const_userptr_t, socklen_t)
+SYSCALL3(getsockname, int, userptr_t, userptr_t)
+
+/*
+ * sendto and recvfrom have six arguments; the last two are on the
+ * user stack, at sp+16 and sp+20.
+ */
+static
+int
+sc_sendto(struct trapframe *tf, int32_t *retval)
+{
+	uint32_t extra[2];
+	int result;
+
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), extra,
+			sizeof(extra));
+	if (result) {
+		return result;
+	}
+	return sys_sendto(tf->tf_a0, (const_userptr_t)tf->tf_a1, tf->tf_a2,
+			  tf->tf_a3, (const_userptr_t)extra[0],
+			  (socklen_t)extra[1], retval);
+}
+
+static
+int
+sc_recvfrom(struct trapframe *tf, int32_t *retval)
+{
+	uint32_t extra[2];
+	int result;
+
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), extra,
+			sizeof(extra));
+	if (result) {
+		return result;
+	}
+	return sys_recvfrom(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
+			    tf->tf_a3, (userptr_t)extra[0],
+			    (userptr_t)extra[1], retval);
+}
+#endif /* OPT_NET */
+
+/*
+ * The dispatch table, indexed by call number. Holes are calls we
+ * don't implement. Each entry also counts its calls and keeps a
+ * histogram of how long they took, real time from dispatch to
+ * return; the cpu cycle counter is no good for that, as it starts
+ * over whenever the timer is set.
+ */
+
+#define SYSCALL_NBUCKETS	16
+
+struct sysent {
+	const char *se_name;
+	int (*se_call)(struct trapframe *tf, int32_t *retval);
+	bool se_noreturn;		/* returns only on error */
+
+	struct spinlock se_lock;	/* protects the rest */
+	unsigned se_calls;
+	unsigned se_errors;
+	uint64_t se_ns;			/* total time */
+	unsigned se_hist[SYSCALL_NBUCKETS]; /* log2 of microseconds */
+};
+
+#define SYSENT(name) \
+	[SYS_##name] = { \
+		.se_name = #name, \
+		.se_call = sc_##name, \
+		.se_lock = SPINLOCK_INITIALIZER, \
+	}
+
+#define SYSENT_NORETURN(name) \
+	[SYS_##name] = { \
+		.se_name = #name, \
+		.se_call = sc_##name, \
+		.se_noreturn = true, \
+		.se_lock = SPINLOCK_INITIALIZER, \
+	}
+
+static struct sysent sysent[] = {
+	SYSENT(fork),
+	SYSENT(vfork),
+	SYSENT(getpid),
+	SYSENT(getppid),
+	SYSENT(waitpid),
+	SYSENT_NORETURN(execv),
+	SYSENT(sbrk),
+	SYSENT(mmap),
+	SYSENT(munmap),
+	SYSENT(madvise),
+	SYSENT(mincore),
+	SYSENT(mlock),
+	SYSENT(munlock),
+	SYSENT(reboot),
+	SYSENT(open),
+	SYSENT(dup2),
+	SYSENT(close),
+	SYSENT(pipe),
+	SYSENT(read),
+	SYSENT(write),
+	SYSENT(pread),
+	SYSENT(pwrite),
+	SYSENT(readv),
+	SYSENT(writev),
+	SYSENT(preadv),
+	SYSENT(pwritev),
+	SYSENT(lseek),
+	SYSENT(fstat),
+	SYSENT(getdirentry),
+	SYSENT(getdirentries),
+	SYSENT(copyfile),
+	SYSENT(ioctl),
+	SYSENT(__time),
+	SYSENT(__timepage),
+	SYSENT(nanosleep),
+	SYSENT(getrusage),
+	SYSENT(getpriority),
+	SYSENT(setpriority),
+	SYSENT(setaffinity),
+	SYSENT(getaffinity),
+	SYSENT(futex_wait),
+	SYSENT(futex_wake),
+	SYSENT(uprof),
+	SYSENT(lwp_create),
+	SYSENT_NORETURN(lwp_exit),
+#if OPT_NET
+	SYSENT(socket),
+	SYSENT(bind),
+	SYSENT(connect),
+	SYSENT(getsockname),
+	SYSENT(sendto),
+	SYSENT(recvfrom),
+#endif
+	SYSENT_NORETURN(_exit),
+};
+
+#define NSYSENT (sizeof(sysent) / sizeof(sysent[0]))
+
+/*
+ * Count a call to SE that took NS nanoseconds and returned ERR.
+ */
+static
+void
+syscall_account(struct sysent *se, uint64_t ns, int err)
+{
+	unsigned bucket;
+	uint32_t us;
+
+	us = ns >= 0xffffffffULL * 1000 ? 0xffffffff : ns / 1000;
+	for (bucket = 0; us > 1 && bucket < SYSCALL_NBUCKETS - 1; bucket++) {
+		us >>= 1;
+	}
+
+	spinlock_acquire(&se->se_lock);
+	se->se_calls++;
+	if (err) {
+		se->se_errors++;
+	}
+	se->se_ns += ns;
+	se->se_hist[bucket]++;
+	spinlock_release(&se->se_lock);
+}
+
+/*
+ * Print the counters for every call that's been made.
+ */
+void
+syscall_printstats(void)
+{
+	struct sysent *se, copy;
+	unsigned i, j, last;
+
+	kprintf("call          calls  errors  avg us  latency (us, log2)\n");
+	for (i=0; i<NSYSENT; i++) {
+		se = &sysent[i];
+		if (se->se_call == NULL) {
+			continue;
+		}
+		spinlock_acquire(&se->se_lock);
+		copy = *se;
+		spinlock_release(&se->se_lock);
+		if (copy.se_calls == 0) {
+			continue;
+		}
+
+		last = 0;
+		for (j=0; j<SYSCALL_NBUCKETS; j++) {
+			if (copy.se_hist[j] > 0) {
+				last = j;
+			}
+		}
+		kprintf("%-12s %6u %7u %7llu ", copy.se_name,
+			copy.se_calls, copy.se_errors,
+			(unsigned long long)(copy.se_ns / 1000 /
+					     copy.se_calls));
+		for (j=0; j<=last; j++) {
+			kprintf(" %u", copy.se_hist[j]);
+		}
+		kprintf("\n");
+	}
+}
+
+/*
+ * The same counters, for kstat. Calls never made are left out.
+ */
+void
+syscall_kstat(struct kstat *ks)
+{
+	struct sysent *se, copy;
+	char prefix[32];
+	unsigned i;
+
+	for (i=0; i<NSYSENT; i++) {
+		se = &sysent[i];
+		if (se->se_call == NULL) {
+			continue;
+		}
+		spinlock_acquire(&se->se_lock);
+		copy = *se;
+		spinlock_release(&se->se_lock);
+		if (copy.se_calls == 0) {
+			continue;
+		}
+		snprintf(prefix, sizeof(prefix), "syscall.%s", copy.se_name);
+		kstat_addsub(ks, prefix, "calls", copy.se_calls);
+		kstat_addsub(ks, prefix, "errors", copy.se_errors);
+		kstat_addsub(ks, prefix, "ns", copy.se_ns);
+	}
+}
+
+void
+syscall_resetstats(void)
+{
+	struct sysent *se;
+	unsigned i;
+
+	for (i=0; i<NSYSENT; i++) {
+		se = &sysent[i];
+		spinlock_acquire(&se->se_lock);
+		se->se_calls = 0;
+		se->se_errors = 0;
+		se->se_ns = 0;
+		bzero(se->se_hist, sizeof(se->se_hist));
+		spinlock_release(&se->se_lock);
+	}
+}
+
 /*
  * System call dispatcher.
  *
@@ -78,6 +557,8 @@
 void
 syscall(struct trapframe *tf)
 {
+	struct sysent *se;
+	uint64_t start;
 	int callno;
 	int32_t retval;
 	int err;
@@ -87,6 +568,8 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	KEVENT(KEV_SYSCALL, callno, tf->tf_a0, 0, 0);
+	pcpu_counter_inc(&syscall_count);
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -99,27 +582,27 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-
-            case SYS__exit:
-                sys__exit(tf->tf_a0);
-                panic("Returning from exit\n");
-                break;
-
-	    /* Add stuff here */
-
-	    default:
+	if (callno < 0 || (unsigned)callno >= NSYSENT ||
+	    sysent[callno].se_call == NULL) {
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
-		break;
+	}
+	else {
+		se = &sysent[callno];
+		if (se->se_noreturn) {
+			/* count it now; if it comes back, it failed */
+			syscall_account(se, 0, 0);
+			err = se->se_call(tf, &retval);
+			spinlock_acquire(&se->se_lock);
+			se->se_errors++;
+			spinlock_release(&se->se_lock);
+		}
+		else {
+			/* mips_trap just charged user time, at this time */
+			start = curthread->t_usagestamp;
+			err = se->se_call(tf, &retval);
+			syscall_account(se, clock_now() - start, err);
+		}
 	}
 
 
@@ -145,6 +628,12 @@ syscall(struct trapframe *tf)
 
 	tf->tf_epc += 4;
 
+	/*
+	 * If another thread is waiting to have the process to itself
+	 * (to exit or exec), leave instead of going back to userlevel.
+	 */
+	proc_checkexit();
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
@@ -152,15 +641,46 @@ syscall(struct trapframe *tf)
 }
 
 /*
- * Enter user mode for a newly forked process.
- *
- * This function is provided as a reminder. You need to write
- * both it and the code that calls it.
- *
- * Thus, you can trash it and do things another way if you prefer.
+ * Enter user mode for a newly forked process. TF is a kmalloc'd copy
+ * of the parent's trapframe from the fork call; we take it over and
+ * make the call return 0 in the child.
  */
 void
 enter_forked_process(struct trapframe *tf)
 {
-	(void)tf;
+	struct trapframe mytf;
+
+	mytf = *tf;
+	kfree(tf);
+
+	mytf.tf_v0 = 0;
+	mytf.tf_a3 = 0;		/* signal no error */
+	mytf.tf_epc += 4;
+
+	as_activate();
+	mips_usermode(&mytf);
+}
+
+/*
+ * Enter user mode in a new thread of the current process. TF is a
+ * kmalloc'd copy of the creating thread's trapframe with tf_epc,
+ * tf_a0 and tf_sp already set to the entry point, its argument and
+ * the new stack; we take it over. Nothing else carries over except
+ * gp, which crt0 set once for the whole program.
+ */
+void
+enter_new_thread(struct trapframe *tf)
+{
+	struct trapframe mytf;
+
+	bzero(&mytf, sizeof(mytf));
+	mytf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	mytf.tf_epc = tf->tf_epc;
+	mytf.tf_a0 = tf->tf_a0;
+	mytf.tf_sp = tf->tf_sp;
+	mytf.tf_gp = tf->tf_gp;
+	kfree(tf);
+
+	as_activate();
+	mips_usermode(&mytf);
 }
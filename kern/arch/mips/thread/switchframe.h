@@ -45,7 +45,7 @@ struct switchframe {
         uint32_t sf_s5;
         uint32_t sf_s6;
         uint32_t sf_s8;
-        uint32_t sf_gp;
+        uint32_t sf_unused;	/* was gp; keeps the frame 8-aligned */
         uint32_t sf_ra;
 };
 
@@ -38,6 +38,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kevent.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -126,6 +127,12 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
@@ -138,12 +145,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
+	KEVENT(KEV_FAULT, faulttype, faultaddress, 0, 0);
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
@@ -213,25 +218,25 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	mmu_map(faultaddress, paddr, true);
+	return 0;
+}
+
+bool
+vm_pinuser(struct addrspace *as, vaddr_t vaddr, bool write, paddr_t *ret)
+{
+	(void)as;
+	(void)vaddr;
+	(void)write;
+	(void)ret;
+	return false;
+}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+void
+vm_unpinuser(paddr_t pa)
+{
+	(void)pa;
 }
 
 struct addrspace *
@@ -263,7 +268,6 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -271,14 +275,7 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	mmu_flush();
 }
 
 void
@@ -383,6 +380,105 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * There's no heap: growing one would take more physically contiguous
+ * memory, which is what dumbvm can't do.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+/*
+ * Nor is there anywhere to put mappings, for the same reason.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *vn, off_t offset, size_t len,
+	int writeable, vaddr_t *ret)
+{
+	(void)as;
+	(void)vn;
+	(void)offset;
+	(void)len;
+	(void)writeable;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_mmapanon(struct addrspace *as, size_t len, int writeable, int shared,
+	    vaddr_t *ret)
+{
+	(void)as;
+	(void)len;
+	(void)writeable;
+	(void)shared;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return EINVAL;
+}
+
+int
+as_timepage(struct addrspace *as, vaddr_t *ret)
+{
+	(void)as;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)advice;
+	return ENOSYS;
+}
+
+int
+as_mlock(struct addrspace *as, vaddr_t vaddr, size_t len, bool lock)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)lock;
+	return ENOSYS;
+}
+
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t len, userptr_t vec)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)vec;
+	return ENOSYS;
+}
+
+/*
+ * Without shared memory, every futex is in just one address space.
+ */
+void
+as_futexkey(struct addrspace *as, vaddr_t uaddr, const void **key,
+	    uintptr_t *off)
+{
+	*key = as;
+	*off = uaddr;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
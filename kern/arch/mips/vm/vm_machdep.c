@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * MIPS MMU (TLB) handling.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <atomic.h>
+#include <mips/tlb.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <kstat.h>
+
+/*
+ * ASIDs.
+ *
+ * An mmu_ctx holds, for each cpu, the cpu's ASID generation (a
+ * multiple of NUM_ASID) plus the ASID, 1 to NUM_ASID-1; 0 means none.
+ * A value is current on a cpu iff its generation matches the cpu's
+ * c_asidgen. Each ASID is handed out once per generation, so a new
+ * one never has entries under it; when a cpu runs out it flushes its
+ * TLB and only then moves to the next generation, which makes all
+ * the old values stale at once. c_asidgen starts at 0, which no
+ * value is current in, so the first activation on each cpu starts
+ * generation 1. (After 2^26 generations the counter would wrap and
+ * very old values could look current again; that's some 4 billion
+ * ASID allocations on one cpu.)
+ *
+ * ASID 0 is the one dumbvm and kernel-only threads before the first
+ * activation run with; the VM system never tags entries with it.
+ *
+ * There are never more than MMU_MAXCPUS cpus (the shootdown code
+ * keeps a 32-bit mask of them), so an mmu_ctx has a slot per cpu.
+ */
+
+#define ASID_GEN(v)	((v) & ~(uint32_t)(NUM_ASID - 1))
+#define ASID_NUM(v)	((v) & (NUM_ASID - 1))
+#define ASID_EHI(n)	((uint32_t)(n) << TLBHI_PIDSHIFT)
+
+static
+bool
+asid_current(uint32_t v, const struct cpu *c)
+{
+	return v != 0 && ASID_GEN(v) == c->c_asidgen;
+}
+
+/*
+ * What the refill handler (mips_utlb_refill in exception-mips1.S)
+ * reads: each cpu's current page table, indexed by cpu number as
+ * cputhreads[] is, and the count of holds. It decodes page tables
+ * itself, so check it agrees with <pagetable.h>. (It also assumes
+ * pt_l2[] is at the start of struct pagetable.)
+ */
+struct pagetable *cpupagetables[MMU_MAXCPUS];
+volatile unsigned mmu_refill_holds;
+
+#if PT_L1BITS != 10 || PT_L2BITS != 10 || PAGE_FRAME != 0xfffff000
+#error "mips_utlb_refill doesn't match the page table layout"
+#endif
+#if PTE_VALID << 9 != TLBLO_VALID || PTE_WRITE << 9 != TLBLO_DIRTY
+#error "mips_utlb_refill doesn't match the PTE bits"
+#endif
+#if PTE_VALID != 0x1 || PTE_REF != 0x40
+#error "mips_utlb_refill doesn't match the PTE bits"
+#endif
+
+void
+mmu_ctx_init(struct mmu_ctx *ctx, struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<MMU_MAXCPUS; i++) {
+		ctx->mc_asid[i] = 0;
+	}
+	ctx->mc_pt = pt;
+}
+
+/*
+ * Only cpus that ran us last can have our page table; some of them
+ * may be switching to something else meanwhile, but all they do is
+ * replace it. Any refill still using it would be for a thread in
+ * this address space, and there aren't any.
+ */
+void
+mmu_ctx_destroy(struct mmu_ctx *ctx)
+{
+	unsigned i;
+
+	if (ctx->mc_pt == NULL) {
+		return;
+	}
+	for (i=0; i<MMU_MAXCPUS; i++) {
+		if (cpupagetables[i] == ctx->mc_pt) {
+			cpupagetables[i] = NULL;
+		}
+	}
+	membar_any_any();
+}
+
+void
+mmu_activate(struct mmu_ctx *ctx)
+{
+	struct cpu *c;
+	uint32_t v;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	KASSERT(c->c_number < MMU_MAXCPUS);
+
+	v = ctx->mc_asid[c->c_number];
+	if (!asid_current(v, c)) {
+		if (c->c_asidgen == 0 || c->c_asidfree == NUM_ASID) {
+			/* Flush first, so no stale entry outlives its gen */
+			mmu_flush();
+			membar_any_any();
+			c->c_asidgen += NUM_ASID;
+			c->c_asidfree = 1;
+			c->c_asid_rollovers++;
+		}
+		v = c->c_asidgen | c->c_asidfree++;
+		ctx->mc_asid[c->c_number] = v;
+		/* Publish before loading any translations under it */
+		membar_any_any();
+	}
+	if (c->c_asid != ASID_NUM(v)) {
+		c->c_asid = ASID_NUM(v);
+		tlb_setasid(ASID_EHI(c->c_asid));
+	}
+	cpupagetables[c->c_number] = ctx->mc_pt;
+
+	splx(spl);
+}
+
+void
+mmu_deactivate(void)
+{
+	int spl;
+
+	spl = splhigh();
+	cpupagetables[curcpu->c_number] = NULL;
+	splx(spl);
+}
+
+void
+mmu_refill_hold(void)
+{
+	atomic_inc(&mmu_refill_holds);
+}
+
+void
+mmu_refill_release(void)
+{
+	KASSERT(atomic_get(&mmu_refill_holds) > 0);
+	atomic_dec_and_test(&mmu_refill_holds);
+}
+
+bool
+mmu_ctx_loaded(const struct mmu_ctx *ctx, const struct cpu *c)
+{
+	KASSERT(c->c_number < MMU_MAXCPUS);
+	return asid_current(ctx->mc_asid[c->c_number], c);
+}
+
+/*
+ * When there's no existing entry for the page, the new entry goes in
+ * the slot named by curcpu->c_tlb_victim, which then advances
+ * round-robin. After a flush this fills the empty slots in order
+ * without having to search for them; once the TLB is full it evicts
+ * the oldest-loaded entry.
+ */
+
+void
+mmu_map(vaddr_t va, paddr_t pa, bool writeable)
+{
+	uint32_t ehi, elo, oldehi, oldelo;
+	int index, spl;
+	struct cpu *c;
+
+	KASSERT(va < USERSPACETOP);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/* Writing the entry leaves c0_entryhi holding our ASID again. */
+	ehi = (va & TLBHI_VPAGE) | ASID_EHI(curcpu->c_asid);
+
+	/* Never load two entries for the same page. */
+	index = tlb_probe(ehi, 0);
+	if (index < 0) {
+		c = curcpu->c_self;
+		index = c->c_tlb_victim;
+		c->c_tlb_victim = (index + 1) % NUM_TLB;
+		tlb_read(&oldehi, &oldelo, index);
+		if (oldelo & TLBLO_VALID) {
+			c->c_tlb_evictions++;
+		}
+	}
+	tlb_write(ehi, elo, index);
+	curcpu->c_tlb_refills++;
+
+	splx(spl);
+}
+
+void
+mmu_unmap(struct mmu_ctx *ctx, vaddr_t va)
+{
+	struct cpu *c;
+	uint32_t v;
+	int index, spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	v = ctx->mc_asid[c->c_number];
+	if (asid_current(v, c)) {
+		index = tlb_probe((va & TLBHI_VPAGE) | ASID_EHI(ASID_NUM(v)),
+				  0);
+		if (index >= 0) {
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),
+				  index);
+		}
+		tlb_setasid(ASID_EHI(c->c_asid));
+	}
+	splx(spl);
+}
+
+void
+mmu_flush_ctx(struct mmu_ctx *ctx)
+{
+	struct cpu *c;
+	uint32_t v;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	v = ctx->mc_asid[c->c_number];
+	if (asid_current(v, c)) {
+		/*
+		 * The entries stay in the TLB, but nothing will match
+		 * them: the ASID isn't handed out again until after the
+		 * next flush. If CTX is the active context, it needs a
+		 * new ASID now.
+		 */
+		ctx->mc_asid[c->c_number] = 0;
+		if (ASID_NUM(v) == c->c_asid) {
+			mmu_activate(ctx);
+		}
+	}
+	splx(spl);
+}
+
+void
+mmu_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(ASID_EHI(curcpu->c_asid));
+	curcpu->c_tlb_victim = 0;
+	splx(spl);
+}
+
+void
+mmu_printstats(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	kprintf("cpu    misses   refills evictions asidgens\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_getcpu(i);
+		kprintf("%3u %9u %9u %9u %8u\n", c->c_number,
+			c->c_tlb_misses, c->c_tlb_refills,
+			c->c_tlb_evictions, c->c_asid_rollovers);
+	}
+}
+
+void
+mmu_kstat(struct kstat *ks)
+{
+	unsigned i;
+	struct cpu *c;
+	char prefix[16];
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_getcpu(i);
+		snprintf(prefix, sizeof(prefix), "cpu%u.tlb", c->c_number);
+		kstat_addsub(ks, prefix, "misses", c->c_tlb_misses);
+		kstat_addsub(ks, prefix, "refills", c->c_tlb_refills);
+		kstat_addsub(ks, prefix, "evictions", c->c_tlb_evictions);
+		kstat_addsub(ks, prefix, "asidgens", c->c_asid_rollovers);
+	}
+}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <kern/unistd.h>
 #include <lib.h>
 #include <mips/specialreg.h>
@@ -40,6 +41,7 @@
 #include <membar.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <kprof.h>
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
 #include "autoconf.h"
@@ -59,10 +61,29 @@
  * matches the c0_compare register, the timer interrupt line is
  * asserted. Writing to c0_compare again clears the interrupt.
  */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 static
 void
 mips_timer_set(uint32_t count)
 {
+	/* the count is about to start over; keep what it got to */
+	curcpu->c_cyclebase += mips_timer_get();
+
 	/*
 	 * $11 == c0_compare; we can't use the symbolic name inside
 	 * the asm string.
@@ -75,6 +96,46 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Arrange a timer interrupt on the current CPU NSECS from now; the
+ * count starts over on each setting. The shortest wait is bounded
+ * below so the interrupt can't be due before we return, and the
+ * longest by the 32-bit counter (about 171 seconds).
+ */
+#define TIMER_MINCYCLES	100
+
+void
+mainbus_settimer(uint64_t nsecs)
+{
+	uint64_t cycles;
+
+	cycles = nsecs * (CPU_FREQUENCY / 1000000) / 1000;
+	if (cycles < TIMER_MINCYCLES) {
+		cycles = TIMER_MINCYCLES;
+	}
+	else if (cycles > 0xffffffff) {
+		cycles = 0xffffffff;
+	}
+	mips_timer_set(cycles);
+}
+
+/*
+ * The current CPU's cycle count: what c0_count had reached at each
+ * timer setting, plus where it is now. Interrupts go off so a timer
+ * interrupt can't restart the count between the two reads.
+ */
+uint64_t
+mainbus_cycles(void)
+{
+	uint64_t cycles;
+	int s;
+
+	s = splhigh();
+	cycles = curcpu->c_cyclebase + mips_timer_get();
+	splx(s);
+	return cycles;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -113,9 +174,10 @@ mainbus_bootstrap(void)
 	autoconf_lamebus(lamebus, 0);
 
 	/*
-	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * Now gettime works, so the MIPS on-chip timer can be programmed
+	 * for events (hardclocks and timeouts) instead of ticking.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	clock_start();
 }
 
 /*
@@ -127,6 +189,50 @@ mainbus_start_cpus(void)
 	lamebus_start_cpus(lamebus);
 }
 
+void
+mainbus_route_cpus(void)
+{
+	lamebus_route_cpus(lamebus);
+}
+
+/*
+ * Interrupt routing controls.
+ */
+void
+mainbus_irq_print(void)
+{
+	lamebus_print_irqs(lamebus);
+}
+
+int
+mainbus_irq_policy(const char *name)
+{
+	if (!strcmp(name, "boot")) {
+		lamebus_set_irqpolicy(lamebus, LB_IRQ_BOOT);
+	}
+	else if (!strcmp(name, "spread")) {
+		lamebus_set_irqpolicy(lamebus, LB_IRQ_SPREAD);
+	}
+	else if (!strcmp(name, "follow")) {
+		lamebus_set_irqpolicy(lamebus, LB_IRQ_FOLLOW);
+	}
+	else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+int
+mainbus_irq_route(unsigned slot, unsigned cpunum)
+{
+	if (slot >= LB_NSLOTS || cpunum >= cpu_count() ||
+	    lamebus->ls_irqfuncs[slot] == NULL) {
+		return EINVAL;
+	}
+	lamebus_route_interrupt(lamebus, slot, cpunum);
+	return 0;
+}
+
 /*
  * Function to generate the memory address (in the uncached segment)
  * for the specified offset into the specified slot's region of the
@@ -299,15 +405,17 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & LAMEBUS_IPI_BIT) {
-		interprocessor_interrupt();
+		/* Clear first, so an IPI sent while we work isn't lost. */
 		lamebus_clear_ipi(lamebus, curcpu);
+		interprocessor_interrupt();
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
-		hardclock();
+		/* Sample before the hardclock, which may switch threads. */
+		KPROF_SAMPLE(tf->tf_epc, tf->tf_ra,
+			     (tf->tf_status & CST_KUp) != 0);
+		/* This resets the timer, which clears the interrupt. */
+		clock_interrupt();
 		seen = true;
 	}
 
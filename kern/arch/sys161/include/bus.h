@@ -49,6 +49,10 @@
 #define bus_map_area(bus, slot, offset) \
     lamebus_map_area(bus, slot, offset)
 
+/* Starting I/O on a device: steer its completion interrupt here. */
+#define bus_irq_follow(bus, slot) \
+    lamebus_irq_follow(bus, slot)
+
 /*
  * Machine-dependent LAMEbus definitions
  */
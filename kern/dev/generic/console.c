@@ -39,6 +39,12 @@
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * Otherwise, output is asynchronous: characters go into a queue that
+ * the write-done interrupt drains, and the writer only waits if the
+ * queue is full. Polled output sends whatever is queued first, so the
+ * order is kept (and a panic message comes out after everything
+ * printed before it).
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -55,6 +61,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -111,17 +118,74 @@ flush_delay_buf(void)
 
 /*
  * Print a character, using polling instead of interrupts to wait for
- * I/O completion.
+ * I/O completion. Flush the output queue first.
+ *
+ * (If we already hold the queue lock we're printing a panic from
+ * inside the console code, and just send the character.)
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	unsigned char qch;
+
+	if (!spinlock_do_i_hold(&cs->cs_outlock)) {
+		spinlock_acquire(&cs->cs_outlock);
+		while (cs->cs_outbuf_tail != cs->cs_outbuf_head) {
+			qch = cs->cs_outbuf[cs->cs_outbuf_tail];
+			cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+			cs->cs_sendpolled(cs->cs_devdata, qch);
+		}
+		wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+		spinlock_release(&cs->cs_outlock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * If the device is idle, send it the next queued character.
+ */
+static
+void
+con_startoutput(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_outbusy || cs->cs_outbuf_tail == cs->cs_outbuf_head) {
+		return;
+	}
+	ch = cs->cs_outbuf[cs->cs_outbuf_tail];
+	cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+		CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outbusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Queue a character for output, waiting for space if need be.
+ */
+static
+void
+con_enqueue(struct con_softc *cs, int ch)
+{
+	unsigned nexthead;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	nexthead = (cs->cs_outbuf_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	while (nexthead == cs->cs_outbuf_tail) {
+		con_startoutput(cs);
+		wchan_sleep(cs->cs_outwchan, &cs->cs_outlock);
+	}
+	cs->cs_outbuf[cs->cs_outbuf_head] = ch;
+	cs->cs_outbuf_head = nexthead;
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +193,31 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	spinlock_acquire(&cs->cs_outlock);
+	con_enqueue(cs, ch);
+	con_startoutput(cs);
+	spinlock_release(&cs->cs_outlock);
+}
+
+/*
+ * Print a buffer of user output, turning newlines into CR-LF, all
+ * under one acquisition of the queue lock.
+ */
+static
+void
+putbuf_intr(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		if (buf[i] == '\n') {
+			con_enqueue(cs, '\r');
+		}
+		con_enqueue(cs, buf[i]);
+	}
+	con_startoutput(cs);
+	spinlock_release(&cs->cs_outlock);
 }
 
 /*
@@ -184,7 +271,11 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	cs->cs_outbusy = false;
+	con_startoutput(cs);
+	wchan_wakeall(cs->cs_outwchan, &cs->cs_outlock);
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -231,6 +322,9 @@ getch(void)
  * VFS interface functions
  */
 
+/* Bytes of a user write copied in at a time. */
+#define CONSOLE_WRITE_CHUNK 128
+
 static
 int
 con_eachopen(struct device *dev, int openflags)
@@ -244,12 +338,13 @@ static
 int
 con_io(struct device *dev, struct uio *uio)
 {
+	struct con_softc *cs = dev->d_data;
+	char buf[CONSOLE_WRITE_CHUNK];
+	size_t len;
 	int result;
 	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -276,15 +371,16 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			putbuf_intr(cs, buf, len);
 		}
 	}
 	lock_release(lk);
@@ -324,6 +420,8 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
+	dev->d_iosched = NULL;
+	dev->d_directio = false;
 
 	result = vfs_adddev("con", dev, 0);
 	if (result) {
@@ -343,7 +441,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,29 +462,33 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = wwc;
+	cs->cs_outbuf_head = 0;
+	cs->cs_outbuf_tail = 0;
+	cs->cs_outbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -35,9 +35,18 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output is queued in cs_outbuf and sent a character per write-done
+ * interrupt; cs_outbusy is set while a character is on its way. The
+ * queue is empty when head == tail, as for input.
  */
 
+#include <spinlock.h>
+
+struct wchan;	/* in <wchan.h> */
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -47,10 +56,16 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	struct spinlock cs_outlock;	/* protects the output queue */
+	struct wchan *cs_outwchan;	/* for writers waiting for space */
+	unsigned char cs_outbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outbuf_head;	/* next slot to put a char in */
+	unsigned cs_outbuf_tail;	/* next slot to take a char out */
+	bool cs_outbusy;		/* device is sending a char */
 };
 
 /*
@@ -31,6 +31,9 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <uio.h>
 #include <vfs.h>
 #include <generic/random.h>
@@ -124,6 +127,8 @@ config_random(struct random_softc *rs, int unit)
 	rs->rs_dev.d_blocks = 0;
 	rs->rs_dev.d_blocksize = 1;
 	rs->rs_dev.d_data = rs;
+	rs->rs_dev.d_iosched = NULL;
+	rs->rs_dev.d_directio = false;
 
 	/* Add the VFS device structure to the VFS device list. */
 	result = vfs_adddev("random", &rs->rs_dev, 0);
@@ -137,15 +142,75 @@ config_random(struct random_softc *rs, int unit)
 
 /*
  * Random number functions exported to the rest of the kernel.
+ *
+ * random() hands out device values from a per-cpu buffer refilled
+ * CPU_RANDPOOL words at a time, through the device's bulk fill
+ * function if it has one. Interrupts are off while the buffer is
+ * touched, since interrupt handlers may call random() too.
  */
 
+static
+void
+random_refill(struct cpu *c)
+{
+	unsigned i;
+
+	if (the_random->rs_fill != NULL) {
+		the_random->rs_fill(the_random->rs_devdata, c->c_randpool,
+				    CPU_RANDPOOL);
+	}
+	else {
+		for (i=0; i<CPU_RANDPOOL; i++) {
+			c->c_randpool[i] =
+				the_random->rs_random(the_random->rs_devdata);
+		}
+	}
+	c->c_randavail = CPU_RANDPOOL;
+}
+
 uint32_t
 random(void)
 {
+	struct cpu *c;
+	uint32_t val;
+	int spl;
+
 	if (the_random==NULL) {
 		panic("No random device\n");
 	}
-	return the_random->rs_random(the_random->rs_devdata);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_randavail == 0) {
+		random_refill(c);
+	}
+	val = c->c_randpool[--c->c_randavail];
+	splx(spl);
+	return val;
+}
+
+/*
+ * xorshift32 (Marsaglia), one state word per cpu. This deliberately
+ * doesn't raise the spl: if an interrupt or a migration interleaves
+ * two updates of the same state, the worst outcome is a repeated
+ * value, which the callers this is meant for don't care about, and
+ * xorshift never turns a nonzero state into zero.
+ */
+uint32_t
+fastrandom(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t x;
+
+	x = c->c_fastrand;
+	while (x == 0) {
+		x = random();
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c->c_fastrand = x;
+	return x;
 }
 
 uint32_t
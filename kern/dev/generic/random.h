@@ -38,6 +38,7 @@ struct random_softc {
 	void *rs_devdata;
 	uint32_t (*rs_random)(void *devdata);
 	uint32_t (*rs_randmax)(void *devdata);
+	void (*rs_fill)(void *devdata, uint32_t *buf, unsigned num);
 	int (*rs_read)(void *devdata, struct uio *uio);
 
 	struct device rs_dev;
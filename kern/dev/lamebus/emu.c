@@ -43,6 +43,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
+#include <limits.h>
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
@@ -52,8 +54,12 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
 #include <emufs.h>
 #include "autoconf.h"
+#include "opt-dumbvm.h"
 
 /* Register offsets */
 #define REG_HANDLE    0
@@ -128,8 +134,20 @@ emu_irq(void *dev)
 
 	sc->e_result = emu_rreg(sc, REG_RESULT);
 	emu_wreg(sc, REG_RESULT, 0);
+	softint_schedule(&sc->e_softint);
+}
 
-	V(sc->e_sem);
+/*
+ * Bottom half: someone is waiting in emu_waitdone; get it going.
+ * There's only ever one operation outstanding.
+ */
+static
+void
+emu_softint(void *dev)
+{
+	struct emu_softc *sc = dev;
+
+	V_handoff(sc->e_sem);
 }
 
 /*
@@ -160,6 +178,12 @@ translate_err(struct emu_softc *sc, uint32_t code)
 	return EAGAIN;
 }
 
+/*
+ * How long to wait for the card before complaining. (nanoseconds)
+ * The operation can't be abandoned, so we then keep waiting.
+ */
+#define EMU_WATCHDOG	10000000000ULL
+
 /*
  * Wait for an operation to complete, and return an errno for the result.
  */
@@ -167,26 +191,56 @@ static
 int
 emu_waitdone(struct emu_softc *sc)
 {
-	P(sc->e_sem);
+	if (sem_timedP(sc->e_sem, EMU_WATCHDOG) == ETIMEDOUT) {
+		kprintf("emu%d: operation not done after %llu seconds; "
+			"still waiting\n", sc->e_unit,
+			EMU_WATCHDOG / 1000000000ULL);
+		P(sc->e_sem);
+	}
 	return translate_err(sc, sc->e_result);
 }
 
+/*
+ * Wait for a file read or write to complete, recording it in the
+ * device statistics. LEN is the size requested; for a read, the
+ * amount actually transferred is read back from the card.
+ */
+static
+int
+emu_waitio(struct emu_softc *sc, enum uio_rw rw, uint32_t len)
+{
+	struct timespec started;
+	int result;
+
+	iostat_start(&sc->e_iostat, &started);
+	result = emu_waitdone(sc);
+	if (result == 0 && rw == UIO_READ) {
+		len = emu_rreg(sc, REG_IOLEN);
+	}
+	iostat_done(&sc->e_iostat, &started, rw, len, result);
+	return result;
+}
+
 /*
  * Common file open routine (for both VOP_LOOKUP and VOP_CREATE).  Not
  * for VOP_EACHOPEN. At the hardware level, we need to "open" files in
  * order to look at them, so by the time VOP_EACHOPEN is called the
  * files are already open.
+ *
+ * The name is the first NAMELEN bytes of NAME; it need not be
+ * null-terminated there.
  */
 static
 int
-emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
+emu_open(struct emu_softc *sc, uint32_t handle,
+	 const char *name, size_t namelen,
 	 bool create, bool excl, mode_t mode,
 	 uint32_t *newhandle, int *newisdir)
 {
 	uint32_t op;
 	int result;
 
-	if (strlen(name)+1 > EMU_MAXIO) {
+	if (namelen+1 > EMU_MAXIO) {
 		return ENAMETOOLONG;
 	}
 
@@ -205,9 +259,10 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 
 	lock_acquire(sc->e_lock);
 
-	strcpy(sc->e_iobuf, name);
+	memcpy(sc->e_iobuf, name, namelen);
+	((char *)sc->e_iobuf)[namelen] = 0;
 	membar_store_store();
-	emu_wreg(sc, REG_IOLEN, strlen(name));
+	emu_wreg(sc, REG_IOLEN, namelen);
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
@@ -284,7 +339,7 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
 	emu_wreg(sc, REG_OPER, op);
-	result = emu_waitdone(sc);
+	result = emu_waitio(sc, UIO_READ, len);
 	if (result) {
 		goto out;
 	}
@@ -350,7 +405,7 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
-	result = emu_waitdone(sc);
+	result = emu_waitio(sc, UIO_WRITE, len);
 
  out:
 	lock_release(sc->e_lock);
@@ -365,8 +420,12 @@ int
 emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 {
 	int result;
+	bool mine;
 
-	lock_acquire(sc->e_lock);
+	mine = lock_do_i_hold(sc->e_lock);
+	if (!mine) {
+		lock_acquire(sc->e_lock);
+	}
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, EMU_OP_GETSIZE);
@@ -375,7 +434,9 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 		*retval = emu_rreg(sc, REG_IOLEN);
 	}
 
-	lock_release(sc->e_lock);
+	if (!mine) {
+		lock_release(sc->e_lock);
+	}
 	return result;
 }
 
@@ -414,6 +475,273 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   struct emufs_vnode **ret);
 
+/*
+ * Number of pages read ahead at once: as many as one transfer moves.
+ */
+#define EMUFS_RAPAGES	(EMU_MAXIO / PAGE_SIZE)
+
+/*
+ * Get the size of a file or directory, from the cache if we have it.
+ */
+static
+int
+emufs_getsize(struct emufs_vnode *ev, off_t *ret)
+{
+	struct emu_softc *sc = ev->ev_emu;
+	int result;
+
+	lock_acquire(sc->e_lock);
+	if (!ev->ev_sizevalid) {
+		result = emu_getsize(sc, ev->ev_handle, &ev->ev_size);
+		if (result) {
+			lock_release(sc->e_lock);
+			return result;
+		}
+		ev->ev_sizevalid = true;
+	}
+	*ret = ev->ev_size;
+	lock_release(sc->e_lock);
+	return 0;
+}
+
+/*
+ * Drop the cached directory entries of EV. Call with e_lock held.
+ */
+static
+void
+emufs_dropdirents(struct emufs_vnode *ev)
+{
+	struct emufs_dirent *ed;
+
+	KASSERT(lock_do_i_hold(ev->ev_emu->e_lock));
+
+	while (ev->ev_dirents != NULL) {
+		ed = ev->ev_dirents;
+		ev->ev_dirents = ed->ed_link;
+		kfree(ed->ed_name);
+		kfree(ed);
+	}
+	ev->ev_dirlast = NULL;
+	ev->ev_dirgen++;
+}
+
+/*
+ * Find the cached directory entry at OFFSET. Entries are usually read
+ * in order, so look after the last one used first. Call with e_lock
+ * held.
+ */
+static
+struct emufs_dirent *
+emufs_finddirent(struct emufs_vnode *ev, off_t offset)
+{
+	struct emufs_dirent *ed;
+
+	KASSERT(lock_do_i_hold(ev->ev_emu->e_lock));
+
+	if (ev->ev_dirlast != NULL) {
+		for (ed = ev->ev_dirlast; ed != NULL; ed = ed->ed_link) {
+			if (ed->ed_offset == offset) {
+				ev->ev_dirlast = ed;
+				return ed;
+			}
+		}
+	}
+	for (ed = ev->ev_dirents; ed != NULL; ed = ed->ed_link) {
+		if (ed->ed_offset == offset) {
+			ev->ev_dirlast = ed;
+			return ed;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Cache a directory entry. Failing for lack of memory is harmless.
+ * Call with e_lock held.
+ */
+static
+void
+emufs_adddirent(struct emufs_vnode *ev, off_t offset, off_t nextoffset,
+		const char *name, size_t len)
+{
+	struct emufs_dirent *ed;
+
+	KASSERT(lock_do_i_hold(ev->ev_emu->e_lock));
+
+	ed = kmalloc(sizeof(*ed));
+	if (ed == NULL) {
+		return;
+	}
+	ed->ed_name = kmalloc(len + 1);
+	if (ed->ed_name == NULL) {
+		kfree(ed);
+		return;
+	}
+	memcpy(ed->ed_name, name, len);
+	ed->ed_name[len] = 0;
+	ed->ed_offset = offset;
+	ed->ed_nextoffset = nextoffset;
+	ed->ed_len = len;
+
+	/* Keep the order entries are read in, after the last one used. */
+	if (ev->ev_dirlast != NULL) {
+		ed->ed_link = ev->ev_dirlast->ed_link;
+		ev->ev_dirlast->ed_link = ed;
+	}
+	else {
+		ed->ed_link = ev->ev_dirents;
+		ev->ev_dirents = ed;
+	}
+	ev->ev_dirlast = ed;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Read up to NPAGES pages of EV, starting at the page-aligned OFFSET,
+ * into the page cache with one transfer. Stops early at EOF (SIZE),
+ * at a page that's already cached, or when there's no free memory:
+ * it isn't worth paging anything out for. Returns in *RET how many
+ * pages were read, which may be 0.
+ */
+static
+int
+emufs_fillpages(struct emufs_vnode *ev, off_t offset, unsigned npages,
+		off_t size, unsigned *ret)
+{
+	struct iovec iov[EMUFS_RAPAGES];
+	paddr_t pas[EMUFS_RAPAGES];
+	struct uio ku;
+	unsigned i, n;
+	size_t got, oldresid;
+	paddr_t pa;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(npages <= EMUFS_RAPAGES);
+
+	for (n=0; n<npages; n++) {
+		if (offset + (off_t)n * PAGE_SIZE >= size) {
+			break;
+		}
+		if (n > 0) {
+			pa = pagecache_lookup(&ev->ev_v,
+					      offset + n * PAGE_SIZE);
+			if (pa != 0) {
+				coremap_freeuser(pa);
+				break;
+			}
+		}
+		pa = coremap_allocuser(NULL, 0, false);
+		if (pa == 0) {
+			break;
+		}
+		pas[n] = pa;
+		iov[n].iov_kbase = (void *)PADDR_TO_KVADDR(pa);
+		iov[n].iov_len = PAGE_SIZE;
+	}
+	*ret = 0;
+	if (n == 0) {
+		return 0;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = offset;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+
+	result = 0;
+	while (ku.uio_resid > 0) {
+		oldresid = ku.uio_resid;
+		result = emu_read(ev->ev_emu, ev->ev_handle, ku.uio_resid,
+				  &ku);
+		if (result || ku.uio_resid == oldresid) {
+			break;
+		}
+	}
+	if (result) {
+		for (i=0; i<n; i++) {
+			coremap_freeuser(pas[i]);
+		}
+		return result;
+	}
+
+	/* Past EOF reads as zero; drop pages that are all past it. */
+	got = n * PAGE_SIZE - ku.uio_resid;
+	for (i=0; i<n; i++) {
+		if (i > 0 && i * PAGE_SIZE >= got) {
+			coremap_freeuser(pas[i]);
+			continue;
+		}
+		if ((i + 1) * PAGE_SIZE > got) {
+			bzero((char *)PADDR_TO_KVADDR(pas[i]) +
+			      (got - i * PAGE_SIZE),
+			      (i + 1) * PAGE_SIZE - got);
+		}
+		pa = pagecache_insert(&ev->ev_v, offset + i * PAGE_SIZE,
+				      pas[i]);
+		coremap_freeuser(pa);
+		(*ret)++;
+	}
+	return 0;
+}
+
+/*
+ * Do as much of a read as we can from the page cache, filling it as
+ * needed: one page at a time for random reads, EMUFS_RAPAGES for
+ * sequential ones. Sets *EOF if the read reached the end of the file;
+ * otherwise whatever is left must be read directly.
+ */
+static
+int
+emufs_cachedread(struct emufs_vnode *ev, struct uio *uio, bool *eof)
+{
+	off_t size, pageoff;
+	size_t oldresid;
+	unsigned npages, got;
+	bool filled;
+	int result;
+
+	*eof = false;
+	result = emufs_getsize(ev, &size);
+	if (result) {
+		return result;
+	}
+	npages = uio->uio_offset == ev->ev_nextread ? EMUFS_RAPAGES : 1;
+
+	filled = false;
+	while (uio->uio_resid > 0 && uio->uio_offset < size) {
+		oldresid = uio->uio_resid;
+		result = pagecache_read(&ev->ev_v, uio, size);
+		if (result) {
+			return result;
+		}
+		if (uio->uio_resid == oldresid && filled) {
+			/* the pages didn't stay cached; read directly */
+			return 0;
+		}
+		if (uio->uio_resid == 0 || uio->uio_offset >= size) {
+			break;
+		}
+
+		pageoff = uio->uio_offset - uio->uio_offset % PAGE_SIZE;
+		result = emufs_fillpages(ev, pageoff, npages, size, &got);
+		if (result) {
+			return result;
+		}
+		if (got == 0) {
+			return 0;
+		}
+		filled = true;
+	}
+	ev->ev_nextread = uio->uio_offset;
+	*eof = true;
+	return 0;
+}
+#endif /* !OPT_DUMBVM */
+
 /*
  * VOP_EACHOPEN on files
  */
@@ -473,28 +801,17 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks: e_lock to protect the device,
-	 * and vn_countlock for the reference count.
+	 * e_lock protects the device, and while we hold it nobody can
+	 * look the vnode up and take a new reference.
 	 */
 
 	lock_acquire(ef->ef_emu->e_lock);
-	spinlock_acquire(&ev->ev_v.vn_countlock);
-
-	if (ev->ev_v.vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		ev->ev_v.vn_refcount--;
 
-		spinlock_release(&ev->ev_v.vn_countlock);
+	if (!vnode_lastref(&ev->ev_v)) {
+		/* it consumed the reference VOP_DECREF passed us */
 		lock_release(ef->ef_emu->e_lock);
 		return EBUSY;
 	}
-	KASSERT(ev->ev_v.vn_refcount == 1);
-
-	/*
-	 * Since we hold e_lock and are the last ref, nobody can increment
-	 * the refcount, so we can release vn_countlock.
-	 */
-	spinlock_release(&ev->ev_v.vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -520,6 +837,7 @@ emufs_reclaim(struct vnode *v)
 	}
 
 	vnodearray_remove(ef->ef_vnodes, ix);
+	emufs_dropdirents(ev);
 	vnode_cleanup(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
@@ -539,9 +857,19 @@ emufs_read(struct vnode *v, struct uio *uio)
 	uint32_t amt;
 	size_t oldresid;
 	int result;
+#if !OPT_DUMBVM
+	bool eof;
+#endif
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+#if !OPT_DUMBVM
+	result = emufs_cachedread(ev, uio, &eof);
+	if (result || eof) {
+		return result;
+	}
+#endif
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -572,16 +900,59 @@ int
 emufs_getdirentry(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
+	struct emu_softc *sc = ev->ev_emu;
+	struct emufs_dirent *ed;
+	char name[NAME_MAX+1];
+	struct iovec iov;
+	struct uio ku;
+	off_t nextoffset;
+	size_t len;
+	unsigned gen;
+	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	amt = uio->uio_resid;
-	if (amt > EMU_MAXIO) {
-		amt = EMU_MAXIO;
+	/*
+	 * Copy the name out of the cache, or read it into the cache,
+	 * and hand it over after dropping e_lock: uiomove can fault and
+	 * the fault can need the device.
+	 */
+	lock_acquire(sc->e_lock);
+	ed = emufs_finddirent(ev, uio->uio_offset);
+	if (ed != NULL) {
+		len = ed->ed_len;
+		memcpy(name, ed->ed_name, len);
+		nextoffset = ed->ed_nextoffset;
+		lock_release(sc->e_lock);
+	}
+	else {
+		gen = ev->ev_dirgen;
+		lock_release(sc->e_lock);
+
+		uio_kinit(&iov, &ku, name, sizeof(name), uio->uio_offset,
+			  UIO_READ);
+		result = emu_readdir(sc, ev->ev_handle, sizeof(name), &ku);
+		if (result) {
+			return result;
+		}
+		len = sizeof(name) - ku.uio_resid;
+		nextoffset = ku.uio_offset;
+
+		lock_acquire(sc->e_lock);
+		if (ev->ev_dirgen == gen &&
+		    emufs_finddirent(ev, uio->uio_offset) == NULL) {
+			emufs_adddirent(ev, uio->uio_offset, nextoffset,
+					name, len);
+		}
+		lock_release(sc->e_lock);
 	}
 
-	return emu_readdir(ev->ev_emu, ev->ev_handle, amt, uio);
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	result = uiomove(name, len, uio);
+	uio->uio_offset = nextoffset;
+	return result;
 }
 
 /*
@@ -598,6 +969,9 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	/* What's cached about the file is about to be stale. */
+	vnode_dropcaches(v);
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -617,6 +991,12 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
+	lock_acquire(ev->ev_emu->e_lock);
+	if (ev->ev_sizevalid && uio->uio_offset > ev->ev_size) {
+		ev->ev_size = uio->uio_offset;
+	}
+	lock_release(ev->ev_emu->e_lock);
+
 	return 0;
 }
 
@@ -627,14 +1007,12 @@ static
 int
 emufs_ioctl(struct vnode *v, int op, userptr_t data)
 {
-	/*
-	 * No ioctls.
-	 */
-
-	(void)v;
-	(void)op;
-	(void)data;
+	struct emufs_vnode *ev = v->vn_data;
 
+	switch (op) {
+	    case IOCTL_IOSTAT:
+		return iostat_ioctl(&ev->ev_emu->e_iostat, data);
+	}
 	return EINVAL;
 }
 
@@ -650,7 +1028,7 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	result = emufs_getsize(ev, &statbuf->st_size);
 	if (result) {
 		return result;
 	}
@@ -720,7 +1098,17 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	vnode_dropcaches(v);
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+
+	lock_acquire(ev->ev_emu->e_lock);
+	ev->ev_sizevalid = result == 0;
+	ev->ev_size = len;
+	lock_release(ev->ev_emu->e_lock);
+
+	return result;
 }
 
 /*
@@ -738,8 +1126,15 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
-			  &handle, &isdir);
+	result = emu_open(ev->ev_emu, ev->ev_handle, name, strlen(name),
+			  true, excl, mode, &handle, &isdir);
+
+	/* The directory may have a new entry. */
+	lock_acquire(ev->ev_emu->e_lock);
+	emufs_dropdirents(ev);
+	ev->ev_sizevalid = false;
+	lock_release(ev->ev_emu->e_lock);
+
 	if (result) {
 		return result;
 	}
@@ -755,11 +1150,12 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 }
 
 /*
- * VOP_LOOKUP
+ * Look up the first LEN bytes of PATHNAME.
  */
 static
 int
-emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
+emufs_lookupn(struct vnode *dir, const char *pathname, size_t len,
+	      struct vnode **ret)
 {
 	struct emufs_vnode *ev = dir->vn_data;
 	struct emufs_fs *ef = dir->vn_fs->fs_data;
@@ -768,8 +1164,8 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
-	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
-			  &handle, &isdir);
+	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, len,
+			  false, false, 0, &handle, &isdir);
 	if (result) {
 		return result;
 	}
@@ -784,15 +1180,25 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	return 0;
 }
 
+/*
+ * VOP_LOOKUP
+ */
+static
+int
+emufs_lookup(struct vnode *dir, const char *pathname, struct vnode **ret)
+{
+	return emufs_lookupn(dir, pathname, strlen(pathname), ret);
+}
+
 /*
  * VOP_LOOKPARENT
  */
 static
 int
-emufs_lookparent(struct vnode *dir, char *pathname, struct vnode **ret,
-		 char *buf, size_t len)
+emufs_lookparent(struct vnode *dir, const char *pathname,
+		 struct vnode **ret, char *buf, size_t len)
 {
-	char *s;
+	const char *s;
 
 	s = strrchr(pathname, '/');
 	if (s==NULL) {
@@ -806,14 +1212,13 @@ emufs_lookparent(struct vnode *dir, char *pathname, struct vnode **ret,
 		return 0;
 	}
 
-	*s = 0;
-	s++;
-	if (strlen(s)+1 > len) {
+	if (strlen(s+1)+1 > len) {
 		return ENAMETOOLONG;
 	}
-	strcpy(buf, s);
+	strcpy(buf, s+1);
 
-	return emufs_lookup(dir, pathname, ret);
+	/* the host sees just the directory part */
+	return emufs_lookupn(dir, pathname, s - pathname, ret);
 }
 
 /*
@@ -839,14 +1244,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP. Mapped files are paged in with VOP_READ, so any file
+ * will do.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1031,7 +1437,8 @@ emufs_rename_notdir(struct vnode *v1, const char *n1,
 
 static
 int
-emufs_lookup_notdir(struct vnode *v, char *pathname, struct vnode **result)
+emufs_lookup_notdir(struct vnode *v, const char *pathname,
+		    struct vnode **result)
 {
 	(void)v;
 	(void)pathname;
@@ -1041,8 +1448,8 @@ emufs_lookup_notdir(struct vnode *v, char *pathname, struct vnode **result)
 
 static
 int
-emufs_lookparent_notdir(struct vnode *v, char *pathname, struct vnode **result,
-			char *buf, size_t len)
+emufs_lookparent_notdir(struct vnode *v, const char *pathname,
+			struct vnode **result, char *buf, size_t len)
 {
 	(void)v;
 	(void)pathname;
@@ -1076,6 +1483,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_read = emufs_read,
 	.vop_readlink = emufs_readlink_notlink,
 	.vop_getdirentry = emufs_uio_op_notdir,
+	.vop_getdirentries = emufs_uio_op_notdir,
 	.vop_write = emufs_write,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1084,6 +1492,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_fsync = emufs_fsync,
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
+	.vop_seekhole = vnode_seekhole_generic,
 	.vop_namefile = emufs_uio_op_notdir,
 
 	.vop_creat = emufs_creat_notdir,
@@ -1110,6 +1519,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_read = emufs_uio_op_isdir,
 	.vop_readlink = emufs_uio_op_isdir,
 	.vop_getdirentry = emufs_getdirentry,
+	.vop_getdirentries = vnode_getdirentries_generic,
 	.vop_write = emufs_uio_op_isdir,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1118,6 +1528,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_fsync = emufs_void_op_isdir,
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = emufs_namefile,
 
 	.vop_creat = emufs_creat,
@@ -1172,6 +1583,12 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_sizevalid = false;
+	ev->ev_size = 0;
+	ev->ev_dirents = NULL;
+	ev->ev_dirlast = NULL;
+	ev->ev_dirgen = 0;
+	ev->ev_nextread = 0;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
@@ -1271,6 +1688,9 @@ static const struct fs_ops emufs_fsops = {
 	/* we don't do block I/O */
 	.fsop_readblock = NULL,
 	.fsop_writeblock = NULL,
+	.fsop_flushlog = NULL,
+	.fsop_startread = NULL,
+	.fsop_kstat = NULL,
 };
 
 /*
@@ -1343,8 +1763,10 @@ config_emu(struct emu_softc *sc, int emuno)
 		return ENOMEM;
 	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
+	softint_init(&sc->e_softint, emu_softint, sc);
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
+	iostat_init(&sc->e_iostat, name);
 
 	return emufs_addtovfs(sc, name);
 }
@@ -30,6 +30,8 @@
 #ifndef _LAMEBUS_EMU_H_
 #define _LAMEBUS_EMU_H_
 
+#include <iostat.h>
+#include <softint.h>
 
 #define EMU_MAXIO       16384
 #define EMU_ROOTHANDLE  0
@@ -53,6 +55,9 @@ struct emu_softc {
 
 	/* Written by the interrupt handler */
 	uint32_t e_result;
+	struct softint e_softint;	/* wakes the waiter */
+
+	struct iostat e_iostat;		/* Statistics */
 };
 
 /* Functions called by lower-level drivers */
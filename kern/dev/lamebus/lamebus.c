@@ -121,6 +121,13 @@ write_ctlcpu_register(struct lamebus_softc *lb, unsigned hw_cpunum,
 	lamebus_write_register(lb, LB_CONTROLLER_SLOT, offset, val);
 }
 
+/*
+ * Policy lamebus_route_cpus applies once all the CPUs are up. Disk
+ * drivers call lamebus_irq_follow, so their completions come back to
+ * whoever is waiting for them; everything else is just spread out.
+ */
+#define LB_IRQ_DEFAULT	LB_IRQ_FOLLOW
+
 /*
  * Find and create secondary CPUs.
  */
@@ -167,9 +174,9 @@ lamebus_find_cpus(struct lamebus_softc *lamebus)
 	}
 
 	/*
-	 * By default, route all interrupts only to the boot cpu. We
-	 * could be arbitrarily more elaborate, up to things like
-	 * dynamic load balancing.
+	 * Route all interrupts only to the boot cpu for now, as
+	 * lamebus_init recorded. Once the other cpus are running,
+	 * lamebus_route_cpus spreads them out.
 	 */
 
 	for (i=0; i<numcpus; i++) {
@@ -396,6 +403,169 @@ lamebus_detach_interrupt(struct lamebus_softc *sc, int slot)
 	spinlock_release(&sc->ls_lock);
 }
 
+/*
+ * Interrupt routing.
+ *
+ * The controller has an interrupt enable mask per CPU (CIRQE); we
+ * keep each slot enabled on exactly one CPU and mirror the masks in
+ * ls_cpuslots. lamebus_interrupt only services the slots routed to
+ * the CPU it's running on, so each device's handler runs where it
+ * was sent.
+ */
+
+/*
+ * Write CPUNUM's interrupt enables.
+ */
+static
+void
+lamebus_write_cirqe(struct lamebus_softc *lb, unsigned cpunum)
+{
+	KASSERT(spinlock_do_i_hold(&lb->ls_lock));
+	write_ctlcpu_register(lb, cpu_getcpu(cpunum)->c_hardware_number,
+			      CTLCPU_CIRQE, lb->ls_cpuslots[cpunum]);
+}
+
+/*
+ * Move SLOT to CPUNUM. The new CPU's enables go first, so the slot
+ * is never routed nowhere; an interrupt that comes in between goes
+ * to whichever looks first, and the other finds nothing of its own.
+ */
+static
+void
+lamebus_route_locked(struct lamebus_softc *lb, int slot, unsigned cpunum)
+{
+	uint32_t mask = ((uint32_t)1) << slot;
+	unsigned old;
+
+	KASSERT(spinlock_do_i_hold(&lb->ls_lock));
+	KASSERT(cpunum < cpu_count());
+
+	old = lb->ls_irqcpu[slot];
+	if (old == cpunum) {
+		return;
+	}
+	lb->ls_cpuslots[cpunum] |= mask;
+	lamebus_write_cirqe(lb, cpunum);
+	lb->ls_cpuslots[old] &= ~mask;
+	lamebus_write_cirqe(lb, old);
+	lb->ls_irqcpu[slot] = cpunum;
+}
+
+void
+lamebus_route_cpus(struct lamebus_softc *lb)
+{
+	KASSERT(cpu_count() <= LB_NCPUS);
+	lamebus_set_irqpolicy(lb, LB_IRQ_DEFAULT);
+}
+
+void
+lamebus_route_interrupt(struct lamebus_softc *lb, int slot, unsigned cpunum)
+{
+	KASSERT(slot >= 0 && slot < LB_NSLOTS);
+
+	if (lb->ls_uniprocessor) {
+		return;
+	}
+	spinlock_acquire(&lb->ls_lock);
+	lb->ls_irqfollow &= ~(((uint32_t)1) << slot);
+	lamebus_route_locked(lb, slot, cpunum);
+	spinlock_release(&lb->ls_lock);
+}
+
+/*
+ * Only slots with a handler are moved; the rest stay put. Spreading
+ * starts at the second CPU, since the boot CPU usually has the
+ * console's work anyway.
+ */
+void
+lamebus_set_irqpolicy(struct lamebus_softc *lb, unsigned policy)
+{
+	unsigned ncpus, next;
+	int slot;
+
+	KASSERT(policy == LB_IRQ_BOOT || policy == LB_IRQ_SPREAD ||
+		policy == LB_IRQ_FOLLOW);
+
+	if (lb->ls_uniprocessor) {
+		return;
+	}
+	ncpus = cpu_count();
+	next = 1;
+
+	spinlock_acquire(&lb->ls_lock);
+	lb->ls_irqfollow = 0;
+	for (slot=0; slot<LB_NSLOTS; slot++) {
+		if (lb->ls_irqfuncs[slot] == NULL) {
+			continue;
+		}
+		if (policy == LB_IRQ_BOOT) {
+			lamebus_route_locked(lb, slot, 0);
+			continue;
+		}
+		lamebus_route_locked(lb, slot, next++ % ncpus);
+		if (policy == LB_IRQ_FOLLOW) {
+			lb->ls_irqfollow |= ((uint32_t)1) << slot;
+		}
+	}
+	spinlock_release(&lb->ls_lock);
+}
+
+/*
+ * The unlocked checks can be stale; that only moves the interrupt
+ * one request late, or takes the lock for nothing.
+ */
+void
+lamebus_irq_follow(struct lamebus_softc *lb, int slot)
+{
+	uint32_t mask = ((uint32_t)1) << slot;
+	unsigned me;
+
+	KASSERT(slot >= 0 && slot < LB_NSLOTS);
+
+	if ((lb->ls_irqfollow & mask) == 0) {
+		return;
+	}
+	me = curcpu->c_number;
+	if (lb->ls_irqcpu[slot] == me) {
+		return;
+	}
+	spinlock_acquire(&lb->ls_lock);
+	if (lb->ls_irqfollow & mask) {
+		lamebus_route_locked(lb, slot, me);
+	}
+	spinlock_release(&lb->ls_lock);
+}
+
+void
+lamebus_print_irqs(struct lamebus_softc *lb)
+{
+	unsigned cpunum[LB_NSLOTS], count[LB_NSLOTS];
+	uint32_t handled, follow;
+	int slot;
+
+	handled = 0;
+	spinlock_acquire(&lb->ls_lock);
+	for (slot=0; slot<LB_NSLOTS; slot++) {
+		if (lb->ls_irqfuncs[slot] != NULL) {
+			handled |= ((uint32_t)1) << slot;
+		}
+		cpunum[slot] = lb->ls_irqcpu[slot];
+		count[slot] = lb->ls_irqcount[slot];
+	}
+	follow = lb->ls_irqfollow;
+	spinlock_release(&lb->ls_lock);
+
+	kprintf("slot  cpu  follow  interrupts\n");
+	for (slot=0; slot<LB_NSLOTS; slot++) {
+		if ((handled & (((uint32_t)1) << slot)) == 0) {
+			continue;
+		}
+		kprintf("%4d  %3u  %6s  %10u\n", slot, cpunum[slot],
+			(follow & (((uint32_t)1) << slot)) ? "yes" : "no",
+			count[slot]);
+	}
+}
+
 /*
  * Mask/unmask an interrupt using the global IRQE register.
  */
@@ -445,7 +615,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 
 	int slot;
 	uint32_t mask;
-	uint32_t irqs;
+	uint32_t irqs, mine;
 	void (*handler)(void *);
 	void *data;
 
@@ -461,8 +631,10 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 
 	/*
 	 * Read the LAMEbus controller register that tells us which
-	 * slots are asserting an interrupt condition.
+	 * slots are asserting an interrupt condition. Leave the ones
+	 * not routed here to their own CPUs.
 	 */
+	mine = lamebus->ls_cpuslots[curcpu->c_number];
 	irqs = read_ctl_register(lamebus, CTLREG_IRQS);
 
 	if (irqs == 0) {
@@ -492,6 +664,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 	 * ones are set.
 	 */
 
+	irqs &= mine;
 	for (mask=1, slot=0; slot<LB_NSLOTS; mask<<=1, slot++) {
 		if ((irqs & mask) == 0) {
 			/* Nope. */
@@ -528,6 +701,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 */
 		handler = lamebus->ls_irqfuncs[slot];
 		data = lamebus->ls_devdata[slot];
+		lamebus->ls_irqcount[slot]++;
 		spinlock_release(&lamebus->ls_lock);
 
 		handler(data);
@@ -538,9 +712,11 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 * Reload the mask of pending IRQs - if we just called
 		 * hardclock, we might not have come back to this
 		 * context for some time, and it might have changed.
+		 * So might the routing.
 		 */
 
-		irqs = read_ctl_register(lamebus, CTLREG_IRQS);
+		mine = lamebus->ls_cpuslots[curcpu->c_number];
+		irqs = read_ctl_register(lamebus, CTLREG_IRQS) & mine;
 	}
 
 
@@ -657,7 +833,16 @@ lamebus_init(void)
 	for (i=0; i<LB_NSLOTS; i++) {
 		lamebus->ls_devdata[i] = NULL;
 		lamebus->ls_irqfuncs[i] = NULL;
+		lamebus->ls_irqcpu[i] = 0;
+		lamebus->ls_irqcount[i] = 0;
+	}
+
+	/* Everything goes to the boot cpu to begin with. */
+	lamebus->ls_cpuslots[0] = 0xffffffff;
+	for (i=1; i<LB_NCPUS; i++) {
+		lamebus->ls_cpuslots[i] = 0;
 	}
+	lamebus->ls_irqfollow = 0;
 
 	lamebus->ls_uniprocessor = 0;
 
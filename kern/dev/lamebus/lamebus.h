@@ -61,6 +61,9 @@
 /* Number of slots */
 #define LB_NSLOTS            32
 
+/* Most CPUs a LAMEbus controller can have */
+#define LB_NCPUS             32
+
 /* LAMEbus controller per-slot config space */
 #define LB_CONFIG_SIZE       1024
 
@@ -87,10 +90,21 @@ struct lamebus_softc {
 	void        *ls_devdata[LB_NSLOTS];
 	lb_irqfunc   ls_irqfuncs[LB_NSLOTS];
 
+	/* Interrupt routing; synchronized with ls_lock */
+	unsigned     ls_irqcpu[LB_NSLOTS];	/* CPU number for each slot */
+	uint32_t     ls_cpuslots[LB_NCPUS];	/* slots routed to each CPU */
+	uint32_t     ls_irqfollow;		/* slots that follow I/O */
+	unsigned     ls_irqcount[LB_NSLOTS];	/* interrupts taken */
+
 	/* Read-only once set early in boot */
 	unsigned     ls_uniprocessor;
 };
 
+/* Interrupt routing policies */
+#define LB_IRQ_BOOT          0	/* everything to the boot CPU */
+#define LB_IRQ_SPREAD        1	/* devices round-robin over CPUs */
+#define LB_IRQ_FOLLOW        2	/* spread, then follow the I/O */
+
 /*
  * Allocate and set up a lamebus_softc for the system.
  */
@@ -147,6 +161,32 @@ void lamebus_unmask_interrupt(struct lamebus_softc *, int slot);
  */
 void lamebus_interrupt(struct lamebus_softc *);
 
+/*
+ * Interrupt routing. Each slot's interrupts go to one CPU. Until the
+ * secondary CPUs are running that's the boot CPU for everything;
+ * lamebus_route_cpus is called once they are, and applies the
+ * default policy.
+ *
+ * lamebus_route_interrupt sends SLOT's interrupts to CPU number
+ * CPUNUM, and stops them following I/O.
+ *
+ * lamebus_set_irqpolicy reroutes every slot by one of the LB_IRQ_*
+ * policies. Under LB_IRQ_FOLLOW, each slot's interrupts move to the
+ * CPU that last called lamebus_irq_follow for it; drivers call that
+ * when starting I/O, so the completion interrupt comes to the CPU
+ * the waiting thread was running on, and wakes it there.
+ *
+ * lamebus_irq_follow is cheap when nothing needs to change.
+ *
+ * lamebus_print_irqs shows where each slot in use is routed.
+ */
+void lamebus_route_cpus(struct lamebus_softc *);
+void lamebus_route_interrupt(struct lamebus_softc *, int slot,
+			     unsigned cpunum);
+void lamebus_set_irqpolicy(struct lamebus_softc *, unsigned policy);
+void lamebus_irq_follow(struct lamebus_softc *, int slot);
+void lamebus_print_irqs(struct lamebus_softc *);
+
 /*
  * Have the LAMEbus controller power the system off.
  */
@@ -33,12 +33,15 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <bio.h>
+#include <iosched.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -96,28 +99,95 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the request at the head of the queue:
+ * for a write, copy it to the on-card buffer; then tell the card
+ * which sector and go.
  */
 static
 void
+lhd_start(struct lhd_softc *lh)
+{
+	struct bio *bio = lh->lh_cur;
+	char *data;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(bio != NULL);
+
+	data = (char *)bio->bio_data + lh->lh_qdone * LHD_SECTSIZE;
+	if (bio->bio_rw == UIO_WRITE) {
+		memcpy(lh->lh_buf, data, LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT,
+		 bio->bio_offset / LHD_SECTSIZE + lh->lh_qdone);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that a sector has completed. For a read, copy it out of the
+ * on-card buffer. If the request is done (or failed), take it off the
+ * transfer and return it so the caller can call its completion
+ * routine once the lock is dropped; in any case start what comes
+ * next, which is the rest of the transfer and then whatever the
+ * scheduler picks.
+ */
+static
+struct bio *
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct bio *bio = lh->lh_cur;
+	char *data;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (bio == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return NULL;
+	}
+
+	if (err == 0 && bio->bio_rw == UIO_READ) {
+		data = (char *)bio->bio_data + lh->lh_qdone * LHD_SECTSIZE;
+		membar_load_load();
+		memcpy(data, lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_qdone++;
+
+	if (err == 0 && lh->lh_qdone * LHD_SECTSIZE < bio->bio_len) {
+		lhd_start(lh);
+		return NULL;
+	}
+
+	lh->lh_cur = bio->bio_next;
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = iosched_next(&lh->lh_sched);
+	}
+	lh->lh_qdone = 0;
+	bio->bio_next = NULL;
+	bio->bio_result = err;
+	if (lh->lh_cur != NULL) {
+		lhd_start(lh);
+	}
+	iostat_done(&lh->lh_iostat, &bio->bio_started, bio->bio_rw,
+		    bio->bio_len, err);
+	return bio;
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, start the next one, and leave the completion for the
+ * bottom half.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct bio *done = NULL;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_lock);
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -128,9 +198,42 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		done = lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+	if (done != NULL) {
+		*lh->lh_donetail = done;
+		lh->lh_donetail = &done->bio_next;
+	}
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		softint_schedule(&lh->lh_softint);
+	}
+}
+
+/*
+ * Bottom half: call the completion routines of everything finished
+ * since last time.
+ */
+static
+void
+lhd_softint(void *vlh)
+{
+	struct lhd_softc *lh = vlh;
+	struct bio *done, *next;
+
+	spinlock_acquire(&lh->lh_lock);
+	done = lh->lh_done;
+	lh->lh_done = NULL;
+	lh->lh_donetail = &lh->lh_done;
+	spinlock_release(&lh->lh_lock);
+
+	for (; done != NULL; done = next) {
+		next = done->bio_next;
+		done->bio_next = NULL;
+		done->bio_done(done);
+	}
 }
 
 /*
@@ -156,12 +259,12 @@ static
 int
 lhd_ioctl(struct device *d, int op, userptr_t data)
 {
-	/*
-	 * We don't support any ioctls.
-	 */
-	(void)d;
-	(void)op;
-	(void)data;
+	struct lhd_softc *lh = d->d_data;
+
+	switch (op) {
+	    case IOCTL_IOSTAT:
+		return iostat_ioctl(&lh->lh_iostat, data);
+	}
 	return EIOCTL;
 }
 
@@ -180,94 +283,63 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Queue a block I/O request. The scheduler decides the order; each
+ * transfer is done one sector at a time, driven by the interrupt
+ * handler.
  */
 static
-int
-lhd_io(struct device *d, struct uio *uio)
+void
+lhd_strategy(struct device *d, struct bio *bio)
 {
 	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
-
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
+	uint32_t sector = bio->bio_offset / LHD_SECTSIZE;
+	uint32_t len = bio->bio_len / LHD_SECTSIZE;
+
+	/* Don't allow I/O that isn't sector-aligned, or is empty. */
+	if (bio->bio_offset % LHD_SECTSIZE != 0 ||
+	    bio->bio_len % LHD_SECTSIZE != 0 || len == 0) {
+		bio->bio_result = bio->bio_len == 0 ? 0 : EINVAL;
+		bio->bio_done(bio);
+		return;
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
-		return EINVAL;
+	if (sector >= lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
+		bio->bio_result = EINVAL;
+		bio->bio_done(bio);
+		return;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
+	iostat_start(&lh->lh_iostat, &bio->bio_started);
+	bus_irq_follow(lh->lh_busdata, lh->lh_buspos);
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(&lh->lh_sched, bio);
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = iosched_next(&lh->lh_sched);
+		lh->lh_qdone = 0;
+		lhd_start(lh);
 	}
+	spinlock_release(&lh->lh_lock);
+}
 
-	return 0;
+/*
+ * I/O function (for both reads and writes). This goes through the
+ * request queue like everything else.
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	return bio_uio(d, uio, LHD_SECTSIZE);
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_strategy = lhd_strategy,
 };
 
 /*
@@ -284,17 +356,15 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	iosched_init(&lh->lh_sched, &lh->lh_lock);
+	lh->lh_cur = NULL;
+	lh->lh_qdone = 0;
+	lh->lh_done = NULL;
+	lh->lh_donetail = &lh->lh_done;
+	softint_init(&lh->lh_softint, lhd_softint, lh);
+	iostat_init(&lh->lh_iostat, name);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -302,6 +372,8 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
+	lh->lh_dev.d_iosched = &lh->lh_sched;
+	lh->lh_dev.d_directio = true;
 
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
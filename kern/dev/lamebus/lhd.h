@@ -30,7 +30,13 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
+#include <iosched.h>
+#include <iostat.h>
+#include <softint.h>
+
+struct bio;	/* in <bio.h> */
 
 /*
  * Our sector size
@@ -51,9 +57,26 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/*
+	 * Requests. lh_cur is the transfer the scheduler dispatched
+	 * last, as a list of bios; the first is the one on the card,
+	 * and lh_qdone is how many of its sectors are finished.
+	 */
+	struct spinlock lh_lock;	/* Lock for the following */
+	struct iosched lh_sched;	/* Requests not yet dispatched */
+	struct bio *lh_cur;
+	uint32_t lh_qdone;
+
+	/*
+	 * Finished requests, oldest first, waiting for the bottom
+	 * half to call their completion routines. Also under lh_lock.
+	 */
+	struct bio *lh_done;
+	struct bio **lh_donetail;
+	struct softint lh_softint;
+
+	struct iostat lh_iostat;	/* Statistics */
 
 	struct device lh_dev;		/* VFS device structure */
 };
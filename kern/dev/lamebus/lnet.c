@@ -27,20 +27,255 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * LAMEbus network card (lnet) driver.
+ *
+ * The card has one receive buffer and one transmit buffer. A frame
+ * that arrives while the receive buffer is full is lost, so the
+ * interrupt handler copies each frame out into a pbuf and acks it
+ * right away; everything else (waking receivers, which happens once
+ * per batch, and whatever protocol processing) is left to whoever
+ * takes the packets off the interface. Outgoing frames wait on a
+ * queue of pbufs, and each transmit-done interrupt starts the next.
+ */
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-/*#include <lamebus/lnet.h>*/ /* not yet */
+#include <endian.h>
+#include <spinlock.h>
+#include <platform/bus.h>
+#include <net.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
+#include "opt-net.h"
+
+/* Registers (offsets within slot) */
+#define LN_REG_RXINTR	0	/* Receive interrupt status */
+#define LN_REG_TXINTR	4	/* Transmit interrupt status */
+#define LN_REG_CONTROL	8	/* Control */
+#define LN_REG_STATUS	12	/* Status */
+
+/* Bits in the interrupt registers; write 0 to acknowledge */
+#define LN_INTR_DONE	0x1	/* Frame received / transmitted */
+
+/* Bits in the control register */
+#define LN_CTL_PROMISC	0x1	/* Receive frames for all addresses */
+#define LN_CTL_START	0x2	/* Send the frame in the transmit buffer */
+
+/* Bits in the status register */
+#define LN_STAT_HWADDR	0xffff	/* Our link address */
+
+/* Buffers (offsets within slot) */
+#define LN_RXBUF	32768
+#define LN_TXBUF	49152
+
+/*
+ * Link header at the front of every frame, in network byte order.
+ * The length includes the header.
+ */
+struct lnet_header {
+	uint16_t lh_frame;		/* LN_FRAME */
+	uint16_t lh_from;		/* Sender's address */
+	uint16_t lh_len;		/* Frame length */
+	uint16_t lh_to;			/* Recipient, or NET_BROADCAST */
+};
+#define LN_FRAME	0xa4b3
+
+/*
+ * Shortcut for reading a register.
+ */
+static
+inline
+uint32_t lnet_rdreg(struct lnet_softc *ln, uint32_t reg)
+{
+	return bus_read_register(ln->ln_busdata, ln->ln_buspos, reg);
+}
+
+/*
+ * Shortcut for writing a register.
+ */
+static
+inline
+void lnet_wreg(struct lnet_softc *ln, uint32_t reg, uint32_t val)
+{
+	bus_write_register(ln->ln_busdata, ln->ln_buspos, reg, val);
+}
+
+#if OPT_NET
+
+/*
+ * If the card is idle and there's a frame waiting, put it on the card
+ * and start it going. The pbuf goes back to the pool as soon as it's
+ * been copied. Called with ln_lock held.
+ */
+static
+void
+lnet_txstart(struct lnet_softc *ln)
+{
+	struct lnet_header *lh;
+	struct pbuf *pb;
+
+	KASSERT(spinlock_do_i_hold(&ln->ln_lock));
+
+	if (ln->ln_txbusy) {
+		return;
+	}
+	pb = pbufq_remhead(&ln->ln_txq);
+	if (pb == NULL) {
+		return;
+	}
+
+	lh = pbuf_prepend(pb, sizeof(*lh));
+	KASSERT(lh != NULL);
+	lh->lh_frame = htons(LN_FRAME);
+	lh->lh_from = htons(pb->pb_linksrc);
+	lh->lh_len = htons(pb->pb_len);
+	lh->lh_to = htons(pb->pb_linkdst);
+
+	memcpy(ln->ln_txbuf, PBUF_DATA(pb), pb->pb_len);
+	pbuf_put(pb);
+
+	ln->ln_txbusy = true;
+	lnet_wreg(ln, LN_REG_CONTROL, LN_CTL_START);
+}
+
+/*
+ * Copy the frame in the receive buffer into a pbuf, and strip the
+ * header. Returns NULL if there was no pbuf to be had, and sets
+ * *BAD if the frame was malformed. Called with ln_lock held.
+ */
+static
+struct pbuf *
+lnet_rxframe(struct lnet_softc *ln, bool *bad)
+{
+	struct lnet_header lh;
+	struct pbuf *pb;
+	unsigned len;
+
+	memcpy(&lh, ln->ln_rxbuf, sizeof(lh));
+	len = ntohs(lh.lh_len);
+	if (ntohs(lh.lh_frame) != LN_FRAME || len < sizeof(lh) ||
+	    len > PBUF_SIZE) {
+		*bad = true;
+		return NULL;
+	}
+
+	pb = pbuf_get();
+	if (pb == NULL) {
+		return NULL;
+	}
+	memcpy(PBUF_DATA(pb), ln->ln_rxbuf, len);
+	pb->pb_len = len;
+	pbuf_adj(pb, sizeof(lh));
+	pb->pb_linksrc = ntohs(lh.lh_from);
+	pb->pb_linkdst = ntohs(lh.lh_to);
+	return pb;
+}
+
+/*
+ * Interrupt handler. The card raises the same interrupt for both
+ * directions, so deal with both each time.
+ */
+void
+lnet_irq(void *vln)
+{
+	struct lnet_softc *ln = vln;
+	struct pbuf *pb = NULL;
+	bool rx = false, bad = false;
+
+	spinlock_acquire(&ln->ln_lock);
+	if (lnet_rdreg(ln, LN_REG_RXINTR) & LN_INTR_DONE) {
+		pb = lnet_rxframe(ln, &bad);
+		lnet_wreg(ln, LN_REG_RXINTR, 0);
+		rx = true;
+	}
+	if (lnet_rdreg(ln, LN_REG_TXINTR) & LN_INTR_DONE) {
+		lnet_wreg(ln, LN_REG_TXINTR, 0);
+		ln->ln_txbusy = false;
+		lnet_txstart(ln);
+	}
+	spinlock_release(&ln->ln_lock);
+
+	if (bad) {
+		netif_inerror(&ln->ln_if);
+	}
+	else if (rx) {
+		netif_input(&ln->ln_if, pb);
+	}
+}
+
+/*
+ * Output function for the netif.
+ */
+static
+int
+lnet_output(struct netif *ni, struct pbuf *pb)
+{
+	struct lnet_softc *ln = ni->ni_data;
+
+	spinlock_acquire(&ln->ln_lock);
+	if (ln->ln_txq.pq_count >= PBUF_NBUFS / 2) {
+		spinlock_release(&ln->ln_lock);
+		pbuf_put(pb);
+		return EAGAIN;
+	}
+	pbufq_append(&ln->ln_txq, pb);
+	lnet_txstart(ln);
+	spinlock_release(&ln->ln_lock);
+	return 0;
+}
+
+/*
+ * Config routine called by autoconf stuff.
+ */
+int
+config_lnet(struct lnet_softc *ln, int lnetno)
+{
+	struct netif *ni = &ln->ln_if;
+
+	ln->ln_rxbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos, LN_RXBUF);
+	ln->ln_txbuf = bus_map_area(ln->ln_busdata, ln->ln_buspos, LN_TXBUF);
+
+	spinlock_init(&ln->ln_lock);
+	pbufq_init(&ln->ln_txq);
+	ln->ln_txbusy = false;
+
+	snprintf(ni->ni_name, sizeof(ni->ni_name), "lnet%d", lnetno);
+	ni->ni_hwaddr = lnet_rdreg(ln, LN_REG_STATUS) & LN_STAT_HWADDR;
+	ni->ni_mtu = PBUF_SIZE - sizeof(struct lnet_header);
+	ni->ni_output = lnet_output;
+	ni->ni_data = ln;
+
+	/* Toss anything that came in before we were ready */
+	lnet_wreg(ln, LN_REG_RXINTR, 0);
+	lnet_wreg(ln, LN_REG_TXINTR, 0);
+
+	return netif_attach(ni);
+}
+
+#else /* OPT_NET */
+
+/*
+ * Without the network code, just keep the card quiet.
+ */
+void
+lnet_irq(void *vln)
+{
+	struct lnet_softc *ln = vln;
+
+	lnet_wreg(ln, LN_REG_RXINTR, 0);
+	lnet_wreg(ln, LN_REG_TXINTR, 0);
+}
 
 int
-config_lnet(struct lnet_softc *sc, int lnetno)
+config_lnet(struct lnet_softc *ln, int lnetno)
 {
-	(void)sc;
+	(void)ln;
 
 	kprintf("lnet%d: No network support in system\n", lnetno);
 
 	return ENODEV;
 }
 
-
+#endif /* OPT_NET */
@@ -42,6 +42,7 @@
 
 /* Constants */
 #define LR_RANDMAX  0xffffffff
+#define LR_BATCH    16      /* words per uiomove in lrandom_read */
 
 int
 config_lrandom(struct lrandom_softc *lr, int lrandomno)
@@ -65,17 +66,33 @@ lrandom_randmax(void *devdata)
 	return LR_RANDMAX;
 }
 
+void
+lrandom_fill(void *devdata, uint32_t *buf, unsigned num)
+{
+	struct lrandom_softc *lr = devdata;
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		buf[i] = bus_read_register(lr->lr_bus, lr->lr_buspos,
+					   LR_REG_RAND);
+	}
+}
+
 int
 lrandom_read(void *devdata, struct uio *uio)
 {
-	struct lrandom_softc *lr = devdata;
-	uint32_t val;
+	uint32_t vals[LR_BATCH];
+	size_t len;
 	int result;
 
 	while (uio->uio_resid > 0) {
-		val = bus_read_register(lr->lr_bus, lr->lr_buspos,
-					  LR_REG_RAND);
-		result = uiomove(&val, sizeof(val), uio);
+		len = uio->uio_resid;
+		if (len > sizeof(vals)) {
+			len = sizeof(vals);
+		}
+		lrandom_fill(devdata, vals,
+			     (len + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+		result = uiomove(vals, len, uio);
 		if (result) {
 			return result;
 		}
@@ -41,6 +41,8 @@ struct lrandom_softc {
 /* Functions called by higher-level drivers */
 uint32_t lrandom_random(/*struct lrandom_softc*/ void *devdata);
 uint32_t lrandom_randmax(/*struct lrandom_softc*/ void *devdata);
+void lrandom_fill(/*struct lrandom_softc*/ void *devdata,
+		  uint32_t *buf, unsigned num);
 int lrandom_read(/*struct lrandom_softc*/ void *, struct uio *);
 
 #endif /* _LAMEBUS_LRANDOM_H_ */
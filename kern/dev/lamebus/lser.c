@@ -44,14 +44,17 @@
 #define LSER_IRQ_ACTIVE  2
 #define LSER_IRQ_FORCE   4
 
+/*
+ * Interrupt handler. Acknowledge the device and stash what happened;
+ * the callbacks into the attached driver run later from lser_softint.
+ */
 void
 lser_irq(void *vsc)
 {
 	struct lser_softc *sc = vsc;
 	uint32_t x;
-	bool clear_to_write = false;
-	bool got_a_read = false;
-	uint32_t ch = 0;
+	uint32_t ch;
+	bool work = false;
 
 	spinlock_acquire(&sc->ls_lock);
 
@@ -59,7 +62,8 @@ lser_irq(void *vsc)
 	if (x & LSER_IRQ_ACTIVE) {
 		x = LSER_IRQ_ENABLE;
 		sc->ls_wbusy = 0;
-		clear_to_write = true;
+		sc->ls_startpending = true;
+		work = true;
 		bus_write_register(sc->ls_busdata, sc->ls_buspos,
 				   LSER_REG_WIRQ, x);
 	}
@@ -69,19 +73,58 @@ lser_irq(void *vsc)
 		x = LSER_IRQ_ENABLE;
 		ch = bus_read_register(sc->ls_busdata, sc->ls_buspos,
 				       LSER_REG_CHAR);
-		got_a_read = true;
+		/* If the bottom half has fallen this far behind, drop it. */
+		if (sc->ls_incount < LSER_INBUF) {
+			sc->ls_inbuf[(sc->ls_inhead + sc->ls_incount)
+				     % LSER_INBUF] = ch;
+			sc->ls_incount++;
+			work = true;
+		}
 		bus_write_register(sc->ls_busdata, sc->ls_buspos,
 				   LSER_REG_RIRQ, x);
 	}
 
 	spinlock_release(&sc->ls_lock);
 
+	if (work) {
+		softint_schedule(&sc->ls_softint);
+	}
+}
+
+/*
+ * Bottom half: report write completion and hand up received
+ * characters, without holding the lock across the callbacks (the
+ * start callback normally comes straight back into lser_write).
+ */
+static
+void
+lser_softint(void *vsc)
+{
+	struct lser_softc *sc = vsc;
+	bool clear_to_write;
+	int ch;
+
+	spinlock_acquire(&sc->ls_lock);
+	clear_to_write = sc->ls_startpending;
+	sc->ls_startpending = false;
+	spinlock_release(&sc->ls_lock);
+
 	if (clear_to_write && sc->ls_start != NULL) {
 		sc->ls_start(sc->ls_devdata);
 	}
-	if (got_a_read && sc->ls_input != NULL) {
-		sc->ls_input(sc->ls_devdata, ch);
+
+	spinlock_acquire(&sc->ls_lock);
+	while (sc->ls_incount > 0) {
+		ch = sc->ls_inbuf[sc->ls_inhead];
+		sc->ls_inhead = (sc->ls_inhead + 1) % LSER_INBUF;
+		sc->ls_incount--;
+		spinlock_release(&sc->ls_lock);
+		if (sc->ls_input != NULL) {
+			sc->ls_input(sc->ls_devdata, ch);
+		}
+		spinlock_acquire(&sc->ls_lock);
 	}
+	spinlock_release(&sc->ls_lock);
 }
 
 void
@@ -184,6 +227,10 @@ config_lser(struct lser_softc *sc, int lserno)
 
 	spinlock_init(&sc->ls_lock);
 	sc->ls_wbusy = false;
+	sc->ls_inhead = 0;
+	sc->ls_incount = 0;
+	sc->ls_startpending = false;
+	softint_init(&sc->ls_softint, lser_softint, sc);
 
 	x = bus_read_register(sc->ls_busdata, sc->ls_buspos, LSER_REG_RIRQ);
 	bus_write_register(sc->ls_busdata, sc->ls_buspos,
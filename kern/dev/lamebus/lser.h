@@ -31,12 +31,23 @@
 #define _LAMEBUS_LSER_H_
 
 #include <spinlock.h>
+#include <softint.h>
+
+/* Characters received but not yet handed up by the bottom half. */
+#define LSER_INBUF 16
 
 struct lser_softc {
 	/* Initialized by config function */
 	struct spinlock ls_lock;    /* protects ls_wbusy and device regs */
 	volatile bool ls_wbusy;     /* true if write in progress */
 
+	/* Also protected by ls_lock */
+	char ls_inbuf[LSER_INBUF];  /* received characters */
+	unsigned ls_inhead;         /* oldest character */
+	unsigned ls_incount;        /* number of characters */
+	bool ls_startpending;       /* write finished, not yet reported */
+	struct softint ls_softint;  /* bottom half */
+
 	/* Initialized by lower-level attachment function */
 	void *ls_busdata;
 	uint32_t ls_buspos;
@@ -38,7 +38,6 @@ struct timespec;
 struct ltimer_softc {
 	/* Initialized by config function */
 	int lt_hardclock;        /* true if we should call hardclock() */
-	int lt_timerclock;        /* true if we should call timerclock() */
 
 	/* Initialized by lower-level attach routine */
 	void *lt_bus;		/* bus we're on */
@@ -31,6 +31,7 @@
 #define SEMFS_H
 
 #include <array.h>
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -50,11 +51,21 @@
  * We don't use the kernel-level semaphore to implement it (although
  * that would be tidy) because we'd have to violate its abstraction.
  * XXX: or would we? review once all this is done.
+ *
+ * P and V only touch the count, so it gets a spinlock and waiters
+ * sleep on a wchan; a ping-ponging pair of processes then never
+ * blocks on a sleeplock just to get at the count. The two flags
+ * belong to the table and are protected by semfs_tablelock.
+ *
+ * A P only sleeps when the count is 0, but a batch operation may
+ * sleep waiting for more than is there; sems_batchwaiters tells V to
+ * wake everyone whenever the count goes up.
  */
 struct semfs_sem {
-	struct lock *sems_lock;			/* Lock to protect count */
-	struct cv *sems_cv;			/* CV to wait */
+	struct spinlock sems_lock;		/* Lock to protect count */
+	struct wchan *sems_wchan;		/* Where P waits */
 	unsigned sems_count;			/* Semaphore count */
+	unsigned sems_batchwaiters;		/* IOCTL_SEMOPs waiting */
 	bool sems_hasvnode;			/* The vnode exists */
 	bool sems_linked;			/* In the directory */
 };
@@ -75,11 +86,16 @@ DECLARRAY(semfs_direntry, SEMFS_INLINE);
  * ignore VOP_RECLAIM and destroy vnodes only when the underlying
  * objects are removed; but it ends up being more complicated in
  * practice. XXX: review after finishing)
+ *
+ * A semaphore can't go away while its vnode exists (sems_hasvnode),
+ * so the vnode caches a pointer to it and P and V need no table
+ * lookup.
  */
 struct semfs_vnode {
 	struct vnode semv_absvn;		/* Abstract vnode */
 	struct semfs *semv_semfs;		/* Back-pointer to fs */
 	unsigned semv_semnum;			/* Which semaphore */
+	struct semfs_sem *semv_sem;		/* It (NULL for root dir) */
 };
 
 /*
@@ -110,7 +126,7 @@ DEFARRAY(semfs_direntry, SEMFS_INLINE);
  */
 
 /* in semfs_obj.c */
-struct semfs_sem *semfs_sem_create(const char *name);
+struct semfs_sem *semfs_sem_create(void);
 int semfs_sem_insert(struct semfs *, struct semfs_sem *, unsigned *);
 void semfs_sem_destroy(struct semfs_sem *);
 struct semfs_direntry *semfs_direntry_create(const char *name, unsigned semno);
@@ -29,7 +29,9 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
 
 #define SEMFS_INLINE
 #include "semfs.h"
@@ -41,38 +43,26 @@
  * Constructor for semfs_sem.
  */
 struct semfs_sem *
-semfs_sem_create(const char *name)
+semfs_sem_create(void)
 {
 	struct semfs_sem *sem;
-	char lockname[32];
-	char cvname[32];
-
-	snprintf(lockname, sizeof(lockname), "sem:l.%s", name);
-	snprintf(cvname, sizeof(cvname), "sem:%s", name);
 
 	sem = kmalloc(sizeof(*sem));
 	if (sem == NULL) {
-		goto fail_return;
-	}
-	sem->sems_lock = lock_create(lockname);
-	if (sem->sems_lock == NULL) {
-		goto fail_sem;
+		return NULL;
 	}
-	sem->sems_cv = cv_create(cvname);
-	if (sem->sems_cv == NULL) {
-		goto fail_lock;
+	spinlock_init(&sem->sems_lock);
+	sem->sems_wchan = wchan_create("semfs_sem");
+	if (sem->sems_wchan == NULL) {
+		spinlock_cleanup(&sem->sems_lock);
+		kfree(sem);
+		return NULL;
 	}
 	sem->sems_count = 0;
+	sem->sems_batchwaiters = 0;
 	sem->sems_hasvnode = false;
 	sem->sems_linked = false;
 	return sem;
-
- fail_lock:
-	lock_destroy(sem->sems_lock);
- fail_sem:
-	kfree(sem);
- fail_return:
-	return NULL;
 }
 
 /*
@@ -81,8 +71,8 @@ semfs_sem_create(const char *name)
 void
 semfs_sem_destroy(struct semfs_sem *sem)
 {
-	cv_destroy(sem->sems_cv);
-	lock_destroy(sem->sems_lock);
+	wchan_destroy(sem->sems_wchan);
+	spinlock_cleanup(&sem->sems_lock);
 	kfree(sem);
 }
 
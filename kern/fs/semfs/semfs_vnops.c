@@ -30,9 +30,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
 #include <stat.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -62,16 +65,6 @@ semfs_eachopen(struct vnode *vn, int openflags)
 	return 0;
 }
 
-static
-int
-semfs_ioctl(struct vnode *vn, int op, userptr_t data)
-{
-	(void)vn;
-	(void)op;
-	(void)data;
-	return EINVAL;
-}
-
 static
 int
 semfs_gettype(struct vnode *vn, mode_t *ret)
@@ -106,50 +99,32 @@ semfs_fsync(struct vnode *vn)
 ////////////////////////////////////////////////////////////
 // semaphore ops
 
-/*
- * XXX fold these two together
- */
-
-static
-struct semfs_sem *
-semfs_getsembynum(struct semfs *semfs, unsigned semnum)
-{
-	struct semfs_sem *sem;
-
-	lock_acquire(semfs->semfs_tablelock);
-	sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-	lock_release(semfs->semfs_tablelock);
-
-	return sem;
-}
-
-static
-struct semfs_sem *
-semfs_getsem(struct semfs_vnode *semv)
-{
-	struct semfs *semfs = semv->semv_semfs;
-
-	return semfs_getsembynum(semfs, semv->semv_semnum);
-}
-
 /*
  * Wakeup helper. We only need to wake up if there are sleepers, which
  * should only be the case if the old count is 0; and we only
  * potentially need to wake more than one sleeper if the new count
- * will be more than 1.
+ * will be more than 1. Batch operations can be waiting at any count,
+ * though, so if there are any, wake everyone on any increase.
  */
 static
 void
 semfs_wakeup(struct semfs_sem *sem, unsigned newcount)
 {
-	if (sem->sems_count > 0 || newcount == 0) {
+	if (newcount <= sem->sems_count) {
+		return;
+	}
+	if (sem->sems_batchwaiters > 0) {
+		wchan_wakeall(sem->sems_wchan, &sem->sems_lock);
+		return;
+	}
+	if (sem->sems_count > 0) {
 		return;
 	}
 	if (newcount == 1) {
-		cv_signal(sem->sems_cv, sem->sems_lock);
+		wchan_wakeone(sem->sems_wchan, &sem->sems_lock);
 	}
 	else {
-		cv_broadcast(sem->sems_cv, sem->sems_lock);
+		wchan_wakeall(sem->sems_wchan, &sem->sems_lock);
 	}
 }
 
@@ -161,16 +136,18 @@ int
 semfs_semstat(struct vnode *vn, struct stat *buf)
 {
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
-
-	sem = semfs_getsem(semv);
+	struct semfs *semfs = semv->semv_semfs;
+	struct semfs_sem *sem = semv->semv_sem;
 
 	bzero(buf, sizeof(*buf));
 
-	lock_acquire(sem->sems_lock);
-	buf->st_size = sem->sems_count;
+	lock_acquire(semfs->semfs_tablelock);
 	buf->st_nlink = sem->sems_linked ? 1 : 0;
-	lock_release(sem->sems_lock);
+	lock_release(semfs->semfs_tablelock);
+
+	spinlock_acquire(&sem->sems_lock);
+	buf->st_size = sem->sems_count;
+	spinlock_release(&sem->sems_lock);
 
 	buf->st_mode = S_IFREG | 0666;
 	buf->st_blocks = 0;
@@ -189,12 +166,10 @@ int
 semfs_read(struct vnode *vn, struct uio *uio)
 {
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
+	struct semfs_sem *sem = semv->semv_sem;
 	size_t consume;
 
-	sem = semfs_getsem(semv);
-
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	while (uio->uio_resid > 0) {
 		if (sem->sems_count > 0) {
 			consume = uio->uio_resid;
@@ -215,10 +190,10 @@ semfs_read(struct vnode *vn, struct uio *uio)
 		if (sem->sems_count == 0) {
 			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
 			      semv->semv_semnum);
-			cv_wait(sem->sems_cv, sem->sems_lock);
+			wchan_sleep(sem->sems_wchan, &sem->sems_lock);
 		}
 	}
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 	return 0;
 }
 
@@ -231,17 +206,15 @@ int
 semfs_write(struct vnode *vn, struct uio *uio)
 {
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
+	struct semfs_sem *sem = semv->semv_sem;
 	unsigned newcount;
 
-	sem = semfs_getsem(semv);
-
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	while (uio->uio_resid > 0) {
 		newcount = sem->sems_count + uio->uio_resid;
 		if (newcount < sem->sems_count) {
 			/* overflow */
-			lock_release(sem->sems_lock);
+			spinlock_release(&sem->sems_lock);
 			return EFBIG;
 		}
 		DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
@@ -251,7 +224,7 @@ semfs_write(struct vnode *vn, struct uio *uio)
 		uio->uio_offset += uio->uio_resid;
 		uio->uio_resid = 0;
 	}
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 	return 0;
 }
 
@@ -270,7 +243,7 @@ semfs_truncate(struct vnode *vn, off_t len)
 	const unsigned max = (unsigned)-1;
 
 	struct semfs_vnode *semv = vn->vn_data;
-	struct semfs_sem *sem;
+	struct semfs_sem *sem = semv->semv_sem;
 	unsigned newcount;
 
 	if (len < 0) {
@@ -281,16 +254,156 @@ semfs_truncate(struct vnode *vn, off_t len)
 	}
 	newcount = len;
 
-	sem = semfs_getsem(semv);
-
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	semfs_wakeup(sem, newcount);
 	sem->sems_count = newcount;
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 
 	return 0;
 }
 
+/*
+ * One semaphore in a batch operation, with the total change to it.
+ */
+struct semfs_semop {
+	unsigned sop_semnum;
+	struct vnode *sop_vn;		/* holds the semaphore in place */
+	struct semfs_sem *sop_sem;
+	int64_t sop_delta;
+};
+
+/*
+ * IOCTL_SEMOP. Get a vnode reference for each semaphore named, so
+ * none can vanish, and sort them by number; then lock them all in
+ * that order and either apply every change or, if some count would
+ * go negative, unlock all but that one and wait on it.
+ */
+static
+int
+semfs_semop(struct semfs *semfs, userptr_t data)
+{
+	/* UINT_MAX; see semfs_truncate */
+	const unsigned max = (unsigned)-1;
+
+	struct ioctl_semop so;
+	struct semfs_semop ops[IOCTL_SEMOP_MAX], tmp;
+	struct semfs_vnode *semv;
+	struct semfs_sem *sem;
+	unsigned i, j, num, wait;
+	int64_t newcount;
+	int result;
+
+	result = copyin(data, &so, sizeof(so));
+	if (result) {
+		return result;
+	}
+	if (so.so_num > IOCTL_SEMOP_MAX) {
+		return EINVAL;
+	}
+
+	num = 0;
+	result = 0;
+	for (i=0; i<so.so_num; i++) {
+		for (j=0; j<num; j++) {
+			if (ops[j].sop_semnum == so.so_ops[i].sb_sem) {
+				break;
+			}
+		}
+		if (j == num) {
+			if (so.so_ops[i].sb_sem == SEMFS_ROOTDIR) {
+				result = EINVAL;
+				goto out;
+			}
+			result = semfs_getvnode(semfs, so.so_ops[i].sb_sem,
+						&ops[num].sop_vn);
+			if (result) {
+				goto out;
+			}
+			semv = ops[num].sop_vn->vn_data;
+			ops[num].sop_semnum = so.so_ops[i].sb_sem;
+			ops[num].sop_sem = semv->semv_sem;
+			ops[num].sop_delta = 0;
+			num++;
+		}
+		ops[j].sop_delta += so.so_ops[i].sb_delta;
+	}
+
+	/* insertion sort, for the lock order */
+	for (i=1; i<num; i++) {
+		tmp = ops[i];
+		for (j=i; j>0 && ops[j-1].sop_semnum > tmp.sop_semnum; j--) {
+			ops[j] = ops[j-1];
+		}
+		ops[j] = tmp;
+	}
+
+	while (1) {
+		wait = num;
+		for (i=0; i<num; i++) {
+			sem = ops[i].sop_sem;
+			spinlock_acquire(&sem->sems_lock);
+			newcount = sem->sems_count + ops[i].sop_delta;
+			if (newcount > max) {
+				result = EFBIG;
+			}
+			else if (newcount < 0 && wait == num) {
+				wait = i;
+			}
+		}
+		if (result == 0 && wait == num) {
+			break;
+		}
+		for (i=0; i<num; i++) {
+			if (i != wait || result) {
+				spinlock_release(&ops[i].sop_sem->sems_lock);
+			}
+		}
+		if (result) {
+			goto out;
+		}
+
+		sem = ops[wait].sop_sem;
+		DEBUG(DB_SEMFS, "semfs: sem%u: batch blocking\n",
+		      ops[wait].sop_semnum);
+		sem->sems_batchwaiters++;
+		wchan_sleep(sem->sems_wchan, &sem->sems_lock);
+		sem->sems_batchwaiters--;
+		spinlock_release(&sem->sems_lock);
+	}
+
+	for (i=0; i<num; i++) {
+		sem = ops[i].sop_sem;
+		newcount = sem->sems_count + ops[i].sop_delta;
+		DEBUG(DB_SEMFS, "semfs: sem%u: batch, count %u -> %u\n",
+		      ops[i].sop_semnum, sem->sems_count,
+		      (unsigned)newcount);
+		semfs_wakeup(sem, newcount);
+		sem->sems_count = newcount;
+	}
+	for (i=num; i-- > 0; ) {
+		spinlock_release(&ops[i].sop_sem->sems_lock);
+	}
+
+ out:
+	for (i=0; i<num; i++) {
+		VOP_DECREF(ops[i].sop_vn);
+	}
+	return result;
+}
+
+static
+int
+semfs_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+
+	switch (op) {
+	    case IOCTL_SEMOP:
+		return semfs_semop(semv->semv_semfs, data);
+	}
+	return EINVAL;
+}
+
 ////////////////////////////////////////////////////////////
 // directory ops
 
@@ -411,7 +524,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	}
 
 	/* create it */
-	sem = semfs_sem_create(name);
+	sem = semfs_sem_create();
 	if (sem == NULL) {
 		result = ENOMEM;
 		goto fail_unlock;
@@ -491,20 +604,19 @@ semfs_remove(struct vnode *dirvn, const char *name)
 		}
 		if (!strcmp(name, dent->semd_name)) {
 			/* found */
-			sem = semfs_getsembynum(semfs, dent->semd_semnum);
-			lock_acquire(sem->sems_lock);
+			lock_acquire(semfs->semfs_tablelock);
+			sem = semfs_semarray_get(semfs->semfs_sems,
+						 dent->semd_semnum);
 			KASSERT(sem->sems_linked);
 			sem->sems_linked = false;
 			if (sem->sems_hasvnode == false) {
-				lock_acquire(semfs->semfs_tablelock);
 				semfs_semarray_set(semfs->semfs_sems,
 						   dent->semd_semnum, NULL);
 				lock_release(semfs->semfs_tablelock);
-				lock_release(sem->sems_lock);
 				semfs_sem_destroy(sem);
 			}
 			else {
-				lock_release(sem->sems_lock);
+				lock_release(semfs->semfs_tablelock);
 			}
 			semfs_direntryarray_set(semfs->semfs_dents, i, NULL);
 			semfs_direntry_destroy(dent);
@@ -523,7 +635,7 @@ semfs_remove(struct vnode *dirvn, const char *name)
  */
 static
 int
-semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
+semfs_lookup(struct vnode *dirvn, const char *path, struct vnode **resultvn)
 {
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
@@ -561,7 +673,7 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
  */
 static
 int
-semfs_lookparent(struct vnode *dirvn, char *path,
+semfs_lookparent(struct vnode *dirvn, const char *path,
 		 struct vnode **resultdirvn, char *namebuf, size_t bufmax)
 {
         if (strlen(path)+1 > bufmax) {
@@ -603,19 +715,13 @@ semfs_reclaim(struct vnode *vn)
 
 	lock_acquire(semfs->semfs_tablelock);
 
-	/* vnode refcount is protected by the vnode's ->vn_countlock */
-	spinlock_acquire(&vn->vn_countlock);
-	if (vn->vn_refcount > 1) {
-		/* consume the reference VOP_DECREF passed us */
-		vn->vn_refcount--;
-
-		spinlock_release(&vn->vn_countlock);
+	/* the table lock keeps anyone new from finding the vnode */
+	if (!vnode_lastref(vn)) {
+		/* it consumed the reference VOP_DECREF passed us */
 		lock_release(semfs->semfs_tablelock);
 		return EBUSY;
 	}
 
-	spinlock_release(&vn->vn_countlock);
-
 	/* remove from the table */
 	num = vnodearray_num(semfs->semfs_vnodes);
 	for (i=0; i<num; i++) {
@@ -627,7 +733,9 @@ semfs_reclaim(struct vnode *vn)
 	}
 
 	if (semv->semv_semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semv->semv_semnum);
+		sem = semv->semv_sem;
+		KASSERT(sem == semfs_semarray_get(semfs->semfs_sems,
+						  semv->semv_semnum));
 		KASSERT(sem->sems_hasvnode);
 		sem->sems_hasvnode = false;
 		if (sem->sems_linked == false) {
@@ -657,6 +765,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_isdir,
 	.vop_getdirentry = semfs_getdirentry,
+	.vop_getdirentries = vnode_getdirentries_generic,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_dirstat,
@@ -665,6 +774,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = semfs_namefile,
 
 	.vop_creat = semfs_creat,
@@ -690,6 +800,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_read = semfs_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = semfs_write,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_semstat,
@@ -698,6 +809,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -716,7 +828,8 @@ static const struct vnode_ops semfs_semops = {
  */
 static
 struct semfs_vnode *
-semfs_vnode_create(struct semfs *semfs, unsigned semnum)
+semfs_vnode_create(struct semfs *semfs, unsigned semnum,
+		   struct semfs_sem *sem)
 {
 	const struct vnode_ops *optable;
 	struct semfs_vnode *semv;
@@ -736,6 +849,7 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 	semv->semv_semfs = semfs;
 	semv->semv_semnum = semnum;
+	semv->semv_sem = sem;
 
 	result = vnode_init(&semv->semv_absvn, optable,
 			    &semfs->semfs_absfs, semv);
@@ -775,7 +889,23 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 	}
 
 	/* Make it */
-	semv = semfs_vnode_create(semfs, semnum);
+	if (semnum != SEMFS_ROOTDIR) {
+		/* IOCTL_SEMOP takes numbers from userland */
+		if (semnum >= semfs_semarray_num(semfs->semfs_sems)) {
+			lock_release(semfs->semfs_tablelock);
+			return ENOENT;
+		}
+		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
+		if (sem == NULL) {
+			lock_release(semfs->semfs_tablelock);
+			return ENOENT;
+		}
+		KASSERT(sem->sems_hasvnode == false);
+	}
+	else {
+		sem = NULL;
+	}
+	semv = semfs_vnode_create(semfs, semnum, sem);
 	if (semv == NULL) {
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
@@ -786,10 +916,7 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
 	}
-	if (semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-		KASSERT(sem != NULL);
-		KASSERT(sem->sems_hasvnode == false);
+	if (sem != NULL) {
 		sem->sems_hasvnode = true;
 	}
 	lock_release(semfs->semfs_tablelock);
@@ -41,11 +41,10 @@
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block, without reading it.
  *
  * Uses one buffer; returns it if bufret is not NULL.
  */
-static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 {
@@ -58,6 +57,8 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 		return result;
 	}
 
+	/* whatever the journal last saw in the block is gone */
+	sfs_jlog_reset(sfs, buf);
 	ptr = buffer_map(buf);
 	bzero(ptr, SFS_BLOCKSIZE);
 	buffer_mark_valid(buf);
@@ -73,9 +74,40 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 	return 0;
 }
 
+/*
+ * Note that the freemap bits for blocks START through START+COUNT-1
+ * have changed, so the freemap blocks holding them need writing.
+ * The changes themselves are in the journal (ALLOC and FREE records),
+ * so only these blocks need to reach disk at the next checkpoint.
+ *
+ * Locking: must hold sfs_freemaplock.
+ */
+void
+sfs_freemap_dirtied(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	uint32_t first, last, i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(count > 0);
+
+	first = start / SFS_BITSPERBLOCK;
+	last = (start + count - 1) / SFS_BITSPERBLOCK;
+	for (i=first; i<=last; i++) {
+		if (!bitmap_isset(sfs->sfs_freemapdirtymap, i)) {
+			bitmap_mark(sfs->sfs_freemapdirtymap, i);
+		}
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
 /*
  * Allocate a block.
  *
+ * GOAL is where the caller would like the block to be; the first
+ * free block at or after it is used, wrapping around to the start of
+ * the volume if need be. Block 0 is the superblock and never free,
+ * so a GOAL of 0 just means no preference.
+ *
  * Returns the block number, plus a buffer for it if BUFRET isn't
  * null. The buffer, if any, is marked valid and dirty, and zeroed
  * out.
@@ -83,18 +115,20 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
  * Uses 1 buffer.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock,
+	   struct buf **bufret)
 {
 	int result;
 
 	lock_acquire(sfs->sfs_freemaplock);
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
 		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_jlog_alloc(sfs, *diskblock, 1);
+	sfs_freemap_dirtied(sfs, *diskblock, 1);
 
 	lock_release(sfs->sfs_freemaplock);
 
@@ -106,23 +140,96 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock, bufret);
 	if (result) {
-		lock_acquire(sfs->sfs_freemaplock);
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
-		lock_release(sfs->sfs_freemaplock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
 
+/*
+ * Allocate a run of up to COUNT consecutive blocks, starting with the
+ * first free block at or after GOAL (as for sfs_balloc) and taking as
+ * many of the blocks after it as are free. Returns the first block
+ * and how many were taken.
+ *
+ * Unlike sfs_balloc, the blocks are not cleared: the caller must
+ * either write all of each block or clear it itself before it can be
+ * read back, and free any it doesn't end up using.
+ *
+ * Uses no buffers.
+ */
+int
+sfs_balloc_range(struct sfs_fs *sfs, daddr_t goal, uint32_t count,
+		 daddr_t *firstret, uint32_t *countret)
+{
+	daddr_t first;
+	uint32_t got;
+	int result;
+
+	KASSERT(count > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, &first);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	if (first >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc_range: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, first);
+	}
+	for (got = 1; got < count; got++) {
+		if (first + got >= sfs->sfs_sb.sb_nblocks ||
+		    bitmap_isset(sfs->sfs_freemap, first + got)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, first + got);
+	}
+	sfs_jlog_alloc(sfs, first, got);
+	sfs_freemap_dirtied(sfs, first, got);
+
+	lock_release(sfs->sfs_freemaplock);
+
+	*firstret = first;
+	*countret = got;
+	return 0;
+}
+
 /*
  * Free a block, for when we already have the freemap locked.
+ *
+ * Inside an operation the block isn't actually released until the
+ * operation commits (see sfs_jlog.c).
  */
 void
 sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 {
 	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	if (!sfs_jlog_free(sfs, diskblock, 1)) {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		sfs_freemap_dirtied(sfs, diskblock, 1);
+	}
+}
+
+/*
+ * Free COUNT consecutive blocks starting at START, for when we
+ * already have the freemap locked. This updates each freemap block's
+ * worth of bits once, instead of once per disk block.
+ */
+void
+sfs_bfree_range_prelocked(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (start + count > sfs->sfs_sb.sb_nblocks || start + count < start) {
+		panic("sfs: %s: bfree_range: invalid blocks %u-%u\n",
+		      sfs->sfs_sb.sb_volname, start, start + count - 1);
+	}
+	if (!sfs_jlog_free(sfs, start, count)) {
+		bitmap_unmark_range(sfs->sfs_freemap, start, count);
+		sfs_freemap_dirtied(sfs, start, count);
+	}
 }
 
 /*
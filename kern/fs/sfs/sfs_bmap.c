@@ -126,6 +126,11 @@
  * reference to use, so the access offset should always be zero.
  */
 
+/*
+ * File blocks freed per step of a truncate or hole punch (see
+ * sfs_discard_steps): one indirect block's worth.
+ */
+#define SFS_DISCARDSTEP SFS_DBPERIDB
 
 /*
  * Subtree reference.
@@ -147,6 +152,7 @@ struct sfs_blockobj {
 		} bo_inode;
 		struct {
 			struct buf *id_buf;
+			daddr_t id_block;
 		} bo_idblock;
 	};
 };
@@ -244,10 +250,11 @@ sfs_blockobj_init_inode(struct sfs_blockobj *bo,
 static
 void
 sfs_blockobj_init_idblock(struct sfs_blockobj *bo,
-			  struct buf *idbuf)
+			  struct buf *idbuf, daddr_t idblock)
 {
 	bo->bo_isinode = false;
 	bo->bo_idblock.id_buf = idbuf;
+	bo->bo_idblock.id_block = idblock;
 }
 
 /*
@@ -319,11 +326,10 @@ sfs_blockobj_get(struct sfs_blockobj *bo, uint32_t offset)
  */
 static
 void
-sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
+sfs_blockobj_set(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
+		 uint32_t newval)
 {
 	if (bo->bo_isinode) {
-		struct sfs_vnode *sv = bo->bo_inode.i_sv;
-		struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 		struct sfs_dinode *dino;
 		unsigned indirlevel, indirnum;
 
@@ -366,7 +372,59 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 
 		idptr = buffer_map(bo->bo_idblock.id_buf);
 		idptr[offset] = newval;
-		buffer_mark_dirty(bo->bo_idblock.id_buf);
+		sfs_jlog_dirty(sfs, bo->bo_idblock.id_buf,
+			       bo->bo_idblock.id_block);
+	}
+}
+
+/*
+ * Choose the allocation goal for the block slot at offset OFFSET in
+ * a blockobj: just past the block the previous slot maps, which for
+ * a file written in order is the previous block of the file, or
+ * failing that just past the blockobj itself, so the first data
+ * block goes after its inode or indirect block.
+ */
+static
+daddr_t
+sfs_blockobj_goal(struct sfs_blockobj *bo, uint32_t offset)
+{
+	daddr_t prev;
+
+	if (bo->bo_isinode) {
+		struct sfs_vnode *sv = bo->bo_inode.i_sv;
+		struct sfs_dinode *dino;
+		unsigned indirlevel, indirnum;
+
+		KASSERT(offset == 0);
+
+		dino = sfs_dinode_map(sv);
+		indirlevel = bo->bo_inode.i_subtree.str_indirlevel;
+		indirnum = bo->bo_inode.i_subtree.str_indirnum;
+
+		switch (indirlevel) {
+		    case 0:
+			prev = indirnum > 0 ? dino->sfi_direct[indirnum-1] : 0;
+			break;
+		    case 1:
+			prev = dino->sfi_direct[SFS_NDIRECT-1];
+			break;
+		    case 2:
+			prev = dino->sfi_indirect;
+			break;
+		    default:
+			prev = dino->sfi_dindirect;
+			break;
+		}
+		return (prev != 0 ? prev : sv->sv_ino) + 1;
+	}
+	else {
+		uint32_t *idptr;
+
+		KASSERT(offset < SFS_DBPERIDB);
+
+		idptr = buffer_map(bo->bo_idblock.id_buf);
+		prev = offset > 0 ? idptr[offset-1] : 0;
+		return (prev != 0 ? prev : bo->bo_idblock.id_block) + 1;
 	}
 }
 
@@ -376,11 +434,15 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 /*
  * Given a pointer to a block slot, return it, allocating a block
  * if necessary.
+ *
+ * If RUN isn't NULL, the slot maps file data and the block is taken
+ * from RUN, which is refilled with sfs_balloc_range when empty. Such
+ * blocks are not cleared (see sfs_io).
  */
 static
 int
 sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
-	     bool doalloc, daddr_t *diskblock_ret)
+	     bool doalloc, struct sfs_allocrun *run, daddr_t *diskblock_ret)
 {
 	daddr_t block;
 	int result;
@@ -393,14 +455,34 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
 	/*
 	 * Do we need to allocate?
 	 */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block, NULL);
+	if (block==0 && doalloc && run != NULL) {
+		if (run->ar_count == 0) {
+			KASSERT(run->ar_want > 0);
+			result = sfs_balloc_range(sfs,
+						  sfs_blockobj_goal(bo, offset),
+						  run->ar_want,
+						  &run->ar_next,
+						  &run->ar_count);
+			if (result) {
+				return result;
+			}
+		}
+		block = run->ar_next++;
+		run->ar_count--;
+		run->ar_fresh = true;
+
+		/* Remember what we allocated; mark storage dirty */
+		sfs_blockobj_set(sfs, bo, offset, block);
+	}
+	else if (block==0 && doalloc) {
+		result = sfs_balloc(sfs, sfs_blockobj_goal(bo, offset),
+				    &block, NULL);
 		if (result) {
 			return result;
 		}
 
 		/* Remember what we allocated; mark storage dirty */
-		sfs_blockobj_set(bo, offset, block);
+		sfs_blockobj_set(sfs, bo, offset, block);
 	}
 
 	/*
@@ -421,7 +503,9 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
  * OFFSET is the block offset into the subtree.
  * DOALLOC is true if we're allocating blocks.
  *
- * DISKBLOCK_RET gets the resulting disk block number.
+ * DISKBLOCK_RET gets the resulting disk block number. If that's 0
+ * and HOLESPAN_RET isn't NULL, it gets the number of blocks from
+ * OFFSET to the end of the empty pointer we stopped at.
  *
  * This function would be somewhat tidier if it were recursive, but
  * recursion in the kernel is generally a bad idea because of the
@@ -431,18 +515,24 @@ static
 int
 sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		 unsigned indir,
-		 uint32_t offset, bool doalloc,
-		 daddr_t *diskblock_ret)
+		 uint32_t offset, bool doalloc, struct sfs_allocrun *run,
+		 daddr_t *diskblock_ret, uint32_t *holespan_ret)
 {
 	daddr_t block;
 	struct buf *idbuf;
 	uint32_t idoff;
 	uint32_t fileblocks_per_entry;
 	struct sfs_blockobj idobj;
+	unsigned i;
 	int result;
 
-	/* Get the block inodeobj immediately points to (maybe allocating) */
-	result = sfs_bmap_get(sfs, inodeobj, 0, doalloc, &block);
+	/*
+	 * Get the block inodeobj immediately points to (maybe
+	 * allocating). Only the data blocks at the bottom come from
+	 * RUN.
+	 */
+	result = sfs_bmap_get(sfs, inodeobj, 0, doalloc,
+			      indir == 0 ? run : NULL, &block);
 	if (result) {
 		return result;
 	}
@@ -453,6 +543,14 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		if (block == 0) {
 			KASSERT(doalloc == false);
 			*diskblock_ret = 0;
+			if (holespan_ret != NULL) {
+				/* this pointer would map DBPERIDB^indir */
+				*holespan_ret = 1;
+				for (i=0; i<indir; i++) {
+					*holespan_ret *= SFS_DBPERIDB;
+				}
+				*holespan_ret -= offset;
+			}
 			return 0;
 		}
 
@@ -485,13 +583,18 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		if (result) {
 			return result;
 		}
+		if (doalloc) {
+			sfs_jlog_prepare(sfs, idbuf);
+		}
 
-		sfs_blockobj_init_idblock(&idobj, idbuf);
+		sfs_blockobj_init_idblock(&idobj, idbuf, block);
 
 		/* Get the address of the next layer down (maybe allocating) */
-		result = sfs_bmap_get(sfs, &idobj, idoff, doalloc, &block);
+		result = sfs_bmap_get(sfs, &idobj, idoff, doalloc,
+				      indir == 1 ? run : NULL, &block);
 
 		sfs_blockobj_cleanup(&idobj);
+		sfs_jlog_forget(sfs, idbuf);
 		buffer_release(idbuf);
 
 		if (result) {
@@ -501,6 +604,9 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		indir--;
 	}
 	*diskblock_ret = block;
+	if (block == 0 && holespan_ret != NULL) {
+		*holespan_ret = 1;
+	}
 	return 0;
 }
 
@@ -513,11 +619,13 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
  * Locking: must hold vnode lock. May get/release buffer cache locks
  * and (via sfs_balloc) sfs_freemaplock.
  *
- * Requires up to 2 buffers.
+ * Requires up to 2 buffers, or 7 for an extent-mapped file.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock)
+sfs_bmap_internal(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		  struct sfs_allocrun *run, daddr_t *diskblock,
+		  uint32_t *holespan)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct sfs_subtreeref subtree;
@@ -527,15 +635,24 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Figure out where to start */
-	result = sfs_get_indirection(fileblock, &subtree, &offset);
+	/* Load the inode */
+	result = sfs_dinode_load(sv);
 	if (result) {
 		return result;
 	}
 
-	/* Load the inode */
-	result = sfs_dinode_load(sv);
+	if (sfs_dinode_map(sv)->sfi_flags & SFS_IFLAG_EXTENTS) {
+		/* Mapped by extents instead; see sfs_extent.c */
+		result = sfs_extent_bmap(sv, fileblock, doalloc, run,
+					 diskblock, holespan);
+		sfs_dinode_unload(sv);
+		goto done;
+	}
+
+	/* Figure out where to start */
+	result = sfs_get_indirection(fileblock, &subtree, &offset);
 	if (result) {
+		sfs_dinode_unload(sv);
 		return result;
 	}
 
@@ -545,11 +662,13 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	/* Do the work in the indicated subtree */
 	result = sfs_bmap_subtree(sfs, &inodeobj,
 				  subtree.str_indirlevel,
-				  offset, doalloc,
-				  diskblock);
+				  offset, doalloc, run,
+				  diskblock, holespan);
 	sfs_blockobj_cleanup(&inodeobj);
 	sfs_dinode_unload(sv);
 
+ done:
+
 	if (result) {
 		return result;
 	}
@@ -564,6 +683,201 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	return 0;
 }
 
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock)
+{
+	return sfs_bmap_internal(sv, fileblock, doalloc, NULL, diskblock,
+				 NULL);
+}
+
+/*
+ * Same as sfs_bmap with DOALLOC set, but if the block has to be
+ * allocated take it from RUN (see sfs_io), setting RUN->ar_fresh.
+ * The caller must then write the whole block or clear it.
+ */
+int
+sfs_bmap_run(struct sfs_vnode *sv, uint32_t fileblock,
+	     struct sfs_allocrun *run, daddr_t *diskblock)
+{
+	run->ar_fresh = false;
+	return sfs_bmap_internal(sv, fileblock, true, run, diskblock, NULL);
+}
+
+/*
+ * Same as sfs_bmap without DOALLOC, but when FILEBLOCK is in a hole
+ * also report in *HOLESPAN how many blocks starting with it are
+ * certainly unmapped (at least 1): the rest of whatever empty
+ * pointer or gap between extents the lookup stopped at. A reader
+ * can then pass over a sparse region a subtree at a time.
+ *
+ * Preallocated blocks that were never written count as holes, since
+ * that's how they read; past a file's unwritten mark everything does.
+ */
+int
+sfs_bmap_hole(struct sfs_vnode *sv, uint32_t fileblock,
+	      daddr_t *diskblock, uint32_t *holespan)
+{
+	struct sfs_dinode *inodeptr;
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if ((inodeptr->sfi_flags & SFS_IFLAG_PREALLOC) &&
+	    fileblock >= inodeptr->sfi_unwritten) {
+		sfs_dinode_unload(sv);
+		*diskblock = 0;
+		*holespan = (uint32_t)-1 - fileblock;
+		return 0;
+	}
+	sfs_dinode_unload(sv);
+
+	return sfs_bmap_internal(sv, fileblock, false, NULL, diskblock,
+				 holespan);
+}
+
+/*
+ * Move the unwritten mark of SV (whose inode is INODEPTR) up toward
+ * file block FILEBLOCK, zeroing the mapped blocks it passes over,
+ * since from now on they're read from disk. Stops after zeroing
+ * MAXZERO blocks; holes cost nothing. The mark is left just past
+ * what was zeroed, even on error. Sets *ZEROED to the count.
+ *
+ * Requires up to 5 buffers.
+ */
+static
+int
+sfs_bmap_zeroto(struct sfs_vnode *sv, struct sfs_dinode *inodeptr,
+		uint32_t fileblock, uint32_t maxzero, uint32_t *zeroed)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t diskblock;
+	uint32_t block, holespan;
+	int result = 0;
+
+	*zeroed = 0;
+	block = inodeptr->sfi_unwritten;
+	while (block < fileblock && *zeroed < maxzero) {
+		result = sfs_bmap_internal(sv, block, false, NULL,
+					   &diskblock, &holespan);
+		if (result) {
+			break;
+		}
+		if (diskblock == 0) {
+			if (holespan > fileblock - block) {
+				holespan = fileblock - block;
+			}
+			block += holespan;
+			continue;
+		}
+		result = buffer_get(&sfs->sfs_absfs, diskblock,
+				    SFS_BLOCKSIZE, &buf);
+		if (result) {
+			break;
+		}
+		bzero(buffer_map(buf), SFS_BLOCKSIZE);
+		buffer_mark_valid(buf);
+		sfs_data_done(sfs, buf, diskblock, true, true);
+		block++;
+		(*zeroed)++;
+	}
+
+	if (block != inodeptr->sfi_unwritten) {
+		inodeptr->sfi_unwritten = block;
+		sfs_dinode_mark_dirty(sv);
+	}
+	return result;
+}
+
+/*
+ * Get ready to write at file block FILEBLOCK: in a file with
+ * preallocated blocks, move the unwritten mark up to it, zeroing at
+ * most MAXZERO blocks. Sets *DONE if that took no zeroing at all;
+ * otherwise the caller should end the operation, so a large gap is
+ * zeroed a bounded piece per transaction, and call again.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 5 buffers.
+ */
+int
+sfs_bmap_advance(struct sfs_vnode *sv, uint32_t fileblock, uint32_t maxzero,
+		 bool *done)
+{
+	struct sfs_dinode *inodeptr;
+	uint32_t zeroed;
+	int result;
+
+	*done = true;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if (!(inodeptr->sfi_flags & SFS_IFLAG_PREALLOC) ||
+	    fileblock <= inodeptr->sfi_unwritten) {
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+
+	result = sfs_bmap_zeroto(sv, inodeptr, fileblock, maxzero, &zeroed);
+	if (zeroed > 0) {
+		*done = false;
+	}
+	sfs_dinode_unload(sv);
+	return result;
+}
+
+/*
+ * Note that file block FILEBLOCK is about to be written. In a file
+ * with preallocated blocks, if it's at or past the unwritten mark,
+ * move the mark past it, zeroing the mapped blocks it skips over.
+ * Writers close any large gap beforehand with sfs_bmap_advance, so
+ * that is at most a few blocks here. Sets *UNWRITTEN if FILEBLOCK
+ * itself was past the mark: then if it's mapped its contents are
+ * garbage, and the caller should treat it as freshly allocated.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 5 buffers.
+ */
+int
+sfs_bmap_markwritten(struct sfs_vnode *sv, uint32_t fileblock,
+		     bool *unwritten)
+{
+	struct sfs_dinode *inodeptr;
+	uint32_t zeroed;
+	int result;
+
+	*unwritten = false;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if (!(inodeptr->sfi_flags & SFS_IFLAG_PREALLOC) ||
+	    fileblock < inodeptr->sfi_unwritten) {
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+
+	result = sfs_bmap_zeroto(sv, inodeptr, fileblock, (uint32_t)-1,
+				 &zeroed);
+	if (result == 0) {
+		inodeptr->sfi_unwritten = fileblock + 1;
+		sfs_dinode_mark_dirty(sv);
+		*unwritten = true;
+	}
+	sfs_dinode_unload(sv);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // truncate
 
@@ -580,6 +894,48 @@ struct layerinfo {
 	bool modified;
 };
 
+/*
+ * Blocks being freed by a truncate are collected into runs of
+ * consecutive block numbers and handed to the freemap a run at a
+ * time. Files are mostly laid out in order, so this turns freeing a
+ * large file into a handful of range frees.
+ */
+struct sfs_freerun {
+	daddr_t fr_start;
+	uint32_t fr_count;
+};
+
+static
+void
+sfs_freerun_flush(struct sfs_fs *sfs, struct sfs_freerun *run)
+{
+	if (run->fr_count > 0) {
+		sfs_bfree_range_prelocked(sfs, run->fr_start, run->fr_count);
+		run->fr_count = 0;
+	}
+}
+
+static
+void
+sfs_freerun_add(struct sfs_fs *sfs, struct sfs_freerun *run, daddr_t block)
+{
+	if (run->fr_count > 0) {
+		if (block == run->fr_start + run->fr_count) {
+			run->fr_count++;
+			return;
+		}
+		/* an indirect block usually sits just before its data */
+		if (block + 1 == run->fr_start) {
+			run->fr_start = block;
+			run->fr_count++;
+			return;
+		}
+		sfs_freerun_flush(sfs, run);
+	}
+	run->fr_start = block;
+	run->fr_count = 1;
+}
+
 /*
  * Find the intersection between the ranges [astart, aend)
  * and [bstart, bend). Returns true if this is nonempty.
@@ -699,16 +1055,37 @@ sfs_itrunc_readindir(struct sfs_vnode *sv, struct layerinfo *layers,
 			layer, layers[layer].block, strerror(result));
 		return result;
 	}
+	sfs_jlog_prepare(sfs, layers[layer].buf);
 	layers[layer].modified = false;
 	return 0;
 }
 
+/*
+ * Start reading the indirect block after the one at the current
+ * position in LAYER, so it's likely in memory by the time we finish
+ * with the current one.
+ */
+static
+void
+sfs_itrunc_readahead(struct sfs_vnode *sv, struct layerinfo *layers,
+		     unsigned layer)
+{
+	int next;
+
+	next = layers[layer].pos + 1;
+	if (next < SFS_DBPERIDB && layers[layer].data[next] != 0) {
+		buffer_prefetch(sv->sv_absvn.vn_fs, layers[layer].data[next],
+				SFS_BLOCKSIZE);
+	}
+}
+
 /*
  * Discard from one of the subtrees in the inode. ROOTPTR points to the
  * block pointer in the inode. INDIR is the indirection level of that
  * block pointer. STARTOFFSET and ENDOFFSET are fileblock numbers
  * relative to the beginning of this subtree, not indexes into the
- * indirect blocks. (yes, this is confusing)
+ * indirect blocks. (yes, this is confusing) Freed blocks are added
+ * to RUN.
  *
  * XXX: this code is a mess. I have been working on splitting out the
  * cut/paste portions, but it still needs quite a bit more.
@@ -716,7 +1093,8 @@ sfs_itrunc_readindir(struct sfs_vnode *sv, struct layerinfo *layers,
 static
 int
 sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
-		    uint32_t startoffset, uint32_t endoffset)
+		    uint32_t startoffset, uint32_t endoffset,
+		    struct sfs_freerun *run)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
@@ -799,6 +1177,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 * Read the double indirect block,
 		 * hand it to the next inner loop.
 		 */
+		sfs_itrunc_readahead(sv, layers, layer);
 		result = sfs_itrunc_readindir(sv, layers, layer - 1);
 		if (result) {
 			/* XXX blah */
@@ -831,6 +1210,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			 * Read the indirect block, hand it to the
 			 * next inner loop.
 			 */
+			sfs_itrunc_readahead(sv, layers, layer);
 			result = sfs_itrunc_readindir(sv, layers, layer - 1);
 			if (result) {
 				/* XXX blah */
@@ -864,7 +1244,8 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				layers[layer].data[layers[layer].pos] = 0;
 				layers[layer].modified = true;
 
-				sfs_bfree_prelocked(sfs, layers[layer - 1].block);
+				sfs_freerun_add(sfs, run,
+						layers[layer - 1].block);
 			}
 			/* end for level 1 */
 
@@ -874,7 +1255,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				 * block is empty now;
 				 * free it
 				 */
-				sfs_bfree_prelocked(sfs, layers[1].block);
+				sfs_freerun_add(sfs, run, layers[1].block);
 				if (indir == 1) {
 					*rootptr = 0;
 					sfs_dinode_mark_dirty(sv);
@@ -890,13 +1271,14 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 				 * The indirect block
 				 * has been modified
 				 */
-				buffer_mark_dirty(layers[1].buf);
+				sfs_jlog_dirty(sfs, layers[1].buf, layers[1].block);
 				if (indir != 1) {
 					layers[2].hasnonzero = true;
 				}
 				buffer_release(layers[1].buf);
 			}
 			else {
+				sfs_jlog_forget(sfs, layers[1].buf);
 				buffer_release(layers[1].buf);
 			}
 
@@ -927,7 +1309,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			 * The whole double indirect
 			 * block is empty now; free it
 			 */
-			sfs_bfree_prelocked(sfs, layers[2].block);
+			sfs_freerun_add(sfs, run, layers[2].block);
 			if (indir == 2) {
 				*rootptr = 0;
 				sfs_dinode_mark_dirty(sv);
@@ -943,13 +1325,14 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 			 * The double indirect block
 			 * has been modified
 			 */
-			buffer_mark_dirty(layers[2].buf);
+			sfs_jlog_dirty(sfs, layers[2].buf, layers[2].block);
 			if (indir == 3) {
 				layers[3].hasnonzero = true;
 			}
 			buffer_release(layers[2].buf);
 		}
 		else {
+			sfs_jlog_forget(sfs, layers[2].buf);
 			buffer_release(layers[2].buf);
 		}
 
@@ -969,7 +1352,7 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 * The whole triple indirect block is
 		 * empty now; free it
 		 */
-		sfs_bfree_prelocked(sfs, layers[3].block);
+		sfs_freerun_add(sfs, run, layers[3].block);
 		*rootptr = 0;
 		sfs_dinode_mark_dirty(sv);
 		buffer_release_and_invalidate(layers[3].buf);
@@ -979,10 +1362,11 @@ sfs_discard_subtree(struct sfs_vnode *sv, uint32_t *rootptr, unsigned indir,
 		 * The triple indirect block has been
 		 * modified
 		 */
-		buffer_mark_dirty(layers[3].buf);
+		sfs_jlog_dirty(sfs, layers[3].buf, layers[3].block);
 		buffer_release(layers[3].buf);
 	}
 	else {
+		sfs_jlog_forget(sfs, layers[3].buf);
 		buffer_release(layers[3].buf);
 	}
 
@@ -1003,9 +1387,12 @@ sfs_discard(struct sfs_vnode *sv,
 	uint32_t i;
 	daddr_t block;
 	uint32_t lo, hi, substart, subend;
-	int result;
+	struct sfs_freerun run;
+	int result = 0;
 
 	inodeptr = sfs_dinode_map(sv);
+	run.fr_start = 0;
+	run.fr_count = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1014,7 +1401,7 @@ sfs_discard(struct sfs_vnode *sv,
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = inodeptr->sfi_direct[i];
 		if (i >= startfileblock && i < endfileblock && block != 0) {
-			sfs_bfree_prelocked(sfs, block);
+			sfs_freerun_add(sfs, &run, block);
 			inodeptr->sfi_direct[i] = 0;
 			sfs_dinode_mark_dirty(sv);
 		}
@@ -1026,9 +1413,10 @@ sfs_discard(struct sfs_vnode *sv,
 	if (sfs_intersect_range(lo, hi, startfileblock, endfileblock,
 				&substart, &subend)) {
 		result = sfs_discard_subtree(sv, &inodeptr->sfi_indirect, 1,
-					     substart - lo, subend - lo);
+					     substart - lo, subend - lo,
+					     &run);
 		if (result) {
-			return result;
+			goto done;
 		}
 	}
 
@@ -1038,9 +1426,10 @@ sfs_discard(struct sfs_vnode *sv,
 	if (sfs_intersect_range(lo, hi, startfileblock, endfileblock,
 				&substart, &subend)) {
 		result = sfs_discard_subtree(sv, &inodeptr->sfi_dindirect, 2,
-					     substart - lo, subend - lo);
+					     substart - lo, subend - lo,
+					     &run);
 		if (result) {
-			return result;
+			goto done;
 		}
 	}
 
@@ -1050,26 +1439,183 @@ sfs_discard(struct sfs_vnode *sv,
 	if (sfs_intersect_range(lo, hi, startfileblock, endfileblock,
 				&substart, &subend)) {
 		result = sfs_discard_subtree(sv, &inodeptr->sfi_tindirect, 3,
-					     substart - lo, subend - lo);
+					     substart - lo, subend - lo,
+					     &run);
+		if (result) {
+			goto done;
+		}
+	}
+
+ done:
+	sfs_freerun_flush(sfs, &run);
+	return result;
+}
+
+/*
+ * Discard blocks STARTFILEBLOCK through ENDFILEBLOCK - 1 of either
+ * kind of inode.
+ */
+static
+int
+sfs_discard_blocks(struct sfs_vnode *sv,
+		   uint32_t startfileblock, uint32_t endfileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	if (sfs_dinode_map(sv)->sfi_flags & SFS_IFLAG_EXTENTS) {
+		/* this does its own freemap locking */
+		return sfs_extent_discard(sv, startfileblock, endfileblock);
+	}
+
+	sfs_lock_freemap(sfs);
+	result = sfs_discard(sv, startfileblock, endfileblock);
+	sfs_unlock_freemap(sfs);
+	return result;
+}
+
+/*
+ * Find the end of what's mapped in a file: one past its last mapped
+ * block, or in a file with indirect blocks possibly further, if an
+ * indirect block on the way down to it turns out to be empty.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Requires up to 2 buffers, or 4 for an extent-mapped file.
+ */
+static
+int
+sfs_mapend(struct sfs_vnode *sv, uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	struct buf *buf;
+	uint32_t *ptrs;
+	daddr_t block;
+	uint32_t base, span;
+	unsigned levels, i;
+	int result;
+
+	inodeptr = sfs_dinode_map(sv);
+	if (inodeptr->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_extent_mapend(sv, ret);
+	}
+
+	/* Start from the furthest subtree with anything in it */
+	base = SFS_NDIRECT;
+	if (inodeptr->sfi_tindirect != 0) {
+		base += SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB;
+		span = SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB;
+		block = inodeptr->sfi_tindirect;
+		levels = 3;
+	}
+	else if (inodeptr->sfi_dindirect != 0) {
+		base += SFS_DBPERIDB;
+		span = SFS_DBPERIDB * SFS_DBPERIDB;
+		block = inodeptr->sfi_dindirect;
+		levels = 2;
+	}
+	else if (inodeptr->sfi_indirect != 0) {
+		span = SFS_DBPERIDB;
+		block = inodeptr->sfi_indirect;
+		levels = 1;
+	}
+	else {
+		for (i = SFS_NDIRECT; i > 0; i--) {
+			if (inodeptr->sfi_direct[i - 1] != 0) {
+				break;
+			}
+		}
+		*ret = i;
+		return 0;
+	}
+
+	/* Go down through the last nonzero pointer at each level */
+	for (; levels > 0; levels--) {
+		result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+				     &buf);
 		if (result) {
 			return result;
 		}
+		ptrs = buffer_map(buf);
+		for (i = SFS_DBPERIDB; i > 0; i--) {
+			if (ptrs[i - 1] != 0) {
+				break;
+			}
+		}
+		if (i == 0) {
+			/* empty; count all of it */
+			buffer_release(buf);
+			*ret = base + span;
+			return 0;
+		}
+		span /= SFS_DBPERIDB;
+		base += (i - 1) * span;
+		block = ptrs[i - 1];
+		buffer_release(buf);
 	}
+	*ret = base + span;
+	return 0;
+}
 
+/*
+ * Discard blocks START through END - 1 (END may be (uint32_t)-1 for
+ * everything mapped) in steps of SFS_DISCARDSTEP, from the end back,
+ * letting the transaction be split between steps (see
+ * sfs_trans_split), so freeing a large part of the volume needn't
+ * fit in the journal at once. Each step just shortens what's mapped
+ * (in an extent-mapped file only the first step of a hole punch
+ * splits an extent), so a crash partway through leaves a file whose
+ * end of the range is already a hole.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Requires up to 7 buffers.
+ */
+static
+int
+sfs_discard_steps(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t lo, hi;
+	int result;
+
+	result = sfs_mapend(sv, &hi);
+	if (result) {
+		return result;
+	}
+	if (hi > end) {
+		hi = end;
+	}
+	while (hi > start) {
+		lo = (hi - 1) / SFS_DISCARDSTEP * SFS_DISCARDSTEP;
+		if (lo < start) {
+			lo = start;
+		}
+		result = sfs_discard_blocks(sv, lo, hi);
+		if (result) {
+			return result;
+		}
+		hi = lo;
+		if (hi > start) {
+			sfs_trans_split(sfs, sv->sv_dinobuf);
+		}
+	}
 	return 0;
 }
 
 /*
- * Truncate a file (or directory).
+ * Truncate a file (or directory). Freeing many blocks may commit the
+ * caller's transaction partway through (see sfs_discard_steps).
  *
  * Locking: must hold vnode lock. Acquires/releases buffer locks.
+ *    May get/release sfs_freemaplock.
  *
- * Requires up to 4 buffers.
+ * Requires up to 7 buffers.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct sfs_dinode *inodeptr;
 	uint32_t oldblocklen, newblocklen;
 	int result;
@@ -1082,33 +1628,209 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/*
+	 * An inline file has no blocks to discard: just clear what's
+	 * past the new end, or move it out to a block if it won't fit.
+	 */
+	if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		if (newlen <= SFS_INLINESIZE) {
+			if (newlen < inodeptr->sfi_size) {
+				bzero(inodeptr->sfi_inline + newlen,
+				      inodeptr->sfi_size - newlen);
+			}
+			if (newlen == 0) {
+				inodeptr->sfi_flags &= ~SFS_IFLAG_INLINE;
+			}
+			inodeptr->sfi_size = newlen;
+			sfs_dinode_mark_dirty(sv);
+			sfs_dinode_unload(sv);
+			return 0;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
 	/* Length in blocks (divide rounding up) */
 	oldblocklen = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
 	newblocklen = DIVROUNDUP(newlen, SFS_BLOCKSIZE);
-
-	/* Lock the freemap for the whole truncate */
-	sfs_lock_freemap(sfs);
+	if (inodeptr->sfi_flags & SFS_IFLAG_PREALLOC) {
+		/* May have blocks preallocated past EOF */
+		oldblocklen = (uint32_t)-1;
+	}
 
 	if (newblocklen < oldblocklen) {
-		result = sfs_discard(sv, newblocklen, oldblocklen);
+		result = sfs_discard_steps(sv, newblocklen, oldblocklen);
 		if (result) {
-			sfs_unlock_freemap(sfs);
 			sfs_dinode_unload(sv);
 			return result;
 		}
 	}
 
+	/* An empty file has nothing compressed */
+	if (newblocklen == 0) {
+		inodeptr->sfi_flags &= ~SFS_IFLAG_COMPRESSED;
+	}
+
+	/* Blocks past the new end go, and with them what's unwritten */
+	if (inodeptr->sfi_flags & SFS_IFLAG_PREALLOC) {
+		if (newblocklen == 0) {
+			inodeptr->sfi_flags &= ~SFS_IFLAG_PREALLOC;
+			inodeptr->sfi_unwritten = 0;
+		}
+		else if (inodeptr->sfi_unwritten > newblocklen) {
+			inodeptr->sfi_unwritten = newblocklen;
+		}
+	}
+
 	/* Set the file size */
 	inodeptr->sfi_size = newlen;
 
 	/* Mark the inode dirty */
 	sfs_dinode_mark_dirty(sv);
 
-	/* release the freemap */
-	sfs_unlock_freemap(sfs);
-
 	/* release the inode buffer */
 	sfs_dinode_unload(sv);
 
 	return 0;
 }
+
+/*
+ * Zero bytes FROM through TO - 1 of file block FILEBLOCK, if it's
+ * allocated.
+ *
+ * Requires 1 buffer.
+ */
+static
+int
+sfs_zero_partial(struct sfs_vnode *sv, uint32_t fileblock,
+		 uint32_t from, uint32_t to)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t diskblock;
+	uint32_t holespan;
+	int result;
+
+	KASSERT(from < to && to <= SFS_BLOCKSIZE);
+
+	result = sfs_bmap_hole(sv, fileblock, &diskblock, &holespan);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		/* already a hole, or reads as one */
+		return 0;
+	}
+	result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	sfs_data_prepare(sfs, buf);
+	bzero((char *)buffer_map(buf) + from, to - from);
+	sfs_data_done(sfs, buf, diskblock, true, false);
+	return 0;
+}
+
+/*
+ * Punch a hole in a file: make bytes POS through POS + LEN - 1 read
+ * back as zeros, freeing the blocks that lie wholly inside the range.
+ * The file size doesn't change; any part of the range past EOF is
+ * ignored. As for sfs_itrunc, a large hole may be punched in more
+ * than one transaction.
+ *
+ * Locking: must hold vnode lock. Acquires/releases buffer locks.
+ *    May get/release sfs_freemaplock.
+ *
+ * Requires up to 7 buffers.
+ */
+int
+sfs_ipunch(struct sfs_vnode *sv, off_t pos, off_t len)
+{
+	struct sfs_dinode *inodeptr;
+	off_t end;
+	uint32_t firstblock, endblock, blocklen;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(pos >= 0 && len >= 0);
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+
+	if (pos >= inodeptr->sfi_size || len == 0) {
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+	/* (written this way so pos + len can't overflow) */
+	if (len < inodeptr->sfi_size - pos) {
+		end = pos + len;
+	}
+	else {
+		end = inodeptr->sfi_size;
+	}
+
+	if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		bzero(inodeptr->sfi_inline + pos, end - pos);
+		sfs_dinode_mark_dirty(sv);
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+
+	/*
+	 * The whole blocks to free. The block holding EOF counts as
+	 * whole if the range runs to EOF, since nothing past EOF in it
+	 * is visible.
+	 */
+	blocklen = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
+	firstblock = DIVROUNDUP(pos, SFS_BLOCKSIZE);
+	if (end == inodeptr->sfi_size) {
+		endblock = blocklen;
+	}
+	else {
+		endblock = end / SFS_BLOCKSIZE;
+	}
+
+	/* Zero the partial blocks at the edges */
+	if (pos % SFS_BLOCKSIZE != 0) {
+		uint32_t to;
+
+		if (end - (pos - pos % SFS_BLOCKSIZE) < SFS_BLOCKSIZE) {
+			to = end % SFS_BLOCKSIZE;
+		}
+		else {
+			to = SFS_BLOCKSIZE;
+		}
+		if (end == inodeptr->sfi_size) {
+			/* the rest of the EOF block needn't be kept */
+			to = SFS_BLOCKSIZE;
+		}
+		result = sfs_zero_partial(sv, pos / SFS_BLOCKSIZE,
+					  pos % SFS_BLOCKSIZE, to);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+	if (endblock < blocklen && endblock >= firstblock &&
+	    end % SFS_BLOCKSIZE != 0) {
+		result = sfs_zero_partial(sv, endblock,
+					  0, end % SFS_BLOCKSIZE);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
+	if (firstblock < endblock) {
+		result = sfs_discard_steps(sv, firstblock, endblock);
+	}
+
+	sfs_dinode_unload(sv);
+	return result;
+}
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Compressed files.
+ *
+ * A file read much more than it's written can be stored compressed
+ * (IOCTL_COMPRESS), in chunks of SFS_ZBLOCKS blocks each squeezed
+ * into as few blocks as it will go, so reading it moves less data
+ * off the disk and the buffer cache holds more of it. See kern/sfs.h
+ * for the format. A chunk is decompressed as a whole and, where
+ * there's a page cache, the result is offered to it, so reading the
+ * rest of the chunk (or mapping the file) finds it there.
+ *
+ * Compressed files aren't changed in place. To compress a file, or
+ * store it plainly again, it is copied a chunk at a time into a new
+ * inode that isn't linked anywhere, and then one transaction swaps
+ * the block maps of the two inodes; the new inode, now holding the
+ * old blocks, is then let go and erased as any removed file is. A
+ * crash partway leaves the copy as an inode nobody refers to, which
+ * sfsck recovers. Writing to a compressed file, or changing its size
+ * other than by dropping whole chunks, first stores it plainly this
+ * way (sfs_zexpand), so the fast paths for writes never see chunks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vm.h>
+#include <buf.h>
+#include <pagecache.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+#include "opt-dumbvm.h"
+
+#if !OPT_DUMBVM
+#include <coremap.h>
+#endif
+
+/* Bytes in a chunk */
+#define SFS_ZCHUNKSIZE	(SFS_ZBLOCKS * SFS_BLOCKSIZE)
+
+/* Size of sfs_zencode's table of where 3-byte strings were last seen */
+#define SFS_ZHASHBITS	10
+#define SFS_ZHASHSIZE	(1 << SFS_ZHASHBITS)
+#define SFS_ZHASH(p) \
+	((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2]) * \
+	  0x9e3779b1U) >> (32 - SFS_ZHASHBITS))
+
+/*
+ * Scratch space for sfs_zconvert; too big for the stack.
+ */
+struct sfs_zwork {
+	unsigned char zw_data[SFS_ZCHUNKSIZE];	/* a chunk as read */
+	unsigned char zw_out[SFS_ZCHUNKSIZE];	/* ...as written */
+	uint16_t zw_table[SFS_ZHASHSIZE];	/* for sfs_zencode */
+	struct sfs_dinode zw_dino;		/* for swapping inodes */
+};
+
+////////////////////////////////////////////////////////////
+// Compression
+
+/*
+ * Compress SRCLEN bytes at SRC into DST, which has room for DSTMAX.
+ * Returns the compressed length, or 0 if it doesn't fit. TABLE is
+ * scratch of SFS_ZHASHSIZE entries.
+ *
+ * Greedy: each position is matched against the last place the
+ * string of SFS_ZMINMATCH bytes there was seen, if any.
+ */
+static
+size_t
+sfs_zencode(const unsigned char *src, size_t srclen,
+	    unsigned char *dst, size_t dstmax, uint16_t *table)
+{
+	size_t i, o, flagpos, len, max;
+	unsigned bit, h, tok;
+	uint16_t cand;
+
+	KASSERT(srclen <= SFS_ZCHUNKSIZE);
+
+	bzero(table, SFS_ZHASHSIZE * sizeof(table[0]));
+	i = o = 0;
+	while (i < srclen) {
+		if (o >= dstmax) {
+			return 0;
+		}
+		flagpos = o++;
+		dst[flagpos] = 0;
+		for (bit = 0; bit < 8 && i < srclen; bit++) {
+			len = 0;
+			cand = 0;
+			if (srclen - i >= SFS_ZMINMATCH) {
+				/* table entries are positions plus 1 */
+				h = SFS_ZHASH(src + i);
+				cand = table[h];
+				table[h] = i + 1;
+			}
+			if (cand != 0) {
+				cand--;
+				max = srclen - i;
+				if (max > SFS_ZMAXMATCH) {
+					max = SFS_ZMAXMATCH;
+				}
+				while (len < max &&
+				       src[cand + len] == src[i + len]) {
+					len++;
+				}
+			}
+			if (len >= SFS_ZMINMATCH) {
+				if (dstmax - o < 2) {
+					return 0;
+				}
+				tok = (len - SFS_ZMINMATCH) << 12 |
+					(i - cand - 1);
+				dst[o++] = tok & 0xff;
+				dst[o++] = tok >> 8;
+				dst[flagpos] |= 1 << bit;
+				i += len;
+			}
+			else {
+				if (o >= dstmax) {
+					return 0;
+				}
+				dst[o++] = src[i++];
+			}
+		}
+	}
+	return o;
+}
+
+/*
+ * Expand SRCLEN bytes of compressed data at SRC into exactly DSTLEN
+ * bytes at DST. Fails with EIO if the data is malformed.
+ */
+static
+int
+sfs_zdecode(const unsigned char *src, size_t srclen,
+	    unsigned char *dst, size_t dstlen)
+{
+	size_t i, o, len, dist;
+	unsigned bit, flags, tok;
+
+	i = o = 0;
+	while (o < dstlen) {
+		if (i >= srclen) {
+			return EIO;
+		}
+		flags = src[i++];
+		for (bit = 0; bit < 8 && o < dstlen; bit++) {
+			if ((flags & (1 << bit)) == 0) {
+				if (i >= srclen) {
+					return EIO;
+				}
+				dst[o++] = src[i++];
+				continue;
+			}
+			if (srclen - i < 2) {
+				return EIO;
+			}
+			tok = src[i] | (unsigned)src[i + 1] << 8;
+			i += 2;
+			len = (tok >> 12) + SFS_ZMINMATCH;
+			dist = (tok & 0xfff) + 1;
+			if (dist > o || len > dstlen - o) {
+				return EIO;
+			}
+			/* byte by byte, as the copy may overlap itself */
+			while (len-- > 0) {
+				dst[o] = dst[o - dist];
+				o++;
+			}
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Reading
+
+/*
+ * Read chunk CHUNK of the compressed file SV into DATA, which holds
+ * SFS_ZCHUNKSIZE bytes; what's past EOF comes out as zeros. ZBUF, of
+ * the same size, is scratch.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_zchunk_read(struct sfs_vnode *sv, uint32_t chunk, unsigned char *data,
+		unsigned char *zbuf)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const struct sfs_zheader *zh;
+	struct buf *buf;
+	daddr_t diskblock;
+	uint32_t first, nblocks, n;
+	off_t start, size;
+	size_t datalen;
+	int result;
+
+	first = chunk * SFS_ZBLOCKS;
+	start = (off_t)first * SFS_BLOCKSIZE;
+	size = sfs_dinode_map(sv)->sfi_size;
+	KASSERT(start < size);
+	datalen = size - start < SFS_ZCHUNKSIZE ?
+		size - start : SFS_ZCHUNKSIZE;
+	nblocks = DIVROUNDUP(datalen, SFS_BLOCKSIZE);
+
+	/* Read the blocks until the first that isn't mapped */
+	for (n = 0; n < nblocks; n++) {
+		result = sfs_bmap(sv, first + n, false, &diskblock);
+		if (result) {
+			return result;
+		}
+		if (diskblock == 0) {
+			break;
+		}
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     SFS_BLOCKSIZE, &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(zbuf + n * SFS_BLOCKSIZE, buffer_map(buf),
+		       SFS_BLOCKSIZE);
+		buffer_release(buf);
+	}
+
+	if (n == 0) {
+		/* all zeros */
+		bzero(data, SFS_ZCHUNKSIZE);
+		return 0;
+	}
+	if (n == nblocks) {
+		/* stored as is */
+		memcpy(data, zbuf, datalen);
+		bzero(data + datalen, SFS_ZCHUNKSIZE - datalen);
+		return 0;
+	}
+
+	zh = (const struct sfs_zheader *)zbuf;
+	if (zh->zh_magic != SFS_ZMAGIC ||
+	    sizeof(*zh) + zh->zh_len > n * SFS_BLOCKSIZE) {
+		kprintf("sfs: %s: file %u: chunk %u: bad header\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, chunk);
+		return EIO;
+	}
+	result = sfs_zdecode(zbuf + sizeof(*zh), zh->zh_len, data, datalen);
+	if (result) {
+		kprintf("sfs: %s: file %u: chunk %u: bad compressed data\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, chunk);
+		return result;
+	}
+	bzero(data + datalen, SFS_ZCHUNKSIZE - datalen);
+	return 0;
+}
+
+/*
+ * Offer chunk CHUNK of SV, just read into DATA, to the page cache.
+ * Nothing comes of it if memory is short.
+ */
+static
+void
+sfs_zchunk_cache(struct sfs_vnode *sv, uint32_t chunk,
+		 const unsigned char *data)
+{
+#if OPT_DUMBVM
+	(void)sv;
+	(void)chunk;
+	(void)data;
+#else
+	paddr_t pa;
+
+	COMPILE_ASSERT(SFS_ZCHUNKSIZE == PAGE_SIZE);
+
+	pa = coremap_allocuser(NULL, 0, false);
+	if (pa == 0) {
+		return;
+	}
+	memcpy((void *)PADDR_TO_KVADDR(pa), data, PAGE_SIZE);
+	pa = pagecache_insert(&sv->sv_absvn,
+			      (off_t)chunk * SFS_ZCHUNKSIZE, pa);
+	coremap_freeuser(pa);
+#endif
+}
+
+/*
+ * Read from a compressed file, a chunk at a time, taking what's
+ * already decompressed from the page cache. UIO must not reach past
+ * EOF (sfs_io sees to this).
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_zread(struct sfs_vnode *sv, struct uio *uio)
+{
+	unsigned char *data, *zbuf;
+	uint32_t chunk;
+	size_t skip, len;
+	off_t size;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	data = kmalloc(2 * SFS_ZCHUNKSIZE);
+	if (data == NULL) {
+		return ENOMEM;
+	}
+	zbuf = data + SFS_ZCHUNKSIZE;
+	size = sfs_dinode_map(sv)->sfi_size;
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		result = pagecache_read(&sv->sv_absvn, uio, size);
+		if (result || uio->uio_resid == 0) {
+			break;
+		}
+
+		chunk = uio->uio_offset / SFS_ZCHUNKSIZE;
+		skip = uio->uio_offset % SFS_ZCHUNKSIZE;
+		len = SFS_ZCHUNKSIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		result = sfs_zchunk_read(sv, chunk, data, zbuf);
+		if (result) {
+			break;
+		}
+		sfs_zchunk_cache(sv, chunk, data);
+		result = uiomove(data + skip, len, uio);
+		if (result) {
+			break;
+		}
+	}
+
+	kfree(data);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Conversion
+
+/*
+ * Check if LEN bytes at P are all zero.
+ */
+static
+bool
+sfs_zallzero(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (p[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Do I/O to file SV the way sfs_read and sfs_write would, while
+ * holding a range lock on all of it: LEN bytes at POS, into or out
+ * of DATA.
+ *
+ * Locking: gets/releases the vnode lock.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_zconvert_io(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
+		enum uio_rw rw)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, data, len, pos, rw);
+	if (rw == UIO_WRITE) {
+		sfs_trans_begin(sfs);
+	}
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+	result = sfs_io(sv, &ku, false);
+	if (rw == UIO_WRITE) {
+		sfs_trans_touch(sfs, &sv->sv_commitlsn);
+		sfs_trans_end(sfs);
+	}
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+
+	if (result == 0 && ku.uio_resid != 0) {
+		/* the size doesn't change while we're at it */
+		result = EIO;
+	}
+	return result;
+}
+
+/*
+ * Copy the chunk at POS, LEN bytes long, of SV into the new inode
+ * TMP, compressed if COMPRESS and that saves a block. Chunks of
+ * zeros are left as holes. Sets *SHRANK if it was compressed.
+ *
+ * Locking: gets/releases the vnode locks, one at a time.
+ */
+static
+int
+sfs_zconvert_chunk(struct sfs_vnode *sv, struct sfs_vnode *tmp,
+		   struct sfs_zwork *zw, off_t pos, size_t len,
+		   bool compress, bool *shrank)
+{
+	struct sfs_zheader *zh;
+	uint32_t plain, packed;
+	size_t zlen;
+	int result;
+
+	*shrank = false;
+	result = sfs_zconvert_io(sv, pos, zw->zw_data, len, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (sfs_zallzero(zw->zw_data, len)) {
+		return 0;
+	}
+
+	plain = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	zh = (struct sfs_zheader *)zw->zw_out;
+	zlen = 0;
+	if (compress && plain > 1) {
+		/* It has to fit in one block less, header and all */
+		zlen = sfs_zencode(zw->zw_data, len, zw->zw_out + sizeof(*zh),
+				   (plain - 1) * SFS_BLOCKSIZE - sizeof(*zh),
+				   zw->zw_table);
+	}
+	if (zlen == 0) {
+		return sfs_zconvert_io(tmp, pos, zw->zw_data, len, UIO_WRITE);
+	}
+
+	zh->zh_magic = SFS_ZMAGIC;
+	zh->zh_len = zlen;
+	packed = DIVROUNDUP(sizeof(*zh) + zlen, SFS_BLOCKSIZE);
+	bzero(zw->zw_out + sizeof(*zh) + zlen,
+	      packed * SFS_BLOCKSIZE - sizeof(*zh) - zlen);
+	/* (whole blocks, so a small chunk 0 doesn't go inline) */
+	result = sfs_zconvert_io(tmp, pos, zw->zw_out,
+				 packed * SFS_BLOCKSIZE, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	*shrank = true;
+	return 0;
+}
+
+/*
+ * Give SV the blocks of TMP, and TMP those of SV, marking SV
+ * compressed or not per COMPRESS. Everything about how the data is
+ * stored goes across; the size, type, and link count stay.
+ *
+ * Locking: gets/releases both vnode locks.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_zconvert_swap(struct sfs_vnode *sv, struct sfs_vnode *tmp,
+		  struct sfs_zwork *zw, bool compress)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sd, *td, *save = &zw->zw_dino;
+	int result;
+
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(tmp->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		goto out;
+	}
+	result = sfs_dinode_load(tmp);
+	if (result) {
+		sfs_dinode_unload(sv);
+		goto out;
+	}
+	sd = sfs_dinode_map(sv);
+	td = sfs_dinode_map(tmp);
+
+	*save = *sd;
+	*sd = *td;
+	sd->sfi_size = save->sfi_size;
+	sd->sfi_type = save->sfi_type;
+	sd->sfi_linkcount = save->sfi_linkcount;
+	if (compress) {
+		sd->sfi_flags |= SFS_IFLAG_COMPRESSED;
+	}
+	else {
+		sd->sfi_flags &= ~SFS_IFLAG_COMPRESSED;
+	}
+
+	/* TMP gets the old blocks, and the size that covers them */
+	save->sfi_type = td->sfi_type;
+	save->sfi_linkcount = td->sfi_linkcount;
+	*td = *save;
+
+	sfs_dinode_mark_dirty(sv);
+	sfs_dinode_mark_dirty(tmp);
+	sfs_dinode_unload(tmp);
+	sfs_dinode_unload(sv);
+
+ out:
+	sfs_trans_end(sfs);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(tmp->sv_lock);
+	lock_release(sv->sv_lock);
+	return result;
+}
+
+/*
+ * Store the regular file SV compressed, if COMPRESS, or plainly. A
+ * file that fits in the inode or in one block isn't compressed, as
+ * that can't save anything; nor is one none of whose chunks gets any
+ * smaller.
+ *
+ * Locking: the caller must hold a range lock on the whole file, and
+ * no vnode lock or transaction. Gets/releases the vnode lock.
+ */
+int
+sfs_zconvert(struct sfs_vnode *sv, bool compress)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *tmp;
+	struct sfs_zwork *zw;
+	uint32_t flags;
+	off_t pos, size;
+	size_t len;
+	bool shrank, any;
+	int result;
+
+	KASSERT(sv->sv_type == SFS_TYPE_FILE);
+
+	flags = 0;
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+	result = sfs_dinode_load(sv);
+	if (result == 0) {
+		flags = sfs_dinode_map(sv)->sfi_flags;
+		sfs_dinode_unload(sv);
+	}
+	unreserve_buffers(SFS_BLOCKSIZE);
+	size = sv->sv_size;
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_compressed == compress) {
+		return 0;
+	}
+	if (compress &&
+	    ((flags & SFS_IFLAG_INLINE) || size <= SFS_BLOCKSIZE)) {
+		return 0;
+	}
+
+	zw = kmalloc(sizeof(*zw));
+	if (zw == NULL) {
+		return ENOMEM;
+	}
+
+	/* Make the inode to copy into */
+	sfs_trans_begin(sfs);
+	reserve_buffers(SFS_BLOCKSIZE);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &tmp);
+	if (result == 0) {
+		sfs_dinode_unload(tmp);
+		lock_release(tmp->sv_lock);
+	}
+	sfs_trans_end(sfs);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	if (result) {
+		kfree(zw);
+		return result;
+	}
+
+	any = false;
+	for (pos = 0; pos < size; pos += SFS_ZCHUNKSIZE) {
+		len = size - pos < SFS_ZCHUNKSIZE ?
+			size - pos : SFS_ZCHUNKSIZE;
+		result = sfs_zconvert_chunk(sv, tmp, zw, pos, len, compress,
+					    &shrank);
+		if (result) {
+			break;
+		}
+		any = any || shrank;
+	}
+
+	if (result == 0 && (any || !compress)) {
+		result = sfs_zconvert_swap(sv, tmp, zw, compress);
+	}
+
+	kfree(zw);
+	/* Erases TMP, taking with it whichever blocks it has */
+	VOP_DECREF(&tmp->sv_absvn);
+	return result;
+}
+
+/*
+ * Store SV plainly, if it's compressed, before changing it.
+ *
+ * Locking: as for sfs_zconvert.
+ */
+int
+sfs_zexpand(struct sfs_vnode *sv)
+{
+	if (!sv->sv_compressed) {
+		return 0;
+	}
+	return sfs_zconvert(sv, false);
+}
@@ -36,10 +36,361 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <synch.h>
+#include <vfs.h>
 #include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Name index for large directories.
+ *
+ * Directories are unsorted arrays of entries, so finding a name
+ * means reading every slot. Once a directory has SFS_DIRINDEX_MIN
+ * slots, the first lookup builds an index of it in memory instead:
+ * a hash table (open addressing, linear probing) from a hash of each
+ * name to the slot holding it, and a list of the empty slots.
+ * Lookups then read only the slots whose hash matches, and creates
+ * take an empty slot from the list.
+ *
+ * The index belongs to the vnode and is protected by its lock. It
+ * isn't stored on disk: the directory itself stays authoritative, and
+ * sfs_writedir updates the index to match each entry it writes, so
+ * the index can't disagree with the directory. If anything goes
+ * wrong (an allocation or I/O failure while updating) it's thrown
+ * away, and built again on a later lookup.
+ */
+
+#define SFS_DIRINDEX_MIN	128	/* slots; smaller dirs are scanned */
+#define SFS_DIRINDEX_INITSIZE	256	/* initial buckets (power of 2) */
+
+#define DIRHASH_EMPTY		(-1)	/* bucket never used */
+#define DIRHASH_DELETED		(-2)	/* bucket was used, now free */
+
+struct sfs_dirhashent {
+	uint32_t dh_hash;		/* sfs_dirhash of the name */
+	int dh_slot;			/* slot, or DIRHASH_* */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirhashent *di_table;
+	unsigned di_size;		/* number of buckets */
+	unsigned di_used;		/* buckets with a slot */
+	unsigned di_filled;		/* ...or DIRHASH_DELETED */
+	int *di_free;			/* empty directory slots */
+	unsigned di_nfree;
+	unsigned di_maxfree;
+};
+
+/*
+ * Hash a name (FNV-1a).
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Throw away a directory's index, if it has one.
+ */
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+
+	if (di == NULL) {
+		return;
+	}
+	sv->sv_dirindex = NULL;
+	kfree(di->di_table);
+	kfree(di->di_free);
+	kfree(di);
+}
+
+/*
+ * Set up the hash table with SIZE buckets, all empty.
+ */
+static
+int
+sfs_dirindex_inittable(struct sfs_dirindex *di, unsigned size)
+{
+	unsigned i;
+
+	di->di_table = kmalloc(size * sizeof(di->di_table[0]));
+	if (di->di_table == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<size; i++) {
+		di->di_table[i].dh_slot = DIRHASH_EMPTY;
+	}
+	di->di_size = size;
+	di->di_used = 0;
+	di->di_filled = 0;
+	return 0;
+}
+
+/*
+ * Put an entry in a bucket, without checking the load.
+ */
+static
+void
+sfs_dirindex_place(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	unsigned mask = di->di_size - 1;
+	unsigned i;
+
+	for (i = hash & mask; di->di_table[i].dh_slot >= 0; i = (i+1) & mask) {
+		/* keep probing */
+	}
+	if (di->di_table[i].dh_slot == DIRHASH_EMPTY) {
+		di->di_filled++;
+	}
+	di->di_table[i].dh_hash = hash;
+	di->di_table[i].dh_slot = slot;
+	di->di_used++;
+}
+
+/*
+ * Add an entry, growing (or just cleaning out) the table first if it's
+ * more than 3/4 full.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirhashent *old;
+	unsigned oldsize, newsize, i;
+	int result;
+
+	if ((di->di_filled + 1) * 4 > di->di_size * 3) {
+		old = di->di_table;
+		oldsize = di->di_size;
+		newsize = (di->di_used + 1) * 2 > oldsize ?
+			oldsize * 2 : oldsize;
+		result = sfs_dirindex_inittable(di, newsize);
+		if (result) {
+			di->di_table = old;
+			di->di_size = oldsize;
+			return result;
+		}
+		for (i=0; i<oldsize; i++) {
+			if (old[i].dh_slot >= 0) {
+				sfs_dirindex_place(di, old[i].dh_hash,
+						   old[i].dh_slot);
+			}
+		}
+		kfree(old);
+	}
+	sfs_dirindex_place(di, hash, slot);
+	return 0;
+}
+
+/*
+ * Remove the entry for SLOT, whose name hashes to HASH.
+ */
+static
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	unsigned mask = di->di_size - 1;
+	unsigned i;
+
+	for (i = hash & mask; di->di_table[i].dh_slot != DIRHASH_EMPTY;
+	     i = (i+1) & mask) {
+		if (di->di_table[i].dh_slot == slot) {
+			KASSERT(di->di_table[i].dh_hash == hash);
+			di->di_table[i].dh_slot = DIRHASH_DELETED;
+			di->di_used--;
+			return;
+		}
+	}
+	panic("sfs: directory index lost slot %d\n", slot);
+}
+
+/*
+ * Record that SLOT is empty.
+ */
+static
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	unsigned newmax;
+	int *newfree;
+
+	if (di->di_nfree == di->di_maxfree) {
+		newmax = di->di_maxfree == 0 ? 16 : di->di_maxfree * 2;
+		newfree = kmalloc(newmax * sizeof(newfree[0]));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		if (di->di_nfree > 0) {
+			memcpy(newfree, di->di_free,
+			       di->di_nfree * sizeof(newfree[0]));
+		}
+		kfree(di->di_free);
+		di->di_free = newfree;
+		di->di_maxfree = newmax;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Take SLOT off the empty list, if it's there. It's usually the last
+ * one, as that's the one sfs_dir_findname hands out.
+ */
+static
+void
+sfs_dirindex_takefree(struct sfs_dirindex *di, int slot)
+{
+	unsigned i;
+
+	for (i=di->di_nfree; i-- > 0; ) {
+		if (di->di_free[i] == slot) {
+			di->di_free[i] = di->di_free[--di->di_nfree];
+			return;
+		}
+	}
+}
+
+/*
+ * Build the index for a directory with NENTRIES slots.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv, int nentries)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry tsd;
+	unsigned size;
+	int i, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	for (size = SFS_DIRINDEX_INITSIZE; size < (unsigned)nentries * 2;
+	     size *= 2) {
+		/* nothing */
+	}
+	result = sfs_dirindex_inittable(di, size);
+	if (result) {
+		kfree(di);
+		return result;
+	}
+	di->di_free = NULL;
+	di->di_nfree = 0;
+	di->di_maxfree = 0;
+	sv->sv_dirindex = di;
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			result = sfs_dirindex_addfree(di, i);
+		}
+		else {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			result = sfs_dirindex_insert(di,
+						     sfs_dirhash(tsd.sfd_name),
+						     i);
+		}
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Update the index for writing SD into SLOT, which used to hold OLDSD
+ * (NULL if SLOT is past the end of the directory).
+ */
+static
+int
+sfs_dirindex_update(struct sfs_dirindex *di, int slot,
+		    struct sfs_direntry *oldsd, struct sfs_direntry *sd)
+{
+	char name[SFS_NAMELEN];
+
+	if (oldsd != NULL && oldsd->sfd_ino != SFS_NOINO) {
+		oldsd->sfd_name[sizeof(oldsd->sfd_name)-1] = 0;
+		sfs_dirindex_remove(di, sfs_dirhash(oldsd->sfd_name), slot);
+	}
+	else if (oldsd != NULL) {
+		sfs_dirindex_takefree(di, slot);
+	}
+
+	if (sd->sfd_ino == SFS_NOINO) {
+		return sfs_dirindex_addfree(di, slot);
+	}
+	memcpy(name, sd->sfd_name, sizeof(name));
+	name[sizeof(name)-1] = 0;
+	return sfs_dirindex_insert(di, sfs_dirhash(name), slot);
+}
+
+/*
+ * Look up NAME using the index. Same interface as sfs_dir_findname.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dirindex_lookup(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_direntry tsd;
+	unsigned mask, i;
+	uint32_t hash;
+	int result;
+
+	if (emptyslot != NULL && di->di_nfree > 0) {
+		*emptyslot = di->di_free[di->di_nfree - 1];
+	}
+
+	hash = sfs_dirhash(name);
+	mask = di->di_size - 1;
+	for (i = hash & mask; di->di_table[i].dh_slot != DIRHASH_EMPTY;
+	     i = (i+1) & mask) {
+		if (di->di_table[i].dh_slot < 0 ||
+		    di->di_table[i].dh_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, di->di_table[i].dh_slot, &tsd);
+		if (result) {
+			return result;
+		}
+		KASSERT(tsd.sfd_ino != SFS_NOINO);
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = di->di_table[i].dh_slot;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -61,20 +412,48 @@ sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
 
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * vnode, keeping the directory's index (if any) up to date.
  *
  * Requires up to 3 buffers.
  */
 int
 sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
 {
+	struct sfs_direntry oldsd;
+	bool hadold = false;
 	off_t actualpos;
+	int nentries, result;
 
 	/* Compute the actual position in the directory. */
 	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_direntry);
 
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
+	/* The index needs to know what we're replacing. */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_dir_nentries(sv, &nentries);
+		if (result == 0 && slot < nentries) {
+			result = sfs_readdir(sv, slot, &oldsd);
+			hadold = true;
+		}
+		if (result) {
+			sfs_dirindex_destroy(sv);
+		}
+	}
+
+	result = sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
+	if (result) {
+		/* we don't know exactly what happened */
+		sfs_dirindex_destroy(sv);
+		return result;
+	}
+
+	if (sv->sv_dirindex != NULL) {
+		if (sfs_dirindex_update(sv->sv_dirindex, slot,
+					hadold ? &oldsd : NULL, sd)) {
+			sfs_dirindex_destroy(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -120,6 +499,10 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
  *
+ * Large directories are searched through their index, building it
+ * first if need be; if that can't be done, they're scanned like
+ * small ones.
+ *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
  * Requires up to 3 buffers.
@@ -133,11 +516,20 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dirindex_lookup(sv, name, ino, slot, emptyslot);
+	}
+
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
 		return result;
 	}
 
+	if (nentries >= SFS_DIRINDEX_MIN &&
+	    sfs_dirindex_build(sv, nentries) == 0) {
+		return sfs_dirindex_lookup(sv, name, ino, slot, emptyslot);
+	}
+
 	/* For each slot... */
 	found = 0;
 	for (i=0; i<nentries; i++) {
@@ -305,7 +697,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
  * Returns the vnode with its inode unloaded.
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table bucket lock.
  *    Returns the result vnode locked.
  *
  * Requires up to 3 buffers.
@@ -350,10 +742,11 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The answer, either way, is entered in the
+ * VFS name cache.
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table bucket lock.
  *
  * Requires up to 3 buffers.
  */
@@ -371,6 +764,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	result = sfs_dir_findname(sv, name, &ino, slot, &emptyslot);
 	if (result == ENOENT) {
 		*ret = NULL;
+		vfs_ncache_enter(&sv->sv_absvn, name, NULL);
 		if (slot != NULL) {
 			if (emptyslot < 0) {
 				result2 = sfs_dir_nentries(sv, &emptyslot);
@@ -390,6 +784,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	if (result) {
 		return result;
 	}
+	vfs_ncache_enter(&sv->sv_absvn, name, &(*ret)->sv_absvn);
 
 	return 0;
 }
@@ -0,0 +1,959 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Extent-based block mapping, for inodes with SFS_IFLAG_EXTENTS.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * The on-disk format is described in kern/sfs.h. To find a file
+ * block we walk from the root down to the leaf whose range covers
+ * it, recording the node and the entry used at each level in a PATH,
+ * so that inserting or removing entries can work back up the tree.
+ * The nodes below the root are buffers, held as long as the path is.
+ *
+ * Keys in interior nodes are lower bounds: every entry in a child's
+ * subtree is at or after the child's key (and before the next
+ * child's). The first entry of an interior node always carries the
+ * bound of the node itself, which is 0 down the left edge of the
+ * tree, so a lookup can't fall off the front of a node, and adding
+ * a block in front of a leaf's first extent or trimming extents never
+ * requires fixing keys further up.
+ *
+ * Splitting nodes needs new blocks. These are allocated, and their
+ * buffers gotten, up front before anything is changed, so an insert
+ * either happens completely or fails without touching the tree.
+ */
+
+/*
+ * A node in a path: the root in the inode, or a tree block.
+ */
+struct sfs_extnode {
+	struct sfs_extent_header *en_hdr;
+	struct sfs_extent *en_ext;
+	struct buf *en_buf;		/* buffer; NULL for the root */
+	daddr_t en_block;		/* block number; 0 for the root */
+};
+
+/*
+ * A path from the root (level 0) to a leaf (level ep_depth). EP_POS
+ * at each level is the entry with the last key at or before the file
+ * block looked up; in a leaf this is -1 if there isn't one.
+ */
+struct sfs_extpath {
+	unsigned ep_depth;
+	struct sfs_extnode ep_node[SFS_EXTENT_MAXDEPTH + 1];
+	int ep_pos[SFS_EXTENT_MAXDEPTH + 1];
+};
+
+/*
+ * Blocks allocated ahead for the splits an insert is going to do,
+ * and their buffers, held so setting up the new nodes can't fail.
+ */
+struct sfs_extspare {
+	daddr_t es_blocks[SFS_EXTENT_MAXDEPTH + 1];
+	struct buf *es_bufs[SFS_EXTENT_MAXDEPTH + 1];
+	unsigned es_num;
+};
+
+////////////////////////////////////////////////////////////
+// nodes
+
+/*
+ * Set up an empty tree in a new inode.
+ */
+void
+sfs_extent_initroot(struct sfs_dinode *dino)
+{
+	bzero(&dino->sfi_extents, sizeof(dino->sfi_extents));
+	dino->sfi_extents.er_hdr.eh_magic = SFS_EXTENT_MAGIC;
+	dino->sfi_extents.er_hdr.eh_max = SFS_EXTENTS_INODE;
+	dino->sfi_extents.er_hdr.eh_depth = 0;
+	dino->sfi_flags |= SFS_IFLAG_EXTENTS;
+}
+
+/*
+ * Make sure a node's header is sane. DEPTH is the depth it should
+ * have.
+ */
+static
+int
+sfs_extnode_check(struct sfs_vnode *sv, struct sfs_extnode *en,
+		  unsigned depth)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_header *eh = en->en_hdr;
+	unsigned max;
+
+	max = en->en_block == 0 ? SFS_EXTENTS_INODE : SFS_EXTENTS_BLOCK;
+	if (eh->eh_magic != SFS_EXTENT_MAGIC || eh->eh_max != max ||
+	    eh->eh_count > max || eh->eh_depth != depth ||
+	    depth > SFS_EXTENT_MAXDEPTH ||
+	    (depth > 0 && eh->eh_count == 0)) {
+		kprintf("sfs: %s: inode %u: invalid extent tree node %u\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, en->en_block);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the tree block BLOCK, which should be at depth DEPTH, into EN.
+ */
+static
+int
+sfs_extnode_read(struct sfs_vnode *sv, daddr_t block, unsigned depth,
+		 struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_block *eb;
+	int result;
+
+	if (block == 0 || block >= sfs->sfs_sb.sb_nblocks) {
+		kprintf("sfs: %s: inode %u: extent tree block %u "
+			"out of range\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, block);
+		return EIO;
+	}
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE,
+			     &en->en_buf);
+	if (result) {
+		return result;
+	}
+	sfs_jlog_prepare(sfs, en->en_buf);
+	eb = buffer_map(en->en_buf);
+	en->en_hdr = &eb->eb_hdr;
+	en->en_ext = eb->eb_ext;
+	en->en_block = block;
+
+	result = sfs_extnode_check(sv, en, depth);
+	if (result) {
+		sfs_jlog_forget(sfs, en->en_buf);
+		buffer_release(en->en_buf);
+		en->en_buf = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Set up EN as a fresh node at depth DEPTH in the next of the spare
+ * blocks in SPARE, taking over its buffer. The caller marks it dirty
+ * once it's been filled in, so the journal gets the whole new node
+ * at once.
+ */
+static
+void
+sfs_extnode_new(struct sfs_extspare *spare, unsigned depth,
+		struct sfs_extnode *en)
+{
+	struct sfs_extent_block *eb;
+
+	KASSERT(spare->es_num > 0);
+	spare->es_num--;
+	en->en_buf = spare->es_bufs[spare->es_num];
+	en->en_block = spare->es_blocks[spare->es_num];
+
+	eb = buffer_map(en->en_buf);
+	eb->eb_hdr.eh_magic = SFS_EXTENT_MAGIC;
+	eb->eb_hdr.eh_count = 0;
+	eb->eb_hdr.eh_max = SFS_EXTENTS_BLOCK;
+	eb->eb_hdr.eh_depth = depth;
+	en->en_hdr = &eb->eb_hdr;
+	en->en_ext = eb->eb_ext;
+}
+
+static
+void
+sfs_extnode_dirty(struct sfs_vnode *sv, struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (en->en_block == 0) {
+		sfs_dinode_mark_dirty(sv);
+	}
+	else {
+		sfs_jlog_dirty(sfs, en->en_buf, en->en_block);
+	}
+}
+
+/*
+ * Put EX into node EN at position POS, moving later entries up. The
+ * node must have room.
+ */
+static
+void
+sfs_extnode_put(struct sfs_extnode *en, unsigned pos,
+		const struct sfs_extent *ex)
+{
+	unsigned count = en->en_hdr->eh_count;
+
+	KASSERT(count < en->en_hdr->eh_max);
+	KASSERT(pos <= count);
+	memmove(&en->en_ext[pos + 1], &en->en_ext[pos],
+		(count - pos) * sizeof(en->en_ext[0]));
+	en->en_ext[pos] = *ex;
+	en->en_hdr->eh_count++;
+}
+
+/*
+ * Take the entry at position POS out of node EN.
+ */
+static
+void
+sfs_extnode_remove(struct sfs_extnode *en, unsigned pos)
+{
+	unsigned count = en->en_hdr->eh_count;
+
+	KASSERT(pos < count);
+	memmove(&en->en_ext[pos], &en->en_ext[pos + 1],
+		(count - pos - 1) * sizeof(en->en_ext[0]));
+	bzero(&en->en_ext[count - 1], sizeof(en->en_ext[0]));
+	en->en_hdr->eh_count--;
+}
+
+/*
+ * Return the index of the last of the COUNT entries in EXT whose key
+ * is at or before FILEBLOCK, or -1 if there isn't one.
+ */
+static
+int
+sfs_extnode_search(const struct sfs_extent *ext, unsigned count,
+		   uint32_t fileblock)
+{
+	unsigned lo, hi, mid;
+
+	/* entries before LO are at or before FILEBLOCK; from HI on, after */
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ext[mid].ex_fileblock <= fileblock) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return (int)lo - 1;
+}
+
+/*
+ * Free COUNT blocks starting at START.
+ */
+static
+void
+sfs_ext_free(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	sfs_lock_freemap(sfs);
+	sfs_bfree_range_prelocked(sfs, start, count);
+	sfs_unlock_freemap(sfs);
+}
+
+////////////////////////////////////////////////////////////
+// paths
+
+static
+void
+sfs_extpath_release(struct sfs_vnode *sv, struct sfs_extpath *path)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i;
+
+	for (i=1; i<=path->ep_depth; i++) {
+		if (path->ep_node[i].en_buf != NULL) {
+			sfs_jlog_forget(sfs, path->ep_node[i].en_buf);
+			buffer_release(path->ep_node[i].en_buf);
+			path->ep_node[i].en_buf = NULL;
+		}
+	}
+}
+
+/*
+ * Find the path to FILEBLOCK. The inode must be loaded.
+ */
+static
+int
+sfs_extpath_find(struct sfs_vnode *sv, uint32_t fileblock,
+		 struct sfs_extpath *path)
+{
+	struct sfs_dinode *dino;
+	struct sfs_extnode *en;
+	unsigned level;
+	int pos, result;
+
+	dino = sfs_dinode_map(sv);
+	en = &path->ep_node[0];
+	en->en_hdr = &dino->sfi_extents.er_hdr;
+	en->en_ext = dino->sfi_extents.er_ext;
+	en->en_buf = NULL;
+	en->en_block = 0;
+	path->ep_depth = 0;
+
+	result = sfs_extnode_check(sv, en, en->en_hdr->eh_depth);
+	if (result) {
+		return result;
+	}
+	path->ep_depth = en->en_hdr->eh_depth;
+
+	for (level = 0; level < path->ep_depth; level++) {
+		en = &path->ep_node[level];
+		pos = sfs_extnode_search(en->en_ext, en->en_hdr->eh_count,
+					 fileblock);
+		/* (can only happen if the tree is damaged) */
+		if (pos < 0) {
+			pos = 0;
+		}
+		path->ep_pos[level] = pos;
+
+		result = sfs_extnode_read(sv, en->en_ext[pos].ex_diskblock,
+					  path->ep_depth - level - 1,
+					  &path->ep_node[level + 1]);
+		if (result) {
+			/* release just the levels we got */
+			path->ep_depth = level;
+			sfs_extpath_release(sv, path);
+			return result;
+		}
+	}
+
+	en = &path->ep_node[path->ep_depth];
+	path->ep_pos[path->ep_depth] =
+		sfs_extnode_search(en->en_ext, en->en_hdr->eh_count,
+				   fileblock);
+	return 0;
+}
+
+/*
+ * Return the disk block FILEBLOCK maps to, given the path to it, or
+ * 0 if it's in a hole.
+ */
+static
+daddr_t
+sfs_extpath_map(struct sfs_extpath *path, uint32_t fileblock)
+{
+	struct sfs_extnode *leaf;
+	struct sfs_extent *ex;
+	int pos;
+
+	leaf = &path->ep_node[path->ep_depth];
+	pos = path->ep_pos[path->ep_depth];
+	if (pos < 0) {
+		return 0;
+	}
+	ex = &leaf->en_ext[pos];
+	KASSERT(fileblock >= ex->ex_fileblock);
+	if (fileblock - ex->ex_fileblock >= ex->ex_len) {
+		return 0;
+	}
+	return ex->ex_diskblock + (fileblock - ex->ex_fileblock);
+}
+
+/*
+ * Get the first file block the leaf after the one in PATH can
+ * cover. Returns false, with 0 there, if this is the last leaf.
+ */
+static
+bool
+sfs_extpath_nextleaf(struct sfs_extpath *path, uint32_t *ret)
+{
+	struct sfs_extnode *en;
+	unsigned level;
+
+	for (level = path->ep_depth; level-- > 0; ) {
+		en = &path->ep_node[level];
+		if (path->ep_pos[level] + 1 < en->en_hdr->eh_count) {
+			*ret = en->en_ext[path->ep_pos[level] + 1].ex_fileblock;
+			return true;
+		}
+	}
+	*ret = 0;
+	return false;
+}
+
+////////////////////////////////////////////////////////////
+// insert
+
+/*
+ * Give back the spare blocks in SPARE that weren't used.
+ */
+static
+void
+sfs_ext_putspares(struct sfs_vnode *sv, struct sfs_extspare *spare)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	while (spare->es_num > 0) {
+		spare->es_num--;
+		sfs_jlog_forget(sfs, spare->es_bufs[spare->es_num]);
+		buffer_release(spare->es_bufs[spare->es_num]);
+		buffer_drop(&sfs->sfs_absfs, spare->es_blocks[spare->es_num],
+			    SFS_BLOCKSIZE);
+		sfs_bfree(sfs, spare->es_blocks[spare->es_num]);
+	}
+}
+
+/*
+ * Allocate the blocks needed to insert an entry in the node at level
+ * LEVEL of PATH: one for each full node, going up, that will have to
+ * be split, and one more if the root has to grow. Their buffers stay
+ * held until they're used or given back.
+ */
+static
+int
+sfs_ext_getspares(struct sfs_vnode *sv, struct sfs_extpath *path,
+		  unsigned level, struct sfs_extspare *spare)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode *en;
+	daddr_t goal;
+	unsigned need, i;
+	int result;
+
+	goal = path->ep_node[level].en_block;
+	if (goal == 0) {
+		goal = sv->sv_ino;
+	}
+	goal++;
+
+	need = 0;
+	while (1) {
+		en = &path->ep_node[level];
+		if (en->en_hdr->eh_count < en->en_hdr->eh_max) {
+			break;
+		}
+		if (level == 0 && path->ep_depth == SFS_EXTENT_MAXDEPTH) {
+			/* the tree can't grow any more */
+			return EFBIG;
+		}
+		need++;
+		if (level == 0) {
+			break;
+		}
+		level--;
+	}
+
+	spare->es_num = 0;
+	for (i=0; i<need; i++) {
+		result = sfs_balloc(sfs, goal, &spare->es_blocks[i], NULL);
+		if (result) {
+			sfs_ext_putspares(sv, spare);
+			return result;
+		}
+		/* sfs_balloc cleared it, so this is normally a cache hit */
+		result = buffer_read(&sfs->sfs_absfs, spare->es_blocks[i],
+				     SFS_BLOCKSIZE, &spare->es_bufs[i]);
+		if (result) {
+			buffer_drop(&sfs->sfs_absfs, spare->es_blocks[i],
+				    SFS_BLOCKSIZE);
+			sfs_bfree(sfs, spare->es_blocks[i]);
+			sfs_ext_putspares(sv, spare);
+			return result;
+		}
+		sfs_jlog_prepare(sfs, spare->es_bufs[i]);
+		spare->es_num++;
+	}
+	return 0;
+}
+
+/*
+ * The root is full: move its entries out to a new block, and make
+ * the root an interior node with that block as its only child. The
+ * tree gets one level deeper, and PATH is shifted down to match.
+ */
+static
+void
+sfs_ext_grow(struct sfs_vnode *sv, struct sfs_extpath *path,
+	     struct sfs_extspare *spare)
+{
+	struct sfs_extnode *root = &path->ep_node[0];
+	struct sfs_extnode child;
+	unsigned count, i;
+
+	KASSERT(path->ep_depth < SFS_EXTENT_MAXDEPTH);
+
+	sfs_extnode_new(spare, root->en_hdr->eh_depth, &child);
+	count = root->en_hdr->eh_count;
+	memcpy(child.en_ext, root->en_ext, count * sizeof(root->en_ext[0]));
+	child.en_hdr->eh_count = count;
+	sfs_extnode_dirty(sv, &child);
+
+	/* the root covers the whole file */
+	root->en_ext[0].ex_fileblock = 0;
+	root->en_ext[0].ex_diskblock = child.en_block;
+	root->en_ext[0].ex_len = 0;
+	bzero(&root->en_ext[1], (count - 1) * sizeof(root->en_ext[0]));
+	root->en_hdr->eh_count = 1;
+	root->en_hdr->eh_depth++;
+	sfs_dinode_mark_dirty(sv);
+
+	for (i = path->ep_depth + 1; i > 1; i--) {
+		path->ep_node[i] = path->ep_node[i - 1];
+		path->ep_pos[i] = path->ep_pos[i - 1];
+	}
+	path->ep_node[1] = child;
+	path->ep_pos[1] = path->ep_pos[0];
+	path->ep_pos[0] = 0;
+	path->ep_depth++;
+}
+
+/*
+ * The node at level LEVEL of PATH (not the root) is full: move the
+ * upper half of its entries to a new block, then put EX at POS in
+ * whichever half that falls in. On return EX is the entry for the
+ * new block, which belongs in the parent after the node's own one.
+ */
+static
+void
+sfs_ext_split(struct sfs_vnode *sv, struct sfs_extpath *path,
+	      unsigned level, unsigned pos, struct sfs_extent *ex,
+	      struct sfs_extspare *spare)
+{
+	struct sfs_extnode *left = &path->ep_node[level];
+	struct sfs_extnode right;
+	unsigned count, mid;
+
+	KASSERT(level > 0);
+
+	sfs_extnode_new(spare, left->en_hdr->eh_depth, &right);
+	count = left->en_hdr->eh_count;
+	mid = count / 2;
+	memcpy(right.en_ext, &left->en_ext[mid],
+	       (count - mid) * sizeof(left->en_ext[0]));
+	right.en_hdr->eh_count = count - mid;
+	bzero(&left->en_ext[mid], (count - mid) * sizeof(left->en_ext[0]));
+	left->en_hdr->eh_count = mid;
+
+	if (pos <= mid) {
+		sfs_extnode_put(left, pos, ex);
+	}
+	else {
+		sfs_extnode_put(&right, pos - mid, ex);
+	}
+	sfs_extnode_dirty(sv, left);
+	sfs_extnode_dirty(sv, &right);
+
+	ex->ex_fileblock = right.en_ext[0].ex_fileblock;
+	ex->ex_diskblock = right.en_block;
+	ex->ex_len = 0;
+	buffer_release(right.en_buf);
+}
+
+/*
+ * Insert NEWEX at position POS of the node at level LEVEL of PATH,
+ * splitting nodes and growing the tree as needed. On failure the
+ * tree hasn't been changed. Either way, only the levels of PATH above
+ * LEVEL remain meaningful afterwards.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, struct sfs_extpath *path,
+	       unsigned level, unsigned pos, const struct sfs_extent *newex)
+{
+	struct sfs_extspare spare;
+	struct sfs_extnode *en;
+	struct sfs_extent ex;
+	int result;
+
+	result = sfs_ext_getspares(sv, path, level, &spare);
+	if (result) {
+		return result;
+	}
+
+	ex = *newex;
+	while (1) {
+		en = &path->ep_node[level];
+		if (en->en_hdr->eh_count < en->en_hdr->eh_max) {
+			sfs_extnode_put(en, pos, &ex);
+			sfs_extnode_dirty(sv, en);
+			break;
+		}
+		if (level == 0) {
+			sfs_ext_grow(sv, path, &spare);
+			/* the old root's entries are now one level down */
+			level = 1;
+			continue;
+		}
+		sfs_ext_split(sv, path, level, pos, &ex, &spare);
+		level--;
+		pos = path->ep_pos[level] + 1;
+	}
+
+	/* sfs_ext_getspares got exactly as many as were needed */
+	KASSERT(spare.es_num == 0);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// bmap
+
+/*
+ * Look up the disk block for FILEBLOCK in an extent-mapped file, as
+ * for sfs_bmap: if DOALLOC is set and there isn't one, allocate one
+ * (from RUN if that isn't NULL, setting RUN->ar_fresh). Otherwise,
+ * for a hole, put in *HOLESPAN (if not NULL) how many blocks from
+ * FILEBLOCK on are unmapped, as for sfs_bmap_hole.
+ *
+ * A new block goes where it would continue the extent before it,
+ * which is then just made longer; so a file written in order ends up
+ * as a few long extents and a tree that is rarely more than the root.
+ *
+ * Locking: must hold vnode lock, with the inode loaded. May get
+ *    and release buffer cache locks and sfs_freemaplock.
+ *
+ * Requires up to 7 buffers.
+ */
+int
+sfs_extent_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		struct sfs_allocrun *run, daddr_t *diskblock_ret,
+		uint32_t *holespan)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extpath path;
+	struct sfs_extnode *leaf;
+	struct sfs_extent *ex, *next, newex;
+	daddr_t block, goal;
+	uint32_t nextblock;
+	int pos, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_extpath_find(sv, fileblock, &path);
+	if (result) {
+		return result;
+	}
+
+	leaf = &path.ep_node[path.ep_depth];
+	pos = path.ep_pos[path.ep_depth];
+	ex = pos >= 0 ? &leaf->en_ext[pos] : NULL;
+	next = pos + 1 < leaf->en_hdr->eh_count ? &leaf->en_ext[pos + 1] : NULL;
+
+	block = sfs_extpath_map(&path, fileblock);
+	if (block != 0 || !doalloc) {
+		if (block == 0 && holespan != NULL) {
+			/* the hole runs to the next extent, wherever it is */
+			if (next != NULL) {
+				nextblock = next->ex_fileblock;
+			}
+			else if (!sfs_extpath_nextleaf(&path, &nextblock)) {
+				nextblock = (uint32_t)-1;
+			}
+			*holespan = nextblock - fileblock;
+		}
+		sfs_extpath_release(sv, &path);
+		*diskblock_ret = block;
+		return 0;
+	}
+
+	/* Aim for where the previous extent would put this block */
+	if (ex != NULL) {
+		goal = ex->ex_diskblock + (fileblock - ex->ex_fileblock);
+	}
+	else {
+		goal = sv->sv_ino + 1;
+	}
+
+	if (run != NULL) {
+		if (run->ar_count == 0) {
+			KASSERT(run->ar_want > 0);
+			result = sfs_balloc_range(sfs, goal, run->ar_want,
+						  &run->ar_next,
+						  &run->ar_count);
+			if (result) {
+				sfs_extpath_release(sv, &path);
+				return result;
+			}
+		}
+		block = run->ar_next++;
+		run->ar_count--;
+	}
+	else {
+		result = sfs_balloc(sfs, goal, &block, NULL);
+		if (result) {
+			sfs_extpath_release(sv, &path);
+			return result;
+		}
+	}
+
+	if (ex != NULL && ex->ex_fileblock + ex->ex_len == fileblock &&
+	    ex->ex_diskblock + ex->ex_len == block) {
+		/* Extends the previous extent; maybe joins the next too */
+		ex->ex_len++;
+		if (next != NULL && next->ex_fileblock == fileblock + 1 &&
+		    next->ex_diskblock == block + 1) {
+			ex->ex_len += next->ex_len;
+			sfs_extnode_remove(leaf, pos + 1);
+		}
+		sfs_extnode_dirty(sv, leaf);
+	}
+	else if (next != NULL && next->ex_fileblock == fileblock + 1 &&
+		 next->ex_diskblock == block + 1) {
+		/* Goes just in front of the next extent */
+		next->ex_fileblock--;
+		next->ex_diskblock--;
+		next->ex_len++;
+		sfs_extnode_dirty(sv, leaf);
+	}
+	else {
+		newex.ex_fileblock = fileblock;
+		newex.ex_diskblock = block;
+		newex.ex_len = 1;
+		result = sfs_ext_insert(sv, &path, path.ep_depth, pos + 1,
+					&newex);
+		if (result) {
+			sfs_extpath_release(sv, &path);
+			/* (a block from RUN is cleaned up by sfs_io) */
+			if (run == NULL) {
+				buffer_drop(&sfs->sfs_absfs, block,
+					    SFS_BLOCKSIZE);
+				sfs_bfree(sfs, block);
+			}
+			else {
+				run->ar_next--;
+				run->ar_count++;
+			}
+			return result;
+		}
+	}
+	sfs_extpath_release(sv, &path);
+
+	if (run != NULL) {
+		run->ar_fresh = true;
+	}
+	*diskblock_ret = block;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// discard
+
+/*
+ * Take out tree nodes emptied by a discard, starting from the leaf
+ * of PATH and going up. An empty root becomes an empty leaf.
+ */
+static
+void
+sfs_ext_prune(struct sfs_vnode *sv, struct sfs_extpath *path)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode *en, *parent;
+	uint32_t bound;
+	unsigned level;
+
+	level = path->ep_depth;
+	while (level > 0 && path->ep_node[level].en_hdr->eh_count == 0) {
+		en = &path->ep_node[level];
+		sfs_ext_free(sfs, en->en_block, 1);
+		buffer_release_and_invalidate(en->en_buf);
+		en->en_buf = NULL;
+
+		level--;
+		parent = &path->ep_node[level];
+		bound = parent->en_ext[0].ex_fileblock;
+		sfs_extnode_remove(parent, path->ep_pos[level]);
+		/* the new first entry takes over the node's bound */
+		parent->en_ext[0].ex_fileblock = bound;
+		sfs_extnode_dirty(sv, parent);
+	}
+	if (level == 0 && path->ep_node[0].en_hdr->eh_count == 0) {
+		path->ep_node[0].en_hdr->eh_depth = 0;
+		sfs_dinode_mark_dirty(sv);
+	}
+}
+
+/*
+ * Discard file blocks START through END - 1 from the leaf of PATH.
+ * Sets *DONE if there's nothing of the range left in later leaves.
+ */
+static
+int
+sfs_ext_discardleaf(struct sfs_vnode *sv, struct sfs_extpath *path,
+		    uint32_t start, uint32_t end, bool *done)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode *leaf;
+	struct sfs_extent *ex, tail;
+	uint32_t exend, s, e;
+	unsigned i;
+	int pos, result;
+
+	leaf = &path->ep_node[path->ep_depth];
+	pos = path->ep_pos[path->ep_depth];
+	i = pos < 0 ? 0 : pos;
+
+	*done = false;
+	while (i < leaf->en_hdr->eh_count) {
+		ex = &leaf->en_ext[i];
+		if (ex->ex_fileblock >= end) {
+			*done = true;
+			break;
+		}
+		exend = ex->ex_fileblock + ex->ex_len;
+		s = ex->ex_fileblock > start ? ex->ex_fileblock : start;
+		e = exend < end ? exend : end;
+		if (s >= e) {
+			/* ends before the range does */
+			i++;
+			continue;
+		}
+
+		if (s > ex->ex_fileblock && e < exend) {
+			/*
+			 * Hole in the middle of the extent: the part
+			 * after it becomes a new extent. Insert that
+			 * before freeing anything, as it can fail.
+			 */
+			tail.ex_fileblock = e;
+			tail.ex_diskblock = ex->ex_diskblock +
+				(e - ex->ex_fileblock);
+			tail.ex_len = exend - e;
+			ex->ex_len = s - ex->ex_fileblock;
+			sfs_extnode_dirty(sv, leaf);
+			result = sfs_ext_insert(sv, path, path->ep_depth,
+						i + 1, &tail);
+			if (result) {
+				/* nothing moved; put it back */
+				ex->ex_len = exend - ex->ex_fileblock;
+				return result;
+			}
+			sfs_ext_free(sfs, tail.ex_diskblock - (e - s), e - s);
+			*done = true;
+			return 0;
+		}
+
+		sfs_ext_free(sfs, ex->ex_diskblock + (s - ex->ex_fileblock),
+			     e - s);
+		if (s == ex->ex_fileblock && e == exend) {
+			sfs_extnode_remove(leaf, i);
+		}
+		else if (s == ex->ex_fileblock) {
+			ex->ex_diskblock += e - s;
+			ex->ex_fileblock = e;
+			ex->ex_len -= e - s;
+			i++;
+		}
+		else {
+			ex->ex_len = s - ex->ex_fileblock;
+			i++;
+		}
+		sfs_extnode_dirty(sv, leaf);
+	}
+
+	sfs_ext_prune(sv, path);
+	return 0;
+}
+
+/*
+ * Find the end of what's mapped in an extent-mapped file: one past
+ * the last block of its last extent, or 0 if it has none.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Requires up to 4 buffers.
+ */
+int
+sfs_extent_mapend(struct sfs_vnode *sv, uint32_t *ret)
+{
+	struct sfs_extpath path;
+	struct sfs_extnode *leaf;
+	struct sfs_extent *ex;
+	int pos, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_extpath_find(sv, (uint32_t)-1, &path);
+	if (result) {
+		return result;
+	}
+	leaf = &path.ep_node[path.ep_depth];
+	pos = path.ep_pos[path.ep_depth];
+	if (pos < 0) {
+		*ret = 0;
+	}
+	else {
+		ex = &leaf->en_ext[pos];
+		*ret = ex->ex_fileblock + ex->ex_len;
+	}
+	sfs_extpath_release(sv, &path);
+	return 0;
+}
+
+/*
+ * Free the blocks of an extent-mapped file from file block START
+ * through END - 1, as sfs_discard does for the other kind. Unlike
+ * sfs_discard this takes the freemap lock itself, as punching a hole
+ * in an extent can mean allocating a tree block.
+ *
+ * Locking: must hold vnode lock, with the inode loaded, but not
+ *    sfs_freemaplock.
+ *
+ * Requires up to 7 buffers.
+ */
+int
+sfs_extent_discard(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_extpath path;
+	uint32_t cur, next;
+	bool done, more;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	cur = start;
+	while (cur < end) {
+		result = sfs_extpath_find(sv, cur, &path);
+		if (result) {
+			return result;
+		}
+		/* (get this before the leaf changes) */
+		more = sfs_extpath_nextleaf(&path, &next);
+		result = sfs_ext_discardleaf(sv, &path, start, end, &done);
+		sfs_extpath_release(sv, &path);
+		if (result) {
+			return result;
+		}
+		if (done || !more) {
+			break;
+		}
+		KASSERT(next > cur);
+		cur = next;
+	}
+	return 0;
+}
@@ -52,31 +52,87 @@
 #define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
 
+/*
+ * Most clean freemap blocks sfs_freemap_writedirty writes over to
+ * join two runs of dirty ones into one write.
+ */
+#define SFS_FREEMAPGAP	8
+
+/*
+ * Write the freemap blocks marked in sfs_freemapdirtymap, each run of
+ * nearby ones in a single write, and clear their marks. On error the
+ * blocks not yet written stay marked.
+ *
+ * A run can take in a few clean blocks between dirty ones: with the
+ * freemap lock held, they are what's on disk already, so rewriting
+ * them is harmless and cheaper than another I/O.
+ */
+static
+int
+sfs_freemap_writedirty(struct sfs_fs *sfs, char *freemapdata,
+		       uint32_t freemapblocks)
+{
+	struct bitmap *dirtymap = sfs->sfs_freemapdirtymap;
+	uint32_t j, k, end;
+	int result;
+
+	for (j=0; j<freemapblocks; j = k) {
+		if (!bitmap_isset(dirtymap, j)) {
+			k = j + 1;
+			continue;
+		}
+		/* END is past the last dirty block seen */
+		end = j + 1;
+		for (k = j + 1; k < freemapblocks; k++) {
+			if (bitmap_isset(dirtymap, k)) {
+				end = k + 1;
+			}
+			else if (k - end >= SFS_FREEMAPGAP) {
+				break;
+			}
+		}
+		k = end;
+		result = sfs_writeblock(&sfs->sfs_absfs,
+					SFS_FREEMAP_START + j, NULL,
+					freemapdata + j*SFS_BLOCKSIZE,
+					(k - j) * SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		for (; j<k; j++) {
+			if (bitmap_isset(dirtymap, j)) {
+				bitmap_unmark(dirtymap, j);
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization. Similarly, storing
- * the freemap in the buffer cache might or might not be a worthwhile
- * optimization. (But that would require a total rewrite of the way
- * it's handled, so not now.)
+ * Reads do the whole bitmap at once; writes do only the sectors that
+ * have changed (see sfs_freemap_writedirty). Storing the freemap in
+ * the buffer cache might or might not be a worthwhile optimization.
+ * (But that would require a total rewrite of the way it's handled,
+ * so not now.)
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of
+ * bits, one bit for each block on the filesystem. The number of
+ * blocks in the bitmap is thus rounded up to the nearest multiple of
+ * SFS_BITSPERBLOCK, SFS_BLOCKSIZE*8. (This rounded number is
+ * SFS_FREEMAPBITS.) This means that the bitmap will (in general)
+ * contain space for some number of invalid blocks that are actually
+ * beyond the end of the disk device. This is ok. These blocks are
+ * supposed to be marked "in use" by mksfs and never get marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
+ * The blocks used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
  */
 static
 int
 sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, freemapblocks;
+	uint32_t freemapblocks;
 	char *freemapdata;
 	int result;
 
@@ -88,47 +144,51 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
-
-		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
-
-		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(&sfs->sfs_absfs,
-					       SFS_FREEMAP_START + j,
-					       ptr, SFS_BLOCKSIZE);
-		}
-		else {
-			result = sfs_writeblock(&sfs->sfs_absfs,
-						SFS_FREEMAP_START + j, NULL,
-						ptr, SFS_BLOCKSIZE);
-		}
+	if (rw == UIO_WRITE) {
+		return sfs_freemap_writedirty(sfs, freemapdata,
+					      freemapblocks);
+	}
 
-		/* If we failed, stop. */
-		if (result) {
-			return result;
-		}
+	/*
+	 * The freemap blocks are consecutive on disk and in memory,
+	 * so read them all with one transfer rather than a sector at
+	 * a time; on a big volume there are hundreds of them. They
+	 * start at sector 2.
+	 */
+	result = sfs_readblock(&sfs->sfs_absfs, SFS_FREEMAP_START,
+			       freemapdata, freemapblocks * SFS_BLOCKSIZE);
+	if (result) {
+		return result;
 	}
+	/* the bitmap's allocation summary needs updating */
+	bitmap_recount(sfs->sfs_freemap);
 	return 0;
 }
 
 #if 0	/* This is subsumed by sync_fs_buffers, plus would now be recursive */
 /*
  * Sync routine for the vnode table.
+ *
+ * Not needed: everything a vnode has to write is in dirty buffers,
+ * and sync_fs_buffers goes through only those (the dirty_buffers
+ * list), so a sync costs nothing per clean vnode however many are
+ * loaded. A list of dirty vnodes would just duplicate that.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	unsigned i, j, num;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Go over the arrays of loaded vnodes, syncing as we go. */
+	for (j=0; j<SFS_VNHASHSIZE; j++) {
+		struct vnodearray *a = sfs->sfs_vnhash[j].vb_vnodes;
+
+		num = vnodearray_num(a);
+		for (i=0; i<num; i++) {
+			struct vnode *v = vnodearray_get(a, i);
+			VOP_FSYNC(v);
+		}
 	}
 	return 0;
 }
@@ -136,9 +196,9 @@ sfs_sync_vnodes(struct sfs_fs *sfs)
 #endif
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Only the freemap blocks that changed
+ * since the last sync are written.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
@@ -147,12 +207,19 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 	lock_acquire(sfs->sfs_freemaplock);
 
 	if (sfs->sfs_freemapdirty) {
+		/* the journal entries for the changes must go first */
+		result = sfs_jlog_prefreemap(sfs);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
 			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
+		sfs_jlog_postfreemap(sfs);
 	}
 
 	lock_release(sfs->sfs_freemaplock);
@@ -253,13 +320,17 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
+	/* Everything is on disk; let the journal tail move up. */
+	sfs_jlog_checkpoint(sfs);
+
 	return 0;
 }
 
 /*
  * Code called when buffers are attached to and detached from the fs.
- * This can allocate and destroy fs-specific buffer data. We don't
- * currently have any, but later changes might want to.
+ * This can allocate and destroy fs-specific buffer data. Buffers
+ * start out with none; the journal code adds its state to metadata
+ * buffers when they're first changed (sfs_jlog_prepare).
  */
 static
 int
@@ -287,14 +358,40 @@ sfs_detachbuf(struct fs *fs, daddr_t diskblock, struct buf *buf)
 	struct sfs_fs *sfs = fs->fs_data;
 	void *bufdata;
 
-	(void)sfs;
 	(void)diskblock;
 
 	/* Clear the fs-specific metadata by installing null. */
 	bufdata = buffer_set_fsdata(buf, NULL);
 
-	/* The fs-specific buffer data we installed before was just NULL. */
-	KASSERT(bufdata == NULL);
+	/* Metadata buffers carry journal state (see sfs_jlog.c) */
+	if (bufdata != NULL) {
+		sfs_jlog_detach(sfs, bufdata);
+	}
+}
+
+/*
+ * Write-ahead logging: flush the journal through LSN before the
+ * buffer cache writes a buffer that needs it (see sfs_jlog_dirty).
+ */
+static
+int
+sfs_flushlog(struct fs *fs, uint64_t lsn)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	return sfs_jphys_flush(sfs, lsn);
+}
+
+/*
+ * kstat: report the journal's counters.
+ */
+static
+void
+sfs_kstat(struct fs *fs, struct kstat *ks)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	sfs_jlog_kstat(sfs, ks);
 }
 
 /*
@@ -319,6 +416,48 @@ sfs_getvolname(struct fs *fs)
 	return sfs->sfs_sb.sb_volname;
 }
 
+/*
+ * Destroy the first NUM buckets of the vnode table.
+ */
+static
+void
+sfs_vnhash_destroy(struct sfs_fs *sfs, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		lock_destroy(sfs->sfs_vnhash[i].vb_lock);
+		vnodearray_destroy(sfs->sfs_vnhash[i].vb_vnodes);
+	}
+}
+
+/*
+ * Set up the vnode table. Returns false if out of memory.
+ */
+static
+bool
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	struct sfs_vnbucket *vb;
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		vb = &sfs->sfs_vnhash[i];
+		vb->vb_vnodes = vnodearray_create();
+		if (vb->vb_vnodes == NULL) {
+			sfs_vnhash_destroy(sfs, i);
+			return false;
+		}
+		vb->vb_lock = lock_create("sfs_vnlock");
+		if (vb->vb_lock == NULL) {
+			vnodearray_destroy(vb->vb_vnodes);
+			sfs_vnhash_destroy(sfs, i);
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * Destructor for struct sfs_fs.
  */
@@ -326,14 +465,18 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_inactive_cleanup(sfs);
+	sfs_jlog_destroy(sfs->sfs_jlog);
 	sfs_jphys_destroy(sfs->sfs_jphys);
-	lock_destroy(sfs->sfs_renamelock);
+	rwlock_destroy(sfs->sfs_renamelock);
 	lock_destroy(sfs->sfs_freemaplock);
-	lock_destroy(sfs->sfs_vnlock);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_freemapdirtymap != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtymap);
+	}
+	sfs_vnhash_destroy(sfs, SFS_VNHASHSIZE);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -348,15 +491,37 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	unsigned i;
+	int result;
 
+	/* Let go of vnodes nobody's using, so they don't count below. */
+	sfs_inactive_stop(sfs);
 
-	lock_acquire(sfs->sfs_vnlock);
+	/* The checkpoint thread takes the freemap lock; stop it first. */
+	sfs_jlog_stopcheckpointer(sfs);
+
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		lock_acquire(sfs->sfs_vnhash[i].vb_lock);
+	}
 	lock_acquire(sfs->sfs_freemaplock);
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		if (vnodearray_num(sfs->sfs_vnhash[i].vb_vnodes) > 0) {
+			break;
+		}
+	}
+	if (i < SFS_VNHASHSIZE) {
 		lock_release(sfs->sfs_freemaplock);
-		lock_release(sfs->sfs_vnlock);
+		for (i=0; i<SFS_VNHASHSIZE; i++) {
+			lock_release(sfs->sfs_vnhash[i].vb_lock);
+		}
+		result = sfs_jlog_startcheckpointer(sfs);
+		if (result) {
+			kprintf("sfs: %s: checkpoint thread: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+		sfs_inactive_start(sfs);
 		return EBUSY;
 	}
 
@@ -375,7 +540,9 @@ sfs_unmount(struct fs *fs)
 	sfs->sfs_device = NULL;
 
 	/* Release the locks. VFS guarantees we can do this safely. */
-	lock_release(sfs->sfs_vnlock);
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		lock_release(sfs->sfs_vnhash[i].vb_lock);
+	}
 	lock_release(sfs->sfs_freemaplock);
 
 	/* Destroy the fs object; once we start nuking stuff we can't fail. */
@@ -397,6 +564,9 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_writeblock = sfs_writeblock,
 	.fsop_attachbuf = sfs_attachbuf,
 	.fsop_detachbuf = sfs_detachbuf,
+	.fsop_flushlog = sfs_flushlog,
+	.fsop_startread = sfs_startread,
+	.fsop_kstat = sfs_kstat,
 };
 
 /*
@@ -416,6 +586,9 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_extent_block)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_extent_root) ==
+		       (SFS_NDIRECT + 3) * sizeof(uint32_t));
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -439,25 +612,21 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	if (!sfs_vnhash_init(sfs)) {
 		goto cleanup_object;
 	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirtymap = NULL;
 
 	/* locks */
-	sfs->sfs_vnlock = lock_create("sfs_vnlock");
-	if (sfs->sfs_vnlock == NULL) {
-		goto cleanup_vnodes;
-	}
 	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
 	if (sfs->sfs_freemaplock == NULL) {
-		goto cleanup_vnlock;
+		goto cleanup_vnodes;
 	}
-	sfs->sfs_renamelock = lock_create("sfs_renamelock");
+	sfs->sfs_renamelock = rwlock_create("sfs_renamelock");
 	if (sfs->sfs_renamelock == NULL) {
 		goto cleanup_freemaplock;
 	}
@@ -467,17 +636,24 @@ sfs_fs_create(void)
 	if (sfs->sfs_jphys == NULL) {
 		goto cleanup_renamelock;
 	}
+	sfs->sfs_jlog = sfs_jlog_create();
+	if (sfs->sfs_jlog == NULL) {
+		goto cleanup_jphys;
+	}
+
+	/* unreferenced vnodes, kept once it's mounted */
+	sfs_inactive_init(sfs);
 
 	return sfs;
 
+cleanup_jphys:
+	sfs_jphys_destroy(sfs->sfs_jphys);
 cleanup_renamelock:
-	lock_destroy(sfs->sfs_renamelock);
+	rwlock_destroy(sfs->sfs_renamelock);
 cleanup_freemaplock:
 	lock_destroy(sfs->sfs_freemaplock);
-cleanup_vnlock:
-	lock_destroy(sfs->sfs_vnlock);
 cleanup_vnodes:
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_destroy(sfs, SFS_VNHASHSIZE);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -503,23 +679,23 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
+	blkcnt_t devblocks;
 
-	/* We don't pass any options through mount */
-	(void)options;
+	/* The only option is the data mode; NULL means ordered */
+	const unsigned *datamode = options;
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors don't divide our
+	 * blocks evenly. With 512-byte blocks a block is one sector of
+	 * the usual disk; with 4096-byte blocks it's eight, which the
+	 * device reads and writes in one go.
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+	if (dev->d_blocksize == 0 || SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
 	}
+	devblocks = dev->d_blocks / (SFS_BLOCKSIZE / dev->d_blocksize);
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
@@ -528,16 +704,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
+	sfs->sfs_datamode = datamode != NULL ? *datamode : SFS_DATA_ORDERED;
 
-	/* Acquire the locks so various stuff works right */
-	lock_acquire(sfs->sfs_vnlock);
+	/*
+	 * Acquire the freemap lock so various stuff works right. (No
+	 * vnodes can be loaded yet, so the vnode table needs nothing.)
+	 */
 	lock_acquire(sfs->sfs_freemaplock);
 
 	/* Load superblock */
 	result = sfs_readblock(&sfs->sfs_absfs, SFS_SUPER_BLOCK,
 			       &sfs->sfs_sb, sizeof(sfs->sfs_sb));
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_freemaplock);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -551,7 +729,24 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
-		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if (SFS_SB_BLOCKSIZE(&sfs->sfs_sb) != SFS_BLOCKSIZE) {
+		kprintf("sfs: Volume has %u-byte blocks; only %u supported\n",
+			SFS_SB_BLOCKSIZE(&sfs->sfs_sb), SFS_BLOCKSIZE);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_flags & ~SFS_SBFLAG_EXTENTS) {
+		kprintf("sfs: Unknown superblock flags 0x%x\n",
+			sfs->sfs_sb.sb_flags & ~SFS_SBFLAG_EXTENTS);
 		lock_release(sfs->sfs_freemaplock);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -562,9 +757,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		kprintf("sfs: warning - journal takes up whole volume\n");
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
+	if (sfs->sfs_sb.sb_nblocks > devblocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+			sfs->sfs_sb.sb_nblocks, devblocks);
 	}
 
 	/* Ensure null termination of the volume name */
@@ -572,8 +767,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
-		lock_release(sfs->sfs_vnlock);
+	sfs->sfs_freemapdirtymap = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirtymap == NULL) {
 		lock_release(sfs->sfs_freemaplock);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -581,7 +776,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_freemaplock);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
@@ -591,7 +785,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	lock_release(sfs->sfs_vnlock);
 	lock_release(sfs->sfs_freemaplock);
 
 	reserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
@@ -619,9 +812,20 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	reserve_buffers(SFS_BLOCKSIZE);
 
-	/********************************/
-	/* Call your recovery code here */
-	/********************************/
+	/* Replay the metadata journal and roll back incomplete ops */
+	result = sfs_jlog_recover(sfs);
+	if (result) {
+		kprintf("sfs: %s: journal recovery failed: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+		unreserve_buffers(SFS_BLOCKSIZE);
+		sfs_jphys_stopreading(sfs);
+		sync_fs_buffers(&sfs->sfs_absfs);
+		unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+		drop_fs_buffers(&sfs->sfs_absfs);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
@@ -633,28 +837,82 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_jphys_startwriting(sfs);
 	if (result) {
 		unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+		/* recovery may have left blocks dirty */
+		sync_fs_buffers(&sfs->sfs_absfs);
 		drop_fs_buffers(&sfs->sfs_absfs);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
 		return result;
 	}
 
-	reserve_buffers(SFS_BLOCKSIZE);
+	/*
+	 * Write out what recovery did, which also trims the journal
+	 * so the records it replayed won't be replayed again.
+	 */
+	result = sfs_sync(&sfs->sfs_absfs);
+	if (result) {
+		kprintf("sfs: %s: sync after recovery: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
 
-	/**************************************/
-	/* Maybe call more recovery code here */
-	/**************************************/
+	/*
+	 * Without a checkpoint thread, operations checkpoint for
+	 * themselves when the journal fills; that's slower but works.
+	 */
+	result = sfs_jlog_startcheckpointer(sfs);
+	if (result) {
+		kprintf("sfs: %s: checkpoint thread: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
 
-	unreserve_buffers(SFS_BLOCKSIZE);
+	sfs_inactive_start(sfs);
 
 	return 0;
 }
 
 /*
- * Actual function called from high-level code to mount an sfs.
+ * Actual functions called from high-level code to mount an sfs.
  */
 int
 sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+int
+sfs_mount_datajournal(const char *device)
+{
+	unsigned datamode = SFS_DATA_JOURNAL;
+
+	return vfs_mount(device, &datamode, sfs_domount);
+}
+
+/*
+ * Journal statistics for the menu. Holding the root vnode keeps the
+ * volume from being unmounted meanwhile.
+ */
+int
+sfs_jstats(const char *device, bool reset)
+{
+	struct vnode *root;
+	struct sfs_fs *sfs;
+	int result;
+
+	result = vfs_getroot(device, &root);
+	if (result) {
+		return result;
+	}
+	if (root->vn_fs == NULL || root->vn_fs->fs_ops != &sfs_fsops) {
+		VOP_DECREF(root);
+		return EINVAL;
+	}
+	sfs = root->vn_fs->fs_data;
+	if (reset) {
+		sfs_jlog_resetstats(sfs);
+	}
+	else {
+		sfs_jlog_printstats(sfs);
+	}
+	VOP_DECREF(root);
+	return 0;
+}
@@ -34,15 +34,34 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <vfs.h>
 #include <buf.h>
+#include <reclaim.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Most unreferenced vnodes we keep per volume; see "inactive vnodes"
+ * below.
+ */
+#define SFS_INACTIVE_MAX	128
+
+
+/*
+ * Find the vnode table bucket for inode INO.
+ */
+static
+struct sfs_vnbucket *
+sfs_vnbucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnhash[ino & (SFS_VNHASHSIZE - 1)];
+}
 
 /*
  * Constructor for sfs_vnode.
@@ -62,10 +81,32 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 		kfree(sv);
 		return NULL;
 	}
+	sv->sv_rangewchan = wchan_create("sfs_range");
+	if (sv->sv_rangewchan == NULL) {
+		lock_destroy(sv->sv_lock);
+		kfree(sv);
+		return NULL;
+	}
+	spinlock_init(&sv->sv_rangelock);
+	list_init(&sv->sv_ranges);
 	sv->sv_ino = ino;
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_size = 0;
+	sv->sv_linkcount = 0;
+	sv->sv_compressed = false;
+	sv->sv_ranextpos = 0;
+	sv->sv_radone = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_advice = FADV_NORMAL;
+	sv->sv_direct = false;
+	sv->sv_dirindex = NULL;
+	sv->sv_dirtystart = 0;
+	sv->sv_dirtyend = 0;
+	sv->sv_commitlsn = 0;
+	listnode_init(&sv->sv_inactnode, sv);
+	sv->sv_inactive = false;
 	return sv;
 }
 
@@ -76,6 +117,12 @@ static
 void
 sfs_vnode_destroy(struct sfs_vnode *victim)
 {
+	KASSERT(victim->sv_inactive == false);
+	sfs_dirindex_destroy(victim);
+	listnode_cleanup(&victim->sv_inactnode);
+	list_cleanup(&victim->sv_ranges);
+	spinlock_cleanup(&victim->sv_rangelock);
+	wchan_destroy(victim->sv_rangewchan);
 	lock_destroy(victim->sv_lock);
 	kfree(victim);
 }
@@ -107,6 +154,7 @@ sfs_dinode_load(struct sfs_vnode *sv)
 		if (result) {
 			return result;
 		}
+		sfs_jlog_prepare(sfs, sv->sv_dinobuf);
 	}
 	else {
 		KASSERT(sv->sv_dinobuf != NULL);
@@ -128,6 +176,9 @@ sfs_dinode_load(struct sfs_vnode *sv)
 void
 sfs_dinode_unload(struct sfs_vnode *sv)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	KASSERT(sv->sv_dinobuf != NULL);
@@ -135,6 +186,14 @@ sfs_dinode_unload(struct sfs_vnode *sv)
 
 	sv->sv_dinobufcount--;
 	if (sv->sv_dinobufcount == 0) {
+		/* Everything that changes the dinode has it loaded */
+		dino = buffer_map(sv->sv_dinobuf);
+		sv->sv_size = dino->sfi_size;
+		sv->sv_linkcount = dino->sfi_linkcount;
+		sv->sv_compressed =
+			(dino->sfi_flags & SFS_IFLAG_COMPRESSED) != 0;
+
+		sfs_jlog_forget(sfs, sv->sv_dinobuf);
 		buffer_release(sv->sv_dinobuf);
 		sv->sv_dinobuf = NULL;
 	}
@@ -158,61 +217,335 @@ sfs_dinode_map(struct sfs_vnode *sv)
 
 /*
  * Mark the on-disk inode dirty after scribbling in it with
- * sfs_dinode_map.
+ * sfs_dinode_map. This also journals the changes.
  *
  * Locking: must hold the vnode lock.
  */
 void
 sfs_dinode_mark_dirty(struct sfs_vnode *sv)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	KASSERT(sv->sv_dinobuf != NULL);
-	buffer_mark_dirty(sv->sv_dinobuf);
+	sfs_jlog_dirty(sfs, sv->sv_dinobuf, sv->sv_ino);
+	sfs_trans_touch(sfs, &sv->sv_commitlsn);
+}
+
+////////////////////////////////////////////////////////////
+// inactive vnodes
+
+/*
+ * When the last reference to a vnode goes away it is normally kept
+ * loaded, on its volume's inactive list, in case it's wanted again
+ * soon: reopening a file that was just closed (the shell running the
+ * same program again, say) then needn't read the inode and set up a
+ * new vnode. The list holds the reference that would have been
+ * dropped, so a vnode on it has a refcount of 1 and stays in the
+ * vnode table. sfs_loadvnode, which finds it there, takes that
+ * reference over. A name cache hit adds a reference of its own and
+ * leaves the vnode on the list, so eviction checks again, through
+ * the usual vnode_lastref test, that the list's is the only one.
+ *
+ * Files with no links left aren't kept, as reclaiming them is what
+ * erases them.
+ *
+ * Past SFS_INACTIVE_MAX vnodes, or when the memory reclaim hooks ask,
+ * a work item evicts the least recently used ones. It runs on the
+ * system work queue because evicting takes vnode locks and whoever
+ * dropped the last reference may be holding others.
+ */
+
+/* Mounted volumes, for the reclaim hook. */
+static struct spinlock sfs_mounts_lock = SPINLOCK_INITIALIZER;
+static struct sfs_fs *sfs_mounts;
+static bool sfs_reclaimer_registered;
+
+static int sfs_reclaim_vnode(struct sfs_vnode *sv, bool keep);
+
+/*
+ * Put SV, whose last reference is being dropped, on the inactive
+ * list. Returns false if the volume is being unmounted.
+ */
+static
+bool
+sfs_inactive_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	spinlock_acquire(&sfs->sfs_inactlock);
+	if (sfs->sfs_inactoff) {
+		spinlock_release(&sfs->sfs_inactlock);
+		return false;
+	}
+	KASSERT(sv->sv_inactive == false);
+	list_addtail(&sfs->sfs_inactive, &sv->sv_inactnode);
+	sv->sv_inactive = true;
+	if (list_count(&sfs->sfs_inactive) > sfs->sfs_inacttarget) {
+		/* (with the lock held, so sfs_inactive_stop can't miss it) */
+		workqueue_enqueue(system_workqueue, &sfs->sfs_inactwork);
+	}
+	spinlock_release(&sfs->sfs_inactlock);
+	return true;
+}
+
+/*
+ * Take SV off the inactive list if it's there. Returns true if it was,
+ * in which case the caller now has the list's reference.
+ */
+static
+bool
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	bool ret;
+
+	spinlock_acquire(&sfs->sfs_inactlock);
+	ret = sv->sv_inactive;
+	if (ret) {
+		list_remove(&sfs->sfs_inactive, &sv->sv_inactnode);
+		sv->sv_inactive = false;
+	}
+	spinlock_release(&sfs->sfs_inactlock);
+	return ret;
+}
+
+/*
+ * Reclaim inactive vnodes, oldest first, until no more than TARGET
+ * are left.
+ */
+static
+void
+sfs_inactive_evict(struct sfs_fs *sfs, unsigned target)
+{
+	struct sfs_vnode *sv;
+	int result;
+
+	while (1) {
+		spinlock_acquire(&sfs->sfs_inactlock);
+		if (list_count(&sfs->sfs_inactive) <= target) {
+			spinlock_release(&sfs->sfs_inactlock);
+			break;
+		}
+		sv = list_remhead(&sfs->sfs_inactive);
+		sv->sv_inactive = false;
+		spinlock_release(&sfs->sfs_inactlock);
+
+		/* this uses up the list's reference */
+		result = sfs_reclaim_vnode(sv, false);
+		if (result != 0 && result != EBUSY) {
+			kprintf("sfs: %s: evicting inode %u: %s\n",
+				sfs->sfs_sb.sb_volname, sv->sv_ino,
+				strerror(result));
+		}
+	}
+}
+
+/*
+ * Work item: evict down to sfs_inacttarget, then put the target back
+ * to the normal limit.
+ */
+static
+void
+sfs_inactive_work(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	unsigned target;
+
+	(void)data2;
+
+	spinlock_acquire(&sfs->sfs_inactlock);
+	target = sfs->sfs_inacttarget;
+	spinlock_release(&sfs->sfs_inactlock);
+
+	sfs_inactive_evict(sfs, target);
+
+	spinlock_acquire(&sfs->sfs_inactlock);
+	sfs->sfs_inacttarget = SFS_INACTIVE_MAX;
+	spinlock_release(&sfs->sfs_inactlock);
 }
 
+/*
+ * Reclaim hook: have every volume drop half its inactive vnodes. This
+ * can't be done here, as the caller may hold vnode locks, so it
+ * happens in the background and we report nothing freed yet.
+ */
+static
+unsigned
+sfs_inactive_reclaim(unsigned npages, unsigned flags)
+{
+	struct sfs_fs *sfs;
+	unsigned count;
+
+	(void)npages;
+	(void)flags;
+
+	spinlock_acquire(&sfs_mounts_lock);
+	for (sfs = sfs_mounts; sfs != NULL; sfs = sfs->sfs_nextmount) {
+		spinlock_acquire(&sfs->sfs_inactlock);
+		count = list_count(&sfs->sfs_inactive);
+		if (count / 2 < sfs->sfs_inacttarget) {
+			sfs->sfs_inacttarget = count / 2;
+		}
+		spinlock_release(&sfs->sfs_inactlock);
+		if (count > 0) {
+			workqueue_enqueue(system_workqueue,
+					  &sfs->sfs_inactwork);
+		}
+	}
+	spinlock_release(&sfs_mounts_lock);
+
+	return 0;
+}
+
+static struct reclaimer sfs_reclaimer =
+	RECLAIMER_INITIALIZER("sfs vnodes", sfs_inactive_reclaim);
+
+/*
+ * Set up and tear down the inactive list of a struct sfs_fs.
+ */
+void
+sfs_inactive_init(struct sfs_fs *sfs)
+{
+	spinlock_init(&sfs->sfs_inactlock);
+	list_init(&sfs->sfs_inactive);
+	sfs->sfs_inacttarget = SFS_INACTIVE_MAX;
+	sfs->sfs_inactoff = true;
+	work_init(&sfs->sfs_inactwork, sfs_inactive_work, sfs, 0);
+	sfs->sfs_nextmount = NULL;
+}
+
+void
+sfs_inactive_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_inactoff);
+	list_cleanup(&sfs->sfs_inactive);
+	spinlock_cleanup(&sfs->sfs_inactlock);
+}
+
+/*
+ * Start keeping inactive vnodes; called once the volume is mounted,
+ * and again if an unmount fails.
+ */
+void
+sfs_inactive_start(struct sfs_fs *sfs)
+{
+	bool doregister;
+
+	spinlock_acquire(&sfs->sfs_inactlock);
+	sfs->sfs_inactoff = false;
+	spinlock_release(&sfs->sfs_inactlock);
+
+	spinlock_acquire(&sfs_mounts_lock);
+	sfs->sfs_nextmount = sfs_mounts;
+	sfs_mounts = sfs;
+	doregister = !sfs_reclaimer_registered;
+	sfs_reclaimer_registered = true;
+	spinlock_release(&sfs_mounts_lock);
+
+	if (doregister) {
+		reclaim_register(&sfs_reclaimer);
+	}
+}
+
+/*
+ * Stop keeping inactive vnodes and reclaim the ones we have, for
+ * unmount. Call without holding any vnode table locks.
+ */
+void
+sfs_inactive_stop(struct sfs_fs *sfs)
+{
+	struct sfs_fs **p;
+
+	spinlock_acquire(&sfs_mounts_lock);
+	for (p = &sfs_mounts; *p != sfs; p = &(*p)->sfs_nextmount) {
+		KASSERT(*p != NULL);
+	}
+	*p = sfs->sfs_nextmount;
+	sfs->sfs_nextmount = NULL;
+	spinlock_release(&sfs_mounts_lock);
+
+	spinlock_acquire(&sfs->sfs_inactlock);
+	sfs->sfs_inactoff = true;
+	spinlock_release(&sfs->sfs_inactlock);
+
+	/* Nothing can queue the work item now; let it finish. */
+	workqueue_flush(system_workqueue);
+	sfs_inactive_evict(sfs, 0);
+}
+
+////////////////////////////////////////////////////////////
+// reclaim and load
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
+ * If KEEP is set and the file still exists, the vnode goes on the
+ * inactive list instead of being torn down; see above.
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
- * Locking: gets/releases vnode lock. Gets/releases sfs_vnlock, and
- *    possibly also sfs_freemaplock, while holding the vnode lock.
+ * Locking: gets/releases vnode lock. Gets/releases the vnode table
+ *    bucket lock, and possibly also sfs_freemaplock, while holding
+ *    the vnode lock.
  *
  * Requires 1 buffer locally but may also afterward call sfs_itrunc,
  * which takes 4.
  */
+static
 int
-sfs_reclaim(struct vnode *v)
+sfs_reclaim_vnode(struct sfs_vnode *sv, bool keep)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	struct vnode *v = &sv->sv_absvn;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_vnbucket *vb;
 	struct sfs_dinode *iptr;
 	unsigned ix, i, num;
 	bool buffers_needed;
 	int result;
 
+	vb = sfs_vnbucket(sfs, sv->sv_ino);
+
 	lock_acquire(sv->sv_lock);
-	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(vb->vb_lock);
+
+	/*
+	 * The link count is current, as nobody has the inode loaded
+	 * (we have the vnode lock). A vnode we keep can stay in the
+	 * name cache, and if someone gets it from there meanwhile it
+	 * makes no difference.
+	 */
+	if (keep && sv->sv_linkcount > 0) {
+		if (!vnode_lastref(v)) {
+			lock_release(vb->vb_lock);
+			lock_release(sv->sv_lock);
+			return EBUSY;
+		}
+		if (sfs_inactive_add(sfs, sv)) {
+			/* sticky only while open */
+			sv->sv_direct = false;
+			sv->sv_advice = FADV_NORMAL;
+			lock_release(vb->vb_lock);
+			lock_release(sv->sv_lock);
+			return 0;
+		}
+	}
+
+	/*
+	 * Drop it from the name cache first: after this, no cache hit
+	 * can pick it up, and any that already did holds a reference
+	 * we'll see below.
+	 */
+	vfs_ncache_purge_vnode(v);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
 	 * decision was made to reclaim it. (This must interact
 	 * properly with sfs_loadvnode.)
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
-		lock_release(sfs->sfs_vnlock);
+	if (!vnode_lastref(v)) {
+		/* it consumed the reference VOP_DECREF gave us */
+		lock_release(vb->vb_lock);
 		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
-	spinlock_release(&v->vn_countlock);
 
 	/*
 	 * This grossness arises because reclaim gets called via
@@ -232,7 +565,7 @@ sfs_reclaim(struct vnode *v)
 		 * This case is likely to lead to problems, but
 		 * there's essentially no helping it...
 		 */
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		lock_release(sv->sv_lock);
 		if (buffers_needed) {
 			unreserve_buffers(SFS_BLOCKSIZE);
@@ -243,10 +576,12 @@ sfs_reclaim(struct vnode *v)
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (iptr->sfi_linkcount == 0) {
+		sfs_trans_begin_locked(sfs);
 		result = sfs_itrunc(sv, 0);
 		if (result) {
+			sfs_trans_end(sfs);
 			sfs_dinode_unload(sv);
-			lock_release(sfs->sfs_vnlock);
+			lock_release(vb->vb_lock);
 			lock_release(sv->sv_lock);
 			if (buffers_needed) {
 				unreserve_buffers(SFS_BLOCKSIZE);
@@ -257,6 +592,7 @@ sfs_reclaim(struct vnode *v)
 		/* Discard the inode */
 		buffer_drop(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE);
 		sfs_bfree(sfs, sv->sv_ino);
+		sfs_trans_end(sfs);
 	}
 	else {
 		sfs_dinode_unload(sv);
@@ -266,11 +602,11 @@ sfs_reclaim(struct vnode *v)
 		unreserve_buffers(SFS_BLOCKSIZE);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Remove the vnode structure from its bucket of the vnode table. */
+	num = vnodearray_num(vb->vb_vnodes);
 	ix = num;
 	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
+		struct vnode *v2 = vnodearray_get(vb->vb_vnodes, i);
 		struct sfs_vnode *sv2 = v2->vn_data;
 		if (sv2 == sv) {
 			ix = i;
@@ -281,11 +617,12 @@ sfs_reclaim(struct vnode *v)
 		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
 		      sfs->sfs_sb.sb_volname, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	vnodearray_remove(vb->vb_vnodes, ix);
 
 	vnode_cleanup(&sv->sv_absvn);
+	sfs_trans_untouch(sfs, &sv->sv_commitlsn);
 
-	lock_release(sfs->sfs_vnlock);
+	lock_release(vb->vb_lock);
 	lock_release(sv->sv_lock);
 
 	sfs_vnode_destroy(sv);
@@ -294,13 +631,19 @@ sfs_reclaim(struct vnode *v)
 	return 0;
 }
 
+int
+sfs_reclaim(struct vnode *v)
+{
+	return sfs_reclaim_vnode(v->vn_data, true);
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
  *
  * The vnode is returned unlocked and with its inode not loaded.
  *
- * Locking: gets/releases sfs_vnlock.
+ * Locking: gets/releases the vnode table bucket lock for INO.
  *
  * May require 3 buffers if VOP_DECREF triggers reclaim.
  */
@@ -310,21 +653,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 {
 	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_vnbucket *vb;
 	struct buf *dinobuf;
 	struct sfs_dinode *dino;
 	const struct vnode_ops *ops;
 	unsigned i, num;
 	int result;
 
-	/* sfs_vnlock protects the vnodes table */
-	lock_acquire(sfs->sfs_vnlock);
-
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* The bucket lock protects its part of the vnode table */
+	vb = sfs_vnbucket(sfs, ino);
+	lock_acquire(vb->vb_lock);
 
-	/* Linear search. Is this too slow? You decide. */
+	/* Look in the bucket; it's short, so search it linearly. */
+	num = vnodearray_num(vb->vb_vnodes);
 	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
+		v = vnodearray_get(vb->vb_vnodes, i);
 		sv = v->vn_data;
 
 		/* Every inode in memory must be in an allocated block */
@@ -339,8 +682,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			/* forcetype is only allowed when creating objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			lock_release(sfs->sfs_vnlock);
+			/* An inactive vnode comes with a reference. */
+			if (!sfs_inactive_remove(sfs, sv)) {
+				VOP_INCREF(&sv->sv_absvn);
+			}
+			lock_release(vb->vb_lock);
 
 			*ret = sv;
 			return 0;
@@ -362,12 +708,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 * Read the block the inode is in.
 	 *
 	 * (We can do this before creating and locking the new vnode
-	 * because we are holding the vnode table lock. Nobody else can
+	 * because we are holding the bucket lock for INO. Nobody else can
 	 * be in here trying to load the same vnode at the same time.)
 	 */
 	result = buffer_read(&sfs->sfs_absfs, ino, SFS_BLOCKSIZE, &dinobuf);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 	dino = buffer_map(dinobuf);
@@ -379,8 +725,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(dino->sfi_type == SFS_TYPE_INVAL);
+		sfs_jlog_prepare(sfs, dinobuf);
 		dino->sfi_type = forcetype;
-		buffer_mark_dirty(dinobuf);
+		sfs_jlog_dirty(sfs, dinobuf, ino);
 	}
 
 	/*
@@ -410,49 +757,111 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 */
 	sv = sfs_vnode_create(ino, dino->sfi_type);
 	if (sv==NULL) {
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return ENOMEM;
 	}
+	sv->sv_size = dino->sfi_size;
+	sv->sv_linkcount = dino->sfi_linkcount;
+	sv->sv_compressed = (dino->sfi_flags & SFS_IFLAG_COMPRESSED) != 0;
 
+	sfs_jlog_forget(sfs, dinobuf);
 	buffer_release(dinobuf);
+	sv->sv_commitlsn = sfs_trans_loadlsn(sfs);
 
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
 		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = vnodearray_add(vb->vb_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
 		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
-	lock_release(sfs->sfs_vnlock);
+	lock_release(vb->vb_lock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
+/*
+ * Find out the type of inode INO without loading a vnode for it, for
+ * getdirentries. If the vnode is loaded its type is cached there;
+ * otherwise read the inode block. Holding the bucket lock meanwhile
+ * means nobody can load the vnode and so nobody can be holding that
+ * block busy.
+ *
+ * The caller must hold the lock of a directory containing INO, so
+ * the inode can't be freed and reused underneath us.
+ *
+ * Locking: gets/releases the vnode table bucket lock for INO.
+ *
+ * Requires 1 buffer.
+ */
+int
+sfs_peektype(struct sfs_fs *sfs, uint32_t ino, int *ret)
+{
+	struct sfs_vnbucket *vb;
+	struct sfs_vnode *sv;
+	struct vnode *v;
+	struct buf *dinobuf;
+	struct sfs_dinode *dino;
+	unsigned i, num;
+	int result;
+
+	vb = sfs_vnbucket(sfs, ino);
+	lock_acquire(vb->vb_lock);
+
+	num = vnodearray_num(vb->vb_vnodes);
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(vb->vb_vnodes, i);
+		sv = v->vn_data;
+		if (sv->sv_ino == ino) {
+			*ret = sv->sv_type;
+			lock_release(vb->vb_lock);
+			return 0;
+		}
+	}
+
+	result = buffer_read(&sfs->sfs_absfs, ino, SFS_BLOCKSIZE, &dinobuf);
+	if (result) {
+		lock_release(vb->vb_lock);
+		return result;
+	}
+	dino = buffer_map(dinobuf);
+	*ret = dino->sfi_type;
+	buffer_release(dinobuf);
+
+	lock_release(vb->vb_lock);
+	return 0;
+}
+
 /*
  * Create a new filesystem object and hand back its vnode.
  * Always hands back vnode "locked and loaded"
  *
+ * GOAL is passed to sfs_balloc to place the inode; callers use the
+ * inode of the directory the object is going into.
+ *
  * As a matter of convenience, returns the vnode with its inode loaded.
  *
  * Locking: Gets/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock, but does not hold them together.
+ *    Also gets/releases a vnode table bucket lock, but does not hold
+ *    them together.
  *
  * Requires up to 3 buffers as sfs_loadvnode might trigger reclaim and
  * truncate.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	struct sfs_dinode *dino;
@@ -463,7 +872,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino, NULL);
+	result = sfs_balloc(sfs, goal, &ino, NULL);
 	if (result) {
 		return result;
 	}
@@ -493,6 +902,12 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	dino = sfs_dinode_map(*ret);
 	KASSERT(dino->sfi_linkcount == 0);
 
+	/* and maps its blocks with extents if the volume says to */
+	if (sfs->sfs_sb.sb_flags & SFS_SBFLAG_EXTENTS) {
+		sfs_extent_initroot(dino);
+		sfs_dinode_mark_dirty(*ret);
+	}
+
 	return result;
 }
 
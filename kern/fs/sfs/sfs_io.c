@@ -34,12 +34,15 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vfs.h>
 #include <buf.h>
 #include <device.h>
+#include <bio.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,7 +105,24 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Start reading a block without waiting, for read-ahead. Unlike
+ * sfs_readblock this doesn't retry on error; the buffer just stays
+ * invalid, and reading it for real will.
+ */
+void
+sfs_startread(struct fs *fs, daddr_t block, struct bio *bio)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	KASSERT(bio->bio_len > 0 && bio->bio_len % SFS_BLOCKSIZE == 0);
+
+	bio->bio_offset = ((off_t)block)*SFS_BLOCKSIZE;
+	bio_submit(sfs->sfs_device, bio);
+}
+
+/*
+ * Read a block, or a run of consecutive blocks if LEN is larger than
+ * one block (for multi-block buffers).
  */
 int
 sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
@@ -111,14 +131,22 @@ sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or a run of consecutive blocks. Multi-block buffers
+ * are never used for the journal.
+ *
+ * A run can also be several buffers the buffer cache is writing
+ * together. Journal blocks have to be written in order; a run of them
+ * is fine, since everything before its first block is flushed first,
+ * but we refuse a run that is only partly in the journal. The buffer
+ * cache then writes those buffers separately.
  */
 int
 sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
@@ -127,14 +155,24 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	struct sfs_fs *sfs = fs->fs_data;
 	struct iovec iov;
 	struct uio ku;
+	uint32_t nblocks, i;
 	bool isjournal;
 	int result;
 
-	(void)fsbufdata;
-
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
+	nblocks = len / SFS_BLOCKSIZE;
 
 	isjournal = sfs_block_is_journal(sfs, block);
+	if (nblocks > 1 &&
+	    isjournal != sfs_block_is_journal(sfs, block + nblocks - 1)) {
+		return EINVAL;
+	}
+	if (nblocks > 1 && !isjournal &&
+	    block < sfs->sfs_sb.sb_journalstart &&
+	    block + nblocks > sfs->sfs_sb.sb_journalstart) {
+		/* spans the whole journal */
+		return EINVAL;
+	}
 
 	if (isjournal) {
 		/*
@@ -160,15 +198,25 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 			return result;
 		}
 	}
+	/*
+	 * Metadata needs its journal records on disk first; the buffer
+	 * cache has already seen to that (see sfs_flushlog).
+	 */
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_WRITE);
 	result = sfs_rwblock(sfs, &ku);
 	if (result) {
 		return result;
 	}
 
 	if (isjournal) {
-		sfs_wrote_journal_block(sfs, block);
+		for (i=0; i<nblocks; i++) {
+			sfs_wrote_journal_block(sfs, block + i);
+		}
+	}
+	else if (fsbufdata != NULL) {
+		sfs_jlog_postwrite(sfs, fsbufdata);
 	}
 
 	return 0;
@@ -178,16 +226,404 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 //
 // File-level I/O
 
+/*
+ * Read-ahead window limits, in blocks.
+ */
+#define SFS_RA_MINWINDOW	4
+#define SFS_RA_MAXWINDOW	32
+
+/*
+ * Ask the buffer cache to prefetch the file's blocks from FILEBLOCK
+ * up to LIMIT, skipping holes. Returns the block it got to, which is
+ * LIMIT unless looking up a block failed.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ */
+static
+uint32_t
+sfs_prefetch(struct sfs_vnode *sv, uint32_t fileblock, uint32_t limit)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t holespan;
+	daddr_t diskblock;
+	int result;
+
+	while (fileblock < limit) {
+		result = sfs_bmap_hole(sv, fileblock, &diskblock, &holespan);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_prefetch(&sfs->sfs_absfs, diskblock,
+					SFS_BLOCKSIZE);
+			fileblock++;
+		}
+		else {
+			/* nothing to fetch in a hole */
+			fileblock += holespan;
+		}
+	}
+	if (fileblock > limit) {
+		/* the hole went on past it */
+		fileblock = limit;
+	}
+	return fileblock;
+}
+
+/*
+ * Read-ahead. Called at the start of each read of a file with the
+ * range about to be read. If the read starts where the last one
+ * ended, the file is being read sequentially: grow the window
+ * (doubling it each time, up to the limit) and ask the buffer cache
+ * to prefetch the blocks in it that haven't been asked for yet.
+ * Otherwise close the window again. Advice from IOCTL_FADVISE
+ * overrides this: random access never reads ahead, and sequential
+ * access always does, with the biggest window.
+ *
+ * This is only a hint, so errors are ignored.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, size_t len, off_t filesize)
+{
+	uint32_t endblock, limit, fileblock;
+	bool sequential;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sequential = (pos == sv->sv_ranextpos);
+	sv->sv_ranextpos = pos + len;
+	endblock = DIVROUNDUP(pos + len, SFS_BLOCKSIZE);
+
+	if (!sequential) {
+		sv->sv_radone = endblock;
+	}
+	if (sv->sv_advice == FADV_RANDOM ||
+	    (!sequential && sv->sv_advice != FADV_SEQUENTIAL)) {
+		sv->sv_rawindow = 0;
+		return;
+	}
+
+	if (sv->sv_advice == FADV_SEQUENTIAL) {
+		/* No need to wait and see. */
+		sv->sv_rawindow = SFS_RA_MAXWINDOW;
+	}
+	else if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MINWINDOW;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAXWINDOW) {
+		sv->sv_rawindow *= 2;
+	}
+
+	fileblock = sv->sv_radone > endblock ? sv->sv_radone : endblock;
+	limit = endblock + sv->sv_rawindow;
+	if (limit > DIVROUNDUP(filesize, SFS_BLOCKSIZE)) {
+		limit = DIVROUNDUP(filesize, SFS_BLOCKSIZE);
+	}
+	sv->sv_radone = sfs_prefetch(sv, fileblock, limit);
+}
+
+/*
+ * Take IOCTL_FADVISE advice ADVICE about the LEN bytes of the file at
+ * POS (through EOF if LEN is 0); see <kern/ioctl.h>. The caller drops
+ * the page cache for FADV_DONTNEED, after letting go of the lock.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_fadvise(struct sfs_vnode *sv, off_t pos, off_t len, unsigned advice)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	uint32_t fileblock, limit, holespan;
+	daddr_t diskblock;
+	off_t size, end;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	switch (advice) {
+	    case FADV_NORMAL:
+	    case FADV_RANDOM:
+	    case FADV_SEQUENTIAL:
+		sv->sv_advice = advice;
+		sv->sv_rawindow = 0;
+		return 0;
+	    case FADV_WILLNEED:
+	    case FADV_DONTNEED:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		/* No blocks; the data is in the inode. */
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+
+	size = inodeptr->sfi_size;
+	end = (len == 0 || len > size - pos) ? size : pos + len;
+	if (pos >= end) {
+		sfs_dinode_unload(sv);
+		return 0;
+	}
+	fileblock = pos / SFS_BLOCKSIZE;
+	limit = DIVROUNDUP(end, SFS_BLOCKSIZE);
+
+	if (advice == FADV_WILLNEED) {
+		(void)sfs_prefetch(sv, fileblock, limit);
+	}
+	else {
+		while (fileblock < limit) {
+			result = sfs_bmap_hole(sv, fileblock, &diskblock,
+					       &holespan);
+			if (result) {
+				break;
+			}
+			if (diskblock != 0) {
+				buffer_forget(&sfs->sfs_absfs, diskblock);
+				fileblock++;
+			}
+			else {
+				fileblock += holespan;
+			}
+		}
+	}
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// File data and the journal
+
+/* Most data blocks sfs_data_flushrun writes at once. */
+#define SFS_DATARUN		16
+
+/*
+ * How written data is handled depends on the volume's data mode
+ * (see sfs_jlog.c). Call sfs_data_prepare before changing a data
+ * buffer that holds the block's contents (one that was read, or
+ * freshly zeroed), and sfs_data_done instead of buffer_mark_dirty
+ * and buffer_release when finished with it. DIRTY says whether it
+ * was changed; FRESH, whether this write allocated the block.
+ */
+void
+sfs_data_prepare(struct sfs_fs *sfs, struct buf *buf)
+{
+	if (sfs->sfs_datamode == SFS_DATA_JOURNAL) {
+		sfs_jlog_prepare(sfs, buf);
+	}
+}
+
+void
+sfs_data_done(struct sfs_fs *sfs, struct buf *buf, daddr_t block,
+	      bool dirty, bool fresh)
+{
+	if (sfs->sfs_datamode == SFS_DATA_JOURNAL) {
+		if (dirty) {
+			sfs_jlog_dirty(sfs, buf, block);
+		}
+		sfs_jlog_forget(sfs, buf);
+		buffer_release(buf);
+		return;
+	}
+
+	if (dirty) {
+		buffer_mark_dirty(buf);
+	}
+	buffer_release(buf);
+	if (dirty && fresh) {
+		sfs_jlog_ordered(sfs, block);
+	}
+}
+
+/*
+ * Write out whatever of the COUNT data blocks at START is dirty, in
+ * as few writes as buffer_flush_run manages (SFS_DATARUN blocks at
+ * most per write), then anything it skipped singly.
+ */
+int
+sfs_data_flushrun(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	struct fs *fs = &sfs->sfs_absfs;
+	uint32_t num, j;
+	int result;
+
+	for (j=0; j<count; j += num) {
+		num = count - j;
+		if (num > SFS_DATARUN) {
+			num = SFS_DATARUN;
+		}
+		result = buffer_flush_run(fs, start + j, num, SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+	}
+	for (j=0; j<count; j++) {
+		result = buffer_flush(fs, start + j, SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Note that bytes POS through POS+LEN-1 of the file may have been
+ * changed, for fsync. Only the span covering everything changed
+ * since the last fsync is kept, which is exact for the usual
+ * append-then-fsync pattern and merely pessimistic otherwise.
+ *
+ * Locking: must hold vnode lock.
+ */
+void
+sfs_data_dirtied(struct sfs_vnode *sv, off_t pos, off_t len)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (len <= 0) {
+		return;
+	}
+	if (sv->sv_dirtystart >= sv->sv_dirtyend) {
+		sv->sv_dirtystart = pos;
+		sv->sv_dirtyend = pos + len;
+		return;
+	}
+	if (pos < sv->sv_dirtystart) {
+		sv->sv_dirtystart = pos;
+	}
+	if (pos + len > sv->sv_dirtyend) {
+		sv->sv_dirtyend = pos + len;
+	}
+}
+
+/*
+ * Write out the file's data changed since the last fsync (see
+ * sfs_data_dirtied), in runs where its blocks are contiguous on
+ * disk. In ordered mode blocks allocated by a write were already
+ * written before it committed, so for an append this is usually
+ * just the block that was partly filled before. Journaled data and
+ * inline data go out with the journal instead, so there's nothing
+ * to do for them.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 5 buffers (for sfs_bmap).
+ */
+int
+sfs_data_sync(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	off_t start, end;
+	uint32_t fileblock, lastblock, runlen;
+	daddr_t diskblock, runstart;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	start = sv->sv_dirtystart;
+	end = sv->sv_dirtyend;
+	if (start >= end || sfs->sfs_datamode == SFS_DATA_JOURNAL) {
+		sv->sv_dirtystart = sv->sv_dirtyend = 0;
+		return 0;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		end = 0;
+	}
+	else if (end > inodeptr->sfi_size) {
+		/* Past EOF there's nothing (left) to write */
+		end = inodeptr->sfi_size;
+	}
+
+	fileblock = start / SFS_BLOCKSIZE;
+	lastblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	runstart = 0;
+	runlen = 0;
+	result = 0;
+	for (; start < end && fileblock < lastblock; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result) {
+			break;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			result = sfs_data_flushrun(sfs, runstart, runlen);
+			if (result) {
+				break;
+			}
+		}
+		runstart = diskblock;
+		runlen = diskblock != 0 ? 1 : 0;
+	}
+	if (result == 0 && runlen > 0) {
+		result = sfs_data_flushrun(sfs, runstart, runlen);
+	}
+	sfs_dinode_unload(sv);
+
+	if (result == 0) {
+		/* Otherwise keep the range to try again next time */
+		sv->sv_dirtystart = sv->sv_dirtyend = 0;
+	}
+	return result;
+}
+
+/*
+ * Give back blocks allocated for a write that it didn't use.
+ */
+static
+void
+sfs_allocrun_cleanup(struct sfs_fs *sfs, struct sfs_allocrun *run)
+{
+	if (run->ar_count == 0) {
+		return;
+	}
+	sfs_lock_freemap(sfs);
+	while (run->ar_count > 0) {
+		sfs_bfree_prelocked(sfs, run->ar_next++);
+		run->ar_count--;
+	}
+	sfs_unlock_freemap(sfs);
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
  * we don't clobber the portion of the block we're not intending to
  * write over.
  *
+ * Except when what's there is known to be zeros: a block the write
+ * allocates, a preallocated block never written, or one lying wholly
+ * past EOF (as every block an append gets to does). Then the buffer
+ * is just cleared (sfs_clearblock) and nothing is read, so appending
+ * a little at a time doesn't cost a read per block. A block the
+ * write needs is allocated uncleared, as for whole blocks.
+ *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
  * UIO is the area to do the I/O into.
  *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
  * Requires up to 2 buffers.
  */
 static
@@ -196,10 +632,12 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_allocrun run;
 	struct buf *iobuffer;
 	char *ioptr;
 	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, holespan;
+	bool fresh = false;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
@@ -211,8 +649,27 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Get the disk block number, noting whether it holds zeros */
+	if (doalloc) {
+		result = sfs_bmap_markwritten(sv, fileblock, &fresh);
+		if (result == 0) {
+			run.ar_want = 1;
+			run.ar_count = 0;
+			run.ar_fresh = false;
+			result = sfs_bmap_run(sv, fileblock, &run, &diskblock);
+			fresh = fresh || run.ar_fresh;
+			sfs_allocrun_cleanup(sfs, &run);
+		}
+		if (result == 0 &&
+		    (off_t)fileblock * SFS_BLOCKSIZE >=
+		    sfs_dinode_map(sv)->sfi_size) {
+			/* the file doesn't have anything here yet */
+			fresh = true;
+		}
+	}
+	else {
+		result = sfs_bmap_hole(sv, fileblock, &diskblock, &holespan);
+	}
 	if (result) {
 		return result;
 	}
@@ -227,6 +684,13 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		KASSERT(uio->uio_rw == UIO_READ);
 		return uiomovezeros(len, uio);
 	}
+	else if (fresh) {
+		/* Start from zeros, not whatever's on disk */
+		result = sfs_clearblock(sfs, diskblock, &iobuffer);
+		if (result) {
+			return result;
+		}
+	}
 	else {
 		/*
 		 * Read the block.
@@ -241,72 +705,133 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_data_prepare(sfs, iobuffer);
+	}
 	ioptr = buffer_map(iobuffer);
 	result = uiomove(ioptr+skipstart, len, uio);
 	if (result) {
-		buffer_release(iobuffer);
+		/* The block is in the file now; the zeros must reach disk */
+		sfs_data_done(sfs, iobuffer, diskblock, fresh, fresh);
 		return result;
 	}
 
 	/*
 	 * If it was a write, mark the modified block dirty.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		buffer_mark_dirty(iobuffer);
-	}
-
-	buffer_release(iobuffer);
+	sfs_data_done(sfs, iobuffer, diskblock, uio->uio_rw == UIO_WRITE,
+		      fresh);
 	return 0;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Where a block of a file read or written in whole is, as found by
+ * sfs_blockmap: the disk block, or 0 for a hole (read only), and how
+ * many file blocks that covers (more than one only for a hole).
+ */
+struct sfs_iomap {
+	daddr_t im_block;
+	uint32_t im_count;
+	bool im_fresh;		/* allocated or first written by this I/O */
+};
+
+/* Most blocks sfs_blockrun maps before copying any of them. */
+#define SFS_IOBATCH		16
+
+/*
+ * Find the disk block for whole-block I/O at file block FILEBLOCK,
+ * for sfs_blockdata.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * When writing, a block that has to be allocated comes from RUN and
+ * isn't cleared first, as we're about to overwrite all of it; if
+ * that fails partway we clear it instead (see sfs_blockdata). A
+ * preallocated block that was never written is handled the same way.
  *
- * Requires up to 2 buffers.
+ * When reading a hole, up to MAXBLOCKS blocks of it are covered at
+ * once, as far as sfs_bmap_hole says it goes; so reading across a
+ * sparse region costs a lookup per empty subtree, not per block.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockmap(struct sfs_vnode *sv, enum uio_rw rw, uint32_t fileblock,
+	     struct sfs_allocrun *run, uint32_t maxblocks,
+	     struct sfs_iomap *im)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	struct buf *iobuf;
-	void *ioptr;
-	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t holespan = 1;
+	bool fresh = false;
 	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
-
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	KASSERT(maxblocks > 0);
+
+	if (rw == UIO_WRITE) {
+		/* A preallocated block never written counts as fresh */
+		result = sfs_bmap_markwritten(sv, fileblock, &fresh);
+		if (result == 0) {
+			result = sfs_bmap_run(sv, fileblock, run,
+					      &im->im_block);
+			fresh = fresh || run->ar_fresh;
+		}
+		run->ar_want--;
+	}
+	else {
+		result = sfs_bmap_hole(sv, fileblock, &im->im_block,
+				       &holespan);
+	}
 	if (result) {
 		return result;
 	}
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	/* sfs_bmap would have allocated a block if we were writing */
+	KASSERT(im->im_block != 0 || rw == UIO_READ);
+	if (im->im_block != 0) {
+		holespan = 1;
+	}
+	else if (holespan > maxblocks) {
+		holespan = maxblocks;
+	}
+	im->im_count = holespan;
+	im->im_fresh = fresh;
+	return 0;
+}
+
+/*
+ * Do I/O (either read or write) of the whole block(s) IM says are at
+ * the uio's offset. A hole reads as zeros.
+ *
+ * Since a buffer for a block being written may not have been read,
+ * it isn't prepared; in data-journal mode the whole block is logged.
+ *
+ * Locking: none needed, but whatever of the file IM covers must stay
+ * put: the caller holds at least the vnode lock or a range lock on
+ * it; see sfs_io.
+ *
+ * Requires up to 1 buffer.
+ */
+static
+int
+sfs_blockdata(struct sfs_fs *sfs, struct uio *uio, struct sfs_iomap *im)
+{
+	struct buf *iobuf;
+	void *ioptr;
+	int result;
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+
+	if (im->im_block == 0) {
+		/* No block - fill with zeros. */
+		return uiomovezeros(im->im_count * SFS_BLOCKSIZE, uio);
 	}
 
 	if (uio->uio_rw == UIO_READ) {
-		result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				     &iobuf);
+		result = buffer_read(&sfs->sfs_absfs, im->im_block,
+				     SFS_BLOCKSIZE, &iobuf);
 	}
 	else {
-		result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				    &iobuf);
+		result = buffer_get(&sfs->sfs_absfs, im->im_block,
+				    SFS_BLOCKSIZE, &iobuf);
 	}
 	if (result) {
 		return result;
@@ -318,34 +843,443 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	ioptr = buffer_map(iobuf);
 	result = uiomove(ioptr, SFS_BLOCKSIZE, uio);
 	if (result) {
-		buffer_release(iobuf);
+		if (im->im_fresh) {
+			bzero(ioptr, SFS_BLOCKSIZE);
+			buffer_mark_valid(iobuf);
+			sfs_data_done(sfs, iobuf, im->im_block, true, true);
+		}
+		else {
+			sfs_data_done(sfs, iobuf, im->im_block, false, false);
+		}
 		return result;
 	}
 
 	if (uio->uio_rw == UIO_WRITE) {
 		buffer_mark_valid(iobuf);
-		buffer_mark_dirty(iobuf);
+		sfs_data_done(sfs, iobuf, im->im_block, true, im->im_fresh);
+	}
+	else {
+		buffer_release(iobuf);
+	}
+	return 0;
+}
+
+/*
+ * Do I/O of a single whole block, or of up to MAXBLOCKS of a hole
+ * when reading.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, struct sfs_allocrun *run,
+	    uint32_t maxblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_iomap im;
+	int result;
+
+	result = sfs_blockmap(sv, uio->uio_rw, uio->uio_offset / SFS_BLOCKSIZE,
+			      run, maxblocks, &im);
+	if (result) {
+		return result;
+	}
+	return sfs_blockdata(sfs, uio, &im);
+}
+
+/*
+ * Do the whole blocks of a read or write, that is, all of the uio
+ * but a partial block at the end.
+ *
+ * If DROPLOCK, the vnode lock is let go while the data is copied,
+ * which is most of the time a big read or overwrite takes, and it's
+ * only held to map batches of up to SFS_IOBATCH blocks. The inode is
+ * unloaded meanwhile, as its buffer can't be left busy for whoever
+ * gets the lock next. This stops, for this batch and the rest, as
+ * soon as the caller's transaction logs something, as sfs_trans_end
+ * has to run with the vnode lock held throughout since then; so in
+ * practice it's only writes over blocks that are already there. If
+ * reloading the inode fails, *UNLOADED is set.
+ *
+ * Locking: must hold vnode lock; if DROPLOCK, also a range lock on
+ * the region, and the inode must be loaded exactly once. May
+ * get/release sfs_freemaplock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_blockrun(struct sfs_vnode *sv, struct uio *uio, struct sfs_allocrun *run,
+	     bool droplock, bool *unloaded)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_iomap maps[SFS_IOBATCH];
+	uint32_t fileblock, left, num, i;
+	int result, result2;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	while (uio->uio_resid >= SFS_BLOCKSIZE) {
+		fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+		left = uio->uio_resid / SFS_BLOCKSIZE;
+		result = 0;
+		num = 0;
+		while (num < SFS_IOBATCH && left > 0) {
+			result = sfs_blockmap(sv, uio->uio_rw, fileblock,
+					      run, left, &maps[num]);
+			if (result) {
+				break;
+			}
+			fileblock += maps[num].im_count;
+			left -= maps[num].im_count;
+			num++;
+			if (droplock && sfs_trans_logged(sfs)) {
+				droplock = false;
+			}
+			if (!droplock) {
+				/* one at a time, as before */
+				break;
+			}
+		}
+
+		if (droplock && num > 0) {
+			KASSERT(sv->sv_dinobufcount == 1);
+			sfs_dinode_unload(sv);
+			lock_release(sv->sv_lock);
+		}
+		result2 = 0;
+		for (i=0; i<num && result2 == 0; i++) {
+			result2 = sfs_blockdata(sfs, uio, &maps[i]);
+		}
+		if (result2) {
+			result = result2;
+		}
+		if (droplock && num > 0) {
+			lock_acquire(sv->sv_lock);
+			result2 = sfs_dinode_load(sv);
+			if (result2) {
+				*unloaded = true;
+				return result ? result : result2;
+			}
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read a run of COUNT disk blocks starting at START straight into the
+ * uio, which is at the file offset they hold.
+ */
+static
+int
+sfs_directrun(struct sfs_fs *sfs, struct uio *uio, daddr_t start,
+	      uint32_t count)
+{
+	off_t pos;
+	size_t resid, len, done;
+	int result;
+
+	/* Point the uio at the disk for the duration. */
+	pos = uio->uio_offset;
+	resid = uio->uio_resid;
+	len = count * SFS_BLOCKSIZE;
+	KASSERT(len <= resid);
+	uio->uio_offset = ((off_t)start)*SFS_BLOCKSIZE;
+	uio->uio_resid = len;
+
+	result = sfs_rwblock(sfs, uio);
+
+	done = len - uio->uio_resid;
+	uio->uio_offset = pos + done;
+	uio->uio_resid = resid - done;
+	return result;
+}
+
+/*
+ * Read NBLOCKS whole blocks for an O_DIRECT file without going through
+ * the buffer cache: each run of consecutive disk blocks is one device
+ * request into the caller's memory. Holes, and blocks the cache holds
+ * (which may be newer than the disk), go through sfs_blockio.
+ *
+ * Locking: must hold vnode lock, which keeps the blocks from being
+ * written meanwhile.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_directread(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks,
+	       struct sfs_allocrun *run)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock, start = 0;
+	uint32_t fileblock, holespan, i, count = 0;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	for (i=0; i<nblocks; i++) {
+		result = sfs_bmap_hole(sv, fileblock + i, &diskblock,
+				       &holespan);
+		if (result) {
+			return result;
+		}
+		if (diskblock != 0 &&
+		    !buffer_cached(&sfs->sfs_absfs, diskblock)) {
+			if (count > 0 && diskblock == start + count) {
+				count++;
+				continue;
+			}
+			if (count > 0) {
+				result = sfs_directrun(sfs, uio, start, count);
+				if (result) {
+					return result;
+				}
+			}
+			start = diskblock;
+			count = 1;
+			continue;
+		}
+
+		if (count > 0) {
+			result = sfs_directrun(sfs, uio, start, count);
+			if (result) {
+				return result;
+			}
+			count = 0;
+		}
+		result = sfs_blockio(sv, uio, run, 1);
+		if (result) {
+			return result;
+		}
+	}
+	if (count > 0) {
+		return sfs_directrun(sfs, uio, start, count);
 	}
-
-	buffer_release(iobuf);
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Inline data
+
+/*
+ * Small regular files keep their contents in the inode block itself
+ * (sfi_inline, flagged with SFS_IFLAG_INLINE; see kern/sfs.h), which
+ * saves a block and an I/O per file. An empty file becomes inline
+ * when first written, as long as the write fits; an inline file is
+ * moved out to an ordinary data block by sfs_inline_evict as soon as
+ * it would grow past SFS_INLINESIZE.
+ */
+
+/*
+ * Do I/O on an inline file. The caller has already clipped reads at
+ * EOF and checked that writes fit.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ */
+static
+int
+sfs_inlineio(struct sfs_vnode *sv, struct sfs_dinode *inodeptr,
+	     struct uio *uio)
+{
+	int result;
+
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE);
+
+	result = uiomove(inodeptr->sfi_inline + uio->uio_offset,
+			 uio->uio_resid, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_dinode_mark_dirty(sv);
+	}
+	return result;
+}
+
+/*
+ * Move an inline file's data out to block 0 of the file and clear
+ * the inline flag, so ordinary block I/O can take over.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_inline_evict(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	struct buf *iobuffer;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	KASSERT(inodeptr->sfi_flags & SFS_IFLAG_INLINE);
+	KASSERT(inodeptr->sfi_size <= SFS_INLINESIZE);
+
+	if (inodeptr->sfi_size > 0) {
+		/* This allocates a zeroed block */
+		result = sfs_bmap(sv, 0, true, &diskblock);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     SFS_BLOCKSIZE, &iobuffer);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+		sfs_data_prepare(sfs, iobuffer);
+		memcpy(buffer_map(iobuffer), inodeptr->sfi_inline,
+		       inodeptr->sfi_size);
+		sfs_data_done(sfs, iobuffer, diskblock, true, true);
+	}
+
+	bzero(inodeptr->sfi_inline, sizeof(inodeptr->sfi_inline));
+	inodeptr->sfi_flags &= ~SFS_IFLAG_INLINE;
+	sfs_dinode_mark_dirty(sv);
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Range locks
+
+/*
+ * Reads and writes of a file hold the byte range they cover, shared
+ * to read and exclusive to write, so the vnode lock needn't be held
+ * while their data is copied (see sfs_blockrun), only while the
+ * block map and inode are being looked at or changed.
+ *
+ * Whatever changes the file's size or unmaps its blocks holds all of
+ * the file exclusively: writes that go past EOF, truncate, punching
+ * holes, and preallocation. So while any range is held, sfi_size
+ * (and sv_size) stays put, and the blocks mapped under the range are
+ * the ones that are going to stay there.
+ *
+ * Ranges are granted in order: a request waits for those ahead of it
+ * on sv_ranges that it conflicts with, whether or not they've been
+ * granted yet, so a stream of readers can't starve a writer.
+ *
+ * Locking: range locks come before transactions and vnode locks.
+ */
+
+/*
+ * Check whether ranges A and B can't be held at the same time.
+ */
+static
+bool
+sfs_range_conflicts(const struct sfs_range *a, const struct sfs_range *b)
+{
+	if (!a->sr_excl && !b->sr_excl) {
+		return false;
+	}
+	return a->sr_start < b->sr_end && b->sr_start < a->sr_end;
+}
+
+/*
+ * Check whether SR has to wait for a range ahead of it.
+ */
+static
+bool
+sfs_range_blocked(struct sfs_vnode *sv, struct sfs_range *sr)
+{
+	struct sfs_range *other;
+
+	KASSERT(spinlock_do_i_hold(&sv->sv_rangelock));
+
+	LIST_FORALL(other, &sv->sv_ranges, sr_node) {
+		if (other == sr) {
+			return false;
+		}
+		if (sfs_range_conflicts(other, sr)) {
+			return true;
+		}
+	}
+	panic("sfs_range_blocked: range not on the list\n");
+}
+
+/*
+ * Lock bytes START through END-1 of the file, exclusively if EXCL,
+ * using SR for the state. END may be SFS_RANGE_ALL.
+ */
+void
+sfs_range_lock(struct sfs_vnode *sv, struct sfs_range *sr,
+	       off_t start, off_t end, bool excl)
+{
+	KASSERT(start >= 0 && start <= end);
+	KASSERT(!lock_do_i_hold(sv->sv_lock));
+
+	listnode_init(&sr->sr_node, sr);
+	sr->sr_start = start;
+	sr->sr_end = end;
+	sr->sr_excl = excl;
+
+	spinlock_acquire(&sv->sv_rangelock);
+	list_addtail(&sv->sv_ranges, &sr->sr_node);
+	while (sfs_range_blocked(sv, sr)) {
+		wchan_sleep(sv->sv_rangewchan, &sv->sv_rangelock);
+	}
+	spinlock_release(&sv->sv_rangelock);
+}
+
+/*
+ * Unlock the range held with SR.
+ */
+void
+sfs_range_unlock(struct sfs_vnode *sv, struct sfs_range *sr)
+{
+	spinlock_acquire(&sv->sv_rangelock);
+	list_remove(&sv->sv_ranges, &sr->sr_node);
+	wchan_wakeall(sv->sv_rangewchan, &sv->sv_rangelock);
+	spinlock_release(&sv->sv_rangelock);
+	listnode_cleanup(&sr->sr_node);
+}
+
+////////////////////////////////////////////////////////////
+// Main I/O path
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
+ * When writing, the whole blocks that aren't allocated yet are
+ * allocated together as far as possible (see sfs_balloc_range) so a
+ * large write gets laid out contiguously instead of one block at a
+ * time.
+ *
+ * If DROPLOCK, the vnode lock is released while copying whole blocks
+ * where that's safe (see sfs_blockrun), so non-overlapping I/O to
+ * the file can go on meanwhile. The caller must then hold a range
+ * lock on the region (shared to read, exclusive to write), not have
+ * the inode loaded, and, when writing, not be extending the file.
+ *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
  * Requires up to 3 buffers.
  */
 int
-sfs_io(struct sfs_vnode *sv, struct uio *uio)
+sfs_io(struct sfs_vnode *sv, struct uio *uio, bool droplock)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_allocrun run;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 	struct sfs_dinode *inodeptr;
+	bool unloaded = false;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
@@ -357,6 +1291,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/* Compressed files are stored plainly again before writing */
+	KASSERT(uio->uio_rw == UIO_READ ||
+		(inodeptr->sfi_flags & SFS_IFLAG_COMPRESSED) == 0);
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -379,6 +1317,38 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+			result = sfs_inlineio(sv, inodeptr, uio);
+			goto out;
+		}
+
+		if (!sv->sv_direct) {
+			sfs_readahead(sv, uio->uio_offset, uio->uio_resid,
+				      size);
+		}
+
+		if (inodeptr->sfi_flags & SFS_IFLAG_COMPRESSED) {
+			result = sfs_zread(sv, uio);
+			goto out;
+		}
+	}
+	else if (uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE &&
+		 ((inodeptr->sfi_flags & SFS_IFLAG_INLINE) ||
+		  (inodeptr->sfi_type == SFS_TYPE_FILE &&
+		   inodeptr->sfi_size == 0 &&
+		   !(inodeptr->sfi_flags & SFS_IFLAG_PREALLOC)))) {
+		/* Write that fits in the inode; an empty file has no blocks */
+		inodeptr->sfi_flags |= SFS_IFLAG_INLINE;
+		result = sfs_inlineio(sv, inodeptr, uio);
+		goto out;
+	}
+	else if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		/* Growing past what fits inline */
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
 	}
 
 	/*
@@ -414,11 +1384,25 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
-		if (result) {
-			goto out;
-		}
+	run.ar_want = nblocks;
+	run.ar_count = 0;
+	run.ar_fresh = false;
+	if (sv->sv_direct && uio->uio_rw == UIO_READ) {
+		result = sfs_directread(sv, uio, nblocks, &run);
+	}
+	else {
+		result = sfs_blockrun(sv, uio, &run, droplock, &unloaded);
+	}
+	sfs_allocrun_cleanup(sfs, &run);
+	if (unloaded) {
+		/* The inode can't be looked at; there's nothing to update */
+		KASSERT(result != 0);
+		uio->uio_resid += extraresid;
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	if (result) {
+		goto out;
 	}
 
 	/*
@@ -451,6 +1435,91 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Allocate the blocks under bytes POS through POS+LEN-1 of a file,
+ * for IOCTL_PREALLOC, and extend the file over them unless KEEPSIZE.
+ *
+ * Blocks at or past the file's unwritten mark (which starts at the
+ * end of file) are taken in runs, as for a large write, and not
+ * cleared: until something is written there they read as zeros (see
+ * sfs_bmap_hole and sfs_bmap_markwritten). So reserving space costs
+ * no data I/O. Holes before the mark get ordinary cleared blocks.
+ *
+ * Every block allocated is logged, so sfs_ioctl calls this a bounded
+ * piece at a time, each piece its own operation, with KEEPSIZE set
+ * for all but the last. A piece leaves the file consistent: its
+ * blocks are past the unwritten mark or cleared, whatever the size.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 5 buffers.
+ */
+int
+sfs_iprealloc(struct sfs_vnode *sv, off_t pos, off_t len, bool keepsize)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	struct sfs_allocrun run;
+	uint32_t fileblock, endblock;
+	daddr_t diskblock;
+	off_t end;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	end = pos + len;
+	if (end > (off_t)(uint32_t)-1) {
+		return EFBIG;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+
+	if (inodeptr->sfi_flags & SFS_IFLAG_INLINE) {
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
+	}
+	if (!(inodeptr->sfi_flags & SFS_IFLAG_PREALLOC)) {
+		inodeptr->sfi_flags |= SFS_IFLAG_PREALLOC;
+		inodeptr->sfi_unwritten = DIVROUNDUP(inodeptr->sfi_size,
+						     SFS_BLOCKSIZE);
+		sfs_dinode_mark_dirty(sv);
+	}
+
+	fileblock = pos / SFS_BLOCKSIZE;
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	run.ar_count = 0;
+	run.ar_fresh = false;
+	for (; fileblock < endblock; fileblock++) {
+		if (fileblock < inodeptr->sfi_unwritten) {
+			result = sfs_bmap(sv, fileblock, true, &diskblock);
+		}
+		else {
+			run.ar_want = endblock - fileblock;
+			result = sfs_bmap_run(sv, fileblock, &run,
+					      &diskblock);
+		}
+		if (result) {
+			break;
+		}
+	}
+	sfs_allocrun_cleanup(sfs, &run);
+
+	/* Running out partway keeps the blocks, but not the new size */
+	if (result == 0 && !keepsize && end > (off_t)inodeptr->sfi_size) {
+		inodeptr->sfi_size = end;
+		sfs_dinode_mark_dirty(sv);
+	}
+ out:
+	sfs_dinode_unload(sv);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -528,9 +1597,10 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		memcpy(data, ioptr + blockoffset, len);
 	}
 	else {
-		/* Update the selected region */
+		/* Update the selected region, journaling the change */
+		sfs_jlog_prepare(sfs, iobuf);
 		memcpy(ioptr + blockoffset, data, len);
-		buffer_mark_dirty(iobuf);
+		sfs_jlog_dirty(sfs, iobuf, diskblock);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -0,0 +1,2487 @@
+/*
+ * Copyright (c) 2014, 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <current.h>
+#include <thread.h>
+#include <cpu.h>
+#include <clock.h>
+#include <bitmap.h>
+#include <buf.h>
+#include <kstat.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Metadata journal.
+ *
+ * This is the client of the physical journal container in
+ * sfs_jphys.c. It logs every change to metadata, so that after a
+ * crash the volume can be brought back to a consistent state at
+ * mount time instead of depending on the order metadata buffers
+ * happen to reach the disk.
+ *
+ * The scheme is undo/redo logging:
+ *
+ *  - Each vnode operation is a transaction (sfs_trans_begin and
+ *    sfs_trans_end). Its TXBEGIN record is written lazily when it
+ *    logs its first change, and its LSN is the transaction id. It
+ *    commits when its TXEND record reaches the disk. TXEND is written
+ *    while the operation still holds its vnode locks, so rolling back
+ *    an operation that didn't commit can't undo changes that were
+ *    made after it by some other operation.
+ *
+ *  - Metadata buffers carry a shadow copy of what they looked like
+ *    when last logged (struct sfs_bufdata, as the fs-specific buffer
+ *    data). Code that is about to change a metadata buffer calls
+ *    sfs_jlog_prepare; code that has changed one calls sfs_jlog_dirty
+ *    instead of buffer_mark_dirty, which diffs the buffer against the
+ *    shadow and writes a META record for each changed range.
+ *
+ *  - File data is by default not journaled (except data stored
+ *    inline in the inode), since that would write it all twice, and
+ *    so its buffers still get clustered. Instead it's ordered: the
+ *    data blocks an operation allocated are written, in runs, just
+ *    before its TXEND (sfs_jlog_ordered), so a committed file never
+ *    points at a block holding something else's old contents.
+ *    Overwriting data already in the file changes no metadata and
+ *    needs no ordering. A volume mounted as "sfsdata" journals data
+ *    like metadata instead (see sfs_io.c), for durability of the data
+ *    itself at the cost of throughput.
+ *
+ *  - Allocations are logged as ALLOC records. Frees are logged as
+ *    FREE records, but the blocks aren't actually returned to the
+ *    freemap until the transaction commits; otherwise someone else
+ *    could reuse a block that rolling back the operation would then
+ *    need to have back.
+ *
+ *  - Write-ahead logging: each metadata buffer's write-ahead point
+ *    (buffer_set_walsn) is its last record, and the buffer cache
+ *    flushes the journal that far before writing it. Before the
+ *    freemap is written, the journal is flushed through the last
+ *    change to it.
+ *
+ *  - Checkpointing: the journal is trimmed to the oldest record that
+ *    might still be needed: the first record of any open transaction
+ *    and of any buffer not yet written back, and the oldest ALLOC or
+ *    FREE not yet in the on-disk freemap. A checkpoint thread per
+ *    volume keeps the tail moving: when more than a quarter of the
+ *    journal is in use, it writes back the buffers with the oldest
+ *    unwritten records, oldest first, and the freemap if that's what
+ *    is holding the tail, and then trims. Operations starting while
+ *    more than three quarters is in use wait for it to make room.
+ *
+ *  - Recovery (sfs_jlog_recover) replays every record forward, then
+ *    rolls back the transactions that never committed by applying the
+ *    old data of their records in reverse. Changes to a block logged
+ *    before a committed FREE of the block are not replayed, since the
+ *    block may since have been reused for file data. The journal is
+ *    read once, into a table of each block's records; since no
+ *    record touches more than one block, the blocks are then patched
+ *    by several threads at once.
+ *
+ *  - Long operations are split up, since an operation's records
+ *    can't be trimmed until it commits and one big enough would run
+ *    the journal head into the tail. Writes are done in pieces of
+ *    bounded size, each its own operation (see sfs_write), and so
+ *    are preallocation (sfs_ioctl) and the zeroing of preallocated
+ *    blocks a write skips over (sfs_bmap_advance). Truncates
+ *    and hole punches free blocks in steps (sfs_discard_steps) and
+ *    between steps call sfs_trans_split, which commits what has been
+ *    done so far once the transaction has logged more than
+ *    SFS_TXSPLIT and carries on in a new one. Each step leaves the
+ *    file consistent, just not yet as short as asked (or with the
+ *    hole not yet as big), so this is safe to commit.
+ *
+ * fsync and sync commit by flushing the journal through the latest
+ * TXEND with one sfs_jphys_flush call, so all the operations that
+ * finished since the last flush become durable with one journal
+ * write.
+ */
+
+/* Merge changed ranges separated by fewer unchanged bytes than this. */
+#define SFS_JLOG_GAP		12
+
+/* Buckets in the recovery block table; must be a power of 2. */
+#define SFS_RHASHSIZE		64
+
+/* Most threads patching blocks during recovery. */
+#define SFS_RTHREADS		8
+
+/* Buffers the checkpoint thread writes back between trims. */
+#define SFS_CPBATCH		16
+
+/* Most batches in one pass of the checkpoint thread. */
+#define SFS_CPMAXBATCHES	64
+
+/*
+ * Journal blocks in use (out of N) at which the checkpoint thread
+ * starts work, at which it stops, and at which new operations wait.
+ */
+#define SFS_CPSTART(n)		((n) / 4)
+#define SFS_CPTARGET(n)		((n) / 8)
+#define SFS_CPWAIT(n)		((n) / 4 * 3)
+
+/*
+ * Journal blocks in use at which new operations are throttled, if
+ * the journal odometer also shows more than SFS_CPAHEAD blocks used
+ * since the last checkpoint: writers are outrunning the checkpoint
+ * thread, so each waits for it to finish a batch.
+ */
+#define SFS_CPTHROTTLE(n)	((n) / 2)
+#define SFS_CPAHEAD(n)		((n) / 8)
+
+/*
+ * Journal blocks' worth of records a transaction can log before
+ * sfs_trans_split commits it.
+ */
+#define SFS_TXSPLIT(n)		((n) / 8)
+
+/*
+ * Journal state for a metadata buffer, hung off it as its fs-specific
+ * buffer data.
+ */
+struct sfs_bufdata {
+	char *bd_shadow;		/* contents as last logged, or NULL */
+	bool bd_zeroed;			/* shadow is a freshly zeroed block */
+	sfs_lsn_t bd_oldlsn;		/* first record not on disk, or 0 */
+	daddr_t bd_block;		/* block, once it has records */
+
+	/* list of buffers with unwritten records (bd_oldlsn != 0) */
+	struct sfs_bufdata *bd_prev;
+	struct sfs_bufdata *bd_next;
+};
+
+/*
+ * A run of blocks freed by an open transaction, or (in ordered data
+ * mode) of data blocks it allocated and wrote.
+ */
+struct sfs_txfree {
+	daddr_t tf_start;
+	uint32_t tf_count;
+};
+
+/* Most vnode commit LSNs one transaction updates (see sfs_trans_touch). */
+#define SFS_TXTOUCHED		8
+
+/*
+ * An open transaction. There is one per thread (and fs) at a time;
+ * nested begins (reclaim runs inside other operations) just count.
+ */
+struct sfs_trans {
+	struct thread *tx_thread;	/* thread running the operation */
+	unsigned tx_depth;		/* nesting depth */
+	sfs_lsn_t tx_id;		/* TXBEGIN LSN; 0 until written */
+	sfs_lsn_t tx_holdlsn;		/* tail held for dropped buffers */
+	size_t tx_logged;		/* bytes of records written */
+	struct sfs_txfree *tx_frees;	/* deferred frees */
+	unsigned tx_nfrees;
+	unsigned tx_maxfrees;
+	struct sfs_txfree *tx_data;	/* new data to write before TXEND */
+	unsigned tx_ndata;
+	unsigned tx_maxdata;
+	sfs_lsn_t *tx_touched[SFS_TXTOUCHED]; /* commit LSNs to update */
+	unsigned tx_ntouched;
+	struct sfs_trans *tx_next;	/* list of open transactions */
+};
+
+/*
+ * Per-volume journaling state.
+ */
+struct sfs_jlog {
+	struct spinlock jl_lock;	/* lock for the following */
+	struct sfs_trans *jl_txs;	/* open transactions */
+	struct sfs_bufdata *jl_unwritten; /* buffers with unwritten records */
+	sfs_lsn_t jl_freemaplsn;	/* oldest change not in disk freemap */
+	sfs_lsn_t jl_freemapnewlsn;	/* latest change not in disk freemap */
+	sfs_lsn_t jl_lastcommit;	/* latest TXEND */
+	uint64_t jl_ntxends;		/* TXENDs written */
+	uint64_t jl_committxends;	/* jl_ntxends at the last commit */
+	uint64_t jl_ncommitted;		/* TXENDs covered by commits */
+	unsigned jl_ncommits;		/* commits that covered any */
+	unsigned jl_nsplits;		/* transactions sfs_trans_split ended */
+	struct timespec jl_statstart;	/* when the counts were zeroed */
+
+	struct lock *jl_cplock;		/* lock for checkpointing */
+	sfs_lsn_t jl_taillsn;		/* tail at the last checkpoint */
+
+	struct lock *jl_cpthreadlock;	/* lock for the following */
+	struct cv *jl_cpcv;		/* to wake the checkpoint thread */
+	struct cv *jl_spacecv;		/* to wait for journal space */
+	bool jl_cprunning;		/* checkpoint thread exists */
+	bool jl_cpwanted;		/* checkpoint thread has work */
+	bool jl_cpquit;			/* checkpoint thread should exit */
+	unsigned jl_cppasses;		/* passes finished, for waiters */
+	unsigned jl_cpprogress;		/* batches and passes finished */
+	unsigned jl_nthrottles;		/* operations throttled */
+	unsigned jl_nspacewaits;	/* operations that waited for room */
+};
+
+/*
+ * What to note when a record gets its LSN. This is handed to
+ * sfs_jphys_write, which calls sfs_jlog_wrote with it while holding
+ * the journal lock; so the LSN is noted before anyone checkpointing
+ * can see a later next-LSN and trim the record away.
+ */
+struct sfs_jphys_writecontext {
+	struct sfs_trans *wc_begin;	/* TXBEGIN for this transaction */
+	struct sfs_bufdata *wc_bd;	/* META for this buffer */
+	daddr_t wc_block;		/* ...which is in this block */
+	bool wc_freemap;		/* ALLOC or FREE */
+	bool wc_commit;			/* TXEND */
+};
+
+static struct sfs_trans *sfs_trans_current(struct sfs_fs *sfs);
+static void sfs_jlog_makeroom(struct sfs_fs *sfs);
+static void sfs_jlog_wakecp(struct sfs_fs *sfs);
+
+////////////////////////////////////////////////////////////
+// record writing
+
+/*
+ * Write callback for sfs_jphys_write.
+ */
+static
+void
+sfs_jlog_wrote(struct sfs_fs *sfs, sfs_lsn_t lsn,
+	       struct sfs_jphys_writecontext *ctx)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_bufdata *bd;
+
+	spinlock_acquire(&jl->jl_lock);
+	if (ctx->wc_begin != NULL) {
+		KASSERT(ctx->wc_begin->tx_id == 0);
+		ctx->wc_begin->tx_id = lsn;
+	}
+	bd = ctx->wc_bd;
+	if (bd != NULL) {
+		if (bd->bd_oldlsn == 0) {
+			bd->bd_oldlsn = lsn;
+			bd->bd_block = ctx->wc_block;
+			bd->bd_prev = NULL;
+			bd->bd_next = jl->jl_unwritten;
+			if (bd->bd_next != NULL) {
+				bd->bd_next->bd_prev = bd;
+			}
+			jl->jl_unwritten = bd;
+		}
+	}
+	if (ctx->wc_freemap) {
+		if (jl->jl_freemaplsn == 0) {
+			jl->jl_freemaplsn = lsn;
+		}
+		jl->jl_freemapnewlsn = lsn;
+	}
+	if (ctx->wc_commit) {
+		jl->jl_lastcommit = lsn;
+		jl->jl_ntxends++;
+	}
+	spinlock_release(&jl->jl_lock);
+}
+
+/*
+ * Write a record, counting it against the current transaction.
+ * Returns its LSN.
+ */
+static
+sfs_lsn_t
+sfs_jlog_write(struct sfs_fs *sfs, struct sfs_jphys_writecontext *ctx,
+	       unsigned type, const void *rec, size_t len)
+{
+	struct sfs_trans *tx;
+
+	tx = sfs_trans_current(sfs);
+	if (tx != NULL) {
+		tx->tx_logged += len;
+	}
+	return sfs_jphys_write(sfs, sfs_jlog_wrote, ctx, type, rec, len);
+}
+
+/*
+ * Initialize a write context.
+ */
+static
+void
+sfs_jlog_ctx(struct sfs_jphys_writecontext *ctx)
+{
+	ctx->wc_begin = NULL;
+	ctx->wc_bd = NULL;
+	ctx->wc_block = 0;
+	ctx->wc_freemap = false;
+	ctx->wc_commit = false;
+}
+
+////////////////////////////////////////////////////////////
+// transactions
+
+/*
+ * Find the current thread's open transaction, if any. Only the
+ * owning thread adds or removes its transaction, so the result stays
+ * valid after the lock is dropped.
+ */
+static
+struct sfs_trans *
+sfs_trans_current(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+
+	spinlock_acquire(&jl->jl_lock);
+	for (tx = jl->jl_txs; tx != NULL; tx = tx->tx_next) {
+		if (tx->tx_thread == curthread) {
+			break;
+		}
+	}
+	spinlock_release(&jl->jl_lock);
+	return tx;
+}
+
+/*
+ * Get the id to put in a record: that of the current transaction,
+ * writing its TXBEGIN first if this is its first record, or 0 if
+ * there isn't one.
+ */
+static
+uint64_t
+sfs_trans_getid(struct sfs_fs *sfs, struct sfs_trans *tx)
+{
+	struct sfs_jphys_writecontext ctx;
+	struct sfs_jrec_tx rec;
+
+	if (tx == NULL) {
+		return 0;
+	}
+	if (tx->tx_id == 0) {
+		sfs_jlog_ctx(&ctx);
+		ctx.wc_begin = tx;
+		rec.jx_txid = 0;
+		sfs_jlog_write(sfs, &ctx, SFS_JREC_TXBEGIN, &rec, sizeof(rec));
+		KASSERT(tx->tx_id != 0);
+	}
+	return tx->tx_id;
+}
+
+/*
+ * Start a transaction, or a nested one.
+ */
+static
+void
+sfs_trans_enter(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+
+	tx = sfs_trans_current(sfs);
+	if (tx != NULL) {
+		tx->tx_depth++;
+		return;
+	}
+
+	tx = kmalloc(sizeof(*tx));
+	if (tx == NULL) {
+		/*
+		 * Carry on anyway; the changes are logged as if they
+		 * weren't part of an operation and replayed at
+		 * recovery, but can't be rolled back.
+		 */
+		return;
+	}
+	tx->tx_thread = curthread;
+	tx->tx_depth = 0;
+	tx->tx_id = 0;
+	tx->tx_holdlsn = 0;
+	tx->tx_logged = 0;
+	tx->tx_frees = NULL;
+	tx->tx_nfrees = 0;
+	tx->tx_maxfrees = 0;
+	tx->tx_data = NULL;
+	tx->tx_ndata = 0;
+	tx->tx_maxdata = 0;
+	tx->tx_ntouched = 0;
+
+	spinlock_acquire(&jl->jl_lock);
+	tx->tx_next = jl->jl_txs;
+	jl->jl_txs = tx;
+	spinlock_release(&jl->jl_lock);
+}
+
+/*
+ * Begin an operation. Call this at the very start, before taking any
+ * vnode locks: if the journal is filling up this waits for the
+ * checkpoint thread to make room.
+ */
+void
+sfs_trans_begin(struct sfs_fs *sfs)
+{
+	if (sfs_trans_current(sfs) == NULL) {
+		sfs_jlog_makeroom(sfs);
+	}
+	sfs_trans_enter(sfs);
+}
+
+/*
+ * Begin an operation from a context that may already hold locks
+ * (reclaim, which can be reached from any VOP_DECREF). This never
+ * checkpoints.
+ */
+void
+sfs_trans_begin_locked(struct sfs_fs *sfs)
+{
+	sfs_trans_enter(sfs);
+}
+
+/*
+ * Write the data blocks transaction TX allocated (see
+ * sfs_jlog_ordered).
+ */
+static
+void
+sfs_trans_flushdata(struct sfs_fs *sfs, struct sfs_trans *tx)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<tx->tx_ndata; i++) {
+		result = sfs_data_flushrun(sfs, tx->tx_data[i].tf_start,
+					   tx->tx_data[i].tf_count);
+		if (result) {
+			/*
+			 * Commit anyway; the metadata is consistent,
+			 * and the block that failed is garbage either
+			 * way.
+			 */
+			kprintf("sfs: %s: writing data before commit: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+			result = 0;
+		}
+	}
+}
+
+/*
+ * End an operation: write its new data blocks, then its TXEND, and
+ * give back the blocks it freed. Must be called before releasing the
+ * vnode locks the operation used. If there's no open transaction
+ * this does nothing, so error paths can call it again after a commit.
+ */
+void
+sfs_trans_end(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_jphys_writecontext ctx;
+	struct sfs_jrec_tx rec;
+	struct sfs_trans *tx, **txp;
+	sfs_lsn_t lsn;
+	unsigned i;
+
+	tx = sfs_trans_current(sfs);
+	if (tx == NULL) {
+		return;
+	}
+	if (tx->tx_depth > 0) {
+		tx->tx_depth--;
+		return;
+	}
+
+	if (tx->tx_ndata > 0) {
+		sfs_trans_flushdata(sfs, tx);
+	}
+
+	if (tx->tx_id != 0) {
+		sfs_jlog_ctx(&ctx);
+		ctx.wc_commit = true;
+		rec.jx_txid = tx->tx_id;
+		lsn = sfs_jlog_write(sfs, &ctx, SFS_JREC_TXEND,
+				     &rec, sizeof(rec));
+
+		spinlock_acquire(&jl->jl_lock);
+		for (i=0; i<tx->tx_ntouched; i++) {
+			if (tx->tx_touched[i] != NULL &&
+			    *tx->tx_touched[i] < lsn) {
+				*tx->tx_touched[i] = lsn;
+			}
+		}
+		spinlock_release(&jl->jl_lock);
+	}
+
+	if (tx->tx_nfrees > 0) {
+		KASSERT(tx->tx_id != 0);
+		lock_acquire(sfs->sfs_freemaplock);
+		for (i=0; i<tx->tx_nfrees; i++) {
+			bitmap_unmark_range(sfs->sfs_freemap,
+					    tx->tx_frees[i].tf_start,
+					    tx->tx_frees[i].tf_count);
+			sfs_freemap_dirtied(sfs, tx->tx_frees[i].tf_start,
+					    tx->tx_frees[i].tf_count);
+		}
+		/*
+		 * The FREE records are needed until the freemap is
+		 * written, and the freemap can't be written before
+		 * the TXEND is on disk.
+		 */
+		spinlock_acquire(&jl->jl_lock);
+		if (jl->jl_freemaplsn == 0 || jl->jl_freemaplsn > tx->tx_id) {
+			jl->jl_freemaplsn = tx->tx_id;
+		}
+		if (jl->jl_freemapnewlsn < jl->jl_lastcommit) {
+			jl->jl_freemapnewlsn = jl->jl_lastcommit;
+		}
+		spinlock_release(&jl->jl_lock);
+		lock_release(sfs->sfs_freemaplock);
+	}
+
+	spinlock_acquire(&jl->jl_lock);
+	for (txp = &jl->jl_txs; *txp != tx; txp = &(*txp)->tx_next) {
+		KASSERT(*txp != NULL);
+	}
+	*txp = tx->tx_next;
+	spinlock_release(&jl->jl_lock);
+
+	if (tx->tx_frees != NULL) {
+		kfree(tx->tx_frees);
+	}
+	if (tx->tx_data != NULL) {
+		kfree(tx->tx_data);
+	}
+	kfree(tx);
+}
+
+/*
+ * Called by a long operation between steps, at a point where what it
+ * has done so far leaves the volume consistent, holding no buffers
+ * but HELD (its inode's, or NULL) and not the freemap lock. If the
+ * current transaction has logged more than SFS_TXSPLIT, commit it
+ * and carry on in a new one, so the records can be trimmed. A nested
+ * transaction is left alone, as the operation outside it may be in
+ * the middle of a change.
+ *
+ * This can't wait for the checkpoint thread as sfs_trans_begin does,
+ * since the caller holds vnode locks that other operations holding
+ * buffers the thread wants may be waiting for. Instead, if the
+ * journal is filling up, wake the thread and write out HELD, which
+ * it can't get at; past SFS_CPWAIT, also write the freemap (which
+ * the freed blocks' records are waiting on) and trim here.
+ */
+void
+sfs_trans_split(struct sfs_fs *sfs, struct buf *held)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+	uint32_t nblocks, usage;
+	int result;
+
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	tx = sfs_trans_current(sfs);
+	if (tx == NULL || tx->tx_depth > 0 ||
+	    tx->tx_logged <= SFS_TXSPLIT(nblocks) * SFS_BLOCKSIZE) {
+		return;
+	}
+	sfs_trans_end(sfs);
+
+	spinlock_acquire(&jl->jl_lock);
+	jl->jl_nsplits++;
+	spinlock_release(&jl->jl_lock);
+
+	usage = sfs_jphys_getusage(sfs);
+	if (usage > SFS_CPSTART(nblocks)) {
+		sfs_jlog_wakecp(sfs);
+		if (held != NULL) {
+			result = buffer_writeout(held);
+			if (result) {
+				kprintf("sfs: %s: split: writing inode: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+			}
+		}
+	}
+	if (usage > SFS_CPWAIT(nblocks)) {
+		result = sfs_sync_freemap(sfs);
+		if (result) {
+			kprintf("sfs: %s: split: freemap: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
+		else {
+			sfs_jlog_checkpoint(sfs);
+		}
+	}
+
+	sfs_trans_enter(sfs);
+}
+
+/*
+ * Add the run of COUNT blocks at START to one of a transaction's
+ * lists of runs (*RUNS, *NUM long with room for *MAX), extending
+ * the last run if the new one follows it. Returns false if out of
+ * memory.
+ */
+static
+bool
+sfs_trans_addrun(struct sfs_txfree **runs, unsigned *num, unsigned *max,
+		 daddr_t start, uint32_t count)
+{
+	struct sfs_txfree *newruns;
+	unsigned newmax;
+
+	if (*num > 0) {
+		struct sfs_txfree *last = &(*runs)[*num - 1];
+
+		if (last->tf_start + last->tf_count == start) {
+			last->tf_count += count;
+			return true;
+		}
+	}
+
+	if (*num == *max) {
+		newmax = *max == 0 ? 8 : *max * 2;
+		newruns = kmalloc(newmax * sizeof(*newruns));
+		if (newruns == NULL) {
+			return false;
+		}
+		if (*runs != NULL) {
+			memcpy(newruns, *runs, *num * sizeof(*newruns));
+			kfree(*runs);
+		}
+		*runs = newruns;
+		*max = newmax;
+	}
+
+	(*runs)[*num].tf_start = start;
+	(*runs)[*num].tf_count = count;
+	(*num)++;
+	return true;
+}
+
+/*
+ * In ordered data mode, file data isn't journaled; instead, a data
+ * block the current operation allocated must reach the disk before
+ * the operation commits, or after a crash the file could show
+ * whatever was in the block before. Call after changing and
+ * releasing the buffer for such a block. The writes are put off
+ * until sfs_trans_end, so a run of them can be clustered.
+ */
+void
+sfs_jlog_ordered(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_trans *tx;
+
+	KASSERT(sfs->sfs_datamode == SFS_DATA_ORDERED);
+
+	tx = sfs_trans_current(sfs);
+	if (tx != NULL &&
+	    sfs_trans_addrun(&tx->tx_data, &tx->tx_ndata, &tx->tx_maxdata,
+			     block, 1)) {
+		return;
+	}
+	/* No transaction to wait for, or out of memory: write it now */
+	(void)buffer_flush(&sfs->sfs_absfs, block, SFS_BLOCKSIZE);
+}
+
+/*
+ * Check whether the current operation has logged anything yet: a
+ * record, a free, or a new data block to write before its TXEND.
+ * Until it has, the vnode locks it holds aren't protecting any of
+ * its own changes, so sfs_io can let go of one for a while.
+ */
+bool
+sfs_trans_logged(struct sfs_fs *sfs)
+{
+	struct sfs_trans *tx;
+
+	tx = sfs_trans_current(sfs);
+	if (tx == NULL) {
+		return false;
+	}
+	return tx->tx_id != 0 || tx->tx_nfrees > 0 || tx->tx_ndata > 0;
+}
+
+/*
+ * Each vnode keeps a commit LSN (sv_commitlsn): the journal must be
+ * on disk through it for the file's metadata to be durable, so fsync
+ * needn't flush past it. Call sfs_trans_touch with a pointer to it
+ * when an operation changes the file; the operation's TXEND LSN is
+ * stored there once written. It's 0 if nothing is pending. If a
+ * transaction runs out of room to note it, it becomes
+ * SFS_LSN_UNKNOWN (which sorts after every real LSN) for good, and
+ * fsync of that file commits everything, as it used to; SFS_TXTOUCHED
+ * is big enough that rename, which touches the most, doesn't.
+ * Vnodes start with the latest TXEND as of when they're loaded,
+ * which covers anything done to the file before.
+ *
+ * The commit LSNs are protected by jl_lock.
+ */
+void
+sfs_trans_touch(struct sfs_fs *sfs, sfs_lsn_t *lsnp)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+	unsigned i;
+
+	tx = sfs_trans_current(sfs);
+	if (tx != NULL) {
+		for (i=0; i<tx->tx_ntouched; i++) {
+			if (tx->tx_touched[i] == lsnp) {
+				return;
+			}
+		}
+		if (tx->tx_ntouched < SFS_TXTOUCHED) {
+			tx->tx_touched[tx->tx_ntouched++] = lsnp;
+			return;
+		}
+	}
+	/* Nowhere to note it; be pessimistic */
+	spinlock_acquire(&jl->jl_lock);
+	*lsnp = SFS_LSN_UNKNOWN;
+	spinlock_release(&jl->jl_lock);
+}
+
+/*
+ * Get the commit LSN for a vnode being loaded.
+ */
+sfs_lsn_t
+sfs_trans_loadlsn(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	sfs_lsn_t lsn;
+
+	spinlock_acquire(&jl->jl_lock);
+	lsn = jl->jl_lastcommit;
+	spinlock_release(&jl->jl_lock);
+	return lsn;
+}
+
+/*
+ * Forget a commit LSN that's about to be freed (by reclaim). Another
+ * thread's transaction may still have it: operations can drop their
+ * references to a vnode before they end.
+ */
+void
+sfs_trans_untouch(struct sfs_fs *sfs, sfs_lsn_t *lsnp)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+	unsigned i;
+
+	spinlock_acquire(&jl->jl_lock);
+	for (tx = jl->jl_txs; tx != NULL; tx = tx->tx_next) {
+		for (i=0; i<tx->tx_ntouched; i++) {
+			if (tx->tx_touched[i] == lsnp) {
+				tx->tx_touched[i] = NULL;
+			}
+		}
+	}
+	spinlock_release(&jl->jl_lock);
+}
+
+////////////////////////////////////////////////////////////
+// freemap changes
+
+/*
+ * Log the allocation of COUNT blocks starting at START. Call with
+ * the freemap locked, right after marking them.
+ */
+void
+sfs_jlog_alloc(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	struct sfs_jphys_writecontext ctx;
+	struct sfs_jrec_blocks rec;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	sfs_jlog_ctx(&ctx);
+	ctx.wc_freemap = true;
+	rec.jb_txid = sfs_trans_getid(sfs, sfs_trans_current(sfs));
+	rec.jb_start = start;
+	rec.jb_count = count;
+	sfs_jlog_write(sfs, &ctx, SFS_JREC_ALLOC, &rec, sizeof(rec));
+}
+
+/*
+ * Log freeing COUNT blocks starting at START. Call with the freemap
+ * locked, instead of unmarking them. Returns true if the free has
+ * been put off until the current transaction commits; false if the
+ * caller should unmark the blocks now.
+ */
+bool
+sfs_jlog_free(struct sfs_fs *sfs, daddr_t start, uint32_t count)
+{
+	struct sfs_jphys_writecontext ctx;
+	struct sfs_jrec_blocks rec;
+	struct sfs_trans *tx;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	tx = sfs_trans_current(sfs);
+
+	sfs_jlog_ctx(&ctx);
+	ctx.wc_freemap = true;
+	rec.jb_txid = sfs_trans_getid(sfs, tx);
+	rec.jb_start = start;
+	rec.jb_count = count;
+
+	if (tx == NULL) {
+		sfs_jlog_write(sfs, &ctx, SFS_JREC_FREE, &rec, sizeof(rec));
+		return false;
+	}
+
+	/* Truncate frees in order, so runs usually just get longer. */
+	if (!sfs_trans_addrun(&tx->tx_frees, &tx->tx_nfrees,
+			      &tx->tx_maxfrees, start, count)) {
+		/*
+		 * Free them now. This is only unsafe if we crash
+		 * before committing and someone else has reused them
+		 * by then, so make the record say so: it then counts
+		 * as committed at recovery.
+		 */
+		rec.jb_txid = 0;
+		sfs_jlog_write(sfs, &ctx, SFS_JREC_FREE, &rec, sizeof(rec));
+		return false;
+	}
+
+	sfs_jlog_write(sfs, &ctx, SFS_JREC_FREE, &rec, sizeof(rec));
+	return true;
+}
+
+/*
+ * The freemap is about to be written; the journal records for the
+ * changes to it must get there first. Call with the freemap locked,
+ * so no more can be made.
+ */
+int
+sfs_jlog_prefreemap(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	sfs_lsn_t lsn;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	spinlock_acquire(&jl->jl_lock);
+	lsn = jl->jl_freemapnewlsn;
+	spinlock_release(&jl->jl_lock);
+
+	return lsn == 0 ? 0 : sfs_jphys_flush(sfs, lsn);
+}
+
+/*
+ * The freemap has been written. Since changes are only logged with
+ * the freemap locked, it now contains all of them.
+ */
+void
+sfs_jlog_postfreemap(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	spinlock_acquire(&jl->jl_lock);
+	jl->jl_freemaplsn = 0;
+	jl->jl_freemapnewlsn = 0;
+	spinlock_release(&jl->jl_lock);
+}
+
+////////////////////////////////////////////////////////////
+// metadata buffers
+
+/*
+ * Check if a block is all zeros.
+ */
+static
+bool
+sfs_jlog_iszero(const char *data)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		if (data[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Get ready to change the metadata buffer BUF: make sure it has a
+ * shadow copy to diff against. If the buffer is clean, its contents
+ * are what's on disk. If it's dirty and has no shadow it was just
+ * zeroed by sfs_balloc (nothing else dirties a metadata buffer
+ * without logging it) and the first record will say so.
+ *
+ * If we run out of memory, there's no shadow and sfs_jlog_dirty
+ * logs the whole block.
+ */
+void
+sfs_jlog_prepare(struct sfs_fs *sfs, struct buf *buf)
+{
+	struct sfs_bufdata *bd;
+	char *data;
+
+	(void)sfs;
+
+	bd = buffer_get_fsdata(buf);
+	if (bd != NULL && bd->bd_shadow != NULL) {
+		return;
+	}
+	if (bd == NULL) {
+		bd = kmalloc(sizeof(*bd));
+		if (bd == NULL) {
+			return;
+		}
+		bd->bd_shadow = NULL;
+		bd->bd_zeroed = false;
+		bd->bd_oldlsn = 0;
+		bd->bd_block = 0;
+		bd->bd_prev = bd->bd_next = NULL;
+		buffer_set_fsdata(buf, bd);
+	}
+	bd->bd_shadow = kmalloc(SFS_BLOCKSIZE);
+	if (bd->bd_shadow == NULL) {
+		return;
+	}
+	data = buffer_map(buf);
+	memcpy(bd->bd_shadow, data, SFS_BLOCKSIZE);
+	bd->bd_zeroed = buffer_is_dirty(buf) && sfs_jlog_iszero(data);
+}
+
+/*
+ * Done with BUF for now; if it's clean, drop the shadow copy so
+ * buffers that are only read don't keep one.
+ */
+void
+sfs_jlog_forget(struct sfs_fs *sfs, struct buf *buf)
+{
+	struct sfs_bufdata *bd;
+
+	(void)sfs;
+
+	bd = buffer_get_fsdata(buf);
+	if (bd != NULL && bd->bd_shadow != NULL && !buffer_is_dirty(buf)) {
+		kfree(bd->bd_shadow);
+		bd->bd_shadow = NULL;
+	}
+}
+
+/*
+ * The block in BUF is being cleared for reuse (by sfs_balloc); any
+ * shadow is of its previous life, so drop it. The next
+ * sfs_jlog_prepare will see a freshly zeroed block.
+ */
+void
+sfs_jlog_reset(struct sfs_fs *sfs, struct buf *buf)
+{
+	struct sfs_bufdata *bd;
+
+	(void)sfs;
+
+	bd = buffer_get_fsdata(buf);
+	if (bd != NULL && bd->bd_shadow != NULL) {
+		kfree(bd->bd_shadow);
+		bd->bd_shadow = NULL;
+	}
+}
+
+/*
+ * Write a META record for LEN bytes at OFFSET in the buffer with
+ * journal state BD (which is in block BLOCK). Returns its LSN.
+ */
+static
+sfs_lsn_t
+sfs_jlog_meta(struct sfs_fs *sfs, struct sfs_bufdata *bd, daddr_t block,
+	      uint64_t txid, unsigned offset, unsigned len,
+	      const char *olddata, const char *newdata, unsigned flags)
+{
+	struct {
+		struct sfs_jrec_meta jm;
+		char data[2 * SFS_JMETA_MAXLEN];
+	} rec;
+	struct sfs_jphys_writecontext ctx;
+
+	KASSERT(len > 0 && len <= SFS_JMETA_MAXLEN);
+	KASSERT(offset + len <= SFS_BLOCKSIZE);
+
+	sfs_jlog_ctx(&ctx);
+	ctx.wc_bd = bd;
+	ctx.wc_block = block;
+	rec.jm.jm_txid = txid;
+	rec.jm.jm_block = block;
+	rec.jm.jm_offset = offset;
+	rec.jm.jm_len = len;
+	rec.jm.jm_flags = flags;
+	rec.jm.jm_unused = 0;
+	memcpy(rec.data, olddata, len);
+	memcpy(rec.data + len, newdata, len);
+	return sfs_jlog_write(sfs, &ctx, SFS_JREC_META, &rec,
+			      sizeof(rec.jm) + 2 * len);
+}
+
+/*
+ * Log the changes made to the metadata buffer BUF (for block BLOCK)
+ * since it was last logged, and mark it dirty. Use this instead of
+ * buffer_mark_dirty for metadata. The buffer's write-ahead point
+ * becomes the last record written.
+ */
+void
+sfs_jlog_dirty(struct sfs_fs *sfs, struct buf *buf, daddr_t block)
+{
+	struct sfs_bufdata *bd;
+	uint64_t txid;
+	sfs_lsn_t lsn;
+	char *data, *shadow;
+	unsigned pos, start, end, flags;
+
+	data = buffer_map(buf);
+	bd = buffer_get_fsdata(buf);
+	if (bd == NULL || bd->bd_shadow == NULL) {
+		/*
+		 * No shadow (not prepared, or out of memory). Log the
+		 * whole block, with its current contents as the old
+		 * data too: replay works, but rolling back doesn't.
+		 */
+		sfs_jlog_prepare(sfs, buf);
+		bd = buffer_get_fsdata(buf);
+		txid = sfs_trans_getid(sfs, sfs_trans_current(sfs));
+		lsn = 0;
+		for (pos = 0; pos < SFS_BLOCKSIZE; pos += SFS_JMETA_MAXLEN) {
+			end = pos + SFS_JMETA_MAXLEN;
+			if (end > SFS_BLOCKSIZE) {
+				end = SFS_BLOCKSIZE;
+			}
+			lsn = sfs_jlog_meta(sfs, bd, block, txid,
+					    pos, end - pos,
+					    data + pos, data + pos, 0);
+		}
+		if (bd != NULL && bd->bd_shadow != NULL) {
+			bd->bd_zeroed = false;
+		}
+		buffer_set_walsn(buf, lsn);
+		buffer_mark_dirty(buf);
+		return;
+	}
+
+	shadow = bd->bd_shadow;
+	txid = 0;
+	pos = 0;
+	while (pos < SFS_BLOCKSIZE) {
+		/* Find the next changed byte */
+		while (pos < SFS_BLOCKSIZE && data[pos] == shadow[pos]) {
+			pos++;
+		}
+		if (pos == SFS_BLOCKSIZE) {
+			break;
+		}
+
+		/* Find the end of the change, absorbing small gaps */
+		start = pos;
+		end = pos + 1;
+		for (pos = end; pos < SFS_BLOCKSIZE &&
+			     pos - start < SFS_JMETA_MAXLEN; pos++) {
+			if (data[pos] != shadow[pos]) {
+				end = pos + 1;
+			}
+			else if (pos - end >= SFS_JLOG_GAP) {
+				break;
+			}
+		}
+
+		if (txid == 0) {
+			txid = sfs_trans_getid(sfs, sfs_trans_current(sfs));
+		}
+		flags = bd->bd_zeroed ? SFS_JMETA_ZERO : 0;
+		lsn = sfs_jlog_meta(sfs, bd, block, txid, start,
+				    end - start, shadow + start,
+				    data + start, flags);
+		buffer_set_walsn(buf, lsn);
+		bd->bd_zeroed = false;
+		memcpy(shadow + start, data + start, end - start);
+		pos = end;
+	}
+
+	buffer_mark_dirty(buf);
+}
+
+/*
+ * A buffer has been written. Its records are no longer needed to
+ * bring the block up to date. Keep the shadow, though: whoever holds
+ * the buffer (it may be written by buffer_sync while in use) will
+ * diff against it next; sfs_jlog_forget drops it at release.
+ */
+void
+sfs_jlog_postwrite(struct sfs_fs *sfs, void *fsbufdata)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_bufdata *bd = fsbufdata;
+
+	spinlock_acquire(&jl->jl_lock);
+	if (bd->bd_oldlsn != 0) {
+		if (bd->bd_prev != NULL) {
+			bd->bd_prev->bd_next = bd->bd_next;
+		}
+		else {
+			jl->jl_unwritten = bd->bd_next;
+		}
+		if (bd->bd_next != NULL) {
+			bd->bd_next->bd_prev = bd->bd_prev;
+		}
+		bd->bd_oldlsn = 0;
+	}
+	spinlock_release(&jl->jl_lock);
+}
+
+/*
+ * A buffer is going away (from sfs_detachbuf). If it's being dropped
+ * without being written, which happens when its block is freed, the
+ * current transaction inherits its place in the journal: until the
+ * free commits, the block's earlier records are still needed.
+ */
+void
+sfs_jlog_detach(struct sfs_fs *sfs, void *fsbufdata)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_bufdata *bd = fsbufdata;
+	struct sfs_trans *tx;
+
+	tx = sfs_trans_current(sfs);
+	spinlock_acquire(&jl->jl_lock);
+	if (bd->bd_oldlsn != 0) {
+		if (tx != NULL &&
+		    (tx->tx_holdlsn == 0 || tx->tx_holdlsn > bd->bd_oldlsn)) {
+			tx->tx_holdlsn = bd->bd_oldlsn;
+		}
+		if (bd->bd_prev != NULL) {
+			bd->bd_prev->bd_next = bd->bd_next;
+		}
+		else {
+			jl->jl_unwritten = bd->bd_next;
+		}
+		if (bd->bd_next != NULL) {
+			bd->bd_next->bd_prev = bd->bd_prev;
+		}
+	}
+	spinlock_release(&jl->jl_lock);
+
+	if (bd->bd_shadow != NULL) {
+		kfree(bd->bd_shadow);
+	}
+	kfree(bd);
+}
+
+////////////////////////////////////////////////////////////
+// commit and checkpoint
+
+/*
+ * Make every operation that has finished so far durable: flush the
+ * journal through the latest TXEND. Concurrent callers mostly find
+ * their records already flushed by whoever got there first.
+ */
+int
+sfs_jlog_commit(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	sfs_lsn_t lsn;
+
+	spinlock_acquire(&jl->jl_lock);
+	lsn = jl->jl_lastcommit;
+	if (jl->jl_ntxends > jl->jl_committxends) {
+		jl->jl_ncommits++;
+		jl->jl_ncommitted += jl->jl_ntxends - jl->jl_committxends;
+		jl->jl_committxends = jl->jl_ntxends;
+	}
+	spinlock_release(&jl->jl_lock);
+
+	return sfs_jphys_flush(sfs, lsn);
+}
+
+/*
+ * Commit one file's metadata: flush the journal through the commit
+ * LSN *LSNP (see sfs_trans_touch), or do nothing if it's 0. Other
+ * files' later transactions stay in memory.
+ */
+int
+sfs_jlog_commitlsn(struct sfs_fs *sfs, sfs_lsn_t *lsnp)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	sfs_lsn_t want;
+	int result;
+
+	spinlock_acquire(&jl->jl_lock);
+	want = *lsnp;
+	spinlock_release(&jl->jl_lock);
+
+	if (want == 0) {
+		return 0;
+	}
+	if (want == SFS_LSN_UNKNOWN) {
+		return sfs_jlog_commit(sfs);
+	}
+	result = sfs_jphys_flush(sfs, want);
+	if (result) {
+		return result;
+	}
+
+	/* Unless something newer has committed meanwhile, it's all out */
+	spinlock_acquire(&jl->jl_lock);
+	if (*lsnp == want) {
+		*lsnp = 0;
+	}
+	spinlock_release(&jl->jl_lock);
+	return 0;
+}
+
+/*
+ * Trim the journal to the oldest record still needed. Called at the
+ * end of sfs_sync and by the checkpoint thread.
+ */
+void
+sfs_jlog_checkpoint(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_trans *tx;
+	struct sfs_bufdata *bd;
+	sfs_lsn_t tail;
+
+	lock_acquire(jl->jl_cplock);
+
+	/*
+	 * Get the next LSN first: records written after this are
+	 * past it, and any written before have been noted (see
+	 * struct sfs_jphys_writecontext).
+	 */
+	tail = sfs_jphys_peeknextlsn(sfs);
+
+	spinlock_acquire(&jl->jl_lock);
+	for (tx = jl->jl_txs; tx != NULL; tx = tx->tx_next) {
+		if (tx->tx_id != 0 && tx->tx_id < tail) {
+			tail = tx->tx_id;
+		}
+		if (tx->tx_holdlsn != 0 && tx->tx_holdlsn < tail) {
+			tail = tx->tx_holdlsn;
+		}
+	}
+	for (bd = jl->jl_unwritten; bd != NULL; bd = bd->bd_next) {
+		if (bd->bd_oldlsn < tail) {
+			tail = bd->bd_oldlsn;
+		}
+	}
+	if (jl->jl_freemaplsn != 0 && jl->jl_freemaplsn < tail) {
+		tail = jl->jl_freemaplsn;
+	}
+	spinlock_release(&jl->jl_lock);
+
+	if (tail > jl->jl_taillsn) {
+		sfs_jphys_trim(sfs, tail);
+		jl->jl_taillsn = tail;
+	}
+	sfs_jphys_clearodometer(sfs->sfs_jphys);
+
+	lock_release(jl->jl_cplock);
+}
+
+////////////////////////////////////////////////////////////
+// checkpoint thread
+
+/*
+ * Write back what's holding the journal tail and trim, until the
+ * journal is down to SFS_CPTARGET or the tail stops moving (because
+ * an open transaction holds it, or nothing left is old enough to
+ * matter). Each batch is the SFS_CPBATCH buffers with the oldest
+ * unwritten records, written oldest first; if the freemap's changes
+ * are older than the newest of them it goes first.
+ *
+ * This waits for buffers other operations are using, so it must be
+ * called holding no vnode locks or buffers.
+ */
+static
+void
+sfs_jlog_clean(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_bufdata *bd;
+	daddr_t blocks[SFS_CPBATCH];
+	sfs_lsn_t lsns[SFS_CPBATCH];
+	sfs_lsn_t lsn, freemaplsn, oldtail, newtail;
+	unsigned batch, num, i;
+	uint32_t target;
+	int result;
+
+	target = SFS_CPTARGET(sfs->sfs_sb.sb_journalblocks);
+	for (batch = 0; batch < SFS_CPMAXBATCHES; batch++) {
+		if (sfs_jphys_getusage(sfs) <= target) {
+			break;
+		}
+
+		/* Keep the oldest SFS_CPBATCH, sorted by insertion. */
+		num = 0;
+		spinlock_acquire(&jl->jl_lock);
+		for (bd = jl->jl_unwritten; bd != NULL; bd = bd->bd_next) {
+			lsn = bd->bd_oldlsn;
+			if (num == SFS_CPBATCH && lsn >= lsns[num - 1]) {
+				continue;
+			}
+			if (num < SFS_CPBATCH) {
+				num++;
+			}
+			for (i = num - 1; i > 0 && lsns[i - 1] > lsn; i--) {
+				lsns[i] = lsns[i - 1];
+				blocks[i] = blocks[i - 1];
+			}
+			lsns[i] = lsn;
+			blocks[i] = bd->bd_block;
+		}
+		freemaplsn = jl->jl_freemaplsn;
+		spinlock_release(&jl->jl_lock);
+
+		if (freemaplsn != 0 &&
+		    (num == 0 || freemaplsn < lsns[num - 1])) {
+			result = sfs_sync_freemap(sfs);
+			if (result) {
+				kprintf("sfs: %s: checkpoint: freemap: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+				return;
+			}
+		}
+
+		/*
+		 * The buffers may have been written or dropped since we
+		 * looked; buffer_flush then does nothing.
+		 */
+		for (i=0; i<num; i++) {
+			result = buffer_flush(&sfs->sfs_absfs, blocks[i],
+					      SFS_BLOCKSIZE);
+			if (result) {
+				kprintf("sfs: %s: checkpoint: block %u: %s\n",
+					sfs->sfs_sb.sb_volname,
+					(unsigned)blocks[i], strerror(result));
+				return;
+			}
+		}
+
+		lock_acquire(jl->jl_cplock);
+		oldtail = jl->jl_taillsn;
+		lock_release(jl->jl_cplock);
+
+		sfs_jlog_checkpoint(sfs);
+
+		lock_acquire(jl->jl_cplock);
+		newtail = jl->jl_taillsn;
+		lock_release(jl->jl_cplock);
+
+		/* Let throttled operations go */
+		lock_acquire(jl->jl_cpthreadlock);
+		jl->jl_cpprogress++;
+		cv_broadcast(jl->jl_spacecv, jl->jl_cpthreadlock);
+		lock_release(jl->jl_cpthreadlock);
+
+		if (newtail == oldtail) {
+			break;
+		}
+	}
+}
+
+/*
+ * The checkpoint thread. It sleeps until an operation starting finds
+ * the journal past SFS_CPSTART, cleans, and tells anyone waiting for
+ * space that it has finished a pass.
+ */
+static
+void
+sfs_jlog_cpthread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+
+	(void)data2;
+
+	lock_acquire(jl->jl_cpthreadlock);
+	while (!jl->jl_cpquit) {
+		if (!jl->jl_cpwanted) {
+			cv_wait(jl->jl_cpcv, jl->jl_cpthreadlock);
+			continue;
+		}
+		jl->jl_cpwanted = false;
+		lock_release(jl->jl_cpthreadlock);
+
+		sfs_jlog_clean(sfs);
+
+		lock_acquire(jl->jl_cpthreadlock);
+		jl->jl_cppasses++;
+		jl->jl_cpprogress++;
+		cv_broadcast(jl->jl_spacecv, jl->jl_cpthreadlock);
+	}
+	jl->jl_cprunning = false;
+	cv_broadcast(jl->jl_spacecv, jl->jl_cpthreadlock);
+	lock_release(jl->jl_cpthreadlock);
+
+	thread_exit();
+}
+
+/*
+ * Wake the checkpoint thread, if there is one, without waiting for it.
+ */
+static
+void
+sfs_jlog_wakecp(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+
+	lock_acquire(jl->jl_cpthreadlock);
+	if (jl->jl_cprunning) {
+		jl->jl_cpwanted = true;
+		cv_signal(jl->jl_cpcv, jl->jl_cpthreadlock);
+	}
+	lock_release(jl->jl_cpthreadlock);
+}
+
+/*
+ * Called when an operation starts. If the journal is past
+ * SFS_CPSTART, wake the checkpoint thread; if it's past
+ * SFS_CPTHROTTLE and filling faster than the thread trims it, wait
+ * for one batch of its work; if it's past SFS_CPWAIT, wait for it to
+ * make room, so the operations already running can finish without
+ * the head running into the tail. If there's no checkpoint thread,
+ * clean here instead.
+ */
+static
+void
+sfs_jlog_makeroom(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	uint32_t nblocks, usage;
+	unsigned passes, progress;
+	bool throttle;
+
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	usage = sfs_jphys_getusage(sfs);
+	if (usage <= SFS_CPSTART(nblocks)) {
+		return;
+	}
+	throttle = usage > SFS_CPTHROTTLE(nblocks) &&
+		usage <= SFS_CPWAIT(nblocks) &&
+		sfs_jphys_getodometer(sfs->sfs_jphys) > SFS_CPAHEAD(nblocks);
+
+	lock_acquire(jl->jl_cpthreadlock);
+	if (!jl->jl_cprunning) {
+		lock_release(jl->jl_cpthreadlock);
+		sfs_jlog_clean(sfs);
+		return;
+	}
+	jl->jl_cpwanted = true;
+	cv_signal(jl->jl_cpcv, jl->jl_cpthreadlock);
+	if (throttle) {
+		jl->jl_nthrottles++;
+		progress = jl->jl_cpprogress;
+		while (jl->jl_cprunning && jl->jl_cpprogress == progress) {
+			cv_wait(jl->jl_spacecv, jl->jl_cpthreadlock);
+		}
+	}
+	if (jl->jl_cprunning && usage > SFS_CPWAIT(nblocks)) {
+		jl->jl_nspacewaits++;
+	}
+	while (jl->jl_cprunning &&
+	       sfs_jphys_getusage(sfs) > SFS_CPWAIT(nblocks)) {
+		passes = jl->jl_cppasses;
+		while (jl->jl_cprunning && jl->jl_cppasses == passes) {
+			cv_wait(jl->jl_spacecv, jl->jl_cpthreadlock);
+		}
+		jl->jl_cpwanted = true;
+		cv_signal(jl->jl_cpcv, jl->jl_cpthreadlock);
+	}
+	lock_release(jl->jl_cpthreadlock);
+}
+
+/*
+ * Print the journal statistics.
+ */
+void
+sfs_jlog_printstats(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_jphys_stats js;
+	struct timespec now;
+	uint64_t ms, ncommitted;
+	unsigned ncommits, nsplits, nthrottles, nspacewaits;
+	uint32_t nblocks, usage;
+
+	sfs_jphys_getstats(sfs->sfs_jphys, &js);
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	usage = sfs_jphys_getusage(sfs);
+
+	gettime(&now);
+	spinlock_acquire(&jl->jl_lock);
+	timespec_sub(&now, &jl->jl_statstart, &now);
+	ncommits = jl->jl_ncommits;
+	ncommitted = jl->jl_ncommitted;
+	nsplits = jl->jl_nsplits;
+	spinlock_release(&jl->jl_lock);
+
+	lock_acquire(jl->jl_cpthreadlock);
+	nthrottles = jl->jl_nthrottles;
+	nspacewaits = jl->jl_nspacewaits;
+	lock_release(jl->jl_cpthreadlock);
+
+	ms = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	kprintf("Journal for %s:\n", sfs->sfs_sb.sb_volname);
+	kprintf("   head to tail: %u of %u blocks (%u%%), "
+		"%u since checkpoint\n", usage, nblocks,
+		usage * 100 / nblocks, js.js_odometer);
+	kprintf("   %llu records in %llu.%03llu s (%llu/s), "
+		"%llu bytes/record\n", js.js_records, ms / 1000, ms % 1000,
+		js.js_records * 1000 / ms,
+		js.js_records == 0 ? 0ULL : js.js_recbytes / js.js_records);
+	kprintf("   %u blocks used, %u flushes\n",
+		js.js_blocks, js.js_flushes);
+	kprintf("   %u group commits, %llu.%llu transactions each\n",
+		ncommits,
+		ncommits == 0 ? 0ULL : ncommitted / ncommits,
+		ncommits == 0 ? 0ULL : ncommitted * 10 / ncommits % 10);
+	kprintf("   %u operations throttled, %u waited for space, "
+		"%u split\n", nthrottles, nspacewaits, nsplits);
+}
+
+/*
+ * The same, for kstat, as counters; the reader takes the rates.
+ */
+void
+sfs_jlog_kstat(struct sfs_fs *sfs, struct kstat *ks)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct sfs_jphys_stats js;
+	char prefix[SFS_VOLNAME_SIZE + 16];
+	uint64_t ncommitted;
+	unsigned ncommits, nsplits, nthrottles, nspacewaits;
+
+	sfs_jphys_getstats(sfs->sfs_jphys, &js);
+
+	spinlock_acquire(&jl->jl_lock);
+	ncommits = jl->jl_ncommits;
+	ncommitted = jl->jl_ncommitted;
+	nsplits = jl->jl_nsplits;
+	spinlock_release(&jl->jl_lock);
+
+	lock_acquire(jl->jl_cpthreadlock);
+	nthrottles = jl->jl_nthrottles;
+	nspacewaits = jl->jl_nspacewaits;
+	lock_release(jl->jl_cpthreadlock);
+
+	snprintf(prefix, sizeof(prefix), "fs.%s.journal",
+		 sfs->sfs_sb.sb_volname);
+	kstat_addsub(ks, prefix, "size", sfs->sfs_sb.sb_journalblocks);
+	kstat_addsub(ks, prefix, "usage", sfs_jphys_getusage(sfs));
+	kstat_addsub(ks, prefix, "odometer", js.js_odometer);
+	kstat_addsub(ks, prefix, "records", js.js_records);
+	kstat_addsub(ks, prefix, "recbytes", js.js_recbytes);
+	kstat_addsub(ks, prefix, "blocks", js.js_blocks);
+	kstat_addsub(ks, prefix, "flushes", js.js_flushes);
+	kstat_addsub(ks, prefix, "commits", ncommits);
+	kstat_addsub(ks, prefix, "committed", ncommitted);
+	kstat_addsub(ks, prefix, "throttles", nthrottles);
+	kstat_addsub(ks, prefix, "spacewaits", nspacewaits);
+	kstat_addsub(ks, prefix, "splits", nsplits);
+}
+
+/*
+ * Zero the journal statistics.
+ */
+void
+sfs_jlog_resetstats(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	struct timespec now;
+
+	sfs_jphys_clearstats(sfs->sfs_jphys);
+
+	gettime(&now);
+	spinlock_acquire(&jl->jl_lock);
+	jl->jl_statstart = now;
+	jl->jl_committxends = jl->jl_ntxends;
+	jl->jl_ncommitted = 0;
+	jl->jl_ncommits = 0;
+	jl->jl_nsplits = 0;
+	spinlock_release(&jl->jl_lock);
+
+	lock_acquire(jl->jl_cpthreadlock);
+	jl->jl_nthrottles = 0;
+	jl->jl_nspacewaits = 0;
+	lock_release(jl->jl_cpthreadlock);
+}
+
+/*
+ * Start the checkpoint thread. Called at mount time once recovery
+ * is done, and again if an unmount fails.
+ */
+int
+sfs_jlog_startcheckpointer(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+	int result;
+
+	lock_acquire(jl->jl_cpthreadlock);
+	KASSERT(!jl->jl_cprunning);
+	jl->jl_cpquit = false;
+	jl->jl_cpwanted = false;
+	result = thread_fork("sfs_checkpoint", NULL, sfs_jlog_cpthread,
+			     sfs, 0);
+	if (result == 0) {
+		jl->jl_cprunning = true;
+	}
+	lock_release(jl->jl_cpthreadlock);
+	return result;
+}
+
+/*
+ * Stop the checkpoint thread and wait for it to exit.
+ */
+void
+sfs_jlog_stopcheckpointer(struct sfs_fs *sfs)
+{
+	struct sfs_jlog *jl = sfs->sfs_jlog;
+
+	lock_acquire(jl->jl_cpthreadlock);
+	jl->jl_cpquit = true;
+	cv_signal(jl->jl_cpcv, jl->jl_cpthreadlock);
+	while (jl->jl_cprunning) {
+		cv_wait(jl->jl_spacecv, jl->jl_cpthreadlock);
+	}
+	lock_release(jl->jl_cpthreadlock);
+}
+
+////////////////////////////////////////////////////////////
+// recovery
+
+/* A transaction seen during recovery */
+struct sfs_rtx {
+	sfs_lsn_t rt_id;
+	bool rt_committed;
+};
+
+/* An ALLOC or FREE record seen during recovery */
+struct sfs_rrun {
+	sfs_lsn_t rr_lsn;
+	uint64_t rr_txid;
+	daddr_t rr_start;
+	uint32_t rr_count;
+	bool rr_free;
+};
+
+/* A META record seen during recovery; its old and new data follow */
+struct sfs_rmeta {
+	sfs_lsn_t rm_lsn;
+	uint64_t rm_txid;
+	unsigned rm_offset;
+	unsigned rm_len;
+	unsigned rm_flags;
+	struct sfs_rmeta *rm_prev;
+	struct sfs_rmeta *rm_next;
+};
+
+/* A block with META records */
+struct sfs_rblock {
+	daddr_t rb_block;
+	sfs_lsn_t rb_freelsn;	/* latest committed FREE, or 0 */
+	struct sfs_rmeta *rb_first;	/* its records, in LSN order */
+	struct sfs_rmeta *rb_last;
+	struct sfs_rblock *rb_next;
+};
+
+struct sfs_recovery {
+	struct sfs_rtx *rc_txs;		/* in LSN order */
+	unsigned rc_ntxs, rc_maxtxs;
+	struct sfs_rrun *rc_runs;	/* in LSN order */
+	unsigned rc_nruns, rc_maxruns;
+	struct sfs_rblock *rc_blocks[SFS_RHASHSIZE];
+	unsigned rc_nblocks;
+	unsigned rc_nrecs;
+};
+
+/*
+ * Shared state for the threads patching blocks. Each takes the next
+ * block from the table until there are none left or one fails.
+ */
+struct sfs_rwork {
+	struct sfs_fs *rw_fs;
+	struct sfs_recovery *rw_rc;
+	struct lock *rw_lock;		/* lock for the following */
+	struct cv *rw_cv;		/* to wait for the helpers */
+	unsigned rw_bucket;		/* next hash bucket */
+	struct sfs_rblock *rw_rb;	/* next block in that bucket */
+	unsigned rw_helpers;		/* helper threads still running */
+	int rw_result;			/* first error */
+};
+
+/* Any record, copied out of the journal */
+union sfs_jrec {
+	struct sfs_jrec_tx jr_tx;
+	struct sfs_jrec_blocks jr_blocks;
+	struct {
+		struct sfs_jrec_meta jm;
+		char data[2 * SFS_JMETA_MAXLEN];
+	} jr_meta;
+};
+
+/*
+ * Make room for one more element in a growable array ARRAY of NUM
+ * elements of SIZE bytes, with room for *MAX. Returns the array,
+ * possibly moved, or NULL if out of memory (leaving ARRAY alone).
+ */
+static
+void *
+sfs_recov_grow(void *array, unsigned num, unsigned *max, size_t size)
+{
+	unsigned newmax;
+	void *newarray;
+
+	if (num < *max) {
+		return array;
+	}
+	newmax = *max == 0 ? 64 : *max * 2;
+	newarray = kmalloc(newmax * size);
+	if (newarray == NULL) {
+		return NULL;
+	}
+	if (array != NULL) {
+		memcpy(newarray, array, num * size);
+		kfree(array);
+	}
+	*max = newmax;
+	return newarray;
+}
+
+/*
+ * Find a transaction by id.
+ */
+static
+struct sfs_rtx *
+sfs_recov_gettx(struct sfs_recovery *rc, uint64_t txid)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = rc->rc_ntxs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rc->rc_txs[mid].rt_id == txid) {
+			return &rc->rc_txs[mid];
+		}
+		if (rc->rc_txs[mid].rt_id < txid) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check if a record's transaction committed. Records outside any
+ * transaction count as committed, as do those whose TXBEGIN was
+ * trimmed: the tail never passes the start of an open transaction.
+ */
+static
+bool
+sfs_recov_committed(struct sfs_recovery *rc, uint64_t txid)
+{
+	struct sfs_rtx *rt;
+
+	if (txid == 0) {
+		return true;
+	}
+	rt = sfs_recov_gettx(rc, txid);
+	return rt == NULL || rt->rt_committed;
+}
+
+/*
+ * Find (or, if CREATE is set, add) the table entry for BLOCK.
+ */
+static
+struct sfs_rblock *
+sfs_recov_getblock(struct sfs_recovery *rc, daddr_t block, bool create)
+{
+	struct sfs_rblock *rb;
+	unsigned ix;
+
+	ix = block & (SFS_RHASHSIZE - 1);
+	for (rb = rc->rc_blocks[ix]; rb != NULL; rb = rb->rb_next) {
+		if (rb->rb_block == block) {
+			return rb;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	rb = kmalloc(sizeof(*rb));
+	if (rb == NULL) {
+		return NULL;
+	}
+	rb->rb_block = block;
+	rb->rb_freelsn = 0;
+	rb->rb_first = rb->rb_last = NULL;
+	rb->rb_next = rc->rc_blocks[ix];
+	rc->rc_blocks[ix] = rb;
+	rc->rc_nblocks++;
+	return rb;
+}
+
+/*
+ * Check that a range of blocks is one the journal could describe:
+ * inside the volume and not the superblock, freemap, or journal.
+ */
+static
+bool
+sfs_recov_blocksok(struct sfs_fs *sfs, uint32_t start, uint32_t count)
+{
+	uint32_t first;
+
+	first = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	if (count == 0 || start < first || start + count < start ||
+	    start + count > sfs->sfs_sb.sb_nblocks) {
+		return false;
+	}
+	if (start < sfs->sfs_sb.sb_journalstart + sfs->sfs_sb.sb_journalblocks
+	    && start + count > sfs->sfs_sb.sb_journalstart) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Copy the current record out of the journal and check it. Returns
+ * EINVAL for a record we don't understand, which the caller skips;
+ * if COMPLAIN is set, say so.
+ */
+static
+int
+sfs_recov_getrec(struct sfs_fs *sfs, struct sfs_jiter *ji, bool complain,
+		 unsigned *type_ret, union sfs_jrec *jr)
+{
+	unsigned type;
+	size_t len, want;
+	void *rec;
+
+	type = sfs_jiter_type(ji);
+	rec = sfs_jiter_rec(ji, &len);
+	switch (type) {
+	    case SFS_JREC_TXBEGIN:
+	    case SFS_JREC_TXEND:
+		want = sizeof(jr->jr_tx);
+		break;
+	    case SFS_JREC_ALLOC:
+	    case SFS_JREC_FREE:
+		want = sizeof(jr->jr_blocks);
+		break;
+	    case SFS_JREC_META:
+		want = sizeof(jr->jr_meta.jm);
+		break;
+	    default:
+		goto bad;
+	}
+	if (len < want || len > sizeof(*jr)) {
+		goto bad;
+	}
+	/* the record isn't necessarily aligned in the journal block */
+	memcpy(jr, rec, len);
+
+	switch (type) {
+	    case SFS_JREC_ALLOC:
+	    case SFS_JREC_FREE:
+		if (!sfs_recov_blocksok(sfs, jr->jr_blocks.jb_start,
+					jr->jr_blocks.jb_count)) {
+			goto bad;
+		}
+		break;
+	    case SFS_JREC_META:
+		if (jr->jr_meta.jm.jm_len == 0 ||
+		    jr->jr_meta.jm.jm_len > SFS_JMETA_MAXLEN ||
+		    len != want + 2 * jr->jr_meta.jm.jm_len ||
+		    jr->jr_meta.jm.jm_offset + jr->jr_meta.jm.jm_len >
+		    SFS_BLOCKSIZE ||
+		    !sfs_recov_blocksok(sfs, jr->jr_meta.jm.jm_block, 1)) {
+			goto bad;
+		}
+		break;
+	}
+
+	*type_ret = type;
+	return 0;
+
+ bad:
+	if (complain) {
+		kprintf("sfs: %s: ignoring bad journal record (lsn %llu, "
+			"type %u, length %zu)\n", sfs->sfs_sb.sb_volname,
+			(unsigned long long)sfs_jiter_lsn(ji), type, len);
+	}
+	return EINVAL;
+}
+
+/*
+ * Set or clear freemap bits during recovery. A bit may already be in
+ * the state we want if the freemap was written after the record.
+ */
+static
+void
+sfs_recov_freemap(struct sfs_fs *sfs, uint32_t start, uint32_t count,
+		  bool inuse)
+{
+	uint32_t i;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=start; i<start+count; i++) {
+		if (inuse && !bitmap_isset(sfs->sfs_freemap, i)) {
+			bitmap_mark(sfs->sfs_freemap, i);
+			sfs_freemap_dirtied(sfs, i, 1);
+		}
+		else if (!inuse && bitmap_isset(sfs->sfs_freemap, i)) {
+			bitmap_unmark(sfs->sfs_freemap, i);
+			sfs_freemap_dirtied(sfs, i, 1);
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Add a META record to its block's list.
+ */
+static
+int
+sfs_recov_addmeta(struct sfs_recovery *rc, const union sfs_jrec *jr,
+		  sfs_lsn_t lsn)
+{
+	const struct sfs_jrec_meta *jm = &jr->jr_meta.jm;
+	struct sfs_rblock *rb;
+	struct sfs_rmeta *rm;
+
+	rb = sfs_recov_getblock(rc, jm->jm_block, true);
+	if (rb == NULL) {
+		return ENOMEM;
+	}
+	rm = kmalloc(sizeof(*rm) + 2 * jm->jm_len);
+	if (rm == NULL) {
+		return ENOMEM;
+	}
+	rm->rm_lsn = lsn;
+	rm->rm_txid = jm->jm_txid;
+	rm->rm_offset = jm->jm_offset;
+	rm->rm_len = jm->jm_len;
+	rm->rm_flags = jm->jm_flags;
+	memcpy(rm + 1, jr->jr_meta.data, 2 * jm->jm_len);
+
+	rm->rm_next = NULL;
+	rm->rm_prev = rb->rb_last;
+	if (rb->rb_last != NULL) {
+		rb->rb_last->rm_next = rm;
+	}
+	else {
+		rb->rb_first = rm;
+	}
+	rb->rb_last = rm;
+	return 0;
+}
+
+/*
+ * Scan: read the journal, once, finding the transactions and which
+ * committed, the freemap changes, and each block's META records,
+ * and note when each of those blocks was last freed.
+ */
+static
+int
+sfs_recov_scan(struct sfs_fs *sfs, struct sfs_recovery *rc)
+{
+	struct sfs_jiter *ji;
+	union sfs_jrec jr;
+	struct sfs_rtx *rt;
+	struct sfs_rrun *rr;
+	struct sfs_rblock *rb;
+	unsigned type, i;
+	uint32_t b;
+	int result;
+
+	result = sfs_jiter_fwdcreate(sfs, &ji);
+	if (result) {
+		return result;
+	}
+	while (!sfs_jiter_done(ji)) {
+		if (sfs_recov_getrec(sfs, ji, true, &type, &jr) == 0) {
+			rc->rc_nrecs++;
+			switch (type) {
+			    case SFS_JREC_TXBEGIN:
+				rt = sfs_recov_grow(rc->rc_txs, rc->rc_ntxs,
+						    &rc->rc_maxtxs,
+						    sizeof(*rt));
+				if (rt == NULL) {
+					result = ENOMEM;
+					goto fail;
+				}
+				rc->rc_txs = rt;
+				rt = &rc->rc_txs[rc->rc_ntxs++];
+				rt->rt_id = sfs_jiter_lsn(ji);
+				rt->rt_committed = false;
+				break;
+			    case SFS_JREC_TXEND:
+				rt = sfs_recov_gettx(rc, jr.jr_tx.jx_txid);
+				if (rt != NULL) {
+					rt->rt_committed = true;
+				}
+				break;
+			    case SFS_JREC_ALLOC:
+			    case SFS_JREC_FREE:
+				rr = sfs_recov_grow(rc->rc_runs, rc->rc_nruns,
+						    &rc->rc_maxruns,
+						    sizeof(*rr));
+				if (rr == NULL) {
+					result = ENOMEM;
+					goto fail;
+				}
+				rc->rc_runs = rr;
+				rr = &rc->rc_runs[rc->rc_nruns++];
+				rr->rr_lsn = sfs_jiter_lsn(ji);
+				rr->rr_txid = jr.jr_blocks.jb_txid;
+				rr->rr_start = jr.jr_blocks.jb_start;
+				rr->rr_count = jr.jr_blocks.jb_count;
+				rr->rr_free = type == SFS_JREC_FREE;
+				break;
+			    case SFS_JREC_META:
+				result = sfs_recov_addmeta(rc, &jr,
+							sfs_jiter_lsn(ji));
+				if (result) {
+					goto fail;
+				}
+				break;
+			}
+		}
+		result = sfs_jiter_next(sfs, ji);
+		if (result) {
+			goto fail;
+		}
+	}
+	sfs_jiter_destroy(ji);
+
+	/* Now note the committed frees of blocks we care about. */
+	for (i=0; i<rc->rc_nruns; i++) {
+		rr = &rc->rc_runs[i];
+		if (!rr->rr_free || !sfs_recov_committed(rc, rr->rr_txid)) {
+			continue;
+		}
+		for (b = rr->rr_start; b < rr->rr_start + rr->rr_count; b++) {
+			rb = sfs_recov_getblock(rc, b, false);
+			if (rb != NULL && rb->rb_freelsn < rr->rr_lsn) {
+				rb->rb_freelsn = rr->rr_lsn;
+			}
+		}
+	}
+	return 0;
+
+ fail:
+	sfs_jiter_destroy(ji);
+	return result;
+}
+
+/*
+ * Redo and undo the freemap changes: replay every ALLOC and every
+ * committed FREE forward, then take back the ALLOCs of operations
+ * that didn't commit, backward.
+ */
+static
+void
+sfs_recov_freemaps(struct sfs_fs *sfs, struct sfs_recovery *rc)
+{
+	struct sfs_rrun *rr;
+	unsigned i;
+
+	for (i=0; i<rc->rc_nruns; i++) {
+		rr = &rc->rc_runs[i];
+		if (!rr->rr_free) {
+			sfs_recov_freemap(sfs, rr->rr_start, rr->rr_count,
+					  true);
+		}
+		else if (sfs_recov_committed(rc, rr->rr_txid)) {
+			/* frees take effect at commit */
+			sfs_recov_freemap(sfs, rr->rr_start, rr->rr_count,
+					  false);
+		}
+	}
+	for (i = rc->rc_nruns; i-- > 0; ) {
+		rr = &rc->rc_runs[i];
+		if (!rr->rr_free && !sfs_recov_committed(rc, rr->rr_txid)) {
+			sfs_recov_freemap(sfs, rr->rr_start, rr->rr_count,
+					  false);
+		}
+	}
+}
+
+/*
+ * Redo and undo one block: apply the new data of its records
+ * forward, then the old data of those that didn't commit backward,
+ * skipping records from before the block was last freed.
+ */
+static
+int
+sfs_recov_patch(struct sfs_fs *sfs, struct sfs_recovery *rc,
+		struct sfs_rblock *rb)
+{
+	struct sfs_rmeta *rm;
+	const char *olddata;
+	struct buf *buf;
+	char *ptr;
+	int result;
+
+	if (rb->rb_last == NULL || rb->rb_last->rm_lsn <= rb->rb_freelsn) {
+		/* nothing applies */
+		return 0;
+	}
+
+	result = buffer_read(&sfs->sfs_absfs, rb->rb_block, SFS_BLOCKSIZE,
+			     &buf);
+	if (result) {
+		kprintf("sfs: %s: recovery: reading block %u: %s\n",
+			sfs->sfs_sb.sb_volname, rb->rb_block,
+			strerror(result));
+		return result;
+	}
+	ptr = buffer_map(buf);
+
+	for (rm = rb->rb_first; rm != NULL; rm = rm->rm_next) {
+		if (rm->rm_lsn <= rb->rb_freelsn) {
+			continue;
+		}
+		if (rm->rm_flags & SFS_JMETA_ZERO) {
+			bzero(ptr, SFS_BLOCKSIZE);
+		}
+		olddata = (const char *)(rm + 1);
+		memcpy(ptr + rm->rm_offset, olddata + rm->rm_len, rm->rm_len);
+	}
+	for (rm = rb->rb_last; rm != NULL; rm = rm->rm_prev) {
+		if (rm->rm_lsn <= rb->rb_freelsn) {
+			break;
+		}
+		if (!sfs_recov_committed(rc, rm->rm_txid)) {
+			olddata = (const char *)(rm + 1);
+			memcpy(ptr + rm->rm_offset, olddata, rm->rm_len);
+		}
+	}
+
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Patch blocks from the table until there are none left or someone
+ * fails. Run by each thread, including the one mounting.
+ */
+static
+void
+sfs_recov_work(struct sfs_rwork *rw)
+{
+	struct sfs_recovery *rc = rw->rw_rc;
+	struct sfs_rblock *rb;
+	bool reserved;
+	int result;
+
+	reserved = !curthread->t_did_reserve_buffers;
+	if (reserved) {
+		reserve_buffers(SFS_BLOCKSIZE);
+	}
+
+	while (1) {
+		lock_acquire(rw->rw_lock);
+		while (rw->rw_rb == NULL && rw->rw_bucket < SFS_RHASHSIZE) {
+			rw->rw_rb = rc->rc_blocks[rw->rw_bucket++];
+		}
+		rb = rw->rw_rb;
+		if (rb == NULL || rw->rw_result != 0) {
+			lock_release(rw->rw_lock);
+			break;
+		}
+		rw->rw_rb = rb->rb_next;
+		lock_release(rw->rw_lock);
+
+		result = sfs_recov_patch(rw->rw_fs, rc, rb);
+		if (result) {
+			lock_acquire(rw->rw_lock);
+			if (rw->rw_result == 0) {
+				rw->rw_result = result;
+			}
+			lock_release(rw->rw_lock);
+			break;
+		}
+	}
+
+	if (reserved) {
+		unreserve_buffers(SFS_BLOCKSIZE);
+	}
+}
+
+/*
+ * Helper thread for patching blocks.
+ */
+static
+void
+sfs_recov_thread(void *data1, unsigned long data2)
+{
+	struct sfs_rwork *rw = data1;
+
+	(void)data2;
+
+	sfs_recov_work(rw);
+
+	lock_acquire(rw->rw_lock);
+	KASSERT(rw->rw_helpers > 0);
+	rw->rw_helpers--;
+	cv_signal(rw->rw_cv, rw->rw_lock);
+	lock_release(rw->rw_lock);
+
+	thread_exit();
+}
+
+/*
+ * Patch all the blocks, using a thread per CPU (up to SFS_RTHREADS
+ * and one per few blocks). If helper threads can't be had, we just
+ * do more of it ourselves.
+ */
+static
+int
+sfs_recov_blocks(struct sfs_fs *sfs, struct sfs_recovery *rc)
+{
+	struct sfs_rwork rw;
+	unsigned i, nthreads;
+	int result;
+
+	rw.rw_fs = sfs;
+	rw.rw_rc = rc;
+	rw.rw_lock = lock_create("sfs_recovery");
+	if (rw.rw_lock == NULL) {
+		return ENOMEM;
+	}
+	rw.rw_cv = cv_create("sfs_recovery");
+	if (rw.rw_cv == NULL) {
+		lock_destroy(rw.rw_lock);
+		return ENOMEM;
+	}
+	rw.rw_bucket = 0;
+	rw.rw_rb = NULL;
+	rw.rw_helpers = 0;
+	rw.rw_result = 0;
+
+	nthreads = cpu_count();
+	if (nthreads > SFS_RTHREADS) {
+		nthreads = SFS_RTHREADS;
+	}
+	if (nthreads > rc->rc_nblocks / 4 + 1) {
+		nthreads = rc->rc_nblocks / 4 + 1;
+	}
+
+	lock_acquire(rw.rw_lock);
+	for (i=1; i<nthreads; i++) {
+		result = thread_fork("sfs_recovery", NULL, sfs_recov_thread,
+				     &rw, 0);
+		if (result) {
+			break;
+		}
+		rw.rw_helpers++;
+	}
+	lock_release(rw.rw_lock);
+
+	sfs_recov_work(&rw);
+
+	lock_acquire(rw.rw_lock);
+	while (rw.rw_helpers > 0) {
+		cv_wait(rw.rw_cv, rw.rw_lock);
+	}
+	lock_release(rw.rw_lock);
+
+	cv_destroy(rw.rw_cv);
+	lock_destroy(rw.rw_lock);
+	return rw.rw_result;
+}
+
+/*
+ * Recover the volume from the journal. Called at mount time with the
+ * journal in reading mode. Changed blocks are left dirty in the
+ * buffer cache and the freemap changes in memory; the caller syncs
+ * once the journal is writable, which also trims it.
+ */
+int
+sfs_jlog_recover(struct sfs_fs *sfs)
+{
+	struct sfs_recovery rc;
+	struct sfs_rblock *rb;
+	struct sfs_rmeta *rm;
+	unsigned i, losers;
+	int result;
+
+	bzero(&rc, sizeof(rc));
+
+	SAY("*** Scanning the journal ***\n");
+	result = sfs_recov_scan(sfs, &rc);
+	if (result) {
+		goto out;
+	}
+	if (rc.rc_nrecs == 0) {
+		goto out;
+	}
+
+	losers = 0;
+	for (i=0; i<rc.rc_ntxs; i++) {
+		if (!rc.rc_txs[i].rt_committed) {
+			losers++;
+		}
+	}
+
+	SAY("*** Replaying %u records, rolling back %u operations ***\n",
+	    rc.rc_nrecs, losers);
+	sfs_recov_freemaps(sfs, &rc);
+	result = sfs_recov_blocks(sfs, &rc);
+	if (result) {
+		goto out;
+	}
+
+	kprintf("sfs: %s: journal recovery: %u records, %u blocks, "
+		"%u incomplete operations rolled back\n",
+		sfs->sfs_sb.sb_volname, rc.rc_nrecs, rc.rc_nblocks, losers);
+
+ out:
+	for (i=0; i<SFS_RHASHSIZE; i++) {
+		while (rc.rc_blocks[i] != NULL) {
+			rb = rc.rc_blocks[i];
+			rc.rc_blocks[i] = rb->rb_next;
+			while (rb->rb_first != NULL) {
+				rm = rb->rb_first;
+				rb->rb_first = rm->rm_next;
+				kfree(rm);
+			}
+			kfree(rb);
+		}
+	}
+	if (rc.rc_txs != NULL) {
+		kfree(rc.rc_txs);
+	}
+	if (rc.rc_runs != NULL) {
+		kfree(rc.rc_runs);
+	}
+	return result;
+}
+
+#ifdef SFS_VERBOSE_RECOVERY
+/*
+ * Record names for the journal dumping in sfs_jphys.c.
+ */
+const char *
+sfs_jphys_client_recname(unsigned type)
+{
+	switch (type) {
+	    case SFS_JREC_TXBEGIN: return "txbegin";
+	    case SFS_JREC_TXEND: return "txend";
+	    case SFS_JREC_ALLOC: return "alloc";
+	    case SFS_JREC_FREE: return "free";
+	    case SFS_JREC_META: return "meta";
+	}
+	return "<unknown>";
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// setup
+
+struct sfs_jlog *
+sfs_jlog_create(void)
+{
+	struct sfs_jlog *jl;
+
+	jl = kmalloc(sizeof(*jl));
+	if (jl == NULL) {
+		return NULL;
+	}
+	jl->jl_cplock = lock_create("sfs_cplock");
+	if (jl->jl_cplock == NULL) {
+		goto fail;
+	}
+	jl->jl_cpthreadlock = lock_create("sfs_cpthreadlock");
+	if (jl->jl_cpthreadlock == NULL) {
+		goto fail_cplock;
+	}
+	jl->jl_cpcv = cv_create("sfs_cpcv");
+	if (jl->jl_cpcv == NULL) {
+		goto fail_cpthreadlock;
+	}
+	jl->jl_spacecv = cv_create("sfs_spacecv");
+	if (jl->jl_spacecv == NULL) {
+		goto fail_cpcv;
+	}
+	spinlock_init(&jl->jl_lock);
+	jl->jl_txs = NULL;
+	jl->jl_unwritten = NULL;
+	jl->jl_freemaplsn = 0;
+	jl->jl_freemapnewlsn = 0;
+	jl->jl_lastcommit = 0;
+	jl->jl_ntxends = 0;
+	jl->jl_committxends = 0;
+	jl->jl_ncommitted = 0;
+	jl->jl_ncommits = 0;
+	jl->jl_nsplits = 0;
+	gettime(&jl->jl_statstart);
+	jl->jl_taillsn = 0;
+	jl->jl_cprunning = false;
+	jl->jl_cpwanted = false;
+	jl->jl_cpquit = false;
+	jl->jl_cppasses = 0;
+	jl->jl_cpprogress = 0;
+	jl->jl_nthrottles = 0;
+	jl->jl_nspacewaits = 0;
+	return jl;
+
+fail_cpcv:
+	cv_destroy(jl->jl_cpcv);
+fail_cpthreadlock:
+	lock_destroy(jl->jl_cpthreadlock);
+fail_cplock:
+	lock_destroy(jl->jl_cplock);
+fail:
+	kfree(jl);
+	return NULL;
+}
+
+void
+sfs_jlog_destroy(struct sfs_jlog *jl)
+{
+	KASSERT(jl->jl_txs == NULL);
+	KASSERT(jl->jl_unwritten == NULL);
+	KASSERT(!jl->jl_cprunning);
+	spinlock_cleanup(&jl->jl_lock);
+	cv_destroy(jl->jl_spacecv);
+	cv_destroy(jl->jl_cpcv);
+	lock_destroy(jl->jl_cpthreadlock);
+	lock_destroy(jl->jl_cplock);
+	kfree(jl);
+}
@@ -46,6 +46,12 @@
  * The interface to this module is documented in design/jphys.txt.
  */
 
+/* Most journal blocks written out with one device write. */
+#define SFS_JFLUSHRUN	16
+
+/* Journal blocks read ahead when iterating forward. */
+#define SFS_JREADAHEAD	16
+
 ////////////////////////////////////////////////////////////
 // types
 
@@ -75,6 +81,17 @@ struct sfs_jposition {
  * also at the beginning of jp_oldestjblock, because we discard
  * journal blocks once they're written out.
  *
+ * Appending doesn't take jp_lock unless the record needs a new head
+ * block. A writer reserves its space and LSN by bumping jp_headbyte
+ * and jp_nextlsn under jp_headlock, and copies its record in with no
+ * lock held, so writers on several CPUs copy at once. jp_headcopiers
+ * counts copies in progress into jp_headbuf; the head block isn't
+ * turned over (and so can't be written) until they're done, so every
+ * record before the head block is complete. Changing the head block
+ * (jp_headbuf, jp_headjblock, jp_headfirstlsn) takes jp_lock and
+ * happens only once the head block is full, when no new reservation
+ * can be made in it.
+ *
  * The on-disk tail is not actually tracked; it's just written out
  * when we trim the log. XXX: we should track it so we can check for
  * head/tail collisions. The reason this is problematic is that we
@@ -94,13 +111,26 @@ struct sfs_jphys {
 	struct cv *jp_nextcv;		/* to wait for jp_nextbuf */
 
 	uint32_t jp_headjblock;		/* journal block number of head */
-	unsigned jp_headbyte;		/* byte offset for journal head */
 	sfs_lsn_t jp_headfirstlsn;	/* oldest lsn in headbuf */
 
+	struct spinlock jp_headlock;	/* lock for the following */
+	unsigned jp_headbyte;		/* byte offset for journal head */
 	sfs_lsn_t jp_nextlsn;		/* next LSN to use */
+	unsigned jp_headcopiers;	/* records being copied into headbuf */
+	bool jp_headdirty;		/* a record has gone into headbuf */
+	struct wchan *jp_copywchan;	/* to wait for them */
 
 	uint32_t jp_odometer;		/* counter of jblocks used */
 
+	/*
+	 * statistics (sfs_jphys_getstats); jp_nrecords and jp_recbytes
+	 * are under jp_headlock, jp_nflushes under jp_lsnmaplock
+	 */
+	uint64_t jp_nrecords;		/* client records written */
+	uint64_t jp_recbytes;		/* their size, headers included */
+	uint32_t jp_nblocks;		/* jblocks used, never cleared */
+	uint32_t jp_nflushes;		/* flushes that had to write */
+
 	struct spinlock jp_lsnmaplock;	/* lock for the following */
 	sfs_lsn_t *jp_firstlsns;	/* first lsn in each journal block */
 	uint32_t jp_oldestjblock;	/* oldest journal block in memory */
@@ -167,7 +197,8 @@ sfs_jposition_eq(const struct sfs_jposition *a, const struct sfs_jposition *b)
 
 /*
  * Move to the next journal block. (If we don't need another journal
- * block yet, return without doing anything.)
+ * block yet, return without doing anything.) Waits first for any
+ * records still being copied into the current one.
  *
  * This releases jp_headbuf and switches in jp_nextbuf, and notes that
  * we're the thread that's going to replace jp_nextbuf later. We can't
@@ -189,12 +220,20 @@ sfs_advance_journal(struct sfs_fs *sfs)
 
 	KASSERT(lock_do_i_hold(jp->jp_lock));
 
+	spinlock_acquire(&jp->jp_headlock);
 	if (jp->jp_headbyte < SFS_BLOCKSIZE) {
+		spinlock_release(&jp->jp_headlock);
 		return;
 	}
 	/* Must not have run off the end. */
 	KASSERT(jp->jp_headbyte == SFS_BLOCKSIZE);
 
+	/* The block is full, so no more copies into it can start. */
+	while (jp->jp_headcopiers > 0) {
+		wchan_sleep(jp->jp_copywchan, &jp->jp_headlock);
+	}
+	spinlock_release(&jp->jp_headlock);
+
 	/* Validate the LSN map entry. */
 	spinlock_acquire(&jp->jp_lsnmaplock);
 	KASSERT(jp->jp_firstlsns[jp->jp_headjblock] == jp->jp_headfirstlsn);
@@ -209,7 +248,7 @@ sfs_advance_journal(struct sfs_fs *sfs)
 		jp->jp_headjblock = 0;
 	}
 	KASSERT(jp->jp_headjblock < sfs->sfs_sb.sb_journalblocks);
-	jp->jp_headbyte = 0;
+	/* Nobody can take an LSN while the old block is full */
 	jp->jp_headfirstlsn = jp->jp_nextlsn;
 
 	/*
@@ -239,6 +278,12 @@ sfs_advance_journal(struct sfs_fs *sfs)
 	}
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
 	spinlock_release(&jp->jp_lsnmaplock);
+
+	/* Open the new block for reservations. */
+	spinlock_acquire(&jp->jp_headlock);
+	jp->jp_headbyte = 0;
+	jp->jp_headdirty = false;
+	spinlock_release(&jp->jp_headlock);
 }
 
 /*
@@ -257,11 +302,12 @@ sfs_advance_journal(struct sfs_fs *sfs)
  * sfs_getnextbuf.
  *
  * Also, in order to prevent running off the end of the current
- * journal head buffer before a new jp_nextbuf is ready, anyone
- * entering sfs_jphys_write while jp_nextbuf is NULL sleeps until we
- * finish here. If we get back there recursively somehow, we'll panic;
- * currently that can't happen, but if it becomes possible we'll need
- * to allow ourselves through there without waiting. If it becomes
+ * journal head buffer before a new jp_nextbuf is ready, anyone in
+ * sfs_jphys_write whose record needs a new head block while
+ * jp_nextbuf is NULL sleeps until we finish here. If we get back
+ * there recursively somehow, we'll panic; currently that can't
+ * happen, but if it becomes possible we'll need to allow ourselves
+ * through there without waiting. If it becomes
  * possible to generate more than a whole block's worth of journal
  * entries from buffer writes triggered by buffer_get... this whole
  * scheme fails and needs to be redesigned.
@@ -316,34 +362,94 @@ sfs_getnextbuf(struct sfs_fs *sfs)
 	jp->jp_nextbuf = buf;
 	jp->jp_gettingnext = NULL;
 	jp->jp_odometer++;
+	jp->jp_nblocks++;
 	cv_broadcast(jp->jp_nextcv, jp->jp_lock);
 }
 
 /*
- * Write some data directly into the journal.
+ * Reserve room at the head for a record of TOTALLEN bytes, if it
+ * fits in the current head block: take the next LSN and the space,
+ * and count ourselves as copying into the block so it isn't turned
+ * over under us. The callback (see sfs_jphys_write) is called with
+ * the new LSN before anyone can see a later next-LSN. *FIRST_RET is
+ * set if this is the block's first record. Returns false if the
+ * record doesn't fit.
  */
 static
-void
-sfs_put_journal(struct sfs_fs *sfs, sfs_lsn_t lsn, const void *rec, size_t len)
+bool
+sfs_jphys_reserve(struct sfs_fs *sfs, size_t totallen, unsigned class,
+		  void (*callback)(struct sfs_fs *sfs,
+				   sfs_lsn_t newlsn,
+				   struct sfs_jphys_writecontext *ctx),
+		  struct sfs_jphys_writecontext *ctx,
+		  sfs_lsn_t *lsn_ret, struct buf **buf_ret,
+		  unsigned *offset_ret, bool *first_ret)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	char *buf;
 
-	KASSERT(lock_do_i_hold(jp->jp_lock));
-	KASSERT(jp->jp_headbyte + len <= SFS_BLOCKSIZE);
+	spinlock_acquire(&jp->jp_headlock);
+	if (jp->jp_headbyte + totallen > SFS_BLOCKSIZE) {
+		spinlock_release(&jp->jp_headlock);
+		return false;
+	}
+	*lsn_ret = jp->jp_nextlsn++;
+	*buf_ret = jp->jp_headbuf;
+	*offset_ret = jp->jp_headbyte;
+	*first_ret = !jp->jp_headdirty;
+	jp->jp_headbyte += totallen;
+	jp->jp_headcopiers++;
+	jp->jp_headdirty = true;
+	if (class == SFS_JPHYS_CLIENT) {
+		jp->jp_nrecords++;
+		jp->jp_recbytes += totallen;
+	}
+	if (callback != NULL) {
+		callback(sfs, *lsn_ret, ctx);
+	}
+	spinlock_release(&jp->jp_headlock);
+	return true;
+}
 
-	KASSERT(lsn >= jp->jp_headfirstlsn);
+/*
+ * Copy a record (header HDR and LEN bytes of REC) into the space
+ * reserved for it at OFFSET in the head buffer BUF, marking the
+ * buffer dirty if it's the block's FIRST record. Then let
+ * sfs_advance_journal know we're done with the block.
+ */
+static
+void
+sfs_jphys_copyin(struct sfs_fs *sfs, struct buf *buf, unsigned offset,
+		 bool first, const struct sfs_jphys_header *hdr,
+		 const void *rec, size_t len)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	char *ptr;
 
-	buf = buffer_map(jp->jp_headbuf);
-	memcpy(buf + jp->jp_headbyte, rec, len);
-	buffer_mark_dirty(jp->jp_headbuf);
-	jp->jp_headbyte += len;
+	KASSERT(offset + sizeof(*hdr) + len <= SFS_BLOCKSIZE);
 
-	sfs_advance_journal(sfs);
+	ptr = buffer_map(buf);
+	memcpy(ptr + offset, hdr, sizeof(*hdr));
+	if (len > 0) {
+		memcpy(ptr + offset + sizeof(*hdr), rec, len);
+	}
+	if (first) {
+		buffer_mark_dirty(buf);
+	}
+
+	spinlock_acquire(&jp->jp_headlock);
+	KASSERT(jp->jp_headcopiers > 0);
+	jp->jp_headcopiers--;
+	if (jp->jp_headcopiers == 0) {
+		wchan_wakeall(jp->jp_copywchan, &jp->jp_headlock);
+	}
+	spinlock_release(&jp->jp_headlock);
 }
 
 /*
- * Write a pad record to the end of the current journal block.
+ * Write pad records to the end of the current journal block (if
+ * it isn't already full) and move to the next block. It takes more
+ * than one if the space left is more than SFS_CONINFO_MAXLEN; less
+ * than a header's worth at the end is implicit padding.
  */
 static
 void
@@ -351,25 +457,44 @@ sfs_pad_journal(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	struct sfs_jphys_header hdr;
+	struct buf *buf;
+	unsigned offset, npads, i;
 	sfs_lsn_t lsn;
-	size_t len;
+	size_t len, padlen;
+	bool first;
 
 	KASSERT(lock_do_i_hold(jp->jp_lock));
-	KASSERT(jp->jp_headbyte < SFS_BLOCKSIZE);
 
+	/* Take the rest of the block, as sfs_jphys_reserve would */
+	spinlock_acquire(&jp->jp_headlock);
 	len = SFS_BLOCKSIZE - jp->jp_headbyte;
-	if (len >= sizeof(hdr)) {
-		lsn = jp->jp_nextlsn++;
+	npads = len / SFS_CONINFO_MAXLEN;
+	if (len % SFS_CONINFO_MAXLEN >= sizeof(hdr)) {
+		npads++;
+	}
+	if (npads > 0) {
+		lsn = jp->jp_nextlsn;
+		jp->jp_nextlsn += npads;
+		buf = jp->jp_headbuf;
+		offset = jp->jp_headbyte;
+		first = !jp->jp_headdirty;
+		jp->jp_headcopiers += npads;
+		jp->jp_headdirty = true;
+	}
+	jp->jp_headbyte = SFS_BLOCKSIZE;
+	spinlock_release(&jp->jp_headlock);
+
+	for (i=0; i<npads; i++) {
+		padlen = len < SFS_CONINFO_MAXLEN ? len : SFS_CONINFO_MAXLEN;
 		hdr.jh_coninfo = SFS_MKCONINFO(SFS_JPHYS_CONTAINER,
-					       SFS_JPHYS_PAD, len, lsn);
-		sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
-		len -= sizeof(hdr);
-	}
-	else {
-		/* padding is implicit; do nothing */
+					       SFS_JPHYS_PAD, padlen,
+					       lsn + i);
+		sfs_jphys_copyin(sfs, buf, offset, first && i == 0,
+				 &hdr, NULL, 0);
+		offset += padlen;
+		len -= padlen;
 	}
 
-	jp->jp_headbyte += len;
 	sfs_advance_journal(sfs);
 }
 
@@ -403,44 +528,46 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	struct sfs_jphys_header hdr;
+	struct buf *buf;
+	unsigned offset;
 	sfs_lsn_t lsn;
 	size_t totallen;
-	bool already_gettingnext;
+	bool already_gettingnext, full, first;
 
 	KASSERT(len % 2 == 0);
 
 	/* our total length includes a header */
 	totallen = len + sizeof(hdr);
 
-	/* lock the journal */
-	lock_acquire(jp->jp_lock);
-
-	/*
-	 * If we are already marked responsible for getting the next
-	 * journal head buffer, we must be here recursively. This
-	 * happens when e.g. sfs_getnextbuf triggers an eviction that
-	 * triggers a journal write. We need to *not* get the next
-	 * journal head buffer in this call, because we're already
-	 * doing so up the call stack and doing it here would make a
-	 * mess. And we must not wait for ourselves.
-	 */
-	already_gettingnext = jp->jp_nextbuf == NULL && 
-		jp->jp_gettingnext == curthread;
+	/* Check some limits required by the container logic */
+	KASSERT(class == SFS_JPHYS_CONTAINER || class == SFS_JPHYS_CLIENT);
+	KASSERT(type < 128);
+	KASSERT(totallen <= SFS_CONINFO_MAXLEN);
+	KASSERT(totallen % 2 == 0);
 
 	/*
-	 * If the journal head is turning over, wait until it
-	 * finishes. If we're the thread that was supposed to fetch
-	 * the next head buffer, though, we can't.
+	 * Usually the record fits in the current head block: reserve
+	 * its space and copy it in without jp_lock. Otherwise turn
+	 * over the head block and try again; someone may use up the
+	 * new block first, so loop.
 	 */
-	if (already_gettingnext == false) {
-		while (jp->jp_nextbuf == NULL) {
-			KASSERT(jp->jp_gettingnext != curthread);
-			cv_wait(jp->jp_nextcv, jp->jp_lock);
-		}
-	}
+	while (!sfs_jphys_reserve(sfs, totallen, class, callback, ctx,
+				  &lsn, &buf, &offset, &first)) {
+		/* lock the journal */
+		lock_acquire(jp->jp_lock);
 
-	/* If we aren't going to fit, pad the current block and get a new one */
-	if (jp->jp_headbyte + totallen > SFS_BLOCKSIZE) {
+		/*
+		 * If we are already marked responsible for getting
+		 * the next journal head buffer, we must be here
+		 * recursively. This happens when e.g. sfs_getnextbuf
+		 * triggers an eviction that triggers a journal write.
+		 * We need to *not* get the next journal head buffer
+		 * in this call, because we're already doing so up the
+		 * call stack and doing it here would make a mess. And
+		 * we must not wait for ourselves.
+		 */
+		already_gettingnext = jp->jp_nextbuf == NULL &&
+			jp->jp_gettingnext == curthread;
 		if (already_gettingnext) {
 			/* We need another buffer and can't get one */
 			panic("sfs: %s: Journal head block full while "
@@ -448,72 +575,52 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 			      sfs->sfs_sb.sb_volname);
 		}
 
-		sfs_pad_journal(sfs);
 		/*
-		 * We just turned over the journal head, so we must be
-		 * responsible for fetching the next journal head
-		 * buffer.
+		 * If the journal head is turning over, wait until it
+		 * finishes.
 		 */
-		KASSERT(jp->jp_nextbuf == NULL &&
-			jp->jp_gettingnext == curthread);
-#if 0
-		/*
-		 * Do it immediately (instead of writing out our
-		 * record first and waiting until the end of this
-		 * function) -- this behavior is disabled by default
-		 * because it has been found to interact badly with
-		 * as-yet-poorly-understood dynamic behavior issues.
-		 * However, you may need to enable it if you are
-		 * flushing the journal out very aggressively.
-		 *
-		 * In that case calling sfs_getnextbuf at the end of
-		 * this function may trigger an eviction that in turn
-		 * causes a flush that tries to flush out the record
-		 * this function just wrote. That pads out the current
-		 * journal head block and goes to the next one; but
-		 * that will happen before jp_nextbuf can be set, so
-		 * sfs_advance_journal asserts because jp_nextbuf is
-		 * null.
-		 */
-		sfs_getnextbuf(sfs);
-#endif
-	}
-
-	/* Check some limits required by the container logic */
-	KASSERT(class == SFS_JPHYS_CONTAINER || class == SFS_JPHYS_CLIENT);
-	KASSERT(type < 128);
-	KASSERT(totallen <= SFS_BLOCKSIZE);
-	KASSERT(totallen % 2 == 0);
-
-	/* Get a LSN and initialize the record header. */
-	lsn = jp->jp_nextlsn++;
-	hdr.jh_coninfo = SFS_MKCONINFO(class, type, totallen, lsn);
-
-	/* Write the header and the actual log entry. */
-	sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
-	sfs_put_journal(sfs, lsn, rec, len);
+		while (jp->jp_nextbuf == NULL) {
+			KASSERT(jp->jp_gettingnext != curthread);
+			cv_wait(jp->jp_nextcv, jp->jp_lock);
+		}
 
-	/* Call the callback, if any */
-	if (callback != NULL) {
-		callback(sfs, lsn, ctx);
-	}
+		/* Someone else may have turned it over meanwhile */
+		spinlock_acquire(&jp->jp_headlock);
+		full = jp->jp_headbyte + totallen > SFS_BLOCKSIZE;
+		spinlock_release(&jp->jp_headlock);
 
-	/*
-	 * If we turned over the head buffer, get a new nextbuf.
-	 * (Unless we're already doing so up the call stack.)
-	 * This releases the jphys lock while working so it must come
-	 * after all the work that needs to be atomic.
-	 */
-	if (already_gettingnext == false) {
-		if (jp->jp_nextbuf == NULL &&
-		    jp->jp_gettingnext == curthread) {
+		if (full) {
+			sfs_pad_journal(sfs);
+			/*
+			 * We just turned over the journal head, so we
+			 * must be responsible for fetching the next
+			 * journal head buffer.
+			 */
+			KASSERT(jp->jp_nextbuf == NULL &&
+				jp->jp_gettingnext == curthread);
+			/*
+			 * Do it immediately, before writing out our
+			 * record. The metadata journal (sfs_jlog.c)
+			 * flushes the journal before metadata writes,
+			 * so sfs_getnextbuf may trigger an eviction
+			 * that in turn causes a flush that pads out
+			 * the current journal head block and goes to
+			 * the next one; that must not happen before
+			 * jp_nextbuf is set, or sfs_advance_journal
+			 * would assert because jp_nextbuf is null.
+			 * This releases the jphys lock while working.
+			 */
 			sfs_getnextbuf(sfs);
+			KASSERT(jp->jp_nextbuf != NULL);
 		}
-		KASSERT(jp->jp_nextbuf != NULL);
+
+		/* done with the jphys lock */
+		lock_release(jp->jp_lock);
 	}
 
-	/* done with the jphys lock */
-	lock_release(jp->jp_lock);
+	/* Initialize the record header and write it and the entry. */
+	hdr.jh_coninfo = SFS_MKCONINFO(class, type, totallen, lsn);
+	sfs_jphys_copyin(sfs, buf, offset, first, &hdr, rec, len);
 
 	/* return the LSN we used */
 	return lsn;
@@ -560,11 +667,15 @@ sfs_jphys_write(struct sfs_fs *sfs,
  * violates assumptions made by the code that recovers the physical
  * journal container -- in particular how it finds the journal head.
  *
- * 2. When the buffer cache writes out other buffers, it also calls
- * sfs_writeblock; code should be added there to flush the journal
- * (with sfs_jphys_flush) as necessary to maintain the write-ahead
- * logging invariant required for recovery. sfs_jphys_flush comes
- * here once it translates LSNs to jblocks.
+ * 2. Before the buffer cache writes out other buffers, it calls
+ * sfs_flushlog with the buffer's write-ahead LSN, which flushes the
+ * journal (with sfs_jphys_flush) as necessary to maintain the
+ * write-ahead logging invariant required for recovery.
+ * sfs_jphys_flush comes here once it translates LSNs to jblocks.
+ *
+ * Either way, runs of consecutive journal blocks go out with one
+ * device write each (buffer_flush_run), so a flush that covers many
+ * blocks, e.g. a group commit under load, costs few disk transactions.
  *
  * 3. An explicit sync call goes through sfs_sync, which by default
  * calls sfs_jphys_flushall and might do more than that, e.g. in
@@ -575,7 +686,7 @@ void
 sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	uint32_t myjblock;
+	uint32_t nblocks, myjblock, num, written, i;
 	uint32_t diskblock;
 	int result;
 
@@ -584,6 +695,8 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
 	/* Should already have the state locked */
 	KASSERT(spinlock_do_i_hold(&jp->jp_lsnmaplock));
 
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+
 	/* Write out journal blocks as needed */
 	myjblock = jp->jp_oldestjblock;
 	while (1) {
@@ -611,6 +724,21 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
 		 * circular.)
 		 */
 		if (myjblock == jp->jp_oldestjblock) {
+			/*
+			 * Write as many of the blocks from here to
+			 * endjblock as we can in one go; they're
+			 * consecutive on disk up to the wraparound.
+			 */
+			if (endjblock > myjblock) {
+				num = endjblock - myjblock;
+			}
+			else {
+				num = nblocks - myjblock;
+			}
+			if (num > SFS_JFLUSHRUN) {
+				num = SFS_JFLUSHRUN;
+			}
+
 			/*
 			 * Unlock so that sfs_writeblock can call back
 			 * into here to update jp_oldestjblock after
@@ -620,20 +748,22 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
 			spinlock_release(&jp->jp_lsnmaplock);
 
 			/*
-			 * Write the buffer out.
+			 * Write the buffers out.
 			 *
-			 * buffer_flush is idempotent (it does nothing
-			 * if the buffer is clean or no longer
-			 * present) so if someone else is already
-			 * partway through writing it, or even if
-			 * someone else has already finished writing
-			 * it, nothing bad will happen. It will only
-			 * be written once and sfs_wrote_journal_block
-			 * will only be called once.
+			 * buffer_flush_run is idempotent (it does
+			 * nothing for buffers that are clean or no
+			 * longer present) so if someone else is
+			 * already partway through writing some, or
+			 * even if someone else has already finished
+			 * writing them, nothing bad will happen. Each
+			 * will only be written once and
+			 * sfs_wrote_journal_block will only be called
+			 * once for it. It may stop short (at a busy
+			 * buffer); then we come around again.
 			 */
 			diskblock = sfs->sfs_sb.sb_journalstart + myjblock;
-			result = buffer_flush(&sfs->sfs_absfs, diskblock,
-					      SFS_BLOCKSIZE);
+			result = buffer_flush_run(&sfs->sfs_absfs, diskblock,
+						  num, SFS_BLOCKSIZE);
 			if (result) {
 				/* Oopsey. */
 				panic("sfs: %s: writing journal buffer: %s\n",
@@ -641,11 +771,32 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
 				      strerror(result));
 			}
 
-			/* invalidate the buffer too; don't need it any more */
-			buffer_drop(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+			/* See how far the journal is written now */
+			spinlock_acquire(&jp->jp_lsnmaplock);
+			written = (jp->jp_oldestjblock + nblocks - myjblock)
+				% nblocks;
+			spinlock_release(&jp->jp_lsnmaplock);
+			if (written > num) {
+				written = num;
+			}
+
+			/*
+			 * Invalidate the buffers written too; don't
+			 * need them any more. (Only those: dropping
+			 * one not yet written would lose it.)
+			 */
+			for (i=0; i<written; i++) {
+				buffer_drop(&sfs->sfs_absfs, diskblock + i,
+					    SFS_BLOCKSIZE);
+			}
 
 			/* Get the spinlock again */
 			spinlock_acquire(&jp->jp_lsnmaplock);
+
+			if (written > 0) {
+				myjblock = (myjblock + written) % nblocks;
+				continue;
+			}
 		}
 
 		/* go on to the next block */
@@ -692,6 +843,7 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	uint32_t jblock, headjblock;
 	sfs_lsn_t headfirstlsn;
+	bool inhead;
 
 	if (lsn == 0) {
 		/*
@@ -703,9 +855,12 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 
 	lock_acquire(jp->jp_lock);
 
+	spinlock_acquire(&jp->jp_headlock);
 	KASSERT(lsn < jp->jp_nextlsn);
+	inhead = lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0;
+	spinlock_release(&jp->jp_headlock);
 
-	if (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
+	if (inhead) {
 		/*
 		 * We will need to flush out the current journal head;
 		 * advance the head.
@@ -746,6 +901,9 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	}
 
 	/* now flush up to but not including jblock */
+	if (jblock != jp->jp_oldestjblock) {
+		jp->jp_nflushes++;
+	}
 	sfs_jphys_flush_upto_jblock(sfs, jblock);
 
 	KASSERT(lsn < headfirstlsn);
@@ -792,9 +950,9 @@ sfs_jphys_flushall(struct sfs_fs *sfs)
 	sfs_lsn_t nextlsn;
 	int result;
 
-	lock_acquire(jp->jp_lock);
+	spinlock_acquire(&jp->jp_headlock);
 	nextlsn = jp->jp_nextlsn;
-	lock_release(jp->jp_lock);
+	spinlock_release(&jp->jp_headlock);
 
 	result = sfs_jphys_flush(sfs, nextlsn - 1);
 	if (result) {
@@ -845,9 +1003,9 @@ sfs_jphys_peeknextlsn(struct sfs_fs *sfs)
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	sfs_lsn_t nextlsn;
 
-	lock_acquire(jp->jp_lock);
+	spinlock_acquire(&jp->jp_headlock);
 	nextlsn = jp->jp_nextlsn;
-	lock_release(jp->jp_lock);
+	spinlock_release(&jp->jp_headlock);
 
 	return nextlsn;
 }
@@ -923,6 +1081,69 @@ sfs_jphys_clearodometer(struct sfs_jphys *jp)
 	lock_release(jp->jp_lock);
 }
 
+/*
+ * Retrieve the journal statistics: counts of records, bytes, flushes
+ * that wrote something, and journal blocks used (unlike the odometer,
+ * these are only cleared by sfs_jphys_clearstats).
+ */
+void
+sfs_jphys_getstats(struct sfs_jphys *jp, struct sfs_jphys_stats *st)
+{
+	lock_acquire(jp->jp_lock);
+	st->js_blocks = jp->jp_nblocks;
+	st->js_odometer = jp->jp_odometer;
+	lock_release(jp->jp_lock);
+	spinlock_acquire(&jp->jp_headlock);
+	st->js_records = jp->jp_nrecords;
+	st->js_recbytes = jp->jp_recbytes;
+	spinlock_release(&jp->jp_headlock);
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	st->js_flushes = jp->jp_nflushes;
+	spinlock_release(&jp->jp_lsnmaplock);
+}
+
+/*
+ * Reset the journal statistics.
+ */
+void
+sfs_jphys_clearstats(struct sfs_jphys *jp)
+{
+	lock_acquire(jp->jp_lock);
+	jp->jp_nblocks = 0;
+	lock_release(jp->jp_lock);
+	spinlock_acquire(&jp->jp_headlock);
+	jp->jp_nrecords = 0;
+	jp->jp_recbytes = 0;
+	spinlock_release(&jp->jp_headlock);
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	jp->jp_nflushes = 0;
+	spinlock_release(&jp->jp_lsnmaplock);
+}
+
+/*
+ * Retrieve how many journal blocks are in use: from the block holding
+ * the in-memory tail through the head block. If this reaches the
+ * size of the journal, the head runs into the tail.
+ */
+uint32_t
+sfs_jphys_getusage(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t nblocks, head, tail;
+
+	KASSERT(jp->jp_writermode);
+
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	lock_acquire(jp->jp_lock);
+	head = jp->jp_headjblock;
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	tail = jp->jp_memtailjblock;
+	spinlock_release(&jp->jp_lsnmaplock);
+	lock_release(jp->jp_lock);
+
+	return (head + nblocks - tail) % nblocks + 1;
+}
+
 ////////////////////////////////////////////////////////////
 // journal iterator (reader mode) interface
 
@@ -972,6 +1193,9 @@ struct sfs_jiter {
 	/* buffer for current journal block */
 	struct buf *ji_buf;
 
+	/* next journal block to read ahead when going forward */
+	uint32_t ji_raend;
+
 	/* current record (valid if ji_read is true) */
 	unsigned ji_class;
 	unsigned ji_type;
@@ -1009,6 +1233,7 @@ sfs_jiter_create(struct sfs_fs *sfs,
 	ji->ji_pos = *tailpos;
 
 	ji->ji_buf = NULL;
+	ji->ji_raend = tailpos->jp_jblock;
 
 	ji->ji_read = false;
 	ji->ji_done = false;
@@ -1142,6 +1367,33 @@ sfs_jiter_getbuf(struct sfs_fs *sfs, struct sfs_jiter *ji)
 	return result;
 }
 
+/*
+ * Start reading the journal blocks after the current one, up to
+ * SFS_JREADAHEAD of them but not past the head block, so going
+ * forward doesn't wait for each block in turn. Blocks already asked
+ * for (from ji_raend back to the current block) aren't asked for
+ * again.
+ */
+static
+void
+sfs_jiter_readahead(struct sfs_fs *sfs, struct sfs_jiter *ji)
+{
+	uint32_t nblocks, here, last;
+
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	here = ji->ji_pos.jp_jblock;
+	last = (ji->ji_headpos.jp_jblock + nblocks - here) % nblocks;
+	if (last > SFS_JREADAHEAD) {
+		last = SFS_JREADAHEAD;
+	}
+	while ((ji->ji_raend + nblocks - here) % nblocks <= last) {
+		buffer_prefetch(&sfs->sfs_absfs,
+				sfs->sfs_sb.sb_journalstart + ji->ji_raend,
+				SFS_BLOCKSIZE);
+		ji->ji_raend = (ji->ji_raend + 1) % nblocks;
+	}
+}
+
 /*
  * Read the current record.
  */
@@ -1260,6 +1512,9 @@ sfs_jiter_one_next(struct sfs_fs *sfs, struct sfs_jiter *ji)
 		buffer_release(ji->ji_buf);
 		ji->ji_buf = NULL;
 	}
+	if (changebuf) {
+		sfs_jiter_readahead(sfs, ji);
+	}
 
 	/* If we were done, we aren't any more */
 	ji->ji_done = false;
@@ -1481,6 +1736,11 @@ sfs_jiter_seektail(struct sfs_fs *sfs, struct sfs_jiter *ji)
 		ji->ji_buf = NULL;
 	}
 
+	/* Start reading what comes next. */
+	ji->ji_raend = (ji->ji_pos.jp_jblock + 1) %
+		sfs->sfs_sb.sb_journalblocks;
+	sfs_jiter_readahead(sfs, ji);
+
 	/* We don't need to advance, so just read the record. */
 	result = sfs_jiter_read(sfs, ji);
 	if (result) {
@@ -2018,14 +2278,30 @@ sfs_jphys_create(void)
 		return NULL;
 	}
 
+	jp->jp_copywchan = wchan_create("sfs_jcopy");
+	if (jp->jp_copywchan == NULL) {
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+
 	jp->jp_headjblock = 0;
-	jp->jp_headbyte = 0;
 	jp->jp_headfirstlsn = 0;
 
+	spinlock_init(&jp->jp_headlock);
+	jp->jp_headbyte = 0;
 	jp->jp_nextlsn = 0;
+	jp->jp_headcopiers = 0;
+	jp->jp_headdirty = false;
 
 	jp->jp_odometer = 0;
 
+	jp->jp_nrecords = 0;
+	jp->jp_recbytes = 0;
+	jp->jp_nblocks = 0;
+	jp->jp_nflushes = 0;
+
 	spinlock_init(&jp->jp_lsnmaplock);
 	jp->jp_firstlsns = NULL;
 	jp->jp_oldestjblock = 0;
@@ -2054,6 +2330,9 @@ sfs_jphys_destroy(struct sfs_jphys *jp)
 	kfree(jp->jp_firstlsns);
 	KASSERT(jp->jp_headbuf == NULL);
 	KASSERT(jp->jp_nextbuf == NULL);
+	KASSERT(jp->jp_headcopiers == 0);
+	spinlock_cleanup(&jp->jp_headlock);
+	wchan_destroy(jp->jp_copywchan);
 	cv_destroy(jp->jp_nextcv);
 	lock_destroy(jp->jp_lock);
 	kfree(jp);
@@ -2133,6 +2412,7 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
 	jp->jp_oldestjblock = jp->jp_headjblock;
+	jp->jp_headdirty = false;
 
 	jp->jp_writermode = true;
 	return 0;
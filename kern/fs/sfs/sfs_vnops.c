@@ -35,26 +35,34 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/dirent.h>
+#include <kern/ioctl.h>
+#include <kern/seek.h>
 #include <limits.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <synch.h>
 #include <vfs.h>
 #include <buf.h>
+#include <device.h>
+#include <pagecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
  * Locking protocol for sfs:
  *    The following locks exist:
+ *       file range locks (sfs_range_lock)
  *       vnode locks (sv_lock)
- *       vnode table lock (sfs_vnlock)
+ *       vnode table bucket locks (sfs_vnhash[].vb_lock)
  *       freemap lock (sfs_freemaplock)
  *       rename lock (sfs_renamelock)
  *       buffer lock
  *
  *    Ordering constraints:
+ *       range locks       before  vnode locks
  *       rename lock       before  vnode locks
  *       vnode locks       before  vnode table lock
  *       vnode locks       before  buffer locks
@@ -64,6 +72,9 @@
  *    I believe the vnode table lock and the buffer locks are
  *    independent.
  *
+ *    Only one vnode table bucket lock is held at a time, except by
+ *    unmount, which takes them all in bucket order.
+ *
  *    Ordering among vnode locks:
  *       directory lock    before  lock of a file within the directory
  *
@@ -74,18 +85,37 @@
 /* Slot in a directory that ".." is expected to appear in */
 #define DOTDOTSLOT  1
 
+/*
+ * Most bytes written by one operation. An operation's records can't
+ * be trimmed until it commits, so big writes are split up. In
+ * data-journal mode the data goes through the journal; otherwise
+ * each new block costs at most an ALLOC record and a changed pointer,
+ * a few dozen bytes, so a journal's worth of blocks is a small part
+ * of the journal.
+ */
+#define SFS_JDATAWRITE	(8 * SFS_BLOCKSIZE)
+#define SFS_METAWRITE(sfs) \
+	((size_t)(sfs)->sfs_sb.sb_journalblocks * SFS_BLOCKSIZE)
+
 ////////////////////////////////////////////////////////////
 // Vnode operations.
 
 /*
  * This is called on *each* open().
  *
- * Locking: not needed
+ * O_DIRECT turns on direct reads for the file, as with Solaris'
+ * directio(): it applies to every open of the file until the vnode
+ * is reclaimed. The disk has to take uios of any size.
+ *
+ * Locking: gets/releases vnode lock for O_DIRECT.
  */
 static
 int
 sfs_eachopen(struct vnode *v, int openflags)
 {
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+
 	/*
 	 * At this level we do not need to handle O_CREAT, O_EXCL,
 	 * O_TRUNC, or O_APPEND.
@@ -94,8 +124,14 @@ sfs_eachopen(struct vnode *v, int openflags)
 	 * to check that either.
 	 */
 
-	(void)v;
-	(void)openflags;
+	if (openflags & O_DIRECT) {
+		if (!sfs->sfs_device->d_directio) {
+			return EINVAL;
+		}
+		lock_acquire(sv->sv_lock);
+		sv->sv_direct = true;
+		lock_release(sv->sv_lock);
+	}
 
 	return 0;
 }
@@ -127,9 +163,11 @@ sfs_eachopendir(struct vnode *v, int openflags)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Called for read(). Whatever of the file is in the page cache (e.g.
+ * because it's mapped) is copied from there; sfs_io() does the rest.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases a shared range lock on what's read, and the
+ * vnode lock, which sfs_io lets go of while copying.
  *
  * Requires up to 3 buffers.
  */
@@ -138,17 +176,28 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_range range;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	sfs_range_lock(sv, &range, uio->uio_offset,
+		       uio->uio_offset + uio->uio_resid, false);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
-	result = sfs_io(sv, uio);
+	/* (the cached size, so a page cache hit needs no buffers) */
+	result = pagecache_read(v, uio, sv->sv_size);
+	if (result || uio->uio_resid == 0) {
+		goto out;
+	}
+
+	result = sfs_io(sv, uio, true);
 
+ out:
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
+	sfs_range_unlock(sv, &range);
 
 	return result;
 }
@@ -156,7 +205,19 @@ sfs_read(struct vnode *v, struct uio *uio)
 /*
  * Called for write(). sfs_io() does the work.
  *
- * Locking: gets/releases vnode lock.
+ * A write within the file holds just what it writes (exclusively),
+ * and in ordered mode sfs_io lets go of the vnode lock while it
+ * copies over blocks already there. One that extends the file holds
+ * all of it, and the vnode lock throughout, as before. Since only
+ * holders of the whole file change the size, sv_size can be checked
+ * without the vnode lock once the range is held. A compressed file
+ * is likewise held all through while sfs_zexpand stores it plainly.
+ * A large write is done in pieces (see SFS_JDATAWRITE), each its own
+ * operation. So is zeroing the preallocated blocks between the
+ * file's unwritten mark and a write past it (see sfs_bmap_advance),
+ * a piece's worth at a time, before the write itself.
+ *
+ * Locking: gets/releases a range lock, and the vnode lock.
  *
  * Requires up to 3 buffers.
  */
@@ -165,17 +226,61 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_range range;
+	size_t rest, max;
+	off_t pos;
+	bool extending, ready;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	lock_acquire(sv->sv_lock);
-	reserve_buffers(SFS_BLOCKSIZE);
+	max = sfs->sfs_datamode == SFS_DATA_JOURNAL ?
+		SFS_JDATAWRITE : SFS_METAWRITE(sfs);
+	do {
+		pos = uio->uio_offset;
+		rest = 0;
+		if (uio->uio_resid > max) {
+			rest = uio->uio_resid - max;
+			uio->uio_resid = max;
+		}
 
-	result = sfs_io(sv, uio);
+		sfs_range_lock(sv, &range, pos, pos + uio->uio_resid, true);
+		extending = pos + uio->uio_resid > sv->sv_size;
+		if (extending || sv->sv_compressed) {
+			sfs_range_unlock(sv, &range);
+			sfs_range_lock(sv, &range, 0, SFS_RANGE_ALL, true);
+		}
+		result = sfs_zexpand(sv);
+		if (result) {
+			sfs_range_unlock(sv, &range);
+			uio->uio_resid += rest;
+			break;
+		}
 
-	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+		sfs_trans_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+
+		result = sfs_bmap_advance(sv, pos / SFS_BLOCKSIZE,
+					  max / SFS_BLOCKSIZE, &ready);
+		if (result == 0 && ready) {
+			result = sfs_io(sv, uio, !extending &&
+					sfs->sfs_datamode == SFS_DATA_ORDERED);
+			sfs_data_dirtied(sv, pos, uio->uio_offset - pos);
+		}
+		sfs_trans_touch(sfs, &sv->sv_commitlsn);
+
+		sfs_trans_end(sfs);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		sfs_range_unlock(sv, &range);
+
+		uio->uio_resid += rest;
+	} while (result == 0 && (rest > 0 || !ready));
+
+	/* What's cached about the file is now stale. */
+	vnode_dropcaches(v);
 
 	return result;
 }
@@ -258,38 +363,257 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 	return result;
 }
 
+/*
+ * Called for getdirentries(). Like sfs_getdirentry, but packs as many
+ * entries into the uio as fit, with inode numbers and types.
+ *
+ * Locking: gets/releases vnode lock; sfs_peektype takes vnode table
+ *    bucket locks, which come after it.
+ *
+ * Requires up to 4 buffers.
+ */
+static
+int
+sfs_getdirentries(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	size_t startresid;
+	off_t pos;
+	int nentries, type;
+	int result;
+
+	KASSERT(uio->uio_offset >= 0);
+	KASSERT(uio->uio_rw==UIO_READ);
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		sfs_dinode_unload(sv);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	/* Use uio_offset as the slot index, as in sfs_getdirentry. */
+	pos = uio->uio_offset;
+	startresid = uio->uio_resid;
+
+	while (pos < nentries) {
+		result = sfs_readdir(sv, pos, &tsd);
+		if (result) {
+			break;
+		}
+
+		if (tsd.sfd_ino == SFS_NOINO) {
+			/* Blank entry */
+			pos++;
+			continue;
+		}
+
+		/* Ensure null termination, just in case */
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+		result = sfs_peektype(sfs, tsd.sfd_ino, &type);
+		if (result) {
+			break;
+		}
+
+		result = vnode_putdirent(uio, tsd.sfd_ino,
+					 type == SFS_TYPE_DIR ? DT_DIR :
+					 type == SFS_TYPE_FILE ? DT_REG :
+					 DT_UNKNOWN,
+					 tsd.sfd_name, strlen(tsd.sfd_name));
+		if (result == ENOSPC) {
+			/* Leave this one for next time */
+			result = uio->uio_resid < startresid ? 0 : EINVAL;
+			break;
+		}
+		if (result) {
+			break;
+		}
+		pos++;
+	}
+
+	sfs_dinode_unload(sv);
+
+	unreserve_buffers(SFS_BLOCKSIZE);
+
+	lock_release(sv->sv_lock);
+
+	/* Update the offset the way we want it */
+	uio->uio_offset = pos;
+
+	return result;
+}
+
 /*
  * Called for ioctl()
- * Locking: not needed.
+ *
+ * Locking: gets/releases a range lock on the whole file, and the
+ *    vnode lock, for IOCTL_PUNCHHOLE, IOCTL_PREALLOC, and
+ *    IOCTL_COMPRESS; just the vnode lock for IOCTL_FADVISE.
+ *
+ * A large preallocation, like a large write, is done in pieces, each
+ * its own operation; only the last extends the file.
+ *
+ * Requires up to 5 buffers.
  */
 static
 int
 sfs_ioctl(struct vnode *v, int op, userptr_t data)
 {
-	/*
-	 * No ioctls.
-	 */
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct ioctl_punchhole ph;
+	struct ioctl_prealloc pa;
+	struct ioctl_fadvise fa;
+	struct sfs_range range;
+	off_t pos, end, stepend;
+	int compress, result;
+
+	switch (op) {
+	    case IOCTL_PUNCHHOLE:
+		if (sv->sv_type != SFS_TYPE_FILE) {
+			return EINVAL;
+		}
+		result = copyin(data, &ph, sizeof(ph));
+		if (result) {
+			return result;
+		}
+		if (ph.ph_offset < 0 || ph.ph_len < 0) {
+			return EINVAL;
+		}
 
-	(void)v;
-	(void)op;
-	(void)data;
+		sfs_range_lock(sv, &range, 0, SFS_RANGE_ALL, true);
+		result = sfs_zexpand(sv);
+		if (result) {
+			sfs_range_unlock(sv, &range);
+			return result;
+		}
+		sfs_trans_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+		result = sfs_ipunch(sv, ph.ph_offset, ph.ph_len);
+		sfs_data_dirtied(sv, ph.ph_offset, ph.ph_len);
+		sfs_trans_touch(sfs, &sv->sv_commitlsn);
+		sfs_trans_end(sfs);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		sfs_range_unlock(sv, &range);
+
+		vnode_dropcaches(v);
+		return result;
+
+	    case IOCTL_PREALLOC:
+		if (sv->sv_type != SFS_TYPE_FILE) {
+			return EINVAL;
+		}
+		result = copyin(data, &pa, sizeof(pa));
+		if (result) {
+			return result;
+		}
+		if (pa.pa_offset < 0 || pa.pa_len <= 0 ||
+		    (pa.pa_flags & ~PREALLOC_KEEPSIZE) != 0) {
+			return EINVAL;
+		}
+		if (pa.pa_len > (off_t)(uint32_t)-1 - pa.pa_offset) {
+			return EFBIG;
+		}
+
+		sfs_range_lock(sv, &range, 0, SFS_RANGE_ALL, true);
+		result = sfs_zexpand(sv);
+		if (result) {
+			sfs_range_unlock(sv, &range);
+			return result;
+		}
+		pos = pa.pa_offset;
+		end = pa.pa_offset + pa.pa_len;
+		do {
+			stepend = pos - pos % SFS_BLOCKSIZE +
+				SFS_METAWRITE(sfs);
+			if (stepend > end) {
+				stepend = end;
+			}
+			sfs_trans_begin(sfs);
+			lock_acquire(sv->sv_lock);
+			reserve_buffers(SFS_BLOCKSIZE);
+			result = sfs_iprealloc(sv, pos, stepend - pos,
+				(pa.pa_flags & PREALLOC_KEEPSIZE) != 0 ||
+				stepend < end);
+			sfs_trans_touch(sfs, &sv->sv_commitlsn);
+			sfs_trans_end(sfs);
+			unreserve_buffers(SFS_BLOCKSIZE);
+			lock_release(sv->sv_lock);
+			pos = stepend;
+		} while (result == 0 && pos < end);
+		sfs_range_unlock(sv, &range);
+
+		vnode_dropcaches(v);
+		return result;
+
+	    case IOCTL_COMPRESS:
+		if (sv->sv_type != SFS_TYPE_FILE) {
+			return EINVAL;
+		}
+		result = copyin(data, &compress, sizeof(compress));
+		if (result) {
+			return result;
+		}
+
+		sfs_range_lock(sv, &range, 0, SFS_RANGE_ALL, true);
+		result = sfs_zconvert(sv, compress != 0);
+		sfs_range_unlock(sv, &range);
+		return result;
+
+	    case IOCTL_FADVISE:
+		if (sv->sv_type != SFS_TYPE_FILE) {
+			return EINVAL;
+		}
+		result = copyin(data, &fa, sizeof(fa));
+		if (result) {
+			return result;
+		}
+		if (fa.fa_offset < 0 || fa.fa_len < 0) {
+			return EINVAL;
+		}
+
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+		result = sfs_fadvise(sv, fa.fa_offset, fa.fa_len,
+				     fa.fa_advice);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+
+		if (result == 0 && fa.fa_advice == FADV_DONTNEED) {
+			vnode_dropcaches(v);
+		}
+		return result;
+	}
 
 	return EINVAL;
 }
 
 /*
- * Called for stat/fstat/lstat.
+ * Called for stat/fstat/lstat. This comes from the copy of the
+ * dinode fields in the vnode, so it needn't touch the inode buffer.
  *
  * Locking: gets/releases vnode lock.
- *
- * Requires 1 buffer.
  */
 static
 int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_dinode *inodeptr;
 	int result;
 
 	/* Fill in the stat structure */
@@ -302,27 +626,14 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 	lock_acquire(sv->sv_lock);
 
-	reserve_buffers(SFS_BLOCKSIZE);
-
-	result = sfs_dinode_load(sv);
-	if (result) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
-		return result;
-	}
-
-	inodeptr = sfs_dinode_map(sv);
-
-	statbuf->st_size = inodeptr->sfi_size;
-	statbuf->st_nlink = inodeptr->sfi_linkcount;
+	statbuf->st_size = sv->sv_size;
+	statbuf->st_nlink = sv->sv_linkcount;
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
 
 	/* Fill in other fields as desired/possible... */
 
-	sfs_dinode_unload(sv);
-	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
 	return 0;
 }
@@ -367,35 +678,59 @@ sfs_isseekable(struct vnode *v)
 /*
  * Called for fsync().
  *
- * Since for now the buffer cache can't sync just one file, sync the
- * whole fs. This is lame.
+ * First write the file's own data changed since the last fsync (in
+ * ordered mode; see sfs_data_sync), then flush the journal through
+ * the file's commit LSN, which makes its metadata durable. Nothing
+ * else is written: other dirty buffers, the freemap, and the
+ * superblock are left to the checkpointer. A directory's entries are
+ * changed without touching its inode, so for a directory this
+ * commits everything instead.
  *
- * Locking: gets/releases vnode lock. (XXX: really?)
+ * Locking: gets/releases vnode lock.
+ *
+ * Requires up to 5 buffers.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
 
-	return FSOP_SYNC(sv->sv_absvn.vn_fs);
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+	result = sfs_data_sync(sv);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_type == SFS_TYPE_DIR) {
+		return sfs_jlog_commit(sfs);
+	}
+	return sfs_jlog_commitlsn(sfs, &sv->sv_commitlsn);
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped files are paged through the page cache,
+ * which reads them with VOP_READ, so there's nothing SFS-specific to
+ * set up; just say that regular files can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
  * Truncate a file.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases a range lock on the whole file, and the
+ * vnode lock.
  *
  * Requires up to 4 buffers.
  */
@@ -404,13 +739,111 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_range range;
 	int result;
 
+	sfs_range_lock(sv, &range, 0, SFS_RANGE_ALL, true);
+
+	/* Whole chunks can go from a compressed file; nothing else can */
+	if (len > sv->sv_size ||
+	    len % (SFS_ZBLOCKS * SFS_BLOCKSIZE) != 0) {
+		result = sfs_zexpand(sv);
+		if (result) {
+			sfs_range_unlock(sv, &range);
+			return result;
+		}
+	}
+
+	sfs_trans_begin(sfs);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_itrunc(sv, len);
+	/* The block at the new EOF may have been partly zeroed */
+	sfs_data_dirtied(sv, len, 1);
+	sfs_trans_touch(sfs, &sv->sv_commitlsn);
+
+	sfs_trans_end(sfs);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+	sfs_range_unlock(sv, &range);
+
+	vnode_dropcaches(v);
+	return result;
+}
+
+/*
+ * Find the next hole or data (per WHENCE) at or after POS. Data is
+ * whatever blocks are mapped, so a block only partly written counts
+ * as data all through, while preallocated blocks count as holes
+ * until written; and there's always a hole at EOF. Inline and
+ * compressed files are all data.
+ *
+ * Locking: gets/releases vnode lock.
+ *
+ * Requires up to 5 buffers.
+ */
+static
+int
+sfs_seekhole(struct vnode *v, int whence, off_t pos, off_t *ret)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_dinode *inodeptr;
+	daddr_t diskblock;
+	uint32_t fileblock, holespan;
+	off_t size, blockpos;
+	int result;
+
+	KASSERT(whence == SEEK_HOLE || whence == SEEK_DATA);
+
+	lock_acquire(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		goto out;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	size = inodeptr->sfi_size;
+	if (pos < 0 || pos >= size) {
+		result = ENXIO;
+		goto unload;
+	}
+	if (inodeptr->sfi_flags &
+	    (SFS_IFLAG_INLINE | SFS_IFLAG_COMPRESSED)) {
+		/* all data (compressed chunks leave holes that aren't) */
+		*ret = whence == SEEK_DATA ? pos : size;
+		goto unload;
+	}
 
+	fileblock = pos / SFS_BLOCKSIZE;
+	while (1) {
+		blockpos = (off_t)fileblock * SFS_BLOCKSIZE;
+		if (blockpos >= size) {
+			if (whence == SEEK_DATA) {
+				result = ENXIO;
+			}
+			else {
+				*ret = size;
+			}
+			break;
+		}
+		result = sfs_bmap_hole(sv, fileblock, &diskblock, &holespan);
+		if (result) {
+			break;
+		}
+		if ((diskblock != 0) == (whence == SEEK_DATA)) {
+			/* found it */
+			*ret = blockpos > pos ? blockpos : pos;
+			break;
+		}
+		fileblock += diskblock != 0 ? 1 : holespan;
+	}
+
+ unload:
+	sfs_dinode_unload(sv);
+ out:
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
 	return result;
@@ -570,11 +1003,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
+	sfs_trans_begin(sfs);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return result;
@@ -583,6 +1018,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	if (sv_dino->sfi_linkcount == 0) {
 		sfs_dinode_unload(sv);
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return ENOENT;
@@ -593,6 +1029,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return result;
@@ -600,6 +1037,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return EEXIST;
@@ -609,20 +1047,23 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
+			sfs_trans_end(sfs);
 			unreserve_buffers(SFS_BLOCKSIZE);
 			lock_release(sv->sv_lock);
 			return result;
 		}
 
 		*ret = &newguy->sv_absvn;
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
+		sfs_trans_end(sfs);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		return result;
@@ -640,10 +1081,12 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		sfs_dinode_unload(newguy);
 		lock_release(newguy->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
+		sfs_trans_end(sfs);
 		lock_release(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		return result;
 	}
+	vfs_ncache_purge(&sv->sv_absvn, name);
 
 	/* Update the linkcount of the new file */
 	new_dino->sfi_linkcount++;
@@ -654,6 +1097,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	*ret = &newguy->sv_absvn;
 
 	sfs_dinode_unload(newguy);
+	sfs_trans_end(sfs);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(newguy->sv_lock);
 	lock_release(sv->sv_lock);
@@ -675,6 +1119,7 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	struct sfs_dinode *inodeptr;
@@ -688,6 +1133,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	}
 	KASSERT(file != dir);
 
+	sfs_trans_begin(sfs);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
@@ -696,6 +1142,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	result = sfs_dinode_load(f);
 	if (result) {
+		sfs_trans_end(sfs);
 		lock_release(f->sv_lock);
 		lock_release(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
@@ -706,11 +1153,13 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
 		sfs_dinode_unload(f);
+		sfs_trans_end(sfs);
 		lock_release(f->sv_lock);
 		lock_release(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		return result;
 	}
+	vfs_ncache_purge(dir, name);
 
 	/* and update the link count, marking the inode dirty */
 	inodeptr = sfs_dinode_map(f);
@@ -718,6 +1167,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	sfs_dinode_mark_dirty(f);
 
 	sfs_dinode_unload(f);
+	sfs_trans_end(sfs);
 	lock_release(f->sv_lock);
 	lock_release(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
@@ -749,6 +1199,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	(void)mode;
 
+	sfs_trans_begin(sfs);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -786,7 +1237,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 		      sfs->sfs_sb.sb_volname, name, sv->sv_ino);
 	}
 
-	result = sfs_makeobj(sfs, SFS_TYPE_DIR, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_DIR, sv->sv_ino, &newguy);
 	if (result) {
 		goto die_simple;
 	}
@@ -806,6 +1257,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	if (result) {
 		goto die_uncreate;
 	}
+	vfs_ncache_purge(&sv->sv_absvn, name);
 
         /*
          * Increment link counts (Note: not until after the names are
@@ -824,6 +1276,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	sfs_dinode_unload(newguy);
 	sfs_dinode_unload(sv);
+	sfs_trans_end(sfs);
 	lock_release(newguy->sv_lock);
 	lock_release(sv->sv_lock);
 	VOP_DECREF(&newguy->sv_absvn);
@@ -842,6 +1295,7 @@ die_simple:
 	sfs_dinode_unload(sv);
 
 die_early:
+	sfs_trans_end(sfs);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
 	return result;
@@ -872,6 +1326,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		return EINVAL;
 	}
 
+	sfs_trans_begin(sfs);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -918,6 +1373,8 @@ sfs_rmdir(struct vnode *v, const char *name)
 	if (result) {
 		goto die_total;
 	}
+	/* This drops both NAME and anything cached inside VICTIM */
+	vfs_ncache_purge_vnode(&victim->sv_absvn);
 
 	KASSERT(dir_inodeptr->sfi_linkcount > 1);
 	KASSERT(victim_inodeptr->sfi_linkcount==2);
@@ -943,6 +1400,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 	}
 
 die_total:
+	sfs_trans_end(sfs);
 	sfs_dinode_unload(victim);
 die_loadvictim:
 	lock_release(victim->sv_lock);
@@ -950,6 +1408,7 @@ die_loadvictim:
 die_linkcount:
 	sfs_dinode_unload(sv);
 die_loadsv:
+	sfs_trans_end(sfs);
  	unreserve_buffers(SFS_BLOCKSIZE);
  	lock_release(sv->sv_lock);
 
@@ -968,6 +1427,7 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	struct sfs_dinode *victim_inodeptr;
@@ -980,6 +1440,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		return EISDIR;
 	}
 
+	sfs_trans_begin(sfs);
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
@@ -1021,6 +1482,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	if (result) {
 		goto out_reference;
 	}
+	vfs_ncache_purge(dir, name);
 
 	/* Decrement the link count. */
 	KASSERT(victim_inodeptr->sfi_linkcount > 0);
@@ -1028,6 +1490,9 @@ sfs_remove(struct vnode *dir, const char *name)
 	sfs_dinode_mark_dirty(victim);
 
 out_reference:
+	/* Commit while still holding the locks */
+	sfs_trans_end(sfs);
+
 	/* Discard the reference that sfs_lookonce got us */
 	sfs_dinode_unload(victim);
 	lock_release(victim->sv_lock);
@@ -1037,6 +1502,7 @@ out_loadsv:
 	sfs_dinode_unload(sv);
 
 out_buffers:
+	sfs_trans_end(sfs);
 	lock_release(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	return result;
@@ -1053,11 +1519,42 @@ recovermsg(const char *vol, int result, int result2)
 		strerror(result), strerror(result2));
 }
 
+/*
+ * Look up one path component, trying the name cache before locking
+ * the directory.
+ *
+ * Requires up to 3 buffers (on a cache miss).
+ */
+static
+int
+sfs_lookname(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret)
+{
+	struct vnode *vn;
+	int result;
+
+	if (vfs_ncache_lookup(&sv->sv_absvn, name, &vn)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn->vn_data;
+		return 0;
+	}
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_lookonce(sv, name, ret, NULL);
+	lock_release(sv->sv_lock);
+	return result;
+}
+
 /*
  * Helper function for rename. Make sure COMPARE is not a direct
  * ancestor of (or the same as) CHILD.
  *
- * Note: acquires locks as it goes up.
+ * The ".." entries come from the name cache where it has them, so a
+ * walk up a tree that's been walked before locks nothing; that's
+ * safe because the caller holds the rename lock exclusively, and
+ * nothing else changes "..". Otherwise each directory is locked in
+ * turn as the walk goes up.
  */
 static
 int
@@ -1081,10 +1578,7 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
 			*found = 1;
 		}
 
-		lock_acquire(child->sv_lock);
-		result = sfs_lookonce(child, "..", &up, NULL);
-		lock_release(child->sv_lock);
-
+		result = sfs_lookname(child, "..", &up);
 		if (result) {
 			VOP_DECREF(&child->sv_absvn);
 			return result;
@@ -1106,9 +1600,10 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
  * Rename a file.
  *
  * Locking:
- *    Locks sfs_renamelock.
- *    Calls check_parent, which locks various directories one at a
- *       time.
+ *    Locks sfs_renamelock, shared within one directory and
+ *       exclusive between two.
+ *    Calls check_parent, which may lock various directories one at
+ *       a time, when there are two directories.
  *    Locks the target vnodes and their parents in a complex fashion
  *       (described in detail below) which is carefully arranged so
  *       it won't deadlock with rmdir. Or at least I hope so.
@@ -1133,6 +1628,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	int result, result2;
 	struct sfs_direntry sd;
 	int found_dir1;
+	bool samedir = (dir1 == dir2);
 
 	/* make gcc happy */
 	obj2_inodeptr = NULL;
@@ -1163,29 +1659,39 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 *
 	 * To prevent certain deadlocks while locking the vnodes we
 	 * need, the rename lock goes outside all the vnode locks.
+	 *
+	 * A rename within one directory doesn't move anything in the
+	 * tree, so it can't invalidate anyone's parent check and
+	 * needs none itself; and holding the directory locked orders
+	 * it against rmdir and other renames there. So those share
+	 * the rename lock, and go straight to locking the directory.
+	 * (This is the common atomic-replace pattern: write a
+	 * temporary file, then rename it over the real one.)
 	 */
 
+	sfs_trans_begin(sfs);
 	reserve_buffers(SFS_BLOCKSIZE);
 
-	lock_acquire(sfs->sfs_renamelock);
+	if (samedir) {
+		rwlock_acquire_read(sfs->sfs_renamelock);
+		found_dir1 = 1;
+		goto lockdirs;
+	}
+	rwlock_acquire_write(sfs->sfs_renamelock);
 
 	/*
 	 * Get the objects we're moving.
 	 *
-	 * Lock each directory temporarily. We'll check again later to
+	 * This is from the name cache if possible, or else locks
+	 * each directory temporarily. We'll check again later to
 	 * make sure they haven't disappeared and to find slots.
 	 */
-	lock_acquire(dir1->sv_lock);
-	result = sfs_lookonce(dir1, name1, &obj1, NULL);
-	lock_release(dir1->sv_lock);
-
+	result = sfs_lookname(dir1, name1, &obj1);
 	if (result) {
 		goto out0;
 	}
 
-	lock_acquire(dir2->sv_lock);
-	result = sfs_lookonce(dir2, name2, &obj2, NULL);
-	lock_release(dir2->sv_lock);
+	result = sfs_lookname(dir2, name2, &obj2);
 
 	if (result && result != ENOENT) {
 		goto out0;
@@ -1299,6 +1805,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * (If this is true, found_dir1 will be set.)
 	 */
 
+ lockdirs:
 	if (dir1==dir2) {
 		/* This locks "both" dirs */
 		lock_acquire(dir1->sv_lock);
@@ -1365,8 +1872,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * Now reload obj1.
 	 */
 	KASSERT(lock_do_i_hold(dir1->sv_lock));
-	VOP_DECREF(&obj1->sv_absvn);
-	obj1 = NULL;
+	if (obj1 != NULL) {
+		VOP_DECREF(&obj1->sv_absvn);
+		obj1 = NULL;
+	}
 	result = sfs_lookonce(dir1, name1, &obj1, &slot1);
 	if (result) {
 		goto out1;
@@ -1563,6 +2072,8 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
  out4:
+	/* Commit while still holding the locks */
+	sfs_trans_end(sfs);
  	sfs_dinode_unload(dir1);
  out3:
  	sfs_dinode_unload(dir2);
@@ -1570,6 +2081,16 @@ sfs_rename(struct vnode *absdir1, const char *name1,
  	sfs_dinode_unload(obj1);
 	lock_release(obj1->sv_lock);
  out1:
+	sfs_trans_end(sfs);
+	/*
+	 * Whatever happened, forget both names (and, if a directory
+	 * moved, its ..) while we still hold the directory locks.
+	 */
+	vfs_ncache_purge(&dir1->sv_absvn, name1);
+	vfs_ncache_purge(&dir2->sv_absvn, name2);
+	if (obj1 != NULL && obj1->sv_type == SFS_TYPE_DIR) {
+		vfs_ncache_purge(&obj1->sv_absvn, "..");
+	}
 	if (obj2) {
 		sfs_dinode_unload(obj2);
 		lock_release(obj2->sv_lock);
@@ -1579,6 +2100,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		lock_release(dir2->sv_lock);
 	}
  out0:
+	sfs_trans_end(sfs);
 	if (obj2 != NULL) {
 		VOP_DECREF(&obj2->sv_absvn);
 	}
@@ -1588,19 +2110,30 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
-	lock_release(sfs->sfs_renamelock);
+	if (samedir) {
+		rwlock_release_read(sfs->sfs_renamelock);
+	}
+	else {
+		rwlock_release_write(sfs->sfs_renamelock);
+	}
 
 	return result;
 }
 
+/*
+ * Walk PATH, which is left alone: each directory component is looked
+ * up from a copy in NAME rather than by cutting the path up in place.
+ */
 static
 int
-sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
+sfs_lookparent_internal(struct vnode *v, const char *path, struct vnode **ret,
 		  char *buf, size_t buflen)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *next;
-	char *s;
+	char name[SFS_NAMELEN];
+	const char *s;
+	size_t len;
 	int result;
 
 	VOP_INCREF(&sv->sv_absvn);
@@ -1617,12 +2150,16 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 			/* Last component. */
 			break;
 		}
-		*s = 0;
+		len = s - path;
+		if (len >= sizeof(name)) {
+			VOP_DECREF(&sv->sv_absvn);
+			return ENAMETOOLONG;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
 		s++;
 
-		lock_acquire(sv->sv_lock);
-		result = sfs_lookonce(sv, path, &next, NULL);
-		lock_release(sv->sv_lock);
+		result = sfs_lookname(sv, name, &next);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -1649,15 +2186,16 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
  * lookparent returns the last path component as a string and the
  * directory it's in as a vnode.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
- *   lock the new vnode, but does hand back a reference to it (so it
+ * Locking: gets the vnode lock while calling sfs_lookonce, if the
+ *   name cache can't answer. Doesn't lock the new vnode, but does
+ *   hand back a reference to it (so it
  *   won't evaporate).
  *
  * Requires up to 3 buffers.
  */
 static
 int
-sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
+sfs_lookparent(struct vnode *v, const char *path, struct vnode **ret,
 		  char *buf, size_t buflen)
 {
 	int result;
@@ -1671,15 +2209,16 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 /*
  * Lookup gets a vnode for a pathname.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
- *   lock the new vnode, but does hand back a reference to it (so it
+ * Locking: gets the vnode lock while calling sfs_lookonce, if the
+ *   name cache can't answer. Doesn't lock the new vnode, but does
+ *   hand back a reference to it (so it
  *   won't evaporate).
  *
  * Requires up to 3 buffers.
  */
 static
 int
-sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
+sfs_lookup(struct vnode *v, const char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct vnode *dirv;
@@ -1697,11 +2236,7 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	}
 
 	dir = dirv->vn_data;
-	lock_acquire(dir->sv_lock);
-
-	result = sfs_lookonce(dir, name, &final, NULL);
-
-	lock_release(dir->sv_lock);
+	result = sfs_lookname(dir, name, &final);
 	VOP_DECREF(dirv);
 
 	if (result) {
@@ -1730,6 +2265,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_read = sfs_read,
 	.vop_readlink = vopfail_uio_notdir,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = sfs_write,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -1738,6 +2274,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
+	.vop_seekhole = sfs_seekhole,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -1764,6 +2301,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = sfs_getdirentry,
+	.vop_getdirentries = sfs_getdirentries,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -1772,6 +2310,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = sfs_namefile,
 
 	.vop_creat = sfs_creat,
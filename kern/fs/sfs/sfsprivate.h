@@ -32,6 +32,8 @@
 
 #include <uio.h> /* for uio_rw */
 struct buf; /* in buf.h */
+struct bio; /* in bio.h */
+struct kstat; /* in kstat.h */
 
 
 //#define SFS_VERBOSE_RECOVERY
@@ -40,6 +42,9 @@ struct buf; /* in buf.h */
 /* Type for log sequence numbers */
 typedef uint64_t sfs_lsn_t;
 
+/* Commit LSN not known (see sfs_trans_touch) */
+#define SFS_LSN_UNKNOWN ((sfs_lsn_t)-1)
+
 /* jphys write callback context; define it however is convenient */
 struct sfs_jphys_writecontext;
 
@@ -66,19 +71,74 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock,
+	       struct buf **bufret);
+int sfs_balloc_range(struct sfs_fs *sfs, daddr_t goal, uint32_t count,
+		     daddr_t *firstret, uint32_t *countret);
+void sfs_freemap_dirtied(struct sfs_fs *sfs, daddr_t start, uint32_t count);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfree_range_prelocked(struct sfs_fs *sfs, daddr_t start,
+		uint32_t count);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_lock_freemap(struct sfs_fs *sfs);
 void sfs_unlock_freemap(struct sfs_fs *sfs);
 
+/*
+ * Blocks allocated ahead for a write of whole blocks; see sfs_io.
+ */
+struct sfs_allocrun {
+	uint32_t ar_want;	/* blocks the write may still need */
+	daddr_t ar_next;	/* next allocated block not yet used */
+	uint32_t ar_count;	/* how many allocated blocks are left */
+	bool ar_fresh;		/* last block mapped came from the run */
+};
+
+/*
+ * A byte range of a file held by sfs_range_lock, for the duration of
+ * a read or write; see sfs_io.c. These are the caller's, usually on
+ * its stack.
+ */
+struct sfs_range {
+	struct listnode sr_node;	/* on sv_ranges */
+	off_t sr_start;			/* first byte */
+	off_t sr_end;			/* past the last byte */
+	bool sr_excl;			/* exclusive (for writing) */
+};
+
+/* sr_end for a range that covers the whole file, however long */
+#define SFS_RANGE_ALL	((off_t)(~(uint64_t)0 >> 1))
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock,
 		bool doalloc, daddr_t *diskblock);
+int sfs_bmap_run(struct sfs_vnode *sv, uint32_t fileblock,
+		struct sfs_allocrun *run, daddr_t *diskblock);
+int sfs_bmap_hole(struct sfs_vnode *sv, uint32_t fileblock,
+		  daddr_t *diskblock, uint32_t *holespan);
+int sfs_bmap_advance(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t maxzero, bool *done);
+int sfs_bmap_markwritten(struct sfs_vnode *sv, uint32_t fileblock,
+		bool *unwritten);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_ipunch(struct sfs_vnode *sv, off_t pos, off_t len);
+
+/* Functions in sfs_extent.c */
+void sfs_extent_initroot(struct sfs_dinode *dino);
+int sfs_extent_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		struct sfs_allocrun *run, daddr_t *diskblock,
+		uint32_t *holespan);
+int sfs_extent_discard(struct sfs_vnode *sv, uint32_t start, uint32_t end);
+int sfs_extent_mapend(struct sfs_vnode *sv, uint32_t *ret);
+
+/* Functions in sfs_compress.c */
+int sfs_zread(struct sfs_vnode *sv, struct uio *uio);
+int sfs_zconvert(struct sfs_vnode *sv, bool compress);
+int sfs_zexpand(struct sfs_vnode *sv);
 
 /* Functions in sfs_dir.c */
+void sfs_dirindex_destroy(struct sfs_vnode *sv);
 int sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd);
 int sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd);
 int sfs_dir_nentries(struct sfs_vnode *sv, int *ret);
@@ -94,6 +154,9 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_dinode_load(struct sfs_vnode *sv);
 void sfs_dinode_unload(struct sfs_vnode *sv);
@@ -102,23 +165,84 @@ void sfs_dinode_mark_dirty(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_peektype(struct sfs_fs *sfs, uint32_t ino, int *ret);
+int sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
+void sfs_inactive_init(struct sfs_fs *sfs);
+void sfs_inactive_cleanup(struct sfs_fs *sfs);
+void sfs_inactive_start(struct sfs_fs *sfs);
+void sfs_inactive_stop(struct sfs_fs *sfs);
 
 /* Functions in sfs_io.c */
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
+void sfs_startread(struct fs *fs, daddr_t block, struct bio *bio);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		   void *data, size_t len);
-int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+void sfs_data_prepare(struct sfs_fs *sfs, struct buf *buf);
+void sfs_data_done(struct sfs_fs *sfs, struct buf *buf, daddr_t block,
+		   bool dirty, bool fresh);
+int sfs_data_flushrun(struct sfs_fs *sfs, daddr_t start, uint32_t count);
+void sfs_data_dirtied(struct sfs_vnode *sv, off_t pos, off_t len);
+int sfs_data_sync(struct sfs_vnode *sv);
+void sfs_range_lock(struct sfs_vnode *sv, struct sfs_range *sr,
+		off_t start, off_t end, bool excl);
+void sfs_range_unlock(struct sfs_vnode *sv, struct sfs_range *sr);
+int sfs_io(struct sfs_vnode *sv, struct uio *uio, bool droplock);
+int sfs_fadvise(struct sfs_vnode *sv, off_t pos, off_t len, unsigned advice);
+int sfs_inline_evict(struct sfs_vnode *sv);
+int sfs_iprealloc(struct sfs_vnode *sv, off_t pos, off_t len,
+		bool keepsize);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
-/* Function used by sfs_jphys.c - you write this */
-/* XXX: there should be a template; but we don't ship the file it belongs in */
+/* Functions in sfs_jlog.c */
+struct sfs_jlog *sfs_jlog_create(void);
+void sfs_jlog_destroy(struct sfs_jlog *jl);
+void sfs_trans_begin(struct sfs_fs *sfs);
+void sfs_trans_begin_locked(struct sfs_fs *sfs);
+void sfs_trans_end(struct sfs_fs *sfs);
+void sfs_trans_split(struct sfs_fs *sfs, struct buf *held);
+bool sfs_trans_logged(struct sfs_fs *sfs);
+void sfs_trans_touch(struct sfs_fs *sfs, sfs_lsn_t *lsnp);
+sfs_lsn_t sfs_trans_loadlsn(struct sfs_fs *sfs);
+void sfs_trans_untouch(struct sfs_fs *sfs, sfs_lsn_t *lsnp);
+void sfs_jlog_alloc(struct sfs_fs *sfs, daddr_t start, uint32_t count);
+bool sfs_jlog_free(struct sfs_fs *sfs, daddr_t start, uint32_t count);
+int sfs_jlog_prefreemap(struct sfs_fs *sfs);
+void sfs_jlog_postfreemap(struct sfs_fs *sfs);
+void sfs_jlog_prepare(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jlog_forget(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jlog_reset(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jlog_dirty(struct sfs_fs *sfs, struct buf *buf, daddr_t block);
+void sfs_jlog_ordered(struct sfs_fs *sfs, daddr_t block);
+void sfs_jlog_postwrite(struct sfs_fs *sfs, void *fsbufdata);
+void sfs_jlog_detach(struct sfs_fs *sfs, void *fsbufdata);
+int sfs_jlog_commit(struct sfs_fs *sfs);
+int sfs_jlog_commitlsn(struct sfs_fs *sfs, sfs_lsn_t *lsnp);
+void sfs_jlog_checkpoint(struct sfs_fs *sfs);
+int sfs_jlog_startcheckpointer(struct sfs_fs *sfs);
+void sfs_jlog_stopcheckpointer(struct sfs_fs *sfs);
+void sfs_jlog_printstats(struct sfs_fs *sfs);
+void sfs_jlog_kstat(struct sfs_fs *sfs, struct kstat *ks);
+void sfs_jlog_resetstats(struct sfs_fs *sfs);
+int sfs_jlog_recover(struct sfs_fs *sfs);
+/* used by sfs_jphys.c */
 #ifdef SFS_VERBOSE_RECOVERY
 const char *sfs_jphys_client_recname(unsigned type);
 #endif
 
+/*
+ * Journal container statistics (sfs_jphys_getstats).
+ */
+struct sfs_jphys_stats {
+	uint64_t js_records;	/* client records written */
+	uint64_t js_recbytes;	/* their size, headers included */
+	uint32_t js_blocks;	/* journal blocks used */
+	uint32_t js_odometer;	/* ...since the last checkpoint */
+	uint32_t js_flushes;	/* flushes that had to write */
+};
+
 /* Functions in sfs_jphys.c */
 bool sfs_block_is_journal(struct sfs_fs *sfs, uint32_t block);
 /* writer interface */
@@ -138,6 +262,9 @@ sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
+void sfs_jphys_getstats(struct sfs_jphys *jp, struct sfs_jphys_stats *st);
+void sfs_jphys_clearstats(struct sfs_jphys *jp);
+uint32_t sfs_jphys_getusage(struct sfs_fs *sfs);
 /* reader interface */
 bool sfs_jiter_done(struct sfs_jiter *ji);
 unsigned sfs_jiter_type(struct sfs_jiter *ji);
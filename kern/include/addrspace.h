@@ -39,8 +39,60 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct shm;
 
 
+#if !OPT_DUMBVM
+struct pagetable;
+
+/*
+ * A region of an address space: NPAGES pages starting at VBASE, with
+ * the access permissions in PERMS. Regions are kept on a list sorted
+ * by address and never overlap. Region lookups only happen the first
+ * time a page is touched; after that the page table answers.
+ *
+ * A region may be backed by a file: FILESIZE bytes starting at
+ * address FILEVA come from offset FILEOFF of VNODE. Such pages are
+ * read in from the file the first time they're touched; everything
+ * else in the region (e.g. BSS) is zero-filled.
+ *
+ * A region may instead be a mapping of the shared memory segment
+ * SHM, whose pages are the same physical pages in every address
+ * space that maps it (see shm.h). Regions made by mmap have MAPPED
+ * set, and only those can be unmapped.
+ *
+ * Or a region may be the one page KPAGE of kernel memory, read-only;
+ * that's how the time page is mapped. It never goes in the page
+ * table, which only has user pages; vm_fault loads the translation.
+ *
+ * ADVICE is the access pattern last given for the region with
+ * madvise (an MADV_* value from <kern/mman.h>).
+ */
+struct as_region {
+	vaddr_t ar_vbase;
+	size_t ar_npages;
+	unsigned ar_perms;		/* AR_* flags */
+	struct vnode *ar_vnode;		/* backing file, or NULL */
+	off_t ar_fileoff;		/* file offset of ar_fileva */
+	vaddr_t ar_fileva;		/* where the file data starts */
+	size_t ar_filesize;		/* bytes of file data */
+	struct shm *ar_shm;		/* shared segment, or NULL */
+	bool ar_mapped;			/* made by as_mmap or as_mmapanon */
+	paddr_t ar_kpage;		/* kernel page mapped, or 0 */
+	int ar_advice;			/* MADV_NORMAL, _RANDOM, _SEQUENTIAL */
+	struct as_region *ar_next;
+};
+
+/* Region permissions (same values as the ELF PF_* flags) */
+#define AR_EXEC    0x1
+#define AR_WRITE   0x2
+#define AR_READ    0x4
+
+/* Size of the user stack, in pages. Costs nothing until touched. */
+#define VM_STACKPAGES    256
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -58,7 +110,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+	struct lock *as_lock;		/* for threads sharing it */
+	struct as_region *as_regions;	/* sorted list of regions */
+	struct pagetable *as_pt;	/* page table */
+	bool as_loading;		/* between prepare/complete_load */
+	struct as_region *as_heap;	/* heap region, once loaded */
+	vaddr_t as_heapbreak;		/* current break, within as_heap */
+	struct mmu_ctx as_mmu;		/* ASIDs (see <machine/vm.h>) */
 #endif
 };
 
@@ -99,6 +157,60 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - make the FILESIZE bytes at VADDR, which must lie
+ *                within one region, come from offset OFFSET of file
+ *                VN on demand. The address space keeps a reference
+ *                to VN.
+ *
+ *    as_mmap   - map LEN bytes of file VN, starting at the page-aligned
+ *                offset OFFSET, at an address of the address space's
+ *                choosing, handed back in RET. Pages are shared with
+ *                the page cache; if WRITEABLE, writing makes private
+ *                copies (nothing is ever written back to the file).
+ *
+ *    as_mmapanon - map LEN bytes of zero-filled memory, as for as_mmap.
+ *                If SHARED, it's a new shared memory segment, which
+ *                stays shared with the children as_copy makes;
+ *                otherwise it's private like the heap.
+ *
+ *    as_munmap - remove the mapping made by as_mmap or as_mmapanon
+ *                that covers exactly the LEN bytes at VADDR. Fails
+ *                with EINVAL for anything else, including part of a
+ *                mapping.
+ *
+ *    as_timepage - map the time page (see <kern/timepage.h>), if it
+ *                isn't already, and hand back its address.
+ *
+ *    as_madvise - take ADVICE, an MADV_* value, about the LEN bytes at
+ *                the page-aligned address VADDR (see <kern/mman.h>).
+ *                Fails with ENOMEM if any of it isn't mapped.
+ *
+ *    as_mlock  - lock the pages of the LEN bytes at VADDR in memory,
+ *                if LOCK, paging them in; otherwise unlock them.
+ *                Fails with ENOMEM if any of it isn't mapped, and
+ *                with EAGAIN if too much memory is locked already;
+ *                pages already done stay locked.
+ *
+ *    as_mincore - store a byte for each page of the LEN bytes at
+ *                VADDR in the user array VEC: 1 if it's in memory,
+ *                0 if not.
+ *
+ *    as_futexkey - name the word at UADDR for futexes: normally AS
+ *                and UADDR themselves, but for a shared segment, the
+ *                segment and the offset in it, so that futexes work
+ *                between processes mapping it.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                Used by vm_fault.
+ *
+ *    as_sbrk   - move the heap's break by AMOUNT bytes, handing back
+ *                the old break. The heap is a region starting just
+ *                above the program's highest segment; it grows and
+ *                shrinks a page at a time, each page allocated on
+ *                first touch like any other. Fails with EINVAL if
+ *                the break would go below its start, and ENOMEM if
+ *                the heap would run into the next region.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,16 +229,45 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *vn,
+                          off_t offset, size_t len, int writeable,
+                          vaddr_t *ret);
+int               as_mmapanon(struct addrspace *as, size_t len,
+                              int writeable, int shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t len);
+int               as_timepage(struct addrspace *as, vaddr_t *ret);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr,
+                             size_t len, int advice);
+int               as_mlock(struct addrspace *as, vaddr_t vaddr,
+                           size_t len, bool lock);
+int               as_mincore(struct addrspace *as, vaddr_t vaddr,
+                             size_t len, userptr_t vec);
+void              as_futexkey(struct addrspace *as, vaddr_t uaddr,
+                              const void **key, uintptr_t *off);
+#if !OPT_DUMBVM
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *vn, off_t offset,
+                                 size_t filesize);
+struct as_region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+#endif
 
 
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
  *               address space. Returns the entry point (initial PC)
- *               in the space pointed to by ENTRYPOINT.
+ *               in the space pointed to by ENTRYPOINT. The parsed
+ *               headers are cached in the vnode for next time.
+ *
+ *    load_elf_uncache - forget V's cached headers. Called through
+ *               vnode_dropcaches when the file changes.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
+void load_elf_uncache(struct vnode *v);
 
 
 #endif /* _ADDRSPACE_H_ */
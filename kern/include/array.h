@@ -31,9 +31,17 @@
 #define _ARRAY_H_
 
 #include <cdefs.h>
+#include <kern/errno.h>
 #include <lib.h>
 
+/*
+ * Bounds and consistency checks. These follow the "noasserts" kernel
+ * config option, so in production kernels array and vector accessors
+ * compile down to plain loads and stores.
+ */
+#if !OPT_NOASSERTS
 #define ARRAYS_CHECKED
+#endif
 
 #ifdef ARRAYS_CHECKED
 #define ARRAYASSERT KASSERT
@@ -42,7 +50,7 @@
 #endif
 
 #ifndef ARRAYINLINE
-#define ARRAYINLINE INLINE
+#define ARRAYINLINE INLINE __FORCEINLINE
 #endif
 
 /*
@@ -115,9 +123,15 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	int ret;
 
 	index = a->num;
-	ret = array_setsize(a, index+1);
-	if (ret) {
-		return ret;
+	if (index < a->max) {
+		/* Fast path: there's already room, no call needed. */
+		a->num = index+1;
+	}
+	else {
+		ret = array_setsize(a, index+1);
+		if (ret) {
+			return ret;
+		}
 	}
 	a->v[index] = val;
 	if (index_ret != NULL) {
@@ -258,6 +272,189 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 #define DECLARRAY(T, INLINE) DECLARRAY_BYTYPE(T##array, struct T, INLINE)
 #define DEFARRAY(T, INLINE) DEFARRAY_BYTYPE(T##array, struct T, INLINE)
 
+/*
+ * Typed vectors.
+ *
+ * The arrays above always hold pointers, each one boxed as a void *;
+ * getting at an element means reaching through the array and then
+ * through the pointer. Vectors instead hold elements of type T
+ * directly in a resizeable block of T, with the same operations as
+ * arrays except that get and set take and return T by value, and
+ * getptr returns a pointer to the element in place (valid until the
+ * next operation that may resize the vector). Element access is a
+ * single indexed load; the capacity is doubled when it runs out, so
+ * adding is amortized constant time, and only the growth itself goes
+ * out of line.
+ *
+ * Usage:
+ *
+ * DECLVECTOR_BYTYPE(foo, bar, INLINE) declares "struct foo", which is
+ * a vector of "bar", plus the operations on it.
+ *
+ * DECLVECTOR(foo, INLINE) is equivalent to
+ * DECLVECTOR_BYTYPE(foovector, struct foo, INLINE).
+ *
+ * DEFVECTOR_BYTYPE and DEFVECTOR define the operations, in the same
+ * way as DEFARRAY_BYTYPE and DEFARRAY.
+ *
+ * For example, DECLVECTOR_BYTYPE(u32vector, uint32_t, INLINE) gives
+ * u32vector_add(v, 7, NULL), u32vector_get(v, 0), and so forth.
+ *
+ * Since vectors store elements by value, removing an element or
+ * cleaning up the vector frees nothing the elements may point to.
+ */
+
+/*
+ * Allocate room for NEED elements of size ELSIZE, copying the first
+ * NUM from the old block V, and return the new block. *MAXP is the old
+ * capacity on entry and the new one on success. Returns NULL (and
+ * leaves V alone) if out of memory.
+ */
+void *vector_grow(void *v, size_t elsize, unsigned num,
+		  unsigned *maxp, unsigned need);
+
+#define DECLVECTOR_BYTYPE(VEC, T, INLINE) \
+	struct VEC {						\
+		T *v;						\
+		unsigned num, max;				\
+	};							\
+								\
+	INLINE struct VEC *VEC##_create(void);			\
+	INLINE void VEC##_destroy(struct VEC *vec);		\
+	INLINE void VEC##_init(struct VEC *vec);		\
+	INLINE void VEC##_cleanup(struct VEC *vec);		\
+	INLINE unsigned VEC##_num(const struct VEC *vec);	\
+	INLINE T VEC##_get(const struct VEC *vec, unsigned index); \
+	INLINE T *VEC##_getptr(const struct VEC *vec, unsigned index); \
+	INLINE void VEC##_set(struct VEC *vec, unsigned index, T val); \
+	INLINE int VEC##_preallocate(struct VEC *vec, unsigned num); \
+	INLINE int VEC##_setsize(struct VEC *vec, unsigned num);	\
+	INLINE int VEC##_add(struct VEC *vec, T val, unsigned *index_ret); \
+	INLINE void VEC##_remove(struct VEC *vec, unsigned index)
+
+#define DEFVECTOR_BYTYPE(VEC, T, INLINE) \
+	INLINE struct VEC *					\
+	VEC##_create(void)					\
+	{							\
+		struct VEC *vec = kmalloc(sizeof(*vec));	\
+		if (vec == NULL) {				\
+			return NULL;				\
+		}						\
+		VEC##_init(vec);				\
+		return vec;					\
+	}							\
+								\
+	INLINE void						\
+	VEC##_destroy(struct VEC *vec)				\
+	{							\
+		VEC##_cleanup(vec);				\
+		kfree(vec);					\
+	}							\
+								\
+	INLINE void						\
+	VEC##_init(struct VEC *vec)				\
+	{							\
+		vec->v = NULL;					\
+		vec->num = vec->max = 0;			\
+	}							\
+								\
+	INLINE void						\
+	VEC##_cleanup(struct VEC *vec)				\
+	{							\
+		kfree(vec->v);					\
+		vec->v = NULL;					\
+		vec->num = vec->max = 0;			\
+	}							\
+								\
+	INLINE unsigned						\
+	VEC##_num(const struct VEC *vec)			\
+	{							\
+		return vec->num;				\
+	}							\
+								\
+	INLINE T						\
+	VEC##_get(const struct VEC *vec, unsigned index)	\
+	{							\
+		ARRAYASSERT(index < vec->num);			\
+		return vec->v[index];				\
+	}							\
+								\
+	INLINE T *						\
+	VEC##_getptr(const struct VEC *vec, unsigned index)	\
+	{							\
+		ARRAYASSERT(index < vec->num);			\
+		return &vec->v[index];				\
+	}							\
+								\
+	INLINE void						\
+	VEC##_set(struct VEC *vec, unsigned index, T val)	\
+	{							\
+		ARRAYASSERT(index < vec->num);			\
+		vec->v[index] = val;				\
+	}							\
+								\
+	INLINE int						\
+	VEC##_preallocate(struct VEC *vec, unsigned num)	\
+	{							\
+		T *newv;					\
+								\
+		if (num <= vec->max) {				\
+			return 0;				\
+		}						\
+		newv = vector_grow(vec->v, sizeof(T), vec->num,	\
+				   &vec->max, num);		\
+		if (newv == NULL) {				\
+			return ENOMEM;				\
+		}						\
+		vec->v = newv;					\
+		return 0;					\
+	}							\
+								\
+	INLINE int						\
+	VEC##_setsize(struct VEC *vec, unsigned num)		\
+	{							\
+		int result;					\
+								\
+		result = VEC##_preallocate(vec, num);		\
+		if (result) {					\
+			return result;				\
+		}						\
+		vec->num = num;					\
+		return 0;					\
+	}							\
+								\
+	INLINE int						\
+	VEC##_add(struct VEC *vec, T val, unsigned *index_ret)	\
+	{							\
+		unsigned index;					\
+		int result;					\
+								\
+		index = vec->num;				\
+		result = VEC##_setsize(vec, index+1);		\
+		if (result) {					\
+			return result;				\
+		}						\
+		vec->v[index] = val;				\
+		if (index_ret != NULL) {			\
+			*index_ret = index;			\
+		}						\
+		return 0;					\
+	}							\
+								\
+	INLINE void						\
+	VEC##_remove(struct VEC *vec, unsigned index)		\
+	{							\
+		ARRAYASSERT(index < vec->num);			\
+		memmove(vec->v + index, vec->v + index + 1,	\
+			(vec->num - (index + 1)) * sizeof(T));	\
+		vec->num--;					\
+	}
+
+#define DECLVECTOR(T, INLINE) \
+	DECLVECTOR_BYTYPE(T##vector, struct T, INLINE)
+#define DEFVECTOR(T, INLINE) \
+	DEFVECTOR_BYTYPE(T##vector, struct T, INLINE)
+
 /*
  * This is how you declare an array of strings; it works out as
  * an array of pointers to char.
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic counters. These are for reference counts and the like,
+ * where taking a spinlock for every increment and decrement would
+ * make the lock itself the point of contention: each operation is
+ * one atomic read-modify-write of the counter and nothing else.
+ *
+ * atomic_get reads the counter.
+ *
+ * atomic_inc adds one to it.
+ *
+ * atomic_inc_not_zero adds one unless it's zero, and returns whether
+ * it did. Use it to take a reference on an object whose count may
+ * already have dropped to zero (being destroyed).
+ *
+ * atomic_dec_and_test subtracts one and returns true if that made it
+ * zero.
+ *
+ * atomic_add_unless adds DELTA unless the counter is UNLESS, and
+ * returns whether it did. The others are built on it; it's also what
+ * to use to drop a reference that mustn't be the last one.
+ *
+ * Like the spinlock operations, these include any memory barriers
+ * the machine needs: everything before each one happens before it,
+ * and everything after it happens after.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+ATOMIC_INLINE unsigned atomic_get(volatile unsigned *p);
+ATOMIC_INLINE void atomic_inc(volatile unsigned *p);
+ATOMIC_INLINE bool atomic_inc_not_zero(volatile unsigned *p);
+ATOMIC_INLINE bool atomic_dec_and_test(volatile unsigned *p);
+ATOMIC_INLINE bool atomic_add_unless(volatile unsigned *p, int delta,
+				     unsigned unless);
+
+/* Get the implementation. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
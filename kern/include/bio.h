@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BIO_H_
+#define _BIO_H_
+
+/*
+ * Block I/O requests.
+ *
+ * A struct bio describes one transfer between a kernel buffer and a
+ * block device. It's handed to bio_submit, which returns without
+ * waiting for the transfer if the device can queue requests
+ * (devop_strategy), though a device short of request structures
+ * (devraid) may sleep until some free up, so submit from a thread
+ * unless the device is known not to (lhd). The completion
+ * routine bio_done is called later with bio_result set. Completion
+ * may happen in an interrupt handler, so bio_done must not sleep or
+ * take sleep locks; it should just note the result and wake
+ * someone. The submitter owns the bio and the data until then.
+ *
+ * A device without devop_strategy gets the request done synchronously
+ * by devop_io instead, and bio_done is called before bio_submit
+ * returns.
+ *
+ * Conversely, a device with devop_strategy can implement devop_io
+ * with bio_uio, which does a uio as requests and waits for them.
+ */
+
+#include <uio.h>	/* for enum uio_rw */
+#include <kern/time.h>	/* for struct timespec */
+
+struct device;		/* in <device.h> */
+
+struct bio {
+	off_t bio_offset;		/* byte position on the device */
+	void *bio_data;			/* kernel buffer */
+	size_t bio_len;			/* bytes to transfer */
+	enum uio_rw bio_rw;		/* read or write */
+	void (*bio_done)(struct bio *);	/* completion routine */
+	void *bio_arg;			/* for the completion routine */
+	int bio_result;			/* errno, set before bio_done */
+	struct bio *bio_next;		/* for the device's queue */
+
+	/* for the I/O scheduler (see iosched.h) */
+	struct bio *bio_chain;		/* requests merged after this one */
+	struct timespec bio_queued;	/* when it was queued */
+
+	/* for the driver's statistics (see iostat.h) */
+	struct timespec bio_started;	/* when the driver got it */
+};
+
+/* Fill in a request. */
+void bio_init(struct bio *bio, off_t offset, void *data, size_t len,
+	      enum uio_rw rw, void (*done)(struct bio *), void *arg);
+
+/* Start a request; BIO->bio_done is called when it's finished. */
+void bio_submit(struct device *dev, struct bio *bio);
+
+/* Do a uio on DEV as requests, in units of SECTSIZE, and wait. */
+int bio_uio(struct device *dev, struct uio *uio, size_t sectsize);
+
+/* Largest sector size bio_uio handles. */
+#define BIO_MAXSECTSIZE		512
+
+/* Sectors per request when bio_uio copies through a bounce buffer. */
+#define BIO_BOUNCESECTS		8
+
+
+#endif /* _BIO_H_ */
@@ -37,9 +37,17 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_recount - update internal state after changing the raw
+ *                      bit data (e.g. reading it in).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - same, but look at or after a given bit first.
+ *     bitmap_alloc_range - locate a run of cleared bits, set them, and
+ *                      return the index of the first.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_mark_range - set a run of clear bits.
+ *     bitmap_unmark_range - clear a run of set bits.
+ *     bitmap_count   - return the number of set bits.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
  */
@@ -49,9 +57,19 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_recount(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned goal,
+                                 unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned count,
+                                  unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_mark_range(struct bitmap *, unsigned start,
+                                 unsigned count);
+void           bitmap_unmark_range(struct bitmap *, unsigned start,
+                                   unsigned count);
+unsigned       bitmap_count(struct bitmap *);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
@@ -39,16 +39,18 @@ struct fs;  /* fs.h */
  * virtually indexed, where the key is a vnode and block offset within
  * the vnode.)
  *
- * In the real world you'd want buffers to be able to be different
- * sizes (since not every FS in existence uses the same block size,
- * and some can use different block sizes as a formatting option) but
- * to reduce complexity here we'll require all buffers to be the
- * ONE_TRUE_BUFFER_SIZE, which is defined in buf.c.
- *
- * In any event each FS should use buffers of only one size, or at
- * least of a consistent size for any particular disk offset, because
- * handling partial or overlapping buffers would be extremely
- * problematic.
+ * Buffers can be any multiple of BUFFER_MINSIZE (512) bytes up to
+ * BUFFER_MAXSIZE (8192), both defined in buf.c. A buffer larger than
+ * one block covers that many consecutive blocks and is keyed by the
+ * first of them, so an FS can cache and do I/O on whole extents at a
+ * time; the FS's readblock and writeblock functions are then passed
+ * the full length.
+ *
+ * Each FS should still use a consistent size for any particular disk
+ * offset, and must not let buffers overlap, because handling partial
+ * or overlapping buffers would be extremely problematic. (Asking for
+ * a different size at a block that already has a buffer works, but
+ * only by writing out and discarding the old buffer first.)
  */
 
 struct buf; /* Opaque. */
@@ -80,8 +82,24 @@ struct buf; /* Opaque. */
  * buffer_flush looks for an existing buffer and writes it out (if
  * dirty) immediately without returning it.
  *
+ * buffer_flush_run is the same for a run of adjacent blocks, which it
+ * writes in order with as few device writes as it can; it may stop
+ * early (see buf.c), so check and call again for the rest.
+ *
  * buffer_drop looks for an existing buffer and invalidates it
  * immediately without returning it.
+ *
+ * buffer_forget is the same, but only if the buffer is clean and not
+ * in use; it's for hints that the block won't be needed soon.
+ *
+ * buffer_prefetch asks for a block to be read into the cache in the
+ * background, for read-ahead. It doesn't wait for the I/O and doesn't
+ * return anything; requests may be dropped if too many are pending.
+ *
+ * buffer_cached says whether the cache holds valid contents for a
+ * block, for I/O that bypasses the cache and mustn't read around
+ * newer data. The answer only stays true while the caller keeps the
+ * block from being written.
  */
 
 int buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
@@ -91,7 +109,12 @@ int buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 			  struct buf **ret);
 int buffer_flush(struct fs *fs, daddr_t block, size_t size);
+int buffer_flush_run(struct fs *fs, daddr_t block, unsigned num,
+		     size_t size);
 void buffer_drop(struct fs *fs, daddr_t block, size_t size);
+void buffer_forget(struct fs *fs, daddr_t block);
+void buffer_prefetch(struct fs *fs, daddr_t block, size_t size);
+bool buffer_cached(struct fs *fs, daddr_t block);
 
 /*
  * Release-a-buffer operations.
@@ -125,6 +148,19 @@ void buffer_release_and_invalidate(struct buf *buf);
 void *buffer_get_fsdata(struct buf *buf);
 void *buffer_set_fsdata(struct buf *buf, void *fsd);
 
+/*
+ * Write-ahead point.
+ *
+ * buffer_set_walsn says the FS's log must be on disk through LSN
+ * before the buffer may be written; the buffer cache calls
+ * FSOP_FLUSHLOG for it first. Setting a lower LSN than one already
+ * set does nothing. The point goes back to none when the buffer is
+ * written (or invalidated).
+ *
+ * The buffer must be marked busy.
+ */
+void buffer_set_walsn(struct buf *buf, uint64_t lsn);
+
 /*
  * Other operations on buffers.
  *
@@ -184,9 +220,20 @@ void reserve_fsmanaged_buffers(unsigned count, size_t size);
 void unreserve_fsmanaged_buffers(unsigned count, size_t size);
 
 /*
- * Print stats.
+ * Give a file system a guaranteed minimum and/or a maximum share of
+ * the buffer cache, in percent of the buffer space; a maximum of 0 is
+ * no limit. Reservations (above) stay global.
+ */
+int buffer_set_fs_share(struct fs *fs, unsigned minpct, unsigned maxpct);
+
+/*
+ * Print stats, overall and per file system; or reset the counters.
+ * buffer_kstat adds the overall ones to a kstat snapshot.
  */
+struct kstat;
 void buffer_printstats(void);
+void buffer_resetstats(void);
+void buffer_kstat(struct kstat *ks);
 
 /*
  * Bootup.
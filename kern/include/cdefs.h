@@ -51,16 +51,20 @@
 /*
  * Tell GCC how to check printf formats. Also tell it about functions
  * that don't return, as this is helpful for avoiding bogus warnings
- * about uninitialized variables.
+ * about uninitialized variables. __aligned(n) aligns a type, variable,
+ * or structure member to N bytes, e.g. to keep fields written by
+ * different cpus on different cache lines.
  */
 #ifdef __GNUC__
 #define __PF(a,b) __attribute__((__format__(__printf__, a, b)))
 #define __DEAD    __attribute__((__noreturn__))
 #define __UNUSED  __attribute__((__unused__))
+#define __aligned(n) __attribute__((__aligned__(n)))
 #else
 #define __PF(a,b)
 #define __DEAD
 #define __UNUSED
+#define __aligned(n)
 #endif
 
 
@@ -137,5 +141,22 @@
 #define INLINE static __UNUSED inline
 #endif
 
+/*
+ * __FORCEINLINE can be added after INLINE (as in "INLINE __FORCEINLINE")
+ * on small, hot functions whose calls should always be inlined
+ * whatever the compiler's size heuristics think, like the spinlock
+ * primitives. It is controlled by the kernel config option
+ * "forceinline" and is empty otherwise. It must not be used on the
+ * out-of-line copy (where FOO_INLINE is empty), as gcc complains
+ * about always_inline on functions that are not declared inline.
+ */
+#include "opt-forceinline.h"
+
+#if OPT_FORCEINLINE && defined(__GNUC__)
+#define __FORCEINLINE __attribute__((__always_inline__))
+#else
+#define __FORCEINLINE
+#endif
+
 
 #endif /* _CDEFS_H_ */
@@ -38,8 +38,8 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, only when the
+ * CPU is not idle, for scheduling.
  */
 
 /* hardclocks per second */
@@ -49,10 +49,57 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 
 /*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * Timer plumbing (see clock.c). The platform calls clock_start once
+ * gettime works and clock_interrupt on each CPU's timer interrupt;
+ * it provides mainbus_settimer for clock.c to program. thread_switch
+ * calls clock_idle each time before idling the CPU and clock_unidle
+ * after, as hardclocks stop while a CPU is idle.
  */
-void timerclock(void);
+void clock_start(void);
+void clock_interrupt(void);
+void clock_idle(bool poll);
+void clock_unidle(void);
+
+/*
+ * The time page (see <kern/timepage.h>), which clock.c keeps up to
+ * date. timepage_bootstrap allocates it, once there's a VM system;
+ * timepage_paddr gives its physical address, for mapping into user
+ * address spaces.
+ */
+void timepage_bootstrap(void);
+paddr_t timepage_paddr(void);
+
+/*
+ * Timeouts: call a function, in interrupt context, at some time in
+ * the future, to nanosecond precision (as far as the hardware goes).
+ *
+ * timeout_init  - set up TO to call FUNC(DATA).
+ * timeout_set   - arm TO to fire NSECS from now, on the current CPU,
+ *                 replacing any earlier setting.
+ * timeout_cancel - disarm TO. Returns true if it was pending, false
+ *                 if it wasn't, which includes if it is firing at
+ *                 that moment on another CPU.
+ *
+ * A timeout must be disarmed, or have fired, before it's freed. FUNC
+ * may use only spinlocks and wchan wakeups.
+ */
+struct timeout {
+	uint64_t to_when;		/* deadline (clock_now() time) */
+	void (*to_func)(void *);	/* what to call */
+	void *to_data;			/* its argument */
+	struct cpu *to_cpu;		/* CPU queued on, or NULL */
+	struct timeout *to_next;	/* next later on that CPU */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_set(struct timeout *to, uint64_t nsecs);
+bool timeout_cancel(struct timeout *to);
+
+/*
+ * clock_now() returns the current time of day as nanoseconds, or 0
+ * before the clock devices are attached.
+ */
+uint64_t clock_now(void);
 
 /*
  * gettime() may be used to fetch the current time of day.
@@ -75,9 +122,11 @@ void timespec_sub(const struct timespec *t1,
 
 /*
  * clocksleep() suspends execution for the requested number of seconds,
- * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * like userlevel sleep(3); clocksleep_ns() for a number of
+ * nanoseconds. (Don't confuse them with wchan_sleep.)
  */
 void clocksleep(int seconds);
+void clocksleep_ns(uint64_t nsecs);
 
 
 #endif /* _CLOCK_H_ */
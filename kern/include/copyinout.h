@@ -59,12 +59,24 @@
  * The const qualifiers and types will help protect against mistakes
  * in this regard but are obviously not foolproof.
  *
+ * copyinv copies N blocks at once, each from its own user address to
+ * its own kernel address, as described by an array of copyinvec. It's
+ * all or nothing: every range is checked first, and it returns EFAULT
+ * without saying how far it got if any of them is bad.
+ *
  * These functions are machine-dependent; however, a common version
  * that can be used by a number of machine types is found in
  * vm/copyinout.c.
  */
 
+struct copyinvec {
+	const_userptr_t ci_src;
+	void *ci_dest;
+	size_t ci_len;
+};
+
 int copyin(const_userptr_t usersrc, void *dest, size_t len);
+int copyinv(const struct copyinvec *vec, unsigned n);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Coremap: the physical page allocator.
+ *
+ * The coremap has one entry for every physical page of RAM, indexed
+ * by physical page number. Free pages are kept on a doubly-linked
+ * free list threaded through the entries, so single-page allocation
+ * and release are O(1). Multi-page (contiguous) kernel allocations
+ * scan for a run of free pages.
+ *
+ * Pages handed out by ram_stealmem() before the coremap is set up
+ * (and the kernel image itself) are marked fixed and are never
+ * reused.
+ *
+ * A thread zeroes free pages in the background, so that pages that
+ * must start out zeroed can usually be had without clearing them on
+ * the spot.
+ *
+ * User pages can be "pinned" (marked busy). While a page is pinned
+ * only the thread that pinned it may change it or the page table
+ * entry that maps it, and the page can't be paged out. Anyone else
+ * who wants to pin it waits. Page table entries are read without
+ * locking, so after pinning the page named by an entry, check that
+ * the entry still names it (see pt_pin()).
+ *
+ * Functions:
+ *
+ *    coremap_bootstrap - take over physical memory management from
+ *                ram.c. Called from vm_bootstrap().
+ *
+ *    coremap_allocuser - allocate one page for user memory, with one
+ *                reference, for page VADDR of AS. If ZERO is set the
+ *                page is zero-filled, preferably from the pool the
+ *                background zeroing thread keeps; otherwise its
+ *                contents are garbage. The page is returned pinned.
+ *                Returns 0 if no memory is available; the caller
+ *                can then page something out and try again.
+ *
+ *    coremap_pin - pin a user page, waiting if it's already pinned.
+ *                Returns false, without pinning, if the page isn't a
+ *                user page (e.g. it was freed while we waited).
+ *
+ *    coremap_trypin - like coremap_pin, but returns false instead of
+ *                waiting if the page is pinned, and doesn't count as a
+ *                reference to the page for pageout.
+ *
+ *    coremap_unpin - unpin a page.
+ *
+ *    coremap_setowner - record that the pinned page PA, which must
+ *                have one reference, is page VADDR of AS. This makes
+ *                it eligible for pageout.
+ *
+ *    coremap_increfuser - add a reference to a pinned user page, for
+ *                sharing it copy-on-write. Shared pages are not
+ *                paged out.
+ *
+ *    coremap_freeuser - drop a reference to a pinned user page and
+ *                unpin it; the page is freed when the last reference
+ *                goes away.
+ *
+ *    coremap_setwired - mark the pinned page PA wired, or not, for
+ *                mlock: pageout leaves wired pages alone. Only pages
+ *                with one owner are marked, since shared pages aren't
+ *                paged out anyway, and sharing a page clears the
+ *                mark. Returns false, without marking it, if too much
+ *                memory is wired already.
+ *
+ *    coremap_userrefs - return the number of references to a user
+ *                page.
+ *
+ *    coremap_getvictim - choose a page to page out; see coremap.c.
+ *
+ *    coremap_pageout_wait - sleep until memory is low.
+ *
+ *    coremap_pageout_wanted - true while memory is still low enough
+ *                that the pageout thread should keep evicting.
+ *
+ *    coremap_plenty - true if NPAGES could be allocated with free
+ *                memory staying well clear of the pageout thresholds.
+ *
+ *    coremap_printstats - print page counts.
+ *
+ *    coremap_kstat - add the page counts to a kstat snapshot.
+ *
+ * Kernel pages are allocated with alloc_kpages() and free_kpages(),
+ * which are declared in <vm.h>. They are never paged out.
+ */
+
+struct addrspace;
+struct kstat;
+
+void coremap_bootstrap(void);
+paddr_t coremap_allocuser(struct addrspace *as, vaddr_t vaddr, bool zero);
+bool coremap_pin(paddr_t pa);
+bool coremap_trypin(paddr_t pa);
+void coremap_unpin(paddr_t pa);
+void coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_increfuser(paddr_t pa);
+void coremap_freeuser(paddr_t pa);
+bool coremap_setwired(paddr_t pa, bool wired);
+unsigned coremap_userrefs(paddr_t pa);
+paddr_t coremap_getvictim(struct addrspace **as_ret, vaddr_t *vaddr_ret);
+void coremap_pageout_wait(void);
+bool coremap_pageout_wanted(void);
+bool coremap_plenty(unsigned npages);
+void coremap_printstats(void);
+void coremap_kstat(struct kstat *ks);
+
+
+#endif /* _COREMAP_H_ */
@@ -31,9 +31,11 @@
 #define _CPU_H_
 
 
+#include <cdefs.h>
 #include <spinlock.h>
 #include <threadlist.h>
-#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX, CACHELINE_SIZE */
+#include <pcpu.h>        /* for PCPU_MAXCOUNTERS */
 
 
 /*
@@ -44,7 +46,32 @@
  * cpu->c_self should always be used when *using* the address of curcpu
  * (as opposed to merely dereferencing it) in case curcpu is defined as
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
+ *
+ * The fields are grouped by who writes them, and each group after the
+ * first starts a cache line, so other cpus taking the run queue, timeout
+ * or shootdown locks, or posting IPIs, don't false-share with the
+ * fields this cpu updates all the time, nor with each other. (struct
+ * cpu comes from kmalloc, whose blocks of 128 bytes and up are
+ * multiples of CACHELINE_SIZE placed at multiples of their size, so
+ * the alignment holds in memory too.)
+ */
+
+struct ktracebuf;
+struct keventbuf;
+struct timeout;
+struct softint;
+
+/*
+ * Run queues. A thread's queue is its feedback level, 0 to
+ * SCHED_NLEVELS-1, offset by the band its process's nice value falls
+ * in, 0 to SCHED_NBANDS-1; queue 0 is the highest priority.
  */
+#define SCHED_NLEVELS	4
+#define SCHED_NBANDS	8
+#define SCHED_NPRIO	(SCHED_NBANDS + SCHED_NLEVELS - 1)
+
+/* Words of device randomness kept per cpu for random() */
+#define CPU_RANDPOOL	16
 
 struct cpu {
 	/*
@@ -57,36 +84,107 @@ struct cpu {
 	/*
 	 * Accessed only by this cpu.
 	 */
-	struct thread *c_curthread;	/* Current thread on cpu */
+	struct thread *c_curthread	/* Current thread on cpu */
+		__aligned(CACHELINE_SIZE);
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_spares;	/* Reaped threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct thread *c_migrant;	/* Queued here, to go elsewhere */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	HANGMAN_ACTOR(c_hangman);	/* Deadlock detector hook */
+	unsigned c_tlb_victim;		/* Next TLB slot to replace */
+	unsigned c_tlb_misses;		/* Counter of TLB miss faults */
+	unsigned c_tlb_refills;		/* Counter of TLB entries loaded */
+	unsigned c_tlb_evictions;	/* ...that replaced a valid entry */
+	unsigned c_asid;		/* ASID in c0_entryhi (vm_machdep.c) */
+	unsigned c_asidfree;		/* Next ASID to hand out */
+	unsigned c_asid_rollovers;	/* Counter of ASID generations */
+	uint64_t c_nexttick;		/* When the next hardclock is due */
+	uint64_t c_cyclebase;		/* Cycles before timer last set */
+	uint32_t c_maxlatency;		/* Worst irq wakeup latency, ns */
+	uint32_t c_randpool[CPU_RANDPOOL]; /* Buffered random() values */
+	unsigned c_randavail;		/* ...how many are unused */
+	uint32_t c_fastrand;		/* fastrandom() state; 0 = unseeded */
+	struct softint *c_softints;	/* Pending softints, newest first */
+	bool c_insoftint;		/* Running them (softint.h) */
+	bool c_softint_handoff;		/* ...and one wants to yield */
+
+	/*
+	 * Written only by this cpu, read by others for TLB shootdown.
+	 */
+	volatile uint32_t c_asidgen	/* Current ASID generation */
+		__aligned(CACHELINE_SIZE);
+	struct ktracebuf *c_ktrace;	/* Trace records (see ktrace.h) */
+	struct keventbuf *c_kevent;	/* Event records (see kevent.h) */
+	struct kprofbuf *c_kprof;	/* Profile samples (see kprof.h) */
+
+	/*
+	 * Written only by this cpu, read by others for RCU grace periods.
+	 */
+	volatile unsigned c_rcu_gen;	/* rcu_gen at last quiescent state */
+
+	/*
+	 * Written only by this cpu, read by others to sum counters.
+	 */
+	unsigned c_pcpu[PCPU_MAXCOUNTERS]; /* Counter slots (see pcpu.h) */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
-	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	bool c_isidle			/* True if this cpu is idle */
+		__aligned(CACHELINE_SIZE);
+	struct threadlist c_runqueue[SCHED_NPRIO]; /* Run queues by priority */
+	uint32_t c_runqueue_bits;	/* Bit i set iff queue i nonempty */
+	unsigned c_runqueue_count;	/* Threads on all the run queues */
+	bool c_needresched;		/* Preempt c_curthread (thread.h) */
 	struct spinlock c_runqueue_lock;
 
 	/*
 	 * Accessed by other cpus.
-	 * Protected by the IPI lock.
+	 * Protected by the timeout lock.
+	 */
+	struct timeout *c_timeouts	/* Pending, earliest first */
+		__aligned(CACHELINE_SIZE);
+	struct spinlock c_timeout_lock;
+
+	/*
+	 * Accessed by other cpus, without a lock.
+	 *
+	 * c_ipi_pending is the IPI mailbox. Senders set bits in it
+	 * atomically, and raise the interrupt only if it was empty: if
+	 * it wasn't, one is already on its way. The handler takes the
+	 * whole word at once. c_ipi_calls is the list of struct
+	 * ipi_call queued by ipi_call, pushed by compare-and-swap and
+	 * likewise taken whole.
+	 */
+	volatile spinlock_data_t c_ipi_pending	/* One bit per IPI number */
+		__aligned(CACHELINE_SIZE);
+	volatile spinlock_data_t c_ipi_calls;	/* struct ipi_call * */
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the shootdown lock.
 	 *
 	 * TLB shootdown requests made to this CPU are queued in
 	 * c_shootdown[], with c_numshootdown holding the number of
 	 * requests. TLBSHOOTDOWN_MAX is the maximum number that can
-	 * be queued at once, which is machine-dependent.
+	 * be queued at once, which is machine-dependent. If more
+	 * arrive, or a whole-TLB flush is requested, the queue is
+	 * dropped and c_numshootdown is set to TLBSHOOTDOWN_ALL.
+	 * c_shootdown_seq counts requests queued and c_shootdown_done
+	 * is the value it had when the last batch was processed, so a
+	 * sender can wait for its requests to be finished.
 	 *
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
 	 */
-	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
-	struct spinlock c_ipi_lock;
+	volatile unsigned c_shootdown_seq;
+	volatile unsigned c_shootdown_done;
+	struct spinlock c_shootdown_lock;
 };
 
 /*
@@ -107,6 +205,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Enumerate CPUs, e.g. for collecting per-cpu statistics.
+ *
+ * cpu_count returns the number of CPUs; cpu_getcpu returns the CPU
+ * with software number NUM, which must be less than cpu_count().
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_getcpu(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -150,6 +257,18 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_all asks the target to flush its whole TLB.
+ * Requests queued before the target gets around to them share a
+ * single IPI. ipi_tlbshootdown_wait waits until the target has
+ * processed everything sent to it so far.
+ *
+ * ipi_call has the target call FUNC(ARG) from its IPI handler, with
+ * interrupts off; calls queued together share one IPI, and run in
+ * the order queued. IC is the caller's storage for the request and
+ * must stay valid until ipi_call_wait says it has run. Like
+ * ipi_tlbshootdown_wait, ipi_call_wait spins, and must be called
+ * with interrupts on and no spinlocks held. A call to the current
+ * cpu is made at once.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -160,10 +279,27 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_RESCHED		4	/* Preempt for a better thread */
+#define IPI_CALL		5	/* Function calls are queued */
+
+/* Value of c_numshootdown meaning "flush everything" */
+#define TLBSHOOTDOWN_ALL	(TLBSHOOTDOWN_MAX + 1)
+
+struct ipi_call {
+	void (*ic_func)(void *arg);
+	void *ic_arg;
+	struct ipi_call *ic_next;	/* on the target's c_ipi_calls */
+	volatile bool ic_done;		/* set once ic_func has returned */
+};
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_all(struct cpu *target);
+void ipi_tlbshootdown_wait(struct cpu *target);
+void ipi_call(struct cpu *target, struct ipi_call *ic,
+	      void (*func)(void *), void *arg);
+void ipi_call_wait(struct ipi_call *ic);
 
 void interprocessor_interrupt(void);
 
@@ -36,6 +36,8 @@
 
 
 struct uio;  /* in <uio.h> */
+struct bio;  /* in <bio.h> */
+struct iosched;  /* in <iosched.h> */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -49,6 +51,8 @@ struct device {
 	dev_t d_devnumber;	/* serial number for this device */
 
 	void *d_data;		/* device-specific data */
+	struct iosched *d_iosched; /* request scheduler, if it queues */
+	bool d_directio;	/* devop_io takes any sector-aligned uio */
 };
 
 /*
@@ -56,11 +60,14 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_strategy - queue a block I/O request (see bio.h); optional,
+ *                       may be NULL
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	void (*devop_strategy)(struct device *, struct bio *);
 };
 
 /*
@@ -69,6 +76,7 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_STRATEGY(d, b)	((d)->d_ops->devop_strategy(d, b))
 
 
 /* Create vnode for a vfs-level device. */
@@ -79,6 +87,11 @@ void dev_uncreate_vnode(struct vnode *vn);
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
+void devkstat_create(void);
+
+/* Create a RAID (level 0 or 1) over mountable devices; see devraid.c. */
+int devraid_create(const char *name, unsigned level, unsigned nunits,
+		   const char *const *units);
 
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
@@ -41,10 +41,36 @@
  * Our structures
  */
 
+/*
+ * A cached directory entry: what reading the directory at the position
+ * ed_offset returned. At the end of the directory the name is empty.
+ */
+struct emufs_dirent {
+	off_t ed_offset;		/* position read at */
+	off_t ed_nextoffset;		/* position after it */
+	size_t ed_len;			/* name length */
+	char *ed_name;
+	struct emufs_dirent *ed_link;	/* next cached entry */
+};
+
 struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+
+	/*
+	 * Cached size and directory entries, protected by the device
+	 * lock e_lock. ev_dirgen counts invalidations of the entries.
+	 * They're dropped when we change the file or directory, but
+	 * changes made on the host side are not noticed.
+	 */
+	bool ev_sizevalid;
+	off_t ev_size;
+	struct emufs_dirent *ev_dirents;
+	struct emufs_dirent *ev_dirlast;	/* last one used */
+	unsigned ev_dirgen;
+
+	off_t ev_nextread;		/* for readahead; unlocked hint */
 };
 
 struct emufs_fs {
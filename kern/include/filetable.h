@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is one open() of a vnode: it carries the seek position
+ * and the open flags, and is shared, refcounted, between every
+ * descriptor that came from that open through dup2 or fork. Its
+ * sleep lock serializes I/O that uses or moves the seek position.
+ *
+ * A filetable maps descriptors to openfiles. Lookups index an array
+ * under the table's own spinlock; a bitmap of the slots in use makes
+ * finding the lowest free descriptor cheap. Nothing here takes a
+ * lock shared between processes.
+ *
+ * filetable_get returns the openfile with a reference held, so it
+ * can't be closed out from under the caller; drop it with
+ * openfile_decref.
+ *
+ * Tables are refcounted too, so fork can share the parent's table in
+ * O(1) instead of copying it. A shared table is copied the first time
+ * either side wants to change it: call filetable_unshare on your own
+ * table pointer before filetable_place, _close, or _dup2. Only the
+ * process owning the pointer may do that, and a process with more
+ * than one thread never shares its table (lwp_create unshares it
+ * and fork copies instead), so the pointer itself needs no lock.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+struct bitmap;
+
+struct openfile {
+	struct vnode *of_vn;
+	int of_flags;			/* flags from open(), O_ACCMODE etc. */
+	struct lock *of_lock;		/* serializes use of of_offset */
+	off_t of_offset;		/* seek position */
+
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;
+};
+
+struct filetable {
+	struct spinlock ft_lock;	/* protects the rest */
+	unsigned ft_refcount;		/* processes sharing this table */
+	struct openfile *ft_files[OPEN_MAX];
+	struct bitmap *ft_used;		/* which of ft_files are set */
+};
+
+/* Open PATH and make an openfile for it. */
+int openfile_open(const char *path, int flags, mode_t mode,
+		  struct openfile **ret);
+/* Make an openfile for VN, taking over the caller's reference on success. */
+int openfile_fromvnode(struct vnode *vn, int flags, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable *filetable_create(void);
+void filetable_incref(struct filetable *ft);
+void filetable_decref(struct filetable *ft);
+
+/* Make a table sharing all of SRC's openfiles. */
+int filetable_copy(struct filetable *src, struct filetable **ret);
+
+/* Make sure *FTP isn't shared, replacing it with a copy if it is. */
+int filetable_unshare(struct filetable **ftp);
+
+/* Put OF (consuming the caller's reference) at the lowest free fd. */
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+
+/* Look up FD; returns a new reference. */
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+
+int filetable_close(struct filetable *ft, int fd);
+int filetable_dup2(struct filetable *ft, int oldfd, int newfd);
+
+
+#endif /* _FILETABLE_H_ */
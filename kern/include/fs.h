@@ -31,7 +31,9 @@
 #define _FS_H_
 
 struct buf; /* from buf.h */
+struct bio; /* in bio.h */
 struct vnode; /* in vnode.h */
+struct kstat; /* in kstat.h */
 
 
 /*
@@ -56,6 +58,9 @@ struct fs {
  *      fsop_writeblock - Write block to storage.
  *      fsop_attachbuf  - Hook for initializing fs-specific buffer state.
  *      fsop_detachbuf  - Hook for cleaning up fs-specific buffer state.
+ *      fsop_flushlog   - Make the fs's log durable through a given LSN.
+ *      fsop_startread  - Start reading a block, without waiting.
+ *      fsop_kstat      - Add the fs's own counters to a kstat snapshot.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -87,6 +92,26 @@ struct fs {
  * The third argument (bufdata) to fsop_writeblock is the FS-specific
  * metadata previously set with buffer_set_fsdata, or NULL if none was
  * ever set.
+ *
+ * When syncing, the buffer cache may also pass fsop_writeblock a run
+ * of several adjacent buffers (none with bufdata) in one call, as one
+ * length. The FS may fail such a write if it can't do it in one go;
+ * the buffer cache then writes the buffers one at a time instead.
+ *
+ * fsop_flushlog is for file systems with a write-ahead log. Before
+ * writing a buffer that has a log sequence number set on it with
+ * buffer_set_walsn, the buffer cache calls fsop_flushlog with that
+ * LSN; it should return once the log is on disk at least that far.
+ * (For a run of several buffers it's called once, with the highest.)
+ * It may be NULL if the FS never sets one.
+ *
+ * fsop_startread is an asynchronous fsop_readblock, for read-ahead.
+ * The buffer cache fills in the bio's data, length, and completion
+ * routine; the FS sets the device offset and submits it (see bio.h).
+ * It may be NULL, in which case read-ahead uses fsop_readblock.
+ *
+ * fsop_kstat is called for each mounted file system when /dev/kstat
+ * is read. It may be NULL if the FS has nothing to report.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
@@ -98,6 +123,9 @@ struct fs_ops {
 					void *, size_t);
 	int           (*fsop_attachbuf)(struct fs *, daddr_t, struct buf *);
 	void          (*fsop_detachbuf)(struct fs *, daddr_t, struct buf *);
+	int           (*fsop_flushlog)(struct fs *, uint64_t lsn);
+	void          (*fsop_startread)(struct fs *, daddr_t, struct bio *);
+	void          (*fsop_kstat)(struct fs *, struct kstat *);
 };
 
 /*
@@ -114,6 +142,10 @@ struct fs_ops {
 							       ptr,sz))
 #define FSOP_ATTACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_attachbuf(fs,blk,buf))
 #define FSOP_DETACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_detachbuf(fs,blk,buf))
+#define FSOP_FLUSHLOG(fs, lsn) ((fs)->fs_ops->fsop_flushlog(fs, lsn))
+#define FSOP_STARTREAD(fs, blk, bio) \
+				((fs)->fs_ops->fsop_startread(fs, blk, bio))
+#define FSOP_KSTAT(fs, ks)   ((fs)->fs_ops->fsop_kstat(fs, ks))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
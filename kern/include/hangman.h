@@ -33,37 +33,73 @@
 /*
  * Simple deadlock detector. Enable with "options hangman" in the
  * kernel config.
+ *
+ * The same hooks also drive lockstat, lock contention statistics,
+ * with "options lockstat". Actors are CPUs (for spinlocks) and
+ * threads (for sleeplocks); lockables are the locks. Lockstat counts
+ * each lock's acquires, contended acquires, total time spent waiting
+ * for it, and longest hold; it's turned on and dumped from the menu
+ * ("lockstat"). A lock is listed once it's been contended while
+ * lockstat was on.
  */
 
 #include "opt-hangman.h"
+#include "opt-lockstat.h"
 
-#if OPT_HANGMAN
+#if OPT_HANGMAN || OPT_LOCKSTAT
 
 struct hangman_actor {
 	const char *a_name;
 	const struct hangman_lockable *a_waiting;
+#if OPT_LOCKSTAT
+	uint64_t a_waitstart;		/* when the wait began (ns), or 0 */
+	bool a_contended;		/* lock was held when it began */
+#endif
 };
 
 struct hangman_lockable {
 	const char *l_name;
 	const struct hangman_actor *l_holding;
+#if OPT_LOCKSTAT
+	/* updated by the holder */
+	uint64_t l_heldsince;		/* when acquired (ns), or 0 */
+	uint64_t l_waitns;		/* total time spent waiting */
+	uint64_t l_maxholdns;		/* longest hold */
+	unsigned l_acquires;		/* acquires */
+	unsigned l_contended;		/* acquires that found it held */
+	bool l_tracked;			/* in lockstat's table */
+#endif
 };
 
 void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l);
 void hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l);
 void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_cleanup(struct hangman_lockable *l);
 
 #define HANGMAN_ACTOR(sym)	struct hangman_actor sym
 #define HANGMAN_LOCKABLE(sym)	struct hangman_lockable sym
 
+#if OPT_LOCKSTAT
+#define HANGMAN_ACTORINIT(a, n) \
+	((a)->a_name = (n), (a)->a_waiting = NULL, (a)->a_waitstart = 0)
+#define HANGMAN_LOCKABLEINIT(l, n) \
+	(bzero((l), sizeof(*(l))), (l)->l_name = (n))
+#else
 #define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL)
 #define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL)
+#endif
 
+#if OPT_LOCKSTAT
+#define HANGMAN_LOCKABLE_INITIALIZER \
+	{ "spinlock", NULL, 0, 0, 0, 0, 0, false }
+#else
 #define HANGMAN_LOCKABLE_INITIALIZER	{ "spinlock", NULL }
+#endif
 
 #define HANGMAN_WAIT(a, l)	hangman_wait(a, l)
 #define HANGMAN_ACQUIRE(a, l)	hangman_acquire(a, l)
 #define HANGMAN_RELEASE(a, l)	hangman_release(a, l)
+#define HANGMAN_CLEANUP(l)	hangman_cleanup(l)
 
 #else
 
@@ -78,7 +114,14 @@ void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
 #define HANGMAN_WAIT(a, l)
 #define HANGMAN_ACQUIRE(a, l)
 #define HANGMAN_RELEASE(a, l)
+#define HANGMAN_CLEANUP(l)
+
+#endif
 
+#if OPT_LOCKSTAT
+void lockstat_setenabled(bool on);
+void lockstat_print(void);
+void lockstat_reset(void);
 #endif
 
 #endif /* HANGMAN_H */
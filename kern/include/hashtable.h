@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+#include <cdefs.h>
+#include <lib.h>
+#include <spinlock.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef HASHINLINE
+#define HASHINLINE INLINE __FORCEINLINE
+#endif
+
+/*
+ * Resizable hash table with intrusive nodes, for keyed lookup of any
+ * kind of object.
+ *
+ * Objects embed a struct hashnode, initialized with hashnode_init to
+ * point back at the object, and are added with a 32-bit hash of
+ * their key computed by the caller. The table only keeps the hash;
+ * lookups compare it and then call the caller's MATCH function to
+ * check the key itself. The top bits of the hash pick the bucket, so
+ * they must depend on all of the key; finishing with hash32 (below)
+ * takes care of that.
+ *
+ * Locking. Buckets are divided among HASHTABLE_NSTRIPES stripes by
+ * the top bits of the hash, each with a spinlock, as in the buffer
+ * cache's hash. hashtable_add and hashtable_remove take the stripe
+ * lock themselves, so operations on different keys seldom contend.
+ * There are two kinds of lookup:
+ *
+ *    hashtable_lookup calls MATCH with the stripe lock held, so MATCH
+ *    may take a reference to the object it accepts (but must not
+ *    sleep).
+ *
+ *    hashtable_lookup_rcu takes no lock, and is for use inside an RCU
+ *    read-side section (see rcu.h). MATCH may then see an object
+ *    being removed, and must only look at fields that don't change
+ *    while it's in the table. A table searched this way must not
+ *    have its removed objects freed, or added again, until a grace
+ *    period has passed.
+ *
+ * Either way, the table doesn't keep an object alive after the
+ * lookup: that's the caller's job, by a lock of its own, a reference
+ * taken in MATCH, or RCU.
+ *
+ * Resizing. The number of buckets is a power of two, and doubles
+ * when the chains get too long on average. The larger bucket array
+ * is allocated by hashtable_prepare, which callers should make
+ * before hashtable_add and where kmalloc is allowed: not holding a
+ * spinlock, nor any lock that memory reclaim might need. hashtable_add
+ * itself never allocates and can't fail; a caller that never calls
+ * hashtable_prepare gets a table that never grows. Moving the nodes
+ * is incremental, a couple of old buckets on each add, so no one
+ * operation has to rehash everything; lookups meanwhile look in
+ * whichever table has the key. The table never shrinks.
+ *
+ * Functions:
+ *
+ *    hashnode_init    - set up a node for the object SELF.
+ *
+ *    hashnode_cleanup - clean up a node, which must not be in a table.
+ *
+ *    hashtable_init   - set up a table with 2^BITS buckets to begin
+ *                       with (fewer are rounded up). Returns ENOMEM if
+ *                       out of memory.
+ *
+ *    hashtable_cleanup - clean up an empty table.
+ *
+ *    hashtable_prepare - grow the table if it's due. May sleep.
+ *
+ *    hashtable_add    - add node HN with hash value HASH. Several nodes
+ *                       may have the same key; lookups find any one.
+ *
+ *    hashtable_remove - remove node HN.
+ *
+ *    hashtable_lookup - return an object whose node has hash HASH and
+ *                       for which MATCH(object, KEY) is true, or NULL.
+ *
+ *    hashtable_lookup_rcu - the same, without locking; see above.
+ *
+ *    hashtable_count  - number of nodes in the table. Exact only if
+ *                       nothing is adding or removing meanwhile.
+ *
+ *    hashtable_numbuckets - current number of buckets, for stats.
+ *
+ *    hash32           - mix V so that the top bits depend on all of
+ *                       it (Fibonacci hashing). Combine several words
+ *                       as hash32(hash32(a) ^ b).
+ */
+
+#define HASHTABLE_STRIPEBITS	4
+#define HASHTABLE_NSTRIPES	(1U << HASHTABLE_STRIPEBITS)
+
+struct hashnode {
+	struct hashnode *hn_next;	/* next in bucket */
+	struct hashnode **hn_pprev;	/* what points to us; NULL if out */
+	uint32_t hn_hash;
+	void *hn_self;
+};
+
+struct hashbuckets;			/* private to hashtable.c */
+
+struct hashstripe {
+	struct spinlock hs_lock;	/* protects our buckets' chains */
+	unsigned hs_count;		/* nodes in our buckets */
+};
+
+struct hashtable {
+	struct hashbuckets *ht_cur;	/* the table */
+	struct hashbuckets *ht_old;	/* while resizing: old table */
+	unsigned ht_migrated;		/* old buckets moved so far */
+	volatile unsigned ht_seq;	/* odd while nodes are moving */
+	struct spinlock ht_resizelock;	/* one resizer at a time */
+	struct hashstripe ht_stripes[HASHTABLE_NSTRIPES];
+};
+
+HASHINLINE void hashnode_init(struct hashnode *hn, void *self);
+HASHINLINE void hashnode_cleanup(struct hashnode *hn);
+HASHINLINE uint32_t hash32(uint32_t v);
+
+int hashtable_init(struct hashtable *ht, unsigned bits);
+void hashtable_cleanup(struct hashtable *ht);
+void hashtable_prepare(struct hashtable *ht);
+void hashtable_add(struct hashtable *ht, struct hashnode *hn, uint32_t hash);
+void hashtable_remove(struct hashtable *ht, struct hashnode *hn);
+void *hashtable_lookup(struct hashtable *ht, uint32_t hash,
+		       bool (*match)(void *obj, const void *key),
+		       const void *key);
+void *hashtable_lookup_rcu(struct hashtable *ht, uint32_t hash,
+			   bool (*match)(void *obj, const void *key),
+			   const void *key);
+unsigned hashtable_count(struct hashtable *ht);
+unsigned hashtable_numbuckets(struct hashtable *ht);
+
+/*
+ * Inlining for the node operations
+ */
+
+HASHINLINE void
+hashnode_init(struct hashnode *hn, void *self)
+{
+	KASSERT(self != NULL);
+	hn->hn_next = NULL;
+	hn->hn_pprev = NULL;
+	hn->hn_hash = 0;
+	hn->hn_self = self;
+}
+
+HASHINLINE void
+hashnode_cleanup(struct hashnode *hn)
+{
+	KASSERT(hn->hn_pprev == NULL);
+}
+
+HASHINLINE uint32_t
+hash32(uint32_t v)
+{
+	return v * 0x9e3779b1U;
+}
+
+
+#endif /* _HASHTABLE_H_ */
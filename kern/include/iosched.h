@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Disk I/O scheduler.
+ *
+ * A driver that queues requests (see bio.h) keeps them in a struct
+ * iosched, which decides what to dispatch next. Requests for
+ * adjacent sectors going the same way are merged as they arrive:
+ * they're chained together and come out as one transfer, whose
+ * bios are linked through bio_next in disk order.
+ *
+ * Policies:
+ *    fifo     - arrival order.
+ *    clook    - C-LOOK elevator: the nearest request at or past where
+ *               the last transfer ended, wrapping to the lowest.
+ *    deadline - like clook, but reads go ahead of writes (with
+ *               writes passed over only so many times in a row), and
+ *               any request that has waited too long goes next.
+ *
+ * All calls except init/cleanup need the driver's queue lock, which
+ * is given to iosched_init; iosched_setpolicy takes it itself.
+ * iosched_add and iosched_next may be called in interrupt handlers.
+ */
+
+struct bio;		/* in <bio.h> */
+struct spinlock;	/* in <spinlock.h> */
+
+#define IOSCHED_FIFO		0
+#define IOSCHED_CLOOK		1
+#define IOSCHED_DEADLINE	2
+
+struct iosched {
+	struct spinlock *is_lock;	/* driver's queue lock */
+	unsigned is_policy;		/* IOSCHED_* */
+	struct bio *is_head;		/* queued transfers, oldest first */
+	struct bio *is_tail;
+	off_t is_pos;			/* where the last transfer ended */
+	unsigned is_readruns;		/* reads picked over waiting writes */
+
+	/* statistics */
+	unsigned is_nqueued;		/* requests added */
+	unsigned is_nmerged;		/* ...of which merged */
+	unsigned is_ndispatched;	/* transfers dispatched */
+	unsigned is_nexpired;		/* ...picked for their deadline */
+};
+
+void iosched_init(struct iosched *is, struct spinlock *lock);
+void iosched_cleanup(struct iosched *is);
+int iosched_setpolicy(struct iosched *is, const char *name);
+const char *iosched_policyname(struct iosched *is);
+void iosched_add(struct iosched *is, struct bio *bio);
+struct bio *iosched_next(struct iosched *is);
+
+
+#endif /* _IOSCHED_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOSTAT_H_
+#define _IOSTAT_H_
+
+/*
+ * Per-device I/O statistics.
+ *
+ * A driver embeds a struct iostat, calls iostat_start when it takes a
+ * request and iostat_done when the request finishes, and hands
+ * IOCTL_IOSTAT to iostat_ioctl. Both calls may be made in interrupt
+ * handlers. Every iostat is listed for the "iostat" menu command.
+ */
+
+#include <spinlock.h>
+#include <uio.h>		/* for enum uio_rw */
+#include <kern/time.h>
+#include <kern/ioctl.h>
+
+#define IOSTAT_NAMELEN		16
+
+struct iostat {
+	char st_name[IOSTAT_NAMELEN];	/* device name, for printing */
+	struct spinlock st_lock;	/* protects the rest */
+	struct ioctl_iostat st_stats;
+	struct timespec st_reset;	/* when the counters started */
+	struct timespec st_changed;	/* last change of st_depth */
+	struct iostat *st_next;		/* list of all of them */
+};
+
+/* Set up ST for the device NAME, and list it. */
+void iostat_init(struct iostat *st, const char *name);
+
+/* A request arrived; the time is put in STARTED for iostat_done. */
+void iostat_start(struct iostat *st, struct timespec *started);
+
+/* A request started at STARTED finished; ERR is its errno. */
+void iostat_done(struct iostat *st, const struct timespec *started,
+		 enum uio_rw rw, size_t bytes, int err);
+
+/* Copy out the counters, or zero them. */
+void iostat_get(struct iostat *st, struct ioctl_iostat *ret);
+void iostat_reset(struct iostat *st);
+
+/* Handle IOCTL_IOSTAT, copying out to DATA. */
+int iostat_ioctl(struct iostat *st, userptr_t data);
+
+/* For the menu: print or reset all of them. */
+void iostat_printall(void);
+void iostat_resetall(void);
+
+/* Add all of them to a kstat snapshot. */
+struct kstat;
+void iostat_kstat(struct kstat *ks);
+
+#endif /* _IOSTAT_H_ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+#include <kern/stattypes.h>
+
+/*
+ * Records returned by getdirentries().
+ *
+ * Each call fills the buffer with as many whole records as fit, one
+ * after another. Each record is a struct dirent followed by the
+ * null-terminated name, padded so the next record is 4-byte aligned;
+ * d_reclen is the distance to the next record. d_ino is the file's
+ * inode number and d_type its type (one of the DT_ values below); a
+ * filesystem that can't supply these cheaply leaves them 0 and
+ * DT_UNKNOWN respectively.
+ *
+ * A return of 0 means the end of the directory. A buffer too small
+ * for even one record gets EINVAL.
+ */
+struct dirent {
+	__u32 d_ino;		/* inode number, or 0 */
+	__u16 d_reclen;		/* length of this record */
+	__u8 d_type;		/* file type */
+	__u8 d_namlen;		/* length of d_name, not counting the null */
+	char d_name[];		/* name, null-terminated */
+};
+
+/* Record length for a name of NAMLEN characters */
+#define DIRENT_RECLEN(namlen) \
+	((sizeof(struct dirent) + (namlen) + 1 + 3) & ~(size_t)3)
+
+/* File types for d_type: the st_mode file type bits, shifted down */
+#define DT_UNKNOWN	0
+#define DT_REG		(_S_IFREG >> 12)
+#define DT_DIR		(_S_IFDIR >> 12)
+#define DT_LNK		(_S_IFLNK >> 12)
+#define DT_FIFO		(_S_IFIFO >> 12)
+#define DT_SOCK		(_S_IFSOCK >> 12)
+#define DT_CHR		(_S_IFCHR >> 12)
+#define DT_BLK		(_S_IFBLK >> 12)
+
+
+#endif /* _KERN_DIRENT_H_ */
@@ -34,6 +34,117 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Make a byte range of a regular file read back as zeros, releasing
+ * the disk blocks under it where the filesystem can. The file size
+ * doesn't change. The argument is a struct ioctl_punchhole.
+ */
+#define IOCTL_PUNCHHOLE		1
+
+struct ioctl_punchhole {
+	off_t ph_offset;	/* start of the range */
+	off_t ph_len;		/* length of the range in bytes */
+};
+
+/*
+ * Get a device's I/O statistics (raw disk devices). The argument is
+ * a struct ioctl_iostat, filled in. Index the per-direction arrays
+ * with IOSTAT_READ or IOSTAT_WRITE. Bucket i of the latency
+ * histogram counts requests that took [2^i, 2^(i+1)) microseconds,
+ * except that the first starts at 0 and the last has no upper limit.
+ * All times are in nanoseconds and run from the last reset.
+ */
+#define IOCTL_IOSTAT		2
+
+#define IOSTAT_READ		0
+#define IOSTAT_WRITE		1
+#define IOSTAT_NBUCKETS		24
+
+struct ioctl_iostat {
+	__u64 st_ops[2];		/* requests completed */
+	__u64 st_bytes[2];		/* bytes transferred */
+	__u64 st_errors[2];		/* requests that failed */
+	__u32 st_hist[2][IOSTAT_NBUCKETS]; /* latency histogram */
+	__u64 st_elapsed;		/* time covered */
+	__u64 st_busy;			/* time with requests pending */
+	__u64 st_depthtime;		/* queue depth integrated over time */
+	__u32 st_depth;			/* requests pending now */
+	__u32 st_maxdepth;		/* most pending at once */
+};
+
+/*
+ * Apply a set of adjustments to several semfs semaphores at once
+ * (semfs vnodes only; any of them, including the directory, will
+ * do). The argument is a struct ioctl_semop. Each so_sem is a
+ * semaphore's st_ino as reported by fstat. If every decrement can be
+ * met, all the adjustments are made together; otherwise the call
+ * waits until they can be, taking nothing in the meantime. A
+ * semaphore may appear more than once; its deltas are summed.
+ */
+#define IOCTL_SEMOP		3
+
+#define IOCTL_SEMOP_MAX		16
+
+struct ioctl_sembuf {
+	__u32 sb_sem;			/* which semaphore */
+	__i32 sb_delta;			/* add this to its count */
+};
+
+struct ioctl_semop {
+	__u32 so_num;			/* entries used in so_ops */
+	struct ioctl_sembuf so_ops[IOCTL_SEMOP_MAX];
+};
+
+/*
+ * Allocate disk blocks for a byte range of a regular file ahead of
+ * writing it, laid out contiguously where possible. The range reads
+ * as before (zeros where it was a hole), and the file grows to cover
+ * it unless PREALLOC_KEEPSIZE is given. The argument is a struct
+ * ioctl_prealloc.
+ */
+#define IOCTL_PREALLOC		4
+
+#define PREALLOC_KEEPSIZE	1	/* don't change the file size */
+
+struct ioctl_prealloc {
+	off_t pa_offset;		/* start of the range */
+	off_t pa_len;			/* length of the range in bytes */
+	__u32 pa_flags;			/* PREALLOC_* */
+};
+
+/*
+ * Store a regular file compressed, if the argument (an int) is
+ * nonzero, or plainly again if it's 0. What the file reads as doesn't
+ * change. Compression is meant for files that are read much more than
+ * they're written: writing to a compressed file, or changing its
+ * size, stores it plainly again first.
+ */
+#define IOCTL_COMPRESS		5
+
+/*
+ * Tell the file system how a byte range of a regular file is going to
+ * be used, so it can cache accordingly. The argument is a struct
+ * ioctl_fadvise; a length of 0 means through the end of the file.
+ * The access pattern (the first three) is kept for the whole file,
+ * for everyone who has it open: random access turns read-ahead off,
+ * and sequential access starts it at full size instead of waiting to
+ * see sequential reads. FADV_WILLNEED starts reading the range into
+ * the cache in the background. FADV_DONTNEED drops the range's clean
+ * cached blocks, and the file's cached pages, now. The values are the
+ * same as madvise's (see <kern/mman.h>).
+ */
+#define IOCTL_FADVISE		6
+
+#define FADV_NORMAL		0	/* no particular pattern */
+#define FADV_RANDOM		1	/* random access */
+#define FADV_SEQUENTIAL		2	/* sequential access */
+#define FADV_WILLNEED		3	/* will be read soon */
+#define FADV_DONTNEED		4	/* won't be read soon */
+
+struct ioctl_fadvise {
+	off_t fa_offset;		/* start of the range */
+	off_t fa_len;			/* length in bytes, or 0 */
+	__u32 fa_advice;		/* FADV_* */
+};
 
 #endif /* _KERN_IOCTL_H_*/
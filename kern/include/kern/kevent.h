@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_KEVENT_H_
+#define _KERN_KEVENT_H_
+
+/*
+ * Binary kernel event trace format, as written by the kernel's
+ * kevent facility (see <kevent.h> in the kernel) and read by
+ * /sbin/kevdump.
+ *
+ * A trace file is a struct kevent_header followed by records. Each
+ * CPU's records are in order, but CPUs are drained in turn, so sort
+ * by time to merge them. Thread identities are the kernel's thread
+ * pointers; a KEV_THREAD record gives one a name.
+ */
+
+#define KEVENT_MAGIC	0x6b657631	/* "kev1" */
+
+struct kevent_header {
+	uint32_t kh_magic;
+	uint32_t kh_recsize;		/* sizeof(struct kevent_rec) */
+};
+
+struct kevent_rec {
+	uint32_t ke_sec;		/* time */
+	uint32_t ke_nsec;
+	uint16_t ke_type;		/* KEV_* */
+	uint16_t ke_cpu;
+	uint32_t ke_thread;		/* current thread */
+	uint32_t ke_args[4];
+};
+
+/*
+ * Event types, with their arguments. "name" means up to 12 bytes of
+ * a name packed into args 1-3, NUL-padded and not NUL-terminated if
+ * it's that long.
+ */
+#define KEV_THREAD	1	/* thread, name */
+#define KEV_SWITCH	2	/* next thread, old thread's new state */
+#define KEV_SLEEP	3	/* wchan, name */
+#define KEV_BUFREAD	4	/* block, size, 1 if a fast-path hit */
+#define KEV_FAULT	5	/* fault type, address */
+#define KEV_SYSCALL	6	/* call number, first argument */
+#define KEV_LOST	7	/* number of records overwritten */
+#define KEV_NTYPES	8
+
+#endif /* _KERN_KEVENT_H_ */
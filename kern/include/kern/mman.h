@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Flags for mmap(). PROT_READ is required; the MIPS has no way to
+ * map a page that can be written but not read, and PROT_EXEC comes
+ * with PROT_READ. Exactly one of MAP_SHARED and MAP_PRIVATE must be
+ * given. Files can only be mapped privately (nothing is written
+ * back), so MAP_SHARED also needs MAP_ANON, which means zero-filled
+ * memory instead of a file; the fd must then be -1.
+ */
+
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+#define MAP_SHARED    0x01   /* Writes seen by the processes sharing it */
+#define MAP_PRIVATE   0x02   /* Writes are private to this process */
+#define MAP_ANON      0x10   /* Zero-filled memory; no file */
+
+/*
+ * Advice for madvise(). The access pattern (the first three) is kept
+ * per mapping, not per page: it applies to the whole of every mapping
+ * the range touches. Random access turns off reading ahead when pages
+ * come back from swap; sequential access is the same as normal, which
+ * already reads ahead. MADV_WILLNEED reads in pages that are in swap
+ * or would come from a file, as long as memory isn't short.
+ * MADV_DONTNEED throws pages away, so they come back zero-filled or
+ * fresh from the file; it fails with EINVAL on locked pages, and
+ * leaves shared (MAP_SHARED) memory alone.
+ */
+
+#define MADV_NORMAL      0   /* No particular pattern */
+#define MADV_RANDOM      1   /* Random access */
+#define MADV_SEQUENTIAL  2   /* Sequential access */
+#define MADV_WILLNEED    3   /* Will be used soon */
+#define MADV_DONTNEED    4   /* Won't be used soon */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -36,14 +36,26 @@
  * and is used by tools that work on SFS volumes, such as mksfs.
  */
 
-#define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+/*
+ * The block size is chosen when the system is built (SFS_BLOCKSIZE
+ * in mk/os161.config.mk, or configure --sfs-blocksize) and must be
+ * the same for the kernel and the tools; 512 and 4096 are supported.
+ * Several of the sizes below are derived from it.
+ */
+#ifndef SFS_BLOCKSIZE
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
+#endif
+#if SFS_BLOCKSIZE != 512 && SFS_BLOCKSIZE != 4096
+#error "SFS_BLOCKSIZE must be 512 or 4096"
+#endif
+
+#define SFS_MAGIC         0xabadf001    /* magic number identifying us */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
 #define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
 #define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_DBPERIDB      (SFS_BLOCKSIZE/4) /* # direct blks per indir blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
@@ -67,6 +79,26 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/*
+ * sb_blocksize records the block size the volume was made with, so a
+ * volume can't be mounted by code built for a different one. Volumes
+ * from before the field existed have 0 there, meaning 512.
+ */
+#define SFS_SB_BLOCKSIZE(sb) \
+	((sb)->sb_blocksize == 0 ? 512 : (sb)->sb_blocksize)
+
+/* Flags for sb_flags */
+#define SFS_SBFLAG_EXTENTS 0x1    /* new files and directories use extents */
+
+/* Flags for sfi_flags */
+#define SFS_IFLAG_INLINE  0x1     /* data is in sfi_inline, not in blocks */
+#define SFS_IFLAG_EXTENTS 0x2     /* blocks are mapped by sfi_extents */
+#define SFS_IFLAG_PREALLOC 0x4    /* sfi_unwritten is in use */
+#define SFS_IFLAG_COMPRESSED 0x8  /* data is in compressed chunks */
+
+/* Bytes of file data that fit in the inode itself */
+#define SFS_INLINESIZE    ((SFS_BLOCKSIZE/4-6-SFS_NDIRECT)*4)
+
 /*
  * On-disk superblock
  */
@@ -76,7 +108,86 @@ struct sfs_superblock {
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
 	uint32_t sb_journalstart;		/* First block in journal */
 	uint32_t sb_journalblocks;		/* # of blocks in journal */
-	uint32_t reserved[116];			/* unused, set to 0 */
+	uint32_t sb_flags;			/* SFS_SBFLAG_* above */
+	uint32_t sb_blocksize;			/* SFS_BLOCKSIZE, or 0 */
+	uint32_t reserved[SFS_BLOCKSIZE/4-14];	/* unused, set to 0 */
+};
+
+/*
+ * On-disk extent tree, for inodes with SFS_IFLAG_EXTENTS.
+ *
+ * Instead of the block pointers, such an inode holds the root node of
+ * a small B-tree keyed by file block. A leaf entry maps the run of
+ * ex_len file blocks starting at ex_fileblock to as many consecutive
+ * disk blocks starting at ex_diskblock. An entry in an interior node
+ * (eh_depth > 0) points to the child node at ex_diskblock, whose
+ * entries all map file blocks from ex_fileblock (or, for the first
+ * entry, from 0) up to the next entry's ex_fileblock; its ex_len is
+ * 0. Entries in a node are sorted by ex_fileblock and leaf entries
+ * don't overlap. File blocks no extent covers are holes.
+ *
+ * The root is in the inode; the other nodes are whole blocks.
+ */
+#define SFS_EXTENT_MAGIC    0xe47e  /* eh_magic */
+#define SFS_EXTENT_MAXDEPTH 3       /* most levels below the root */
+#define SFS_EXTENTS_INODE   5       /* # of entries in the root */
+#define SFS_EXTENTS_BLOCK   ((SFS_BLOCKSIZE-8)/12) /* # in a tree block */
+
+struct sfs_extent_header {
+	uint16_t eh_magic;			/* SFS_EXTENT_MAGIC */
+	uint16_t eh_count;			/* # of entries in use */
+	uint16_t eh_max;			/* # of entries there's room for */
+	uint16_t eh_depth;			/* levels below; 0 for a leaf */
+};
+
+struct sfs_extent {
+	uint32_t ex_fileblock;			/* first file block */
+	uint32_t ex_diskblock;			/* first disk block or child */
+	uint32_t ex_len;			/* # of blocks (leaf only) */
+};
+
+struct sfs_extent_root {
+	struct sfs_extent_header er_hdr;
+	struct sfs_extent er_ext[SFS_EXTENTS_INODE];
+	uint32_t er_unused;			/* set to 0 */
+};
+
+struct sfs_extent_block {
+	struct sfs_extent_header eb_hdr;
+	struct sfs_extent eb_ext[SFS_EXTENTS_BLOCK];
+#if (SFS_BLOCKSIZE-8) % 12 != 0
+	uint32_t eb_unused[(SFS_BLOCKSIZE-8) % 12 / 4];	/* set to 0 */
+#endif
+};
+
+/*
+ * On-disk format of compressed files, for inodes with
+ * SFS_IFLAG_COMPRESSED.
+ *
+ * The file is divided into 4K chunks of SFS_ZBLOCKS file blocks, each
+ * stored by itself in the blocks the inode maps for it:
+ *    - with none of them mapped, the chunk is zeros;
+ *    - with all of them (up to EOF) mapped, they hold its data as is;
+ *    - with only the first N mapped, fewer than that, those N hold
+ *      an sfs_zheader and then zh_len bytes of compressed data that
+ *      expand to the chunk (or to EOF, for the last one).
+ * (With 4096-byte blocks a chunk is one block, so there's nothing to
+ * save and chunks are always stored as is.)
+ *
+ * Compressed data is a series of groups, each a flag byte followed
+ * by up to eight items, one per bit starting from the lowest. For a
+ * 0 bit the item is a byte of data. For a 1 bit it is two bytes, low
+ * byte first, repeating earlier data: the top 4 bits are the length
+ * less SFS_ZMINMATCH, and the other 12 how far back it starts, less 1.
+ */
+#define SFS_ZBLOCKS       (4096/SFS_BLOCKSIZE) /* file blocks per chunk */
+#define SFS_ZMAGIC        0x5a43        /* zh_magic */
+#define SFS_ZMINMATCH     3             /* shortest repeat encoded */
+#define SFS_ZMAXMATCH     (SFS_ZMINMATCH + 15) /* longest */
+
+struct sfs_zheader {
+	uint16_t zh_magic;			/* SFS_ZMAGIC */
+	uint16_t zh_len;			/* bytes of compressed data */
 };
 
 /*
@@ -86,11 +197,31 @@ struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
 	uint16_t sfi_type;			/* One of SFS_TYPE_* above */
 	uint16_t sfi_linkcount;			/* # hard links to this file */
-	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
-	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_dindirect;   /* Double indirect block */
-	uint32_t sfi_tindirect;   /* Triple indirect block */
-	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+	union {
+		struct {
+			uint32_t sfi_direct[SFS_NDIRECT]; /* Direct blocks */
+			uint32_t sfi_indirect;	/* Indirect block */
+			uint32_t sfi_dindirect;	/* Double indirect block */
+			uint32_t sfi_tindirect;	/* Triple indirect block */
+		};
+		/* instead, with SFS_IFLAG_EXTENTS */
+		struct sfs_extent_root sfi_extents;
+	};
+	uint32_t sfi_flags;			/* SFS_IFLAG_* above */
+	/*
+	 * A regular file no larger than SFS_INLINESIZE may keep its
+	 * contents here instead of in a data block, with
+	 * SFS_IFLAG_INLINE set and no blocks mapped. Otherwise (and
+	 * past sfi_size) this is unused and set to 0.
+	 *
+	 * A file with blocks preallocated (SFS_IFLAG_PREALLOC) instead
+	 * keeps sfi_unwritten: blocks mapped from that file block on
+	 * have never been written and read as zeros.
+	 */
+	union {
+		char sfi_inline[SFS_INLINESIZE];	/* inline file data */
+		uint32_t sfi_unwritten;		/* first unwritten block */
+	};
 };
 
 /*
@@ -117,8 +248,9 @@ struct sfs_direntry {
  * level records, or SFS_JPHYS_CLIENT, for records defined by higher-
  * level code.
  *
- * The length is stored in 2-octet units so we only need 8 bits for a
- * record of up to one whole block.
+ * The length is stored in 2-octet units, in 8 bits, so a record is at
+ * most SFS_CONINFO_MAXLEN bytes; with 4096-byte blocks that's less
+ * than a block, and it takes several pad records to fill one up.
  *
  * The length includes the header. (struct sfs_jphys_header)
  *
@@ -129,6 +261,7 @@ struct sfs_direntry {
 #define SFS_CONINFO_TYPE(ci)	(((ci) >> 56) & 0x7f)	/* record type */
 #define SFS_CONINFO_LEN(ci)	((((ci) >> 48) & 0xff)*2) /* record length */
 #define SFS_CONINFO_LSN(ci)	((ci) & 0xffffffffffff)	/* log sequence no. */
+#define SFS_CONINFO_MAXLEN	510			/* longest record */
 #define SFS_MKCONINFO(cl, ty, len, lsn) \
 	(						\
 		((uint64_t)(cl) << 63) |		\
@@ -156,5 +289,51 @@ struct sfs_jphys_trim {
 	uint64_t jt_taillsn;			/* Tail LSN */
 };
 
+/*
+ * Client record types, for the metadata journal (sfs_jlog.c).
+ *
+ * Each operation is a transaction; its id is the LSN of its TXBEGIN
+ * record, and it commits when its TXEND record reaches the disk.
+ * ALLOC and FREE record changes to the freemap. META records a byte
+ * range of a metadata block (inode, indirect/extent block, directory
+ * block), both the old contents (for rolling back an operation that
+ * didn't commit) and the new (for replaying one that did). A record
+ * whose transaction id is 0 isn't part of an operation and counts as
+ * committed.
+ */
+#define SFS_JREC_TXBEGIN	1		/* Operation starts */
+#define SFS_JREC_TXEND		2		/* Operation commits */
+#define SFS_JREC_ALLOC		3		/* Blocks allocated */
+#define SFS_JREC_FREE		4		/* Blocks freed */
+#define SFS_JREC_META		5		/* Metadata block changed */
+
+/* Contents for SFS_JREC_TXBEGIN and SFS_JREC_TXEND */
+struct sfs_jrec_tx {
+	uint64_t jx_txid;			/* Transaction (0 in TXBEGIN) */
+};
+
+/* Contents for SFS_JREC_ALLOC and SFS_JREC_FREE */
+struct sfs_jrec_blocks {
+	uint64_t jb_txid;			/* Transaction */
+	uint32_t jb_start;			/* First block */
+	uint32_t jb_count;			/* Number of blocks */
+};
+
+/*
+ * Contents for SFS_JREC_META: this header, then jm_len bytes of old
+ * data, then jm_len bytes of new data. SFS_JMETA_ZERO means the block
+ * was freshly zeroed before the change, so replay zeroes it first.
+ */
+struct sfs_jrec_meta {
+	uint64_t jm_txid;			/* Transaction */
+	uint32_t jm_block;			/* Block changed */
+	uint16_t jm_offset;			/* Offset of change in block */
+	uint16_t jm_len;			/* Length of change */
+	uint16_t jm_flags;			/* SFS_JMETA_* */
+	uint16_t jm_unused;			/* Unused, set to 0 */
+};
+#define SFS_JMETA_MAXLEN	240		/* Max. bytes per record */
+#define SFS_JMETA_ZERO		0x0001		/* Block was zeroed */
+
 
 #endif /* _KERN_SFS_H_ */
@@ -49,12 +49,14 @@
 #define AF_UNIX		1
 #define AF_INET		2
 #define AF_INET6	3
+#define AF_LNET		4	/* sys161 network, see sockaddr_ln */
 
 /* Protocol families. Pointless layer of indirection in the standard API. */
 #define PF_UNSPEC	AF_UNSPEC
 #define PF_UNIX		AF_UNIX
 #define PF_INET		AF_INET
 #define PF_INET6	AF_INET6
+#define PF_LNET		AF_LNET
 
 /*
  * Socket address structures. Socket addresses are polymorphic, and
@@ -75,6 +77,22 @@ struct sockaddr {
    __u8 sa_family;
 };
 
+/*
+ * Address of a datagram socket on the sys161 network: a link address
+ * (the hub address of the machine's lnet card, or 0xffff for all of
+ * them) and a port number, both in host byte order.
+ */
+struct sockaddr_ln {
+   __u8 sln_len;
+   __u8 sln_family;		/* AF_LNET */
+   __u16 sln_port;
+   __u16 sln_addr;
+   __u16 sln_zero;
+};
+
+/* Flags for sendto() and recvfrom(). */
+#define MSG_DONTWAIT	0x1	/* fail with EAGAIN instead of waiting */
+
 #define _SS_SIZE	128
 struct sockaddr_storage {
    __u8 ss_len;
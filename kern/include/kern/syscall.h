@@ -59,10 +59,10 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
-//#define SYS_mincore    12
-//#define SYS_mlock      13
-//#define SYS_munlock    14
+#define SYS_madvise      11
+#define SYS_mincore      12
+#define SYS_mlock        13
+#define SYS_munlock      14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
 //                              (security/credentials)
@@ -86,13 +86,13 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage   35
 //                              (resource limits)
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
 //                              (process priority control)
-//#define SYS_getpriority 38
-//#define SYS_setpriority 39
+#define SYS_getpriority 38
+#define SYS_setpriority 39
 //                              (process groups, sessions, and job control)
 //#define SYS_getpgid    40
 //#define SYS_setpgid    41
@@ -109,13 +109,13 @@
 #define SYS_close        49
 #define SYS_read         50
 #define SYS_pread        51
-//#define SYS_readv      52
-//#define SYS_preadv     53
+#define SYS_readv        52
+#define SYS_preadv       53
 #define SYS_getdirentry  54
 #define SYS_write        55
 #define SYS_pwrite       56
-//#define SYS_writev     57
-//#define SYS_pwritev    58
+#define SYS_writev       57
+#define SYS_pwritev      58
 #define SYS_lseek        59
 #define SYS_flock        60
 #define SYS_ftruncate    61
@@ -180,8 +180,8 @@
 #define SYS_getpeername  106
 #define SYS_getsockopt   107
 #define SYS_setsockopt   108
-//#define SYS_recvfrom   109
-//#define SYS_sendto     110
+#define SYS_recvfrom     109
+#define SYS_sendto       110
 //#define SYS_recvmsg    111
 //#define SYS_sendmsg    112
 
@@ -196,6 +196,23 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+//                              (bulk getdirentry; see kern/dirent.h)
+#define SYS_getdirentries 121
+//                              (cpu affinity; OS/161-specific)
+#define SYS_setaffinity  122
+#define SYS_getaffinity  123
+//                              (futexes; OS/161-specific)
+#define SYS_futex_wait   124
+#define SYS_futex_wake   125
+//                              (in-kernel file copy; OS/161-specific)
+#define SYS_copyfile     126
+//                              (user PC sampling; OS/161-specific)
+#define SYS_uprof        127
+//                              (user threads; OS/161-specific)
+#define SYS_lwp_create   128
+#define SYS_lwp_exit     129
+//                              (time page; OS/161-specific)
+#define SYS___timepage   130
 
 /*CALLEND*/
 
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_TIMEPAGE_H_
+#define _KERN_TIMEPAGE_H_
+
+/*
+ * The time page: a page the kernel keeps the time of day in, which
+ * the __timepage system call maps read-only into the calling process
+ * and hands back the address of. Reading the time from it takes no
+ * system call, just a few loads.
+ *
+ * The time is updated every clock tick (tp_tick nanoseconds), not
+ * continuously, so it's only that precise; __time is exact. tp_seq
+ * is odd while an update is in progress. To read it: read tp_seq,
+ * wait for it to be even, read the time, then read tp_seq again and
+ * start over if it changed. A read barrier goes between each step.
+ */
+struct timepage {
+	volatile __u32 tp_seq;		/* bumped before and after updates */
+	__u32 tp_tick;			/* update interval, nanoseconds */
+	volatile __time_t tp_sec;	/* the time of day */
+	volatile __u32 tp_nsec;
+};
+
+
+#endif /* _KERN_TIMEPAGE_H_ */
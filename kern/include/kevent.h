@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KEVENT_H_
+#define _KEVENT_H_
+
+/*
+ * Structured kernel event tracing.
+ *
+ * Tracepoints (KEVENT and KEVENT_NAME) append fixed-size binary
+ * records, in the format of <kern/kevent.h>, to a ring belonging to
+ * the current CPU, taking no locks. A drain thread writes the rings
+ * to a file for /sbin/kevdump to decode. While tracing is off a
+ * tracepoint costs a test of kevent_enabled.
+ *
+ * If ltrace mirroring is on, each event is also passed to
+ * ltrace_debug with code KEVENT_LTRACECODE(type), so trace161 logs
+ * it too, timestamped in simulated cycles.
+ *
+ * kevent_start opens the trace file (created or truncated) and starts
+ * tracing; kevent_stop stops, drains what's left, and closes it.
+ */
+
+#include <kern/kevent.h>
+
+#define KEVENT_LTRACECODE(type)	(0x6b650000 | (type))
+
+extern volatile bool kevent_enabled;
+
+void kevent_record(unsigned type, uint32_t a0, uint32_t a1, uint32_t a2,
+		   uint32_t a3);
+void kevent_recordname(unsigned type, uint32_t a0, const char *name);
+
+#define KEVENT(type, a0, a1, a2, a3) \
+	do { \
+		if (kevent_enabled) { \
+			kevent_record(type, (uintptr_t)(a0), \
+				      (uintptr_t)(a1), (uintptr_t)(a2), \
+				      (uintptr_t)(a3)); \
+		} \
+	} while (0)
+
+#define KEVENT_NAME(type, a0, name) \
+	do { \
+		if (kevent_enabled) { \
+			kevent_recordname(type, (uintptr_t)(a0), name); \
+		} \
+	} while (0)
+
+void kevent_bootstrap(void);		/* after thread_start_cpus */
+int kevent_start(const char *path);
+void kevent_stop(void);
+void kevent_setltrace(bool on);
+
+#endif /* _KEVENT_H_ */
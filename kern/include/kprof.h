@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KPROF_H_
+#define _KPROF_H_
+
+/*
+ * Sampling kernel profiler.
+ *
+ * While profiling is on, each timer interrupt records the PC it
+ * interrupted into a buffer belonging to the current CPU, taking no
+ * locks. Optionally it also records a caller for each sample (see
+ * below). "kprof dump" merges the buffers and prints a histogram of
+ * PCs, most frequent first; testscripts/profsym.py maps those to
+ * functions using the kernel's symbol table.
+ *
+ * MIPS code doesn't keep a frame pointer chain, and gcc doesn't put
+ * the return address at a fixed place in the frame, so rather than a
+ * stack walk the "caller" is the interrupted RA register. That's the
+ * real caller if the interrupted function is a leaf or hasn't called
+ * anything yet, and otherwise it's the last place it returned to;
+ * it's no more than a hint, which is why it is optional.
+ *
+ * Samples come from hardclocks, so they happen at HZ per CPU and
+ * only on CPUs that are busy (idle CPUs take no hardclocks). Samples
+ * of user code are counted here but not recorded.
+ *
+ * User profiling is per process (see <kern/uprof.h>): a process with
+ * a uprof buffer (p_uprof) gets the PC of each tick that interrupts
+ * it in user mode recorded there, whether or not the kernel profiler
+ * is on. Processes get a buffer by calling uprof(UPROF_START), or by
+ * being started from the menu after "kprof user on", or by being
+ * forked by a process that has one.
+ */
+
+struct proc;
+
+extern volatile bool kprof_enabled;
+extern volatile unsigned uprof_nprocs;	/* processes with a buffer */
+
+/* Called from the timer interrupt with the interrupted PC and RA. */
+void kprof_sample(vaddr_t pc, vaddr_t ra, bool user);
+
+#define KPROF_SAMPLE(pc, ra, user) \
+	do { \
+		if (kprof_enabled || uprof_nprocs > 0) { \
+			kprof_sample(pc, ra, user); \
+		} \
+	} while (0)
+
+void kprof_bootstrap(void);
+int kprof_start(bool callers);
+void kprof_stop(void);
+void kprof_reset(void);
+void kprof_status(void);
+int kprof_dump(unsigned maxlines);
+
+/* User profiling. */
+void uprof_setnew(bool on);		/* for menu-started processes */
+int uprof_attach(struct proc *p);	/* start, or restart empty */
+void uprof_detach(struct proc *p, bool dump);	/* stop */
+void uprof_reset(struct proc *p);	/* empty the buffer */
+int uprof_read(struct proc *p, userptr_t buf, size_t len,
+	       unsigned *retcount);
+bool uprof_getnew(void);
+
+#endif /* _KPROF_H_ */
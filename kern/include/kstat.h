@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KSTAT_H_
+#define _KSTAT_H_
+
+/*
+ * Kernel statistics, for user programs: reading the device "kstat:"
+ * gives a snapshot of the kernel's counters, as text. The first line
+ * is "kstat" and the format version, KSTAT_VERSION; the second is
+ * "time" and the time of day it was taken, as SEC.NSEC. After that
+ * each line is a name and a value, separated by a space. Names are
+ * made of dot-separated words (e.g. "vm.coremap.free"); values are
+ * unsigned decimal, up to 64 bits. Most values are counts, which
+ * only go up (and may wrap); the rest are current levels. Which
+ * names appear can change from one snapshot to the next.
+ *
+ * A read at offset 0 takes a new snapshot, and reads further on
+ * continue the same one, so reading the device from the start in one
+ * go (it's a few K) gets a consistent picture.
+ *
+ * Subsystems contribute with a function that calls kstat_add, or
+ * kstat_addsub, for each value; devkstat.c has the list.
+ *
+ * Functions:
+ *
+ *    kstat_add    - add the value VALUE named NAME to the snapshot KS.
+ *
+ *    kstat_addsub - the same, named PREFIX.NAME; for when the prefix
+ *                   names one of several things (a cpu, a device).
+ */
+
+#define KSTAT_VERSION	1
+
+struct kstat;
+
+void kstat_add(struct kstat *ks, const char *name, uint64_t value);
+void kstat_addsub(struct kstat *ks, const char *prefix, const char *name,
+		  uint64_t value);
+
+
+#endif /* _KSTAT_H_ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+/*
+ * Lightweight tracing for hot paths.
+ *
+ * ktrace() records its format string and arguments in a ring buffer
+ * belonging to the current CPU, with interrupts off for a moment and
+ * no locks; formatting happens later, when the "ktrace" thread drains
+ * the rings to the console or to a file. If a ring fills before it's
+ * drained, the oldest records are overwritten and counted as lost.
+ *
+ * Because formatting is deferred:
+ *    - FMT must be a string constant;
+ *    - arguments must be int-sized (int, unsigned, pointers; no
+ *      64-bit values), at most KTRACE_NARGS of them;
+ *    - %s arguments must point to strings that never go away.
+ *
+ * Each line comes out prefixed with its CPU number and the value of
+ * that CPU's hardclock counter.
+ *
+ * Tracing is off until ktrace_setenabled(true); ktrace() then costs a
+ * test of a global flag.
+ */
+
+#define KTRACE_NARGS	4
+
+void ktrace(const char *fmt, ...);
+
+void ktrace_bootstrap(void);		/* after thread_start_cpus */
+void ktrace_setenabled(bool on);
+int ktrace_setoutput(const char *path);	/* NULL for the console */
+void ktrace_drain(void);		/* drain now */
+
+#endif /* _KTRACE_H_ */
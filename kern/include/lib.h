@@ -113,11 +113,19 @@ extern uint32_t dbflags;
 /*
  * Random number generator, using the random device.
  *
- * random() returns a number between 0 and randmax() inclusive.
+ * random() returns a number between 0 and randmax() inclusive. The
+ * values come from the device CPU_RANDPOOL at a time and are handed
+ * out from a per-cpu buffer.
+ *
+ * fastrandom() returns a number between 0 and 0xffffffff from a
+ * per-cpu xorshift generator seeded from random(). It is cheap,
+ * takes no locks, and is fine for test data and for picking victims,
+ * but it is not unpredictable: don't use it where that matters.
  */
 #define RANDOM_MAX (randmax())
 uint32_t randmax(void);
 uint32_t random(void);
+uint32_t fastrandom(void);
 
 /*
  * Kernel heap memory allocation. Like malloc/free.
@@ -125,6 +133,8 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_printsites prints per-call-site usage if the kmallocsites
+ * option is on.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +142,7 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printsites(void);
 
 /*
  * C string functions.
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LIST_H_
+#define _LIST_H_
+
+#include <cdefs.h>
+#include <lib.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef LISTINLINE
+#define LISTINLINE INLINE __FORCEINLINE
+#endif
+
+/*
+ * Intrusive doubly-linked list, the same shape as threadlist (see
+ * threadlist.h) but for any type. Objects that go on a list embed a
+ * struct listnode; adding and removing never allocates and so cannot
+ * fail, and removing from the middle is constant time, which makes
+ * this the better choice than an array for collections that are
+ * mostly added to and removed from rather than indexed.
+ *
+ * The head and tail nodes are always on the list as bookends, so the
+ * operations have no special cases. This means lists must not be
+ * copied by assignment or memcpy.
+ *
+ * ->ln_self points to the object containing the node, and is NULL
+ * for the bookends; that is what ends iterations.
+ */
+
+struct listnode {
+	struct listnode *ln_prev;
+	struct listnode *ln_next;
+	void *ln_self;
+};
+
+struct list {
+	struct listnode l_head;
+	struct listnode l_tail;
+	unsigned l_count;
+};
+
+LISTINLINE void listnode_init(struct listnode *ln, void *self);
+LISTINLINE void listnode_cleanup(struct listnode *ln);
+LISTINLINE void list_init(struct list *l);
+LISTINLINE void list_cleanup(struct list *l);
+LISTINLINE bool list_isempty(const struct list *l);
+LISTINLINE unsigned list_count(const struct list *l);
+LISTINLINE void list_insertafter(struct list *l, struct listnode *onlist,
+				 struct listnode *addee);
+LISTINLINE void list_addhead(struct list *l, struct listnode *ln);
+LISTINLINE void list_addtail(struct list *l, struct listnode *ln);
+LISTINLINE void list_remove(struct list *l, struct listnode *ln);
+LISTINLINE void *list_remhead(struct list *l);
+LISTINLINE void *list_remtail(struct list *l);
+
+/*
+ * Inlining for list operations
+ */
+
+LISTINLINE void
+listnode_init(struct listnode *ln, void *self)
+{
+	KASSERT(self != NULL);
+	ln->ln_prev = NULL;
+	ln->ln_next = NULL;
+	ln->ln_self = self;
+}
+
+LISTINLINE void
+listnode_cleanup(struct listnode *ln)
+{
+	KASSERT(ln->ln_prev == NULL);
+	KASSERT(ln->ln_next == NULL);
+}
+
+LISTINLINE void
+list_init(struct list *l)
+{
+	l->l_head.ln_prev = NULL;
+	l->l_head.ln_next = &l->l_tail;
+	l->l_head.ln_self = NULL;
+	l->l_tail.ln_prev = &l->l_head;
+	l->l_tail.ln_next = NULL;
+	l->l_tail.ln_self = NULL;
+	l->l_count = 0;
+}
+
+LISTINLINE void
+list_cleanup(struct list *l)
+{
+	KASSERT(l->l_head.ln_next == &l->l_tail);
+	KASSERT(l->l_tail.ln_prev == &l->l_head);
+	KASSERT(l->l_count == 0);
+}
+
+LISTINLINE bool
+list_isempty(const struct list *l)
+{
+	return l->l_count == 0;
+}
+
+LISTINLINE unsigned
+list_count(const struct list *l)
+{
+	return l->l_count;
+}
+
+LISTINLINE void
+list_insertafter(struct list *l, struct listnode *onlist,
+		 struct listnode *addee)
+{
+	KASSERT(addee->ln_prev == NULL);
+	KASSERT(addee->ln_next == NULL);
+	KASSERT(onlist->ln_next != NULL);
+
+	addee->ln_prev = onlist;
+	addee->ln_next = onlist->ln_next;
+	addee->ln_next->ln_prev = addee;
+	onlist->ln_next = addee;
+	l->l_count++;
+}
+
+LISTINLINE void
+list_addhead(struct list *l, struct listnode *ln)
+{
+	list_insertafter(l, &l->l_head, ln);
+}
+
+LISTINLINE void
+list_addtail(struct list *l, struct listnode *ln)
+{
+	list_insertafter(l, l->l_tail.ln_prev, ln);
+}
+
+LISTINLINE void
+list_remove(struct list *l, struct listnode *ln)
+{
+	KASSERT(ln->ln_self != NULL);
+	KASSERT(ln->ln_prev != NULL && ln->ln_next != NULL);
+	KASSERT(l->l_count > 0);
+
+	ln->ln_prev->ln_next = ln->ln_next;
+	ln->ln_next->ln_prev = ln->ln_prev;
+	ln->ln_prev = NULL;
+	ln->ln_next = NULL;
+	l->l_count--;
+}
+
+LISTINLINE void *
+list_remhead(struct list *l)
+{
+	struct listnode *ln;
+
+	ln = l->l_head.ln_next;
+	if (ln->ln_self == NULL) {
+		return NULL;
+	}
+	list_remove(l, ln);
+	return ln->ln_self;
+}
+
+LISTINLINE void *
+list_remtail(struct list *l)
+{
+	struct listnode *ln;
+
+	ln = l->l_tail.ln_prev;
+	if (ln->ln_self == NULL) {
+		return NULL;
+	}
+	list_remove(l, ln);
+	return ln->ln_self;
+}
+
+/*
+ * Iteration: ITERVAR should be declared as a pointer to the element
+ * type, and MEMBER is the name of the listnode within it. Don't remove
+ * ITERVAR from the list inside the loop; use LIST_FORALL_SAFE, which
+ * needs a second variable NEXTVAR of the same type, for that.
+ */
+#define LIST_FORALL(itervar, l, member) \
+	for ((itervar) = (l)->l_head.ln_next->ln_self; \
+	     (itervar) != NULL; \
+	     (itervar) = (itervar)->member.ln_next->ln_self)
+
+#define LIST_FORALL_REV(itervar, l, member) \
+	for ((itervar) = (l)->l_tail.ln_prev->ln_self; \
+	     (itervar) != NULL; \
+	     (itervar) = (itervar)->member.ln_prev->ln_self)
+
+#define LIST_FORALL_SAFE(itervar, nextvar, l, member) \
+	for ((itervar) = (l)->l_head.ln_next->ln_self; \
+	     (itervar) != NULL && \
+		((nextvar) = (itervar)->member.ln_next->ln_self, 1); \
+	     (itervar) = (nextvar))
+
+/*
+ * Typed lists, for type checking. DECLLIST_BYTYPE(foo, bar, INLINE)
+ * declares "struct foo", a list of "bar" linked through the
+ * listnode MEMBER of bar, with operations foo_init, foo_cleanup,
+ * foo_isempty, foo_count, foo_addhead, foo_addtail, foo_remove,
+ * foo_remhead, foo_remtail. DEFLIST_BYTYPE defines them. DECLLIST(foo,
+ * member, INLINE) is DECLLIST_BYTYPE(foolist, struct foo, member,
+ * INLINE). The element's listnode must still be initialized with
+ * listnode_init() to point back at the element.
+ */
+
+#define DECLLIST_BYTYPE(LIST, T, MEMBER, INLINE) \
+	struct LIST {						\
+		struct list l;					\
+	};							\
+								\
+	INLINE void LIST##_init(struct LIST *lst);		\
+	INLINE void LIST##_cleanup(struct LIST *lst);		\
+	INLINE bool LIST##_isempty(const struct LIST *lst);	\
+	INLINE unsigned LIST##_count(const struct LIST *lst);	\
+	INLINE void LIST##_addhead(struct LIST *lst, T *t);	\
+	INLINE void LIST##_addtail(struct LIST *lst, T *t);	\
+	INLINE void LIST##_remove(struct LIST *lst, T *t);	\
+	INLINE T *LIST##_remhead(struct LIST *lst);		\
+	INLINE T *LIST##_remtail(struct LIST *lst)
+
+#define DEFLIST_BYTYPE(LIST, T, MEMBER, INLINE) \
+	INLINE void						\
+	LIST##_init(struct LIST *lst)				\
+	{							\
+		list_init(&lst->l);				\
+	}							\
+								\
+	INLINE void						\
+	LIST##_cleanup(struct LIST *lst)			\
+	{							\
+		list_cleanup(&lst->l);				\
+	}							\
+								\
+	INLINE bool						\
+	LIST##_isempty(const struct LIST *lst)			\
+	{							\
+		return list_isempty(&lst->l);			\
+	}							\
+								\
+	INLINE unsigned						\
+	LIST##_count(const struct LIST *lst)			\
+	{							\
+		return list_count(&lst->l);			\
+	}							\
+								\
+	INLINE void						\
+	LIST##_addhead(struct LIST *lst, T *t)			\
+	{							\
+		list_addhead(&lst->l, &t->MEMBER);		\
+	}							\
+								\
+	INLINE void						\
+	LIST##_addtail(struct LIST *lst, T *t)			\
+	{							\
+		list_addtail(&lst->l, &t->MEMBER);		\
+	}							\
+								\
+	INLINE void						\
+	LIST##_remove(struct LIST *lst, T *t)			\
+	{							\
+		list_remove(&lst->l, &t->MEMBER);		\
+	}							\
+								\
+	INLINE T *						\
+	LIST##_remhead(struct LIST *lst)			\
+	{							\
+		return list_remhead(&lst->l);			\
+	}							\
+								\
+	INLINE T *						\
+	LIST##_remtail(struct LIST *lst)			\
+	{							\
+		return list_remtail(&lst->l);			\
+	}
+
+#define DECLLIST(T, MEMBER, INLINE) \
+	DECLLIST_BYTYPE(T##list, struct T, MEMBER, INLINE)
+#define DEFLIST(T, MEMBER, INLINE) \
+	DEFLIST_BYTYPE(T##list, struct T, MEMBER, INLINE)
+
+
+#endif /* _LIST_H_ */
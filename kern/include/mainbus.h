@@ -45,6 +45,18 @@ void mainbus_bootstrap(void);
 /* Start up secondary CPUs, once their cpu structures are set up */
 void mainbus_start_cpus(void);
 
+/* Spread device interrupts over the CPUs, once they're all running */
+void mainbus_route_cpus(void);
+
+/*
+ * Interrupt routing, for the menu: print it; apply a policy by name
+ * ("boot", "spread", or "follow"); or send device slot SLOT's
+ * interrupts to CPU number CPUNUM. Return EINVAL for bad arguments.
+ */
+void mainbus_irq_print(void);
+int mainbus_irq_policy(const char *name);
+int mainbus_irq_route(unsigned slot, unsigned cpunum);
+
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
@@ -55,6 +67,12 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/* Program the current CPU's timer to interrupt NSECS from now. */
+void mainbus_settimer(uint64_t nsecs);
+
+/* Cycles the current CPU has run since it started; for benchmarks. */
+uint64_t mainbus_cycles(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NET_H_
+#define _NET_H_
+
+/*
+ * Network interfaces and packet buffers.
+ *
+ * Packets live in struct pbufs from a pool allocated once, when the
+ * first interface attaches, so nothing on the packet path calls
+ * kmalloc; in particular drivers can get and queue pbufs in their
+ * interrupt handlers. A pbuf holds one whole frame. Its data starts
+ * PBUF_HEADROOM bytes in, so each layer on the way out can prepend
+ * its header with pbuf_prepend, and each on the way in strips its
+ * own with pbuf_adj.
+ *
+ * A driver fills in a struct netif and calls netif_attach. Received
+ * packets go to netif_input, in the interrupt handler; they collect
+ * on the interface's receive queue, and whoever takes them does so a
+ * batch at a time with netif_recvbatch. Only the first packet of a
+ * batch wakes anyone up.
+ */
+
+#include <spinlock.h>
+
+struct wchan;
+
+/* Largest frame, link header included, and the space left before it */
+#define PBUF_SIZE	4096
+#define PBUF_HEADROOM	64
+
+/* Number of pbufs in the pool */
+#define PBUF_NBUFS	32
+
+/* Link-level address that reaches every node */
+#define NET_BROADCAST	0xffff
+
+struct pbuf {
+	struct pbuf *pb_next;		/* on a pbufq */
+	unsigned pb_off;		/* start of data in pb_buf */
+	unsigned pb_len;		/* length of data */
+	uint16_t pb_linksrc;		/* link addresses (host order) */
+	uint16_t pb_linkdst;
+	char pb_buf[PBUF_HEADROOM + PBUF_SIZE];
+};
+
+/* FIFO of pbufs. Unlocked: whoever owns it provides the lock. */
+struct pbufq {
+	struct pbuf *pq_head;
+	struct pbuf *pq_tail;
+	unsigned pq_count;
+};
+
+#define PBUF_DATA(pb)	((pb)->pb_buf + (pb)->pb_off)
+
+/*
+ * Pool operations. pbuf_get returns NULL when the pool is empty
+ * rather than wait, so it can be used in interrupt handlers; it
+ * returns a pbuf with no data and full headroom. pbuf_getwait waits
+ * instead, for thread context.
+ */
+struct pbuf *pbuf_get(void);
+struct pbuf *pbuf_getwait(void);
+void pbuf_put(struct pbuf *pb);
+void pbuf_putq(struct pbufq *q);
+unsigned pbuf_navail(void);
+
+/*
+ * Grow the data at the front by LEN bytes, returning a pointer to
+ * them, or NULL if there's no headroom; or shrink it by LEN bytes.
+ */
+void *pbuf_prepend(struct pbuf *pb, unsigned len);
+void pbuf_adj(struct pbuf *pb, unsigned len);
+
+void pbufq_init(struct pbufq *q);
+void pbufq_append(struct pbufq *q, struct pbuf *pb);
+struct pbuf *pbufq_remhead(struct pbufq *q);
+void pbufq_concat(struct pbufq *q, struct pbufq *from);
+
+/*
+ * A network interface.
+ *
+ * The driver sets ni_name, ni_hwaddr, ni_mtu (largest payload past
+ * the link header), ni_output and ni_data before netif_attach.
+ * ni_output queues PB for transmission; it always takes the pbuf,
+ * and returns EAGAIN and drops it if the transmit queue is full.
+ * The counters are updated by netif_input, netif_output and the
+ * driver, under ni_lock.
+ */
+struct netif {
+	char ni_name[16];
+	uint16_t ni_hwaddr;
+	unsigned ni_mtu;
+	int (*ni_output)(struct netif *ni, struct pbuf *pb);
+	void *ni_data;
+
+	struct spinlock ni_lock;	/* protects the following */
+	struct pbufq ni_rxq;		/* received, not yet taken */
+	struct wchan *ni_rxwchan;	/* for netif_recvbatch */
+	unsigned ni_rxbatches;		/* empty->nonempty transitions */
+	uint64_t ni_ipackets;
+	uint64_t ni_ibytes;
+	uint64_t ni_idrops;		/* no pbuf, or queue too long */
+	uint64_t ni_ierrors;		/* bad frames */
+	uint64_t ni_opackets;
+	uint64_t ni_obytes;
+	uint64_t ni_odrops;
+};
+
+/* Most packets left waiting on an interface's receive queue */
+#define NETIF_RXQMAX	(PBUF_NBUFS / 2)
+
+int netif_attach(struct netif *ni);
+struct netif *netif_get(unsigned index);
+
+/* For drivers: a packet came in (PB may be NULL if none to be had) */
+void netif_input(struct netif *ni, struct pbuf *pb);
+void netif_inerror(struct netif *ni);
+
+/*
+ * Send PB (consumed in any case) to link address DST; the payload is
+ * the data in PB. Returns EMSGSIZE if it's bigger than ni_mtu.
+ */
+int netif_output(struct netif *ni, struct pbuf *pb, uint16_t dst);
+
+/*
+ * Move everything on NI's receive queue to Q. If nothing has arrived
+ * and WAIT is set, wait up to NSECS nanoseconds (0 for no limit) for
+ * something; returns ETIMEDOUT if nothing did, EAGAIN if not WAIT.
+ */
+int netif_recvbatch(struct netif *ni, struct pbufq *q, bool wait,
+		    uint64_t nsecs);
+
+/* For the menu */
+void netif_printall(void);
+
+/*
+ * Datagram sockets (socket.c).
+ *
+ * A socket is a vnode, so it lives in the file table like a pipe; it
+ * talks to the first interface. Each datagram carries a small header
+ * with the source and destination ports. Sending copies the caller's
+ * data straight into a pbuf, past room for the headers, and hands
+ * the pbuf down; receiving leaves the pbufs on the socket's ring, as
+ * the interrupt handler delivered them, until they're copied straight
+ * out to the reader. So each byte is copied once between the caller
+ * and the pbuf, and once between the pbuf and the card.
+ *
+ *    socket_create  - make an unbound AF_LNET/SOCK_DGRAM socket.
+ *    socket_bind    - bind to a port (0 picks a free one).
+ *    socket_connect - set the default destination, and take
+ *                     datagrams only from there.
+ *    socket_getname - get the local address.
+ *    socket_sendto  - send the data in UIO as one datagram, to TO or
+ *                     (if NULL) the connected address.
+ *    socket_recvfrom - take one datagram into UIO; the rest of one
+ *                     that doesn't fit is discarded. FROM, if not
+ *                     NULL, gets the sender.
+ *    socket_input   - for netif_input: deliver PB if it's for us.
+ *                     Returns false if it isn't a datagram at all.
+ */
+
+struct uio;
+struct vnode;
+struct sockaddr_ln;
+
+int socket_create(struct vnode **ret);
+int socket_bind(struct vnode *vn, const struct sockaddr_ln *addr);
+int socket_connect(struct vnode *vn, const struct sockaddr_ln *addr);
+int socket_getname(struct vnode *vn, struct sockaddr_ln *addr);
+int socket_sendto(struct vnode *vn, struct uio *uio, int flags,
+		  const struct sockaddr_ln *to);
+int socket_recvfrom(struct vnode *vn, struct uio *uio, int flags,
+		    struct sockaddr_ln *from);
+bool socket_input(struct netif *ni, struct pbuf *pb);
+
+#endif /* _NET_H_ */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache: physical pages holding file contents, shared by every
+ * address space that maps the same page of the same file, and by
+ * reads of the file (e.g. the text of a program run by several
+ * processes at once, or a file mapped with as_mmap).
+ *
+ * A cached page holds PAGE_SIZE bytes of the file starting at the
+ * page-aligned offset OFFSET; anything past EOF is zero. The cache
+ * holds one coremap reference to each of its pages, and each mapping
+ * or reader holds another. Pages nobody else holds are reclaimed,
+ * oldest first, when memory is short.
+ *
+ * The page cache is not written back; instead writing or truncating
+ * a file drops its pages from the cache (address spaces that already
+ * map them keep the old contents, as if privately mapped).
+ *
+ * Functions:
+ *
+ *    pagecache_bootstrap - initialize. Called from vm_bootstrap().
+ *
+ *    pagecache_lookup - find a cached page and return it pinned, with
+ *                a new reference for the caller, or 0 if not cached.
+ *
+ *    pagecache_insert - offer the pinned page PA, which the caller
+ *                has filled in and holds the only reference to, to
+ *                the cache. Returns the page to use, pinned: either
+ *                PA, now also referenced by the cache, or (if someone
+ *                else got there first) the cached copy, in which
+ *                case PA has been freed.
+ *
+ *    pagecache_read - copy the file data in UIO from cached pages,
+ *                stopping at the first page that isn't cached or at
+ *                SIZE, the file's size. Leaves the rest for the
+ *                caller to read the slow way.
+ *
+ *    pagecache_purge - drop all cached pages of VN. Called when VN is
+ *                written, truncated, or reclaimed.
+ *
+ *    pagecache_reclaim - free up to NPAGES unmapped cached pages.
+ *                Returns the number freed.
+ *
+ *    pagecache_printstats - print counters.
+ *
+ *    pagecache_kstat - add the counters to a kstat snapshot.
+ */
+
+#include "opt-dumbvm.h"
+
+struct vnode;
+struct uio;
+struct kstat;
+
+#if OPT_DUMBVM
+#define pagecache_read(vn, uio, size) ((void)(vn), (void)(uio), (void)(size), 0)
+#define pagecache_purge(vn) ((void)(vn))
+#else
+void pagecache_bootstrap(void);
+paddr_t pagecache_lookup(struct vnode *vn, off_t offset);
+paddr_t pagecache_insert(struct vnode *vn, off_t offset, paddr_t pa);
+int pagecache_read(struct vnode *vn, struct uio *uio, off_t size);
+void pagecache_purge(struct vnode *vn);
+unsigned pagecache_reclaim(unsigned npages);
+void pagecache_printstats(void);
+void pagecache_kstat(struct kstat *ks);
+#endif
+
+
+#endif /* _PAGECACHE_H_ */
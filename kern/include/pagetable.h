@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table.
+ *
+ * A user virtual address is split into a 10-bit first-level index,
+ * a 10-bit second-level index, and a 12-bit page offset. The first
+ * level is an array of pointers to second-level tables; second-level
+ * tables are only allocated for 4M ranges that contain at least one
+ * page, so a sparse address space costs memory roughly in proportion
+ * to the pages it actually uses. Lookup is two array indexes no
+ * matter how many regions the address space has.
+ *
+ * Each page table entry (pte_t) holds the physical frame in the
+ * PAGE_FRAME bits and flags in the low bits. If the page has been
+ * paged out, PTE_SWAPPED is set instead of PTE_VALID and the upper
+ * bits hold the swap slot. An entry of 0 means the page has never
+ * been touched.
+ *
+ * PTE_REF says the page has been used since the pageout clock last
+ * looked at it. The TLB refill handler only loads entries that have
+ * it, and leaves the rest to vm_fault, which sets it and marks the
+ * page referenced in the coremap; that's how pages used only through
+ * TLB refills still get their second chance.
+ *
+ * Functions:
+ *
+ *    pt_create  - allocate an empty page table. Returns NULL if out
+ *                 of memory.
+ *
+ *    pt_destroy - free a page table and drop its reference to every
+ *                 page it maps, including swap slots.
+ *
+ *    pt_lookup  - return a pointer to the entry for VADDR. If the
+ *                 second-level table doesn't exist, returns NULL
+ *                 unless CREATE is set, in which case it's allocated
+ *                 (and NULL means out of memory).
+ *
+ *    pt_copy    - make NEWPT, which should be empty, map the same
+ *                 pages as OLDPT. Pages are shared copy-on-write:
+ *                 writeable pages become read-only with PTE_COW set
+ *                 in both tables, so the caller must flush OLDPT's
+ *                 stale writeable translations (even on failure).
+ *                 Pages marked PTE_SHARED are just shared.
+ *                 Memory locks (PTE_LOCKED) and use bits
+ *                 (PTE_REF) aren't copied.
+ *                 Pages in swap are copied to new swap slots.
+ *                 Returns an error code.
+ *
+ *    pt_pin     - pin the page PTE maps, if it's resident, waiting
+ *                 for any pageout in progress. Returns false if the
+ *                 page isn't resident (any more).
+ *
+ *    pt_unmap   - drop the mapping for VADDR, if any, releasing its
+ *                 page or swap slot. The caller must shoot down any
+ *                 translations for it.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_VALID	0x00000001	/* page present in memory */
+#define PTE_WRITE	0x00000002	/* page may be written */
+#define PTE_COW		0x00000004	/* copy page before writing */
+#define PTE_SWAPPED	0x00000008	/* page is in swap */
+#define PTE_SHARED	0x00000010	/* shared segment page; never COW */
+#define PTE_LOCKED	0x00000020	/* mlocked; keep the page wired */
+#define PTE_REF		0x00000040	/* used since the clock looked */
+
+#define PTE_PADDR(pte)	((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_SLOT(pte)	((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot, flags) \
+	(((pte_t)(slot) << 12) | PTE_SWAPPED | ((flags) & (PTE_WRITE|PTE_COW)))
+
+#define PT_L1BITS	10
+#define PT_L2BITS	10
+#define PT_L1ENTRIES	(1 << PT_L1BITS)
+#define PT_L2ENTRIES	(1 << PT_L2BITS)
+#define PT_L1INDEX(va)	((va) >> (32 - PT_L1BITS))
+#define PT_L2INDEX(va)	(((va) >> 12) & (PT_L2ENTRIES - 1))
+
+/* The MIPS TLB refill handler walks this itself; see vm_machdep.c. */
+struct pagetable {
+	pte_t *pt_l2[PT_L1ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_copy(struct pagetable *oldpt, struct pagetable *newpt);
+bool pt_pin(pte_t *pte);
+void pt_unmap(struct pagetable *pt, vaddr_t vaddr);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PCPU_H_
+#define _PCPU_H_
+
+/*
+ * Per-cpu statistics counters.
+ *
+ * A counter's count is kept in one slot of each cpu's c_pcpu[]. An
+ * increment touches only the current cpu's slot, with interrupts
+ * off for the read-modify-write; no lock, no atomic operation, no
+ * cache line shared with other cpus. Reading a counter sums the
+ * slots of all cpus, so it's slower, and concurrent increments may
+ * or may not be in the total. Counts are unsigned and wrap, like the
+ * counters they replace.
+ *
+ * A counter is a static struct pcpu_counter, defined with
+ * PCPU_COUNTER_INITIALIZER. Its slot is assigned the first time it's
+ * counted; there are PCPU_MAXCOUNTERS slots in all, and running out
+ * is a panic. Counts made before the current cpu exists are lost.
+ *
+ * Functions:
+ *
+ *    pcpu_counter_add   - add N to a counter. May be used anywhere,
+ *                         including interrupt handlers.
+ *
+ *    pcpu_counter_inc   - add 1.
+ *
+ *    pcpu_counter_read  - return the sum over all cpus.
+ *
+ *    pcpu_counter_reset - set the count back to 0. Increments made
+ *                         meanwhile on other cpus may survive.
+ *
+ *    pcpu_counter_printall / pcpu_counter_resetall
+ *                       - the same, for every counter used so far.
+ *
+ *    pcpu_counter_kstat - add every counter used so far to a kstat
+ *                         snapshot, under its own name.
+ */
+
+#define PCPU_MAXCOUNTERS	64
+
+struct pcpu_counter {
+	const char *pc_name;
+	unsigned pc_slot;		/* in c_pcpu[]; 0 until first used */
+	struct pcpu_counter *pc_next;	/* on the list of used counters */
+};
+
+#define PCPU_COUNTER_INITIALIZER(name)	{ name, 0, NULL }
+
+void pcpu_counter_add(struct pcpu_counter *pc, unsigned n);
+unsigned pcpu_counter_read(struct pcpu_counter *pc);
+void pcpu_counter_reset(struct pcpu_counter *pc);
+void pcpu_counter_printall(void);
+void pcpu_counter_resetall(void);
+struct kstat;
+void pcpu_counter_kstat(struct kstat *ks);
+
+#define pcpu_counter_inc(pc)	pcpu_counter_add(pc, 1)
+
+
+#endif /* _PCPU_H_ */
@@ -37,17 +37,20 @@
  */
 
 #include <spinlock.h>
+#include <thread.h>	/* for struct usage */
 
 struct addrspace;
 struct thread;
 struct vnode;
+struct filetable;
+struct semaphore;
+struct cv;
 
 /*
  * Process structure.
  *
  * Note that we only count the number of threads in each process.
- * (And, unless you implement multithreaded user processes, this
- * number will not exceed 1 except in kproc.) If you want to know
+ * User processes get more than one with lwp_create. If you want to know
  * exactly which threads are in the process, e.g. for debugging, add
  * an array and a sleeplock to protect it. (You can't use a spinlock
  * to protect an array because arrays need to be able to call
@@ -62,13 +65,34 @@ struct vnode;
 struct proc {
 	char *p_name;			/* Name of this process */
 	struct spinlock p_lock;		/* Lock for this structure */
+	pid_t p_pid;			/* Process ID (0 for kproc) */
 	unsigned p_numthreads;		/* Number of threads in this process */
+	unsigned p_nlive;		/* ...user threads not yet leaving */
+	volatile bool p_exiting;	/* other threads must leave */
+	struct wchan p_singlewchan;	/* proc_single waits here */
+	int p_nice;			/* Nice value, PRIO_MIN to PRIO_MAX */
+	struct usage p_usage;		/* of threads that have left */
+	struct usage p_cusage;		/* of reaped children, in all */
+
+	/* Family; protected by the global wait lock in proc.c */
+	struct proc *p_parent;		/* NULL if orphaned */
+	struct proc *p_children;	/* first child */
+	struct proc *p_nextsib;		/* next child of p_parent */
+	struct proc *p_prevsib;		/* previous child of p_parent */
+	bool p_exited;			/* zombie, waiting to be reaped */
+	int p_exitstatus;		/* for waitpid, once p_exited */
+	struct cv *p_exitcv;		/* the parent waits here */
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct semaphore *p_vforkdone;	/* vfork parent waiting for it */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+	struct filetable *p_filetable;	/* open files */
+
+	/* Profiling */
+	struct uprofbuf *p_uprof;	/* user PC samples (see kprof.h) */
 
 	/* add more material here as needed */
 };
@@ -82,12 +106,81 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+/*
+ * Create a child of the current process for fork. It gets a new PID
+ * and shares the parent's file table and current directory, but has
+ * no address space yet; the caller provides that.
+ */
+int proc_fork(struct proc **ret);
+
+/*
+ * For a vforked child: let the parent continue. The caller must already
+ * have stopped using the borrowed address space, which is left alone.
+ */
+void proc_vfork_release(struct proc *proc);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
 /* terminate a process */
 void proc__exit(int status);
 
+/*
+ * User threads (see lwp_create in fork_syscalls.c).
+ *
+ *    proc_single     - make the current thread the only one in its
+ *                      process, for exit and exec: the others leave
+ *                      the next time they'd return to user mode, and
+ *                      any asleep on a futex are woken to do so. A
+ *                      thread doing something else that blocks for
+ *                      long is waited for. If another thread got
+ *                      there first, the current one leaves instead.
+ *
+ *    proc_mustexit   - true if the current thread should leave
+ *                      because of proc_single. Cheap; for sleeps
+ *                      that proc_single knows how to interrupt.
+ *
+ *    proc_checkexit  - leave now if proc_mustexit; otherwise return.
+ *                      Called on the way back to user mode.
+ *
+ *    proc_lwp_exit   - the current thread leaves its process,
+ *                      which exits with status 0 if it was the last.
+ *
+ *    proc_lwp_added  - count a user thread just created in the current
+ *                      process; proc_lwp_failed takes it back if the
+ *                      thread couldn't be started.
+ */
+void proc_single(void);
+bool proc_mustexit(void);
+void proc_checkexit(void);
+__DEAD void proc_lwp_exit(void);
+void proc_lwp_added(void);
+void proc_lwp_failed(void);
+
+/*
+ * Wait for the current process's child PID to exit, handing it back
+ * (or NULL, with WNOHANG, if it hasn't yet). Its exit status is in
+ * p_exitstatus. It stays a zombie until passed to proc_reap.
+ */
+int proc_wait(pid_t pid, int flags, struct proc **ret);
+void proc_reap(struct proc *child);
+
+/*
+ * Resource usage of the current process (RUSAGE_SELF) or of all its
+ * reaped descendants (RUSAGE_CHILDREN).
+ */
+int proc_getusage(int who, struct usage *ret);
+
+/*
+ * Nice value of process PID, or of the current process for PID 0.
+ * ESRCH if there's no such process.
+ */
+int proc_getnice(pid_t pid, int *ret);
+int proc_setnice(pid_t pid, int nice);
+
+/* PID of the current process's parent, or 0 if it has none. */
+pid_t proc_getppid(void);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/*
+ * Read-copy-update: deferred reclamation for read-mostly data.
+ *
+ * Readers bracket their lookups with rcu_read_lock/rcu_read_unlock,
+ * which only count nesting in the current thread: no atomic
+ * operations, no shared cache lines. A reader must not sleep, and
+ * isn't preempted, until rcu_read_unlock. Writers (serialized among
+ * themselves by a lock of their own) never change an object readers
+ * can see. They publish a new version with RCU_ASSIGN, and free the
+ * old one only after a grace period: rcu_synchronize waits for one,
+ * and rcu_call runs a function after one without waiting.
+ *
+ * Grace periods are quiescent-state based: a cpu is known to be out
+ * of any read-side section, and so done with anything unpublished
+ * before, each time it goes through thread_switch, or a hardclock
+ * arrives outside a reader, or while it's idle.
+ *
+ * Functions:
+ *
+ *    rcu_read_lock   - start a read-side section. May nest. May be
+ *                      used in interrupt handlers.
+ *
+ *    rcu_read_unlock - end one.
+ *
+ *    rcu_synchronize - wait until every reader that might have seen
+ *                      something unpublished before the call is done.
+ *                      Sleeps; not in a read-side section.
+ *
+ *    rcu_call        - call FUNC(ARG) after a grace period, from
+ *                      system_workqueue. RH is the caller's storage,
+ *                      usually in the object to be freed, and must
+ *                      stay valid until then. May be used anywhere.
+ *
+ *    RCU_ASSIGN(p, v) - publish V in pointer P, after the stores that
+ *                      initialized it.
+ *
+ *    RCU_READ(p)     - fetch pointer P once, for a reader.
+ */
+
+#include <membar.h>
+
+struct rcu_head {
+	struct rcu_head *rh_next;	/* on the pending list */
+	void (*rh_func)(void *arg);
+	void *rh_arg;
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+void rcu_call(struct rcu_head *rh, void (*func)(void *), void *arg);
+
+#define RCU_ASSIGN(p, v)	(membar_store_store(), (p) = (v))
+#define RCU_READ(p)		(*(__typeof__(p) volatile *)&(p))
+
+/* For thread.c: the current cpu has passed a quiescent state. */
+void rcu_quiescent(void);
+
+/* Call once during system startup, after workqueue_bootstrap. */
+void rcu_bootstrap(void);
+
+
+#endif /* _RCU_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/*
+ * Memory reclaim hooks.
+ *
+ * Subsystems that cache things in kernel memory register a reclaimer,
+ * a function that gives back cached objects nobody is using (clean
+ * buffers, free objects sitting in caches, and so on) when memory
+ * runs short. alloc_kpages calls the reclaimers and tries again
+ * before failing, and the pageout thread calls them before it takes
+ * pages away from anything else.
+ *
+ * A reclaimer is asked for NPAGES pages and returns about how many it
+ * freed; it's fine to free more or fewer, and the count need only be
+ * a rough estimate, as kfree doesn't always give whole pages back.
+ * With RECLAIM_NOFS set the caller may be holding file system locks
+ * (it's somebody whose kmalloc failed), so the reclaimer must not
+ * call into file systems or wait for anything they might hold; it
+ * should just skip whatever it can't free without doing so.
+ * Reclaimers are never called from interrupt handlers or with
+ * spinlocks held, and a reclaimer that itself runs short of memory
+ * doesn't recurse into the hooks.
+ *
+ * Functions:
+ *
+ *    reclaim_register - add RC to the list. RC (usually static) must
+ *                stay around forever. Reclaimers are called in the
+ *                order registered.
+ *
+ *    reclaim_run - call reclaimers until NPAGES pages have been freed
+ *                or all have been tried. Returns the pages freed.
+ *
+ *    reclaim_plenty - true if NPAGES more pages could be allocated
+ *                and still leave free memory well above the point
+ *                where reclaiming starts. Caches allowed to grow past
+ *                their normal share use this to decide whether to.
+ *                Always false with dumbvm.
+ *
+ *    reclaim_printstats - print per-reclaimer counts.
+ *
+ * The kernel heap's own reclaimers are built in and come first:
+ *
+ *    kmem_cache_reclaim - free every object sitting in an object
+ *                cache's free list (kmemcache.c).
+ *
+ *    kheap_reclaim - empty the current cpu's kmalloc magazines, which
+ *                is where those objects go when freed (kmalloc.c).
+ */
+
+#define RECLAIM_NOFS	1	/* caller may hold file system locks */
+
+struct reclaimer {
+	const char *rc_name;
+	unsigned (*rc_func)(unsigned npages, unsigned flags);
+
+	/* Private to reclaim.c */
+	unsigned rc_calls;
+	unsigned rc_pages;
+	struct reclaimer *rc_next;
+};
+
+#define RECLAIMER_INITIALIZER(name, func) { name, func, 0, 0, NULL }
+
+void reclaim_register(struct reclaimer *rc);
+unsigned reclaim_run(unsigned npages, unsigned flags);
+bool reclaim_plenty(unsigned npages);
+void reclaim_printstats(void);
+
+unsigned kmem_cache_reclaim(unsigned npages, unsigned flags);
+unsigned kheap_reclaim(unsigned npages, unsigned flags);
+
+
+#endif /* _RECLAIM_H_ */
@@ -37,12 +37,16 @@
 
 
 struct buf; /* in buf.h */
+struct wchan; /* in wchan.h */
 
 /*
  * Get abstract structure definitions
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
+#include <list.h>
+#include <workqueue.h>
 
 /*
  * Get on-disk structures and constants that are made available to
@@ -60,8 +64,70 @@ struct sfs_vnode {
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
 	struct lock *sv_lock;		/* lock for vnode */
+
+	/*
+	 * Copy of the dinode fields stat wants, under sv_lock; kept
+	 * up to date as the dinode is unloaded after each change.
+	 */
+	uint32_t sv_size;		/* cache of sfi_size */
+	uint16_t sv_linkcount;		/* cache of sfi_linkcount */
+
+	/*
+	 * SFS_IFLAG_COMPRESSED, likewise. It only changes while the
+	 * whole file is range-locked, so holding any range of it is
+	 * also enough to look at it.
+	 */
+	bool sv_compressed;
+
+	/* read-ahead state, protected by sv_lock */
+	off_t sv_ranextpos;		/* where a sequential read would start */
+	uint32_t sv_radone;		/* file block read-ahead has reached */
+	unsigned sv_rawindow;		/* read-ahead window, in blocks */
+	unsigned sv_advice;		/* access pattern (IOCTL_FADVISE) */
+	bool sv_direct;			/* opened O_DIRECT (sfs_directread) */
+
+	/* name index for large directories (sfs_dir.c), under sv_lock */
+	struct sfs_dirindex *sv_dirindex;
+
+	/* file data written since the last fsync, under sv_lock */
+	off_t sv_dirtystart;		/* first byte changed */
+	off_t sv_dirtyend;		/* past the last byte changed */
+
+	/* journal position fsync must reach, under the journal lock */
+	uint64_t sv_commitlsn;
+
+	/* byte ranges locked for I/O (sfs_io.c), under sv_rangelock */
+	struct spinlock sv_rangelock;
+	struct wchan *sv_rangewchan;	/* to wait for a range */
+	struct list sv_ranges;		/* struct sfs_range, oldest first */
+
+	/* unreferenced but kept (sfs_inode.c), under sfs_inactlock */
+	struct listnode sv_inactnode;	/* on sfs_inactive */
+	bool sv_inactive;		/* ...if set */
+};
+
+/*
+ * Table of loaded vnodes, hashed by inode number. Each bucket has
+ * its own lock, so loading and reclaiming unrelated files doesn't
+ * serialize on one lock. SFS_VNHASHSIZE must be a power of 2.
+ */
+#define SFS_VNHASHSIZE	32
+
+struct sfs_vnbucket {
+	struct lock *vb_lock;		/* lock for this bucket */
+	struct vnodearray *vb_vnodes;	/* vnodes loaded into memory */
 };
 
+/*
+ * What the journal does with file data (sfs_datamode). In ordered
+ * mode data isn't journaled, but newly allocated data blocks are
+ * written before the operation that allocated them commits. In
+ * data-journal mode (mounted as "sfsdata") data is logged like
+ * metadata.
+ */
+#define SFS_DATA_ORDERED	0
+#define SFS_DATA_JOURNAL	1
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -70,20 +136,38 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
-	struct lock *sfs_vnlock;	/* lock for vnode table */
+	struct bitmap *sfs_freemapdirtymap; /* freemap blocks modified */
+	struct sfs_vnbucket sfs_vnhash[SFS_VNHASHSIZE]; /* vnode table */
 	struct lock *sfs_freemaplock;	/* lock for freemap/superblock */
-	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
+	struct rwlock *sfs_renamelock;	/* lock for sfs_rename() */
 
 	struct sfs_jphys *sfs_jphys;	/* physical journal container */
+	struct sfs_jlog *sfs_jlog;	/* metadata journal */
+	unsigned sfs_datamode;		/* SFS_DATA_* */
+
+	/* unreferenced vnodes kept loaded for reuse (sfs_inode.c) */
+	struct spinlock sfs_inactlock;	/* protects the next three */
+	struct list sfs_inactive;	/* least recently used first */
+	unsigned sfs_inacttarget;	/* evict down to this many */
+	bool sfs_inactoff;		/* unmounting; keep nothing */
+	struct work sfs_inactwork;	/* does the evicting */
+	struct sfs_fs *sfs_nextmount;	/* on the mounted volume list */
 };
 
 /*
- * Function for mounting a sfs (calls vfs_mount)
+ * Functions for mounting a sfs (call vfs_mount): ordered data, or
+ * journaling file data too.
  */
 int sfs_mount(const char *device);
+int sfs_mount_datajournal(const char *device);
+
+/*
+ * Print the journal statistics of the sfs mounted on DEVICE, or
+ * with RESET zero them.
+ */
+int sfs_jstats(const char *device, bool reset);
 
 
 #endif /* _SFS_H_ */
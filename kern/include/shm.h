@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory segments: anonymous memory mapped into more than one
+ * address space at once, from mmap with MAP_SHARED | MAP_ANON. The
+ * segment outlives any one mapping; a child process inherits its
+ * parent's mappings, and writes on either side are seen by the
+ * other, with no copying in between.
+ *
+ * A segment's pages are allocated on first touch, like any other
+ * anonymous memory. The segment holds one coremap reference to each
+ * of its pages and each address space mapping the page holds
+ * another; since they have no single owner, they're never paged out.
+ *
+ * Functions:
+ *
+ *    shm_create  - make a segment of NPAGES pages, with one
+ *                  reference. Returns NULL if out of memory.
+ *
+ *    shm_incref  - add a reference, for another mapping.
+ *
+ *    shm_decref  - drop a reference; the last one frees the segment,
+ *                  and drops its reference to each page.
+ *
+ *    shm_lookup  - return page INDEX of the segment pinned, with a
+ *                  new reference for the caller, or 0 if it hasn't
+ *                  been touched yet.
+ *
+ *    shm_insert  - offer the pinned, zeroed page PA, which the caller
+ *                  holds the only reference to, as page INDEX.
+ *                  Returns the page to use, pinned and with a
+ *                  reference for the caller: either PA, now also held
+ *                  by the segment, or (if someone else got there
+ *                  first) the segment's page, in which case PA has
+ *                  been freed.
+ */
+
+struct shm;
+
+struct shm *shm_create(unsigned npages);
+void shm_incref(struct shm *shm);
+void shm_decref(struct shm *shm);
+paddr_t shm_lookup(struct shm *shm, unsigned index);
+paddr_t shm_insert(struct shm *shm, unsigned index, paddr_t pa);
+
+
+#endif /* _SHM_H_ */
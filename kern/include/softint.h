@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SOFTINT_H_
+#define _SOFTINT_H_
+
+/*
+ * Soft interrupts ("bottom halves").
+ *
+ * A device interrupt handler should do only what has to happen with
+ * interrupts off: read and acknowledge the device, and start its
+ * next operation. The rest of the completion work, such as waking
+ * whoever waits for it, goes in a softint, which the handler
+ * schedules. Softints run on the cpu they were scheduled on, on the
+ * way out of the interrupt, with interrupts turned back on, so
+ * other devices and the timer needn't wait for them.
+ *
+ * On an idle cpu, or if the interrupt came in with interrupts
+ * already disabled, they run when that cpu next leaves idle, at
+ * splhigh, as the handler would have run them before.
+ *
+ * A softint function runs in interrupt context: it may not sleep,
+ * and other softints on its cpu wait for it. Scheduling a softint
+ * that's already pending does nothing; the function must collect
+ * whatever work has piled up since it last ran (use a lock shared
+ * with the top half). Once it has started running it can be
+ * scheduled again.
+ *
+ * Functions:
+ *
+ *    softint_init - set up a softint to call FUNC(DATA).
+ *
+ *    softint_schedule - queue a softint on the current cpu. For
+ *                interrupt handlers only. Returns false if it was
+ *                already pending.
+ *
+ *    softint_run - run the current cpu's pending softints. For the
+ *                interrupt and idle code. If LOWERSPL, drops to spl
+ *                0 while running them; otherwise leaves the spl
+ *                (which must be high) alone. Does nothing when
+ *                called from within a softint. Returns true if one
+ *                of them called softint_handoff, in which case the
+ *                caller should yield as soon as it can.
+ *
+ *    softint_active - true while the current cpu is running
+ *                softints.
+ *
+ *    softint_handoff - from a softint: a thread was woken that
+ *                should have this cpu next (see V_handoff), but a
+ *                softint can't yield.
+ */
+
+#include <spinlock.h>
+
+struct softint {
+	void (*si_func)(void *data);
+	void *si_data;
+	struct softint *si_next;	/* on the cpu's pending list */
+	volatile spinlock_data_t si_queued; /* pending */
+};
+
+void softint_init(struct softint *si, void (*func)(void *), void *data);
+bool softint_schedule(struct softint *si);
+bool softint_run(bool lowerspl);
+bool softint_active(void);
+void softint_handoff(void);
+
+
+#endif /* _SOFTINT_H_ */
@@ -39,12 +39,15 @@
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
-#define SPINLOCK_INLINE INLINE
+#define SPINLOCK_INLINE INLINE __FORCEINLINE
 #endif
 
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/* Deadlock detection and lock statistics. */
+#include <hangman.h>
+
 /*
  * Basic spinlock.
  *
@@ -53,16 +56,27 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * These are ticket locks: each CPU that wants the lock takes the next
+ * number from splk_next and waits until splk_owner reaches it, so the
+ * lock is handed out in arrival order. The counters are updated by
+ * the holder, so they need no atomics of their own.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_owner; /* Ticket allowed in now. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	unsigned splk_contended;	    /* Acquires that had to wait. */
+	unsigned splk_spins;		    /* Backoff rounds spent waiting. */
+	HANGMAN_LOCKABLE(splk_hangman);	    /* Deadlock detector hook. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, \
+	  HANGMAN_LOCKABLE_INITIALIZER }
 
 /*
  * Spinlock functions.
@@ -71,18 +85,32 @@ struct spinlock {
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * tryacquire	Get the lock only if it's free; returns true if it was.
+ *		Disables interrupts only if so.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the most contended locks (by address; look them
+ *		up in the kernel's symbol table) and their counters.
+ * resetstats	Zero the counters and forget the locks.
+ *
+ * kstat	Add totals over the contended locks to a kstat snapshot.
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(void);
+void spinlock_resetstats(void);
+struct kstat;
+void spinlock_kstat(struct kstat *ks);
+
 
 #endif /* _SPINLOCK_H_ */
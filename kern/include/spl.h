@@ -34,7 +34,7 @@
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPL_INLINE
-#define SPL_INLINE INLINE
+#define SPL_INLINE INLINE __FORCEINLINE
 #endif
 
 /*
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap: backing store for user pages that have been paged out.
+ *
+ * The swap device is divided into page-sized slots, allocated with a
+ * bitmap. A dedicated pageout thread evicts pages (chosen by the
+ * coremap's clock algorithm) when free memory runs low, writing
+ * clusters of pages to consecutive slots; a thread that can't get a
+ * page at all evicts one itself.
+ *
+ * Functions:
+ *
+ *    swap_bootstrap - attach SWAP_DEVICE and start the pageout
+ *                thread. If there's no such device, the system runs
+ *                without swap.
+ *
+ *    swap_evict - page out one page. Returns ENOMEM if nothing can
+ *                be evicted, ENOSPC if swap is full, or an I/O error.
+ *
+ *    swap_pagein - read slot SLOT into the (pinned) page PA and free
+ *                the slot. If READAHEAD, also reads in any following
+ *                slots that hold pages of AS, updating AS's page
+ *                table. Must be called by AS's own thread.
+ *
+ *    swap_free - release slot SLOT.
+ *
+ *    swap_dup - copy slot SLOT to a new slot, returned in NEWSLOT.
+ *
+ *    swap_printstats - print swap usage.
+ *
+ *    swap_kstat - add swap usage to a kstat snapshot.
+ */
+
+#define SWAP_DEVICE "lhd1"
+
+struct addrspace;
+struct kstat;
+
+void swap_bootstrap(void);
+int swap_evict(void);
+int swap_pagein(struct addrspace *as, unsigned slot, paddr_t pa,
+		bool readahead);
+void swap_free(unsigned slot);
+int swap_dup(unsigned slot, unsigned *newslot);
+void swap_printstats(void);
+void swap_kstat(struct kstat *ks);
+
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <wchan.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -62,6 +63,20 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * sem_timedP: P, but give up after NSECS nanoseconds. Returns 0 once
+ * the count has been decremented, or ETIMEDOUT (leaving the count
+ * alone) if the time ran out first.
+ */
+int sem_timedP(struct semaphore *, uint64_t nsecs);
+
+/*
+ * V_handoff: V, and have the thread woken, if any, run next: on this
+ * cpu right away if possible. For completions someone is waiting on;
+ * may be called from an interrupt handler.
+ */
+void V_handoff(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -78,6 +93,11 @@ struct lock {
 	struct wchan *lock_wchan;	//lock wchan and spinlock. Usage adapted from semaphore
 	struct spinlock lock_lock;	
 	volatile struct thread *curr_user; //the thread currently using the lock
+	struct cpu *volatile lk_ownercpu;	/* CPU curr_user took it on */
+	volatile unsigned lk_waiters;		/* asleep on lock_wchan */
+	unsigned lk_waitprio;			/* best waiter's priority */
+	bool lk_lent;				/* ...lent to curr_user */
+	HANGMAN_LOCKABLE(lk_hangman);		/* deadlock detector hook */
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -88,7 +108,13 @@ void lock_destroy(struct lock *);
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. If it's held by a thread that's running
+ *                   on another CPU, spin for a while first in the hope
+ *                   that it's let go soon; otherwise sleep. A
+ *                   thread that sleeps lends the holder its
+ *                   priority until the holder lets go, so the
+ *                   holder isn't kept off the CPU by threads that
+ *                   rank between them (priority inheritance).
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -119,6 +145,8 @@ struct cv {
         char *cv_name;
 	struct wchan *control_wchan;
 	struct spinlock control_spinlock;
+	unsigned cv_waiters;		/* in cv_wait, not yet moved */
+	struct lock *cv_lock;		/* lock they all passed, or NULL */
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -130,9 +158,18 @@ void cv_destroy(struct cv *);
  * Operations:
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
+ *    cv_timedwait - Like cv_wait, but give up waiting after NSECS
+ *                   nanoseconds. Returns 0 if woken, ETIMEDOUT if not;
+ *                   the lock is re-acquired either way.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
+ * As the waiters can't go on until the signaller lets go of the lock,
+ * cv_signal and cv_broadcast move them straight to the lock's queue
+ * instead of waking them (wait morphing), and lock_release then wakes
+ * them one at a time. That's done only while every waiter passed the
+ * same lock as the signaller; otherwise they're just woken.
+ *
  * For all three operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
@@ -140,8 +177,98 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, uint64_t nsecs);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * cv_signal_handoff: cv_signal, but the thread woken goes at the head
+ * of the run queue, on this cpu if it may run here, so it runs as soon
+ * as this one releases the lock and blocks.
+ */
+void cv_signal_handoff(struct cv *cv, struct lock *lock);
+
+
+/*
+ * Completion: a one-shot event to wait for, such as a thread exiting
+ * or an I/O request finishing. It's embedded in whatever it belongs
+ * to and needs no allocation, unlike a lock and CV or a semaphore.
+ *
+ * Operations:
+ *    completion_init    - Set up, not done. NAME isn't copied.
+ *    completion_cleanup - Clean up. Nobody may be waiting.
+ *    completion_reinit  - Make it not done again, to reuse it.
+ *    complete           - Mark done and wake everyone waiting. May be
+ *                         called from an interrupt handler.
+ *    wait_for_completion - Sleep until done; return at once if it is.
+ *    wait_for_completion_timeout - Likewise, but give up after NSECS
+ *                         nanoseconds. Returns 0 if done, ETIMEDOUT if
+ *                         not.
+ *    completion_done    - Check if done, without waiting.
+ *
+ * Once a wait has returned, complete() is finished with the
+ * completion, so a waiter may free it; that isn't so after only
+ * seeing completion_done.
+ */
+struct completion {
+	struct spinlock cm_lock;
+	struct wchan cm_wchan;
+	volatile bool cm_done;
+};
+
+void completion_init(struct completion *cm, const char *name);
+void completion_cleanup(struct completion *cm);
+void completion_reinit(struct completion *cm);
+void complete(struct completion *cm);
+void wait_for_completion(struct completion *cm);
+int wait_for_completion_timeout(struct completion *cm, uint64_t nsecs);
+bool completion_done(struct completion *cm);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, readers arriving
+ * after it wait too. But it's fair to readers as well: each writer
+ * that lets go first admits every reader that was waiting, so a
+ * reader never waits behind more than one writer.
+ *
+ * rwl_gen counts the writer releases that admitted readers; a waiting
+ * reader whose generation has passed holds one of the rwl_readpass
+ * passes and gets in ahead of any writer.
+ */
+struct rwlock {
+	char *rwl_name;
+	struct wchan *rwl_rwchan;	/* readers wait here */
+	struct wchan *rwl_wwchan;	/* writers wait here */
+	struct spinlock rwl_lock;	/* protects everything */
+	unsigned rwl_readers;		/* readers holding it */
+	struct thread *rwl_writer;	/* writer holding it, or NULL */
+	unsigned rwl_rwaiting;		/* readers waiting */
+	unsigned rwl_wwaiting;		/* writers waiting */
+	unsigned rwl_gen;		/* writer-release generation */
+	unsigned rwl_readpass;		/* admitted readers yet to enter */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared.
+ *    rwlock_release_read  - Let go of a shared hold.
+ *    rwlock_acquire_write - Get the lock exclusive.
+ *    rwlock_release_write - Let go of an exclusive hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock exclusive. (Readers aren't tracked, so
+ *                   there's no equivalent for them.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
 
 #endif /* _SYNCH_H_ */
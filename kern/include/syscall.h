@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct addrspace; /* from <addrspace.h> */
 
 /*
  * The system call dispatcher.
@@ -44,20 +45,112 @@ void syscall(struct trapframe *tf);
  * Support functions.
  */
 
-/* Helper for fork(). You write this. */
-void enter_forked_process(struct trapframe *tf);
+/* Go to user mode in a newly forked child. Does not return. */
+__DEAD void enter_forked_process(struct trapframe *tf);
+
+/* Go to user mode in a new thread from lwp_create. Does not return. */
+__DEAD void enter_new_thread(struct trapframe *tf);
 
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
+/* Per-call counts and latency histograms, for the menu and kstat. */
+struct kstat;
+void syscall_printstats(void);
+void syscall_resetstats(void);
+void syscall_kstat(struct kstat *ks);
+
+/*
+ * Argument vectors for execv and runprogram, gathered into one kernel
+ * buffer and copied out to the new user stack in one go.
+ */
+struct argbuf {
+	char *ab_buf;		/* the strings, back to back */
+	size_t ab_size;		/* allocated size of ab_buf */
+	size_t ab_len;		/* bytes of ab_buf in use */
+	int ab_argc;		/* number of strings */
+};
+
+void argbuf_init(struct argbuf *ab);
+int argbuf_fromuser(struct argbuf *ab, const_userptr_t uargv);
+int argbuf_fromkernel(struct argbuf *ab, int argc, char **argv);
+int argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *uargv);
+void argbuf_cleanup(struct argbuf *ab);
+
+/* Set up the futex wait queues. */
+void futex_bootstrap(void);
+
+/* Futex wakeups from inside the kernel (thread exit, proc_single). */
+int futex_wakeaddr(struct addrspace *as, userptr_t uaddr, int n);
+void futex_wakeall(struct addrspace *as);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
  */
 
 int sys_reboot(int code);
+int sys_fork(struct trapframe *tf, int32_t *retval);
+int sys_vfork(struct trapframe *tf, int32_t *retval);
+int sys_getpid(int32_t *retval);
+int sys_getppid(int32_t *retval);
+int sys_waitpid(pid_t pid, userptr_t user_status, int flags,
+		int32_t *retval);
+int sys_execv(const_userptr_t user_prog, const_userptr_t user_argv);
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(size_t len, int prot, int flags, int fd, off_t pos,
+	     int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec);
+int sys_mlock(userptr_t addr, size_t len);
+int sys_munlock(userptr_t addr, size_t len);
+int sys_open(const_userptr_t user_path, int flags, mode_t mode,
+	     int32_t *retval);
+int sys_dup2(int oldfd, int newfd, int32_t *retval);
+int sys_pipe(userptr_t user_fds);
+int sys_close(int fd);
+int sys_read(int fd, userptr_t buf, size_t len, int32_t *retval);
+int sys_write(int fd, userptr_t buf, size_t len, int32_t *retval);
+int sys_pread(int fd, userptr_t buf, size_t len, off_t pos, int32_t *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t len, off_t pos,
+	       int32_t *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int32_t *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int32_t *retval);
+int sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+	       int32_t *retval);
+int sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+		int32_t *retval);
+int sys_copyfile(int fromfd, int tofd, size_t len, int32_t *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_fstat(int fd, userptr_t user_statbuf);
+int sys_getdirentry(int fd, userptr_t buf, size_t len, int32_t *retval);
+int sys_getdirentries(int fd, userptr_t buf, size_t len, int32_t *retval);
+int sys_ioctl(int fd, int code, userptr_t data);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys___timepage(int32_t *retval);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
+int sys_getrusage(int who, userptr_t user_usage);
+int sys_getpriority(int which, int who, int32_t *retval);
+int sys_setpriority(int which, int who, int prio);
+int sys_setaffinity(pid_t pid, uint32_t mask);
+int sys_uprof(int op, userptr_t buf, size_t len, int32_t *retval);
+int sys_getaffinity(pid_t pid, userptr_t user_mask);
+int sys_futex_wait(userptr_t uaddr, int val, const_userptr_t user_timeout);
+int sys_futex_wake(userptr_t uaddr, int n, int32_t *retval);
+int sys_lwp_create(struct trapframe *tf, int32_t *retval);
+__DEAD void sys_lwp_exit(void);
+int sys_socket(int domain, int type, int protocol, int32_t *retval);
+int sys_bind(int fd, const_userptr_t user_addr, socklen_t len);
+int sys_connect(int fd, const_userptr_t user_addr, socklen_t len);
+int sys_getsockname(int fd, userptr_t user_addr, userptr_t user_len);
+int sys_sendto(int fd, const_userptr_t buf, size_t len, int flags,
+	       const_userptr_t user_addr, socklen_t addrlen,
+	       int32_t *retval);
+int sys_recvfrom(int fd, userptr_t buf, size_t len, int flags,
+		 userptr_t user_addr, userptr_t user_addrlen,
+		 int32_t *retval);
 void sys__exit(int code);
 
 #endif /* _SYSCALL_H_ */
@@ -47,6 +47,10 @@ int airballoon(int, char **);
 /* data structure tests */
 int arraytest(int, char **);
 int arraytest2(int, char **);
+int vectortest(int, char **);
+int listtest(int, char **);
+int hashtest(int, char **);
+int hashtest2(int, char **);
 int bitmaptest(int, char **);
 int threadlisttest(int, char **);
 
@@ -59,6 +63,14 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int cmtest(int, char **);
+int wqtest(int, char **);
+int rcutest(int, char **);
+int pcputest(int, char **);
+int fsharetest(int, char **);
+int kbench(int, char **);
+int ipitest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -83,9 +95,13 @@ int semu19(int, char **);
 int semu20(int, char **);
 int semu21(int, char **);
 int semu22(int, char **);
+int semu23(int, char **);
+int semu24(int, char **);
+int semu25(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
+int fsbench(int, char **);
 int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
@@ -98,10 +114,13 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int memtest(int, char **);
+int membench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
-int runprogram(char *progname);
+int runprogram(const char *progname, int argc, char **argv);
 
 /* Kernel menu system. */
 void menu(char *argstr);
@@ -109,5 +128,8 @@ void menu(char *argstr);
 /* The main function, called from start.S. */
 void kmain(char *bootstring);
 
+/* Print how long each phase of boot took. */
+void boot_printphases(void);
+
 
 #endif /* _TEST_H_ */
@@ -36,9 +36,12 @@
  * Note: curthread is defined by <current.h>.
  */
 
+#include <cdefs.h>
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <synch.h>
+#include <machine/vm.h>	/* for CACHELINE_SIZE */
 
 struct cpu;
 
@@ -64,6 +67,22 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Resource usage, for getrusage. Times are in nanoseconds. Each
+ * thread counts its own, and they add up in its process when it
+ * leaves (see proc_remthread).
+ */
+struct usage {
+	uint64_t u_utime;		/* time in user mode */
+	uint64_t u_stime;		/* time in the kernel */
+	uint32_t u_minflt;		/* faults not needing I/O */
+	uint32_t u_majflt;		/* faults that read from swap */
+	uint32_t u_inblock;		/* blocks read from disk */
+	uint32_t u_oublock;		/* blocks written to disk */
+	uint32_t u_nvcsw;		/* switches from sleeping */
+	uint32_t u_nivcsw;		/* switches from preemption */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -71,18 +90,37 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[16];		/* t_name, if it fits */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	bool t_wchan_moved;		/* Last sleep was wchan_transfer'd */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
 	 * Thread subsystem internal fields.
 	 */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
-	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
-	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	userptr_t t_lwpdone;		/* user word to zero at exit */
+	uint32_t t_affinity;		/* CPUs allowed, bit per c_number */
+
+	/*
+	 * Scheduling fields. Other cpus write these too, under t_cpu's
+	 * run queue lock, when they queue, wake, or steal the thread, or
+	 * its neighbors on a run queue; so they start a cache line, away
+	 * from the interrupt state the running thread keeps updating.
+	 */
+	struct threadlistnode t_listnode /* Link for run/sleep/zombie lists */
+		__aligned(CACHELINE_SIZE);
+	struct cpu *t_cpu;		/* CPU thread runs on */
+	unsigned t_prio;		/* Feedback level; 0 is highest */
+	unsigned t_runqueue;		/* Run queue index while S_READY */
+	unsigned t_inherit;		/* Best run queue lent, or NPRIO */
+	unsigned t_loans;		/* Loans not yet given back */
+	unsigned t_ticks;		/* Hardclocks run at this priority */
+	unsigned t_readyclock;		/* t_cpu's c_hardclocks when queued */
+	uint64_t t_waketime;		/* clock_now() if woken by an irq */
 
 	/*
 	 * Interrupt state fields.
@@ -97,22 +135,29 @@ struct thread {
 	 * Exercise for the student: why is this material per-thread
 	 * rather than per-cpu or global?
 	 */
-	bool t_in_interrupt;		/* Are we in an interrupt? */
+	bool t_in_interrupt		/* Are we in an interrupt? */
+		__aligned(CACHELINE_SIZE);
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
+	unsigned t_rcu_nest;		/* rcu_read_lock depth (see rcu.h) */
+
+	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
 	/*
 	 * Public fields
 	 */
 
+	/* Accounting; only the thread itself updates these */
+	struct usage t_usage;		/* what it has used so far */
+	uint64_t t_usagestamp;		/* clock_now() as last charged */
+
 	/* VFS */
 	bool t_did_reserve_buffers;	/* reserve_buffers() in effect */
+	bool t_dirtied_buffers;		/* ...and buffers were dirtied */
+	bool t_reclaiming;		/* in reclaim_run() */
 
 	/* add more here as needed */
-	bool complete;	//set when child is terminating, checked by parent
-	struct lock *t_lock;	//to protect
-	struct wchan *t_wchan;	//parent to sleep and wait
-	struct cv *t_cv;	//cv for parent to be waken up when child terminates
+	struct completion t_done;	/* for thread_join: we've exited */
 };
 
 /*
@@ -157,6 +202,29 @@ int thread_join(struct thread *child);
  */
 __DEAD void thread_exit(void);
 
+/*
+ * CPU affinity of the current thread: bit N of the mask allows cpu
+ * number N. New threads inherit their creator's. Setting a mask that
+ * names no existing cpu fails with EINVAL. If the current cpu is no
+ * longer allowed, the thread moves the next time it yields to other
+ * work here. A cpu always has some thread on it, so until there is
+ * other work the thread stays put.
+ */
+#define THREAD_AFFINITY_ALL	0xffffffffU
+int thread_setaffinity(uint32_t mask);
+uint32_t thread_getaffinity(void);
+
+/*
+ * Charge the time since the current thread was last charged to user
+ * time if USER, or else to system time. Called on each trap from user
+ * mode (USER) and on the way back (not USER); thread_switch charges
+ * system time itself.
+ */
+void thread_charge(bool user);
+
+/* Add the counts in FROM to TO. */
+void usage_add(struct usage *to, const struct usage *from);
+
 /*
  * Cause the current thread to yield to the next runnable thread, but
  * itself stay runnable.
@@ -165,15 +233,65 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Preemption. A wakeup that queues a thread of higher priority than
+ * the one running on its cpu sets that cpu's c_needresched (with an
+ * IPI if it's another cpu), and the running thread gives way at the
+ * next safe point rather than at the end of its quantum:
+ *
+ *    thread_preempt_point - yield if c_needresched is set and this
+ *                           is a safe point: not in an interrupt or
+ *                           an RCU reader, no spinlock held, spl 0.
+ *                           spinlock_release calls it when the last
+ *                           spinlock goes, so long loops at spl 0
+ *                           need not; code that has held preemption
+ *                           off for a while may call it any time.
+ *
+ *    thread_preempt_irq   - the same on the way out of an interrupt
+ *                           that came in at spl 0. For the trap code.
+ *
+ * Interrupt-to-run latency, from a wakeup in an interrupt handler to
+ * the woken thread getting its cpu, is measured for each such wakeup;
+ * thread_printlatency shows the worst case and the average.
  */
-void schedule(void);
+void thread_preempt_point(void);
+void thread_preempt_irq(void);
+void thread_printlatency(void);
+void thread_resetlatency(void);
+
+/*
+ * Priority inheritance, for sleep locks (see synch.c). A priority is
+ * a run queue index, so lower is better, and SCHED_NPRIO is none.
+ * A thread that has been lent priorities runs at the best of its own
+ * and those until it has given back every loan; a loan given back
+ * while others are outstanding doesn't lower it.
+ *
+ *    thread_getpriority   - the current thread's priority, including
+ *                           anything lent to it.
+ *
+ *    thread_lend_priority - lend thread T priority PRIO, as a new loan
+ *                           if NEWLOAN, else improving an existing one.
+ *                           T must be kept from exiting, e.g. by its
+ *                           holding a lock whose spinlock is held.
+ *
+ *    thread_unlend_priority - give back one of the current thread's
+ *                           loans.
+ */
+unsigned thread_getpriority(void);
+void thread_lend_priority(struct thread *t, unsigned prio, bool newloan);
+void thread_unlend_priority(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a hardclock, and yield if it has used
+ * up its quantum or a higher-priority thread is waiting. Called from
+ * the timer interrupt.
  */
-void thread_consider_migration(void);
+void thread_tick(void);
+
+/*
+ * Boost every thread to the top priority, so none starve. Called
+ * from the timer interrupt.
+ */
+void schedule(void);
 
 
 #endif /* _THREAD_H_ */
@@ -45,6 +45,7 @@ struct uio;    /* kernel or userspace I/O buffer (uio.h) */
 struct device; /* abstract structure for a device (dev.h) */
 struct fs;     /* abstract structure for a filesystem (fs.h) */
 struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
+struct kstat;  /* counter snapshot for /dev/kstat (kstat.h) */
 
 /*
  * VFS layer low-level operations.
@@ -56,7 +57,11 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_getcurdir - retrieve vnode of current directory of current thread
  *    vfs_sync      - force all dirty buffers to disk
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
+ *    vfs_getrootn  - same, for a DEVNAME of LEN bytes not necessarily
+ *                    followed by a null
  *    vfs_getdevname - get mounted device name for the filesystem passed in
+ *    vfs_kstat     - add the name cache's and every mounted filesystem's
+ *                    counters to a kstat snapshot
  */
 
 int vfs_setcurdir(struct vnode *dir);
@@ -64,7 +69,9 @@ int vfs_clearcurdir(void);
 int vfs_getcurdir(struct vnode **retdir);
 int vfs_sync(void);
 int vfs_getroot(const char *devname, struct vnode **result);
+int vfs_getrootn(const char *devname, size_t len, struct vnode **result);
 const char *vfs_getdevname(struct fs *fs);
+void vfs_kstat(struct kstat *ks);
 
 /*
  * VFS layer mid-level operations.
@@ -74,16 +81,43 @@ const char *vfs_getdevname(struct fs *fs);
  *                     goes to the correct filesystem.
  *    vfs_lookparent - Likewise, for VOP_LOOKPARENT.
  *
- * Both of these may destroy the path passed in.
+ * Neither modifies the path passed in; components are handed down to
+ * the filesystem in place rather than copied or cut out.
  */
 
-int vfs_lookup(char *path, struct vnode **result);
-int vfs_lookparent(char *path, struct vnode **result,
+int vfs_lookup(const char *path, struct vnode **result);
+int vfs_lookparent(const char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * VFS directory name cache (vfsnamecache.c), for use by filesystems
+ * in their lookup code. Entries do not hold vnode references; a
+ * filesystem using the cache must purge a vnode before reclaiming it.
+ *
+ *    vfs_ncache_lookup  - Look up NAME in DIR. Returns true on a hit,
+ *                         with *RESULT a new reference, or NULL if the
+ *                         name is known not to exist.
+ *    vfs_ncache_enter   - Record the result of a lookup (VN may be
+ *                         NULL). Call holding DIR's lock.
+ *    vfs_ncache_purge   - Forget NAME in DIR. Call after changing the
+ *                         entry, still holding DIR's lock.
+ *    vfs_ncache_purge_vnode - Forget all entries for or in VN.
+ *    vfs_ncache_printstats  - Print hit/miss counts.
+ *    vfs_ncache_kstat   - Add them to a kstat snapshot.
+ */
+
+void vfs_ncache_bootstrap(void);
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **result);
+void vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_ncache_purge(struct vnode *dir, const char *name);
+void vfs_ncache_purge_vnode(struct vnode *vn);
+void vfs_ncache_printstats(void);
+void vfs_ncache_kstat(struct kstat *ks);
+
 /*
  * VFS layer high-level operations on pathnames
- * Because lookup may destroy pathnames, these all may too.
+ * Like lookup, these leave the pathnames passed in alone.
  *
  *    vfs_open         - Open or create a file. FLAGS/MODE per the syscall.
  *    vfs_readlink     - Read contents of a symlink into a uio.
@@ -101,17 +135,18 @@ int vfs_lookparent(char *path, struct vnode **result,
  *                 (See vfspath.c for a discussion of why.)
  */
 
-int vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret);
+int vfs_open(const char *path, int openflags, mode_t mode,
+	     struct vnode **ret);
 void vfs_close(struct vnode *vn);
-int vfs_readlink(char *path, struct uio *data);
-int vfs_symlink(const char *contents, char *path);
-int vfs_mkdir(char *path, mode_t mode);
-int vfs_link(char *oldpath, char *newpath);
-int vfs_remove(char *path);
-int vfs_rmdir(char *path);
-int vfs_rename(char *oldpath, char *newpath);
-
-int vfs_chdir(char *path);
+int vfs_readlink(const char *path, struct uio *data);
+int vfs_symlink(const char *contents, const char *path);
+int vfs_mkdir(const char *path, mode_t mode);
+int vfs_link(const char *oldpath, const char *newpath);
+int vfs_remove(const char *path);
+int vfs_rmdir(const char *path);
+int vfs_rename(const char *oldpath, const char *newpath);
+
+int vfs_chdir(const char *path);
 int vfs_getcwd(struct uio *buf);
 
 /*
@@ -130,6 +165,15 @@ int vfs_getcwd(struct uio *buf);
  *                    name or volume name for the filesystem (such as
  *                    "lhd0:") but need not have the trailing colon.
  *
+ *    vfs_deferbootfs - Like vfs_setbootfs, but don't look the name
+ *                    up until the first path beginning with a slash
+ *                    (or the first use of the kernel's current
+ *                    directory) needs it. Failure is silent then;
+ *                    such paths get ENOENT. Also sets the kernel
+ *                    process's current directory if it has none.
+ *
+ *    vfs_bindbootfs - Resolve a deferred bootfs now, if there is one.
+ *
  *    vfs_clearbootfs - Clear the bootfs filesystem. This should be
  *                    done during shutdown so that the filesystem in
  *                    question can be unmounted.
@@ -160,6 +204,13 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_unmount   - Unmount the filesystem presently mounted on the
  *                    specified device.
  *
+ *    vfs_setiosched - Choose the I/O scheduler policy, by name, for
+ *                    the mountable device DEVNAME.
+ *
+ *    vfs_setbufshare - Give the filesystem mounted on DEVNAME a
+ *                    minimum and maximum share of the buffer cache,
+ *                    in percent (see buffer_set_fs_share).
+ *
  *    vfs_swapon    - Look up DEVNAME and mark it as a swap device,
  *                    returning a vnode. Similar to vfs_mount.
  *
@@ -167,6 +218,12 @@ int vfs_getcwd(struct uio *buf);
  *                    previously returned by vfs_swapon should be
  *                    decref'd first. Similar to vfs_unmount.
  *
+ *    vfs_claimdev  - Look up the mountable device DEVNAME and mark it
+ *                    as in use by another device, e.g. a RAID. It
+ *                    can then no longer be mounted or swapped on.
+ *
+ *    vfs_unclaimdev - Release a device claimed with vfs_claimdev.
+ *
  *    vfs_unmountall - Unmount all mounted filesystems.
  */
 
@@ -174,6 +231,8 @@ void vfs_bootstrap(void);
 
 void vfs_initbootfs(void);
 int vfs_setbootfs(const char *fsname);
+void vfs_deferbootfs(const char *fsname);
+void vfs_bindbootfs(void);
 void vfs_clearbootfs(void);
 
 int vfs_adddev(const char *devname, struct device *dev, int mountable);
@@ -184,10 +243,26 @@ int vfs_mount(const char *devname, void *data,
 			       struct device *dev,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
+int vfs_setiosched(const char *devname, const char *policy);
+int vfs_setbufshare(const char *devname, unsigned minpct, unsigned maxpct);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
+int vfs_claimdev(const char *devname, struct device **result);
+void vfs_unclaimdev(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Pipes (pipe.c).
+ *
+ *    pipe_create   - Make a pipe, handing back vnodes for its read and
+ *                    write ends. An end is closed when the last
+ *                    reference to its vnode goes away: reading then
+ *                    gets EOF once the data runs out, and writing
+ *                    fails with EPIPE.
+ */
+
+int pipe_create(struct vnode **rret, struct vnode **wret);
+
 /*
  * Array of vnodes.
  */
@@ -56,7 +56,46 @@ vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Drop translations for NPAGES pages at VADDR of AS, or for all of
+ * AS, on every CPU that might hold them, including this one. Each
+ * other CPU gets at most one IPI per call. Returns once all the CPUs
+ * are done; don't call with spinlocks held. Not provided by dumbvm.
+ */
+struct addrspace;
+void vm_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+void vm_shootdown_all(struct addrspace *as);
+
+/*
+ * Pin the page holding user address VADDR of AS, which needn't be the
+ * current address space, so the kernel can get at it through its
+ * physical address. Fails (returns false) unless the page is resident
+ * and, if WRITE, privately writeable; the caller should then fall
+ * back to the usual copyin/copyout from AS itself. Unpin with
+ * vm_unpinuser. dumbvm always fails.
+ */
+bool vm_pinuser(struct addrspace *as, vaddr_t vaddr, bool write,
+		paddr_t *ret);
+void vm_unpinuser(paddr_t pa);
+
+/*
+ * Bring page VADDR of AS, the current address space, into memory as
+ * if it had been read, and hand back its page pinned. Call with AS's
+ * lock held; the page must be in a region other than the time page's.
+ * Not provided by dumbvm.
+ */
+int vm_pagein(struct addrspace *as, vaddr_t vaddr, paddr_t *ret);
+
+/*
+ * For the pageout clock: clear the referenced bit of page VADDR of
+ * AS, which is the pinned page PA, and shoot down its translations,
+ * so the next touch goes through vm_fault and marks the page used
+ * again. Don't call with spinlocks held. Not provided by dumbvm.
+ */
+void vm_unreference(struct addrspace *as, vaddr_t vaddr, paddr_t pa);
+
 
 #endif /* _VM_H_ */
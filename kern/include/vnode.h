@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct pcpage;
 
 
 /*
@@ -49,14 +50,17 @@ struct stat;
  * Note: vn_fs may be null if the vnode refers to a device.
  */
 struct vnode {
-	int vn_refcount;                /* Reference count */
-	struct spinlock vn_countlock;   /* Lock for vn_refcount */
+	volatile unsigned vn_refcount;  /* Reference count (atomic.h) */
+	struct spinlock vn_countlock;   /* Lock for vn_elf */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct pcpage *vn_pcpages;      /* Cached pages (see pagecache.h) */
+	struct elfinfo *vn_elf;         /* Cached ELF headers (loadelf.c) */
 };
 
 /*
@@ -98,6 +102,17 @@ struct vnode {
  *                      handled in the normal fashion.
  *                      On non-directory objects, return ENOTDIR.
  *
+ *    vop_getdirentries - Like vop_getdirentry, but fill the uio with as
+ *                      many packed struct dirent records (see
+ *                      kern/dirent.h) as fit, starting at the entry
+ *                      named by the offset field. Return EINVAL if not
+ *                      even one record fits; at the end of the
+ *                      directory, transfer nothing. Filesystems without
+ *                      anything better to do may use
+ *                      vnode_getdirentries_generic, which is built on
+ *                      vop_getdirentry.
+ *                      On non-directory objects, return ENOTDIR.
+ *
  *    vop_write       - Write data from uio to file at offset specified
  *                      in the uio, updating uio_resid to reflect the
  *                      amount written, and updating uio_offset to match.
@@ -120,13 +135,23 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory. Mapped pages are read with vop_read
+ *                      through the page cache (see pagecache.h), so
+ *                      there's nothing else for the file to do.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_seekhole    - For lseek's SEEK_DATA and SEEK_HOLE (WHENCE):
+ *                      hand back the offset of the first data or hole
+ *                      at or after POS. The end of the file counts as
+ *                      a hole. Fails with ENXIO if POS is not within
+ *                      the file, or for SEEK_DATA if there is no more
+ *                      data. Files that don't track holes may use
+ *                      vnode_seekhole_generic, which calls the whole
+ *                      file data.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
@@ -163,16 +188,16 @@ struct vnode {
  *
  *    vop_lookup      - Parse PATHNAME relative to the passed directory
  *                      DIR, and hand back the vnode for the file it
- *                      refers to. May destroy PATHNAME. Should increment
- *                      refcount on vnode handed back.
+ *                      refers to. Does not modify PATHNAME. Should
+ *                      increment refcount on vnode handed back.
  *
  *    vop_lookparent  - Parse PATHNAME relative to the passed directory
  *                      DIR, and hand back (1) the vnode for the
  *                      parent directory of the file it refers to, and
  *                      (2) the last component of the filename, copied
- *                      into kernel buffer BUF with max length LEN. May
- *                      destroy PATHNAME. Should increment refcount on
- *                      vnode handed back.
+ *                      into kernel buffer BUF with max length LEN. Does
+ *                      not modify PATHNAME. Should increment refcount
+ *                      on vnode handed back.
  */
 
 #define VOP_MAGIC	0xa2b3c4d5
@@ -187,14 +212,17 @@ struct vnode_ops {
 	int (*vop_read)(struct vnode *file, struct uio *uio);
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
+	int (*vop_getdirentries)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	bool (*vop_isseekable)(struct vnode *object);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_seekhole)(struct vnode *file, int whence, off_t pos,
+			    off_t *result);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
 
@@ -217,9 +245,9 @@ struct vnode_ops {
 
 
 	int (*vop_lookup)(struct vnode *dir,
-			  char *pathname, struct vnode **result);
+			  const char *pathname, struct vnode **result);
 	int (*vop_lookparent)(struct vnode *dir,
-			      char *pathname, struct vnode **result,
+			      const char *pathname, struct vnode **result,
 			      char *buf, size_t len);
 };
 
@@ -231,14 +259,16 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
+#define VOP_GETDIRENTRIES(vn, uio)      (__VOP(vn,getdirentries)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn)                    (__VOP(vn, mmap)(vn))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_SEEKHOLE(vn, wh, pos, res)  (__VOP(vn, seekhole)(vn, wh, pos, res))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -259,9 +289,17 @@ void vnode_check(struct vnode *, const char *op);
 
 /*
  * Reference count manipulation (handled above filesystem level)
+ *
+ * The count is atomic, not locked. The last VOP_DECREF doesn't drop
+ * the count to zero but hands the reference to VOP_RECLAIM, which
+ * must call vnode_lastref while holding whatever lock keeps the
+ * filesystem from handing out new references (e.g. its vnode table
+ * lock). If someone took one since, vnode_lastref drops the reference
+ * it was passed and returns false, and reclaim returns EBUSY.
  */
 void vnode_incref(struct vnode *);
 void vnode_decref(struct vnode *);
+bool vnode_lastref(struct vnode *);
 
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
@@ -279,6 +317,36 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * Drop everything cached about the file's contents: its pages in the
+ * page cache and its parsed ELF headers. Filesystems call this when
+ * the file is written or truncated.
+ */
+void vnode_dropcaches(struct vnode *);
+
+/*
+ * Support for vop_getdirentries (intended for use by filesystem code).
+ *
+ *    vnode_putdirent - Append a struct dirent record for NAME to UIO.
+ *                      Returns ENOSPC, touching nothing, if the record
+ *                      doesn't fit. Does not update uio_offset in the
+ *                      way directories need; the caller must set it.
+ *
+ *    vnode_getdirentries_generic - vop_getdirentries implemented by
+ *                      calling vop_getdirentry repeatedly. The records
+ *                      have no inode number or type.
+ */
+int vnode_putdirent(struct uio *uio, uint32_t ino, unsigned type,
+		    const char *name, size_t namelen);
+int vnode_getdirentries_generic(struct vnode *dir, struct uio *uio);
+
+/*
+ * vop_seekhole for files with no holes: everything up to the size
+ * vop_stat reports is data.
+ */
+int vnode_seekhole_generic(struct vnode *file, int whence, off_t pos,
+			   off_t *result);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -286,10 +354,14 @@ int vopfail_uio_notdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_isdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_inval(struct vnode *vn, struct uio *uio);
 int vopfail_uio_nosys(struct vnode *vn, struct uio *uio);
-int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
-int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
-int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
+int vopfail_mmap_isdir(struct vnode *vn);
+int vopfail_mmap_perm(struct vnode *vn);
+int vopfail_mmap_nosys(struct vnode *vn);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopfail_seekhole_isdir(struct vnode *vn, int whence, off_t pos,
+			   off_t *result);
+int vopfail_seekhole_nosys(struct vnode *vn, int whence, off_t pos,
+			   off_t *result);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
@@ -308,8 +380,9 @@ int vopfail_rename_notdir(struct vnode *fromdir, const char *fromname,
 			  struct vnode *todir, const char *toname);
 int vopfail_rename_nosys(struct vnode *fromdir, const char *fromname,
 			 struct vnode *todir, const char *toname);
-int vopfail_lookup_notdir(struct vnode *vn, char *path, struct vnode **result);
-int vopfail_lookparent_notdir(struct vnode *vn, char *path,
+int vopfail_lookup_notdir(struct vnode *vn, const char *path,
+			  struct vnode **result);
+int vopfail_lookparent_notdir(struct vnode *vn, const char *path,
 			      struct vnode **result, char *buf, size_t len);
 
 
@@ -34,9 +34,19 @@
  * Wait channel.
  */
 
+#include <threadlist.h>
 
 struct spinlock; /* in spinlock.h */
-struct wchan; /* Opaque */
+
+/*
+ * A wchan is protected by an associated, passed-in spinlock. The
+ * structure is here only so it can be embedded (see wchan_init);
+ * use it through the functions below.
+ */
+struct wchan {
+	const char *wc_name;		/* name for this channel */
+	struct threadlist wc_threads;	/* list of waiting threads */
+};
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -45,6 +55,13 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Set up and clean up a wait channel embedded in something else, as
+ * wchan_create and wchan_destroy do for one of their own.
+ */
+void wchan_init(struct wchan *wc, const char *name);
+void wchan_cleanup(struct wchan *wc);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -66,6 +83,14 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up after NSECS nanoseconds. Returns 0 if
+ * awakened, or ETIMEDOUT if the time ran out first. Either way the
+ * lock is relocked upon return.
+ */
+int wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk,
+			uint64_t nsecs);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -76,5 +101,28 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_wakeone, but the thread woken, if any, is to run next:
+ * it's queued at the head of its run queue, on the current cpu if it
+ * may run there. Returns true if it was put on the current cpu; the
+ * caller may then thread_yield, after dropping its spinlocks, to run
+ * it right away.
+ */
+bool wchan_wakeone_handoff(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Move the first thread sleeping on FROM, or all of them if ALL, to
+ * the tail of TO, still asleep, so a later wakeup on TO wakes them.
+ * Both spinlocks must be locked, and FROMLK must come before TOLK
+ * in the lock order. Returns how many were moved.
+ *
+ * A thread can tell it was woken on the channel it was moved to
+ * with wchan_wasmoved, which describes the current thread's last
+ * wchan_sleep or wchan_sleep_timeout.
+ */
+unsigned wchan_transfer(struct wchan *from, struct spinlock *fromlk,
+			struct wchan *to, struct spinlock *tolk, bool all);
+bool wchan_wasmoved(void);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Work queues.
+ *
+ * A work queue runs deferred function calls ("work items") on a pool
+ * of kernel threads it owns, so background jobs don't each need a
+ * thread of their own. By default there is one worker per cpu, each
+ * with its own queue, and items run on a worker for the cpu they
+ * were queued from; a worker takes everything queued for it in one
+ * go and runs the batch. A WQ_ORDERED queue has a single worker, so
+ * its items run one at a time in the order they were queued.
+ *
+ * The caller provides the struct work, usually embedded in whatever
+ * the work is about, and must keep it around until it has run. An
+ * item can be queued again once it has started running, including
+ * by its own function; queueing it while it's still waiting does
+ * nothing. On a queue that isn't ordered a requeued item may then
+ * run on another cpu while the first run finishes.
+ *
+ * Work functions run in an ordinary thread and may sleep, but a
+ * sleeping item holds up the rest of its worker's queue.
+ *
+ * Functions:
+ *
+ *    work_init - set up a work item to call FUNC(DATA1, DATA2).
+ *
+ *    workqueue_create - make a work queue and start its workers.
+ *                NAME is used for the thread names. FLAGS is 0 or
+ *                WQ_ORDERED. Returns NULL if out of memory.
+ *
+ *    workqueue_destroy - run whatever is still queued, stop the
+ *                workers, and free the queue. Nothing may be queued
+ *                on it concurrently.
+ *
+ *    workqueue_enqueue - queue an item. Returns false if it was
+ *                already waiting. May be called from an interrupt
+ *                handler.
+ *
+ *    workqueue_flush - wait until everything queued before the call
+ *                has run.
+ *
+ * system_workqueue is a shared queue for anything that doesn't need
+ * one of its own; it exists from workqueue_bootstrap on.
+ */
+
+#include <spinlock.h>
+
+struct work {
+	void (*w_func)(void *data1, unsigned long data2);
+	void *w_data1;
+	unsigned long w_data2;
+	struct work *w_next;		/* on the queue */
+	volatile spinlock_data_t w_queued; /* waiting to run */
+};
+
+#define WQ_ORDERED	1	/* one worker, items in queue order */
+
+struct workqueue;
+
+void work_init(struct work *w, void (*func)(void *, unsigned long),
+	       void *data1, unsigned long data2);
+
+struct workqueue *workqueue_create(const char *name, unsigned flags);
+void workqueue_destroy(struct workqueue *wq);
+bool workqueue_enqueue(struct workqueue *wq, struct work *w);
+void workqueue_flush(struct workqueue *wq);
+
+extern struct workqueue *system_workqueue;
+
+/* Call once during system startup, after the cpus are started. */
+void workqueue_bootstrap(void);
+
+
+#endif /* _WORKQUEUE_H_ */
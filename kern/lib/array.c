@@ -121,6 +121,33 @@ array_setsize(struct array *a, unsigned num)
 	return 0;
 }
 
+/*
+ * Out-of-line growth for vectors (see array.h). Uses the same
+ * doubling rule as array_preallocate.
+ */
+void *
+vector_grow(void *v, size_t elsize, unsigned num,
+	    unsigned *maxp, unsigned need)
+{
+	void *newv;
+	unsigned newmax;
+
+	newmax = *maxp;
+	while (need > newmax) {
+		newmax = newmax ? newmax*2 : 4;
+	}
+	newv = kmalloc(newmax*elsize);
+	if (newv == NULL) {
+		return NULL;
+	}
+	if (num > 0) {
+		memcpy(newv, v, num*elsize);
+	}
+	kfree(v);
+	*maxp = newmax;
+	return newv;
+}
+
 void
 array_remove(struct array *a, unsigned index)
 {
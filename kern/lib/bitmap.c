@@ -41,15 +41,34 @@
  * or unsigned long as the base type for holding bits. But we don't,
  * because if one uses any data type more than a single byte wide,
  * bitmap data saved on disk becomes endian-dependent, which is a
- * severe nuisance.
+ * severe nuisance. (Searches still skip full words four at a time;
+ * whether a 32-bit chunk is all ones doesn't depend on byte order.)
  */
 #define BITS_PER_WORD   (CHAR_BIT)
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * So allocation doesn't have to walk the whole map, the bits are
+ * divided into groups of BITMAP_GROUPBITS and we keep a count of the
+ * clear bits in each; searches skip groups with none without looking
+ * at them, so for a large map they look at the counts and then at
+ * most a group or two of bits. Also, every bit below HINT is known
+ * to be set, so bitmap_alloc starts there.
+ *
+ * These exist only in memory. Code that changes the bits directly
+ * through bitmap_getdata (e.g. by reading them from disk) must call
+ * bitmap_recount afterwards.
+ */
+#define BITMAP_GROUPBITS        4096
+#define BITMAP_GROUPWORDS       (BITMAP_GROUPBITS / BITS_PER_WORD)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned ngroups;
+        unsigned *groupfree;    /* clear bits in each group */
+        unsigned hint;          /* all bits below this are set */
 };
 
 
@@ -69,6 +88,13 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->ngroups = DIVROUNDUP(nbits, BITMAP_GROUPBITS);
+        b->groupfree = kmalloc(b->ngroups*sizeof(unsigned));
+        if (b->groupfree == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
@@ -86,6 +112,7 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        bitmap_recount(b);
         return b;
 }
 
@@ -95,29 +122,243 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+/*
+ * Index of the lowest set bit in a nonzero word, and of the lowest
+ * clear bit in a word that isn't full. MIPS-I has no count-leading-
+ * zeros instruction and the kernel doesn't link libgcc, so isolate
+ * the bit and look it up with a de Bruijn multiply (as the scheduler
+ * does for its run queue bits) rather than using __builtin_ctz.
+ */
+static
+inline
+unsigned
+bitmap_ffs(uint32_t w)
+{
+        static const uint8_t debruijn[32] = {
+                0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+                31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+        };
+
+        KASSERT(w != 0);
+        return debruijn[((w & -w) * 0x077CB531U) >> 27];
+}
+
+static
+inline
+unsigned
+bitmap_ffz(WORD_TYPE w)
+{
+        KASSERT(w != WORD_ALLBITS);
+        return bitmap_ffs((WORD_TYPE)~w);
+}
+
+/*
+ * Number of set bits in a 32-bit chunk, counted in parallel. Which
+ * bytes of the map the chunk came from doesn't matter.
+ */
+static
+inline
+unsigned
+bitmap_popcount(uint32_t w)
+{
+        w = w - ((w >> 1) & 0x55555555);
+        w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+        w = (w + (w >> 4)) & 0x0f0f0f0f;
+        return (w * 0x01010101) >> 24;
+}
+
+/*
+ * Find the first word at or after word FROMIX, but before word TOIX,
+ * that isn't full. Returns TOIX if there isn't one.
+ */
+static
+unsigned
+bitmap_findword(struct bitmap *b, unsigned fromix, unsigned toix)
 {
         unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        ix = fromix;
+        /* one word at a time until 32-bit aligned */
+        while (ix < toix && ix % sizeof(uint32_t) != 0) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        return ix;
                 }
+                ix++;
         }
-        return ENOSPC;
+        /* then skip full chunks at once */
+        while (ix + sizeof(uint32_t) <= toix &&
+               *(uint32_t *)&b->v[ix] == 0xffffffff) {
+                ix += sizeof(uint32_t);
+        }
+        while (ix < toix && b->v[ix] == WORD_ALLBITS) {
+                ix++;
+        }
+        return ix;
+}
+
+/*
+ * Recompute the group counts and the hint from the bits.
+ */
+void
+bitmap_recount(struct bitmap *b)
+{
+        unsigned ix, maxix, g;
+        uint32_t chunk;
+
+        maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        for (g=0; g<b->ngroups; g++) {
+                b->groupfree[g] = 0;
+        }
+        b->hint = b->nbits;
+        /*
+         * Groups are a multiple of 4 words and the data block is
+         * kmalloc'd, hence aligned, so count 32 bits at a time
+         * where there are 32 bits left, and then by word.
+         */
+        for (ix=0; ix + sizeof(uint32_t) <= maxix; ix += sizeof(uint32_t)) {
+                chunk = *(uint32_t *)&b->v[ix];
+                if (chunk == 0xffffffff) {
+                        continue;
+                }
+                b->groupfree[ix / BITMAP_GROUPWORDS] +=
+                        32 - bitmap_popcount(chunk);
+        }
+        for (; ix<maxix; ix++) {
+                b->groupfree[ix / BITMAP_GROUPWORDS] +=
+                        BITS_PER_WORD - bitmap_popcount(b->v[ix]);
+        }
+        ix = bitmap_findword(b, 0, maxix);
+        if (ix < maxix) {
+                b->hint = ix*BITS_PER_WORD + bitmap_ffz(b->v[ix]);
+        }
+}
+
+/*
+ * Find a clear bit at or after bit START in the same group. Returns
+ * the bit index, or nbits if there isn't one.
+ */
+static
+unsigned
+bitmap_findingroup(struct bitmap *b, unsigned start)
+{
+        unsigned ix, endix, maxix, offset;
+        WORD_TYPE w;
+
+        ix = start / BITS_PER_WORD;
+        maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        endix = (ix / BITMAP_GROUPWORDS + 1) * BITMAP_GROUPWORDS;
+        if (endix > maxix) {
+                endix = maxix;
+        }
+
+        /* first bits in START's word from START up */
+        offset = start % BITS_PER_WORD;
+        w = b->v[ix] | (WORD_TYPE)((1U << offset) - 1);
+        if (w != WORD_ALLBITS) {
+                return ix*BITS_PER_WORD + bitmap_ffz(w);
+        }
+
+        ix = bitmap_findword(b, ix+1, endix);
+        if (ix == endix) {
+                return b->nbits;
+        }
+        return ix*BITS_PER_WORD + bitmap_ffz(b->v[ix]);
+}
+
+/*
+ * Find a clear bit at or after bit START, going to later groups and
+ * then wrapping around if need be. Returns the bit index, or nbits
+ * if there are no clear bits.
+ */
+static
+unsigned
+bitmap_find(struct bitmap *b, unsigned start)
+{
+        unsigned g, i, bit;
+
+        g = start / BITMAP_GROUPBITS;
+        if (b->groupfree[g] > 0) {
+                bit = bitmap_findingroup(b, start);
+                if (bit < b->nbits) {
+                        return bit;
+                }
+        }
+        for (i=1; i<=b->ngroups; i++) {
+                g++;
+                if (g == b->ngroups) {
+                        g = 0;
+                }
+                if (b->groupfree[g] > 0) {
+                        bit = bitmap_findingroup(b, g * BITMAP_GROUPBITS);
+                        KASSERT(bit < b->nbits);
+                        return bit;
+                }
+        }
+        return b->nbits;
+}
+
+/*
+ * Set a clear bit found by bitmap_find, updating the summary.
+ */
+static
+void
+bitmap_take(struct bitmap *b, unsigned index)
+{
+        unsigned ix = index / BITS_PER_WORD;
+        WORD_TYPE mask = ((WORD_TYPE)1) << (index % BITS_PER_WORD);
+
+        KASSERT(index < b->nbits);
+        KASSERT((b->v[ix] & mask)==0);
+        KASSERT(b->groupfree[index / BITMAP_GROUPBITS] > 0);
+        b->v[ix] |= mask;
+        b->groupfree[index / BITMAP_GROUPBITS]--;
+        if (index == b->hint) {
+                b->hint++;
+        }
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        unsigned bit;
+
+        if (b->hint >= b->nbits) {
+                return ENOSPC;
+        }
+        /* nothing below the hint is clear, so this can't wrap */
+        bit = bitmap_find(b, b->hint);
+        if (bit == b->nbits) {
+                b->hint = b->nbits;
+                return ENOSPC;
+        }
+        b->hint = bit;
+        bitmap_take(b, bit);
+        *index = bit;
+        return 0;
+}
+
+/*
+ * Find a cleared bit at or after GOAL, wrapping around to the start
+ * if there are none, and set it.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned bit;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        if (goal < b->hint) {
+                goal = b->hint < b->nbits ? b->hint : 0;
+        }
+        bit = bitmap_find(b, goal);
+        if (bit == b->nbits) {
+                return ENOSPC;
+        }
+        bitmap_take(b, bit);
+        *index = bit;
+        return 0;
 }
 
 static
@@ -142,6 +383,11 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        KASSERT(b->groupfree[index / BITMAP_GROUPBITS] > 0);
+        b->groupfree[index / BITMAP_GROUPBITS]--;
+        if (index == b->hint) {
+                b->hint++;
+        }
 }
 
 void
@@ -155,8 +401,224 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->groupfree[index / BITMAP_GROUPBITS]++;
+        if (index < b->hint) {
+                b->hint = index;
+        }
+}
+
+/*
+ * Clear COUNT set bits starting at START. Whole words in the middle
+ * are cleared at once and each group's count is adjusted once, so
+ * freeing a long run costs about a word's worth of work per 8 bits
+ * rather than a full bitmap_unmark per bit.
+ */
+void
+bitmap_unmark_range(struct bitmap *b, unsigned start, unsigned count)
+{
+        unsigned bit, end, g, gend, n;
+        unsigned ix;
+        WORD_TYPE mask;
+
+        KASSERT(start <= b->nbits && count <= b->nbits - start);
+        if (count == 0) {
+                return;
+        }
+        end = start + count;
+
+        bit = start;
+        while (bit < end) {
+                g = bit / BITMAP_GROUPBITS;
+                gend = (g + 1) * BITMAP_GROUPBITS;
+                if (gend > end) {
+                        gend = end;
+                }
+                n = gend - bit;
+
+                /* leading bits up to a word boundary */
+                while (bit < gend && bit % BITS_PER_WORD != 0) {
+                        bitmap_translate(bit, &ix, &mask);
+                        KASSERT((b->v[ix] & mask)!=0);
+                        b->v[ix] &= ~mask;
+                        bit++;
+                }
+                /* whole words */
+                while (bit + BITS_PER_WORD <= gend) {
+                        ix = bit / BITS_PER_WORD;
+                        KASSERT(b->v[ix] == WORD_ALLBITS);
+                        b->v[ix] = 0;
+                        bit += BITS_PER_WORD;
+                }
+                /* trailing bits */
+                while (bit < gend) {
+                        bitmap_translate(bit, &ix, &mask);
+                        KASSERT((b->v[ix] & mask)!=0);
+                        b->v[ix] &= ~mask;
+                        bit++;
+                }
+
+                b->groupfree[g] += n;
+                KASSERT(b->groupfree[g] <= BITMAP_GROUPBITS);
+        }
+
+        if (start < b->hint) {
+                b->hint = start;
+        }
+}
+
+/*
+ * Set COUNT clear bits starting at START, a word at a time in the
+ * middle, like bitmap_unmark_range.
+ */
+void
+bitmap_mark_range(struct bitmap *b, unsigned start, unsigned count)
+{
+        unsigned bit, end, g, gend, n;
+        unsigned ix;
+        WORD_TYPE mask;
+
+        KASSERT(start <= b->nbits && count <= b->nbits - start);
+        if (count == 0) {
+                return;
+        }
+        end = start + count;
+
+        bit = start;
+        while (bit < end) {
+                g = bit / BITMAP_GROUPBITS;
+                gend = (g + 1) * BITMAP_GROUPBITS;
+                if (gend > end) {
+                        gend = end;
+                }
+                n = gend - bit;
+
+                while (bit < gend && bit % BITS_PER_WORD != 0) {
+                        bitmap_translate(bit, &ix, &mask);
+                        KASSERT((b->v[ix] & mask)==0);
+                        b->v[ix] |= mask;
+                        bit++;
+                }
+                while (bit + BITS_PER_WORD <= gend) {
+                        ix = bit / BITS_PER_WORD;
+                        KASSERT(b->v[ix] == 0);
+                        b->v[ix] = WORD_ALLBITS;
+                        bit += BITS_PER_WORD;
+                }
+                while (bit < gend) {
+                        bitmap_translate(bit, &ix, &mask);
+                        KASSERT((b->v[ix] & mask)==0);
+                        b->v[ix] |= mask;
+                        bit++;
+                }
+
+                KASSERT(b->groupfree[g] >= n);
+                b->groupfree[g] -= n;
+        }
+
+        if (start <= b->hint && end > b->hint) {
+                b->hint = end;
+        }
 }
 
+/*
+ * Find the first set bit at or after START and before LIMIT, skipping
+ * clear words and 32-bit chunks at once. Returns LIMIT if there's
+ * none.
+ */
+static
+unsigned
+bitmap_findset(struct bitmap *b, unsigned start, unsigned limit)
+{
+        unsigned ix, limix, bit;
+        WORD_TYPE w;
+
+        if (start >= limit) {
+                return limit;
+        }
+        ix = start / BITS_PER_WORD;
+        limix = DIVROUNDUP(limit, BITS_PER_WORD);
+
+        /* bits in START's word from START up */
+        w = b->v[ix] & (WORD_TYPE)~((1U << (start % BITS_PER_WORD)) - 1);
+        if (w == 0) {
+                ix++;
+                while (ix < limix && ix % sizeof(uint32_t) != 0 &&
+                       b->v[ix] == 0) {
+                        ix++;
+                }
+                if (ix % sizeof(uint32_t) == 0) {
+                        while (ix + sizeof(uint32_t) <= limix &&
+                               *(uint32_t *)&b->v[ix] == 0) {
+                                ix += sizeof(uint32_t);
+                        }
+                }
+                while (ix < limix && b->v[ix] == 0) {
+                        ix++;
+                }
+                if (ix == limix) {
+                        return limit;
+                }
+                w = b->v[ix];
+        }
+        bit = ix*BITS_PER_WORD + bitmap_ffs(w);
+        return bit < limit ? bit : limit;
+}
+
+/*
+ * Find COUNT consecutive clear bits, set them, and return the first
+ * in *INDEX. Takes the lowest such run: starting from the hint, find
+ * a clear bit (skipping full groups and words), measure the clear run
+ * from there a word at a time, and if it's too short carry on from
+ * the set bit that ended it.
+ */
+int
+bitmap_alloc_range(struct bitmap *b, unsigned count, unsigned *index)
+{
+        unsigned bit, end, limit;
+
+        KASSERT(count > 0);
+        if (count > b->nbits) {
+                return ENOSPC;
+        }
+
+        bit = b->hint;
+        while (bit + count <= b->nbits) {
+                end = bitmap_find(b, bit);
+                if (end == b->nbits || end < bit) {
+                        /* nothing clear after BIT (it wrapped) */
+                        break;
+                }
+                bit = end;
+                if (bit + count > b->nbits) {
+                        break;
+                }
+                limit = bit + count;
+                end = bitmap_findset(b, bit, limit);
+                if (end == limit) {
+                        bitmap_mark_range(b, bit, count);
+                        *index = bit;
+                        return 0;
+                }
+                bit = end + 1;
+        }
+        return ENOSPC;
+}
+
+/*
+ * Return the number of set bits. The group counts make this cheap.
+ */
+unsigned
+bitmap_count(struct bitmap *b)
+{
+        unsigned g, nfree;
+
+        nfree = 0;
+        for (g=0; g<b->ngroups; g++) {
+                nfree += b->groupfree[g];
+        }
+        KASSERT(nfree <= b->nbits);
+        return b->nbits - nfree;
+}
 
 int
 bitmap_isset(struct bitmap *b, unsigned index)
@@ -171,6 +633,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->groupfree);
         kfree(b->v);
         kfree(b);
 }
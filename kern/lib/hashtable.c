@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Resizable hash table. See hashtable.h.
+ *
+ * Each bucket is a chain linked through hn_next, with hn_pprev
+ * pointing back at whatever points to the node (the bucket head or
+ * the previous node's hn_next), so removal needs no search. Chains
+ * are changed only by single pointer stores published with
+ * RCU_ASSIGN, which keeps them walkable by lockless readers, except
+ * when a resize moves nodes from an old bucket to a new one: then a
+ * reader could follow a moved node into the wrong chain and miss the
+ * key. Moves (and switching tables) are therefore bracketed by
+ * making ht_seq odd, and an RCU lookup that misses while ht_seq is
+ * odd or has changed asks again under the stripe lock.
+ *
+ * Bucket N of a table with 2^BITS buckets belongs to stripe
+ * N >> (BITS - HASHTABLE_STRIPEBITS), that is, to the stripe given by
+ * the top bits of the hash, in both the old and new tables during a
+ * resize. So one stripe lock covers a key wherever it lives, and
+ * moving old bucket N to new buckets 2N and 2N+1 needs just that
+ * stripe's lock. Switching tables takes every stripe lock. Resizing
+ * is serialized by ht_resizelock, which comes before the stripe
+ * locks.
+ */
+
+#define HASHINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <thread.h>
+#include <current.h>
+#include <rcu.h>
+#include <hashtable.h>
+
+/* Average chain length at which the table doubles. */
+#define HASHTABLE_MAXLOAD	2U
+
+/* Old buckets moved on each add while resizing. */
+#define HASHTABLE_MIGRATE	2
+
+/*
+ * A bucket array. hb_heads follows the structure in the same block.
+ * When a resize is done with an old one it's freed with rcu_call, as
+ * lockless lookups may still be looking at it.
+ */
+struct hashbuckets {
+	struct rcu_head hb_rcu;
+	unsigned hb_bits;		/* log2 of the number of buckets */
+	struct hashnode **hb_heads;
+};
+
+////////////////////////////////////////////////////////////
+// buckets
+
+/*
+ * Bucket number for a hash value in a table of 2^BITS buckets.
+ */
+static
+unsigned
+hashtable_bucketnum(uint32_t hash, unsigned bits)
+{
+	KASSERT(bits >= HASHTABLE_STRIPEBITS && bits < 32);
+	return hash >> (32 - bits);
+}
+
+/*
+ * Stripe for a hash value; or for bucket BN of a table of 2^BITS
+ * buckets, which is the same thing.
+ */
+static
+struct hashstripe *
+hashtable_stripe(struct hashtable *ht, uint32_t hash)
+{
+	return &ht->ht_stripes[hash >> (32 - HASHTABLE_STRIPEBITS)];
+}
+
+static
+struct hashstripe *
+hashtable_bucketstripe(struct hashtable *ht, unsigned bn, unsigned bits)
+{
+	return &ht->ht_stripes[bn >> (bits - HASHTABLE_STRIPEBITS)];
+}
+
+/*
+ * Allocate a bucket array of 2^BITS empty buckets.
+ */
+static
+struct hashbuckets *
+hashtable_makebuckets(unsigned bits)
+{
+	struct hashbuckets *hb;
+	unsigned i, num;
+
+	num = 1U << bits;
+	hb = kmalloc(sizeof(*hb) + num * sizeof(hb->hb_heads[0]));
+	if (hb == NULL) {
+		return NULL;
+	}
+	hb->hb_bits = bits;
+	hb->hb_heads = (struct hashnode **)(hb + 1);
+	for (i=0; i<num; i++) {
+		hb->hb_heads[i] = NULL;
+	}
+	return hb;
+}
+
+/*
+ * Free a bucket array; for rcu_call.
+ */
+static
+void
+hashtable_freebuckets(void *hb)
+{
+	kfree(hb);
+}
+
+/*
+ * Find the bucket a key lives in, allowing for a resize in progress.
+ * CUR, OLD, and MIGRATED are the table's fields, passed in so a
+ * lockless reader can fetch them once each.
+ */
+static
+struct hashnode **
+hashtable_bucket(struct hashbuckets *cur, struct hashbuckets *old,
+		 unsigned migrated, uint32_t hash)
+{
+	unsigned bn;
+
+	if (old != NULL) {
+		bn = hashtable_bucketnum(hash, old->hb_bits);
+		if (bn >= migrated) {
+			return &old->hb_heads[bn];
+		}
+	}
+	return &cur->hb_heads[hashtable_bucketnum(hash, cur->hb_bits)];
+}
+
+/*
+ * Put HN at the head of the chain HEAD, or take it off its chain.
+ * The caller holds the stripe lock. Unlinking leaves hn_next alone
+ * for the sake of any lockless reader standing on HN.
+ */
+static
+void
+hashtable_link(struct hashnode **head, struct hashnode *hn)
+{
+	hn->hn_next = *head;
+	hn->hn_pprev = head;
+	if (*head != NULL) {
+		(*head)->hn_pprev = &hn->hn_next;
+	}
+	RCU_ASSIGN(*head, hn);
+}
+
+static
+void
+hashtable_unlink(struct hashnode *hn)
+{
+	*hn->hn_pprev = hn->hn_next;
+	if (hn->hn_next != NULL) {
+		hn->hn_next->hn_pprev = hn->hn_pprev;
+	}
+	hn->hn_pprev = NULL;
+}
+
+/*
+ * Search the chain starting at HN.
+ */
+static
+void *
+hashtable_search(struct hashnode *hn, uint32_t hash,
+		 bool (*match)(void *obj, const void *key), const void *key)
+{
+	for (; hn != NULL; hn = RCU_READ(hn->hn_next)) {
+		if (hn->hn_hash == hash && match(hn->hn_self, key)) {
+			return hn->hn_self;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// resizing
+
+/*
+ * Take (or drop) every stripe lock, for switching tables.
+ */
+static
+void
+hashtable_lockall(struct hashtable *ht)
+{
+	unsigned i;
+
+	for (i=0; i<HASHTABLE_NSTRIPES; i++) {
+		spinlock_acquire(&ht->ht_stripes[i].hs_lock);
+	}
+}
+
+static
+void
+hashtable_unlockall(struct hashtable *ht)
+{
+	unsigned i;
+
+	for (i=HASHTABLE_NSTRIPES; i-- > 0; ) {
+		spinlock_release(&ht->ht_stripes[i].hs_lock);
+	}
+}
+
+/*
+ * Bracket changes that could make a lockless reader miss a key.
+ * Called holding ht_resizelock.
+ */
+static
+void
+hashtable_beginmove(struct hashtable *ht)
+{
+	KASSERT(spinlock_do_i_hold(&ht->ht_resizelock));
+	KASSERT(ht->ht_seq % 2 == 0);
+	ht->ht_seq++;
+	membar_store_store();
+}
+
+static
+void
+hashtable_endmove(struct hashtable *ht)
+{
+	KASSERT(ht->ht_seq % 2 == 1);
+	membar_store_store();
+	ht->ht_seq++;
+}
+
+/*
+ * Move up to COUNT old buckets into the new table. Because the table
+ * doubles, old bucket N splits exactly into new buckets 2N and 2N+1.
+ * If someone else is already at it, leave it to them.
+ */
+static
+void
+hashtable_migrate(struct hashtable *ht, unsigned count)
+{
+	struct hashbuckets *old, *cur;
+	struct hashstripe *hs;
+	struct hashnode *hn;
+	unsigned bn, newbn;
+
+	if (!spinlock_tryacquire(&ht->ht_resizelock)) {
+		return;
+	}
+	while (count-- > 0 && ht->ht_old != NULL) {
+		old = ht->ht_old;
+		cur = ht->ht_cur;
+		bn = ht->ht_migrated;
+		hs = hashtable_bucketstripe(ht, bn, old->hb_bits);
+
+		spinlock_acquire(&hs->hs_lock);
+		hashtable_beginmove(ht);
+		while ((hn = old->hb_heads[bn]) != NULL) {
+			hashtable_unlink(hn);
+			newbn = hashtable_bucketnum(hn->hn_hash, cur->hb_bits);
+			KASSERT(newbn == 2*bn || newbn == 2*bn+1);
+			hashtable_link(&cur->hb_heads[newbn], hn);
+		}
+		ht->ht_migrated++;
+		hashtable_endmove(ht);
+		spinlock_release(&hs->hs_lock);
+
+		if (ht->ht_migrated == 1U << old->hb_bits) {
+			/* done; throw away the old table */
+			hashtable_lockall(ht);
+			hashtable_beginmove(ht);
+			ht->ht_old = NULL;
+			ht->ht_migrated = 0;
+			hashtable_endmove(ht);
+			hashtable_unlockall(ht);
+			rcu_call(&old->hb_rcu, hashtable_freebuckets, old);
+		}
+	}
+	spinlock_release(&ht->ht_resizelock);
+}
+
+/*
+ * Start doubling the table if it's overloaded and not already being
+ * resized. If we can't get the memory, just carry on with the
+ * current size; we'll try again on a later call.
+ */
+void
+hashtable_prepare(struct hashtable *ht)
+{
+	struct hashbuckets *cur, *new;
+
+	/* Unlocked peek; checked again below. */
+	cur = ht->ht_cur;
+	if (ht->ht_old != NULL || cur->hb_bits + 1 >= 32 ||
+	    hashtable_count(ht) < HASHTABLE_MAXLOAD << cur->hb_bits) {
+		return;
+	}
+
+	new = hashtable_makebuckets(cur->hb_bits + 1);
+	if (new == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&ht->ht_resizelock);
+	if (ht->ht_cur != cur || ht->ht_old != NULL) {
+		/* Someone else got there first. */
+		spinlock_release(&ht->ht_resizelock);
+		kfree(new);
+		return;
+	}
+	hashtable_lockall(ht);
+	hashtable_beginmove(ht);
+	ht->ht_old = cur;
+	ht->ht_migrated = 0;
+	RCU_ASSIGN(ht->ht_cur, new);
+	hashtable_endmove(ht);
+	hashtable_unlockall(ht);
+	spinlock_release(&ht->ht_resizelock);
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+int
+hashtable_init(struct hashtable *ht, unsigned bits)
+{
+	unsigned i;
+
+	if (bits < HASHTABLE_STRIPEBITS) {
+		bits = HASHTABLE_STRIPEBITS;
+	}
+	KASSERT(bits < 32);
+
+	ht->ht_cur = hashtable_makebuckets(bits);
+	if (ht->ht_cur == NULL) {
+		return ENOMEM;
+	}
+	ht->ht_old = NULL;
+	ht->ht_migrated = 0;
+	ht->ht_seq = 0;
+	spinlock_init(&ht->ht_resizelock);
+	for (i=0; i<HASHTABLE_NSTRIPES; i++) {
+		spinlock_init(&ht->ht_stripes[i].hs_lock);
+		ht->ht_stripes[i].hs_count = 0;
+	}
+	return 0;
+}
+
+void
+hashtable_cleanup(struct hashtable *ht)
+{
+	unsigned i;
+
+	KASSERT(hashtable_count(ht) == 0);
+
+	/* Nobody can be looking any more, so no need for rcu_call. */
+	if (ht->ht_old != NULL) {
+		kfree(ht->ht_old);
+	}
+	kfree(ht->ht_cur);
+	ht->ht_old = ht->ht_cur = NULL;
+	for (i=0; i<HASHTABLE_NSTRIPES; i++) {
+		spinlock_cleanup(&ht->ht_stripes[i].hs_lock);
+	}
+	spinlock_cleanup(&ht->ht_resizelock);
+}
+
+void
+hashtable_add(struct hashtable *ht, struct hashnode *hn, uint32_t hash)
+{
+	struct hashstripe *hs;
+	struct hashnode **head;
+
+	KASSERT(hn->hn_pprev == NULL);
+
+	/* Unlocked peek; hashtable_migrate checks again. */
+	if (ht->ht_old != NULL) {
+		hashtable_migrate(ht, HASHTABLE_MIGRATE);
+	}
+
+	hn->hn_hash = hash;
+	hs = hashtable_stripe(ht, hash);
+	spinlock_acquire(&hs->hs_lock);
+	head = hashtable_bucket(ht->ht_cur, ht->ht_old, ht->ht_migrated, hash);
+	hashtable_link(head, hn);
+	hs->hs_count++;
+	spinlock_release(&hs->hs_lock);
+}
+
+void
+hashtable_remove(struct hashtable *ht, struct hashnode *hn)
+{
+	struct hashstripe *hs;
+
+	hs = hashtable_stripe(ht, hn->hn_hash);
+	spinlock_acquire(&hs->hs_lock);
+	KASSERT(hn->hn_pprev != NULL);
+	hashtable_unlink(hn);
+	KASSERT(hs->hs_count > 0);
+	hs->hs_count--;
+	spinlock_release(&hs->hs_lock);
+}
+
+void *
+hashtable_lookup(struct hashtable *ht, uint32_t hash,
+		 bool (*match)(void *obj, const void *key), const void *key)
+{
+	struct hashstripe *hs;
+	struct hashnode **head;
+	void *obj;
+
+	hs = hashtable_stripe(ht, hash);
+	spinlock_acquire(&hs->hs_lock);
+	head = hashtable_bucket(ht->ht_cur, ht->ht_old, ht->ht_migrated, hash);
+	obj = hashtable_search(*head, hash, match, key);
+	spinlock_release(&hs->hs_lock);
+	return obj;
+}
+
+/*
+ * A hit is always good. A miss is good only if no nodes moved while
+ * we were looking; otherwise look again the slow way.
+ */
+void *
+hashtable_lookup_rcu(struct hashtable *ht, uint32_t hash,
+		     bool (*match)(void *obj, const void *key),
+		     const void *key)
+{
+	struct hashnode **head;
+	unsigned seq;
+	void *obj;
+
+	KASSERT(curthread->t_rcu_nest > 0);
+
+	seq = ht->ht_seq;
+	if (seq % 2 == 0) {
+		membar_load_load();
+		head = hashtable_bucket(RCU_READ(ht->ht_cur),
+					RCU_READ(ht->ht_old),
+					ht->ht_migrated, hash);
+		obj = hashtable_search(RCU_READ(*head), hash, match, key);
+		if (obj != NULL) {
+			return obj;
+		}
+		membar_load_load();
+		if (ht->ht_seq == seq) {
+			return NULL;
+		}
+	}
+	return hashtable_lookup(ht, hash, match, key);
+}
+
+unsigned
+hashtable_count(struct hashtable *ht)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<HASHTABLE_NSTRIPES; i++) {
+		count += ht->ht_stripes[i].hs_count;
+	}
+	return count;
+}
+
+unsigned
+hashtable_numbuckets(struct hashtable *ht)
+{
+	return 1U << ht->ht_cur->hb_bits;
+}
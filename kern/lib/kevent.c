@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Structured kernel event tracing. See kevent.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <lamebus/ltrace.h>
+#include <kevent.h>
+
+/* Records per CPU; a power of two */
+#define KEVENT_NRECS	512
+
+/* Records written to the file at once */
+#define KEVENT_BATCH	32
+
+/* Seconds between drains */
+#define KEVENT_INTERVAL	1
+
+/*
+ * One CPU's ring, as for ktrace: only that CPU writes records and
+ * kb_head; kb_tail and kb_lost belong to the drain side, under
+ * kevent_lock.
+ */
+struct keventbuf {
+	volatile unsigned kb_head;
+	unsigned kb_tail;
+	unsigned kb_lost;
+	struct kevent_rec kb_recs[KEVENT_NRECS];
+};
+
+volatile bool kevent_enabled;
+static volatile bool kevent_ltrace;
+
+/* For draining, and for the output file. */
+static struct lock *kevent_lock;
+static struct vnode *kevent_vnode;
+static off_t kevent_offset;
+
+////////////////////////////////////////////////////////////
+// recording
+
+void
+kevent_record(unsigned type, uint32_t a0, uint32_t a1, uint32_t a2,
+	      uint32_t a3)
+{
+	struct keventbuf *kb;
+	struct kevent_rec *ke;
+	struct timespec ts;
+	unsigned head;
+	int s;
+
+	if (kevent_ltrace) {
+		ltrace_debug(KEVENT_LTRACECODE(type));
+	}
+
+	/* Interrupts off so nothing else on this CPU writes the ring. */
+	s = splhigh();
+	kb = curcpu->c_kevent;
+	if (kb == NULL) {
+		splx(s);
+		return;
+	}
+	gettime(&ts);
+
+	head = kb->kb_head;
+	ke = &kb->kb_recs[head % KEVENT_NRECS];
+	ke->ke_sec = ts.tv_sec;
+	ke->ke_nsec = ts.tv_nsec;
+	ke->ke_type = type;
+	ke->ke_cpu = curcpu->c_number;
+	ke->ke_thread = (uintptr_t)curthread;
+	ke->ke_args[0] = a0;
+	ke->ke_args[1] = a1;
+	ke->ke_args[2] = a2;
+	ke->ke_args[3] = a3;
+	membar_store_store();
+	kb->kb_head = head + 1;
+	splx(s);
+}
+
+/*
+ * Record an event whose args 1-3 hold a name.
+ */
+void
+kevent_recordname(unsigned type, uint32_t a0, const char *name)
+{
+	uint32_t packed[3];
+	size_t len;
+
+	bzero(packed, sizeof(packed));
+	len = strlen(name);
+	if (len > sizeof(packed)) {
+		len = sizeof(packed);
+	}
+	memcpy(packed, name, len);
+	kevent_record(type, a0, packed[0], packed[1], packed[2]);
+}
+
+////////////////////////////////////////////////////////////
+// draining
+
+/*
+ * Write records to the trace file. Call with kevent_lock held.
+ */
+static
+void
+kevent_write(const struct kevent_rec *recs, unsigned n)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(kevent_lock));
+
+	if (kevent_vnode == NULL || n == 0) {
+		return;
+	}
+	uio_kinit(&iov, &ku, (void *)recs, n * sizeof(*recs), kevent_offset,
+		  UIO_WRITE);
+	result = VOP_WRITE(kevent_vnode, &ku);
+	if (result) {
+		kprintf("kevent: write: %s; tracing stopped\n",
+			strerror(result));
+		kevent_enabled = false;
+		vfs_close(kevent_vnode);
+		kevent_vnode = NULL;
+		return;
+	}
+	kevent_offset = ku.uio_offset;
+}
+
+/*
+ * Drain one CPU's ring to the file, a batch at a time. As in ktrace,
+ * a record the writer lapped while we copied it is dropped.
+ */
+static
+void
+kevent_drainbuf(unsigned cpunum, struct keventbuf *kb)
+{
+	struct kevent_rec batch[KEVENT_BATCH];
+	struct timespec ts;
+	unsigned head, n;
+
+	n = 0;
+	while (1) {
+		head = kb->kb_head;
+		membar_load_load();
+		if (head - kb->kb_tail > KEVENT_NRECS) {
+			kb->kb_lost += head - kb->kb_tail - KEVENT_NRECS;
+			kb->kb_tail = head - KEVENT_NRECS;
+		}
+		if (kb->kb_tail == head) {
+			break;
+		}
+		batch[n] = kb->kb_recs[kb->kb_tail % KEVENT_NRECS];
+		membar_load_load();
+		if (kb->kb_head - kb->kb_tail > KEVENT_NRECS) {
+			continue;
+		}
+		kb->kb_tail++;
+		if (++n == KEVENT_BATCH) {
+			kevent_write(batch, n);
+			n = 0;
+		}
+	}
+
+	if (kb->kb_lost > 0 && n < KEVENT_BATCH) {
+		gettime(&ts);
+		bzero(&batch[n], sizeof(batch[n]));
+		batch[n].ke_sec = ts.tv_sec;
+		batch[n].ke_nsec = ts.tv_nsec;
+		batch[n].ke_type = KEV_LOST;
+		batch[n].ke_cpu = cpunum;
+		batch[n].ke_args[0] = kb->kb_lost;
+		n++;
+		kb->kb_lost = 0;
+	}
+	kevent_write(batch, n);
+}
+
+/*
+ * Drain all the rings.
+ */
+static
+void
+kevent_drain(void)
+{
+	struct cpu *c;
+	unsigned i, num;
+
+	lock_acquire(kevent_lock);
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		c = cpu_getcpu(i);
+		if (c->c_kevent != NULL) {
+			kevent_drainbuf(i, c->c_kevent);
+		}
+	}
+	lock_release(kevent_lock);
+}
+
+/*
+ * The drain thread.
+ */
+static
+void
+kevent_thread(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(KEVENT_INTERVAL);
+		if (kevent_enabled) {
+			kevent_drain();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// control
+
+/*
+ * Start tracing to the file PATH.
+ */
+int
+kevent_start(const char *path)
+{
+	struct kevent_header kh;
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	struct keventbuf *kb;
+	unsigned i, num;
+	int result;
+
+	result = vfs_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		return result;
+	}
+
+	kh.kh_magic = KEVENT_MAGIC;
+	kh.kh_recsize = sizeof(struct kevent_rec);
+	uio_kinit(&iov, &ku, &kh, sizeof(kh), 0, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+
+	lock_acquire(kevent_lock);
+	if (kevent_vnode != NULL) {
+		lock_release(kevent_lock);
+		vfs_close(vn);
+		return EBUSY;
+	}
+	kevent_vnode = vn;
+	kevent_offset = ku.uio_offset;
+
+	/* Skip anything left over from before. */
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kb = cpu_getcpu(i)->c_kevent;
+		if (kb != NULL) {
+			kb->kb_tail = kb->kb_head;
+			kb->kb_lost = 0;
+		}
+	}
+	kevent_enabled = true;
+	lock_release(kevent_lock);
+
+	KEVENT_NAME(KEV_THREAD, curthread, curthread->t_name);
+	return 0;
+}
+
+/*
+ * Stop tracing and close the file.
+ */
+void
+kevent_stop(void)
+{
+	kevent_enabled = false;
+	kevent_drain();
+
+	lock_acquire(kevent_lock);
+	if (kevent_vnode != NULL) {
+		vfs_close(kevent_vnode);
+		kevent_vnode = NULL;
+	}
+	lock_release(kevent_lock);
+}
+
+/*
+ * Turn mirroring events to ltrace_debug on or off.
+ */
+void
+kevent_setltrace(bool on)
+{
+	kevent_ltrace = on;
+}
+
+/*
+ * Give each CPU a ring and start the drain thread.
+ */
+void
+kevent_bootstrap(void)
+{
+	struct keventbuf *kb;
+	struct cpu *c;
+	unsigned i, num;
+	int result;
+
+	kevent_lock = lock_create("kevent");
+	if (kevent_lock == NULL) {
+		panic("kevent: Could not create lock\n");
+	}
+
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kb = kmalloc(sizeof(*kb));
+		if (kb == NULL) {
+			panic("kevent: Out of memory\n");
+		}
+		kb->kb_head = 0;
+		kb->kb_tail = 0;
+		kb->kb_lost = 0;
+		c = cpu_getcpu(i);
+		membar_store_store();
+		c->c_kevent = kb;
+	}
+
+	result = thread_fork("kevent", NULL, kevent_thread, NULL, 0);
+	if (result) {
+		panic("kevent: thread_fork: %s\n", strerror(result));
+	}
+}
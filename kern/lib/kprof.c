@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sampling kernel profiler. See kprof.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <synch.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <kprof.h>
+
+/* Samples per CPU: at HZ 100, about 40 seconds of busy time */
+#define KPROF_NRECS	4096
+
+struct kprof_rec {
+	uint32_t kr_pc;
+	uint32_t kr_ra;
+};
+
+/*
+ * One CPU's samples. Only that CPU writes it, from the timer
+ * interrupt; it's read only while profiling is off.
+ */
+struct kprofbuf {
+	unsigned kp_num;		/* samples in kp_recs */
+	unsigned kp_user;		/* user samples (not recorded) */
+	unsigned kp_lost;		/* kernel samples with no room */
+	struct kprof_rec kp_recs[KPROF_NRECS];
+};
+
+/* Samples per process, for user profiling */
+#define UPROF_NRECS	8192
+
+/* Most PCs printed when a profiled process exits */
+#define UPROF_DUMPLINES	500
+
+/*
+ * One process's user samples. Written from the timer interrupt when
+ * it interrupts the process in user mode; since user processes have
+ * one thread, that never happens while the process is in the kernel
+ * looking at the buffer itself.
+ */
+struct uprofbuf {
+	unsigned up_num;
+	unsigned up_lost;
+	uint32_t up_pcs[UPROF_NRECS];
+};
+
+/* A histogram entry, as built by kprof_dump */
+struct kprof_ent {
+	uint32_t ke_pc;
+	uint32_t ke_ra;
+	unsigned ke_count;
+};
+
+volatile bool kprof_enabled;
+static bool kprof_callers;
+
+volatile unsigned uprof_nprocs;
+static struct spinlock uprof_lock = SPINLOCK_INITIALIZER;
+static bool uprof_newprocs;
+
+/* Serializes the control operations. */
+static struct lock *kprof_lock;
+
+////////////////////////////////////////////////////////////
+// recording
+
+void
+kprof_sample(vaddr_t pc, vaddr_t ra, bool user)
+{
+	struct kprofbuf *kp;
+	struct kprof_rec *kr;
+	struct uprofbuf *up;
+
+	/* We're in the timer interrupt, so interrupts are already off. */
+	kp = kprof_enabled ? curcpu->c_kprof : NULL;
+	if (user) {
+		if (kp != NULL) {
+			kp->kp_user++;
+		}
+		up = curproc->p_uprof;
+		if (up == NULL) {
+			return;
+		}
+		if (up->up_num == UPROF_NRECS) {
+			up->up_lost++;
+			return;
+		}
+		up->up_pcs[up->up_num++] = pc;
+		return;
+	}
+	if (kp == NULL) {
+		return;
+	}
+	if (kp->kp_num == KPROF_NRECS) {
+		kp->kp_lost++;
+		return;
+	}
+	kr = &kp->kp_recs[kp->kp_num++];
+	kr->kr_pc = pc;
+	kr->kr_ra = kprof_callers ? ra : 0;
+}
+
+////////////////////////////////////////////////////////////
+// control
+
+/*
+ * Start profiling, adding to any samples already taken. Each CPU's
+ * buffer is allocated the first time.
+ */
+int
+kprof_start(bool callers)
+{
+	struct kprofbuf *kp;
+	struct cpu *c;
+	unsigned i, num;
+
+	lock_acquire(kprof_lock);
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		c = cpu_getcpu(i);
+		if (c->c_kprof != NULL) {
+			continue;
+		}
+		kp = kmalloc(sizeof(*kp));
+		if (kp == NULL) {
+			lock_release(kprof_lock);
+			return ENOMEM;
+		}
+		kp->kp_num = 0;
+		kp->kp_user = 0;
+		kp->kp_lost = 0;
+		membar_store_store();
+		c->c_kprof = kp;
+	}
+	kprof_callers = callers;
+	membar_store_store();
+	kprof_enabled = true;
+	lock_release(kprof_lock);
+	return 0;
+}
+
+void
+kprof_stop(void)
+{
+	kprof_enabled = false;
+	membar_any_any();
+}
+
+/*
+ * Stop profiling and throw away the samples.
+ */
+void
+kprof_reset(void)
+{
+	struct kprofbuf *kp;
+	unsigned i, num;
+
+	kprof_stop();
+	lock_acquire(kprof_lock);
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kp = cpu_getcpu(i)->c_kprof;
+		if (kp != NULL) {
+			kp->kp_num = 0;
+			kp->kp_user = 0;
+			kp->kp_lost = 0;
+		}
+	}
+	lock_release(kprof_lock);
+}
+
+/*
+ * Add up the counts over all CPUs.
+ */
+static
+void
+kprof_totals(unsigned *kern, unsigned *user, unsigned *lost)
+{
+	struct kprofbuf *kp;
+	unsigned i, num;
+
+	*kern = *user = *lost = 0;
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kp = cpu_getcpu(i)->c_kprof;
+		if (kp != NULL) {
+			*kern += kp->kp_num;
+			*user += kp->kp_user;
+			*lost += kp->kp_lost;
+		}
+	}
+}
+
+void
+kprof_status(void)
+{
+	unsigned kern, user, lost;
+
+	kprof_totals(&kern, &user, &lost);
+	kprintf("kprof: %s%s; %u kernel samples, %u user, %u lost\n",
+		kprof_enabled ? "on" : "off",
+		kprof_enabled && kprof_callers ? " with callers" : "",
+		kern, user, lost);
+	kprintf("kprof: user profiling %s for new processes; "
+		"%u processes profiled\n",
+		uprof_newprocs ? "on" : "off", uprof_nprocs);
+}
+
+////////////////////////////////////////////////////////////
+// dumping
+
+static
+int
+kprof_bypc(const struct kprof_ent *a, const struct kprof_ent *b)
+{
+	if (a->ke_pc != b->ke_pc) {
+		return a->ke_pc < b->ke_pc ? -1 : 1;
+	}
+	if (a->ke_ra != b->ke_ra) {
+		return a->ke_ra < b->ke_ra ? -1 : 1;
+	}
+	return 0;
+}
+
+static
+int
+kprof_bycount(const struct kprof_ent *a, const struct kprof_ent *b)
+{
+	if (a->ke_count != b->ke_count) {
+		return a->ke_count > b->ke_count ? -1 : 1;
+	}
+	return kprof_bypc(a, b);
+}
+
+/*
+ * Shell sort; the kernel has no qsort, and this is called only from
+ * the menu.
+ */
+static
+void
+kprof_sort(struct kprof_ent *v, unsigned n,
+	   int (*cmp)(const struct kprof_ent *, const struct kprof_ent *))
+{
+	struct kprof_ent tmp;
+	unsigned gap, i, j;
+
+	gap = 1;
+	while (gap < n / 3) {
+		gap = gap*3 + 1;
+	}
+	for (; gap > 0; gap /= 3) {
+		for (i=gap; i<n; i++) {
+			tmp = v[i];
+			for (j=i; j>=gap && cmp(&v[j-gap], &tmp) > 0; j-=gap) {
+				v[j] = v[j-gap];
+			}
+			v[j] = tmp;
+		}
+	}
+}
+
+/*
+ * Merge adjacent entries (in a sorted array) that are the same by
+ * pc alone or by pc and caller, adding their counts. Returns the new
+ * length.
+ */
+static
+unsigned
+kprof_merge(struct kprof_ent *v, unsigned n, bool byra)
+{
+	unsigned i, j;
+
+	if (n == 0) {
+		return 0;
+	}
+	j = 0;
+	for (i=1; i<n; i++) {
+		if (v[i].ke_pc == v[j].ke_pc &&
+		    (!byra || v[i].ke_ra == v[j].ke_ra)) {
+			v[j].ke_count += v[i].ke_count;
+		}
+		else {
+			v[++j] = v[i];
+		}
+	}
+	return j + 1;
+}
+
+/*
+ * Print the histogram, at most MAXLINES of each kind (if nonzero),
+ * in a form testscripts/profsym.py reads:
+ *    kprof samples KERN user USER lost LOST
+ *    kprof pc PC COUNT
+ *    kprof arc PC CALLER COUNT
+ * Stops profiling first if it's on.
+ */
+int
+kprof_dump(unsigned maxlines)
+{
+	struct kprof_ent *arcs, *pcs;
+	struct kprofbuf *kp;
+	unsigned kern, user, lost;
+	unsigned i, j, k, num, narcs, npcs;
+
+	kprof_stop();
+	lock_acquire(kprof_lock);
+	kprof_totals(&kern, &user, &lost);
+
+	arcs = kmalloc((kern ? kern : 1) * sizeof(*arcs));
+	pcs = kmalloc((kern ? kern : 1) * sizeof(*pcs));
+	if (arcs == NULL || pcs == NULL) {
+		kfree(arcs);
+		kfree(pcs);
+		lock_release(kprof_lock);
+		return ENOMEM;
+	}
+
+	k = 0;
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kp = cpu_getcpu(i)->c_kprof;
+		if (kp == NULL) {
+			continue;
+		}
+		for (j=0; j<kp->kp_num && k<kern; j++) {
+			arcs[k].ke_pc = kp->kp_recs[j].kr_pc;
+			arcs[k].ke_ra = kp->kp_recs[j].kr_ra;
+			arcs[k].ke_count = 1;
+			k++;
+		}
+	}
+
+	/* Sorted by pc and caller, the arcs and pcs fall out in turn. */
+	kprof_sort(arcs, k, kprof_bypc);
+	narcs = kprof_merge(arcs, k, true);
+	memcpy(pcs, arcs, narcs * sizeof(*pcs));
+	npcs = kprof_merge(pcs, narcs, false);
+	kprof_sort(pcs, npcs, kprof_bycount);
+	kprof_sort(arcs, narcs, kprof_bycount);
+
+	kprintf("kprof samples %u user %u lost %u\n", kern, user, lost);
+	for (i=0; i<npcs && (maxlines == 0 || i < maxlines); i++) {
+		kprintf("kprof pc 0x%08x %u\n", pcs[i].ke_pc, pcs[i].ke_count);
+	}
+	if (kprof_callers) {
+		for (i=0; i<narcs && (maxlines == 0 || i < maxlines); i++) {
+			kprintf("kprof arc 0x%08x 0x%08x %u\n",
+				arcs[i].ke_pc, arcs[i].ke_ra,
+				arcs[i].ke_count);
+		}
+	}
+
+	kfree(arcs);
+	kfree(pcs);
+	lock_release(kprof_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// user profiling
+
+/*
+ * Turn on or off profiling of processes started from the menu.
+ */
+void
+uprof_setnew(bool on)
+{
+	uprof_newprocs = on;
+}
+
+bool
+uprof_getnew(void)
+{
+	return uprof_newprocs;
+}
+
+/*
+ * Give process P a buffer, or empty the one it has. P must be the
+ * current process or one that isn't running yet.
+ */
+int
+uprof_attach(struct proc *p)
+{
+	struct uprofbuf *up;
+	int s;
+
+	if (p->p_uprof != NULL) {
+		uprof_reset(p);
+		return 0;
+	}
+	up = kmalloc(sizeof(*up));
+	if (up == NULL) {
+		return ENOMEM;
+	}
+	up->up_num = 0;
+	up->up_lost = 0;
+
+	spinlock_acquire(&uprof_lock);
+	uprof_nprocs++;
+	spinlock_release(&uprof_lock);
+
+	s = splhigh();
+	p->p_uprof = up;
+	splx(s);
+	return 0;
+}
+
+/*
+ * Print a process's samples as a histogram, most frequent first, in
+ * the form testscripts/profsym.py reads:
+ *    uprof samples NUM lost LOST pid PID name NAME
+ *    uprof pc PC COUNT
+ */
+static
+void
+uprof_dump(struct proc *p, struct uprofbuf *up)
+{
+	struct kprof_ent *v;
+	unsigned i, n;
+
+	kprintf("uprof samples %u lost %u pid %d name %s\n",
+		up->up_num, up->up_lost, (int)p->p_pid, p->p_name);
+
+	v = kmalloc(up->up_num * sizeof(*v));
+	if (v == NULL) {
+		kprintf("uprof: Out of memory for the histogram\n");
+		return;
+	}
+	for (i=0; i<up->up_num; i++) {
+		v[i].ke_pc = up->up_pcs[i];
+		v[i].ke_ra = 0;
+		v[i].ke_count = 1;
+	}
+	kprof_sort(v, up->up_num, kprof_bypc);
+	n = kprof_merge(v, up->up_num, false);
+	kprof_sort(v, n, kprof_bycount);
+	for (i=0; i<n && i<UPROF_DUMPLINES; i++) {
+		kprintf("uprof pc 0x%08x %u\n", v[i].ke_pc, v[i].ke_count);
+	}
+	kfree(v);
+}
+
+/*
+ * Take away process P's buffer, if it has one, printing its samples
+ * first if DUMP is set and there are any. P must be the current
+ * process or one with no threads.
+ */
+void
+uprof_detach(struct proc *p, bool dump)
+{
+	struct uprofbuf *up;
+	int s;
+
+	s = splhigh();
+	up = p->p_uprof;
+	p->p_uprof = NULL;
+	splx(s);
+	if (up == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&uprof_lock);
+	KASSERT(uprof_nprocs > 0);
+	uprof_nprocs--;
+	spinlock_release(&uprof_lock);
+
+	if (dump && up->up_num > 0) {
+		uprof_dump(p, up);
+	}
+	kfree(up);
+}
+
+void
+uprof_reset(struct proc *p)
+{
+	int s;
+
+	s = splhigh();
+	if (p->p_uprof != NULL) {
+		p->p_uprof->up_num = 0;
+		p->p_uprof->up_lost = 0;
+	}
+	splx(s);
+}
+
+/*
+ * Copy up to LEN bytes' worth of the current process's samples out
+ * to BUF and remove them from the buffer.
+ */
+int
+uprof_read(struct proc *p, userptr_t buf, size_t len, unsigned *retcount)
+{
+	struct uprofbuf *up;
+	unsigned n;
+	int result, s;
+
+	KASSERT(p == curproc);
+	up = p->p_uprof;
+	if (up == NULL) {
+		return EINVAL;
+	}
+
+	/* We're in the kernel, so no samples get added while we work. */
+	n = len / sizeof(up->up_pcs[0]);
+	if (n > up->up_num) {
+		n = up->up_num;
+	}
+	result = copyout(up->up_pcs, buf, n * sizeof(up->up_pcs[0]));
+	if (result) {
+		return result;
+	}
+	s = splhigh();
+	memmove(up->up_pcs, up->up_pcs + n,
+		(up->up_num - n) * sizeof(up->up_pcs[0]));
+	up->up_num -= n;
+	splx(s);
+
+	*retcount = n;
+	return 0;
+}
+
+void
+kprof_bootstrap(void)
+{
+	kprof_lock = lock_create("kprof");
+	if (kprof_lock == NULL) {
+		panic("kprof: Could not create lock\n");
+	}
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lightweight per-CPU tracing. See ktrace.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <ktrace.h>
+
+/* Records per CPU; a power of two */
+#define KTRACE_NRECS	256
+
+/* Seconds between drains */
+#define KTRACE_INTERVAL	1
+
+struct ktracerec {
+	const char *kr_fmt;
+	unsigned kr_nargs;
+	uintptr_t kr_args[KTRACE_NARGS];
+	unsigned kr_hardclocks;
+};
+
+/*
+ * One CPU's ring. Only that CPU writes records and kb_head; only the
+ * drain side (under ktrace_drainlock) touches kb_tail and kb_lost.
+ * The indexes count up forever and are taken modulo KTRACE_NRECS.
+ */
+struct ktracebuf {
+	volatile unsigned kb_head;	/* next record to write */
+	unsigned kb_tail;		/* next record to drain */
+	unsigned kb_lost;		/* overwritten before drained */
+	struct ktracerec kb_recs[KTRACE_NRECS];
+};
+
+static volatile bool ktrace_enabled;
+
+/* For draining, and for the output file. */
+static struct lock *ktrace_drainlock;
+static struct vnode *ktrace_vnode;
+static off_t ktrace_offset;
+
+////////////////////////////////////////////////////////////
+// recording
+
+/*
+ * Count the conversions in FMT, which is how many arguments it takes.
+ */
+static
+unsigned
+ktrace_countargs(const char *fmt)
+{
+	unsigned n = 0;
+
+	for (; *fmt != 0; fmt++) {
+		if (*fmt != '%') {
+			continue;
+		}
+		if (fmt[1] == '%') {
+			fmt++;
+			continue;
+		}
+		n++;
+	}
+	return n < KTRACE_NARGS ? n : KTRACE_NARGS;
+}
+
+void
+ktrace(const char *fmt, ...)
+{
+	struct ktracebuf *kb;
+	struct ktracerec *kr;
+	unsigned i, head;
+	va_list ap;
+	int s;
+
+	if (!ktrace_enabled) {
+		return;
+	}
+
+	/* Interrupts off so nothing else on this CPU writes the ring. */
+	s = splhigh();
+	kb = curcpu->c_ktrace;
+	if (kb == NULL) {
+		splx(s);
+		return;
+	}
+	head = kb->kb_head;
+	kr = &kb->kb_recs[head % KTRACE_NRECS];
+	kr->kr_fmt = fmt;
+	kr->kr_nargs = ktrace_countargs(fmt);
+	va_start(ap, fmt);
+	for (i=0; i<kr->kr_nargs; i++) {
+		kr->kr_args[i] = va_arg(ap, uintptr_t);
+	}
+	va_end(ap);
+	kr->kr_hardclocks = curcpu->c_hardclocks;
+	membar_store_store();
+	kb->kb_head = head + 1;
+	splx(s);
+}
+
+////////////////////////////////////////////////////////////
+// draining
+
+/*
+ * Send a line to the output. Call with the drain lock held.
+ */
+static
+void
+ktrace_output(const char *line, size_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(ktrace_drainlock));
+
+	if (ktrace_vnode == NULL) {
+		kprintf("%s", line);
+		return;
+	}
+	uio_kinit(&iov, &ku, (char *)line, len, ktrace_offset, UIO_WRITE);
+	result = VOP_WRITE(ktrace_vnode, &ku);
+	if (result) {
+		kprintf("ktrace: write: %s; back to the console\n",
+			strerror(result));
+		vfs_close(ktrace_vnode);
+		ktrace_vnode = NULL;
+		kprintf("%s", line);
+		return;
+	}
+	ktrace_offset = ku.uio_offset;
+}
+
+/*
+ * Format and send one record.
+ */
+static
+void
+ktrace_print(unsigned cpunum, const struct ktracerec *kr)
+{
+	char line[160];
+	size_t len;
+
+	len = snprintf(line, sizeof(line), "[%u %u] ", cpunum,
+		       kr->kr_hardclocks);
+	len += snprintf(line + len, sizeof(line) - len, kr->kr_fmt,
+			kr->kr_args[0], kr->kr_args[1], kr->kr_args[2],
+			kr->kr_args[3]);
+	if (len >= sizeof(line) - 1) {
+		len = sizeof(line) - 2;
+	}
+	if (len == 0 || line[len - 1] != '\n') {
+		line[len++] = '\n';
+		line[len] = 0;
+	}
+	ktrace_output(line, len);
+}
+
+/*
+ * Drain one CPU's ring. A record is copied out, then the head is
+ * checked again: if the writer has since lapped it, the copy may be
+ * torn and is dropped.
+ */
+static
+void
+ktrace_drainbuf(unsigned cpunum, struct ktracebuf *kb)
+{
+	struct ktracerec kr;
+	unsigned head;
+	char msg[64];
+
+	while (1) {
+		head = kb->kb_head;
+		membar_load_load();
+		if (head - kb->kb_tail > KTRACE_NRECS) {
+			kb->kb_lost += head - kb->kb_tail - KTRACE_NRECS;
+			kb->kb_tail = head - KTRACE_NRECS;
+		}
+		if (kb->kb_tail == head) {
+			break;
+		}
+		kr = kb->kb_recs[kb->kb_tail % KTRACE_NRECS];
+		membar_load_load();
+		if (kb->kb_head - kb->kb_tail > KTRACE_NRECS) {
+			/* overwritten while we copied it */
+			continue;
+		}
+		kb->kb_tail++;
+		ktrace_print(cpunum, &kr);
+	}
+
+	if (kb->kb_lost > 0) {
+		snprintf(msg, sizeof(msg), "[%u] ktrace: %u records lost\n",
+			 cpunum, kb->kb_lost);
+		ktrace_output(msg, strlen(msg));
+		kb->kb_lost = 0;
+	}
+}
+
+void
+ktrace_drain(void)
+{
+	struct cpu *c;
+	unsigned i, num;
+
+	lock_acquire(ktrace_drainlock);
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		c = cpu_getcpu(i);
+		if (c->c_ktrace != NULL) {
+			ktrace_drainbuf(i, c->c_ktrace);
+		}
+	}
+	lock_release(ktrace_drainlock);
+}
+
+/*
+ * The drain thread. It does nothing much while tracing is off.
+ */
+static
+void
+ktrace_thread(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(KTRACE_INTERVAL);
+		if (ktrace_enabled) {
+			ktrace_drain();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// control
+
+void
+ktrace_setenabled(bool on)
+{
+	ktrace_enabled = on;
+	if (!on) {
+		/* flush what's there */
+		ktrace_drain();
+	}
+}
+
+/*
+ * Send output to the file PATH (created or truncated), or to the
+ * console if PATH is NULL.
+ */
+int
+ktrace_setoutput(const char *path)
+{
+	struct vnode *vn = NULL;
+	int result;
+
+	if (path != NULL) {
+		result = vfs_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+		if (result) {
+			return result;
+		}
+	}
+
+	ktrace_drain();
+	lock_acquire(ktrace_drainlock);
+	if (ktrace_vnode != NULL) {
+		vfs_close(ktrace_vnode);
+	}
+	ktrace_vnode = vn;
+	ktrace_offset = 0;
+	lock_release(ktrace_drainlock);
+	return 0;
+}
+
+/*
+ * Give each CPU a ring and start the drain thread.
+ */
+void
+ktrace_bootstrap(void)
+{
+	struct ktracebuf *kb;
+	struct cpu *c;
+	unsigned i, num;
+	int result;
+
+	ktrace_drainlock = lock_create("ktrace");
+	if (ktrace_drainlock == NULL) {
+		panic("ktrace: Could not create lock\n");
+	}
+
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		kb = kmalloc(sizeof(*kb));
+		if (kb == NULL) {
+			panic("ktrace: Out of memory\n");
+		}
+		kb->kb_head = 0;
+		kb->kb_tail = 0;
+		kb->kb_lost = 0;
+		c = cpu_getcpu(i);
+		membar_store_store();
+		c->c_ktrace = kb;
+	}
+
+	result = thread_fork("ktrace", NULL, ktrace_thread, NULL, 0);
+	if (result) {
+		panic("ktrace: thread_fork: %s\n", strerror(result));
+	}
+}
@@ -51,6 +51,11 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <ktrace.h>
+#include <kevent.h>
+#include <kprof.h>
+#include <workqueue.h>
+#include <rcu.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -73,6 +78,70 @@ static const char harvard_copyright[] =
     "Copyright (c) 2000, 2001-2005, 2008-2011, 2013, 2014\n"
     "   President and Fellows of Devry University.  All rights reserved.\n";
 
+/*
+ * Boot phase timestamps, for finding out where time-to-menu goes.
+ * Each entry is the cycle count (since reset, on the boot CPU) at
+ * which the named phase finished. The cycle counter needs curcpu,
+ * so the first mark comes after thread_bootstrap(); it covers
+ * everything before that, including the boot loader.
+ */
+#define BOOT_MAXPHASES 8
+
+static struct {
+	const char *bp_name;
+	uint64_t bp_cycles;
+} boot_phases[BOOT_MAXPHASES];
+static unsigned boot_nphases;
+
+/* Count of concurrent boot tasks finished, for boot() to wait on */
+static struct semaphore *boot_tasksem;
+
+static
+void
+boot_phase(const char *name)
+{
+	KASSERT(boot_nphases < BOOT_MAXPHASES);
+	boot_phases[boot_nphases].bp_name = name;
+	boot_phases[boot_nphases].bp_cycles = mainbus_cycles();
+	boot_nphases++;
+}
+
+/*
+ * Print the boot phase table (from the menu).
+ */
+void
+boot_printphases(void)
+{
+	uint64_t prev;
+	unsigned i;
+
+	prev = 0;
+	for (i=0; i<boot_nphases; i++) {
+		kprintf("%-10s %12llu cycles %12llu total\n",
+			boot_phases[i].bp_name,
+			(unsigned long long)(boot_phases[i].bp_cycles - prev),
+			(unsigned long long)boot_phases[i].bp_cycles);
+		prev = boot_phases[i].bp_cycles;
+	}
+}
+
+/*
+ * Thread for bringing up the buffer cache in parallel with the rest
+ * of the late initialization: it is the largest piece of it (the
+ * ghost ring and hash scale with RAM) and depends only on the heap,
+ * synchronization primitives, and thread_fork.
+ */
+static
+void
+boot_bufferthread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	buffer_bootstrap();
+	V(boot_tasksem);
+}
+
 
 /*
  * Initial boot sequence.
@@ -81,6 +150,8 @@ static
 void
 boot(void)
 {
+	int result;
+
 	/*
 	 * The order of these is important!
 	 * Don't go changing it without thinking about the consequences.
@@ -114,6 +185,7 @@ boot(void)
 	hardclock_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
+	boot_phase("early");
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -124,17 +196,46 @@ boot(void)
 	pseudoconfig();
 	kprintf("\n");
 	kheap_nextgeneration();
+	boot_phase("devices");
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	timepage_bootstrap();
+	boot_phase("vm");
 	kprintf_bootstrap();
 	thread_start_cpus();
+	boot_phase("cpus");
+	workqueue_bootstrap();
+	rcu_bootstrap();
 
-	/* Buffer cache */
-	buffer_bootstrap();
+	/*
+	 * Now that the other CPUs are up, the buffer cache can come up
+	 * on one of them while this thread does the rest, none of which
+	 * it depends on.
+	 */
+	boot_tasksem = sem_create("boot", 0);
+	if (boot_tasksem == NULL) {
+		panic("boot: Could not create semaphore\n");
+	}
+	result = thread_fork("boot buffers", NULL, boot_bufferthread, NULL, 0);
+	if (result) {
+		panic("boot: thread_fork: %s\n", strerror(result));
+	}
+	ktrace_bootstrap();
+	kevent_bootstrap();
+	kprof_bootstrap();
+	futex_bootstrap();
+
+	/*
+	 * Default bootfs. Don't look it up until something uses it; if
+	 * emu0 doesn't exist, paths starting with / just fail then.
+	 */
+	vfs_deferbootfs("emu0");
 
-	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
-	vfs_setbootfs("emu0");
+	P(boot_tasksem);
+	sem_destroy(boot_tasksem);
+	boot_tasksem = NULL;
+	boot_phase("late");
 
 	kheap_nextgeneration();
 
@@ -31,17 +31,33 @@
 #include <kern/errno.h>
 #include <kern/reboot.h>
 #include <kern/unistd.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
+#include <spinlock.h>
+#include <pcpu.h>
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
 #include <proc.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <kmemcache.h>
+#include <reclaim.h>
 #include <vfs.h>
+#include <device.h>
 #include <buf.h>
+#include <iostat.h>
+#include <ktrace.h>
+#include <kevent.h>
+#include <kprof.h>
+#include <mainbus.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include "opt-dumbvm.h"
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -62,37 +78,23 @@
  * Function for a thread that runs an arbitrary userlevel program by
  * name.
  *
- * Note: this cannot pass arguments to the program. You may wish to
- * change it so it can, because that will make testing much easier
- * in the future.
- *
- * It copies the program name because runprogram destroys the copy
- * it gets by passing it to vfs_open().
+ * The program gets the whole command line, itself included, as argv.
  */
 static
 void
 cmd_progthread(void *ptr, unsigned long nargs)
 {
 	char **args = ptr;
-	char progname[128];
 	int result;
 
 	KASSERT(nargs >= 1);
 
-	if (nargs > 2) {
-		kprintf("Warning: argument passing from menu not supported\n");
-	}
-
-	/* Hope we fit. */
-	KASSERT(strlen(args[0]) < sizeof(progname));
-
-	strcpy(progname, args[0]);
-
-	result = runprogram(progname);
+	result = runprogram(args[0], nargs, args);
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
-		return;
+		/* so the menu, waiting for us, hears about it */
+		proc__exit(_MKWAIT_EXIT(1));
 	}
 
 	/* NOTREACHED: runprogram only returns on error. */
@@ -101,20 +103,15 @@ cmd_progthread(void *ptr, unsigned long nargs)
 /*
  * Common code for cmd_prog and cmd_shell.
  *
- * Note that this does not wait for the subprogram to finish, but
- * returns immediately to the menu. This is usually not what you want,
- * so you should have it call your system-calls-assignment waitpid
- * code after forking.
- *
- * Also note that because the subprogram's thread uses the "args"
- * array and strings, until you do this a race condition exists
- * between that code and the menu input code.
+ * Waits for the program to finish, which also keeps the menu from
+ * reusing the "args" array and strings while the program's thread is
+ * still reading them.
  */
 static
 int
 common_prog(int nargs, char **args)
 {
-	struct proc *proc;
+	struct proc *proc, *child;
 	int result;
 
 	/* Create a process for the new program to run in. */
@@ -133,11 +130,18 @@ common_prog(int nargs, char **args)
 		return result;
 	}
 
-	/*
-	 * The new process will be destroyed when the program exits...
-	 * once you write the code for handling that.
-	 */
-
+	/* it stays around, as a zombie if need be, until reaped */
+	result = proc_wait(proc->p_pid, 0, &child);
+	if (result) {
+		kprintf("Waiting for %s failed: %s\n", args[0],
+			strerror(result));
+		return result;
+	}
+	if (WEXITSTATUS(child->p_exitstatus) != 0) {
+		kprintf("%s exited with status %d\n", args[0],
+			WEXITSTATUS(child->p_exitstatus));
+	}
+	proc_reap(child);
 	return 0;
 }
 
@@ -280,6 +284,7 @@ static const struct {
 } mounttable[] = {
 #if OPT_SFS
 	{ "sfs", sfs_mount },
+	{ "sfsdata", sfs_mount_datajournal },
 #endif
 };
 
@@ -290,9 +295,10 @@ cmd_mount(int nargs, char **args)
 	char *fstype;
 	char *device;
 	unsigned i;
+	int result;
 
-	if (nargs != 3) {
-		kprintf("Usage: mount fstype device:\n");
+	if (nargs != 3 && nargs != 4) {
+		kprintf("Usage: mount fstype device: [iosched]\n");
 		return EINVAL;
 	}
 
@@ -304,6 +310,16 @@ cmd_mount(int nargs, char **args)
 		device[strlen(device)-1] = 0;
 	}
 
+	if (nargs == 4) {
+		/* fifo, clook, or deadline; see iosched.h */
+		result = vfs_setiosched(device, args[3]);
+		if (result) {
+			kprintf("mount: iosched %s: %s\n", args[3],
+				strerror(result));
+			return result;
+		}
+	}
+
 	for (i=0; i<ARRAYCOUNT(mounttable); i++) {
 		if (!strcmp(mounttable[i].name, fstype)) {
 			return mounttable[i].func(device);
@@ -313,6 +329,41 @@ cmd_mount(int nargs, char **args)
 	return EINVAL;
 }
 
+static
+int
+cmd_raid(int nargs, char **args)
+{
+	unsigned level;
+	size_t len;
+	int i, result;
+
+	if (nargs < 5) {
+		kprintf("Usage: raid name level unit unit...\n");
+		return EINVAL;
+	}
+
+	level = atoi(args[2]);
+	if (strcmp(args[2], "0") && strcmp(args[2], "1")) {
+		kprintf("raid: level must be 0 or 1\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after the unit names */
+	for (i=3; i<nargs; i++) {
+		len = strlen(args[i]);
+		if (len > 0 && args[i][len-1] == ':') {
+			args[i][len-1] = 0;
+		}
+	}
+
+	result = devraid_create(args[1], level, nargs - 3,
+				(const char *const *)&args[3]);
+	if (result) {
+		kprintf("raid: %s\n", strerror(result));
+	}
+	return result;
+}
+
 static
 int
 cmd_unmount(int nargs, char **args)
@@ -334,6 +385,42 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command to give a mounted filesystem a share of the buffer cache.
+ */
+static
+int
+cmd_bufshare(int nargs, char **args)
+{
+	char *device;
+	int minpct, maxpct, result;
+
+	if (nargs != 4) {
+		kprintf("Usage: bufshare device: minpct maxpct\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	minpct = atoi(args[2]);
+	maxpct = atoi(args[3]);
+	if (minpct < 0 || maxpct < 0) {
+		kprintf("bufshare: Invalid share\n");
+		return EINVAL;
+	}
+
+	result = vfs_setbufshare(device, minpct, maxpct);
+	if (result) {
+		kprintf("bufshare: %s\n", strerror(result));
+	}
+	return result;
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -371,6 +458,8 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
+	reclaim_printstats();
 
 	return 0;
 }
@@ -404,21 +493,346 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printsites();
+
+	return 0;
+}
+
 static
 int
 cmd_bufstats(int nargs, char **args)
 {
 	if (nargs == 1) {
-		(void)args;
 		buffer_printstats();
 	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		buffer_resetstats();
+	}
 	else {
-		kprintf("Usage: buf\n");
+		kprintf("Usage: buf [reset]\n");
 	}
 
 	return 0;
 }
 
+static
+int
+cmd_ktrace(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		ktrace_setenabled(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		ktrace_setenabled(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "drain")) {
+		ktrace_drain();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "con")) {
+		return ktrace_setoutput(NULL);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "file")) {
+		result = ktrace_setoutput(args[2]);
+		if (result) {
+			kprintf("ktrace: %s: %s\n", args[2], strerror(result));
+		}
+		return result;
+	}
+	else {
+		kprintf("Usage: ktrace on | off | drain | con | file path\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_kevent(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 3 && !strcmp(args[1], "file")) {
+		result = kevent_start(args[2]);
+		if (result) {
+			kprintf("kevent: %s: %s\n", args[2], strerror(result));
+		}
+		return result;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kevent_stop();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "ltrace")) {
+		kevent_setltrace(!strcmp(args[2], "on"));
+	}
+	else {
+		kprintf("Usage: kevent file path | off | ltrace on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for the sampling profiler.
+ */
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprof_status();
+	}
+	else if (!strcmp(args[1], "on") &&
+		 (nargs == 2 || (nargs == 3 && !strcmp(args[2], "callers")))) {
+		result = kprof_start(nargs == 3);
+		if (result) {
+			kprintf("kprof: %s\n", strerror(result));
+		}
+		return result;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kprof_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kprof_reset();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "user") &&
+		 (!strcmp(args[2], "on") || !strcmp(args[2], "off"))) {
+		uprof_setnew(!strcmp(args[2], "on"));
+	}
+	else if (nargs <= 3 && !strcmp(args[1], "dump")) {
+		result = kprof_dump(nargs == 3 ? atoi(args[2]) : 0);
+		if (result) {
+			kprintf("kprof: %s\n", strerror(result));
+		}
+		return result;
+	}
+	else {
+		kprintf("Usage: kprof [on [callers] | off | reset | "
+			"dump [n] | user on|off]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_boottime(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	boot_printphases();
+	return 0;
+}
+
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		iostat_printall();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		iostat_resetall();
+	}
+	else {
+		kprintf("Usage: iostat [reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_jstats(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2) {
+		result = sfs_jstats(args[1], false);
+	}
+	else if (nargs == 3 && !strcmp(args[2], "reset")) {
+		result = sfs_jstats(args[1], true);
+	}
+	else {
+		kprintf("Usage: js device [reset]\n");
+		return EINVAL;
+	}
+	if (result) {
+		kprintf("js: %s: %s\n", args[1], strerror(result));
+	}
+
+	return result;
+}
+#endif
+
+static
+int
+cmd_ncachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_ncache_printstats();
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	swap_printstats();
+	pagecache_printstats();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_spinstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		spinlock_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		spinlock_resetstats();
+	}
+	else {
+		kprintf("Usage: spin [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_counters(int nargs, char **args)
+{
+	if (nargs == 1) {
+		pcpu_counter_printall();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		pcpu_counter_resetall();
+	}
+	else {
+		kprintf("Usage: counters [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_latency(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printlatency();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		thread_resetlatency();
+	}
+	else {
+		kprintf("Usage: lat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_sysstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		syscall_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		syscall_resetstats();
+	}
+	else {
+		kprintf("Usage: sysstat [reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_setenabled(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_setenabled(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		kprintf("Usage: lockstat [on|off|reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_irq(int nargs, char **args)
+{
+	if (nargs == 1) {
+		mainbus_irq_print();
+		return 0;
+	}
+	if (nargs == 2 && mainbus_irq_policy(args[1]) == 0) {
+		return 0;
+	}
+	if (nargs == 3 &&
+	    mainbus_irq_route(atoi(args[1]), atoi(args[2])) == 0) {
+		return 0;
+	}
+	kprintf("Usage: irq [boot | spread | follow | slot cpu]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	mmu_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -453,6 +867,8 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[bufshare] Share buffer cache       ",
+	"[raid]    Make a RAID over disks    ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -477,12 +893,19 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[at2] Large array test              ",
+	"[at3] Vector test                   ",
+	"[lt]  List test                     ",
+	"[ht]  Hash table test               ",
+	"[ht2] Concurrent hash table test    ",
 	"[bt]  Bitmap test                   ",
 	"[tlt] Threadlist test               ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmem_cache test               ",
+	"[mct] memcpy/memmove/memset test    ",
+	"[mcb] memcpy/memmove/memset bench   ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -494,13 +917,22 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
-	"[semu1-22] Semaphore unit tests     ",
+	"[sy5] RW lock test                  ",
+	"[sy6] Completion test               ",
+	"[wq]  Work queue test               ",
+	"[rcu] RCU test                      ",
+	"[pcpu] Per-cpu counter test         ",
+	"[fsh] False sharing benchmark       ",
+	"[kb]  Kernel microbenchmarks        ",
+	"[ipi] IPI function call test        ",
+	"[semu1-25] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fsbench] FS throughput benchmark   ",
 	NULL
 };
 
@@ -525,7 +957,29 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
-	"[buf] Print buffer cache stats      ",
+	"[khsites] Kernel heap use by caller ",
+	"[buf] Buffer cache stats [reset]    ",
+	"[iostat] Disk I/O stats [reset]     ",
+	"[boottime] Boot phase timings       ",
+	"[ktrace] Trace on/off/drain/con/file",
+	"[kevent] Event trace file/off/ltrace",
+	"[kprof] Profile on/off/reset/dump   ",
+#if OPT_SFS
+	"[js] SFS journal stats [reset]      ",
+#endif
+	"[nc] Directory name cache stats     ",
+	"[spin] Spinlock contention [reset]  ",
+	"[counters] Per-cpu counters [reset] ",
+	"[lat] Wakeup latency stats [reset]  ",
+	"[sysstat] Syscall stats [reset]     ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock stats on/off/reset  ",
+#endif
+	"[irq] Interrupt routing [policy]    ",
+	"[tlb] Print TLB miss/refill stats   ",
+#if !OPT_DUMBVM
+	"[vm] Print memory and swap stats    ",
+#endif
 #if OPT_SYNCHPROBS
     "[sp1] Elves                         ",
     "[sp2] Air Balloon                   ",
@@ -575,6 +1029,8 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "bufshare",	cmd_bufshare },
+	{ "raid",	cmd_raid },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -589,17 +1045,46 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khsites",    cmd_kheapsites },
 	{ "buf",        cmd_bufstats },
+	{ "iostat",     cmd_iostats },
+	{ "boottime",   cmd_boottime },
+	{ "ktrace",     cmd_ktrace },
+	{ "kevent",     cmd_kevent },
+	{ "kprof",      cmd_kprof },
+#if OPT_SFS
+	{ "js",         cmd_jstats },
+#endif
+	{ "nc",         cmd_ncachestats },
+	{ "spin",       cmd_spinstats },
+	{ "counters",   cmd_counters },
+	{ "lat",        cmd_latency },
+	{ "sysstat",    cmd_sysstat },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
+	{ "irq",        cmd_irq },
+	{ "tlb",        cmd_tlbstats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "at2",	arraytest2 },
+	{ "at3",	vectortest },
+	{ "lt",		listtest },
+	{ "ht",		hashtest },
+	{ "ht2",	hashtest2 },
 	{ "bt",		bitmaptest },
 	{ "tlt",	threadlisttest },
 	{ "km1",	kmalloctest },
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "mct",	memtest },
+	{ "mcb",	membench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -613,6 +1098,14 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	cmtest },
+	{ "wq",		wqtest },
+	{ "rcu",	rcutest },
+	{ "pcpu",	pcputest },
+	{ "fsh",	fsharetest },
+	{ "kb",		kbench },
+	{ "ipi",	ipitest },
 #if OPT_SYNCHPROBS
     { "sp1",    elves },
     { "sp2",    airballoon },
@@ -641,6 +1134,9 @@ static struct {
 	{ "semu20",	semu20 },
 	{ "semu21",	semu21 },
 	{ "semu22",	semu22 },
+	{ "semu23",	semu23 },
+	{ "semu24",	semu24 },
+	{ "semu25",	semu25 },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
@@ -649,6 +1145,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fsbench",	fsbench },
 
 	{ NULL, NULL }
 };
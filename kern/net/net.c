@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Network interfaces and the packet buffer pool. See net.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <wchan.h>
+#include <net.h>
+
+/* Most interfaces we keep track of */
+#define NET_MAXIFS	4
+
+/* The pool: an array allocated when the first interface attaches */
+static struct spinlock pbuf_lock = SPINLOCK_INITIALIZER;
+static struct pbuf *pbuf_pool;
+static struct pbufq pbuf_free;
+static struct wchan *pbuf_wchan;	/* for pbuf_getwait */
+static unsigned pbuf_waiters;
+
+static struct spinlock netif_listlock = SPINLOCK_INITIALIZER;
+static struct netif *netifs[NET_MAXIFS];
+static unsigned netif_count;
+
+////////////////////////////////////////////////////////////
+// pbuf queues
+
+void
+pbufq_init(struct pbufq *q)
+{
+	q->pq_head = q->pq_tail = NULL;
+	q->pq_count = 0;
+}
+
+void
+pbufq_append(struct pbufq *q, struct pbuf *pb)
+{
+	pb->pb_next = NULL;
+	if (q->pq_tail == NULL) {
+		q->pq_head = pb;
+	}
+	else {
+		q->pq_tail->pb_next = pb;
+	}
+	q->pq_tail = pb;
+	q->pq_count++;
+}
+
+struct pbuf *
+pbufq_remhead(struct pbufq *q)
+{
+	struct pbuf *pb;
+
+	pb = q->pq_head;
+	if (pb != NULL) {
+		q->pq_head = pb->pb_next;
+		if (q->pq_head == NULL) {
+			q->pq_tail = NULL;
+		}
+		pb->pb_next = NULL;
+		q->pq_count--;
+	}
+	return pb;
+}
+
+/*
+ * Move all of FROM to the end of Q.
+ */
+void
+pbufq_concat(struct pbufq *q, struct pbufq *from)
+{
+	if (from->pq_head == NULL) {
+		return;
+	}
+	if (q->pq_tail == NULL) {
+		q->pq_head = from->pq_head;
+	}
+	else {
+		q->pq_tail->pb_next = from->pq_head;
+	}
+	q->pq_tail = from->pq_tail;
+	q->pq_count += from->pq_count;
+	pbufq_init(from);
+}
+
+////////////////////////////////////////////////////////////
+// the pool
+
+/*
+ * Allocate the pool. Called during autoconf, from the first
+ * netif_attach, so no locking is needed against other callers; we
+ * take the lock anyway for the benefit of pbuf_get in an early
+ * interrupt.
+ */
+static
+int
+pbuf_bootstrap(void)
+{
+	struct pbuf *pool;
+	unsigned i;
+
+	pool = kmalloc(PBUF_NBUFS * sizeof(*pool));
+	if (pool == NULL) {
+		return ENOMEM;
+	}
+	pbuf_wchan = wchan_create("pbufs");
+	if (pbuf_wchan == NULL) {
+		kfree(pool);
+		return ENOMEM;
+	}
+	spinlock_acquire(&pbuf_lock);
+	pbufq_init(&pbuf_free);
+	for (i=0; i<PBUF_NBUFS; i++) {
+		pbufq_append(&pbuf_free, &pool[i]);
+	}
+	pbuf_pool = pool;
+	spinlock_release(&pbuf_lock);
+	return 0;
+}
+
+/*
+ * Set up a pbuf fresh from the pool.
+ */
+static
+struct pbuf *
+pbuf_reset(struct pbuf *pb)
+{
+	if (pb != NULL) {
+		pb->pb_off = PBUF_HEADROOM;
+		pb->pb_len = 0;
+		pb->pb_linksrc = pb->pb_linkdst = 0;
+	}
+	return pb;
+}
+
+struct pbuf *
+pbuf_get(void)
+{
+	struct pbuf *pb;
+
+	spinlock_acquire(&pbuf_lock);
+	pb = pbufq_remhead(&pbuf_free);
+	spinlock_release(&pbuf_lock);
+
+	return pbuf_reset(pb);
+}
+
+/*
+ * Like pbuf_get, but wait for one instead of failing. Not for use in
+ * interrupt handlers.
+ */
+struct pbuf *
+pbuf_getwait(void)
+{
+	struct pbuf *pb;
+
+	spinlock_acquire(&pbuf_lock);
+	while (pbuf_free.pq_head == NULL) {
+		pbuf_waiters++;
+		wchan_sleep(pbuf_wchan, &pbuf_lock);
+		pbuf_waiters--;
+	}
+	pb = pbufq_remhead(&pbuf_free);
+	spinlock_release(&pbuf_lock);
+
+	return pbuf_reset(pb);
+}
+
+void
+pbuf_put(struct pbuf *pb)
+{
+	KASSERT(pb >= pbuf_pool && pb < pbuf_pool + PBUF_NBUFS);
+
+	spinlock_acquire(&pbuf_lock);
+	pbufq_append(&pbuf_free, pb);
+	if (pbuf_waiters > 0) {
+		wchan_wakeone(pbuf_wchan, &pbuf_lock);
+	}
+	spinlock_release(&pbuf_lock);
+}
+
+/*
+ * Return a whole queue at once.
+ */
+void
+pbuf_putq(struct pbufq *q)
+{
+	spinlock_acquire(&pbuf_lock);
+	pbufq_concat(&pbuf_free, q);
+	if (pbuf_waiters > 0) {
+		wchan_wakeall(pbuf_wchan, &pbuf_lock);
+	}
+	spinlock_release(&pbuf_lock);
+}
+
+unsigned
+pbuf_navail(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&pbuf_lock);
+	ret = pbuf_free.pq_count;
+	spinlock_release(&pbuf_lock);
+	return ret;
+}
+
+void *
+pbuf_prepend(struct pbuf *pb, unsigned len)
+{
+	if (len > pb->pb_off) {
+		return NULL;
+	}
+	pb->pb_off -= len;
+	pb->pb_len += len;
+	return PBUF_DATA(pb);
+}
+
+void
+pbuf_adj(struct pbuf *pb, unsigned len)
+{
+	KASSERT(len <= pb->pb_len);
+	pb->pb_off += len;
+	pb->pb_len -= len;
+}
+
+////////////////////////////////////////////////////////////
+// interfaces
+
+int
+netif_attach(struct netif *ni)
+{
+	int result;
+
+	KASSERT(ni->ni_output != NULL);
+
+	if (pbuf_pool == NULL) {
+		result = pbuf_bootstrap();
+		if (result) {
+			return result;
+		}
+	}
+
+	ni->ni_rxwchan = wchan_create(ni->ni_name);
+	if (ni->ni_rxwchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&ni->ni_lock);
+	pbufq_init(&ni->ni_rxq);
+	ni->ni_rxbatches = 0;
+	ni->ni_ipackets = ni->ni_ibytes = 0;
+	ni->ni_idrops = ni->ni_ierrors = 0;
+	ni->ni_opackets = ni->ni_obytes = ni->ni_odrops = 0;
+
+	spinlock_acquire(&netif_listlock);
+	if (netif_count == NET_MAXIFS) {
+		spinlock_release(&netif_listlock);
+		wchan_destroy(ni->ni_rxwchan);
+		return ENOSPC;
+	}
+	netifs[netif_count++] = ni;
+	spinlock_release(&netif_listlock);
+	return 0;
+}
+
+struct netif *
+netif_get(unsigned index)
+{
+	struct netif *ni;
+
+	spinlock_acquire(&netif_listlock);
+	ni = index < netif_count ? netifs[index] : NULL;
+	spinlock_release(&netif_listlock);
+	return ni;
+}
+
+/*
+ * A packet arrived. Datagrams go to their sockets; anything else is
+ * queued here, and wakes the receivers if it's the first of a batch.
+ * A receiver that's already awake will pick it up with the rest. A
+ * NULL PB means the driver couldn't get a pbuf and dropped the frame.
+ */
+void
+netif_input(struct netif *ni, struct pbuf *pb)
+{
+	unsigned len;
+
+	if (pb != NULL) {
+		len = pb->pb_len;
+		if (socket_input(ni, pb)) {
+			spinlock_acquire(&ni->ni_lock);
+			ni->ni_ipackets++;
+			ni->ni_ibytes += len;
+			spinlock_release(&ni->ni_lock);
+			return;
+		}
+	}
+
+	spinlock_acquire(&ni->ni_lock);
+	if (pb == NULL) {
+		ni->ni_idrops++;
+	}
+	else if (ni->ni_rxq.pq_count >= NETIF_RXQMAX) {
+		ni->ni_idrops++;
+		spinlock_release(&ni->ni_lock);
+		pbuf_put(pb);
+		return;
+	}
+	else {
+		ni->ni_ipackets++;
+		ni->ni_ibytes += pb->pb_len;
+		pbufq_append(&ni->ni_rxq, pb);
+		if (ni->ni_rxq.pq_count == 1) {
+			ni->ni_rxbatches++;
+			wchan_wakeall(ni->ni_rxwchan, &ni->ni_lock);
+		}
+	}
+	spinlock_release(&ni->ni_lock);
+}
+
+void
+netif_inerror(struct netif *ni)
+{
+	spinlock_acquire(&ni->ni_lock);
+	ni->ni_ierrors++;
+	spinlock_release(&ni->ni_lock);
+}
+
+int
+netif_output(struct netif *ni, struct pbuf *pb, uint16_t dst)
+{
+	unsigned len;
+	int result;
+
+	len = pb->pb_len;
+	if (len > ni->ni_mtu) {
+		pbuf_put(pb);
+		return EMSGSIZE;
+	}
+	pb->pb_linksrc = ni->ni_hwaddr;
+	pb->pb_linkdst = dst;
+
+	result = ni->ni_output(ni, pb);
+
+	spinlock_acquire(&ni->ni_lock);
+	if (result) {
+		ni->ni_odrops++;
+	}
+	else {
+		ni->ni_opackets++;
+		ni->ni_obytes += len;
+	}
+	spinlock_release(&ni->ni_lock);
+	return result;
+}
+
+int
+netif_recvbatch(struct netif *ni, struct pbufq *q, bool wait,
+		uint64_t nsecs)
+{
+	int result = 0;
+
+	spinlock_acquire(&ni->ni_lock);
+	while (ni->ni_rxq.pq_head == NULL) {
+		if (!wait) {
+			result = EAGAIN;
+			break;
+		}
+		if (nsecs == 0) {
+			wchan_sleep(ni->ni_rxwchan, &ni->ni_lock);
+		}
+		else if (wchan_sleep_timeout(ni->ni_rxwchan, &ni->ni_lock,
+					       nsecs)) {
+			if (ni->ni_rxq.pq_head == NULL) {
+				result = ETIMEDOUT;
+			}
+			break;
+		}
+	}
+	pbufq_concat(q, &ni->ni_rxq);
+	spinlock_release(&ni->ni_lock);
+	return result;
+}
+
+void
+netif_printall(void)
+{
+	struct netif *ni;
+	uint64_t in[4], out[3];
+	unsigned i, queued, batches;
+
+	for (i=0; (ni = netif_get(i)) != NULL; i++) {
+		/* copy the counters so as not to print under the lock */
+		spinlock_acquire(&ni->ni_lock);
+		queued = ni->ni_rxq.pq_count;
+		batches = ni->ni_rxbatches;
+		in[0] = ni->ni_ipackets;
+		in[1] = ni->ni_ibytes;
+		in[2] = ni->ni_idrops;
+		in[3] = ni->ni_ierrors;
+		out[0] = ni->ni_opackets;
+		out[1] = ni->ni_obytes;
+		out[2] = ni->ni_odrops;
+		spinlock_release(&ni->ni_lock);
+
+		kprintf("%s: address 0x%04x, mtu %u, %u queued, "
+			"%u rx batches\n", ni->ni_name, ni->ni_hwaddr,
+			ni->ni_mtu, queued, batches);
+		kprintf("    in %llu packets %llu bytes, "
+			"%llu dropped, %llu errors\n",
+			(unsigned long long)in[0], (unsigned long long)in[1],
+			(unsigned long long)in[2], (unsigned long long)in[3]);
+		kprintf("    out %llu packets %llu bytes, %llu dropped\n",
+			(unsigned long long)out[0], (unsigned long long)out[1],
+			(unsigned long long)out[2]);
+	}
+	kprintf("pbufs: %u of %u free\n", pbuf_navail(), PBUF_NBUFS);
+}
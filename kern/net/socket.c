@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Datagram sockets over the sys161 network. See net.h.
+ *
+ * Bound sockets are hashed by port. Datagrams are delivered in the
+ * interrupt handler, straight onto the socket's ring of pbufs, so the
+ * hash and the rings are under spinlocks: sock_portlock for the hash
+ * and each socket's binding, then so_lock for its ring and
+ * connection. A datagram that finds the ring full is dropped, as is
+ * one for a port nobody has bound.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/socket.h>
+#include <stat.h>
+#include <lib.h>
+#include <endian.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <net.h>
+
+/* Datagrams a socket holds before it drops them; a power of 2 */
+#define SOCK_RING	8
+
+/* Buckets in the port hash */
+#define SOCK_NHASH	32
+
+/* Where ports handed out by bind(0) (or an unbound send) start */
+#define SOCK_EPHEMERAL	49152
+
+/*
+ * Header at the front of each datagram, in network byte order, after
+ * the link header. dh_len is the length of the data after it.
+ */
+struct dgram_header {
+	uint16_t dh_magic;		/* DGRAM_MAGIC */
+	uint16_t dh_srcport;
+	uint16_t dh_dstport;
+	uint16_t dh_len;
+};
+#define DGRAM_MAGIC	0x5544
+
+struct socket {
+	struct vnode so_vn;
+	struct socket *so_hashnext;	/* in sock_hash[], if bound */
+	uint16_t so_port;		/* 0 if unbound */
+
+	struct spinlock so_lock;	/* protects the rest */
+	bool so_connected;
+	uint16_t so_peeraddr;
+	uint16_t so_peerport;
+	struct pbuf *so_ring[SOCK_RING];
+	unsigned so_head;		/* oldest datagram in so_ring */
+	unsigned so_count;
+	unsigned so_drops;		/* ring was full */
+	struct wchan *so_wchan;		/* readers waiting for data */
+};
+
+static const struct vnode_ops socket_vnode_ops;
+
+static struct spinlock sock_portlock = SPINLOCK_INITIALIZER;
+static struct socket *sock_hash[SOCK_NHASH];
+static uint16_t sock_nextport = SOCK_EPHEMERAL;
+
+/*
+ * The socket for a vnode, or NULL if it isn't one.
+ */
+static
+struct socket *
+socket_get(struct vnode *vn)
+{
+	return vn->vn_ops == &socket_vnode_ops ? vn->vn_data : NULL;
+}
+
+/*
+ * Find the socket bound to PORT. Called with sock_portlock held.
+ */
+static
+struct socket *
+socket_lookup(uint16_t port)
+{
+	struct socket *so;
+
+	for (so = sock_hash[port % SOCK_NHASH]; so != NULL;
+	     so = so->so_hashnext) {
+		if (so->so_port == port) {
+			return so;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Bind SO to PORT, or, if PORT is 0, to the next free ephemeral port.
+ */
+static
+int
+socket_dobind(struct socket *so, uint16_t port)
+{
+	unsigned tries;
+
+	spinlock_acquire(&sock_portlock);
+	if (so->so_port != 0) {
+		spinlock_release(&sock_portlock);
+		return EINVAL;
+	}
+	if (port == 0) {
+		for (tries = 0; tries <= 0xffff - SOCK_EPHEMERAL; tries++) {
+			port = sock_nextport;
+			sock_nextport = port == 0xffff ? SOCK_EPHEMERAL :
+				port + 1;
+			if (socket_lookup(port) == NULL) {
+				break;
+			}
+		}
+	}
+	if (socket_lookup(port) != NULL) {
+		spinlock_release(&sock_portlock);
+		return EADDRINUSE;
+	}
+	so->so_port = port;
+	so->so_hashnext = sock_hash[port % SOCK_NHASH];
+	sock_hash[port % SOCK_NHASH] = so;
+	spinlock_release(&sock_portlock);
+	return 0;
+}
+
+static
+int
+socket_checkaddr(const struct sockaddr_ln *addr)
+{
+	if (addr->sln_family != AF_LNET) {
+		return EAFNOSUPPORT;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// creation and destruction
+
+int
+socket_create(struct vnode **ret)
+{
+	struct socket *so;
+	int result;
+
+	if (netif_get(0) == NULL) {
+		return ENETDOWN;
+	}
+
+	so = kmalloc(sizeof(*so));
+	if (so == NULL) {
+		return ENOMEM;
+	}
+	so->so_wchan = wchan_create("socket");
+	if (so->so_wchan == NULL) {
+		kfree(so);
+		return ENOMEM;
+	}
+	so->so_hashnext = NULL;
+	so->so_port = 0;
+	spinlock_init(&so->so_lock);
+	so->so_connected = false;
+	so->so_peeraddr = so->so_peerport = 0;
+	so->so_head = so->so_count = 0;
+	so->so_drops = 0;
+
+	result = vnode_init(&so->so_vn, &socket_vnode_ops, NULL, so);
+	KASSERT(result == 0);
+
+	*ret = &so->so_vn;
+	return 0;
+}
+
+/*
+ * Last close. Once we're out of the hash, the interrupt handler can't
+ * find us, so whatever is on the ring stays there to be freed.
+ */
+static
+int
+socket_reclaim(struct vnode *vn)
+{
+	struct socket *so = vn->vn_data;
+	struct socket **pp;
+
+	vnode_cleanup(vn);
+
+	spinlock_acquire(&sock_portlock);
+	if (so->so_port != 0) {
+		pp = &sock_hash[so->so_port % SOCK_NHASH];
+		while (*pp != so) {
+			pp = &(*pp)->so_hashnext;
+		}
+		*pp = so->so_hashnext;
+	}
+	spinlock_release(&sock_portlock);
+
+	while (so->so_count > 0) {
+		pbuf_put(so->so_ring[so->so_head]);
+		so->so_head = (so->so_head + 1) % SOCK_RING;
+		so->so_count--;
+	}
+	wchan_destroy(so->so_wchan);
+	spinlock_cleanup(&so->so_lock);
+	kfree(so);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// addresses
+
+int
+socket_bind(struct vnode *vn, const struct sockaddr_ln *addr)
+{
+	struct socket *so = socket_get(vn);
+	int result;
+
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	result = socket_checkaddr(addr);
+	if (result) {
+		return result;
+	}
+	return socket_dobind(so, addr->sln_port);
+}
+
+int
+socket_connect(struct vnode *vn, const struct sockaddr_ln *addr)
+{
+	struct socket *so = socket_get(vn);
+	int result;
+
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	result = socket_checkaddr(addr);
+	if (result) {
+		return result;
+	}
+	if (addr->sln_port == 0) {
+		return EADDRNOTAVAIL;
+	}
+	if (so->so_port == 0) {
+		result = socket_dobind(so, 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	spinlock_acquire(&so->so_lock);
+	so->so_connected = true;
+	so->so_peeraddr = addr->sln_addr;
+	so->so_peerport = addr->sln_port;
+	spinlock_release(&so->so_lock);
+	return 0;
+}
+
+int
+socket_getname(struct vnode *vn, struct sockaddr_ln *addr)
+{
+	struct socket *so = socket_get(vn);
+
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	bzero(addr, sizeof(*addr));
+	addr->sln_len = sizeof(*addr);
+	addr->sln_family = AF_LNET;
+	addr->sln_port = so->so_port;
+	addr->sln_addr = netif_get(0)->ni_hwaddr;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+int
+socket_sendto(struct vnode *vn, struct uio *uio, int flags,
+	      const struct sockaddr_ln *to)
+{
+	struct socket *so = socket_get(vn);
+	struct netif *ni = netif_get(0);
+	struct dgram_header *dh;
+	struct pbuf *pb;
+	uint16_t addr, port;
+	size_t len;
+	int result;
+
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+
+	spinlock_acquire(&so->so_lock);
+	if (to != NULL && so->so_connected) {
+		spinlock_release(&so->so_lock);
+		return EISCONN;
+	}
+	if (to == NULL && !so->so_connected) {
+		spinlock_release(&so->so_lock);
+		return ENOTCONN;
+	}
+	addr = to != NULL ? to->sln_addr : so->so_peeraddr;
+	port = to != NULL ? to->sln_port : so->so_peerport;
+	spinlock_release(&so->so_lock);
+
+	if (to != NULL) {
+		result = socket_checkaddr(to);
+		if (result) {
+			return result;
+		}
+	}
+	len = uio->uio_resid;
+	if (len > ni->ni_mtu - sizeof(*dh)) {
+		return EMSGSIZE;
+	}
+	if (so->so_port == 0) {
+		result = socket_dobind(so, 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (flags & MSG_DONTWAIT) {
+		pb = pbuf_get();
+		if (pb == NULL) {
+			return EAGAIN;
+		}
+	}
+	else {
+		pb = pbuf_getwait();
+	}
+
+	/* The one copy on the way out: from the caller into the pbuf */
+	result = uiomove(PBUF_DATA(pb), len, uio);
+	if (result) {
+		pbuf_put(pb);
+		return result;
+	}
+	pb->pb_len = len;
+
+	dh = pbuf_prepend(pb, sizeof(*dh));
+	KASSERT(dh != NULL);
+	dh->dh_magic = htons(DGRAM_MAGIC);
+	dh->dh_srcport = htons(so->so_port);
+	dh->dh_dstport = htons(port);
+	dh->dh_len = htons(len);
+
+	/* EAGAIN here means the card's queue is full */
+	return netif_output(ni, pb, addr);
+}
+
+int
+socket_recvfrom(struct vnode *vn, struct uio *uio, int flags,
+		struct sockaddr_ln *from)
+{
+	struct socket *so = socket_get(vn);
+	struct dgram_header *dh;
+	struct pbuf *pb;
+	size_t len;
+	int result;
+
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	if (so->so_port == 0) {
+		/* nothing could ever arrive */
+		return ENOTCONN;
+	}
+
+	spinlock_acquire(&so->so_lock);
+	while (so->so_count == 0) {
+		if (flags & MSG_DONTWAIT) {
+			spinlock_release(&so->so_lock);
+			return EAGAIN;
+		}
+		wchan_sleep(so->so_wchan, &so->so_lock);
+	}
+	pb = so->so_ring[so->so_head];
+	so->so_head = (so->so_head + 1) % SOCK_RING;
+	so->so_count--;
+	spinlock_release(&so->so_lock);
+
+	/* socket_input left the header on, for the sender's port */
+	dh = (struct dgram_header *)PBUF_DATA(pb);
+	if (from != NULL) {
+		bzero(from, sizeof(*from));
+		from->sln_len = sizeof(*from);
+		from->sln_family = AF_LNET;
+		from->sln_port = ntohs(dh->dh_srcport);
+		from->sln_addr = pb->pb_linksrc;
+	}
+	pbuf_adj(pb, sizeof(*dh));
+
+	/* The one copy on the way in: from the pbuf to the caller */
+	len = pb->pb_len < uio->uio_resid ? pb->pb_len : uio->uio_resid;
+	result = uiomove(PBUF_DATA(pb), len, uio);
+	pbuf_put(pb);
+	return result;
+}
+
+/*
+ * Deliver a frame from the interface, in its interrupt handler. We
+ * take anything that looks like a datagram, and drop it if there's
+ * no room for it.
+ */
+bool
+socket_input(struct netif *ni, struct pbuf *pb)
+{
+	struct dgram_header dh;
+	struct socket *so;
+	uint16_t srcport;
+	bool wanted;
+
+	(void)ni;
+
+	if (pb->pb_len < sizeof(dh)) {
+		return false;
+	}
+	memcpy(&dh, PBUF_DATA(pb), sizeof(dh));
+	if (ntohs(dh.dh_magic) != DGRAM_MAGIC ||
+	    ntohs(dh.dh_len) > pb->pb_len - sizeof(dh)) {
+		return false;
+	}
+	/* trim any padding the link added */
+	pb->pb_len = sizeof(dh) + ntohs(dh.dh_len);
+	srcport = ntohs(dh.dh_srcport);
+
+	spinlock_acquire(&sock_portlock);
+	so = socket_lookup(ntohs(dh.dh_dstport));
+	if (so == NULL) {
+		spinlock_release(&sock_portlock);
+		pbuf_put(pb);
+		return true;
+	}
+
+	spinlock_acquire(&so->so_lock);
+	if (so->so_connected) {
+		/* only take it from whoever we're connected to */
+		wanted = so->so_peerport == srcport &&
+			(so->so_peeraddr == pb->pb_linksrc ||
+			 so->so_peeraddr == NET_BROADCAST);
+	}
+	else {
+		wanted = true;
+	}
+	if (wanted && so->so_count == SOCK_RING) {
+		so->so_drops++;
+	}
+	else if (wanted) {
+		so->so_ring[(so->so_head + so->so_count) % SOCK_RING] = pb;
+		so->so_count++;
+		pb = NULL;
+		wchan_wakeone(so->so_wchan, &so->so_lock);
+	}
+	spinlock_release(&so->so_lock);
+	spinlock_release(&sock_portlock);
+
+	if (pb != NULL) {
+		pbuf_put(pb);
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// vnode operations
+
+static
+int
+socket_read(struct vnode *vn, struct uio *uio)
+{
+	return socket_recvfrom(vn, uio, 0, NULL);
+}
+
+static
+int
+socket_write(struct vnode *vn, struct uio *uio)
+{
+	return socket_sendto(vn, uio, 0, NULL);
+}
+
+static
+int
+socket_eachopen(struct vnode *vn, int openflags)
+{
+	/* Sockets don't have names, so there's no way to get here. */
+	(void)vn;
+	(void)openflags;
+	return EINVAL;
+}
+
+static
+int
+socket_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+socket_stat(struct vnode *vn, struct stat *st)
+{
+	struct socket *so = vn->vn_data;
+
+	bzero(st, sizeof(*st));
+	st->st_mode = S_IFSOCK | 0600;
+	st->st_nlink = 1;
+	st->st_blksize = PBUF_SIZE;
+
+	/* st_size is the number of datagrams waiting */
+	spinlock_acquire(&so->so_lock);
+	st->st_size = so->so_count;
+	spinlock_release(&so->so_lock);
+	return 0;
+}
+
+static
+int
+socket_gettype(struct vnode *vn, mode_t *ret)
+{
+	(void)vn;
+	*ret = S_IFSOCK;
+	return 0;
+}
+
+static
+bool
+socket_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return false;
+}
+
+static
+int
+socket_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+static
+int
+socket_truncate(struct vnode *vn, off_t len)
+{
+	(void)vn;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops socket_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = socket_eachopen,
+	.vop_reclaim = socket_reclaim,
+	.vop_read = socket_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
+	.vop_write = socket_write,
+	.vop_ioctl = socket_ioctl,
+	.vop_stat = socket_stat,
+	.vop_gettype = socket_gettype,
+	.vop_isseekable = socket_isseekable,
+	.vop_fsync = socket_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = socket_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_namefile = vopfail_uio_nosys,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Open files and file tables. See filetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vfs.h>
+#include <filetable.h>
+
+////////////////////////////////////////////////////////////
+// openfile
+
+int
+openfile_open(const char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct vnode *vn;
+	int result;
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		return result;
+	}
+	result = openfile_fromvnode(vn, flags, ret);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	return 0;
+}
+
+int
+openfile_fromvnode(struct vnode *vn, int flags, struct openfile **ret)
+{
+	struct openfile *of;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	of->of_vn = vn;
+	of->of_flags = flags;
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = of->of_refcount == 0;
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vn);
+		spinlock_cleanup(&of->of_reflock);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// filetable
+
+static
+bool
+filetable_okfd(int fd)
+{
+	return fd >= 0 && fd < OPEN_MAX;
+}
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	ft->ft_used = bitmap_create(OPEN_MAX);
+	if (ft->ft_used == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+	spinlock_init(&ft->ft_lock);
+	ft->ft_refcount = 1;
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	return ft;
+}
+
+void
+filetable_incref(struct filetable *ft)
+{
+	spinlock_acquire(&ft->ft_lock);
+	KASSERT(ft->ft_refcount > 0);
+	ft->ft_refcount++;
+	spinlock_release(&ft->ft_lock);
+}
+
+void
+filetable_decref(struct filetable *ft)
+{
+	unsigned i;
+	bool last;
+
+	spinlock_acquire(&ft->ft_lock);
+	KASSERT(ft->ft_refcount > 0);
+	ft->ft_refcount--;
+	last = ft->ft_refcount == 0;
+	spinlock_release(&ft->ft_lock);
+	if (!last) {
+		return;
+	}
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+		}
+	}
+	bitmap_destroy(ft->ft_used);
+	spinlock_cleanup(&ft->ft_lock);
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&src->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		if (src->ft_files[i] != NULL) {
+			openfile_incref(src->ft_files[i]);
+			ft->ft_files[i] = src->ft_files[i];
+			bitmap_mark(ft->ft_used, i);
+		}
+	}
+	spinlock_release(&src->ft_lock);
+
+	*ret = ft;
+	return 0;
+}
+
+int
+filetable_unshare(struct filetable **ftp)
+{
+	struct filetable *ft, *copy;
+	bool shared;
+	int result;
+
+	ft = *ftp;
+	spinlock_acquire(&ft->ft_lock);
+	shared = ft->ft_refcount > 1;
+	spinlock_release(&ft->ft_lock);
+
+	/*
+	 * If it's not shared now it can't become shared, because only
+	 * we can hand out references to it.
+	 */
+	if (!shared) {
+		return 0;
+	}
+
+	result = filetable_copy(ft, &copy);
+	if (result) {
+		return result;
+	}
+	*ftp = copy;
+	filetable_decref(ft);
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	unsigned ix;
+
+	spinlock_acquire(&ft->ft_lock);
+	if (bitmap_alloc(ft->ft_used, &ix)) {
+		spinlock_release(&ft->ft_lock);
+		return EMFILE;
+	}
+	KASSERT(ft->ft_files[ix] == NULL);
+	ft->ft_files[ix] = of;
+	spinlock_release(&ft->ft_lock);
+
+	*fd = ix;
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (!filetable_okfd(fd)) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	if (of == NULL) {
+		spinlock_release(&ft->ft_lock);
+		return EBADF;
+	}
+	openfile_incref(of);
+	spinlock_release(&ft->ft_lock);
+
+	*ret = of;
+	return 0;
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *of;
+
+	if (!filetable_okfd(fd)) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	if (of == NULL) {
+		spinlock_release(&ft->ft_lock);
+		return EBADF;
+	}
+	ft->ft_files[fd] = NULL;
+	bitmap_unmark(ft->ft_used, fd);
+	spinlock_release(&ft->ft_lock);
+
+	/* may close the vnode, so not under the spinlock */
+	openfile_decref(of);
+	return 0;
+}
+
+int
+filetable_dup2(struct filetable *ft, int oldfd, int newfd)
+{
+	struct openfile *of, *old;
+
+	if (!filetable_okfd(oldfd) || !filetable_okfd(newfd)) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[oldfd];
+	if (of == NULL) {
+		spinlock_release(&ft->ft_lock);
+		return EBADF;
+	}
+	if (oldfd == newfd) {
+		spinlock_release(&ft->ft_lock);
+		return 0;
+	}
+	openfile_incref(of);
+	old = ft->ft_files[newfd];
+	if (old == NULL) {
+		bitmap_mark(ft->ft_used, newfd);
+	}
+	ft->ft_files[newfd] = of;
+	spinlock_release(&ft->ft_lock);
+
+	if (old != NULL) {
+		openfile_decref(old);
+	}
+	return 0;
+}
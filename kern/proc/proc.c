@@ -38,22 +38,229 @@
  * things they point to. Rearrange this (and/or change it to be a
  * regular lock) as needed.
  *
- * Unless you're implementing multithreaded user processes, the only
- * process that will have more than one thread is the kernel process.
+ * User processes may have more than one thread (see lwp_create);
+ * p_nlive, p_exiting and p_singlewchan coordinate them leaving, and
+ * are protected by p_lock.
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <limits.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <vfs.h>
+#include <filetable.h>
+#include <synch.h>
+#include <kmemcache.h>
+#include <kprof.h>
+#include <copyinout.h>
+#include <syscall.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Cache of proc structures; p_lock is set up once per structure and
+ * kept across reuse.
+ */
+static struct kmem_cache *proc_cache;
+
+/*
+ * PIDs. The table has a slot per PID modulo PROC_NSLOTS, so looking
+ * one up is a single index; allocation goes round from the last PID
+ * handed out, skipping any whose slot is taken. So PIDs don't get
+ * reused quickly, but the system tops out at PROC_NSLOTS processes.
+ * The rest of a PID, PID / PROC_NSLOTS, is in effect a generation
+ * number for its slot: a stale PID finds the slot empty or holding a
+ * process with some other p_pid.
+ */
+#define PROC_NSLOTS	128
+
+static struct spinlock proc_tablelock = SPINLOCK_INITIALIZER;
+static struct proc *proc_table[PROC_NSLOTS];
+static pid_t proc_nextpid = PID_MIN;
+
+static
+pid_t
+proc_pidnext(pid_t pid)
+{
+	return pid == PID_MAX ? PID_MIN : pid + 1;
+}
+
+static
+int
+proc_allocpid(struct proc *proc)
+{
+	pid_t pid;
+	unsigned tries;
+
+	spinlock_acquire(&proc_tablelock);
+	pid = proc_nextpid;
+	for (tries = 0; tries < PROC_NSLOTS; tries++) {
+		if (proc_table[pid % PROC_NSLOTS] == NULL) {
+			proc_table[pid % PROC_NSLOTS] = proc;
+			proc->p_pid = pid;
+			proc_nextpid = proc_pidnext(pid);
+			spinlock_release(&proc_tablelock);
+			return 0;
+		}
+		pid = proc_pidnext(pid);
+	}
+	spinlock_release(&proc_tablelock);
+	return ENPROC;
+}
+
+/*
+ * Find process PID, or the current process for PID 0. The caller
+ * holds the table lock, and the process can't be freed until it's
+ * let go.
+ */
+static
+struct proc *
+proc_findpid(pid_t pid)
+{
+	struct proc *p;
+
+	KASSERT(spinlock_do_i_hold(&proc_tablelock));
+
+	if (pid == 0) {
+		return curproc;
+	}
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	p = proc_table[pid % PROC_NSLOTS];
+	if (p == NULL || p->p_pid != pid) {
+		return NULL;
+	}
+	return p;
+}
+
+static
+void
+proc_freepid(struct proc *proc)
+{
+	spinlock_acquire(&proc_tablelock);
+	KASSERT(proc_table[proc->p_pid % PROC_NSLOTS] == proc);
+	proc_table[proc->p_pid % PROC_NSLOTS] = NULL;
+	spinlock_release(&proc_tablelock);
+}
+
+/*
+ * Parents and children. Each process has a list of its children, and
+ * one sleep lock covers all the family links and exit statuses, so
+ * that exit, orphaning, and waitpid don't race each other. It's only
+ * held briefly, and nothing done under it looks at any process but
+ * the ones directly involved: waitpid finds the child through the PID
+ * table and sleeps on the child's own CV, and exit walks only its own
+ * children. So none of it costs more with more processes around.
+ */
+static struct lock *proc_waitlock;
+
+static
+void
+proc_link(struct proc *parent, struct proc *child)
+{
+	KASSERT(lock_do_i_hold(proc_waitlock));
+	KASSERT(child->p_parent == NULL);
+
+	child->p_parent = parent;
+	child->p_prevsib = NULL;
+	child->p_nextsib = parent->p_children;
+	if (parent->p_children != NULL) {
+		parent->p_children->p_prevsib = child;
+	}
+	parent->p_children = child;
+}
+
+static
+void
+proc_unlink(struct proc *child)
+{
+	KASSERT(lock_do_i_hold(proc_waitlock));
+	KASSERT(child->p_parent != NULL);
+
+	if (child->p_prevsib != NULL) {
+		child->p_prevsib->p_nextsib = child->p_nextsib;
+	}
+	else {
+		child->p_parent->p_children = child->p_nextsib;
+	}
+	if (child->p_nextsib != NULL) {
+		child->p_nextsib->p_prevsib = child->p_prevsib;
+	}
+	child->p_parent = NULL;
+	child->p_nextsib = child->p_prevsib = NULL;
+}
+
+/*
+ * Find the current process's child PID. Its fields are only looked at
+ * under the table lock, as any process but our own child might be
+ * freed as soon as we let go.
+ */
+static
+int
+proc_getchild(pid_t pid, struct proc **ret)
+{
+	struct proc *p;
+	int result;
+
+	KASSERT(lock_do_i_hold(proc_waitlock));
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return ESRCH;
+	}
+
+	spinlock_acquire(&proc_tablelock);
+	p = proc_table[pid % PROC_NSLOTS];
+	if (p == NULL || p->p_pid != pid) {
+		result = ESRCH;
+	}
+	else if (p->p_parent != curproc) {
+		result = ECHILD;
+	}
+	else {
+		*ret = p;
+		result = 0;
+	}
+	spinlock_release(&proc_tablelock);
+	return result;
+}
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_exitcv = cv_create("exit");
+	if (proc->p_exitcv == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&proc->p_lock);
+	wchan_init(&proc->p_singlewchan, "single");
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	wchan_cleanup(&proc->p_singlewchan);
+	spinlock_cleanup(&proc->p_lock);
+	cv_destroy(proc->p_exitcv);
+}
+
 /*
  * Create a proc structure.
  */
@@ -63,61 +270,75 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
+	proc->p_pid = 0;
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
+	proc->p_nlive = 1;
+	proc->p_exiting = false;
+	proc->p_nice = 0;
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_cusage, sizeof(proc->p_cusage));
+
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_nextsib = NULL;
+	proc->p_prevsib = NULL;
+	proc->p_exited = false;
+	proc->p_exitstatus = 0;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vforkdone = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	proc->p_filetable = NULL;
+
+	proc->p_uprof = NULL;
 
 	return proc;
 }
 
 /*
- * Destroy a proc structure.
- *
- * Note: nothing currently calls this. Your wait/exit code will
- * probably want to do so.
+ * Let go of everything a process holds besides the proc structure
+ * itself: files, current directory, and address space. Done at exit,
+ * so that zombies waiting to be reaped cost next to nothing, and again
+ * (harmlessly) by proc_destroy.
  */
+static
 void
-proc_destroy(struct proc *proc)
+proc_cleanup(struct proc *proc)
 {
-	/*
-	 * You probably want to destroy and null out much of the
-	 * process (particularly the address space) at exit time if
-	 * your wait/exit design calls for the process structure to
-	 * hang around beyond process exit. Some wait/exit designs
-	 * do, some don't.
-	 */
-
-	KASSERT(proc != NULL);
-	KASSERT(proc != kproc);
-
-	/*
-	 * We don't take p_lock in here because we must have the only
-	 * reference to this structure. (Otherwise it would be
-	 * incorrect to destroy it.)
-	 */
+	/* Profile, if any; at exit, this prints it */
+	uprof_detach(proc, true);
 
 	/* VFS fields */
+	if (proc->p_filetable) {
+		filetable_decref(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
 
 	/* VM fields */
+	if (proc->p_vforkdone != NULL) {
+		/* it isn't ours to destroy */
+		spinlock_acquire(&proc->p_lock);
+		proc->p_addrspace = NULL;
+		spinlock_release(&proc->p_lock);
+		proc_vfork_release(proc);
+	}
 	if (proc->p_addrspace) {
 		/*
 		 * If p is the current process, remove it safely from
@@ -164,12 +385,43 @@ proc_destroy(struct proc *proc)
 		}
 		as_destroy(as);
 	}
+}
+
+/*
+ * Destroy a proc structure.
+ *
+ * Called by the parent on reaping a zombie, at exit for processes
+ * nobody will wait for, and to clean up after a failed fork.
+ */
+void
+proc_destroy(struct proc *proc)
+{
+	KASSERT(proc != NULL);
+	KASSERT(proc != kproc);
+
+	/*
+	 * We don't take p_lock in here because we must have the only
+	 * reference to this structure. (Otherwise it would be
+	 * incorrect to destroy it.)
+	 */
+
+	proc_cleanup(proc);
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(proc->p_children == NULL);
 
+	if (proc->p_parent != NULL) {
+		/* a failed fork; nobody else knows about it */
+		lock_acquire(proc_waitlock);
+		proc_unlink(proc);
+		lock_release(proc_waitlock);
+	}
+
+	if (proc->p_pid != 0) {
+		proc_freepid(proc);
+	}
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -178,6 +430,16 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: kmem_cache_create failed\n");
+	}
+	proc_waitlock = lock_create("proc wait");
+	if (proc_waitlock == NULL) {
+		panic("proc_bootstrap: lock_create failed\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -199,6 +461,10 @@ proc_create_runprogram(const char *name)
 	if (newproc == NULL) {
 		return NULL;
 	}
+	if (proc_allocpid(newproc)) {
+		proc_destroy(newproc);
+		return NULL;
+	}
 
 	/* VM fields */
 
@@ -206,42 +472,397 @@ proc_create_runprogram(const char *name)
 
 	/* VFS fields */
 
+	newproc->p_filetable = filetable_create();
+	if (newproc->p_filetable == NULL) {
+		proc_destroy(newproc);
+		return NULL;
+	}
+
 	/*
 	 * Lock the current process to copy its current directory.
 	 * (We don't need to lock the new process, though, as we have
-	 * the only reference to it.)
+	 * the only reference to it.) That may be the bootfs, if it
+	 * hasn't been looked up yet.
 	 */
+	vfs_bindbootfs();
 	spinlock_acquire(&curproc->p_lock);
+	newproc->p_nice = curproc->p_nice;
 	if (curproc->p_cwd != NULL) {
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
 	spinlock_release(&curproc->p_lock);
 
+	if (uprof_getnew() && uprof_attach(newproc)) {
+		proc_destroy(newproc);
+		return NULL;
+	}
+
+	/* The menu can wait for it like any other parent. */
+	lock_acquire(proc_waitlock);
+	proc_link(curproc, newproc);
+	lock_release(proc_waitlock);
+
 	return newproc;
 }
 
+int
+proc_fork(struct proc **ret)
+{
+	struct proc *newproc;
+	int result;
+
+	KASSERT(curproc != kproc);
+
+	newproc = proc_create(curproc->p_name);
+	if (newproc == NULL) {
+		return ENOMEM;
+	}
+	result = proc_allocpid(newproc);
+	if (result) {
+		proc_destroy(newproc);
+		return result;
+	}
+
+	/*
+	 * Only we can change our own table, so no lock for this. But a
+	 * process with other threads must keep owning its table
+	 * outright, as they'd have nothing to unshare it with, so then
+	 * the child gets a copy. (If we're the only thread, nobody can
+	 * add another until we're done here.)
+	 */
+	if (curproc->p_numthreads > 1) {
+		result = filetable_copy(curproc->p_filetable,
+					&newproc->p_filetable);
+		if (result) {
+			proc_destroy(newproc);
+			return result;
+		}
+	}
+	else {
+		filetable_incref(curproc->p_filetable);
+		newproc->p_filetable = curproc->p_filetable;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	newproc->p_nice = curproc->p_nice;
+	if (curproc->p_cwd != NULL) {
+		VOP_INCREF(curproc->p_cwd);
+		newproc->p_cwd = curproc->p_cwd;
+	}
+	spinlock_release(&curproc->p_lock);
+
+	if (curproc->p_uprof != NULL) {
+		result = uprof_attach(newproc);
+		if (result) {
+			proc_destroy(newproc);
+			return result;
+		}
+	}
+
+	lock_acquire(proc_waitlock);
+	proc_link(curproc, newproc);
+	lock_release(proc_waitlock);
+
+	*ret = newproc;
+	return 0;
+}
+
+void
+proc_vfork_release(struct proc *proc)
+{
+	struct semaphore *done;
+
+	spinlock_acquire(&proc->p_lock);
+	KASSERT(proc->p_vforkdone != NULL);
+	done = proc->p_vforkdone;
+	proc->p_vforkdone = NULL;
+	spinlock_release(&proc->p_lock);
+
+	V(done);
+}
+
 /*
  * Make the current process exit.
+ *
+ * Everything but the proc structure goes right away. Children are
+ * orphaned, and any that have already exited are destroyed, since
+ * nobody can wait for them now. Then, if we have a parent, we become
+ * a zombie holding STATUS until it waits for us; otherwise we're
+ * destroyed too.
  */
 void
 proc__exit(int status)
 {
-        struct proc *proc = curproc;
+	struct proc *proc = curproc;
+	struct proc *child, *next;
+	bool orphan;
+
+	/* The kernel isn't supposed to exit. */
+	KASSERT(proc != kproc);
+
+	/* Our other threads must be gone before the address space is */
+	proc_single();
+	proc_cleanup(proc);
+
+	/* Detach from the process and attach to the kernel process. */
+	KASSERT(curthread->t_proc == proc);
+	proc_remthread(curthread);
+	proc_addthread(kproc, curthread);
+
+	lock_acquire(proc_waitlock);
+	for (child = proc->p_children; child != NULL; child = next) {
+		next = child->p_nextsib;
+		proc_unlink(child);
+		if (child->p_exited) {
+			proc_destroy(child);
+		}
+	}
+	orphan = proc->p_parent == NULL;
+	if (!orphan) {
+		proc->p_exitstatus = status;
+		proc->p_exited = true;
+		cv_broadcast(proc->p_exitcv, proc_waitlock);
+	}
+	lock_release(proc_waitlock);
+
+	if (orphan) {
+		proc_destroy(proc);
+	}
+
+	thread_exit();
+}
+
+/*
+ * The current thread leaves its process, which carries on without
+ * it. If it was created with a word to clear at exit, clear that and
+ * wake anyone waiting for it to change (uthread_join, in userland).
+ */
+static
+__DEAD
+void
+proc_lwp_leave(void)
+{
+	struct thread *cur = curthread;
+	int zero = 0;
+
+	if (cur->t_lwpdone != NULL) {
+		/* if it's gone bad there's nobody to tell */
+		if (copyout(&zero, cur->t_lwpdone, sizeof(zero)) == 0) {
+			futex_wakeaddr(proc_getas(), cur->t_lwpdone, -1);
+		}
+		cur->t_lwpdone = NULL;
+	}
+	thread_exit();
+}
+
+void
+proc_single(void)
+{
+	struct proc *proc = curproc;
+
+	spinlock_acquire(&proc->p_lock);
+	if (proc->p_exiting) {
+		/* another thread is exiting or exec'ing; let it */
+		spinlock_release(&proc->p_lock);
+		proc_lwp_leave();
+	}
+	if (proc->p_numthreads == 1) {
+		spinlock_release(&proc->p_lock);
+		return;
+	}
+	proc->p_exiting = true;
+	spinlock_release(&proc->p_lock);
+
+	/* futex_wait checks p_exiting, so none can go to sleep after this */
+	futex_wakeall(proc_getas());
+
+	spinlock_acquire(&proc->p_lock);
+	while (proc->p_numthreads > 1) {
+		wchan_sleep(&proc->p_singlewchan, &proc->p_lock);
+	}
+	proc->p_exiting = false;
+	proc->p_nlive = 1;
+	spinlock_release(&proc->p_lock);
+}
+
+bool
+proc_mustexit(void)
+{
+	struct proc *proc = curproc;
+
+	return proc != NULL && proc != kproc && proc->p_exiting;
+}
+
+void
+proc_checkexit(void)
+{
+	/*
+	 * No lock needed: proc_single doesn't clear p_exiting until
+	 * we're gone, so if we see it set it stays set.
+	 */
+	if (proc_mustexit()) {
+		proc_lwp_leave();
+	}
+}
 
-        /* The kernel isn't supposed to exit. */
-        KASSERT(proc != kproc);
+void
+proc_lwp_exit(void)
+{
+	struct proc *proc = curproc;
+	bool last;
 
-        kprintf("Proc exit status %d \n", status);
-        /* Detach from the process and attach to the kernel process. */
-        KASSERT(curthread->t_proc == proc);
-        proc_remthread(curthread);
-        proc_addthread(kproc, curthread);
+	KASSERT(proc != kproc);
 
-        /* Now we can destroy the process. */
-        proc_destroy(proc);
+	spinlock_acquire(&proc->p_lock);
+	KASSERT(proc->p_nlive > 0);
+	proc->p_nlive--;
+	last = proc->p_nlive == 0;
+	spinlock_release(&proc->p_lock);
 
-        thread_exit();
+	if (last) {
+		proc__exit(_MKWAIT_EXIT(0));
+	}
+	proc_lwp_leave();
+}
+
+void
+proc_lwp_added(void)
+{
+	struct proc *proc = curproc;
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_nlive++;
+	spinlock_release(&proc->p_lock);
+}
+
+void
+proc_lwp_failed(void)
+{
+	struct proc *proc = curproc;
+
+	spinlock_acquire(&proc->p_lock);
+	KASSERT(proc->p_nlive > 1);
+	proc->p_nlive--;
+	spinlock_release(&proc->p_lock);
+}
+
+int
+proc_wait(pid_t pid, int flags, struct proc **ret)
+{
+	struct proc *child;
+	int result;
+
+	if ((flags & ~WNOHANG) != 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(proc_waitlock);
+	result = proc_getchild(pid, &child);
+	if (result) {
+		lock_release(proc_waitlock);
+		return result;
+	}
+	/* only we can reap or orphan it, so it'll stay put */
+	while (!child->p_exited && (flags & WNOHANG) == 0) {
+		cv_wait(child->p_exitcv, proc_waitlock);
+	}
+	*ret = child->p_exited ? child : NULL;
+	lock_release(proc_waitlock);
+	return 0;
+}
+
+void
+proc_reap(struct proc *child)
+{
+	KASSERT(child->p_exited);
+
+	lock_acquire(proc_waitlock);
+	KASSERT(child->p_parent == curproc);
+	proc_unlink(child);
+	lock_release(proc_waitlock);
+
+	/* it has no threads left to count */
+	spinlock_acquire(&curproc->p_lock);
+	usage_add(&curproc->p_cusage, &child->p_usage);
+	usage_add(&curproc->p_cusage, &child->p_cusage);
+	spinlock_release(&curproc->p_lock);
+
+	proc_destroy(child);
+}
+
+/*
+ * Threads add their usage in as they leave, so this counts the ones
+ * that have left and the current one; other threads still running
+ * show up once they're gone.
+ */
+int
+proc_getusage(int who, struct usage *ret)
+{
+	struct proc *proc = curproc;
+
+	switch (who) {
+	    case RUSAGE_SELF:
+		thread_charge(false);
+		spinlock_acquire(&proc->p_lock);
+		*ret = proc->p_usage;
+		spinlock_release(&proc->p_lock);
+		usage_add(ret, &curthread->t_usage);
+		return 0;
+	    case RUSAGE_CHILDREN:
+		spinlock_acquire(&proc->p_lock);
+		*ret = proc->p_cusage;
+		spinlock_release(&proc->p_lock);
+		return 0;
+	}
+	return EINVAL;
+}
+
+int
+proc_getnice(pid_t pid, int *ret)
+{
+	struct proc *p;
+	int result = ESRCH;
+
+	spinlock_acquire(&proc_tablelock);
+	p = proc_findpid(pid);
+	if (p != NULL) {
+		spinlock_acquire(&p->p_lock);
+		*ret = p->p_nice;
+		spinlock_release(&p->p_lock);
+		result = 0;
+	}
+	spinlock_release(&proc_tablelock);
+	return result;
+}
+
+int
+proc_setnice(pid_t pid, int nice)
+{
+	struct proc *p;
+	int result = ESRCH;
+
+	spinlock_acquire(&proc_tablelock);
+	p = proc_findpid(pid);
+	if (p != NULL) {
+		spinlock_acquire(&p->p_lock);
+		p->p_nice = nice;
+		spinlock_release(&p->p_lock);
+		result = 0;
+	}
+	spinlock_release(&proc_tablelock);
+	return result;
+}
+
+pid_t
+proc_getppid(void)
+{
+	pid_t pid;
+
+	lock_acquire(proc_waitlock);
+	pid = curproc->p_parent != NULL ? curproc->p_parent->p_pid : 0;
+	lock_release(proc_waitlock);
+	return pid;
 }
 
 /*
@@ -289,10 +910,20 @@ proc_remthread(struct thread *t)
 	proc = t->t_proc;
 	KASSERT(proc != NULL);
 
+	if (t == curthread) {
+		thread_charge(false);
+	}
+
 	spinlock_acquire(&proc->p_lock);
 	KASSERT(proc->p_numthreads > 0);
 	proc->p_numthreads--;
+	usage_add(&proc->p_usage, &t->t_usage);
+	if (proc->p_exiting && proc->p_numthreads == 1) {
+		wchan_wakeall(&proc->p_singlewchan, &proc->p_lock);
+	}
 	spinlock_release(&proc->p_lock);
+	/* whatever it does from here on isn't this process's */
+	bzero(&t->t_usage, sizeof(t->t_usage));
 
 	spl = splhigh();
 	t->t_proc = NULL;
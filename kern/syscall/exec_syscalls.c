@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * execv, and the argument handling it shares with runprogram.
+ *
+ * The arguments are gathered into one kernel buffer (struct argbuf),
+ * growing it as needed up to ARG_MAX, and then laid out on the new
+ * user stack, pointer array first and strings after it, with a single
+ * copyout. The strings have to be copied in one at a time, since
+ * they're wherever the caller put them, but go straight into place.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <limits.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vfs.h>
+#include <copyinout.h>
+#include <kprof.h>
+#include <syscall.h>
+
+/* Initial size of an argbuf; enough for most command lines. */
+#define ARGBUF_INITSIZE	512
+
+void
+argbuf_init(struct argbuf *ab)
+{
+	ab->ab_buf = NULL;
+	ab->ab_size = 0;
+	ab->ab_len = 0;
+	ab->ab_argc = 0;
+}
+
+void
+argbuf_cleanup(struct argbuf *ab)
+{
+	if (ab->ab_buf != NULL) {
+		kfree(ab->ab_buf);
+	}
+	argbuf_init(ab);
+}
+
+/*
+ * Make the buffer hold at least NEED bytes.
+ */
+static
+int
+argbuf_grow(struct argbuf *ab, size_t need)
+{
+	size_t size;
+	char *buf;
+
+	if (need <= ab->ab_size) {
+		return 0;
+	}
+	if (need > ARG_MAX) {
+		return E2BIG;
+	}
+
+	size = ab->ab_size > 0 ? ab->ab_size : ARGBUF_INITSIZE;
+	while (size < need) {
+		size *= 2;
+	}
+	if (size > ARG_MAX) {
+		size = ARG_MAX;
+	}
+
+	buf = kmalloc(size);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	if (ab->ab_buf != NULL) {
+		memcpy(buf, ab->ab_buf, ab->ab_len);
+		kfree(ab->ab_buf);
+	}
+	ab->ab_buf = buf;
+	ab->ab_size = size;
+	return 0;
+}
+
+/*
+ * Bytes the arguments will take on the user stack, counting the
+ * pointer array with its terminating NULL.
+ */
+static
+size_t
+argbuf_stacksize(int argc, size_t len)
+{
+	return ROUNDUP((argc + 1) * sizeof(userptr_t) + len, 8);
+}
+
+/*
+ * Collect the NULL-terminated user argument vector UARGV.
+ *
+ * The pointers are fetched ARGBUF_PTRCHUNK at a time rather than one
+ * copyin apiece, but never past the end of the page the next one is
+ * on: we don't know where the vector ends, and a valid one that stops
+ * short of an unmapped page mustn't fault.
+ */
+#define ARGBUF_PTRCHUNK 32
+
+int
+argbuf_fromuser(struct argbuf *ab, const_userptr_t uargv)
+{
+	userptr_t uargs[ARGBUF_PTRCHUNK];
+	userptr_t uarg;
+	vaddr_t va;
+	unsigned next, count;
+	size_t got;
+	int result;
+
+	result = argbuf_grow(ab, ARGBUF_INITSIZE);
+	if (result) {
+		return result;
+	}
+
+	next = count = 0;
+	while (1) {
+		if (next == count) {
+			va = (vaddr_t)uargv + ab->ab_argc * sizeof(userptr_t);
+			count = (PAGE_SIZE - va % PAGE_SIZE) /
+				sizeof(userptr_t);
+			if (count == 0) {
+				count = 1;
+			}
+			else if (count > ARGBUF_PTRCHUNK) {
+				count = ARGBUF_PTRCHUNK;
+			}
+			result = copyin((const_userptr_t)va, uargs,
+					count * sizeof(userptr_t));
+			if (result) {
+				return result;
+			}
+			next = 0;
+		}
+		uarg = uargs[next++];
+		if (uarg == NULL) {
+			break;
+		}
+
+		while (1) {
+			result = copyinstr((const_userptr_t)uarg,
+					   ab->ab_buf + ab->ab_len,
+					   ab->ab_size - ab->ab_len, &got);
+			if (result != ENAMETOOLONG) {
+				break;
+			}
+			result = argbuf_grow(ab, ab->ab_size + 1);
+			if (result) {
+				return result;
+			}
+		}
+		if (result) {
+			return result;
+		}
+		ab->ab_len += got;
+		ab->ab_argc++;
+
+		if (argbuf_stacksize(ab->ab_argc, ab->ab_len) > ARG_MAX) {
+			return E2BIG;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collect ARGC kernel strings from ARGV.
+ */
+int
+argbuf_fromkernel(struct argbuf *ab, int argc, char **argv)
+{
+	size_t len;
+	int i, result;
+
+	for (i=0; i<argc; i++) {
+		len = strlen(argv[i]) + 1;
+		if (argbuf_stacksize(i + 1, ab->ab_len + len) > ARG_MAX) {
+			return E2BIG;
+		}
+		result = argbuf_grow(ab, ab->ab_len + len);
+		if (result) {
+			return result;
+		}
+		memcpy(ab->ab_buf + ab->ab_len, argv[i], len);
+		ab->ab_len += len;
+		ab->ab_argc++;
+	}
+	return 0;
+}
+
+/*
+ * Put the arguments on the user stack, in the current address space,
+ * below *STACKPTR. Updates *STACKPTR and hands back the user address
+ * of the argument vector in *UARGV. Uses up the buffer's contents.
+ */
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *uargv)
+{
+	userptr_t *ptrs;
+	size_t ptrbytes, total, off;
+	vaddr_t base;
+	int i, result;
+
+	ptrbytes = (ab->ab_argc + 1) * sizeof(userptr_t);
+	total = argbuf_stacksize(ab->ab_argc, ab->ab_len);
+	result = argbuf_grow(ab, total);
+	if (result) {
+		return result;
+	}
+
+	/* Slide the strings up to make room for the pointers. */
+	memmove(ab->ab_buf + ptrbytes, ab->ab_buf, ab->ab_len);
+	bzero(ab->ab_buf + ptrbytes + ab->ab_len,
+	      total - ptrbytes - ab->ab_len);
+
+	base = *stackptr - total;
+	ptrs = (userptr_t *)ab->ab_buf;
+	off = ptrbytes;
+	for (i=0; i<ab->ab_argc; i++) {
+		ptrs[i] = (userptr_t)(base + off);
+		off += strlen(ab->ab_buf + off) + 1;
+	}
+	ptrs[ab->ab_argc] = NULL;
+
+	result = copyout(ab->ab_buf, (userptr_t)base, total);
+	ab->ab_len = 0;
+	if (result) {
+		return result;
+	}
+
+	*stackptr = base;
+	*uargv = (userptr_t)base;
+	return 0;
+}
+
+/*
+ * Replace the current program with PROG, passing it ARGV.
+ */
+int
+sys_execv(const_userptr_t user_prog, const_userptr_t user_argv)
+{
+	struct argbuf ab;
+	struct addrspace *oldas, *newas;
+	struct vnode *v;
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+	char *path;
+	int argc, result;
+
+	/*
+	 * The other threads (if any) go before we take their address
+	 * space away, and before we're holding anything that would
+	 * leak if one of them beat us to exiting and we had to go
+	 * instead. They stay gone if the exec fails.
+	 */
+	proc_single();
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(user_prog, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	argbuf_init(&ab);
+	result = argbuf_fromuser(&ab, user_argv);
+	if (result) {
+		goto fail_args;
+	}
+
+	result = vfs_open(path, O_RDONLY, 0, &v);
+	if (result) {
+		goto fail_args;
+	}
+	kfree(path);
+	path = NULL;
+
+	newas = as_create();
+	if (newas == NULL) {
+		vfs_close(v);
+		result = ENOMEM;
+		goto fail_args;
+	}
+	oldas = proc_setas(newas);
+	as_activate();
+
+	result = load_elf(v, &entrypoint);
+	vfs_close(v);
+	if (result) {
+		goto fail_as;
+	}
+
+	result = as_define_stack(newas, &stackptr);
+	if (result) {
+		goto fail_as;
+	}
+
+	argc = ab.ab_argc;
+	result = argbuf_copyout(&ab, &stackptr, &uargv);
+	if (result) {
+		goto fail_as;
+	}
+	argbuf_cleanup(&ab);
+
+	/* No going back now. */
+	uprof_reset(curproc);
+	if (curproc->p_vforkdone != NULL) {
+		/* oldas is our parent's; give it back */
+		proc_vfork_release(curproc);
+	}
+	else {
+		as_destroy(oldas);
+	}
+
+	enter_new_process(argc, uargv, NULL /*env*/, stackptr, entrypoint);
+	panic("enter_new_process returned\n");
+	return EINVAL;
+
+ fail_as:
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(newas);
+ fail_args:
+	argbuf_cleanup(&ab);
+	if (path != NULL) {
+		kfree(path);
+	}
+	return result;
+}
@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * File system calls on descriptors: open, the read and write family,
+ * lseek, fstat, getdirentry, getdirentries, close, dup2, pipe. The
+ * descriptor table and open-file objects are in filetable.c; pipes
+ * themselves are in vfs/pipe.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <kern/iovec.h>
+#include <limits.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <filetable.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Get the current process's file table for changing it; see
+ * filetable_unshare.
+ */
+static
+int
+file_owntable(struct filetable **ret)
+{
+	int result;
+
+	result = filetable_unshare(&curproc->p_filetable);
+	if (result) {
+		return result;
+	}
+	*ret = curproc->p_filetable;
+	return 0;
+}
+
+int
+sys_open(const_userptr_t user_path, int flags, mode_t mode, int32_t *retval)
+{
+	struct filetable *ft;
+	struct openfile *of;
+	char *path;
+	int fd, result;
+
+	if ((flags & O_ACCMODE) == O_ACCMODE) {
+		return EINVAL;
+	}
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(user_path, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = file_owntable(&ft);
+	if (result == 0) {
+		result = filetable_place(ft, of, &fd);
+	}
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	*retval = fd;
+	return 0;
+}
+
+/*
+ * Common code for all the read and write calls. IOV is IOVCNT
+ * iovecs, already in the kernel, describing user buffers. POS is
+ * where to do the I/O for the positional calls, or -1 to use and
+ * advance the seek position; the positional calls leave the seek
+ * position alone, so they don't take the openfile's lock.
+ */
+static
+int
+file_rw(int fd, struct iovec *iov, unsigned iovcnt, off_t pos,
+	enum uio_rw rw, int32_t *retval)
+{
+	struct openfile *of;
+	struct uio u;
+	struct stat st;
+	size_t len;
+	unsigned i;
+	int acc, result;
+
+	len = 0;
+	for (i=0; i<iovcnt; i++) {
+		/* the count we return has to fit in an int32_t */
+		if (iov[i].iov_len > 0x7fffffff - len) {
+			return EINVAL;
+		}
+		len += iov[i].iov_len;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+
+	acc = of->of_flags & O_ACCMODE;
+	if ((rw == UIO_READ && acc == O_WRONLY) ||
+	    (rw == UIO_WRITE && acc == O_RDONLY)) {
+		openfile_decref(of);
+		return EBADF;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_resid = len;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = proc_getas();
+
+	if (pos >= 0) {
+		if (!VOP_ISSEEKABLE(of->of_vn)) {
+			openfile_decref(of);
+			return ESPIPE;
+		}
+		u.uio_offset = pos;
+		if (rw == UIO_READ) {
+			result = VOP_READ(of->of_vn, &u);
+		}
+		else {
+			result = VOP_WRITE(of->of_vn, &u);
+		}
+		if (result == 0) {
+			*retval = len - u.uio_resid;
+		}
+		openfile_decref(of);
+		return result;
+	}
+
+	lock_acquire(of->of_lock);
+	if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+		result = VOP_STAT(of->of_vn, &st);
+		if (result) {
+			goto out;
+		}
+		of->of_offset = st.st_size;
+	}
+	u.uio_offset = of->of_offset;
+	if (rw == UIO_READ) {
+		result = VOP_READ(of->of_vn, &u);
+	}
+	else {
+		result = VOP_WRITE(of->of_vn, &u);
+	}
+	if (result) {
+		goto out;
+	}
+	of->of_offset = u.uio_offset;
+	*retval = len - u.uio_resid;
+
+ out:
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	return result;
+}
+
+/*
+ * Common code for the vectored calls: fetch the iovec array and hand
+ * off to file_rw. Short arrays are copied to the stack; longer ones
+ * cost a kmalloc.
+ */
+#define FILE_STACKIOVS	8
+
+static
+int
+file_rwv(int fd, const_userptr_t user_iov, int iovcnt, off_t pos,
+	 enum uio_rw rw, int32_t *retval)
+{
+	struct iovec stackiov[FILE_STACKIOVS], *iov;
+	int result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+	if (iovcnt <= FILE_STACKIOVS) {
+		iov = stackiov;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(*iov));
+		if (iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = copyin(user_iov, iov, iovcnt * sizeof(*iov));
+	if (result == 0) {
+		result = file_rw(fd, iov, iovcnt, pos, rw, retval);
+	}
+
+	if (iov != stackiov) {
+		kfree(iov);
+	}
+	return result;
+}
+
+static
+int
+file_rw1(int fd, userptr_t buf, size_t len, off_t pos, enum uio_rw rw,
+	 int32_t *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = len;
+	return file_rw(fd, &iov, 1, pos, rw, retval);
+}
+
+int
+sys_read(int fd, userptr_t buf, size_t len, int32_t *retval)
+{
+	return file_rw1(fd, buf, len, -1, UIO_READ, retval);
+}
+
+int
+sys_write(int fd, userptr_t buf, size_t len, int32_t *retval)
+{
+	return file_rw1(fd, buf, len, -1, UIO_WRITE, retval);
+}
+
+int
+sys_pread(int fd, userptr_t buf, size_t len, off_t pos, int32_t *retval)
+{
+	if (pos < 0) {
+		return EINVAL;
+	}
+	return file_rw1(fd, buf, len, pos, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf, size_t len, off_t pos, int32_t *retval)
+{
+	if (pos < 0) {
+		return EINVAL;
+	}
+	return file_rw1(fd, buf, len, pos, UIO_WRITE, retval);
+}
+
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, -1, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, -1, UIO_WRITE, retval);
+}
+
+int
+sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+	   int32_t *retval)
+{
+	if (pos < 0) {
+		return EINVAL;
+	}
+	return file_rwv(fd, iov, iovcnt, pos, UIO_READ, retval);
+}
+
+int
+sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t pos,
+	    int32_t *retval)
+{
+	if (pos < 0) {
+		return EINVAL;
+	}
+	return file_rwv(fd, iov, iovcnt, pos, UIO_WRITE, retval);
+}
+
+/*
+ * copyfile: copy up to LEN bytes from FROMFD's seek position to
+ * TOFD's, advancing both, without the data passing through user
+ * space. It goes through one kernel buffer of FILE_COPYBUF bytes at
+ * a time; a short count means the source hit EOF, or that an error
+ * came up after some of the data had been copied.
+ */
+#define FILE_COPYBUF	(16*1024)
+
+int
+sys_copyfile(int fromfd, int tofd, size_t len, int32_t *retval)
+{
+	struct openfile *from, *to, *first, *second;
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	char *buf;
+	size_t done, chunk, got;
+	int result;
+
+	/* the count we return has to fit in an int32_t */
+	if (len > 0x7fffffff) {
+		len = 0x7fffffff;
+	}
+
+	result = filetable_get(curproc->p_filetable, fromfd, &from);
+	if (result) {
+		return result;
+	}
+	result = filetable_get(curproc->p_filetable, tofd, &to);
+	if (result) {
+		openfile_decref(from);
+		return result;
+	}
+	if ((from->of_flags & O_ACCMODE) == O_WRONLY ||
+	    (to->of_flags & O_ACCMODE) == O_RDONLY) {
+		result = EBADF;
+		goto fail;
+	}
+	if (from->of_vn == to->of_vn) {
+		/* don't try to sort out overlapping ranges */
+		result = EINVAL;
+		goto fail;
+	}
+
+	buf = kmalloc(FILE_COPYBUF);
+	if (buf == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/* Lock the two in address order, so two copies can't deadlock. */
+	if (from < to) {
+		first = from;
+		second = to;
+	}
+	else {
+		first = to;
+		second = from;
+	}
+	lock_acquire(first->of_lock);
+	lock_acquire(second->of_lock);
+
+	if (to->of_flags & O_APPEND) {
+		result = VOP_STAT(to->of_vn, &st);
+		if (result) {
+			goto out;
+		}
+		to->of_offset = st.st_size;
+	}
+
+	done = 0;
+	while (done < len) {
+		chunk = len - done;
+		if (chunk > FILE_COPYBUF) {
+			chunk = FILE_COPYBUF;
+		}
+
+		uio_kinit(&iov, &u, buf, chunk, from->of_offset, UIO_READ);
+		result = VOP_READ(from->of_vn, &u);
+		if (result) {
+			break;
+		}
+		got = chunk - u.uio_resid;
+		if (got == 0) {
+			break;
+		}
+
+		uio_kinit(&iov, &u, buf, got, to->of_offset, UIO_WRITE);
+		result = VOP_WRITE(to->of_vn, &u);
+		/*
+		 * Advance the source only past what got written, so
+		 * the next call picks up where this one stopped.
+		 */
+		from->of_offset += got - u.uio_resid;
+		to->of_offset = u.uio_offset;
+		done += got - u.uio_resid;
+		if (result || u.uio_resid > 0) {
+			break;
+		}
+	}
+	if (done > 0) {
+		/* report the partial copy; the error will come up again */
+		result = 0;
+		*retval = done;
+	}
+	else if (result == 0) {
+		*retval = 0;
+	}
+
+ out:
+	lock_release(second->of_lock);
+	lock_release(first->of_lock);
+	kfree(buf);
+ fail:
+	openfile_decref(to);
+	openfile_decref(from);
+	return result;
+}
+
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t base;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (!VOP_ISSEEKABLE(of->of_vn)) {
+		openfile_decref(of);
+		return ESPIPE;
+	}
+
+	lock_acquire(of->of_lock);
+	switch (whence) {
+	    case SEEK_SET:
+		base = 0;
+		break;
+	    case SEEK_CUR:
+		base = of->of_offset;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vn, &st);
+		if (result) {
+			goto out;
+		}
+		base = st.st_size;
+		break;
+	    case SEEK_DATA:
+	    case SEEK_HOLE:
+		result = VOP_SEEKHOLE(of->of_vn, whence, pos, &base);
+		if (result) {
+			goto out;
+		}
+		pos = 0;
+		break;
+	    default:
+		result = EINVAL;
+		goto out;
+	}
+	if (base + pos < 0) {
+		result = EINVAL;
+		goto out;
+	}
+	of->of_offset = base + pos;
+	*retval = of->of_offset;
+
+ out:
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_fstat(int fd, userptr_t user_statbuf)
+{
+	struct openfile *of;
+	struct stat st;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(of->of_vn, &st);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	return copyout(&st, user_statbuf, sizeof(st));
+}
+
+/*
+ * Common code for getdirentry and getdirentries: read from the
+ * directory at the seek position, like read, with BULK choosing the
+ * VOP. The seek position is whatever the filesystem keeps there, not
+ * a byte count.
+ */
+static
+int
+file_getdirent(int fd, userptr_t buf, size_t len, bool bulk,
+	       int32_t *retval)
+{
+	struct openfile *of;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	/* the count we return has to fit in an int32_t */
+	if (len > 0x7fffffff) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	if ((of->of_flags & O_ACCMODE) == O_WRONLY) {
+		openfile_decref(of);
+		return EBADF;
+	}
+
+	iov.iov_ubase = buf;
+	iov.iov_len = len;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_resid = len;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = proc_getas();
+
+	lock_acquire(of->of_lock);
+	u.uio_offset = of->of_offset;
+	if (bulk) {
+		result = VOP_GETDIRENTRIES(of->of_vn, &u);
+	}
+	else {
+		result = VOP_GETDIRENTRY(of->of_vn, &u);
+	}
+	if (result == 0) {
+		of->of_offset = u.uio_offset;
+		*retval = len - u.uio_resid;
+	}
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_getdirentry(int fd, userptr_t buf, size_t len, int32_t *retval)
+{
+	return file_getdirent(fd, buf, len, false, retval);
+}
+
+int
+sys_getdirentries(int fd, userptr_t buf, size_t len, int32_t *retval)
+{
+	return file_getdirent(fd, buf, len, true, retval);
+}
+
+int
+sys_ioctl(int fd, int code, userptr_t data)
+{
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = VOP_IOCTL(of->of_vn, code, data);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_close(int fd)
+{
+	struct filetable *ft;
+	int result;
+
+	result = file_owntable(&ft);
+	if (result) {
+		return result;
+	}
+	return filetable_close(ft, fd);
+}
+
+int
+sys_dup2(int oldfd, int newfd, int32_t *retval)
+{
+	struct filetable *ft;
+	int result;
+
+	result = file_owntable(&ft);
+	if (result) {
+		return result;
+	}
+	result = filetable_dup2(ft, oldfd, newfd);
+	if (result) {
+		return result;
+	}
+	*retval = newfd;
+	return 0;
+}
+
+int
+sys_pipe(userptr_t user_fds)
+{
+	struct filetable *ft;
+	struct vnode *rvn, *wvn;
+	struct openfile *rof, *wof;
+	int fds[2];
+	int result;
+
+	result = pipe_create(&rvn, &wvn);
+	if (result) {
+		return result;
+	}
+	result = openfile_fromvnode(rvn, O_RDONLY, &rof);
+	if (result) {
+		vfs_close(rvn);
+		vfs_close(wvn);
+		return result;
+	}
+	result = openfile_fromvnode(wvn, O_WRONLY, &wof);
+	if (result) {
+		openfile_decref(rof);
+		vfs_close(wvn);
+		return result;
+	}
+
+	result = file_owntable(&ft);
+	if (result) {
+		goto fail;
+	}
+	result = filetable_place(ft, rof, &fds[0]);
+	if (result) {
+		goto fail;
+	}
+	result = filetable_place(ft, wof, &fds[1]);
+	if (result) {
+		/* closing fds[0] drops rof */
+		filetable_close(ft, fds[0]);
+		openfile_decref(wof);
+		return result;
+	}
+
+	result = copyout(fds, user_fds, sizeof(fds));
+	if (result) {
+		filetable_close(ft, fds[0]);
+		filetable_close(ft, fds[1]);
+		return result;
+	}
+	return 0;
+
+ fail:
+	openfile_decref(rof);
+	openfile_decref(wof);
+	return result;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Process creation and its aftermath: fork, vfork, waitpid, getpid,
+ * getppid; and threads within a process, lwp_create and lwp_exit.
+ *
+ * fork is cheap by construction: as_copy shares every page
+ * copy-on-write, and the child shares the parent's file table until
+ * one of them changes it (see filetable.h), so the cost doesn't grow
+ * with the size of the process.
+ *
+ * vfork doesn't even copy the page table. The child runs in the
+ * parent's address space, and the parent sleeps until the child
+ * hands it back by exiting (or exec'ing). The child
+ * must not return from the function that called vfork or touch much
+ * of anything besides its own stack frame.
+ *
+ * lwp_create starts another thread in the current process, sharing
+ * everything; userlevel supplies the stack. See proc_single in
+ * proc.c for how the threads are gathered up again at exit and exec.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <filetable.h>
+#include <mips/trapframe.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * The new thread starts here, with a kmalloc'd copy of the parent's
+ * trapframe.
+ */
+static
+void
+fork_child(void *tf, unsigned long junk)
+{
+	(void)junk;
+	enter_forked_process(tf);
+}
+
+static
+int
+fork_common(struct trapframe *tf, bool borrow, int32_t *retval)
+{
+	struct trapframe *childtf;
+	struct proc *newproc;
+	struct semaphore *done;
+	pid_t pid;
+	int result;
+
+	childtf = kmalloc(sizeof(*childtf));
+	if (childtf == NULL) {
+		return ENOMEM;
+	}
+	*childtf = *tf;
+
+	done = NULL;
+	if (borrow) {
+		done = sem_create("vfork", 0);
+		if (done == NULL) {
+			kfree(childtf);
+			return ENOMEM;
+		}
+	}
+
+	result = proc_fork(&newproc);
+	if (result) {
+		goto fail;
+	}
+
+	if (borrow) {
+		newproc->p_addrspace = proc_getas();
+		newproc->p_vforkdone = done;
+	}
+	else {
+		result = as_copy(proc_getas(), &newproc->p_addrspace);
+		if (result) {
+			proc_destroy(newproc);
+			goto fail;
+		}
+	}
+
+	/* it stays around, as a zombie if need be, until we reap it */
+	pid = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc, fork_child,
+			     childtf, 0);
+	if (result) {
+		proc_destroy(newproc);
+		goto fail;
+	}
+
+	if (borrow) {
+		P(done);
+		sem_destroy(done);
+	}
+	*retval = pid;
+	return 0;
+
+ fail:
+	if (done != NULL) {
+		sem_destroy(done);
+	}
+	kfree(childtf);
+	return result;
+}
+
+int
+sys_fork(struct trapframe *tf, int32_t *retval)
+{
+	return fork_common(tf, false, retval);
+}
+
+int
+sys_vfork(struct trapframe *tf, int32_t *retval)
+{
+	return fork_common(tf, true, retval);
+}
+
+/*
+ * The new thread of lwp_create starts here, with a kmalloc'd
+ * trapframe for enter_new_thread.
+ */
+static
+void
+lwp_child(void *tf, unsigned long done)
+{
+	curthread->t_lwpdone = (userptr_t)done;
+	if (proc_mustexit()) {
+		/* the process started exiting while we were being made */
+		kfree(tf);
+		proc_checkexit();
+	}
+	enter_new_thread(tf);
+}
+
+/*
+ * Start a thread in the current process at ENTRY (a0), calling it
+ * with ARG (a1) on the stack whose top is STACK (a2). If DONE (a3)
+ * isn't NULL it's an int the kernel sets to 0, with a futex wake,
+ * when the thread exits; the caller sets it nonzero beforehand. No
+ * id comes back; DONE is what there is to wait on.
+ */
+int
+sys_lwp_create(struct trapframe *tf, int32_t *retval)
+{
+	struct trapframe *childtf;
+	vaddr_t stack, done;
+	int result;
+
+	stack = tf->tf_a2;
+	done = tf->tf_a3;
+	if (stack % 8 != 0 || done % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	if (stack == 0 || stack > USERSPACETOP ||
+	    done >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	childtf = kmalloc(sizeof(*childtf));
+	if (childtf == NULL) {
+		return ENOMEM;
+	}
+	*childtf = *tf;
+	childtf->tf_epc = tf->tf_a0;
+	childtf->tf_a0 = tf->tf_a1;
+	childtf->tf_sp = stack;
+
+	/*
+	 * A shared file table would be copied, not shared, by the first
+	 * thread to change it (see filetable.h), which is wrong for a
+	 * thread; so the process has to own its table outright.
+	 */
+	result = filetable_unshare(&curproc->p_filetable);
+	if (result) {
+		kfree(childtf);
+		return result;
+	}
+
+	proc_lwp_added();
+	result = thread_fork(curthread->t_name, curproc, lwp_child,
+			     childtf, done);
+	if (result) {
+		proc_lwp_failed();
+		kfree(childtf);
+		return result;
+	}
+
+	*retval = 0;
+	return 0;
+}
+
+/*
+ * The current thread leaves; the process exits, with status 0, if it
+ * was the last one.
+ */
+void
+sys_lwp_exit(void)
+{
+	proc_lwp_exit();
+}
+
+int
+sys_getpid(int32_t *retval)
+{
+	*retval = curproc->p_pid;
+	return 0;
+}
+
+int
+sys_waitpid(pid_t pid, userptr_t user_status, int flags, int32_t *retval)
+{
+	struct proc *child;
+	int result;
+
+	if (pid <= 0) {
+		/* no process groups, and no waiting for just anyone */
+		return ENOSYS;
+	}
+
+	result = proc_wait(pid, flags, &child);
+	if (result) {
+		return result;
+	}
+	if (child == NULL) {
+		/* WNOHANG, and it's still running */
+		*retval = 0;
+		return 0;
+	}
+
+	/* leave it to be waited for again if the status can't be had */
+	if (user_status != NULL) {
+		result = copyout(&child->p_exitstatus, user_status,
+				 sizeof(int));
+		if (result) {
+			return result;
+		}
+	}
+	proc_reap(child);
+	*retval = pid;
+	return 0;
+}
+
+int
+sys_getppid(int32_t *retval)
+{
+	*retval = proc_getppid();
+	return 0;
+}
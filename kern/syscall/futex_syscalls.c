@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes: sleep and wake keyed by a user address.
+ *
+ * A futex is just an int in user memory. The kernel keeps no state
+ * for it except while someone is asleep on it; userlevel code does
+ * its locking with atomic operations on the int and only comes in
+ * here when it has to block (futex_wait) or when it knows somebody
+ * might be blocked (futex_wake). See <uthread.h> in userland.
+ *
+ * Waiters are hashed by a key naming the futex into a fixed table of
+ * buckets, each with a lock and a CV. The key is normally (address
+ * space, user address), but for a word in a shared memory segment
+ * it's (segment, offset), so processes mapping the segment at
+ * different addresses still meet (see as_futexkey). A waiter puts a record
+ * on its bucket's list and sleeps on the bucket's CV; futex_wake
+ * marks the records it picks and broadcasts. Unrelated futexes that
+ * share a bucket cost each other a spurious wakeup, nothing more.
+ *
+ * The value check in futex_wait is done under the bucket lock, and
+ * futex_wake takes the same lock, so a wake issued after userlevel
+ * changed the int can't slip in between the check and the sleep.
+ * For the same reason futex_wait checks proc_mustexit() there, so a
+ * thread can't go to sleep after proc_single's futex_wakeall passed.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+#define FUTEX_NBUCKETS	64
+
+struct futex_waiter {
+	struct addrspace *fw_as;	/* for futex_wakeall */
+	const void *fw_key;		/* from as_futexkey */
+	uintptr_t fw_off;
+	bool fw_woken;
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct cv *fb_cv;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_buckets[FUTEX_NBUCKETS];
+
+/*
+ * Set up the bucket table.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		futex_buckets[i].fb_lock = lock_create("futex");
+		futex_buckets[i].fb_cv = cv_create("futex");
+		if (futex_buckets[i].fb_lock == NULL ||
+		    futex_buckets[i].fb_cv == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_buckets[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(const void *key, uintptr_t off)
+{
+	uint32_t h;
+
+	h = (off >> 2) ^ ((uintptr_t)key >> 6);
+	h ^= h >> 11;
+	return &futex_buckets[h % FUTEX_NBUCKETS];
+}
+
+/*
+ * Take W off its bucket's list. Caller holds the bucket lock.
+ */
+static
+void
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *w)
+{
+	struct futex_waiter **pp;
+
+	for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		if (*pp == w) {
+			*pp = w->fw_next;
+			return;
+		}
+	}
+}
+
+/*
+ * Sleep on UADDR if it still holds VAL. Gives EAGAIN if it doesn't,
+ * ETIMEDOUT if USER_TIMEOUT (a relative interval, or NULL for none)
+ * runs out first, and 0 once woken by futex_wake. Callers must
+ * recheck their condition either way.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val, const_userptr_t user_timeout)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter w, **pp;
+	struct timespec ts;
+	uint64_t deadline, now;
+	int cur, result;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	deadline = 0;
+	if (user_timeout != NULL) {
+		result = copyin(user_timeout, &ts, sizeof(ts));
+		if (result) {
+			return result;
+		}
+		if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+		    ts.tv_nsec >= 1000000000) {
+			return EINVAL;
+		}
+		deadline = clock_now() +
+			(uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	w.fw_as = proc_getas();
+	as_futexkey(w.fw_as, (vaddr_t)uaddr, &w.fw_key, &w.fw_off);
+	w.fw_woken = false;
+
+	fb = futex_hash(w.fw_key, w.fw_off);
+	lock_acquire(fb->fb_lock);
+
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		goto out;
+	}
+	if (cur != val) {
+		result = EAGAIN;
+		goto out;
+	}
+	if (proc_mustexit()) {
+		/* proc_single has already been through; don't sleep */
+		result = EINTR;
+		goto out;
+	}
+
+	/* Go on the end, so futex_wake wakes the longest sleepers first */
+	for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		/* nothing */
+	}
+	w.fw_next = NULL;
+	*pp = &w;
+
+	while (!w.fw_woken) {
+		if (user_timeout == NULL) {
+			cv_wait(fb->fb_cv, fb->fb_lock);
+			continue;
+		}
+		now = clock_now();
+		if (now >= deadline) {
+			futex_unlink(fb, &w);
+			result = ETIMEDOUT;
+			goto out;
+		}
+		cv_timedwait(fb->fb_cv, fb->fb_lock, deadline - now);
+	}
+	/* futex_wake already unlinked us */
+	result = 0;
+
+ out:
+	lock_release(fb->fb_lock);
+	return result;
+}
+
+/*
+ * Wake up to N threads (all of them, if N is negative) sleeping on
+ * UADDR in AS. Returns the number woken.
+ */
+int
+futex_wakeaddr(struct addrspace *as, userptr_t uaddr, int n)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **pp, *w;
+	const void *key;
+	uintptr_t off;
+	int woken;
+
+	as_futexkey(as, (vaddr_t)uaddr, &key, &off);
+	fb = futex_hash(key, off);
+	woken = 0;
+
+	lock_acquire(fb->fb_lock);
+	pp = &fb->fb_waiters;
+	while (*pp != NULL && (n < 0 || woken < n)) {
+		w = *pp;
+		if (w->fw_key == key && w->fw_off == off) {
+			*pp = w->fw_next;
+			w->fw_woken = true;
+			woken++;
+		}
+		else {
+			pp = &w->fw_next;
+		}
+	}
+	if (woken > 0) {
+		cv_broadcast(fb->fb_cv, fb->fb_lock);
+	}
+	lock_release(fb->fb_lock);
+
+	return woken;
+}
+
+/*
+ * Wake every thread sleeping on any futex in AS. Used by proc_single
+ * to get the other threads of a process out of futex_wait; they see
+ * proc_mustexit() on the way out and leave.
+ */
+void
+futex_wakeall(struct addrspace *as)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **pp, *w;
+	unsigned i;
+	bool any;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		fb = &futex_buckets[i];
+		any = false;
+
+		lock_acquire(fb->fb_lock);
+		pp = &fb->fb_waiters;
+		while (*pp != NULL) {
+			w = *pp;
+			if (w->fw_as == as) {
+				*pp = w->fw_next;
+				w->fw_woken = true;
+				any = true;
+			}
+			else {
+				pp = &w->fw_next;
+			}
+		}
+		if (any) {
+			cv_broadcast(fb->fb_cv, fb->fb_lock);
+		}
+		lock_release(fb->fb_lock);
+	}
+}
+
+/*
+ * Wake up to N threads sleeping on UADDR; the number woken goes in
+ * *RETVAL.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int n, int32_t *retval)
+{
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	*retval = futex_wakeaddr(proc_getas(), uaddr, n);
+	return 0;
+}
@@ -42,8 +42,12 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * With the real VM system (not dumbvm), segments are not read here:
+ * each one is attached to its region with as_define_file, and pages
+ * are read from the executable the first time they're touched.
+ *
+ * The headers are only read the first time a given file is run (until
+ * it changes); see struct elfinfo below.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -57,9 +61,12 @@
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
+#include <spinlock.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,23 +151,44 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
- * Load an ELF executable user program into the current address space.
- *
- * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ * What load_elf needs from an executable's headers: the entry point
+ * and the loadable segments. This is what gets cached in the vnode,
+ * so that running the same program again doesn't read and check the
+ * headers again. Programs with more than ELF_MAXSEGS loadable
+ * segments aren't supported.
+ */
+#define ELF_MAXSEGS	8
+
+struct elfseg {
+	off_t es_offset;		/* where in the file */
+	vaddr_t es_vaddr;		/* where in memory */
+	size_t es_memsz;
+	size_t es_filesz;
+	unsigned es_flags;		/* PF_* */
+};
+
+struct elfinfo {
+	vaddr_t ei_entry;
+	unsigned ei_nsegs;
+	struct elfseg ei_segs[ELF_MAXSEGS];
+};
+
+/*
+ * Read and check the headers of V into EI.
  */
+static
 int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+load_elf_parse(struct vnode *v, struct elfinfo *ei)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
-	struct addrspace *as;
-
-	as = proc_getas();
+	struct elfseg *es;
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -203,12 +231,12 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * Go through the list of segments and collect the loadable
+	 * ones.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
-	 * conceivably be more. You don't need to support such files
-	 * if it's unduly awkward to do so.
+	 * conceivably be more, up to ELF_MAXSEGS.
 	 *
 	 * Note that the expression eh.e_phoff + i*eh.e_phentsize is
 	 * mandated by the ELF standard - we use sizeof(ph) to load,
@@ -217,6 +245,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * to find where the phdr starts.
 	 */
 
+	ei->ei_entry = eh.e_entry;
+	ei->ei_nsegs = 0;
 	for (i=0; i<eh.e_phnum; i++) {
 		off_t offset = eh.e_phoff + i*eh.e_phentsize;
 		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
@@ -243,11 +273,122 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (ei->ei_nsegs == ELF_MAXSEGS) {
+			kprintf("loadelf: too many segments\n");
+			return ENOEXEC;
+		}
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > "
+				"segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		es = &ei->ei_segs[ei->ei_nsegs++];
+		es->es_offset = ph.p_offset;
+		es->es_vaddr = ph.p_vaddr;
+		es->es_memsz = ph.p_memsz;
+		es->es_filesz = ph.p_filesz;
+		es->es_flags = ph.p_flags;
+	}
+
+	return 0;
+}
+
+/*
+ * Get V's cached headers into EI, if there are any.
+ */
+static
+bool
+load_elf_lookup(struct vnode *v, struct elfinfo *ei)
+{
+	bool found;
+
+	spinlock_acquire(&v->vn_countlock);
+	found = v->vn_elf != NULL;
+	if (found) {
+		*ei = *v->vn_elf;
+	}
+	spinlock_release(&v->vn_countlock);
+	return found;
+}
+
+/*
+ * Cache EI as V's headers. Not being able to is no great loss.
+ */
+static
+void
+load_elf_remember(struct vnode *v, const struct elfinfo *ei)
+{
+	struct elfinfo *copy;
+
+	copy = kmalloc(sizeof(*copy));
+	if (copy == NULL) {
+		return;
+	}
+	*copy = *ei;
+
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_elf == NULL) {
+		v->vn_elf = copy;
+		copy = NULL;
+	}
+	spinlock_release(&v->vn_countlock);
+
+	if (copy != NULL) {
+		/* someone else got there first */
+		kfree(copy);
+	}
+}
+
+void
+load_elf_uncache(struct vnode *v)
+{
+	struct elfinfo *ei;
+
+	spinlock_acquire(&v->vn_countlock);
+	ei = v->vn_elf;
+	v->vn_elf = NULL;
+	spinlock_release(&v->vn_countlock);
+
+	if (ei != NULL) {
+		kfree(ei);
+	}
+}
+
+/*
+ * Load an ELF executable user program into the current address space.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	struct elfinfo ei;
+	struct elfseg *es;
+	struct addrspace *as;
+	unsigned i;
+	int result;
+
+	as = proc_getas();
+
+	if (!load_elf_lookup(v, &ei)) {
+		result = load_elf_parse(v, &ei);
+		if (result) {
+			return result;
+		}
+		load_elf_remember(v, &ei);
+	}
+
+	/*
+	 * Set up the address space.
+	 */
+
+	for (i=0; i<ei.ei_nsegs; i++) {
+		es = &ei.ei_segs[i];
 		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+					  es->es_vaddr, es->es_memsz,
+					  es->es_flags & PF_R,
+					  es->es_flags & PF_W,
+					  es->es_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -262,35 +403,19 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * Now actually load each segment.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
-
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
-		}
-
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+	for (i=0; i<ei.ei_nsegs; i++) {
+		es = &ei.ei_segs[i];
+#if OPT_DUMBVM
+		result = load_segment(as, v, es->es_offset, es->es_vaddr,
+				      es->es_memsz, es->es_filesz,
+				      es->es_flags & PF_X);
+#else
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) es->es_filesz,
+		      (unsigned long) es->es_vaddr);
+		result = as_define_file(as, es->es_vaddr, v, es->es_offset,
+					es->es_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -301,7 +426,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
-	*entrypoint = eh.e_entry;
+	*entrypoint = ei.ei_entry;
 
 	return 0;
 }
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Process resource usage, and scheduling: priority and cpu affinity.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <kern/uprof.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <copyinout.h>
+#include <kprof.h>
+#include <syscall.h>
+
+/* Nanoseconds to a timeval. */
+static
+void
+usage_timeval(uint64_t ns, struct timeval *tv)
+{
+	tv->tv_sec = ns / 1000000000ULL;
+	tv->tv_usec = (ns % 1000000000ULL) / 1000;
+}
+
+/*
+ * Report resource usage. Only the times, faults, block I/O and context
+ * switches are kept track of; the rest reads as zero.
+ */
+int
+sys_getrusage(int who, userptr_t user_usage)
+{
+	struct usage u;
+	struct rusage ru;
+	int result;
+
+	result = proc_getusage(who, &u);
+	if (result) {
+		return result;
+	}
+
+	bzero(&ru, sizeof(ru));
+	usage_timeval(u.u_utime, &ru.ru_utime);
+	usage_timeval(u.u_stime, &ru.ru_stime);
+	ru.ru_minflt = u.u_minflt;
+	ru.ru_majflt = u.u_majflt;
+	ru.ru_inblock = u.u_inblock;
+	ru.ru_oublock = u.u_oublock;
+	ru.ru_nvcsw = u.u_nvcsw;
+	ru.ru_nivcsw = u.u_nivcsw;
+	return copyout(&ru, user_usage, sizeof(ru));
+}
+
+/*
+ * Check WHICH/WHO and get the PID it names, 0 for the current
+ * process. There are no process groups or users to look up, so only
+ * PRIO_PROCESS can find anything; the process itself is looked up in
+ * the PID table by proc_getnice and proc_setnice.
+ */
+static
+int
+prio_lookup(int which, int who, pid_t *ret)
+{
+	switch (which) {
+	    case PRIO_PROCESS:
+	    case PRIO_PGRP:
+	    case PRIO_USER:
+		break;
+	    default:
+		return EINVAL;
+	}
+	if (which != PRIO_PROCESS) {
+		return ESRCH;
+	}
+	*ret = who;
+	return 0;
+}
+
+/*
+ * Get the nice value. It can legitimately be negative, so the libc
+ * stub's -1 on error is ambiguous here as it is everywhere else;
+ * callers who care clear errno first.
+ */
+int
+sys_getpriority(int which, int who, int32_t *retval)
+{
+	pid_t pid;
+	int nice, result;
+
+	result = prio_lookup(which, who, &pid);
+	if (result) {
+		return result;
+	}
+	result = proc_getnice(pid, &nice);
+	if (result) {
+		return result;
+	}
+	*retval = nice;
+	return 0;
+}
+
+/*
+ * Set the nice value, clamped to PRIO_MIN..PRIO_MAX as on other
+ * systems. Higher values run later: the scheduler puts the process's
+ * threads in a lower band of run queues (see thread.c). Threads
+ * already queued move at the next schedule() pass; the caller's own
+ * thread the next time it's queued.
+ *
+ * There are no users, so anyone may raise their own priority too.
+ */
+int
+sys_setpriority(int which, int who, int prio)
+{
+	pid_t pid;
+	int result;
+
+	result = prio_lookup(which, who, &pid);
+	if (result) {
+		return result;
+	}
+
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+	return proc_setnice(pid, prio);
+}
+
+/*
+ * Set the cpu affinity: bit N of MASK allows cpu N. This is the
+ * calling thread's mask (see thread_setaffinity); threads it goes on
+ * to create, with fork or lwp_create, inherit it. The mask belongs
+ * to a thread and nothing lists another process's threads, so PID
+ * has to name the calling process, as 0 or its own PID.
+ */
+int
+sys_setaffinity(pid_t pid, uint32_t mask)
+{
+	if (pid != 0 && pid != curproc->p_pid) {
+		return ESRCH;
+	}
+	return thread_setaffinity(mask);
+}
+
+/*
+ * Get the cpu affinity mask into *USER_MASK. It's copied out rather
+ * than returned since all cpus allowed, the usual case, looks like -1.
+ */
+int
+sys_getaffinity(pid_t pid, userptr_t user_mask)
+{
+	uint32_t mask;
+
+	if (pid != 0 && pid != curproc->p_pid) {
+		return ESRCH;
+	}
+	mask = thread_getaffinity();
+	return copyout(&mask, user_mask, sizeof(mask));
+}
+
+/*
+ * User PC sampling of the current process; see <kern/uprof.h>.
+ */
+int
+sys_uprof(int op, userptr_t buf, size_t len, int32_t *retval)
+{
+	unsigned count;
+	int result;
+
+	switch (op) {
+	    case UPROF_START:
+		result = uprof_attach(curproc);
+		count = 0;
+		break;
+	    case UPROF_STOP:
+		uprof_detach(curproc, false);
+		result = 0;
+		count = 0;
+		break;
+	    case UPROF_READ:
+		result = uprof_read(curproc, buf, len, &count);
+		break;
+	    default:
+		return EINVAL;
+	}
+	if (result) {
+		return result;
+	}
+	*retval = count;
+	return 0;
+}
@@ -42,36 +42,82 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <vfs.h>
+#include <filetable.h>
 #include <syscall.h>
 #include <test.h>
 
 /*
- * Load program "progname" and start running it in usermode.
- * Does not return except on error.
- *
- * Calls vfs_open on progname and thus may destroy it.
+ * Open the console as stdin, stdout, and stderr, which take fds 0-2
+ * because the table starts out empty.
  */
+static
 int
-runprogram(char *progname)
+runprogram_openstd(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	int i, fd, result;
+
+	for (i=0; i<3; i++) {
+		result = openfile_open("con:", modes[i], 0, &of);
+		if (result) {
+			return result;
+		}
+		result = filetable_place(ft, of, &fd);
+		if (result) {
+			openfile_decref(of);
+			return result;
+		}
+		KASSERT(fd == i);
+	}
+	return 0;
+}
+
+/*
+ * Load program "progname" and start running it in usermode, passing
+ * it the ARGC strings in ARGV. Does not return except on error.
+ */
+int
+runprogram(const char *progname, int argc, char **argv)
 {
 	struct addrspace *as;
 	struct vnode *v;
+	struct argbuf ab;
 	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
 	int result;
 
+	/* Collect the arguments. */
+	argbuf_init(&ab);
+	result = argbuf_fromkernel(&ab, argc, argv);
+	if (result) {
+		argbuf_cleanup(&ab);
+		return result;
+	}
+
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
+		argbuf_cleanup(&ab);
 		return result;
 	}
 
 	/* We should be a new process. */
 	KASSERT(proc_getas() == NULL);
 
+	result = runprogram_openstd(curproc->p_filetable);
+	if (result) {
+		/* the table goes away when curproc is destroyed */
+		vfs_close(v);
+		argbuf_cleanup(&ab);
+		return result;
+	}
+
 	/* Create a new address space. */
 	as = as_create();
 	if (as == NULL) {
 		vfs_close(v);
+		argbuf_cleanup(&ab);
 		return ENOMEM;
 	}
 
@@ -84,6 +130,7 @@ runprogram(char *progname)
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
+		argbuf_cleanup(&ab);
 		return result;
 	}
 
@@ -94,11 +141,19 @@ runprogram(char *progname)
 	result = as_define_stack(as, &stackptr);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
+		argbuf_cleanup(&ab);
+		return result;
+	}
+
+	/* Put the arguments on the stack. */
+	result = argbuf_copyout(&ab, &stackptr, &uargv);
+	argbuf_cleanup(&ab);
+	if (result) {
 		return result;
 	}
 
 	/* Warp to user mode. */
-	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
+	enter_new_process(argc, uargv,
 			  NULL /*userspace addr of environment*/,
 			  stackptr, entrypoint);
 
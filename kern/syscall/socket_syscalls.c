@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Socket system calls: socket, bind, connect, getsockname, sendto,
+ * recvfrom. The sockets themselves are in net/socket.c; this is just
+ * the descriptors and the copying in and out of addresses. read and
+ * write on a connected socket go through the vnode, like any file.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/iovec.h>
+#include <kern/socket.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <filetable.h>
+#include <copyinout.h>
+#include <net.h>
+#include <syscall.h>
+
+int
+sys_socket(int domain, int type, int protocol, int32_t *retval)
+{
+	struct vnode *vn;
+	struct openfile *of;
+	int fd, result;
+
+	if (domain != PF_LNET) {
+		return EAFNOSUPPORT;
+	}
+	if (type != SOCK_DGRAM) {
+		return ESOCKTNOSUPPORT;
+	}
+	if (protocol != 0) {
+		return EPROTONOSUPPORT;
+	}
+
+	result = socket_create(&vn);
+	if (result) {
+		return result;
+	}
+	result = openfile_fromvnode(vn, O_RDWR, &of);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	result = filetable_unshare(&curproc->p_filetable);
+	if (result == 0) {
+		result = filetable_place(curproc->p_filetable, of, &fd);
+	}
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	*retval = fd;
+	return 0;
+}
+
+/*
+ * Fetch a socket address from userspace.
+ */
+static
+int
+socket_getaddr(const_userptr_t user_addr, socklen_t len,
+	       struct sockaddr_ln *addr)
+{
+	if (len < 0 || (size_t)len < sizeof(*addr)) {
+		return EINVAL;
+	}
+	return copyin(user_addr, addr, sizeof(*addr));
+}
+
+/*
+ * Hand back a socket address, truncated to the caller's buffer, and
+ * its real length.
+ */
+static
+int
+socket_putaddr(const struct sockaddr_ln *addr, userptr_t user_addr,
+	       userptr_t user_len)
+{
+	socklen_t len;
+	int result;
+
+	result = copyin(user_len, &len, sizeof(len));
+	if (result) {
+		return result;
+	}
+	if (len < 0) {
+		return EINVAL;
+	}
+	if ((size_t)len > sizeof(*addr)) {
+		len = sizeof(*addr);
+	}
+	result = copyout(addr, user_addr, len);
+	if (result) {
+		return result;
+	}
+	len = sizeof(*addr);
+	return copyout(&len, user_len, sizeof(len));
+}
+
+int
+sys_bind(int fd, const_userptr_t user_addr, socklen_t len)
+{
+	struct sockaddr_ln addr;
+	struct openfile *of;
+	int result;
+
+	result = socket_getaddr(user_addr, len, &addr);
+	if (result) {
+		return result;
+	}
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = socket_bind(of->of_vn, &addr);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_connect(int fd, const_userptr_t user_addr, socklen_t len)
+{
+	struct sockaddr_ln addr;
+	struct openfile *of;
+	int result;
+
+	result = socket_getaddr(user_addr, len, &addr);
+	if (result) {
+		return result;
+	}
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = socket_connect(of->of_vn, &addr);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_getsockname(int fd, userptr_t user_addr, userptr_t user_len)
+{
+	struct sockaddr_ln addr;
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = socket_getname(of->of_vn, &addr);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	return socket_putaddr(&addr, user_addr, user_len);
+}
+
+/*
+ * Set up a uio on the user buffer BUF, like file_rw does.
+ */
+static
+void
+socket_uinit(struct iovec *iov, struct uio *u, userptr_t buf, size_t len,
+	     enum uio_rw rw)
+{
+	iov->iov_ubase = buf;
+	iov->iov_len = len;
+	u->uio_iov = iov;
+	u->uio_iovcnt = 1;
+	u->uio_offset = 0;
+	u->uio_resid = len;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = proc_getas();
+}
+
+int
+sys_sendto(int fd, const_userptr_t buf, size_t len, int flags,
+	   const_userptr_t user_addr, socklen_t addrlen, int32_t *retval)
+{
+	struct sockaddr_ln addr;
+	struct openfile *of;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	if (len > 0x7fffffff) {
+		return EINVAL;
+	}
+	if (user_addr != NULL) {
+		result = socket_getaddr(user_addr, addrlen, &addr);
+		if (result) {
+			return result;
+		}
+	}
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	socket_uinit(&iov, &u, (userptr_t)buf, len, UIO_WRITE);
+	result = socket_sendto(of->of_vn, &u, flags,
+			       user_addr != NULL ? &addr : NULL);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	*retval = len;
+	return 0;
+}
+
+int
+sys_recvfrom(int fd, userptr_t buf, size_t len, int flags,
+	     userptr_t user_addr, userptr_t user_addrlen, int32_t *retval)
+{
+	struct sockaddr_ln addr;
+	struct openfile *of;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	if (len > 0x7fffffff) {
+		return EINVAL;
+	}
+	result = filetable_get(curproc->p_filetable, fd, &of);
+	if (result) {
+		return result;
+	}
+	socket_uinit(&iov, &u, buf, len, UIO_READ);
+	result = socket_recvfrom(of->of_vn, &u, flags, &addr);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	if (user_addr != NULL) {
+		result = socket_putaddr(&addr, user_addr, user_addrlen);
+		if (result) {
+			return result;
+		}
+	}
+	*retval = len - u.uio_resid;
+	return 0;
+}
@@ -28,7 +28,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
+#include <proc.h>
+#include <addrspace.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +59,53 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Map the time page into the current process, if it isn't already,
+ * and return its address. See <kern/timepage.h>.
+ */
+int
+sys___timepage(int32_t *retval)
+{
+	vaddr_t va;
+	int result;
+
+	result = as_timepage(proc_getas(), &va);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)va;
+	return 0;
+}
+
+/*
+ * Sleep for the time in *USER_REQ. We don't have signals, so the
+ * sleep is never cut short and the remaining time, if asked for, is
+ * always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	clocksleep_ns((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
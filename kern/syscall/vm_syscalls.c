@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Address space system calls: sbrk, mmap, munmap, madvise, mincore,
+ * mlock, munlock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <filetable.h>
+#include <syscall.h>
+
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	vaddr_t oldbreak;
+	int result;
+
+	result = as_sbrk(proc_getas(), amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * Map LEN bytes: anonymous memory, shared with children or private,
+ * or a private copy-on-write mapping of file FD from offset POS (see
+ * <kern/mman.h>). We pick the address; the caller's hint isn't even
+ * passed in. The address comes back in *RETVAL.
+ */
+int
+sys_mmap(size_t len, int prot, int flags, int fd, off_t pos,
+	 int32_t *retval)
+{
+	struct openfile *of;
+	bool writeable;
+	vaddr_t va;
+	int result;
+
+	if ((prot & PROT_READ) == 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	writeable = (prot & PROT_WRITE) != 0;
+
+	switch (flags & ~MAP_ANON) {
+	    case MAP_SHARED:
+		if ((flags & MAP_ANON) == 0) {
+			/* nothing would be written back */
+			return EINVAL;
+		}
+		break;
+	    case MAP_PRIVATE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (flags & MAP_ANON) {
+		if (fd != -1 || pos != 0) {
+			return EINVAL;
+		}
+		result = as_mmapanon(proc_getas(), len, writeable,
+				     (flags & MAP_SHARED) != 0, &va);
+	}
+	else {
+		result = filetable_get(curproc->p_filetable, fd, &of);
+		if (result) {
+			return result;
+		}
+		if ((of->of_flags & O_ACCMODE) == O_WRONLY) {
+			openfile_decref(of);
+			return EACCES;
+		}
+		result = as_mmap(proc_getas(), of->of_vn, pos, len,
+				 writeable, &va);
+		openfile_decref(of);
+	}
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)va;
+	return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	return as_munmap(proc_getas(), (vaddr_t)addr, len);
+}
+
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	return as_madvise(proc_getas(), (vaddr_t)addr, len, advice);
+}
+
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	return as_mincore(proc_getas(), (vaddr_t)addr, len, vec);
+}
+
+/*
+ * mlock and munlock work on whole pages, so the range is rounded out
+ * to page boundaries.
+ */
+static
+int
+mlock_common(userptr_t addr, size_t len, bool lock)
+{
+	vaddr_t va;
+
+	if (len > USERSPACETOP) {
+		return EINVAL;
+	}
+	va = (vaddr_t)addr & PAGE_FRAME;
+	len += (vaddr_t)addr - va;
+	return as_mlock(proc_getas(), va, len, lock);
+}
+
+int
+sys_mlock(userptr_t addr, size_t len)
+{
+	return mlock_common(addr, len, true);
+}
+
+int
+sys_munlock(userptr_t addr, size_t len)
+{
+	return mlock_common(addr, len, false);
+}
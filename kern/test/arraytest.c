@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <array.h>
+#include <list.h>
 #include <test.h>
 
 #define TESTSIZE 73
@@ -215,3 +216,177 @@ arraytest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Vectors hold their elements by value; use a struct that's bigger
+ * than a pointer to make sure the element size is honored.
+ */
+struct vtestelem {
+	unsigned ve_a;
+	uint64_t ve_b;
+};
+
+DECLVECTOR(vtestelem, static __UNUSED inline);
+DEFVECTOR(vtestelem, static __UNUSED inline);
+
+#define VE_B(i) ((uint64_t)(i) * 0x100000001ULL)
+
+int
+vectortest(int nargs, char **args)
+{
+	struct vtestelemvector *v;
+	struct vtestelem e, *ep;
+	unsigned i, x;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Beginning vector test...\n");
+	v = vtestelemvector_create();
+	KASSERT(v != NULL);
+	KASSERT(vtestelemvector_num(v) == 0);
+
+	/* 1. Fill it one at a time; this grows it many times. */
+	for (i=0; i<BIGTESTSIZE; i++) {
+		e.ve_a = i;
+		e.ve_b = VE_B(i);
+		result = vtestelemvector_add(v, e, &x);
+		KASSERT(result == 0);
+		KASSERT(x == i);
+	}
+	KASSERT(vtestelemvector_num(v) == BIGTESTSIZE);
+
+	/* 2. Check the contents, by value and in place */
+	for (i=0; i<BIGTESTSIZE; i++) {
+		e = vtestelemvector_get(v, i);
+		KASSERT(e.ve_a == i && e.ve_b == VE_B(i));
+		ep = vtestelemvector_getptr(v, i);
+		KASSERT(ep->ve_a == i && ep->ve_b == VE_B(i));
+	}
+
+	/* 3. Overwrite with set and through getptr */
+	for (i=0; i<BIGTESTSIZE; i++) {
+		if (i % 2) {
+			e.ve_a = BIGTESTSIZE - i;
+			e.ve_b = 0;
+			vtestelemvector_set(v, i, e);
+		}
+		else {
+			vtestelemvector_getptr(v, i)->ve_a = BIGTESTSIZE - i;
+			vtestelemvector_getptr(v, i)->ve_b = 0;
+		}
+	}
+	for (i=0; i<BIGTESTSIZE; i++) {
+		e = vtestelemvector_get(v, i);
+		KASSERT(e.ve_a == BIGTESTSIZE - i && e.ve_b == 0);
+	}
+
+	/* 4. Remove an entry and check the rest slid down */
+	vtestelemvector_remove(v, 1);
+	KASSERT(vtestelemvector_num(v) == BIGTESTSIZE-1);
+	KASSERT(vtestelemvector_get(v, 0).ve_a == BIGTESTSIZE);
+	for (i=1; i<BIGTESTSIZE-1; i++) {
+		KASSERT(vtestelemvector_get(v, i).ve_a == BIGTESTSIZE-i-1);
+	}
+
+	/* 5. Shrink, then grow past the old capacity */
+	result = vtestelemvector_setsize(v, 2);
+	KASSERT(result == 0);
+	result = vtestelemvector_setsize(v, BIGTESTSIZE*2);
+	KASSERT(result == 0);
+	KASSERT(vtestelemvector_get(v, 0).ve_a == BIGTESTSIZE);
+	KASSERT(vtestelemvector_get(v, 1).ve_a == BIGTESTSIZE-2);
+
+	vtestelemvector_destroy(v);
+
+	kprintf("Done.\n");
+	return 0;
+}
+
+struct ltestelem {
+	unsigned le_val;
+	struct listnode le_node;
+};
+
+DECLLIST(ltestelem, le_node, static __UNUSED inline);
+DEFLIST(ltestelem, le_node, static __UNUSED inline);
+
+int
+listtest(int nargs, char **args)
+{
+	struct ltestelem elems[TESTSIZE];
+	struct ltestelemlist lst;
+	struct ltestelem *le, *next;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Beginning list test...\n");
+
+	for (i=0; i<TESTSIZE; i++) {
+		elems[i].le_val = i;
+		listnode_init(&elems[i].le_node, &elems[i]);
+	}
+	ltestelemlist_init(&lst);
+	KASSERT(ltestelemlist_isempty(&lst));
+	KASSERT(ltestelemlist_remhead(&lst) == NULL);
+	KASSERT(ltestelemlist_remtail(&lst) == NULL);
+
+	/* Odd ones at the tail, even ones at the head. */
+	for (i=0; i<TESTSIZE; i++) {
+		if (i % 2) {
+			ltestelemlist_addtail(&lst, &elems[i]);
+		}
+		else {
+			ltestelemlist_addhead(&lst, &elems[i]);
+		}
+	}
+	KASSERT(ltestelemlist_count(&lst) == TESTSIZE);
+
+	/* Forwards: evens descending, then odds ascending */
+	i = 0;
+	LIST_FORALL(le, &lst.l, le_node) {
+		if (i <= (TESTSIZE-1)/2) {
+			KASSERT(le->le_val == 2*((TESTSIZE-1)/2 - i));
+		}
+		else {
+			KASSERT(le->le_val == 2*(i - (TESTSIZE-1)/2) - 1);
+		}
+		i++;
+	}
+	KASSERT(i == TESTSIZE);
+
+	/* Remove every element divisible by three while iterating */
+	LIST_FORALL_SAFE(le, next, &lst.l, le_node) {
+		if (le->le_val % 3 == 0) {
+			ltestelemlist_remove(&lst, le);
+		}
+	}
+	KASSERT(ltestelemlist_count(&lst) == TESTSIZE - (TESTSIZE+2)/3);
+	i = 0;
+	LIST_FORALL_REV(le, &lst.l, le_node) {
+		KASSERT(le->le_val % 3 != 0);
+		i++;
+	}
+	KASSERT(i == ltestelemlist_count(&lst));
+
+	/* Drain from both ends */
+	while (!ltestelemlist_isempty(&lst)) {
+		le = ltestelemlist_remhead(&lst);
+		KASSERT(le != NULL);
+		if (ltestelemlist_isempty(&lst)) {
+			break;
+		}
+		le = ltestelemlist_remtail(&lst);
+		KASSERT(le != NULL);
+	}
+	ltestelemlist_cleanup(&lst);
+	for (i=0; i<TESTSIZE; i++) {
+		listnode_cleanup(&elems[i].le_node);
+	}
+
+	kprintf("Done.\n");
+	return 0;
+}
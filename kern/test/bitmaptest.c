@@ -28,11 +28,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
 
 #define TESTSIZE 533
+#define BIGSIZE 21000
+
+/* in increasing order */
+static const uint32_t bigfree[] = { 3, 4095, 4096, 12345, 20999 };
 
 int
 bitmaptest(int nargs, char **args)
@@ -101,6 +106,80 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* allocating near a goal finds the next free bit, wrapping */
+	bitmap_unmark(b, 7);
+	bitmap_unmark(b, 300);
+	bitmap_unmark(b, TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 290, &x)==0 && x==300);
+	KASSERT(bitmap_alloc_near(b, 300, &x)==0 && x==TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 301, &x)==0 && x==7);
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+	bitmap_unmark(b, 9);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE, &x)==0 && x==9);
+	bitmap_destroy(b);
+
+	/* a map big enough for searches to skip over whole full parts */
+	b = bitmap_create(BIGSIZE);
+	KASSERT(b != NULL);
+	for (i=0; i<BIGSIZE; i++) {
+		KASSERT(bitmap_alloc(b, &x)==0 && x==(uint32_t)i);
+	}
+	KASSERT(bitmap_alloc(b, &x)==ENOSPC);
+	for (i=0; i<(int)ARRAYCOUNT(bigfree); i++) {
+		bitmap_unmark(b, bigfree[i]);
+	}
+	KASSERT(bitmap_alloc_near(b, 9000, &x)==0 && x==bigfree[3]);
+	KASSERT(bitmap_alloc_near(b, 20000, &x)==0 && x==bigfree[4]);
+	for (i=0; i<3; i++) {
+		KASSERT(bitmap_alloc(b, &x)==0 && x==bigfree[i]);
+	}
+	KASSERT(bitmap_alloc_near(b, 5, &x)==ENOSPC);
+	bitmap_unmark(b, bigfree[1]);
+	bitmap_recount(b);
+	KASSERT(bitmap_alloc(b, &x)==0 && x==bigfree[1]);
+
+	/* a range crossing a group boundary, not word-aligned at either end */
+	bitmap_unmark_range(b, 4001, 203);
+	for (i=4001; i<4204; i++) {
+		KASSERT(!bitmap_isset(b, i));
+	}
+	KASSERT(bitmap_isset(b, 4000) && bitmap_isset(b, 4204));
+	for (i=4001; i<4204; i++) {
+		KASSERT(bitmap_alloc(b, &x)==0 && x==(uint32_t)i);
+	}
+	KASSERT(bitmap_alloc(b, &x)==ENOSPC);
+	KASSERT(bitmap_count(b) == BIGSIZE);
+	bitmap_destroy(b);
+
+	/* runs: marking, counting, and allocating contiguous ranges */
+	b = bitmap_create(BIGSIZE);
+	KASSERT(b != NULL);
+	KASSERT(bitmap_count(b) == 0);
+	bitmap_mark_range(b, 5, 4100);
+	KASSERT(bitmap_count(b) == 4100);
+	KASSERT(!bitmap_isset(b, 4) && !bitmap_isset(b, 4105));
+	for (i=5; i<4105; i++) {
+		KASSERT(bitmap_isset(b, i));
+	}
+	/* the hole at 0-4 is too small; the run goes right after 4105 */
+	KASSERT(bitmap_alloc_range(b, 6, &x)==0 && x==4105);
+	KASSERT(bitmap_alloc_range(b, 5, &x)==0 && x==0);
+	KASSERT(bitmap_count(b) == 4111);
+	/* a single set bit in the middle of a long clear stretch */
+	bitmap_mark(b, 9000);
+	KASSERT(bitmap_alloc_range(b, 5000, &x)==0 && x==9001);
+	KASSERT(bitmap_alloc_range(b, 4889, &x)==0 && x==4111);
+	KASSERT(bitmap_alloc_range(b, BIGSIZE-14000, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_range(b, BIGSIZE-14001, &x)==0 && x==14001);
+	KASSERT(bitmap_count(b) == BIGSIZE);
+	KASSERT(bitmap_alloc_range(b, 1, &x)==ENOSPC);
+	/* the counts survive a recount */
+	bitmap_unmark_range(b, 100, 8000);
+	bitmap_recount(b);
+	KASSERT(bitmap_count(b) == BIGSIZE - 8000);
+	KASSERT(bitmap_alloc_range(b, 8000, &x)==0 && x==100);
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * File system throughput benchmark.
+ *
+ * Usage: fsbench filesystem [test [filesizek [iosize [nthreads]]]]
+ *
+ * The tests are seqwrite, seqread, randwrite, randread (each thread
+ * on a file of its own of FILESIZEK kilobytes, in IOSIZE transfers),
+ * create and unlink (FSB_NAMEOPS empty files per thread), and lookup
+ * (FSB_NAMEOPS lookups per thread of a path FSB_DEPTH directories
+ * deep); "all" (the default) runs them in that order. The read and
+ * random write tests create their files first if need be, untimed.
+ *
+ * Each test prints its rate, then the buffer cache statistics (which
+ * include the device reads and writes) accumulated during it. Files
+ * are left behind only if a test fails.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <buf.h>
+#include <test.h>
+
+#define FSB_MAXTHREADS	16
+#define FSB_MAXIOSIZE	65536
+#define FSB_NAMEOPS	200
+#define FSB_DEPTH	8
+
+enum fsb_test {
+	FSB_SEQWRITE,
+	FSB_SEQREAD,
+	FSB_RANDWRITE,
+	FSB_RANDREAD,
+	FSB_CREATE,
+	FSB_UNLINK,
+	FSB_LOOKUP,
+	FSB_NTESTS
+};
+
+static const char *const fsb_names[FSB_NTESTS] = {
+	"seqwrite", "seqread", "randwrite", "randread",
+	"create", "unlink", "lookup",
+};
+
+/* parameters, fixed for the duration of a run */
+static const char *fsb_fs;
+static size_t fsb_filesize, fsb_iosize;
+static unsigned fsb_nthreads;
+
+/* the test in progress */
+static enum fsb_test fsb_curtest;
+static struct semaphore *fsb_done;
+static volatile int fsb_error;
+
+static
+void
+fsb_filename(char *buf, size_t len, unsigned thread, int file)
+{
+	if (file < 0) {
+		snprintf(buf, len, "%s:fsbench.%u", fsb_fs, thread);
+	}
+	else {
+		snprintf(buf, len, "%s:fsbench.%u.%d", fsb_fs, thread, file);
+	}
+}
+
+static
+void
+fsb_dirname(char *buf, size_t len, unsigned depth)
+{
+	size_t pos;
+	unsigned i;
+
+	pos = snprintf(buf, len, "%s:", fsb_fs);
+	for (i=0; i<depth && pos < len; i++) {
+		pos += snprintf(buf + pos, len - pos, "%sfsbd%u",
+				i > 0 ? "/" : "", i);
+	}
+	KASSERT(pos < len);
+}
+
+/*
+ * Cheap per-thread pseudo-random offsets; the random device would
+ * cost more than the I/O.
+ */
+static
+uint32_t
+fsb_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+/*
+ * Do the file I/O for one thread. For the random tests the
+ * transfers are the same number as a sequential pass, at random
+ * IOSIZE-aligned offsets.
+ */
+static
+int
+fsb_io(unsigned thread, enum fsb_test test, char *buf)
+{
+	char name[64];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	size_t nios, i;
+	off_t pos;
+	uint32_t seed;
+	bool write;
+	int flags, result;
+
+	write = test == FSB_SEQWRITE || test == FSB_RANDWRITE;
+	flags = test == FSB_SEQWRITE ? O_WRONLY|O_CREAT|O_TRUNC :
+		write ? O_WRONLY : O_RDONLY;
+	fsb_filename(name, sizeof(name), thread, -1);
+	result = vfs_open(name, flags, 0664, &vn);
+	if (result) {
+		return result;
+	}
+
+	seed = thread + 1;
+	nios = fsb_filesize / fsb_iosize;
+	for (i=0; i<nios; i++) {
+		if (test == FSB_SEQWRITE || test == FSB_SEQREAD) {
+			pos = (off_t)i * fsb_iosize;
+		}
+		else {
+			pos = (off_t)(fsb_rand(&seed) % nios) * fsb_iosize;
+		}
+		uio_kinit(&iov, &ku, buf, fsb_iosize, pos,
+			  write ? UIO_WRITE : UIO_READ);
+		result = write ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+		if (result == 0 && ku.uio_resid > 0) {
+			result = EIO;
+		}
+		if (result) {
+			break;
+		}
+	}
+	vfs_close(vn);
+	return result;
+}
+
+static
+int
+fsb_names_op(unsigned thread, enum fsb_test test)
+{
+	char name[64];
+	struct vnode *vn;
+	unsigned i;
+	int result;
+
+	if (test == FSB_LOOKUP) {
+		fsb_dirname(name, sizeof(name), FSB_DEPTH);
+	}
+	for (i=0; i<FSB_NAMEOPS; i++) {
+		if (test == FSB_LOOKUP) {
+			result = vfs_lookup(name, &vn);
+			if (result == 0) {
+				VOP_DECREF(vn);
+			}
+		}
+		else if (test == FSB_CREATE) {
+			fsb_filename(name, sizeof(name), thread, i);
+			result = vfs_open(name, O_WRONLY|O_CREAT|O_EXCL, 0664,
+					  &vn);
+			if (result == 0) {
+				vfs_close(vn);
+			}
+		}
+		else {
+			fsb_filename(name, sizeof(name), thread, i);
+			result = vfs_remove(name);
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+void
+fsb_thread(void *buf, unsigned long thread)
+{
+	int result;
+
+	switch (fsb_curtest) {
+	    case FSB_CREATE:
+	    case FSB_UNLINK:
+	    case FSB_LOOKUP:
+		result = fsb_names_op(thread, fsb_curtest);
+		break;
+	    default:
+		result = fsb_io(thread, fsb_curtest, buf);
+		break;
+	}
+	if (result) {
+		fsb_error = result;
+	}
+	V(fsb_done);
+}
+
+/*
+ * Run TEST on all the threads and wait for them, returning the time
+ * taken in nanoseconds, or 0 on error.
+ */
+static
+uint64_t
+fsb_runthreads(enum fsb_test test, char **bufs)
+{
+	uint64_t start;
+	unsigned i, started;
+	int result;
+
+	fsb_curtest = test;
+	fsb_error = 0;
+	start = clock_now();
+	for (started=0; started<fsb_nthreads; started++) {
+		result = thread_fork("fsbench", NULL, fsb_thread,
+				     bufs[started], started);
+		if (result) {
+			fsb_error = result;
+			break;
+		}
+	}
+	for (i=0; i<started; i++) {
+		P(fsb_done);
+	}
+	if (fsb_error) {
+		kprintf("fsbench: %s: %s\n", fsb_names[test],
+			strerror(fsb_error));
+		return 0;
+	}
+	return clock_now() - start;
+}
+
+/*
+ * Make or remove the directory chain for the lookup test.
+ */
+static
+int
+fsb_dirs(bool make)
+{
+	char name[64];
+	unsigned i;
+	int result;
+
+	for (i=1; i<=FSB_DEPTH; i++) {
+		if (make) {
+			fsb_dirname(name, sizeof(name), i);
+			result = vfs_mkdir(name, 0775);
+		}
+		else {
+			fsb_dirname(name, sizeof(name), FSB_DEPTH + 1 - i);
+			result = vfs_rmdir(name);
+		}
+		if (result && (make || result != ENOENT)) {
+			kprintf("fsbench: %s: %s\n", name, strerror(result));
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+void
+fsb_report(enum fsb_test test, uint64_t ns)
+{
+	uint64_t amount, rate;
+
+	if (ns == 0) {
+		ns = 1;
+	}
+	if (test <= FSB_RANDREAD) {
+		/* in kilobytes */
+		amount = (uint64_t)(fsb_filesize / fsb_iosize) * fsb_iosize *
+			fsb_nthreads / 1024;
+		rate = amount * 1000000000ULL / ns;
+		kprintf("%-10s %8llu KB in %6llu ms: %llu.%llu MB/s\n",
+			fsb_names[test], amount, ns / 1000000,
+			rate / 1024, (rate % 1024) * 10 / 1024);
+	}
+	else {
+		amount = (uint64_t)FSB_NAMEOPS * fsb_nthreads;
+		rate = amount * 1000000000ULL / ns;
+		kprintf("%-10s %8llu ops in %6llu ms: %llu ops/s\n",
+			fsb_names[test], amount, ns / 1000000, rate);
+	}
+}
+
+static
+void
+fsb_cleanup(void)
+{
+	char name[64];
+	unsigned i;
+
+	for (i=0; i<fsb_nthreads; i++) {
+		fsb_filename(name, sizeof(name), i, -1);
+		(void)vfs_remove(name);
+	}
+	(void)fsb_dirs(false);
+}
+
+/* what earlier tests in the run have left for later ones */
+static bool fsb_havefiles, fsb_havenames;
+
+static
+int
+fsb_runtest(enum fsb_test test, char **bufs)
+{
+	uint64_t ns;
+	int result;
+
+	/* set up what the test needs, untimed */
+	if ((test == FSB_SEQREAD || test == FSB_RANDWRITE ||
+	     test == FSB_RANDREAD) && !fsb_havefiles) {
+		if (fsb_runthreads(FSB_SEQWRITE, bufs) == 0) {
+			return EIO;
+		}
+		fsb_havefiles = true;
+	}
+	if (test == FSB_UNLINK && !fsb_havenames) {
+		if (fsb_runthreads(FSB_CREATE, bufs) == 0) {
+			return EIO;
+		}
+	}
+	if (test == FSB_LOOKUP) {
+		result = fsb_dirs(true);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* don't charge this test for writing out the last one's data */
+	(void)vfs_sync();
+	buffer_resetstats();
+	ns = fsb_runthreads(test, bufs);
+	if (ns == 0) {
+		return EIO;
+	}
+	fsb_report(test, ns);
+	buffer_printstats();
+
+	if (test == FSB_SEQWRITE) {
+		fsb_havefiles = true;
+	}
+	fsb_havenames = test == FSB_CREATE;
+	if (test == FSB_LOOKUP) {
+		return fsb_dirs(false);
+	}
+	return 0;
+}
+
+int
+fsbench(int nargs, char **args)
+{
+	char *bufs[FSB_MAXTHREADS];
+	unsigned i, first, last;
+	int result;
+
+	if (nargs < 2 || nargs > 6) {
+		kprintf("Usage: fsbench filesystem [test [filesizek [iosize "
+			"[nthreads]]]]\n");
+		return EINVAL;
+	}
+	fsb_fs = args[1];
+	if (fsb_fs[strlen(fsb_fs)-1] == ':') {
+		/* Allow (but do not require) colon after device name */
+		args[1][strlen(fsb_fs)-1] = 0;
+	}
+	fsb_filesize = nargs > 3 ? (size_t)atoi(args[3]) * 1024 : 512*1024;
+	fsb_iosize = nargs > 4 ? (size_t)atoi(args[4]) : 4096;
+	fsb_nthreads = nargs > 5 ? (unsigned)atoi(args[5]) : 1;
+	if (fsb_iosize == 0 || fsb_iosize > FSB_MAXIOSIZE ||
+	    fsb_filesize < fsb_iosize ||
+	    fsb_nthreads == 0 || fsb_nthreads > FSB_MAXTHREADS) {
+		kprintf("fsbench: need 0 < iosize <= %u, iosize <= "
+			"filesize, and 1-%u threads\n", FSB_MAXIOSIZE,
+			FSB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	if (nargs < 3 || !strcmp(args[2], "all")) {
+		first = 0;
+		last = FSB_NTESTS - 1;
+	}
+	else {
+		for (first=0; first<FSB_NTESTS; first++) {
+			if (!strcmp(args[2], fsb_names[first])) {
+				break;
+			}
+		}
+		if (first == FSB_NTESTS) {
+			kprintf("fsbench: No test %s\n", args[2]);
+			return EINVAL;
+		}
+		last = first;
+	}
+
+	for (i=0; i<fsb_nthreads; i++) {
+		bufs[i] = kmalloc(fsb_iosize);
+		if (bufs[i] == NULL) {
+			while (i-- > 0) {
+				kfree(bufs[i]);
+			}
+			kprintf("fsbench: Out of memory\n");
+			return ENOMEM;
+		}
+		memset(bufs[i], 'A' + i, fsb_iosize);
+	}
+	fsb_done = sem_create("fsbench", 0);
+	if (fsb_done == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	kprintf("fsbench on %s: %uK files, %u byte I/O, %u thread%s\n",
+		fsb_fs, (unsigned)(fsb_filesize / 1024), (unsigned)fsb_iosize,
+		fsb_nthreads, fsb_nthreads == 1 ? "" : "s");
+	fsb_havefiles = fsb_havenames = false;
+	result = 0;
+	for (i=first; i<=last && result == 0; i++) {
+		result = fsb_runtest(i, bufs);
+	}
+	if (result == 0 && fsb_havenames) {
+		/* ran create alone; don't leave its files behind */
+		(void)fsb_runthreads(FSB_UNLINK, bufs);
+	}
+	if (result == 0) {
+		fsb_cleanup();
+	}
+	sem_destroy(fsb_done);
+ out:
+	for (i=0; i<fsb_nthreads; i++) {
+		kfree(bufs[i]);
+	}
+	return result;
+}
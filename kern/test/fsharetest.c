@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * False sharing microbenchmark.
+ *
+ * One thread per cpu (up to FSH_MAXTHREADS) bangs on a counter of its
+ * own, first with the counters packed together, then with each on a
+ * cache line of its own, as struct cpu and struct thread now lay out
+ * fields written by different cpus. The time for each is printed;
+ * with coherent caches the packed run pays for the lines bouncing
+ * between cpus. (System/161 doesn't model caches, so there the two
+ * should come out about the same.)
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define FSH_MAXTHREADS	8
+#define FSH_COUNTS	100000
+
+static struct {
+	volatile unsigned fs_count;
+} fsh_packed[FSH_MAXTHREADS];
+
+static struct {
+	volatile unsigned fs_count __aligned(CACHELINE_SIZE);
+} fsh_padded[FSH_MAXTHREADS];
+
+static volatile bool fsh_usepadded;
+static struct semaphore *fsh_start;
+static struct semaphore *fsh_done;
+
+static
+void
+fsh_thread(void *junk, unsigned long num)
+{
+	volatile unsigned *count;
+	unsigned run, i;
+
+	(void)junk;
+
+	/* Get onto a cpu of our own; yielding lets the move happen. */
+	thread_setaffinity((uint32_t)1 << num);
+	thread_yield();
+
+	for (run=0; run<2; run++) {
+		P(fsh_start);
+		count = fsh_usepadded ? &fsh_padded[num].fs_count :
+			&fsh_packed[num].fs_count;
+		for (i=0; i<FSH_COUNTS; i++) {
+			(*count)++;
+		}
+		V(fsh_done);
+	}
+}
+
+/*
+ * Release the threads and time them until they're all done.
+ */
+static
+uint32_t
+fsh_run(unsigned nthreads, bool padded)
+{
+	uint64_t start, delta;
+	unsigned i;
+
+	fsh_usepadded = padded;
+	start = clock_now();
+	for (i=0; i<nthreads; i++) {
+		V(fsh_start);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(fsh_done);
+	}
+	delta = clock_now() - start;
+
+	for (i=0; i<nthreads; i++) {
+		if ((padded ? fsh_padded[i].fs_count :
+		     fsh_packed[i].fs_count) != FSH_COUNTS) {
+			panic("fsharetest: thread %u lost counts\n", i);
+		}
+	}
+	return delta > 0xffffffffULL ? 0xffffffffU : (uint32_t)delta;
+}
+
+int
+fsharetest(int nargs, char **args)
+{
+	unsigned i, nthreads;
+	uint32_t packed, padded;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	nthreads = cpu_count();
+	if (nthreads > FSH_MAXTHREADS) {
+		nthreads = FSH_MAXTHREADS;
+	}
+	for (i=0; i<nthreads; i++) {
+		fsh_packed[i].fs_count = 0;
+		fsh_padded[i].fs_count = 0;
+	}
+	fsh_start = sem_create("fsh_start", 0);
+	fsh_done = sem_create("fsh_done", 0);
+	if (fsh_start == NULL || fsh_done == NULL) {
+		panic("fsharetest: sem_create failed\n");
+	}
+
+	kprintf("Starting false sharing test with %u threads...\n",
+		nthreads);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("fsharetest", NULL, fsh_thread, NULL, i);
+		if (result) {
+			panic("fsharetest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	packed = fsh_run(nthreads, false);
+	padded = fsh_run(nthreads, true);
+
+	sem_destroy(fsh_start);
+	sem_destroy(fsh_done);
+
+	kprintf("packed: %u us, one per cache line: %u us\n",
+		packed / 1000, padded / 1000);
+	kprintf("False sharing test done.\n");
+	return 0;
+}
@@ -115,13 +115,11 @@ int
 fstest_remove(const char *fs, const char *namesuffix)
 {
 	char name[32];
-	char buf[32];
 	int err;
 
 	MAKENAME();
 
-	strcpy(buf, name);
-	err = vfs_remove(buf);
+	err = vfs_remove(name);
 	if (err) {
 		kprintf("Could not remove %s: %s\n", name, strerror(err));
 		return -1;
@@ -156,9 +154,7 @@ fstest_write(const char *fs, const char *namesuffix,
 		flags |= O_TRUNC;
 	}
 
-	/* vfs_open destroys the string it's passed */
-	strcpy(buf, name);
-	err = vfs_open(buf, flags, 0664, &vn);
+	err = vfs_open(name, flags, 0664, &vn);
 	if (err) {
 		kprintf("Could not open %s for write: %s\n",
 			name, strerror(err));
@@ -223,9 +219,7 @@ fstest_read(const char *fs, const char *namesuffix)
 
 	MAKENAME();
 
-	/* vfs_open destroys the string it's passed */
-	strcpy(buf, name);
-	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	err = vfs_open(name, O_RDONLY, 0664, &vn);
 	if (err) {
 		kprintf("Could not open test file for read: %s\n",
 			strerror(err));
@@ -551,9 +545,7 @@ createstress_thread(void *fs, unsigned long num)
 		snprintf(namesuffix, sizeof(namesuffix), "%lu-%d", num, i);
 		MAKENAME();
 
-		/* vfs_open destroys the string it's passed */
-		strcpy(buf, name);
-		err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+		err = vfs_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
 		if (err) {
 			kprintf("Could not open %s for write: %s\n",
 				name, strerror(err));
@@ -591,9 +583,7 @@ createstress_thread(void *fs, unsigned long num)
 		snprintf(namesuffix, sizeof(namesuffix), "%lu-%d", num, i);
 		MAKENAME();
 
-		/* vfs_open destroys the string it's passed */
-		strcpy(buf, name);
-		err = vfs_open(buf, O_RDONLY, 0664, &vn);
+		err = vfs_open(name, O_RDONLY, 0664, &vn);
 		if (err) {
 			kprintf("Could not open %s for read: %s\n",
 				name, strerror(err));
@@ -725,7 +715,6 @@ printfile(int nargs, char **args)
 	struct uio ku;
 	off_t rpos=0, wpos=0;
 	char buf[128];
-	char outfile[16];
 	int result;
 	int done=0;
 
@@ -734,16 +723,13 @@ printfile(int nargs, char **args)
 		return EINVAL;
 	}
 
-	/* vfs_open destroys the string it's passed; make a copy */
-	strcpy(outfile, "con:");
-
 	result = vfs_open(args[1], O_RDONLY, 0664, &rv);
 	if (result) {
 		kprintf("printfile: %s\n", strerror(result));
 		return result;
 	}
 
-	result = vfs_open(outfile, O_WRONLY, 0664, &wv);
+	result = vfs_open("con:", O_WRONLY, 0664, &wv);
 	if (result) {
 		kprintf("printfile: output: %s\n", strerror(result));
 		vfs_close(rv);
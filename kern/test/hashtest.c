@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hash table test code.
+ *
+ * ht  fills a table well past several doublings, checking every key
+ *     (and some that aren't there) with both kinds of lookup after
+ *     each add, so lookups are exercised in the middle of resizes;
+ *     then empties it again.
+ *
+ * ht2 has writer threads repeatedly add and remove their own ranges
+ *     of keys, checking that what they find is exactly what they put
+ *     in, while reader threads do lockless lookups of any key and
+ *     check that whatever they find is live and the right one.
+ */
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <rcu.h>
+#include <hashtable.h>
+#include <test.h>
+
+#define HT_NKEYS	4096
+#define HT_INITBITS	0	/* start as small as allowed */
+
+#define HT2_NWRITERS	4
+#define HT2_NREADERS	4
+#define HT2_PERWRITER	512
+#define HT2_NKEYS	(HT2_NWRITERS * HT2_PERWRITER)
+#define HT2_ROUNDS	20
+
+#define HTT_LIVE	0x4a5b6c7d
+#define HTT_DEAD	0xdeadbeef
+
+struct htt_obj {
+	unsigned ho_magic;
+	unsigned ho_key;
+	struct hashnode ho_node;
+};
+
+static struct htt_obj *htt_objs;
+static struct hashtable htt_table;
+static volatile bool htt_stop;
+static unsigned htt_hits[HT2_NREADERS];
+static struct semaphore *htt_done;
+
+////////////////////////////////////////////////////////////
+// common
+
+/*
+ * Keys are hashed badly on purpose: keys 512 apart get the same hash
+ * value, so some chains stay long however big the table gets, and
+ * telling those keys apart is up to the MATCH function.
+ */
+static
+uint32_t
+htt_hash(unsigned key)
+{
+	return hash32(key % 512);
+}
+
+static
+bool
+htt_match(void *obj, const void *keyv)
+{
+	const struct htt_obj *ho = obj;
+	const unsigned *key = keyv;
+
+	return ho->ho_key == *key;
+}
+
+static
+void
+htt_makeobjs(unsigned num)
+{
+	unsigned i;
+
+	htt_objs = kmalloc(num * sizeof(htt_objs[0]));
+	if (htt_objs == NULL) {
+		panic("hashtest: Out of memory\n");
+	}
+	for (i=0; i<num; i++) {
+		htt_objs[i].ho_magic = HTT_LIVE;
+		htt_objs[i].ho_key = i;
+		hashnode_init(&htt_objs[i].ho_node, &htt_objs[i]);
+	}
+	if (hashtable_init(&htt_table, HT_INITBITS)) {
+		panic("hashtest: hashtable_init failed\n");
+	}
+}
+
+static
+void
+htt_destroyobjs(unsigned num)
+{
+	unsigned i;
+
+	hashtable_cleanup(&htt_table);
+	for (i=0; i<num; i++) {
+		hashnode_cleanup(&htt_objs[i].ho_node);
+		htt_objs[i].ho_magic = HTT_DEAD;
+	}
+	kfree(htt_objs);
+	htt_objs = NULL;
+}
+
+static
+void
+htt_add(unsigned key)
+{
+	hashtable_prepare(&htt_table);
+	hashtable_add(&htt_table, &htt_objs[key].ho_node, htt_hash(key));
+}
+
+static
+void
+htt_remove(unsigned key)
+{
+	hashtable_remove(&htt_table, &htt_objs[key].ho_node);
+}
+
+/*
+ * Look KEY up both ways; check the answers agree, and that anything
+ * found is live and has the key.
+ */
+static
+struct htt_obj *
+htt_lookup(unsigned key)
+{
+	struct htt_obj *a, *b;
+
+	a = hashtable_lookup(&htt_table, htt_hash(key), htt_match, &key);
+	rcu_read_lock();
+	b = hashtable_lookup_rcu(&htt_table, htt_hash(key), htt_match, &key);
+	rcu_read_unlock();
+	if (a != b) {
+		panic("hashtest: key %u: locked lookup got %p, rcu %p\n",
+		      key, a, b);
+	}
+	if (a != NULL && (a->ho_magic != HTT_LIVE || a->ho_key != key)) {
+		panic("hashtest: key %u: found the wrong object %p\n",
+		      key, a);
+	}
+	return a;
+}
+
+static
+void
+htt_check(unsigned key, bool present)
+{
+	struct htt_obj *ho;
+
+	ho = htt_lookup(key);
+	if (present && ho != &htt_objs[key]) {
+		panic("hashtest: key %u: lookup got %p, expected %p\n",
+		      key, ho, &htt_objs[key]);
+	}
+	if (!present && ho != NULL) {
+		panic("hashtest: key %u: found %p after removal\n", key, ho);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// ht
+
+int
+hashtest(int nargs, char **args)
+{
+	unsigned i, j, initbuckets;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Beginning hash table test...\n");
+	htt_makeobjs(HT_NKEYS);
+	initbuckets = hashtable_numbuckets(&htt_table);
+
+	for (i=0; i<HT_NKEYS; i++) {
+		htt_add(i);
+		/* the newest, a few older ones, and some not there yet */
+		htt_check(i, true);
+		for (j=0; j<4; j++) {
+			htt_check(random() % (i + 1), true);
+		}
+		if (i + 1 < HT_NKEYS) {
+			htt_check(i + 1 + random() % (HT_NKEYS - i - 1),
+				  false);
+		}
+	}
+	if (hashtable_count(&htt_table) != HT_NKEYS) {
+		panic("hashtest: count is %u, expected %u\n",
+		      hashtable_count(&htt_table), HT_NKEYS);
+	}
+	kprintf("%u keys: grew from %u to %u buckets\n", HT_NKEYS,
+		initbuckets, hashtable_numbuckets(&htt_table));
+	if (hashtable_numbuckets(&htt_table) <= initbuckets) {
+		panic("hashtest: table didn't grow\n");
+	}
+
+	/* take out the odd ones, then the rest */
+	for (i=1; i<HT_NKEYS; i+=2) {
+		htt_remove(i);
+		htt_check(i, false);
+		htt_check(i - 1, true);
+	}
+	for (i=0; i<HT_NKEYS; i++) {
+		htt_check(i, i % 2 == 0);
+	}
+	for (i=0; i<HT_NKEYS; i+=2) {
+		htt_remove(i);
+		htt_check(i, false);
+	}
+	if (hashtable_count(&htt_table) != 0) {
+		panic("hashtest: count is %u after emptying\n",
+		      hashtable_count(&htt_table));
+	}
+
+	htt_destroyobjs(HT_NKEYS);
+	kprintf("Hash table test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// ht2
+
+static
+void
+htt_writer(void *junk, unsigned long num)
+{
+	unsigned base, i, round;
+
+	(void)junk;
+
+	base = num * HT2_PERWRITER;
+	for (round=0; round<HT2_ROUNDS; round++) {
+		for (i=0; i<HT2_PERWRITER; i++) {
+			htt_add(base + i);
+		}
+		for (i=0; i<HT2_PERWRITER; i++) {
+			htt_check(base + i, true);
+		}
+		for (i=0; i<HT2_PERWRITER; i++) {
+			htt_remove(base + i);
+			htt_check(base + i, false);
+		}
+		/* readers may still be on the nodes; let them leave */
+		rcu_synchronize();
+	}
+	V(htt_done);
+}
+
+static
+void
+htt_reader(void *junk, unsigned long num)
+{
+	struct htt_obj *ho;
+	unsigned key, n;
+
+	(void)junk;
+
+	n = 0;
+	while (!htt_stop) {
+		key = random() % HT2_NKEYS;
+		rcu_read_lock();
+		ho = hashtable_lookup_rcu(&htt_table, htt_hash(key),
+					  htt_match, &key);
+		if (ho != NULL) {
+			if (ho->ho_magic != HTT_LIVE || ho->ho_key != key) {
+				panic("hashtest2: key %u: found the wrong "
+				      "object %p\n", key, ho);
+			}
+			n++;
+		}
+		rcu_read_unlock();
+		if (key % 16 == 0) {
+			thread_yield();
+		}
+	}
+	htt_hits[num] = n;
+	V(htt_done);
+}
+
+int
+hashtest2(int nargs, char **args)
+{
+	unsigned i, hits;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	htt_done = sem_create("htt_done", 0);
+	if (htt_done == NULL) {
+		panic("hashtest2: sem_create failed\n");
+	}
+	htt_makeobjs(HT2_NKEYS);
+	htt_stop = false;
+
+	kprintf("Starting concurrent hash table test...\n");
+	for (i=0; i<HT2_NREADERS; i++) {
+		result = thread_fork("hashtest2", NULL, htt_reader, NULL, i);
+		if (result) {
+			panic("hashtest2: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<HT2_NWRITERS; i++) {
+		result = thread_fork("hashtest2", NULL, htt_writer, NULL, i);
+		if (result) {
+			panic("hashtest2: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<HT2_NWRITERS; i++) {
+		P(htt_done);
+	}
+	htt_stop = true;
+	for (i=0; i<HT2_NREADERS; i++) {
+		P(htt_done);
+	}
+	hits = 0;
+	for (i=0; i<HT2_NREADERS; i++) {
+		hits += htt_hits[i];
+	}
+
+	kprintf("%u buckets, %u reader hits\n",
+		hashtable_numbuckets(&htt_table), hits);
+	htt_destroyobjs(HT2_NKEYS);
+	sem_destroy(htt_done);
+	kprintf("Concurrent hash table test done.\n");
+	return 0;
+}
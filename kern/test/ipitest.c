@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * IPI function call test.
+ *
+ * Queues a batch of calls on every cpu at once, waits for them, and
+ * checks each ran on the cpu it was sent to, in the order queued.
+ */
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <test.h>
+
+#define IPIT_NCALLS	4
+
+struct ipit_call {
+	struct ipi_call ic_call;
+	unsigned ic_seq;		/* order queued on its cpu */
+	unsigned ic_cpu;		/* where it ran */
+	unsigned ic_ran;		/* how many had run there before */
+};
+
+static unsigned ipit_count[32];		/* calls run, by cpu */
+
+static
+void
+ipit_func(void *arg)
+{
+	struct ipit_call *c = arg;
+
+	c->ic_cpu = curcpu->c_number;
+	c->ic_ran = ipit_count[c->ic_cpu]++;
+}
+
+int
+ipitest(int nargs, char **args)
+{
+	static struct ipit_call calls[32][IPIT_NCALLS];
+	unsigned ncpus, i, j;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = cpu_count();
+	if (ncpus > 32) {
+		ncpus = 32;
+	}
+	for (i=0; i<ncpus; i++) {
+		ipit_count[i] = 0;
+	}
+
+	kprintf("Starting IPI call test on %u cpus...\n", ncpus);
+	for (j=0; j<IPIT_NCALLS; j++) {
+		for (i=0; i<ncpus; i++) {
+			calls[i][j].ic_seq = j;
+			ipi_call(cpu_getcpu(i), &calls[i][j].ic_call,
+				 ipit_func, &calls[i][j]);
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		for (j=0; j<IPIT_NCALLS; j++) {
+			ipi_call_wait(&calls[i][j].ic_call);
+			if (calls[i][j].ic_cpu != i) {
+				panic("ipitest: cpu %u's call ran on %u\n",
+				      i, calls[i][j].ic_cpu);
+			}
+			if (calls[i][j].ic_ran != calls[i][j].ic_seq) {
+				panic("ipitest: cpu %u ran call %u as %u\n",
+				      i, calls[i][j].ic_seq,
+				      calls[i][j].ic_ran);
+			}
+		}
+	}
+
+	kprintf("IPI call test done.\n");
+	return 0;
+}
@@ -0,0 +1,918 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel microbenchmarks.
+ *
+ * Each benchmark is a loop timed in CPU cycles with mainbus_cycles().
+ * A run does KB_WARMUP untimed repetitions, then KB_REPS timed ones
+ * of kb_iters iterations each, and reports the per-iteration cost of
+ * the fastest, median, and 99th-percentile repetition. The benchmark
+ * thread is pinned to the cpu it starts on for the duration so all
+ * the cycle counts come from one counter, and so do any threads it
+ * forks.
+ *
+ * Usage: kb [name|all] [path]. The buffer cache benchmarks run on the
+ * file system holding PATH, which must be SFS; they use the first
+ * freemap block, which SFS itself reads and writes around the cache.
+ * The lookup benchmark looks up PATH. Without a path the buffer cache
+ * benchmarks are skipped and lookup uses ".".
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <mainbus.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <fs.h>
+#include <buf.h>
+#include <bitmap.h>
+#include <hashtable.h>
+#include <rcu.h>
+#include <uio.h>
+#include <kern/sfs.h>
+#include <test.h>
+
+#define KB_WARMUP	3
+#define KB_REPS		200
+
+struct kbench {
+	const char *kb_name;
+	unsigned kb_iters;		/* iterations per repetition */
+	unsigned long kb_arg;		/* passed to each function */
+	bool kb_needfs;			/* needs a buffer cache fs */
+	int (*kb_setup)(unsigned long arg);
+	int (*kb_run)(unsigned long arg, unsigned iters);
+	void (*kb_cleanup)(unsigned long arg);
+};
+
+static const char *kb_path;
+static struct fs *kb_fs;
+static uint32_t kb_samples[KB_REPS];
+
+////////////////////////////////////////////////////////////
+// locks
+
+static struct spinlock kb_spinlock;
+static struct lock *kb_lock;
+
+static
+int
+kb_spinlock_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		spinlock_acquire(&kb_spinlock);
+		spinlock_release(&kb_spinlock);
+	}
+	return 0;
+}
+
+static
+int
+kb_lock_setup(unsigned long arg)
+{
+	(void)arg;
+	kb_lock = lock_create("kb_lock");
+	return kb_lock == NULL ? ENOMEM : 0;
+}
+
+static
+int
+kb_lock_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		lock_acquire(kb_lock);
+		lock_release(kb_lock);
+	}
+	return 0;
+}
+
+static
+void
+kb_lock_cleanup(unsigned long arg)
+{
+	(void)arg;
+	lock_destroy(kb_lock);
+}
+
+////////////////////////////////////////////////////////////
+// threads
+
+static struct semaphore *kb_ping, *kb_pong;
+static volatile bool kb_stop;
+
+static
+int
+kb_sems_setup(unsigned long arg)
+{
+	(void)arg;
+	kb_ping = sem_create("kb_ping", 0);
+	kb_pong = sem_create("kb_pong", 0);
+	if (kb_ping == NULL || kb_pong == NULL) {
+		if (kb_ping != NULL) {
+			sem_destroy(kb_ping);
+		}
+		if (kb_pong != NULL) {
+			sem_destroy(kb_pong);
+		}
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+kb_sems_cleanup(unsigned long arg)
+{
+	(void)arg;
+	sem_destroy(kb_ping);
+	sem_destroy(kb_pong);
+}
+
+/*
+ * thread_join can't be used here, as thread_fork doesn't hand back
+ * the thread; the child signals on its way out instead, which is
+ * what the other thread tests do.
+ */
+static
+void
+kb_fork_thread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+	V(kb_pong);
+}
+
+static
+int
+kb_fork_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+	int result;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		result = thread_fork("kb_fork", NULL, kb_fork_thread, NULL, 0);
+		if (result) {
+			return result;
+		}
+		P(kb_pong);
+	}
+	return 0;
+}
+
+static
+void
+kb_pingpong_thread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+	while (1) {
+		P(kb_ping);
+		if (kb_stop) {
+			break;
+		}
+		V(kb_pong);
+	}
+	V(kb_pong);
+}
+
+static
+int
+kb_pingpong_setup(unsigned long arg)
+{
+	int result;
+
+	result = kb_sems_setup(arg);
+	if (result) {
+		return result;
+	}
+	kb_stop = false;
+	result = thread_fork("kb_pingpong", NULL, kb_pingpong_thread,
+			     NULL, 0);
+	if (result) {
+		kb_sems_cleanup(arg);
+	}
+	return result;
+}
+
+/* Each iteration is two switches: there and back. */
+static
+int
+kb_pingpong_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		V(kb_ping);
+		P(kb_pong);
+	}
+	return 0;
+}
+
+static
+void
+kb_pingpong_cleanup(unsigned long arg)
+{
+	kb_stop = true;
+	V(kb_ping);
+	P(kb_pong);
+	kb_sems_cleanup(arg);
+}
+
+////////////////////////////////////////////////////////////
+// kmalloc
+
+static
+int
+kb_kmalloc_run(unsigned long size, unsigned iters)
+{
+	unsigned i;
+	void *p;
+
+	for (i=0; i<iters; i++) {
+		p = kmalloc(size);
+		if (p == NULL) {
+			return ENOMEM;
+		}
+		kfree(p);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// random numbers
+
+static volatile uint32_t kb_sink;
+
+static
+int
+kb_random_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		kb_sink = random();
+	}
+	return 0;
+}
+
+static
+int
+kb_fastrandom_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		kb_sink = fastrandom();
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// uiomove
+
+/*
+ * Kernel-to-kernel block moves, the way the buffer cache and the
+ * sector layer do them. The "uio" benches take uiomove's one-iovec
+ * fast path (a multiple of 32 aligned bytes gets the block copy; an
+ * odd size gets memcpy); "uiosplit" spreads the same move over two
+ * iovecs so it goes through the general loop, for comparison.
+ */
+
+#define KB_UIOMAX	4096
+
+static char *kb_uiosrc, *kb_uiodst;
+
+static
+int
+kb_uio_setup(unsigned long size)
+{
+	KASSERT(size <= KB_UIOMAX);
+	kb_uiosrc = kmalloc(KB_UIOMAX);
+	kb_uiodst = kmalloc(KB_UIOMAX);
+	if (kb_uiosrc == NULL || kb_uiodst == NULL) {
+		kfree(kb_uiosrc);
+		kfree(kb_uiodst);
+		return ENOMEM;
+	}
+	memset(kb_uiosrc, 0x5a, KB_UIOMAX);
+	return 0;
+}
+
+static
+int
+kb_uio_run(unsigned long size, unsigned iters)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	for (i=0; i<iters; i++) {
+		uio_kinit(&iov, &ku, kb_uiodst, size, 0, UIO_READ);
+		result = uiomove(kb_uiosrc, size, &ku);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+kb_uiosplit_run(unsigned long size, unsigned iters)
+{
+	struct iovec iov[2];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	for (i=0; i<iters; i++) {
+		iov[0].iov_kbase = kb_uiodst;
+		iov[0].iov_len = size / 2;
+		iov[1].iov_kbase = kb_uiodst + size / 2;
+		iov[1].iov_len = size - size / 2;
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = 2;
+		ku.uio_offset = 0;
+		ku.uio_resid = size;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = UIO_READ;
+		ku.uio_space = NULL;
+		result = uiomove(kb_uiosrc, size, &ku);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+void
+kb_uio_cleanup(unsigned long size)
+{
+	(void)size;
+	kfree(kb_uiosrc);
+	kfree(kb_uiodst);
+	kb_uiosrc = kb_uiodst = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// buffer cache and vfs
+
+static
+int
+kb_buf_setup(unsigned long miss)
+{
+	struct buf *buf;
+	int result;
+
+	reserve_buffers(SFS_BLOCKSIZE);
+	if (!miss) {
+		/* make sure it's there to hit */
+		result = buffer_read(kb_fs, SFS_FREEMAP_START, SFS_BLOCKSIZE,
+				     &buf);
+		if (result) {
+			unreserve_buffers(SFS_BLOCKSIZE);
+			return result;
+		}
+		buffer_release(buf);
+	}
+	return 0;
+}
+
+/*
+ * A miss is forced by invalidating the buffer after each read. That
+ * would lose changes if anything had dirtied it, so stop if so.
+ */
+static
+int
+kb_buf_run(unsigned long miss, unsigned iters)
+{
+	struct buf *buf;
+	unsigned i;
+	int result;
+
+	for (i=0; i<iters; i++) {
+		result = buffer_read(kb_fs, SFS_FREEMAP_START, SFS_BLOCKSIZE,
+				     &buf);
+		if (result) {
+			return result;
+		}
+		if (!miss) {
+			buffer_release(buf);
+		}
+		else if (buffer_is_dirty(buf)) {
+			buffer_release(buf);
+			return EBUSY;
+		}
+		else {
+			buffer_release_and_invalidate(buf);
+		}
+	}
+	return 0;
+}
+
+static
+void
+kb_buf_cleanup(unsigned long miss)
+{
+	(void)miss;
+	unreserve_buffers(SFS_BLOCKSIZE);
+}
+
+static
+int
+kb_lookup_run(unsigned long arg, unsigned iters)
+{
+	struct vnode *vn;
+	unsigned i;
+	int result;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		result = vfs_lookup(kb_path, &vn);
+		if (result) {
+			return result;
+		}
+		VOP_DECREF(vn);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// bitmaps
+
+/*
+ * A map the size of a large freemap, with the low half fragmented:
+ * every 64th bit is set, so a range allocation of more than 63 bits
+ * has to measure and reject each of those runs before reaching the
+ * clear upper half. Single-bit allocations find the first hole via
+ * the hint, which is the common case. Each iteration undoes its
+ * changes.
+ */
+#define KB_BMBITS	65536
+#define KB_BMRANGE	64
+
+static struct bitmap *kb_bitmap;
+
+static
+int
+kb_bitmap_setup(unsigned long arg)
+{
+	unsigned i;
+
+	(void)arg;
+	kb_bitmap = bitmap_create(KB_BMBITS);
+	if (kb_bitmap == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<KB_BMBITS/2; i += KB_BMRANGE) {
+		bitmap_mark(kb_bitmap, i);
+	}
+	return 0;
+}
+
+static
+int
+kb_bmalloc_run(unsigned long arg, unsigned iters)
+{
+	unsigned i, x;
+	int result;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		result = bitmap_alloc(kb_bitmap, &x);
+		if (result) {
+			return result;
+		}
+		bitmap_unmark(kb_bitmap, x);
+	}
+	return 0;
+}
+
+static
+int
+kb_bmrange_run(unsigned long count, unsigned iters)
+{
+	unsigned i, x;
+	int result;
+
+	for (i=0; i<iters; i++) {
+		result = bitmap_alloc_range(kb_bitmap, count, &x);
+		if (result) {
+			return result;
+		}
+		bitmap_unmark_range(kb_bitmap, x, count);
+	}
+	return 0;
+}
+
+static
+int
+kb_bmmark_run(unsigned long count, unsigned iters)
+{
+	unsigned i;
+
+	for (i=0; i<iters; i++) {
+		bitmap_mark_range(kb_bitmap, KB_BMBITS/2, count);
+		bitmap_unmark_range(kb_bitmap, KB_BMBITS/2, count);
+	}
+	return 0;
+}
+
+static
+int
+kb_bmcount_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		if (bitmap_count(kb_bitmap) != KB_BMBITS/2/KB_BMRANGE) {
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+static
+int
+kb_bmrecount_run(unsigned long arg, unsigned iters)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		bitmap_recount(kb_bitmap);
+	}
+	return 0;
+}
+
+static
+void
+kb_bitmap_cleanup(unsigned long arg)
+{
+	(void)arg;
+	bitmap_destroy(kb_bitmap);
+	kb_bitmap = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// hash table
+
+/*
+ * Lookups in a hash table of KB_HTSIZE objects, locked or lockless
+ * (arg 1), against finding the same keys by scanning an array of
+ * them, which is what a table replaces; and an add and a remove.
+ */
+#define KB_HTSIZE	1024
+
+struct kb_htobj {
+	unsigned ko_key;
+	struct hashnode ko_node;
+};
+
+static struct kb_htobj *kb_htobjs;
+static struct hashtable kb_ht;
+
+static
+bool
+kb_htmatch(void *obj, const void *key)
+{
+	return ((struct kb_htobj *)obj)->ko_key == *(const unsigned *)key;
+}
+
+static
+int
+kb_ht_setup(unsigned long arg)
+{
+	unsigned i;
+	int result;
+
+	(void)arg;
+	kb_htobjs = kmalloc(KB_HTSIZE * sizeof(kb_htobjs[0]));
+	if (kb_htobjs == NULL) {
+		return ENOMEM;
+	}
+	result = hashtable_init(&kb_ht, 0);
+	if (result) {
+		kfree(kb_htobjs);
+		return result;
+	}
+	for (i=0; i<KB_HTSIZE; i++) {
+		kb_htobjs[i].ko_key = i;
+		hashnode_init(&kb_htobjs[i].ko_node, &kb_htobjs[i]);
+		hashtable_prepare(&kb_ht);
+		hashtable_add(&kb_ht, &kb_htobjs[i].ko_node, hash32(i));
+	}
+	return 0;
+}
+
+static
+int
+kb_htlookup_run(unsigned long rcu, unsigned iters)
+{
+	unsigned i, key;
+	void *obj;
+
+	for (i=0; i<iters; i++) {
+		key = i * 37 % KB_HTSIZE;
+		if (rcu) {
+			rcu_read_lock();
+			obj = hashtable_lookup_rcu(&kb_ht, hash32(key),
+						   kb_htmatch, &key);
+			rcu_read_unlock();
+		}
+		else {
+			obj = hashtable_lookup(&kb_ht, hash32(key),
+					       kb_htmatch, &key);
+		}
+		if (obj != &kb_htobjs[key]) {
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+static
+int
+kb_htscan_run(unsigned long arg, unsigned iters)
+{
+	unsigned i, j, key;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		key = i * 37 % KB_HTSIZE;
+		for (j=0; j<KB_HTSIZE; j++) {
+			if (kb_htobjs[j].ko_key == key) {
+				break;
+			}
+		}
+		if (j == KB_HTSIZE) {
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+static
+int
+kb_htadd_run(unsigned long arg, unsigned iters)
+{
+	unsigned i, key;
+
+	(void)arg;
+	for (i=0; i<iters; i++) {
+		key = i * 37 % KB_HTSIZE;
+		hashtable_remove(&kb_ht, &kb_htobjs[key].ko_node);
+		hashtable_add(&kb_ht, &kb_htobjs[key].ko_node, hash32(key));
+	}
+	return 0;
+}
+
+static
+void
+kb_ht_cleanup(unsigned long arg)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<KB_HTSIZE; i++) {
+		hashtable_remove(&kb_ht, &kb_htobjs[i].ko_node);
+		hashnode_cleanup(&kb_htobjs[i].ko_node);
+	}
+	hashtable_cleanup(&kb_ht);
+	kfree(kb_htobjs);
+	kb_htobjs = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// driver
+
+static const struct kbench kbenches[] = {
+	{ "spinlock",   1000, 0,    false, NULL, kb_spinlock_run, NULL },
+	{ "lock",       1000, 0,    false,
+	  kb_lock_setup, kb_lock_run, kb_lock_cleanup },
+	{ "fork",       8,    0,    false,
+	  kb_sems_setup, kb_fork_run, kb_sems_cleanup },
+	{ "pingpong",   100,  0,    false,
+	  kb_pingpong_setup, kb_pingpong_run, kb_pingpong_cleanup },
+	{ "kmalloc16",  100,  16,   false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc32",  100,  32,   false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc64",  100,  64,   false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc128", 100,  128,  false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc256", 100,  256,  false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc512", 100,  512,  false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc1k",  100,  1024, false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc2k",  100,  2048, false, NULL, kb_kmalloc_run, NULL },
+	{ "kmalloc4k",  100,  4096, false, NULL, kb_kmalloc_run, NULL },
+	{ "random",     100,  0,    false, NULL, kb_random_run, NULL },
+	{ "fastrandom", 100,  0,    false, NULL, kb_fastrandom_run, NULL },
+	{ "uio512",     100,  512,  false,
+	  kb_uio_setup, kb_uio_run, kb_uio_cleanup },
+	{ "uio511",     100,  511,  false,
+	  kb_uio_setup, kb_uio_run, kb_uio_cleanup },
+	{ "uio4k",      100,  4096, false,
+	  kb_uio_setup, kb_uio_run, kb_uio_cleanup },
+	{ "uiosplit512", 100, 512,  false,
+	  kb_uio_setup, kb_uiosplit_run, kb_uio_cleanup },
+	{ "uiosplit4k", 100,  4096, false,
+	  kb_uio_setup, kb_uiosplit_run, kb_uio_cleanup },
+	{ "bufhit",     100,  0,    true,
+	  kb_buf_setup, kb_buf_run, kb_buf_cleanup },
+	{ "bufmiss",    10,   1,    true,
+	  kb_buf_setup, kb_buf_run, kb_buf_cleanup },
+	{ "lookup",     100,  0,    false, NULL, kb_lookup_run, NULL },
+	{ "bmalloc",    100,  0,    false,
+	  kb_bitmap_setup, kb_bmalloc_run, kb_bitmap_cleanup },
+	{ "bmrange",    10,   KB_BMRANGE, false,
+	  kb_bitmap_setup, kb_bmrange_run, kb_bitmap_cleanup },
+	{ "bmmark",     100,  4096, false,
+	  kb_bitmap_setup, kb_bmmark_run, kb_bitmap_cleanup },
+	{ "bmcount",    100,  0,    false,
+	  kb_bitmap_setup, kb_bmcount_run, kb_bitmap_cleanup },
+	{ "bmrecount",  10,   0,    false,
+	  kb_bitmap_setup, kb_bmrecount_run, kb_bitmap_cleanup },
+	{ "htlookup",   100,  0,    false,
+	  kb_ht_setup, kb_htlookup_run, kb_ht_cleanup },
+	{ "htrcu",      100,  1,    false,
+	  kb_ht_setup, kb_htlookup_run, kb_ht_cleanup },
+	{ "htscan",     10,   0,    false,
+	  kb_ht_setup, kb_htscan_run, kb_ht_cleanup },
+	{ "htadd",      100,  0,    false,
+	  kb_ht_setup, kb_htadd_run, kb_ht_cleanup },
+};
+static const unsigned numkbenches = sizeof(kbenches) / sizeof(kbenches[0]);
+
+/*
+ * Time one repetition, returning cycles per iteration, or 0 with
+ * *ERR set if the benchmark failed.
+ */
+static
+uint32_t
+kb_rep(const struct kbench *kb, int *err)
+{
+	uint64_t start, cycles;
+
+	start = mainbus_cycles();
+	*err = kb->kb_run(kb->kb_arg, kb->kb_iters);
+	cycles = (mainbus_cycles() - start) / kb->kb_iters;
+	return cycles > 0xffffffffULL ? 0xffffffffU : (uint32_t)cycles;
+}
+
+static
+void
+kb_sort(uint32_t *v, unsigned n)
+{
+	unsigned i, j;
+	uint32_t x;
+
+	for (i=1; i<n; i++) {
+		x = v[i];
+		for (j=i; j>0 && v[j-1] > x; j--) {
+			v[j] = v[j-1];
+		}
+		v[j] = x;
+	}
+}
+
+static
+void
+kb_runone(const struct kbench *kb)
+{
+	unsigned i;
+	int result;
+
+	if (kb->kb_needfs && kb_fs == NULL) {
+		kprintf("%-12s (skipped; needs an SFS path)\n", kb->kb_name);
+		return;
+	}
+	if (kb->kb_setup != NULL) {
+		result = kb->kb_setup(kb->kb_arg);
+		if (result) {
+			kprintf("%-12s setup failed: %s\n", kb->kb_name,
+				strerror(result));
+			return;
+		}
+	}
+
+	result = 0;
+	for (i=0; i<KB_WARMUP && result == 0; i++) {
+		(void)kb_rep(kb, &result);
+	}
+	for (i=0; i<KB_REPS && result == 0; i++) {
+		kb_samples[i] = kb_rep(kb, &result);
+	}
+
+	if (kb->kb_cleanup != NULL) {
+		kb->kb_cleanup(kb->kb_arg);
+	}
+	if (result) {
+		kprintf("%-12s failed: %s\n", kb->kb_name, strerror(result));
+		return;
+	}
+
+	kb_sort(kb_samples, KB_REPS);
+	kprintf("%-12s %10u %10u %10u\n", kb->kb_name, kb_samples[0],
+		kb_samples[KB_REPS / 2], kb_samples[KB_REPS * 99 / 100]);
+}
+
+int
+kbench(int nargs, char **args)
+{
+	const char *name;
+	struct vnode *vn;
+	uint32_t oldaffinity;
+	unsigned i, ran;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: kb [name|all] [path]\n");
+		return EINVAL;
+	}
+	name = nargs > 1 ? args[1] : "all";
+	kb_path = nargs > 2 ? args[2] : ".";
+
+	kb_fs = NULL;
+	vn = NULL;
+	if (nargs > 2) {
+		result = vfs_lookup(kb_path, &vn);
+		if (result) {
+			kprintf("kb: %s: %s\n", kb_path, strerror(result));
+			return result;
+		}
+		if (vn->vn_fs != NULL &&
+		    vn->vn_fs->fs_ops->fsop_readblock != NULL) {
+			kb_fs = vn->vn_fs;
+		}
+	}
+
+	/* Stay on this cpu, so every count comes from the same counter. */
+	oldaffinity = thread_getaffinity();
+	thread_setaffinity((uint32_t)1 << curcpu->c_number);
+
+	kprintf("%-12s %10s %10s %10s  (cycles per iteration)\n",
+		"benchmark", "min", "median", "p99");
+	ran = 0;
+	spinlock_init(&kb_spinlock);
+	for (i=0; i<numkbenches; i++) {
+		if (strcmp(name, "all") && strcmp(name, kbenches[i].kb_name)) {
+			continue;
+		}
+		kb_runone(&kbenches[i]);
+		ran++;
+	}
+	spinlock_cleanup(&kb_spinlock);
+
+	thread_setaffinity(oldaffinity);
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (ran == 0) {
+		kprintf("kb: No benchmark %s\n", name);
+		return EINVAL;
+	}
+	return 0;
+}
@@ -36,6 +36,7 @@
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <kmemcache.h>
 #include <test.h>
 
 #include "opt-dumbvm.h"
@@ -378,3 +379,93 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Test object caches: objects must come back constructed, the
+ * constructor should only run for new objects, and everything
+ * constructed must be destructed by the time the cache is destroyed.
+ */
+
+#define KM5_NOBJS	100
+#define KM5_MAGIC	0x6b6d3521
+
+struct km5obj {
+	uint32_t magic;
+	unsigned serial;
+	char pad[52];
+};
+
+static unsigned km5_nctors, km5_ndtors;
+
+static
+int
+km5_ctor(void *obj)
+{
+	struct km5obj *ko = obj;
+
+	ko->magic = KM5_MAGIC;
+	ko->serial = km5_nctors++;
+	return 0;
+}
+
+static
+void
+km5_dtor(void *obj)
+{
+	struct km5obj *ko = obj;
+
+	KASSERT(ko->magic == KM5_MAGIC);
+	ko->magic = 0;
+	km5_ndtors++;
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	struct km5obj *objs[KM5_NOBJS];
+	unsigned i, round, nctors;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmem_cache test...\n");
+
+	km5_nctors = km5_ndtors = 0;
+	kc = kmem_cache_create("km5", sizeof(struct km5obj),
+			       km5_ctor, km5_dtor);
+	if (kc == NULL) {
+		panic("kmalloctest5: kmem_cache_create failed\n");
+	}
+
+	for (round=0; round<3; round++) {
+		nctors = km5_nctors;
+		for (i=0; i<KM5_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				panic("kmalloctest5: out of memory\n");
+			}
+			if (objs[i]->magic != KM5_MAGIC) {
+				panic("kmalloctest5: object not constructed\n");
+			}
+		}
+		if (round > 0 && km5_nctors - nctors >= KM5_NOBJS) {
+			panic("kmalloctest5: no objects were reused\n");
+		}
+		for (i=0; i<KM5_NOBJS; i++) {
+			kmem_cache_free(kc, objs[i]);
+		}
+	}
+
+	kmem_cache_destroy(kc);
+	if (km5_ndtors != km5_nctors) {
+		panic("kmalloctest5: %u objects constructed, %u destructed\n",
+		      km5_nctors, km5_ndtors);
+	}
+
+	kprintf("kmem_cache test done\n");
+	return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests and a benchmark for memcpy, memmove, memset, and bzero.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h> /* for PAGE_SIZE */
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// mct
+
+/*
+ * Each operation is tried at all combinations of alignment up to
+ * MAXALIGN and all lengths up to MAXLEN, plus a few big ones, in
+ * buffers of two pages. The buffers are filled with known patterns
+ * first so we can check both that the right bytes were written and
+ * that nothing else was.
+ */
+
+#define BUFSIZE		(2*PAGE_SIZE)
+#define MAXALIGN	8
+#define MAXLEN		80
+#define MOVEBASE	64
+
+static const size_t biglens[] = { 511, 512, 513, PAGE_SIZE };
+#define NBIGLENS (sizeof(biglens) / sizeof(biglens[0]))
+
+static const size_t moveshifts[] = { 1, 5, 16 };
+#define NMOVESHIFTS (sizeof(moveshifts) / sizeof(moveshifts[0]))
+
+static
+unsigned char
+pattern(unsigned which, size_t i)
+{
+	return (i * (which ? 13 : 7) + (which ? 201 : 3)) & 0xff;
+}
+
+static
+void
+fillbuf(unsigned char *buf, unsigned which)
+{
+	size_t i;
+
+	for (i=0; i<BUFSIZE; i++) {
+		buf[i] = pattern(which, i);
+	}
+}
+
+/*
+ * Check that BUF holds pattern WHICH, except for LEN bytes at offset
+ * TO, which should hold pattern FROMWHICH starting at offset FROM,
+ * or (if FROM is negative) all CH.
+ */
+static
+bool
+checkbuf(const char *what, const unsigned char *buf, unsigned which,
+	 size_t to, unsigned fromwhich, int from, unsigned char ch,
+	 size_t len)
+{
+	size_t i;
+	unsigned char want;
+
+	for (i=0; i<BUFSIZE; i++) {
+		if (i < to || i >= to + len) {
+			want = pattern(which, i);
+		}
+		else if (from < 0) {
+			want = ch;
+		}
+		else {
+			want = pattern(fromwhich, from + i - to);
+		}
+		if (buf[i] != want) {
+			kprintf("%s failed (to %zu from %d len %zu): "
+				"byte %zu is 0x%x, not 0x%x\n",
+				what, to, from, len, i, buf[i], want);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Try all the operations with one length at all alignments.
+ */
+static
+bool
+memtest_len(unsigned char *src, unsigned char *dst, size_t len)
+{
+	size_t doff, soff, to, from;
+	unsigned i;
+
+	for (doff=0; doff<MAXALIGN; doff++) {
+		for (soff=0; soff<MAXALIGN; soff++) {
+			fillbuf(src, 0);
+			fillbuf(dst, 1);
+			memcpy(dst + doff, src + soff, len);
+			if (!checkbuf("memcpy", dst, 1, doff, 0, soff, 0,
+				      len)) {
+				return false;
+			}
+
+			/* overlapping moves, up and down */
+			for (i=0; i<NMOVESHIFTS; i++) {
+				to = MOVEBASE + doff + moveshifts[i];
+				from = MOVEBASE + soff;
+				fillbuf(dst, 1);
+				memmove(dst + to, dst + from, len);
+				if (!checkbuf("memmove", dst, 1, to, 1, from,
+					      0, len)) {
+					return false;
+				}
+
+				to = MOVEBASE + doff;
+				from = MOVEBASE + soff + moveshifts[i];
+				fillbuf(dst, 1);
+				memmove(dst + to, dst + from, len);
+				if (!checkbuf("memmove", dst, 1, to, 1, from,
+					      0, len)) {
+					return false;
+				}
+			}
+		}
+
+		fillbuf(dst, 1);
+		memset(dst + doff, 0xa5 ^ len, len);
+		if (!checkbuf("memset", dst, 1, doff, 0, -1, 0xa5 ^ len,
+			      len)) {
+			return false;
+		}
+
+		fillbuf(dst, 1);
+		bzero(dst + doff, len);
+		if (!checkbuf("bzero", dst, 1, doff, 0, -1, 0, len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+memtest(int nargs, char **args)
+{
+	unsigned char *src, *dst;
+	size_t len;
+	unsigned i;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting memcpy/memmove/memset test...\n");
+
+	src = kmalloc(BUFSIZE);
+	dst = kmalloc(BUFSIZE);
+	if (src == NULL || dst == NULL) {
+		kprintf("memtest: Out of memory\n");
+		kfree(src);
+		kfree(dst);
+		return 0;
+	}
+
+	ok = true;
+	for (len=0; ok && len<=MAXLEN; len++) {
+		ok = memtest_len(src, dst, len);
+	}
+	for (i=0; ok && i<NBIGLENS; i++) {
+		ok = memtest_len(src, dst, biglens[i]);
+	}
+
+	kfree(src);
+	kfree(dst);
+
+	kprintf("memtest %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// mcb
+
+/*
+ * Time memcpy, memmove, and memset on disk-sector-sized and
+ * page-sized blocks, with the pointers aligned, misaligned the same
+ * way, and misaligned differently.
+ */
+
+#define BENCHLOOPS	200
+
+static const size_t benchlens[] = { 512, PAGE_SIZE };
+#define NBENCHLENS (sizeof(benchlens) / sizeof(benchlens[0]))
+
+static const struct {
+	const char *name;
+	unsigned doff, soff;
+} benchaligns[] = {
+	{ "aligned", 0, 0 },
+	{ "offset", 3, 3 },
+	{ "skewed", 1, 2 },
+};
+#define NBENCHALIGNS (sizeof(benchaligns) / sizeof(benchaligns[0]))
+
+/*
+ * Return the average time per call in nanoseconds, given the times
+ * before and after BENCHLOOPS calls.
+ */
+static
+uint32_t
+bench_nsec(struct timespec *before, struct timespec *after)
+{
+	struct timespec diff;
+
+	timespec_sub(after, before, &diff);
+	return (diff.tv_sec * 1000000000U + diff.tv_nsec) / BENCHLOOPS;
+}
+
+int
+membench(int nargs, char **args)
+{
+	unsigned char *src, *dst;
+	struct timespec before, after;
+	uint32_t cpy, mov, set;
+	size_t len;
+	unsigned i, j, k;
+
+	(void)nargs;
+	(void)args;
+
+	src = kmalloc(BUFSIZE);
+	dst = kmalloc(BUFSIZE);
+	if (src == NULL || dst == NULL) {
+		kprintf("membench: Out of memory\n");
+		kfree(src);
+		kfree(dst);
+		return 0;
+	}
+	fillbuf(src, 0);
+	fillbuf(dst, 1);
+
+	kprintf("Size  Alignment   memcpy ns  memmove ns   memset ns\n");
+	for (i=0; i<NBENCHLENS; i++) {
+		len = benchlens[i];
+		for (j=0; j<NBENCHALIGNS; j++) {
+			unsigned char *d = dst + benchaligns[j].doff;
+			unsigned char *s = src + benchaligns[j].soff;
+
+			gettime(&before);
+			for (k=0; k<BENCHLOOPS; k++) {
+				memcpy(d, s, len);
+			}
+			gettime(&after);
+			cpy = bench_nsec(&before, &after);
+
+			/* overlapping, so it has to go backwards */
+			gettime(&before);
+			for (k=0; k<BENCHLOOPS; k++) {
+				memmove(d + 8, d, len);
+			}
+			gettime(&after);
+			mov = bench_nsec(&before, &after);
+
+			gettime(&before);
+			for (k=0; k<BENCHLOOPS; k++) {
+				memset(d, k, len);
+			}
+			gettime(&after);
+			set = bench_nsec(&before, &after);
+
+			kprintf("%4zu  %-9s %11u %11u %11u\n", len,
+				benchaligns[j].name, cpy, mov, set);
+		}
+	}
+
+	kfree(src);
+	kfree(dst);
+
+	return 0;
+}
@@ -29,16 +29,186 @@
 
 /*
  * Network test code.
+ *
+ * These run against the first network interface, and are meant for a
+ * few sys161 instances on one hub: run "net recv" or "net echo" on
+ * one and "net send" on another, and compare packets per second.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <net.h>
 #include <test.h>
 
+#define NETTEST_SIZE	64		/* default payload size */
+#define NETTEST_WAIT	10		/* seconds to wait for a packet */
+
+/*
+ * Nanoseconds since START.
+ */
+static
+uint64_t
+nettest_elapsed(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+static
+void
+nettest_report(const char *what, unsigned count, unsigned bytes,
+	       uint64_t ns)
+{
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%s %u packets (%u bytes) in %llu ms: %llu packets/sec\n",
+		what, count, bytes, (unsigned long long)(ns / 1000000),
+		(unsigned long long)count * 1000000000ULL / ns);
+}
+
+/*
+ * Send COUNT packets of SIZE bytes to DST, as fast as the card will
+ * take them, each numbered in its first four bytes.
+ */
+static
+int
+nettest_send(struct netif *ni, unsigned count, unsigned size, uint16_t dst)
+{
+	struct timespec start;
+	struct pbuf *pb;
+	unsigned i, j;
+	int result;
+
+	if (size < sizeof(uint32_t) || size > ni->ni_mtu) {
+		kprintf("net send: size must be 4 to %u\n", ni->ni_mtu);
+		return EINVAL;
+	}
+
+	gettime(&start);
+	for (i=0; i<count; ) {
+		pb = pbuf_get();
+		if (pb == NULL) {
+			/* everything's on the transmit queue */
+			thread_yield();
+			continue;
+		}
+		for (j=0; j<size; j++) {
+			PBUF_DATA(pb)[j] = (char)j;
+		}
+		*(uint32_t *)PBUF_DATA(pb) = i;
+		pb->pb_len = size;
+
+		result = netif_output(ni, pb, dst);
+		if (result == EAGAIN) {
+			thread_yield();
+			continue;
+		}
+		if (result) {
+			kprintf("net send: %s\n", strerror(result));
+			return result;
+		}
+		i++;
+	}
+	nettest_report("Sent", count, count * size, nettest_elapsed(&start));
+	return 0;
+}
+
+/*
+ * Take COUNT packets off the interface; if ECHO, send each back where
+ * it came from. Timing starts at the first packet.
+ */
+static
+int
+nettest_recv(struct netif *ni, unsigned count, bool echo)
+{
+	struct timespec start;
+	struct pbufq q;
+	struct pbuf *pb;
+	unsigned got, bytes, batches, lost;
+	uint32_t seq, next;
+	int result;
+
+	pbufq_init(&q);
+	got = bytes = batches = lost = 0;
+	next = 0;
+	while (got < count) {
+		result = netif_recvbatch(ni, &q, true,
+					 NETTEST_WAIT * 1000000000ULL);
+		if (result) {
+			kprintf("net recv: %s after %u packets\n",
+				strerror(result), got);
+			return result;
+		}
+		if (got == 0) {
+			gettime(&start);
+		}
+		batches++;
+		while ((pb = pbufq_remhead(&q)) != NULL) {
+			if (got == count) {
+				pbuf_put(pb);
+				continue;
+			}
+			got++;
+			bytes += pb->pb_len;
+			if (pb->pb_len >= sizeof(uint32_t)) {
+				seq = *(uint32_t *)PBUF_DATA(pb);
+				if (seq > next) {
+					lost += seq - next;
+				}
+				next = seq + 1;
+			}
+			if (echo) {
+				netif_output(ni, pb, pb->pb_linksrc);
+			}
+			else {
+				pbuf_put(pb);
+			}
+		}
+	}
+	nettest_report(echo ? "Echoed" : "Received", got, bytes,
+		       nettest_elapsed(&start));
+	kprintf("%u batches, %u missing by sequence number\n", batches, lost);
+	return 0;
+}
+
 int
 nettest(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
-	kprintf("No network support available\n");
-	return 1;
+	struct netif *ni;
+	unsigned count, size;
+	uint16_t dst;
+
+	ni = netif_get(0);
+	if (ni == NULL) {
+		kprintf("No network interfaces\n");
+		return ENODEV;
+	}
+
+	if (nargs == 1) {
+		netif_printall();
+		return 0;
+	}
+
+	count = nargs > 2 ? atoi(args[2]) : 1000;
+	if (!strcmp(args[1], "send") && nargs <= 5) {
+		size = nargs > 3 ? atoi(args[3]) : NETTEST_SIZE;
+		dst = nargs > 4 ? atoi(args[4]) : NET_BROADCAST;
+		return nettest_send(ni, count, size, dst);
+	}
+	if (!strcmp(args[1], "recv") && nargs <= 3) {
+		return nettest_recv(ni, count, false);
+	}
+	if (!strcmp(args[1], "echo") && nargs <= 3) {
+		return nettest_recv(ni, count, true);
+	}
+
+	kprintf("Usage: net [send [count [size [addr]]] | recv [count] | "
+		"echo [count]]\n");
+	return EINVAL;
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-cpu counter test code.
+ *
+ * Threads count on one counter, yielding now and then so they move
+ * between cpus, and the total read afterwards must come out exact.
+ */
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <pcpu.h>
+#include <test.h>
+
+#define NTHREADS	8
+#define NCOUNTS		5000
+
+static struct pcpu_counter pcput_counter =
+	PCPU_COUNTER_INITIALIZER("test.pcpu");
+static struct semaphore *pcput_done;
+
+static
+void
+pcput_thread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<NCOUNTS; i++) {
+		pcpu_counter_add(&pcput_counter, num + 1);
+		if (i % 100 == 0) {
+			thread_yield();
+		}
+	}
+	V(pcput_done);
+}
+
+int
+pcputest(int nargs, char **args)
+{
+	unsigned i, expected, got;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	pcput_done = sem_create("pcput_done", 0);
+	if (pcput_done == NULL) {
+		panic("pcputest: sem_create failed\n");
+	}
+	pcpu_counter_reset(&pcput_counter);
+
+	kprintf("Starting per-cpu counter test...\n");
+	expected = 0;
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("pcputest", NULL, pcput_thread, NULL, i);
+		if (result) {
+			panic("pcputest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+		expected += NCOUNTS * (i + 1);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(pcput_done);
+	}
+	sem_destroy(pcput_done);
+
+	got = pcpu_counter_read(&pcput_counter);
+	if (got != expected) {
+		panic("pcputest: counted %u, expected %u\n", got, expected);
+	}
+	pcpu_counter_reset(&pcput_counter);
+	if (pcpu_counter_read(&pcput_counter) != 0) {
+		panic("pcputest: counter not reset\n");
+	}
+
+	kprintf("%u counted\n", got);
+	kprintf("Per-cpu counter test done.\n");
+	return 0;
+}
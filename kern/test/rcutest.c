@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * RCU test code.
+ *
+ * Readers keep looking at a shared object while a writer replaces it,
+ * freeing the old versions after grace periods, alternately with
+ * rcu_synchronize and rcu_call. An old version is poisoned before
+ * it's freed, so a reader that could still see one would notice.
+ */
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <rcu.h>
+#include <test.h>
+
+#define NREADERS	6
+#define NREPLACES	200
+#define NSPINS		50
+
+#define RCUT_LIVE	0x11ce11ce
+#define RCUT_DEAD	0xdeadbeef
+
+struct rcut_obj {
+	unsigned ro_magic;
+	unsigned ro_val;
+	unsigned ro_square;
+	struct rcu_head ro_rcu;
+};
+
+static struct rcut_obj *rcut_shared;
+static volatile bool rcut_stop;
+static volatile unsigned rcut_reads;
+static struct semaphore *rcut_done;
+
+static
+void
+rcut_kill(void *objv)
+{
+	struct rcut_obj *obj = objv;
+
+	obj->ro_magic = RCUT_DEAD;
+	obj->ro_val = RCUT_DEAD;
+	kfree(obj);
+}
+
+static
+void
+rcut_reader(void *junk, unsigned long num)
+{
+	struct rcut_obj *obj;
+	unsigned i, val;
+
+	(void)junk;
+
+	while (!rcut_stop) {
+		rcu_read_lock();
+		obj = RCU_READ(rcut_shared);
+		val = obj->ro_val;
+		/* Hang on to it a while, without switching. */
+		for (i=0; i<NSPINS; i++) {
+			if (obj->ro_magic != RCUT_LIVE ||
+			    obj->ro_square != val * val) {
+				panic("rcutest: reader %lu: object %p freed "
+				      "under it\n", num, obj);
+			}
+		}
+		rcu_read_unlock();
+		rcut_reads++;
+		thread_yield();
+	}
+	V(rcut_done);
+}
+
+static
+struct rcut_obj *
+rcut_make(unsigned val)
+{
+	struct rcut_obj *obj;
+
+	obj = kmalloc(sizeof(*obj));
+	if (obj == NULL) {
+		panic("rcutest: Out of memory\n");
+	}
+	obj->ro_magic = RCUT_LIVE;
+	obj->ro_val = val;
+	obj->ro_square = val * val;
+	return obj;
+}
+
+int
+rcutest(int nargs, char **args)
+{
+	struct rcut_obj *old;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	rcut_done = sem_create("rcut_done", 0);
+	if (rcut_done == NULL) {
+		panic("rcutest: sem_create failed\n");
+	}
+	rcut_stop = false;
+	rcut_reads = 0;
+	rcut_shared = rcut_make(0);
+
+	kprintf("Starting RCU test...\n");
+	for (i=0; i<NREADERS; i++) {
+		result = thread_fork("rcutest", NULL, rcut_reader, NULL, i);
+		if (result) {
+			panic("rcutest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=1; i<=NREPLACES; i++) {
+		old = rcut_shared;
+		RCU_ASSIGN(rcut_shared, rcut_make(i));
+		if (i % 2) {
+			rcu_synchronize();
+			rcut_kill(old);
+		}
+		else {
+			rcu_call(&old->ro_rcu, rcut_kill, old);
+		}
+		thread_yield();
+	}
+
+	rcut_stop = true;
+	for (i=0; i<NREADERS; i++) {
+		P(rcut_done);
+	}
+	/* The readers are gone, so the last one can go right away. */
+	rcut_kill(rcut_shared);
+	rcut_shared = NULL;
+	sem_destroy(rcut_done);
+
+	kprintf("%u reads, %u replacements\n", rcut_reads, NREPLACES);
+	kprintf("RCU test done.\n");
+	return 0;
+}
@@ -28,9 +28,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <clock.h>
@@ -818,3 +820,126 @@ semu22(int nargs, char **args)
 	panic("semu22: P tolerated null semaphore\n");
 	return 0;
 }
+
+/*
+ * 23. sem_timedP on a semaphore with count 0 and nobody to V it:
+ *    - returns ETIMEDOUT
+ *    - not before the time is up
+ *    - sem_count is still 0
+ */
+int
+semu23(int nargs, char **args)
+{
+	struct semaphore *sem;
+	uint64_t start;
+	int result;
+
+	(void)nargs; (void)args;
+
+	sem = makesem(0);
+	start = clock_now();
+	result = sem_timedP(sem, 100000000ULL);
+	KASSERT(result == ETIMEDOUT);
+	KASSERT(clock_now() - start >= 100000000ULL);
+	KASSERT(sem->sem_count == 0);
+	ok();
+	sem_destroy(sem);
+	return 0;
+}
+
+/*
+ * 24. sem_timedP on a semaphore that's V'd before the time is up:
+ *    - returns 0
+ *    - sem_count is 0 again
+ */
+static
+void
+semu24_sub(void *semv, unsigned long junk)
+{
+	struct semaphore *sem = semv;
+
+	(void)junk;
+
+	clocksleep(1);
+	V(sem);
+}
+
+int
+semu24(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int result;
+
+	(void)nargs; (void)args;
+
+	sem = makesem(0);
+	result = thread_fork("semu24_sub", NULL, semu24_sub, sem, 0);
+	if (result) {
+		panic("semu24: whoops: thread_fork failed\n");
+	}
+	result = sem_timedP(sem, 10000000000ULL);
+	KASSERT(result == 0);
+	KASSERT(sem->sem_count == 0);
+	ok();
+	sem_destroy(sem);
+	return 0;
+}
+
+/*
+ * 25. V_handoff on a semaphore a thread is sleeping on:
+ *    - the thread wakes and gets the count
+ *    - sem_count is 0 again
+ * It should usually have run before V_handoff returns, but that
+ * isn't promised (it might be busy elsewhere), so just report it.
+ */
+static volatile bool semu25_done;
+
+static
+void
+semu25_sub(void *semv, unsigned long donesemv)
+{
+	struct semaphore *sem = semv;
+	struct semaphore *donesem = (struct semaphore *)donesemv;
+
+	P(sem);
+	semu25_done = true;
+	V(donesem);
+}
+
+int
+semu25(int nargs, char **args)
+{
+	struct semaphore *sem, *donesem;
+	bool ranfirst;
+	int result;
+
+	(void)nargs; (void)args;
+
+	sem = makesem(0);
+	donesem = makesem(0);
+	semu25_done = false;
+	result = thread_fork("semu25_sub", NULL, semu25_sub, sem,
+			     (unsigned long)donesem);
+	if (result) {
+		panic("semu25: whoops: thread_fork failed\n");
+	}
+	spinlock_acquire(&sem->sem_lock);
+	while (wchan_isempty(sem->sem_wchan, &sem->sem_lock)) {
+		spinlock_release(&sem->sem_lock);
+		thread_yield();
+		spinlock_acquire(&sem->sem_lock);
+	}
+	spinlock_release(&sem->sem_lock);
+
+	V_handoff(sem);
+	ranfirst = semu25_done;
+	P(donesem);
+	KASSERT(semu25_done);
+	KASSERT(sem->sem_count == 0);
+	kprintf("semu25: woken thread %s before V_handoff returned\n",
+		ranfirst ? "ran" : "had not run");
+	ok();
+	sem_destroy(donesem);
+	sem_destroy(sem);
+	return 0;
+}
@@ -32,8 +32,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -399,3 +401,195 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test. Writers update the testvals together, as
+ * in locktest; readers check they never see a writer at work and
+ * that the values agree. Reader i is also a writer every
+ * RWWRITEEVERY loops.
+ */
+
+#define NRWLOOPS	200
+#define RWWRITEEVERY	8
+
+static struct rwlock *testrw;
+static volatile unsigned rwreaders;
+static volatile bool rwwriting;
+static unsigned rwmaxreaders;
+static struct spinlock rwstat_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	panic("rwtest failed\n");
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long v;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (i % RWWRITEEVERY == (int)(num % RWWRITEEVERY)) {
+			rwlock_acquire_write(testrw);
+			if (rwwriting || rwreaders > 0) {
+				rwfail(num, "writer got in with company");
+			}
+			rwwriting = true;
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			testval3 = num%3;
+			rwwriting = false;
+			rwlock_release_write(testrw);
+			continue;
+		}
+
+		rwlock_acquire_read(testrw);
+		spinlock_acquire(&rwstat_lock);
+		rwreaders++;
+		if (rwreaders > rwmaxreaders) {
+			rwmaxreaders = rwreaders;
+		}
+		spinlock_release(&rwstat_lock);
+
+		if (rwwriting) {
+			rwfail(num, "reader got in with a writer");
+		}
+		v = testval1;
+		thread_yield();
+		if (testval2 != v*v || testval3 != v%3) {
+			rwfail(num, "testvals changed under a read lock");
+		}
+
+		spinlock_acquire(&rwstat_lock);
+		rwreaders--;
+		spinlock_release(&rwstat_lock);
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwmaxreaders = 0;
+
+	kprintf("Starting rwlock test...\n");
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+	kprintf("Most readers at once: %u\n", rwmaxreaders);
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Completion test. Threads wait for a completion that isn't done
+ * yet, on which a timed wait runs out, and then all come back once
+ * it's completed; waiting again returns at once.
+ */
+
+#define CMWAITNS	10000000ULL	/* 10 ms */
+
+static struct completion testcm;
+static struct semaphore *cmgatesem;
+
+static
+void
+cmtestthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(cmgatesem);
+	wait_for_completion(&testcm);
+	if (!completion_done(&testcm)) {
+		panic("cmtest: woken before completion\n");
+	}
+	V(donesem);
+}
+
+int
+cmtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	cmgatesem = sem_create("cmgatesem", 0);
+	if (cmgatesem == NULL) {
+		panic("cmtest: sem_create failed\n");
+	}
+	completion_init(&testcm, "cmtest");
+	kprintf("Starting completion test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("cmtest", NULL, cmtestthread, NULL, i);
+		if (result) {
+			panic("cmtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(cmgatesem);
+	}
+	if (wait_for_completion_timeout(&testcm, CMWAITNS) != ETIMEDOUT) {
+		panic("cmtest: timed wait didn't time out\n");
+	}
+	if (completion_done(&testcm)) {
+		panic("cmtest: done before complete\n");
+	}
+
+	complete(&testcm);
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	wait_for_completion(&testcm);
+	if (wait_for_completion_timeout(&testcm, CMWAITNS) != 0) {
+		panic("cmtest: timed wait on a done completion failed\n");
+	}
+
+	completion_reinit(&testcm);
+	if (completion_done(&testcm)) {
+		panic("cmtest: still done after reinit\n");
+	}
+	completion_cleanup(&testcm);
+	sem_destroy(cmgatesem);
+	cmgatesem = NULL;
+	kprintf("Completion test done.\n");
+	return 0;
+}
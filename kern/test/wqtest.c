@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Work queue test code.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define NITEMS		64
+#define NREQUEUES	100
+
+static struct work items[NITEMS];
+static struct work requeuer;
+static struct spinlock wqt_lock = SPINLOCK_INITIALIZER;
+static unsigned wqt_count;		/* under wqt_lock */
+static unsigned wqt_next;		/* under wqt_lock */
+static bool wqt_bad;			/* under wqt_lock */
+static struct workqueue *wqt_wq;
+
+/*
+ * Count a run.
+ */
+static
+void
+wqt_countfunc(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&wqt_lock);
+	wqt_count++;
+	spinlock_release(&wqt_lock);
+	thread_yield();
+}
+
+/*
+ * Check we run in queue order.
+ */
+static
+void
+wqt_orderfunc(void *data1, unsigned long num)
+{
+	(void)data1;
+
+	spinlock_acquire(&wqt_lock);
+	if (num != wqt_next) {
+		wqt_bad = true;
+	}
+	wqt_next = num + 1;
+	spinlock_release(&wqt_lock);
+	thread_yield();
+}
+
+/*
+ * Queue ourselves again until we've run NREQUEUES times.
+ */
+static
+void
+wqt_requeuefunc(void *data1, unsigned long data2)
+{
+	bool again;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&wqt_lock);
+	wqt_count++;
+	again = wqt_count < NREQUEUES;
+	spinlock_release(&wqt_lock);
+	if (again && !workqueue_enqueue(wqt_wq, &requeuer)) {
+		panic("wqtest: requeue from own function failed\n");
+	}
+}
+
+static
+void
+wqt_reset(void)
+{
+	spinlock_acquire(&wqt_lock);
+	wqt_count = 0;
+	wqt_next = 0;
+	wqt_bad = false;
+	spinlock_release(&wqt_lock);
+}
+
+static
+struct workqueue *
+wqt_create(const char *name, unsigned flags)
+{
+	struct workqueue *wq;
+
+	wq = workqueue_create(name, flags);
+	if (wq == NULL) {
+		panic("wqtest: workqueue_create failed\n");
+	}
+	return wq;
+}
+
+int
+wqtest(int nargs, char **args)
+{
+	unsigned i, queued;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting work queue test...\n");
+
+	/* Every item runs exactly once, however many times queued. */
+	wqt_reset();
+	wqt_wq = wqt_create("wqtest", 0);
+	queued = 0;
+	for (i=0; i<NITEMS; i++) {
+		work_init(&items[i], wqt_countfunc, NULL, i);
+		if (workqueue_enqueue(wqt_wq, &items[i])) {
+			queued++;
+		}
+		if (workqueue_enqueue(wqt_wq, &items[i])) {
+			queued++;
+		}
+	}
+	workqueue_flush(wqt_wq);
+	if (wqt_count != queued || queued < NITEMS) {
+		panic("wqtest: %u items queued, %u ran\n", queued, wqt_count);
+	}
+
+	/* An item can requeue itself. */
+	wqt_reset();
+	work_init(&requeuer, wqt_requeuefunc, NULL, 0);
+	workqueue_enqueue(wqt_wq, &requeuer);
+	while (1) {
+		workqueue_flush(wqt_wq);
+		spinlock_acquire(&wqt_lock);
+		i = wqt_count;
+		spinlock_release(&wqt_lock);
+		if (i >= NREQUEUES) {
+			break;
+		}
+	}
+	if (i != NREQUEUES) {
+		panic("wqtest: requeuer ran %u times\n", i);
+	}
+	workqueue_destroy(wqt_wq);
+
+	/* Ordered queues run in order. */
+	wqt_reset();
+	wqt_wq = wqt_create("wqtest-ordered", WQ_ORDERED);
+	for (i=0; i<NITEMS; i++) {
+		work_init(&items[i], wqt_orderfunc, NULL, i);
+		workqueue_enqueue(wqt_wq, &items[i]);
+	}
+	/* Destroy runs what's left. */
+	workqueue_destroy(wqt_wq);
+	wqt_wq = NULL;
+	if (wqt_bad || wqt_next != NITEMS) {
+		panic("wqtest: ordered queue got to %u%s\n", wqt_next,
+		      wqt_bad ? " out of order" : "");
+	}
+
+	/* And the shared queue works. */
+	wqt_reset();
+	work_init(&items[0], wqt_countfunc, NULL, 0);
+	workqueue_enqueue(system_workqueue, &items[0]);
+	workqueue_flush(system_workqueue);
+	if (wqt_count != 1) {
+		panic("wqtest: system_workqueue item ran %u times\n",
+		      wqt_count);
+	}
+
+	kprintf("Work queue test done.\n");
+	return 0;
+}
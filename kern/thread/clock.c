@@ -29,18 +29,28 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
+#include <vm.h>
+#include <kern/timepage.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Each CPU's timer is programmed one-shot for whichever comes first:
+ * its next hardclock, or the earliest timeout queued on it. An idle
+ * CPU takes no hardclocks at all, only timeouts, so a machine that's
+ * mostly sleeping isn't woken HZ times a second on every CPU.
+ * Timeouts are per-CPU lists kept in deadline order; there are
+ * seldom more than a handful (mostly sleeping threads), which a list
+ * handles better than a heap or wheel would.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,14 +60,25 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Boost priorities every 100. */
+#define NSEC_PER_TICK		(1000000000ULL / HZ)
+
+/* For clocksleep_ns sleepers to wait on. */
+static struct wchan *clocksleep_wchan;
+static struct spinlock clocksleep_lock;
+
+/* Set once gettime works, which it doesn't in early boot. */
+static bool clock_started;
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * The time page, and when it was last updated. Whichever CPU takes a
+ * hardclock, or comes out of idle, first after it's gone a tick stale
+ * updates it; so it's never more than a tick old while anything at
+ * all is running.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct timepage *timepage;
+static uint64_t timepage_stamp;
+static struct spinlock timepage_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Setup.
@@ -65,29 +86,307 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	spinlock_init(&clocksleep_lock);
+	clocksleep_wchan = wchan_create("clocksleep");
+	if (clocksleep_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
+}
+
+/*
+ * Called by the platform once the clock devices are attached, to
+ * begin programmed timing on the boot CPU. (Other CPUs start with
+ * their first timer interrupt.)
+ */
+void
+clock_start(void)
+{
+	int s;
+
+	s = splhigh();
+	clock_started = true;
+	curcpu->c_nexttick = clock_now() + NSEC_PER_TICK;
+	mainbus_settimer(NSEC_PER_TICK);
+	splx(s);
+}
+
+void
+timepage_bootstrap(void)
+{
+	vaddr_t va;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		panic("timepage_bootstrap: Out of memory\n");
 	}
+	bzero((void *)va, PAGE_SIZE);
+	((struct timepage *)va)->tp_tick = NSEC_PER_TICK;
+	/* clock interrupts may look at it as soon as it's set */
+	membar_store_store();
+	timepage = (struct timepage *)va;
+}
+
+paddr_t
+timepage_paddr(void)
+{
+	KASSERT(timepage != NULL);
+	return KVADDR_TO_PADDR((vaddr_t)timepage);
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Update the time page if it's stale as of NOW, with the sequence
+ * count protocol described in <kern/timepage.h>.
  */
+static
 void
-timerclock(void)
+timepage_update(uint64_t now)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	struct timespec ts;
+
+	if (timepage == NULL || now - timepage_stamp < NSEC_PER_TICK) {
+		return;
+	}
+
+	spinlock_acquire(&timepage_lock);
+	if (now - timepage_stamp >= NSEC_PER_TICK) {
+		gettime(&ts);
+		timepage->tp_seq++;
+		membar_store_store();
+		timepage->tp_sec = ts.tv_sec;
+		timepage->tp_nsec = ts.tv_nsec;
+		membar_store_store();
+		timepage->tp_seq++;
+		timepage_stamp = now;
+	}
+	spinlock_release(&timepage_lock);
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * Current time, as nanoseconds; 0 until there's a clock to read.
+ */
+uint64_t
+clock_now(void)
+{
+	struct timespec ts;
+
+	if (!clock_started) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////
+// timeouts
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_when = 0;
+	to->to_func = func;
+	to->to_data = data;
+	to->to_cpu = NULL;
+	to->to_next = NULL;
+}
+
+/*
+ * Program this CPU's timer for its next event: NEXT, or the earliest
+ * timeout if that's sooner. Call with interrupts off.
+ */
+static
+void
+clock_program(uint64_t now, uint64_t next)
+{
+	struct cpu *c = curcpu->c_self;
+
+	spinlock_acquire(&c->c_timeout_lock);
+	if (c->c_timeouts != NULL && c->c_timeouts->to_when < next) {
+		next = c->c_timeouts->to_when;
+	}
+	spinlock_release(&c->c_timeout_lock);
+
+	mainbus_settimer(next > now ? next - now : 0);
+}
+
+/*
+ * Same, for the next hardclock if we aren't idle. With neither that
+ * nor a timeout, the hardware maximum will do.
+ */
+static
+void
+clock_reprogram(uint64_t now)
+{
+	struct cpu *c = curcpu->c_self;
+
+	clock_program(now, c->c_isidle ? (uint64_t)-1 : c->c_nexttick);
+}
+
+/*
+ * Take TO off whatever CPU's list it's on. Call with that CPU's
+ * timeout lock held.
+ */
+static
+void
+timeout_unlink(struct cpu *c, struct timeout *to)
+{
+	struct timeout **pp;
+
+	KASSERT(spinlock_do_i_hold(&c->c_timeout_lock));
+
+	for (pp = &c->c_timeouts; *pp != to; pp = &(*pp)->to_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = to->to_next;
+	to->to_next = NULL;
+	to->to_cpu = NULL;
+}
+
+/*
+ * Arm TO to go off NSECS from now, on the current CPU, cancelling
+ * any earlier setting.
+ */
+void
+timeout_set(struct timeout *to, uint64_t nsecs)
+{
+	struct cpu *c;
+	struct timeout **pp;
+	uint64_t now;
+	bool first;
+	int s;
+
+	timeout_cancel(to);
+
+	s = splhigh();
+	c = curcpu->c_self;
+	now = clock_now();
+	to->to_when = now + nsecs;
+
+	spinlock_acquire(&c->c_timeout_lock);
+	for (pp = &c->c_timeouts; *pp != NULL; pp = &(*pp)->to_next) {
+		if ((*pp)->to_when > to->to_when) {
+			break;
+		}
+	}
+	to->to_next = *pp;
+	*pp = to;
+	to->to_cpu = c;
+	first = (c->c_timeouts == to);
+	spinlock_release(&c->c_timeout_lock);
+
+	if (first && clock_started) {
+		clock_reprogram(now);
+	}
+	splx(s);
+}
+
+/*
+ * Disarm TO. Returns true if it was pending, false if it wasn't
+ * (including if it has already fired or is firing now on another
+ * CPU).
+ */
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct cpu *c;
+
+	while ((c = to->to_cpu) != NULL) {
+		spinlock_acquire(&c->c_timeout_lock);
+		if (to->to_cpu == c) {
+			timeout_unlink(c, to);
+			spinlock_release(&c->c_timeout_lock);
+			return true;
+		}
+		/* it fired, or moved, while we weren't looking */
+		spinlock_release(&c->c_timeout_lock);
+	}
+	return false;
+}
+
+////////////////////////////////////////////////////////////
+// timer interrupts
+
+/*
+ * Timer interrupt, on each CPU. Fire whatever timeouts are due, take
+ * a hardclock if one's due and we aren't idle, and set up the next
+ * interrupt.
+ */
+void
+clock_interrupt(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct timeout *to;
+	uint64_t now;
+	bool tick;
+
+	if (!clock_started) {
+		/* early boot: just tick */
+		mainbus_settimer(NSEC_PER_TICK);
+		hardclock();
+		return;
+	}
+
+	now = clock_now();
+	spinlock_acquire(&c->c_timeout_lock);
+	while ((to = c->c_timeouts) != NULL && to->to_when <= now) {
+		timeout_unlink(c, to);
+		spinlock_release(&c->c_timeout_lock);
+		to->to_func(to->to_data);
+		spinlock_acquire(&c->c_timeout_lock);
+	}
+	spinlock_release(&c->c_timeout_lock);
+
+	tick = !c->c_isidle && now >= c->c_nexttick;
+	if (tick) {
+		c->c_nexttick += NSEC_PER_TICK;
+		if (c->c_nexttick <= now) {
+			/* we fell behind, or the CPU was idle */
+			c->c_nexttick = now + NSEC_PER_TICK;
+		}
+	}
+
+	/* Before hardclock, which may switch threads. */
+	clock_reprogram(now);
+
+	if (tick) {
+		timepage_update(now);
+		hardclock();
+	}
+}
+
+/*
+ * The CPU is going idle, or coming back: stop or restart hardclocks.
+ * Called from thread_switch with interrupts off. POLL asks for an
+ * interrupt within a tick anyway, for an idle CPU that has seen work
+ * it may be able to steal soon.
+ */
+void
+clock_idle(bool poll)
+{
+	uint64_t now;
+
+	if (clock_started) {
+		now = clock_now();
+		clock_program(now, poll ? now + NSEC_PER_TICK : (uint64_t)-1);
+	}
+}
+
+void
+clock_unidle(void)
+{
+	uint64_t now;
+
+	if (clock_started) {
+		now = clock_now();
+		curcpu->c_nexttick = now + NSEC_PER_TICK;
+		clock_reprogram(now);
+		/* it may have been a long time since anyone ticked */
+		timepage_update(now);
+	}
+}
+
+/*
+ * This is called HZ times a second (on each processor that isn't idle)
+ * by the timer code.
  */
 void
 hardclock(void)
@@ -97,13 +396,49 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_tick();
+}
+
+////////////////////////////////////////////////////////////
+// sleeping
+
+struct clocksleeper {
+	struct timeout cs_timeout;
+	volatile bool cs_done;
+};
+
+static
+void
+clocksleep_wakeup(void *data)
+{
+	struct clocksleeper *cs = data;
+
+	spinlock_acquire(&clocksleep_lock);
+	cs->cs_done = true;
+	wchan_wakeall(clocksleep_wchan, &clocksleep_lock);
+	spinlock_release(&clocksleep_lock);
+}
+
+/*
+ * Suspend execution for NSECS nanoseconds.
+ */
+void
+clocksleep_ns(uint64_t nsecs)
+{
+	struct clocksleeper cs;
+
+	cs.cs_done = false;
+	timeout_init(&cs.cs_timeout, clocksleep_wakeup, &cs);
+
+	spinlock_acquire(&clocksleep_lock);
+	timeout_set(&cs.cs_timeout, nsecs);
+	while (!cs.cs_done) {
+		wchan_sleep(clocksleep_wchan, &clocksleep_lock);
+	}
+	spinlock_release(&clocksleep_lock);
 }
 
 /*
@@ -112,10 +447,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ns(num_secs * 1000000000ULL);
 	}
-	spinlock_release(&lbolt_lock);
 }
@@ -28,15 +28,21 @@
  */
 
 /*
- * Simple deadlock detector.
+ * Simple deadlock detector, and lock contention statistics.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <spl.h>
+#include <clock.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <hangman.h>
 
+#if OPT_HANGMAN || OPT_LOCKSTAT
+
+#if OPT_HANGMAN
+
 static struct spinlock hangman_lock = SPINLOCK_INITIALIZER;
 
 /*
@@ -106,9 +112,10 @@ hangman_check(const struct hangman_lockable *start,
  * tricky and problematic. For now we'll settle for just detecting and
  * reporting deadlocks that do happen.
  */
+static
 void
-hangman_wait(struct hangman_actor *a,
-	     struct hangman_lockable *l)
+hangman_dowait(struct hangman_actor *a,
+	       struct hangman_lockable *l)
 {
 	if (l == &hangman_lock.splk_hangman) {
 		/* don't recurse */
@@ -128,9 +135,10 @@ hangman_wait(struct hangman_actor *a,
 	spinlock_release(&hangman_lock);
 }
 
+static
 void
-hangman_acquire(struct hangman_actor *a,
-		struct hangman_lockable *l)
+hangman_doacquire(struct hangman_actor *a,
+		  struct hangman_lockable *l)
 {
 	if (l == &hangman_lock.splk_hangman) {
 		/* don't recurse */
@@ -156,9 +164,10 @@ hangman_acquire(struct hangman_actor *a,
 	spinlock_release(&hangman_lock);
 }
 
+static
 void
-hangman_release(struct hangman_actor *a,
-		struct hangman_lockable *l)
+hangman_dorelease(struct hangman_actor *a,
+		  struct hangman_lockable *l)
 {
 	if (l == &hangman_lock.splk_hangman) {
 		/* don't recurse */
@@ -180,3 +189,306 @@ hangman_release(struct hangman_actor *a,
 
 	spinlock_release(&hangman_lock);
 }
+
+#endif /* OPT_HANGMAN */
+
+#if OPT_LOCKSTAT
+
+////////////////////////////////////////////////////////////
+// lockstat
+
+/*
+ * Table of locks that have been contended while lockstat was on. A
+ * lock goes in the first time, and comes out when it's cleaned up.
+ * Spinlocks are instrumented too, so the table is protected by a bare
+ * test-and-set word, which is only taken at splhigh.
+ */
+#define LOCKSTAT_SLOTS	128
+#define LOCKSTAT_PRINT	20
+
+static volatile bool lockstat_enabled;
+static struct hangman_lockable *lockstat_locks[LOCKSTAT_SLOTS];
+static unsigned lockstat_dropped;	/* table was full */
+static volatile spinlock_data_t lockstat_word = SPINLOCK_DATA_INITIALIZER;
+
+static
+int
+lockstat_grab(void)
+{
+	int s;
+
+	s = splhigh();
+	while (spinlock_data_get(&lockstat_word) != 0 ||
+	       spinlock_data_testandset(&lockstat_word) != 0) {
+		/* spin */
+	}
+	membar_store_any();
+	return s;
+}
+
+static
+void
+lockstat_ungrab(int s)
+{
+	membar_any_store();
+	spinlock_data_set(&lockstat_word, 0);
+	splx(s);
+}
+
+static
+void
+lockstat_track(struct hangman_lockable *l)
+{
+	unsigned i;
+	int s;
+
+	s = lockstat_grab();
+	for (i=0; i<LOCKSTAT_SLOTS; i++) {
+		if (lockstat_locks[i] == NULL) {
+			lockstat_locks[i] = l;
+			l->l_tracked = true;
+			break;
+		}
+	}
+	if (i == LOCKSTAT_SLOTS) {
+		lockstat_dropped++;
+	}
+	lockstat_ungrab(s);
+}
+
+static
+void
+lockstat_untrack(struct hangman_lockable *l)
+{
+	unsigned i;
+	int s;
+
+	s = lockstat_grab();
+	for (i=0; i<LOCKSTAT_SLOTS; i++) {
+		if (lockstat_locks[i] == l) {
+			lockstat_locks[i] = NULL;
+			break;
+		}
+	}
+	l->l_tracked = false;
+	lockstat_ungrab(s);
+}
+
+/*
+ * A is about to try for L: note the time, and whether it's held.
+ */
+static
+void
+lockstat_wait(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	if (!lockstat_enabled) {
+		a->a_waitstart = 0;
+		return;
+	}
+	a->a_contended = (l->l_holding != NULL);
+	a->a_waitstart = clock_now();
+}
+
+/*
+ * A got L. We hold L now, so its counters are ours to update.
+ */
+static
+void
+lockstat_acquire(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	uint64_t now;
+
+	if (a->a_waitstart == 0) {
+		/* lockstat was off when we started */
+		l->l_heldsince = 0;
+		return;
+	}
+	now = clock_now();
+	l->l_acquires++;
+	if (a->a_contended) {
+		l->l_contended++;
+		l->l_waitns += now - a->a_waitstart;
+		if (!l->l_tracked) {
+			lockstat_track(l);
+		}
+	}
+	l->l_heldsince = now;
+	a->a_waitstart = 0;
+}
+
+static
+void
+lockstat_release(struct hangman_lockable *l)
+{
+	uint64_t held;
+
+	if (l->l_heldsince == 0) {
+		return;
+	}
+	held = clock_now() - l->l_heldsince;
+	if (held > l->l_maxholdns) {
+		l->l_maxholdns = held;
+	}
+	l->l_heldsince = 0;
+}
+
+/*
+ * Turn collection on or off. (Off by default: until the clock is
+ * attached there's no time to take.)
+ */
+void
+lockstat_setenabled(bool on)
+{
+	lockstat_enabled = on;
+}
+
+/*
+ * Print the locks that have been waited for longest in total. The
+ * counters are read without the locks, so may be a little stale.
+ */
+void
+lockstat_print(void)
+{
+	struct lockstat_snap {
+		const struct hangman_lockable *ls_lock;
+		const char *ls_name;
+		unsigned ls_acquires, ls_contended;
+		uint64_t ls_waitns, ls_maxholdns;
+	};
+	static struct lockstat_snap snap[LOCKSTAT_SLOTS];
+	struct lockstat_snap t;
+	struct hangman_lockable *l;
+	unsigned i, j, n, dropped;
+	int s;
+
+	/* the static snapshot is protected by being in the menu thread */
+	n = 0;
+	s = lockstat_grab();
+	for (i=0; i<LOCKSTAT_SLOTS; i++) {
+		l = lockstat_locks[i];
+		if (l == NULL || l->l_contended == 0) {
+			continue;
+		}
+		snap[n].ls_lock = l;
+		snap[n].ls_name = l->l_name;
+		snap[n].ls_acquires = l->l_acquires;
+		snap[n].ls_contended = l->l_contended;
+		snap[n].ls_waitns = l->l_waitns;
+		snap[n].ls_maxholdns = l->l_maxholdns;
+		n++;
+	}
+	dropped = lockstat_dropped;
+	lockstat_ungrab(s);
+
+	/* insertion sort, most total wait first */
+	for (i=1; i<n; i++) {
+		t = snap[i];
+		for (j=i; j>0 && snap[j-1].ls_waitns < t.ls_waitns; j--) {
+			snap[j] = snap[j-1];
+		}
+		snap[j] = t;
+	}
+
+	kprintf("lockstat: %s, %u contended locks", lockstat_enabled ?
+		"on" : "off", n);
+	if (dropped > 0) {
+		kprintf(" (and %u not tracked)", dropped);
+	}
+	kprintf("\n");
+	if (n == 0) {
+		return;
+	}
+	kprintf("    %-16s %-10s %9s %9s %10s %10s\n", "name", "address",
+		"acquires", "contended", "wait us", "maxhold us");
+	for (i=0; i<n && i<LOCKSTAT_PRINT; i++) {
+		kprintf("    %-16.16s %10p %9u %9u %10llu %10llu\n",
+			snap[i].ls_name, snap[i].ls_lock,
+			snap[i].ls_acquires, snap[i].ls_contended,
+			snap[i].ls_waitns / 1000,
+			snap[i].ls_maxholdns / 1000);
+	}
+}
+
+/*
+ * Zero the counters. Locks stay in the table.
+ */
+void
+lockstat_reset(void)
+{
+	struct hangman_lockable *l;
+	unsigned i;
+	int s;
+
+	s = lockstat_grab();
+	for (i=0; i<LOCKSTAT_SLOTS; i++) {
+		l = lockstat_locks[i];
+		if (l != NULL) {
+			l->l_acquires = 0;
+			l->l_contended = 0;
+			l->l_waitns = 0;
+			l->l_maxholdns = 0;
+		}
+	}
+	lockstat_dropped = 0;
+	lockstat_ungrab(s);
+}
+
+#endif /* OPT_LOCKSTAT */
+
+////////////////////////////////////////////////////////////
+// hooks
+
+void
+hangman_wait(struct hangman_actor *a, struct hangman_lockable *l)
+{
+#if OPT_LOCKSTAT
+	lockstat_wait(a, l);
+#endif
+#if OPT_HANGMAN
+	hangman_dowait(a, l);
+#endif
+}
+
+void
+hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l)
+{
+#if OPT_HANGMAN
+	hangman_doacquire(a, l);
+#else
+	l->l_holding = a;
+#endif
+#if OPT_LOCKSTAT
+	lockstat_acquire(a, l);
+#endif
+}
+
+void
+hangman_release(struct hangman_actor *a, struct hangman_lockable *l)
+{
+#if OPT_LOCKSTAT
+	lockstat_release(l);
+#endif
+#if OPT_HANGMAN
+	hangman_dorelease(a, l);
+#else
+	(void)a;
+	l->l_holding = NULL;
+#endif
+}
+
+/*
+ * L is being destroyed.
+ */
+void
+hangman_cleanup(struct hangman_lockable *l)
+{
+#if OPT_LOCKSTAT
+	if (l->l_tracked) {
+		lockstat_untrack(l);
+	}
+#else
+	(void)l;
+#endif
+}
+
+#endif /* OPT_HANGMAN || OPT_LOCKSTAT */
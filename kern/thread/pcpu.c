@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-cpu statistics counters. See pcpu.h.
+ *
+ * Slot 0 of c_pcpu[] is never assigned, so a pc_slot of 0 means the
+ * counter hasn't been used yet. Assigning a slot happens once per
+ * counter, under pcpu_lock; the counter then goes on the tail of
+ * pcpu_counters, so they print in order of first use.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
+#include <pcpu.h>
+#include <kstat.h>
+
+static struct spinlock pcpu_lock = SPINLOCK_INITIALIZER;
+static unsigned pcpu_nextslot = 1;		/* under pcpu_lock */
+static struct pcpu_counter *pcpu_counters;	/* under pcpu_lock */
+static struct pcpu_counter **pcpu_countertail = &pcpu_counters;
+
+/*
+ * Assign a slot to a counter being used for the first time.
+ */
+static
+unsigned
+pcpu_counter_register(struct pcpu_counter *pc)
+{
+	unsigned slot;
+
+	spinlock_acquire(&pcpu_lock);
+	slot = pc->pc_slot;
+	if (slot == 0) {
+		if (pcpu_nextslot >= PCPU_MAXCOUNTERS) {
+			panic("pcpu: out of counter slots for %s\n",
+			      pc->pc_name);
+		}
+		slot = pcpu_nextslot++;
+		pc->pc_next = NULL;
+		*pcpu_countertail = pc;
+		pcpu_countertail = &pc->pc_next;
+		pc->pc_slot = slot;
+	}
+	spinlock_release(&pcpu_lock);
+	return slot;
+}
+
+void
+pcpu_counter_add(struct pcpu_counter *pc, unsigned n)
+{
+	unsigned slot;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	slot = pc->pc_slot;
+	if (slot == 0) {
+		slot = pcpu_counter_register(pc);
+	}
+
+	/* Off for the read-modify-write, and so we stay on this cpu. */
+	spl = splhigh();
+	curcpu->c_pcpu[slot] += n;
+	splx(spl);
+}
+
+unsigned
+pcpu_counter_read(struct pcpu_counter *pc)
+{
+	unsigned i, n, slot, total;
+
+	slot = pc->pc_slot;
+	if (slot == 0) {
+		return 0;
+	}
+
+	total = 0;
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		total += cpu_getcpu(i)->c_pcpu[slot];
+	}
+	return total;
+}
+
+void
+pcpu_counter_reset(struct pcpu_counter *pc)
+{
+	unsigned i, n, slot;
+
+	slot = pc->pc_slot;
+	if (slot == 0) {
+		return;
+	}
+
+	n = cpu_count();
+	for (i=0; i<n; i++) {
+		cpu_getcpu(i)->c_pcpu[slot] = 0;
+	}
+}
+
+/*
+ * No counter ever comes off the list, and pc_next is set before the
+ * counter is linked, so it's safe to walk without the lock once the
+ * head has been fetched.
+ */
+static
+struct pcpu_counter *
+pcpu_counter_first(void)
+{
+	struct pcpu_counter *pc;
+
+	spinlock_acquire(&pcpu_lock);
+	pc = pcpu_counters;
+	spinlock_release(&pcpu_lock);
+	return pc;
+}
+
+void
+pcpu_counter_printall(void)
+{
+	struct pcpu_counter *pc;
+
+	for (pc = pcpu_counter_first(); pc != NULL; pc = pc->pc_next) {
+		kprintf("%-24s %u\n", pc->pc_name, pcpu_counter_read(pc));
+	}
+}
+
+void
+pcpu_counter_kstat(struct kstat *ks)
+{
+	struct pcpu_counter *pc;
+
+	for (pc = pcpu_counter_first(); pc != NULL; pc = pc->pc_next) {
+		kstat_add(ks, pc->pc_name, pcpu_counter_read(pc));
+	}
+}
+
+void
+pcpu_counter_resetall(void)
+{
+	struct pcpu_counter *pc;
+
+	for (pc = pcpu_counter_first(); pc != NULL; pc = pc->pc_next) {
+		pcpu_counter_reset(pc);
+	}
+}
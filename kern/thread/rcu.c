@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-copy-update. See rcu.h.
+ *
+ * rcu_gen counts grace periods started. Each cpu copies it into
+ * c_rcu_gen at every quiescent state, so once a cpu's c_rcu_gen has
+ * caught up with a generation, it has been quiescent since that
+ * generation began. An idle cpu is in no reader, so it counts too;
+ * it might be just waking up, but any reader it starts now can't
+ * find what the writer unpublished before bumping rcu_gen.
+ *
+ * rcu_call queues onto one pending list, handled in batches by a
+ * work item on system_workqueue that waits out a grace period and
+ * calls everything taken. Anything queued meanwhile waits for the
+ * next batch.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <workqueue.h>
+#include <rcu.h>
+
+/* How long rcu_synchronize sleeps between checks. */
+#define RCU_POLL	1000000ULL	/* 1 ms */
+
+static struct spinlock rcu_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rcu_gen;	/* written under rcu_lock */
+static struct rcu_head *rcu_pending;	/* under rcu_lock */
+static struct work rcu_work;
+
+void
+rcu_read_lock(void)
+{
+	curthread->t_rcu_nest++;
+}
+
+void
+rcu_read_unlock(void)
+{
+	KASSERT(curthread->t_rcu_nest > 0);
+	curthread->t_rcu_nest--;
+	if (curthread->t_rcu_nest == 0) {
+		/* If a hardclock or wakeup wanted us preempted, now. */
+		thread_preempt_point();
+	}
+}
+
+/*
+ * Called by the thread system on this cpu, outside any reader. Make
+ * sure the reads before are done before the new generation shows.
+ */
+void
+rcu_quiescent(void)
+{
+	unsigned gen;
+
+	gen = rcu_gen;
+	if (curcpu->c_rcu_gen != gen) {
+		membar_any_store();
+		curcpu->c_rcu_gen = gen;
+	}
+}
+
+/*
+ * Check if cpu C has been quiescent since generation GEN began.
+ */
+static
+bool
+rcu_passed(struct cpu *c, unsigned gen)
+{
+	return (int)(c->c_rcu_gen - gen) >= 0 || c->c_isidle;
+}
+
+void
+rcu_synchronize(void)
+{
+	struct cpu *c;
+	unsigned gen, i, numcpus;
+
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curthread->t_rcu_nest == 0);
+
+	spinlock_acquire(&rcu_lock);
+	gen = ++rcu_gen;
+	spinlock_release(&rcu_lock);
+	membar_any_any();
+
+	/* We're outside a reader ourselves. */
+	rcu_quiescent();
+
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		c = cpu_getcpu(i);
+		while (!rcu_passed(c, gen)) {
+			clocksleep_ns(RCU_POLL);
+			/* We may have moved onto C; then it's passed. */
+			rcu_quiescent();
+		}
+	}
+	membar_any_any();
+}
+
+/*
+ * Work item: run a batch of rcu_calls after a grace period.
+ */
+static
+void
+rcu_dowork(void *data1, unsigned long data2)
+{
+	struct rcu_head *rh, *next;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&rcu_lock);
+	rh = rcu_pending;
+	rcu_pending = NULL;
+	spinlock_release(&rcu_lock);
+
+	if (rh == NULL) {
+		return;
+	}
+	rcu_synchronize();
+
+	for (; rh != NULL; rh = next) {
+		next = rh->rh_next;
+		rh->rh_func(rh->rh_arg);
+	}
+}
+
+void
+rcu_call(struct rcu_head *rh, void (*func)(void *), void *arg)
+{
+	rh->rh_func = func;
+	rh->rh_arg = arg;
+
+	spinlock_acquire(&rcu_lock);
+	rh->rh_next = rcu_pending;
+	rcu_pending = rh;
+	spinlock_release(&rcu_lock);
+
+	workqueue_enqueue(system_workqueue, &rcu_work);
+}
+
+void
+rcu_bootstrap(void)
+{
+	KASSERT(system_workqueue != NULL);
+	work_init(&rcu_work, rcu_dowork, NULL, 0);
+}
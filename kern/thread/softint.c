@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Soft interrupts. See softint.h.
+ *
+ * Each cpu's pending softints are a list in its struct cpu, touched
+ * only by that cpu at splhigh, so no lock is needed. Whether a
+ * softint is pending is a test-and-set word in it, since the device
+ * behind it may interrupt on another cpu while it waits here.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <thread.h>
+#include <current.h>
+#include <pcpu.h>
+#include <softint.h>
+
+static struct pcpu_counter softint_runs =
+	PCPU_COUNTER_INITIALIZER("softint.runs");
+
+void
+softint_init(struct softint *si, void (*func)(void *), void *data)
+{
+	si->si_func = func;
+	si->si_data = data;
+	si->si_next = NULL;
+	spinlock_data_set(&si->si_queued, 0);
+}
+
+bool
+softint_schedule(struct softint *si)
+{
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curthread->t_in_interrupt);
+
+	if (spinlock_data_testandset(&si->si_queued) != 0) {
+		return false;
+	}
+	spl = splhigh();
+	c = curcpu->c_self;
+	si->si_next = c->c_softints;
+	c->c_softints = si;
+	splx(spl);
+	return true;
+}
+
+/*
+ * Take the whole list at once and run it oldest first; anything
+ * scheduled meanwhile (by interrupts that come in while the spl is
+ * down) goes round again. t_in_interrupt is set (it already is,
+ * coming from an interrupt), which keeps the functions from sleeping
+ * or being preempted. Nothing here may yield: the cpu's list is
+ * this thread's business until it's done.
+ */
+bool
+softint_run(bool lowerspl)
+{
+	struct cpu *c;
+	struct softint *list, *si, *next;
+	bool handoff;
+	int old_in;
+
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(curthread->t_iplhigh_count == 1 || !lowerspl);
+
+	c = curcpu->c_self;
+	if (c->c_insoftint || c->c_softints == NULL) {
+		return false;
+	}
+	c->c_insoftint = true;
+	c->c_softint_handoff = false;
+	old_in = curthread->t_in_interrupt;
+	curthread->t_in_interrupt = 1;
+	while (c->c_softints != NULL) {
+		list = NULL;
+		for (si = c->c_softints; si != NULL; si = next) {
+			next = si->si_next;
+			si->si_next = list;
+			list = si;
+		}
+		c->c_softints = NULL;
+
+		if (lowerspl) {
+			spl0();
+		}
+		for (si = list; si != NULL; si = next) {
+			next = si->si_next;
+			si->si_next = NULL;
+			/* Work queued from here on gets another run. */
+			spinlock_data_set(&si->si_queued, 0);
+			membar_any_any();
+			si->si_func(si->si_data);
+			pcpu_counter_inc(&softint_runs);
+		}
+		if (lowerspl) {
+			splhigh();
+		}
+	}
+	curthread->t_in_interrupt = old_in;
+	handoff = c->c_softint_handoff;
+	c->c_insoftint = false;
+	return handoff;
+}
+
+bool
+softint_active(void)
+{
+	return curcpu->c_insoftint;
+}
+
+void
+softint_handoff(void)
+{
+	KASSERT(curcpu->c_insoftint);
+	curcpu->c_softint_handoff = true;
+}
@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,12 +38,112 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
+#include <thread.h>	/* for thread_preempt_point */
+#include <kstat.h>
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Backoff while waiting for a ticket: start at SPINLOCK_BACKOFF_MIN
+ * rounds of doing nothing between looks at the lock, and double each
+ * time up to SPINLOCK_BACKOFF_MAX. The cap is kept low because with a
+ * ticket lock a waiter that backs off past its turn holds up everyone
+ * queued behind it.
+ */
+#define SPINLOCK_BACKOFF_MIN	4
+#define SPINLOCK_BACKOFF_MAX	256
+
+/*
+ * Table of spinlocks that have been contended since they were
+ * initialized or the stats were last reset, for spinlock_printstats.
+ * A lock goes in the first time it's contended, and comes out in
+ * spinlock_resetstats or spinlock_cleanup. This can't
+ * use a spinlock, so it's protected by a bare test-and-set word,
+ * which is only ever taken with interrupts off.
+ */
+#define SPINSTAT_SLOTS	64
+#define SPINSTAT_PRINT	16
+
+static struct spinlock *spinstat_locks[SPINSTAT_SLOTS];
+static unsigned spinstat_dropped;	/* table was full */
+static volatile spinlock_data_t spinstat_word = SPINLOCK_DATA_INITIALIZER;
+
+static
+void
+spinstat_grab(void)
+{
+	while (spinlock_data_get(&spinstat_word) != 0 ||
+	       spinlock_data_testandset(&spinstat_word) != 0) {
+		/* spin */
+	}
+	membar_store_any();
+}
+
+static
+void
+spinstat_ungrab(void)
+{
+	membar_any_store();
+	spinlock_data_set(&spinstat_word, 0);
+}
+
+/*
+ * Enter SPLK in the table. Called by its holder, at splhigh.
+ */
+static
+void
+spinstat_add(struct spinlock *splk)
+{
+	unsigned i, slot;
+
+	spinstat_grab();
+	slot = SPINSTAT_SLOTS;
+	for (i=0; i<SPINSTAT_SLOTS; i++) {
+		if (spinstat_locks[i] == splk) {
+			/* already there (raced with a reset) */
+			spinstat_ungrab();
+			return;
+		}
+		if (spinstat_locks[i] == NULL && slot == SPINSTAT_SLOTS) {
+			slot = i;
+		}
+	}
+	if (slot < SPINSTAT_SLOTS) {
+		spinstat_locks[slot] = splk;
+	}
+	else {
+		spinstat_dropped++;
+	}
+	spinstat_ungrab();
+}
+
+/*
+ * Take SPLK out of the table, if it's there. This has to look even
+ * if SPLK's counters are zero: a reset that raced with an acquire can
+ * leave a lock in the table with its counters cleared.
+ */
+static
+void
+spinstat_remove(struct spinlock *splk)
+{
+	unsigned i;
+	int s;
+
+	s = splhigh();
+	spinstat_grab();
+	for (i=0; i<SPINSTAT_SLOTS; i++) {
+		if (spinstat_locks[i] == splk) {
+			spinstat_locks[i] = NULL;
+			break;
+		}
+	}
+	spinstat_ungrab();
+	splx(s);
+}
 
 /*
  * Initialize spinlock.
@@ -50,8 +151,12 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_owner, 0);
 	splk->splk_holder = NULL;
+	splk->splk_contended = 0;
+	splk->splk_spins = 0;
+	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
 /*
@@ -61,20 +166,26 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_owner));
+	spinstat_remove(splk);
+	HANGMAN_CLEANUP(&splk->splk_hangman);
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for it to come up.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned delay, spins;
+	volatile unsigned i;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -85,37 +196,86 @@ spinlock_acquire(struct spinlock *splk)
 			panic("Deadlock on spinlock %p\n", splk);
 		}
 		mycpu->c_spinlocks++;
+		HANGMAN_WAIT(&mycpu->c_hangman, &splk->splk_hangman);
 	}
 	else {
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+	/*
+	 * The fetch-and-increment is the only atomic operation; after
+	 * that we just read splk_owner, which only the holder writes,
+	 * backing off between reads to keep off the bus.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	spins = 0;
+	delay = SPINLOCK_BACKOFF_MIN;
+	while (spinlock_data_get(&splk->splk_owner) != ticket) {
+		for (i=0; i<delay; i++) {
+			/* nothing */
+		}
+		if (delay < SPINLOCK_BACKOFF_MAX) {
+			delay *= 2;
+		}
+		spins++;
+	}
+
+	membar_store_any();
+	splk->splk_holder = mycpu;
+	if (mycpu != NULL) {
+		HANGMAN_ACQUIRE(&mycpu->c_hangman, &splk->splk_hangman);
+	}
+
+	if (spins > 0) {
+		if (splk->splk_contended++ == 0) {
+			spinstat_add(splk);
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+		splk->splk_spins += spins;
+	}
+}
+
+/*
+ * Get the lock if nobody has it, or is waiting for it: that is, if
+ * the next ticket is the one being served, take it.
+ */
+bool
+spinlock_tryacquire(struct spinlock *splk)
+{
+	struct cpu *mycpu;
+	spinlock_data_t owner;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (splk->splk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", splk);
 		}
-		break;
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	owner = spinlock_data_get(&splk->splk_owner);
+	if (spinlock_data_get(&splk->splk_next) != owner ||
+	    !spinlock_data_cas(&splk->splk_next, owner, owner + 1)) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	if (mycpu != NULL) {
+		mycpu->c_spinlocks++;
+		HANGMAN_WAIT(&mycpu->c_hangman, &splk->splk_hangman);
+		HANGMAN_ACQUIRE(&mycpu->c_hangman, &splk->splk_hangman);
+	}
+	return true;
 }
 
 /*
- * Release the lock.
+ * Release the lock: let the next ticket in.
  */
 void
 spinlock_release(struct spinlock *splk)
@@ -125,12 +285,22 @@ spinlock_release(struct spinlock *splk)
 		KASSERT(splk->splk_holder == curcpu->c_self);
 		KASSERT(curcpu->c_spinlocks > 0);
 		curcpu->c_spinlocks--;
+		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_owner,
+			  spinlock_data_get(&splk->splk_owner) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
+
+	/*
+	 * Dropping the last spinlock is a safe point to give way to a
+	 * thread woken meanwhile (see thread.h).
+	 */
+	if (CURCPU_EXISTS() && curcpu->c_needresched) {
+		thread_preempt_point();
+	}
 }
 
 /*
@@ -146,3 +316,112 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the most contended locks. The counters are read without the
+ * locks, so they may be a little stale.
+ */
+void
+spinlock_printstats(void)
+{
+	struct spinlock *locks[SPINSTAT_SLOTS];
+	unsigned contended[SPINSTAT_SLOTS], spins[SPINSTAT_SLOTS];
+	struct spinlock *tl;
+	unsigned i, j, n, dropped, tc, ts;
+	int s;
+
+	n = 0;
+	s = splhigh();
+	spinstat_grab();
+	for (i=0; i<SPINSTAT_SLOTS; i++) {
+		if (spinstat_locks[i] != NULL &&
+		    spinstat_locks[i]->splk_contended > 0) {
+			locks[n] = spinstat_locks[i];
+			contended[n] = locks[n]->splk_contended;
+			spins[n] = locks[n]->splk_spins;
+			n++;
+		}
+	}
+	dropped = spinstat_dropped;
+	spinstat_ungrab();
+	splx(s);
+
+	/* insertion sort, most contended first */
+	for (i=1; i<n; i++) {
+		tl = locks[i];
+		tc = contended[i];
+		ts = spins[i];
+		for (j=i; j>0 && contended[j-1] < tc; j--) {
+			locks[j] = locks[j-1];
+			contended[j] = contended[j-1];
+			spins[j] = spins[j-1];
+		}
+		locks[j] = tl;
+		contended[j] = tc;
+		spins[j] = ts;
+	}
+
+	kprintf("spinlocks: %u contended", n);
+	if (dropped > 0) {
+		kprintf(" (and %u not tracked)", dropped);
+	}
+	kprintf("\n");
+	for (i=0; i<n && i<SPINSTAT_PRINT; i++) {
+		kprintf("    %p: %u contended acquires, %u backoff rounds\n",
+			locks[i], contended[i], spins[i]);
+	}
+}
+
+/*
+ * Totals over the locks in the table, for kstat.
+ */
+void
+spinlock_kstat(struct kstat *ks)
+{
+	unsigned i, n, contended, spins, dropped;
+	int s;
+
+	n = contended = spins = 0;
+	s = splhigh();
+	spinstat_grab();
+	for (i=0; i<SPINSTAT_SLOTS; i++) {
+		if (spinstat_locks[i] != NULL &&
+		    spinstat_locks[i]->splk_contended > 0) {
+			n++;
+			contended += spinstat_locks[i]->splk_contended;
+			spins += spinstat_locks[i]->splk_spins;
+		}
+	}
+	dropped = spinstat_dropped;
+	spinstat_ungrab();
+	splx(s);
+
+	kstat_add(ks, "spinlock.contended_locks", n);
+	kstat_add(ks, "spinlock.untracked_locks", dropped);
+	kstat_add(ks, "spinlock.contended_acquires", contended);
+	kstat_add(ks, "spinlock.backoff_rounds", spins);
+}
+
+/*
+ * Zero the counters and empty the table. A lock goes back in the next
+ * time it's contended.
+ */
+void
+spinlock_resetstats(void)
+{
+	unsigned i;
+	int s;
+
+	s = splhigh();
+	spinstat_grab();
+	for (i=0; i<SPINSTAT_SLOTS; i++) {
+		if (spinstat_locks[i] != NULL) {
+			spinstat_locks[i]->splk_contended = 0;
+			spinstat_locks[i]->splk_spins = 0;
+			spinstat_locks[i] = NULL;
+		}
+	}
+	spinstat_dropped = 0;
+	spinstat_ungrab();
+	splx(s);
+}
@@ -33,12 +33,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <softint.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -120,6 +124,37 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+sem_timedP(struct semaphore *sem, uint64_t nsecs)
+{
+	uint64_t now, deadline;
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	deadline = clock_now() + nsecs;
+	result = 0;
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		/* Someone else may get the count each time we wake. */
+		now = clock_now();
+		if (now >= deadline) {
+			result = ETIMEDOUT;
+			break;
+		}
+		(void)wchan_sleep_timeout(sem->sem_wchan, &sem->sem_lock,
+					  deadline - now);
+	}
+	if (result == 0) {
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+	}
+	spinlock_release(&sem->sem_lock);
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -134,6 +169,37 @@ V(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+/*
+ * V, handing off to the thread woken: it runs next, on this cpu if
+ * it can, and if so we yield to it right away unless we hold
+ * spinlocks or are in an RCU reader. Also usable from interrupt
+ * handlers, where the yield preempts the interrupted thread as
+ * hardclock does.
+ */
+void
+V_handoff(struct semaphore *sem)
+{
+	bool yield;
+
+        KASSERT(sem != NULL);
+
+	spinlock_acquire(&sem->sem_lock);
+
+        sem->sem_count++;
+        KASSERT(sem->sem_count > 0);
+	yield = wchan_wakeone_handoff(sem->sem_wchan, &sem->sem_lock);
+
+	spinlock_release(&sem->sem_lock);
+
+	if (yield && softint_active()) {
+		softint_handoff();
+	}
+	else if (yield && curcpu->c_spinlocks == 0 &&
+		 curthread->t_rcu_nest == 0) {
+		thread_yield();
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
@@ -168,6 +234,11 @@ lock_create(const char *name)
 	lock->free = true;		//locks start out free
 
 	lock->curr_user = NULL;		//locks have no initial user
+	lock->lk_ownercpu = NULL;
+	lock->lk_waiters = 0;
+	lock->lk_waitprio = SCHED_NPRIO;
+	lock->lk_lent = false;
+	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
         return lock;
 }
@@ -181,6 +252,8 @@ lock_destroy(struct lock *lock)
 	
 	KASSERT(lock->free == true);	//ensure no one is using the lock
 	KASSERT(lock->curr_user == NULL);
+	KASSERT(lock->lk_waiters == 0);
+	HANGMAN_CLEANUP(&lock->lk_hangman);
 	spinlock_cleanup(&lock->lock_lock);
 	
 	wchan_destroy(lock->lock_wchan);
@@ -192,41 +265,172 @@ lock_destroy(struct lock *lock)
 
 }
 
+/*
+ * Most times round lock_spin's loop before giving up and sleeping.
+ */
+#define LOCK_SPIN_MAX	1000
+
+/*
+ * Check if LOCK's holder is running on some other CPU. This is only
+ * a hint: we look at the holder's CPU, not the holder, as we mustn't
+ * dereference a thread we don't hold LOCK's spinlock against (it may
+ * release the lock and exit). CPUs are never freed, and
+ * lk_ownercpu's c_curthread is only ever an address to compare with.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+	struct cpu *c = lock->lk_ownercpu;
+	volatile struct thread *owner = lock->curr_user;
+
+	return c != NULL && owner != NULL && c != curcpu->c_self &&
+		c->c_curthread == owner;
+}
+
+/*
+ * With LOCK's spinlock unheld, wait briefly for LOCK to come free
+ * while its holder is on another CPU. Returns true if it looks free.
+ */
+static
+bool
+lock_spin(struct lock *lock)
+{
+	unsigned i;
+
+	for (i = 0; i < LOCK_SPIN_MAX; i++) {
+		if (lock->free) {
+			return true;
+		}
+		if (!lock_owner_running(lock)) {
+			break;
+		}
+	}
+	return false;
+}
+
+/*
+ * Before sleeping on LOCK, whose spinlock is held, lend its holder
+ * the best priority of any thread waiting for it, ours included.
+ *
+ * lk_waitprio only gets better until there are no sleepers, as a
+ * sleeper leaving doesn't say what the rest have; so a holder may
+ * stay lent more than it strictly needs, but only while threads are
+ * waiting for what it holds. The holder can't exit under us, as it
+ * needs the spinlock to let go.
+ */
+static
 void
-lock_acquire(struct lock *lock)
+lock_lend(struct lock *lock)
 {
-        // Write this
+	unsigned prio;
+
+	KASSERT(spinlock_do_i_hold(&lock->lock_lock));
+	KASSERT(lock->curr_user != NULL);
 
+	prio = thread_getpriority();
+	if (prio < lock->lk_waitprio) {
+		lock->lk_waitprio = prio;
+	}
+	thread_lend_priority((struct thread *)lock->curr_user,
+			     lock->lk_waitprio, !lock->lk_lent);
+	lock->lk_lent = true;
+}
+
+/*
+ * Get LOCK. If MOVED, we're a cv waiter that was moved onto the
+ * lock's wchan and then woken there, so we're still counted in
+ * lk_waiters.
+ */
+static
+void
+lock_get(struct lock *lock, bool moved)
+{
 	KASSERT(lock != NULL);		//ensure valid lock is passed
 	KASSERT(curthread->t_in_interrupt == false);
-	
+
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 	spinlock_acquire(&lock->lock_lock);	//aquire spinlock
+	if (moved) {
+		KASSERT(lock->lk_waiters > 0);
+		lock->lk_waiters--;
+		if (lock->lk_waiters == 0) {
+			lock->lk_waitprio = SCHED_NPRIO;
+		}
+	}
 		
+	/*
+	 * While the holder's running it's probably about to let go;
+	 * spin instead of paying for a sleep and a wakeup. Once it's
+	 * off-CPU, or once we've spun long enough, sleep.
+	 */
 	while(lock->free == false)	//while lock is held
 	{
-		
+		if (lock_owner_running(lock)) {
+			spinlock_release(&lock->lock_lock);
+			if (lock_spin(lock)) {
+				spinlock_acquire(&lock->lock_lock);
+				continue;
+			}
+			spinlock_acquire(&lock->lock_lock);
+			if (lock->free) {
+				break;
+			}
+		}
+		lock_lend(lock);
+		lock->lk_waiters++;
 		wchan_sleep(lock->lock_wchan, &lock->lock_lock);
+		lock->lk_waiters--;
+		if (lock->lk_waiters == 0) {
+			lock->lk_waitprio = SCHED_NPRIO;
+		}
 	}
 	//lock should be free at this point
 	
 	lock->curr_user = curthread;	//current user is this thread!
+	lock->lk_ownercpu = curcpu->c_self;
 	lock->free = false;		//lock is no longer free!
+	if (lock->lk_waitprio < SCHED_NPRIO) {
+		/* Take over what the sleepers lent the last holder */
+		thread_lend_priority(curthread, lock->lk_waitprio, true);
+		lock->lk_lent = true;
+	}
 	spinlock_release(&lock->lock_lock);
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+}
+
+void
+lock_acquire(struct lock *lock)
+{
+        // Write this
+	lock_get(lock, false);
          //(void)lock;	// suppress warning until code gets written
 }
 
 void
 lock_release(struct lock *lock)
 {
+	bool lent;
+
         // Write this
 
 	KASSERT(lock != NULL); //ensure valid lock
 	KASSERT(lock_do_i_hold(lock)); //ensure this thread holds the lock!
+	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
 	spinlock_acquire(&lock->lock_lock);	//re-acquire spinlock
 	lock->curr_user = NULL; //Dobby has no Master
+	lock->lk_ownercpu = NULL;
 	lock->free = true; //Dobby is FREE!
-	wchan_wakeone(lock->lock_wchan, &lock->lock_lock);
+	lent = lock->lk_lent;
+	lock->lk_lent = false;
+	/* Spinners will see it; only sleepers need waking. */
+	if (lock->lk_waiters > 0) {
+		wchan_wakeone(lock->lock_wchan, &lock->lock_lock);
+	}
 	spinlock_release(&lock->lock_lock);
+	if (lent) {
+		thread_unlend_priority();
+	}
         //(void)lock;  // suppress warning until code gets written
 }
 
@@ -277,6 +481,8 @@ cv_create(const char *name)
 
         // add stuff here as needed
 	spinlock_init(&cv->control_spinlock);		//CV needs a spinlock as well
+	cv->cv_waiters = 0;
+	cv->cv_lock = NULL;
         return cv;
 }
 
@@ -286,6 +492,7 @@ cv_destroy(struct cv *cv)
         KASSERT(cv != NULL);
 
         // add stuff here as needed
+	KASSERT(cv->cv_waiters == 0);
 	wchan_destroy(cv->control_wchan);		//cleanup our only two variables
 	spinlock_cleanup(&cv->control_spinlock);
 
@@ -294,6 +501,69 @@ cv_destroy(struct cv *cv)
         kfree(cv);
 }
 
+/*
+ * Wait morphing. With the cv's spinlock held, cv_enter counts us as
+ * a waiter using LOCK, and cv_leave, after the sleep, says whether
+ * we were moved to LOCK's wchan (and so are counted in lk_waiters
+ * instead). cv_wake wakes one or ALL of the waiters, moving them to
+ * LOCK if they're all waiting with it. The lock order is a cv's
+ * spinlock and then its lock's one, as in cv_wait's lock_release.
+ */
+static
+void
+cv_enter(struct cv *cv, struct lock *lock)
+{
+	if (cv->cv_waiters == 0) {
+		cv->cv_lock = lock;
+	}
+	else if (cv->cv_lock != lock) {
+		cv->cv_lock = NULL;
+	}
+	cv->cv_waiters++;
+}
+
+static
+bool
+cv_leave(struct cv *cv)
+{
+	if (wchan_wasmoved()) {
+		return true;
+	}
+	KASSERT(cv->cv_waiters > 0);
+	cv->cv_waiters--;
+	return false;
+}
+
+static
+void
+cv_wake(struct cv *cv, struct lock *lock, bool all)
+{
+	unsigned moved;
+
+	if (cv->cv_waiters == 0) {
+		return;
+	}
+	if (cv->cv_lock != lock) {
+		if (all) {
+			wchan_wakeall(cv->control_wchan,
+				      &cv->control_spinlock);
+		}
+		else {
+			wchan_wakeone(cv->control_wchan,
+				      &cv->control_spinlock);
+		}
+		return;
+	}
+
+	spinlock_acquire(&lock->lock_lock);
+	moved = wchan_transfer(cv->control_wchan, &cv->control_spinlock,
+			       lock->lock_wchan, &lock->lock_lock, all);
+	lock->lk_waiters += moved;
+	spinlock_release(&lock->lock_lock);
+	KASSERT(cv->cv_waiters >= moved);
+	cv->cv_waiters -= moved;
+}
+
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
@@ -305,18 +575,44 @@ cv_wait(struct cv *cv, struct lock *lock)
 	//steps directly from slides!
 
 
+	bool moved;
+
 	spinlock_acquire(&cv->control_spinlock); //acquire spinlock for CV
+	cv_enter(cv, lock);
 
 	lock_release(lock);	//release lock
 
 	wchan_sleep(cv->control_wchan, &cv->control_spinlock);		//put thread to sleep in CV wchan
+	moved = cv_leave(cv);
 	spinlock_release(&cv->control_spinlock);	//releace spinlock for CV
-	lock_acquire(lock);	//acquire lock
+	lock_get(lock, moved);	//acquire lock
         // Write this
         //(void)cv;    // suppress warning until code gets written
         //(void)lock;  // suppress warning until code gets written
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, uint64_t nsecs)
+{
+	int result;
+	bool moved;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock) == true);
+
+	/* As cv_wait. */
+	spinlock_acquire(&cv->control_spinlock);
+	cv_enter(cv, lock);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->control_wchan,
+				     &cv->control_spinlock, nsecs);
+	moved = cv_leave(cv);
+	spinlock_release(&cv->control_spinlock);
+	lock_get(lock, moved);
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -326,7 +622,7 @@ cv_signal(struct cv *cv, struct lock *lock)
 
 	spinlock_acquire(&cv->control_spinlock); //acquire spinlock for CV
 	
-	wchan_wakeone(cv->control_wchan, &cv->control_spinlock);	//wake thread in CV
+	cv_wake(cv, lock, false);	//move a thread in CV to the lock
 
 	spinlock_release(&cv->control_spinlock);		//release spinlock for CV
         // Write this
@@ -334,6 +630,23 @@ cv_signal(struct cv *cv, struct lock *lock)
 	//(void)lock;  // suppress warning until code gets written
 }
 
+/*
+ * cv_signal, queueing the thread woken to run next. We hold LOCK,
+ * which it wants first, so don't yield; it runs when we next block
+ * or yield, usually right after releasing the lock and waiting.
+ */
+void
+cv_signal_handoff(struct cv *cv, struct lock *lock)
+{
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	spinlock_acquire(&cv->control_spinlock);
+	(void)wchan_wakeone_handoff(cv->control_wchan, &cv->control_spinlock);
+	spinlock_release(&cv->control_spinlock);
+}
+
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {	
@@ -345,10 +658,245 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 
 	spinlock_acquire(&cv->control_spinlock); //acquire spinlock for CV
 	
-	wchan_wakeall(cv->control_wchan, &cv->control_spinlock);	//wake thread in CV
+	cv_wake(cv, lock, true);	//move threads in CV to the lock
 
 	spinlock_release(&cv->control_spinlock);		//release spinlock for CV
 	// Write this
 	//(void)cv;    // suppress warning until code gets written
 	//(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Completion.
+
+void
+completion_init(struct completion *cm, const char *name)
+{
+	spinlock_init(&cm->cm_lock);
+	wchan_init(&cm->cm_wchan, name);
+	cm->cm_done = false;
+}
+
+void
+completion_cleanup(struct completion *cm)
+{
+	wchan_cleanup(&cm->cm_wchan);
+	spinlock_cleanup(&cm->cm_lock);
+}
+
+void
+completion_reinit(struct completion *cm)
+{
+	spinlock_acquire(&cm->cm_lock);
+	KASSERT(wchan_isempty(&cm->cm_wchan, &cm->cm_lock));
+	cm->cm_done = false;
+	spinlock_release(&cm->cm_lock);
+}
+
+void
+complete(struct completion *cm)
+{
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_done = true;
+	wchan_wakeall(&cm->cm_wchan, &cm->cm_lock);
+	spinlock_release(&cm->cm_lock);
+}
+
+void
+wait_for_completion(struct completion *cm)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	/*
+	 * Take the lock even if it's done, so complete() has let go of
+	 * it before we return and the caller frees the completion.
+	 */
+	spinlock_acquire(&cm->cm_lock);
+	while (!cm->cm_done) {
+		wchan_sleep(&cm->cm_wchan, &cm->cm_lock);
+	}
+	spinlock_release(&cm->cm_lock);
+}
+
+int
+wait_for_completion_timeout(struct completion *cm, uint64_t nsecs)
+{
+	int result = 0;
+
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&cm->cm_lock);
+	/* Only one wakeup can come, so a timeout is final */
+	if (!cm->cm_done) {
+		(void)wchan_sleep_timeout(&cm->cm_wchan, &cm->cm_lock,
+					  nsecs);
+		result = cm->cm_done ? 0 : ETIMEDOUT;
+	}
+	spinlock_release(&cm->cm_lock);
+	return result;
+}
+
+bool
+completion_done(struct completion *cm)
+{
+	return cm->cm_done;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwl_name = kstrdup(name);
+	if (rw->rwl_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rwl_rwchan = wchan_create(rw->rwl_name);
+	if (rw->rwl_rwchan == NULL) {
+		kfree(rw->rwl_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rwl_wwchan = wchan_create(rw->rwl_name);
+	if (rw->rwl_wwchan == NULL) {
+		wchan_destroy(rw->rwl_rwchan);
+		kfree(rw->rwl_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rwl_lock);
+	rw->rwl_readers = 0;
+	rw->rwl_writer = NULL;
+	rw->rwl_rwaiting = 0;
+	rw->rwl_wwaiting = 0;
+	rw->rwl_gen = 0;
+	rw->rwl_readpass = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rwl_readers == 0);
+	KASSERT(rw->rwl_writer == NULL);
+	KASSERT(rw->rwl_rwaiting == 0);
+	KASSERT(rw->rwl_wwaiting == 0);
+
+	spinlock_cleanup(&rw->rwl_lock);
+	wchan_destroy(rw->rwl_wwchan);
+	wchan_destroy(rw->rwl_rwchan);
+	kfree(rw->rwl_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	unsigned gen;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwl_lock);
+	KASSERT(rw->rwl_writer != curthread);
+	if (rw->rwl_writer == NULL && rw->rwl_wwaiting == 0) {
+		/* fast path */
+		rw->rwl_readers++;
+		spinlock_release(&rw->rwl_lock);
+		return;
+	}
+
+	/*
+	 * Wait for the writer that's in, or the writers that are
+	 * waiting, until one of them lets go and gives us a pass.
+	 */
+	gen = rw->rwl_gen;
+	rw->rwl_rwaiting++;
+	do {
+		wchan_sleep(rw->rwl_rwchan, &rw->rwl_lock);
+	} while (rw->rwl_writer != NULL ||
+		 (rw->rwl_wwaiting > 0 && gen == rw->rwl_gen));
+	rw->rwl_rwaiting--;
+	if (gen != rw->rwl_gen) {
+		KASSERT(rw->rwl_readpass > 0);
+		rw->rwl_readpass--;
+	}
+	rw->rwl_readers++;
+	spinlock_release(&rw->rwl_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwl_lock);
+	KASSERT(rw->rwl_readers > 0);
+	rw->rwl_readers--;
+	if (rw->rwl_readers == 0 && rw->rwl_readpass == 0 &&
+	    rw->rwl_wwaiting > 0) {
+		wchan_wakeone(rw->rwl_wwchan, &rw->rwl_lock);
+	}
+	spinlock_release(&rw->rwl_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwl_lock);
+	KASSERT(rw->rwl_writer != curthread);
+	rw->rwl_wwaiting++;
+	while (rw->rwl_writer != NULL || rw->rwl_readers > 0 ||
+	       rw->rwl_readpass > 0) {
+		wchan_sleep(rw->rwl_wwchan, &rw->rwl_lock);
+	}
+	rw->rwl_wwaiting--;
+	rw->rwl_writer = curthread;
+	spinlock_release(&rw->rwl_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwl_lock);
+	KASSERT(rw->rwl_writer == curthread);
+	rw->rwl_writer = NULL;
+	if (rw->rwl_rwaiting > 0) {
+		/* Let in everyone who was waiting before the next writer. */
+		rw->rwl_gen++;
+		rw->rwl_readpass = rw->rwl_rwaiting;
+		wchan_wakeall(rw->rwl_rwchan, &rw->rwl_lock);
+	}
+	else if (rw->rwl_wwaiting > 0) {
+		wchan_wakeone(rw->rwl_wwchan, &rw->rwl_lock);
+	}
+	spinlock_release(&rw->rwl_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rwl_writer == curthread;
+}
@@ -35,10 +35,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
 #include <spl.h>
+#include <membar.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -50,17 +53,17 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmemcache.h>
+#include <clock.h>
+#include <kevent.h>
+#include <rcu.h>
+#include <pcpu.h>
+#include <softint.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
-struct wchan {
-	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
-};
-
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -69,6 +72,28 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Cache of thread structures. The join lock, cv, and wait channel are
+ * made once per structure and kept across reuse.
+ */
+static struct kmem_cache *thread_cache;
+
+/* Scheduler statistics. */
+static struct pcpu_counter sched_switches =
+	PCPU_COUNTER_INITIALIZER("sched.switches");
+static struct pcpu_counter sched_steals =
+	PCPU_COUNTER_INITIALIZER("sched.steals");
+static struct pcpu_counter sched_migrations =
+	PCPU_COUNTER_INITIALIZER("sched.migrations");
+static struct pcpu_counter sched_handoffs =
+	PCPU_COUNTER_INITIALIZER("sched.handoffs");
+static struct pcpu_counter sched_preempts =
+	PCPU_COUNTER_INITIALIZER("sched.preempts");
+static struct pcpu_counter sched_irqwakes =
+	PCPU_COUNTER_INITIALIZER("sched.irqwakes");
+static struct pcpu_counter sched_irqwake_us =
+	PCPU_COUNTER_INITIALIZER("sched.irqwake_us");
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -109,51 +134,126 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Constructor and destructor for thread_cache.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_ctor(void *obj)
 {
-	struct thread *thread;
+	struct thread *thread = obj;
+
+	completion_init(&thread->t_done, "thread");
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	completion_cleanup(&thread->t_done);
+}
 
+/*
+ * Set up a thread structure, fresh from thread_cache or a spare, for
+ * a new thread called NAME. Everything but t_stack, which spares
+ * keep, is initialized here. Short names are kept in the structure,
+ * saving an allocation.
+ */
+static
+int
+thread_init(struct thread *thread, const char *name)
+{
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
 	}
-
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			return ENOMEM;
+		}
 	}
+	KEVENT_NAME(KEV_THREAD, thread, name);
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan_moved = false;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_lwpdone = NULL;
+	thread->t_prio = 0;
+	thread->t_runqueue = 0;
+	thread->t_inherit = SCHED_NPRIO;
+	thread->t_loans = 0;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_ticks = 0;
+	thread->t_readyclock = 0;
+	thread->t_waketime = 0;
+
+	/* Accounting fields */
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+	thread->t_usagestamp = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	thread->t_rcu_nest = 0;
+	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
 	/* VFS fields */
 	thread->t_did_reserve_buffers = false;
+	thread->t_dirtied_buffers = false;
+	thread->t_reclaiming = false;
 
-	/* If you add to struct thread, be sure to initialize here */
-	thread->t_wchan = wchan_create(thread->t_name);
-	thread->t_lock = lock_create(thread->t_name);
-	thread->complete = false;
-	thread->t_cv=cv_create(thread->t_name);
+	/*
+	 * If you add to struct thread, be sure to initialize here
+	 * (or in thread_ctor, for state kept across reuse)
+	 */
+	completion_reinit(&thread->t_done);
+	return 0;
+}
+
+/*
+ * Free a thread's name, if it didn't fit in the structure.
+ */
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmem_cache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	if (thread_init(thread, name)) {
+		kmem_cache_free(thread_cache, thread);
+		return NULL;
+	}
 	return thread;
 }
 
@@ -169,6 +269,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -182,16 +283,53 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_spares);
 	c->c_hardclocks = 0;
+	c->c_migrant = NULL;
 	c->c_spinlocks = 0;
+	HANGMAN_ACTORINIT(&c->c_hangman, "cpu");
+	c->c_tlb_victim = 0;
+	c->c_tlb_misses = 0;
+	c->c_tlb_refills = 0;
+	c->c_tlb_evictions = 0;
+	c->c_nexttick = 0;
+	c->c_cyclebase = 0;
+	c->c_maxlatency = 0;
+	c->c_randavail = 0;
+	c->c_fastrand = 0;
+	c->c_softints = NULL;
+	c->c_insoftint = false;
+	c->c_softint_handoff = false;
+	c->c_asid = 0;
+	c->c_asidfree = 0;
+	c->c_asid_rollovers = 0;
+	c->c_asidgen = 0;
+	c->c_ktrace = NULL;
+	c->c_kevent = NULL;
+	c->c_kprof = NULL;
+	c->c_rcu_gen = 0;
+	for (i=0; i<PCPU_MAXCOUNTERS; i++) {
+		c->c_pcpu[i] = 0;
+	}
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_bits = 0;
+	c->c_runqueue_count = 0;
+	c->c_needresched = false;
 	spinlock_init(&c->c_runqueue_lock);
 
+	c->c_timeouts = NULL;
+	spinlock_init(&c->c_timeout_lock);
+
 	c->c_ipi_pending = 0;
+	c->c_ipi_calls = 0;
 	c->c_numshootdown = 0;
-	spinlock_init(&c->c_ipi_lock);
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
+	spinlock_init(&c->c_shootdown_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -289,26 +427,167 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	thread_freename(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Spare threads.
+ *
+ * Rather than destroying every zombie, exorcise() keeps up to
+ * THREAD_MAXSPARES of them per cpu, stack and all, and thread_fork
+ * reuses one if the current cpu has one. Then a short-lived thread
+ * costs no allocation at all on the fork path but a long name. The
+ * lists are only used by their own cpu, with interrupts off. Spares
+ * hold a stack page each, so don't keep many.
+ */
+#define THREAD_MAXSPARES	8
+
+/*
+ * Keep a zombie as a spare, if it has a stack (it isn't a boot
+ * thread) and there's room. Returns false if the caller should
+ * destroy it instead.
+ */
+static
+bool
+thread_spare_put(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_spares.tl_count >= THREAD_MAXSPARES) {
+		return false;
+	}
+
+	/* As in thread_destroy, except for the stack. */
+	KASSERT(thread->t_did_reserve_buffers == false);
+	KASSERT(thread->t_proc == NULL);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_freename(thread);
+	thread->t_wchan_name = "SPARE";
+
+	/* Most recently used first; its stack may still be cached. */
+	threadlist_addhead(&curcpu->c_spares, thread);
+	return true;
+}
+
+/*
+ * Take a spare thread from this cpu, or NULL if none. It needs
+ * thread_init before use.
+ */
+static
+struct thread *
+thread_spare_get(void)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_spares);
+	splx(spl);
+	return thread;
+}
+
+/*
+ * The reaper.
+ *
+ * Zombies that can't be kept as spares are handed to the reaper
+ * thread to destroy, so exorcise, which runs on the switch path,
+ * never frees anything itself; a burst of exits otherwise costs the
+ * unrelated threads switched to next a kfree or two each. The reaper
+ * yields after each one so it doesn't hold up anything else. Until
+ * it's started (reaper_wchan is NULL) exorcise destroys them itself.
+ */
+static struct spinlock reaper_lock = SPINLOCK_INITIALIZER;
+static struct wchan *reaper_wchan;
+static struct threadlist reaper_list;	/* zombies to destroy */
+
+static
+void
+thread_reaper(void *data1, unsigned long data2)
+{
+	struct thread *z;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&reaper_lock);
+	while (1) {
+		while (threadlist_isempty(&reaper_list)) {
+			wchan_sleep(reaper_wchan, &reaper_lock);
+		}
+		z = threadlist_remhead(&reaper_list);
+		spinlock_release(&reaper_lock);
+
+		thread_destroy(z);
+
+		thread_yield();
+		spinlock_acquire(&reaper_lock);
+	}
+}
+
+/*
+ * Start the reaper, once other threads can be forked.
+ */
+static
+void
+thread_reaper_start(void)
+{
+	struct wchan *wc;
+	int result;
+
+	wc = wchan_create("reaper");
+	if (wc == NULL) {
+		panic("thread: Could not create reaper wchan\n");
+	}
+	result = thread_fork("reaper", NULL, thread_reaper, NULL, 0);
+	if (result) {
+		panic("thread: thread_fork reaper: %s\n", strerror(result));
+	}
+	/* Now exorcise may start queueing for it */
+	spinlock_acquire(&reaper_lock);
+	reaper_wchan = wc;
+	spinlock_release(&reaper_lock);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu. Each zombie either becomes a spare
+ * or goes to the reaper; that's a constant amount of work apiece.
  */
 static
 void
 exorcise(void)
 {
 	struct thread *z;
+	bool locked = false;
+	bool wake = false;
 
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (thread_spare_put(z)) {
+			continue;
+		}
+		if (reaper_wchan == NULL) {
+			/* Early in boot; no reaper yet */
+			thread_destroy(z);
+			continue;
+		}
+		if (!locked) {
+			spinlock_acquire(&reaper_lock);
+			locked = true;
+		}
+		wake = wake || threadlist_isempty(&reaper_list);
+		threadlist_addtail(&reaper_list, z);
+	}
+	if (locked) {
+		if (wake) {
+			wchan_wakeone(reaper_wchan, &reaper_lock);
+		}
+		spinlock_release(&reaper_lock);
 	}
 }
 
@@ -320,6 +599,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -334,9 +616,14 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NPRIO; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runqueue_bits = 0;
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -378,6 +665,13 @@ void
 thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
+	threadlist_init(&reaper_list);
+
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -446,148 +740,799 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	/* Now they can take device interrupts. */
+	mainbus_route_cpus();
+
+	thread_reaper_start();
 }
 
 /*
- * Make a thread runnable.
+ * Run queue helpers. Call with the CPU's run queue lock held.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * The run queues implement a multi-level feedback queue: a thread
+ * runs for SCHED_QUANTUM(prio) hardclocks before being moved down a
+ * level, moves up a level each time it wakes from sleeping, and
+ * everything goes back to the top periodically (see schedule()). The
+ * highest-priority runnable thread runs, round-robin within a queue.
+ *
+ * The process's nice value shifts all of this down by its band (see
+ * cpu.h), so a niced batch job at its best level still queues behind
+ * ordinary threads that have sunk a few levels, and one at the
+ * bottom band never runs ahead of an unniced thread. c_runqueue_bits
+ * tracks which queues are nonempty, so finding the best one is a
+ * lowest-set-bit operation rather than a scan.
  */
-static
-void
-thread_make_runnable(struct thread *target, bool already_have_lock)
-{
-	struct cpu *targetcpu;
+#define SCHED_QUANTUM(prio)	(1U << (prio))
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
+#if SCHED_NPRIO > 32
+#error "c_runqueue_bits is too small for SCHED_NPRIO"
+#endif
 
-	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
-	}
-	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
-	}
+/*
+ * Nice band of a thread's process; kernel-only threads and threads
+ * being set up count as unniced. p_nice is read without the proc
+ * lock: a stale value just places one thread one queue off once.
+ */
+static
+unsigned
+thread_band(struct thread *t)
+{
+	int nice;
 
-	/* Target thread is now ready to run; put it on the run queue. */
-	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	nice = (t->t_proc == NULL) ? 0 : t->t_proc->p_nice;
+	return (nice - PRIO_MIN) * SCHED_NBANDS / (PRIO_MAX - PRIO_MIN + 1);
+}
 
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+/*
+ * Run queue for a thread at its current level and nice band, or
+ * the better one it's been lent (see thread_lend_priority).
+ */
+static
+unsigned
+thread_runqueue(struct thread *t)
+{
+	unsigned q;
 
-	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
-	}
+	KASSERT(t->t_prio < SCHED_NLEVELS);
+	q = thread_band(t) + t->t_prio;
+	return q < t->t_inherit ? q : t->t_inherit;
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Index of the lowest set bit of a nonzero word. MIPS-I has no
+ * count-leading-zeros instruction, and the kernel doesn't link
+ * libgcc, so use de Bruijn multiplication rather than __builtin_ctz.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+unsigned
+runqueue_firstbit(uint32_t bits)
 {
-	struct thread *newthread;
-	int result;
+	static const uint8_t debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+	};
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
-	}
-
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
+	KASSERT(bits != 0);
+	return debruijn[((bits & -bits) * 0x077CB531U) >> 27];
+}
 
-	/*
-	 * Now we clone various fields from the parent thread.
-	 */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	return c->c_runqueue_count;
+}
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
-	//here we set the parent fields!
-	newthread->complete = false;
-	newthread->t_wchan = wchan_create(newthread->t_name);
-	newthread->t_cv = cv_create(newthread->t_name);
-	newthread->t_lock = lock_create(newthread->t_name);
+/*
+ * Queue a thread on its run queue, at the tail.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	unsigned q;
 
-	/* Attach the new thread to its process */
-	if (proc == NULL) {
-		proc = curthread->t_proc;
-	}
-	result = proc_addthread(proc, newthread);
-	if (result) {
-		/* thread_destroy will clean up the stack */
-		thread_destroy(newthread);
-		return result;
-	}
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	/*
-	 * Because new threads come out holding the cpu runqueue lock
-	 * (see notes at bottom of thread_switch), we need to account
-	 * for the spllower() that will be done releasing it.
-	 */
-	newthread->t_iplhigh_count++;
+	q = thread_runqueue(t);
+	t->t_runqueue = q;
+	threadlist_addtail(&c->c_runqueue[q], t);
+	c->c_runqueue_bits |= (uint32_t)1 << q;
+	c->c_runqueue_count++;
+}
 
-	/* Set up the switchframe so entrypoint() gets called */
-	switchframe_init(newthread, entrypoint, data1, data2);
+/*
+ * Queue a thread at the head of its run queue, to run before others
+ * of its priority (see thread_make_runnable).
+ */
+static
+void
+runqueue_addhead(struct cpu *c, struct thread *t)
+{
+	unsigned q;
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	return 0;
-}
-/*THREAD JOIN////////////////////////////////////////////////////////////////////////////*/
-int
-thread_join(struct thread *child)
-{
-	lock_acquire(child->t_lock);	//acquire spinlock
-	while(child->complete == false)
-	{
-		cv_wait(child->t_cv, child->t_lock);
-	}
-	lock_release(child->t_lock);
-	
-	return child->complete;
+	q = thread_runqueue(t);
+	t->t_runqueue = q;
+	threadlist_addhead(&c->c_runqueue[q], t);
+	c->c_runqueue_bits |= (uint32_t)1 << q;
+	c->c_runqueue_count++;
 }
+
 /*
- * High level, machine-independent context switch code.
- *
- * The current thread is queued appropriately and its state is changed
- * to NEWSTATE; another thread to run is selected and switched to.
- *
- * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
- * WC, protected by the spinlock LK. Otherwise WC and Lk should be
- * NULL.
+ * Take a particular thread off the run queue it's on.
  */
 static
 void
-thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
+runqueue_remove(struct cpu *c, struct thread *t)
 {
-	struct thread *cur, *next;
-	int spl;
+	unsigned q;
 
-	DEBUGASSERT(curcpu->c_curthread == curthread);
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	q = t->t_runqueue;
+	threadlist_remove(&c->c_runqueue[q], t);
+	if (threadlist_isempty(&c->c_runqueue[q])) {
+		c->c_runqueue_bits &= ~((uint32_t)1 << q);
+	}
+	c->c_runqueue_count--;
+}
+
+/*
+ * Take the highest-priority thread, or NULL if none.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned q;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_runqueue_bits == 0) {
+		return NULL;
+	}
+	q = runqueue_firstbit(c->c_runqueue_bits);
+	t = threadlist_remhead(&c->c_runqueue[q]);
+	KASSERT(t != NULL);
+	if (threadlist_isempty(&c->c_runqueue[q])) {
+		c->c_runqueue_bits &= ~((uint32_t)1 << q);
+	}
+	c->c_runqueue_count--;
+	return t;
+}
+
+/*
+ * CPU affinity.
+ *
+ * A thread only goes on the run queue of a CPU its t_affinity
+ * allows, and is only stolen by one. The catch is a thread that is
+ * running on, or idling on the stack of, a CPU it no longer may use:
+ * until that CPU has switched to something else, the thread must not
+ * move, as with stealing. So when it yields, thread_switch leaves it
+ * queued as the CPU's c_migrant and the next thread to run there
+ * pushes it away (thread_migrate).
+ */
+
+/*
+ * Check if thread T may run on cpu C. There are at most 32 cpus.
+ */
+static
+bool
+thread_allowed(struct thread *t, struct cpu *c)
+{
+	KASSERT(c->c_number < 32);
+	return (t->t_affinity & ((uint32_t)1 << c->c_number)) != 0;
+}
+
+/*
+ * Choose a cpu for T to be queued on: an allowed idle one if there
+ * is one, else the least loaded allowed one. Unlocked, so only a
+ * hint. Returns NULL only if the mask allows no cpu at all.
+ */
+static
+struct cpu *
+thread_affinity_cpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, load, bestload;
+
+	best = NULL;
+	bestload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!thread_allowed(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		load = c->c_runqueue_count;
+		if (best == NULL || load < bestload) {
+			best = c;
+			bestload = load;
+		}
+	}
+	return best;
+}
+
+/*
+ * Find and lock an allowed cpu other than FROM to move T to. FROM's
+ * run queue lock is held, so only try-lock the target, as stealing
+ * does, to keep clear of a cpu doing the same thing the other way;
+ * on failure T just stays where it is for now. Returns the locked
+ * cpu or NULL.
+ */
+static
+struct cpu *
+thread_affinity_lock(struct thread *t, struct cpu *from)
+{
+	struct cpu *c;
+
+	KASSERT(spinlock_do_i_hold(&from->c_runqueue_lock));
+
+	c = thread_affinity_cpu(t);
+	if (c == NULL || c == from) {
+		return NULL;
+	}
+	if (!spinlock_tryacquire(&c->c_runqueue_lock)) {
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * Queue T, on no run queue, on cpu C, whose lock is held, and get C
+ * to look at it if it's idle.
+ */
+static
+void
+thread_affinity_queue(struct thread *t, struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_cpu = c;
+	t->t_readyclock = c->c_hardclocks;
+	runqueue_add(c, t);
+	if (c->c_isidle && c != curcpu->c_self) {
+		ipi_send(c, IPI_UNIDLE);
+	}
+	pcpu_counter_inc(&sched_migrations);
+}
+
+/*
+ * Push this cpu's migrant, if any, to a cpu it's allowed on. Called
+ * with the run queue lock held right after a switch, in the thread
+ * switched to, so the migrant is no longer running here.
+ */
+static
+void
+thread_migrate(void)
+{
+	struct thread *t;
+	struct cpu *c;
+
+	t = curcpu->c_migrant;
+	if (t == NULL) {
+		return;
+	}
+	curcpu->c_migrant = NULL;
+
+	/* Our run queue lock was held throughout, so it's still here. */
+	KASSERT(t->t_state == S_READY);
+	KASSERT(t->t_cpu == curcpu->c_self);
+
+	c = thread_affinity_lock(t, curcpu->c_self);
+	if (c == NULL) {
+		return;
+	}
+	runqueue_remove(curcpu->c_self, t);
+	thread_affinity_queue(t, c);
+	spinlock_release(&c->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+	      t->t_name, curcpu->c_number, c->c_number);
+}
+
+/*
+ * Work stealing.
+ *
+ * A CPU with nothing to run, on its way into cpu_idle(), looks for
+ * the busiest other CPU and takes the lowest-priority thread queued
+ * there, rather than busy CPUs pushing threads away. It only
+ * try-locks the victim's run queue, so the idle loop never piles up
+ * on a busy CPU's lock; on failure it idles and tries again at the
+ * next interrupt.
+ *
+ * For hysteresis, a thread must have waited STEAL_MINWAIT of the
+ * victim's hardclocks to be taken, so a thread that will get the CPU
+ * again in a moment isn't dragged away from its cache for nothing,
+ * and one just stolen isn't bounced straight back.
+ */
+#define STEAL_MINWAIT	2
+
+/*
+ * Number of threads queued on a CPU, read without the lock: only a
+ * hint for picking a victim.
+ */
+static
+unsigned
+runqueue_load(struct cpu *c)
+{
+	return c->c_runqueue_count;
+}
+
+/*
+ * Try to steal a thread for the current CPU. Returns it, no longer on
+ * any run queue and assigned to this CPU, or NULL. Sets SAWWORK if
+ * some CPU had threads waiting, taken or not, so an idle CPU knows to
+ * keep checking.
+ *
+ * Call with interrupts off and no run queue lock held.
+ */
+static
+struct thread *
+thread_steal(bool *sawwork)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *found;
+	unsigned i, numcpus, load, maxload;
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		load = runqueue_load(c);
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	*sawwork = (victim != NULL);
+	if (victim == NULL) {
+		return NULL;
+	}
+	if (!spinlock_tryacquire(&victim->c_runqueue_lock)) {
+		return NULL;
+	}
+
+	found = NULL;
+	for (i=SCHED_NPRIO; i-- > 0 && found == NULL; ) {
+		THREADLIST_FORALL_REV(t, victim->c_runqueue[i]) {
+			/*
+			 * The victim's curthread can be on its run
+			 * queue while it unidles (see thread_switch);
+			 * it mustn't move. Nor may any thread go
+			 * where its affinity doesn't allow.
+			 */
+			if (t != victim->c_curthread &&
+			    thread_allowed(t, curcpu->c_self) &&
+			    victim->c_hardclocks - t->t_readyclock
+			    >= STEAL_MINWAIT) {
+				found = t;
+				break;
+			}
+		}
+	}
+	if (found != NULL) {
+		runqueue_remove(victim, found);
+		found->t_cpu = curcpu->c_self;
+		found->t_readyclock = curcpu->c_hardclocks;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (found != NULL) {
+		pcpu_counter_inc(&sched_steals);
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      found->t_name, victim->c_number, curcpu->c_number);
+	}
+	return found;
+}
+
+/*
+ * Wake one idle cpu, other than BUSY and this one, so it can look for
+ * work to steal; an idle cpu otherwise gets no timer interrupts. The
+ * idle flags are read unlocked, which at worst costs a spurious IPI
+ * or a missed one the next wakeup makes up for.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * What a cpu has to be told once threads have been queued on it, as
+ * returned by thread_enqueue and acted on by thread_notify. Batched
+ * wakeups (wchan_wakeall) collect these for all the threads going to
+ * one cpu and tell it once.
+ */
+#define NOTIFY_UNIDLE	0x1	/* It's idle: send IPI_UNIDLE */
+#define NOTIFY_RESCHED	0x2	/* Preempt its thread (see thread.h) */
+#define NOTIFY_KICK	0x4	/* A thread waits; tell an idle cpu */
+
+/*
+ * First part of waking TARGET, whose cpu's run queue lock is held.
+ */
+static
+void
+thread_wake_prepare(struct thread *target)
+{
+	/* A thread waking up gets boosted and a fresh quantum. */
+	if (target->t_state == S_SLEEP) {
+		if (target->t_prio > 0) {
+			target->t_prio--;
+		}
+		target->t_ticks = 0;
+	}
+
+	/* Target thread is now ready to run; put it on the run queue. */
+	target->t_state = S_READY;
+
+	/* Time wakeups from interrupts, for thread_printlatency. */
+	target->t_waketime = curthread->t_in_interrupt ? clock_now() : 0;
+}
+
+/*
+ * Queue TARGET, prepared as above, on its cpu C, whose lock is held.
+ * Returns the NOTIFY_ flags C needs; none if the thread went to some
+ * other cpu instead, which has then been told already.
+ */
+static
+unsigned
+thread_enqueue(struct thread *target, struct cpu *c, bool handoff)
+{
+	struct cpu *othercpu;
+	struct thread *cur;
+	unsigned notify;
+
+	KASSERT(target->t_cpu == c);
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	/*
+	 * If it last ran somewhere it may no longer, and isn't still
+	 * there (see thread_steal), send it where it's allowed if we can.
+	 */
+	if (!thread_allowed(target, c) && target != c->c_curthread) {
+		othercpu = thread_affinity_lock(target, c);
+		if (othercpu != NULL) {
+			thread_affinity_queue(target, othercpu);
+			spinlock_release(&othercpu->c_runqueue_lock);
+			return 0;
+		}
+	}
+
+	target->t_readyclock = c->c_hardclocks;
+	if (handoff) {
+		runqueue_addhead(c, target);
+	}
+	else {
+		runqueue_add(c, target);
+	}
+
+	if (c->c_isidle) {
+		/* The current cpu doesn't need an interrupt to unidle. */
+		return c != curcpu->c_self ? NOTIFY_UNIDLE : 0;
+	}
+
+	/* If it outranks what's running, that should give way. */
+	notify = NOTIFY_KICK;
+	cur = c->c_curthread;
+	if (cur != NULL && thread_runqueue(target) < thread_runqueue(cur)) {
+		notify |= NOTIFY_RESCHED;
+	}
+	return notify;
+}
+
+/*
+ * Tell C, whose run queue lock is held, about threads just queued.
+ */
+static
+void
+thread_notify(struct cpu *c, unsigned notify)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (notify & NOTIFY_UNIDLE) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(c, IPI_UNIDLE);
+	}
+	if (notify & NOTIFY_RESCHED) {
+		c->c_needresched = true;
+		if (c != curcpu->c_self) {
+			ipi_send(c, IPI_RESCHED);
+		}
+	}
+	if (notify & NOTIFY_KICK) {
+		/* Unless it can preempt, it has to wait. */
+		thread_kick_idle(c);
+	}
+}
+
+/*
+ * Make a thread runnable.
+ *
+ * targetcpu might be curcpu; it might not be, too.
+ *
+ * With HANDOFF, for a wakeup that something is waiting on, the thread
+ * goes at the head of its run queue instead of the tail, and on this
+ * cpu rather than its own if it may run here and we can get the lock
+ * (only trying, as we hold its cpu's). That way a thread woken by an
+ * I/O completion or a partner in a producer/consumer pair runs next
+ * instead of after a full round of its queue, on the cpu whose cache
+ * has what its waker just did. Returns true if the thread went on
+ * this cpu, so the caller can yield to it once its locks are dropped.
+ */
+static
+bool
+thread_make_runnable(struct thread *target, bool already_have_lock,
+		     bool handoff)
+{
+	struct cpu *targetcpu, *here;
+	bool ret;
+
+	/* Lock the run queue of the target thread's cpu. */
+	targetcpu = target->t_cpu;
+
+	if (already_have_lock) {
+		/* The target thread's cpu should be already locked. */
+		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	}
+	else {
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	}
+
+	thread_wake_prepare(target);
+
+	here = curcpu->c_self;
+	if (handoff && targetcpu != here && thread_allowed(target, here) &&
+	    target != targetcpu->c_curthread && !already_have_lock &&
+	    spinlock_tryacquire(&here->c_runqueue_lock)) {
+		target->t_cpu = here;
+		target->t_readyclock = here->c_hardclocks;
+		runqueue_addhead(here, target);
+		spinlock_release(&here->c_runqueue_lock);
+		spinlock_release(&targetcpu->c_runqueue_lock);
+		pcpu_counter_inc(&sched_handoffs);
+		return true;
+	}
+
+	thread_notify(targetcpu, thread_enqueue(target, targetcpu, handoff));
+	ret = handoff && target->t_cpu == here;
+
+	if (!already_have_lock) {
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+	return ret;
+}
+
+/*
+ * Priority inheritance.
+ *
+ * t_inherit and t_loans are protected by the run queue lock of the
+ * thread's cpu, like the other scheduling fields. A loan to a thread
+ * that's queued moves it to the queue it's been lent, and preempts
+ * what's running there if that now ranks lower; one that's running
+ * or asleep takes effect when it's next compared or queued.
+ */
+
+unsigned
+thread_getpriority(void)
+{
+	return thread_runqueue(curthread);
+}
+
+void
+thread_lend_priority(struct thread *t, unsigned prio, bool newloan)
+{
+	struct cpu *c;
+	struct thread *cur;
+	unsigned notify;
+
+	KASSERT(prio < SCHED_NPRIO);
+
+	/* Its cpu only changes with that cpu's lock held */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	if (newloan) {
+		t->t_loans++;
+	}
+	KASSERT(t->t_loans > 0);
+	if (prio < t->t_inherit) {
+		t->t_inherit = prio;
+		if (t->t_state == S_READY && prio < t->t_runqueue) {
+			runqueue_remove(c, t);
+			runqueue_add(c, t);
+			cur = c->c_curthread;
+			notify = 0;
+			if (!c->c_isidle && cur != NULL &&
+			    prio < thread_runqueue(cur)) {
+				notify = NOTIFY_RESCHED;
+			}
+			thread_notify(c, notify);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+void
+thread_unlend_priority(void)
+{
+	struct thread *cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	KASSERT(cur->t_loans > 0);
+	cur->t_loans--;
+	if (cur->t_loans == 0 && cur->t_inherit < SCHED_NPRIO) {
+		cur->t_inherit = SCHED_NPRIO;
+		/* Give way now to whatever the loan let us run ahead of */
+		if (curcpu->c_runqueue_bits &
+		    (((uint32_t)1 << thread_runqueue(cur)) - 1)) {
+			curcpu->c_needresched = true;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+	/* Reuse a spare, stack and all, if there is one. */
+	newthread = thread_spare_get();
+	if (newthread != NULL) {
+		result = thread_init(newthread, name);
+		if (result) {
+			thread_destroy(newthread);
+			return result;
+		}
+	}
+	else {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
+
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+	}
+	thread_checkstack_init(newthread);
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	if (!thread_allowed(newthread, newthread->t_cpu)) {
+		newthread->t_cpu = thread_affinity_cpu(newthread);
+		KASSERT(newthread->t_cpu != NULL);
+	}
+
+	/* Attach the new thread to its process */
+	if (proc == NULL) {
+		proc = curthread->t_proc;
+	}
+	result = proc_addthread(proc, newthread);
+	if (result) {
+		/* thread_destroy will clean up the stack */
+		thread_destroy(newthread);
+		return result;
+	}
+
+	/*
+	 * Because new threads come out holding the cpu runqueue lock
+	 * (see notes at bottom of thread_switch), we need to account
+	 * for the spllower() that will be done releasing it.
+	 */
+	newthread->t_iplhigh_count++;
+
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false, false);
+
+	return 0;
+}
+/*THREAD JOIN////////////////////////////////////////////////////////////////////////////*/
+int
+thread_join(struct thread *child)
+{
+	wait_for_completion(&child->t_done);
+	return completion_done(&child->t_done);
+}
+
+/*
+ * Record the latency of T, woken by an interrupt handler, which is
+ * about to get the current cpu. Latencies past 4 s are clipped.
+ */
+static
+void
+thread_latency(struct thread *t)
+{
+	uint64_t delta;
+	uint32_t ns;
+
+	delta = clock_now() - t->t_waketime;
+	t->t_waketime = 0;
+	ns = delta > 0xffffffffULL ? 0xffffffffU : (uint32_t)delta;
+	if (ns > curcpu->c_maxlatency) {
+		curcpu->c_maxlatency = ns;
+	}
+	pcpu_counter_inc(&sched_irqwakes);
+	pcpu_counter_add(&sched_irqwake_us, ns / 1000);
+}
+
+/*
+ * High level, machine-independent context switch code.
+ *
+ * The current thread is queued appropriately and its state is changed
+ * to NEWSTATE; another thread to run is selected and switched to.
+ *
+ * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
+ * WC, protected by the spinlock LK. Otherwise WC and Lk should be
+ * NULL.
+ */
+static
+void
+thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *cur, *next;
+	bool idled = false, sawwork;
+	int spl;
+
+	DEBUGASSERT(curcpu->c_curthread == curthread);
 	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
 
 	/* Explicitly disable interrupts on this processor */
@@ -607,11 +1552,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* No switching in an RCU read-side section; this is outside. */
+	KASSERT(cur->t_rcu_nest == 0);
+	rcu_quiescent();
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. (Even
+	 * if this cpu isn't allowed; there's nowhere to go until
+	 * there's something else to run here.)
+	 */
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -622,10 +1575,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		thread_make_runnable(cur, true /*have lock*/, false);
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		cur->t_wchan_moved = false;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -644,8 +1598,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	}
 	cur->t_state = newstate;
 
+	/* Whatever was running is in the kernel by now. */
+	thread_charge(false);
+
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -664,14 +1622,47 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal(&sawwork);
+			if (next == NULL) {
+				clock_idle(sawwork);
+				cpu_idle();
+				/* Interrupts while idle leave these. */
+				softint_run(false);
+				idled = true;
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (idled) {
+		clock_unidle();
+	}
+
+	/* Have the next thread push this one away if it may not stay. */
+	if (newstate == S_READY && next != cur &&
+	    !thread_allowed(cur, curcpu->c_self)) {
+		KASSERT(curcpu->c_migrant == NULL);
+		curcpu->c_migrant = cur;
+	}
+
+	if (next != cur) {
+		pcpu_counter_inc(&sched_switches);
+		if (newstate == S_SLEEP) {
+			cur->t_usage.u_nvcsw++;
+		}
+		else if (newstate == S_READY) {
+			cur->t_usage.u_nivcsw++;
+		}
+	}
+	/* Time spent idle goes to nobody. */
+	next->t_usagestamp = idled ? clock_now() : cur->t_usagestamp;
+	curcpu->c_needresched = false;
+	if (next->t_waketime != 0) {
+		thread_latency(next);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -683,6 +1674,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	KEVENT(KEV_SWITCH, next, newstate, 0, 0);
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -737,6 +1730,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Move the previous thread off this cpu if it must go. */
+	thread_migrate();
+
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -770,6 +1766,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Move the previous thread off this cpu if it must go. */
+	thread_migrate();
+
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -807,11 +1806,7 @@ thread_exit(void)
 
 	KASSERT(cur->t_did_reserve_buffers == false);
 	//thread join child
-	lock_acquire(cur->t_lock);	//acquire the child lock
-	cur->complete = true;
-	cv_signal(cur->t_cv, cur->t_lock);
-	lock_release(cur->t_lock);
-	//end thread join child
+	complete(&cur->t_done);
 	/*
 	 * Detach from our process. You might need to move this action
 	 * around, depending on how your wait/exit works.
@@ -834,149 +1829,240 @@ thread_exit(void)
  * Yield the cpu to another process, but stay runnable.
  */
 void
-thread_yield(void)
+thread_yield(void)
+{
+	thread_switch(S_READY, NULL, NULL);
+}
+
+/*
+ * Preemption; see thread.h. c_needresched is only a hint here, read
+ * without the lock: at worst we yield for nothing, or the next safe
+ * point or hardclock catches what we missed.
+ */
+void
+thread_preempt_point(void)
 {
-	thread_switch(S_READY, NULL, NULL);
+	struct thread *cur = curthread;
+
+	if (!curcpu->c_needresched || cur->t_in_interrupt ||
+	    cur->t_curspl != 0 || cur->t_rcu_nest > 0 ||
+	    curcpu->c_spinlocks > 0) {
+		return;
+	}
+	pcpu_counter_inc(&sched_preempts);
+	thread_yield();
 }
 
-////////////////////////////////////////////////////////////
+void
+thread_preempt_irq(void)
+{
+	KASSERT(curthread->t_in_interrupt);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	if (!curcpu->c_needresched || curcpu->c_isidle ||
+	    curthread->t_rcu_nest > 0) {
+		return;
+	}
+	pcpu_counter_inc(&sched_preempts);
+	thread_yield();
+}
 
 /*
- * Scheduler.
- *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Print the interrupt-to-run latency stats. The worst cases are kept
+ * by each cpu for the threads it ran; the average is over all.
  */
+void
+thread_printlatency(void)
+{
+	unsigned i, wakes;
+	struct cpu *c;
+
+	kprintf("cpu  worst (us)\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_getcpu(i);
+		kprintf("%3u %11u\n", c->c_number, c->c_maxlatency / 1000);
+	}
+	wakes = pcpu_counter_read(&sched_irqwakes);
+	kprintf("%u wakeups from interrupts, average %u us\n", wakes,
+		wakes == 0 ? 0 : pcpu_counter_read(&sched_irqwake_us) / wakes);
+}
 
 void
-schedule(void)
+thread_resetlatency(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	unsigned i;
+
+	for (i=0; i<cpu_count(); i++) {
+		cpu_getcpu(i)->c_maxlatency = 0;
+	}
+	pcpu_counter_reset(&sched_irqwakes);
+	pcpu_counter_reset(&sched_irqwake_us);
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Set the current thread's cpu affinity; see thread.h.
  */
-void
-thread_consider_migration(void)
+int
+thread_setaffinity(uint32_t mask)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned i, numcpus;
+	bool any;
 
-	my_count = total_count = 0;
+	any = false;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c->c_number < 32 &&
+		    (mask & ((uint32_t)1 << c->c_number)) != 0) {
+			any = true;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (!any) {
+		return EINVAL;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	/* Others read it under our cpu's run queue lock. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	curthread->t_affinity = mask;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	if (!thread_allowed(curthread, curcpu->c_self)) {
+		thread_yield();
+	}
+	return 0;
+}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+uint32_t
+thread_getaffinity(void)
+{
+	return curthread->t_affinity;
+}
+
+/*
+ * A stamp of 0 means the clock wasn't running yet, or the thread has
+ * never run; there's nothing sensible to charge then.
+ */
+void
+thread_charge(bool user)
+{
+	struct thread *cur = curthread;
+	uint64_t now;
+
+	now = clock_now();
+	if (cur->t_usagestamp != 0) {
+		if (user) {
+			cur->t_usage.u_utime += now - cur->t_usagestamp;
+		}
+		else {
+			cur->t_usage.u_stime += now - cur->t_usagestamp;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	cur->t_usagestamp = now;
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
+void
+usage_add(struct usage *to, const struct usage *from)
+{
+	to->u_utime += from->u_utime;
+	to->u_stime += from->u_stime;
+	to->u_minflt += from->u_minflt;
+	to->u_majflt += from->u_majflt;
+	to->u_inblock += from->u_inblock;
+	to->u_oublock += from->u_oublock;
+	to->u_nvcsw += from->u_nvcsw;
+	to->u_nivcsw += from->u_nivcsw;
+}
+
+/*
+ * Account for a hardclock. A thread that uses up its quantum drops a
+ * level and yields; one that hasn't yet is preempted only by a
+ * higher-priority thread, e.g. one that just woke up. Threads at the
+ * bottom level still round-robin each quantum.
+ *
+ * Only this CPU changes the priority of the thread it's running, so
+ * that needs no lock.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool yield = false;
+
+	/* Don't charge a thread for time the CPU spent idle. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	/* Unless we interrupted an RCU reader, this is quiescent. */
+	if (cur->t_rcu_nest == 0) {
+		rcu_quiescent();
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_prio)) {
+		if (cur->t_prio < SCHED_NLEVELS - 1) {
+			cur->t_prio++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		if (curcpu->c_runqueue_bits &
+		    (((uint32_t)1 << thread_runqueue(cur)) - 1)) {
+			yield = true;
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	/* Don't preempt an RCU reader; it'll be quick. */
+	if (yield && cur->t_rcu_nest == 0) {
+		thread_yield();
+	}
+	else if (yield) {
+		/* ...but have it yield when it leaves. */
+		curcpu->c_needresched = true;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler.
+ *
+ * This is called periodically from hardclock(). It moves every thread
+ * on the current CPU's run queues, and the current thread, back to the
+ * top level of its nice band with a fresh quantum, so threads that
+ * used up their quanta at the lower levels can't be starved by a
+ * stream of interactive ones, and threads whose behavior changed get
+ * reassessed. Nice values changed since a thread was queued take
+ * effect here too.
+ */
+
+void
+schedule(void)
+{
+	struct threadlist all;
+	struct thread *t;
+
+	threadlist_init(&all);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	/* Drain in priority order, then requeue, keeping FIFO order. */
+	while ((t = runqueue_remhead(curcpu->c_self)) != NULL) {
+		threadlist_addtail(&all, t);
+	}
+	while ((t = threadlist_remhead(&all)) != NULL) {
+		t->t_prio = 0;
+		t->t_ticks = 0;
+		runqueue_add(curcpu->c_self, t);
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&all);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1002,10 +2088,28 @@ wchan_create(const char *name)
 	if (wc == NULL) {
 		return NULL;
 	}
+	wchan_init(wc, name);
+
+	return wc;
+}
+
+/*
+ * Set up a wait channel embedded in something else.
+ */
+void
+wchan_init(struct wchan *wc, const char *name)
+{
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+}
 
-	return wc;
+/*
+ * Clean up an embedded wait channel. Must be empty and unlocked.
+ */
+void
+wchan_cleanup(struct wchan *wc)
+{
+	threadlist_cleanup(&wc->wc_threads);
 }
 
 /*
@@ -1015,7 +2119,7 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
+	wchan_cleanup(wc);
 	kfree(wc);
 }
 
@@ -1038,8 +2142,88 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	/* must not hold other spinlocks */
 	KASSERT(curcpu->c_spinlocks == 1);
 
+	KEVENT_NAME(KEV_SLEEP, wc, wc->wc_name);
+	thread_switch(S_SLEEP, wc, lk);
+	spinlock_acquire(lk);
+}
+
+/*
+ * State for wchan_sleep_timeout, shared with its timeout.
+ */
+struct wchan_timedsleep {
+	struct timeout ws_timeout;
+	struct wchan *ws_wc;
+	struct spinlock *ws_lk;
+	struct thread *ws_thread;
+	bool ws_timedout;		/* we took the thread off WC */
+	volatile bool ws_done;		/* the timeout is finished with us */
+};
+
+/*
+ * Timeout for wchan_sleep_timeout, in interrupt context. If the
+ * sleeper is still on the channel, take it off and wake it. (If it
+ * isn't, someone has already woken it.) The sleeper can't leave
+ * wchan_sleep_timeout until we set ws_done, as it holds the timeout
+ * on its stack; after that we mustn't touch WS.
+ */
+static
+void
+wchan_timedsleep_expire(void *data)
+{
+	struct wchan_timedsleep *ws = data;
+	struct spinlock *lk = ws->ws_lk;
+	struct thread *t;
+
+	spinlock_acquire(lk);
+	THREADLIST_FORALL(t, ws->ws_wc->wc_threads) {
+		if (t == ws->ws_thread) {
+			break;
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&ws->ws_wc->wc_threads, t);
+		ws->ws_timedout = true;
+		thread_make_runnable(t, false, false);
+	}
+	ws->ws_done = true;
+	spinlock_release(lk);
+}
+
+/*
+ * Sleep on WC as with wchan_sleep, for at most NSECS nanoseconds.
+ * The timeout is armed while we hold LK, and LK is what thread_switch
+ * holds while putting us on the channel, so the timeout always finds
+ * us either still asleep there or already woken.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk, uint64_t nsecs)
+{
+	struct wchan_timedsleep ws;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	ws.ws_wc = wc;
+	ws.ws_lk = lk;
+	ws.ws_thread = curthread;
+	ws.ws_timedout = false;
+	ws.ws_done = false;
+	timeout_init(&ws.ws_timeout, wchan_timedsleep_expire, &ws);
+	timeout_set(&ws.ws_timeout, nsecs);
+
+	KEVENT_NAME(KEV_SLEEP, wc, wc->wc_name);
 	thread_switch(S_SLEEP, wc, lk);
 	spinlock_acquire(lk);
+
+	if (!timeout_cancel(&ws.ws_timeout)) {
+		/* It fired, or is firing; wait until it lets go of WS. */
+		while (!ws.ws_done) {
+			spinlock_release(lk);
+			spinlock_acquire(lk);
+		}
+	}
+	return ws.ws_timedout ? ETIMEDOUT : 0;
 }
 
 /*
@@ -1068,7 +2252,26 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_make_runnable(target, false, false);
+}
+
+/*
+ * Wake up one thread and hand off to it; see wchan.h.
+ */
+bool
+wchan_wakeone_handoff(struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	target = threadlist_remhead(&wc->wc_threads);
+	if (target == NULL) {
+		return false;
+	}
+
+	/* As in wchan_wakeone; we only try-lock this cpu's run queue. */
+	return thread_make_runnable(target, false, true);
 }
 
 /*
@@ -1079,6 +2282,8 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
 	struct threadlist list;
+	struct cpu *c;
+	unsigned notify;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
@@ -1093,17 +2298,72 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make them runnable a cpu at a time: each cpu's run queue
+	 * lock is taken once, and the cpu is told once, with at most
+	 * one IPI, however many threads it gets.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		c = target->t_cpu;
+		notify = 0;
+		spinlock_acquire(&c->c_runqueue_lock);
+		while (target != NULL) {
+			thread_wake_prepare(target);
+			notify |= thread_enqueue(target, c, false);
+
+			/* Next one for the same cpu, if any. */
+			THREADLIST_FORALL(target, list) {
+				if (target->t_cpu == c) {
+					threadlist_remove(&list, target);
+					break;
+				}
+			}
+		}
+		thread_notify(c, notify);
+		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move one thread, or all of them, from one wait channel to another
+ * without waking them; see wchan.h. A timed sleeper moved stops
+ * being timed, as its timeout only looks on the channel it slept on;
+ * it was as good as woken, just not yet able to run.
+ */
+unsigned
+wchan_transfer(struct wchan *from, struct spinlock *fromlk,
+	       struct wchan *to, struct spinlock *tolk, bool all)
+{
+	struct thread *target;
+	unsigned moved = 0;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		target->t_wchan_moved = true;
+		threadlist_addtail(&to->wc_threads, target);
+		moved++;
+		if (!all) {
+			break;
+		}
+	}
+	return moved;
+}
+
+/*
+ * True if the current thread's last wchan_sleep was ended by a wakeup
+ * on the channel it was transferred to, rather than the one it slept
+ * on.
+ */
+bool
+wchan_wasmoved(void)
+{
+	return curthread->t_wchan_moved;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1126,17 +2386,40 @@ wchan_isempty(struct wchan *wc, struct spinlock *lk)
  */
 
 /*
- * Send an IPI (inter-processor interrupt) to the specified CPU.
+ * Send an IPI (inter-processor interrupt) to the specified CPU. If
+ * the mailbox already had something in it, the interrupt for that is
+ * still to be taken and will pick this up too.
  */
 void
 ipi_send(struct cpu *target, int code)
 {
 	KASSERT(code >= 0 && code < 32);
 
-	spinlock_acquire(&target->c_ipi_lock);
-	target->c_ipi_pending |= (uint32_t)1 << code;
-	mainbus_send_ipi(target);
-	spinlock_release(&target->c_ipi_lock);
+	/* Whatever the IPI is about must be visible first. */
+	membar_any_store();
+	if (spinlock_data_fetchor(&target->c_ipi_pending,
+				  (uint32_t)1 << code) == 0) {
+		mainbus_send_ipi(target);
+	}
+}
+
+/*
+ * Return the number of CPUs.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Return CPU number NUM.
+ */
+struct cpu *
+cpu_getcpu(unsigned num)
+{
+	KASSERT(num < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, num);
 }
 
 /*
@@ -1158,40 +2441,146 @@ ipi_broadcast(int code)
 
 /*
  * Send a TLB shootdown IPI to the specified CPU.
+ *
+ * If the queue is full, or the target is already going to flush
+ * everything, fall back to a whole-TLB flush instead of queueing.
  */
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	unsigned n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	spinlock_acquire(&target->c_shootdown_lock);
 
+	target->c_shootdown_seq++;
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	if (n >= TLBSHOOTDOWN_MAX) {
+		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	ipi_send(target, IPI_TLBSHOOTDOWN);
+
+	spinlock_release(&target->c_shootdown_lock);
+}
+
+/*
+ * Send a whole-TLB shootdown IPI to the specified CPU.
+ */
+void
+ipi_tlbshootdown_all(struct cpu *target)
+{
+	spinlock_acquire(&target->c_shootdown_lock);
+	target->c_shootdown_seq++;
+	target->c_numshootdown = TLBSHOOTDOWN_ALL;
+	ipi_send(target, IPI_TLBSHOOTDOWN);
+	spinlock_release(&target->c_shootdown_lock);
+}
+
+/*
+ * Wait until TARGET has processed every shootdown sent to it so far.
+ *
+ * This spins, because the target handles shootdowns in its interrupt
+ * handler and so should get to them quickly. It must be called with
+ * interrupts on and no spinlocks held, or two cpus shooting each
+ * other down could wait for each other forever.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target)
+{
+	unsigned want;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	/* Our own requests were counted under the lock, so they show. */
+	want = target->c_shootdown_seq;
+	while ((int)(target->c_shootdown_done - want) < 0) {
+		membar_load_load();
+	}
+}
+
+/*
+ * Queue a function call for TARGET; see cpu.h. Pushing onto the list
+ * needs no lock, as the handler only ever takes the whole list.
+ */
+void
+ipi_call(struct cpu *target, struct ipi_call *ic,
+	 void (*func)(void *), void *arg)
+{
+	spinlock_data_t head;
+	int spl;
+
+	ic->ic_func = func;
+	ic->ic_arg = arg;
+	ic->ic_done = false;
+
+	if (target == curcpu->c_self) {
+		spl = splhigh();
+		func(arg);
+		splx(spl);
+		ic->ic_done = true;
+		return;
+	}
+
+	do {
+		head = spinlock_data_get(&target->c_ipi_calls);
+		ic->ic_next = (struct ipi_call *)(uintptr_t)head;
+		membar_store_store();
+	} while (!spinlock_data_cas(&target->c_ipi_calls, head,
+				    (spinlock_data_t)(uintptr_t)ic));
+	ipi_send(target, IPI_CALL);
+}
+
+/*
+ * Wait until IC has been called.
+ */
+void
+ipi_call_wait(struct ipi_call *ic)
+{
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	while (!ic->ic_done) {
+		membar_load_load();
+	}
+}
+
+/*
+ * Make the function calls queued for this cpu, oldest first.
+ */
+static
+void
+ipi_docalls(void)
+{
+	struct ipi_call *ic, *next, *list;
+
+	/* Take the list, which is newest first, and turn it around. */
+	ic = (struct ipi_call *)(uintptr_t)
+		spinlock_data_swap(&curcpu->c_ipi_calls, 0);
+	membar_load_load();
+	list = NULL;
+	while (ic != NULL) {
+		next = ic->ic_next;
+		ic->ic_next = list;
+		list = ic;
+		ic = next;
+	}
 
-	spinlock_release(&target->c_ipi_lock);
+	for (ic = list; ic != NULL; ic = next) {
+		/* Once ic_done is set the caller may reuse IC. */
+		next = ic->ic_next;
+		ic->ic_func(ic->ic_arg);
+		membar_store_store();
+		ic->ic_done = true;
+	}
 }
 
 /*
- * Handle an incoming interprocessor interrupt.
+ * Handle an incoming interprocessor interrupt. The platform clears
+ * the interrupt before calling this, so anything sent after the
+ * mailbox is emptied raises it again.
  */
 void
 interprocessor_interrupt(void)
@@ -1199,17 +2588,15 @@ interprocessor_interrupt(void)
 	uint32_t bits;
 	unsigned i;
 
-	spinlock_acquire(&curcpu->c_ipi_lock);
-	bits = curcpu->c_ipi_pending;
+	bits = spinlock_data_swap(&curcpu->c_ipi_pending, 0);
+	membar_load_load();
 
 	if (bits & (1U << IPI_PANIC)) {
 		/* panic on another cpu - just stop dead */
-		spinlock_release(&curcpu->c_ipi_lock);
 		cpu_halt();
 	}
 	if (bits & (1U << IPI_OFFLINE)) {
 		/* offline request */
-		spinlock_release(&curcpu->c_ipi_lock);
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		if (!curcpu->c_isidle) {
 			kprintf("cpu%d: offline: warning: not idle\n",
@@ -1225,18 +2612,27 @@ interprocessor_interrupt(void)
 		 * interrupt; don't need to do anything else.
 		 */
 	}
-	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+	if (bits & (1U << IPI_RESCHED)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * c_needresched is already set; the trap code calls
+		 * thread_preempt_irq on the way out.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+	}
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		spinlock_acquire(&curcpu->c_shootdown_lock);
+		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
+		spinlock_release(&curcpu->c_shootdown_lock);
+	}
+	if (bits & (1U << IPI_CALL)) {
+		ipi_docalls();
 	}
-
-	curcpu->c_ipi_pending = 0;
-	spinlock_release(&curcpu->c_ipi_lock);
 }
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Work queues. See workqueue.h.
+ *
+ * Each per-worker queue is a singly linked list with a tail pointer
+ * under a spinlock, so items can be queued from interrupt handlers;
+ * the worker sleeps on a wait channel when its list is empty. Whether
+ * an item is queued is a test-and-set word in the item itself, since
+ * an item isn't tied to one queue and two cpus may race to queue it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <wchan.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <workqueue.h>
+
+struct wqworker {
+	struct workqueue *ww_wq;	/* queue we belong to */
+	unsigned ww_cpu;		/* cpu number to run on */
+	struct spinlock ww_lock;	/* protects the rest */
+	struct wchan *ww_wchan;		/* worker sleeps here */
+	struct work *ww_head;		/* items waiting */
+	struct work **ww_tailp;		/* where to link the next one */
+	bool ww_exit;			/* set by workqueue_destroy */
+};
+
+struct workqueue {
+	unsigned wq_flags;
+	unsigned wq_nworkers;		/* fixed at creation */
+	struct wqworker *wq_workers;
+	struct semaphore *wq_exitsem;	/* upped by each exiting worker */
+	struct lock *wq_flushlock;	/* one workqueue_flush at a time */
+	struct semaphore *wq_flushsem;	/* upped by flush barriers */
+};
+
+struct workqueue *system_workqueue;
+
+void
+work_init(struct work *w, void (*func)(void *, unsigned long),
+	  void *data1, unsigned long data2)
+{
+	w->w_func = func;
+	w->w_data1 = data1;
+	w->w_data2 = data2;
+	w->w_next = NULL;
+	spinlock_data_set(&w->w_queued, 0);
+}
+
+/*
+ * Worker thread. Takes the whole list at once and runs it without
+ * the lock. Each item is marked no longer queued just before it
+ * runs, after we're done with its link and arguments, so it can be
+ * requeued from then on.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long data2)
+{
+	struct wqworker *ww = data1;
+	struct work *batch, *w;
+	void (*func)(void *, unsigned long);
+	void *arg1;
+	unsigned long arg2;
+
+	(void)data2;
+
+	if ((ww->ww_wq->wq_flags & WQ_ORDERED) == 0 && ww->ww_cpu < 32) {
+		/* Can only fail if the cpu doesn't exist. */
+		(void)thread_setaffinity((uint32_t)1 << ww->ww_cpu);
+	}
+
+	spinlock_acquire(&ww->ww_lock);
+	while (1) {
+		while (ww->ww_head == NULL && !ww->ww_exit) {
+			wchan_sleep(ww->ww_wchan, &ww->ww_lock);
+		}
+		if (ww->ww_head == NULL) {
+			/* Exiting, and drained. */
+			break;
+		}
+		batch = ww->ww_head;
+		ww->ww_head = NULL;
+		ww->ww_tailp = &ww->ww_head;
+		spinlock_release(&ww->ww_lock);
+
+		while (batch != NULL) {
+			w = batch;
+			batch = w->w_next;
+			func = w->w_func;
+			arg1 = w->w_data1;
+			arg2 = w->w_data2;
+			membar_any_store();
+			spinlock_data_set(&w->w_queued, 0);
+			func(arg1, arg2);
+		}
+
+		spinlock_acquire(&ww->ww_lock);
+	}
+	spinlock_release(&ww->ww_lock);
+
+	V(ww->ww_wq->wq_exitsem);
+}
+
+/*
+ * Stop the first NUM workers, letting them drain their lists, and
+ * free the queue.
+ */
+static
+void
+workqueue_teardown(struct workqueue *wq, unsigned num)
+{
+	struct wqworker *ww;
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		ww = &wq->wq_workers[i];
+		spinlock_acquire(&ww->ww_lock);
+		ww->ww_exit = true;
+		wchan_wakeall(ww->ww_wchan, &ww->ww_lock);
+		spinlock_release(&ww->ww_lock);
+	}
+	for (i=0; i<num; i++) {
+		P(wq->wq_exitsem);
+	}
+
+	for (i=0; i<wq->wq_nworkers; i++) {
+		ww = &wq->wq_workers[i];
+		KASSERT(ww->ww_head == NULL);
+		if (ww->ww_wchan != NULL) {
+			wchan_destroy(ww->ww_wchan);
+		}
+		spinlock_cleanup(&ww->ww_lock);
+	}
+	sem_destroy(wq->wq_flushsem);
+	lock_destroy(wq->wq_flushlock);
+	sem_destroy(wq->wq_exitsem);
+	kfree(wq->wq_workers);
+	kfree(wq);
+}
+
+struct workqueue *
+workqueue_create(const char *name, unsigned flags)
+{
+	struct workqueue *wq;
+	struct wqworker *ww;
+	char namebuf[32];
+	unsigned i;
+	int result;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_flags = flags;
+	wq->wq_exitsem = NULL;
+	wq->wq_flushlock = NULL;
+	wq->wq_flushsem = NULL;
+	wq->wq_nworkers = (flags & WQ_ORDERED) ? 1 : cpu_count();
+	wq->wq_workers = kmalloc(wq->wq_nworkers * sizeof(*ww));
+	if (wq->wq_workers == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_exitsem = sem_create(name, 0);
+	if (wq->wq_exitsem == NULL) {
+		goto fail;
+	}
+	wq->wq_flushlock = lock_create(name);
+	if (wq->wq_flushlock == NULL) {
+		goto fail;
+	}
+	wq->wq_flushsem = sem_create(name, 0);
+	if (wq->wq_flushsem == NULL) {
+		goto fail;
+	}
+
+	for (i=0; i<wq->wq_nworkers; i++) {
+		ww = &wq->wq_workers[i];
+		ww->ww_wq = wq;
+		ww->ww_cpu = i;
+		spinlock_init(&ww->ww_lock);
+		ww->ww_wchan = wchan_create(name);
+		ww->ww_head = NULL;
+		ww->ww_tailp = &ww->ww_head;
+		ww->ww_exit = false;
+	}
+	for (i=0; i<wq->wq_nworkers; i++) {
+		if (wq->wq_workers[i].ww_wchan == NULL) {
+			workqueue_teardown(wq, 0);
+			return NULL;
+		}
+	}
+
+	for (i=0; i<wq->wq_nworkers; i++) {
+		if (flags & WQ_ORDERED) {
+			snprintf(namebuf, sizeof(namebuf), "%s", name);
+		}
+		else {
+			snprintf(namebuf, sizeof(namebuf), "%s/%u", name, i);
+		}
+		result = thread_fork(namebuf, kproc, workqueue_worker,
+				     &wq->wq_workers[i], 0);
+		if (result) {
+			workqueue_teardown(wq, i);
+			return NULL;
+		}
+	}
+	return wq;
+
+ fail:
+	if (wq->wq_flushlock != NULL) {
+		lock_destroy(wq->wq_flushlock);
+	}
+	if (wq->wq_exitsem != NULL) {
+		sem_destroy(wq->wq_exitsem);
+	}
+	kfree(wq->wq_workers);
+	kfree(wq);
+	return NULL;
+}
+
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	workqueue_teardown(wq, wq->wq_nworkers);
+}
+
+bool
+workqueue_enqueue(struct workqueue *wq, struct work *w)
+{
+	struct wqworker *ww;
+
+	if (spinlock_data_testandset(&w->w_queued) != 0) {
+		return false;
+	}
+
+	/*
+	 * Queue it for this cpu's worker. If we're preempted and
+	 * moved first, it just runs on the old cpu's worker.
+	 */
+	ww = &wq->wq_workers[curcpu->c_number % wq->wq_nworkers];
+
+	spinlock_acquire(&ww->ww_lock);
+	KASSERT(!ww->ww_exit);
+	w->w_next = NULL;
+	*ww->ww_tailp = w;
+	ww->ww_tailp = &w->w_next;
+	wchan_wakeone(ww->ww_wchan, &ww->ww_lock);
+	spinlock_release(&ww->ww_lock);
+	return true;
+}
+
+/*
+ * Barrier item for workqueue_flush.
+ */
+static
+void
+workqueue_flushfunc(void *data1, unsigned long data2)
+{
+	struct semaphore *sem = data1;
+
+	(void)data2;
+	V(sem);
+}
+
+/*
+ * Put a barrier at the end of each worker's list in turn and wait for
+ * it to run. A worker runs its list in order, so when its barrier has
+ * run, so has everything queued on it before. One flush at a time,
+ * so each waits for its own barriers' Vs.
+ */
+void
+workqueue_flush(struct workqueue *wq)
+{
+	struct work barrier;
+	struct wqworker *ww;
+	unsigned i;
+
+	KASSERT(curthread->t_in_interrupt == false);
+
+	lock_acquire(wq->wq_flushlock);
+	for (i=0; i<wq->wq_nworkers; i++) {
+		work_init(&barrier, workqueue_flushfunc, wq->wq_flushsem, 0);
+		spinlock_data_set(&barrier.w_queued, 1);
+		ww = &wq->wq_workers[i];
+		spinlock_acquire(&ww->ww_lock);
+		*ww->ww_tailp = &barrier;
+		ww->ww_tailp = &barrier.w_next;
+		wchan_wakeone(ww->ww_wchan, &ww->ww_lock);
+		spinlock_release(&ww->ww_lock);
+		P(wq->wq_flushsem);
+	}
+	lock_release(wq->wq_flushlock);
+}
+
+void
+workqueue_bootstrap(void)
+{
+	system_workqueue = workqueue_create("events", 0);
+	if (system_workqueue == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+}
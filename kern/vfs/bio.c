@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block I/O request submission. See bio.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <device.h>
+#include <bio.h>
+
+/*
+ * How long to wait for a request before complaining. (nanoseconds)
+ * There's no way to take a request back from a driver, so after
+ * complaining we keep waiting.
+ */
+#define BIO_WATCHDOG	10000000000ULL
+
+/*
+ * Fill in a request.
+ */
+void
+bio_init(struct bio *bio, off_t offset, void *data, size_t len,
+	 enum uio_rw rw, void (*done)(struct bio *), void *arg)
+{
+	bio->bio_offset = offset;
+	bio->bio_data = data;
+	bio->bio_len = len;
+	bio->bio_rw = rw;
+	bio->bio_done = done;
+	bio->bio_arg = arg;
+	bio->bio_result = 0;
+	bio->bio_next = NULL;
+	bio->bio_chain = NULL;
+}
+
+/*
+ * Start a request. Devices that can queue requests take it directly;
+ * for others, do it now through devop_io and complete it before
+ * returning.
+ */
+void
+bio_submit(struct device *dev, struct bio *bio)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(bio->bio_done != NULL);
+
+	if (dev->d_ops->devop_strategy != NULL) {
+		DEVOP_STRATEGY(dev, bio);
+		return;
+	}
+
+	uio_kinit(&iov, &ku, bio->bio_data, bio->bio_len, bio->bio_offset,
+		  bio->bio_rw);
+	bio->bio_result = DEVOP_IO(dev, &ku);
+	bio->bio_done(bio);
+}
+
+/*
+ * A request bio_uio waits for.
+ */
+struct biosync {
+	struct bio bs_bio;
+	struct completion bs_done;
+};
+
+/*
+ * Completion routine for bio_uio's requests.
+ */
+static
+void
+bio_syncdone(struct bio *bio)
+{
+	struct biosync *bs = bio->bio_arg;
+
+	complete(&bs->bs_done);
+}
+
+/*
+ * Start a request to be waited for with bio_syncwait.
+ */
+static
+void
+bio_syncstart(struct device *dev, struct biosync *bs, off_t offset,
+	      void *data, size_t len, enum uio_rw rw)
+{
+	completion_init(&bs->bs_done, "bio");
+	bio_init(&bs->bs_bio, offset, data, len, rw, bio_syncdone, bs);
+	bio_submit(dev, &bs->bs_bio);
+}
+
+/*
+ * Wait for a request started with bio_syncstart.
+ */
+static
+int
+bio_syncwait(struct biosync *bs)
+{
+	int result;
+
+	result = wait_for_completion_timeout(&bs->bs_done, BIO_WATCHDOG);
+	if (result == ETIMEDOUT) {
+		kprintf("bio: %s of %zu bytes at %lld not done "
+			"after %llu seconds; still waiting\n",
+			bs->bs_bio.bio_rw == UIO_READ ? "read" : "write",
+			bs->bs_bio.bio_len,
+			(long long)bs->bs_bio.bio_offset,
+			BIO_WATCHDOG / 1000000000ULL);
+		wait_for_completion(&bs->bs_done);
+	}
+	completion_cleanup(&bs->bs_done);
+	return bs->bs_bio.bio_result;
+}
+
+/*
+ * Bounce the rest of a uio through two kernel buffers of CHUNK bytes,
+ * so the device works on one while uiomove fills or empties the
+ * other: a write copies in chunk N+1 while chunk N is being written,
+ * a read copies out chunk N while chunk N+1 is being read.
+ */
+static
+int
+bio_bounce(struct device *dev, struct uio *uio, char *bufs[2], size_t chunk)
+{
+	struct biosync bs[2];
+	off_t pos = uio->uio_offset;
+	size_t len[2];
+	unsigned cur;
+	bool busy;
+	int result, result2;
+
+	busy = false;
+	cur = 0;
+	result = 0;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		while (uio->uio_resid > 0) {
+			len[cur] = chunk < uio->uio_resid ?
+				chunk : uio->uio_resid;
+			result = uiomove(bufs[cur], len[cur], uio);
+			if (busy) {
+				result2 = bio_syncwait(&bs[!cur]);
+				busy = false;
+				if (result2) {
+					return result2;
+				}
+			}
+			if (result) {
+				return result;
+			}
+			bio_syncstart(dev, &bs[cur], pos, bufs[cur], len[cur],
+				      UIO_WRITE);
+			busy = true;
+			pos += len[cur];
+			cur = !cur;
+		}
+		return busy ? bio_syncwait(&bs[!cur]) : 0;
+	}
+
+	/* Read the first chunk, then keep one ahead of the copying. */
+	len[cur] = chunk < uio->uio_resid ? chunk : uio->uio_resid;
+	bio_syncstart(dev, &bs[cur], pos, bufs[cur], len[cur], UIO_READ);
+	pos += len[cur];
+	while (1) {
+		result = bio_syncwait(&bs[cur]);
+		if (result) {
+			return result;
+		}
+		if (uio->uio_resid > len[cur]) {
+			len[!cur] = uio->uio_resid - len[cur];
+			if (len[!cur] > chunk) {
+				len[!cur] = chunk;
+			}
+			bio_syncstart(dev, &bs[!cur], pos, bufs[!cur],
+				      len[!cur], UIO_READ);
+			pos += len[!cur];
+			busy = true;
+		}
+		result = uiomove(bufs[cur], len[cur], uio);
+		if (!busy) {
+			return result;
+		}
+		if (result) {
+			bio_syncwait(&bs[!cur]);
+			return result;
+		}
+		busy = false;
+		cur = !cur;
+	}
+}
+
+/*
+ * Do a uio as block requests and wait for them, for devices whose
+ * devop_io is built on devop_strategy. A kernel buffer is transferred
+ * directly, in one request per iovec; anything else is bounced,
+ * BIO_BOUNCESECTS sectors at a time if the bounce buffers can be had
+ * and one sector at a time through the stack if not.
+ */
+int
+bio_uio(struct device *dev, struct uio *uio, size_t sectsize)
+{
+	char stackbufs[2][BIO_MAXSECTSIZE];
+	struct biosync bs;
+	struct iovec *iov;
+	char *bufs[2];
+	char *heap;
+	size_t len, chunk;
+	int result;
+
+	KASSERT(sectsize > 0 && sectsize <= BIO_MAXSECTSIZE);
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (uio->uio_offset % sectsize != 0 ||
+	    uio->uio_resid % sectsize != 0) {
+		return EINVAL;
+	}
+
+	while (uio->uio_resid > 0 && uio->uio_segflg == UIO_SYSSPACE) {
+		iov = uio->uio_iov;
+		len = iov->iov_len;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if (len == 0) {
+			KASSERT(uio->uio_iovcnt > 1);
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		if (len % sectsize != 0) {
+			break;
+		}
+		bio_syncstart(dev, &bs, uio->uio_offset, iov->iov_kbase, len,
+			      uio->uio_rw);
+		result = bio_syncwait(&bs);
+		if (result) {
+			return result;
+		}
+		/* Advance the uio as uiomove would */
+		iov->iov_kbase = (char *)iov->iov_kbase + len;
+		iov->iov_len -= len;
+		uio->uio_offset += len;
+		uio->uio_resid -= len;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	chunk = BIO_BOUNCESECTS * sectsize;
+	if (chunk > uio->uio_resid) {
+		chunk = uio->uio_resid;
+	}
+	heap = chunk > sectsize ? kmalloc(2 * chunk) : NULL;
+	if (heap != NULL) {
+		bufs[0] = heap;
+		bufs[1] = heap + chunk;
+	}
+	else {
+		bufs[0] = stackbufs[0];
+		bufs[1] = stackbufs[1];
+		chunk = sectsize;
+	}
+
+	result = bio_bounce(dev, uio, bufs, chunk);
+
+	if (heap != NULL) {
+		kfree(heap);
+	}
+	return result;
+}
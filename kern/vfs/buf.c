@@ -34,25 +34,38 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <fs.h>
+#include <bio.h>
 #include <buf.h>
+#include <kevent.h>
+#include <pcpu.h>
+#include <reclaim.h>
+#include <kstat.h>
 
 /* Uncomment this to enable printouts of the syncer state. */
 //#define SYNCER_VERBOSE
 
-DECLARRAY(buf, static __UNUSED inline);
-DEFARRAY(buf, static __UNUSED inline);
+DECLARRAY(buf, static __UNUSED inline __FORCEINLINE);
+DEFARRAY(buf, static __UNUSED inline __FORCEINLINE);
 
 /*
- * The required size for all buffers. This is the size SFS uses. In a
- * real system you wouldn't have this restriction, but for us managing
- * buffers of different sizes just creates complications and would
- * serve no purpose.
+ * Buffer sizes. A buffer can be any multiple of BUFFER_MINSIZE (the
+ * smallest SFS block size; see SFS_BLOCKSIZE) up to BUFFER_MAXSIZE;
+ * larger buffers cover several consecutive blocks and are keyed by
+ * the first one.
+ * Memory for buffer data is accounted in bytes, and reservations and
+ * the limit on buffer headers are counted in BUFFER_MINSIZE units.
  */
-#define ONE_TRUE_BUFFER_SIZE		512
+#define BUFFER_MINSIZE		512
+#define BUFFER_MAXSIZE		8192
+#define BUFFER_UNITS(sz)	((sz) / BUFFER_MINSIZE)
+#define VALID_BUFFER_SIZE(sz) \
+	((sz) >= BUFFER_MINSIZE && (sz) <= BUFFER_MAXSIZE && \
+	 (sz) % BUFFER_MINSIZE == 0)
 
 /*
  * Illegal array index.
@@ -79,20 +92,32 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 struct buf {
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {de,at}tached_buffers */
+	unsigned b_tableindex;	/* index into detached_buffers */
+	struct buflist *b_list;	/* which LRU list we're on, if attached */
+	struct buf *b_lruprev;	/* previous (less recently used) on b_list */
+	struct buf *b_lrunext;	/* next (more recently used) on b_list */
+	unsigned b_lrustamp;	/* lru_clock when last used */
+	unsigned b_queue;	/* which replacement queue (BQ_*) */
 	unsigned b_dirtyindex;	/* index into dirty_buffers */
 	unsigned b_bucketindex;	/* index into buffer_hash bucket */
 	unsigned b_dirtyepoch;	/* when we became dirty */
+	unsigned b_statslot;	/* index into bufstats[] */
 
 	/* status flags */
 	unsigned b_attached:1;	/* key fields are valid */
-	unsigned b_busy:1;	/* currently in use */
 	unsigned b_valid:1;	/* contains real data */
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
-	struct thread *b_holder; /* who did buffer_mark_busy() */
 	struct timespec b_timestamp; /* when it became dirty */
 
+	/* protected by the stripe lock (see struct bufstripe) */
+	bool b_busy;		/* currently in use */
+	bool b_fasthold;	/* busy via the fast path, still on idle list */
+	bool b_referenced;	/* hit via the fast path since last queued */
+	unsigned b_waiters;	/* how many sleep on b_busycv */
+	struct thread *b_holder; /* who did buffer_mark_busy() */
+	struct cv *b_busycv;	/* for waiting until not busy */
+
 	/* key */
 	struct fs *b_fs;	/* file system buffer belongs to */
 	daddr_t b_physblock;	/* physical block number */
@@ -102,23 +127,178 @@ struct buf {
 	size_t b_size;
 
 	void *b_fsdata;		/* fs-specific metadata */
+	uint64_t b_walsn;	/* log must be on disk through this, or 0 */
+};
+
+/*
+ * Intrusive LRU list of attached buffers, least recently used first.
+ */
+struct buflist {
+	struct buf *bl_head;
+	struct buf *bl_tail;
+	unsigned bl_count;
+};
+
+/*
+ * One of the 2Q replacement queues: its idle buffers, in LRU order.
+ */
+struct bufqueue {
+	const char *bq_name;
+	struct buflist bq_clean;	/* idle clean buffers */
+	struct buflist bq_dirty;	/* idle dirty buffers */
+	unsigned bq_count;		/* attached buffers, including busy */
+	unsigned bq_hits;		/* gets that found a buffer here */
+};
+
+#define BQ_A1IN		0	/* referenced once: FIFO */
+#define BQ_AM		1	/* referenced again: LRU */
+#define NUMQUEUES	2
+
+/*
+ * Remembered key of a buffer recently evicted from BQ_A1IN.
+ */
+struct bufghost {
+	struct fs *g_fs;		/* NULL if slot unused */
+	daddr_t g_physblock;
+	struct bufghost *g_hashnext;
 };
 
 /*
  * Buffer hash table.
+ *
+ * The number of buckets is a power of two, and the table doubles when
+ * the load factor passes BUFHASH_MAXLOAD. Resizing is incremental:
+ * the old table is kept and a couple of its buckets are moved to the
+ * new one on each insert, so no one operation has to rehash
+ * everything. Old buckets numbered bh_migrated and up haven't been
+ * moved yet and are still used for their keys.
  */
 struct bufhash {
+	unsigned bh_bits;		/* log2 of bh_numbuckets */
 	unsigned bh_numbuckets;
 	struct bufarray *bh_buckets;
+	unsigned bh_count;		/* buffers in the table */
+
+	/* while resizing: the old table, or NULL */
+	unsigned bh_oldbits;
+	unsigned bh_oldnumbuckets;
+	struct bufarray *bh_oldbuckets;
+	unsigned bh_migrated;		/* old buckets moved so far */
+};
+
+/*
+ * Statistics kept per file system, for tuning.
+ *
+ * Each fs that attaches buffers gets a slot in bufstats[] until it
+ * calls drop_fs_buffers; slot 0 is shared by any that don't fit.
+ * Latencies are recorded in log2 buckets of microseconds: bucket K
+ * counts operations that took from 2^K up to 2^(K+1) us (bucket 0
+ * also takes those under 1us), and the last bucket takes everything
+ * longer. Hits through the fast path are counted in the stripes.
+ *
+ * Everything here is protected by buffer_lock.
+ */
+#define BUFSTATS_MAXFS		8	/* slots, including slot 0 */
+#define BUFSTATS_NBUCKETS	24	/* last one is 8s and up */
+
+struct bufstats {
+	struct fs *st_fs;		/* NULL if slot unused (but 0) */
+	unsigned st_hits;		/* slow path gets that found it */
+	unsigned st_misses;		/* gets that had to attach one */
+	unsigned st_reads;		/* reads from disk */
+	unsigned st_writes;		/* writes to disk */
+	unsigned st_readtime[BUFSTATS_NBUCKETS];
+	unsigned st_writetime[BUFSTATS_NBUCKETS];
+	unsigned st_busywaits;		/* buffer_mark_busy had to wait */
+	unsigned st_busywait_ms;	/* ...for this long in total */
+};
+
+/*
+ * Share of the cache an fs may be held to, by bufstats[] slot, as
+ * set with buffer_set_fs_share: while it has less than its minimum,
+ * eviction takes other file systems' buffers first, and once it has
+ * its maximum it has to make room from its own. Shares are percents
+ * of max_total_buffers; 0 means none. Slot 0 never has a share, as
+ * it's shared by whatever file systems don't fit.
+ *
+ * The other slots count their attached buffers (in BUFFER_MINSIZE
+ * units) whether or not they have a share, so one can be set at any
+ * time. Protected by buffer_lock.
+ */
+struct bufshare {
+	unsigned sh_units;		/* attached buffer space */
+	unsigned sh_minpct;		/* guaranteed share */
+	unsigned sh_maxpct;		/* share it may not go over */
+};
+
+/*
+ * Lock stripe for the buffer hash.
+ *
+ * Buckets (and the buffers in them) are divided among a fixed number
+ * of stripes by the top bits of the hash value, each with its own
+ * lock, so a buffer_get that hits an idle buffer can mark it busy
+ * holding only the stripe lock and without touching buffer_lock; the
+ * matching buffer_release is likewise done under just the stripe
+ * lock. Such a buffer stays on its idle list (with b_fasthold set)
+ * rather than moving to busy_buffers, as the lists belong to
+ * buffer_lock; anything that takes buffer_lock and wants to change
+ * the buffer's state or list moves it to busy_buffers first, which
+ * sends its release down the slow path. The buffer gets b_referenced
+ * on release instead of moving to the end of its list; eviction
+ * gives referenced BQ_AM buffers another trip through the list when
+ * it finds them at the head.
+ *
+ * The stripe lock protects the bucket contents and each buffer's
+ * b_busy, b_fasthold, b_referenced, b_waiters and b_holder, and the
+ * list a buffer is on whenever it's not busy. Changing a bucket or
+ * any of those fields requires the stripe lock even when buffer_lock
+ * is held; reading the buckets just requires either one. The lock
+ * order is buffer_lock, then stripe lock; only bufhash_lockall ever
+ * holds more than one stripe lock at once.
+ *
+ * These are sleep locks, not spinlocks, because adding to a bucket
+ * can allocate.
+ */
+struct bufstripe {
+	struct lock *bs_lock;
+	unsigned bs_fshits[BUFSTATS_MAXFS]; /* fast path gets by slot */
 };
 
+/* Fast path gets, in total and by queue; per-cpu, as they're hot. */
+static struct pcpu_counter buffer_fastgets =
+	PCPU_COUNTER_INITIALIZER("buf.fastgets");
+static struct pcpu_counter buffer_fasthits[NUMQUEUES] = {
+	[BQ_A1IN] = PCPU_COUNTER_INITIALIZER("buf.fasthits.A1in"),
+	[BQ_AM] = PCPU_COUNTER_INITIALIZER("buf.fasthits.Am"),
+};
+
+/* Number of stripes (log2); see also BUFHASH_INITBITS. */
+#define BUFHASH_STRIPEBITS	5
+#define BUFHASH_NSTRIPES	(1U << BUFHASH_STRIPEBITS)
+
 /*
  * Global state.
  *
- * The main table of buffers is attached_buffers[]. This is an
- * LRU-ordered array. All buffers in attached_buffers[] should be
- * attached (that is, they are associated with a specific fs and
- * block), and should also be in buffer_hash.
+ * Buffers that are attached (that is, associated with a specific fs
+ * and block) are in buffer_hash and belong to one of the replacement
+ * queues in bufqueues[]; this is a "2Q" scheme. A buffer starts out
+ * in BQ_A1IN, which is FIFO ordered; if it gets evicted from there
+ * its key is remembered in the ghost ring (A1out), and if it's asked
+ * for again while remembered it's brought back into BQ_AM, which is
+ * LRU ordered. BQ_A1IN is kept to a fixed fraction of the cache and
+ * evicted from first, so a single sequential scan washes through it
+ * without pushing out the working set in BQ_AM.
+ *
+ * Each attached buffer is on exactly one list: its queue's idle
+ * clean or idle dirty list if it's not busy, or busy_buffers if it
+ * is, except that buffers gotten through the fast path stay on their
+ * idle list (see struct bufstripe). Eviction takes the head of an
+ * idle list, so it never has to step over busy (including fsmanaged)
+ * buffers other than those, which it moves out of the way as it
+ * finds them. Each buffer's
+ * b_lrustamp records lru_clock as of when it was last used (for
+ * BQ_A1IN, when it was attached), so the relative age of buffers on
+ * different lists can still be compared.
  *
  * Buffers that are dirty *also* appear in dirty_buffers[]; this array
  * is ordered by how recently the buffer was *first* modified.
@@ -126,19 +306,31 @@ struct bufhash {
  * Buffers that are not attached appear (only) in detached_buffers[],
  * which is not ordered.
  *
- * Space in all three arrays is preallocated when buffers are created
- * so insert ops won't fail on the fly.
+ * Space in both arrays is preallocated when buffers are created so
+ * insert ops won't fail on the fly.
  *
- * The ordered arrays (attached_buffers and dirty_buffers) are
- * preallocated with extra space (and may contain NULL entries) and
- * are compacted only when the extra space runs out.
+ * The ordered array (dirty_buffers) is preallocated with extra space
+ * (and may contain NULL entries) and is compacted only when the extra
+ * space runs out.
  */
 
 static struct bufhash buffer_hash;
+static struct bufstripe bufstripes[BUFHASH_NSTRIPES];
 
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;   /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
+static struct bufqueue bufqueues[NUMQUEUES];
+static struct buflist busy_buffers;
+static unsigned lru_clock;
+
+/*
+ * The ghost ring is a fixed array of keys overwritten in FIFO order,
+ * with a hash table on top so misses can look them up.
+ */
+static struct bufghost *ghosts;
+static unsigned ghost_max;		/* size of ghosts[] */
+static unsigned ghost_next;		/* next slot to overwrite */
+static unsigned ghost_count;		/* slots in use */
+static struct bufghost **ghost_buckets;
+static unsigned ghost_bucketbits;
 
 static struct bufarray dirty_buffers;
 static unsigned dirty_buffers_first;      /* hint for first empty element */
@@ -153,32 +345,91 @@ static struct bufarray detached_buffers;
  * made, and is used to know when to stop syncing. The
  * dirty_buffers_generation, conversely, is incremented whenever the
  * dirty_buffers table is compacted so syncs in progress know they
- * need to restart from the beginning of it. The attached_buffers
- * generation is the same, but for the attached_buffers table.
+ * need to restart from the beginning of it.
  */
 
 static unsigned dirty_epoch;
 static unsigned dirty_buffers_generation;
-static unsigned attached_buffers_generation;
 
 /*
  * Counters.
  */
 
 static unsigned attached_buffers_count;
-static unsigned busy_buffers_count;
 static unsigned dirty_buffers_count;
+static size_t dirty_buffers_bytes;
 
-static unsigned num_reserved_buffers;
+static unsigned num_reserved_buffers;	/* in BUFFER_MINSIZE units */
 static unsigned num_total_buffers;
-static unsigned max_total_buffers;
+static unsigned max_total_buffers;	/* in BUFFER_MINSIZE units */
+static size_t num_total_bytes;		/* data space of all buffers */
+static size_t max_buffer_mem;
+static unsigned ceil_total_buffers;	/* in BUFFER_MINSIZE units */
+static size_t ceil_buffer_mem;		/* borrowing included */
+static unsigned num_reclaimed_buffers;
 
 static unsigned num_total_gets;
 static unsigned num_valid_gets;
+static unsigned num_ghost_gets;
 static unsigned num_read_gets;
 static unsigned num_total_writeouts;
 static unsigned num_total_evictions;
 static unsigned num_dirty_evictions;
+static unsigned num_share_evictions;
+static unsigned num_prefetch_requests;
+static unsigned num_prefetch_dropped;
+static unsigned num_prefetch_reads;
+static unsigned num_cluster_writes;
+static unsigned num_clustered_buffers;
+static unsigned num_throttles;
+static unsigned num_reserve_stalls;
+static unsigned reserve_stall_ms;
+
+static struct bufstats bufstats[BUFSTATS_MAXFS];
+static struct bufshare bufshares[BUFSTATS_MAXFS];
+static unsigned bufshares_active;	/* slots with a share */
+
+/*
+ * Read-ahead requests waiting for the prefetch thread, in a ring.
+ */
+struct prefetchreq {
+	struct fs *pr_fs;
+	daddr_t pr_physblock;
+	size_t pr_size;
+};
+
+#define PREFETCH_QUEUE_MAX	64
+
+static struct prefetchreq prefetch_queue[PREFETCH_QUEUE_MAX];
+static unsigned prefetch_head;		/* next request to do */
+static unsigned prefetch_count;		/* requests waiting */
+static struct fs *prefetch_busyfs;	/* fs of a synchronous read */
+
+/*
+ * Reads the prefetch thread has in flight. The completion routine
+ * (which may run in an interrupt handler) just puts the read on
+ * prefetch_done and ups prefetch_sem; the thread finishes it. The
+ * semaphore is also upped for each new request, so it's what the
+ * thread waits on. The thread holds one buffer reservation, of
+ * prefetch_units, for all of them.
+ */
+struct prefetchio {
+	struct bio pi_bio;
+	struct buf *pi_buf;		/* NULL if the slot is free */
+	struct timespec pi_start;
+	struct prefetchio *pi_next;	/* on prefetch_done */
+};
+
+#define PREFETCH_INFLIGHT_MAX	8
+
+static struct prefetchio prefetch_io[PREFETCH_INFLIGHT_MAX];
+static unsigned prefetch_inflight;	/* slots in use */
+static size_t prefetch_ressize;		/* size reserved with, or 0 */
+static unsigned prefetch_units;		/* units reserved */
+static unsigned prefetch_usedunits;	/* units in flight */
+static struct spinlock prefetch_donelock;
+static struct prefetchio *prefetch_done; /* under prefetch_donelock */
+static struct semaphore *prefetch_sem;
 
 /*
  * Syncer state. (This is file-static so it's easily visible from the
@@ -186,8 +437,21 @@ static unsigned num_dirty_evictions;
  */
 static bool syncer_under_load;
 static bool syncer_needs_help;
+static bool syncer_idle;		/* waiting on syncer_cv */
 static struct thread *syncer_thread;
 
+/*
+ * Syncer pacing (see syncer_pace). Rates are in KB per second.
+ */
+static size_t syncer_inflow;		/* bytes dirtied since last pace */
+static size_t syncer_wbytes;		/* bytes written, not yet sampled */
+static unsigned syncer_wusecs;		/* ...and microseconds it took */
+static struct timespec syncer_lastpace;
+static unsigned syncer_inrate;		/* dirtying rate */
+static unsigned syncer_bw;		/* achieved write bandwidth */
+static size_t syncer_budget;		/* LRU bytes to write this pass */
+static bool syncer_throttle;		/* writers should wait a pass */
+
 /*
  * Lock
  */
@@ -195,10 +459,12 @@ static struct thread *syncer_thread;
 static struct lock *buffer_lock;
 
 /*
- * CVs
+ * CVs (each buffer also has its own, b_busycv)
  */
-static struct cv *buffer_busy_cv;
 static struct cv *buffer_reserve_cv;
+static struct cv *buffer_prefetch_cv;
+static struct cv *buffer_throttle_cv;
+static struct cv *syncer_cv;
 
 /*
  * Magic numbers (also search the code for "voodoo:")
@@ -209,24 +475,65 @@ static struct cv *buffer_reserve_cv;
  * factor buffer reservation calls into some of these decisions somehow.
  */
 
+/* Initial size of buffer_hash (log2 of the number of buckets). */
+#define BUFHASH_INITBITS	6
+#if BUFHASH_INITBITS < BUFHASH_STRIPEBITS
+#error "Every hash stripe must have at least one bucket"
+#endif
+
+/* Average chain length at which buffer_hash is doubled. */
+#define BUFHASH_MAXLOAD		2
+
+/* Old buckets moved into the new table on each insert while resizing. */
+#define BUFHASH_MIGRATE		2
+
+/* Most dirty buffers sorted and written together by one sync batch. */
+#define SYNC_BATCH		64
+
+/* Largest single write for a run of adjacent buffers (bytes). */
+#define SYNC_CLUSTER_MAX	(32 * BUFFER_MINSIZE)
+
+/* Most buffers buffer_flush_run writes together. */
+#define FLUSH_RUN_MAX		16
+
 /* Number of buffers to reserve for each file system operation. */
 #define RESERVE_BUFFERS		8
 
-/* Factor for choosing attached_buffers_thresh. */
-#define ATTACHED_THRESH_NUM	3
-#define ATTACHED_THRESH_DENOM	2
+/* Idle buffers per list eviction looks through for one to take by share. */
+#define BUFSHARE_SCAN		32
+
+/* Proportion of buffers the 2Q A1in queue may hold before we evict from it. */
+#define TWOQ_KIN_NUM		1
+#define TWOQ_KIN_DENOM		4
+
+/* Number of evicted A1in keys to remember, as a proportion of buffers. */
+#define TWOQ_KOUT_NUM		1
+#define TWOQ_KOUT_DENOM		2
 
 /* Factor for choosing dirty_buffers_thresh. */
 #define DIRTY_THRESH_NUM	5
 #define DIRTY_THRESH_DENOM	4
 
-/* Proportion of buffers we want to keep always clean. */
-#define SYNCER_ALWAYS_NUM	1
-#define SYNCER_ALWAYS_DENOM	5
+/* Proportion of buffer memory the syncer tries to keep dirty, at most. */
+#define SYNCER_DIRTY_TARGET_NUM		1
+#define SYNCER_DIRTY_TARGET_DENOM	5
+
+/* Proportion of buffer memory dirty past which writers are throttled. */
+#define SYNCER_DIRTY_LIMIT_NUM		2
+#define SYNCER_DIRTY_LIMIT_DENOM	5
 
-/* Proportion of buffers we want clean if older than one second. */
-#define SYNCER_IFOLD_NUM	2
-#define SYNCER_IFOLD_DENOM	5
+/* Weight of each new sample in the syncer's rate estimates. */
+#define SYNCER_EWMA_NUM		1
+#define SYNCER_EWMA_DENOM	4
+
+/* Initial guess at write bandwidth, before measuring any. (KB/s) */
+#define SYNCER_INITIAL_BW	256
+
+/* Least write time to measure bandwidth over. (microseconds) */
+#define SYNCER_MIN_SAMPLE	10000
+
+/* Longest the syncer sleeps between passes. (nanoseconds) */
+#define SYNCER_INTERVAL		1000000000ULL
 
 /* Age at which a buffer should be synced unconditionally. (seconds) */
 #define SYNCER_TARGET_AGE	2
@@ -237,23 +544,17 @@ static struct cv *buffer_reserve_cv;
 /* Buffer age at which the syncer considers itself in trouble. (seconds) */
 #define SYNCER_HELP_AGE		8
 
-#if 0
-/* Threshold proportion (of bufs dirty) for starting the syncer */
-#define SYNCER_DIRTY_NUM	1
-#define SYNCER_DIRTY_DENOM	2
-
-/* Target proportion (of total bufs) for syncer to clean in one run */
-#define SYNCER_TARGET_NUM	1
-#define SYNCER_TARGET_DENOM	4
-
-/* Limit on the previous proportion, as proportion of dirty buffers */
-#define SYNCER_LIMIT_NUM	1
-#define SYNCER_LIMIT_DENOM	2
-#endif
-
-/* Overall limit on fraction of main memory to use for buffers */
+/*
+ * Fraction of main memory the buffer cache can always use, and the
+ * fraction it can grow to while memory is otherwise free. The part
+ * above the first is given back through the reclaim hooks when memory
+ * runs short; everything sized from the cache's size (reservations,
+ * syncer limits, 2Q shares) goes by the first.
+ */
 #define BUFFER_MAXMEM_NUM	1
 #define BUFFER_MAXMEM_DENOM	4
+#define BUFFER_CEILMEM_NUM	3
+#define BUFFER_CEILMEM_DENOM	4
 
 /* Macro for applying a NUM/DENOM pair. */
 #define SCALE(x, K) (((x) * K##_NUM) / K##_DENOM)
@@ -273,9 +574,17 @@ static
 void
 bufcheck(void)
 {
-	KASSERT(attached_buffers_count <= bufarray_num(&attached_buffers));
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
+	unsigned i, idle, queued;
+
+	idle = queued = 0;
+	for (i=0; i<NUMQUEUES; i++) {
+		idle += bufqueues[i].bq_clean.bl_count;
+		idle += bufqueues[i].bq_dirty.bl_count;
+		queued += bufqueues[i].bq_count;
+	}
+	KASSERT(attached_buffers_count == idle + busy_buffers.bl_count);
+	KASSERT(attached_buffers_count == queued);
+	KASSERT(ghost_count <= ghost_max);
 
 	KASSERT(dirty_buffers_count <= bufarray_num(&dirty_buffers));
 	KASSERT(dirty_buffers_first <= bufarray_num(&dirty_buffers));
@@ -283,11 +592,9 @@ bufcheck(void)
 
 	KASSERT(bufarray_num(&detached_buffers) + attached_buffers_count
 		== num_total_buffers);
-	// This is not true any more, because busy_buffers_count now
-	// includes buffers marked busy by syncing.
-	//KASSERT(busy_buffers_count <= num_reserved_buffers);
 	KASSERT(num_reserved_buffers <= max_total_buffers);
-	KASSERT(num_total_buffers <= max_total_buffers);
+	KASSERT(num_total_buffers <= ceil_total_buffers);
+	KASSERT(num_total_bytes <= ceil_buffer_mem);
 }
 
 ////////////////////////////////////////////////////////////
@@ -376,34 +683,135 @@ buf_fixup_dirtyindex(struct buf *b, unsigned oldix, unsigned newix)
 	b->b_dirtyindex = newix;
 }
 
+////////////////////////////////////////////////////////////
+// bufhash
+
+/*
+ * Hash function. This is Fibonacci hashing: multiply by 2^32 over
+ * the golden ratio and use the top bits, which depend on all the bits
+ * of the key. The fs pointer is mixed in first with a different odd
+ * constant so the same block number on two volumes doesn't collide.
+ */
+static
+uint32_t
+buffer_hashfunc(struct fs *fs, daddr_t physblock)
+{
+	uint32_t val;
+
+	val = (uint32_t)(uintptr_t)fs * 0x85ebca6bU;
+	val ^= (uint32_t)physblock;
+	return val * 0x9e3779b1U;
+}
+
+/*
+ * Bucket number for a hash value in a table of 2^BITS buckets.
+ */
+static
+unsigned
+buffer_hashbucket(uint32_t hash, unsigned bits)
+{
+	KASSERT(bits > 0 && bits < 32);
+	return hash >> (32 - bits);
+}
+
+/*
+ * Lock stripe for a hash value, or for a table bucket. Because the
+ * stripe is the top bits of the hash, each bucket belongs to exactly
+ * one stripe in both the old and new tables during a resize.
+ */
+static
+struct bufstripe *
+bufhash_stripe(uint32_t hash)
+{
+	return &bufstripes[buffer_hashbucket(hash, BUFHASH_STRIPEBITS)];
+}
+
+static
+struct bufstripe *
+bufhash_bucketstripe(unsigned bn, unsigned bits)
+{
+	KASSERT(bits >= BUFHASH_STRIPEBITS);
+	return &bufstripes[bn >> (bits - BUFHASH_STRIPEBITS)];
+}
+
+/*
+ * Stripe lock for an attached buffer. The key can only change under
+ * buffer_lock or by the buffer's holder, so the caller needs to be
+ * one of those.
+ */
+static
+struct lock *
+buffer_stripelock(struct buf *b)
+{
+	return bufhash_stripe(buffer_hashfunc(b->b_fs,
+					      b->b_physblock))->bs_lock;
+}
+
+/*
+ * Take (or drop) every stripe lock, for changing the table as a
+ * whole.
+ */
 static
 void
-buf_fixup_tableindex(struct buf *b, unsigned oldix, unsigned newix)
+bufhash_lockall(void)
 {
-	KASSERT(b->b_tableindex == oldix);
-	b->b_tableindex = newix;
+	unsigned i;
+
+	for (i=0; i<BUFHASH_NSTRIPES; i++) {
+		lock_acquire(bufstripes[i].bs_lock);
+	}
 }
 
-////////////////////////////////////////////////////////////
-// bufhash
+static
+void
+bufhash_unlockall(void)
+{
+	unsigned i;
+
+	for (i=BUFHASH_NSTRIPES; i-- > 0; ) {
+		lock_release(bufstripes[i].bs_lock);
+	}
+}
+
+/*
+ * Allocate and initialize an array of 2^BITS buckets.
+ */
+static
+struct bufarray *
+bufhash_makebuckets(unsigned bits)
+{
+	struct bufarray *buckets;
+	unsigned i, num;
+
+	num = 1U << bits;
+	buckets = kmalloc(num * sizeof(*buckets));
+	if (buckets == NULL) {
+		return NULL;
+	}
+	for (i=0; i<num; i++) {
+		bufarray_init(&buckets[i]);
+	}
+	return buckets;
+}
 
 /*
  * Set up a bufhash.
  */
 static
 int
-bufhash_init(struct bufhash *bh, unsigned numbuckets)
+bufhash_init(struct bufhash *bh, unsigned bits)
 {
-	unsigned i;
-
-	bh->bh_buckets = kmalloc(numbuckets*sizeof(*bh->bh_buckets));
+	bh->bh_buckets = bufhash_makebuckets(bits);
 	if (bh->bh_buckets == NULL) {
 		return ENOMEM;
 	}
-	for (i=0; i<numbuckets; i++) {
-		bufarray_init(&bh->bh_buckets[i]);
-	}
-	bh->bh_numbuckets = numbuckets;
+	bh->bh_bits = bits;
+	bh->bh_numbuckets = 1U << bits;
+	bh->bh_count = 0;
+	bh->bh_oldbits = 0;
+	bh->bh_oldnumbuckets = 0;
+	bh->bh_oldbuckets = NULL;
+	bh->bh_migrated = 0;
 	return 0;
 }
 
@@ -420,73 +828,194 @@ bufhash_cleanup(struct bufhash *bh)
 #endif /* 0 -- not used */
 
 /*
- * Hash function.
+ * Find the bucket a key lives in, allowing for a resize in progress.
  */
 static
-unsigned
-buffer_hashfunc(struct fs *fs, daddr_t physblock)
+struct bufarray *
+bufhash_bucket(struct bufhash *bh, uint32_t hash)
+{
+	unsigned bn;
+
+	if (bh->bh_oldbuckets != NULL) {
+		bn = buffer_hashbucket(hash, bh->bh_oldbits);
+		if (bn >= bh->bh_migrated) {
+			return &bh->bh_oldbuckets[bn];
+		}
+	}
+	return &bh->bh_buckets[buffer_hashbucket(hash, bh->bh_bits)];
+}
+
+/*
+ * Start doubling the table. If we can't get the memory, just carry on
+ * with the current size; we'll try again on a later insert.
+ */
+static
+void
+bufhash_grow(struct bufhash *bh)
+{
+	struct bufarray *newbuckets;
+
+	KASSERT(bh->bh_oldbuckets == NULL);
+
+	if (bh->bh_bits + 1 >= 32) {
+		return;
+	}
+	newbuckets = bufhash_makebuckets(bh->bh_bits + 1);
+	if (newbuckets == NULL) {
+		return;
+	}
+	bufhash_lockall();
+	bh->bh_oldbits = bh->bh_bits;
+	bh->bh_oldnumbuckets = bh->bh_numbuckets;
+	bh->bh_oldbuckets = bh->bh_buckets;
+	bh->bh_migrated = 0;
+	bh->bh_bits++;
+	bh->bh_numbuckets *= 2;
+	bh->bh_buckets = newbuckets;
+	bufhash_unlockall();
+}
+
+/*
+ * Move up to COUNT old buckets into the new table.
+ *
+ * Because the table doubles, old bucket N splits exactly into new
+ * buckets 2N and 2N+1, which are empty until N is moved; preallocate
+ * those first so the moves themselves can't fail. If that fails, stop
+ * and try again next time. Both halves are in the same stripe as the
+ * old bucket, so only that stripe needs to be locked for the move.
+ */
+static
+void
+bufhash_migrate(struct bufhash *bh, unsigned count)
 {
-	unsigned val = 0;
+	struct bufarray *old, *new;
+	struct bufstripe *bs;
+	struct buf *b;
+	unsigned bn, i, num;
+	int result;
+
+	while (count-- > 0 && bh->bh_oldbuckets != NULL) {
+		bn = bh->bh_migrated;
+		old = &bh->bh_oldbuckets[bn];
+		num = bufarray_num(old);
+		bs = bufhash_bucketstripe(bn, bh->bh_oldbits);
+
+		KASSERT(bufarray_num(&bh->bh_buckets[2*bn]) == 0);
+		KASSERT(bufarray_num(&bh->bh_buckets[2*bn+1]) == 0);
+		if (bufarray_preallocate(&bh->bh_buckets[2*bn], num) ||
+		    bufarray_preallocate(&bh->bh_buckets[2*bn+1], num)) {
+			return;
+		}
 
-	/* there is nothing particularly special or good about this */
-	val = 0xfeeb1e;
-	val ^= ((uintptr_t)fs) >> 6;
-	val ^= physblock;
-	return val;
+		lock_acquire(bs->bs_lock);
+		for (i=0; i<num; i++) {
+			b = bufarray_get(old, i);
+			KASSERT(b->b_bucketindex == i);
+			new = &bh->bh_buckets[buffer_hashbucket(
+				buffer_hashfunc(b->b_fs, b->b_physblock),
+				bh->bh_bits)];
+			KASSERT(new == &bh->bh_buckets[2*bn] ||
+				new == &bh->bh_buckets[2*bn+1]);
+			result = bufarray_add(new, b, &b->b_bucketindex);
+			/* preallocated, should not fail */
+			KASSERT(result == 0);
+		}
+		result = bufarray_setsize(old, 0);
+		/* shrinking, should not fail */
+		KASSERT(result == 0);
+		bh->bh_migrated++;
+		lock_release(bs->bs_lock);
+
+		if (bh->bh_migrated == bh->bh_oldnumbuckets) {
+			/* done; throw away the old table */
+			bufhash_lockall();
+			for (i=0; i<bh->bh_oldnumbuckets; i++) {
+				bufarray_cleanup(&bh->bh_oldbuckets[i]);
+			}
+			kfree(bh->bh_oldbuckets);
+			bh->bh_oldbuckets = NULL;
+			bh->bh_oldbits = 0;
+			bh->bh_oldnumbuckets = 0;
+			bh->bh_migrated = 0;
+			bufhash_unlockall();
+		}
+	}
 }
 
 /*
- * Add a buffer to a bufhash.
+ * Add a buffer to a bufhash. Takes the stripe lock(s) itself; the
+ * caller should hold buffer_lock and no stripe lock.
  */
 static
 int
 bufhash_add(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	struct bufstripe *bs;
+	struct bufarray *bucket;
+	uint32_t hash;
+	int result;
 
 	KASSERT(b->b_bucketindex == INVALID_INDEX);
 
+	if (bh->bh_oldbuckets != NULL) {
+		bufhash_migrate(bh, BUFHASH_MIGRATE);
+	}
+	else if (bh->bh_count >= bh->bh_numbuckets * BUFHASH_MAXLOAD) {
+		bufhash_grow(bh);
+	}
+
 	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
-	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
+	bs = bufhash_stripe(hash);
+	lock_acquire(bs->bs_lock);
+	bucket = bufhash_bucket(bh, hash);
+	result = bufarray_add(bucket, b, &b->b_bucketindex);
+	lock_release(bs->bs_lock);
+	if (result) {
+		return result;
+	}
+	bh->bh_count++;
+	return 0;
 }
 
 /*
- * Remove a buffer from a bufhash.
+ * Remove a buffer from a bufhash. The caller holds buffer_lock and
+ * the buffer's stripe lock.
  */
 static
 void
 bufhash_remove(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	struct bufarray *bucket;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	KASSERT(lock_do_i_hold(buffer_stripelock(b)));
+	bucket = bufhash_bucket(bh, buffer_hashfunc(b->b_fs, b->b_physblock));
 
-	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
-	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
-	bufarray_remove_unordered(&bh->bh_buckets[bn], b->b_bucketindex,
+	KASSERT(bufarray_get(bucket, b->b_bucketindex) == b);
+	bufarray_set(bucket, b->b_bucketindex, NULL);
+	bufarray_remove_unordered(bucket, b->b_bucketindex,
 				  buf_fixup_bucketindex);
 	b->b_bucketindex = INVALID_INDEX;
+	KASSERT(bh->bh_count > 0);
+	bh->bh_count--;
 }
 
 /*
- * Find a buffer in a bufhash.
+ * Find a buffer in a bufhash. The caller holds either buffer_lock or
+ * the key's stripe lock.
  */
 static
 struct buf *
 bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 {
-	unsigned hash, bn;
+	struct bufarray *bucket;
 	unsigned num, i;
 	struct buf *b;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bucket = bufhash_bucket(bh, buffer_hashfunc(fs, physblock));
 
-	num = bufarray_num(&bh->bh_buckets[bn]);
+	num = bufarray_num(bucket);
 	for (i=0; i<num; i++) {
-		b = bufarray_get(&bh->bh_buckets[bn], i);
+		b = bufarray_get(bucket, i);
 		KASSERT(b->b_bucketindex == i);
 		if (b->b_fs == fs && b->b_physblock == physblock) {
 			/* found */
@@ -496,6 +1025,104 @@ bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 	return NULL;
 }
 
+////////////////////////////////////////////////////////////
+// ghost ring
+
+/*
+ * Unlink a ghost from its hash chain and mark the slot unused.
+ */
+static
+void
+ghost_remove(struct bufghost *g)
+{
+	struct bufghost **gp;
+	unsigned bn;
+
+	KASSERT(g->g_fs != NULL);
+
+	bn = buffer_hashbucket(buffer_hashfunc(g->g_fs, g->g_physblock),
+			       ghost_bucketbits);
+	for (gp = &ghost_buckets[bn]; *gp != g; gp = &(*gp)->g_hashnext) {
+		KASSERT(*gp != NULL);
+	}
+	*gp = g->g_hashnext;
+	g->g_hashnext = NULL;
+	g->g_fs = NULL;
+	g->g_physblock = 0;
+	ghost_count--;
+}
+
+/*
+ * Remember the key of a buffer being evicted from BQ_A1IN,
+ * forgetting the oldest one remembered if the ring is full.
+ */
+static
+void
+ghost_add(struct fs *fs, daddr_t physblock)
+{
+	struct bufghost *g;
+	unsigned bn;
+
+	if (ghost_max == 0) {
+		return;
+	}
+
+	g = &ghosts[ghost_next];
+	ghost_next = (ghost_next + 1) % ghost_max;
+	if (g->g_fs != NULL) {
+		ghost_remove(g);
+	}
+
+	bn = buffer_hashbucket(buffer_hashfunc(fs, physblock),
+			       ghost_bucketbits);
+	g->g_fs = fs;
+	g->g_physblock = physblock;
+	g->g_hashnext = ghost_buckets[bn];
+	ghost_buckets[bn] = g;
+	ghost_count++;
+}
+
+/*
+ * Check if a key is remembered, and forget it if so.
+ */
+static
+bool
+ghost_take(struct fs *fs, daddr_t physblock)
+{
+	struct bufghost *g;
+	unsigned bn;
+
+	if (ghost_max == 0) {
+		return false;
+	}
+
+	bn = buffer_hashbucket(buffer_hashfunc(fs, physblock),
+			       ghost_bucketbits);
+	for (g = ghost_buckets[bn]; g != NULL; g = g->g_hashnext) {
+		if (g->g_fs == fs && g->g_physblock == physblock) {
+			ghost_remove(g);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Forget all remembered keys for a file system.
+ */
+static
+void
+ghost_drop_fs(struct fs *fs)
+{
+	unsigned i;
+
+	for (i=0; i<ghost_max; i++) {
+		if (ghosts[i].g_fs == fs) {
+			ghost_remove(&ghosts[i]);
+		}
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // buffer tables
 
@@ -508,9 +1135,8 @@ int
 preallocate_buffer_arrays(unsigned newtotal)
 {
 	int result;
-	unsigned newathresh, newdthresh;
+	unsigned newdthresh;
 
-	newathresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
 	newdthresh = (newtotal*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
 
 	result = bufarray_preallocate(&detached_buffers, newtotal);
@@ -518,12 +1144,6 @@ preallocate_buffer_arrays(unsigned newtotal)
 		return result;
 	}
 
-	result = bufarray_preallocate(&attached_buffers, newathresh);
-	if (result) {
-		return result;
-	}
-	attached_buffers_thresh = newathresh;
-
 	result = bufarray_preallocate(&dirty_buffers, newdthresh);
 	if (result) {
 		return result;
@@ -533,21 +1153,6 @@ preallocate_buffer_arrays(unsigned newtotal)
 	return 0;
 }
 
-/*
- * Go through the attached_buffers array and close up gaps.
- */
-static
-void
-compact_attached_buffers(void)
-{
-	bufarray_compact(&attached_buffers, &attached_buffers_first,
-			 buf_fixup_tableindex);
-	KASSERT(attached_buffers_count == bufarray_num(&attached_buffers));
-
-	/* it does not matter if this overflows */
-	attached_buffers_generation++;
-}
-
 /*
  * Go through the dirty_buffers array and close up gaps.
  */
@@ -600,7 +1205,7 @@ buffer_insert_detached(struct buf *b)
 	int result;
 
 	KASSERT(b->b_attached == 0);
-	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_busy == false);
 	KASSERT(b->b_tableindex == INVALID_INDEX);
 
 	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
@@ -609,55 +1214,207 @@ buffer_insert_detached(struct buf *b)
 }
 
 /*
- * Remove a buffer from the attached (LRU) list.
+ * Compare two LRU stamps, allowing for lru_clock wrapping around.
+ */
+static
+bool
+lrustamp_before(unsigned a, unsigned b)
+{
+	return (int)(a - b) < 0;
+}
+
+/*
+ * Take a buffer off whichever LRU list it's on.
  */
 static
 void
-buffer_remove_attached(struct buf *b, unsigned expected_busy)
+buflist_remove(struct buf *b)
 {
-	unsigned ix;
+	struct buflist *bl;
 
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == expected_busy);
+	bl = b->b_list;
+	KASSERT(bl != NULL);
+	KASSERT(bl->bl_count > 0);
 
-	ix = b->b_tableindex;
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(bl->bl_head == b);
+		bl->bl_head = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(bl->bl_tail == b);
+		bl->bl_tail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+	b->b_list = NULL;
+	bl->bl_count--;
+}
 
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+/*
+ * Put a buffer at the head (least recently used end) of a list.
+ */
+static
+void
+buflist_addhead(struct buflist *bl, struct buf *b)
+{
+	KASSERT(b->b_list == NULL);
 
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
-	b->b_tableindex = INVALID_INDEX;
+	b->b_lruprev = NULL;
+	b->b_lrunext = bl->bl_head;
+	if (bl->bl_head != NULL) {
+		bl->bl_head->b_lruprev = b;
+	}
+	else {
+		bl->bl_tail = b;
+	}
+	bl->bl_head = b;
+	b->b_list = bl;
+	bl->bl_count++;
+}
 
-	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
+/*
+ * Put a buffer at the tail (most recently used end) of a list.
+ */
+static
+void
+buflist_addtail(struct buflist *bl, struct buf *b)
+{
+	KASSERT(b->b_list == NULL);
+
+	b->b_lrunext = NULL;
+	b->b_lruprev = bl->bl_tail;
+	if (bl->bl_tail != NULL) {
+		bl->bl_tail->b_lrunext = b;
+	}
+	else {
+		bl->bl_head = b;
 	}
+	bl->bl_tail = b;
+	b->b_list = bl;
+	bl->bl_count++;
+}
 
-	attached_buffers_count--;
+/*
+ * Check that a buffer we meant to look at next is still where we
+ * left it before releasing buffer_lock: on list BL, with stamp STAMP.
+ * Buffers are never freed, so this is safe even if it has since been
+ * detached. NULL (the end of the list) is always still there.
+ */
+static
+bool
+buflist_stillat(struct buf *b, struct buflist *bl, unsigned stamp)
+{
+	return b == NULL || (b->b_list == bl && b->b_lrustamp == stamp);
 }
 
 /*
- * Put a buffer into the attached (LRU) list, always at the end.
+ * Put an attached buffer on the list that matches its state.
+ *
+ * If it has just been used (gotten and released by a client) and is
+ * in BQ_AM it goes at the tail with a fresh stamp. Otherwise (e.g. it
+ * was only marked busy to sync it, or it's in BQ_A1IN, which is FIFO
+ * ordered by when it was attached) it keeps its stamp and goes at
+ * whichever end of the list is closer to it in age. This keeps the
+ * lists close to the intended order without ever having to search
+ * them.
+ *
+ * A busy buffer always goes to busy_buffers, even if it was gotten
+ * through the fast path; then it has to be released the slow way.
+ * The caller holds the buffer's stripe lock unless it's a new buffer
+ * nobody else can find yet.
  */
 static
 void
-buffer_insert_attached(struct buf *b)
+buffer_queue(struct buf *b, bool used)
 {
-	unsigned num;
-	int result;
+	struct bufqueue *q;
+	struct buflist *bl;
 
 	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	if (b->b_busy) {
+		/* busy buffers are not ordered */
+		b->b_fasthold = false;
+		buflist_addtail(&busy_buffers, b);
+		return;
 	}
 
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	KASSERT(b->b_queue < NUMQUEUES);
+	q = &bufqueues[b->b_queue];
+	bl = b->b_dirty ? &q->bq_dirty : &q->bq_clean;
+	if (used && b->b_queue == BQ_AM) {
+		b->b_lrustamp = lru_clock++;
+		buflist_addtail(bl, b);
+	}
+	else if (bl->bl_head != NULL &&
+		 lrustamp_before(b->b_lrustamp, bl->bl_tail->b_lrustamp) &&
+		 (int)(b->b_lrustamp - bl->bl_head->b_lrustamp) <
+		 (int)(bl->bl_tail->b_lrustamp - b->b_lrustamp)) {
+		buflist_addhead(bl, b);
+	}
+	else {
+		buflist_addtail(bl, b);
+	}
+}
+
+/*
+ * Move an attached buffer to the list that matches its (changed)
+ * state. Does nothing for buffers that aren't on a list yet.
+ */
+static
+void
+buffer_requeue(struct buf *b, bool used)
+{
+	struct lock *sl;
+
+	if (b->b_list != NULL) {
+		sl = buffer_stripelock(b);
+		lock_acquire(sl);
+		buflist_remove(b);
+		buffer_queue(b, used);
+		lock_release(sl);
+	}
+}
+
+/*
+ * Remove a buffer from the attached (LRU) lists.
+ */
+static
+void
+buffer_remove_attached(struct buf *b)
+{
+	KASSERT(b->b_attached == 1);
+
+	buflist_remove(b);
+	KASSERT(bufqueues[b->b_queue].bq_count > 0);
+	bufqueues[b->b_queue].bq_count--;
+	attached_buffers_count--;
+	KASSERT(bufshares[b->b_statslot].sh_units >= BUFFER_UNITS(b->b_size));
+	bufshares[b->b_statslot].sh_units -= BUFFER_UNITS(b->b_size);
+}
+
+/*
+ * Put a buffer into the attached (LRU) lists of its queue, always at
+ * the end.
+ */
+static
+void
+buffer_insert_attached(struct buf *b)
+{
+	KASSERT(b->b_attached == 1);
+	KASSERT(b->b_list == NULL);
+	KASSERT(b->b_queue < NUMQUEUES);
+
+	b->b_lrustamp = lru_clock++;
+	buffer_queue(b, false);
+	bufqueues[b->b_queue].bq_count++;
 	attached_buffers_count++;
+	bufshares[b->b_statslot].sh_units += BUFFER_UNITS(b->b_size);
 }
 
 /*
@@ -698,7 +1455,7 @@ buffer_insert_dirty(struct buf *b)
 	int result;
 
 	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == 1);
+	KASSERT(b->b_busy);
 	KASSERT(b->b_dirtyindex == INVALID_INDEX);
 
 	num = bufarray_num(&dirty_buffers);
@@ -715,7 +1472,7 @@ buffer_insert_dirty(struct buf *b)
 // ops on buffers
 
 /*
- * Create a fresh buffer.
+ * Create a fresh buffer. It has no data space yet; see buffer_obtain.
  */
 static
 struct buf *
@@ -733,33 +1490,234 @@ buffer_create(void)
 	if (b == NULL) {
 		return NULL;
 	}
-
-	b->b_data = kmalloc(ONE_TRUE_BUFFER_SIZE);
-	if (b->b_data == NULL) {
+	b->b_busycv = cv_create("bufbusy");
+	if (b->b_busycv == NULL) {
 		kfree(b);
 		return NULL;
 	}
 
+	b->b_data = NULL;
 	b->b_tableindex = INVALID_INDEX;
+	b->b_list = NULL;
+	b->b_lruprev = NULL;
+	b->b_lrunext = NULL;
+	b->b_lrustamp = 0;
+	b->b_queue = BQ_A1IN;
 	b->b_dirtyindex = INVALID_INDEX;
 	b->b_bucketindex = INVALID_INDEX;
 	b->b_dirtyepoch = 0;
 	b->b_attached = 0;
-	b->b_busy = 0;
 	b->b_valid = 0;
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
-	b->b_holder = NULL;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
+	b->b_busy = false;
+	b->b_fasthold = false;
+	b->b_referenced = false;
+	b->b_waiters = 0;
+	b->b_holder = NULL;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	b->b_size = ONE_TRUE_BUFFER_SIZE;
+	b->b_size = 0;
 	b->b_fsdata = NULL;
+	b->b_walsn = 0;
 	num_total_buffers++;
 	return b;
 }
 
+/*
+ * Give back a detached buffer's data space.
+ */
+static
+void
+buffer_freedata(struct buf *b)
+{
+	KASSERT(b->b_attached == 0);
+
+	if (b->b_data != NULL) {
+		KASSERT(num_total_bytes >= b->b_size);
+		num_total_bytes -= b->b_size;
+		kfree(b->b_data);
+		b->b_data = NULL;
+		b->b_size = 0;
+	}
+}
+
+/*
+ * True if SIZE more bytes of buffer data fit: always within
+ * max_buffer_mem, and up to ceil_buffer_mem while memory is plentiful.
+ */
+static
+bool
+buffer_mem_fits(size_t size)
+{
+	if (num_total_bytes + size <= max_buffer_mem) {
+		return true;
+	}
+	return num_total_bytes + size <= ceil_buffer_mem &&
+		reclaim_plenty(DIVROUNDUP(size, PAGE_SIZE));
+}
+
+/*
+ * Get the bufstats[] slot for FS, claiming a free one if it
+ * doesn't have one yet.
+ */
+static
+unsigned
+bufstats_slot(struct fs *fs)
+{
+	unsigned i, avail;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	avail = 0;
+	for (i=1; i<BUFSTATS_MAXFS; i++) {
+		if (bufstats[i].st_fs == fs) {
+			return i;
+		}
+		if (avail == 0 && bufstats[i].st_fs == NULL) {
+			avail = i;
+		}
+	}
+	if (avail != 0) {
+		bufstats[avail].st_fs = fs;
+	}
+	return avail;
+}
+
+/*
+ * Zero the counters in bufstats slot SLOT, including those in the
+ * stripes.
+ */
+static
+void
+bufstats_zero(unsigned slot)
+{
+	struct fs *fs;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	fs = bufstats[slot].st_fs;
+	bzero(&bufstats[slot], sizeof(bufstats[slot]));
+	bufstats[slot].st_fs = fs;
+
+	bufhash_lockall();
+	for (i=0; i<BUFHASH_NSTRIPES; i++) {
+		bufstripes[i].bs_fshits[slot] = 0;
+	}
+	bufhash_unlockall();
+}
+
+/*
+ * Give up FS's bufstats[] slot, as the fs pointer may be reused.
+ */
+static
+void
+bufstats_drop_fs(struct fs *fs)
+{
+	unsigned i;
+
+	for (i=1; i<BUFSTATS_MAXFS; i++) {
+		if (bufstats[i].st_fs == fs) {
+			bufstats[i].st_fs = NULL;
+			bufstats_zero(i);
+			KASSERT(bufshares[i].sh_units == 0);
+			if (bufshares[i].sh_minpct + bufshares[i].sh_maxpct
+			    > 0) {
+				bufshares_active--;
+			}
+			bufshares[i].sh_minpct = 0;
+			bufshares[i].sh_maxpct = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * Give FS a share of the cache: at least MINPCT percent of the
+ * buffer space, which other file systems can't evict once it's
+ * filled, and at most MAXPCT percent (0 for no limit), beyond which
+ * it reuses its own buffers. Zero for both removes the share.
+ */
+int
+buffer_set_fs_share(struct fs *fs, unsigned minpct, unsigned maxpct)
+{
+	struct bufshare *sh;
+	unsigned slot, i, total;
+	bool had;
+
+	if (maxpct > 100 || (maxpct > 0 && minpct > maxpct) ||
+	    minpct > 100) {
+		return EINVAL;
+	}
+
+	lock_acquire(buffer_lock);
+	slot = bufstats_slot(fs);
+	if (slot == 0) {
+		/* No slot to hang it on */
+		lock_release(buffer_lock);
+		return ENOSPC;
+	}
+
+	/* The minimums have to fit together */
+	total = minpct;
+	for (i=1; i<BUFSTATS_MAXFS; i++) {
+		if (i != slot) {
+			total += bufshares[i].sh_minpct;
+		}
+	}
+	if (total > 100) {
+		lock_release(buffer_lock);
+		return ENOSPC;
+	}
+
+	sh = &bufshares[slot];
+	had = sh->sh_minpct + sh->sh_maxpct > 0;
+	sh->sh_minpct = minpct;
+	sh->sh_maxpct = maxpct;
+	if (had && minpct + maxpct == 0) {
+		bufshares_active--;
+	}
+	else if (!had && minpct + maxpct > 0) {
+		bufshares_active++;
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Return the microseconds since BEFORE.
+ */
+static
+unsigned
+bufstats_elapsed(const struct timespec *before)
+{
+	struct timespec now, took;
+
+	gettime(&now);
+	timespec_sub(&now, before, &took);
+	return took.tv_sec * 1000000 + took.tv_nsec / 1000;
+}
+
+/*
+ * Count an operation that took USECS in latency histogram HIST.
+ */
+static
+void
+bufstats_record(unsigned *hist, unsigned usecs)
+{
+	unsigned k;
+
+	k = 0;
+	while (usecs > 1 && k < BUFSTATS_NBUCKETS - 1) {
+		usecs >>= 1;
+		k++;
+	}
+	hist[k]++;
+}
+
 /*
  * Attach a buffer to a given key (fs and block number)
  */
@@ -769,14 +1727,14 @@ buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
 {
 	int result;
 
-	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_busy == false);
 	KASSERT(b->b_attached == 0);
 	KASSERT(b->b_valid == 0);
-	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_fsdata == NULL);
 	b->b_attached = 1;
 	b->b_fs = fs;
 	b->b_physblock = block;
+	b->b_statslot = bufstats_slot(fs);
 
 	result = bufhash_add(&buffer_hash, b);
 	if (result) {
@@ -789,15 +1747,31 @@ buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
 }
 
 /*
- * Detach a buffer from a particular key.
+ * Detach a buffer from a particular key. The caller must have the
+ * buffer marked busy; it comes back not busy, and anyone waiting for
+ * it will find it gone.
  */
 static
 void
 buffer_detach(struct buf *b)
 {
+	struct lock *sl;
+	bool wake;
+
 	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_busy);
+
+	sl = buffer_stripelock(b);
+	lock_acquire(sl);
 	bufhash_remove(&buffer_hash, b);
+	b->b_busy = false;
+	b->b_fasthold = false;
+	b->b_referenced = false;
+	wake = b->b_waiters > 0;
+	b->b_waiters = 0;
+	b->b_holder = NULL;
+	lock_release(sl);
+	b->b_fsmanaged = 0;
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
@@ -807,7 +1781,10 @@ buffer_detach(struct buf *b)
 	b->b_attached = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	if (wake) {
+		/* they all need to go look for it again */
+		cv_broadcast(b->b_busycv, buffer_lock);
+	}
 }
 
 /*
@@ -823,47 +1800,126 @@ static
 int
 buffer_mark_busy(struct buf *b)
 {
+	struct bufstats *st;
+	struct timespec before;
+	struct lock *sl;
 	struct fs *fs;
 	daddr_t block;
+	bool waited;
 
+	KASSERT(lock_do_i_hold(buffer_lock));
 	KASSERT(b->b_holder != curthread);
 	fs = b->b_fs;
 	block = b->b_physblock;
+	if (!b->b_attached) {
+		return EDEADBUF;
+	}
+	st = &bufstats[b->b_statslot];
+	waited = false;
+	sl = buffer_stripelock(b);
+	lock_acquire(sl);
 	while (b->b_busy) {
+		/*
+		 * Tell the holder to release it the slow way, so it
+		 * wakes us up. Each wakeup takes one waiter off the
+		 * count, so if someone else gets the buffer first we
+		 * add ourselves again.
+		 */
+		if (!waited) {
+			waited = true;
+			st->st_busywaits++;
+			gettime(&before);
+		}
+		b->b_waiters++;
+		lock_release(sl);
+		cv_wait(b->b_busycv, buffer_lock);
 		if (!b->b_attached || fs != b->b_fs ||
 		    block != b->b_physblock) {
+			st->st_busywait_ms += bufstats_elapsed(&before) / 1000;
 			return EDEADBUF;
 		}
-		cv_wait(buffer_busy_cv, buffer_lock);
+		lock_acquire(sl);
 	}
-	if (!b->b_attached || fs != b->b_fs || block != b->b_physblock) {
-		return EDEADBUF;
+	if (waited) {
+		st->st_busywait_ms += bufstats_elapsed(&before) / 1000;
 	}
-	b->b_busy = 1;
 	KASSERT(b->b_fsmanaged == 0);
+	b->b_busy = true;
 	b->b_holder = curthread;
-	busy_buffers_count++;
+	if (b->b_list != NULL) {
+		buflist_remove(b);
+		buffer_queue(b, false);
+	}
+	lock_release(sl);
 	return 0;
 }
 
 /*
- * Unmark a buffer busy, awakening waiters.
+ * Mark a buffer busy if it isn't already, without waiting. Returns
+ * true if it worked.
+ */
+static
+bool
+buffer_try_mark_busy(struct buf *b)
+{
+	struct lock *sl;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_attached);
+
+	sl = buffer_stripelock(b);
+	lock_acquire(sl);
+	if (b->b_busy) {
+		lock_release(sl);
+		return false;
+	}
+	KASSERT(b->b_fsmanaged == 0);
+	b->b_busy = true;
+	b->b_holder = curthread;
+	buflist_remove(b);
+	buffer_queue(b, false);
+	lock_release(sl);
+	return true;
+}
+
+/*
+ * Unmark a buffer busy, awakening a waiter if there is one. Only one
+ * is woken, as only one can have the buffer; when it lets go it'll
+ * wake the next.
  */
 static
 void
 buffer_unmark_busy(struct buf *b)
 {
-	KASSERT(b->b_busy != 0);
-	b->b_busy = 0;
+	struct lock *sl;
+	bool wake;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+
 	if (b->b_fsmanaged) {
 		b->b_fsmanaged = false;
 	}
 	else {
 		KASSERT(b->b_holder == curthread);
 	}
+
+	sl = buffer_stripelock(b);
+	lock_acquire(sl);
+	b->b_busy = false;
 	b->b_holder = NULL;
-	busy_buffers_count--;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	wake = b->b_waiters > 0;
+	if (wake) {
+		b->b_waiters--;
+	}
+	if (b->b_list != NULL) {
+		buflist_remove(b);
+		buffer_queue(b, false);
+	}
+	lock_release(sl);
+	if (wake) {
+		cv_signal(b->b_busycv, buffer_lock);
+	}
 }
 
 /*
@@ -873,6 +1929,8 @@ static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufstats *st;
+	struct timespec before;
 	int result;
 
 	KASSERT(lock_do_i_hold(buffer_lock));
@@ -884,15 +1942,62 @@ buffer_readin(struct buf *b)
 		return 0;
 	}
 
+	gettime(&before);
 	lock_release(buffer_lock);
 	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
 	lock_acquire(buffer_lock);
+	st = &bufstats[b->b_statslot];
+	st->st_reads++;
+	curthread->t_usage.u_inblock++;
+	bufstats_record(st->st_readtime, bufstats_elapsed(&before));
 	if (result == 0) {
 		b->b_valid = 1;
 	}
 	return result;
 }
 
+/*
+ * Record a write of LEN bytes starting at B that started at BEFORE
+ * and has just finished, for the syncer's bandwidth estimate and the
+ * statistics.
+ */
+static
+void
+buffer_account_write(struct buf *b, const struct timespec *before,
+		     size_t len)
+{
+	struct bufstats *st;
+	unsigned usecs;
+
+	usecs = bufstats_elapsed(before);
+	syncer_wbytes += len;
+	syncer_wusecs += usecs;
+
+	st = &bufstats[b->b_statslot];
+	st->st_writes++;
+	curthread->t_usage.u_oublock++;
+	bufstats_record(st->st_writetime, usecs);
+}
+
+/*
+ * Update the state of a buffer that has just been written out.
+ */
+static
+void
+buffer_written(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	dirty_buffers_count--;
+	dirty_buffers_bytes -= b->b_size;
+	b->b_dirty = 0;
+	b->b_walsn = 0;
+	buffer_remove_dirty(b);
+	/* if it's on an idle list, it's on the wrong one now */
+	buffer_requeue(b, false);
+}
+
 /*
  * I/O: buffer to disk
  *
@@ -908,6 +2013,8 @@ static
 int
 buffer_writeout_internal(struct buf *b)
 {
+	struct timespec before;
+	uint64_t walsn;
 	int result;
 
 	KASSERT(lock_do_i_hold(buffer_lock));
@@ -923,14 +2030,23 @@ buffer_writeout_internal(struct buf *b)
 	}
 
 	num_total_writeouts++;
+	walsn = b->b_walsn;
 	lock_release(buffer_lock);
+	if (walsn != 0) {
+		/* write-ahead: the log goes first */
+		result = FSOP_FLUSHLOG(b->b_fs, walsn);
+		if (result) {
+			lock_acquire(buffer_lock);
+			return result;
+		}
+	}
+	gettime(&before);
 	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_fsdata,
 				 b->b_data, b->b_size);
 	lock_acquire(buffer_lock);
 	if (result == 0) {
-		dirty_buffers_count--;
-		b->b_dirty = 0;
-		buffer_remove_dirty(b);
+		buffer_account_write(b, &before, b->b_size);
+		buffer_written(b);
 	}
 	return result;
 }
@@ -1000,12 +2116,22 @@ buffer_mark_dirty(struct buf *b)
 	b->b_dirty = 1;
 	b->b_dirtyepoch = dirty_epoch;
 	gettime(&b->b_timestamp);
+	dirty_buffers_bytes += b->b_size;
+	syncer_inflow += b->b_size;
+	curthread->t_dirtied_buffers = true;
 
 	/* XXX: should we avoid putting fsmanaged buffers on the dirty list? */
 
 	buffer_insert_dirty(b);
 	dirty_buffers_count++;
-	/* Here we might prod the syncer, but currently it doesn't need it */
+	/* as in buffer_written */
+	buffer_requeue(b, false);
+	/* Past the throttling limit, don't wait for the syncer's timer. */
+	if (syncer_idle &&
+	    dirty_buffers_bytes > SCALE(max_buffer_mem, SYNCER_DIRTY_LIMIT)) {
+		syncer_idle = false;
+		cv_signal(syncer_cv, buffer_lock);
+	}
 	lock_release(buffer_lock);
 }
 
@@ -1076,54 +2202,32 @@ buffer_sync(struct buf *b)
 }
 
 /*
- * Write out one buffer from the dirty_buffers queue.
- *
- * If the syncer has signalled for help, this is called on every
- * buffer_get until the dirty_buffers queue gets back to a manageable
- * state.
- *
- * We don't attempt to sync buffers that are currently busy, because
- * that might deadlock; we'll let the syncer deal with those.
- *
- * (Similarly, we don't want to wait for the syncer, in case the
- * syncer is waiting for a buffer we hold.)
+ * Take a busy buffer the file system has let go of off the lists and
+ * detach it. This is the second half of buffer_clean, below.
  */
 static
 void
-sync_one_old_buffer(void)
+buffer_discard(struct buf *b)
 {
-	unsigned i;
-	struct buf *b;
-	int result;
+	KASSERT(b->b_busy);
+	KASSERT(b->b_holder == curthread);
 
-	for (i=0; i < bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
-		if (b == NULL) {
-			continue;
-		}
-		if (b->b_fsmanaged) {
-			continue;
-		}
-		if (b->b_busy) {
-			continue;
-		}
-		KASSERT(b->b_dirty);
-
-		/* could check the buffer age here, but let's not bother */
-
-		result = buffer_sync(b);
-		if (result) {
-			/* wasn't busy -> didn't wait -> can't disappear */
-			KASSERT(result != EDEADBUF);
-			/* let the syncer deal with it */
-			(void)result;
-		}
-		break;
+	buffer_remove_attached(b);
+	b->b_valid = 0;
+	b->b_walsn = 0;
+	if (b->b_dirty) {
+		b->b_dirty = 0;
+		dirty_buffers_count--;
+		dirty_buffers_bytes -= b->b_size;
+		buffer_remove_dirty(b);
 	}
+	buffer_detach(b);
 }
 
 /*
- * Clean out a buffer for reuse and detach it.
+ * Clean out a buffer for reuse and detach it. The caller must have it
+ * marked busy (or it must be fsmanaged); it comes back detached and
+ * not busy.
  *
  * Does not put it on the detached list; the caller should do that if
  * desired.
@@ -1132,82 +2236,245 @@ static
 void
 buffer_clean(struct buf *b)
 {
-	int result;
-
-	KASSERT(b->b_busy == 0);
-	result = buffer_mark_busy(b);
-	/* not busy, won't sleep, can't fail */
-	KASSERT(result == 0);
+	KASSERT(b->b_busy);
+	if (b->b_fsmanaged) {
+		b->b_fsmanaged = 0;
+		b->b_holder = curthread;
+	}
+	KASSERT(b->b_holder == curthread);
 
 	lock_release(buffer_lock);
 	FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
 	lock_acquire(buffer_lock);
-	buffer_unmark_busy(b);
 
-	buffer_remove_attached(b, 0);
-	b->b_valid = 0;
-	if (b->b_dirty) {
-		b->b_dirty = 0;
-		dirty_buffers_count--;
-		buffer_remove_dirty(b);
+	buffer_discard(b);
+}
+
+/*
+ * Tidy the head of an idle list for eviction: buffers that are busy
+ * through the fast path are moved to busy_buffers, and BQ_AM buffers
+ * that were hit through the fast path since they were queued go to
+ * the end of the list, as they would have on a slow release. Each
+ * buffer is looked at at most once. Returns the new head.
+ */
+static
+struct buf *
+buflist_settle(struct buflist *bl)
+{
+	struct buf *b;
+	struct lock *sl;
+	unsigned n;
+
+	for (n = bl->bl_count; n > 0 && bl->bl_head != NULL; n--) {
+		b = bl->bl_head;
+		sl = buffer_stripelock(b);
+		lock_acquire(sl);
+		if (b->b_busy) {
+			KASSERT(b->b_fasthold);
+			buflist_remove(b);
+			buffer_queue(b, false);
+		}
+		else if (b->b_referenced && b->b_queue == BQ_AM) {
+			b->b_referenced = false;
+			buflist_remove(b);
+			buffer_queue(b, true);
+		}
+		else {
+			/* BQ_A1IN is FIFO; hits there don't count */
+			b->b_referenced = false;
+			lock_release(sl);
+			break;
+		}
+		lock_release(sl);
 	}
-	buffer_detach(b);
+	return bl->bl_head;
 }
 
 /*
- * Evict a buffer.
+ * Choose the eviction victim within one queue: the least recently
+ * used idle buffer, preferring clean ones.
  */
 static
-int
-buffer_evict(struct buf **ret)
+struct buf *
+bufqueue_victim(struct bufqueue *q)
 {
-	unsigned num, i;
 	struct buf *b, *db;
+
+	b = buflist_settle(&q->bq_clean);
+	db = buflist_settle(&q->bq_dirty);
+	if (b == NULL) {
+		b = db;
+	}
+	else if (db != NULL &&
+		 lrustamp_before(db->b_lrustamp, b->b_lrustamp) &&
+		 b->b_lrustamp - db->b_lrustamp >
+		 (lru_clock - db->b_lrustamp) / 2) {
+		/*
+		 * voodoo: avoid preferring very recent clean buffers
+		 * to older dirty buffers. "Very recent" means used in
+		 * the newer half of the time since the dirty buffer
+		 * was last used.
+		 */
+		b = db;
+	}
+	return b;
+}
+
+/*
+ * Buffer space a share of PCT percent comes to.
+ */
+static
+unsigned
+bufshare_units(unsigned pct)
+{
+	return (max_total_buffers * pct) / 100;
+}
+
+/*
+ * Check whether the fs in bufstats[] slot SLOT has its maximum share.
+ */
+static
+bool
+bufshare_full(unsigned slot)
+{
+	const struct bufshare *sh = &bufshares[slot];
+
+	return sh->sh_maxpct > 0 &&
+		sh->sh_units >= bufshare_units(sh->sh_maxpct);
+}
+
+/*
+ * Rank buffer B as the victim when making room for the fs in slot
+ * FORSLOT: 3 if it's FORSLOT's own and that's full, 2 if its fs is
+ * otherwise full, 0 if its fs hasn't got its minimum (and isn't
+ * FORSLOT, which may always replace its own buffers), and 1 if none
+ * of that applies.
+ */
+static
+unsigned
+bufshare_rank(const struct buf *b, unsigned forslot)
+{
+	const struct bufshare *sh = &bufshares[b->b_statslot];
+
+	if (b->b_statslot == 0) {
+		return 1;
+	}
+	if (bufshare_full(b->b_statslot)) {
+		return b->b_statslot == forslot ? 3 : 2;
+	}
+	if (b->b_statslot != forslot &&
+	    sh->sh_units < bufshare_units(sh->sh_minpct)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Look through the oldest BUFSHARE_SCAN idle buffers of each list,
+ * clean before dirty and queue FIRSTQ before the other, for a better
+ * victim than one ranked RANK for FORSLOT. Returns the first of those
+ * ranked highest, or NULL if none is better.
+ *
+ * The lists belong to buffer_lock, so walking them needs no stripe
+ * locks. Buffers the fast path has busy are passed over; the flag is
+ * read without the stripe lock, so it may be stale, but the caller
+ * has to claim the buffer with buffer_try_mark_busy anyway.
+ */
+static
+struct buf *
+bufshare_victim(unsigned forslot, unsigned rank, unsigned firstq)
+{
+	struct buflist *lists[2 * NUMQUEUES];
+	struct buf *b, *best;
+	unsigned i, n, r, top;
+
+	lists[0] = &bufqueues[firstq].bq_clean;
+	lists[1] = &bufqueues[firstq].bq_dirty;
+	lists[2] = &bufqueues[1 - firstq].bq_clean;
+	lists[3] = &bufqueues[1 - firstq].bq_dirty;
+	top = bufshare_full(forslot) ? 3 : 2;
+
+	best = NULL;
+	for (i=0; i<2 * NUMQUEUES && rank < top; i++) {
+		n = 0;
+		for (b = lists[i]->bl_head; b != NULL && n < BUFSHARE_SCAN;
+		     b = b->b_lrunext) {
+			n++;
+			if (b->b_busy) {
+				continue;
+			}
+			r = bufshare_rank(b, forslot);
+			if (r > rank) {
+				best = b;
+				rank = r;
+				if (rank == top) {
+					break;
+				}
+			}
+		}
+	}
+	return best;
+}
+
+/*
+ * Evict a buffer, to make room for one of the fs in bufstats[] slot
+ * FORSLOT.
+ */
+static
+int
+buffer_evict(unsigned forslot, struct buf **ret)
+{
+	struct buf *b, *sb;
+	unsigned firstq;
 	int result;
 
 	/*
-	 * Find a target buffer.
+	 * Find a target buffer. Per 2Q, take it from BQ_A1IN if that's
+	 * over its share of the cache, and otherwise from BQ_AM; but
+	 * if the chosen queue has nothing idle, use the other one.
 	 */
 
  tryagain:
-	num = bufarray_num(&attached_buffers);
-	b = db = NULL;
-	for (i=0; i<num; i++) {
-		if (i >= num/2 && db != NULL) {
-			/*
-			 * voodoo: avoid preferring very recent clean
-			 * buffers to older dirty buffers.
-			 */
-			break;
-		}
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL) {
-			continue;
-		}
-		if (b->b_busy == 1) {
-			b = NULL;
-			continue;
-		}
-		/* fsmanaged buffers are always busy */
-		KASSERT(b->b_fsmanaged == 0);
-		if (b->b_dirty == 1) {
-			if (db == NULL) {
-				/* remember first dirty buffer we saw */
-				db = b;
-			}
-			b = NULL;
-			continue;
-		}
-		break;
+	if (bufqueues[BQ_A1IN].bq_count > SCALE(max_total_buffers, TWOQ_KIN)) {
+		firstq = BQ_A1IN;
 	}
-	if (b == NULL && db != NULL) {
-		b = db;
+	else {
+		firstq = BQ_AM;
+	}
+	b = bufqueue_victim(&bufqueues[firstq]);
+	if (b == NULL) {
+		b = bufqueue_victim(&bufqueues[1 - firstq]);
 	}
 	if (b == NULL) {
-		/* No buffers at all...? */
+		/* Every attached buffer is busy...? */
 		kprintf("buffer_evict: no targets!?\n");
 		return EAGAIN;
 	}
+	/* fsmanaged buffers are always busy */
+	KASSERT(b->b_fsmanaged == 0);
+
+	/*
+	 * If file systems have shares, one that's over its maximum
+	 * (the one asking first) loses a buffer before one that isn't,
+	 * and one under its minimum only if nothing else will do.
+	 */
+	sb = NULL;
+	if (bufshares_active > 0) {
+		sb = bufshare_victim(forslot, bufshare_rank(b, forslot),
+				     firstq);
+	}
+
+	/*
+	 * Claim it. If a fast-path get took it since we looked, it's
+	 * still at the head of its list; the next try will move it.
+	 */
+	if (sb != NULL && buffer_try_mark_busy(sb)) {
+		b = sb;
+		num_share_evictions++;
+	}
+	else if (!buffer_try_mark_busy(b)) {
+		goto tryagain;
+	}
 
 	/*
 	 * Flush the buffer out if necessary.
@@ -1215,24 +2482,25 @@ buffer_evict(struct buf **ret)
 	num_total_evictions++;
 	if (b->b_dirty) {
 		num_dirty_evictions++;
-		KASSERT(b->b_busy == 0);
 		/* lock may be released here */
-		result = buffer_sync(b);
+		result = buffer_writeout_internal(b);
 		if (result) {
-			/* it wasn't busy, so it can't disappear */
-			KASSERT(result != EDEADBUF);
-
 			/* urgh... get another buffer */
 			kprintf("buffer_evict: warning: %s\n",
 				strerror(result));
-			buffer_remove_attached(b, 0);
-			buffer_insert_attached(b);
+			buffer_unmark_busy(b);
+			buffer_requeue(b, true);
 			goto tryagain;
 		}
 	}
 
 	KASSERT(b->b_dirty == 0);
 
+	/* Remember buffers evicted after only one reference. */
+	if (b->b_queue == BQ_A1IN) {
+		ghost_add(b->b_fs, b->b_physblock);
+	}
+
 	/*
 	 * Detach it from its old key, and return it in a state where
 	 * it can be reattached properly.
@@ -1243,6 +2511,149 @@ buffer_evict(struct buf **ret)
 	return 0;
 }
 
+/*
+ * Get a detached buffer with SIZE bytes of data space: reuse a
+ * detached one, make a new one, or evict one. If it's the wrong size,
+ * give back its memory and allocate the right amount, evicting more
+ * buffers (and giving back their memory too) until that fits (see
+ * buffer_mem_fits).
+ *
+ * The buffer we have in hand is always put back on the detached list
+ * before evicting, as buffer_evict can release the lock.
+ */
+static
+int
+buffer_obtain(struct fs *fs, size_t size, struct buf **ret)
+{
+	struct buf *b;
+	unsigned slot;
+	bool full;
+	int result;
+
+	slot = bufstats_slot(fs);
+
+ again:
+	/* An fs with all its share has to use one of its own */
+	full = bufshares_active > 0 && bufshare_full(slot);
+	b = full ? NULL : buffer_remove_detached();
+	if (b == NULL && !full &&
+	    (num_total_buffers < max_total_buffers ||
+	     (num_total_buffers < ceil_total_buffers &&
+	      buffer_mem_fits(size)))) {
+		/* Can create a new buffer... */
+		b = buffer_create();
+	}
+	if (b == NULL) {
+		result = buffer_evict(slot, &b);
+		if (result) {
+			return result;
+		}
+		KASSERT(b != NULL);
+	}
+
+	if (b->b_size != size) {
+		buffer_freedata(b);
+		if (!buffer_mem_fits(size)) {
+			/* Not enough memory; evict something else. */
+			buffer_insert_detached(b);
+			result = buffer_evict(slot, &b);
+			if (result) {
+				return result;
+			}
+			buffer_freedata(b);
+			buffer_insert_detached(b);
+			goto again;
+		}
+		b->b_data = kmalloc(size);
+		if (b->b_data == NULL) {
+			buffer_insert_detached(b);
+			return ENOMEM;
+		}
+		b->b_size = size;
+		num_total_bytes += size;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Reclaim hook (see reclaim.h): give back the data space the cache
+ * has grown into beyond max_buffer_mem, first from detached buffers
+ * and then by dropping idle clean ones, oldest first and BQ_A1IN
+ * before BQ_AM. Nothing is written out.
+ *
+ * The struct bufs themselves stay on the detached list, as someone
+ * woken from buffer_mark_busy may still be about to look at one.
+ *
+ * Detaching a buffer the file system has data on calls into the file
+ * system, so with RECLAIM_NOFS we stop at the first such buffer.
+ */
+static
+unsigned
+buffer_reclaim(unsigned npages, unsigned flags)
+{
+	struct buf *b;
+	size_t goal, freed;
+	unsigned i, q;
+
+	if (lock_do_i_hold(buffer_lock)) {
+		/* The cache itself ran out (e.g. in buffer_create). */
+		return 0;
+	}
+
+	goal = (size_t)npages * PAGE_SIZE;
+	freed = 0;
+
+	lock_acquire(buffer_lock);
+	for (i = bufarray_num(&detached_buffers); i-- > 0; ) {
+		if (freed >= goal || num_total_bytes <= max_buffer_mem) {
+			break;
+		}
+		b = bufarray_get(&detached_buffers, i);
+		freed += b->b_size;
+		buffer_freedata(b);
+	}
+	while (freed < goal && num_total_bytes > max_buffer_mem) {
+		b = NULL;
+		for (q = 0; q < NUMQUEUES && b == NULL; q++) {
+			b = buflist_settle(&bufqueues[q].bq_clean);
+		}
+		if (b == NULL) {
+			break;
+		}
+		if (!buffer_try_mark_busy(b)) {
+			continue;
+		}
+		KASSERT(b->b_dirty == 0);
+		if (b->b_fsdata != NULL && (flags & RECLAIM_NOFS)) {
+			buffer_unmark_busy(b);
+			buffer_requeue(b, false);
+			break;
+		}
+		if (b->b_queue == BQ_A1IN) {
+			ghost_add(b->b_fs, b->b_physblock);
+		}
+		if (b->b_fsdata != NULL) {
+			/* lock may be released here */
+			buffer_clean(b);
+		}
+		else {
+			buffer_discard(b);
+		}
+		freed += b->b_size;
+		buffer_freedata(b);
+		buffer_insert_detached(b);
+		num_reclaimed_buffers++;
+	}
+	lock_release(buffer_lock);
+
+	return freed / PAGE_SIZE;
+}
+
+static struct reclaimer buffer_reclaimer =
+	RECLAIMER_INITIALIZER("buffers", buffer_reclaim);
+
 static
 struct buf *
 buffer_find(struct fs *fs, daddr_t physblock)
@@ -1266,15 +2677,11 @@ buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 	KASSERT(lock_do_i_hold(buffer_lock));
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(VALID_BUFFER_SIZE(size));
 	if (!fsmanaged) {
 		KASSERT(curthread->t_did_reserve_buffers == true);
 	}
 
-	if (!fsmanaged && syncer_needs_help) {
-		sync_one_old_buffer();
-	}
-
 	num_total_gets++;
 
 again:
@@ -1285,38 +2692,63 @@ again:
 			KASSERT(result == EDEADBUF);
 			goto again;
 		}
+		if (b->b_size != size) {
+			/*
+			 * There's a buffer of a different size at this
+			 * block. Write it out if need be and get rid of
+			 * it, then start over.
+			 */
+			if (b->b_dirty) {
+				result = buffer_writeout_internal(b);
+				if (result) {
+					buffer_unmark_busy(b);
+					return result;
+				}
+			}
+			buffer_clean(b);
+			buffer_insert_detached(b);
+			goto again;
+		}
 		num_valid_gets++;
-		buffer_remove_attached(b, 1);
+		bufqueues[b->b_queue].bq_hits++;
+		bufstats[b->b_statslot].st_hits++;
 
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
+		/*
+		 * It's on busy_buffers now; it goes to the tail
+		 * (recent end) of the LRU list when released.
+		 */
 	}
 	else {
-		b = buffer_remove_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
-		}
-		if (b == NULL) {
-			result = buffer_evict(&b);
-			if (result) {
-				return result;
-			}
-			KASSERT(b != NULL);
+		result = buffer_obtain(fs, size, &b);
+		if (result) {
+			return result;
 		}
 
-		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
+		KASSERT(b->b_size == size);
 		result = buffer_attach(b, fs, block);
 		if (result) {
 			buffer_insert_detached(b);
 			return result;
 		}
-		KASSERT(b->b_busy == 0);
+		KASSERT(b->b_busy == false);
 		result = buffer_mark_busy(b);
 		/* b wasn't busy, so we didn't wait and it didn't disappear */
 		KASSERT(result == 0);
 
-		/* move it to the tail (recent end) of the LRU list */
+		/*
+		 * A block we evicted from BQ_A1IN not long ago is
+		 * being re-referenced, so it goes in BQ_AM this time.
+		 */
+		bufstats[b->b_statslot].st_misses++;
+		if (ghost_take(fs, block)) {
+			num_ghost_gets++;
+			b->b_queue = BQ_AM;
+		}
+		else {
+			b->b_queue = BQ_A1IN;
+		}
+
+		/* put it on busy_buffers */
 		buffer_insert_attached(b);
 
 		/*
@@ -1337,7 +2769,8 @@ again:
 		result = FSOP_ATTACHBUF(b->b_fs, block, b);
 		lock_acquire(buffer_lock);
 		if (result) {
-			buffer_unmark_busy(b);
+			buffer_remove_attached(b);
+			buffer_detach(b);
 			buffer_insert_detached(b);
 			return result;
 		}
@@ -1370,7 +2803,7 @@ buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 
 	result = buffer_get_internal(fs, block, size, fsmanaged, ret);
 	if (result) {
-		lock_release(buffer_lock);
+		/* the caller releases the lock */
 		*ret = NULL;
 		return result;
 	}
@@ -1389,6 +2822,41 @@ buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 	return 0;
 }
 
+/*
+ * Fast path for gets: if there's an idle valid buffer of the right
+ * size for the block, mark it busy under just its stripe lock and
+ * leave it where it is on its idle list. Otherwise return NULL, and
+ * the caller takes buffer_lock and does it the slow way.
+ */
+static
+struct buf *
+buffer_get_fast(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufstripe *bs;
+	struct buf *b;
+
+	KASSERT(VALID_BUFFER_SIZE(size));
+	KASSERT(curthread->t_did_reserve_buffers == true);
+
+	bs = bufhash_stripe(buffer_hashfunc(fs, block));
+	lock_acquire(bs->bs_lock);
+	b = bufhash_get(&buffer_hash, fs, block);
+	if (b == NULL || b->b_busy || !b->b_valid || b->b_size != size) {
+		lock_release(bs->bs_lock);
+		return NULL;
+	}
+	KASSERT(b->b_fsmanaged == 0);
+	KASSERT(b->b_list != NULL && b->b_list != &busy_buffers);
+	b->b_busy = true;
+	b->b_fasthold = true;
+	b->b_holder = curthread;
+	bs->bs_fshits[b->b_statslot]++;
+	lock_release(bs->bs_lock);
+	pcpu_counter_inc(&buffer_fastgets);
+	pcpu_counter_inc(&buffer_fasthits[b->b_queue]);
+	return b;
+}
+
 /*
  * Find a buffer for the given block, if one already exists; otherwise
  * attach one but don't bother to read it in.
@@ -1398,6 +2866,11 @@ buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
 	int result;
 
+	*ret = buffer_get_fast(fs, block, size);
+	if (*ret != NULL) {
+		return 0;
+	}
+
 	lock_acquire(buffer_lock);
 	result = buffer_get_internal(fs, block, size, false/*fsmanaged*/, ret);
 	lock_release(buffer_lock);
@@ -1414,6 +2887,14 @@ buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
 	int result;
 
+	/* the fast path only finds valid buffers */
+	*ret = buffer_get_fast(fs, block, size);
+	if (*ret != NULL) {
+		KEVENT(KEV_BUFREAD, block, size, 1, 0);
+		return 0;
+	}
+
+	KEVENT(KEV_BUFREAD, block, size, 0, 0);
 	lock_acquire(buffer_lock);
 	result = buffer_read_internal(fs, block, size, false/*fsmanaged*/,ret);
 	lock_release(buffer_lock);
@@ -1470,13 +2951,14 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(VALID_BUFFER_SIZE(size));
 
 	b = buffer_find(fs, block);
 	if (b == NULL) {
 		goto done;
 	}
 	KASSERT(b->b_valid);
+	KASSERT(b->b_size == size);
 
 	if (!b->b_dirty) {
 		/* Not dirty; don't need to do anything. */
@@ -1523,15 +3005,16 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	/* A buffer of any size starting at BLOCK is dropped. */
+	KASSERT(VALID_BUFFER_SIZE(size));
 
 	b = buffer_find(fs, block);
 	if (b != NULL) {
 		/*
 		 * While the FS shouldn't ever drop a buffer that it's also
 		 * actively using, the buffer might be getting synced. So
-		 * wait for it, then release it again. Because we're locked,
-		 * nobody else can get it at that point until we finish.
+		 * wait for it, and keep it busy while cleaning it so
+		 * nobody else can get it until we finish.
 		 */
 		result = buffer_mark_busy(b);
 		if (result == EDEADBUF) {
@@ -1540,7 +3023,6 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 			return;
 		}
 		KASSERT(result == 0);
-		buffer_unmark_busy(b);
 
 		buffer_clean(b);
 		buffer_insert_detached(b);
@@ -1548,8 +3030,36 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 	lock_release(buffer_lock);
 }
 
-static
-void
+/*
+ * Like buffer_drop, but only for a clean buffer nobody is using, for
+ * hints that a block won't be wanted again soon. Buffers that are
+ * busy or dirty are left alone rather than waited for.
+ */
+void
+buffer_forget(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	bufcheck();
+
+	b = buffer_find(fs, block);
+	if (b != NULL && b->b_valid && !b->b_dirty && !b->b_fsmanaged &&
+	    buffer_try_mark_busy(b)) {
+		if (b->b_dirty) {
+			/* changed under the fast path meanwhile */
+			buffer_unmark_busy(b);
+		}
+		else {
+			buffer_clean(b);
+			buffer_insert_detached(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+static
+void
 buffer_release_internal(struct buf *b)
 {
 	KASSERT(lock_do_i_hold(buffer_lock));
@@ -1560,8 +3070,6 @@ buffer_release_internal(struct buf *b)
 		KASSERT(curthread->t_did_reserve_buffers == true);
 	}
 
-	buffer_unmark_busy(b);
-
 	if (!b->b_valid) {
 		/* detach it */
 		buffer_clean(b);
@@ -1569,17 +3077,53 @@ buffer_release_internal(struct buf *b)
 	}
 	else {
 		/* move it to the end of the LRU list */
-		buffer_remove_attached(b, 0);
-		buffer_insert_attached(b);
+		buffer_unmark_busy(b);
+		buffer_requeue(b, true);
 	}
 }
 
+/*
+ * Fast path for releases: a buffer gotten through the fast path that
+ * is still on its idle list, and that nobody is waiting for, can be
+ * released under just its stripe lock. Returns true if it was.
+ */
+static
+bool
+buffer_release_fast(struct buf *b)
+{
+	struct lock *sl;
+	bool done;
+
+	if (b->b_fsmanaged || !b->b_valid) {
+		return false;
+	}
+	KASSERT(curthread->t_did_reserve_buffers == true);
+
+	sl = buffer_stripelock(b);
+	lock_acquire(sl);
+	done = b->b_fasthold && b->b_waiters == 0;
+	if (done) {
+		KASSERT(b->b_busy);
+		KASSERT(b->b_holder == curthread);
+		b->b_busy = false;
+		b->b_fasthold = false;
+		b->b_holder = NULL;
+		b->b_referenced = true;
+	}
+	lock_release(sl);
+	return done;
+}
+
 /*
  * Let go of a buffer obtained with buffer_get or buffer_read.
  */
 void
 buffer_release(struct buf *b)
 {
+	if (buffer_release_fast(b)) {
+		return;
+	}
+
 	lock_acquire(buffer_lock);
 	buffer_release_internal(b);
 	lock_release(buffer_lock);
@@ -1618,6 +3162,494 @@ buffer_set_fsdata(struct buf *buf, void *newfsd)
 	return oldfsd;
 }
 
+/*
+ * Set the write-ahead point (external op)
+ *
+ * no lock necessary because of busy bit
+ */
+void
+buffer_set_walsn(struct buf *buf, uint64_t lsn)
+{
+	KASSERT(buf->b_busy);
+
+	if (lsn > buf->b_walsn) {
+		buf->b_walsn = lsn;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// clustered writeback
+
+/*
+ * A batch of dirty buffers to write out together. Rather than going
+ * through dirty_buffers in order one buffer at a time, the sync code
+ * collects a batch, sorts it by block number (the elevator), and
+ * writes each run of adjacent buffers with a single FSOP_WRITEBLOCK
+ * through sync_clusterbuf, so the disk mostly sees sequential I/O.
+ *
+ * The buffers aren't marked busy while in the batch, only while
+ * their own run is being written, so the key is remembered to check
+ * that the buffer is still the same one. Holding a few buffers of
+ * one run busy at a time is safe for the same reason holding one is:
+ * what the FS does in writeblock only goes after other buffers. (SFS
+ * journal blocks, which it does go after, never get clustered.)
+ */
+struct syncbatch {
+	unsigned sb_num;
+	struct buf *sb_bufs[SYNC_BATCH];
+	struct fs *sb_fs[SYNC_BATCH];
+	daddr_t sb_blocks[SYNC_BATCH];
+	unsigned sb_run[SYNC_BATCH];	/* the run being written */
+	size_t sb_written;		/* bytes written by syncbatch_write */
+};
+
+/* Space for copying a run into; one user at a time. */
+static void *sync_clusterbuf;
+static bool sync_cluster_inuse;
+
+/* The syncer's batch (sync_fs_buffers allocates its own). */
+static struct syncbatch syncer_batch;
+
+/*
+ * Add a buffer to a batch. The batch must not be full.
+ */
+static
+void
+syncbatch_add(struct syncbatch *sb, struct buf *b)
+{
+	KASSERT(sb->sb_num < SYNC_BATCH);
+	sb->sb_bufs[sb->sb_num] = b;
+	sb->sb_fs[sb->sb_num] = b->b_fs;
+	sb->sb_blocks[sb->sb_num] = b->b_physblock;
+	sb->sb_num++;
+}
+
+/*
+ * Sort a batch by fs and then block number; it's small, so use
+ * insertion sort.
+ */
+static
+void
+syncbatch_sort(struct syncbatch *sb)
+{
+	struct buf *b;
+	struct fs *fs;
+	daddr_t block;
+	unsigned i, j;
+
+	for (i=1; i<sb->sb_num; i++) {
+		b = sb->sb_bufs[i];
+		fs = sb->sb_fs[i];
+		block = sb->sb_blocks[i];
+		for (j=i; j>0; j--) {
+			if ((uintptr_t)sb->sb_fs[j-1] < (uintptr_t)fs ||
+			    (sb->sb_fs[j-1] == fs &&
+			     sb->sb_blocks[j-1] <= block)) {
+				break;
+			}
+			sb->sb_bufs[j] = sb->sb_bufs[j-1];
+			sb->sb_fs[j] = sb->sb_fs[j-1];
+			sb->sb_blocks[j] = sb->sb_blocks[j-1];
+		}
+		sb->sb_bufs[j] = b;
+		sb->sb_fs[j] = fs;
+		sb->sb_blocks[j] = block;
+	}
+}
+
+/*
+ * Mark entry IX of a batch busy for writing, if it's still the same
+ * buffer, still dirty, and not in use. Doesn't wait.
+ */
+static
+bool
+syncbatch_claim(struct syncbatch *sb, unsigned ix)
+{
+	struct buf *b;
+
+	b = sb->sb_bufs[ix];
+	if (!b->b_attached || b->b_fs != sb->sb_fs[ix] ||
+	    b->b_physblock != sb->sb_blocks[ix] || b->b_fsmanaged) {
+		return false;
+	}
+	if (!buffer_try_mark_busy(b)) {
+		return false;
+	}
+	if (!b->b_dirty) {
+		/* someone else wrote it out already */
+		buffer_unmark_busy(b);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Write out one claimed buffer of a batch by itself and let go of it.
+ */
+static
+int
+syncbatch_write_one(struct syncbatch *sb, struct buf *b, bool warn)
+{
+	int result;
+
+	result = buffer_writeout_internal(b);
+	if (result == 0) {
+		sb->sb_written += b->b_size;
+	}
+	else if (warn) {
+		/*
+		 * XXX we should probably do something to
+		 * avoid retrying it over and over.
+		 */
+		kprintf("syncer: %s: block %u: Warning: %s\n",
+			FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
+			strerror(result));
+	}
+	buffer_unmark_busy(b);
+	return result;
+}
+
+/*
+ * Write out the run of N claimed buffers in sb_run[], LEN bytes in
+ * all, and let go of them. If the run can't be written in one go,
+ * fall back to writing its buffers one at a time; to avoid holding
+ * more than one of them while doing that, they're let go of first
+ * and claimed again singly.
+ */
+static
+int
+syncbatch_write_run(struct syncbatch *sb, unsigned n, size_t len, bool warn)
+{
+	struct timespec before;
+	uint64_t walsn;
+	struct buf *b;
+	char *ptr;
+	unsigned i;
+	int result, err;
+
+	KASSERT(n > 0);
+	KASSERT(len <= SYNC_CLUSTER_MAX);
+
+	if (n == 1 || sync_cluster_inuse) {
+		err = 0;
+		for (i=0; i<n; i++) {
+			b = sb->sb_bufs[sb->sb_run[i]];
+			result = syncbatch_write_one(sb, b, warn);
+			if (result && err == 0) {
+				err = result;
+			}
+		}
+		return err;
+	}
+
+	ptr = sync_clusterbuf;
+	walsn = 0;
+	for (i=0; i<n; i++) {
+		b = sb->sb_bufs[sb->sb_run[i]];
+		memcpy(ptr, b->b_data, b->b_size);
+		ptr += b->b_size;
+		if (b->b_walsn > walsn) {
+			walsn = b->b_walsn;
+		}
+	}
+	b = sb->sb_bufs[sb->sb_run[0]];
+
+	sync_cluster_inuse = true;
+	num_total_writeouts++;
+	lock_release(buffer_lock);
+	/* one log flush covers the whole run */
+	result = walsn == 0 ? 0 : FSOP_FLUSHLOG(b->b_fs, walsn);
+	if (result == 0) {
+		gettime(&before);
+		result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, NULL,
+					 sync_clusterbuf, len);
+	}
+	lock_acquire(buffer_lock);
+	sync_cluster_inuse = false;
+
+	if (result == 0) {
+		buffer_account_write(b, &before, len);
+		sb->sb_written += len;
+		num_cluster_writes++;
+		num_clustered_buffers += n;
+		for (i=0; i<n; i++) {
+			b = sb->sb_bufs[sb->sb_run[i]];
+			buffer_written(b);
+			buffer_unmark_busy(b);
+		}
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		buffer_unmark_busy(sb->sb_bufs[sb->sb_run[i]]);
+	}
+	err = 0;
+	for (i=0; i<n; i++) {
+		if (!syncbatch_claim(sb, sb->sb_run[i])) {
+			/* gone, or busy; in the latter case, later */
+			continue;
+		}
+		b = sb->sb_bufs[sb->sb_run[i]];
+		result = syncbatch_write_one(sb, b, warn);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/*
+ * Write out a batch: sort it, then claim and write a run of adjacent
+ * buffers at a time. Buffers that are busy are skipped. Empties the
+ * batch. Returns the first error, if any; if WARN is set, also
+ * prints each one.
+ */
+static
+int
+syncbatch_write(struct syncbatch *sb, bool warn)
+{
+	struct buf *b, *prev;
+	unsigned i, n;
+	size_t len;
+	int result, err;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	syncbatch_sort(sb);
+
+	sb->sb_written = 0;
+	err = 0;
+	i = 0;
+	while (i < sb->sb_num) {
+		/* claim a run of adjacent buffers */
+		n = 0;
+		len = 0;
+		prev = NULL;
+		while (i < sb->sb_num) {
+			if (prev != NULL &&
+			    (sb->sb_fs[i] != prev->b_fs ||
+			     sb->sb_blocks[i] != prev->b_physblock +
+			     BUFFER_UNITS(prev->b_size))) {
+				/* not adjacent */
+				break;
+			}
+			if (!syncbatch_claim(sb, i)) {
+				i++;
+				if (prev != NULL) {
+					/* end the run here */
+					break;
+				}
+				continue;
+			}
+			b = sb->sb_bufs[i];
+			if (prev != NULL &&
+			    (len + b->b_size > SYNC_CLUSTER_MAX ||
+			     prev->b_fsdata != NULL || b->b_fsdata != NULL)) {
+				/* it starts the next run instead */
+				buffer_unmark_busy(b);
+				break;
+			}
+			i++;
+			sb->sb_run[n++] = i-1;
+			len += b->b_size;
+			prev = b;
+		}
+
+		if (n > 0) {
+			/* lock may be released (and then re-acquired) here */
+			result = syncbatch_write_run(sb, n, len, warn);
+			if (result && err == 0) {
+				err = result;
+			}
+		}
+	}
+	sb->sb_num = 0;
+	return err;
+}
+
+/*
+ * Write out the dirty buffers for up to NUM adjacent blocks of SIZE
+ * bytes starting at BLOCK, in one FSOP_WRITEBLOCK if possible. This
+ * is for FSes that need a stretch of the disk written in order (SFS
+ * uses it for the journal), so it's like buffer_flush on each block
+ * in turn except that it stops early instead of writing out of order:
+ * at the first block with no dirty buffer, or after the first block
+ * at one that's busy. It waits for the first block's buffer, like
+ * buffer_flush, but not the others', since whoever has those may be
+ * waiting for the first. The caller should check how far it got and
+ * call again for the rest.
+ */
+int
+buffer_flush_run(struct fs *fs, daddr_t block, unsigned num, size_t size)
+{
+	struct buf *bufs[FLUSH_RUN_MAX];
+	struct timespec before;
+	struct buf *b;
+	uint64_t walsn;
+	unsigned i, n;
+	char *ptr;
+	int result;
+
+	lock_acquire(buffer_lock);
+	bufcheck();
+
+	KASSERT(VALID_BUFFER_SIZE(size));
+	if (num > FLUSH_RUN_MAX) {
+		num = FLUSH_RUN_MAX;
+	}
+	if (num * size > SYNC_CLUSTER_MAX) {
+		num = SYNC_CLUSTER_MAX / size;
+	}
+	KASSERT(num > 0);
+
+	/* The first block: as in buffer_flush. */
+	b = buffer_find(fs, block);
+	if (b == NULL || !b->b_dirty) {
+		lock_release(buffer_lock);
+		return 0;
+	}
+	KASSERT(b->b_size == size);
+	result = buffer_mark_busy(b);
+	if (result) {
+		KASSERT(result == EDEADBUF);
+		lock_release(buffer_lock);
+		return 0;
+	}
+	if (!b->b_dirty) {
+		buffer_unmark_busy(b);
+		lock_release(buffer_lock);
+		return 0;
+	}
+	bufs[0] = b;
+
+	/* The rest, while they are there, dirty, and free. */
+	for (n = 1; n < num; n++) {
+		b = buffer_find(fs, block + n * BUFFER_UNITS(size));
+		if (b == NULL || !b->b_dirty || b->b_size != size ||
+		    b->b_fsmanaged || !buffer_try_mark_busy(b)) {
+			break;
+		}
+		if (!b->b_dirty) {
+			buffer_unmark_busy(b);
+			break;
+		}
+		bufs[n] = b;
+	}
+
+	if (n > 1 && !sync_cluster_inuse) {
+		ptr = sync_clusterbuf;
+		walsn = 0;
+		for (i=0; i<n; i++) {
+			memcpy(ptr, bufs[i]->b_data, size);
+			ptr += size;
+			if (bufs[i]->b_walsn > walsn) {
+				walsn = bufs[i]->b_walsn;
+			}
+		}
+
+		sync_cluster_inuse = true;
+		num_total_writeouts++;
+		lock_release(buffer_lock);
+		result = walsn == 0 ? 0 : FSOP_FLUSHLOG(fs, walsn);
+		if (result == 0) {
+			gettime(&before);
+			result = FSOP_WRITEBLOCK(fs, block, NULL,
+						 sync_clusterbuf, n * size);
+		}
+		lock_acquire(buffer_lock);
+		sync_cluster_inuse = false;
+
+		if (result == 0) {
+			buffer_account_write(bufs[0], &before, n * size);
+			num_cluster_writes++;
+			num_clustered_buffers += n;
+			for (i=0; i<n; i++) {
+				buffer_written(bufs[i]);
+			}
+		}
+	}
+
+	/*
+	 * Then one at a time, which does nothing for buffers already
+	 * written. Stop at the first error to keep the writes in order.
+	 */
+	result = 0;
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			result = buffer_writeout_internal(bufs[i]);
+			KASSERT(result != EDEADBUF);
+		}
+		buffer_unmark_busy(bufs[i]);
+	}
+
+	lock_release(buffer_lock);
+	return result;
+}
+
+/*
+ * First pass of sync_fs_buffers: write out what we can of FS's dirty
+ * buffers from before epoch MY_EPOCH in the elevator order, without
+ * waiting for any that are busy. If we can't get memory for the
+ * batch, don't bother; our caller will handle everything.
+ */
+static
+int
+sync_fs_clustered(struct fs *fs, unsigned my_epoch)
+{
+	struct syncbatch *sb;
+	struct buf *b;
+	unsigned i, my_generation;
+	bool done;
+	int result;
+
+	sb = kmalloc(sizeof(*sb));
+	if (sb == NULL) {
+		return 0;
+	}
+	sb->sb_num = 0;
+
+	my_generation = dirty_buffers_generation;
+	result = 0;
+	done = false;
+	i = 0;
+	while (!done) {
+		/* Don't cache the array size; it might change as we work. */
+		if (i >= bufarray_num(&dirty_buffers)) {
+			done = true;
+		}
+		else {
+			b = bufarray_get(&dirty_buffers, i);
+			i++;
+			if (b == NULL || b->b_fs != fs || b->b_fsmanaged) {
+				continue;
+			}
+			if (b->b_dirtyepoch > my_epoch) {
+				/* the rest are newer; see sync_fs_buffers */
+				done = true;
+			}
+			else {
+				syncbatch_add(sb, b);
+			}
+		}
+
+		if (sb->sb_num == SYNC_BATCH || (done && sb->sb_num > 0)) {
+			/* lock may be released (and then re-acquired) here */
+			result = syncbatch_write(sb, false);
+			if (result) {
+				break;
+			}
+			if (my_generation != dirty_buffers_generation) {
+				/* compact_dirty_buffers ran; restart loop */
+				i = 0;
+				my_generation = dirty_buffers_generation;
+			}
+		}
+	}
+
+	kfree(sb);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // explicit sync
 
@@ -1642,6 +3674,17 @@ sync_fs_buffers(struct fs *fs)
 		panic("vfs: buffer cache syncer epoch wrapped around\n");
 	}
 
+	/*
+	 * Write out most of it in clusters, in block order; then go
+	 * through again, one buffer at a time, to wait for and write
+	 * out any that were busy.
+	 */
+	result = sync_fs_clustered(fs, my_epoch);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
 	my_generation = dirty_buffers_generation;
 
 	/* Don't cache the array size; it might change as we work. */
@@ -1684,10 +3727,330 @@ sync_fs_buffers(struct fs *fs)
 			/* compensate for the i++ */
 			i--;
 		}
-	}
+	}
+
+	lock_release(buffer_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// read-ahead
+
+/*
+ * Ask for a block to be read into the cache in the background (an FS
+ * calls this for blocks it expects to be asked for soon). This never
+ * waits for I/O; if the block is already cached nothing happens, and
+ * if too many requests are pending already the request is dropped.
+ *
+ * The reads are started by the prefetch thread, which keeps up to
+ * PREFETCH_INFLIGHT_MAX of them queued at the device (if the fs has
+ * fsop_startread); the caller gets to overlap its own work (e.g.
+ * copying the current block out to userspace) with them.
+ */
+void
+buffer_prefetch(struct fs *fs, daddr_t block, size_t size)
+{
+	struct prefetchreq *pr;
+
+	KASSERT(VALID_BUFFER_SIZE(size));
+
+	lock_acquire(buffer_lock);
+	num_prefetch_requests++;
+	if (buffer_find(fs, block) == NULL) {
+		if (prefetch_count < PREFETCH_QUEUE_MAX) {
+			pr = &prefetch_queue[(prefetch_head + prefetch_count)
+					     % PREFETCH_QUEUE_MAX];
+			pr->pr_fs = fs;
+			pr->pr_physblock = block;
+			pr->pr_size = size;
+			prefetch_count++;
+			V(prefetch_sem);
+		}
+		else {
+			num_prefetch_dropped++;
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Check for a valid buffer for BLOCK. Like the fast path, this needs
+ * only the stripe lock.
+ */
+bool
+buffer_cached(struct fs *fs, daddr_t block)
+{
+	struct bufstripe *bs;
+	struct buf *b;
+	bool ret;
+
+	bs = bufhash_stripe(buffer_hashfunc(fs, block));
+	lock_acquire(bs->bs_lock);
+	b = bufhash_get(&buffer_hash, fs, block);
+	ret = b != NULL && b->b_valid;
+	lock_release(bs->bs_lock);
+	return ret;
+}
+
+/*
+ * Check if the prefetch thread has a read in flight for FS.
+ */
+static
+bool
+prefetch_busy(struct fs *fs)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	if (prefetch_busyfs == fs) {
+		return true;
+	}
+	for (i=0; i<PREFETCH_INFLIGHT_MAX; i++) {
+		if (prefetch_io[i].pi_buf != NULL &&
+		    prefetch_io[i].pi_buf->b_fs == fs) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Discard pending read-ahead requests for a file system, and wait
+ * for the prefetch thread's reads for it to finish.
+ */
+static
+void
+prefetch_drop_fs(struct fs *fs)
+{
+	struct prefetchreq *pr;
+	unsigned i, j, ix;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	/* compact the ring, preserving order */
+	j = 0;
+	for (i=0; i<prefetch_count; i++) {
+		ix = (prefetch_head + i) % PREFETCH_QUEUE_MAX;
+		pr = &prefetch_queue[ix];
+		if (pr->pr_fs != fs) {
+			prefetch_queue[(prefetch_head + j++)
+				       % PREFETCH_QUEUE_MAX] = *pr;
+		}
+	}
+	prefetch_count = j;
+
+	while (prefetch_busy(fs)) {
+		cv_wait(buffer_prefetch_cv, buffer_lock);
+	}
+}
+
+/*
+ * Completion routine for read-ahead; may be called from an interrupt
+ * handler, so just hand the read back to the prefetch thread.
+ */
+static
+void
+prefetch_iodone(struct bio *bio)
+{
+	struct prefetchio *pi = bio->bio_arg;
+
+	spinlock_acquire(&prefetch_donelock);
+	pi->pi_next = prefetch_done;
+	prefetch_done = pi;
+	spinlock_release(&prefetch_donelock);
+	V(prefetch_sem);
+}
+
+/*
+ * Finish the reads that have completed: the buffers become valid
+ * (or, on error, are dropped by release) and go back to the cache.
+ */
+static
+void
+prefetch_reap(void)
+{
+	struct prefetchio *pi, *next;
+	struct bufstats *st;
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	spinlock_acquire(&prefetch_donelock);
+	pi = prefetch_done;
+	prefetch_done = NULL;
+	spinlock_release(&prefetch_donelock);
+
+	if (pi == NULL) {
+		return;
+	}
+	for (; pi != NULL; pi = next) {
+		next = pi->pi_next;
+		b = pi->pi_buf;
+		st = &bufstats[b->b_statslot];
+		st->st_reads++;
+		bufstats_record(st->st_readtime,
+				bufstats_elapsed(&pi->pi_start));
+		if (pi->pi_bio.bio_result == 0) {
+			b->b_valid = 1;
+		}
+		KASSERT(prefetch_usedunits >= BUFFER_UNITS(b->b_size));
+		prefetch_usedunits -= BUFFER_UNITS(b->b_size);
+		prefetch_inflight--;
+		pi->pi_buf = NULL;
+		buffer_release_internal(b);
+	}
+	/* wake up prefetch_drop_fs */
+	cv_broadcast(buffer_prefetch_cv, buffer_lock);
+}
+
+/*
+ * Start the read for a read-ahead request, unless a client got there
+ * first. The prefetch thread's reservation must cover it.
+ */
+static
+void
+prefetch_start(const struct prefetchreq *pr)
+{
+	struct prefetchio *pi;
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	if (buffer_find(pr->pr_fs, pr->pr_physblock) != NULL) {
+		return;
+	}
+
+	/* until the read is in a slot, this is what unmount waits for */
+	prefetch_busyfs = pr->pr_fs;
+	result = buffer_get_internal(pr->pr_fs, pr->pr_physblock,
+				     pr->pr_size, false, &b);
+	if (result) {
+		goto done;
+	}
+	if (b->b_valid) {
+		buffer_release_internal(b);
+		goto done;
+	}
+	num_prefetch_reads++;
+
+	if (pr->pr_fs->fs_ops->fsop_startread == NULL) {
+		/*
+		 * On error the buffer stays invalid and release
+		 * detaches it; the real read will retry.
+		 */
+		(void)buffer_readin(b);
+		buffer_release_internal(b);
+		goto done;
+	}
+
+	for (i=0; i<PREFETCH_INFLIGHT_MAX; i++) {
+		if (prefetch_io[i].pi_buf == NULL) {
+			break;
+		}
+	}
+	KASSERT(i < PREFETCH_INFLIGHT_MAX);
+	pi = &prefetch_io[i];
+	pi->pi_buf = b;
+	gettime(&pi->pi_start);
+	prefetch_inflight++;
+	prefetch_usedunits += BUFFER_UNITS(b->b_size);
+
+	bio_init(&pi->pi_bio, 0, b->b_data, b->b_size, UIO_READ,
+		 prefetch_iodone, pi);
+	lock_release(buffer_lock);
+	FSOP_STARTREAD(pr->pr_fs, pr->pr_physblock, &pi->pi_bio);
+	lock_acquire(buffer_lock);
+
+ done:
+	prefetch_busyfs = NULL;
+	/* wake up prefetch_drop_fs */
+	cv_broadcast(buffer_prefetch_cv, buffer_lock);
+}
+
+/*
+ * Check if the prefetch thread can start the next request now: it
+ * needs a free slot and room in its reservation. With nothing in
+ * flight it can always start one, reserving for it first.
+ */
+static
+bool
+prefetch_canstart(void)
+{
+	const struct prefetchreq *pr;
+
+	if (prefetch_count == 0) {
+		return false;
+	}
+	if (prefetch_inflight == 0) {
+		return true;
+	}
+	pr = &prefetch_queue[prefetch_head];
+	return prefetch_inflight < PREFETCH_INFLIGHT_MAX &&
+		prefetch_ressize > 0 &&
+		prefetch_usedunits + BUFFER_UNITS(pr->pr_size) <=
+		prefetch_units;
+}
+
+/*
+ * The prefetch thread.
+ */
+static
+void
+prefetcher(void *x1, unsigned long x2)
+{
+	struct prefetchreq pr;
+
+	(void)x1;
+	(void)x2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		prefetch_reap();
+
+		if (prefetch_canstart()) {
+			pr = prefetch_queue[prefetch_head];
+			prefetch_head = (prefetch_head + 1) %
+				PREFETCH_QUEUE_MAX;
+			prefetch_count--;
+
+			if (prefetch_ressize > 0 &&
+			    prefetch_usedunits + BUFFER_UNITS(pr.pr_size) >
+			    prefetch_units) {
+				/* too big for it; nothing's in flight */
+				KASSERT(prefetch_inflight == 0);
+				lock_release(buffer_lock);
+				unreserve_buffers(prefetch_ressize);
+				lock_acquire(buffer_lock);
+				prefetch_ressize = 0;
+			}
+			if (prefetch_ressize == 0) {
+				lock_release(buffer_lock);
+				reserve_buffers(pr.pr_size);
+				lock_acquire(buffer_lock);
+				prefetch_ressize = pr.pr_size;
+				prefetch_units = RESERVE_BUFFERS *
+					BUFFER_UNITS(pr.pr_size);
+			}
+			prefetch_start(&pr);
+			continue;
+		}
+
+		if (prefetch_inflight == 0 && prefetch_ressize > 0) {
+			lock_release(buffer_lock);
+			unreserve_buffers(prefetch_ressize);
+			lock_acquire(buffer_lock);
+			prefetch_ressize = 0;
+			prefetch_units = 0;
+			continue;
+		}
 
-	lock_release(buffer_lock);
-	return 0;
+		lock_release(buffer_lock);
+		P(prefetch_sem);
+		lock_acquire(buffer_lock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1704,41 +4067,64 @@ sync_fs_buffers(struct fs *fs)
 void
 drop_fs_buffers(struct fs *fs)
 {
+	struct bufqueue *q;
+	struct buf *b, *next;
+	unsigned nextstamp;
 	unsigned i;
-	struct buf *b;
-	unsigned my_generation;
+	int result;
 
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	my_generation = attached_buffers_generation;
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
+	/* Get the prefetch thread out of the way first. */
+	prefetch_drop_fs(fs);
 
-		KASSERT(b->b_valid);
-		if (b->b_dirty) {
-			panic("drop_fs_buffers: buffer did not get synced\n");
-		}
-		if (b->b_busy) {
+	for (b = busy_buffers.bl_head; b != NULL; b = b->b_lrunext) {
+		if (b->b_fs == fs) {
 			panic("drop_fs_buffers: buffer is busy\n");
 		}
+	}
 
-		buffer_clean(b);
-		buffer_insert_detached(b);
+	for (i=0; i<NUMQUEUES; i++) {
+		q = &bufqueues[i];
+		for (b = q->bq_dirty.bl_head; b != NULL; b = b->b_lrunext) {
+			if (b->b_fs == fs) {
+				panic("drop_fs_buffers: buffer did not get "
+				      "synced\n");
+			}
+		}
 
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			my_generation = attached_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+		b = q->bq_clean.bl_head;
+		while (b != NULL) {
+			next = b->b_lrunext;
+			if (b->b_fs != fs) {
+				b = next;
+				continue;
+			}
+			KASSERT(b->b_valid);
+			KASSERT(b->b_dirty == 0);
+
+			nextstamp = next != NULL ? next->b_lrustamp : 0;
+
+			result = buffer_mark_busy(b);
+			/* the fs is idle, so nobody else has it */
+			KASSERT(result == 0);
+			/* lock may be released (and then re-acquired) here */
+			buffer_clean(b);
+			buffer_insert_detached(b);
+
+			if (!buflist_stillat(next, &q->bq_clean, nextstamp)) {
+				/* the list changed under us; restart */
+				next = q->bq_clean.bl_head;
+			}
+			b = next;
 		}
 	}
 
+	/* The fs pointer may be reused by a later mount. */
+	ghost_drop_fs(fs);
+	bufstats_drop_fs(fs);
+
 	lock_release(buffer_lock);
 }
 
@@ -1752,23 +4138,38 @@ drop_fs_buffers(struct fs *fs)
  * avoid data loss in a crash.
  *
  * Pursuant to this, there are two work functions, one for working
- * the queue of least-recently-used buffers (attached_buffers) and
+ * the queue of least-recently-used buffers (the idle lists) and
  * one for working the queue of old dirty buffers (dirty_buffers).
  *
- * We balance work between them as follows:
- *    - Under normal circumstances, we work attached_buffers first and
+ * The first is paced rather than run to fixed proportions: once a
+ * pass, syncer_pace measures how fast buffers are being dirtied and
+ * how fast the disk has actually been taking writes, and sets a
+ * budget of bytes for the LRU work that brings the dirty total back
+ * down to SYNCER_DIRTY_TARGET of buffer memory, plus what will be
+ * dirtied in the meantime, but no more than the disk can do in a
+ * pass. Below the target the LRU lists are left alone and only old
+ * buffers are written.
+ *
+ * If the dirty total is over SYNCER_DIRTY_LIMIT, or is over the
+ * target and being dirtied faster than it can be written, or some
+ * buffer has gone unwritten far too long, writers are throttled:
+ * a thread that dirtied buffers during an operation waits for the
+ * next pass in unreserve_buffers, at which point it holds no
+ * buffers. This keeps them from filling the cache with dirty
+ * buffers and then having to write them out themselves in
+ * buffer_evict.
+ *
+ * We balance work between the two functions as follows:
+ *    - Under normal circumstances, we work the LRU lists first and
  *      then dirty_buffers.
  *    - Each of the work functions has a goal after which it stops;
- *      but it limits itself to some fixed maximum number of buffers
- *      before returning, in order to bound the amount of time before
- *      the outer loop reconsiders the situation.
+ *      but it limits itself to about a second of work before
+ *      returning, in order to bound the amount of time before the
+ *      outer loop reconsiders the situation.
  *    - Under write load, we switch to working dirty_buffers first, in
- *      order to attempt to bound data loss in a crash. Because client
- *      threads will fall back to synchronous evictions from the LRU
- *      list, under these conditions the syncer should concentrate on
- *      old buffers.
- *    - Under heavy write load, we set a flag to make client threads
- *      write out old buffers.
+ *      order to attempt to bound data loss in a crash.
+ *    - Under heavy write load, we work only dirty_buffers, and
+ *      throttle writers.
  *    - "Write load" and "heavy write load" are defined by whether the
  *      syncer is managing to keep up with the dirty buffer load; or
  *      more precisely, by how far behind it is on dirty_buffers
@@ -1776,132 +4177,171 @@ drop_fs_buffers(struct fs *fs)
  */
 
 /*
- * Sync buffers from the LRU list (attached_buffers)
- *
- * When activated, we write out:
- *    - any of the N least recently used buffers that are dirty;
- *    - any of the N+K least recently used buffers that are dirty and
- *      are older than one second.
- *
- * Any buffers that can still be allocated (max_total_buffers -
- * num_total_buffers) are counted as very old clean buffers, so at
- * first we don't sync anything at all until one of the time limits
- * kicks in.
- *
- * Note that "age" (via b_timestamp) is the time since the buffer
- * means was first marked dirty, which may differ substantially
- * from how recently it has been used.
+ * Apply a SYNCER_EWMA step to a rate estimate.
  */
 static
-bool
-sync_lru_buffers(void)
+unsigned
+syncer_ewma(unsigned old, unsigned sample)
 {
-	struct timespec started, now, age;
-	unsigned sync_always; /* N */
-	unsigned sync_ifold; /* N + K */
-	unsigned seenbuffers;
-	unsigned my_generation;
-	unsigned loops;
-	unsigned i;
-	struct buf *b;
-	bool finished;
-	int result;
+	return old - SCALE(old, SYNCER_EWMA) + SCALE(sample, SYNCER_EWMA);
+}
+
+/*
+ * Update the rate estimates from what happened since the last call,
+ * and set the LRU budget and throttling for the next pass.
+ */
+static
+void
+syncer_pace(void)
+{
+	struct timespec now, elapsed;
+	unsigned msecs, rate;
+	size_t target, limit, excess, budget;
 
 	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-	KASSERT(dirty_buffers_count > 0);
 
-	gettime(&started);
-	finished = false;
+	gettime(&now);
+	timespec_sub(&now, &syncer_lastpace, &elapsed);
+	syncer_lastpace = now;
+	msecs = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+	if (msecs > 0) {
+		rate = (syncer_inflow / 1024) * 1000 / msecs;
+		syncer_inrate = syncer_ewma(syncer_inrate, rate);
+	}
+	syncer_inflow = 0;
+
+	/* Only count writes over long enough to mean something. */
+	if (syncer_wusecs >= SYNCER_MIN_SAMPLE) {
+		rate = (syncer_wbytes / 1024) * 1000 / (syncer_wusecs / 1000);
+		syncer_bw = syncer_ewma(syncer_bw, rate);
+		syncer_wbytes = 0;
+		syncer_wusecs = 0;
+	}
+
+	target = SCALE(max_buffer_mem, SYNCER_DIRTY_TARGET);
+	limit = SCALE(max_buffer_mem, SYNCER_DIRTY_LIMIT);
+	if (dirty_buffers_bytes > target) {
+		excess = dirty_buffers_bytes - target;
+		budget = excess + (size_t)syncer_inrate * 1024;
+		if (budget > (size_t)syncer_bw * 1024) {
+			budget = (size_t)syncer_bw * 1024;
+		}
+	}
+	else {
+		excess = 0;
+		budget = 0;
+	}
+	syncer_budget = budget;
 
-	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS);
-	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD);
-	seenbuffers = 0;
+	syncer_throttle = syncer_needs_help ||
+		dirty_buffers_bytes > limit ||
+		(excess > 0 && syncer_inrate > syncer_bw);
+}
 
-	/*
-	 * Buffers not allocated yet are buffers we have effectively
-	 * already processed.
-	 */
-	seenbuffers += max_total_buffers - num_total_buffers;
+/*
+ * Sync buffers from the LRU lists (the idle lists of bufqueues[]),
+ * least recently used first, until syncer_budget bytes have been
+ * written.
+ *
+ * The queues are walked in the order eviction would use them, BQ_A1IN
+ * first. Only the dirty lists need to be looked at. Buffers are
+ * collected in batches and written in block order (see struct
+ * syncbatch); as the lock isn't released while collecting, there's
+ * no need to worry about the lists changing under us. Busy buffers
+ * are skipped.
+ *
+ * sync_lru_queue does one queue; it returns true if the caller should
+ * stop, with *FINISHEDP set if that's because the budget is used up
+ * or nothing more can be done.
+ */
+static
+bool
+sync_lru_queue(struct bufqueue *q, const struct timespec *started,
+	       bool *finishedp)
+{
+	struct syncbatch *sb = &syncer_batch;
+	struct timespec now, age;
+	struct buf *b;
+	size_t collected;
 
-	my_generation = attached_buffers_generation;
-	loops = 0;
-	i = 0;
+	*finishedp = false;
 	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&attached_buffers)) {
-			/* no more buffers to look at */
-			finished = true;
-			break;
-		}
-		if (seenbuffers >= sync_ifold) {
-			/* checked enough */
-			finished = true;
-			break;
-		}
-
-		b = bufarray_get(&attached_buffers, i);
-		i++;
-		if (b == NULL) {
-			continue;
-		}
-		seenbuffers++;
-		if (!b->b_dirty) {
-			continue;
+		if (syncer_budget == 0) {
+			*finishedp = true;
+			return true;
 		}
 
 		gettime(&now);
-		timespec_sub(&started, &now, &age);
+		timespec_sub(&now, started, &age);
 		if (age.tv_sec > 0) {
 			/*
 			 * Return back to the outer syncer loop if
 			 * we've been running for more than 1 second.
 			 */
-			break;
+			return true;
 		}
 
-		if (seenbuffers >= sync_always) {
-			timespec_sub(&now, &b->b_timestamp, &age);
-			if (age.tv_sec < 1) {
-				/* buffer is less than a second old */
+		KASSERT(sb->sb_num == 0);
+		collected = 0;
+		for (b = q->bq_dirty.bl_head;
+		     b != NULL && sb->sb_num < SYNC_BATCH &&
+			     collected < syncer_budget;
+		     b = b->b_lrunext) {
+			KASSERT(b->b_dirty);
+			if (b->b_busy || b->b_fsmanaged) {
+				/* fast-path gets leave them here */
 				continue;
 			}
+			syncbatch_add(sb, b);
+			collected += b->b_size;
+		}
+		if (sb->sb_num == 0) {
+			/* nothing (more) to do in this queue */
+			return false;
 		}
 
-		/* This can sleep */
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/*
-			 * The buffer was invalidated/evicted while we
-			 * were waiting to mark it busy. It no longer
-			 * needs syncing, so carry on.
-			 */
+		/* errors are printed; nothing else to do about them */
+		(void)syncbatch_write(sb, true);
+		if (sb->sb_written == 0) {
+			/* got nowhere; try again next pass */
+			*finishedp = true;
+			return true;
 		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
+		if (sb->sb_written >= syncer_budget) {
+			syncer_budget = 0;
 		}
-
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			loops++;
-			if (loops > 15) {
-				/* limit 15 tries, then go on */
-				break;
-			}
-			i = 0;
-			seenbuffers = 0;
-			seenbuffers += max_total_buffers - num_total_buffers;
-			my_generation = attached_buffers_generation;
-			continue;
+		else {
+			syncer_budget -= sb->sb_written;
 		}
 	}
-	return finished;
+}
+
+static
+bool
+sync_lru_buffers(void)
+{
+	struct timespec started;
+	bool finished;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(curthread == syncer_thread);
+	bufcheck();
+
+	if (syncer_budget == 0) {
+		/* under the dirty target; nothing to do */
+		return true;
+	}
+
+	gettime(&started);
+
+	if (sync_lru_queue(&bufqueues[BQ_A1IN], &started, &finished)) {
+		return finished;
+	}
+	if (sync_lru_queue(&bufqueues[BQ_AM], &started, &finished)) {
+		return finished;
+	}
+	/* no more buffers to look at */
+	return true;
 }
 
 /*
@@ -1962,7 +4402,8 @@ syncer_adjust_state(unsigned age)
 /*
  * Sync buffers from the age-sorted list of dirty buffers.
  *
- * We write out any dirty buffers that are older than two seconds.
+ * We write out any dirty buffers that are older than two seconds,
+ * in batches sorted by block (see struct syncbatch).
  */
 static
 bool
@@ -1973,9 +4414,9 @@ sync_old_buffers(void)
 	unsigned i;
 	struct buf *b;
 	bool finished;
-	int result;
 
 	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(curthread == syncer_thread);
 	bufcheck();
 	KASSERT(dirty_buffers_count > 0);
 
@@ -1997,7 +4438,7 @@ sync_old_buffers(void)
 		}
 		KASSERT(b->b_dirty);
 		gettime(&now);
-		timespec_sub(&started, &now, &age);
+		timespec_sub(&now, &started, &age);
 		if (age.tv_sec > 0) {
 			/*
 			 * If we've been running for more than one
@@ -2021,19 +4462,21 @@ sync_old_buffers(void)
 		/* If we're seeing sufficiently old buffers, take steps */
 		syncer_adjust_state(age.tv_sec);
 
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/* as above */
+		if (b->b_fsmanaged) {
+			/* buffer_sync would skip it anyway */
+			continue;
 		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
+
+		/*
+		 * Collect a batch and write it out in block order.
+		 * Busy buffers get skipped; we'll get them next time.
+		 */
+		syncbatch_add(&syncer_batch, b);
+		if (syncer_batch.sb_num < SYNC_BATCH) {
+			continue;
 		}
+		/* warnings are printed; nothing else to do about them */
+		(void)syncbatch_write(&syncer_batch, true);
 
 		if (my_generation != dirty_buffers_generation) {
 			/* compact_dirty_buffers ran; restart loop */
@@ -2042,6 +4485,9 @@ sync_old_buffers(void)
 			continue;
 		}
 	}
+	if (syncer_batch.sb_num > 0) {
+		(void)syncbatch_write(&syncer_batch, true);
+	}
 	if (finished && syncer_under_load) {
 		/* If we finished, the age of the "next" buffer is 0. */
 		syncer_adjust_state(0);
@@ -2050,10 +4496,9 @@ sync_old_buffers(void)
 }
 
 /*
- * If OS/161 had a more powerful clock system, we might arrange to run
- * the syncer either when enough buffers become dirty or every second
- * or two when dirty buffers exist. But we don't really have the
- * facilities for that, so instead we'll just run once a second.
+ * The syncer thread. Once it has caught up it sleeps for up to
+ * SYNCER_INTERVAL; buffer_mark_dirty wakes it early if enough buffers
+ * become dirty that writers are going to be throttled.
  */
 static
 void
@@ -2069,13 +4514,16 @@ syncer(void *x1, unsigned long x2)
 
 	lru_finished = true;
 	old_finished = true;
+	gettime(&syncer_lastpace);
 	while (1) {
 		if (lru_finished && old_finished) {
-			lock_release(buffer_lock);
-			clocksleep(1);
-			lock_acquire(buffer_lock);
+			syncer_idle = true;
+			(void)cv_timedwait(syncer_cv, buffer_lock,
+					   SYNCER_INTERVAL);
+			syncer_idle = false;
 		}
 
+		syncer_pace();
 		if (syncer_needs_help) {
 			old_finished = sync_old_buffers();
 			lru_finished = false;
@@ -2092,6 +4540,9 @@ syncer(void *x1, unsigned long x2)
 			lru_finished = true;
 			old_finished = true;
 		}
+
+		/* let throttled writers go; they'll check again */
+		cv_broadcast(buffer_throttle_cv, buffer_lock);
 	}
 	syncer_thread = NULL;
 	lock_release(buffer_lock);
@@ -2121,18 +4572,25 @@ syncer(void *x1, unsigned long x2)
 void
 reserve_buffers(size_t size)
 {
-	unsigned count = RESERVE_BUFFERS;
+	struct timespec before;
+	unsigned count;
+
+	KASSERT(VALID_BUFFER_SIZE(size));
+	count = RESERVE_BUFFERS * BUFFER_UNITS(size);
 
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-
 	/* All buffer reservations must be done up front, all at once. */
 	KASSERT(curthread->t_did_reserve_buffers == false);
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	if (num_reserved_buffers + count > max_total_buffers) {
+		num_reserve_stalls++;
+		gettime(&before);
+		while (num_reserved_buffers + count > max_total_buffers) {
+			cv_wait(buffer_reserve_cv, buffer_lock);
+		}
+		reserve_stall_ms += bufstats_elapsed(&before) / 1000;
 	}
 	num_reserved_buffers += count;
 	curthread->t_did_reserve_buffers = true;
@@ -2140,18 +4598,20 @@ reserve_buffers(size_t size)
 }
 
 /*
- * Release reservation of COUNT buffers.
+ * Release reservation of COUNT buffers. May wait for the syncer if
+ * writers are being throttled.
  */
 void
 unreserve_buffers(size_t size)
 {
-	unsigned count = RESERVE_BUFFERS;
+	unsigned count;
+
+	KASSERT(VALID_BUFFER_SIZE(size));
+	count = RESERVE_BUFFERS * BUFFER_UNITS(size);
 
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-
 	KASSERT(curthread->t_did_reserve_buffers == true);
 	KASSERT(count <= num_reserved_buffers);
 
@@ -2159,6 +4619,19 @@ unreserve_buffers(size_t size)
 	num_reserved_buffers -= count;
 	cv_broadcast(buffer_reserve_cv, buffer_lock);
 
+	/*
+	 * If this operation dirtied buffers and the syncer is
+	 * falling behind, wait for its next pass. We don't hold any
+	 * buffers at this point, so this can't get in its way.
+	 */
+	if (curthread->t_dirtied_buffers) {
+		curthread->t_dirtied_buffers = false;
+		if (syncer_throttle && curthread != syncer_thread) {
+			num_throttles++;
+			cv_wait(buffer_throttle_cv, buffer_lock);
+		}
+	}
+
 	lock_release(buffer_lock);
 }
 
@@ -2168,7 +4641,8 @@ reserve_fsmanaged_buffers(unsigned count, size_t size)
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(VALID_BUFFER_SIZE(size));
+	count *= BUFFER_UNITS(size);
 
 	while (num_reserved_buffers + count > max_total_buffers) {
 		cv_wait(buffer_reserve_cv, buffer_lock);
@@ -2183,7 +4657,8 @@ unreserve_fsmanaged_buffers(unsigned count, size_t size)
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(VALID_BUFFER_SIZE(size));
+	count *= BUFFER_UNITS(size);
 	KASSERT(count <= num_reserved_buffers);
 
 	num_reserved_buffers -= count;
@@ -2195,27 +4670,242 @@ unreserve_fsmanaged_buffers(unsigned count, size_t size)
 ////////////////////////////////////////////////////////////
 // print stats
 
+/*
+ * Print a latency histogram, skipping empty buckets.
+ */
+static
+void
+bufstats_printhist(const char *what, const unsigned *hist)
+{
+	unsigned k, col;
+
+	kprintf("      %s latency (us):", what);
+	col = 0;
+	for (k=0; k<BUFSTATS_NBUCKETS; k++) {
+		if (hist[k] == 0) {
+			continue;
+		}
+		if (col == 5) {
+			kprintf("\n         ");
+			col = 0;
+		}
+		kprintf(" %s%u:%u", k == BUFSTATS_NBUCKETS - 1 ? ">=" : "",
+			1U << k, hist[k]);
+		col++;
+	}
+	kprintf("\n");
+}
+
+/*
+ * Print the statistics for bufstats[] slot SLOT, if it has any.
+ */
+static
+void
+bufstats_print(unsigned slot)
+{
+	const struct bufstats *st;
+	const char *name;
+	unsigned fasthits, i;
+
+	st = &bufstats[slot];
+	fasthits = 0;
+	for (i=0; i<BUFHASH_NSTRIPES; i++) {
+		fasthits += bufstripes[i].bs_fshits[slot];
+	}
+	if (st->st_fs == NULL && st->st_hits + st->st_misses + fasthits +
+	    st->st_reads + st->st_writes == 0) {
+		return;
+	}
+
+	name = st->st_fs != NULL ? FSOP_GETVOLNAME(st->st_fs) : NULL;
+	kprintf("Buffers for %s:\n",
+		st->st_fs == NULL ? "(other file systems)" :
+		name == NULL ? "(unnamed)" : name);
+	kprintf("   %u gets (%u hits, %u misses)\n",
+		st->st_hits + fasthits + st->st_misses,
+		st->st_hits + fasthits, st->st_misses);
+	kprintf("   %u reads, %u writes\n", st->st_reads, st->st_writes);
+	if (st->st_reads > 0) {
+		bufstats_printhist("read", st->st_readtime);
+	}
+	if (st->st_writes > 0) {
+		bufstats_printhist("write", st->st_writetime);
+	}
+	kprintf("   %u waits for busy buffers (%u ms)\n",
+		st->st_busywaits, st->st_busywait_ms);
+	if (slot != 0) {
+		kprintf("   %uk cached, share %u%%-%u%%\n",
+			bufshares[slot].sh_units * BUFFER_MINSIZE / 1024,
+			bufshares[slot].sh_minpct,
+			bufshares[slot].sh_maxpct > 0 ?
+			bufshares[slot].sh_maxpct : 100);
+	}
+}
+
 void
 buffer_printstats(void)
 {
+	struct bufqueue *q;
+	unsigned fastgets, fasthits[NUMQUEUES];
+	unsigned i, j;
+
 	lock_acquire(buffer_lock);
 
-	kprintf("Buffers: %u of %u allocated\n",
-		num_total_buffers, max_total_buffers);
+	/* the fast-path counters are only approximately in sync */
+	fastgets = pcpu_counter_read(&buffer_fastgets);
+	for (j=0; j<NUMQUEUES; j++) {
+		fasthits[j] = pcpu_counter_read(&buffer_fasthits[j]);
+	}
+
+	kprintf("Buffers: %u of %u allocated, %luk of %luk data "
+		"(%luk if spare)\n",
+		num_total_buffers, max_total_buffers,
+		(unsigned long) num_total_bytes/1024,
+		(unsigned long) max_buffer_mem/1024,
+		(unsigned long) ceil_buffer_mem/1024);
+	kprintf("   %u reclaimed\n", num_reclaimed_buffers);
 	kprintf("   %u detached, %u attached\n",
 		bufarray_num(&detached_buffers), attached_buffers_count);
+	for (i=0; i<NUMQUEUES; i++) {
+		q = &bufqueues[i];
+		kprintf("   %s: %u attached (%u idle clean, %u idle dirty), "
+			"%u hits\n", q->bq_name, q->bq_count,
+			q->bq_clean.bl_count, q->bq_dirty.bl_count,
+			q->bq_hits + fasthits[i]);
+	}
+	kprintf("   A1out: %u of %u remembered, %u hits\n",
+		ghost_count, ghost_max, num_ghost_gets);
 	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u busy\n", busy_buffers_count);
-	kprintf("   %u dirty\n", dirty_buffers_count);
+	kprintf("   hash: %u buckets%s\n", buffer_hash.bh_numbuckets,
+		buffer_hash.bh_oldbuckets != NULL ? " (resizing)" : "");
+	kprintf("   %u busy (not counting fast-path gets)\n",
+		busy_buffers.bl_count);
+	kprintf("   %u dirty (%luk)\n", dirty_buffers_count,
+		(unsigned long) dirty_buffers_bytes/1024);
+	kprintf("   syncer: %uk/s dirtied, %uk/s written, %s\n",
+		syncer_inrate, syncer_bw,
+		syncer_throttle ? "throttling" : "not throttling");
 
 	kprintf("Buffer operations:\n");
-	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
-	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
+	kprintf("   %u gets (%u hits, %u fast, %u reads)\n",
+		num_total_gets + fastgets, num_valid_gets + fastgets,
+		fastgets, num_read_gets);
+	kprintf("   %u writeouts (%u clustered, of %u buffers)\n",
+		num_total_writeouts, num_cluster_writes,
+		num_clustered_buffers);
+	kprintf("   %u evictions (%u when dirty, %u moved by shares)\n",
+		num_total_evictions, num_dirty_evictions,
+		num_share_evictions);
+	kprintf("   %u writer throttles\n", num_throttles);
+	kprintf("   %u prefetches (%u reads, %u dropped)\n",
+		num_prefetch_requests, num_prefetch_reads,
+		num_prefetch_dropped);
+	kprintf("   %u reservation stalls (%u ms)\n",
+		num_reserve_stalls, reserve_stall_ms);
+
+	for (i=0; i<BUFSTATS_MAXFS; i++) {
+		bufstats_print(i);
+	}
+
+	lock_release(buffer_lock);
+}
+
+/*
+ * The global state and counters, for kstat. The per-queue hits
+ * include the fast-path ones, as in buffer_printstats.
+ */
+void
+buffer_kstat(struct kstat *ks)
+{
+	struct bufqueue *q;
+	unsigned fastgets, fasthits;
+	char prefix[24];
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+
+	fastgets = pcpu_counter_read(&buffer_fastgets);
+
+	kstat_add(ks, "buf.buffers", num_total_buffers);
+	kstat_add(ks, "buf.maxbuffers", max_total_buffers);
+	kstat_add(ks, "buf.bytes", num_total_bytes);
+	kstat_add(ks, "buf.maxbytes", max_buffer_mem);
+	kstat_add(ks, "buf.reserved", num_reserved_buffers);
+	kstat_add(ks, "buf.busy", busy_buffers.bl_count);
+	kstat_add(ks, "buf.dirty", dirty_buffers_count);
+	kstat_add(ks, "buf.dirtybytes", dirty_buffers_bytes);
+	for (i=0; i<NUMQUEUES; i++) {
+		q = &bufqueues[i];
+		fasthits = pcpu_counter_read(&buffer_fasthits[i]);
+		snprintf(prefix, sizeof(prefix), "buf.%s", q->bq_name);
+		kstat_addsub(ks, prefix, "attached", q->bq_count);
+		kstat_addsub(ks, prefix, "hits", q->bq_hits + fasthits);
+	}
+	kstat_add(ks, "buf.ghosthits", num_ghost_gets);
+
+	kstat_add(ks, "buf.gets", num_total_gets + fastgets);
+	kstat_add(ks, "buf.hits", num_valid_gets + fastgets);
+	kstat_add(ks, "buf.reads", num_read_gets);
+	kstat_add(ks, "buf.writeouts", num_total_writeouts);
+	kstat_add(ks, "buf.clusterwrites", num_cluster_writes);
+	kstat_add(ks, "buf.evictions", num_total_evictions);
+	kstat_add(ks, "buf.dirtyevictions", num_dirty_evictions);
+	kstat_add(ks, "buf.throttles", num_throttles);
+	kstat_add(ks, "buf.prefetches", num_prefetch_requests);
+	kstat_add(ks, "buf.prefetchreads", num_prefetch_reads);
+	kstat_add(ks, "buf.reservestalls", num_reserve_stalls);
+	kstat_add(ks, "buf.syncer.dirtyrate", syncer_inrate);
+	kstat_add(ks, "buf.syncer.writerate", syncer_bw);
+
+	lock_release(buffer_lock);
+}
+
+/*
+ * Zero the global operation counters.
+ */
+static
+void
+bufstats_reset(void)
+{
+	num_total_gets = 0;
+	num_valid_gets = 0;
+	num_ghost_gets = 0;
+	num_read_gets = 0;
+	num_total_writeouts = 0;
+	num_total_evictions = 0;
+	num_dirty_evictions = 0;
+	num_share_evictions = 0;
+	num_prefetch_requests = 0;
+	num_prefetch_dropped = 0;
+	num_prefetch_reads = 0;
+	num_cluster_writes = 0;
+	num_clustered_buffers = 0;
+	num_throttles = 0;
+	num_reserve_stalls = 0;
+	reserve_stall_ms = 0;
+}
 
+/*
+ * Reset the cumulative counters (not the current state, e.g. how
+ * many buffers are dirty) for a fresh measurement.
+ */
+void
+buffer_resetstats(void)
+{
+	unsigned i, j;
+
+	lock_acquire(buffer_lock);
+	bufstats_reset();
+	for (i=0; i<NUMQUEUES; i++) {
+		bufqueues[i].bq_hits = 0;
+	}
+	pcpu_counter_reset(&buffer_fastgets);
+	for (j=0; j<NUMQUEUES; j++) {
+		pcpu_counter_reset(&buffer_fasthits[j]);
+	}
+	for (i=0; i<BUFSTATS_MAXFS; i++) {
+		bufstats_zero(i);
+	}
 	lock_release(buffer_lock);
 }
 
@@ -2225,61 +4915,147 @@ buffer_printstats(void)
 void
 buffer_bootstrap(void)
 {
-	size_t max_buffer_mem;
+	struct bufqueue *q;
+	unsigned i;
 	int result;
 
 	attached_buffers_count = 0;
 	dirty_buffers_count = 0;
+	dirty_buffers_bytes = 0;
 
 	num_reserved_buffers = 0;
 	num_total_buffers = 0;
+	num_total_bytes = 0;
 
 	/* Limit total memory usage for buffers */
 	max_buffer_mem =
 		(mainbus_ramsize() * BUFFER_MAXMEM_NUM) / BUFFER_MAXMEM_DENOM;
-	max_total_buffers = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
+	max_total_buffers = max_buffer_mem / BUFFER_MINSIZE;
+	ceil_buffer_mem = (mainbus_ramsize() * BUFFER_CEILMEM_NUM) /
+		BUFFER_CEILMEM_DENOM;
+	ceil_total_buffers = ceil_buffer_mem / BUFFER_MINSIZE;
+	num_reclaimed_buffers = 0;
 
-	kprintf("buffers: max count %lu; max size %luk\n",
+	kprintf("buffers: max count %lu; max size %luk (%luk if spare)\n",
 		(unsigned long) max_total_buffers,
-		(unsigned long) max_buffer_mem/1024);
+		(unsigned long) max_buffer_mem/1024,
+		(unsigned long) ceil_buffer_mem/1024);
 
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
+	bufstats_reset();
+	bzero(bufstats, sizeof(bufstats));
+
+	syncer_inflow = 0;
+	syncer_wbytes = 0;
+	syncer_wusecs = 0;
+	syncer_inrate = 0;
+	syncer_bw = SYNCER_INITIAL_BW;
+	syncer_budget = 0;
+	syncer_throttle = false;
+
+	prefetch_head = 0;
+	prefetch_count = 0;
+	prefetch_busyfs = NULL;
 
 	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
 	bufarray_init(&dirty_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
+	for (i=0; i<NUMQUEUES; i++) {
+		q = &bufqueues[i];
+		q->bq_clean.bl_head = q->bq_clean.bl_tail = NULL;
+		q->bq_clean.bl_count = 0;
+		q->bq_dirty.bl_head = q->bq_dirty.bl_tail = NULL;
+		q->bq_dirty.bl_count = 0;
+		q->bq_count = 0;
+		q->bq_hits = 0;
+	}
+	bufqueues[BQ_A1IN].bq_name = "A1in";
+	bufqueues[BQ_AM].bq_name = "Am";
+	busy_buffers.bl_head = busy_buffers.bl_tail = NULL;
+	busy_buffers.bl_count = 0;
+	lru_clock = 0;
 	dirty_buffers_first = 0;
 	dirty_buffers_thresh = 0;
 
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
+	result = bufhash_init(&buffer_hash, BUFHASH_INITBITS);
 	if (result) {
 		panic("Creating buffer_hash failed\n");
 	}
+	for (i=0; i<BUFHASH_NSTRIPES; i++) {
+		bufstripes[i].bs_lock = lock_create("buffer hash stripe");
+		if (bufstripes[i].bs_lock == NULL) {
+			panic("Creating buffer hash stripe lock failed\n");
+		}
+		bzero(bufstripes[i].bs_fshits,
+		      sizeof(bufstripes[i].bs_fshits));
+	}
+
+	ghost_max = SCALE(max_total_buffers, TWOQ_KOUT);
+	ghost_next = 0;
+	ghost_count = 0;
+	/* the ring doesn't grow, so size its hash for about 2 per chain */
+	ghost_bucketbits = 1;
+	while ((1U << ghost_bucketbits) * BUFHASH_MAXLOAD < ghost_max) {
+		ghost_bucketbits++;
+	}
+	ghosts = kmalloc(ghost_max * sizeof(*ghosts));
+	ghost_buckets = kmalloc((1U << ghost_bucketbits) *
+				sizeof(*ghost_buckets));
+	if (ghosts == NULL || ghost_buckets == NULL) {
+		panic("Creating buffer ghost ring failed\n");
+	}
+	for (i=0; i<ghost_max; i++) {
+		ghosts[i].g_fs = NULL;
+		ghosts[i].g_physblock = 0;
+		ghosts[i].g_hashnext = NULL;
+	}
+	for (i=0; i < 1U << ghost_bucketbits; i++) {
+		ghost_buckets[i] = NULL;
+	}
+
+	sync_clusterbuf = kmalloc(SYNC_CLUSTER_MAX);
+	if (sync_clusterbuf == NULL) {
+		panic("Allocating buffer sync cluster space failed\n");
+	}
+	sync_cluster_inuse = false;
+	syncer_batch.sb_num = 0;
 
 	buffer_lock = lock_create("buffer cache lock");
 	if (buffer_lock == NULL) {
 		panic("Creating buffer cache lock failed\n");
 	}
-
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
-	}
+	reclaim_register(&buffer_reclaimer);
 
 	buffer_reserve_cv = cv_create("bufreserve");
 	if (buffer_reserve_cv == NULL) {
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
+	buffer_prefetch_cv = cv_create("bufprefetch");
+	if (buffer_prefetch_cv == NULL) {
+		panic("Creating buffer_prefetch_cv failed\n");
+	}
+
+	spinlock_init(&prefetch_donelock);
+	prefetch_sem = sem_create("bufprefetch", 0);
+	if (prefetch_sem == NULL) {
+		panic("Creating prefetch_sem failed\n");
+	}
+
+	buffer_throttle_cv = cv_create("bufthrottle");
+	if (buffer_throttle_cv == NULL) {
+		panic("Creating buffer_throttle_cv failed\n");
+	}
+	syncer_cv = cv_create("syncer");
+	if (syncer_cv == NULL) {
+		panic("Creating syncer_cv failed\n");
+	}
+
 	result = thread_fork("syncer", NULL, syncer, NULL, 0);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
+
+	result = thread_fork("bufprefetch", NULL, prefetcher, NULL, 0);
+	if (result) {
+		panic("Starting prefetch thread failed\n");
+	}
 }
@@ -237,15 +237,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mapped pages come through the page cache, which only
+ * makes sense for files; no device can be mapped (yet).
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -304,7 +304,7 @@ dev_namefile(struct vnode *v, struct uio *uio)
 static
 int
 dev_lookup(struct vnode *dir,
-	   char *pathname, struct vnode **result)
+	   const char *pathname, struct vnode **result)
 {
 	/*
 	 * If the path was "device:", we get "". For that, return self.
@@ -330,6 +330,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_read = dev_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = dev_write,
 	.vop_ioctl = dev_ioctl,
 	.vop_stat = dev_stat,
@@ -338,6 +339,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_fsync = null_fsync,
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
+	.vop_seekhole = vnode_seekhole_generic,
 	.vop_namefile = dev_namefile,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The kernel statistics device, "kstat:". See kstat.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <clock.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <pcpu.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <buf.h>
+#include <iostat.h>
+#include <vfs.h>
+#include <device.h>
+#include <syscall.h>
+#include <kstat.h>
+#include "opt-dumbvm.h"
+
+/* Room for a snapshot. */
+#define KSTAT_BUFSIZE	16384
+
+/*
+ * A snapshot being taken: KS_LEN bytes of KS_SIZE used so far. Lines
+ * that don't fit are dropped, and KS_FULL set.
+ */
+struct kstat {
+	char *ks_buf;
+	size_t ks_size;
+	size_t ks_len;
+	bool ks_full;
+};
+
+/*
+ * The device. The snapshot in dk_buf is the last one taken; dk_lock
+ * protects it.
+ */
+struct devkstat {
+	struct device dk_dev;
+	struct lock *dk_lock;
+	char *dk_buf;
+	size_t dk_len;
+};
+
+void
+kstat_add(struct kstat *ks, const char *name, uint64_t value)
+{
+	int n;
+
+	if (ks->ks_full) {
+		return;
+	}
+	n = snprintf(ks->ks_buf + ks->ks_len, ks->ks_size - ks->ks_len,
+		     "%s %llu\n", name, (unsigned long long)value);
+	if (ks->ks_len + n >= ks->ks_size) {
+		/* cut off; take back the part that got in */
+		ks->ks_buf[ks->ks_len] = 0;
+		ks->ks_full = true;
+		return;
+	}
+	ks->ks_len += n;
+}
+
+void
+kstat_addsub(struct kstat *ks, const char *prefix, const char *name,
+	     uint64_t value)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s.%s", prefix, name);
+	kstat_add(ks, buf, value);
+}
+
+/*
+ * Take a snapshot into DK's buffer.
+ */
+static
+void
+devkstat_snapshot(struct devkstat *dk)
+{
+	struct kstat ks;
+	struct timespec now;
+	int n;
+
+	KASSERT(lock_do_i_hold(dk->dk_lock));
+
+	gettime(&now);
+	n = snprintf(dk->dk_buf, KSTAT_BUFSIZE, "kstat %u\ntime %llu.%09lu\n",
+		     KSTAT_VERSION, (unsigned long long)now.tv_sec,
+		     (unsigned long)now.tv_nsec);
+
+	ks.ks_buf = dk->dk_buf;
+	ks.ks_size = KSTAT_BUFSIZE;
+	ks.ks_len = n;
+	ks.ks_full = false;
+
+	kstat_add(&ks, "ncpus", cpu_count());
+	pcpu_counter_kstat(&ks);
+	mmu_kstat(&ks);
+	spinlock_kstat(&ks);
+	syscall_kstat(&ks);
+#if !OPT_DUMBVM
+	coremap_kstat(&ks);
+	swap_kstat(&ks);
+	pagecache_kstat(&ks);
+#endif
+	buffer_kstat(&ks);
+	iostat_kstat(&ks);
+	vfs_kstat(&ks);
+
+	if (ks.ks_full) {
+		kprintf("kstat: snapshot truncated at %zu bytes\n", ks.ks_len);
+	}
+	dk->dk_len = ks.ks_len;
+}
+
+/* For open() */
+static
+int
+devkstat_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EACCES;
+	}
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+devkstat_io(struct device *dev, struct uio *uio)
+{
+	struct devkstat *dk = dev->d_data;
+	int result;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EIO;
+	}
+
+	lock_acquire(dk->dk_lock);
+	if (uio->uio_offset == 0) {
+		devkstat_snapshot(dk);
+	}
+	if (uio->uio_offset >= (off_t)dk->dk_len) {
+		/* EOF */
+		lock_release(dk->dk_lock);
+		return 0;
+	}
+	result = uiomove(dk->dk_buf + uio->uio_offset,
+			 dk->dk_len - uio->uio_offset, uio);
+	lock_release(dk->dk_lock);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+devkstat_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops devkstat_devops = {
+	.devop_eachopen = devkstat_eachopen,
+	.devop_io = devkstat_io,
+	.devop_ioctl = devkstat_ioctl,
+};
+
+/*
+ * Function to create and attach kstat:
+ */
+void
+devkstat_create(void)
+{
+	struct devkstat *dk;
+	int result;
+
+	dk = kmalloc(sizeof(*dk));
+	if (dk == NULL) {
+		panic("Could not add kstat device: out of memory\n");
+	}
+	dk->dk_lock = lock_create("kstat");
+	dk->dk_buf = kmalloc(KSTAT_BUFSIZE);
+	if (dk->dk_lock == NULL || dk->dk_buf == NULL) {
+		panic("Could not add kstat device: out of memory\n");
+	}
+	dk->dk_len = 0;
+
+	dk->dk_dev.d_ops = &devkstat_devops;
+	dk->dk_dev.d_blocks = 0;
+	dk->dk_dev.d_blocksize = 1;
+	dk->dk_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	dk->dk_dev.d_data = dk;
+	dk->dk_dev.d_iosched = NULL;
+	dk->dk_dev.d_directio = false;
+
+	result = vfs_adddev("kstat", &dk->dk_dev, 0);
+	if (result) {
+		panic("Could not add kstat device: %s\n", strerror(result));
+	}
+}
@@ -116,6 +116,8 @@ devnull_create(void)
 	dev->d_devnumber = 0; /* assigned by vfs_adddev */
 
 	dev->d_data = NULL;
+	dev->d_iosched = NULL;
+	dev->d_directio = false;
 
 	result = vfs_adddev("null", dev, 0);
 	if (result) {
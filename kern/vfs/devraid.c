@@ -0,0 +1,537 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * RAID pseudo-device over several disks.
+ *
+ * Level 0 stripes the array across the units in chunks of
+ * RAID_STRIPESECTS sectors; level 1 mirrors it, writing every unit and
+ * reading whichever is least busy. A read on a mirror that fails is
+ * tried again on the other units before giving up.
+ *
+ * The member disks are claimed from the VFS device list (so they can't
+ * be mounted behind our back) and the array is added as a mountable
+ * device. Requests are split into per-unit child requests that run
+ * in parallel through the units' own queues. Children complete in
+ * interrupt context, so the request and child structures come from
+ * fixed pools instead of kmalloc; if a pool runs dry, devop_strategy
+ * waits for an entry.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vfs.h>
+#include <device.h>
+#include <bio.h>
+
+/* Most units in one array */
+#define RAID_MAXUNITS		8
+
+/* Sectors per stripe unit, for level 0 */
+#define RAID_STRIPESECTS	8
+
+/* Pool sizes */
+#define RAID_NREQS		32
+#define RAID_NCHILDREN		64
+
+struct raid_softc;
+
+/*
+ * One request made to the array. It finishes when its last child
+ * does; rr_pending also holds one count for the submitter while the
+ * children are still being started.
+ */
+struct raid_req {
+	struct bio *rr_parent;		/* the caller's request */
+	unsigned rr_pending;		/* children left, plus submitter */
+	int rr_result;			/* first error seen */
+	struct raid_req *rr_next;	/* free list */
+};
+
+/*
+ * A piece of a request on one unit.
+ */
+struct raid_child {
+	struct bio rc_bio;		/* the request to the unit */
+	struct raid_softc *rc_rd;	/* array we belong to */
+	struct raid_req *rc_req;	/* request we're part of */
+	unsigned rc_unit;		/* unit it's on */
+	unsigned rc_tries;		/* units tried, for mirror reads */
+	struct raid_child *rc_next;	/* free list */
+};
+
+struct raid_softc {
+	struct device rd_dev;
+	unsigned rd_level;			/* 0 or 1 */
+	unsigned rd_nunits;
+	struct device *rd_units[RAID_MAXUNITS];
+
+	struct spinlock rd_lock;		/* protects the rest */
+	struct wchan *rd_wchan;			/* for pool waits */
+	unsigned rd_inflight[RAID_MAXUNITS];	/* children per unit */
+	unsigned rd_nextread;			/* round-robin point */
+	struct raid_req *rd_freereqs;
+	struct raid_child *rd_freechildren;
+	struct raid_req rd_reqs[RAID_NREQS];
+	struct raid_child rd_children[RAID_NCHILDREN];
+};
+
+////////////////////////////////////////////////////////////
+// pools
+
+/*
+ * Get a request structure, waiting if there are none.
+ */
+static
+struct raid_req *
+raid_getreq(struct raid_softc *rd)
+{
+	struct raid_req *rr;
+
+	KASSERT(spinlock_do_i_hold(&rd->rd_lock));
+	while (rd->rd_freereqs == NULL) {
+		wchan_sleep(rd->rd_wchan, &rd->rd_lock);
+	}
+	rr = rd->rd_freereqs;
+	rd->rd_freereqs = rr->rr_next;
+	return rr;
+}
+
+/*
+ * Get a child structure, waiting if there are none. Children already
+ * in flight, including the caller's own, will return some.
+ */
+static
+struct raid_child *
+raid_getchild(struct raid_softc *rd)
+{
+	struct raid_child *rc;
+
+	KASSERT(spinlock_do_i_hold(&rd->rd_lock));
+	while (rd->rd_freechildren == NULL) {
+		wchan_sleep(rd->rd_wchan, &rd->rd_lock);
+	}
+	rc = rd->rd_freechildren;
+	rd->rd_freechildren = rc->rc_next;
+	return rc;
+}
+
+/*
+ * Drop a count on a request. If it was the last, free the request and
+ * return the parent for the caller to complete once it has released
+ * the lock; otherwise return NULL.
+ */
+static
+struct bio *
+raid_reqdrop(struct raid_softc *rd, struct raid_req *rr)
+{
+	struct bio *parent;
+
+	KASSERT(spinlock_do_i_hold(&rd->rd_lock));
+	KASSERT(rr->rr_pending > 0);
+
+	rr->rr_pending--;
+	if (rr->rr_pending > 0) {
+		return NULL;
+	}
+	parent = rr->rr_parent;
+	parent->bio_result = rr->rr_result;
+	rr->rr_next = rd->rd_freereqs;
+	rd->rd_freereqs = rr;
+	wchan_wakeall(rd->rd_wchan, &rd->rd_lock);
+	return parent;
+}
+
+////////////////////////////////////////////////////////////
+// requests
+
+/*
+ * Choose the mirror to read from: the one with the fewest requests
+ * in flight, taking turns among equals. Call with the lock held.
+ */
+static
+unsigned
+raid_pickread(struct raid_softc *rd)
+{
+	unsigned i, unit, best;
+
+	KASSERT(spinlock_do_i_hold(&rd->rd_lock));
+
+	best = rd->rd_nextread;
+	for (i=1; i<rd->rd_nunits; i++) {
+		unit = (rd->rd_nextread + i) % rd->rd_nunits;
+		if (rd->rd_inflight[unit] < rd->rd_inflight[best]) {
+			best = unit;
+		}
+	}
+	rd->rd_nextread = (best + 1) % rd->rd_nunits;
+	return best;
+}
+
+/*
+ * Completion routine for a child. May run in an interrupt handler.
+ */
+static
+void
+raid_childdone(struct bio *bio)
+{
+	struct raid_child *rc = bio->bio_arg;
+	struct raid_softc *rd = rc->rc_rd;
+	struct raid_req *rr = rc->rc_req;
+	struct bio *parent;
+
+	spinlock_acquire(&rd->rd_lock);
+	KASSERT(rd->rd_inflight[rc->rc_unit] > 0);
+	rd->rd_inflight[rc->rc_unit]--;
+
+	if (bio->bio_result != 0 && rd->rd_level == 1 &&
+	    bio->bio_rw == UIO_READ && rc->rc_tries < rd->rd_nunits) {
+		/* Try the next mirror. */
+		rc->rc_unit = (rc->rc_unit + 1) % rd->rd_nunits;
+		rc->rc_tries++;
+		rd->rd_inflight[rc->rc_unit]++;
+		spinlock_release(&rd->rd_lock);
+
+		kprintf("raid: read error (%s), trying unit %u\n",
+			strerror(bio->bio_result), rc->rc_unit);
+		bio->bio_result = 0;
+		bio_submit(rd->rd_units[rc->rc_unit], bio);
+		return;
+	}
+
+	if (bio->bio_result != 0 && rr->rr_result == 0) {
+		rr->rr_result = bio->bio_result;
+	}
+	rc->rc_next = rd->rd_freechildren;
+	rd->rd_freechildren = rc;
+	wchan_wakeall(rd->rd_wchan, &rd->rd_lock);
+
+	parent = raid_reqdrop(rd, rr);
+	spinlock_release(&rd->rd_lock);
+
+	if (parent != NULL) {
+		parent->bio_done(parent);
+	}
+}
+
+/*
+ * Start a child request for part of RR on UNIT. If UNIT is
+ * RAID_MAXUNITS, pick a mirror to read from.
+ */
+static
+void
+raid_startchild(struct raid_softc *rd, struct raid_req *rr, unsigned unit,
+		off_t offset, void *data, size_t len, enum uio_rw rw)
+{
+	struct raid_child *rc;
+
+	spinlock_acquire(&rd->rd_lock);
+	rc = raid_getchild(rd);
+	if (unit == RAID_MAXUNITS) {
+		unit = raid_pickread(rd);
+	}
+	rd->rd_inflight[unit]++;
+	rr->rr_pending++;
+	spinlock_release(&rd->rd_lock);
+
+	rc->rc_rd = rd;
+	rc->rc_req = rr;
+	rc->rc_unit = unit;
+	rc->rc_tries = 1;
+	rc->rc_next = NULL;
+	bio_init(&rc->rc_bio, offset, data, len, rw, raid_childdone, rc);
+	bio_submit(rd->rd_units[unit], &rc->rc_bio);
+}
+
+/*
+ * Split a level 0 request into its stripe units.
+ */
+static
+void
+raid0_strategy(struct raid_softc *rd, struct raid_req *rr, struct bio *bio)
+{
+	size_t sectsize = rd->rd_dev.d_blocksize;
+	uint32_t sector = bio->bio_offset / sectsize;
+	char *data = bio->bio_data;
+	size_t resid = bio->bio_len;
+	uint32_t su, within, usector;
+	unsigned unit;
+	size_t len;
+
+	while (resid > 0) {
+		su = sector / RAID_STRIPESECTS;
+		within = sector % RAID_STRIPESECTS;
+		unit = su % rd->rd_nunits;
+		usector = (su / rd->rd_nunits) * RAID_STRIPESECTS + within;
+
+		len = (RAID_STRIPESECTS - within) * sectsize;
+		if (len > resid) {
+			len = resid;
+		}
+		raid_startchild(rd, rr, unit, (off_t)usector * sectsize,
+				data, len, bio->bio_rw);
+		sector += len / sectsize;
+		data += len;
+		resid -= len;
+	}
+}
+
+/*
+ * Do a level 1 request: one mirror for reads, all of them for writes.
+ */
+static
+void
+raid1_strategy(struct raid_softc *rd, struct raid_req *rr, struct bio *bio)
+{
+	unsigned i;
+
+	if (bio->bio_rw == UIO_READ) {
+		raid_startchild(rd, rr, RAID_MAXUNITS, bio->bio_offset,
+				bio->bio_data, bio->bio_len, UIO_READ);
+		return;
+	}
+	for (i=0; i<rd->rd_nunits; i++) {
+		raid_startchild(rd, rr, i, bio->bio_offset,
+				bio->bio_data, bio->bio_len, UIO_WRITE);
+	}
+}
+
+/*
+ * Queue a request.
+ */
+static
+void
+raid_strategy(struct device *d, struct bio *bio)
+{
+	struct raid_softc *rd = d->d_data;
+	size_t sectsize = d->d_blocksize;
+	uint32_t sector = bio->bio_offset / sectsize;
+	uint32_t len = bio->bio_len / sectsize;
+	struct raid_req *rr;
+	struct bio *parent;
+
+	/* Don't allow I/O that isn't sector-aligned, or is empty. */
+	if (bio->bio_offset % sectsize != 0 ||
+	    bio->bio_len % sectsize != 0 || len == 0) {
+		bio->bio_result = bio->bio_len == 0 ? 0 : EINVAL;
+		bio->bio_done(bio);
+		return;
+	}
+
+	/* Don't allow I/O past the end of the array. */
+	if (sector >= d->d_blocks || len > d->d_blocks - sector) {
+		bio->bio_result = EINVAL;
+		bio->bio_done(bio);
+		return;
+	}
+
+	spinlock_acquire(&rd->rd_lock);
+	rr = raid_getreq(rd);
+	rr->rr_parent = bio;
+	rr->rr_pending = 1;
+	rr->rr_result = 0;
+	rr->rr_next = NULL;
+	spinlock_release(&rd->rd_lock);
+
+	if (rd->rd_level == 0) {
+		raid0_strategy(rd, rr, bio);
+	}
+	else {
+		raid1_strategy(rd, rr, bio);
+	}
+
+	/* Drop the submitter's count; the children may all be done. */
+	spinlock_acquire(&rd->rd_lock);
+	parent = raid_reqdrop(rd, rr);
+	spinlock_release(&rd->rd_lock);
+
+	if (parent != NULL) {
+		parent->bio_done(parent);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// device ops
+
+/* For open() */
+static
+int
+raid_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+raid_io(struct device *d, struct uio *uio)
+{
+	return bio_uio(d, uio, d->d_blocksize);
+}
+
+/* For ioctl() */
+static
+int
+raid_ioctl(struct device *d, int op, userptr_t data)
+{
+	/*
+	 * No ioctls.
+	 */
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static const struct device_ops raid_devops = {
+	.devop_eachopen = raid_eachopen,
+	.devop_io = raid_io,
+	.devop_ioctl = raid_ioctl,
+	.devop_strategy = raid_strategy,
+};
+
+////////////////////////////////////////////////////////////
+// setup
+
+/*
+ * Give back member disks we claimed.
+ */
+static
+void
+raid_unclaim(const char *const *units, unsigned nunits)
+{
+	unsigned i;
+
+	for (i=0; i<nunits; i++) {
+		vfs_unclaimdev(units[i]);
+	}
+}
+
+/*
+ * Create a RAID of level LEVEL (0 or 1) named NAME over the NUNITS
+ * mountable devices named in UNITS, and add it as a mountable
+ * device.
+ */
+int
+devraid_create(const char *name, unsigned level, unsigned nunits,
+	       const char *const *units)
+{
+	struct raid_softc *rd;
+	struct device *unit;
+	blkcnt_t blocks;
+	unsigned i;
+	int result;
+
+	if (level > 1 || nunits < 2 || nunits > RAID_MAXUNITS) {
+		return EINVAL;
+	}
+
+	rd = kmalloc(sizeof(*rd));
+	if (rd == NULL) {
+		return ENOMEM;
+	}
+	rd->rd_wchan = wchan_create("raid");
+	if (rd->rd_wchan == NULL) {
+		kfree(rd);
+		return ENOMEM;
+	}
+	spinlock_init(&rd->rd_lock);
+	rd->rd_level = level;
+	rd->rd_nunits = nunits;
+
+	blocks = 0;
+	for (i=0; i<nunits; i++) {
+		result = vfs_claimdev(units[i], &unit);
+		if (result) {
+			raid_unclaim(units, i);
+			goto fail;
+		}
+		rd->rd_units[i] = unit;
+
+		/* The units must agree on a sector size bio_uio handles. */
+		if (unit->d_blocksize != rd->rd_units[0]->d_blocksize ||
+		    unit->d_blocksize > BIO_MAXSECTSIZE) {
+			raid_unclaim(units, i + 1);
+			result = EINVAL;
+			goto fail;
+		}
+		rd->rd_inflight[i] = 0;
+		if (i == 0 || unit->d_blocks < blocks) {
+			blocks = unit->d_blocks;
+		}
+	}
+	rd->rd_nextread = 0;
+
+	if (level == 0) {
+		/* Use only whole stripes on every unit. */
+		blocks -= blocks % RAID_STRIPESECTS;
+		blocks *= nunits;
+	}
+
+	rd->rd_freereqs = NULL;
+	for (i=0; i<RAID_NREQS; i++) {
+		rd->rd_reqs[i].rr_next = rd->rd_freereqs;
+		rd->rd_freereqs = &rd->rd_reqs[i];
+	}
+	rd->rd_freechildren = NULL;
+	for (i=0; i<RAID_NCHILDREN; i++) {
+		rd->rd_children[i].rc_next = rd->rd_freechildren;
+		rd->rd_freechildren = &rd->rd_children[i];
+	}
+
+	rd->rd_dev.d_ops = &raid_devops;
+	rd->rd_dev.d_blocks = blocks;
+	rd->rd_dev.d_blocksize = rd->rd_units[0]->d_blocksize;
+	rd->rd_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	rd->rd_dev.d_data = rd;
+	rd->rd_dev.d_iosched = NULL; /* the units have their own */
+	rd->rd_dev.d_directio = true;
+
+	result = vfs_adddev(name, &rd->rd_dev, 1);
+	if (result) {
+		raid_unclaim(units, nunits);
+		goto fail;
+	}
+
+	kprintf("%s: raid%u, %u units, %lu sectors\n", name, level, nunits,
+		(unsigned long)blocks);
+	return 0;
+
+ fail:
+	spinlock_cleanup(&rd->rd_lock);
+	wchan_destroy(rd->rd_wchan);
+	kfree(rd);
+	return result;
+}
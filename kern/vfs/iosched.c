@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk I/O scheduler. See iosched.h.
+ *
+ * The queue is one list of transfers in arrival order, and each
+ * policy picks from it by scanning. Driver queues are short, so this
+ * is cheap, and it means the policy can be changed at any time.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <bio.h>
+#include <iosched.h>
+
+/* Largest transfer merging builds (bytes). */
+#define IOSCHED_MAXMERGE	(64 * 1024)
+
+/* How long (ms) reads and writes wait before the deadline policy
+ * dispatches them regardless of position. */
+#define IOSCHED_READEXPIRE	100
+#define IOSCHED_WRITEEXPIRE	1000
+
+/* Reads the deadline policy picks in a row while writes wait. */
+#define IOSCHED_WRITESTARVE	4
+
+static const char *const iosched_names[] = {
+	[IOSCHED_FIFO] = "fifo",
+	[IOSCHED_CLOOK] = "clook",
+	[IOSCHED_DEADLINE] = "deadline",
+};
+
+/*
+ * Setup and teardown. LOCK is the driver's queue lock.
+ */
+void
+iosched_init(struct iosched *is, struct spinlock *lock)
+{
+	is->is_lock = lock;
+	is->is_policy = IOSCHED_CLOOK;
+	is->is_head = NULL;
+	is->is_tail = NULL;
+	is->is_pos = 0;
+	is->is_readruns = 0;
+	is->is_nqueued = 0;
+	is->is_nmerged = 0;
+	is->is_ndispatched = 0;
+	is->is_nexpired = 0;
+}
+
+void
+iosched_cleanup(struct iosched *is)
+{
+	KASSERT(is->is_head == NULL);
+}
+
+/*
+ * Choose a policy by name.
+ */
+int
+iosched_setpolicy(struct iosched *is, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<ARRAYCOUNT(iosched_names); i++) {
+		if (!strcmp(name, iosched_names[i])) {
+			spinlock_acquire(is->is_lock);
+			is->is_policy = i;
+			is->is_readruns = 0;
+			spinlock_release(is->is_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+const char *
+iosched_policyname(struct iosched *is)
+{
+	return iosched_names[is->is_policy];
+}
+
+/*
+ * Get the byte position just past the end of the transfer headed by
+ * BIO, and its total length.
+ */
+static
+off_t
+iosched_end(struct bio *bio, size_t *lenret)
+{
+	size_t len = 0;
+	off_t end = bio->bio_offset;
+
+	for (; bio != NULL; bio = bio->bio_chain) {
+		len += bio->bio_len;
+		end = bio->bio_offset + bio->bio_len;
+	}
+	*lenret = len;
+	return end;
+}
+
+/*
+ * Try to merge BIO into a queued transfer: after one that ends where
+ * it starts, or in front of one that starts where it ends. Returns
+ * true if it did.
+ */
+static
+bool
+iosched_merge(struct iosched *is, struct bio *bio)
+{
+	struct bio *t, *last, **tp;
+	size_t len;
+	off_t end;
+
+	for (tp = &is->is_head; *tp != NULL; tp = &(*tp)->bio_next) {
+		t = *tp;
+		if (t->bio_rw != bio->bio_rw) {
+			continue;
+		}
+		end = iosched_end(t, &len);
+		if (len + bio->bio_len > IOSCHED_MAXMERGE) {
+			continue;
+		}
+		if (end == bio->bio_offset) {
+			for (last = t; last->bio_chain != NULL;
+			     last = last->bio_chain) {
+				/* nothing */
+			}
+			last->bio_chain = bio;
+			return true;
+		}
+		if (bio->bio_offset + (off_t)bio->bio_len == t->bio_offset) {
+			/* BIO heads the transfer now, keeping its place */
+			bio->bio_chain = t;
+			bio->bio_next = t->bio_next;
+			bio->bio_queued = t->bio_queued;
+			t->bio_next = NULL;
+			*tp = bio;
+			if (is->is_tail == t) {
+				is->is_tail = bio;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Queue a request.
+ */
+void
+iosched_add(struct iosched *is, struct bio *bio)
+{
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	bio->bio_next = NULL;
+	bio->bio_chain = NULL;
+	is->is_nqueued++;
+
+	if (is->is_policy != IOSCHED_FIFO && iosched_merge(is, bio)) {
+		is->is_nmerged++;
+		return;
+	}
+
+	gettime(&bio->bio_queued);
+	if (is->is_tail == NULL) {
+		is->is_head = is->is_tail = bio;
+	}
+	else {
+		is->is_tail->bio_next = bio;
+		is->is_tail = bio;
+	}
+}
+
+/*
+ * C-LOOK: of the queued transfers going direction RW (or either, if
+ * ANYRW), the one at the lowest position at or past is_pos, or
+ * failing that the lowest overall. Returns NULL if there are none.
+ */
+static
+struct bio *
+iosched_clook(struct iosched *is, bool anyrw, enum uio_rw rw)
+{
+	struct bio *t, *ahead = NULL, *lowest = NULL;
+
+	for (t = is->is_head; t != NULL; t = t->bio_next) {
+		if (!anyrw && t->bio_rw != rw) {
+			continue;
+		}
+		if (t->bio_offset >= is->is_pos &&
+		    (ahead == NULL || t->bio_offset < ahead->bio_offset)) {
+			ahead = t;
+		}
+		if (lowest == NULL || t->bio_offset < lowest->bio_offset) {
+			lowest = t;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * Check if transfer T has waited longer than its deadline as of NOW.
+ */
+static
+bool
+iosched_expired(struct bio *t, const struct timespec *now)
+{
+	struct timespec waited;
+	unsigned ms;
+
+	timespec_sub(now, &t->bio_queued, &waited);
+	ms = waited.tv_sec * 1000 + waited.tv_nsec / 1000000;
+	return ms > (t->bio_rw == UIO_READ ?
+		     IOSCHED_READEXPIRE : IOSCHED_WRITEEXPIRE);
+}
+
+/*
+ * Deadline: the oldest transfer if it's expired; otherwise by C-LOOK,
+ * reads first unless writes have been passed over too often.
+ */
+static
+struct bio *
+iosched_deadline(struct iosched *is)
+{
+	struct bio *t, *oldread = NULL, *oldwrite = NULL;
+	struct timespec now;
+
+	for (t = is->is_head; t != NULL; t = t->bio_next) {
+		if (t->bio_rw == UIO_READ && oldread == NULL) {
+			oldread = t;
+		}
+		else if (t->bio_rw == UIO_WRITE && oldwrite == NULL) {
+			oldwrite = t;
+		}
+	}
+
+	gettime(&now);
+	if (oldread != NULL && iosched_expired(oldread, &now)) {
+		is->is_nexpired++;
+		return oldread;
+	}
+	if (oldwrite != NULL && iosched_expired(oldwrite, &now)) {
+		is->is_nexpired++;
+		is->is_readruns = 0;
+		return oldwrite;
+	}
+
+	if (oldread != NULL &&
+	    (oldwrite == NULL || is->is_readruns < IOSCHED_WRITESTARVE)) {
+		if (oldwrite != NULL) {
+			is->is_readruns++;
+		}
+		return iosched_clook(is, false, UIO_READ);
+	}
+	is->is_readruns = 0;
+	return iosched_clook(is, false, UIO_WRITE);
+}
+
+/*
+ * Take the next transfer off the queue, or return NULL if it's
+ * empty. Its bios are linked through bio_next, in disk order.
+ */
+struct bio *
+iosched_next(struct iosched *is)
+{
+	struct bio *t, *prev, *b;
+	size_t len;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	if (is->is_head == NULL) {
+		return NULL;
+	}
+
+	switch (is->is_policy) {
+	    case IOSCHED_FIFO:
+		t = is->is_head;
+		break;
+	    case IOSCHED_CLOOK:
+		t = iosched_clook(is, true, UIO_READ);
+		break;
+	    case IOSCHED_DEADLINE:
+		t = iosched_deadline(is);
+		break;
+	    default:
+		panic("iosched: bad policy %u\n", is->is_policy);
+	}
+	KASSERT(t != NULL);
+
+	/* unlink it */
+	if (is->is_head == t) {
+		prev = NULL;
+		is->is_head = t->bio_next;
+	}
+	else {
+		for (prev = is->is_head; prev->bio_next != t;
+		     prev = prev->bio_next) {
+			KASSERT(prev->bio_next != NULL);
+		}
+		prev->bio_next = t->bio_next;
+	}
+	if (is->is_tail == t) {
+		is->is_tail = prev;
+	}
+
+	is->is_pos = iosched_end(t, &len);
+	is->is_ndispatched++;
+
+	/* hand back the merged requests as a list */
+	for (b = t; b != NULL; b = b->bio_chain) {
+		b->bio_next = b->bio_chain;
+	}
+	return t;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-device I/O statistics. See iostat.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <iostat.h>
+#include <kstat.h>
+
+/* All of them, newest first; entries are never removed. */
+static struct spinlock iostat_listlock = SPINLOCK_INITIALIZER;
+static struct iostat *iostat_list;
+
+/*
+ * Nanoseconds from T0 to T1.
+ */
+static
+uint64_t
+iostat_ns(const struct timespec *t0, const struct timespec *t1)
+{
+	struct timespec diff;
+
+	if (t1->tv_sec < t0->tv_sec ||
+	    (t1->tv_sec == t0->tv_sec && t1->tv_nsec < t0->tv_nsec)) {
+		return 0;
+	}
+	timespec_sub(t1, t0, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+/*
+ * Bring the time-weighted counters up to NOW. Call with the lock
+ * held, before changing st_depth.
+ */
+static
+void
+iostat_advance(struct iostat *st, const struct timespec *now)
+{
+	uint64_t ns;
+
+	KASSERT(spinlock_do_i_hold(&st->st_lock));
+
+	ns = iostat_ns(&st->st_changed, now);
+	if (st->st_stats.st_depth > 0) {
+		st->st_stats.st_busy += ns;
+		st->st_stats.st_depthtime += ns * st->st_stats.st_depth;
+	}
+	st->st_changed = *now;
+}
+
+/*
+ * Setup.
+ */
+void
+iostat_init(struct iostat *st, const char *name)
+{
+	snprintf(st->st_name, sizeof(st->st_name), "%s", name);
+	spinlock_init(&st->st_lock);
+	bzero(&st->st_stats, sizeof(st->st_stats));
+	gettime(&st->st_reset);
+	st->st_changed = st->st_reset;
+
+	spinlock_acquire(&iostat_listlock);
+	st->st_next = iostat_list;
+	iostat_list = st;
+	spinlock_release(&iostat_listlock);
+}
+
+/*
+ * Note a request arriving.
+ */
+void
+iostat_start(struct iostat *st, struct timespec *started)
+{
+	gettime(started);
+
+	spinlock_acquire(&st->st_lock);
+	iostat_advance(st, started);
+	st->st_stats.st_depth++;
+	if (st->st_stats.st_depth > st->st_stats.st_maxdepth) {
+		st->st_stats.st_maxdepth = st->st_stats.st_depth;
+	}
+	spinlock_release(&st->st_lock);
+}
+
+/*
+ * Note a request finishing.
+ */
+void
+iostat_done(struct iostat *st, const struct timespec *started,
+	    enum uio_rw rw, size_t bytes, int err)
+{
+	struct timespec now;
+	unsigned dir, bucket;
+	uint64_t us;
+
+	gettime(&now);
+	dir = rw == UIO_READ ? IOSTAT_READ : IOSTAT_WRITE;
+
+	/* log2 of the latency in microseconds */
+	us = iostat_ns(started, &now) / 1000;
+	for (bucket = 0; us > 1 && bucket < IOSTAT_NBUCKETS - 1; bucket++) {
+		us >>= 1;
+	}
+
+	spinlock_acquire(&st->st_lock);
+	iostat_advance(st, &now);
+	/* a reset while the request was out already dropped it */
+	if (st->st_stats.st_depth > 0) {
+		st->st_stats.st_depth--;
+	}
+	st->st_stats.st_ops[dir]++;
+	if (err) {
+		st->st_stats.st_errors[dir]++;
+	}
+	else {
+		st->st_stats.st_bytes[dir] += bytes;
+	}
+	st->st_stats.st_hist[dir][bucket]++;
+	spinlock_release(&st->st_lock);
+}
+
+/*
+ * Get a consistent copy of the counters, current to now.
+ */
+void
+iostat_get(struct iostat *st, struct ioctl_iostat *ret)
+{
+	struct timespec now;
+
+	gettime(&now);
+
+	spinlock_acquire(&st->st_lock);
+	iostat_advance(st, &now);
+	*ret = st->st_stats;
+	ret->st_elapsed = iostat_ns(&st->st_reset, &now);
+	spinlock_release(&st->st_lock);
+}
+
+/*
+ * Zero the counters. Requests still pending stay counted in the
+ * depth, since they'll still finish.
+ */
+void
+iostat_reset(struct iostat *st)
+{
+	uint32_t depth;
+
+	spinlock_acquire(&st->st_lock);
+	depth = st->st_stats.st_depth;
+	bzero(&st->st_stats, sizeof(st->st_stats));
+	st->st_stats.st_depth = depth;
+	st->st_stats.st_maxdepth = depth;
+	gettime(&st->st_reset);
+	st->st_changed = st->st_reset;
+	spinlock_release(&st->st_lock);
+}
+
+/*
+ * IOCTL_IOSTAT.
+ */
+int
+iostat_ioctl(struct iostat *st, userptr_t data)
+{
+	struct ioctl_iostat stats;
+
+	iostat_get(st, &stats);
+	return copyout(&stats, data, sizeof(stats));
+}
+
+/*
+ * Print one direction's counters and histogram.
+ */
+static
+void
+iostat_printdir(const struct ioctl_iostat *s, unsigned dir, const char *what)
+{
+	unsigned i, last;
+
+	kprintf("   %s: %llu ops, %lluk, %llu errors\n", what,
+		(unsigned long long)s->st_ops[dir],
+		(unsigned long long)s->st_bytes[dir] / 1024,
+		(unsigned long long)s->st_errors[dir]);
+	if (s->st_ops[dir] == 0) {
+		return;
+	}
+
+	last = 0;
+	for (i=0; i<IOSTAT_NBUCKETS; i++) {
+		if (s->st_hist[dir][i] > 0) {
+			last = i;
+		}
+	}
+	kprintf("      latency (us, log2):");
+	for (i=0; i<=last; i++) {
+		kprintf(" %u", s->st_hist[dir][i]);
+	}
+	kprintf("\n");
+}
+
+/*
+ * Print everyone's statistics.
+ */
+void
+iostat_printall(void)
+{
+	struct ioctl_iostat s;
+	struct iostat *st;
+	uint64_t ms;
+
+	spinlock_acquire(&iostat_listlock);
+	st = iostat_list;
+	spinlock_release(&iostat_listlock);
+
+	for (; st != NULL; st = st->st_next) {
+		iostat_get(st, &s);
+		ms = s.st_elapsed / 1000000;
+		kprintf("%s: busy %llu of %llu ms, depth %u (max %u, "
+			"avg %llu.%02llu)\n", st->st_name,
+			(unsigned long long)(s.st_busy / 1000000),
+			(unsigned long long)ms, s.st_depth, s.st_maxdepth,
+			(unsigned long long)(ms ? s.st_depthtime / 1000000 /
+						ms : 0),
+			(unsigned long long)(ms ? s.st_depthtime / 10000 /
+						ms % 100 : 0));
+		iostat_printdir(&s, IOSTAT_READ, "read");
+		iostat_printdir(&s, IOSTAT_WRITE, "write");
+	}
+}
+
+/*
+ * Add one direction's counters to a kstat snapshot.
+ */
+static
+void
+iostat_kstatdir(struct kstat *ks, const char *name,
+		const struct ioctl_iostat *s, unsigned dir, const char *what)
+{
+	char prefix[IOSTAT_NAMELEN + 16];
+
+	snprintf(prefix, sizeof(prefix), "dev.%s.%s", name, what);
+	kstat_addsub(ks, prefix, "ops", s->st_ops[dir]);
+	kstat_addsub(ks, prefix, "bytes", s->st_bytes[dir]);
+	kstat_addsub(ks, prefix, "errors", s->st_errors[dir]);
+}
+
+/*
+ * Everyone's statistics, for kstat. The histograms are left out.
+ */
+void
+iostat_kstat(struct kstat *ks)
+{
+	struct ioctl_iostat s;
+	struct iostat *st;
+	char prefix[IOSTAT_NAMELEN + 8];
+
+	spinlock_acquire(&iostat_listlock);
+	st = iostat_list;
+	spinlock_release(&iostat_listlock);
+
+	for (; st != NULL; st = st->st_next) {
+		iostat_get(st, &s);
+		snprintf(prefix, sizeof(prefix), "dev.%s", st->st_name);
+		kstat_addsub(ks, prefix, "busy_ns", s.st_busy);
+		kstat_addsub(ks, prefix, "depthtime_ns", s.st_depthtime);
+		kstat_addsub(ks, prefix, "depth", s.st_depth);
+		iostat_kstatdir(ks, st->st_name, &s, IOSTAT_READ, "read");
+		iostat_kstatdir(ks, st->st_name, &s, IOSTAT_WRITE, "write");
+	}
+}
+
+/*
+ * Reset everyone's statistics.
+ */
+void
+iostat_resetall(void)
+{
+	struct iostat *st;
+
+	spinlock_acquire(&iostat_listlock);
+	st = iostat_list;
+	spinlock_release(&iostat_listlock);
+
+	for (; st != NULL; st = st->st_next) {
+		iostat_reset(st);
+	}
+}
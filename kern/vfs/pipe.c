@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Pipes.
+ *
+ * A pipe is a page-sized ring buffer with a vnode for each end; both
+ * vnodes are embedded in the pipe and point back at it. Readers and
+ * writers each have a sleep lock, so there's only ever one of each
+ * moving data, which lets them copy in and out of the ring without
+ * holding the spinlock: the reader only touches the data and the
+ * writer only the free space, and the indexes are updated afterwards.
+ * Sleeping for data or space is done on wchans under the spinlock.
+ *
+ * Writes of up to PIPE_BUF bytes wait until there's room for all of
+ * them at once, so they're never split. Since writers hold their lock
+ * for the whole write, no write is ever interleaved with another
+ * anyway, but a large write may reach the reader in pieces.
+ *
+ * Going through the ring costs two copies. To save one, a reader that
+ * has to wait posts its uio, and a writer that finds it there (with
+ * the ring empty) copies straight from its own buffer into the
+ * reader's, through the physical addresses of the reader's pages.
+ * That only works for pages that are resident and privately
+ * writeable; anything else, or dumbvm, and the writer just falls
+ * back to the ring for the rest of the write.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <stat.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define PIPE_SIZE	PAGE_SIZE
+
+struct pipe {
+	struct vnode pp_rvn;		/* read end */
+	struct vnode pp_wvn;		/* write end */
+	char *pp_buf;			/* PIPE_SIZE bytes of ring */
+	struct lock *pp_rlock;		/* held by the one active reader */
+	struct lock *pp_wlock;		/* held by the one active writer */
+
+	struct spinlock pp_lock;	/* protects the rest */
+	unsigned pp_head;		/* index of first byte of data */
+	unsigned pp_len;		/* bytes of data in the ring */
+	bool pp_rclosed;		/* read end closed */
+	bool pp_wclosed;		/* write end closed */
+	struct wchan *pp_rwchan;	/* readers waiting for data */
+	struct wchan *pp_wwchan;	/* writers waiting for space */
+	struct uio *pp_direct;		/* waiting reader's buffer */
+	bool pp_directbusy;		/* a writer is filling pp_direct */
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+////////////////////////////////////////////////////////////
+// creation and destruction
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	KASSERT(pp->pp_direct == NULL);
+
+	wchan_destroy(pp->pp_wwchan);
+	wchan_destroy(pp->pp_rwchan);
+	spinlock_cleanup(&pp->pp_lock);
+	lock_destroy(pp->pp_wlock);
+	lock_destroy(pp->pp_rlock);
+	kfree(pp->pp_buf);
+	kfree(pp);
+}
+
+int
+pipe_create(struct vnode **rret, struct vnode **wret)
+{
+	struct pipe *pp;
+	int result;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	if (pp->pp_buf == NULL) {
+		goto fail_pp;
+	}
+	pp->pp_rlock = lock_create("pipe read");
+	if (pp->pp_rlock == NULL) {
+		goto fail_buf;
+	}
+	pp->pp_wlock = lock_create("pipe write");
+	if (pp->pp_wlock == NULL) {
+		goto fail_rlock;
+	}
+	pp->pp_rwchan = wchan_create("pipe read");
+	if (pp->pp_rwchan == NULL) {
+		goto fail_wlock;
+	}
+	pp->pp_wwchan = wchan_create("pipe write");
+	if (pp->pp_wwchan == NULL) {
+		goto fail_rwchan;
+	}
+
+	spinlock_init(&pp->pp_lock);
+	pp->pp_head = 0;
+	pp->pp_len = 0;
+	pp->pp_rclosed = false;
+	pp->pp_wclosed = false;
+	pp->pp_direct = NULL;
+	pp->pp_directbusy = false;
+
+	result = vnode_init(&pp->pp_rvn, &pipe_vnode_ops, NULL, pp);
+	KASSERT(result == 0);
+	result = vnode_init(&pp->pp_wvn, &pipe_vnode_ops, NULL, pp);
+	KASSERT(result == 0);
+
+	*rret = &pp->pp_rvn;
+	*wret = &pp->pp_wvn;
+	return 0;
+
+ fail_rwchan:
+	wchan_destroy(pp->pp_rwchan);
+ fail_wlock:
+	lock_destroy(pp->pp_wlock);
+ fail_rlock:
+	lock_destroy(pp->pp_rlock);
+ fail_buf:
+	kfree(pp->pp_buf);
+ fail_pp:
+	kfree(pp);
+	return ENOMEM;
+}
+
+/*
+ * Close one end. Whoever is waiting on the other end gets woken up to
+ * notice; the pipe goes away with the second end.
+ */
+static
+int
+pipe_reclaim(struct vnode *vn)
+{
+	struct pipe *pp = vn->vn_data;
+	bool last;
+
+	vnode_cleanup(vn);
+
+	spinlock_acquire(&pp->pp_lock);
+	if (vn == &pp->pp_rvn) {
+		pp->pp_rclosed = true;
+		wchan_wakeall(pp->pp_wwchan, &pp->pp_lock);
+	}
+	else {
+		pp->pp_wclosed = true;
+		wchan_wakeall(pp->pp_rwchan, &pp->pp_lock);
+	}
+	last = pp->pp_rclosed && pp->pp_wclosed;
+	spinlock_release(&pp->pp_lock);
+
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Copy LEN bytes between the ring, starting at index POS, and UIO,
+ * in up to two pieces. Hands back the amount moved, which may fall
+ * short if there's an error.
+ */
+static
+int
+pipe_ringmove(struct pipe *pp, unsigned pos, size_t len, struct uio *uio,
+	      size_t *moved)
+{
+	size_t n, resid;
+	int result;
+
+	resid = uio->uio_resid;
+	n = PIPE_SIZE - pos;
+	if (n > len) {
+		n = len;
+	}
+	result = uiomove(pp->pp_buf + pos, n, uio);
+	if (result == 0 && n < len) {
+		result = uiomove(pp->pp_buf, len - n, uio);
+	}
+	*moved = resid - uio->uio_resid;
+	return result;
+}
+
+/*
+ * Copy from the writer's uio WUIO straight into the waiting reader's
+ * RUIO, page by page, until one of them runs out or we come to a page
+ * of the reader's we can't pin. RUIO belongs to another address space,
+ * so it has to be advanced by hand.
+ */
+static
+int
+pipe_directmove(struct uio *ruio, struct uio *wuio)
+{
+	struct iovec *iov;
+	vaddr_t va;
+	paddr_t pa;
+	size_t n, done;
+	int result;
+
+	while (wuio->uio_resid > 0 && ruio->uio_resid > 0) {
+		iov = ruio->uio_iov;
+		if (iov->iov_len == 0) {
+			KASSERT(ruio->uio_iovcnt > 1);
+			ruio->uio_iov++;
+			ruio->uio_iovcnt--;
+			continue;
+		}
+
+		va = (vaddr_t)iov->iov_ubase;
+		n = PAGE_SIZE - (va & ~PAGE_FRAME);
+		if (n > iov->iov_len) {
+			n = iov->iov_len;
+		}
+		if (n > wuio->uio_resid) {
+			n = wuio->uio_resid;
+		}
+
+		if (!vm_pinuser(ruio->uio_space, va, true, &pa)) {
+			return 0;
+		}
+		done = wuio->uio_resid;
+		result = uiomove((char *)PADDR_TO_KVADDR(pa) +
+				 (va & ~PAGE_FRAME), n, wuio);
+		vm_unpinuser(pa);
+		done -= wuio->uio_resid;
+
+		iov->iov_ubase += done;
+		iov->iov_len -= done;
+		ruio->uio_resid -= done;
+		ruio->uio_offset += done;
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *pp = vn->vn_data;
+	size_t want, len, moved;
+	unsigned pos;
+	int result;
+
+	if (vn != &pp->pp_rvn) {
+		return EBADF;
+	}
+	want = uio->uio_resid;
+	if (want == 0) {
+		return 0;
+	}
+
+	lock_acquire(pp->pp_rlock);
+	spinlock_acquire(&pp->pp_lock);
+	while (pp->pp_len == 0 && !pp->pp_wclosed) {
+		if (uio->uio_segflg == UIO_USERSPACE) {
+			pp->pp_direct = uio;
+		}
+		wchan_sleep(pp->pp_rwchan, &pp->pp_lock);
+		while (pp->pp_directbusy) {
+			wchan_sleep(pp->pp_rwchan, &pp->pp_lock);
+		}
+		pp->pp_direct = NULL;
+		if (uio->uio_resid < want) {
+			/* a writer filled it in directly */
+			spinlock_release(&pp->pp_lock);
+			lock_release(pp->pp_rlock);
+			return 0;
+		}
+	}
+
+	/* Data, or EOF if there's none. */
+	pos = pp->pp_head;
+	len = pp->pp_len < want ? pp->pp_len : want;
+	spinlock_release(&pp->pp_lock);
+
+	result = pipe_ringmove(pp, pos, len, uio, &moved);
+
+	spinlock_acquire(&pp->pp_lock);
+	pp->pp_head = (pp->pp_head + moved) % PIPE_SIZE;
+	pp->pp_len -= moved;
+	if (moved > 0) {
+		wchan_wakeall(pp->pp_wwchan, &pp->pp_lock);
+	}
+	spinlock_release(&pp->pp_lock);
+	lock_release(pp->pp_rlock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *pp = vn->vn_data;
+	struct uio *ruio;
+	size_t orig, space, need, len, moved;
+	unsigned pos;
+	bool trydirect;
+	int result;
+
+	if (vn != &pp->pp_wvn) {
+		return EBADF;
+	}
+
+	orig = uio->uio_resid;
+	trydirect = uio->uio_segflg == UIO_USERSPACE;
+	need = orig <= PIPE_BUF ? orig : 1;
+	result = 0;
+
+	lock_acquire(pp->pp_wlock);
+	spinlock_acquire(&pp->pp_lock);
+	while (uio->uio_resid > 0) {
+		if (pp->pp_rclosed) {
+			result = EPIPE;
+			break;
+		}
+
+		if (trydirect && pp->pp_len == 0 && pp->pp_direct != NULL) {
+			ruio = pp->pp_direct;
+			pp->pp_directbusy = true;
+			spinlock_release(&pp->pp_lock);
+
+			len = uio->uio_resid;
+			result = pipe_directmove(ruio, uio);
+
+			spinlock_acquire(&pp->pp_lock);
+			pp->pp_directbusy = false;
+			pp->pp_direct = NULL;
+			if (uio->uio_resid == len) {
+				/* couldn't; don't keep trying */
+				trydirect = false;
+			}
+			wchan_wakeall(pp->pp_rwchan, &pp->pp_lock);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+
+		space = PIPE_SIZE - pp->pp_len;
+		if (space < need) {
+			wchan_sleep(pp->pp_wwchan, &pp->pp_lock);
+			continue;
+		}
+
+		pos = (pp->pp_head + pp->pp_len) % PIPE_SIZE;
+		len = uio->uio_resid < space ? uio->uio_resid : space;
+		spinlock_release(&pp->pp_lock);
+
+		result = pipe_ringmove(pp, pos, len, uio, &moved);
+
+		spinlock_acquire(&pp->pp_lock);
+		pp->pp_len += moved;
+		if (moved > 0) {
+			wchan_wakeall(pp->pp_rwchan, &pp->pp_lock);
+		}
+		if (result) {
+			break;
+		}
+	}
+	spinlock_release(&pp->pp_lock);
+	lock_release(pp->pp_wlock);
+
+	if (result == EPIPE && uio->uio_resid < orig) {
+		/* report the short write; the next one gets EPIPE */
+		result = 0;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// everything else
+
+static
+int
+pipe_eachopen(struct vnode *vn, int openflags)
+{
+	/* Pipes don't have names, so there's no way to get here. */
+	(void)vn;
+	(void)openflags;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_stat(struct vnode *vn, struct stat *st)
+{
+	struct pipe *pp = vn->vn_data;
+
+	bzero(st, sizeof(*st));
+	st->st_mode = S_IFIFO | 0600;
+	st->st_nlink = 1;
+	st->st_blksize = PIPE_SIZE;
+
+	spinlock_acquire(&pp->pp_lock);
+	st->st_size = pp->pp_len;
+	spinlock_release(&pp->pp_lock);
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *vn, mode_t *ret)
+{
+	(void)vn;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *vn)
+{
+	(void)vn;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *vn)
+{
+	(void)vn;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *vn, off_t len)
+{
+	(void)vn;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_namefile = vopfail_uio_nosys,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
@@ -50,6 +50,11 @@ vfs_getcurdir(struct vnode **ret)
 {
 	int rv = 0;
 
+	if (curproc == kproc) {
+		/* The kernel's first current directory is the bootfs */
+		vfs_bindbootfs();
+	}
+
 	spinlock_acquire(&curproc->p_lock);
 	if (curproc->p_cwd!=NULL) {
 		VOP_INCREF(curproc->p_cwd);
@@ -121,7 +126,7 @@ vfs_clearcurdir(void)
  * it to a vnode.
  */
 int
-vfs_chdir(char *path)
+vfs_chdir(const char *path)
 {
 	struct vnode *vn;
 	int result;
@@ -83,21 +83,21 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 // mmap
 
 int
-vopfail_mmap_isdir(struct vnode *vn /*add stuff */)
+vopfail_mmap_isdir(struct vnode *vn)
 {
 	(void)vn;
 	return EISDIR;
 }
 
 int
-vopfail_mmap_perm(struct vnode *vn /*add stuff */)
+vopfail_mmap_perm(struct vnode *vn)
 {
 	(void)vn;
 	return EPERM;
 }
 
 int
-vopfail_mmap_nosys(struct vnode *vn /*add stuff */)
+vopfail_mmap_nosys(struct vnode *vn)
 {
 	(void)vn;
 	return ENOSYS;
@@ -114,6 +114,31 @@ vopfail_truncate_isdir(struct vnode *vn, off_t pos)
 	return EISDIR;
 }
 
+////////////////////////////////////////////////////////////
+// seekhole
+
+int
+vopfail_seekhole_isdir(struct vnode *vn, int whence, off_t pos,
+		       off_t *result)
+{
+	(void)vn;
+	(void)whence;
+	(void)pos;
+	(void)result;
+	return EISDIR;
+}
+
+int
+vopfail_seekhole_nosys(struct vnode *vn, int whence, off_t pos,
+		       off_t *result)
+{
+	(void)vn;
+	(void)whence;
+	(void)pos;
+	(void)result;
+	return ENOSYS;
+}
+
 ////////////////////////////////////////////////////////////
 // creat
 
@@ -242,7 +267,8 @@ vopfail_rename_nosys(struct vnode *fromdir, const char *fromname,
 // lookup
 
 int
-vopfail_lookup_notdir(struct vnode *vn, char *path, struct vnode **result)
+vopfail_lookup_notdir(struct vnode *vn, const char *path,
+		      struct vnode **result)
 {
 	(void)vn;
 	(void)path;
@@ -251,8 +277,8 @@ vopfail_lookup_notdir(struct vnode *vn, char *path, struct vnode **result)
 }
 
 int
-vopfail_lookparent_notdir(struct vnode *vn, char *path, struct vnode **result,
-			  char *buf, size_t len)
+vopfail_lookparent_notdir(struct vnode *vn, const char *path,
+			  struct vnode **result, char *buf, size_t len)
 {
 	(void)vn;
 	(void)path;
@@ -39,10 +39,15 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <rcu.h>
+#include <current.h>
+#include <thread.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <iosched.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -74,22 +79,221 @@
  * device, returns the device itself.
  */
 
+/*
+ * A name in the lookup table (see below). MN_NAME is NULL when the
+ * entry isn't in the table.
+ */
+struct mountname {
+	struct mountname *mn_next;	/* hash chain */
+	const char *mn_name;		/* name looked up */
+	struct vnode *mn_vnode;		/* result, held; NULL for ENXIO */
+};
+
+/* A device answers to its name, its raw name, and its volume name. */
+#define KD_NAME		0
+#define KD_RAWNAME	1
+#define KD_VOLNAME	2
+#define KD_NNAMES	3
+
 struct knowndev {
 	char *kd_name;
 	char *kd_rawname;
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	struct mountname kd_names[KD_NNAMES];
 };
 
 /* A placeholder for kd_fs for devices used as swap */
 #define SWAP_FS	((struct fs *)-1)
 
+/* A placeholder for kd_fs for devices claimed by another device */
+#define CLAIMED_FS	((struct fs *)-2)
+
+/* True if KD has a real filesystem on it. */
+#define KD_HASFS(kd) \
+	((kd)->kd_fs != NULL && (kd)->kd_fs != SWAP_FS && \
+	 (kd)->kd_fs != CLAIMED_FS)
+
 DECLARRAY(knowndev, static __UNUSED inline);
 DEFARRAY(knowndev, static __UNUSED inline);
 
+/*
+ * knowndevs_lock is taken shared by vfs_getdevname and exclusive by
+ * everything that changes the table or the devices on it.
+ */
 static struct knowndevarray *knowndevs;
-static struct lock *knowndevs_lock;
+static struct rwlock *knowndevs_lock;
+
+/*
+ * vfs_getroot, which every lookup of a device:path name does, uses
+ * a hash table of names instead, under RCU and without locking. Each
+ * name holds a reference to what it resolves to: the root of the
+ * mounted filesystem, or the device itself, so a lookup only has to
+ * add one. The table only changes under knowndevs_lock, when devices
+ * are added or filesystems mounted and unmounted; then a device's
+ * names are taken out, and after a grace period put back as they now
+ * should be.
+ */
+#define MOUNTHASH_SIZE	32
+
+static struct mountname *mounthash[MOUNTHASH_SIZE];
+
+/*
+ * FNV-1a, over the LEN bytes of NAME.
+ */
+static
+unsigned
+mountname_hash(const char *name, size_t len)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i=0; i<len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h % MOUNTHASH_SIZE;
+}
+
+/*
+ * Check if MN is named by the LEN bytes of NAME.
+ */
+static
+bool
+mountname_matches(const struct mountname *mn, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (mn->mn_name[i] != name[i]) {
+			return false;
+		}
+	}
+	return mn->mn_name[len] == 0;
+}
+
+/*
+ * Put MN in the table as NAME, handing it our reference to VN.
+ */
+static
+void
+mountname_insert(struct mountname *mn, const char *name, struct vnode *vn)
+{
+	unsigned h;
+
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
+	KASSERT(mn->mn_name == NULL);
+
+	h = mountname_hash(name, strlen(name));
+	mn->mn_name = name;
+	mn->mn_vnode = vn;
+	mn->mn_next = mounthash[h];
+	RCU_ASSIGN(mounthash[h], mn);
+}
+
+/*
+ * Put KD's names in the table, according to what's on it now. Only
+ * fails if it has a filesystem whose root can't be had, and then
+ * publishes nothing.
+ */
+static
+int
+kd_publish(struct knowndev *kd)
+{
+	struct vnode *root;
+	const char *volname;
+	int result;
+
+	if (KD_HASFS(kd)) {
+		result = FSOP_GETROOT(kd->kd_fs, &root);
+		if (result) {
+			return result;
+		}
+		volname = FSOP_GETVOLNAME(kd->kd_fs);
+		if (volname != NULL) {
+			VOP_INCREF(root);
+			mountname_insert(&kd->kd_names[KD_VOLNAME], volname,
+					 root);
+		}
+		mountname_insert(&kd->kd_names[KD_NAME], kd->kd_name, root);
+	}
+	else if (kd->kd_rawname != NULL) {
+		/* mountable, and not mounted */
+		mountname_insert(&kd->kd_names[KD_NAME], kd->kd_name, NULL);
+	}
+	else {
+		KASSERT(kd->kd_fs == NULL);
+		KASSERT(kd->kd_device != NULL);
+		VOP_INCREF(kd->kd_vnode);
+		mountname_insert(&kd->kd_names[KD_NAME], kd->kd_name,
+				 kd->kd_vnode);
+	}
+
+	if (kd->kd_rawname != NULL) {
+		KASSERT(kd->kd_device != NULL);
+		VOP_INCREF(kd->kd_vnode);
+		mountname_insert(&kd->kd_names[KD_RAWNAME], kd->kd_rawname,
+				 kd->kd_vnode);
+	}
+	return 0;
+}
+
+/*
+ * Take KD's names out of the table, and once no lookup can still be
+ * looking at them, drop their references. Sleeps.
+ */
+static
+void
+kd_unpublish(struct knowndev *kd)
+{
+	struct mountname **pp, *mn;
+	unsigned i;
+
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
+
+	for (i=0; i<KD_NNAMES; i++) {
+		mn = &kd->kd_names[i];
+		if (mn->mn_name == NULL) {
+			continue;
+		}
+		pp = &mounthash[mountname_hash(mn->mn_name,
+					       strlen(mn->mn_name))];
+		while (*pp != mn) {
+			KASSERT(*pp != NULL);
+			pp = &(*pp)->mn_next;
+		}
+		/* leave mn_next alone for lookups still on MN */
+		*pp = mn->mn_next;
+	}
+
+	rcu_synchronize();
+
+	for (i=0; i<KD_NNAMES; i++) {
+		mn = &kd->kd_names[i];
+		if (mn->mn_name == NULL) {
+			continue;
+		}
+		if (mn->mn_vnode != NULL) {
+			VOP_DECREF(mn->mn_vnode);
+		}
+		mn->mn_next = NULL;
+		mn->mn_name = NULL;
+		mn->mn_vnode = NULL;
+	}
+}
+
+/*
+ * vfs_sync syncs each filesystem in a thread of its own, so that the
+ * disks write back at the same time. This is its shared state, used
+ * only under knowndevs_lock: the filesystems, the next one nobody has
+ * taken yet, and how many helper threads are still going.
+ */
+static struct fs **vfs_syncfs;
+static unsigned vfs_syncnum, vfs_syncnext, vfs_synchelpers;
+static struct lock *vfs_synclock;
+static struct cv *vfs_synccv;
 
 /*
  * Setup function
@@ -102,124 +306,179 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
-	knowndevs_lock = lock_create("knowndevs");
+	knowndevs_lock = rwlock_create("knowndevs");
 	if (knowndevs_lock==NULL) {
 		panic("vfs: Could not create knowndevs lock\n");
 	}
 
+	vfs_synclock = lock_create("vfs_sync");
+	vfs_synccv = cv_create("vfs_sync");
+	if (vfs_synclock == NULL || vfs_synccv == NULL) {
+		panic("vfs: Could not create sync lock\n");
+	}
+
+	vfs_ncache_bootstrap();
 	vfs_initbootfs();
 	devnull_create();
+	devkstat_create();
 	semfs_bootstrap();
 }
 
 /*
- * Global sync function - call FSOP_SYNC on all devices.
+ * Sync filesystems until there are none left.
  */
-int
-vfs_sync(void)
+static
+void
+vfs_sync_work(void)
 {
-	struct knowndev *dev;
-	unsigned i, num;
-
-	lock_acquire(knowndevs_lock);
-
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
-			/*result =*/ FSOP_SYNC(dev->kd_fs);
+	unsigned i;
+
+	while (1) {
+		lock_acquire(vfs_synclock);
+		i = vfs_syncnext++;
+		lock_release(vfs_synclock);
+		if (i >= vfs_syncnum) {
+			break;
 		}
+		/*result =*/ FSOP_SYNC(vfs_syncfs[i]);
 	}
+}
 
-	lock_release(knowndevs_lock);
+static
+void
+vfs_sync_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
 
-	return 0;
+	vfs_sync_work();
+
+	lock_acquire(vfs_synclock);
+	KASSERT(vfs_synchelpers > 0);
+	vfs_synchelpers--;
+	cv_signal(vfs_synccv, vfs_synclock);
+	lock_release(vfs_synclock);
+
+	thread_exit();
 }
 
 /*
- * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
- * back an appropriate vnode.
+ * Global sync function - call FSOP_SYNC on all devices.
+ *
+ * With more than one filesystem, start a helper thread for each but
+ * one and take a share of the work ourselves, so this takes as long
+ * as the slowest one rather than all of them together. If threads or
+ * memory can't be had we just do more of it ourselves; and when we
+ * can't sleep (from panic) that's all of it.
  */
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+vfs_sync(void)
 {
-	struct knowndev *kd;
-	unsigned i, num;
-	int error;
+	struct knowndev *dev;
+	unsigned i, num, nfs;
+	int result;
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
+	nfs = 0;
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
-
-		/*
-		 * If this device has a mounted filesystem, and
-		 * DEVNAME names either the filesystem or the device,
-		 * return the root of the filesystem.
-		 *
-		 * If it has no mounted filesystem, it's mountable,
-		 * and DEVNAME names the device, return ENXIO.
-		 */
-
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
-			const char *volname;
-			volname = FSOP_GETVOLNAME(kd->kd_fs);
-
-			if (!strcmp(kd->kd_name, devname) ||
-			    (volname!=NULL && !strcmp(volname, devname))) {
-				error = FSOP_GETROOT(kd->kd_fs, ret);
-				lock_release(knowndevs_lock);
-				return error;
-			}
+		dev = knowndevarray_get(knowndevs, i);
+		if (KD_HASFS(dev)) {
+			nfs++;
 		}
-		else {
-			if (kd->kd_rawname!=NULL &&
-			    !strcmp(kd->kd_name, devname)) {
-			    lock_release(knowndevs_lock);
-				return ENXIO;
+	}
+
+	vfs_syncfs = NULL;
+	if (nfs > 1 && curthread->t_curspl == 0) {
+		vfs_syncfs = kmalloc(nfs * sizeof(*vfs_syncfs));
+	}
+	if (vfs_syncfs == NULL) {
+		/* one at a time */
+		for (i=0; i<num; i++) {
+			dev = knowndevarray_get(knowndevs, i);
+			if (KD_HASFS(dev)) {
+				/*result =*/ FSOP_SYNC(dev->kd_fs);
 			}
 		}
+		rwlock_release_write(knowndevs_lock);
+		return 0;
+	}
 
-		/*
-		 * If DEVNAME names the device, and we get here, it
-		 * must have no fs and not be mountable. In this case,
-		 * we return the device itself.
-		 */
-		if (!strcmp(kd->kd_name, devname)) {
-			KASSERT(kd->kd_fs==NULL);
-			KASSERT(kd->kd_rawname==NULL);
-			KASSERT(kd->kd_device != NULL);
-			VOP_INCREF(kd->kd_vnode);
-			*ret = kd->kd_vnode;
-			lock_release(knowndevs_lock);
-			return 0;
+	vfs_syncnum = 0;
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (KD_HASFS(dev)) {
+			vfs_syncfs[vfs_syncnum++] = dev->kd_fs;
 		}
+	}
+	vfs_syncnext = 0;
+	vfs_synchelpers = 0;
 
-		/*
-		 * If the device has a rawname and DEVNAME names that,
-		 * return the device itself.
-		 */
-		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
-			KASSERT(kd->kd_device != NULL);
-			VOP_INCREF(kd->kd_vnode);
-			*ret = kd->kd_vnode;
-			lock_release(knowndevs_lock);
-			return 0;
+	lock_acquire(vfs_synclock);
+	for (i=1; i<nfs; i++) {
+		result = thread_fork("vfs_sync", NULL, vfs_sync_thread,
+				     NULL, 0);
+		if (result) {
+			break;
 		}
+		vfs_synchelpers++;
+	}
+	lock_release(vfs_synclock);
+
+	vfs_sync_work();
+
+	lock_acquire(vfs_synclock);
+	while (vfs_synchelpers > 0) {
+		cv_wait(vfs_synccv, vfs_synclock);
+	}
+	lock_release(vfs_synclock);
+
+	kfree(vfs_syncfs);
+	vfs_syncfs = NULL;
+	rwlock_release_write(knowndevs_lock);
 
-		/*
-		 * If none of the above tests matched, we didn't name
-		 * any of the names of this device, so go on to the
-		 * next one.
-		 */
+	return 0;
+}
+
+/*
+ * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
+ * back an appropriate vnode: see the comment on struct knowndev.
+ *
+ * The name is the first LEN bytes of DEVNAME and need not be
+ * terminated there, so path lookup can pass the front of a
+ * device:path string as is.
+ */
+int
+vfs_getrootn(const char *devname, size_t len, struct vnode **ret)
+{
+	struct mountname *mn;
+	int result;
+
+	rcu_read_lock();
+	mn = RCU_READ(mounthash[mountname_hash(devname, len)]);
+	while (mn != NULL && !mountname_matches(mn, devname, len)) {
+		mn = RCU_READ(mn->mn_next);
+	}
+	if (mn == NULL) {
+		result = ENODEV;
+	}
+	else if (mn->mn_vnode == NULL) {
+		result = ENXIO;
 	}
+	else {
+		VOP_INCREF(mn->mn_vnode);
+		*ret = mn->mn_vnode;
+		result = 0;
+	}
+	rcu_read_unlock();
+	return result;
+}
 
-	/*
-	 * If we got here, the device specified by devname doesn't exist.
-	 */
-	lock_release(knowndevs_lock);
-	return ENODEV;
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	return vfs_getrootn(devname, strlen(devname), ret);
 }
 
 /*
@@ -233,14 +492,14 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
 
 		if (kd->kd_fs == fs) {
-			lock_release(knowndevs_lock);
+			rwlock_release_read(knowndevs_lock);
 			/*
 			 * This is not a race condition: as long as the
 			 * guy calling us holds a reference to the fs,
@@ -251,11 +510,35 @@ vfs_getdevname(struct fs *fs)
 		}
 	}
 
-	lock_release(knowndevs_lock);
+	rwlock_release_read(knowndevs_lock);
 
 	return NULL;
 }
 
+/*
+ * Add the VFS-level counters, and those of each mounted filesystem
+ * that has any, to a kstat snapshot. The read lock keeps the
+ * filesystems from being unmounted meanwhile.
+ */
+void
+vfs_kstat(struct kstat *ks)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	vfs_ncache_kstat(ks);
+
+	rwlock_acquire_read(knowndevs_lock);
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (KD_HASFS(kd) && kd->kd_fs->fs_ops->fsop_kstat != NULL) {
+			FSOP_KSTAT(kd->kd_fs, ks);
+		}
+	}
+	rwlock_release_read(knowndevs_lock);
+}
+
 /*
  * Assemble the name for a raw device from the name for the regular device.
  */
@@ -313,13 +596,13 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(lock_do_i_hold(knowndevs_lock));
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
 
-		if (kd->kd_fs != NULL && kd->kd_fs != SWAP_FS) {
+		if (KD_HASFS(kd)) {
 			volname = FSOP_GETVOLNAME(kd->kd_fs);
 			if (samestring3(volname, n1, n2, n3)) {
 				return 1;
@@ -350,7 +633,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	struct knowndev *kd=NULL;
 	struct vnode *vnode=NULL;
 	const char *volname=NULL;
-	unsigned index;
+	unsigned index, i;
 	int result;
 
 	name = kstrdup(dname);
@@ -383,12 +666,17 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	for (i=0; i<KD_NNAMES; i++) {
+		kd->kd_names[i].mn_next = NULL;
+		kd->kd_names[i].mn_name = NULL;
+		kd->kd_names[i].mn_vnode = NULL;
+	}
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 	if (badnames(name, rawname, volname)) {
 		result = EEXIST;
@@ -400,16 +688,23 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		goto fail_unlock;
 	}
 
+	result = kd_publish(kd);
+	if (result) {
+		/* it's the last one */
+		knowndevarray_remove(knowndevs, index);
+		goto fail_unlock;
+	}
+
 	if (dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
 		dev->d_devnumber = index+1;
 	}
 
-	lock_release(knowndevs_lock);
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 
  fail_unlock:
-	lock_release(knowndevs_lock);
+	rwlock_release_write(knowndevs_lock);
 
  fail:
 	if (name) {
@@ -463,7 +758,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(lock_do_i_hold(knowndevs_lock));
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -482,6 +777,57 @@ findmount(const char *devname, struct knowndev **result)
 	return found ? 0 : ENODEV;
 }
 
+/*
+ * Choose the I/O scheduler policy (see iosched.h) for the mountable
+ * device DEVNAME. Fails with EINVAL if the device doesn't queue
+ * requests or there's no such policy.
+ */
+int
+vfs_setiosched(const char *devname, const char *policy)
+{
+	struct knowndev *kd;
+	int result;
+
+	rwlock_acquire_write(knowndevs_lock);
+	result = findmount(devname, &kd);
+	if (result == 0) {
+		if (kd->kd_device->d_iosched == NULL) {
+			result = EINVAL;
+		}
+		else {
+			result = iosched_setpolicy(kd->kd_device->d_iosched,
+						   policy);
+		}
+	}
+	rwlock_release_write(knowndevs_lock);
+	return result;
+}
+
+/*
+ * Give the filesystem mounted on DEVNAME a share of the buffer
+ * cache. Fails with EINVAL if nothing is mounted there.
+ */
+int
+vfs_setbufshare(const char *devname, unsigned minpct, unsigned maxpct)
+{
+	struct knowndev *kd;
+	int result;
+
+	rwlock_acquire_read(knowndevs_lock);
+	result = findmount(devname, &kd);
+	if (result == 0) {
+		if (kd->kd_fs == NULL) {
+			result = EINVAL;
+		}
+		else {
+			result = buffer_set_fs_share(kd->kd_fs, minpct,
+						     maxpct);
+		}
+	}
+	rwlock_release_read(knowndevs_lock);
+	return result;
+}
+
 /*
  * Mount a filesystem. Once we've found the device, call MOUNTFUNC to
  * set up the filesystem and hand back a struct fs.
@@ -497,7 +843,7 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 
 	result = findmount(devname, &kd);
@@ -519,8 +865,18 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 	KASSERT(fs != SWAP_FS); 
+	KASSERT(fs != CLAIMED_FS);
 
+	kd_unpublish(kd);
 	kd->kd_fs = fs;
+	result = kd_publish(kd);
+	if (result) {
+		/* nothing can have it open yet */
+		FSOP_UNMOUNT(fs);
+		kd->kd_fs = NULL;
+		kd_publish(kd);
+		goto fail;
+	}
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -529,7 +885,7 @@ vfs_mount(const char *devname, void *data,
 	KASSERT(result==0);
 
  fail:
-	lock_release(knowndevs_lock);
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -557,7 +913,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-    lock_acquire(knowndevs_lock);
+    rwlock_acquire_write(knowndevs_lock);
 	result = findmount(devname, &kd);
 	if (result) {
 		goto out;
@@ -577,7 +933,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-    lock_release(knowndevs_lock);
+    rwlock_release_write(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -585,6 +941,85 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	return result;
 }
 
+/*
+ * Claim a mountable device for use by another device (e.g. as a
+ * RAID member), handing back the device. A claimed device can't be
+ * mounted or used for swap until released with vfs_unclaimdev.
+ */
+int
+vfs_claimdev(const char *devname, struct device **ret)
+{
+	struct knowndev *kd;
+	int result;
+
+	rwlock_acquire_write(knowndevs_lock);
+
+	result = findmount(devname, &kd);
+	if (result) {
+		goto fail;
+	}
+
+	if (kd->kd_fs != NULL) {
+		result = EBUSY;
+		goto fail;
+	}
+	KASSERT(kd->kd_rawname != NULL);
+	KASSERT(kd->kd_device != NULL);
+
+	kd->kd_fs = CLAIMED_FS;
+	*ret = kd->kd_device;
+
+	KASSERT(result==0);
+
+ fail:
+	rwlock_release_write(knowndevs_lock);
+	return result;
+}
+
+/*
+ * Undo vfs_claimdev.
+ */
+void
+vfs_unclaimdev(const char *devname)
+{
+	struct knowndev *kd;
+	int result;
+
+	rwlock_acquire_write(knowndevs_lock);
+	result = findmount(devname, &kd);
+	KASSERT(result == 0);
+	KASSERT(kd->kd_fs == CLAIMED_FS);
+	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
+}
+
+/*
+ * Unmount KD's filesystem, which should already be synced. Its names
+ * come out of the lookup table first, so they don't hold its root
+ * busy, and go back afterwards, whether the unmount worked or not.
+ */
+static
+int
+vfs_dounmount(struct knowndev *kd)
+{
+	int result, result2;
+
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
+	KASSERT(KD_HASFS(kd));
+
+	kd_unpublish(kd);
+	result = FSOP_UNMOUNT(kd->kd_fs);
+	if (result == 0) {
+		kd->kd_fs = NULL;
+	}
+	result2 = kd_publish(kd);
+	if (result2) {
+		kprintf("vfs: Warning: %s: can't be looked up: %s\n",
+			kd->kd_name, strerror(result2));
+	}
+	return result;
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -595,7 +1030,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 
 	result = findmount(devname, &kd);
@@ -603,7 +1038,7 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	if (kd->kd_fs == NULL || kd->kd_fs == SWAP_FS) {
+	if (!KD_HASFS(kd)) {
 		result = EINVAL;
 		goto fail;
 	}
@@ -616,20 +1051,15 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	result = FSOP_UNMOUNT(kd->kd_fs);
+	result = vfs_dounmount(kd);
 	if (result) {
 		goto fail;
 	}
 
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
 
-	/* now drop the filesystem */
-	kd->kd_fs = NULL;
-
-	KASSERT(result==0);
-
  fail:
-	lock_release(knowndevs_lock);
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -646,7 +1076,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-    lock_acquire(knowndevs_lock);
+    rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -666,7 +1096,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-    lock_release(knowndevs_lock);
+    rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -680,7 +1110,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	lock_acquire(knowndevs_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -698,6 +1128,10 @@ vfs_unmountall(void)
 			dev->kd_fs = NULL;
 			continue;
 		}
+		if (dev->kd_fs == CLAIMED_FS) {
+			/* belongs to another device; leave it alone */
+			continue;
+		}
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
@@ -719,7 +1153,7 @@ vfs_unmountall(void)
 			}
 		}
 
-		result = FSOP_UNMOUNT(dev->kd_fs);
+		result = vfs_dounmount(dev);
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n",
 				dev->kd_name);
@@ -731,12 +1165,9 @@ vfs_unmountall(void)
 				dev->kd_name, strerror(result));
 			continue;
 		}
-
-		/* now drop the filesystem */
-		dev->kd_fs = NULL;
 	}
 
-	lock_release(knowndevs_lock);
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
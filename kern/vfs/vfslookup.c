@@ -35,7 +35,9 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <stat.h>
 #include <synch.h>
+#include <proc.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
@@ -43,6 +45,14 @@
 static struct vnode *bootfs_vnode = NULL;
 static struct lock *bootfs_lock = NULL;
 
+/*
+ * Name given to vfs_deferbootfs and not looked up yet (protected by
+ * bootfs_lock). bootfs_deferred is for checking without the lock; it
+ * only goes from true to false after boot.
+ */
+static char bootfs_pending[NAME_MAX+1];
+static volatile bool bootfs_deferred = false;
+
 void
 vfs_initbootfs(void)
 {
@@ -64,6 +74,8 @@ change_bootfs(struct vnode *newvn)
 	lock_acquire(bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	bootfs_pending[0] = 0;
+	bootfs_deferred = false;
 	lock_release(bootfs_lock);
 
 	if (oldvn != NULL) {
@@ -114,6 +126,90 @@ vfs_setbootfs(const char *fsname)
 	return 0;
 }
 
+/*
+ * Resolve the deferred bootfs. Called with bootfs_lock held.
+ *
+ * This does what vfs_setbootfs does, except that the current
+ * directory it sets is the kernel process's, since the caller may be
+ * any process, and only if it doesn't already have one.
+ */
+static
+void
+bind_bootfs(void)
+{
+	struct vnode *vn;
+	mode_t vtype;
+	int result;
+
+	KASSERT(lock_do_i_hold(bootfs_lock));
+
+	if (bootfs_pending[0] == 0) {
+		return;
+	}
+	result = vfs_getroot(bootfs_pending, &vn);
+	bootfs_pending[0] = 0;
+	bootfs_deferred = false;
+	if (result) {
+		return;
+	}
+	result = VOP_GETTYPE(vn, &vtype);
+	if (result || vtype != S_IFDIR) {
+		VOP_DECREF(vn);
+		return;
+	}
+
+	KASSERT(bootfs_vnode == NULL);
+	bootfs_vnode = vn;
+
+	VOP_INCREF(vn);
+	spinlock_acquire(&kproc->p_lock);
+	if (kproc->p_cwd == NULL) {
+		kproc->p_cwd = vn;
+		vn = NULL;
+	}
+	spinlock_release(&kproc->p_lock);
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Set the bootfs, but only look it up when it's first needed. This
+ * is for boot: it keeps the lookup (and, for a filesystem that isn't
+ * always resident, the work of reaching its root) off the path to
+ * the menu.
+ */
+void
+vfs_deferbootfs(const char *fsname)
+{
+	size_t len;
+
+	change_bootfs(NULL);
+
+	lock_acquire(bootfs_lock);
+	snprintf(bootfs_pending, sizeof(bootfs_pending), "%s", fsname);
+	len = strlen(bootfs_pending);
+	if (len > 0 && bootfs_pending[len-1] == ':') {
+		bootfs_pending[len-1] = 0;
+	}
+	bootfs_deferred = bootfs_pending[0] != 0;
+	lock_release(bootfs_lock);
+}
+
+/*
+ * Look up the deferred bootfs now, if there is one.
+ */
+void
+vfs_bindbootfs(void)
+{
+	if (!bootfs_deferred) {
+		return;
+	}
+	lock_acquire(bootfs_lock);
+	bind_bootfs();
+	lock_release(bootfs_lock);
+}
+
 /*
  * Clear the bootfs vnode (preparatory to system shutdown).
  */
@@ -131,7 +227,7 @@ vfs_clearbootfs(void)
 
 static
 int
-getdevice(char *path, char **subpath, struct vnode **startvn)
+getdevice(const char *path, const char **subpath, struct vnode **startvn)
 {
 	int slash=-1, colon=-1, i;
 	struct vnode *vn;
@@ -166,18 +262,17 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 
 	if (colon>0) {
 		/* device:path - get root of device's filesystem */
-		path[colon]=0;
+		result = vfs_getrootn(path, colon, startvn);
+		if (result) {
+			return result;
+		}
+
 		while (path[colon+1]=='/') {
 			/* device:/path - skip slash, treat as device:path */
 			colon++;
 		}
 		*subpath = &path[colon+1];
 
-		result = vfs_getroot(path, startvn);
-		if (result) {
-			return result;
-		}
-
 		return 0;
 	}
 
@@ -191,6 +286,7 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 
 	if (path[0]=='/') {
 		lock_acquire(bootfs_lock);
+		bind_bootfs();
 		if (bootfs_vnode==NULL) {
 			lock_release(bootfs_lock);
 			return ENOENT;
@@ -238,7 +334,7 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
  */
 
 int
-vfs_lookparent(char *path, struct vnode **retval,
+vfs_lookparent(const char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
 	struct vnode *startvn;
@@ -266,7 +362,7 @@ vfs_lookparent(char *path, struct vnode **retval,
 }
 
 int
-vfs_lookup(char *path, struct vnode **retval)
+vfs_lookup(const char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
 	int result;
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Directory name cache.
+ *
+ * This remembers the results of recent single-component lookups,
+ * (directory, name) -> vnode, so that walking a familiar path does
+ * not have to lock each directory and scan its entries. A lookup
+ * that found nothing is remembered too (a "negative" entry, with a
+ * null vnode), since repeatedly probing for files that aren't there
+ * is common.
+ *
+ * The cache does not hold references on the vnodes it names. That
+ * would keep every recently looked-up file alive forever. Instead
+ * the filesystem calls vfs_ncache_purge_vnode from its reclaim
+ * routine, before it decides the vnode is really unused; a lookup
+ * that hits in the cache takes its reference under the cache lock,
+ * so either the lookup gets its reference first and reclaim sees
+ * it and backs off, or the entry is already gone.
+ *
+ * Filesystems enter names after a lookup and purge them whenever a
+ * directory changes, in both cases while holding the directory's
+ * own lock, so an entry can never be entered from a stale scan.
+ *
+ * Locking: ncache_lock protects everything here. References are
+ * taken under it with VOP_INCREF, which doesn't lock anything.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <kstat.h>
+
+/* Number of entries; names longer than NCACHE_NAMELEN aren't cached */
+#define NCACHE_SIZE		512
+#define NCACHE_HASHBITS		8
+#define NCACHE_NHASH		(1U << NCACHE_HASHBITS)
+#define NCACHE_NAMELEN		32
+
+#define NC_NONE			((unsigned)-1)
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory; NULL if slot unused */
+	struct vnode *nc_vn;		/* result; NULL for negative entry */
+	unsigned nc_hashnext;		/* next in hash chain */
+	unsigned nc_lruprev;		/* LRU list, most recent first */
+	unsigned nc_lrunext;
+	uint32_t nc_hash;
+	char nc_name[NCACHE_NAMELEN + 1];
+};
+
+static struct spinlock ncache_lock = SPINLOCK_INITIALIZER;
+static struct ncentry ncache[NCACHE_SIZE];
+static unsigned ncache_hash[NCACHE_NHASH];
+static unsigned ncache_lruhead, ncache_lrutail;
+
+/* Statistics. */
+static unsigned ncache_hits, ncache_neghits, ncache_misses;
+
+////////////////////////////////////////////////////////////
+// internals
+
+/*
+ * Hash a directory and a name (FNV-1a over the name, seeded with the
+ * directory's address).
+ */
+static
+uint32_t
+ncache_hashname(struct vnode *dir, const char *name)
+{
+	uint32_t h;
+
+	h = 2166136261U ^ (uint32_t)(uintptr_t)dir;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static
+void
+ncache_lru_remove(unsigned ix)
+{
+	struct ncentry *nc = &ncache[ix];
+
+	if (nc->nc_lruprev == NC_NONE) {
+		ncache_lruhead = nc->nc_lrunext;
+	}
+	else {
+		ncache[nc->nc_lruprev].nc_lrunext = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext == NC_NONE) {
+		ncache_lrutail = nc->nc_lruprev;
+	}
+	else {
+		ncache[nc->nc_lrunext].nc_lruprev = nc->nc_lruprev;
+	}
+}
+
+static
+void
+ncache_lru_addhead(unsigned ix)
+{
+	struct ncentry *nc = &ncache[ix];
+
+	nc->nc_lruprev = NC_NONE;
+	nc->nc_lrunext = ncache_lruhead;
+	if (ncache_lruhead == NC_NONE) {
+		ncache_lrutail = ix;
+	}
+	else {
+		ncache[ncache_lruhead].nc_lruprev = ix;
+	}
+	ncache_lruhead = ix;
+}
+
+/*
+ * Find the entry for DIR/NAME and return its index, or NC_NONE.
+ */
+static
+unsigned
+ncache_find(struct vnode *dir, const char *name, uint32_t hash)
+{
+	unsigned ix;
+	struct ncentry *nc;
+
+	ix = ncache_hash[hash & (NCACHE_NHASH - 1)];
+	while (ix != NC_NONE) {
+		nc = &ncache[ix];
+		if (nc->nc_hash == hash && nc->nc_dir == dir &&
+		    !strcmp(nc->nc_name, name)) {
+			return ix;
+		}
+		ix = nc->nc_hashnext;
+	}
+	return NC_NONE;
+}
+
+/*
+ * Take an entry off its hash chain and mark it unused. It stays on
+ * the LRU list; unused entries are moved to the tail so they get
+ * reused first.
+ */
+static
+void
+ncache_drop(unsigned ix)
+{
+	struct ncentry *nc = &ncache[ix];
+	unsigned *pp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	pp = &ncache_hash[nc->nc_hash & (NCACHE_NHASH - 1)];
+	while (*pp != ix) {
+		KASSERT(*pp != NC_NONE);
+		pp = &ncache[*pp].nc_hashnext;
+	}
+	*pp = nc->nc_hashnext;
+
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc->nc_hashnext = NC_NONE;
+
+	ncache_lru_remove(ix);
+	nc->nc_lrunext = NC_NONE;
+	nc->nc_lruprev = ncache_lrutail;
+	if (ncache_lrutail == NC_NONE) {
+		ncache_lruhead = ix;
+	}
+	else {
+		ncache[ncache_lrutail].nc_lrunext = ix;
+	}
+	ncache_lrutail = ix;
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+/*
+ * Set up the (initially empty) cache.
+ */
+void
+vfs_ncache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NCACHE_NHASH; i++) {
+		ncache_hash[i] = NC_NONE;
+	}
+	ncache_lruhead = ncache_lrutail = NC_NONE;
+	for (i=0; i<NCACHE_SIZE; i++) {
+		ncache[i].nc_dir = NULL;
+		ncache[i].nc_vn = NULL;
+		ncache[i].nc_hashnext = NC_NONE;
+		ncache[i].nc_name[0] = 0;
+		ncache_lru_addhead(i);
+	}
+	ncache_hits = ncache_neghits = ncache_misses = 0;
+}
+
+/*
+ * Look up NAME in DIR. Returns true if the cache knows the answer,
+ * in which case *RET is set to a new reference to the vnode, or to
+ * NULL if the name is known not to exist.
+ */
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	uint32_t hash;
+	unsigned ix;
+
+	if (strlen(name) > NCACHE_NAMELEN) {
+		return false;
+	}
+	hash = ncache_hashname(dir, name);
+
+	spinlock_acquire(&ncache_lock);
+	ix = ncache_find(dir, name, hash);
+	if (ix == NC_NONE) {
+		ncache_misses++;
+		spinlock_release(&ncache_lock);
+		return false;
+	}
+	*ret = ncache[ix].nc_vn;
+	if (*ret != NULL) {
+		VOP_INCREF(*ret);
+		ncache_hits++;
+	}
+	else {
+		ncache_neghits++;
+	}
+	if (ncache_lruhead != ix) {
+		ncache_lru_remove(ix);
+		ncache_lru_addhead(ix);
+	}
+	spinlock_release(&ncache_lock);
+	return true;
+}
+
+/*
+ * Remember that NAME in DIR is VN (or doesn't exist, if VN is NULL).
+ * The caller must hold whatever lock protects DIR's contents.
+ */
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *nc;
+	uint32_t hash;
+	unsigned ix, b;
+
+	if (strlen(name) > NCACHE_NAMELEN) {
+		return;
+	}
+	hash = ncache_hashname(dir, name);
+
+	spinlock_acquire(&ncache_lock);
+	ix = ncache_find(dir, name, hash);
+	if (ix == NC_NONE) {
+		/* Recycle the least recently used entry. */
+		ix = ncache_lrutail;
+		KASSERT(ix != NC_NONE);
+		if (ncache[ix].nc_dir != NULL) {
+			ncache_drop(ix);
+		}
+		nc = &ncache[ix];
+		nc->nc_dir = dir;
+		nc->nc_hash = hash;
+		strcpy(nc->nc_name, name);
+		b = hash & (NCACHE_NHASH - 1);
+		nc->nc_hashnext = ncache_hash[b];
+		ncache_hash[b] = ix;
+	}
+	nc = &ncache[ix];
+	nc->nc_vn = vn;
+	if (ncache_lruhead != ix) {
+		ncache_lru_remove(ix);
+		ncache_lru_addhead(ix);
+	}
+	spinlock_release(&ncache_lock);
+}
+
+/*
+ * Forget NAME in DIR. Call after changing the directory entry, while
+ * still holding the directory's lock.
+ */
+void
+vfs_ncache_purge(struct vnode *dir, const char *name)
+{
+	unsigned ix;
+
+	if (strlen(name) > NCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&ncache_lock);
+	ix = ncache_find(dir, name, ncache_hashname(dir, name));
+	if (ix != NC_NONE) {
+		ncache_drop(ix);
+	}
+	spinlock_release(&ncache_lock);
+}
+
+/*
+ * Forget every entry that mentions VN, either as the directory or
+ * as the result. This is a linear scan; it is called when a vnode is
+ * about to be reclaimed or a directory is removed.
+ */
+void
+vfs_ncache_purge_vnode(struct vnode *vn)
+{
+	unsigned i;
+
+	spinlock_acquire(&ncache_lock);
+	for (i=0; i<NCACHE_SIZE; i++) {
+		if (ncache[i].nc_dir == NULL) {
+			continue;
+		}
+		if (ncache[i].nc_dir == vn || ncache[i].nc_vn == vn) {
+			ncache_drop(i);
+		}
+	}
+	spinlock_release(&ncache_lock);
+}
+
+/*
+ * Print the hit rate.
+ */
+void
+vfs_ncache_printstats(void)
+{
+	unsigned hits, neghits, misses, used, i;
+
+	spinlock_acquire(&ncache_lock);
+	hits = ncache_hits;
+	neghits = ncache_neghits;
+	misses = ncache_misses;
+	used = 0;
+	for (i=0; i<NCACHE_SIZE; i++) {
+		if (ncache[i].nc_dir != NULL) {
+			used++;
+		}
+	}
+	spinlock_release(&ncache_lock);
+
+	kprintf("name cache: %u/%u entries; %u hits, %u negative hits, "
+		"%u misses\n", used, NCACHE_SIZE, hits, neghits, misses);
+}
+
+void
+vfs_ncache_kstat(struct kstat *ks)
+{
+	unsigned hits, neghits, misses;
+
+	spinlock_acquire(&ncache_lock);
+	hits = ncache_hits;
+	neghits = ncache_neghits;
+	misses = ncache_misses;
+	spinlock_release(&ncache_lock);
+
+	kstat_add(ks, "vfs.ncache.hits", hits);
+	kstat_add(ks, "vfs.ncache.neghits", neghits);
+	kstat_add(ks, "vfs.ncache.misses", misses);
+}
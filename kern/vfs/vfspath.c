@@ -42,7 +42,7 @@
 
 /* Does most of the work for open(). */
 int
-vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
+vfs_open(const char *path, int openflags, mode_t mode, struct vnode **ret)
 {
 	int how;
 	int result;
@@ -134,7 +134,7 @@ vfs_close(struct vnode *vn)
 
 /* Does most of the work for remove(). */
 int
-vfs_remove(char *path)
+vfs_remove(const char *path)
 {
 	struct vnode *dir;
 	char name[NAME_MAX+1];
@@ -153,7 +153,7 @@ vfs_remove(char *path)
 
 /* Does most of the work for rename(). */
 int
-vfs_rename(char *oldpath, char *newpath)
+vfs_rename(const char *oldpath, const char *newpath)
 {
 	struct vnode *olddir;
 	char oldname[NAME_MAX+1];
@@ -188,7 +188,7 @@ vfs_rename(char *oldpath, char *newpath)
 
 /* Does most of the work for link(). */
 int
-vfs_link(char *oldpath, char *newpath)
+vfs_link(const char *oldpath, const char *newpath)
 {
 	struct vnode *oldfile;
 	struct vnode *newdir;
@@ -228,7 +228,7 @@ vfs_link(char *oldpath, char *newpath)
  * support for symlinks.
  */
 int
-vfs_symlink(const char *contents, char *path)
+vfs_symlink(const char *contents, const char *path)
 {
 	struct vnode *newdir;
 	char newname[NAME_MAX+1];
@@ -253,7 +253,7 @@ vfs_symlink(const char *contents, char *path)
  * support for symlinks.
  */
 int
-vfs_readlink(char *path, struct uio *uio)
+vfs_readlink(const char *path, struct uio *uio)
 {
 	struct vnode *vn;
 	int result;
@@ -274,7 +274,7 @@ vfs_readlink(char *path, struct uio *uio)
  * Does most of the work for mkdir.
  */
 int
-vfs_mkdir(char *path, mode_t mode)
+vfs_mkdir(const char *path, mode_t mode)
 {
 	struct vnode *parent;
 	char name[NAME_MAX+1];
@@ -296,7 +296,7 @@ vfs_mkdir(char *path, mode_t mode)
  * Does most of the work for rmdir.
  */
 int
-vfs_rmdir(char *path)
+vfs_rmdir(const char *path)
 {
 	struct vnode *parent;
 	char name[NAME_MAX+1];
@@ -32,10 +32,18 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/dirent.h>
+#include <kern/seek.h>
+#include <limits.h>
 #include <lib.h>
+#include <atomic.h>
+#include <uio.h>
+#include <stat.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <pagecache.h>
+#include <addrspace.h>
 
 /*
  * Initialize an abstract vnode.
@@ -52,6 +60,8 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_pcpages = NULL;
+	vn->vn_elf = NULL;
 	return 0;
 }
 
@@ -63,6 +73,7 @@ vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount == 1);
 
+	vnode_dropcaches(vn);
 	spinlock_cleanup(&vn->vn_countlock);
 
 	vn->vn_ops = NULL;
@@ -71,48 +82,48 @@ vnode_cleanup(struct vnode *vn)
 	vn->vn_data = NULL;
 }
 
+void
+vnode_dropcaches(struct vnode *vn)
+{
+	pagecache_purge(vn);
+	load_elf_uncache(vn);
+}
+
 
 /*
  * Increment refcount.
  * Called by VOP_INCREF.
+ *
+ * The caller must already hold a reference, or have found the vnode
+ * under a lock its reclaim routine takes, so the count can't be zero.
  */
 void
 vnode_incref(struct vnode *vn)
 {
+	bool ok;
+
 	KASSERT(vn != NULL);
 
-	spinlock_acquire(&vn->vn_countlock);
-	vn->vn_refcount++;
-	spinlock_release(&vn->vn_countlock);
+	ok = atomic_inc_not_zero(&vn->vn_refcount);
+	KASSERT(ok);
+	(void)ok;
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
- * Calls VOP_RECLAIM if the refcount hits zero.
+ * Calls VOP_RECLAIM instead if this is the last reference.
  */
 void
 vnode_decref(struct vnode *vn)
 {
-	bool destroy;
 	int result;
 
 	KASSERT(vn != NULL);
+	KASSERT(atomic_get(&vn->vn_refcount) > 0);
 
-	spinlock_acquire(&vn->vn_countlock);
-
-	KASSERT(vn->vn_refcount > 0);
-	if (vn->vn_refcount > 1) {
-		vn->vn_refcount--;
-		destroy = false;
-	}
-	else {
+	if (!atomic_add_unless(&vn->vn_refcount, -1, 1)) {
 		/* Don't decrement; pass the reference to VOP_RECLAIM. */
-		destroy = true;
-	}
-	spinlock_release(&vn->vn_countlock);
-
-	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -122,6 +133,16 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * For VOP_RECLAIM: see whether the reference passed in is still the
+ * only one. If not, drop it.
+ */
+bool
+vnode_lastref(struct vnode *vn)
+{
+	return !atomic_add_unless(&vn->vn_refcount, -1, 1);
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
@@ -129,6 +150,8 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
+	unsigned count;
+
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -156,19 +179,121 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	spinlock_acquire(&v->vn_countlock);
-
-	if (v->vn_refcount < 0) {
+	count = atomic_get(&v->vn_refcount);
+	if (count == 0) {
+		panic("vnode_check: vop_%s: zero refcount\n", opstr);
+	}
+	else if (count > 0x80000000) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
+		      (int)count);
 	}
-	else if (v->vn_refcount == 0) {
-		panic("vnode_check: vop_%s: zero refcount\n", opstr);
+	else if (count > 0x100000) {
+		kprintf("vnode_check: vop_%s: warning: large refcount %u\n",
+			opstr, count);
 	}
-	else if (v->vn_refcount > 0x100000) {
-		kprintf("vnode_check: vop_%s: warning: large refcount %d\n",
-			opstr, v->vn_refcount);
+}
+
+/*
+ * Append a directory record to UIO for vop_getdirentries.
+ */
+int
+vnode_putdirent(struct uio *uio, uint32_t ino, unsigned type,
+		const char *name, size_t namelen)
+{
+	static const char zeros[4];
+	struct dirent d;
+	size_t reclen;
+	int result;
+
+	KASSERT(namelen <= NAME_MAX);
+	reclen = DIRENT_RECLEN(namelen);
+	if (reclen > uio->uio_resid) {
+		return ENOSPC;
 	}
 
-	spinlock_release(&v->vn_countlock);
+	d.d_ino = ino;
+	d.d_reclen = reclen;
+	d.d_type = type;
+	d.d_namlen = namelen;
+
+	result = uiomove(&d, sizeof(d), uio);
+	if (result) {
+		return result;
+	}
+	result = uiomove((char *)name, namelen, uio);
+	if (result) {
+		return result;
+	}
+	/* the null terminator, and padding up to the next record */
+	return uiomove((char *)zeros, reclen - sizeof(d) - namelen, uio);
+}
+
+/*
+ * vop_getdirentries for filesystems that only know how to hand out
+ * one name at a time.
+ *
+ * An entry that doesn't fit is read again on the next call: the
+ * directory offset from before reading it is put back. That offset
+ * came from the filesystem, so this is legitimate even though its
+ * meaning is the filesystem's business.
+ */
+int
+vnode_getdirentries_generic(struct vnode *dir, struct uio *uio)
+{
+	char name[NAME_MAX + 1];
+	struct iovec iov;
+	struct uio nameuio;
+	off_t pos;
+	size_t startresid, len;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	startresid = uio->uio_resid;
+	pos = uio->uio_offset;
+
+	while (1) {
+		uio_kinit(&iov, &nameuio, name, NAME_MAX, pos, UIO_READ);
+		result = VOP_GETDIRENTRY(dir, &nameuio);
+		if (result) {
+			break;
+		}
+		len = NAME_MAX - nameuio.uio_resid;
+		if (len == 0) {
+			/* end of directory */
+			break;
+		}
+		result = vnode_putdirent(uio, 0, DT_UNKNOWN, name, len);
+		if (result == ENOSPC) {
+			result = uio->uio_resid < startresid ? 0 : EINVAL;
+			break;
+		}
+		if (result) {
+			break;
+		}
+		pos = nameuio.uio_offset;
+	}
+
+	uio->uio_offset = pos;
+	return result;
+}
+
+/*
+ * vop_seekhole for files that are all data.
+ */
+int
+vnode_seekhole_generic(struct vnode *file, int whence, off_t pos,
+		       off_t *result)
+{
+	struct stat st;
+	int err;
+
+	err = VOP_STAT(file, &st);
+	if (err) {
+		return err;
+	}
+	if (pos < 0 || pos >= st.st_size) {
+		return ENXIO;
+	}
+	*result = whence == SEEK_DATA ? pos : st.st_size;
+	return 0;
 }
@@ -27,18 +27,103 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <synch.h>
 #include <proc.h>
+#include <vnode.h>
+#include <shm.h>
+#include <clock.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
  * used. The cheesy hack versions in dumbvm.c are used instead.
+ *
+ * Physical pages are not allocated when regions are defined; each
+ * page is allocated (and zeroed) by vm_fault the first time it's
+ * touched, and recorded in the page table; pages of file-backed
+ * regions are read in from the file at that point, or shared with
+ * the page cache. as_copy shares
+ * pages copy-on-write instead of copying them, except for pages of
+ * shared segments, which stay shared.
+ */
+
+/*
+ * Add a region to AS, keeping the list sorted, and hand it back in
+ * RET if that isn't NULL. Fails with EINVAL if it would overlap an
+ * existing region. Only the heap is ever empty.
+ */
+static
+int
+region_add(struct addrspace *as, vaddr_t vbase, size_t npages,
+	   unsigned perms, struct as_region **ret)
+{
+	struct as_region *reg, **pp;
+	vaddr_t vtop;
+
+	vtop = vbase + npages * PAGE_SIZE;
+	if (vtop < vbase || vtop > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->ar_next) {
+		reg = *pp;
+		if (vtop <= reg->ar_vbase) {
+			break;
+		}
+		if (vbase < reg->ar_vbase + reg->ar_npages * PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+
+	reg = kmalloc(sizeof(*reg));
+	if (reg == NULL) {
+		return ENOMEM;
+	}
+	reg->ar_vbase = vbase;
+	reg->ar_npages = npages;
+	reg->ar_perms = perms;
+	reg->ar_vnode = NULL;
+	reg->ar_fileoff = 0;
+	reg->ar_fileva = 0;
+	reg->ar_filesize = 0;
+	reg->ar_shm = NULL;
+	reg->ar_mapped = false;
+	reg->ar_kpage = 0;
+	reg->ar_advice = MADV_NORMAL;
+	reg->ar_next = *pp;
+	*pp = reg;
+	if (ret != NULL) {
+		*ret = reg;
+	}
+	return 0;
+}
+
+/*
+ * Drop a region's file backing or shared segment, if any.
  */
+static
+void
+region_cleanup(struct as_region *reg)
+{
+	if (reg->ar_vnode != NULL) {
+		VOP_DECREF(reg->ar_vnode);
+		reg->ar_vnode = NULL;
+	}
+	if (reg->ar_shm != NULL) {
+		shm_decref(reg->ar_shm);
+		reg->ar_shm = NULL;
+	}
+}
 
 struct addrspace *
 as_create(void)
@@ -50,9 +135,22 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_lock = lock_create("as");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	as->as_loading = false;
+	as->as_heap = NULL;
+	as->as_heapbreak = 0;
+	mmu_ctx_init(&as->as_mmu, as->as_pt);
 
 	return as;
 }
@@ -61,17 +159,58 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct as_region *reg, *newreg;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	/* hold off faults by the old one's other threads, if any */
+	lock_acquire(old->as_lock);
+
+	for (reg = old->as_regions; reg != NULL; reg = reg->ar_next) {
+		result = region_add(newas, reg->ar_vbase, reg->ar_npages,
+				    reg->ar_perms, &newreg);
+		if (result) {
+			lock_release(old->as_lock);
+			as_destroy(newas);
+			return result;
+		}
+		if (reg == old->as_heap) {
+			newas->as_heap = newreg;
+		}
+		newreg->ar_mapped = reg->ar_mapped;
+		newreg->ar_kpage = reg->ar_kpage;
+		newreg->ar_advice = reg->ar_advice;
+		if (reg->ar_shm != NULL) {
+			/* pt_copy leaves its pages shared, not COW */
+			shm_incref(reg->ar_shm);
+			newreg->ar_shm = reg->ar_shm;
+		}
+		if (reg->ar_vnode != NULL) {
+			result = as_define_file(newas, reg->ar_fileva,
+						reg->ar_vnode,
+						reg->ar_fileoff,
+						reg->ar_filesize);
+			KASSERT(result == 0);
+		}
+	}
+
+	newas->as_heapbreak = old->as_heapbreak;
+
 	/*
-	 * Write this.
+	 * Pages are now shared copy-on-write, so the old address
+	 * space's writeable translations are stale.
 	 */
-
-	(void)old;
+	result = pt_copy(old->as_pt, newas->as_pt);
+	vm_shootdown_all(old);
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
 	*ret = newas;
 	return 0;
@@ -80,10 +219,17 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct as_region *reg;
 
+	while (as->as_regions != NULL) {
+		reg = as->as_regions;
+		as->as_regions = reg->ar_next;
+		region_cleanup(reg);
+		kfree(reg);
+	}
+	mmu_ctx_destroy(&as->as_mmu);
+	pt_destroy(as->as_pt);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -102,77 +248,114 @@ as_activate(void)
 	}
 
 	/*
-	 * Write this.
+	 * No flush: AS's translations are tagged with its ASID, and
+	 * the shootdowns sent to every cpu where that is current have
+	 * kept them up to date, so whatever of them is still in the
+	 * TLB is good.
 	 */
+	mmu_activate(&as->as_mmu);
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Translations are tagged with the address space's ASID, and
+	 * pages are only freed by as_destroy once nothing can run in
+	 * the address space any more. Its ASIDs aren't reused until
+	 * each cpu's next flush, so its leftover entries never match
+	 * anything. Just stop the refill handler using its page table.
 	 */
+	mmu_deactivate();
 }
 
 /*
- * Set up a segment at virtual address VADDR of size MEMSIZE. The
- * segment in memory extends from VADDR up to (but not including)
+ * Set up a region at virtual address VADDR of size MEMSIZE. The
+ * region in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the region. The
+ * MIPS TLB can't refuse reads or execution, so in practice only
+ * WRITEABLE is enforced.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	unsigned perms;
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	perms = 0;
+	if (readable) {
+		perms |= AR_READ;
+	}
+	if (writeable) {
+		perms |= AR_WRITE;
+	}
+	if (executable) {
+		perms |= AR_EXEC;
+	}
+
+	return region_add(as, vaddr, memsize / PAGE_SIZE, perms, NULL);
 }
 
+/*
+ * While loading, every region is writeable so load_elf can fill in
+ * text and read-only data.
+ */
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	as->as_loading = true;
 	return 0;
 }
 
+/*
+ * Loading is also when we find out where the heap goes: it starts out
+ * empty, just above the highest region so far.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	struct as_region *reg;
+	vaddr_t heapbase;
+	int result;
+
+	as->as_loading = false;
 
-	(void)as;
+	heapbase = 0;
+	for (reg = as->as_regions; reg != NULL; reg = reg->ar_next) {
+		heapbase = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+	}
+	result = region_add(as, heapbase, 0, AR_READ | AR_WRITE,
+			    &as->as_heap);
+	if (result) {
+		return result;
+	}
+	as->as_heapbreak = heapbase;
+
+	/* Drop writeable TLB entries for read-only pages. */
+	mmu_flush_ctx(&as->as_mmu);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = region_add(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			    VM_STACKPAGES, AR_READ | AR_WRITE, NULL);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -180,3 +363,580 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *vn,
+	       off_t offset, size_t filesize)
+{
+	struct as_region *reg;
+	vaddr_t regtop;
+
+	reg = as_findregion(as, vaddr);
+	if (reg == NULL) {
+		return EFAULT;
+	}
+	regtop = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+	if (filesize > regtop - vaddr) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(vn);
+	region_cleanup(reg);
+	reg->ar_vnode = vn;
+	reg->ar_fileoff = offset;
+	reg->ar_fileva = vaddr;
+	reg->ar_filesize = filesize;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES pages: the highest gap between two regions
+ * that's big enough, which is below the stack and well away from the
+ * program. Caller holds the lock.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct as_region *reg;
+	vaddr_t gapbase, gaptop, vaddr;
+
+	vaddr = 0;
+	for (reg = as->as_regions; reg != NULL && reg->ar_next != NULL;
+	     reg = reg->ar_next) {
+		gapbase = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+		gaptop = reg->ar_next->ar_vbase;
+		if (gaptop - gapbase >= npages * PAGE_SIZE) {
+			vaddr = gaptop - npages * PAGE_SIZE;
+		}
+	}
+	if (vaddr == 0) {
+		return ENOMEM;
+	}
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *vn, off_t offset, size_t len,
+	int writeable, vaddr_t *ret)
+{
+	struct as_region *reg;
+	vaddr_t vaddr;
+	size_t npages;
+	unsigned perms;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	result = VOP_MMAP(vn);
+	if (result) {
+		return result;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	perms = AR_READ;
+	if (writeable) {
+		perms |= AR_WRITE;
+	}
+
+	lock_acquire(as->as_lock);
+	result = as_findgap(as, npages, &vaddr);
+	if (result == 0) {
+		result = region_add(as, vaddr, npages, perms, &reg);
+	}
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+	reg->ar_mapped = true;
+	/* Whole pages, so they all come from the page cache. */
+	result = as_define_file(as, vaddr, vn, offset, npages * PAGE_SIZE);
+	KASSERT(result == 0);
+	lock_release(as->as_lock);
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_mmapanon(struct addrspace *as, size_t len, int writeable, int shared,
+	    vaddr_t *ret)
+{
+	struct as_region *reg;
+	struct shm *shm;
+	vaddr_t vaddr;
+	size_t npages;
+	unsigned perms;
+	int result;
+
+	if (len == 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	perms = AR_READ;
+	if (writeable) {
+		perms |= AR_WRITE;
+	}
+
+	shm = NULL;
+	if (shared) {
+		shm = shm_create(npages);
+		if (shm == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	lock_acquire(as->as_lock);
+	result = as_findgap(as, npages, &vaddr);
+	if (result == 0) {
+		result = region_add(as, vaddr, npages, perms, &reg);
+	}
+	if (result) {
+		lock_release(as->as_lock);
+		if (shm != NULL) {
+			shm_decref(shm);
+		}
+		return result;
+	}
+	reg->ar_mapped = true;
+	reg->ar_shm = shm;
+	lock_release(as->as_lock);
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct as_region *reg, **pp;
+	vaddr_t va;
+	size_t npages;
+
+	if (vaddr % PAGE_SIZE != 0 || len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	lock_acquire(as->as_lock);
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->ar_next) {
+		if ((*pp)->ar_vbase == vaddr) {
+			break;
+		}
+	}
+	reg = *pp;
+	if (reg == NULL || !reg->ar_mapped || reg->ar_npages != npages) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	*pp = reg->ar_next;
+
+	for (va = vaddr; va < vaddr + npages * PAGE_SIZE; va += PAGE_SIZE) {
+		pt_unmap(as->as_pt, va);
+	}
+	vm_shootdown(as, vaddr, npages);
+	lock_release(as->as_lock);
+
+	region_cleanup(reg);
+	kfree(reg);
+	return 0;
+}
+
+int
+as_timepage(struct addrspace *as, vaddr_t *ret)
+{
+	struct as_region *reg;
+	paddr_t pa;
+	vaddr_t vaddr;
+	int result;
+
+	pa = timepage_paddr();
+
+	lock_acquire(as->as_lock);
+	for (reg = as->as_regions; reg != NULL; reg = reg->ar_next) {
+		if (reg->ar_kpage == pa) {
+			*ret = reg->ar_vbase;
+			lock_release(as->as_lock);
+			return 0;
+		}
+	}
+	result = as_findgap(as, 1, &vaddr);
+	if (result == 0) {
+		result = region_add(as, vaddr, 1, AR_READ, &reg);
+	}
+	if (result == 0) {
+		reg->ar_kpage = pa;
+		*ret = vaddr;
+	}
+	lock_release(as->as_lock);
+	return result;
+}
+
+void
+as_futexkey(struct addrspace *as, vaddr_t uaddr, const void **key,
+	    uintptr_t *off)
+{
+	struct as_region *reg;
+
+	lock_acquire(as->as_lock);
+	reg = as_findregion(as, uaddr);
+	if (reg != NULL && reg->ar_shm != NULL) {
+		/* the segment, not the address space, is the same */
+		*key = reg->ar_shm;
+		*off = uaddr - reg->ar_vbase;
+	}
+	else {
+		*key = as;
+		*off = uaddr;
+	}
+	lock_release(as->as_lock);
+}
+
+/*
+ * Check the range of LEN bytes at VADDR given to madvise and friends,
+ * handing back its length in pages: EINVAL if it isn't page-aligned
+ * or isn't user memory at all.
+ */
+static
+int
+as_checkrange(vaddr_t vaddr, size_t len, size_t *npages)
+{
+	if (vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+	    len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	*npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Check that every one of the NPAGES pages at VADDR is in a region.
+ * Caller holds the lock.
+ */
+static
+bool
+as_allmapped(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct as_region *reg;
+	vaddr_t va, top;
+
+	top = vaddr + npages * PAGE_SIZE;
+	for (va = vaddr; va < top;
+	     va = reg->ar_vbase + reg->ar_npages * PAGE_SIZE) {
+		reg = as_findregion(as, va);
+		if (reg == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * MADV_WILLNEED for the pages from START to END of REG: bring in the
+ * ones that are in swap, or would come from the region's file, while
+ * that doesn't mean paging anything else out. It's only a hint, so
+ * errors just stop it.
+ */
+static
+void
+as_willneed(struct addrspace *as, struct as_region *reg,
+	    vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+	paddr_t pa;
+	bool want;
+
+	if (reg->ar_kpage != 0 || reg->ar_shm != NULL) {
+		/* Never paged out. */
+		return;
+	}
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			want = reg->ar_vnode != NULL;
+		}
+		else {
+			want = (*pte & PTE_SWAPPED) != 0;
+		}
+		if (!want) {
+			continue;
+		}
+		if (!coremap_plenty(1) || vm_pagein(as, va, &pa) != 0) {
+			return;
+		}
+		coremap_unpin(pa);
+	}
+}
+
+/*
+ * MADV_DONTNEED for the pages from START to END of REG: throw them
+ * away, so that they start over from the file or zero-filled next
+ * time. Shared segments are left alone, since other processes still
+ * see their contents. Fails with EINVAL, partway, at a locked page.
+ */
+static
+int
+as_dontneed(struct addrspace *as, struct as_region *reg,
+	    vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+	int result;
+
+	if (reg->ar_kpage != 0 || reg->ar_shm != NULL) {
+		return 0;
+	}
+	result = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_LOCKED)) {
+			result = EINVAL;
+			break;
+		}
+		pt_unmap(as->as_pt, va);
+	}
+	if (va > start) {
+		vm_shootdown(as, start, (va - start) / PAGE_SIZE);
+	}
+	return result;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	struct as_region *reg;
+	vaddr_t start, end, top;
+	size_t npages;
+	int result;
+
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+	    case MADV_WILLNEED:
+	    case MADV_DONTNEED:
+		break;
+	    default:
+		return EINVAL;
+	}
+	result = as_checkrange(vaddr, len, &npages);
+	if (result || npages == 0) {
+		return result;
+	}
+	top = vaddr + npages * PAGE_SIZE;
+
+	lock_acquire(as->as_lock);
+	if (!as_allmapped(as, vaddr, npages)) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	for (reg = as_findregion(as, vaddr);
+	     reg != NULL && reg->ar_vbase < top && result == 0;
+	     reg = reg->ar_next) {
+		start = reg->ar_vbase > vaddr ? reg->ar_vbase : vaddr;
+		end = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+		if (end > top) {
+			end = top;
+		}
+		switch (advice) {
+		    case MADV_WILLNEED:
+			as_willneed(as, reg, start, end);
+			break;
+		    case MADV_DONTNEED:
+			result = as_dontneed(as, reg, start, end);
+			break;
+		    default:
+			/* Regions aren't split; the whole one gets it. */
+			reg->ar_advice = advice;
+			break;
+		}
+	}
+	lock_release(as->as_lock);
+	return result;
+}
+
+int
+as_mlock(struct addrspace *as, vaddr_t vaddr, size_t len, bool lock)
+{
+	struct as_region *reg;
+	vaddr_t va;
+	size_t npages, i;
+	pte_t *pte;
+	paddr_t pa;
+	int result;
+
+	result = as_checkrange(vaddr, len, &npages);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(as->as_lock);
+	if (!as_allmapped(as, vaddr, npages)) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	for (i=0; i<npages; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		reg = as_findregion(as, va);
+		KASSERT(reg != NULL);
+		if (reg->ar_kpage != 0) {
+			/* Kernel memory; always there. */
+			continue;
+		}
+		if (lock) {
+			result = vm_pagein(as, va, &pa);
+			if (result) {
+				break;
+			}
+			if (!coremap_setwired(pa, true)) {
+				coremap_unpin(pa);
+				result = EAGAIN;
+				break;
+			}
+			pte = pt_lookup(as->as_pt, va, false);
+			*pte |= PTE_LOCKED;
+			coremap_unpin(pa);
+		}
+		else {
+			/* Locked pages are resident. */
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte != NULL && pt_pin(pte)) {
+				pa = PTE_PADDR(*pte);
+				*pte &= ~PTE_LOCKED;
+				(void)coremap_setwired(pa, false);
+				coremap_unpin(pa);
+			}
+		}
+	}
+	lock_release(as->as_lock);
+	return result;
+}
+
+/* Pages mincore looks at between copyouts. */
+#define AS_MINCORE_CHUNK	64
+
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t len, userptr_t vec)
+{
+	struct as_region *reg;
+	unsigned char buf[AS_MINCORE_CHUNK];
+	vaddr_t va;
+	size_t npages, done, n, i;
+	pte_t *pte;
+	int result;
+
+	result = as_checkrange(vaddr, len, &npages);
+	if (result) {
+		return result;
+	}
+
+	for (done = 0; done < npages; done += n) {
+		n = npages - done;
+		if (n > AS_MINCORE_CHUNK) {
+			n = AS_MINCORE_CHUNK;
+		}
+
+		lock_acquire(as->as_lock);
+		for (i=0; i<n; i++) {
+			va = vaddr + (done + i) * PAGE_SIZE;
+			reg = as_findregion(as, va);
+			if (reg == NULL) {
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+			pte = pt_lookup(as->as_pt, va, false);
+			buf[i] = reg->ar_kpage != 0 ||
+				(pte != NULL && (*pte & PTE_VALID) != 0);
+		}
+		lock_release(as->as_lock);
+
+		/* Not under the lock: vec may need faulting in. */
+		result = copyout(buf, (userptr_t)((vaddr_t)vec + done), n);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+struct as_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *reg;
+
+	for (reg = as->as_regions; reg != NULL; reg = reg->ar_next) {
+		if (vaddr < reg->ar_vbase) {
+			break;
+		}
+		if (vaddr - reg->ar_vbase < reg->ar_npages * PAGE_SIZE) {
+			return reg;
+		}
+	}
+	return NULL;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct as_region *heap = as->as_heap;
+	vaddr_t newbreak, va;
+	size_t npages;
+	int result;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	/* the region's size changes under other threads' faults */
+	lock_acquire(as->as_lock);
+
+	if (amount < 0) {
+		if (-(vaddr_t)amount > as->as_heapbreak - heap->ar_vbase) {
+			result = EINVAL;
+			goto out;
+		}
+	}
+	else if ((vaddr_t)amount > USERSPACETOP - as->as_heapbreak) {
+		result = ENOMEM;
+		goto out;
+	}
+	newbreak = as->as_heapbreak + amount;
+
+	npages = (newbreak - heap->ar_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages > heap->ar_npages) {
+		/* Just claim the addresses; pages come on first touch. */
+		if (heap->ar_next != NULL && heap->ar_vbase +
+		    npages * PAGE_SIZE > heap->ar_next->ar_vbase) {
+			result = ENOMEM;
+			goto out;
+		}
+	}
+	else if (npages < heap->ar_npages) {
+		/* Give back whatever was touched above the new top. */
+		for (va = heap->ar_vbase + npages * PAGE_SIZE;
+		     va < heap->ar_vbase + heap->ar_npages * PAGE_SIZE;
+		     va += PAGE_SIZE) {
+			pt_unmap(as->as_pt, va);
+		}
+		vm_shootdown(as, heap->ar_vbase + npages * PAGE_SIZE,
+			     heap->ar_npages - npages);
+	}
+	heap->ar_npages = npages;
+
+	*oldbreak = as->as_heapbreak;
+	as->as_heapbreak = newbreak;
+	result = 0;
+
+ out:
+	lock_release(as->as_lock);
+	return result;
+}
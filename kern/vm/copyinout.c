@@ -178,6 +178,48 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 	return 0;
 }
 
+/*
+ * copyinv
+ *
+ * Copy N blocks of user memory, as described by VEC, each to its own
+ * kernel address. Every range is checked before anything is copied,
+ * and the whole batch shares one setjmp, which is most of the cost of
+ * a small copyin.
+ */
+int
+copyinv(const struct copyinvec *vec, unsigned n)
+{
+	unsigned i;
+	int result;
+	size_t stoplen;
+
+	for (i=0; i<n; i++) {
+		result = copycheck(vec[i].ci_src, vec[i].ci_len, &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != vec[i].ci_len) {
+			return EFAULT;
+		}
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	for (i=0; i<n; i++) {
+		memcpy(vec[i].ci_dest, (const void *)vec[i].ci_src,
+		       vec[i].ci_len);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
 /*
  * copyout
  *
@@ -229,29 +271,69 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * hit STOPLEN it's because the string has run into the end of
  * userspace. Thus in the latter case we return EFAULT, not
  * ENAMETOOLONG.
+ *
+ * Once SRC is word-aligned, the string is moved a word at a time for
+ * as long as the words have no null byte in them. An aligned word
+ * never straddles a page, so reading the bytes past the end of the
+ * string in the last word can't fault when the string itself doesn't;
+ * but that word, and anything short of a word, is done a byte at a
+ * time so nothing past the terminator is ever written.
  */
+#define COPYSTR_HASZERO(w) (((w) - 0x01010101U) & ~(w) & 0x80808080U)
+
 static
 int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
+	size_t i, limit;
+	uint32_t w;
+
+	limit = maxlen < stoplen ? maxlen : stoplen;
 
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	for (i=0; i<limit && ((uintptr_t)(src + i) & 3) != 0; i++) {
 		dest[i] = src[i];
 		if (src[i] == 0) {
-			if (gotlen != NULL) {
-				*gotlen = i+1;
+			goto found;
+		}
+	}
+	if (((uintptr_t)(dest + i) & 3) == 0) {
+		for (; i+4 <= limit; i += 4) {
+			w = *(const uint32_t *)(src + i);
+			if (COPYSTR_HASZERO(w)) {
+				break;
 			}
-			return 0;
+			*(uint32_t *)(dest + i) = w;
 		}
 	}
+	else {
+		for (; i+4 <= limit; i += 4) {
+			w = *(const uint32_t *)(src + i);
+			if (COPYSTR_HASZERO(w)) {
+				break;
+			}
+			memcpy(dest + i, &w, sizeof(w));
+		}
+	}
+	for (; i<limit; i++) {
+		dest[i] = src[i];
+		if (src[i] == 0) {
+			goto found;
+		}
+	}
+
 	if (stoplen < maxlen) {
 		/* ran into user-kernel boundary */
 		return EFAULT;
 	}
 	/* otherwise just ran out of space */
 	return ENAMETOOLONG;
+
+ found:
+	if (gotlen != NULL) {
+		*gotlen = i+1;
+	}
+	return 0;
 }
 
 /*
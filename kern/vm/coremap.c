@@ -0,0 +1,912 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Coremap (physical page allocator).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <reclaim.h>
+#include <kstat.h>
+
+/*
+ * Page states.
+ */
+#define CME_FIXED	0	/* kernel image, coremap, early steals */
+#define CME_FREE	1	/* on the free list */
+#define CME_KERNEL	2	/* kernel heap page (alloc_kpages) */
+#define CME_USER	3	/* user page (coremap_allocuser) */
+
+/* Null value for free list links. */
+#define NOPAGE		((uint32_t)0xffffffff)
+
+/*
+ * One of these per physical page.
+ *
+ * cme_npages is the length of a kernel allocation and is valid only
+ * on the first page of the allocation. cme_next and cme_prev link
+ * free pages and are valid only for free pages; cme_zeroed says
+ * which of the two free lists the page is on.
+ *
+ * For user pages: cme_refcount counts the page tables mapping the
+ * page; it's more than one when the page is shared copy-on-write.
+ * cme_busy means the page is pinned (see coremap.h). cme_referenced
+ * is the clock algorithm's use bit. cme_as and cme_vaddr name the
+ * one address space and page that map the page, if there's only one
+ * and it is known; only such pages can be paged out. cme_wired means
+ * that owner has the page locked in memory (mlock), so it can't be
+ * paged out either; sharing the page clears it.
+ */
+struct coremap_entry {
+	unsigned cme_state : 2;
+	unsigned cme_busy : 1;
+	unsigned cme_referenced : 1;
+	unsigned cme_zeroed : 1;
+	unsigned cme_wired : 1;
+	unsigned cme_npages : 26;
+	uint32_t cme_next;
+	uint32_t cme_prev;
+	uint32_t cme_refcount;
+	struct addrspace *cme_as;
+	vaddr_t cme_vaddr;
+};
+
+/*
+ * The coremap lock protects everything below. It is a spinlock
+ * because alloc_kpages can be called in contexts that cannot sleep.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* NULL until bootstrapped */
+static uint32_t coremap_npages;		/* total pages of RAM */
+static uint32_t coremap_freehead;	/* head of free list */
+static uint32_t coremap_zerohead;	/* head of pre-zeroed free list */
+static uint32_t coremap_clockhand;	/* next page for the clock to visit */
+
+/* Pageout starts below the low water mark and stops above the high. */
+static unsigned coremap_lowater;
+static unsigned coremap_hiwater;
+
+/* The zeroing thread keeps this many zeroed pages, if there's room. */
+static unsigned coremap_zerotarget;
+
+static struct wchan *coremap_pinwchan;		/* waiting for unpin */
+static struct wchan *coremap_pageoutwchan;	/* pageout thread */
+static struct wchan *coremap_zerowchan;		/* zeroing thread */
+
+static unsigned coremap_nfixed;
+static unsigned coremap_nfree;		/* including the zeroed ones */
+static unsigned coremap_nzero;
+static unsigned coremap_nkernel;
+static unsigned coremap_nuser;
+static unsigned coremap_nwired;
+
+/* At most this many pages may be wired, so pageout has room to work. */
+static unsigned coremap_maxwired;
+
+/* Zero-filled user pages taken from the pool, and zeroed on demand */
+static unsigned coremap_nzerohits;
+static unsigned coremap_nzeromisses;
+
+////////////////////////////////////////////////////////////
+// free lists
+
+/*
+ * Free pages are on one of two lists: pages known to be all zeros,
+ * which the zeroing thread fills in the background, and the rest.
+ * Both count as free memory. Allocations that will clear the page
+ * anyway take from the zeroed list; others leave it alone while
+ * there are other free pages.
+ */
+
+static
+void
+coremap_freelist_add(uint32_t pn, bool zeroed)
+{
+	uint32_t *head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (coremap[pn].cme_busy) {
+		wchan_wakeall(coremap_pinwchan, &coremap_lock);
+	}
+	coremap[pn].cme_state = CME_FREE;
+	coremap[pn].cme_busy = 0;
+	coremap[pn].cme_referenced = 0;
+	coremap[pn].cme_zeroed = zeroed;
+	coremap[pn].cme_npages = 0;
+	coremap[pn].cme_refcount = 0;
+	coremap[pn].cme_as = NULL;
+	coremap[pn].cme_vaddr = 0;
+	head = zeroed ? &coremap_zerohead : &coremap_freehead;
+	coremap[pn].cme_prev = NOPAGE;
+	coremap[pn].cme_next = *head;
+	if (*head != NOPAGE) {
+		coremap[*head].cme_prev = pn;
+	}
+	*head = pn;
+	coremap_nfree++;
+	if (zeroed) {
+		coremap_nzero++;
+	}
+}
+
+static
+void
+coremap_freelist_remove(uint32_t pn)
+{
+	uint32_t next, prev, *head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[pn].cme_state == CME_FREE);
+
+	head = coremap[pn].cme_zeroed ? &coremap_zerohead : &coremap_freehead;
+	next = coremap[pn].cme_next;
+	prev = coremap[pn].cme_prev;
+	if (prev != NOPAGE) {
+		coremap[prev].cme_next = next;
+	}
+	else {
+		KASSERT(*head == pn);
+		*head = next;
+	}
+	if (next != NOPAGE) {
+		coremap[next].cme_prev = prev;
+	}
+	coremap[pn].cme_next = coremap[pn].cme_prev = NOPAGE;
+	KASSERT(coremap_nfree > 0);
+	coremap_nfree--;
+	if (coremap[pn].cme_zeroed) {
+		KASSERT(coremap_nzero > 0);
+		coremap_nzero--;
+		coremap[pn].cme_zeroed = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// background zeroing
+
+/*
+ * The zeroing thread. Keeps coremap_zerotarget free pages zeroed so
+ * that demand-zero faults (heap, stack, BSS) needn't clear pages
+ * themselves. It's woken when the pool drops to half, and yields
+ * after each page so it only soaks up time nothing else wants. It
+ * leaves the last few free pages (below the pageout low water mark)
+ * alone, since they'll be gone again too soon to be worth it.
+ *
+ * The page being zeroed is off the free lists and counts as a
+ * kernel page meanwhile.
+ */
+static
+void
+coremap_zero_thread(void *data1, unsigned long data2)
+{
+	uint32_t pn;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		while (coremap_nzero >= coremap_zerotarget ||
+		       coremap_freehead == NOPAGE ||
+		       coremap_nfree < coremap_lowater) {
+			wchan_sleep(coremap_zerowchan, &coremap_lock);
+		}
+		pn = coremap_freehead;
+		coremap_freelist_remove(pn);
+		coremap[pn].cme_state = CME_KERNEL;
+		coremap[pn].cme_npages = 1;
+		coremap_nkernel++;
+		spinlock_release(&coremap_lock);
+
+		bzero((void *)PADDR_TO_KVADDR((paddr_t)pn * PAGE_SIZE),
+		      PAGE_SIZE);
+
+		spinlock_acquire(&coremap_lock);
+		KASSERT(coremap_nkernel > 0);
+		coremap_nkernel--;
+		coremap_freelist_add(pn, true);
+		spinlock_release(&coremap_lock);
+
+		thread_yield();
+		spinlock_acquire(&coremap_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// setup
+
+/*
+ * Take over physical memory from ram.c. After this ram_stealmem()
+ * no longer works, so this must happen before anything else can
+ * call it, and alloc_kpages switches over to the coremap here.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lastpaddr, firstpaddr, cmpaddr;
+	size_t cmsize;
+	struct coremap_entry *cm;
+	uint32_t npages, nfixed, i;
+	int result;
+
+	/* These come out of stolen memory, which is fine. */
+	coremap_pinwchan = wchan_create("coremap");
+	coremap_pageoutwchan = wchan_create("pageout");
+	coremap_zerowchan = wchan_create("pagezero");
+	if (coremap_pinwchan == NULL || coremap_pageoutwchan == NULL ||
+	    coremap_zerowchan == NULL) {
+		panic("coremap: Out of memory\n");
+	}
+
+	/* Must call ram_getsize first; ram_getfirstfree clobbers it. */
+	lastpaddr = ram_getsize();
+	npages = lastpaddr / PAGE_SIZE;
+
+	cmsize = npages * sizeof(struct coremap_entry);
+	cmpaddr = ram_stealmem(DIVROUNDUP(cmsize, PAGE_SIZE));
+	if (cmpaddr == 0) {
+		panic("coremap: Cannot allocate %zu bytes for coremap\n",
+		      cmsize);
+	}
+	cm = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+
+	firstpaddr = ram_getfirstfree();
+	KASSERT(firstpaddr % PAGE_SIZE == 0);
+	nfixed = firstpaddr / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+
+	coremap = cm;
+	coremap_npages = npages;
+	coremap_freehead = NOPAGE;
+	coremap_zerohead = NOPAGE;
+	coremap_clockhand = nfixed;
+
+	for (i=0; i<npages; i++) {
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_busy = 0;
+		coremap[i].cme_referenced = 0;
+		coremap[i].cme_zeroed = 0;
+		coremap[i].cme_wired = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_next = coremap[i].cme_prev = NOPAGE;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+	}
+	coremap_nfixed = nfixed;
+
+	coremap_lowater = (npages - nfixed) / 32;
+	if (coremap_lowater < 4) {
+		coremap_lowater = 4;
+	}
+	coremap_hiwater = coremap_lowater * 2;
+	coremap_zerotarget = coremap_hiwater;
+	coremap_maxwired = (npages - nfixed) / 2;
+
+	/*
+	 * Add pages in descending order so the free list hands out
+	 * low addresses first.
+	 */
+	for (i=npages; i-- > nfixed; ) {
+		coremap_freelist_add(i, false);
+	}
+
+	spinlock_release(&coremap_lock);
+
+	result = thread_fork("pagezero", NULL, coremap_zero_thread, NULL, 0);
+	if (result) {
+		panic("coremap: thread_fork: %s\n", strerror(result));
+	}
+
+	kprintf("coremap: %u pages, %u free\n", npages, npages - nfixed);
+}
+
+////////////////////////////////////////////////////////////
+// allocation
+
+/*
+ * Wake the pageout thread if free memory is getting low, and the
+ * zeroing thread if the zeroed pool is half used up and there are
+ * other free pages to refill it with.
+ */
+static
+void
+coremap_checkpressure(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (coremap_nfree < coremap_lowater) {
+		wchan_wakeone(coremap_pageoutwchan, &coremap_lock);
+	}
+	if (coremap_nzero < coremap_zerotarget / 2 &&
+	    coremap_nfree > coremap_nzero) {
+		wchan_wakeone(coremap_zerowchan, &coremap_lock);
+	}
+}
+
+/*
+ * Find and claim a run of NPAGES free pages. Returns the first page
+ * number or NOPAGE.
+ */
+static
+uint32_t
+coremap_getrun(unsigned npages, unsigned state)
+{
+	uint32_t pn, start, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(npages > 0);
+
+	if (npages > coremap_nfree) {
+		return NOPAGE;
+	}
+
+	if (npages == 1) {
+		/* Keep the zeroed pages for those who want them. */
+		start = coremap_freehead;
+		if (start == NOPAGE) {
+			start = coremap_zerohead;
+		}
+		KASSERT(start != NOPAGE);
+	}
+	else {
+		start = NOPAGE;
+		for (pn = coremap_nfixed; pn + npages <= coremap_npages; pn++) {
+			for (i=0; i<npages; i++) {
+				if (coremap[pn+i].cme_state != CME_FREE) {
+					break;
+				}
+			}
+			if (i == npages) {
+				start = pn;
+				break;
+			}
+			/* skip past the page that stopped us */
+			pn += i;
+		}
+		if (start == NOPAGE) {
+			return NOPAGE;
+		}
+	}
+
+	for (i=0; i<npages; i++) {
+		coremap_freelist_remove(start + i);
+		coremap[start + i].cme_state = state;
+	}
+	coremap[start].cme_npages = npages;
+
+	return start;
+}
+
+/*
+ * Release a run of pages starting at page PN.
+ */
+static
+void
+coremap_putrun(uint32_t pn, unsigned state)
+{
+	unsigned npages, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(pn < coremap_npages);
+	KASSERT(coremap[pn].cme_state == state);
+
+	npages = coremap[pn].cme_npages;
+	KASSERT(npages > 0);
+	KASSERT(pn + npages <= coremap_npages);
+
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[pn+i].cme_state == state);
+		coremap_freelist_add(pn + i, false);
+	}
+}
+
+/*
+ * True if the current thread could run the reclaim hooks: it must be
+ * able to sleep.
+ */
+static
+bool
+coremap_canreclaim(void)
+{
+	return CURCPU_EXISTS() &&
+		!curthread->t_in_interrupt &&
+		curthread->t_curspl == 0 &&
+		curcpu->c_spinlocks == 0;
+}
+
+/*
+ * Allocate kernel pages. Before the coremap exists, fall back to
+ * ram_stealmem; such pages can never be freed. If there's no room,
+ * let the caches give some memory back (see reclaim.h) and try once
+ * more.
+ */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	uint32_t pn;
+	bool reclaimed = false;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		if (pa == 0) {
+			return 0;
+		}
+		return PADDR_TO_KVADDR(pa);
+	}
+
+ again:
+	pn = coremap_getrun(npages, CME_KERNEL);
+	if (pn != NOPAGE) {
+		coremap_nkernel += npages;
+	}
+	coremap_checkpressure();
+	spinlock_release(&coremap_lock);
+
+	if (pn == NOPAGE && !reclaimed && coremap_canreclaim()) {
+		reclaimed = true;
+		if (reclaim_run(npages, RECLAIM_NOFS) > 0) {
+			spinlock_acquire(&coremap_lock);
+			goto again;
+		}
+	}
+
+	if (pn == NOPAGE) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR((paddr_t)pn * PAGE_SIZE);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	uint32_t pn;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+	pn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL || coremap[pn].cme_state == CME_FIXED) {
+		/* Stolen before the coremap existed; leak it. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	KASSERT(coremap_nkernel >= coremap[pn].cme_npages);
+	coremap_nkernel -= coremap[pn].cme_npages;
+	coremap_putrun(pn, CME_KERNEL);
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t
+coremap_allocuser(struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+	uint32_t pn;
+	bool zeroed;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap != NULL);
+	zeroed = false;
+	if (zero && coremap_zerohead != NOPAGE) {
+		pn = coremap_zerohead;
+		coremap_freelist_remove(pn);
+		coremap[pn].cme_state = CME_USER;
+		coremap[pn].cme_npages = 1;
+		coremap_nzerohits++;
+		zeroed = true;
+	}
+	else {
+		pn = coremap_getrun(1, CME_USER);
+		if (pn != NOPAGE && zero) {
+			coremap_nzeromisses++;
+		}
+	}
+	if (pn != NOPAGE) {
+		coremap[pn].cme_busy = 1;
+		coremap[pn].cme_referenced = 1;
+		coremap[pn].cme_refcount = 1;
+		coremap[pn].cme_as = as;
+		coremap[pn].cme_vaddr = vaddr;
+		coremap_nuser++;
+	}
+	coremap_checkpressure();
+	spinlock_release(&coremap_lock);
+
+	if (pn == NOPAGE) {
+		return 0;
+	}
+	if (zero && !zeroed) {
+		bzero((void *)PADDR_TO_KVADDR((paddr_t)pn * PAGE_SIZE),
+		      PAGE_SIZE);
+	}
+	return (paddr_t)pn * PAGE_SIZE;
+}
+
+bool
+coremap_pin(paddr_t pa)
+{
+	uint32_t pn;
+	bool ret;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+	KASSERT(pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	while (coremap[pn].cme_state == CME_USER && coremap[pn].cme_busy) {
+		wchan_sleep(coremap_pinwchan, &coremap_lock);
+	}
+	ret = coremap[pn].cme_state == CME_USER;
+	if (ret) {
+		coremap[pn].cme_busy = 1;
+		coremap[pn].cme_referenced = 1;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+bool
+coremap_trypin(paddr_t pa)
+{
+	uint32_t pn;
+	bool ret;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+	KASSERT(pn < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap[pn].cme_state == CME_USER && !coremap[pn].cme_busy;
+	if (ret) {
+		coremap[pn].cme_busy = 1;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+void
+coremap_unpin(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CME_USER);
+	KASSERT(coremap[pn].cme_busy);
+	coremap[pn].cme_busy = 0;
+	wchan_wakeall(coremap_pinwchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t pn;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CME_USER);
+	KASSERT(coremap[pn].cme_busy);
+	KASSERT(coremap[pn].cme_refcount == 1);
+	coremap[pn].cme_as = as;
+	coremap[pn].cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_increfuser(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CME_USER);
+	KASSERT(coremap[pn].cme_busy);
+	KASSERT(coremap[pn].cme_refcount > 0);
+	coremap[pn].cme_refcount++;
+	/* No longer just one owner. */
+	coremap[pn].cme_as = NULL;
+	coremap[pn].cme_vaddr = 0;
+	if (coremap[pn].cme_wired) {
+		coremap[pn].cme_wired = 0;
+		coremap_nwired--;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_freeuser(paddr_t pa)
+{
+	uint32_t pn;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CME_USER);
+	KASSERT(coremap[pn].cme_busy);
+	KASSERT(coremap[pn].cme_refcount > 0);
+	if (--coremap[pn].cme_refcount == 0) {
+		KASSERT(coremap_nuser > 0);
+		coremap_nuser--;
+		if (coremap[pn].cme_wired) {
+			coremap[pn].cme_wired = 0;
+			coremap_nwired--;
+		}
+		coremap_putrun(pn, CME_USER);
+	}
+	else {
+		coremap[pn].cme_busy = 0;
+		wchan_wakeall(coremap_pinwchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_setwired(paddr_t pa, bool wired)
+{
+	struct coremap_entry *cme;
+	uint32_t pn;
+	bool ret;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[pn];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_busy);
+	ret = true;
+	if (cme->cme_refcount != 1 || cme->cme_as == NULL) {
+		/* Can't be paged out anyway. */
+	}
+	else if (wired && !cme->cme_wired) {
+		if (coremap_nwired < coremap_maxwired) {
+			cme->cme_wired = 1;
+			coremap_nwired++;
+		}
+		else {
+			ret = false;
+		}
+	}
+	else if (!wired && cme->cme_wired) {
+		cme->cme_wired = 0;
+		coremap_nwired--;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+unsigned
+coremap_userrefs(paddr_t pa)
+{
+	uint32_t pn;
+	unsigned refs;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	pn = pa / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pn].cme_state == CME_USER);
+	refs = coremap[pn].cme_refcount;
+	spinlock_release(&coremap_lock);
+
+	return refs;
+}
+
+////////////////////////////////////////////////////////////
+// pageout support
+
+/*
+ * Choose a page to evict with the clock (second-chance) algorithm:
+ * sweep the hand over the coremap, clearing use bits, and take the
+ * first evictable page whose use bit is already clear. A page is
+ * evictable if it is a user page with a single known owner and it
+ * isn't pinned or wired.
+ *
+ * The TLB refill handler can't set use bits, so clearing one also
+ * clears PTE_REF and shoots down the page's translations (with
+ * vm_unreference, holding the page pinned but not the lock); the
+ * next touch then faults and sets both again.
+ *
+ * The victim is returned pinned, with its owner in AS_RET and
+ * VADDR_RET. Returns 0 if nothing can be evicted.
+ */
+paddr_t
+coremap_getvictim(struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+	struct coremap_entry *cme;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	uint32_t pn, i, nscan;
+
+	spinlock_acquire(&coremap_lock);
+
+	/* Two full sweeps: the first may only clear use bits. */
+	nscan = 2 * (coremap_npages - coremap_nfixed);
+	for (i=0; i<nscan; i++) {
+		pn = coremap_clockhand;
+		coremap_clockhand++;
+		if (coremap_clockhand >= coremap_npages) {
+			coremap_clockhand = coremap_nfixed;
+		}
+
+		cme = &coremap[pn];
+		if (cme->cme_state != CME_USER || cme->cme_busy ||
+		    cme->cme_refcount != 1 || cme->cme_as == NULL ||
+		    cme->cme_wired) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			cme->cme_referenced = 0;
+			cme->cme_busy = 1;
+			as = cme->cme_as;
+			vaddr = cme->cme_vaddr;
+			spinlock_release(&coremap_lock);
+
+			vm_unreference(as, vaddr, (paddr_t)pn * PAGE_SIZE);
+			coremap_unpin((paddr_t)pn * PAGE_SIZE);
+
+			spinlock_acquire(&coremap_lock);
+			continue;
+		}
+
+		cme->cme_busy = 1;
+		*as_ret = cme->cme_as;
+		*vaddr_ret = cme->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return (paddr_t)pn * PAGE_SIZE;
+	}
+
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Called by the pageout thread: sleep until free memory drops below
+ * the low water mark.
+ */
+void
+coremap_pageout_wait(void)
+{
+	spinlock_acquire(&coremap_lock);
+	while (coremap_nfree >= coremap_lowater) {
+		wchan_sleep(coremap_pageoutwchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return true if NPAGES could be allocated and still leave twice the
+ * high water mark free, so that caches growing into spare memory stop
+ * well short of waking the pageout thread.
+ */
+bool
+coremap_plenty(unsigned npages)
+{
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap_nfree >= npages + 2 * coremap_hiwater;
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+/*
+ * Return true if the pageout thread should keep going, that is, if
+ * free memory is still below the high water mark.
+ */
+bool
+coremap_pageout_wanted(void)
+{
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = coremap_nfree < coremap_hiwater;
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// stats
+
+void
+coremap_printstats(void)
+{
+	unsigned nfixed, nfree, nzero, nkernel, nuser, nwired, hits, misses;
+
+	spinlock_acquire(&coremap_lock);
+	nfixed = coremap_nfixed;
+	nfree = coremap_nfree;
+	nzero = coremap_nzero;
+	nkernel = coremap_nkernel;
+	nuser = coremap_nuser;
+	nwired = coremap_nwired;
+	hits = coremap_nzerohits;
+	misses = coremap_nzeromisses;
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u pages: %u fixed, %u kernel, %u user, %u free\n",
+		coremap_npages, nfixed, nkernel, nuser, nfree);
+	kprintf("coremap: %u user pages wired\n", nwired);
+	kprintf("coremap: %u free pages zeroed; zero-fills: %u from the "
+		"pool, %u zeroed on demand\n", nzero, hits, misses);
+}
+
+void
+coremap_kstat(struct kstat *ks)
+{
+	unsigned nfixed, nfree, nzero, nkernel, nuser, nwired, hits, misses;
+
+	spinlock_acquire(&coremap_lock);
+	nfixed = coremap_nfixed;
+	nfree = coremap_nfree;
+	nzero = coremap_nzero;
+	nkernel = coremap_nkernel;
+	nuser = coremap_nuser;
+	nwired = coremap_nwired;
+	hits = coremap_nzerohits;
+	misses = coremap_nzeromisses;
+	spinlock_release(&coremap_lock);
+
+	kstat_add(ks, "vm.coremap.pages", coremap_npages);
+	kstat_add(ks, "vm.coremap.fixed", nfixed);
+	kstat_add(ks, "vm.coremap.kernel", nkernel);
+	kstat_add(ks, "vm.coremap.user", nuser);
+	kstat_add(ks, "vm.coremap.wired", nwired);
+	kstat_add(ks, "vm.coremap.free", nfree);
+	kstat_add(ks, "vm.coremap.zeroed", nzero);
+	kstat_add(ks, "vm.coremap.zerohits", hits);
+	kstat_add(ks, "vm.coremap.zeromisses", misses);
+}
@@ -29,8 +29,14 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <reclaim.h>
+#include "opt-kmallocsizes.h"
+#include "opt-kmallocsites.h"
 
 /*
  * Kernel malloc.
@@ -111,6 +117,19 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * MAGAZINES puts a per-cpu cache of free blocks of each size in
+ * front of the subpage allocator, so most kmalloc/kfree calls don't
+ * take the global lock. It's turned off by the debugging modes above:
+ * blocks sitting in a magazine look allocated to the heap checks, and
+ * guard bands and labels are set up by the global path.
+ *
+ * SITES keeps a tally of live blocks, live bytes, and allocations
+ * for each kmalloc call site, for finding out who is using (or
+ * churning) the heap. Unlike LABELS it's cheap enough to leave on and
+ * doesn't turn off MAGAZINES; it's enabled with "options
+ * kmallocsites" in the kernel config. Each subpage block carries a
+ * small header saying which site it belongs to.
  */
 
 #undef  SLOW
@@ -121,12 +140,35 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#define MAGAZINES
+
+#if defined(SLOW) || defined(SLOWER) || defined(GUARDS) || defined(LABELS)
+#undef MAGAZINES
+#endif
+
+#if OPT_KMALLOCSITES
+#define SITES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
+#if OPT_KMALLOCSIZES
+/*
+ * Powers of two and the sizes halfway between them, so a block is
+ * never more than a third wasted rather than up to half. Many kernel
+ * structures land just past a power of two; see the size histogram
+ * printed by kheap_printstats.
+ */
+#define NSIZES 15
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+#else
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#endif
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -160,10 +202,8 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole heap. The per-cpu magazines (see
+ * below) keep most allocations and frees from needing it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -184,19 +224,6 @@ struct pagerefpage {
 	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
-
 /*
  * It would be better to make this dynamically sizeable. However,
  * since we only actually run on System/161 and System/161 is
@@ -210,18 +237,35 @@ struct kheap_root {
 #define NUM_PAGEREFPAGES 16
 #define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pagerefpage *pagerefpages[NUM_PAGEREFPAGES];
+
+/*
+ * Unused pagerefs are kept on a free list, linked through
+ * next_samesize, so getting one doesn't involve a search.
+ */
+static struct pageref *freepagerefs;
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate another page to hold pagerefs, and put its pagerefs on
+ * the free list. Returns false if we can't.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+bool
+allocpagerefpage(void)
 {
+	unsigned whichpage, i;
 	vaddr_t va;
+	struct pagerefpage *page;
 
-	KASSERT(root->page == NULL);
+	for (whichpage=0; whichpage < NUM_PAGEREFPAGES; whichpage++) {
+		if (pagerefpages[whichpage] == NULL) {
+			break;
+		}
+	}
+	if (whichpage == NUM_PAGEREFPAGES) {
+		/* ran out */
+		return false;
+	}
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
@@ -233,21 +277,29 @@ allocpagerefpage(struct kheap_root *root)
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return false;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
+	if (pagerefpages[whichpage] != NULL) {
+		/*
+		 * Oops, somebody else allocated it. Their pagerefs
+		 * are on the free list now, so that's as good.
+		 */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(va);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+		return true;
 	}
 
-	root->page = (struct pagerefpage *)va;
+	/* Once allocated it isn't ever freed. */
+	page = (struct pagerefpage *)va;
+	pagerefpages[whichpage] = page;
+	for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+		page->refs[i].next_samesize = freepagerefs;
+		freepagerefs = &page->refs[i];
+	}
+	return true;
 }
 
 /*
@@ -257,44 +309,18 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pageref *pr;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	while (freepagerefs == NULL) {
+		if (!allocpagerefpage()) {
+			return NULL;
 		}
 	}
-
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 /*
@@ -304,46 +330,204 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+}
+
+////////////////////////////////////////
+
+/*
+ * Each pageref is on two linked lists: one list of pages of blocks of
+ * that same size, and one of all blocks.
+ */
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
+/*
+ * The pageref of each subpage heap page, indexed by physical page
+ * number, so kfree can find it right away. While a block is
+ * allocated its page stays in the heap, so kfree can also look at the
+ * entry for it without the lock. As with the pagerefs, we assume no
+ * more than 16M of RAM.
+ */
+#define KHEAP_MAXPAGES (16*1024*1024 / PAGE_SIZE)
+static struct pageref *pagerefsbypage[KHEAP_MAXPAGES];
+
+static
+void
+setpageref(vaddr_t prpage, struct pageref *pr)
+{
+	paddr_t pn;
+
+	pn = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(pn < KHEAP_MAXPAGES);
+	pagerefsbypage[pn] = pr;
+}
+
+/*
+ * Returns the pageref for the page PTR is on, or NULL if it isn't a
+ * subpage heap page.
+ */
+static
+struct pageref *
+getpageref(vaddr_t ptr)
+{
+	paddr_t pn;
+
+	pn = KVADDR_TO_PADDR(ptr) / PAGE_SIZE;
+	if (pn >= KHEAP_MAXPAGES) {
+		return NULL;
+	}
+	return pagerefsbypage[pn];
+}
+
+#ifdef MAGAZINES
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu has, for each block size, a stack of free blocks (a
+ * "magazine"). kmalloc pops from it and kfree pushes onto it with
+ * interrupts off, so nothing else on the cpu can get in and no lock
+ * is needed. Only when the magazine is empty or full do we take the
+ * global lock, and then we move half a magazine of blocks at once.
+ *
+ * Magazines for big blocks hold fewer, so that what's parked in them
+ * stays around MAG_BYTES per size per cpu.
+ *
+ * A cpu's magazines are allocated the first time it calls kmalloc
+ * (through the global path, which is what the creating flag is for).
+ */
+
+#define MAG_ROUNDS	32	/* most blocks in one magazine */
+#define MAG_MINROUNDS	4	/* fewest, for the biggest sizes */
+#define MAG_BYTES	8192
+
+#define KMALLOC_MAXCPUS	32
+
+struct magazine {
+	unsigned m_count;
+	void *m_rounds[MAG_ROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct magazine kc_mags[NSIZES];
+};
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+static struct kmalloc_cpu *kmalloc_cpus[KMALLOC_MAXCPUS];
+static bool kmalloc_cpus_creating[KMALLOC_MAXCPUS];
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
+/*
+ * Count the blocks and bytes sitting in magazines, for the stats.
+ * This is only a snapshot.
+ */
+static
+void
+magazine_count(unsigned *blocks_ret, size_t *bytes_ret)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i, j;
+
+	*blocks_ret = 0;
+	*bytes_ret = 0;
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		kc = kmalloc_cpus[i];
+		if (kc == NULL) {
 			continue;
 		}
-
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
+		for (j=0; j<NSIZES; j++) {
+			*blocks_ret += kc->kc_mags[j].m_count;
+			*bytes_ret += kc->kc_mags[j].m_count * sizes[j];
 		}
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
 }
 
+#endif /* MAGAZINES */
+
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Allocation profile, for choosing size classes and seeing how much
+ * is lost to rounding up: requests by client size in HIST_BUCKETSIZE
+ * byte buckets, and per block size the number of allocations and the
+ * bytes actually asked for. These are updated without the lock (the
+ * magazine path doesn't have it), so they can occasionally lose a
+ * count; that's fine for statistics.
  */
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+#define HIST_BUCKETSIZE 16
+#define HIST_NBUCKETS (LARGEST_SUBPAGE_SIZE / HIST_BUCKETSIZE)
+
+static unsigned kheap_hist[HIST_NBUCKETS];
+static unsigned kheap_sizeallocs[NSIZES];
+static uint64_t kheap_sizerequested[NSIZES];
+
+static
+void
+kheap_countalloc(size_t clientsz, unsigned blktype)
+{
+	unsigned bucket;
+
+	bucket = clientsz == 0 ? 0 : (clientsz - 1) / HIST_BUCKETSIZE;
+	if (bucket >= HIST_NBUCKETS) {
+		bucket = HIST_NBUCKETS - 1;
+	}
+	kheap_hist[bucket]++;
+	kheap_sizeallocs[blktype]++;
+	kheap_sizerequested[blktype] += clientsz;
+}
+
+/*
+ * Compute NUM * SCALE / DEN, without 64-bit division (which the
+ * kernel has no support library for); precision loss is fine.
+ */
+static
+unsigned
+kheap_ratio(uint64_t num, uint64_t den, unsigned scale)
+{
+	while (num * scale > 0xffffffffULL || den > 0xffffffffULL) {
+		num >>= 1;
+		den >>= 1;
+	}
+	if (den == 0) {
+		return 0;
+	}
+	return (uint32_t)(num * scale) / (uint32_t)den;
+}
+
+/*
+ * Print the allocation profile.
+ */
+static
+void
+kheap_printprofile(void)
+{
+	unsigned i;
+	uint64_t given;
+
+	kprintf("Subpage allocations by block size:\n");
+	for (i=0; i<NSIZES; i++) {
+		if (kheap_sizeallocs[i] == 0) {
+			continue;
+		}
+		given = (uint64_t)kheap_sizeallocs[i] * sizes[i];
+		kprintf("  %4zu: %8u allocs, average %4u bytes, %2u%% wasted\n",
+			sizes[i], kheap_sizeallocs[i],
+			kheap_ratio(kheap_sizerequested[i],
+				    kheap_sizeallocs[i], 1),
+			kheap_ratio(given - kheap_sizerequested[i], given,
+				    100));
+	}
+
+	kprintf("Subpage allocations by requested size:\n");
+	for (i=0; i<HIST_NBUCKETS; i++) {
+		if (kheap_hist[i] == 0) {
+			continue;
+		}
+		kprintf("  %4u-%4u: %8u\n", i * HIST_BUCKETSIZE + 1,
+			(i + 1) * HIST_BUCKETSIZE, kheap_hist[i]);
+	}
+}
 
 ////////////////////////////////////////
 
@@ -737,6 +921,124 @@ kheap_dumpall(void)
 #endif
 }
 
+////////////////////////////////////////
+//
+// Large allocations.
+//
+// Blocks too big for the subpage allocator get whole pages from
+// alloc_kpages. To keep churn in these (big buffers that are
+// allocated and freed over and over) from going to the page
+// allocator every time and chopping up physical memory, freed blocks
+// of up to LARGE_MAXPAGES pages are kept on per-size lists, linked
+// through their first word, up to LARGE_HIWATER pages in all; beyond
+// that they really are freed.
+//
+// largenpages[] records the size of each cacheable block, indexed by
+// the physical page number of its first page, since free_kpages
+// doesn't tell us.
+//
+
+#define LARGE_MAXPAGES	8
+#define LARGE_HIWATER	16
+
+#define LARGE_TABLEPAGES (16*1024*1024 / PAGE_SIZE)	/* as above */
+
+static struct spinlock large_spinlock = SPINLOCK_INITIALIZER;
+static struct freelist *largefree[LARGE_MAXPAGES + 1];
+static unsigned largecached;		/* pages on largefree[] */
+static unsigned largehits, largemisses;	/* for the stats */
+static uint8_t largenpages[LARGE_TABLEPAGES];
+
+static
+unsigned
+large_pagenum(vaddr_t addr)
+{
+	return KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+}
+
+/*
+ * Allocate NPAGES pages for kmalloc.
+ */
+static
+vaddr_t
+large_alloc(unsigned npages)
+{
+	struct freelist *fl;
+	vaddr_t address;
+	unsigned pn;
+
+	if (npages <= LARGE_MAXPAGES) {
+		spinlock_acquire(&large_spinlock);
+		fl = largefree[npages];
+		if (fl != NULL) {
+			largefree[npages] = fl->next;
+			largecached -= npages;
+			largehits++;
+			spinlock_release(&large_spinlock);
+			return (vaddr_t)fl;
+		}
+		largemisses++;
+		spinlock_release(&large_spinlock);
+	}
+
+	address = alloc_kpages(npages);
+	if (address == 0) {
+		return 0;
+	}
+	KASSERT(address % PAGE_SIZE == 0);
+
+	if (npages <= LARGE_MAXPAGES) {
+		pn = large_pagenum(address);
+		if (pn < LARGE_TABLEPAGES) {
+			largenpages[pn] = npages;
+		}
+	}
+	return address;
+}
+
+/*
+ * Free a block from large_alloc.
+ */
+static
+void
+large_free(vaddr_t address)
+{
+	struct freelist *fl;
+	unsigned pn, npages;
+
+	KASSERT(address % PAGE_SIZE == 0);
+
+	pn = large_pagenum(address);
+	npages = pn < LARGE_TABLEPAGES ? largenpages[pn] : 0;
+	if (npages != 0) {
+		spinlock_acquire(&large_spinlock);
+		if (largecached + npages <= LARGE_HIWATER) {
+			fl = (struct freelist *)address;
+			fl->next = largefree[npages];
+			largefree[npages] = fl;
+			largecached += npages;
+			spinlock_release(&large_spinlock);
+			return;
+		}
+		spinlock_release(&large_spinlock);
+		largenpages[pn] = 0;
+	}
+	free_kpages(address);
+}
+
+/*
+ * Print the large allocation cache stats.
+ */
+static
+void
+large_printstats(void)
+{
+	spinlock_acquire(&large_spinlock);
+	kprintf("Large allocations: %u pages cached, %u hits, %u misses\n",
+		largecached, largehits, largemisses);
+	spinlock_release(&large_spinlock);
+}
+
 ////////////////////////////////////////
 
 /*
@@ -812,6 +1114,21 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kheap_printprofile();
+	large_printstats();
+
+#ifdef MAGAZINES
+	{
+		unsigned blocks;
+		size_t bytes;
+
+		/* These show as allocated above. */
+		magazine_count(&blocks, &bytes);
+		kprintf("%u blocks (%zu bytes) in per-cpu magazines\n",
+			blocks, bytes);
+	}
+#endif
 }
 
 ////////////////////////////////////////
@@ -867,79 +1184,471 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a block off the freelist of heap page PR, which must have one.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR (the underlying block, not the client
+ * pointer) back on its page's freelist. If that leaves the page
+ * completely free, the page is taken out of the heap and handed back
+ * in FREEPAGE for the caller to free_kpages once it has released the
+ * lock; otherwise FREEPAGE is set to 0. If the block is not on any
+ * heap page we recognize, return -1.
+ */
+static
+int
+subpage_release(vaddr_t ptraddr, vaddr_t *freepage)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 #ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
+	size_t blocksize, smallerblocksize;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	checksubpages();
+	*freepage = 0;
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	pr = getpageref(ptraddr);
+	if (pr == NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
 
-		if (pr->nfree > 0) {
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
-		doalloc: /* comes here after getting a whole fresh page */
+	offset = ptraddr - prpage;
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
+	}
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
 			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		setpageref(prpage, NULL);
+		*freepage = prpage;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////
+
+#ifdef MAGAZINES
+
+/*
+ * Number of blocks a magazine of block type BLKTYPE may hold.
+ */
+static
+unsigned
+magazine_limit(unsigned blktype)
+{
+	unsigned rounds;
+
+	rounds = MAG_BYTES / sizes[blktype];
+	if (rounds > MAG_ROUNDS) {
+		rounds = MAG_ROUNDS;
+	}
+	if (rounds < MAG_MINROUNDS) {
+		rounds = MAG_MINROUNDS;
+	}
+	return rounds;
+}
+
+/*
+ * Get the current cpu's magazines, if it has any. Interrupts must be
+ * off.
+ */
+static
+struct kmalloc_cpu *
+magazine_getcpu(void)
+{
+	unsigned num;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	num = curcpu->c_number;
+	if (num >= KMALLOC_MAXCPUS) {
+		return NULL;
+	}
+	return kmalloc_cpus[num];
+}
+
+/*
+ * Give the current cpu magazines.
+ */
+static
+void
+magazine_setup(void)
+{
+	struct kmalloc_cpu *kc;
+	unsigned num, i;
+	int spl;
+
+	spl = splhigh();
+	if (!CURCPU_EXISTS() || curcpu->c_number >= KMALLOC_MAXCPUS ||
+	    kmalloc_cpus_creating[curcpu->c_number]) {
+		splx(spl);
+		return;
+	}
+	num = curcpu->c_number;
+	kmalloc_cpus_creating[num] = true;
+	splx(spl);
+
+	/* This comes back to magazine_setup, which returns right away. */
+	kc = kmalloc(sizeof(*kc));
+	if (kc != NULL) {
+		for (i=0; i<NSIZES; i++) {
+			kc->kc_mags[i].m_count = 0;
+		}
+	}
+
+	spl = splhigh();
+	KASSERT(kmalloc_cpus[num] == NULL);
+	kmalloc_cpus[num] = kc;
+	kmalloc_cpus_creating[num] = false;
+	splx(spl);
+}
+
+/*
+ * Fill the empty magazine MAG halfway from the global pool, using
+ * only blocks on pages we already have. Interrupts must be off.
+ */
+static
+void
+magazine_refill(struct magazine *mag, unsigned blktype)
+{
+	struct pageref *pr;
+	unsigned want;
+
+	KASSERT(mag->m_count == 0);
+	want = magazine_limit(blktype) / 2;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = sizebases[blktype];
+	     pr != NULL && mag->m_count < want;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		while (pr->nfree > 0 && mag->m_count < want) {
+			mag->m_rounds[mag->m_count++] = subpage_takeblock(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Return the bottom (least recently freed) half of the full magazine
+ * MAG to the global pool. Interrupts must be off.
+ */
+static
+void
+magazine_drain(struct magazine *mag, unsigned blktype)
+{
+	unsigned n, i;
+	vaddr_t freepage;
+	int result;
+
+	n = magazine_limit(blktype) / 2;
+	KASSERT(mag->m_count >= n);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		result = subpage_release((vaddr_t)mag->m_rounds[i], &freepage);
+		KASSERT(result == 0);
+		if (freepage != 0) {
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(freepage);
+			spinlock_acquire(&kmalloc_spinlock);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=n; i<mag->m_count; i++) {
+		mag->m_rounds[i - n] = mag->m_rounds[i];
+	}
+	mag->m_count -= n;
+}
+
+/*
+ * Allocate a block of type BLKTYPE from the current cpu's magazine.
+ * Returns NULL if that doesn't work out, in which case the caller
+ * should use the global pool.
+ */
+static
+void *
+magazine_get(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	void *ret;
+	int spl;
+
+	spl = splhigh();
+	kc = magazine_getcpu();
+	if (kc == NULL) {
+		splx(spl);
+		magazine_setup();
+		return NULL;
+	}
+	mag = &kc->kc_mags[blktype];
+	if (mag->m_count == 0) {
+		magazine_refill(mag, blktype);
+	}
+	ret = NULL;
+	if (mag->m_count > 0) {
+		ret = mag->m_rounds[--mag->m_count];
+	}
+	splx(spl);
+
+	return ret;
+}
+
+/*
+ * Free the block at PTRADDR into the current cpu's magazine. Returns
+ * false if it isn't a subpage block or the cpu has no magazines, in
+ * which case the caller should use the global pool.
+ */
+static
+bool
+magazine_put(vaddr_t ptraddr)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	struct pageref *pr;
+	int blktype;
+	int spl;
+
+	pr = getpageref(ptraddr);
+	if (pr == NULL) {
+		return false;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	if ((ptraddr % PAGE_SIZE) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
+	}
+
+	/* As in subpage_release. */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = magazine_getcpu();
+	if (kc == NULL) {
+		splx(spl);
+		return false;
+	}
+	mag = &kc->kc_mags[blktype];
+	if (mag->m_count >= magazine_limit(blktype)) {
+		magazine_drain(mag, blktype);
+	}
+	mag->m_rounds[mag->m_count++] = (void *)ptraddr;
+	splx(spl);
+
+	return true;
+}
+
+/*
+ * Empty the current cpu's magazines into the global pool, so pages
+ * whose blocks are then all free go back to the page allocator.
+ * Other cpus' magazines can only be touched from their own cpu and
+ * are left alone. Returns the number of pages freed.
+ */
+static
+unsigned
+magazine_flush(void)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	vaddr_t freepage;
+	unsigned i, n;
+	int spl, result;
+
+	n = 0;
+	spl = splhigh();
+	kc = magazine_getcpu();
+	for (i=0; kc != NULL && i<NSIZES; i++) {
+		mag = &kc->kc_mags[i];
+		spinlock_acquire(&kmalloc_spinlock);
+		while (mag->m_count > 0) {
+			mag->m_count--;
+			result = subpage_release(
+				(vaddr_t)mag->m_rounds[mag->m_count],
+				&freepage);
+			KASSERT(result == 0);
+			if (freepage != 0) {
+				/* As in magazine_drain. */
+				spinlock_release(&kmalloc_spinlock);
+				free_kpages(freepage);
+				n++;
+				spinlock_acquire(&kmalloc_spinlock);
 			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+	splx(spl);
+
+	return n;
+}
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+	kheap_countalloc(sz, blktype);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+#ifdef MAGAZINES
+	retptr = magazine_get(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		if (pr->nfree > 0) {
+
+		doalloc: /* comes here after getting a whole fresh page */
+
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -988,6 +1697,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	setpageref(prpage, pr);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1025,16 +1735,8 @@ static
 int
 subpage_kfree(void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
+	vaddr_t freepage;	// page to release, if any
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1061,98 +1763,280 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
+#ifdef MAGAZINES
+	if (magazine_put(ptraddr)) {
+		return 0;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
+	if (subpage_release(ptraddr, &freepage)) {
+		spinlock_release(&kmalloc_spinlock);
+		return -1;
+	}
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (freepage != 0) {
+		/* Call free_kpages without kmalloc_spinlock. */
+		free_kpages(freepage);
+	}
+
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
+
+	return 0;
+}
+
+////////////////////////////////////////
+//
+// Allocation sites.
+//
+// Each kmalloc caller (by return address) gets an entry in a small
+// open-addressed hash table, with slot 0 standing in for everyone
+// once the table fills up. Subpage blocks carry a header holding the
+// slot and the requested size; for whole-page blocks the same thing
+// is kept in largesites[], indexed by page number like largenpages[].
+//
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+#ifdef SITES
+
+#define SITE_HASHSIZE 128
+#define SITE_OVERHEAD sizeof(struct siteheader)
+#define SITE_TOPRINT  32
+
+struct allocsite {
+	vaddr_t site;		/* return address of kmalloc call */
+	unsigned allocs;	/* total allocations */
+	unsigned lastallocs;	/* value of allocs at the last dump */
+	unsigned liveblocks;	/* blocks not yet freed */
+	size_t livebytes;	/* bytes (as requested) not yet freed */
+	size_t peakbytes;	/* highest value of livebytes */
+};
+
+struct siteheader {
+	unsigned index;		/* slot in allocsites[] */
+	unsigned size;		/* size requested */
+};
+
+struct largesite {
+	uint16_t index;
+	uint16_t npages;
+};
+
+static struct spinlock site_spinlock = SPINLOCK_INITIALIZER;
+static struct allocsite allocsites[SITE_HASHSIZE];
+static struct largesite largesites[LARGE_TABLEPAGES];
+
+/*
+ * Find (or make) the slot for SITE and charge it with an allocation
+ * of SZ bytes. Returns the slot.
+ */
+static
+unsigned
+site_charge(vaddr_t site, size_t sz)
+{
+	struct allocsite *as;
+	unsigned i, index;
+
+	index = 0;
+	spinlock_acquire(&site_spinlock);
+	for (i=0; i<SITE_HASHSIZE-1; i++) {
+		index = 1 + (site / 4 + i) % (SITE_HASHSIZE-1);
+		if (allocsites[index].site == site) {
 			break;
 		}
+		if (allocsites[index].site == 0) {
+			allocsites[index].site = site;
+			break;
+		}
+	}
+	if (i == SITE_HASHSIZE-1) {
+		/* full up */
+		index = 0;
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	as = &allocsites[index];
+	as->allocs++;
+	as->liveblocks++;
+	as->livebytes += sz;
+	if (as->livebytes > as->peakbytes) {
+		as->peakbytes = as->livebytes;
 	}
+	spinlock_release(&site_spinlock);
 
-	offset = ptraddr - prpage;
+	return index;
+}
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+/*
+ * Credit slot INDEX with freeing SZ bytes.
+ */
+static
+void
+site_credit(unsigned index, size_t sz)
+{
+	struct allocsite *as;
+
+	KASSERT(index < SITE_HASHSIZE);
+
+	spinlock_acquire(&site_spinlock);
+	as = &allocsites[index];
+	KASSERT(as->liveblocks > 0);
+	KASSERT(as->livebytes >= sz);
+	as->liveblocks--;
+	as->livebytes -= sz;
+	spinlock_release(&site_spinlock);
+}
+
+/*
+ * Record a subpage block of SZ bytes (not counting the header) at
+ * BLOCK allocated from SITE. Returns the pointer to hand out.
+ */
+static
+void *
+site_establish(void *block, size_t sz, vaddr_t site)
+{
+	struct siteheader *sh;
+
+	sh = block;
+	sh->index = site_charge(site, sz);
+	sh->size = sz;
+	sh++;
+	return sh;
+}
+
+/*
+ * Record a whole-page block of NPAGES pages at ADDRESS allocated
+ * from SITE.
+ */
+static
+void
+site_establishlarge(vaddr_t address, unsigned npages, vaddr_t site)
+{
+	unsigned pn;
+
+	pn = large_pagenum(address);
+	if (pn >= LARGE_TABLEPAGES) {
+		return;
 	}
+	largesites[pn].index = site_charge(site, npages * PAGE_SIZE);
+	largesites[pn].npages = npages;
+}
 
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
-#endif
+/*
+ * Undo the above for the block PTR handed out by kmalloc. Returns
+ * the address of the underlying block.
+ */
+static
+void *
+site_release(void *ptr)
+{
+	struct siteheader *sh;
+	unsigned pn;
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		/*
+		 * Subpage blocks are never page-aligned once we've put
+		 * the header in front, so this is a whole-page block.
+		 */
+		pn = large_pagenum((vaddr_t)ptr);
+		if (pn < LARGE_TABLEPAGES && largesites[pn].npages > 0) {
+			site_credit(largesites[pn].index,
+				    largesites[pn].npages * PAGE_SIZE);
+			largesites[pn].npages = 0;
+		}
+		return ptr;
+	}
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	sh = ptr;
+	sh--;
+	site_credit(sh->index, sh->size);
+	return sh;
+}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+/*
+ * Print the busiest sites, by live bytes, and start a new interval
+ * for the count of recent allocations.
+ */
+static
+void
+site_print(void)
+{
+	bool printed[SITE_HASHSIZE];
+	struct allocsite *as;
+	unsigned i, n, best, numsites;
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	numsites = 0;
+	for (i=0; i<SITE_HASHSIZE; i++) {
+		printed[i] = false;
+	}
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&site_spinlock);
+	kprintf("Site         Blocks      Bytes       Peak     Allocs"
+		"     Recent\n");
+	for (n=0; n<SITE_TOPRINT; n++) {
+		best = SITE_HASHSIZE;
+		for (i=0; i<SITE_HASHSIZE; i++) {
+			as = &allocsites[i];
+			if (printed[i] || as->allocs == 0) {
+				continue;
+			}
+			if (best == SITE_HASHSIZE ||
+			    as->livebytes > allocsites[best].livebytes) {
+				best = i;
 			}
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
+		if (best == SITE_HASHSIZE) {
+			break;
+		}
+		printed[best] = true;
+		as = &allocsites[best];
+		if (best == 0) {
+			kprintf("(other)   ");
+		}
+		else {
+			kprintf("%p", (void *)as->site);
+		}
+		kprintf(" %8u %10zu %10zu %10u %10u\n",
+			as->liveblocks, as->livebytes, as->peakbytes,
+			as->allocs, as->allocs - as->lastallocs);
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	for (i=0; i<SITE_HASHSIZE; i++) {
+		as = &allocsites[i];
+		if (as->allocs > 0) {
+			numsites++;
+		}
+		as->lastallocs = as->allocs;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	spinlock_release(&site_spinlock);
+
+	if (numsites > n) {
+		kprintf("(%u more sites not shown)\n", numsites - n);
 	}
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+#else
 
-	return 0;
+#define SITE_OVERHEAD 0
+
+#endif /* SITES */
+
+void
+kheap_printsites(void)
+{
+#ifdef SITES
+	site_print();
+#else
+	kprintf("Enable \"options kmallocsites\" to use this "
+		"functionality.\n");
+#endif
 }
 
 //
@@ -1160,45 +2044,54 @@ subpage_kfree(void *ptr)
 
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * large_alloc depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
+	void *ptr;
+#if defined(LABELS) || defined(SITES)
 	vaddr_t label;
 #endif
 
-#ifdef LABELS
+#if defined(LABELS) || defined(SITES)
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
+#endif /* LABELS || SITES */
 
-	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD + SITE_OVERHEAD;
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		address = large_alloc(npages);
 		if (address==0) {
 			return NULL;
 		}
-		KASSERT(address % PAGE_SIZE == 0);
+#ifdef SITES
+		site_establishlarge(address, npages, label);
+#endif
 
 		return (void *)address;
 	}
 
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	ptr = subpage_kmalloc(sz + SITE_OVERHEAD, label);
 #else
-	return subpage_kmalloc(sz);
+	ptr = subpage_kmalloc(sz + SITE_OVERHEAD);
 #endif
+#ifdef SITES
+	if (ptr != NULL) {
+		ptr = site_establish(ptr, sz, label);
+	}
+#endif
+	return ptr;
 }
 
 /*
@@ -1207,14 +2100,33 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+	if (ptr == NULL) {
+		return;
+	}
+#ifdef SITES
+	ptr = site_release(ptr);
+#endif
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+		large_free((vaddr_t)ptr);
 	}
 }
 
+/*
+ * Reclaim hook: hand back what the current cpu has parked in its
+ * magazines.
+ */
+unsigned
+kheap_reclaim(unsigned npages, unsigned flags)
+{
+	(void)npages;
+	(void)flags;
+#ifdef MAGAZINES
+	return magazine_flush();
+#else
+	return 0;
+#endif
+}
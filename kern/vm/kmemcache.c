@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each cache keeps up to KMEM_CACHE_MAXFREE constructed free objects
+ * in an array; past that, freed objects are destructed and returned
+ * to kmalloc, so a burst of allocations doesn't pin memory forever.
+ * The objects themselves come from kmalloc (and so the subpage
+ * allocator and its per-cpu magazines) and carry no extra header.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <reclaim.h>
+
+#define KMEM_CACHE_MAXFREE	32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects the rest */
+	void *kc_free[KMEM_CACHE_MAXFREE];
+	unsigned kc_nfree;
+	unsigned kc_nlive;		/* allocated and not freed */
+	unsigned kc_nallocs;		/* total allocations */
+	unsigned kc_nctors;		/* ...that had to construct */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+/* All caches, for the stats. */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_nlive = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+/*
+ * Destruct and release an object.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	KASSERT(kc->kc_nlive == 0);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	/* Nobody else can be using it now. */
+	while (kc->kc_nfree > 0) {
+		kmem_cache_release(kc, kc->kc_free[--kc->kc_nfree]);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_nallocs++;
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_nlive++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_nctors++;
+	spinlock_release(&kc->kc_lock);
+
+	/* Make a new one, without the lock. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_nlive++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_nlive > 0);
+	kc->kc_nlive--;
+	if (kc->kc_nfree < KMEM_CACHE_MAXFREE) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Cache is full; really free it. */
+	kmem_cache_release(kc, obj);
+}
+
+/*
+ * Reclaim hook: destruct and free every cached free object. Objects
+ * are released holding kmem_caches_lock (so no cache can go away
+ * under us) but not their cache's own lock.
+ */
+unsigned
+kmem_cache_reclaim(unsigned npages, unsigned flags)
+{
+	struct kmem_cache *kc;
+	size_t bytes;
+	void *obj;
+
+	(void)npages;
+	(void)flags;
+
+	bytes = 0;
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		while (1) {
+			spinlock_acquire(&kc->kc_lock);
+			if (kc->kc_nfree == 0) {
+				spinlock_release(&kc->kc_lock);
+				break;
+			}
+			obj = kc->kc_free[--kc->kc_nfree];
+			spinlock_release(&kc->kc_lock);
+
+			kmem_cache_release(kc, obj);
+			bytes += kc->kc_size;
+		}
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	return bytes / PAGE_SIZE;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-12s %5zu bytes: %u live, %u free, "
+			"%u allocs, %u constructed\n",
+			kc->kc_name, kc->kc_size, kc->kc_nlive, kc->kc_nfree,
+			kc->kc_nallocs, kc->kc_nctors);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
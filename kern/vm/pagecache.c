@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Page cache. See pagecache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <hashtable.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <kstat.h>
+
+#define PAGECACHE_HASHBITS	8	/* to start with; it grows */
+
+/*
+ * One cached page. It is on a hash chain, on its vnode's list, and
+ * on the LRU list (most recently used first).
+ */
+struct pcpage {
+	struct vnode *pp_vnode;
+	off_t pp_offset;
+	paddr_t pp_pa;
+	struct hashnode pp_hashnode;
+	struct pcpage *pp_vnnext;
+	struct pcpage *pp_lrunext, *pp_lruprev;
+};
+
+/*
+ * pagecache_lock protects everything, including vn_pcpages in every
+ * vnode. It's a sleeplock because we pin pages while holding it; we
+ * never do I/O while holding it.
+ */
+static struct lock *pagecache_lock;
+static struct hashtable pagecache_hash;
+static struct pcpage *pagecache_lruhead, *pagecache_lrutail;
+static unsigned pagecache_npages;
+static unsigned pagecache_nhits;
+static unsigned pagecache_nmisses;
+static unsigned pagecache_nreclaimed;
+
+/* Key for hash lookups. */
+struct pckey {
+	struct vnode *pk_vnode;
+	off_t pk_offset;
+};
+
+void
+pagecache_bootstrap(void)
+{
+	pagecache_lock = lock_create("pagecache");
+	if (pagecache_lock == NULL) {
+		panic("pagecache: lock_create failed\n");
+	}
+	if (hashtable_init(&pagecache_hash, PAGECACHE_HASHBITS)) {
+		panic("pagecache: hashtable_init failed\n");
+	}
+	pagecache_lruhead = pagecache_lrutail = NULL;
+}
+
+static
+uint32_t
+pagecache_hashfunc(struct vnode *vn, off_t offset)
+{
+	return hash32(hash32((uint32_t)(uintptr_t)vn) ^
+		      (uint32_t)(offset / PAGE_SIZE));
+}
+
+static
+bool
+pagecache_match(void *obj, const void *keyv)
+{
+	const struct pcpage *pp = obj;
+	const struct pckey *key = keyv;
+
+	return pp->pp_vnode == key->pk_vnode &&
+		pp->pp_offset == key->pk_offset;
+}
+
+////////////////////////////////////////////////////////////
+// list handling
+
+static
+void
+pagecache_lru_remove(struct pcpage *pp)
+{
+	if (pp->pp_lruprev != NULL) {
+		pp->pp_lruprev->pp_lrunext = pp->pp_lrunext;
+	}
+	else {
+		pagecache_lruhead = pp->pp_lrunext;
+	}
+	if (pp->pp_lrunext != NULL) {
+		pp->pp_lrunext->pp_lruprev = pp->pp_lruprev;
+	}
+	else {
+		pagecache_lrutail = pp->pp_lruprev;
+	}
+}
+
+static
+void
+pagecache_lru_addhead(struct pcpage *pp)
+{
+	pp->pp_lruprev = NULL;
+	pp->pp_lrunext = pagecache_lruhead;
+	if (pagecache_lruhead != NULL) {
+		pagecache_lruhead->pp_lruprev = pp;
+	}
+	else {
+		pagecache_lrutail = pp;
+	}
+	pagecache_lruhead = pp;
+}
+
+static
+struct pcpage *
+pagecache_find(struct vnode *vn, off_t offset)
+{
+	struct pckey key;
+
+	KASSERT(lock_do_i_hold(pagecache_lock));
+
+	key.pk_vnode = vn;
+	key.pk_offset = offset;
+	return hashtable_lookup(&pagecache_hash,
+				pagecache_hashfunc(vn, offset),
+				pagecache_match, &key);
+}
+
+/*
+ * Take PP off all lists, drop the cache's reference to its page, and
+ * free it.
+ */
+static
+void
+pagecache_remove(struct pcpage *pp)
+{
+	struct pcpage **ppp;
+
+	KASSERT(lock_do_i_hold(pagecache_lock));
+
+	hashtable_remove(&pagecache_hash, &pp->pp_hashnode);
+
+	for (ppp = &pp->pp_vnode->vn_pcpages; *ppp != pp;
+	     ppp = &(*ppp)->pp_vnnext) {
+		KASSERT(*ppp != NULL);
+	}
+	*ppp = pp->pp_vnnext;
+
+	pagecache_lru_remove(pp);
+	pagecache_npages--;
+
+	if (coremap_pin(pp->pp_pa)) {
+		coremap_freeuser(pp->pp_pa);
+	}
+	else {
+		panic("pagecache: cached page went away\n");
+	}
+	hashnode_cleanup(&pp->pp_hashnode);
+	kfree(pp);
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+paddr_t
+pagecache_lookup(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+	paddr_t pa;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pagecache_lock);
+	pp = pagecache_find(vn, offset);
+	if (pp == NULL) {
+		pagecache_nmisses++;
+		lock_release(pagecache_lock);
+		return 0;
+	}
+	pa = pp->pp_pa;
+	if (!coremap_pin(pa)) {
+		/* The cache's reference keeps it a user page. */
+		panic("pagecache: cached page went away\n");
+	}
+	coremap_increfuser(pa);
+	pagecache_lru_remove(pp);
+	pagecache_lru_addhead(pp);
+	pagecache_nhits++;
+	lock_release(pagecache_lock);
+
+	return pa;
+}
+
+paddr_t
+pagecache_insert(struct vnode *vn, off_t offset, paddr_t pa)
+{
+	struct pcpage *pp;
+	paddr_t cachedpa;
+
+	/*
+	 * Allocate before locking: kmalloc may wait on pageout, which
+	 * reclaims cached pages.
+	 */
+	pp = kmalloc(sizeof(*pp));
+	hashtable_prepare(&pagecache_hash);
+
+	lock_acquire(pagecache_lock);
+	if (pagecache_find(vn, offset) != NULL) {
+		/* Lost a race; use the cached copy. */
+		lock_release(pagecache_lock);
+		kfree(pp);
+		cachedpa = pagecache_lookup(vn, offset);
+		if (cachedpa != 0) {
+			coremap_freeuser(pa);
+			return cachedpa;
+		}
+		/* ...and it went away again. Just keep ours private. */
+		return pa;
+	}
+	if (pp == NULL) {
+		/* Can't cache it; that's OK, it's just private. */
+		lock_release(pagecache_lock);
+		return pa;
+	}
+
+	pp->pp_vnode = vn;
+	pp->pp_offset = offset;
+	pp->pp_pa = pa;
+	hashnode_init(&pp->pp_hashnode, pp);
+	hashtable_add(&pagecache_hash, &pp->pp_hashnode,
+		      pagecache_hashfunc(vn, offset));
+	pp->pp_vnnext = vn->vn_pcpages;
+	vn->vn_pcpages = pp;
+	pagecache_lru_addhead(pp);
+	pagecache_npages++;
+
+	coremap_increfuser(pa);
+	lock_release(pagecache_lock);
+
+	return pa;
+}
+
+int
+pagecache_read(struct vnode *vn, struct uio *uio, off_t size)
+{
+	off_t offset;
+	size_t skip, len;
+	paddr_t pa;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	/* Unlocked peek, as in pagecache_purge. */
+	while (vn->vn_pcpages != NULL &&
+	       uio->uio_resid > 0 && uio->uio_offset < size) {
+		skip = uio->uio_offset % PAGE_SIZE;
+		offset = uio->uio_offset - skip;
+		pa = pagecache_lookup(vn, offset);
+		if (pa == 0) {
+			break;
+		}
+
+		/*
+		 * Hold the page by our reference rather than the pin
+		 * while copying: uiomove may fault, and the fault may
+		 * need to reclaim or purge cached pages, which pins
+		 * them. A page with our reference isn't reclaimable.
+		 */
+		coremap_unpin(pa);
+
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if ((off_t)len > size - uio->uio_offset) {
+			len = size - uio->uio_offset;
+		}
+		result = uiomove((char *)PADDR_TO_KVADDR(pa) + skip, len, uio);
+
+		if (!coremap_pin(pa)) {
+			panic("pagecache: referenced page went away\n");
+		}
+		coremap_freeuser(pa);
+
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+void
+pagecache_purge(struct vnode *vn)
+{
+	/*
+	 * Unlocked peek: the common case is a vnode with nothing
+	 * cached, and pages are only added by faults on mappings,
+	 * which hold a vnode reference and are not racing with
+	 * writes in any way we promise to handle.
+	 */
+	if (vn->vn_pcpages == NULL) {
+		return;
+	}
+
+	lock_acquire(pagecache_lock);
+	while (vn->vn_pcpages != NULL) {
+		pagecache_remove(vn->vn_pcpages);
+	}
+	lock_release(pagecache_lock);
+}
+
+unsigned
+pagecache_reclaim(unsigned npages)
+{
+	struct pcpage *pp, *prev;
+	unsigned n;
+
+	n = 0;
+	lock_acquire(pagecache_lock);
+	for (pp = pagecache_lrutail; pp != NULL && n < npages; pp = prev) {
+		prev = pp->pp_lruprev;
+		if (coremap_userrefs(pp->pp_pa) == 1) {
+			/* Only the cache has it. */
+			pagecache_remove(pp);
+			n++;
+		}
+	}
+	pagecache_nreclaimed += n;
+	lock_release(pagecache_lock);
+
+	return n;
+}
+
+void
+pagecache_printstats(void)
+{
+	lock_acquire(pagecache_lock);
+	kprintf("pagecache: %u pages, %u hits, %u misses, %u reclaimed\n",
+		pagecache_npages, pagecache_nhits, pagecache_nmisses,
+		pagecache_nreclaimed);
+	lock_release(pagecache_lock);
+}
+
+void
+pagecache_kstat(struct kstat *ks)
+{
+	unsigned npages, nhits, nmisses, nreclaimed;
+
+	lock_acquire(pagecache_lock);
+	npages = pagecache_npages;
+	nhits = pagecache_nhits;
+	nmisses = pagecache_nmisses;
+	nreclaimed = pagecache_nreclaimed;
+	lock_release(pagecache_lock);
+
+	kstat_add(ks, "vm.pagecache.pages", npages);
+	kstat_add(ks, "vm.pagecache.hits", nhits);
+	kstat_add(ks, "vm.pagecache.misses", nmisses);
+	kstat_add(ks, "vm.pagecache.reclaimed", nreclaimed);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Two-level page table. See pagetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <membar.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		pt->pt_l2[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		l2 = pt->pt_l2[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			if (pt_pin(&l2[j])) {
+				coremap_freeuser(PTE_PADDR(l2[j]));
+			}
+			else if (l2[j] & PTE_SWAPPED) {
+				swap_free(PTE_SLOT(l2[j]));
+			}
+		}
+		kfree(l2);
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+	unsigned j;
+
+	l2 = pt->pt_l2[PT_L1INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_L2ENTRIES * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			l2[j] = 0;
+		}
+		/*
+		 * The TLB refill handler may be walking this table on
+		 * another CPU (another thread of the process), so the
+		 * zeroes must be visible before the pointer is.
+		 */
+		membar_store_store();
+		pt->pt_l2[PT_L1INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2INDEX(vaddr)];
+}
+
+int
+pt_copy(struct pagetable *oldpt, struct pagetable *newpt)
+{
+	unsigned i, j, slot;
+	pte_t *oldl2, *newpte;
+	vaddr_t va;
+	int result;
+
+	for (i=0; i<PT_L1ENTRIES; i++) {
+		oldl2 = oldpt->pt_l2[i];
+		if (oldl2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2ENTRIES; j++) {
+			if (oldl2[j] == 0) {
+				continue;
+			}
+			va = ((vaddr_t)i << (32 - PT_L1BITS)) |
+				((vaddr_t)j << 12);
+			newpte = pt_lookup(newpt, va, true);
+			if (newpte == NULL) {
+				return ENOMEM;
+			}
+			if (!pt_pin(&oldl2[j])) {
+				/* In swap; the child gets its own copy. */
+				KASSERT(oldl2[j] & PTE_SWAPPED);
+				result = swap_dup(PTE_SLOT(oldl2[j]), &slot);
+				if (result) {
+					return result;
+				}
+				*newpte = PTE_MKSWAP(slot, oldl2[j]);
+				continue;
+			}
+			if ((oldl2[j] & (PTE_WRITE|PTE_SHARED)) == PTE_WRITE) {
+				oldl2[j] &= ~PTE_WRITE;
+				oldl2[j] |= PTE_COW;
+			}
+			coremap_increfuser(PTE_PADDR(oldl2[j]));
+			*newpte = oldl2[j] & ~(PTE_LOCKED|PTE_REF);
+			coremap_unpin(PTE_PADDR(oldl2[j]));
+		}
+	}
+	return 0;
+}
+
+bool
+pt_pin(pte_t *pte)
+{
+	pte_t old;
+
+	while (1) {
+		old = *pte;
+		if ((old & PTE_VALID) == 0) {
+			return false;
+		}
+		if (coremap_pin(PTE_PADDR(old))) {
+			if (*pte == old) {
+				return true;
+			}
+			/* Paged out and the frame reused while we waited. */
+			coremap_unpin(PTE_PADDR(old));
+		}
+	}
+}
+
+void
+pt_unmap(struct pagetable *pt, vaddr_t vaddr)
+{
+	pte_t *pte;
+	paddr_t pa;
+
+	pte = pt_lookup(pt, vaddr, false);
+	if (pte == NULL) {
+		return;
+	}
+	if (pt_pin(pte)) {
+		pa = PTE_PADDR(*pte);
+		*pte = 0;
+		coremap_freeuser(pa);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(*pte));
+		*pte = 0;
+	}
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory reclaim hooks. See reclaim.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <coremap.h>
+#include <reclaim.h>
+
+#include "opt-dumbvm.h"
+
+/*
+ * The list only ever grows, at the tail, so once we have the head we
+ * can walk it without the lock. The counters in each reclaimer are
+ * updated without the lock and may occasionally lose a count.
+ */
+static struct reclaimer reclaim_kheap =
+	RECLAIMER_INITIALIZER("kmalloc", kheap_reclaim);
+static struct reclaimer reclaim_kmemcache =
+	{ "kmemcache", kmem_cache_reclaim, 0, 0, &reclaim_kheap };
+
+static struct spinlock reclaim_lock = SPINLOCK_INITIALIZER;
+static struct reclaimer *reclaimers = &reclaim_kmemcache;
+static struct reclaimer **reclaimers_tail = &reclaim_kheap.rc_next;
+
+void
+reclaim_register(struct reclaimer *rc)
+{
+	KASSERT(rc->rc_func != NULL);
+
+	rc->rc_next = NULL;
+	spinlock_acquire(&reclaim_lock);
+	*reclaimers_tail = rc;
+	reclaimers_tail = &rc->rc_next;
+	spinlock_release(&reclaim_lock);
+}
+
+unsigned
+reclaim_run(unsigned npages, unsigned flags)
+{
+	struct reclaimer *rc;
+	unsigned n, got;
+
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	if (curthread->t_reclaiming) {
+		/* A reclaimer ran out of memory; don't go round again. */
+		return 0;
+	}
+	curthread->t_reclaiming = true;
+
+	spinlock_acquire(&reclaim_lock);
+	rc = reclaimers;
+	spinlock_release(&reclaim_lock);
+
+	n = 0;
+	for (; rc != NULL && n < npages; rc = rc->rc_next) {
+		got = rc->rc_func(npages - n, flags);
+		rc->rc_calls++;
+		rc->rc_pages += got;
+		n += got;
+	}
+
+	curthread->t_reclaiming = false;
+	return n;
+}
+
+bool
+reclaim_plenty(unsigned npages)
+{
+#if OPT_DUMBVM
+	(void)npages;
+	return false;
+#else
+	return coremap_plenty(npages);
+#endif
+}
+
+void
+reclaim_printstats(void)
+{
+	struct reclaimer *rc;
+
+	spinlock_acquire(&reclaim_lock);
+	rc = reclaimers;
+	spinlock_release(&reclaim_lock);
+
+	kprintf("Reclaimers:\n");
+	for (; rc != NULL; rc = rc->rc_next) {
+		kprintf("%-12s %u calls, %u pages\n",
+			rc->rc_name, rc->rc_calls, rc->rc_pages);
+	}
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory segments. See shm.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <coremap.h>
+#include <shm.h>
+
+/*
+ * shm_lock is a sleeplock because we pin pages while holding it.
+ */
+struct shm {
+	struct lock *shm_lock;		/* protects the rest */
+	unsigned shm_refcount;
+	unsigned shm_npages;
+	paddr_t *shm_pages;		/* 0 until touched */
+};
+
+struct shm *
+shm_create(unsigned npages)
+{
+	struct shm *shm;
+	unsigned i;
+
+	shm = kmalloc(sizeof(*shm));
+	if (shm == NULL) {
+		return NULL;
+	}
+	shm->shm_pages = kmalloc(npages * sizeof(shm->shm_pages[0]));
+	if (shm->shm_pages == NULL) {
+		kfree(shm);
+		return NULL;
+	}
+	shm->shm_lock = lock_create("shm");
+	if (shm->shm_lock == NULL) {
+		kfree(shm->shm_pages);
+		kfree(shm);
+		return NULL;
+	}
+	for (i=0; i<npages; i++) {
+		shm->shm_pages[i] = 0;
+	}
+	shm->shm_refcount = 1;
+	shm->shm_npages = npages;
+	return shm;
+}
+
+void
+shm_incref(struct shm *shm)
+{
+	lock_acquire(shm->shm_lock);
+	KASSERT(shm->shm_refcount > 0);
+	shm->shm_refcount++;
+	lock_release(shm->shm_lock);
+}
+
+void
+shm_decref(struct shm *shm)
+{
+	unsigned i;
+	paddr_t pa;
+	bool last;
+
+	lock_acquire(shm->shm_lock);
+	KASSERT(shm->shm_refcount > 0);
+	shm->shm_refcount--;
+	last = shm->shm_refcount == 0;
+	lock_release(shm->shm_lock);
+
+	if (!last) {
+		return;
+	}
+
+	for (i=0; i<shm->shm_npages; i++) {
+		pa = shm->shm_pages[i];
+		if (pa == 0) {
+			continue;
+		}
+		if (!coremap_pin(pa)) {
+			/* Our reference keeps it a user page. */
+			panic("shm: segment page went away\n");
+		}
+		coremap_freeuser(pa);
+	}
+	lock_destroy(shm->shm_lock);
+	kfree(shm->shm_pages);
+	kfree(shm);
+}
+
+paddr_t
+shm_lookup(struct shm *shm, unsigned index)
+{
+	paddr_t pa;
+
+	KASSERT(index < shm->shm_npages);
+
+	lock_acquire(shm->shm_lock);
+	pa = shm->shm_pages[index];
+	if (pa != 0) {
+		if (!coremap_pin(pa)) {
+			panic("shm: segment page went away\n");
+		}
+		coremap_increfuser(pa);
+	}
+	lock_release(shm->shm_lock);
+
+	return pa;
+}
+
+paddr_t
+shm_insert(struct shm *shm, unsigned index, paddr_t pa)
+{
+	paddr_t cur;
+
+	KASSERT(index < shm->shm_npages);
+
+	lock_acquire(shm->shm_lock);
+	cur = shm->shm_pages[index];
+	if (cur != 0) {
+		/* Lost a race; use the segment's page. */
+		if (!coremap_pin(cur)) {
+			panic("shm: segment page went away\n");
+		}
+		coremap_increfuser(cur);
+		lock_release(shm->shm_lock);
+		coremap_freeuser(pa);
+		return cur;
+	}
+	shm->shm_pages[index] = pa;
+	coremap_increfuser(pa);
+	lock_release(shm->shm_lock);
+
+	return pa;
+}
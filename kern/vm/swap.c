@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Swap space and the pageout thread.
+ *
+ * Pageout works in clusters: a batch of victims is sorted by address
+ * space and virtual address and written to consecutive swap slots
+ * with one I/O per run. Each slot remembers which page it holds, so
+ * swapping a page back in can read ahead the following slots in the
+ * same transfer when they belong to the same address space.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <stat.h>
+#include <clock.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <reclaim.h>
+#include <kstat.h>
+
+/* Maximum number of pages written or read in one transfer. */
+#define SWAP_CLUSTER	16
+
+/*
+ * What's in a swap slot: page SS_VADDR of SS_AS. SS_AS is NULL if
+ * the slot is free or the owner isn't known (after swap_dup).
+ */
+struct swap_slot {
+	struct addrspace *ss_as;
+	vaddr_t ss_vaddr;
+};
+
+/* The swap device, or NULL if there isn't one. Fixed after boot. */
+static struct vnode *swap_vnode;
+static unsigned swap_nslots;
+
+/* swap_lock protects everything below. */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct bitmap *swap_map;
+static struct swap_slot *swap_slots;
+static unsigned swap_rotor;		/* where to look for free slots */
+static unsigned swap_nused;
+static unsigned swap_npageouts;
+static unsigned swap_nwrites;
+static unsigned swap_npageins;
+static unsigned swap_nreadahead;
+static unsigned swap_nreads;
+
+////////////////////////////////////////////////////////////
+// slots
+
+/*
+ * Allocate a run of consecutive free slots, at most WANT long. The
+ * first slot is returned in START. Returns the length of the run,
+ * or 0 if swap is full.
+ */
+static
+unsigned
+swap_allocslots(unsigned want, unsigned *start)
+{
+	unsigned i, slot, got;
+
+	KASSERT(want > 0);
+
+	if (swap_vnode == NULL) {
+		return 0;
+	}
+
+	spinlock_acquire(&swap_lock);
+	got = 0;
+	for (i=0; i<swap_nslots; i++) {
+		slot = (swap_rotor + i) % swap_nslots;
+		if (!bitmap_isset(swap_map, slot)) {
+			break;
+		}
+	}
+	if (i < swap_nslots) {
+		*start = slot;
+		while (got < want && slot + got < swap_nslots &&
+		       !bitmap_isset(swap_map, slot + got)) {
+			bitmap_mark(swap_map, slot + got);
+			swap_slots[slot + got].ss_as = NULL;
+			swap_slots[slot + got].ss_vaddr = 0;
+			got++;
+		}
+		swap_rotor = (slot + got) % swap_nslots;
+		swap_nused += got;
+	}
+	spinlock_release(&swap_lock);
+
+	return got;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_slots[slot].ss_as = NULL;
+	swap_slots[slot].ss_vaddr = 0;
+	KASSERT(swap_nused > 0);
+	swap_nused--;
+	spinlock_release(&swap_lock);
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Transfer NPAGES pages between the physical pages in PAS and the
+ * consecutive slots starting at SLOT, in one operation.
+ */
+static
+int
+swap_io(unsigned slot, const paddr_t *pas, unsigned npages,
+	enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	KASSERT(slot + npages <= swap_nslots);
+
+	for (i=0; i<npages; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = npages;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = npages * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (rw == UIO_READ) {
+		swap_nreads++;
+	}
+	else {
+		swap_nwrites++;
+	}
+	spinlock_release(&swap_lock);
+
+	return 0;
+}
+
+/*
+ * Check whether slot SLOT holds a page of AS that is still waiting
+ * to be swapped in, and if so return its page table entry and put
+ * its address in VADDR_RET.
+ */
+static
+pte_t *
+swap_readahead_pte(struct addrspace *as, unsigned slot, vaddr_t *vaddr_ret)
+{
+	vaddr_t vaddr;
+	pte_t *pte;
+	bool mine;
+
+	if (slot >= swap_nslots) {
+		return NULL;
+	}
+
+	spinlock_acquire(&swap_lock);
+	mine = bitmap_isset(swap_map, slot) && swap_slots[slot].ss_as == as;
+	vaddr = swap_slots[slot].ss_vaddr;
+	spinlock_release(&swap_lock);
+	if (!mine) {
+		return NULL;
+	}
+
+	/* Only this address space's own thread changes swapped PTEs. */
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || (*pte & PTE_SWAPPED) == 0 ||
+	    PTE_SLOT(*pte) != slot) {
+		return NULL;
+	}
+	*vaddr_ret = vaddr;
+	return pte;
+}
+
+int
+swap_pagein(struct addrspace *as, unsigned slot, paddr_t pa, bool readahead)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	pte_t *ptes[SWAP_CLUSTER];
+	vaddr_t vaddr;
+	unsigned n, i;
+	int result;
+
+	/*
+	 * Read ahead the following slots while they hold pages of AS
+	 * that are still out, and we can get memory without paging
+	 * anything else out.
+	 */
+	pas[0] = pa;
+	ptes[0] = NULL;
+	for (n=1; readahead && n<SWAP_CLUSTER; n++) {
+		ptes[n] = swap_readahead_pte(as, slot + n, &vaddr);
+		if (ptes[n] == NULL) {
+			break;
+		}
+		pas[n] = coremap_allocuser(as, vaddr, false);
+		if (pas[n] == 0) {
+			break;
+		}
+	}
+
+	result = swap_io(slot, pas, n, UIO_READ);
+	if (result) {
+		for (i=1; i<n; i++) {
+			coremap_freeuser(pas[i]);
+		}
+		return result;
+	}
+
+	for (i=1; i<n; i++) {
+		*ptes[i] = pas[i] | PTE_VALID |
+			(*ptes[i] & (PTE_WRITE | PTE_COW));
+		coremap_unpin(pas[i]);
+		swap_free(slot + i);
+	}
+	swap_free(slot);
+
+	spinlock_acquire(&swap_lock);
+	swap_npageins += n;
+	swap_nreadahead += n - 1;
+	spinlock_release(&swap_lock);
+
+	return 0;
+}
+
+int
+swap_dup(unsigned slot, unsigned *newslot)
+{
+	vaddr_t buf;
+	paddr_t pa;
+	int result;
+
+	buf = alloc_kpages(1);
+	if (buf == 0) {
+		return ENOMEM;
+	}
+	pa = KVADDR_TO_PADDR(buf);
+
+	if (swap_allocslots(1, newslot) == 0) {
+		free_kpages(buf);
+		return ENOSPC;
+	}
+
+	result = swap_io(slot, &pa, 1, UIO_READ);
+	if (result == 0) {
+		result = swap_io(*newslot, &pa, 1, UIO_WRITE);
+	}
+	if (result) {
+		swap_free(*newslot);
+	}
+	free_kpages(buf);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// pageout
+
+/*
+ * A page chosen for eviction.
+ */
+struct swap_victim {
+	struct addrspace *sv_as;
+	vaddr_t sv_vaddr;
+	paddr_t sv_pa;
+	pte_t *sv_pte;
+};
+
+/*
+ * Order victims by address space, then address, so neighbouring
+ * pages land in neighbouring slots. (Insertion sort; N is small.)
+ */
+static
+void
+swap_sortvictims(struct swap_victim *v, unsigned n)
+{
+	struct swap_victim tmp;
+	unsigned i, j;
+
+	for (i=1; i<n; i++) {
+		tmp = v[i];
+		for (j=i; j>0; j--) {
+			if ((uintptr_t)v[j-1].sv_as < (uintptr_t)tmp.sv_as) {
+				break;
+			}
+			if (v[j-1].sv_as == tmp.sv_as &&
+			    v[j-1].sv_vaddr < tmp.sv_vaddr) {
+				break;
+			}
+			v[j] = v[j-1];
+		}
+		v[j] = tmp;
+	}
+}
+
+/*
+ * Page out up to MAXPAGES pages. Returns the number evicted in
+ * NEVICTED; fails with ENOMEM if nothing could be evicted, ENOSPC if
+ * swap is full, or an I/O error.
+ */
+static
+int
+swap_pageout(unsigned maxpages, unsigned *nevicted)
+{
+	struct swap_victim v[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	unsigned n, i, j, start, got, done;
+	int result;
+
+	KASSERT(maxpages > 0 && maxpages <= SWAP_CLUSTER);
+	*nevicted = 0;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	for (n=0; n<maxpages; n++) {
+		v[n].sv_pa = coremap_getvictim(&v[n].sv_as, &v[n].sv_vaddr);
+		if (v[n].sv_pa == 0) {
+			break;
+		}
+	}
+	if (n == 0) {
+		return ENOMEM;
+	}
+	swap_sortvictims(v, n);
+
+	/*
+	 * The pages are pinned, so their page table entries can't
+	 * change and vm_fault loads no new translations to them; the
+	 * hold keeps the TLB refill handler, which doesn't look at
+	 * pins, from loading any either. Get rid of the existing ones
+	 * before writing the pages out, so they can't be changed under
+	 * us. One shootdown covers all the victims from each address
+	 * space.
+	 */
+	mmu_refill_hold();
+	for (i=0; i<n; i=j) {
+		for (j=i; j<n && v[j].sv_as == v[i].sv_as; j++) {
+			v[j].sv_pte = pt_lookup(v[j].sv_as->as_pt,
+						v[j].sv_vaddr, false);
+			KASSERT(v[j].sv_pte != NULL);
+			KASSERT(*v[j].sv_pte & PTE_VALID);
+			KASSERT(PTE_PADDR(*v[j].sv_pte) == v[j].sv_pa);
+		}
+		vm_shootdown(v[i].sv_as, v[i].sv_vaddr,
+			     (v[j-1].sv_vaddr - v[i].sv_vaddr) / PAGE_SIZE + 1);
+	}
+
+	result = 0;
+	for (done=0; done<n; done += got) {
+		got = swap_allocslots(n - done, &start);
+		if (got == 0) {
+			result = ENOSPC;
+			break;
+		}
+		for (i=0; i<got; i++) {
+			pas[i] = v[done + i].sv_pa;
+		}
+		result = swap_io(start, pas, got, UIO_WRITE);
+		if (result) {
+			for (i=0; i<got; i++) {
+				swap_free(start + i);
+			}
+			break;
+		}
+
+		spinlock_acquire(&swap_lock);
+		for (i=0; i<got; i++) {
+			swap_slots[start + i].ss_as = v[done + i].sv_as;
+			swap_slots[start + i].ss_vaddr = v[done + i].sv_vaddr;
+		}
+		swap_npageouts += got;
+		spinlock_release(&swap_lock);
+
+		for (i=0; i<got; i++) {
+			*v[done + i].sv_pte = PTE_MKSWAP(start + i,
+							 *v[done + i].sv_pte);
+			coremap_freeuser(v[done + i].sv_pa);
+		}
+	}
+
+	/* Put back whatever we couldn't write. */
+	for (i=done; i<n; i++) {
+		coremap_unpin(v[i].sv_pa);
+	}
+	mmu_refill_release();
+
+	*nevicted = done;
+	return done > 0 ? 0 : result;
+}
+
+int
+swap_evict(void)
+{
+	unsigned n;
+
+	return swap_pageout(1, &n);
+}
+
+/*
+ * The pageout thread. Sleeps until memory is low, then evicts pages
+ * a cluster at a time until it's comfortable again.
+ */
+static
+void
+swap_pageout_thread(void *data1, unsigned long data2)
+{
+	unsigned n;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		coremap_pageout_wait();
+		while (coremap_pageout_wanted()) {
+			if (reclaim_run(SWAP_CLUSTER, 0) > 0) {
+				/* Kernel caches give back spare memory. */
+				continue;
+			}
+			if (pagecache_reclaim(SWAP_CLUSTER) > 0) {
+				/* Unmapped file pages go first. */
+				continue;
+			}
+			if (swap_pageout(SWAP_CLUSTER, &n)) {
+				/* Nothing to do for now; don't spin. */
+				clocksleep(1);
+				break;
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// setup and stats
+
+void
+swap_bootstrap(void)
+{
+	struct vnode *vn;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	result = vfs_swapon(SWAP_DEVICE, &vn);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		return;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_slots = kmalloc(swap_nslots * sizeof(struct swap_slot));
+	if (swap_map == NULL || swap_slots == NULL) {
+		panic("swap: Out of memory\n");
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_slots[i].ss_as = NULL;
+		swap_slots[i].ss_vaddr = 0;
+	}
+	swap_rotor = 0;
+	swap_vnode = vn;
+
+	result = thread_fork("pageout", NULL, swap_pageout_thread, NULL, 0);
+	if (result) {
+		panic("swap: thread_fork: %s\n", strerror(result));
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nused, npageouts, nwrites, npageins, nreadahead, nreads;
+
+	if (swap_vnode == NULL) {
+		kprintf("swap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	npageouts = swap_npageouts;
+	nwrites = swap_nwrites;
+	npageins = swap_npageins;
+	nreadahead = swap_nreadahead;
+	nreads = swap_nreads;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u of %u pages used\n", nused, swap_nslots);
+	kprintf("swap: %u pageouts in %u writes\n", npageouts, nwrites);
+	kprintf("swap: %u pageins (%u read ahead) in %u reads\n",
+		npageins, nreadahead, nreads);
+}
+
+void
+swap_kstat(struct kstat *ks)
+{
+	unsigned nused, npageouts, nwrites, npageins, nreadahead, nreads;
+
+	if (swap_vnode == NULL) {
+		kstat_add(ks, "vm.swap.slots", 0);
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	npageouts = swap_npageouts;
+	nwrites = swap_nwrites;
+	npageins = swap_npageins;
+	nreadahead = swap_nreadahead;
+	nreads = swap_nreads;
+	spinlock_release(&swap_lock);
+
+	kstat_add(ks, "vm.swap.slots", swap_nslots);
+	kstat_add(ks, "vm.swap.used", nused);
+	kstat_add(ks, "vm.swap.pageouts", npageouts);
+	kstat_add(ks, "vm.swap.writes", nwrites);
+	kstat_add(ks, "vm.swap.pageins", npageins);
+	kstat_add(ks, "vm.swap.readahead", nreadahead);
+	kstat_add(ks, "vm.swap.reads", nreads);
+}
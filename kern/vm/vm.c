@@ -0,0 +1,704 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Machine-independent VM system: fault handling.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <cpu.h>
+#include <membar.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <kevent.h>
+#include <pcpu.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <shm.h>
+#include <reclaim.h>
+#include <uio.h>
+#include <vnode.h>
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	pagecache_bootstrap();
+	swap_bootstrap();
+}
+
+/*
+ * Get a pinned page for page VADDR of AS, paging something out
+ * first if memory is full. If ZERO is set, the page is zero-filled.
+ */
+static
+int
+vm_allocpage(struct addrspace *as, vaddr_t vaddr, bool zero, paddr_t *ret)
+{
+	paddr_t pa;
+	int result;
+
+	while (1) {
+		pa = coremap_allocuser(as, vaddr, zero);
+		if (pa != 0) {
+			*ret = pa;
+			return 0;
+		}
+		if (reclaim_run(1, RECLAIM_NOFS) > 0) {
+			/* Kernel caches give back spare memory first. */
+			continue;
+		}
+		if (pagecache_reclaim(1) > 0) {
+			/* Dropping a cached file page is cheaper. */
+			continue;
+		}
+		result = swap_evict();
+		if (result) {
+			/* No swap, or swap is full */
+			return ENOMEM;
+		}
+	}
+}
+
+/*
+ * Fill in page VADDR of region REG, whose memory is the pinned page
+ * PA, for its first use: read whatever part of it comes from the
+ * region's file. The page is already zeroed.
+ */
+static
+int
+vm_fillpage(struct as_region *reg, vaddr_t vaddr, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	if (reg->ar_vnode == NULL) {
+		return 0;
+	}
+
+	/* Intersect the page with the file data. */
+	start = vaddr;
+	if (start < reg->ar_fileva) {
+		start = reg->ar_fileva;
+	}
+	end = vaddr + PAGE_SIZE;
+	if (end > reg->ar_fileva + reg->ar_filesize) {
+		end = reg->ar_fileva + reg->ar_filesize;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + (start - vaddr)),
+		  end - start, reg->ar_fileoff + (start - reg->ar_fileva),
+		  UIO_READ);
+	result = VOP_READ(reg->ar_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* File got truncated? */
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Get the page of VN at page-aligned file offset OFFSET from the page
+ * cache, reading it in if it isn't there yet. Returns it pinned.
+ */
+static
+int
+vm_filepage(struct addrspace *as, vaddr_t vaddr, struct vnode *vn,
+	    off_t offset, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa;
+	int result;
+
+	pa = pagecache_lookup(vn, offset);
+	if (pa != 0) {
+		*ret = pa;
+		return 0;
+	}
+
+	result = vm_allocpage(as, vaddr, false, &pa);
+	if (result) {
+		return result;
+	}
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE, offset,
+		  UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result) {
+		coremap_freeuser(pa);
+		return result;
+	}
+	/* Past EOF reads as zero. */
+	bzero((char *)PADDR_TO_KVADDR(pa) + (PAGE_SIZE - ku.uio_resid),
+	      ku.uio_resid);
+
+	*ret = pagecache_insert(vn, offset, pa);
+	return 0;
+}
+
+/*
+ * Get page VADDR of region REG, which maps a shared segment, from
+ * the segment, allocating it if nobody has touched it yet. Returns it
+ * pinned. The page gets no owner, so it's never paged out.
+ */
+static
+int
+vm_shmpage(struct as_region *reg, vaddr_t vaddr, paddr_t *ret)
+{
+	unsigned index;
+	paddr_t pa;
+	int result;
+
+	index = (vaddr - reg->ar_vbase) / PAGE_SIZE;
+	pa = shm_lookup(reg->ar_shm, index);
+	if (pa != 0) {
+		*ret = pa;
+		return 0;
+	}
+
+	result = vm_allocpage(NULL, 0, true, &pa);
+	if (result) {
+		return result;
+	}
+	*ret = shm_insert(reg->ar_shm, index, pa);
+	return 0;
+}
+
+/*
+ * Get the pinned page for the first use of page VADDR of region REG.
+ * *SHARED is set if it's a page cache page, which must not be
+ * written.
+ *
+ * Pages that lie wholly within the file data of the region, at a
+ * page-aligned file offset, are the file's own pages and come from
+ * the page cache; every process running the same program, or mapping
+ * the same file, shares one copy. Not while loading, though, since
+ * the kernel may then write to read-only pages. Other pages (BSS, the
+ * partial page at the end of a segment) are private.
+ */
+static
+int
+vm_firstpage(struct addrspace *as, struct as_region *reg, vaddr_t vaddr,
+	     paddr_t *ret, bool *shared)
+{
+	paddr_t pa;
+	int result;
+
+	*shared = false;
+	if (reg->ar_vnode != NULL && !as->as_loading &&
+	    (reg->ar_fileoff - reg->ar_fileva) % PAGE_SIZE == 0 &&
+	    vaddr >= reg->ar_fileva &&
+	    vaddr + PAGE_SIZE <= reg->ar_fileva + reg->ar_filesize) {
+		*shared = true;
+		return vm_filepage(as, vaddr, reg->ar_vnode,
+				   reg->ar_fileoff + (vaddr - reg->ar_fileva),
+				   ret);
+	}
+
+	result = vm_allocpage(as, vaddr, true, &pa);
+	if (result) {
+		return result;
+	}
+	result = vm_fillpage(reg, vaddr, pa);
+	if (result) {
+		coremap_freeuser(pa);
+		return result;
+	}
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * Handle a write to the copy-on-write page VADDR, whose entry is
+ * PTE. The page is pinned, and on success the page PTE names
+ * afterwards is pinned. If nobody else maps the page any more it's
+ * just made writeable again; otherwise it's copied.
+ */
+static
+int
+vm_cowfault(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+	int result;
+
+	oldpa = PTE_PADDR(*pte);
+	if (coremap_userrefs(oldpa) == 1) {
+		newpa = oldpa;
+		coremap_setowner(oldpa, as, vaddr);
+	}
+	else {
+		result = vm_allocpage(as, vaddr, false, &newpa);
+		if (result) {
+			return result;
+		}
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		coremap_freeuser(oldpa);
+	}
+	*pte = newpa | (*pte & ~(PAGE_FRAME | PTE_COW)) | PTE_WRITE;
+	if (*pte & PTE_LOCKED) {
+		/*
+		 * Sharing unwired the page. Over the wiring limit the
+		 * copy stays pageable, which is all we can do here.
+		 */
+		(void)coremap_setwired(newpa, true);
+	}
+
+	/* Other CPUs may still map the old page read-only. */
+	vm_shootdown(as, vaddr, 1);
+	return 0;
+}
+
+/*
+ * Superpages would be the way to cover big regions with few TLB
+ * entries, but the MIPS-161 TLB only does 4K pages. Instead, after a
+ * fault we also load translations for the resident neighbours of the
+ * page in its aligned group of VM_PREFETCH pages, so walking a large
+ * array or heap arena takes one miss per group rather than one per
+ * page. (A group never straddles second-level page tables.)
+ *
+ * Neighbours are pinned only while their translation is loaded, as
+ * in vm_fault, so a later pageout will shoot it down. Pinned ones
+ * (being paged out, or being faulted on) are skipped rather than
+ * waited for, and prefetching doesn't mark a page referenced.
+ */
+#define VM_PREFETCH	4
+
+static struct pcpu_counter vm_prefetches =
+	PCPU_COUNTER_INITIALIZER("vm.prefetches");
+
+static
+void
+vm_prefetch(struct addrspace *as, vaddr_t faultaddress)
+{
+	vaddr_t base, va;
+	pte_t *pte, old;
+	unsigned i;
+
+	base = faultaddress & ~(vaddr_t)(VM_PREFETCH * PAGE_SIZE - 1);
+	for (i=0; i<VM_PREFETCH; i++) {
+		va = base + i * PAGE_SIZE;
+		if (va == faultaddress) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL) {
+			return;
+		}
+		old = *pte;
+		if ((old & PTE_VALID) == 0 ||
+		    !coremap_trypin(PTE_PADDR(old))) {
+			continue;
+		}
+		if (*pte == old) {
+			mmu_map(va, PTE_PADDR(old),
+				(old & PTE_WRITE) != 0 || as->as_loading);
+			pcpu_counter_inc(&vm_prefetches);
+		}
+		coremap_unpin(PTE_PADDR(old));
+	}
+}
+
+/*
+ * The part of vm_fault that works on the address space, with its
+ * lock held.
+ */
+static
+int
+vm_fault_as(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	struct as_region *reg;
+	pte_t *pte;
+	paddr_t pa;
+	bool shared, writeable, minor, major;
+	int result;
+
+	minor = major = false;
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	if (pte == NULL || *pte == 0) {
+		/* First touch. */
+		reg = as_findregion(as, faultaddress);
+		if (reg == NULL) {
+			return EFAULT;
+		}
+		if (reg->ar_kpage != 0) {
+			/* Not in the page table, so this is every time. */
+			if (faulttype != VM_FAULT_READ) {
+				return EFAULT;
+			}
+			mmu_map(faultaddress, reg->ar_kpage, false);
+			return 0;
+		}
+		pte = pt_lookup(as->as_pt, faultaddress, true);
+		if (pte == NULL) {
+			return ENOMEM;
+		}
+		if (reg->ar_shm != NULL) {
+			result = vm_shmpage(reg, faultaddress, &pa);
+			if (result) {
+				return result;
+			}
+			*pte = pa | PTE_VALID | PTE_SHARED;
+			if (reg->ar_perms & AR_WRITE) {
+				*pte |= PTE_WRITE;
+			}
+		}
+		else {
+			result = vm_firstpage(as, reg, faultaddress, &pa,
+					      &shared);
+			if (result) {
+				return result;
+			}
+			*pte = pa | PTE_VALID;
+			if (reg->ar_perms & AR_WRITE) {
+				/* Writing a page cache page makes a copy. */
+				*pte |= shared ? PTE_COW : PTE_WRITE;
+			}
+		}
+		minor = true;
+	}
+	else if (!pt_pin(pte)) {
+		/* Paged out. */
+		KASSERT(*pte & PTE_SWAPPED);
+		result = vm_allocpage(as, faultaddress, false, &pa);
+		if (result) {
+			return result;
+		}
+		/* Reading ahead is a waste for random access. */
+		reg = as_findregion(as, faultaddress);
+		KASSERT(reg != NULL);
+		result = swap_pagein(as, PTE_SLOT(*pte), pa,
+				     reg->ar_advice != MADV_RANDOM);
+		if (result) {
+			coremap_freeuser(pa);
+			return result;
+		}
+		*pte = pa | PTE_VALID | (*pte & (PTE_WRITE | PTE_COW));
+		major = true;
+	}
+
+	/* The page is now resident and pinned. */
+
+	if (faulttype != VM_FAULT_READ && (*pte & PTE_COW)) {
+		result = vm_cowfault(as, faultaddress, pte);
+		if (result) {
+			coremap_unpin(PTE_PADDR(*pte));
+			return result;
+		}
+		minor = true;
+	}
+
+	writeable = (*pte & PTE_WRITE) != 0 || as->as_loading;
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		coremap_unpin(PTE_PADDR(*pte));
+		return EFAULT;
+	}
+
+	/* pinning marked it referenced; let the refill handler load it */
+	*pte |= PTE_REF;
+	mmu_map(faultaddress, PTE_PADDR(*pte), writeable);
+	coremap_unpin(PTE_PADDR(*pte));
+
+	vm_prefetch(as, faultaddress);
+
+	if (major) {
+		curthread->t_usage.u_majflt++;
+	}
+	else if (minor) {
+		curthread->t_usage.u_minflt++;
+	}
+	return 0;
+}
+
+/*
+ * Handle a TLB fault on a user address.
+ *
+ * Pages already in the page table are just loaded into the TLB.
+ * Pages that have never been touched are allocated here, and read
+ * from the backing file or zero-filled ("demand zero"), so regions
+ * cost nothing until used; file pages may be shared through the
+ * page cache. Pages of shared segments come from the segment.
+ * Pages that were paged out are read back from swap.
+ * Writes to copy-on-write pages get a private copy.
+ *
+ * The page is pinned while we work on it so the pageout thread
+ * can't take it away, and the translation is loaded before it's
+ * unpinned so that a later pageout will shoot it down.
+ *
+ * For getrusage, reading from swap is a major fault, and filling or
+ * copying a page a minor one; faults that only reload the TLB aren't
+ * counted.
+ */
+static struct pcpu_counter vm_faults =
+	PCPU_COUNTER_INITIALIZER("vm.faults");
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+	KEVENT(KEV_FAULT, faulttype, faultaddress, 0, 0);
+	pcpu_counter_inc(&vm_faults);
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/*
+		 * Read-only and copy-on-write pages are entered
+		 * without the dirty bit; sort out which below.
+		 */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	/* other threads of the process may be faulting too */
+	lock_acquire(as->as_lock);
+	result = vm_fault_as(as, faulttype, faultaddress);
+	lock_release(as->as_lock);
+	return result;
+}
+
+int
+vm_pagein(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
+{
+	pte_t *pte;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	while (1) {
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL && pt_pin(pte)) {
+			*ret = PTE_PADDR(*pte);
+			return 0;
+		}
+		/* Pageout may take it again before we can pin it. */
+		result = vm_fault_as(as, VM_FAULT_READ, vaddr);
+		if (result) {
+			return result;
+		}
+	}
+}
+
+void
+vm_unreference(struct addrspace *as, vaddr_t vaddr, paddr_t pa)
+{
+	pte_t *pte;
+
+	/* The pin keeps the entry from changing, and AS from going away. */
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT(PTE_PADDR(*pte) == pa);
+
+	/*
+	 * Clear the bit first: a refill that races with this either
+	 * sees it gone or loads a translation the shootdown removes.
+	 */
+	*pte &= ~PTE_REF;
+	membar_store_any();
+	vm_shootdown(as, vaddr, 1);
+}
+
+/*
+ * The lock keeps AS's other threads from faulting on the page while
+ * we look; after that only pageout could change it, and the pin
+ * holds that off.
+ */
+bool
+vm_pinuser(struct addrspace *as, vaddr_t vaddr, bool write, paddr_t *ret)
+{
+	pte_t *pte;
+	bool ok;
+
+	if (vaddr >= USERSPACETOP) {
+		return false;
+	}
+	ok = false;
+	lock_acquire(as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte != NULL && pt_pin(pte)) {
+		if (write && (*pte & PTE_WRITE) == 0) {
+			coremap_unpin(PTE_PADDR(*pte));
+		}
+		else {
+			*ret = PTE_PADDR(*pte);
+			ok = true;
+		}
+	}
+	lock_release(as->as_lock);
+	return ok;
+}
+
+void
+vm_unpinuser(paddr_t pa)
+{
+	coremap_unpin(pa);
+}
+
+/*
+ * Above this many pages, a ranged shootdown just flushes the TLB;
+ * probing for each page would cost more than refilling.
+ */
+#define VM_SHOOTDOWN_MAXPROBE	16
+
+/*
+ * Send shootdowns for AS to the other CPUs that have it loaded, and
+ * apply them to our own TLB. TS is the range to drop, or NULL for
+ * all of AS. That means every CPU where AS has a current ASID, whether
+ * or not it's running AS right now. The page table must already have
+ * been updated: a CPU that gives AS an ASID after we look has no
+ * entries under it and so only sees the new ones.
+ *
+ * Doesn't return until the other CPUs have done the shootdowns, so
+ * that the caller can then safely reuse the pages.
+ */
+static
+void
+vm_shootdown_cpus(struct addrspace *as, const struct tlbshootdown *ts)
+{
+	struct cpu *c;
+	unsigned i;
+	uint32_t sent;
+
+	KASSERT(cpu_count() <= 32);
+
+	membar_any_any();
+
+	sent = 0;
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_getcpu(i);
+		if (!mmu_ctx_loaded(&as->as_mmu, c)) {
+			continue;
+		}
+		if (c == curcpu->c_self) {
+			if (ts == NULL) {
+				mmu_flush_ctx(&as->as_mmu);
+			}
+			else {
+				vm_tlbshootdown(ts);
+			}
+		}
+		else if (ts == NULL) {
+			ipi_tlbshootdown_all(c);
+			sent |= (uint32_t)1 << i;
+		}
+		else {
+			ipi_tlbshootdown(c, ts);
+			sent |= (uint32_t)1 << i;
+		}
+	}
+
+	for (i=0; i<cpu_count(); i++) {
+		if (sent & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown_wait(cpu_getcpu(i));
+		}
+	}
+}
+
+void
+vm_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (npages > VM_SHOOTDOWN_MAXPROBE) {
+		vm_shootdown_cpus(as, NULL);
+		return;
+	}
+	ts.ts_ctx = &as->as_mmu;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	vm_shootdown_cpus(as, &ts);
+}
+
+void
+vm_shootdown_all(struct addrspace *as)
+{
+	vm_shootdown_cpus(as, NULL);
+}
+
+/*
+ * Handle TLB shootdown requests from another CPU.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	mmu_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	unsigned i;
+
+	for (i=0; i<ts->ts_npages; i++) {
+		mmu_unmap(ts->ts_ctx, ts->ts_vaddr + i * PAGE_SIZE);
+	}
+}
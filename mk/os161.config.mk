@@ -82,6 +82,16 @@
 # This convenience is why these variables are separately defined
 # rather than just being rolled into CFLAGS.
 #
+# (File system.)
+#
+# SFS_BLOCKSIZE			Block size of SFS volumes, in bytes: 512
+#				or 4096. Default: 512
+#
+# The kernel, mksfs, sfsck, and dumpsfs all get it and must agree, so
+# set it in defs.mk (configure --sfs-blocksize) rather than on the
+# command line, and make clean and rebuild everything (and remake your
+# volumes) if you change it.
+#
 ############################################################
 #
 # These build variables can be set explicitly for further control if
@@ -317,6 +327,9 @@ DEBUG=-O2
 WARNINGS=-Wall -W -Wwrite-strings -Wmissing-prototypes
 WERROR=-Werror
 
+# File system.
+SFS_BLOCKSIZE=512
+
 #
 # Less-likely-to-need-setting
 #
@@ -387,6 +400,13 @@ COMPAT_TARGETS=
 
 .-include "$(TOP)/defs.mk"
 
+############################################################
+# Pass the SFS block size to everything that knows the disk format.
+
+CFLAGS+=-DSFS_BLOCKSIZE=$(SFS_BLOCKSIZE)
+KCFLAGS+=-DSFS_BLOCKSIZE=$(SFS_BLOCKSIZE)
+HOST_CFLAGS+=-DSFS_BLOCKSIZE=$(SFS_BLOCKSIZE)
+
 ############################################################
 # Make sure we have a supported PLATFORM and MACHINE.
 
@@ -10,6 +10,7 @@
 #   KTOP=../..			# top of the kernel tree
 #   TOP=$(KTOP)/..		# top of the whole tree
 #   KDEBUG=-g			# debug vs. optimize
+#   KLTO=no			# link-time optimization or not
 #   CONFNAME=GENERIC		# name of the kernel config file
 #   .include "$(TOP)/mk/os161.config.mk"
 #   .include "files.mk"
@@ -64,6 +65,18 @@ KLDFLAGS+=-T $(KTOP)/arch/$(PLATFORM)/conf/ldscript
 KLDFLAGS+=-T $(KTOP)/arch/$(MACHINE)/conf/ldscript
 .endif
 
+# With link-time optimization, each object carries the compiler's
+# intermediate form as well as code, and the final link goes through
+# the compiler driver so it can optimize (and inline) across source
+# files. The driver passes -nostdlib and -T through to the linker.
+# Without it, link with the linker directly as usual.
+.if "$(KLTO)" == "yes"
+KCFLAGS+=-flto
+KLINK=$(CC) $(KCFLAGS)
+.else
+KLINK=$(LD)
+.endif
+
 #
 # This should expand to all the header files in the kernel so they can
 # be fed to tags.
@@ -100,7 +113,7 @@ all: includelinks .WAIT $(KERNEL)
 $(KERNEL):
 	$(KTOP)/conf/newvers.sh $(CONFNAME)
 	$(CC) $(KCFLAGS) -c vers.c
-	$(LD) $(KLDFLAGS) $(OBJS) vers.o -o $(KERNEL)
+	$(KLINK) $(KLDFLAGS) $(OBJS) vers.o -o $(KERNEL)
 	@echo '*** This is $(CONFNAME) build #'`cat version`' ***'
 	$(SIZE) $(KERNEL)
 
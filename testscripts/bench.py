@@ -0,0 +1,289 @@
+#!/usr/pkg/bin/python2.7
+# bench.py - run benchmarks over a matrix of configurations
+# usage: testscripts/bench.py [options]
+# options:
+#    --kernels=K1,K2	Kernels to run (default "kernel")
+#    --cpus=N1,N2	CPU counts (default 1,2,4,8)
+#    --ram=R1,R2	RAM sizes (default from sys161 config)
+#    --conf=sys161.conf	Use alternate sys161 config
+#    --benchmarks=B1,B2	Benchmarks to run (default all; see below)
+#    --repeat=N		Runs per configuration, median kept (default 3)
+#    --results=FILE	Append results to FILE (default bench.results)
+#    --baseline=FILE	Compare against FILE (default bench.baseline)
+#    --save-baseline	Write this run's results as the new baseline
+#    --threshold=PCT	Change needed to count as a regression (default 5)
+#    --commit=ID	Label for this run (default from git)
+#    --timeout=N	Global timeout per run, in seconds (default 1800)
+#
+# Each benchmark is a list of commands for runtest.run and a parser
+# that picks named metrics out of the output. Every metric says
+# whether lower or higher is better. For each configuration (kernel,
+# cpus, ram) every benchmark is run --repeat times and the median of
+# each metric is kept.
+#
+# Results are appended to the results file, one line each:
+#    commit kernel cpus ram metric value
+# The baseline file has the same format. A run is compared against
+# the baseline line with the same configuration and metric, if any.
+# Moving the wrong way by more than the threshold is a regression.
+# Regressions are printed, and the exit status is then 1.
+#
+# The benchmarks:
+#    kb		kernel microbenchmarks (cycles; lower is better)
+#    fsbench	file system throughput on lhd1: (higher is better)
+#    schedpong	scheduler wakeup latency (lower is better)
+#
+# The file system benchmark needs an SFS volume on lhd1 (see
+# mksfs); schedpong needs a kernel that can run user programs.
+#
+
+import re
+import sys
+import subprocess
+from optparse import OptionParser
+
+import runtest
+
+############################################################
+# benchmarks
+
+LOWER = "lower"
+HIGHER = "higher"
+
+def parse_kb(lines):
+	ret = []
+	pat = re.compile(r"^(\S+)\s+(\d+)\s+(\d+)\s+(\d+)$")
+	for line in lines:
+		m = pat.match(line)
+		if m is None:
+			continue
+		name = m.group(1)
+		ret.append(("kb.%s.min" % name, int(m.group(2)), LOWER))
+		ret.append(("kb.%s.median" % name, int(m.group(3)), LOWER))
+		ret.append(("kb.%s.p99" % name, int(m.group(4)), LOWER))
+	return ret
+# end parse_kb
+
+def parse_fsbench(lines):
+	ret = []
+	bw = re.compile(r"^(\w+)\s+\d+ KB in\s+\d+ ms: (\d+\.\d) MB/s$")
+	ops = re.compile(r"^(\w+)\s+\d+ ops in\s+\d+ ms: (\d+) ops/s$")
+	for line in lines:
+		m = bw.match(line)
+		if m is not None:
+			ret.append(("fsbench.%s.MBps" % m.group(1),
+				float(m.group(2)), HIGHER))
+			continue
+		m = ops.match(line)
+		if m is not None:
+			ret.append(("fsbench.%s.opsps" % m.group(1),
+				int(m.group(2)), HIGHER))
+	return ret
+# end parse_fsbench
+
+def parse_schedpong(lines):
+	ret = []
+	lat = re.compile(r"^Pong group (\d+) wakeups: \d+; latency \(us\) "
+		r"p50 ([\d.]+) p95 ([\d.]+) p99 ([\d.]+) max ([\d.]+)$")
+	tm = re.compile(r"^(Thinkers|Grinders|Pong group \d+): ([\d.]+)$")
+	for line in lines:
+		m = lat.match(line)
+		if m is not None:
+			g = m.group(1)
+			for (i, p) in [(2, "p50"), (3, "p95"), (4, "p99")]:
+				ret.append(("schedpong.group%s.%s" % (g, p),
+					float(m.group(i)), LOWER))
+			continue
+		m = tm.match(line)
+		if m is not None:
+			name = m.group(1).replace(" ", "").lower()
+			ret.append(("schedpong.%s.secs" % name,
+				float(m.group(2)), LOWER))
+	return ret
+# end parse_schedpong
+
+benchmarks = {
+	"kb": ("kb", parse_kb),
+	"fsbench": ("MOUNT; fsbench lhd1:; UNMOUNT", parse_fsbench),
+	"schedpong": ("s; /testbin/schedpong -n 200; exit",
+		parse_schedpong),
+}
+benchorder = ["kb", "fsbench", "schedpong"]
+
+############################################################
+# running
+
+#
+# Collects the sys161 output for parsing.
+#
+class Capture:
+	def __init__(self):
+		self.chunks = []
+	def write(self, data):
+		if not isinstance(data, str):
+			data = data.decode("utf-8", "replace")
+		self.chunks.append(data)
+	def flush(self):
+		pass
+	def lines(self):
+		text = "".join(self.chunks).replace("\r", "")
+		return [l.strip() for l in text.split("\n")]
+# end Capture
+
+def median(values):
+	values = sorted(values)
+	n = len(values)
+	if n % 2 == 1:
+		return values[n // 2]
+	return (values[n // 2 - 1] + values[n // 2]) / 2.0
+# end median
+
+#
+# Run one benchmark REPEAT times in one configuration; returns a
+# dict of metric -> (value, better).
+#
+def runbench(name, kernel, cpus, ram, conf, repeat, timeout):
+	(commands, parser) = benchmarks[name]
+	samples = {}
+	better = {}
+	for i in range(repeat):
+		out = Capture()
+		msg = runtest.run(commands, out, conf=conf, ram=ram,
+			cpus=cpus, progress=None, timeout=timeout,
+			kernel=kernel)
+		if msg is not None:
+			sys.stderr.write("bench.py: %s on %s cpus=%s "
+				"ram=%s: %s\n" %
+				(name, kernel, cpus, ram, msg))
+			return {}
+		for (metric, value, b) in parser(out.lines()):
+			samples.setdefault(metric, []).append(value)
+			better[metric] = b
+	ret = {}
+	for metric in samples:
+		ret[metric] = (median(samples[metric]), better[metric])
+	return ret
+# end runbench
+
+############################################################
+# results files
+
+def readresults(path):
+	ret = {}
+	try:
+		f = open(path)
+	except IOError:
+		return ret
+	for line in f:
+		words = line.split()
+		if len(words) != 6 or words[0].startswith("#"):
+			continue
+		ret[tuple(words[1:5])] = float(words[5])
+	f.close()
+	return ret
+# end readresults
+
+def writeresults(path, mode, commit, results):
+	f = open(path, mode)
+	for (key, (value, better)) in sorted(results.items()):
+		f.write("%s %s %s\n" % (commit, " ".join(key), value))
+	f.close()
+# end writeresults
+
+#
+# Returns a list of regression messages.
+#
+def compare(results, baseline, threshold):
+	ret = []
+	for (key, (value, better)) in sorted(results.items()):
+		if key not in baseline or baseline[key] == 0:
+			continue
+		old = baseline[key]
+		change = (value - old) * 100.0 / old
+		if better == HIGHER:
+			change = -change
+		if change > threshold:
+			ret.append("%s cpus=%s ram=%s %s: %s -> %s "
+				"(%.1f%% worse)" % (key[0], key[1], key[2],
+				key[3], old, value, change))
+	return ret
+# end compare
+
+############################################################
+# main
+
+def commitid():
+	try:
+		out = subprocess.check_output(["git", "rev-parse", "--short",
+			"HEAD"], stderr=open("/dev/null", "w"))
+	except (OSError, subprocess.CalledProcessError):
+		return "unknown"
+	if not isinstance(out, str):
+		out = out.decode("ascii", "replace")
+	return out.strip()
+# end commitid
+
+def getargs():
+	p = OptionParser()
+	p.add_option("-k", "--kernels", dest="kernels", default="kernel")
+	p.add_option("-j", "--cpus", dest="cpus", default="1,2,4,8")
+	p.add_option("-r", "--ram", dest="ram", default=None)
+	p.add_option("-c", "--conf", dest="conf", default=None)
+	p.add_option("-b", "--benchmarks", dest="benchmarks",
+		default=",".join(benchorder))
+	p.add_option("-n", "--repeat", dest="repeat", default="3")
+	p.add_option("-o", "--results", dest="results",
+		default="bench.results")
+	p.add_option("-B", "--baseline", dest="baseline",
+		default="bench.baseline")
+	p.add_option("-S", "--save-baseline", dest="savebaseline",
+		action="store_true", default=False)
+	p.add_option("-T", "--threshold", dest="threshold", default="5")
+	p.add_option("-C", "--commit", dest="commit", default=None)
+	p.add_option("-t", "--timeout", dest="timeout", default="1800")
+
+	(options, args) = p.parse_args()
+	if len(args) != 0:
+		sys.stderr.write("Usage: bench.py [options]\n")
+		exit(1)
+	for b in options.benchmarks.split(","):
+		if b not in benchmarks:
+			sys.stderr.write("bench.py: No benchmark %s\n" % b)
+			exit(1)
+	return options
+# end getargs
+
+options = getargs()
+commit = options.commit
+if commit is None:
+	commit = commitid()
+rams = [None]
+if options.ram is not None:
+	rams = options.ram.split(",")
+
+results = {}
+for kernel in options.kernels.split(","):
+	for cpus in [int(c) for c in options.cpus.split(",")]:
+		for ram in rams:
+			for b in options.benchmarks.split(","):
+				r = runbench(b, kernel, cpus, ram,
+					options.conf, int(options.repeat),
+					int(options.timeout))
+				for metric in r:
+					key = (kernel, str(cpus),
+						ram if ram is not None
+						else "default", metric)
+					results[key] = r[metric]
+
+writeresults(options.results, "a", commit, results)
+if options.savebaseline:
+	writeresults(options.baseline, "w", commit, results)
+	exit(0)
+
+regressions = compare(results, readresults(options.baseline),
+	float(options.threshold))
+for msg in regressions:
+	sys.stdout.write("REGRESSION: %s\n" % msg)
+if len(regressions) > 0:
+	exit(1)
+exit(0)
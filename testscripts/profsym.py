@@ -0,0 +1,169 @@
+#!/usr/pkg/bin/python2.7
+# profsym.py - symbolize kernel profiler output
+# usage: testscripts/profsym.py [options] program [logfile]
+# options:
+#    --nm=PROG		nm to use (default mips-harvard-os161-nm)
+#    --top=N		Print at most N lines of each table (default 30)
+#    --pcs		Also print the hottest individual PCs
+#    --user		Read a user profile rather than the kernel's
+#    --pid=N		With --user, the process to read (default last)
+#
+# Reads the output of the kernel menu command "kprof dump" from
+# LOGFILE (default stdin; other output mixed in is ignored), looks
+# each sampled PC up in the symbol table of PROGRAM (the kernel), and
+# prints a histogram of time by function, hottest first. If the
+# profile was taken with "kprof on callers" it also prints the
+# hottest caller -> callee pairs. (The caller is only a hint; see
+# kprof.h.)
+#
+# With --user it reads instead the profile a user process prints
+# when it exits (see <kern/uprof.h>; "kprof user on" in the menu
+# profiles the programs it runs), and PROGRAM should be that
+# process's executable, e.g. testbin/sort/sort in the build tree.
+#
+
+import re
+import sys
+import bisect
+import subprocess
+from optparse import OptionParser
+
+def readsyms(nm, kernel):
+	try:
+		out = subprocess.check_output([nm, "-n", kernel])
+	except (OSError, subprocess.CalledProcessError):
+		sys.stderr.write("profsym.py: %s -n %s failed\n" %
+			(nm, kernel))
+		exit(1)
+	if not isinstance(out, str):
+		out = out.decode("ascii", "replace")
+	addrs = []
+	names = []
+	pat = re.compile(r"^([0-9a-fA-F]+)\s+[TtWw]\s+(\S+)$")
+	for line in out.split("\n"):
+		m = pat.match(line.strip())
+		if m is None:
+			continue
+		addrs.append(int(m.group(1), 16))
+		names.append(m.group(2))
+	return (addrs, names)
+# end readsyms
+
+def lookup(syms, pc, withoffset):
+	(addrs, names) = syms
+	i = bisect.bisect_right(addrs, pc) - 1
+	if i < 0:
+		return "0x%08x" % pc
+	if withoffset:
+		return "%s+0x%x" % (names[i], pc - addrs[i])
+	return names[i]
+# end lookup
+
+def readprofile(f, user, pid):
+	total = None
+	pcs = []
+	arcs = []
+	hdr = re.compile(r"^kprof samples (\d+) user (\d+) lost (\d+)$")
+	uhdr = re.compile(r"^uprof samples (\d+) lost (\d+) " +
+		r"pid (\d+) name (\S+)$")
+	pcpat = re.compile(r"^kprof pc 0x([0-9a-f]+) (\d+)$")
+	upcpat = re.compile(r"^uprof pc 0x([0-9a-f]+) (\d+)$")
+	arcpat = re.compile(r"^kprof arc 0x([0-9a-f]+) 0x([0-9a-f]+) (\d+)$")
+	reading = False
+	for line in f:
+		line = line.strip()
+		m = uhdr.match(line) if user else hdr.match(line)
+		if m is not None:
+			if user:
+				reading = pid is None or int(m.group(3)) == pid
+				if not reading:
+					continue
+				total = (int(m.group(1)), 0, int(m.group(2)))
+			else:
+				total = tuple([int(x) for x in m.groups()])
+			# a later dump replaces an earlier one
+			pcs = []
+			arcs = []
+			continue
+		if user:
+			m = upcpat.match(line)
+			if m is not None and reading:
+				pcs.append((int(m.group(1), 16),
+					int(m.group(2))))
+			continue
+		m = pcpat.match(line)
+		if m is not None:
+			pcs.append((int(m.group(1), 16), int(m.group(2))))
+			continue
+		m = arcpat.match(line)
+		if m is not None:
+			arcs.append((int(m.group(1), 16),
+				int(m.group(2), 16), int(m.group(3))))
+	return (total, pcs, arcs)
+# end readprofile
+
+def tally(items):
+	counts = {}
+	for (key, n) in items:
+		counts[key] = counts.get(key, 0) + n
+	return sorted(counts.items(), key=lambda kv: (-kv[1], kv[0]))
+# end tally
+
+def show(title, rows, total, top):
+	sys.stdout.write("%s\n" % title)
+	for (name, n) in rows[:top]:
+		pct = 100.0 * n / total if total > 0 else 0.0
+		sys.stdout.write("%6.2f%% %8d  %s\n" % (pct, n, name))
+	sys.stdout.write("\n")
+# end show
+
+def getargs():
+	p = OptionParser()
+	p.add_option("--nm", dest="nm", default="mips-harvard-os161-nm")
+	p.add_option("--top", dest="top", default="30")
+	p.add_option("--pcs", dest="pcs", action="store_true",
+		default=False)
+	p.add_option("--user", dest="user", action="store_true",
+		default=False)
+	p.add_option("--pid", dest="pid", default=None)
+	(options, args) = p.parse_args()
+	if len(args) < 1 or len(args) > 2:
+		sys.stderr.write("Usage: profsym.py [options] program " +
+			"[logfile]\n")
+		exit(1)
+	return (options, args)
+# end getargs
+
+(options, args) = getargs()
+syms = readsyms(options.nm, args[0])
+pid = None
+if options.pid is not None:
+	pid = int(options.pid)
+if len(args) == 2:
+	f = open(args[1])
+else:
+	f = sys.stdin
+(total, pcs, arcs) = readprofile(f, options.user, pid)
+if total is None:
+	sys.stderr.write("profsym.py: No %s dump found\n" %
+		("uprof" if options.user else "kprof"))
+	exit(1)
+(kern, user, lost) = total
+top = int(options.top)
+
+if options.user:
+	sys.stdout.write("%d samples, %d lost\n\n" % (kern, lost))
+else:
+	sys.stdout.write("%d kernel samples, %d user, %d lost\n\n" %
+		(kern, user, lost))
+show("By function:",
+	tally([(lookup(syms, pc, False), n) for (pc, n) in pcs]), kern, top)
+if options.pcs:
+	show("By PC:",
+		[(lookup(syms, pc, True), n) for (pc, n) in pcs], kern, top)
+if len(arcs) > 0:
+	show("By caller -> function:",
+		tally([("%s -> %s" % (lookup(syms, ra, False),
+			lookup(syms, pc, False)), n)
+			for (pc, ra, n) in arcs]), kern, top)
+exit(0)
@@ -27,8 +27,8 @@
 # not issued explicitly.
 #
 # The following commands are interpreted as macros:
-#    DOMOUNT		expands to "mount sfs lhd1:; cd lhd1:"
-#    DOUNMOUNT		expands to "cd /; unmount lhd1:"
+#    MOUNT		expands to "mount sfs lhd1:; cd lhd1:"
+#    UNMOUNT		expands to "cd /; unmount lhd1:"
 #    WAIT		sleeps 3 seconds and just presses return
 #
 # * The outputfile argument should be a python file (e.g. sys.stdout)
@@ -33,31 +33,24 @@
 /*
  * cp - copy a file.
  * Usage: cp oldfile newfile
+ *
+ * The data is moved in the kernel with copyfile() when that works;
+ * otherwise it goes through a large buffer here.
  */
 
+#define COPYCHUNK	(256*1024)
 
-/* Copy one file to another. */
+static char buf[64*1024];
+
+/*
+ * Copy with read and write. Returns only on success.
+ */
 static
 void
-copy(const char *from, const char *to)
+copybuf(int fromfd, const char *from, int tofd, const char *to)
 {
-	int fromfd;
-	int tofd;
-	char buf[1024];
 	int len, wr, wrtot;
 
-	/*
-	 * Open the files, and give up if they won't open
-	 */
-	fromfd = open(from, O_RDONLY);
-	if (fromfd<0) {
-		err(1, "%s", from);
-	}
-	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
-	if (tofd<0) {
-		err(1, "%s", to);
-	}
-
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
 	 * Zero means EOF. Less than zero means an error occurred.
@@ -84,6 +77,42 @@ copy(const char *from, const char *to)
 	if (len<0) {
 		err(1, "%s", from);
 	}
+}
+
+/* Copy one file to another. */
+static
+void
+copy(const char *from, const char *to)
+{
+	int fromfd;
+	int tofd;
+	ssize_t len;
+
+	/*
+	 * Open the files, and give up if they won't open
+	 */
+	fromfd = open(from, O_RDONLY);
+	if (fromfd<0) {
+		err(1, "%s", from);
+	}
+	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
+	if (tofd<0) {
+		err(1, "%s", to);
+	}
+
+	/*
+	 * Let the kernel do it until it hits EOF. If it can't do
+	 * this kind of file at all (ENOSYS from an older kernel,
+	 * EINVAL for the same file twice) fall back to doing it
+	 * here; that picks up at whatever point copyfile got to, and
+	 * gets us a proper error message for anything else.
+	 */
+	while ((len = copyfile(fromfd, tofd, COPYCHUNK)) > 0) {
+		/* nothing */
+	}
+	if (len < 0) {
+		copybuf(fromfd, from, tofd, to);
+	}
 
 	if (close(fromfd) < 0) {
 		err(1, "%s: close", from);
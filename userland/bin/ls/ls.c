@@ -107,6 +107,80 @@ isdir(const char *path)
 	return S_ISDIR(buf.st_mode);
 }
 
+/*
+ * Directory reading. We read many entries per call with
+ * getdirentries(), which also tells us each entry's type; if the
+ * kernel doesn't have it, fall back to one name per call with
+ * getdirentry().
+ */
+struct dirreader {
+	int fd;
+	int bulk;		/* still using getdirentries */
+	char buf[2048];
+	size_t pos, len;	/* unread records in buf */
+};
+
+static
+void
+dir_open(struct dirreader *dr, const char *path)
+{
+	dr->fd = open(path, O_RDONLY);
+	if (dr->fd<0) {
+		err(1, "%s", path);
+	}
+	dr->bulk = 1;
+	dr->pos = dr->len = 0;
+}
+
+static
+void
+dir_close(struct dirreader *dr)
+{
+	close(dr->fd);
+}
+
+/*
+ * Get the next name into NAME (of size MAX) and its DT_ type into
+ * *TYPE. Returns 1, or 0 at the end, or -1 on error.
+ */
+static
+int
+dir_next(struct dirreader *dr, char *name, size_t max, unsigned *type)
+{
+	struct dirent *d;
+	ssize_t len;
+
+	if (dr->bulk && dr->pos >= dr->len) {
+		len = getdirentries(dr->fd, dr->buf, sizeof(dr->buf));
+		if (len<0 && errno==ENOSYS) {
+			dr->bulk = 0;
+		}
+		else if (len<=0) {
+			return len<0 ? -1 : 0;
+		}
+		else {
+			dr->pos = 0;
+			dr->len = len;
+		}
+	}
+
+	if (!dr->bulk) {
+		len = getdirentry(dr->fd, name, max-1);
+		if (len<=0) {
+			return len<0 ? -1 : 0;
+		}
+		name[len] = 0;
+		*type = DT_UNKNOWN;
+		return 1;
+	}
+
+	d = (struct dirent *)(dr->buf + dr->pos);
+	dr->pos += d->d_reclen;
+	snprintf(name, max, "%s", d->d_name);
+	*type = d->d_type;
+	return 1;
+}
+
 /*
  * When listing one of several subdirectories, show the name of the
  * directory.
@@ -192,10 +266,11 @@ static
 void
 listdir(const char *path, int showheader)
 {
-	int fd;
+	struct dirreader dr;
 	char buf[1024];
 	char newpath[1024];
-	ssize_t len;
+	unsigned type;
+	int r;
 
 	if (showheader) {
 		printheader(path);
@@ -204,17 +279,12 @@ listdir(const char *path, int showheader)
 	/*
 	 * Open it.
 	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
+	dir_open(&dr, path);
 
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
-
+	while ((r = dir_next(&dr, buf, sizeof(buf), &type)) > 0) {
 		/* Assemble the full name of the new item */
 		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
 
@@ -223,37 +293,33 @@ listdir(const char *path, int showheader)
 			print(newpath);
 		}
 	}
-	if (len<0) {
+	if (r<0) {
 		err(1, "%s: getdirentry", path);
 	}
 
 	/* Done */
-	close(fd);
+	dir_close(&dr);
 }
 
 static
 void
 recursedir(const char *path)
 {
-	int fd;
+	struct dirreader dr;
 	char buf[1024];
 	char newpath[1024];
-	int len;
+	unsigned type;
+	int r;
 
 	/*
 	 * Open it.
 	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
+	dir_open(&dr, path);
 
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
-
+	while ((r = dir_next(&dr, buf, sizeof(buf), &type)) > 0) {
 		/* Assemble the full name of the new item */
 		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
 
@@ -267,7 +333,8 @@ recursedir(const char *path)
 			continue;
 		}
 
-		if (!isdir(newpath)) {
+		/* Only stat it if getdirentries didn't tell us the type */
+		if (type == DT_UNKNOWN ? !isdir(newpath) : type != DT_DIR) {
 			continue;
 		}
 
@@ -276,11 +343,11 @@ recursedir(const char *path)
 			recursedir(newpath);
 		}
 	}
-	if (len<0) {
+	if (r<0) {
 		err(1, "%s", path);
 	}
 
-	close(fd);
+	dir_close(&dr);
 }
 
 static
@@ -43,6 +43,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <err.h>
 
@@ -58,6 +59,12 @@
 /* avoid making this unreasonably large; causes problems under dumbvm */
 #define CMDLINE_MAX 4096
 
+/* most commands in one pipeline */
+#define PIPELINE_MAX 16
+
+/* size of the command path cache; a power of 2 */
+#define PATHCACHE_SIZE 64
+
 /* struct to (portably) hold exit info */
 struct exitinfo {
 	unsigned val:8,
@@ -292,6 +299,103 @@ cmd_wait(int ac, char *av[], struct exitinfo *ei)
 	exitinfo_exit(ei, 1);
 }
 
+/*
+ * command path cache
+ * maps a command name to where on the PATH it was last found, so
+ * running it again costs one execv instead of one per directory
+ * searched. direct-mapped; a collision just replaces the old entry.
+ * the whole thing is dropped when the PATH itself changes or on cd
+ * (which moves any relative PATH entries).
+ */
+static struct {
+	char name[NAME_MAX + 1];
+	char path[PATH_MAX];
+} pathcache[PATHCACHE_SIZE];
+static char pathcache_searchpath[CMDLINE_MAX];
+
+static
+void
+pathcache_flush(void)
+{
+	unsigned i;
+
+	for (i=0; i<PATHCACHE_SIZE; i++) {
+		pathcache[i].name[0] = 0;
+	}
+}
+
+static
+unsigned
+pathcache_hash(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h & (PATHCACHE_SIZE - 1);
+}
+
+/*
+ * pathcache_lookup
+ * returns the full path to run NAME from, or NULL to leave it to
+ * execvp (names containing a slash, or things not found). the
+ * probing is done with open, as a missing file is all we can afford
+ * to rule out here; execvp gets the final say if the exec fails.
+ */
+static
+const char *
+pathcache_lookup(const char *name)
+{
+	const char *searchpath, *s, *t;
+	unsigned slot;
+	size_t len, namelen;
+	int fd;
+
+	namelen = strlen(name);
+	if (strchr(name, '/') != NULL || namelen > NAME_MAX) {
+		return NULL;
+	}
+	searchpath = getenv("PATH");
+	if (searchpath == NULL || strlen(searchpath) >= CMDLINE_MAX) {
+		return NULL;
+	}
+	if (strcmp(searchpath, pathcache_searchpath)) {
+		pathcache_flush();
+		strcpy(pathcache_searchpath, searchpath);
+	}
+
+	slot = pathcache_hash(name);
+	if (!strcmp(pathcache[slot].name, name)) {
+		return pathcache[slot].path;
+	}
+
+	for (s = searchpath; s != NULL; s = t) {
+		t = strchr(s, ':');
+		if (t != NULL) {
+			len = t - s;
+			t++;
+		}
+		else {
+			len = strlen(s);
+		}
+		if (len == 0 || len + 1 + namelen >= PATH_MAX) {
+			continue;
+		}
+		memcpy(pathcache[slot].path, s, len);
+		pathcache[slot].path[len] = '/';
+		strcpy(pathcache[slot].path + len + 1, name);
+		fd = open(pathcache[slot].path, O_RDONLY);
+		if (fd >= 0) {
+			close(fd);
+			strcpy(pathcache[slot].name, name);
+			return pathcache[slot].path;
+		}
+	}
+	pathcache[slot].name[0] = 0;
+	return NULL;
+}
+
 /*
  * chdir
  * just an interface to the system call.  no concept of home directory, so
@@ -302,6 +406,8 @@ void
 cmd_chdir(int ac, char *av[], struct exitinfo *ei)
 {
 	if (ac == 2) {
+		/* relative PATH entries now point somewhere else */
+		pathcache_flush();
 		if (chdir(av[1])) {
 			warn("chdir: %s", av[1]);
 			exitinfo_exit(ei, 1);
@@ -340,6 +446,78 @@ cmd_exit(int ac, char *av[], struct exitinfo *ei)
 	exit(code);
 }
 
+/*
+ * true, false
+ * do nothing, successfully or otherwise.
+ */
+static
+void
+cmd_true(int ac, char *av[], struct exitinfo *ei)
+{
+	(void)ac;
+	(void)av;
+	exitinfo_exit(ei, 0);
+}
+
+static
+void
+cmd_false(int ac, char *av[], struct exitinfo *ei)
+{
+	(void)ac;
+	(void)av;
+	exitinfo_exit(ei, 1);
+}
+
+/*
+ * pwd
+ * print the current directory, as /bin/pwd would.
+ */
+static
+void
+cmd_pwd(int ac, char *av[], struct exitinfo *ei)
+{
+	char buf[PATH_MAX + 1];
+
+	(void)av;
+	if (ac != 1) {
+		printf("Usage: pwd\n");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+	if (getcwd(buf, sizeof(buf)) == NULL) {
+		warn("pwd");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+	printf("%s\n", buf);
+	exitinfo_exit(ei, 0);
+}
+
+/*
+ * echo
+ * print the arguments, separated by spaces; -n leaves off the newline.
+ */
+static
+void
+cmd_echo(int ac, char *av[], struct exitinfo *ei)
+{
+	int i, newline = 1;
+
+	i = 1;
+	if (ac > 1 && !strcmp(av[1], "-n")) {
+		newline = 0;
+		i++;
+	}
+	for (; i < ac; i++) {
+		printf("%s%s", av[i], i < ac-1 ? " " : "");
+	}
+	if (newline) {
+		printf("\n");
+	}
+	fflush(stdout);
+	exitinfo_exit(ei, 0);
+}
+
 /*
  * a struct of the builtins associates the builtin name with the function that
  * executes it.  they must all take an argc and argv.
@@ -355,23 +533,103 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * these stand in for programs that would otherwise cost a fork and
+ * exec apiece. unlike the ones above they're only used for a plain
+ * foreground command; in a pipeline or with & the real program runs.
+ */
+static struct {
+	const char *name;
+	void (*func)(int, char **, struct exitinfo *);
+} simplecmds[] = {
+	{ "true",  cmd_true },
+	{ "false", cmd_false },
+	{ "pwd",   cmd_pwd },
+	{ "echo",  cmd_echo },
+	{ NULL, NULL }
+};
+
+/*
+ * runstage
+ * starts one command of a pipeline, reading from infd and writing to
+ * outfd (either of which may be -1, meaning leave it alone), and
+ * returns its pid, or -1 on error.  closefd, if not -1, is the other
+ * end of the output pipe, which the child mustn't hold open.
+ */
+static
+pid_t
+runstage(char **args, int infd, int outfd, int closefd)
+{
+	const char *path;
+	pid_t pid;
+
+	/* look it up here, so the parent remembers the answer */
+	path = pathcache_lookup(args[0]);
+
+	/*
+	 * The child only execs or exits, so vfork will do, and saves
+	 * setting up an address space just to throw it away. (Its
+	 * file table is still its own.)
+	 */
+	pid = vfork();
+	switch (pid) {
+		case -1:
+			/* error */
+			warn("vfork");
+			return -1;
+		case 0:
+			/* child */
+			if (infd >= 0) {
+				dup2(infd, 0);
+				close(infd);
+			}
+			if (outfd >= 0) {
+				dup2(outfd, 1);
+				close(outfd);
+			}
+			if (closefd >= 0) {
+				close(closefd);
+			}
+			if (path != NULL) {
+				execv(path, args);
+			}
+			execvp(args[0], args);
+			warn("%s", args[0]);
+			/*
+			 * Use _exit() instead of exit() in the child
+			 * process to avoid calling atexit() functions,
+			 * which would cause hostcompat (if present) to
+			 * reset the tty state and mess up our input
+			 * handling.
+			 */
+			_exit(1);
+		default:
+			break;
+	}
+	return pid;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
- * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * otherwise, it's a standard command, or a pipeline of them separated
+ * by '|'.  check for the '&', try to background the job if possible,
+ * otherwise just run it and wait on it.
  */
 static
 void
 docommand(char *buf, struct exitinfo *ei)
 {
 	char *args[NARG_MAX + 1];
-	int nargs, i;
+	char **stages[PIPELINE_MAX];
+	pid_t pids[PIPELINE_MAX];
+	int nargs, nstages, i;
 	char *s;
 	pid_t pid;
 	int status;
 	int bg=0;
+	int fds[2], infd;
 	time_t startsecs, endsecs;
 	unsigned long startnsecs, endnsecs;
 
@@ -417,34 +675,81 @@ docommand(char *buf, struct exitinfo *ei)
 		bg = 1;
 	}
 
+	/* split into pipeline stages at each "|" */
+	nstages = 0;
+	stages[nstages++] = args;
+	for (i=0; i<nargs; i++) {
+		if (strcmp(args[i], "|")) {
+			continue;
+		}
+		if (stages[nstages-1] == &args[i] || i == nargs-1) {
+			printf("Missing command in pipeline\n");
+			exitinfo_exit(ei, 1);
+			return;
+		}
+		if (nstages >= PIPELINE_MAX) {
+			printf("Too many commands in pipeline\n");
+			exitinfo_exit(ei, 1);
+			return;
+		}
+		args[i] = NULL;
+		stages[nstages++] = &args[i+1];
+	}
+	if (bg && nstages > 1) {
+		printf("Background pipelines not supported\n");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
+	if (!bg && nstages == 1) {
+		for (i=0; simplecmds[i].name; i++) {
+			if (!strcmp(simplecmds[i].name, args[0])) {
+				simplecmds[i].func(nargs, args, ei);
+				return;
+			}
+		}
+	}
+
 	if (timing) {
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
-			return;
-		case 0:
-			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
+	infd = -1;
+	for (i=0; i<nstages; i++) {
+		fds[0] = fds[1] = -1;
+		if (i < nstages-1 && pipe(fds) < 0) {
+			warn("pipe");
+			pid = -1;
+		}
+		else {
+			pid = runstage(stages[i], infd, fds[1], fds[0]);
+		}
+		if (infd >= 0) {
+			close(infd);
+		}
+		if (fds[1] >= 0) {
+			close(fds[1]);
+		}
+		infd = fds[0];
+		if (pid < 0) {
 			break;
+		}
+		pids[i] = pid;
+	}
+	if (infd >= 0) {
+		close(infd);
+	}
+	if (i < nstages) {
+		/* collect the ones that did start, and give up */
+		while (i-- > 0) {
+			waitpid(pids[i], &status, 0);
+		}
+		exitinfo_exit(ei, 255);
+		return;
 	}
 
 	/* parent */
+	pid = pids[nstages-1];
 	if (bg) {
 		/* background this command */
 		remember_bg(pid);
@@ -453,6 +758,12 @@ docommand(char *buf, struct exitinfo *ei)
 		return;
 	}
 
+	/* the pipeline's status is the last command's */
+	for (i=0; i<nstages-1; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid");
+		}
+	}
 	if (waitpid(pid, &status, 0) < 0) {
 		warn("waitpid");
 		exitinfo_exit(ei, 255);
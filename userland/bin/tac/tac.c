@@ -42,7 +42,7 @@
  * complain about this.
  *
  * This program uses these system calls:
- *    getpid open read write lseek close remove _exit
+ *    getpid open read pread write lseek close remove _exit
  */
 
 #include <stdio.h>
@@ -115,6 +115,19 @@ dowrite(int fd, const char *name, const void *buf, size_t len)
 	}
 }
 
+static
+size_t
+dopread(int fd, const char *name, void *buf, size_t len, off_t pos)
+{
+	ssize_t r;
+
+	r = pread(fd, buf, len, pos);
+	if (r == -1) {
+		err(1, "%s: pread", name);
+	}
+	return (size_t)r;
+}
+
 static
 off_t
 dolseek(int fd, const char *name, off_t pos, int whence)
@@ -200,22 +213,20 @@ dumpdata(void)
 	assert(pos % sizeof(x) == 0);
 	while (pos != 0) {
 		pos -= sizeof(x);
-		dolseek(indexfd, indexname, pos, SEEK_SET);
-
-		len = doread(indexfd, indexname, &x, sizeof(x));
+		len = dopread(indexfd, indexname, &x, sizeof(x), pos);
 		if (len != sizeof(x)) {
-			errx(1, "%s: read: Unexpected EOF", indexname);
+			errx(1, "%s: pread: Unexpected EOF", indexname);
 		}
-		dolseek(datafd, dataname, x.pos, SEEK_SET);
 
 		for (done = 0; done < x.len; done += amount) {
 			amount = sizeof(buf);
 			if ((off_t)amount > x.len - done) {
 				amount = x.len - done;
 			}
-			len = doread(datafd, dataname, buf, amount);
+			len = dopread(datafd, dataname, buf, amount,
+				      x.pos + done);
 			if (len != amount) {
-				errx(1, "%s: read: Unexpected short count"
+				errx(1, "%s: pread: Unexpected short count"
 				     " %zu of %zu", dataname, len, amount);
 			}
 			dowrite(STDOUT_FILENO, "stdout", buf, len);
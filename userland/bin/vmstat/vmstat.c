@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/*
+ * vmstat - sample the kernel's counters.
+ * Usage: vmstat [-a] [wait [count]]
+ *
+ * Reads the kernel statistics device kstat: and prints one line of
+ * the main VM, buffer cache, disk, and scheduler figures. With WAIT,
+ * keeps going, every WAIT seconds, COUNT times (or until killed);
+ * the first line covers the time since boot and each later one the
+ * interval just past. With -a, also lists every counter that changed
+ * over the interval, by its kstat name.
+ *
+ * Columns: free and swap are pages now in use (or free); the rest
+ * are counts over the interval: page faults, swap pageins and
+ * pageouts, buffer cache gets and hits, disk reads and writes, system
+ * calls, and context switches.
+ */
+
+#define KSTAT_PATH	"kstat:"
+#define KSTAT_VERSION	1	/* the format we understand; see kstat.h */
+
+#define BUFSIZE		32768
+#define MAXVALS		1024
+#define NAMELEN		48
+#define HEADEREVERY	20
+
+struct kstatval {
+	char kv_name[NAMELEN];
+	uint64_t kv_value;
+};
+
+struct snapshot {
+	uint64_t s_ns;			/* time taken */
+	unsigned s_num;
+	struct kstatval s_vals[MAXVALS];
+};
+
+static struct snapshot snaps[2];
+static char buf[BUFSIZE];
+
+////////////////////////////////////////////////////////////
+// reading
+
+/*
+ * Parse an unsigned decimal number at *PP, and move past it.
+ */
+static
+uint64_t
+getnum(const char **pp)
+{
+	const char *p = *pp;
+	uint64_t v = 0;
+
+	while (*p >= '0' && *p <= '9') {
+		v = v*10 + (*p - '0');
+		p++;
+	}
+	*pp = p;
+	return v;
+}
+
+/*
+ * Read the whole device in one open, so it's a single snapshot.
+ */
+static
+size_t
+readkstat(void)
+{
+	size_t len;
+	ssize_t r;
+	int fd;
+
+	fd = open(KSTAT_PATH, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", KSTAT_PATH);
+	}
+	len = 0;
+	while (len < sizeof(buf) - 1) {
+		r = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (r < 0) {
+			err(1, "%s: read", KSTAT_PATH);
+		}
+		if (r == 0) {
+			break;
+		}
+		len += r;
+	}
+	close(fd);
+	buf[len] = 0;
+	return len;
+}
+
+/*
+ * Take a snapshot into S.
+ */
+static
+void
+snap(struct snapshot *s)
+{
+	const char *p, *nl, *sp;
+	uint64_t sec, nsec;
+	size_t len;
+
+	readkstat();
+
+	p = buf;
+	if (memcmp(p, "kstat ", 6) != 0) {
+		errx(1, "%s: Not a kstat snapshot", KSTAT_PATH);
+	}
+	p += 6;
+	if (getnum(&p) != KSTAT_VERSION) {
+		errx(1, "%s: Unknown format version", KSTAT_PATH);
+	}
+	p = strchr(p, '\n');
+	if (p == NULL || memcmp(p + 1, "time ", 5) != 0) {
+		errx(1, "%s: Malformed header", KSTAT_PATH);
+	}
+	p += 6;
+	sec = getnum(&p);
+	nsec = 0;
+	if (*p == '.') {
+		p++;
+		nsec = getnum(&p);
+	}
+	s->s_ns = sec * 1000000000ULL + nsec;
+	p = strchr(p, '\n');
+
+	s->s_num = 0;
+	while (p != NULL && *++p != 0 && s->s_num < MAXVALS) {
+		nl = strchr(p, '\n');
+		sp = strchr(p, ' ');
+		if (nl == NULL || sp == NULL || sp > nl) {
+			break;
+		}
+		len = sp - p;
+		if (len >= NAMELEN) {
+			len = NAMELEN - 1;
+		}
+		memcpy(s->s_vals[s->s_num].kv_name, p, len);
+		s->s_vals[s->s_num].kv_name[len] = 0;
+		sp++;
+		s->s_vals[s->s_num].kv_value = getnum(&sp);
+		s->s_num++;
+		p = nl;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// lookups
+
+/*
+ * The value named NAME in S, or 0 if it isn't there.
+ */
+static
+uint64_t
+get(const struct snapshot *s, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<s->s_num; i++) {
+		if (!strcmp(s->s_vals[i].kv_name, name)) {
+			return s->s_vals[i].kv_value;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The sum of the values named PREFIX*SUFFIX in S.
+ */
+static
+uint64_t
+sum(const struct snapshot *s, const char *prefix, const char *suffix)
+{
+	size_t plen, slen, len;
+	const char *name;
+	uint64_t total;
+	unsigned i;
+
+	plen = strlen(prefix);
+	slen = strlen(suffix);
+	total = 0;
+	for (i=0; i<s->s_num; i++) {
+		name = s->s_vals[i].kv_name;
+		len = strlen(name);
+		if (len >= plen + slen && !memcmp(name, prefix, plen) &&
+		    !strcmp(name + len - slen, suffix)) {
+			total += s->s_vals[i].kv_value;
+		}
+	}
+	return total;
+}
+
+////////////////////////////////////////////////////////////
+// printing
+
+static
+void
+header(void)
+{
+	printf("   secs   free   swap faults  pgin pgout  bgets  bhits "
+	       "dread dwrit    sys   csw\n");
+}
+
+/*
+ * One line: levels from NEW, counts from OLD to NEW. OLD may be NULL,
+ * for counts since boot.
+ */
+static
+void
+line(const struct snapshot *old, const struct snapshot *new)
+{
+	static const struct snapshot zero;
+	uint64_t ms;
+
+	if (old == NULL) {
+		old = &zero;
+		ms = 0;
+	}
+	else {
+		ms = (new->s_ns - old->s_ns) / 1000000;
+	}
+
+#define D(name) ((unsigned long long)(get(new, name) - get(old, name)))
+#define DS(p, s) ((unsigned long long)(sum(new, p, s) - sum(old, p, s)))
+	printf("%3llu.%03llu %6llu %6llu %6llu %5llu %5llu %6llu %6llu "
+	       "%5llu %5llu %6llu %5llu\n",
+	       (unsigned long long)(ms / 1000),
+	       (unsigned long long)(ms % 1000),
+	       (unsigned long long)get(new, "vm.coremap.free"),
+	       (unsigned long long)get(new, "vm.swap.used"),
+	       D("vm.faults"), D("vm.swap.pageins"), D("vm.swap.pageouts"),
+	       D("buf.gets"), D("buf.hits"),
+	       DS("dev.", ".read.ops"), DS("dev.", ".write.ops"),
+	       D("syscall.calls"), D("sched.switches"));
+#undef D
+#undef DS
+}
+
+/*
+ * List every value that changed from OLD to NEW, with the change.
+ * Values that went down are levels; print the new value for those.
+ */
+static
+void
+changes(const struct snapshot *old, const struct snapshot *new)
+{
+	const struct kstatval *kv;
+	uint64_t was;
+	unsigned i;
+
+	for (i=0; i<new->s_num; i++) {
+		kv = &new->s_vals[i];
+		was = get(old, kv->kv_name);
+		if (kv->kv_value > was) {
+			printf("    %-40s +%llu\n", kv->kv_name,
+			       (unsigned long long)(kv->kv_value - was));
+		}
+		else if (kv->kv_value < was) {
+			printf("    %-40s =%llu\n", kv->kv_name,
+			       (unsigned long long)kv->kv_value);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// main
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: vmstat [-a] [wait [count]]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct snapshot *old, *new, *t;
+	struct timespec ts;
+	bool all = false;
+	int wait = 0, count = -1;
+	unsigned lines;
+	int i;
+
+	i = 1;
+	if (i < argc && !strcmp(argv[i], "-a")) {
+		all = true;
+		i++;
+	}
+	if (i < argc) {
+		wait = atoi(argv[i++]);
+		if (wait <= 0) {
+			usage();
+		}
+	}
+	if (i < argc) {
+		count = atoi(argv[i++]);
+		if (count <= 0) {
+			usage();
+		}
+	}
+	if (i < argc) {
+		usage();
+	}
+
+	old = &snaps[0];
+	new = &snaps[1];
+	snap(new);
+	header();
+	line(NULL, new);
+	lines = 1;
+
+	while (wait > 0 && (count < 0 || --count > 0)) {
+		t = old;
+		old = new;
+		new = t;
+
+		ts.tv_sec = wait;
+		ts.tv_nsec = 0;
+		nanosleep(&ts, NULL);
+		snap(new);
+
+		if (all || lines % HEADEREVERY == 0) {
+			header();
+		}
+		line(old, new);
+		if (all) {
+			changes(old, new);
+		}
+		lines++;
+	}
+	return 0;
+}
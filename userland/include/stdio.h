@@ -41,6 +41,26 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/*
+ * Output streams. stdout is line-buffered if it's a terminal (a
+ * character device) and fully buffered otherwise, decided on first
+ * use; stderr is unbuffered. Everything buffered is flushed by
+ * exit(), fork(), and execv(), and stdout also before getchar()
+ * reads. There are no input streams; use getchar() or read().
+ */
+typedef struct __file FILE;
+
+extern FILE *stdout;
+extern FILE *stderr;
+
+/* Size of a stream buffer */
+#define BUFSIZ 1024
+
+/* Buffering modes for setvbuf */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -53,6 +73,8 @@ int __vprintf(void (*sendfunc)(void *clientdata, const char *, size_t len),
 /* Printf calls for user programs */
 int printf(const char *fmt, ...);
 int vprintf(const char *fmt, __va_list ap);
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
 int snprintf(char *buf, size_t len, const char *fmt, ...);
 int vsnprintf(char *buf, size_t len, const char *fmt, __va_list ap);
 
@@ -66,6 +88,21 @@ int __puts(const char *);
 /* Writes one character. Returns it. */
 int putchar(int);
 
+/* Stream output. Returns as per the C standard; EOF on error. */
+int fputc(int, FILE *);
+int putc(int, FILE *);
+int fputs(const char *, FILE *);
+size_t fwrite(const void *, size_t size, size_t nitems, FILE *);
+
+/* Write out what's buffered; for all streams if given NULL. */
+int fflush(FILE *);
+
+/* Change a stream's buffering. BUF must be NULL; SIZE is ignored. */
+int setvbuf(FILE *, char *buf, int mode, size_t size);
+
+/* Nonzero if a write to the stream has failed. */
+int ferror(FILE *);
+
 /* Reads one character (0-255) or returns EOF on error. */
 int getchar(void);
 
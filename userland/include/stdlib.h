@@ -70,6 +70,17 @@ void srandom(unsigned long seed);
 char *initstate(unsigned long, char *, size_t);
 char *setstate(char *);
 
+/*
+ * Fast pseudo-random numbers for test data, with caller-held state.
+ * Not related to random(); same seed always gives the same sequence.
+ */
+struct xrandom {
+	__u32 xr_s[4];
+};
+void xrandom_seed(struct xrandom *xr, unsigned long seed);
+__u32 xrandom(struct xrandom *xr);
+void xrandom_fill(struct xrandom *xr, __u32 *buf, size_t nwords);
+
 /*
  * Memory allocation functions.
  */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SYS_SOCKET_H_
+#define _SYS_SOCKET_H_
+
+/*
+ * Get the socket types, address families, and address structures
+ * from the kernel.
+ */
+#include <sys/types.h>
+#include <kern/socket.h>
+
+/*
+ * Sockets. The kernel supports only SOCK_DGRAM sockets in PF_LNET,
+ * addressed with struct sockaddr_ln: datagrams between machines on
+ * one sys161 network hub. read and write work on a connected socket;
+ * close it like any other file.
+ */
+int socket(int domain, int type, int protocol);
+int bind(int sock, const struct sockaddr *addr, socklen_t addrlen);
+int connect(int sock, const struct sockaddr *addr, socklen_t addrlen);
+int getsockname(int sock, struct sockaddr *addr, socklen_t *addrlen);
+ssize_t sendto(int sock, const void *buf, size_t len, int flags,
+	       const struct sockaddr *addr, socklen_t addrlen);
+ssize_t recvfrom(int sock, void *buf, size_t len, int flags,
+		 struct sockaddr *addr, socklen_t *addrlen);
+
+#endif /* _SYS_SOCKET_H_ */
@@ -38,13 +38,16 @@
  * kernel includes. This way user-level code doesn't need to know
  * about the kern/ headers.
  */
+#include <kern/dirent.h>
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/uprof.h>
 
 
 /*
@@ -112,6 +115,7 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+pid_t vfork(void);
 pid_t waitpid(pid_t pid, int *returncode, int flags);
 /*
  * Open actually takes either two or three args: the optional third
@@ -129,6 +133,7 @@ int rmdir(const char *dirname);
 
 /* Recommended. */
 pid_t getpid(void);
+pid_t getppid(void);
 int ioctl(int filehandle, int code, void *buf);
 off_t lseek(int filehandle, off_t pos, int code);
 int fsync(int filehandle);
@@ -142,11 +147,29 @@ int chdir(const char *path);
 /* Optional. */
 void *sbrk(__intptr_t change);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
+ssize_t getdirentries(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+/* readv, writev, preadv, pwritev - see sys/uio.h */
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+const struct timepage *__timepage(void);	/* see kern/timepage.h */
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int getrusage(int who, struct rusage *usage);
+int getpriority(int which, int who);
+int setpriority(int which, int who, int prio);
+int setaffinity(pid_t pid, unsigned mask);
+int getaffinity(pid_t pid, unsigned *mask);
+int futex_wait(volatile int *addr, int val, const struct timespec *timeout);
+int futex_wake(volatile int *addr, int n);
+ssize_t copyfile(int fromfd, int tofd, size_t len);
+int uprof(int op, void *buf, size_t len);
+int lwp_create(void (*func)(void *), void *arg, void *stack,
+	       volatile int *done);
+__DEAD void lwp_exit(void);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -157,6 +180,8 @@ ssize_t __getcwd(char *buf, size_t buflen);
 
 int execvp(const char *prog, char *const *args); /* calls execv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
-time_t time(time_t *seconds);			/* calls __time */
+time_t time(time_t *seconds);			/* calls __time_fast */
+/* __time without a system call, but only to the clock tick */
+int __time_fast(time_t *seconds, unsigned long *nanoseconds);
 
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _UTHREAD_H_
+#define _UTHREAD_H_
+
+#include <sys/cdefs.h>
+
+/*
+ * Userlevel threads and synchronization, built on lwp_create,
+ * lwp_exit and futex_wait/futex_wake; link with -lthread.
+ *
+ * uthread_create starts FUNC(ARG) in a new thread of the process,
+ * which exits when FUNC returns or calls uthread_exit. The process
+ * exits when its last thread does, or when any thread calls exit or
+ * execv; then the others are stopped wherever they are. Joining a
+ * thread (at most once) frees its stack; the stack of one that's
+ * never joined stays allocated.
+ *
+ * malloc and free are thread-safe, and each thread has its own cache
+ * of small blocks, kept at the bottom of its stack, so allocating
+ * doesn't usually need the heap lock. That only works for threads
+ * made with uthread_create, so a thread started with lwp_create
+ * directly may not use malloc. The rest of libc isn't thread-safe.
+ *
+ * Mutexes (which are in libc, for malloc's use) and condition
+ * variables are plain ints in user memory and can live anywhere the
+ * threads sharing them can see, including memory shared between
+ * processes. Initialize them statically with
+ * the _INITIALIZER macros or at runtime with the _init functions;
+ * there's nothing to destroy.
+ *
+ * umutex_lock and umutex_unlock don't enter the kernel unless the
+ * mutex is contended. ucond_signal and ucond_broadcast don't enter
+ * the kernel unless somebody is waiting.
+ */
+
+struct timespec;
+
+#define UTHREAD_STACKSIZE	65536
+
+struct uthread {
+	volatile int ut_done;		/* zeroed by the kernel at exit */
+	void *ut_stack;
+	void (*ut_func)(void *);
+	void *ut_arg;
+};
+
+struct umutex {
+	volatile int um_state;		/* 0 free, 1 held, 2 held+waiters */
+};
+
+struct ucond {
+	volatile int uc_seq;		/* bumped by every signal */
+	volatile int uc_waiters;	/* threads in ucond_wait */
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0, 0 }
+
+int uthread_create(struct uthread **ret, void (*func)(void *), void *arg);
+void uthread_join(struct uthread *t);
+__DEAD void uthread_exit(void);
+
+void umutex_init(struct umutex *m);
+void umutex_lock(struct umutex *m);
+int umutex_trylock(struct umutex *m);	/* returns 0 or EBUSY */
+void umutex_unlock(struct umutex *m);
+
+/* malloc's side of thread stacks; for libthread only */
+void *__malloc_stackalloc(void);	/* UTHREAD_STACKSIZE-aligned */
+void __malloc_stackfree(void *stack);
+void __malloc_threadexit(void);
+
+void ucond_init(struct ucond *c);
+void ucond_wait(struct ucond *c, struct umutex *m);
+int ucond_timedwait(struct ucond *c, struct umutex *m,
+		    const struct timespec *timeout);  /* 0 or ETIMEDOUT */
+void ucond_signal(struct ucond *c);
+void ucond_broadcast(struct ucond *c);
+
+#endif /* _UTHREAD_H_ */
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <uthread.h>
+
+/*
+ * Buffered output streams. The rest of stdio goes through fwrite and
+ * fputc here.
+ *
+ * Threads share the streams, so each has a lock, held across each
+ * call that touches the buffer; that also keeps what one fwrite or
+ * printf puts out in one piece. The functions below with the lock
+ * held don't take it again.
+ */
+
+struct __file {
+	int f_fd;		/* file descriptor written to */
+	int f_mode;		/* _IO*BF, or -1 if not chosen yet */
+	int f_error;		/* a write has failed */
+	struct umutex f_lock;	/* protects the rest */
+	size_t f_len;		/* bytes waiting in f_buf */
+	char f_buf[BUFSIZ];
+};
+
+static FILE __stdout = {
+	STDOUT_FILENO, -1, 0, UMUTEX_INITIALIZER, 0, { 0 }
+};
+static FILE __stderr = {
+	STDERR_FILENO, _IONBF, 0, UMUTEX_INITIALIZER, 0, { 0 }
+};
+
+FILE *stdout = &__stdout;
+FILE *stderr = &__stderr;
+
+/*
+ * On first use, line-buffer a terminal and fully buffer anything
+ * else. If fstat fails we can't tell, so line-buffer to be safe:
+ * then at worst output is written a bit more often than it needed
+ * to be, rather than lost when the process dies without exiting.
+ * This mustn't disturb errno.
+ */
+static
+void
+choosemode(FILE *f)
+{
+	struct stat st;
+	int olderrno;
+
+	if (f->f_mode >= 0) {
+		return;
+	}
+	olderrno = errno;
+	if (fstat(f->f_fd, &st) == 0 && !S_ISCHR(st.st_mode)) {
+		f->f_mode = _IOFBF;
+	}
+	else {
+		f->f_mode = _IOLBF;
+	}
+	errno = olderrno;
+}
+
+/*
+ * Write LEN bytes at DATA out to the stream's file, all of them
+ * unless there's an error.
+ */
+static
+int
+writeall(FILE *f, const char *data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(f->f_fd, data, len);
+		if (r <= 0) {
+			f->f_error = 1;
+			return EOF;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Empty the buffer. On error what was in it is dropped, so one
+ * failure doesn't repeat forever.
+ */
+static
+int
+flushbuf(FILE *f)
+{
+	int result;
+
+	result = writeall(f, f->f_buf, f->f_len);
+	f->f_len = 0;
+	return result;
+}
+
+/*
+ * Put LEN bytes at DATA into the stream, writing out as its mode
+ * says. Returns 0 or EOF. The lock must be held.
+ */
+static
+int
+putdata(FILE *f, const char *data, size_t len)
+{
+	size_t amt, i;
+	int sawnewline = 0;
+
+	choosemode(f);
+
+	if (f->f_mode == _IONBF) {
+		return writeall(f, data, len);
+	}
+
+	if (len >= BUFSIZ) {
+		/* Too big to be worth copying */
+		if (flushbuf(f) || writeall(f, data, len)) {
+			return EOF;
+		}
+		return 0;
+	}
+
+	while (len > 0) {
+		amt = BUFSIZ - f->f_len;
+		if (amt > len) {
+			amt = len;
+		}
+		for (i=0; i<amt; i++) {
+			f->f_buf[f->f_len++] = data[i];
+			if (data[i] == '\n') {
+				sawnewline = 1;
+			}
+		}
+		data += amt;
+		len -= amt;
+		if (f->f_len == BUFSIZ && flushbuf(f)) {
+			return EOF;
+		}
+	}
+	if (sawnewline && f->f_mode == _IOLBF && flushbuf(f)) {
+		return EOF;
+	}
+	return 0;
+}
+
+size_t
+fwrite(const void *ptr, size_t size, size_t nitems, FILE *f)
+{
+	size_t len;
+	int result;
+
+	len = size * nitems;
+	if (len == 0) {
+		return 0;
+	}
+	umutex_lock(&f->f_lock);
+	result = putdata(f, ptr, len);
+	umutex_unlock(&f->f_lock);
+	return result ? 0 : nitems;
+}
+
+int
+fputc(int ch, FILE *f)
+{
+	char c = ch;
+	int result;
+
+	umutex_lock(&f->f_lock);
+	if (f->f_mode == _IOFBF ||
+	    (f->f_mode == _IOLBF && c != '\n')) {
+		/* Fast path: just add it */
+		f->f_buf[f->f_len++] = c;
+		result = f->f_len == BUFSIZ ? flushbuf(f) : 0;
+	}
+	else {
+		result = putdata(f, &c, 1);
+	}
+	umutex_unlock(&f->f_lock);
+	return result ? EOF : (unsigned char)c;
+}
+
+int
+putc(int ch, FILE *f)
+{
+	return fputc(ch, f);
+}
+
+int
+fflush(FILE *f)
+{
+	int result;
+
+	if (f == NULL) {
+		/* stderr is never buffered */
+		return fflush(stdout);
+	}
+	umutex_lock(&f->f_lock);
+	result = f->f_len == 0 ? 0 : flushbuf(f);
+	umutex_unlock(&f->f_lock);
+	return result;
+}
+
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	(void)size;
+
+	if (buf != NULL ||
+	    (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)) {
+		errno = EINVAL;
+		return EOF;
+	}
+	umutex_lock(&f->f_lock);
+	if (f->f_len > 0 && flushbuf(f)) {
+		umutex_unlock(&f->f_lock);
+		return EOF;
+	}
+	f->f_mode = mode;
+	umutex_unlock(&f->f_lock);
+	return 0;
+}
+
+int
+ferror(FILE *f)
+{
+	return f->f_error;
+}
@@ -30,10 +30,14 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a basic boundary-tag allocator. Each block has a header
+ * giving the offsets to its neighbors, so free blocks can be merged
+ * with the blocks on either side right away. Free blocks are kept on
+ * lists ("bins") by size, so malloc doesn't have to search the whole
+ * heap: there is one bin for each small size, and one bin for each
+ * power of two above that. It's intended to be simple and easy to
+ * follow. To get (much) better out-of-core performance, port the
+ * kernel's malloc. :-)
  */
 
 #include <stdlib.h>
@@ -41,6 +45,7 @@
 #include <unistd.h>
 #include <err.h>
 #include <assert.h>
+#include <uthread.h>
 
 #undef MALLOCDEBUG
 
@@ -60,7 +65,7 @@
  *
  * mh_nextblock is the upwards offset to the next header.
  *
- * mh_pad is unused.
+ * mh_cached is 1 if the block is sitting in a thread cache (see below).
  * mh_inuse is 1 if the block is in use, 0 if it is free.
  * mh_magic* should always be a fixed value.
  *
@@ -79,7 +84,7 @@ struct mheader {
 	 * Block size is 8 bytes.
 	 */
 	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
+	unsigned mh_cached:1;
 	unsigned mh_magic1:2;
 
 	unsigned mh_nextblock:29;
@@ -95,7 +100,7 @@ struct mheader {
 	 * Block size is 16 bytes.
 	 */
 	unsigned mh_prevblock:60;
-	unsigned mh_pad:1;
+	unsigned mh_cached:1;
 	unsigned mh_magic1:3;
 
 	unsigned mh_nextblock:60;
@@ -134,6 +139,36 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Free-list links, kept in the data area of a free block. This is
+ * the same size as struct mheader, so every block has room for it
+ * once malloc rounds sizes up to at least MBLOCKSIZE.
+ *
+ * M_LINK:		return the links of a free block
+ */
+struct mlink {
+	struct mheader *ml_next;
+	struct mheader *ml_prev;
+};
+
+#define M_LINK(mh)	((struct mlink *)M_DATA(mh))
+
+/*
+ * Bins.
+ *
+ * Free blocks whose data size is at most NSMALLBINS * MBLOCKSIZE go
+ * in the bin for exactly that size. Bigger ones go in the bin for
+ * their power of two; the first large bin covers everything from just
+ * past the small sizes up to the next power of two. The last bin
+ * takes whatever is left.
+ *
+ * NBINS must be a multiple of 32 for the bitmap of nonempty bins.
+ */
+#define NSMALLBINS	64
+#define NLARGEBINS	32
+#define NBINS		(NSMALLBINS + NLARGEBINS)
+#define SMALLBINSHIFT	(MBLOCKSHIFT + 6)	/* log2(NSMALLBINS*MBLOCKSIZE) */
+
 /*
  * System page size. In POSIX you're supposed to call
  * sysconf(_SC_PAGESIZE). If _SC_PAGESIZE isn't defined, as on OS/161,
@@ -147,6 +182,16 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * When the free block at the top of the heap reaches TRIM_THRESHOLD
+ * bytes, free() hands all but its last TRIM_KEEP bytes back to the
+ * system with a negative sbrk, so that a process whose heap spikes
+ * doesn't keep the memory forever. Keeping some back avoids doing
+ * an sbrk each way when the heap goes up and down around one size.
+ */
+#define TRIM_THRESHOLD	(16 * PAGE_SIZE)
+#define TRIM_KEEP	(4 * PAGE_SIZE)
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -154,6 +199,17 @@ static size_t __malloc_pagesize;
  */
 static uintptr_t __heapbase, __heaptop;
 
+/*
+ * The highest block on the heap, or NULL if the heap is empty.
+ */
+static struct mheader *__heaplast;
+
+/*
+ * The bins, and a bitmap of which bins are nonempty.
+ */
+static struct mheader *__malloc_bins[NBINS];
+static uint32_t __malloc_binmap[NBINS / 32];
+
 /*
  * Setup function.
  */
@@ -175,6 +231,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mlink) != MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - struct mlink wrong size");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -255,12 +314,20 @@ __malloc_dump(void)
 			     (unsigned long) rightprevblock << MBLOCKSHIFT);
 		}
 		rightprevblock = mh->mh_nextblock;
+		if (!mh->mh_inuse && (uintptr_t)mh != __heapbase &&
+		    !M_PREV(mh)->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; free blocks at 0x%lx"
+			     " and 0x%lx not merged",
+			     (unsigned long) (uintptr_t) M_PREV(mh),
+			     (unsigned long) i);
+		}
 
 		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
 		      (unsigned long) i + MBLOCKSIZE,
 		      (unsigned long) M_SIZE(mh),
 		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		      !mh->mh_inuse ? "FREE" :
+		      mh->mh_cached ? "CACHED" : "INUSE");
 	}
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
@@ -273,6 +340,126 @@ __malloc_dump(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Return the bin for a free block with SIZE bytes of data.
+ */
+static
+unsigned
+__malloc_binof(size_t size)
+{
+	unsigned bin;
+
+	if (size <= NSMALLBINS * MBLOCKSIZE) {
+		return (size >> MBLOCKSHIFT) - 1;
+	}
+
+	bin = NSMALLBINS;
+	size >>= SMALLBINSHIFT + 1;
+	while (size > 0 && bin < NBINS - 1) {
+		bin++;
+		size >>= 1;
+	}
+	return bin;
+}
+
+/*
+ * Put a free block on its bin.
+ */
+static
+void
+__malloc_bin(struct mheader *mh)
+{
+	unsigned bin;
+	struct mlink *ml;
+
+	bin = __malloc_binof(M_SIZE(mh));
+	ml = M_LINK(mh);
+	ml->ml_prev = NULL;
+	ml->ml_next = __malloc_bins[bin];
+	if (ml->ml_next != NULL) {
+		M_LINK(ml->ml_next)->ml_prev = mh;
+	}
+	__malloc_bins[bin] = mh;
+	__malloc_binmap[bin / 32] |= (uint32_t)1 << (bin % 32);
+}
+
+/*
+ * Take a free block off its bin.
+ */
+static
+void
+__malloc_unbin(struct mheader *mh)
+{
+	unsigned bin;
+	struct mlink *ml;
+
+	bin = __malloc_binof(M_SIZE(mh));
+	ml = M_LINK(mh);
+	if (ml->ml_prev != NULL) {
+		M_LINK(ml->ml_prev)->ml_next = ml->ml_next;
+	}
+	else {
+		if (__malloc_bins[bin] != mh) {
+			errx(1, "malloc: Heap corrupt; free block %p "
+			     "not on its bin", mh);
+		}
+		__malloc_bins[bin] = ml->ml_next;
+	}
+	if (ml->ml_next != NULL) {
+		M_LINK(ml->ml_next)->ml_prev = ml->ml_prev;
+	}
+	if (__malloc_bins[bin] == NULL) {
+		__malloc_binmap[bin / 32] &= ~((uint32_t)1 << (bin % 32));
+	}
+}
+
+/*
+ * Find a free block with at least SIZE bytes of data, or return NULL
+ * if there isn't one.
+ *
+ * A small bin holds only blocks of one size, and every block in a
+ * higher bin is bigger than anything in a lower one, so the only
+ * searching needed is within the large bin SIZE itself falls in.
+ */
+static
+struct mheader *
+__malloc_findfree(size_t size)
+{
+	struct mheader *mh;
+	unsigned bin;
+	uint32_t bits;
+
+	bin = __malloc_binof(size);
+	if (bin < NSMALLBINS) {
+		if (__malloc_bins[bin] != NULL) {
+			return __malloc_bins[bin];
+		}
+	}
+	else {
+		for (mh = __malloc_bins[bin]; mh != NULL;
+		     mh = M_LINK(mh)->ml_next) {
+			if (M_SIZE(mh) >= size) {
+				return mh;
+			}
+		}
+	}
+
+	/* Find the next nonempty bin up. */
+	for (bin++; bin < NBINS; bin += 32 - bin % 32) {
+		bits = __malloc_binmap[bin / 32] >> (bin % 32);
+		if (bits != 0) {
+			while ((bits & 1) == 0) {
+				bits >>= 1;
+				bin++;
+			}
+			return __malloc_bins[bin];
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Get more memory (at the top of the heap) using sbrk, and
  * return a pointer to it.
@@ -298,10 +485,48 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Give memory at the top of the heap back to the system, if the free
+ * block MH (which must be the top block, and not on a bin) is big
+ * enough to be worth it. If sbrk won't shrink the heap, just leave
+ * it alone.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t release;
+	void *x;
+
+	if (M_SIZE(mh) < TRIM_THRESHOLD) {
+		return;
+	}
+	release = PAGE_SIZE * ((M_SIZE(mh) - TRIM_KEEP) / PAGE_SIZE);
+
+	x = sbrk(-(intptr_t)release);
+	if (x == (void *)-1) {
+		return;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "malloc: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
+	}
+	__heaptop -= release;
+	mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) - release);
+
+#ifdef MALLOCDEBUG
+	warnx("free: returned %lu bytes to the system",
+	      (unsigned long) release);
+#endif
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * bytes for data in the current block, and put it on its bin. size
+ * must be a multiple of MBLOCKSIZE. The current block must not be on
+ * a bin, and the block after it must not be free.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -334,7 +559,7 @@ __malloc_split(struct mheader *mh, size_t size)
 	}
 
 	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
+	mhnew->mh_cached = 0;
 	mhnew->mh_magic1 = MMAGIC;
 	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
 	mhnew->mh_inuse = 0;
@@ -343,70 +568,30 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	__malloc_bin(mhnew);
 }
 
 /*
- * malloc itself.
+ * Allocate a block with SIZE bytes of data from the heap. SIZE must
+ * already be rounded as malloc does it.
  */
+static
 void *
-malloc(size_t size)
+__malloc_arena_alloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
 	size_t rightprevblock;
 	size_t morespace;
 	void *p;
 
-	if (__heapbase==0) {
-		__malloc_init();
-	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes",
-	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
-#endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	mh = NULL;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
+	/* Look for a free block in the bins. */
+	mh = __malloc_findfree(size);
+	if (mh != NULL) {
+		__malloc_unbin(mh);
 
 		/* Try splitting block. */
 		__malloc_split(mh, size);
@@ -422,17 +607,14 @@ malloc(size_t size)
 #endif
 		return M_DATA(mh);
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
 
 	/*
 	 * Didn't find anything. Expand the heap.
 	 *
-	 * If the heap is nonempty and the top block (the one mh is
-	 * left pointing to after the above loop) is free, we can
+	 * If the heap is nonempty and the top block is free, we can
 	 * expand it. Otherwise we need a new block.
 	 */
+	mh = __heaplast;
 	if (mh != NULL && !mh->mh_inuse) {
 		assert(size > M_SIZE(mh));
 		morespace = size - M_SIZE(mh);
@@ -451,18 +633,21 @@ malloc(size_t size)
 
 	if (mh != NULL && !mh->mh_inuse) {
 		/* update old header */
+		__malloc_unbin(mh);
 		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + morespace);
 		mh->mh_inuse = 1;
 	}
 	else {
 		/* fill out new header */
+		rightprevblock = mh != NULL ? mh->mh_nextblock : 0;
 		mh = p;
 		mh->mh_prevblock = rightprevblock;
 		mh->mh_magic1 = MMAGIC;
 		mh->mh_magic2 = MMAGIC;
-		mh->mh_pad = 0;
+		mh->mh_cached = 0;
 		mh->mh_inuse = 1;
 		mh->mh_nextblock = M_MKFIELD(morespace);
+		__heaplast = mh;
 	}
 
 	/*
@@ -497,10 +682,11 @@ __malloc_deadbeef(void *ptr, size_t size)
 }
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Attempt to merge two adjacent blocks (mh below mhnext). Neither
+ * should be on a bin. Returns nonzero if they were merged.
  */
 static
-void
+int
 __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
@@ -511,7 +697,7 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	}
 	if (mh->mh_inuse || mhnext->mh_inuse) {
 		/* can't merge */
-		return;
+		return 0;
 	}
 
 	mhnextnext = M_NEXT(mhnext);
@@ -522,9 +708,266 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+	return 1;
+}
+
+/*
+ * Return the block MH to the heap. It should already be wiped.
+ */
+static
+void
+__malloc_arena_free(struct mheader *mh)
+{
+	struct mheader *mhnext, *mhprev;
+
+	/* mark it free */
+	mh->mh_inuse = 0;
+
+	/*
+	 * Try merging with the block above (but not if we're at the
+	 * top). Free neighbors have to come off their bins first.
+	 */
+	mhnext = M_NEXT(mh);
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_unbin(mhnext);
+		__malloc_trymerge(mh, mhnext);
+	}
+
+	/* Try merging with the block below (but not if we're at the bottom) */
+	if (mh != (struct mheader *)__heapbase) {
+		mhprev = M_PREV(mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_unbin(mhprev);
+			if (__malloc_trymerge(mhprev, mh)) {
+				mh = mhprev;
+			}
+		}
+	}
+
+	/* shrink the heap if there's a lot free at the top */
+	if (mh == __heaplast) {
+		__malloc_trim(mh);
+	}
+
+	/* file whatever we ended up with */
+	__malloc_bin(mh);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Thread cache.
+ *
+ * Freed small blocks go on a list for their size in the freeing
+ * thread's cache instead of back to the heap, and malloc looks there
+ * first. The heap itself is shared and is protected by MALLOC_LOCK
+ * and MALLOC_UNLOCK; a thread only needs the lock when its cache is
+ * empty, in which case it takes TCACHE_REFILL blocks at once, or
+ * full, in which case it gives back half the list. Cached blocks are
+ * still in use as far as the heap is concerned, so they're never
+ * merged; mh_cached marks them so double frees are still caught.
+ *
+ * Each thread made by uthread_create has its stack in the heap,
+ * allocated by __malloc_stackalloc aligned to UTHREAD_STACKSIZE, and
+ * its cache lives at the bottom of that stack. So a stack pointer
+ * inside the heap leads straight to the cache without a system call
+ * or any per-thread register; any other stack pointer belongs to the
+ * original thread, which uses __malloc_tcache0. A thread flushes its
+ * cache when it exits (__malloc_threadexit), and whatever's left when
+ * the stack is freed is flushed then.
+ */
+
+#define TCACHE_NSIZES		16	/* sizes up to this many blocks */
+#define TCACHE_MAXBLOCKS	32	/* per size */
+#define TCACHE_REFILL		8
+#define STACKMASK		((uintptr_t)UTHREAD_STACKSIZE - 1)
+
+struct tcache {
+	struct mheader *tc_blocks[TCACHE_NSIZES];
+	unsigned tc_count[TCACHE_NSIZES];
+};
+
+static struct tcache __malloc_tcache0;
+
+static struct umutex __malloc_lock = UMUTEX_INITIALIZER;
+
+#define MALLOC_LOCK()	umutex_lock(&__malloc_lock)
+#define MALLOC_UNLOCK()	umutex_unlock(&__malloc_lock)
+
+/*
+ * Return the calling thread's cache. The heap never shrinks below a
+ * block that's in use, such as the caller's stack, so reading the
+ * bounds without the lock is safe.
+ */
+static
+struct tcache *
+__malloc_gettcache(void)
+{
+	uintptr_t sp;
+
+	sp = (uintptr_t)&sp;
+	if (sp >= __heapbase && sp < __heaptop) {
+		return (struct tcache *)(sp & ~STACKMASK);
+	}
+	return &__malloc_tcache0;
+}
+
+/*
+ * Return the cache list for blocks with SIZE bytes of data, or -1 if
+ * they aren't cached.
+ */
+static
+int
+__malloc_tcache_index(size_t size)
+{
+	size_t index;
+
+	index = (size >> MBLOCKSHIFT) - 1;
+	if (index >= TCACHE_NSIZES) {
+		return -1;
+	}
+	return index;
+}
+
+/*
+ * Take a block from list INDEX of cache TC, or return NULL if it's
+ * empty.
+ */
+static
+struct mheader *
+__malloc_tcache_get(struct tcache *tc, int index)
+{
+	struct mheader *mh;
+
+	mh = tc->tc_blocks[index];
+	if (mh == NULL) {
+		return NULL;
+	}
+	tc->tc_blocks[index] = M_LINK(mh)->ml_next;
+	tc->tc_count[index]--;
+	mh->mh_cached = 0;
+	return mh;
+}
+
+/*
+ * Put the in-use block MH on list INDEX of cache TC.
+ */
+static
+void
+__malloc_tcache_put(struct tcache *tc, int index, struct mheader *mh)
+{
+	mh->mh_cached = 1;
+	M_LINK(mh)->ml_next = tc->tc_blocks[index];
+	tc->tc_blocks[index] = mh;
+	tc->tc_count[index]++;
+}
+
+/*
+ * Return all but KEEP blocks of list INDEX of cache TC to the heap.
+ */
+static
+void
+__malloc_tcache_flush(struct tcache *tc, int index, unsigned keep)
+{
+	struct mheader *mh;
+
+	MALLOC_LOCK();
+	while (tc->tc_count[index] > keep) {
+		mh = __malloc_tcache_get(tc, index);
+		__malloc_arena_free(mh);
+	}
+	MALLOC_UNLOCK();
+}
+
+/*
+ * Get a block with SIZE bytes of data from the heap, and (if SIZE is
+ * cached) some more for list INDEX of cache TC while we have the lock.
+ */
+static
+void *
+__malloc_tcache_refill(struct tcache *tc, int index, size_t size)
+{
+	void *ret, *p;
+	struct mheader *mh;
+	unsigned i;
+
+	MALLOC_LOCK();
+	ret = __malloc_arena_alloc(size);
+	for (i=1; ret != NULL && index >= 0 && i<TCACHE_REFILL; i++) {
+		p = __malloc_arena_alloc(size);
+		if (p == NULL) {
+			break;
+		}
+		mh = ((struct mheader *)p)-1;
+		if (M_SIZE(mh) != size) {
+			/* couldn't split it; don't bother */
+			__malloc_arena_free(mh);
+			break;
+		}
+		__malloc_tcache_put(tc, index, mh);
+	}
+	MALLOC_UNLOCK();
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct tcache *tc;
+	struct mheader *mh;
+	int index;
+
+	if (__heapbase==0) {
+		MALLOC_LOCK();
+		if (__heapbase==0) {
+			__malloc_init();
+		}
+		MALLOC_UNLOCK();
+	}
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
+	      (unsigned long) size, (unsigned long) size);
+	__malloc_dump();
+#endif
+
+	/*
+	 * Round size up to an integral number of blocks, and make
+	 * sure there's room for the free-list links when the block is
+	 * freed.
+	 */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size < sizeof(struct mlink)) {
+		size = sizeof(struct mlink);
+	}
+
+	/* Try this thread's cache. */
+	tc = __malloc_gettcache();
+	index = __malloc_tcache_index(size);
+	if (index >= 0) {
+		mh = __malloc_tcache_get(tc, index);
+		if (mh != NULL) {
+			return M_DATA(mh);
+		}
+	}
+
+	return __malloc_tcache_refill(tc, index, size);
 }
 
 /*
@@ -533,7 +976,9 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 void
 free(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	struct tcache *tc;
+	struct mheader *mh;
+	int index;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -562,26 +1007,26 @@ free(void *x)
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
 
-	if (!mh->mh_inuse) {
+	if (!mh->mh_inuse || mh->mh_cached) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
 
-	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	/* Keep it in this thread's cache if it's small. */
+	tc = __malloc_gettcache();
+	index = __malloc_tcache_index(M_SIZE(mh));
+	if (index >= 0) {
+		__malloc_tcache_put(tc, index, mh);
+		if (tc->tc_count[index] > TCACHE_MAXBLOCKS) {
+			__malloc_tcache_flush(tc, index, TCACHE_MAXBLOCKS / 2);
+		}
 	}
-
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
-		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+	else {
+		MALLOC_LOCK();
+		__malloc_arena_free(mh);
+		MALLOC_UNLOCK();
 	}
 
 #ifdef MALLOCDEBUG
@@ -589,3 +1034,140 @@ free(void *x)
 	__malloc_dump();
 #endif
 }
+
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Thread support, for libthread.
+ */
+
+/*
+ * Cut the in-use block MH in two, OFF bytes (header included) from
+ * its header; both halves are left in use. Return the upper one.
+ */
+static
+struct mheader *
+__malloc_carve(struct mheader *mh, size_t off)
+{
+	struct mheader *mhnext, *mhnew;
+
+	mhnext = M_NEXT(mh);
+	mhnew = (struct mheader *)((char *)mh + off);
+
+	mhnew->mh_prevblock = M_MKFIELD(off);
+	mhnew->mh_cached = 0;
+	mhnew->mh_magic1 = MMAGIC;
+	mhnew->mh_nextblock = M_MKFIELD((char *)mhnext - (char *)mhnew);
+	mhnew->mh_inuse = 1;
+	mhnew->mh_magic2 = MMAGIC;
+	mh->mh_nextblock = M_MKFIELD(off);
+
+	if (mhnext != (struct mheader *)__heaptop) {
+		mhnext->mh_prevblock = mhnew->mh_nextblock;
+	}
+	else {
+		__heaplast = mhnew;
+	}
+	return mhnew;
+}
+
+/*
+ * Allocate a block with SIZE bytes of data aligned to ALIGN, a power
+ * of two at least MBLOCKSIZE, by allocating enough extra to find an
+ * aligned spot with room for a block below it, and then giving back
+ * the pieces on either side.
+ */
+static
+void *
+__malloc_arena_alignedalloc(size_t size, size_t align)
+{
+	struct mheader *mh, *mhnew;
+	uintptr_t p, q;
+
+	p = (uintptr_t)__malloc_arena_alloc(size + align + 2*MBLOCKSIZE);
+	if (p == 0) {
+		return NULL;
+	}
+	mh = ((struct mheader *)p)-1;
+
+	if ((p & (align - 1)) != 0) {
+		q = (p + 2*MBLOCKSIZE + align - 1) & ~(uintptr_t)(align - 1);
+		mhnew = __malloc_carve(mh, q - p);
+		__malloc_arena_free(mh);
+		mh = mhnew;
+	}
+	if (M_SIZE(mh) >= size + 2*MBLOCKSIZE) {
+		__malloc_arena_free(__malloc_carve(mh, MBLOCKSIZE + size));
+	}
+	return M_DATA(mh);
+}
+
+/*
+ * Allocate a thread stack: UTHREAD_STACKSIZE bytes, aligned to that
+ * size, with an empty cache at the bottom. Returns NULL if out of
+ * memory.
+ */
+void *
+__malloc_stackalloc(void)
+{
+	struct tcache *tc;
+	unsigned i;
+
+	MALLOC_LOCK();
+	if (__heapbase==0) {
+		__malloc_init();
+	}
+	tc = __malloc_arena_alignedalloc(UTHREAD_STACKSIZE,
+					 UTHREAD_STACKSIZE);
+	MALLOC_UNLOCK();
+	if (tc == NULL) {
+		return NULL;
+	}
+	for (i=0; i<TCACHE_NSIZES; i++) {
+		tc->tc_blocks[i] = NULL;
+		tc->tc_count[i] = 0;
+	}
+	return tc;
+}
+
+/*
+ * Free a thread stack from __malloc_stackalloc, once its thread is
+ * gone, along with anything still in its cache.
+ */
+void
+__malloc_stackfree(void *stack)
+{
+	struct tcache *tc = stack;
+	struct mheader *mh;
+	unsigned i;
+
+	MALLOC_LOCK();
+	for (i=0; i<TCACHE_NSIZES; i++) {
+		while ((mh = __malloc_tcache_get(tc, i)) != NULL) {
+			__malloc_arena_free(mh);
+		}
+	}
+	mh = ((struct mheader *)stack)-1;
+	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	__malloc_arena_free(mh);
+	MALLOC_UNLOCK();
+}
+
+/*
+ * Give the calling thread's cached blocks back to the heap, because
+ * it's about to exit.
+ */
+void
+__malloc_threadexit(void)
+{
+	struct tcache *tc;
+	unsigned i;
+
+	tc = __malloc_gettcache();
+	for (i=0; i<TCACHE_NSIZES; i++) {
+		if (tc->tc_count[i] > 0) {
+			__malloc_tcache_flush(tc, i, 0);
+		}
+	}
+}
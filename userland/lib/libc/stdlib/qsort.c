@@ -27,119 +27,224 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
-#include <assert.h>
 
 /*
  * qsort() for OS/161, where it isn't in libc.
+ *
+ * This is an introsort: quicksort with a median-of-three pivot,
+ * going over to heapsort for any part of the array where quicksort
+ * recurses too deeply (so adversarial input can't make it
+ * quadratic), and finishing small partitions with insertion sort.
+ * It recurses only on the smaller side of each partition and loops
+ * on the larger, so the stack stays O(log n).
  */
-void
-qsort(void *vdata, unsigned num, size_t size,
-      int (*f)(const void *, const void *))
-{
-	unsigned pivot, head, tail;
-	char *data = vdata;
-	char tmp[size];
 
-#define COMPARE(aa, bb) \
-		((aa) == (bb) ? 0 : f(data + (aa) * size, data + (bb) * size))
-#define EXCHANGE(aa, bb) \
-		memcpy(tmp, data + (aa) * size, size);			\
-		memcpy(data + (aa) * size, data + (bb) * size, size);	\
-		memcpy(data + (bb) * size, tmp, size)
+/* Partitions this small are insertion-sorted */
+#define QSORT_CUTOFF	8
 
+typedef int (*qsort_cmp_t)(const void *, const void *);
+
+struct qsort_state {
+	size_t size;		/* element size */
+	qsort_cmp_t cmp;	/* comparison function */
+	int bywords;		/* elements can be swapped a long at a time */
+};
+
+static
+void
+qsort_swap(const struct qsort_state *qs, char *a, char *b)
+{
+	size_t n;
 
-	if (num <= 1) {
+	if (a == b) {
 		return;
 	}
-	if (num == 2) {
-		if (COMPARE(0, 1) > 0) {
-			EXCHANGE(0, 1);
-			return;
+	if (qs->bywords) {
+		long *la = (long *)a, *lb = (long *)b, t;
+
+		for (n = qs->size / sizeof(long); n > 0; n--) {
+			t = *la;
+			*la++ = *lb;
+			*lb++ = t;
 		}
 	}
+	else {
+		char t;
 
-	/*
-	 * 1. Pick a pivot value. For simplicity, always use the
-	 * middle of the array.
-	 */
-	pivot = num / 2;
-
-	/*
-	 * 2. Shift all values less than or equal to the pivot value
-	 * to the front of the array.
-	 */
-	head = 0;
-	tail = num - 1;
-
-	while (head < tail) {
-		if (COMPARE(head, pivot) <= 0) {
-			head++;
-		}
-		else if (COMPARE(tail, pivot) > 0) {
-			tail--;
+		for (n = qs->size; n > 0; n--) {
+			t = *a;
+			*a++ = *b;
+			*b++ = t;
 		}
-		else {
-			EXCHANGE(head, tail);
-			if (pivot == head) {
-				pivot = tail;
-			}
-			else if (pivot == tail) {
-				pivot = head;
+	}
+}
+
+static
+void
+qsort_insertion(const struct qsort_state *qs, char *data, unsigned num)
+{
+	size_t size = qs->size;
+	char *p, *q;
+	unsigned i;
+
+	for (i=1; i<num; i++) {
+		for (p = data + i * size; p > data; p = q) {
+			q = p - size;
+			if (qs->cmp(q, p) <= 0) {
+				break;
 			}
-			head++;
-			tail--;
+			qsort_swap(qs, q, p);
 		}
 	}
+}
 
-	/*
-	 * 3. If there's an even number of elements and we swapped the
-	 * last two, the head and tail indexes will cross. In this
-	 * case the first entry on the tail side is tail+1. If there's
-	 * an odd number of elements, we stop with head == tail, and
-	 * the first entry on the tail side is this value (hence,
-	 * tail) if it's is greater than the pivot value, and the next
-	 * element (hence, tail+1) if it's less than or equal to the
-	 * pivot value.
-	 *
-	 * Henceforth use "tail" to hold the index of the first entry
-	 * of the back portion of the array.
-	 */
-	if (head > tail || COMPARE(head, pivot) <= 0) {
-		tail++;
+/*
+ * Move element ROOT of the NUM-element heap at DATA down to where it
+ * belongs.
+ */
+static
+void
+qsort_siftdown(const struct qsort_state *qs, char *data, unsigned root,
+	       unsigned num)
+{
+	size_t size = qs->size;
+	unsigned child;
+
+	while ((child = 2 * root + 1) < num) {
+		if (child + 1 < num &&
+		    qs->cmp(data + child * size,
+			    data + (child + 1) * size) < 0) {
+			child++;
+		}
+		if (qs->cmp(data + root * size, data + child * size) >= 0) {
+			return;
+		}
+		qsort_swap(qs, data + root * size, data + child * size);
+		root = child;
 	}
+}
+
+static
+void
+qsort_heapsort(const struct qsort_state *qs, char *data, unsigned num)
+{
+	unsigned i;
 
-	/*
-	 * 4. If we got a bad pivot that gave us only one partition,
-	 * because of the order of the advances in the loop above it
-	 * will always put everything in the front portion of the
-	 * array (so tail == num). This happens if we picked the
-	 * largest value. Move the pivot to the end, if necessary, lop
-	 * off all values equal to it, and recurse on the rest.  (If
-	 * there is no rest, the array is already sorted and we're
-	 * done.)
-	 */
-	if (tail == num) {
-		if (pivot < num - 1) {
-			if (COMPARE(pivot, num - 1) > 0) {
-				EXCHANGE(pivot, num - 1);
+	for (i = num / 2; i-- > 0; ) {
+		qsort_siftdown(qs, data, i, num);
+	}
+	for (i = num - 1; i > 0; i--) {
+		qsort_swap(qs, data, data + i * qs->size);
+		qsort_siftdown(qs, data, 0, i);
+	}
+}
+
+/*
+ * Return whichever of A, B, and C is the median.
+ */
+static
+char *
+qsort_med3(const struct qsort_state *qs, char *a, char *b, char *c)
+{
+	if (qs->cmp(a, b) < 0) {
+		if (qs->cmp(b, c) < 0) {
+			return b;
+		}
+		return qs->cmp(a, c) < 0 ? c : a;
+	}
+	if (qs->cmp(b, c) > 0) {
+		return b;
+	}
+	return qs->cmp(a, c) < 0 ? a : c;
+}
+
+/*
+ * Sort NUM elements at DATA, switching to heapsort if more than
+ * DEPTH more levels of partitioning are needed.
+ */
+static
+void
+qsort_intro(const struct qsort_state *qs, char *data, unsigned num,
+	    unsigned depth)
+{
+	size_t size = qs->size;
+	unsigned i, j;
+
+	while (num > QSORT_CUTOFF) {
+		if (depth == 0) {
+			qsort_heapsort(qs, data, num);
+			return;
+		}
+		depth--;
+
+		/* Put the pivot at the front */
+		qsort_swap(qs, data,
+			   qsort_med3(qs, data, data + (num / 2) * size,
+				      data + (num - 1) * size));
+
+		/*
+		 * Partition the rest around it. Both scans stop on
+		 * elements equal to the pivot, so runs of equal
+		 * values still split down the middle. The pivot
+		 * itself stops the downward scan.
+		 */
+		i = 1;
+		j = num - 1;
+		while (1) {
+			while (i < num && qs->cmp(data + i * size, data) < 0) {
+				i++;
+			}
+			while (qs->cmp(data + j * size, data) > 0) {
+				j--;
 			}
+			if (i >= j) {
+				break;
+			}
+			qsort_swap(qs, data + i * size, data + j * size);
+			i++;
+			j--;
 		}
-		tail = num - 1;
-		while (tail > 0 && COMPARE(tail - 1, tail) == 0) {
-			tail--;
+		/* Now [1, j] <= pivot <= [j+1, num); put it at j */
+		qsort_swap(qs, data, data + j * size);
+
+		/* Recurse on the smaller side, loop on the larger */
+		if (j < num - j - 1) {
+			qsort_intro(qs, data, j, depth);
+			data += (j + 1) * size;
+			num -= j + 1;
 		}
-		if (tail > 0) {
-			qsort(vdata, tail, size, f);
+		else {
+			qsort_intro(qs, data + (j + 1) * size, num - j - 1,
+				    depth);
+			num = j;
 		}
+	}
+	qsort_insertion(qs, data, num);
+}
+
+void
+qsort(void *vdata, unsigned num, size_t size,
+      int (*f)(const void *, const void *))
+{
+	struct qsort_state qs;
+	unsigned depth, n;
+
+	if (num <= 1 || size == 0) {
 		return;
 	}
-	assert(tail > 0 && tail < num);
 
-	/*
-	 * 5. Recurse on each subpart of the array.
-	 */
-	qsort(vdata, tail, size, f);
-	qsort((char *)vdata + tail * size, num - tail, size, f);
+	qs.size = size;
+	qs.cmp = f;
+	qs.bywords = size % sizeof(long) == 0 &&
+		(uintptr_t)vdata % sizeof(long) == 0;
+
+	/* Allow twice the depth a perfectly balanced sort would take */
+	depth = 0;
+	for (n = num; n > 1; n >>= 1) {
+		depth += 2;
+	}
+
+	qsort_intro(&qs, vdata, num, depth);
 }
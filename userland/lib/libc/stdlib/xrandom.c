@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+/*
+ * Fast pseudo-random numbers: xoshiro128** (Blackman and Vigna).
+ *
+ * This is for generating bulk test data, where random() is too slow
+ * and its exact sequence doesn't matter. Unlike random() the state is
+ * the caller's, so there's no global state and nothing to lock, and
+ * everything is 32-bit arithmetic, which suits the MIPS. Not for
+ * anything that needs to be unpredictable.
+ */
+
+static
+__u32
+xrandom_rotl(__u32 x, unsigned k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+/*
+ * Seed the generator. The seed is spread out with splitmix32 so that
+ * nearby seeds (and 0) still give unrelated, nonzero states.
+ */
+void
+xrandom_seed(struct xrandom *xr, unsigned long seed)
+{
+	__u32 z, x;
+	unsigned i;
+
+	z = seed;
+	for (i = 0; i < 4; i++) {
+		z += 0x9e3779b9;
+		x = z;
+		x = (x ^ (x >> 16)) * 0x85ebca6b;
+		x = (x ^ (x >> 13)) * 0xc2b2ae35;
+		xr->xr_s[i] = x ^ (x >> 16);
+	}
+}
+
+/*
+ * Return the next random word.
+ */
+__u32
+xrandom(struct xrandom *xr)
+{
+	__u32 *s = xr->xr_s;
+	__u32 result, t;
+
+	result = xrandom_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = xrandom_rotl(s[3], 11);
+	return result;
+}
+
+/*
+ * Fill BUF with NWORDS random words. Gives the same sequence as
+ * calling xrandom() NWORDS times, but keeps the state in registers.
+ */
+void
+xrandom_fill(struct xrandom *xr, __u32 *buf, size_t nwords)
+{
+	__u32 s0, s1, s2, s3, t;
+	size_t i;
+
+	s0 = xr->xr_s[0];
+	s1 = xr->xr_s[1];
+	s2 = xr->xr_s[2];
+	s3 = xr->xr_s[3];
+	for (i = 0; i < nwords; i++) {
+		buf[i] = xrandom_rotl(s1 * 5, 7) * 9;
+		t = s1 << 9;
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = xrandom_rotl(s3, 11);
+	}
+	xr->xr_s[0] = s0;
+	xr->xr_s[1] = s1;
+	xr->xr_s[2] = s2;
+	xr->xr_s[3] = s3;
+}
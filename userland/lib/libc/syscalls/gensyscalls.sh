@@ -21,5 +21,12 @@ awk '
     }
 ' | awk '{
 	# output something simple that will work in syscalls.S.
-	printf "SYSCALL(%s, %s)\n", $1, $2;
+	# fork and execv have C wrappers in unix/ that flush stdio
+	# first; their stubs become __fork and __execv.
+	if ($1 == "fork" || $1 == "execv") {
+		printf "SYSCALL_AS(__%s, %s)\n", $1, $1;
+	}
+	else {
+		printf "SYSCALL(%s, %s)\n", $1, $2;
+	}
 }'
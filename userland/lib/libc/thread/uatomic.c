@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * uatomic.c
+ *
+ *	Atomic operations for umutex and libthread, using MIPS32
+ *	load-linked and store-conditional. The sync on each side keeps
+ *	ordinary loads and stores from moving across the operation.
+ */
+
+#include "uatomic.h"
+
+/*
+ * If *P is OLD, set it to NEW. Either way, return what *P was.
+ */
+int
+uatomic_cas(volatile int *p, int old, int new)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill the delay slots */
+		".set volatile;"	/* avoid unwanted optimization */
+		"sync;"
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   give up if x != old */
+		" move %1, %4;"		/*   (delay slot) y = new */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		" nop;"
+		"2: sync;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return x;
+}
+
+/*
+ * Set *P to NEW; return what it was.
+ */
+int
+uatomic_swap(volatile int *p, int new)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		".set noreorder;"
+		".set volatile;"
+		"sync;"
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"move %1, %3;"		/*   y = new */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		" nop;"
+		"sync;"
+		".set pop"
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (new)
+		: "memory");
+	return x;
+}
+
+/*
+ * Add N to *P; return what it was.
+ */
+int
+uatomic_add(volatile int *p, int n)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		".set noreorder;"
+		".set volatile;"
+		"sync;"
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addu %1, %0, %3;"	/*   y = x + n */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		" nop;"
+		"sync;"
+		".set pop"
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (n)
+		: "memory");
+	return x;
+}
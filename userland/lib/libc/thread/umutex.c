@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * umutex.c
+ *
+ *	Futex-based mutex. The state word is 0 when the mutex is free,
+ *	1 when it's held and nobody is waiting, and 2 when it's held
+ *	and somebody may be asleep in the kernel. Locking a free mutex
+ *	and unlocking one with no waiters are each a single atomic
+ *	operation; only the 2 state costs a system call.
+ *
+ *	This is the three-state mutex from Drepper's "Futexes Are
+ *	Tricky". It lives in libc rather than libthread because
+ *	malloc uses it.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <uthread.h>
+#include "uatomic.h"
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	c = uatomic_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		/* fast path */
+		return;
+	}
+
+	/*
+	 * Contended. Mark the mutex as having waiters and sleep until
+	 * we're the one who moved it out of the free state. Since we
+	 * can't tell whether anyone else is still asleep, we always
+	 * take it in state 2; the worst that does is one unneeded wake
+	 * at unlock time.
+	 */
+	if (c != 2) {
+		c = uatomic_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		futex_wait(&m->um_state, 2, NULL);
+		c = uatomic_swap(&m->um_state, 2);
+	}
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	if (uatomic_cas(&m->um_state, 0, 1) != 0) {
+		return EBUSY;
+	}
+	return 0;
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	if (uatomic_add(&m->um_state, -1) != 1) {
+		/* there may be waiters */
+		m->um_state = 0;
+		futex_wake(&m->um_state, 1);
+	}
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ucond.c
+ *
+ *	Futex-based condition variable. Waiters sleep on a sequence
+ *	number that every signal bumps, so a signal that lands between
+ *	a waiter releasing the mutex and going to sleep makes the
+ *	futex_wait fail with EAGAIN instead of being lost. There's no
+ *	requeueing; everyone woken goes back to contend for the mutex
+ *	in the ordinary way.
+ *
+ *	uc_waiters lets signal and broadcast skip the system call when
+ *	nobody is waiting. A waiter counts itself before reading the
+ *	sequence number, so a signaller that sees no waiters bumped the
+ *	sequence before the waiter read it, and the signal happened
+ *	before the wait began.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <uthread.h>
+#include "uatomic.h"
+
+/* wake count for broadcast: everyone */
+#define UCOND_ALL	0x7fffffff
+
+void
+ucond_init(struct ucond *c)
+{
+	c->uc_seq = 0;
+	c->uc_waiters = 0;
+}
+
+int
+ucond_timedwait(struct ucond *c, struct umutex *m,
+		const struct timespec *timeout)
+{
+	int seq, result;
+
+	uatomic_add(&c->uc_waiters, 1);
+	seq = c->uc_seq;
+	umutex_unlock(m);
+
+	result = futex_wait(&c->uc_seq, seq, timeout);
+	if (result < 0 && errno == ETIMEDOUT) {
+		result = ETIMEDOUT;
+	}
+	else {
+		/* woken, or EAGAIN because a signal got in first */
+		result = 0;
+	}
+
+	umutex_lock(m);
+	uatomic_add(&c->uc_waiters, -1);
+	return result;
+}
+
+void
+ucond_wait(struct ucond *c, struct umutex *m)
+{
+	ucond_timedwait(c, m, NULL);
+}
+
+void
+ucond_signal(struct ucond *c)
+{
+	uatomic_add(&c->uc_seq, 1);
+	if (c->uc_waiters > 0) {
+		futex_wake(&c->uc_seq, 1);
+	}
+}
+
+void
+ucond_broadcast(struct ucond *c)
+{
+	uatomic_add(&c->uc_seq, 1);
+	if (c->uc_waiters > 0) {
+		futex_wake(&c->uc_seq, UCOND_ALL);
+	}
+}
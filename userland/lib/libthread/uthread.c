@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * uthread.c
+ *
+ *	Threads over lwp_create. Each thread gets a stack from malloc,
+ *	aligned so malloc can find the thread's cache at its bottom,
+ *	and a done word the kernel zeroes (and wakes with futex_wake)
+ *	once the thread is off that stack for good, which is when
+ *	uthread_join can free it.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <uthread.h>
+
+/*
+ * The new thread starts here, on its own stack.
+ */
+static
+void
+uthread_start(void *data)
+{
+	struct uthread *t = data;
+
+	t->ut_func(t->ut_arg);
+	uthread_exit();
+}
+
+int
+uthread_create(struct uthread **ret, void (*func)(void *), void *arg)
+{
+	struct uthread *t;
+	char *top;
+	int result;
+
+	t = malloc(sizeof(*t));
+	if (t == NULL) {
+		return ENOMEM;
+	}
+	t->ut_stack = __malloc_stackalloc();
+	if (t->ut_stack == NULL) {
+		free(t);
+		return ENOMEM;
+	}
+
+	t->ut_func = func;
+	t->ut_arg = arg;
+	t->ut_done = 1;
+
+	/* leave the 16 bytes of argument slots the MIPS ABI reserves */
+	top = (char *)t->ut_stack + UTHREAD_STACKSIZE - 16;
+
+	if (lwp_create(uthread_start, t, top, &t->ut_done) < 0) {
+		/* freeing can sleep on the heap lock, which sets errno */
+		result = errno;
+		__malloc_stackfree(t->ut_stack);
+		free(t);
+		return result;
+	}
+	*ret = t;
+	return 0;
+}
+
+void
+uthread_join(struct uthread *t)
+{
+	int done;
+
+	while ((done = t->ut_done) != 0) {
+		futex_wait(&t->ut_done, done, NULL);
+	}
+
+	__malloc_stackfree(t->ut_stack);
+	free(t);
+}
+
+void
+uthread_exit(void)
+{
+	__malloc_threadexit();
+	lwp_exit();
+}
@@ -73,6 +73,11 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* block range for the summary (-S), half-open */
+static uint32_t rangestart, rangeend;
+/* what the summary covers (-c) */
+static bool sumfree = true, sumfiles = true, sumdirs = true;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -222,9 +227,14 @@ dumpsb(void)
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+	dumpvalf("Block size", "%u bytes%s",
+		 sb.sb_blocksize == 0 ? 512 : SWAP32(sb.sb_blocksize),
+		 sb.sb_blocksize == 0 ? " (not recorded)" : "");
 	dumpvalf("Journal start", "%u", SWAP32(sb.sb_journalstart));
 	dumpvalf("Journal size", "%u blocks", SWAP32(sb.sb_journalblocks));
+	dumpvalf("Flags", "0x%x%s", SWAP32(sb.sb_flags),
+		 (SWAP32(sb.sb_flags) & SFS_SBFLAG_EXTENTS) ?
+		 " (extents)" : "");
 	dumplval("Volume name", sb.sb_volname);
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
@@ -799,6 +809,117 @@ dumpindirect(uint32_t block, unsigned indirection)
 	}
 }
 
+static
+void
+dumpextents(const struct sfs_extent_header *eh, const struct sfs_extent *ext)
+{
+	unsigned i, count;
+
+	count = SWAP16(eh->eh_count);
+	printf("    Extent header: magic 0x%x, %u/%u entries, depth %u\n",
+	       SWAP16(eh->eh_magic), count, SWAP16(eh->eh_max),
+	       SWAP16(eh->eh_depth));
+	if (count > SWAP16(eh->eh_max)) {
+		warnx("Warning: extent node is overfull");
+		return;
+	}
+	for (i=0; i<count; i++) {
+		if (SWAP16(eh->eh_depth) > 0) {
+			printf("@%-3u     block %u -> node %u\n", i,
+			       SWAP32(ext[i].ex_fileblock),
+			       SWAP32(ext[i].ex_diskblock));
+		}
+		else {
+			printf("@%-3u     blocks %u-%u -> %u-%u\n", i,
+			       SWAP32(ext[i].ex_fileblock),
+			       SWAP32(ext[i].ex_fileblock) +
+			       SWAP32(ext[i].ex_len) - 1,
+			       SWAP32(ext[i].ex_diskblock),
+			       SWAP32(ext[i].ex_diskblock) +
+			       SWAP32(ext[i].ex_len) - 1);
+		}
+	}
+}
+
+/*
+ * Read extent tree block BLOCK, returning 0 if it isn't one.
+ */
+static
+int
+readextblock(uint32_t block, struct sfs_extent_block *eb)
+{
+	diskread(eb, block);
+	if (SWAP16(eb->eb_hdr.eh_magic) != SFS_EXTENT_MAGIC ||
+	    SWAP16(eb->eb_hdr.eh_count) > SFS_EXTENTS_BLOCK) {
+		warnx("Warning: block %u is not a valid extent block", block);
+		return 0;
+	}
+	return 1;
+}
+
+static
+void
+dumpextblocks(const struct sfs_extent_header *eh,
+	      const struct sfs_extent *ext)
+{
+	struct sfs_extent_block eb;
+	unsigned i;
+
+	if (SWAP16(eh->eh_depth) == 0 ||
+	    SWAP16(eh->eh_count) > SWAP16(eh->eh_max)) {
+		return;
+	}
+	for (i=0; i<SWAP16(eh->eh_count); i++) {
+		printf("Extent tree block %u\n", SWAP32(ext[i].ex_diskblock));
+		if (!readextblock(SWAP32(ext[i].ex_diskblock), &eb)) {
+			continue;
+		}
+		dumpextents(&eb.eb_hdr, eb.eb_ext);
+		dumpextblocks(&eb.eb_hdr, eb.eb_ext);
+	}
+}
+
+static
+uint32_t
+traverse_ext(uint32_t fileblock, uint32_t numblocks,
+	     const struct sfs_extent_header *eh, const struct sfs_extent *ext,
+	     void (*doblock)(uint32_t, uint32_t))
+{
+	struct sfs_extent_block eb;
+	uint32_t start, disk, len, j;
+	unsigned i, count;
+
+	count = SWAP16(eh->eh_count);
+	if (count > SWAP16(eh->eh_max)) {
+		return fileblock;
+	}
+	for (i=0; i<count && fileblock < numblocks; i++) {
+		if (SWAP16(eh->eh_depth) > 0) {
+			if (readextblock(SWAP32(ext[i].ex_diskblock), &eb)) {
+				fileblock = traverse_ext(fileblock, numblocks,
+							 &eb.eb_hdr, eb.eb_ext,
+							 doblock);
+			}
+			continue;
+		}
+
+		start = SWAP32(ext[i].ex_fileblock);
+		disk = SWAP32(ext[i].ex_diskblock);
+		len = SWAP32(ext[i].ex_len);
+
+		/* holes before the extent */
+		while (fileblock < start && fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		for (j=0; j<len && fileblock < numblocks; j++) {
+			if (start + j == fileblock) {
+				doblock(fileblock++, disk + j);
+			}
+		}
+	}
+	return fileblock;
+}
+
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
@@ -837,6 +958,16 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
 	fileblock = 0;
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_EXTENTS) {
+		fileblock = traverse_ext(fileblock, numblocks,
+					 &sfi->sfi_extents.er_hdr,
+					 sfi->sfi_extents.er_ext, doblock);
+		/* holes at the end */
+		while (fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		return;
+	}
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
@@ -1014,6 +1145,11 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
 	printf("\n");
 
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) {
+		dumpextents(&sfi.sfi_extents.er_hdr, sfi.sfi_extents.er_ext);
+		goto flags;
+	}
+
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -1043,14 +1179,33 @@ dumpinode(uint32_t ino, const char *name)
 	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
 	printf("    Triple indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+ flags:
+	printf("    Flags: 0x%x%s%s%s%s\n", SWAP32(sfi.sfi_flags),
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ? " (inline)" : "",
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) ?
+	       " (extents)" : "",
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_PREALLOC) ?
+	       " (prealloc)" : "",
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_COMPRESSED) ?
+	       " (compressed)" : "");
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_PREALLOC) {
+		printf("    Unwritten from block: %u\n",
+		       SWAP32(sfi.sfi_unwritten));
+	}
+	else if (!(SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE)) {
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_inline); i++) {
+			if (sfi.sfi_inline[i] != 0) {
+				printf("    Byte %u in inline area: 0x%x\n",
+				       i, (unsigned char)sfi.sfi_inline[i]);
+			}
 		}
 	}
 
-	if (doindirect) {
+	if (doindirect && (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS)) {
+		dumpextblocks(&sfi.sfi_extents.er_hdr,
+			      sfi.sfi_extents.er_ext);
+	}
+	else if (doindirect) {
 		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
 		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
 		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
@@ -1067,6 +1222,358 @@ dumpinode(uint32_t ino, const char *name)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// summary (-S)
+
+/*
+ * The summary reads only metadata: the freemap, in order, then the
+ * directories to find the inodes, then the inodes (and their
+ * indirect or extent blocks) in ascending block order so the reads
+ * go through the disk window instead of seeking. File data is never
+ * read. Without the b class (-c) the freemap is skipped, and the
+ * indirect and extent blocks of inodes left out by -c aren't read.
+ *
+ * Output is one "key value..." item per line: the totals first, then
+ * one "file" line per inode. The file lines are kept in memory until
+ * the totals are known.
+ */
+
+#define NFREEBUCKETS 32
+
+/* inodes found so far, as a bitmap over disk blocks */
+static uint8_t *inodemap;
+/* directories still to read */
+static uint32_t *dirqueue;
+static uint32_t dirqhead, dirqtail;
+
+/* statistics */
+static uint32_t sum_free, sum_freeruns;
+static uint32_t sum_freebuckets[NFREEBUCKETS];
+static uint32_t sum_files, sum_fileblocks, sum_fileextents;
+static uint32_t sum_fragfiles;
+
+/* the extent being accumulated for the current file */
+static uint32_t run_start, run_len, run_count;
+
+/* the file lines, and the run lengths they refer to */
+struct sumfile {
+	uint32_t sf_ino;
+	bool sf_isdir;
+	uint32_t sf_firstrun;
+	uint32_t sf_numruns;
+};
+static struct sumfile *sumfilelist;
+static uint32_t numsumfiles;
+static uint32_t *sumruns;
+static uint32_t numsumruns;
+
+static
+bool
+inrange(uint32_t block)
+{
+	return block >= rangestart && block < rangeend;
+}
+
+static
+void
+addfreerun(uint32_t len)
+{
+	unsigned b;
+
+	if (len == 0) {
+		return;
+	}
+	b = 0;
+	while (b < NFREEBUCKETS-1 && (len >> (b+1)) != 0) {
+		b++;
+	}
+	sum_freebuckets[b]++;
+	sum_freeruns++;
+	sum_free += len;
+}
+
+static
+void
+summarize_freemap(void)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+	uint32_t i, bn, run;
+
+	run = 0;
+	for (bn = rangestart; bn < rangeend; bn++) {
+		i = bn / SFS_BITSPERBLOCK;
+		if (bn == rangestart || bn % SFS_BITSPERBLOCK == 0) {
+			diskread(data, SFS_FREEMAP_START + i);
+		}
+		i = bn % SFS_BITSPERBLOCK;
+		if ((data[i/8] & (1U << (i%8))) == 0) {
+			run++;
+		}
+		else {
+			addfreerun(run);
+			run = 0;
+		}
+	}
+	addfreerun(run);
+}
+
+static
+void
+markinode(uint32_t ino)
+{
+	if (ino >= diskblocks()) {
+		warnx("Warning: inode %u is past the end of the volume", ino);
+		return;
+	}
+	inodemap[ino/8] |= 1U << (ino%8);
+}
+
+static
+bool
+inodemarked(uint32_t ino)
+{
+	return (inodemap[ino/8] & (1U << (ino%8))) != 0;
+}
+
+static
+void
+finddirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
+	struct sfs_dinode sfi;
+	unsigned i;
+	uint32_t ino;
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(&sds, diskblock);
+	for (i=0; i<ARRAYCOUNT(sds); i++) {
+		ino = SWAP32(sds[i].sfd_ino);
+		if (ino == SFS_NOINO || ino >= diskblocks() ||
+		    inodemarked(ino)) {
+			continue;
+		}
+		markinode(ino);
+		diskread(&sfi, ino);
+		if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+			dirqueue[dirqtail++] = ino;
+		}
+	}
+}
+
+static
+void
+findinodes(void)
+{
+	struct sfs_dinode sfi;
+
+	markinode(SFS_ROOTDIR_INO);
+	dirqueue[dirqtail++] = SFS_ROOTDIR_INO;
+	while (dirqhead < dirqtail) {
+		diskread(&sfi, dirqueue[dirqhead++]);
+		traverse(&sfi, finddirblock);
+	}
+}
+
+static
+void
+endrun(void)
+{
+	if (run_len > 0) {
+		if (numsumruns == diskblocks()) {
+			/* only possible if files share blocks */
+			errx(1, "More extents than blocks; run sfsck");
+		}
+		sumruns[numsumruns++] = run_len;
+		run_count++;
+		sum_fileblocks += run_len;
+	}
+	run_len = 0;
+}
+
+static
+void
+extentblock(uint32_t fileblock, uint32_t diskblock)
+{
+	(void)fileblock;
+	if (diskblock == 0) {
+		/* a hole doesn't split the run; the disk blocks are still in order */
+		return;
+	}
+	if (!inrange(diskblock)) {
+		endrun();
+		return;
+	}
+	if (run_len > 0 && diskblock == run_start + run_len) {
+		run_len++;
+		return;
+	}
+	endrun();
+	run_start = diskblock;
+	run_len = 1;
+}
+
+static
+void
+summarize_inode(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+	struct sumfile *sf;
+	bool isdir;
+
+	diskread(&sfi, ino);
+	isdir = SWAP16(sfi.sfi_type) == SFS_TYPE_DIR;
+	if (isdir ? !sumdirs : !sumfiles) {
+		return;
+	}
+	sf = &sumfilelist[numsumfiles++];
+	sf->sf_ino = ino;
+	sf->sf_isdir = isdir;
+	sf->sf_firstrun = numsumruns;
+	run_len = run_count = 0;
+	if (!(SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE)) {
+		traverse(&sfi, extentblock);
+		endrun();
+	}
+	sf->sf_numruns = run_count;
+
+	if (run_count > 0) {
+		sum_files++;
+		sum_fileextents += run_count;
+		if (run_count > 1) {
+			sum_fragfiles++;
+		}
+	}
+}
+
+static
+void
+dumpsummary(uint32_t fsblocks)
+{
+	uint32_t ino, frag, n, i;
+	unsigned b;
+
+	if (sumfree) {
+		summarize_freemap();
+	}
+
+	if (sumfiles || sumdirs) {
+		inodemap = malloc(DIVROUNDUP(diskblocks(), 8));
+		dirqueue = malloc(diskblocks() * sizeof(dirqueue[0]));
+		if (inodemap == NULL || dirqueue == NULL) {
+			errx(1, "Out of memory");
+		}
+		memset(inodemap, 0, DIVROUNDUP(diskblocks(), 8));
+		findinodes();
+		free(dirqueue);
+
+		n = 0;
+		for (ino = 0; ino < diskblocks(); ino++) {
+			if (inodemarked(ino)) {
+				n++;
+			}
+		}
+		sumfilelist = malloc((n + 1) * sizeof(sumfilelist[0]));
+		/* each run has at least one block of its own */
+		sumruns = malloc(diskblocks() * sizeof(sumruns[0]));
+		if (sumfilelist == NULL || sumruns == NULL) {
+			errx(1, "Out of memory");
+		}
+		for (ino = 0; ino < diskblocks(); ino++) {
+			if (inodemarked(ino)) {
+				summarize_inode(ino);
+			}
+		}
+		free(inodemap);
+	}
+
+	/*
+	 * Fragmentation, in thousandths: the fraction of places a
+	 * file's next block could have followed its previous one and
+	 * didn't. 0 means every file is one extent.
+	 */
+	if (sum_fileblocks > sum_files) {
+		frag = (uint64_t)(sum_fileextents - sum_files) * 1000 /
+			(sum_fileblocks - sum_files);
+	}
+	else {
+		frag = 0;
+	}
+
+	printf("blocks %u\n", fsblocks);
+	printf("range %u %u\n", rangestart, rangeend);
+	if (sumfree) {
+		printf("free %u\n", sum_free);
+		printf("freeruns %u\n", sum_freeruns);
+		for (b = 0; b < NFREEBUCKETS; b++) {
+			if (sum_freebuckets[b] != 0) {
+				printf("freerun %u-%u %u\n", 1U << b,
+				       (1U << b) + ((1U << b) - 1),
+				       sum_freebuckets[b]);
+			}
+		}
+	}
+	if (!sumfiles && !sumdirs) {
+		return;
+	}
+	printf("files %u\n", sum_files);
+	printf("fragmentedfiles %u\n", sum_fragfiles);
+	printf("fileblocks %u\n", sum_fileblocks);
+	printf("fileextents %u\n", sum_fileextents);
+	printf("fragmentation %u\n", frag);
+
+	for (n = 0; n < numsumfiles; n++) {
+		printf("file %u %c", sumfilelist[n].sf_ino,
+		       sumfilelist[n].sf_isdir ? 'd' : 'f');
+		for (i = 0; i < sumfilelist[n].sf_numruns; i++) {
+			printf(" %u", sumruns[sumfilelist[n].sf_firstrun + i]);
+		}
+		printf("\n");
+	}
+
+	free(sumruns);
+	free(sumfilelist);
+}
+
+/*
+ * Parse the classes for -c: any of b (free blocks), f (files), and
+ * d (directories).
+ */
+static
+void
+parseclasses(const char *s)
+{
+	sumfree = sumfiles = sumdirs = false;
+	for (; *s; s++) {
+		switch (*s) {
+		    case 'b': sumfree = true; break;
+		    case 'f': sumfiles = true; break;
+		    case 'd': sumdirs = true; break;
+		    default:
+			errx(1, "Invalid summary class %c", *s);
+		}
+	}
+}
+
+/*
+ * Parse a block range "start-end" (inclusive) or a single block.
+ */
+static
+void
+parserange(const char *s)
+{
+	const char *t;
+
+	rangestart = atoi(s);
+	t = strchr(s, '-');
+	rangeend = (t != NULL ? (uint32_t)atoi(t+1) : rangestart) + 1;
+	if (rangeend <= rangestart) {
+		errx(1, "Invalid block range %s", s);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -1085,6 +1592,9 @@ usage(void)
 	warnx("   -d: dump directory contents");
 	warnx("   -r: recurse into directory contents");
 	warnx("   -a: equivalent to -sbdfr -i 1");
+	warnx("   -S: print a summary of layout and fragmentation");
+	warnx("   -R start-end: limit the summary to those blocks");
+	warnx("   -c bfd: limit the summary to free blocks, files, dirs");
 	errx(1, "   Default is -i 1");
 }
 
@@ -1095,6 +1605,7 @@ main(int argc, char **argv)
 	bool dofreemap = false;
 	bool dojournal = false;
 	bool dophysjournal = false;
+	bool dosummary = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
 
@@ -1129,6 +1640,29 @@ main(int argc, char **argv)
 				    case 'f': dofiles = true; break;
 				    case 'd': dodirs = true; break;
 				    case 'r': recurse = true; break;
+				    case 'S': dosummary = true; break;
+				    case 'R':
+					if (argv[i][j+1] == 0) {
+						if (argv[++i] == NULL) {
+							usage();
+						}
+						parserange(argv[i]);
+					}
+					else {
+						parserange(argv[i]+j+1);
+					}
+					goto nextarg;
+				    case 'c':
+					if (argv[i][j+1] == 0) {
+						if (argv[++i] == NULL) {
+							usage();
+						}
+						parseclasses(argv[i]);
+					}
+					else {
+						parseclasses(argv[i]+j+1);
+					}
+					goto nextarg;
 				    case 'a':
 					dosb = true;
 					dofreemap = true;
@@ -1160,12 +1694,15 @@ main(int argc, char **argv)
 	}
 
 	if (!dosb && !dofreemap && !dojournal && !dophysjournal &&
-	    dumpino == 0) {
+	    !dosummary && dumpino == 0) {
 		dumpino = SFS_ROOTDIR_INO;
 	}
 
 	opendisk(dumpdisk);
 	nblocks = readsb();
+	if (rangeend == 0 || rangeend > nblocks) {
+		rangeend = nblocks;
+	}
 
 	if (dosb) {
 		dumpsb();
@@ -1182,6 +1719,9 @@ main(int argc, char **argv)
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
 	}
+	if (dosummary) {
+		dumpsummary(nblocks);
+	}
 
 	closedisk();
 
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include <kern/kevent.h>
+
+/*
+ * kevdump - decode a kernel event trace.
+ * Usage: kevdump [-s subsystem]... tracefile
+ *
+ * Reads a trace written by the kernel's "kevent file" command, merges
+ * the CPUs' records by time, and prints them as a timeline. Times are
+ * relative to the first record. The subsystems are "sched" (thread
+ * creation, switches and sleeps), "buf", "vm" and "syscall"; with no
+ * -s option, all are shown. Lost-record notices are always shown.
+ */
+
+#define MAXTHREADS	512
+#define NAMELEN		12
+
+static const char *const subsystems[KEV_NTYPES] = {
+	[KEV_THREAD] = "sched",
+	[KEV_SWITCH] = "sched",
+	[KEV_SLEEP] = "sched",
+	[KEV_BUFREAD] = "buf",
+	[KEV_FAULT] = "vm",
+	[KEV_SYSCALL] = "syscall",
+};
+
+static bool show[KEV_NTYPES];
+
+/* Thread names, from KEV_THREAD records. */
+static struct {
+	uint32_t t_addr;
+	char t_name[NAMELEN + 1];
+} threads[MAXTHREADS];
+static unsigned nthreads;
+
+////////////////////////////////////////////////////////////
+// threads
+
+static
+void
+unpackname(const struct kevent_rec *ke, char *buf)
+{
+	memcpy(buf, &ke->ke_args[1], NAMELEN);
+	buf[NAMELEN] = 0;
+}
+
+static
+void
+addthread(uint32_t addr, const char *name)
+{
+	unsigned i;
+
+	/* thread structures are reused; the latest name wins */
+	for (i=0; i<nthreads; i++) {
+		if (threads[i].t_addr == addr) {
+			break;
+		}
+	}
+	if (i == nthreads) {
+		if (nthreads == MAXTHREADS) {
+			return;
+		}
+		nthreads++;
+	}
+	threads[i].t_addr = addr;
+	strcpy(threads[i].t_name, name);
+}
+
+static
+const char *
+threadname(uint32_t addr)
+{
+	static char buf[2][16];
+	static unsigned which;
+	unsigned i;
+
+	for (i=0; i<nthreads; i++) {
+		if (threads[i].t_addr == addr) {
+			return threads[i].t_name;
+		}
+	}
+	which = !which;
+	snprintf(buf[which], sizeof(buf[which]), "0x%lx",
+		 (unsigned long)addr);
+	return buf[which];
+}
+
+////////////////////////////////////////////////////////////
+// printing
+
+static
+const char *
+statename(uint32_t state)
+{
+	/* the kernel's threadstate_t */
+	switch (state) {
+	    case 0: return "run";
+	    case 1: return "ready";
+	    case 2: return "sleep";
+	    case 3: return "zombie";
+	}
+	return "?";
+}
+
+static
+const char *
+faultname(uint32_t type)
+{
+	/* VM_FAULT_* from the kernel's vm.h */
+	switch (type) {
+	    case 0: return "read";
+	    case 1: return "write";
+	    case 2: return "readonly";
+	}
+	return "?";
+}
+
+static
+void
+printrec(const struct kevent_rec *ke, const struct kevent_rec *first)
+{
+	char name[NAMELEN + 1];
+	uint32_t sec, nsec;
+
+	if (ke->ke_type >= KEV_NTYPES ||
+	    (ke->ke_type != KEV_LOST && !show[ke->ke_type])) {
+		return;
+	}
+
+	sec = ke->ke_sec - first->ke_sec;
+	if (ke->ke_nsec >= first->ke_nsec) {
+		nsec = ke->ke_nsec - first->ke_nsec;
+	}
+	else {
+		sec--;
+		nsec = ke->ke_nsec + 1000000000 - first->ke_nsec;
+	}
+
+	if (ke->ke_type == KEV_LOST) {
+		printf("%4lu.%06lu cpu%u *** %lu records lost\n",
+		       (unsigned long)sec, (unsigned long)(nsec / 1000),
+		       ke->ke_cpu, (unsigned long)ke->ke_args[0]);
+		return;
+	}
+
+	printf("%4lu.%06lu cpu%u %-12s ",
+	       (unsigned long)sec, (unsigned long)(nsec / 1000),
+	       ke->ke_cpu, threadname(ke->ke_thread));
+
+	switch (ke->ke_type) {
+	    case KEV_THREAD:
+		unpackname(ke, name);
+		printf("create %s\n", name);
+		break;
+	    case KEV_SWITCH:
+		printf("switch -> %s (%s)\n", threadname(ke->ke_args[0]),
+		       statename(ke->ke_args[1]));
+		break;
+	    case KEV_SLEEP:
+		unpackname(ke, name);
+		printf("sleep on %s (0x%lx)\n", name,
+		       (unsigned long)ke->ke_args[0]);
+		break;
+	    case KEV_BUFREAD:
+		printf("bufread block %lu size %lu%s\n",
+		       (unsigned long)ke->ke_args[0],
+		       (unsigned long)ke->ke_args[1],
+		       ke->ke_args[2] ? " (hit)" : "");
+		break;
+	    case KEV_FAULT:
+		printf("fault %s 0x%lx\n", faultname(ke->ke_args[0]),
+		       (unsigned long)ke->ke_args[1]);
+		break;
+	    case KEV_SYSCALL:
+		printf("syscall %lu (0x%lx)\n",
+		       (unsigned long)ke->ke_args[0],
+		       (unsigned long)ke->ke_args[1]);
+		break;
+	    default:
+		printf("type %u\n", ke->ke_type);
+		break;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// main
+
+static
+int
+reccmp(const void *av, const void *bv)
+{
+	const struct kevent_rec *a = av, *b = bv;
+
+	if (a->ke_sec != b->ke_sec) {
+		return a->ke_sec < b->ke_sec ? -1 : 1;
+	}
+	if (a->ke_nsec != b->ke_nsec) {
+		return a->ke_nsec < b->ke_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: kevdump [-s sched|buf|vm|syscall]... tracefile");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct kevent_header kh;
+	struct kevent_rec *recs;
+	off_t size;
+	char name[NAMELEN + 1];
+	const char *path = NULL;
+	bool any = false, found;
+	unsigned i, j, n;
+	ssize_t len;
+	int fd;
+
+	for (i=1; i<(unsigned)argc; i++) {
+		if (!strcmp(argv[i], "-s") && i+1 < (unsigned)argc) {
+			i++;
+			found = false;
+			for (j=0; j<KEV_NTYPES; j++) {
+				if (subsystems[j] != NULL &&
+				    !strcmp(subsystems[j], argv[i])) {
+					show[j] = found = any = true;
+				}
+			}
+			if (!found) {
+				usage();
+			}
+		}
+		else if (path == NULL && argv[i][0] != '-') {
+			path = argv[i];
+		}
+		else {
+			usage();
+		}
+	}
+	if (path == NULL) {
+		usage();
+	}
+	if (!any) {
+		for (j=0; j<KEV_NTYPES; j++) {
+			show[j] = true;
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+	/* Size it by seeking to the end */
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", path);
+	}
+
+	len = read(fd, &kh, sizeof(kh));
+	if (len < 0) {
+		err(1, "%s: read", path);
+	}
+	if ((size_t)len < sizeof(kh) || kh.kh_magic != KEVENT_MAGIC) {
+		errx(1, "%s: Not a kernel event trace", path);
+	}
+	if (kh.kh_recsize != sizeof(struct kevent_rec)) {
+		errx(1, "%s: Record size %u, expected %u", path,
+		     (unsigned)kh.kh_recsize,
+		     (unsigned)sizeof(struct kevent_rec));
+	}
+
+	n = (size - sizeof(kh)) / sizeof(struct kevent_rec);
+	if (n == 0) {
+		close(fd);
+		return 0;
+	}
+	recs = malloc(n * sizeof(struct kevent_rec));
+	if (recs == NULL) {
+		errx(1, "Out of memory");
+	}
+	len = read(fd, recs, n * sizeof(struct kevent_rec));
+	if (len < 0) {
+		err(1, "%s: read", path);
+	}
+	n = len / sizeof(struct kevent_rec);
+	close(fd);
+
+	qsort(recs, n, sizeof(struct kevent_rec), reccmp);
+
+	/* learn all the names first so early records can use them */
+	for (i=0; i<n; i++) {
+		if (recs[i].ke_type == KEV_THREAD) {
+			unpackname(&recs[i], name);
+			addthread(recs[i].ke_args[0], name);
+		}
+	}
+	for (i=0; i<n; i++) {
+		printrec(&recs[i], &recs[0]);
+	}
+
+	free(recs);
+	return 0;
+}
@@ -27,6 +27,10 @@
  * SUCH DAMAGE.
  */
 
+#ifdef HOST
+#define _GNU_SOURCE	/* for SEEK_DATA on Linux */
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -38,10 +42,21 @@
 #include <err.h>
 
 #include "support.h"
+#include "kern/sfs.h"
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define BLOCKSIZE  SFS_BLOCKSIZE
+
+/*
+ * A System/161 disk image starts with a header sector, which is 512
+ * bytes whatever our block size is.
+ */
+#ifdef HOST
+#define HEADERSIZE 512
+#else
+#define HEADERSIZE 0
+#endif
 
 #ifndef EINTR
 #define EINTR 0
@@ -50,6 +65,19 @@
 static int fd=-1;
 static uint32_t nblocks;
 
+/*
+ * Reads go through a window of DISK_WINDOW consecutive blocks, which
+ * is refilled with one big read from the requested block onwards
+ * whenever a block outside it is asked for. So a scan that moves
+ * mostly forward costs one read call per window rather than one per
+ * block. Writes go straight to the disk and update the window's copy
+ * on the way.
+ */
+#define DISK_WINDOW 64
+
+static char window[DISK_WINDOW * BLOCKSIZE];
+static uint32_t windowstart, windowlen;	/* in blocks; 0 len is empty */
+
 /*
  * Open a disk. If we're built for the host OS, check that it's a
  * System/161 disk image, and then ignore the header block.
@@ -68,11 +96,10 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nblocks = statbuf.st_size < HEADERSIZE ? 0 :
+		(statbuf.st_size - HEADERSIZE) / BLOCKSIZE;
 
 #ifdef HOST
-	nblocks--;
-
 	{
 		char buf[64];
 		int len;
@@ -115,28 +142,44 @@ diskblocks(void)
 }
 
 /*
- * Write a block.
+ * Seek to a block.
  */
+static
 void
-diskwrite(const void *data, uint32_t block)
+diskseek(uint32_t block)
+{
+	// skip over disk file header, if any
+	if (lseek(fd, HEADERSIZE + (off_t)block*BLOCKSIZE, SEEK_SET)<0) {
+		err(1, "lseek");
+	}
+}
+
+/*
+ * Write NUM consecutive blocks starting at BLOCK, with one seek.
+ */
+void
+diskwritemany(const void *data, uint32_t block, uint32_t num)
 {
 	const char *cdata = data;
-	uint32_t tot=0;
+	uint32_t tot=0, want, i;
 	int len;
 
 	assert(fd>=0);
+	assert(num <= nblocks && block <= nblocks - num);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+	for (i=0; i<num; i++) {
+		if (block + i >= windowstart &&
+		    block + i - windowstart < windowlen) {
+			memcpy(window + (block + i - windowstart) * BLOCKSIZE,
+			       cdata + i * BLOCKSIZE, BLOCKSIZE);
+		}
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	diskseek(block);
+
+	want = num * BLOCKSIZE;
+	while (tot < want) {
+		len = write(fd, cdata + tot, want - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -151,28 +194,111 @@ diskwrite(const void *data, uint32_t block)
 }
 
 /*
- * Read a block.
+ * Write a block.
  */
 void
-diskread(void *data, uint32_t block)
+diskwrite(const void *data, uint32_t block)
 {
-	char *cdata = data;
-	uint32_t tot=0;
-	int len;
+	diskwritemany(data, block, 1);
+}
 
-	assert(fd>=0);
+/*
+ * Return how many blocks from BLOCK on (up to NUM) are all hole, in
+ * which case set *ISHOLE, or all data (or might be, if the device
+ * can't say).
+ */
+static
+uint32_t
+diskrun(uint32_t block, uint32_t num, int *ishole)
+{
+#ifdef SEEK_DATA
+	off_t start, end, pos;
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
+	// skip over disk file header, if any
+	start = HEADERSIZE + (off_t)block * BLOCKSIZE;
+	end = start + (off_t)num * BLOCKSIZE;
+
+	pos = lseek(fd, start, SEEK_DATA);
+	if (pos < 0) {
+		/* ENXIO means there's no more data in the file at all */
+		*ishole = errno == ENXIO;
+		return num;
+	}
+	if (pos > start) {
+		*ishole = 1;
+		return pos >= end ? num : (pos - start) / BLOCKSIZE;
+	}
+	pos = lseek(fd, start, SEEK_HOLE);
+	*ishole = 0;
+	if (pos <= start || pos >= end) {
+		return num;
+	}
+	/* round up; a partial block has to be written */
+	return (pos - start + BLOCKSIZE - 1) / BLOCKSIZE;
+#else
+	(void)block;
+	*ishole = 0;
+	return num;
 #endif
+}
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+/*
+ * Zero NUM blocks starting at BLOCK, in big writes, skipping any
+ * stretch the device says is already zero (such as a hole in a
+ * fresh disk image).
+ */
+void
+diskzero(uint32_t block, uint32_t num)
+{
+	static const char zeros[DISK_WINDOW * BLOCKSIZE];
+	uint32_t n;
+	int ishole;
+
+	assert(fd>=0);
+	assert(num <= nblocks && block <= nblocks - num);
+
+	while (num > 0) {
+		n = diskrun(block, num, &ishole);
+		if (n == 0) {
+			/* hole starts mid-block; write the block */
+			n = 1;
+			ishole = 0;
+		}
+		if (ishole) {
+			block += n;
+			num -= n;
+			continue;
+		}
+		if (n > DISK_WINDOW) {
+			n = DISK_WINDOW;
+		}
+		diskwritemany(zeros, block, n);
+		block += n;
+		num -= n;
 	}
+}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+/*
+ * Load the window with as many blocks as fit, starting at BLOCK.
+ */
+static
+void
+diskfill(uint32_t block)
+{
+	uint32_t tot=0, want;
+	int len;
+
+	windowlen = 0;
+	want = nblocks - block;
+	if (want > DISK_WINDOW) {
+		want = DISK_WINDOW;
+	}
+	want *= BLOCKSIZE;
+
+	diskseek(block);
+
+	while (tot < want) {
+		len = read(fd, window + tot, want - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -184,6 +310,26 @@ diskread(void *data, uint32_t block)
 		}
 		tot += len;
 	}
+	windowstart = block;
+	windowlen = want / BLOCKSIZE;
+}
+
+/*
+ * Read a block.
+ */
+void
+diskread(void *data, uint32_t block)
+{
+	assert(fd>=0);
+
+	if (block >= nblocks) {
+		errx(1, "read of block %lu past end of disk",
+		     (unsigned long)block);
+	}
+	if (block < windowstart || block - windowstart >= windowlen) {
+		diskfill(block);
+	}
+	memcpy(data, window + (block - windowstart) * BLOCKSIZE, BLOCKSIZE);
 }
 
 /*
@@ -197,4 +343,5 @@ closedisk(void)
 		err(1, "close");
 	}
 	fd = -1;
+	windowlen = 0;
 }
@@ -33,6 +33,8 @@ uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
+void diskwritemany(const void *data, uint32_t block, uint32_t num);
 void diskread(void *data, uint32_t block);
+void diskzero(uint32_t block, uint32_t num);
 
 void closedisk(void);
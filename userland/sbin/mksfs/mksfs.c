@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -63,9 +64,15 @@
 /* Block number for the initial root directory contents */
 static uint32_t rootdir_data_block;
 
-/* Journal location and size */
+/* Journal location and size; journalblocks can be set with -j */
 static uint32_t journalstart, journalblocks;
 
+/* Smallest journal allowed, whether set with -j or by default */
+#define MINJOURNALBLOCKS 16
+
+/* Whether files on the new volume map their blocks with extents (-e) */
+static int use_extents;
+
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
 
@@ -79,6 +86,7 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_extent_block)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -122,7 +130,19 @@ initfreemap(uint32_t fsblocks)
 
 	/* journal goes after the freemap */
 	journalstart = SFS_FREEMAP_START + freemapblocks;
-	journalblocks = fsblocks / 20;
+	if (journalblocks == 0) {
+		journalblocks = fsblocks / 20;
+		if (journalblocks < MINJOURNALBLOCKS) {
+			journalblocks = MINJOURNALBLOCKS;
+		}
+	}
+	/* leave room for the root directory block */
+	if (journalblocks >= fsblocks ||
+	    journalstart + journalblocks >= fsblocks) {
+		errx(1, "Volume of %lu blocks too small for a journal of "
+		     "%lu blocks", (unsigned long)fsblocks,
+		     (unsigned long)journalblocks);
+	}
 	for (i=0; i<journalblocks; i++) {
 		allocblock(journalstart + i);
 	}
@@ -159,6 +179,8 @@ writesuper(const char *volname, uint32_t nblocks)
 	strcpy(sb.sb_volname, volname);
 	sb.sb_journalstart = SWAP32(journalstart);
 	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_flags = SWAP32(use_extents ? SFS_SBFLAG_EXTENTS : 0);
+	sb.sb_blocksize = SWAP32(SFS_BLOCKSIZE);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -171,16 +193,9 @@ static
 void
 writefreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks;
-	char *ptr;
-	uint32_t i;
-
-	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
-	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
-		diskwrite(ptr, SFS_FREEMAP_START+i);
-	}
+	/* Write out the free block bitmap, all in one go. */
+	diskwritemany(freemapbuf, SFS_FREEMAP_START,
+		      SFS_FREEMAPBLOCKS(fsblocks));
 }
 
 /*
@@ -202,7 +217,21 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(sizeof(struct sfs_direntry) * 2);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(2);
-	sfi.sfi_direct[0] = SWAP32(rootdir_data_block);
+	if (use_extents) {
+		/* one extent holding the one block */
+		sfi.sfi_flags = SWAP32(SFS_IFLAG_EXTENTS);
+		sfi.sfi_extents.er_hdr.eh_magic = SWAP16(SFS_EXTENT_MAGIC);
+		sfi.sfi_extents.er_hdr.eh_count = SWAP16(1);
+		sfi.sfi_extents.er_hdr.eh_max = SWAP16(SFS_EXTENTS_INODE);
+		sfi.sfi_extents.er_hdr.eh_depth = SWAP16(0);
+		sfi.sfi_extents.er_ext[0].ex_fileblock = SWAP32(0);
+		sfi.sfi_extents.er_ext[0].ex_diskblock =
+			SWAP32(rootdir_data_block);
+		sfi.sfi_extents.er_ext[0].ex_len = SWAP32(1);
+	}
+	else {
+		sfi.sfi_direct[0] = SWAP32(rootdir_data_block);
+	}
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -228,13 +257,14 @@ writejournal(void)
 	struct sfs_jphys_header hdr;
 	struct sfs_jphys_trim rec;
 	uint64_t coninfo;
-	unsigned i;
+	unsigned offset, len;
+	uint64_t lsn;
 
 	bzero((void *)block, sizeof(block));
 
 	/* Zero all of the journal but the first block */
-	for (i=1; i<journalblocks; i++) {
-		diskwrite(block, journalstart + i);
+	if (journalblocks > 1) {
+		diskzero(journalstart + 1, journalblocks - 1);
 	}
 
 	/* and write a trim record into the first block */
@@ -249,13 +279,24 @@ writejournal(void)
 
 	/* put more stuff in here if needed for your checkpoint scheme */
 
-	/* the rest of the block is a pad record */
-	coninfo = SFS_MKCONINFO(SFS_JPHYS_CONTAINER,
-				SFS_JPHYS_PAD,
-				SFS_BLOCKSIZE - sizeof(hdr) - sizeof(rec),
-				2 /* second lsn */);
-	hdr.jh_coninfo = SWAP64(coninfo);
-	memcpy(block + sizeof(hdr) + sizeof(rec), &hdr, sizeof(hdr));
+	/*
+	 * The rest of the block is pad records, as many as it takes;
+	 * less than a header's worth at the end is implicit padding.
+	 */
+	offset = sizeof(hdr) + sizeof(rec);
+	lsn = 2 /* second lsn */;
+	while (offset + sizeof(hdr) <= SFS_BLOCKSIZE) {
+		len = SFS_BLOCKSIZE - offset;
+		if (len > SFS_CONINFO_MAXLEN) {
+			len = SFS_CONINFO_MAXLEN;
+		}
+		coninfo = SFS_MKCONINFO(SFS_JPHYS_CONTAINER,
+					SFS_JPHYS_PAD, len, lsn);
+		hdr.jh_coninfo = SWAP64(coninfo);
+		memcpy(block + offset, &hdr, sizeof(hdr));
+		offset += len;
+		lsn++;
+	}
 
 	diskwrite(block, journalstart);
 }
@@ -273,8 +314,31 @@ main(int argc, char **argv)
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-e")) {
+			use_extents = 1;
+		}
+		else if (!strcmp(argv[1], "-j") && argc > 2) {
+			for (s = argv[2]; *s >= '0' && *s <= '9'; s++) {
+				/* nothing */
+			}
+			journalblocks = atoi(argv[2]);
+			if (*s != 0 || journalblocks < MINJOURNALBLOCKS) {
+				errx(1, "Journal size must be a number of "
+				     "blocks, at least %u", MINJOURNALBLOCKS);
+			}
+			argc--;
+			argv++;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-e] [-j journalblocks] "
+		     "device/diskfile volume-name");
 	}
 
 	check();
@@ -57,12 +57,59 @@ struct inodeinfo {
 static struct inodeinfo *inodes = NULL;
 static unsigned ninodes = 0, maxinodes = 0;
 
-/* Whether the table is sorted and can be looked up with binary search. */
-static int inodes_sorted = 0;
+/*
+ * Open-addressed hash of inode number to index in the table, so
+ * lookups (including the duplicate check when adding) don't have to
+ * scan. It has twice as many slots as the table has room for, so it
+ * never gets more than half full; empty slots hold INODEHASH_EMPTY.
+ */
+#define INODEHASH_EMPTY ((unsigned)-1)
+static unsigned *inodehash = NULL;
+static unsigned inodehashsize = 0;
 
 ////////////////////////////////////////////////////////////
 // inode table ops
 
+/*
+ * Return the hash slot for inode INO: either the one holding it, or
+ * the empty one where it would go.
+ */
+static
+unsigned
+inode_hashslot(uint32_t ino)
+{
+	unsigned slot;
+
+	assert(inodehashsize > 0);
+	/* multiplicative hash; the size is a power of 2 */
+	slot = (ino * 2654435761U) & (inodehashsize - 1);
+	while (inodehash[slot] != INODEHASH_EMPTY &&
+	       inodes[inodehash[slot]].ino != ino) {
+		slot = (slot + 1) & (inodehashsize - 1);
+	}
+	return slot;
+}
+
+/*
+ * Rebuild the hash from the table, at a size to go with maxinodes.
+ */
+static
+void
+inode_rehash(void)
+{
+	unsigned i;
+
+	free(inodehash);
+	inodehashsize = maxinodes * 2;
+	inodehash = domalloc(inodehashsize * sizeof(inodehash[0]));
+	for (i=0; i<inodehashsize; i++) {
+		inodehash[i] = INODEHASH_EMPTY;
+	}
+	for (i=0; i<ninodes; i++) {
+		inodehash[inode_hashslot(inodes[i].ino)] = i;
+	}
+}
+
 /*
  * Add an entry to the inode table, realloc'ing it if needed.
  */
@@ -78,13 +125,14 @@ inode_addtable(uint32_t ino, int type)
 		inodes = dorealloc(inodes, maxinodes * sizeof(inodes[0]),
 				   newmax * sizeof(inodes[0]));
 		maxinodes = newmax;
+		inode_rehash();
 	}
 	inodes[ninodes].ino = ino;
 	inodes[ninodes].linkcount = 0;
 	inodes[ninodes].visited = 0;
 	inodes[ninodes].type = type;
+	inodehash[inode_hashslot(ino)] = ninodes;
 	ninodes++;
-	inodes_sorted = 0;
 }
 
 /*
@@ -114,17 +162,20 @@ inode_compare(const void *av, const void *bv)
 }
 
 /*
- * After pass1, we sort the inode table for faster access.
+ * After pass1, we sort the inode table so the link count fixups walk
+ * the disk in order. This moves everything, so redo the hash.
  */
 void
 inode_sorttable(void)
 {
 	qsort(inodes, ninodes, sizeof(inodes[0]), inode_compare);
-	inodes_sorted = 1;
+	if (maxinodes > 0) {
+		inode_rehash();
+	}
 }
 
 /*
- * Find an inode by binary search.
+ * Find an inode in the hash.
  *
  * This will error out if asked for an inode not in the table; that's
  * not supposed to happen. (This might need to change; if we improve
@@ -136,31 +187,15 @@ static
 struct inodeinfo *
 inode_find(uint32_t ino)
 {
-	unsigned min, max, i;
+	unsigned slot;
 
-	assert(inodes_sorted);
 	assert(ninodes > 0);
 
-	min = 0;
-	max = ninodes;
-	while (1) {
-		assert(min <= max);
-		if (min == max) {
-			errx(EXIT_UNRECOV, "FATAL: inode %u wasn't found in my inode table", ino);
-		}
-		i = min + (max - min)/2;
-		if (inodes[i].ino < ino) {
-			min = i + 1;
-		}
-		else if (inodes[i].ino > ino) {
-			max = i;
-		}
-		else {
-			assert(inodes[i].ino == ino);
-			return &inodes[i];
-		}
+	slot = inode_hashslot(ino);
+	if (inodehash[slot] == INODEHASH_EMPTY) {
+		errx(EXIT_UNRECOV, "FATAL: inode %u wasn't found in my inode table", ino);
 	}
-	/* NOTREACHED */
+	return &inodes[inodehash[slot]];
 }
 
 ////////////////////////////////////////////////////////////
@@ -168,20 +203,17 @@ inode_find(uint32_t ino)
 
 /*
  * Add an inode; returns 1 if we've already seen it.
- *
- * Uses linear search because we only sort the table for faster access
- * after all inodes have been added. In the FUTURE this could be
- * changed to a better data structure.
  */
 int
 inode_add(uint32_t ino, int type)
 {
-	unsigned i;
+	unsigned slot;
 
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount == 0);
-			assert(inodes[i].type == type);
+	if (ninodes > 0) {
+		slot = inode_hashslot(ino);
+		if (inodehash[slot] != INODEHASH_EMPTY) {
+			assert(inodes[inodehash[slot]].linkcount == 0);
+			assert(inodes[inodehash[slot]].type == type);
 			return 1;
 		}
 	}
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Journal check (sfsck -j).
+ *
+ * Instead of walking the whole volume, read the journal and check
+ * that what it says was done to the volume is in fact on disk. The
+ * journal is a circular buffer, so besides the live records past
+ * the tail it still holds the already-checkpointed ones back to
+ * where it last wrapped: a window of recent activity whose size is
+ * set by the journal size, not the volume size. For every block
+ * changed in that window we check that
+ *    - the freemap shows it allocated or free according to the last
+ *      ALLOC or FREE of it, and
+ *    - if it's metadata still in use, its contents match its META
+ *      records: the new data where the operation committed and the
+ *      old data where it was rolled back.
+ *
+ * Live client records mean the volume wasn't unmounted cleanly and
+ * hasn't been recovered; mounting it replays them. Those, and any
+ * mismatch or a journal we can't parse, are reported by returning
+ * nonzero, and the caller then does the full check.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sfs.h"
+#include "sb.h"
+#include "journal.h"
+
+/* A record, found in the copy of the journal */
+struct jrec {
+	uint64_t lsn;
+	unsigned class;		/* SFS_JPHYS_CONTAINER or _CLIENT */
+	unsigned type;
+	const uint8_t *data;	/* contents, after the header */
+	unsigned len;		/* length of contents */
+};
+
+/* The whole journal, read into memory */
+static uint8_t *jdata;
+
+/* The records in the window, in LSN order */
+static struct jrec *jrecs;
+static unsigned njrecs, maxjrecs;
+
+/* The transaction ids of the TXEND records, sorted */
+static uint64_t *committed;
+static unsigned ncommitted;
+
+/* Number of problems found */
+static unsigned jproblems;
+
+////////////////////////////////////////////////////////////
+// reading the journal
+
+static
+int
+jrec_compare(const void *av, const void *bv)
+{
+	const struct jrec *a = av;
+	const struct jrec *b = bv;
+
+	if (a->lsn < b->lsn) {
+		return -1;
+	}
+	if (a->lsn > b->lsn) {
+		return 1;
+	}
+	return 0;
+}
+
+static
+void
+jrec_add(uint64_t ci, const uint8_t *data, unsigned len)
+{
+	unsigned newmax;
+
+	if (njrecs == maxjrecs) {
+		newmax = maxjrecs ? maxjrecs * 2 : 64;
+		jrecs = dorealloc(jrecs, maxjrecs * sizeof(jrecs[0]),
+				  newmax * sizeof(jrecs[0]));
+		maxjrecs = newmax;
+	}
+	jrecs[njrecs].lsn = SFS_CONINFO_LSN(ci);
+	jrecs[njrecs].class = SFS_CONINFO_CLASS(ci);
+	jrecs[njrecs].type = SFS_CONINFO_TYPE(ci);
+	jrecs[njrecs].data = data;
+	jrecs[njrecs].len = len;
+	njrecs++;
+}
+
+/*
+ * Read the journal and collect its records. Returns nonzero if it
+ * isn't well-formed.
+ */
+static
+int
+journal_load(void)
+{
+	struct sfs_jphys_header jh;
+	uint32_t jstart, jblocks, block;
+	unsigned offset, len, i, first;
+	uint8_t *buf;
+	uint64_t ci;
+
+	jstart = sb_journalstart();
+	jblocks = sb_journalblocks();
+	jdata = domalloc(jblocks * SFS_BLOCKSIZE);
+
+	for (block=0; block<jblocks; block++) {
+		buf = jdata + block * SFS_BLOCKSIZE;
+		diskread(buf, jstart + block);
+		offset = 0;
+		while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
+			memcpy(&jh, buf + offset, sizeof(jh));
+			ci = SWAP64(jh.jh_coninfo);
+			if (ci == 0) {
+				if (offset != 0) {
+					warnx("Journal block %lu: zero header "
+					      "at offset %u",
+					      (unsigned long)block, offset);
+					return 1;
+				}
+				/* block hasn't been used yet */
+				break;
+			}
+			len = SFS_CONINFO_LEN(ci);
+			if (len < sizeof(jh) ||
+			    offset + len > SFS_BLOCKSIZE) {
+				warnx("Journal block %lu: bad record length "
+				      "%u at offset %u",
+				      (unsigned long)block, len, offset);
+				return 1;
+			}
+			jrec_add(ci, buf + offset + sizeof(jh),
+				 len - sizeof(jh));
+			offset += len;
+		}
+	}
+	if (njrecs == 0) {
+		return 0;
+	}
+
+	/*
+	 * LSNs go up by one per record. What's left from before the
+	 * journal last wrapped continues on from the newest records,
+	 * so once sorted, the window is the run of consecutive LSNs
+	 * ending at the head. Anything older than a break in the run
+	 * is stale; drop it.
+	 */
+	qsort(jrecs, njrecs, sizeof(jrecs[0]), jrec_compare);
+	for (first = njrecs - 1; first > 0; first--) {
+		if (jrecs[first - 1].lsn + 1 != jrecs[first].lsn) {
+			break;
+		}
+	}
+	if (first > 0) {
+		memmove(jrecs, jrecs + first,
+			(njrecs - first) * sizeof(jrecs[0]));
+		njrecs -= first;
+	}
+
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class == SFS_JPHYS_CLIENT &&
+		    jrecs[i].type == SFS_JREC_TXEND &&
+		    jrecs[i].len >= sizeof(struct sfs_jrec_tx)) {
+			ncommitted++;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// transactions
+
+static
+int
+txid_compare(const void *av, const void *bv)
+{
+	uint64_t a = *(const uint64_t *)av;
+	uint64_t b = *(const uint64_t *)bv;
+
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Build the sorted table of committed transactions.
+ */
+static
+void
+journal_findcommits(void)
+{
+	struct sfs_jrec_tx jx;
+	unsigned i, n;
+
+	committed = domalloc((ncommitted + 1) * sizeof(committed[0]));
+	n = 0;
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class == SFS_JPHYS_CLIENT &&
+		    jrecs[i].type == SFS_JREC_TXEND &&
+		    jrecs[i].len >= sizeof(jx)) {
+			memcpy(&jx, jrecs[i].data, sizeof(jx));
+			committed[n++] = SWAP64(jx.jx_txid);
+		}
+	}
+	qsort(committed, ncommitted, sizeof(committed[0]), txid_compare);
+}
+
+/*
+ * Did transaction TXID commit? Records outside any transaction
+ * (txid 0) count as committed. A transaction whose records are in
+ * the window has its TXEND there too, if it ever wrote one, since
+ * that comes later.
+ */
+static
+int
+journal_committed(uint64_t txid)
+{
+	unsigned min, max, i;
+
+	if (txid == 0) {
+		return 1;
+	}
+	min = 0;
+	max = ncommitted;
+	while (min < max) {
+		i = min + (max - min) / 2;
+		if (committed[i] < txid) {
+			min = i + 1;
+		}
+		else if (committed[i] > txid) {
+			max = i;
+		}
+		else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// record contents
+
+/*
+ * Copy out and byte-swap an ALLOC or FREE record. Returns nonzero
+ * if it's malformed.
+ */
+static
+int
+journal_getblocks(const struct jrec *jr, struct sfs_jrec_blocks *jb)
+{
+	if (jr->len < sizeof(*jb)) {
+		return 1;
+	}
+	memcpy(jb, jr->data, sizeof(*jb));
+	jb->jb_txid = SWAP64(jb->jb_txid);
+	jb->jb_start = SWAP32(jb->jb_start);
+	jb->jb_count = SWAP32(jb->jb_count);
+	if (jb->jb_start + jb->jb_count < jb->jb_start ||
+	    jb->jb_start + jb->jb_count > sb_totalblocks()) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Likewise for a META record.
+ */
+static
+int
+journal_getmeta(const struct jrec *jr, struct sfs_jrec_meta *jm)
+{
+	if (jr->len < sizeof(*jm)) {
+		return 1;
+	}
+	memcpy(jm, jr->data, sizeof(*jm));
+	jm->jm_txid = SWAP64(jm->jm_txid);
+	jm->jm_block = SWAP32(jm->jm_block);
+	jm->jm_offset = SWAP16(jm->jm_offset);
+	jm->jm_len = SWAP16(jm->jm_len);
+	jm->jm_flags = SWAP16(jm->jm_flags);
+	if (jm->jm_len == 0 || jm->jm_len > SFS_JMETA_MAXLEN ||
+	    jr->len != sizeof(*jm) + 2 * jm->jm_len ||
+	    jm->jm_offset + jm->jm_len > SFS_BLOCKSIZE ||
+	    jm->jm_block >= sb_totalblocks()) {
+		return 1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// checks
+
+/*
+ * Check the freemap against the window's ALLOC and FREE records.
+ * Uncommitted ALLOCs were rolled back, so leave the block free;
+ * uncommitted FREEs never happened. The last record to touch a
+ * block decides.
+ */
+static
+void
+journal_checkfreemap(unsigned *nblocks_ret)
+{
+	struct sfs_jrec_blocks jb;
+	uint8_t *ondisk, *known, *expect, mask;
+	uint32_t mapblocks, i, b;
+	size_t mapbytes;
+	unsigned n;
+	int inuse;
+
+	mapblocks = sb_freemapblocks();
+	mapbytes = mapblocks * SFS_BLOCKSIZE;
+	ondisk = domalloc(mapbytes);
+	known = domalloc(mapbytes);
+	expect = domalloc(mapbytes);
+	memset(known, 0, mapbytes);
+	memset(expect, 0, mapbytes);
+	for (i=0; i<mapblocks; i++) {
+		sfs_readfreemapblock(i, ondisk + i * SFS_BLOCKSIZE);
+	}
+
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class != SFS_JPHYS_CLIENT ||
+		    (jrecs[i].type != SFS_JREC_ALLOC &&
+		     jrecs[i].type != SFS_JREC_FREE)) {
+			continue;
+		}
+		if (journal_getblocks(&jrecs[i], &jb)) {
+			warnx("Journal: bad block record at lsn %llu",
+			      (unsigned long long)jrecs[i].lsn);
+			jproblems++;
+			continue;
+		}
+		if (jrecs[i].type == SFS_JREC_ALLOC) {
+			inuse = journal_committed(jb.jb_txid);
+		}
+		else if (journal_committed(jb.jb_txid)) {
+			inuse = 0;
+		}
+		else {
+			continue;
+		}
+		for (b = jb.jb_start; b < jb.jb_start + jb.jb_count; b++) {
+			mask = 1 << (b % 8);
+			known[b / 8] |= mask;
+			if (inuse) {
+				expect[b / 8] |= mask;
+			}
+			else {
+				expect[b / 8] &= ~mask;
+			}
+		}
+	}
+
+	n = 0;
+	for (b=0; b<sb_totalblocks(); b++) {
+		mask = 1 << (b % 8);
+		if ((known[b / 8] & mask) == 0) {
+			continue;
+		}
+		n++;
+		if ((ondisk[b / 8] & mask) != (expect[b / 8] & mask)) {
+			warnx("Block %lu shown %s in freemap; journal says "
+			      "%s", (unsigned long)b,
+			      (ondisk[b / 8] & mask) ? "allocated" : "free",
+			      (expect[b / 8] & mask) ? "allocated" : "free");
+			jproblems++;
+		}
+	}
+	*nblocks_ret = n;
+
+	free(expect);
+	free(known);
+	free(ondisk);
+}
+
+/*
+ * Return the LSN of the last committed FREE of BLOCK, or 0.
+ */
+static
+uint64_t
+journal_lastfree(uint32_t block)
+{
+	struct sfs_jrec_blocks jb;
+	unsigned i;
+
+	for (i = njrecs; i-- > 0; ) {
+		if (jrecs[i].class != SFS_JPHYS_CLIENT ||
+		    jrecs[i].type != SFS_JREC_FREE ||
+		    journal_getblocks(&jrecs[i], &jb)) {
+			continue;
+		}
+		if (block >= jb.jb_start &&
+		    block - jb.jb_start < jb.jb_count &&
+		    journal_committed(jb.jb_txid)) {
+			return jrecs[i].lsn;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sort META records by block, then LSN, so each block's are together
+ * and in order. ARGS are indexes into jrecs.
+ */
+static
+int
+meta_compare(const void *av, const void *bv)
+{
+	const struct jrec *a = &jrecs[*(const unsigned *)av];
+	const struct jrec *b = &jrecs[*(const unsigned *)bv];
+	struct sfs_jrec_meta ma, mb;
+
+	/* only well-formed records get in the table */
+	journal_getmeta(a, &ma);
+	journal_getmeta(b, &mb);
+	if (ma.jm_block != mb.jm_block) {
+		return ma.jm_block < mb.jm_block ? -1 : 1;
+	}
+	return jrec_compare(a, b);
+}
+
+/*
+ * Check one block against its META records, META[0..N): replay them
+ * onto a copy of what's on disk the way mounting does (the new data
+ * forward, then the old data of the uncommitted ones backward) and
+ * see if that changed anything.
+ */
+static
+void
+journal_checkblock(uint32_t block, const unsigned *meta, unsigned n)
+{
+	uint8_t ondisk[SFS_BLOCKSIZE], replayed[SFS_BLOCKSIZE];
+	struct sfs_jrec_meta jm;
+	const uint8_t *olddata;
+	uint64_t freelsn;
+	unsigned i, first;
+
+	/*
+	 * Skip what came before the block was last freed; it may
+	 * since have been reused for file data, which isn't logged.
+	 */
+	freelsn = journal_lastfree(block);
+	for (first = 0; first < n; first++) {
+		if (jrecs[meta[first]].lsn > freelsn) {
+			break;
+		}
+	}
+	if (first == n) {
+		return;
+	}
+
+	diskread(ondisk, block);
+	memcpy(replayed, ondisk, SFS_BLOCKSIZE);
+	for (i=first; i<n; i++) {
+		journal_getmeta(&jrecs[meta[i]], &jm);
+		if (jm.jm_flags & SFS_JMETA_ZERO) {
+			memset(replayed, 0, SFS_BLOCKSIZE);
+		}
+		olddata = jrecs[meta[i]].data + sizeof(jm);
+		memcpy(replayed + jm.jm_offset, olddata + jm.jm_len,
+		       jm.jm_len);
+	}
+	for (i=n; i-- > first; ) {
+		journal_getmeta(&jrecs[meta[i]], &jm);
+		if (!journal_committed(jm.jm_txid)) {
+			olddata = jrecs[meta[i]].data + sizeof(jm);
+			memcpy(replayed + jm.jm_offset, olddata, jm.jm_len);
+		}
+	}
+
+	if (memcmp(ondisk, replayed, SFS_BLOCKSIZE) != 0) {
+		warnx("Block %lu doesn't match its journal records",
+		      (unsigned long)block);
+		jproblems++;
+	}
+}
+
+/*
+ * Check every metadata block the window touches.
+ */
+static
+void
+journal_checkmeta(unsigned *nblocks_ret)
+{
+	struct sfs_jrec_meta jm;
+	unsigned *meta, nmeta, i, j, n;
+	uint32_t jstart;
+
+	jstart = sb_journalstart();
+	meta = domalloc((njrecs + 1) * sizeof(meta[0]));
+	nmeta = 0;
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class != SFS_JPHYS_CLIENT ||
+		    jrecs[i].type != SFS_JREC_META) {
+			continue;
+		}
+		if (journal_getmeta(&jrecs[i], &jm) ||
+		    (jm.jm_block >= jstart &&
+		     jm.jm_block - jstart < sb_journalblocks())) {
+			warnx("Journal: bad metadata record at lsn %llu",
+			      (unsigned long long)jrecs[i].lsn);
+			jproblems++;
+			continue;
+		}
+		meta[nmeta++] = i;
+	}
+	qsort(meta, nmeta, sizeof(meta[0]), meta_compare);
+
+	n = 0;
+	for (i=0; i<nmeta; i=j) {
+		journal_getmeta(&jrecs[meta[i]], &jm);
+		for (j=i+1; j<nmeta; j++) {
+			struct sfs_jrec_meta jm2;
+
+			journal_getmeta(&jrecs[meta[j]], &jm2);
+			if (jm2.jm_block != jm.jm_block) {
+				break;
+			}
+		}
+		journal_checkblock(jm.jm_block, meta + i, j - i);
+		n++;
+	}
+	*nblocks_ret = n;
+	free(meta);
+}
+
+/*
+ * Count the client records at or past the tail: the latest trim
+ * record's tail LSN, or the whole window if it has no trim record.
+ */
+static
+unsigned
+journal_countlive(void)
+{
+	struct sfs_jphys_trim jt;
+	uint64_t taillsn;
+	unsigned i, n;
+
+	taillsn = 0;
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class == SFS_JPHYS_CONTAINER &&
+		    jrecs[i].type == SFS_JPHYS_TRIM &&
+		    jrecs[i].len >= sizeof(jt)) {
+			memcpy(&jt, jrecs[i].data, sizeof(jt));
+			taillsn = SWAP64(jt.jt_taillsn);
+		}
+	}
+
+	n = 0;
+	for (i=0; i<njrecs; i++) {
+		if (jrecs[i].class == SFS_JPHYS_CLIENT &&
+		    jrecs[i].lsn >= taillsn) {
+			n++;
+		}
+	}
+	return n;
+}
+
+////////////////////////////////////////////////////////////
+// entry point
+
+/*
+ * Check the volume against its journal. Returns 0 if that turned up
+ * nothing wrong, in which case no further checking is needed.
+ */
+int
+journal_check(void)
+{
+	unsigned live, nmeta, nmap;
+	int ret;
+
+	ret = 1;
+	nmeta = nmap = 0;
+
+	if (journal_load()) {
+		warnx("Cannot use the journal");
+		goto out;
+	}
+	live = journal_countlive();
+	if (live > 0) {
+		warnx("Journal has %u records not yet recovered; mount the "
+		      "volume to replay them", live);
+		goto out;
+	}
+	journal_findcommits();
+
+	journal_checkfreemap(&nmap);
+	journal_checkmeta(&nmeta);
+	printf("Journal: %u records; checked %u metadata blocks, "
+	       "%u freemap entries\n", njrecs, nmeta, nmap);
+	if (jproblems > 0) {
+		warnx("%u problems found against the journal", jproblems);
+		goto out;
+	}
+	ret = 0;
+
+ out:
+	free(committed);
+	free(jrecs);
+	free(jdata);
+	committed = NULL;
+	jrecs = NULL;
+	jdata = NULL;
+	njrecs = maxjrecs = ncommitted = 0;
+	return ret;
+}
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
@@ -40,6 +41,7 @@
 #include "freemap.h"
 #include "inode.h"
 #include "passes.h"
+#include "journal.h"
 #include "main.h"
 
 static int badness=0;
@@ -64,13 +66,20 @@ setbadness(int code)
 int
 main(int argc, char **argv)
 {
+	int jflag = 0;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
 	/* FUTURE: add -n option */
+	if (argc==3 && !strcmp(argv[1], "-j")) {
+		jflag = 1;
+		argc--;
+		argv++;
+	}
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-j] device/diskfile");
 	}
 
 	opendisk(argv[1]);
@@ -78,6 +87,20 @@ main(int argc, char **argv)
 	sfs_setup();
 	sb_load();
 	sb_check();
+
+	/*
+	 * With -j, check only what the journal says changed recently,
+	 * and do the full check only if that finds trouble.
+	 */
+	if (jflag && badness < EXIT_UNRECOV) {
+		printf("Phase 0 -- check recent changes from the journal\n");
+		if (journal_check() == 0) {
+			closedisk();
+			return badness;
+		}
+		warnx("Doing a full check");
+	}
+
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
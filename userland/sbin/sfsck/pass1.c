@@ -49,6 +49,11 @@
 
 static unsigned long count_dirs=0, count_files=0;
 
+/* Inode flags we know how to check */
+#define KNOWN_IFLAGS \
+	(SFS_IFLAG_INLINE | SFS_IFLAG_EXTENTS | SFS_IFLAG_PREALLOC | \
+	 SFS_IFLAG_COMPRESSED)
+
 /*
  * State for checking indirect blocks.
  */
@@ -172,6 +177,272 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 }
 
+/*
+ * Reset the extent tree root RT to an empty leaf.
+ */
+static
+void
+extent_clearroot(struct sfs_extent_root *rt)
+{
+	bzero(rt, sizeof(*rt));
+	rt->er_hdr.eh_magic = SFS_EXTENT_MAGIC;
+	rt->er_hdr.eh_max = SFS_EXTENTS_INODE;
+}
+
+/*
+ * Check a leaf of an extent tree: EH and EXT are its header and
+ * entries, and every entry must lie within file blocks [LO, HI).
+ * Entries that are out of order, overlap, or point outside the volume
+ * are dropped; blocks past EOF are freed by trimming the extent. The
+ * rest are recorded in the freemap.
+ *
+ * Returns nonzero if the node has been modified.
+ */
+static
+int
+check_extent_leaf(struct ibstate *ibs, struct sfs_extent_header *eh,
+		  struct sfs_extent *ext, uint32_t lo, uint32_t hi)
+{
+	struct sfs_extent *ex;
+	uint32_t i, j, b, keep;
+	int changed = 0;
+
+	for (i=j=0; i<eh->eh_count; i++) {
+		ex = &ext[i];
+		if (ex->ex_len == 0 || ex->ex_fileblock < lo ||
+		    ex->ex_fileblock >= hi ||
+		    ex->ex_len > hi - ex->ex_fileblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent for blocks %lu-%lu "
+			      "out of order or out of range (dropped)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)ex->ex_fileblock,
+			      (unsigned long)(ex->ex_fileblock +
+					      ex->ex_len - 1));
+			changed = 1;
+			continue;
+		}
+		if (ex->ex_diskblock == 0 ||
+		    ex->ex_diskblock >= ibs->volblocks ||
+		    ex->ex_len > ibs->volblocks - ex->ex_diskblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent for block %lu outside "
+			      "of volume: %lu+%lu (dropped)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)ex->ex_fileblock,
+			      (unsigned long)ex->ex_diskblock,
+			      (unsigned long)ex->ex_len);
+			changed = 1;
+			continue;
+		}
+
+		/* Free whatever lies past EOF */
+		if (ex->ex_fileblock >= ibs->fileblocks) {
+			keep = 0;
+		}
+		else {
+			keep = ibs->fileblocks - ex->ex_fileblock;
+			if (keep > ex->ex_len) {
+				keep = ex->ex_len;
+			}
+		}
+		for (b=keep; b<ex->ex_len; b++) {
+			ibs->pasteofcount++;
+			freemap_blockfree(ex->ex_diskblock + b);
+		}
+		if (keep < ex->ex_len) {
+			setbadness(EXIT_RECOV);
+			ex->ex_len = keep;
+			changed = 1;
+			if (keep == 0) {
+				continue;
+			}
+		}
+
+		for (b=0; b<ex->ex_len; b++) {
+			freemap_blockinuse(ex->ex_diskblock + b,
+					   ibs->usagetype, ibs->ino);
+		}
+
+		/* The next extent must start after this one */
+		lo = ex->ex_fileblock + ex->ex_len;
+		if (j != i) {
+			ext[j] = *ex;
+		}
+		j++;
+	}
+
+	if (j != eh->eh_count) {
+		bzero(&ext[j], (eh->eh_count - j) * sizeof(ext[0]));
+		eh->eh_count = j;
+	}
+	return changed;
+}
+
+/*
+ * Check a node of an extent tree, which maps file blocks [LO, HI).
+ * EH and EXT are the node's header and entries; for an interior node
+ * each child is read, checked against its expected depth, and checked
+ * recursively. Children that come out empty are freed and dropped,
+ * and the first entry's key is kept equal to LO as the kernel
+ * expects.
+ *
+ * Returns nonzero if the node has been modified.
+ */
+static
+int
+check_extent_node(struct ibstate *ibs, struct sfs_extent_header *eh,
+		  struct sfs_extent *ext, uint32_t lo, uint32_t hi)
+{
+	struct sfs_extent_block eb;
+	struct sfs_extent *ex;
+	uint32_t i, j, k, child, childhi, prev;
+	int changed = 0, childchanged;
+
+	if (eh->eh_depth == 0) {
+		return check_extent_leaf(ibs, eh, ext, lo, hi);
+	}
+
+	prev = lo;
+	for (i=j=0; i<eh->eh_count; i++) {
+		ex = &ext[i];
+		child = ex->ex_diskblock;
+		if ((i > 0 && ex->ex_fileblock <= prev) ||
+		    ex->ex_fileblock >= hi || ex->ex_len != 0 ||
+		    child == 0 || child >= ibs->volblocks) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: invalid extent index entry "
+			      "for block %lu -> %lu (dropped)",
+			      (unsigned long)ibs->ino,
+			      (unsigned long)ex->ex_fileblock,
+			      (unsigned long)child);
+			changed = 1;
+			continue;
+		}
+		if (i == 0) {
+			ex->ex_fileblock = lo;
+		}
+		prev = ex->ex_fileblock;
+
+		/* The child ends where the next plausible entry begins */
+		childhi = hi;
+		for (k=i+1; k<eh->eh_count; k++) {
+			if (ext[k].ex_fileblock > prev &&
+			    ext[k].ex_fileblock < hi) {
+				childhi = ext[k].ex_fileblock;
+				break;
+			}
+		}
+
+		sfs_readextblock(child, &eb);
+		if (eb.eb_hdr.eh_magic != SFS_EXTENT_MAGIC ||
+		    eb.eb_hdr.eh_max != SFS_EXTENTS_BLOCK ||
+		    eb.eb_hdr.eh_count > SFS_EXTENTS_BLOCK ||
+		    eb.eb_hdr.eh_depth != eh->eh_depth - 1) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: invalid extent tree block %lu "
+			      "(dropped)", (unsigned long)ibs->ino,
+			      (unsigned long)child);
+			changed = 1;
+			continue;
+		}
+
+		childchanged = check_extent_node(ibs, &eb.eb_hdr, eb.eb_ext,
+						 ex->ex_fileblock, childhi);
+		if (eb.eb_hdr.eh_count == 0) {
+			/* nothing left in it */
+			setbadness(EXIT_RECOV);
+			freemap_blockfree(child);
+			changed = 1;
+			continue;
+		}
+		freemap_blockinuse(child, B_IBLOCK, ibs->ino);
+		if (childchanged) {
+			sfs_writeextblock(child, &eb);
+		}
+
+		if (j != i) {
+			ext[j] = *ex;
+		}
+		j++;
+	}
+
+	if (j != eh->eh_count) {
+		bzero(&ext[j], (eh->eh_count - j) * sizeof(ext[0]));
+		eh->eh_count = j;
+	}
+	if (j > 0 && ext[0].ex_fileblock != lo) {
+		/* the first entry was dropped */
+		ext[0].ex_fileblock = lo;
+	}
+	return changed;
+}
+
+/*
+ * Check the extent tree of inode INO, as check_inode_blocks does for
+ * block pointers. A damaged root is reset to an empty tree; the
+ * blocks it mapped are then unreferenced and the freemap check will
+ * deal with them.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_extent_root *rt = &sfi->sfi_extents;
+	struct ibstate ibs;
+	int changed = 0;
+
+	ibs.ino = ino;
+	ibs.curfileblock = 0;
+	ibs.fileblocks = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) /
+		SFS_BLOCKSIZE;
+	if (sfi->sfi_flags & SFS_IFLAG_PREALLOC) {
+		/* may have blocks preallocated past EOF */
+		ibs.fileblocks = 0xffffffff;
+	}
+	ibs.volblocks = sb_totalblocks();
+	ibs.pasteofcount = 0;
+	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
+
+	if (rt->er_hdr.eh_magic != SFS_EXTENT_MAGIC ||
+	    rt->er_hdr.eh_max != SFS_EXTENTS_INODE ||
+	    rt->er_hdr.eh_count > SFS_EXTENTS_INODE ||
+	    rt->er_hdr.eh_depth > SFS_EXTENT_MAXDEPTH) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: invalid extent tree root (cleared)",
+		      (unsigned long)ino);
+		extent_clearroot(rt);
+		return 1;
+	}
+	if (rt->er_unused != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: unused extent root field not zeroed "
+		      "(fixed)", (unsigned long)ino);
+		rt->er_unused = 0;
+		changed = 1;
+	}
+
+	if (check_extent_node(&ibs, &rt->er_hdr, rt->er_ext,
+			      0, 0xffffffff)) {
+		changed = 1;
+	}
+	if (rt->er_hdr.eh_count == 0 && rt->er_hdr.eh_depth > 0) {
+		rt->er_hdr.eh_depth = 0;
+		changed = 1;
+	}
+
+	if (ibs.pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (freed)",
+		     (unsigned long) ibs.ino, ibs.pasteofcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -189,11 +460,19 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return check_inode_extents(ino, sfi, isdir);
+	}
+
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
 	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	if (sfi->sfi_flags & SFS_IFLAG_PREALLOC) {
+		/* may have blocks preallocated past EOF */
+		ibs.fileblocks = 0xffffffff;
+	}
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
@@ -247,6 +526,65 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * An inline file (SFS_IFLAG_INLINE) keeps its data in the inode and
+ * must not have any blocks. Clear any block pointers it has; the
+ * blocks themselves are then unreferenced and the freemap check will
+ * deal with them.
+ *
+ * Returns nonzero if SFI has been modified.
+ */
+static
+int
+check_inline_noblocks(uint32_t ino, struct sfs_dinode *sfi)
+{
+	int changed = 0;
+	int i;
+
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		if (sfi->sfi_extents.er_hdr.eh_count != 0 ||
+		    sfi->sfi_extents.er_hdr.eh_depth != 0) {
+			warnx("Inode %lu: inline file has extents (cleared)",
+			      (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			extent_clearroot(&sfi->sfi_extents);
+			return 1;
+		}
+		return 0;
+	}
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	if (changed) {
+		warnx("Inode %lu: inline file has block pointers (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+	}
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -270,8 +608,91 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
+	if (sfi->sfi_flags & ~KNOWN_IFLAGS) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~KNOWN_IFLAGS));
+		sfi->sfi_flags &= KNOWN_IFLAGS;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) &&
+	    (isdir || sfi->sfi_size > SFS_INLINESIZE)) {
+		warnx("Inode %lu: %s marked inline (data discarded)",
+		      (unsigned long) ino,
+		      isdir ? "directory" : "oversize file");
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+		/* the inline area gets cleared below */
+	}
+
+	if ((sfi->sfi_flags & SFS_IFLAG_PREALLOC) &&
+	    (isdir || (sfi->sfi_flags & SFS_IFLAG_INLINE))) {
+		warnx("Inode %lu: %s marked preallocated (flag cleared)",
+		      (unsigned long) ino,
+		      isdir ? "directory" : "inline file");
+		sfi->sfi_flags &= ~SFS_IFLAG_PREALLOC;
+		if (isdir) {
+			sfi->sfi_unwritten = 0;
+		}
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	/* Only the kernel's copies of plain files are made compressed */
+	if ((sfi->sfi_flags & SFS_IFLAG_COMPRESSED) &&
+	    (isdir || (sfi->sfi_flags &
+		       (SFS_IFLAG_INLINE | SFS_IFLAG_PREALLOC)))) {
+		warnx("Inode %lu: %s marked compressed (flag cleared)",
+		      (unsigned long) ino,
+		      isdir ? "directory" :
+		      (sfi->sfi_flags & SFS_IFLAG_INLINE) ? "inline file" :
+		      "preallocated file");
+		sfi->sfi_flags &= ~SFS_IFLAG_COMPRESSED;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		/* Inline data: no blocks, and zeros past EOF */
+		if (check_inline_noblocks(ino, sfi)) {
+			changed = 1;
+		}
+		if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+				SFS_INLINESIZE - sfi->sfi_size)) {
+			warnx("Inode %lu: inline data past EOF not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+	else if (sfi->sfi_flags & SFS_IFLAG_PREALLOC) {
+		/* Nothing past EOF has been written */
+		if (sfi->sfi_unwritten >
+		    SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) /
+		    SFS_BLOCKSIZE) {
+			warnx("Inode %lu: unwritten mark %lu past EOF "
+			      "(fixed)", (unsigned long) ino,
+			      (unsigned long) sfi->sfi_unwritten);
+			sfi->sfi_unwritten =
+				SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) /
+				SFS_BLOCKSIZE;
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		if (checkzeroed(sfi->sfi_inline + sizeof(sfi->sfi_unwritten),
+				sizeof(sfi->sfi_inline) -
+				sizeof(sfi->sfi_unwritten))) {
+			warnx("Inode %lu: sfi_inline section not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+	else if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+		warnx("Inode %lu: sfi_inline section not zeroed (fixed)",
 		      (unsigned long) ino);
 		setbadness(EXIT_RECOV);
 		changed = 1;
@@ -97,6 +97,19 @@ sb_check(void)
 		warnx("Journal extends past volume end (NOT FIXED)");
 		setbadness(EXIT_UNRECOV);
 	}
+	if (SFS_SB_BLOCKSIZE(&sb) != SFS_BLOCKSIZE) {
+		errx(EXIT_FATAL, "Volume has %lu-byte blocks; "
+		     "only %u supported",
+		     (unsigned long)SFS_SB_BLOCKSIZE(&sb),
+		     SFS_BLOCKSIZE);
+	}
+	if (sb.sb_flags & ~SFS_SBFLAG_EXTENTS) {
+		warnx("Unknown superblock flags 0x%lx (cleared)",
+		      (unsigned long)(sb.sb_flags & ~SFS_SBFLAG_EXTENTS));
+		setbadness(EXIT_RECOV);
+		sb.sb_flags &= SFS_SBFLAG_EXTENTS;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
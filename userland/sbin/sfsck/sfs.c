@@ -51,6 +51,7 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_extent_block)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -64,6 +65,8 @@ swapsb(struct sfs_superblock *sb)
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
 	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
 	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_flags = SWAP32(sb->sb_flags);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
 }
 
 static
@@ -76,13 +79,55 @@ swapbits(uint8_t *bits)
 
 static
 void
-swapinode(struct sfs_dinode *sfi)
+swapextheader(struct sfs_extent_header *eh)
 {
+	eh->eh_magic = SWAP16(eh->eh_magic);
+	eh->eh_count = SWAP16(eh->eh_count);
+	eh->eh_max = SWAP16(eh->eh_max);
+	eh->eh_depth = SWAP16(eh->eh_depth);
+}
+
+static
+void
+swapextents(struct sfs_extent *ext, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		ext[i].ex_fileblock = SWAP32(ext[i].ex_fileblock);
+		ext[i].ex_diskblock = SWAP32(ext[i].ex_diskblock);
+		ext[i].ex_len = SWAP32(ext[i].ex_len);
+	}
+}
+
+/*
+ * Which fields the block pointer area holds depends on sfi_flags, so
+ * we need to know whether SFI is currently in disk byte order.
+ */
+static
+void
+swapinode(struct sfs_dinode *sfi, int ondisk)
+{
+	uint32_t flags;
 	int i;
 
+	flags = ondisk ? SWAP32(sfi->sfi_flags) : sfi->sfi_flags;
+
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	if (flags & SFS_IFLAG_PREALLOC) {
+		sfi->sfi_unwritten = SWAP32(sfi->sfi_unwritten);
+	}
+
+	if (flags & SFS_IFLAG_EXTENTS) {
+		swapextheader(&sfi->sfi_extents.er_hdr);
+		swapextents(sfi->sfi_extents.er_ext, SFS_EXTENTS_INODE);
+		sfi->sfi_extents.er_unused =
+			SWAP32(sfi->sfi_extents.er_unused);
+		sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+		return;
+	}
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -99,6 +144,16 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+}
+
+static
+void
+swapextblock(struct sfs_extent_block *eb)
+{
+	swapextheader(&eb->eb_hdr);
+	swapextents(eb->eb_ext, SFS_EXTENTS_BLOCK);
 }
 
 static
@@ -154,6 +209,47 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	}
 }
 
+/*
+ * Extent tree bmap: find FILEBLOCK in the extent node with header EH
+ * and entries EXT. Each node is searched linearly for the last entry
+ * starting at or before FILEBLOCK. Pass 1 has already checked the
+ * tree, so a bad child just reads as a hole here.
+ */
+static
+uint32_t
+extbmap(const struct sfs_extent_header *eh, const struct sfs_extent *ext,
+	uint32_t fileblock)
+{
+	struct sfs_extent_block eb;
+	unsigned i;
+
+	for (i=0; i<eh->eh_count; i++) {
+		if (ext[i].ex_fileblock > fileblock) {
+			break;
+		}
+	}
+	if (i == 0) {
+		return 0;
+	}
+	i--;
+
+	if (eh->eh_depth > 0) {
+		if (ext[i].ex_diskblock == 0) {
+			return 0;
+		}
+		sfs_readextblock(ext[i].ex_diskblock, &eb);
+		if (eb.eb_hdr.eh_magic != SFS_EXTENT_MAGIC ||
+		    eb.eb_hdr.eh_count > SFS_EXTENTS_BLOCK) {
+			return 0;
+		}
+		return extbmap(&eb.eb_hdr, eb.eb_ext, fileblock);
+	}
+	if (fileblock - ext[i].ex_fileblock >= ext[i].ex_len) {
+		return 0;
+	}
+	return ext[i].ex_diskblock + (fileblock - ext[i].ex_fileblock);
+}
+
 /*
  * bmap() for SFS.
  *
@@ -165,6 +261,11 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return extbmap(&sfi->sfi_extents.er_hdr,
+			       sfi->sfi_extents.er_ext, fileblock);
+	}
+
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -236,15 +337,15 @@ void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	diskread(sfi, ino);
-	swapinode(sfi);
+	swapinode(sfi, 1);
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	swapinode(sfi);
+	swapinode(sfi, 0);
 	diskwrite(sfi, ino);
-	swapinode(sfi);
+	swapinode(sfi, 1);
 }
 
 /*
@@ -266,6 +367,25 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent tree blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, struct sfs_extent_block *eb)
+{
+	diskread(eb, blocknum);
+	swapextblock(eb);
+}
+
+void
+sfs_writeextblock(uint32_t blocknum, struct sfs_extent_block *eb)
+{
+	swapextblock(eb);
+	diskwrite(eb, blocknum);
+	swapextblock(eb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -47,7 +47,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <errno.h>
 #include <err.h>
+#include <uthread.h>
 
 
 #define _PATH_RANDOM   "random:"
@@ -629,6 +631,125 @@ test7(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Test 8
+ *
+ * Test 5's loop in several threads at once. Each thread leaves its
+ * last blocks allocated for the main thread to check and free, so
+ * blocks also get freed by a thread other than the one that got them.
+ * random() isn't thread-safe, so each thread has its own generator.
+ */
+
+#define T8_THREADS	4
+#define T8_SLOTS	32
+
+struct t8thread {
+	unsigned num;
+	unsigned long seed;
+	void *ptrs[T8_SLOTS];
+	int psizes[T8_SLOTS];
+	int failed;
+};
+
+static
+unsigned
+t8random(struct t8thread *tt)
+{
+	tt->seed = tt->seed * 1103515245 + 12345;
+	return (tt->seed >> 8) & 0xffffff;
+}
+
+static
+void
+t8thread(void *arg)
+{
+	static const int sizes[8] = { 13, 17, 69, 176, 433, 871, 1150, 6060 };
+
+	struct t8thread *tt = arg;
+	unsigned bias;
+	int i, n, size;
+
+	for (i=0; i<50000; i++) {
+		n = t8random(tt) % T8_SLOTS;
+		bias = tt->num * T8_SLOTS + n;
+		if (tt->ptrs[n] == NULL) {
+			size = sizes[t8random(tt) % 8];
+			tt->ptrs[n] = malloc(size);
+			tt->psizes[n] = size;
+			if (tt->ptrs[n] == NULL) {
+				tt->failed = 1;
+				return;
+			}
+			markblock(tt->ptrs[n], size, bias, 0);
+		}
+		else {
+			size = tt->psizes[n];
+			if (checkblock(tt->ptrs[n], size, bias, 0)) {
+				tt->failed = 1;
+				return;
+			}
+			free(tt->ptrs[n]);
+			tt->ptrs[n] = NULL;
+			tt->psizes[n] = 0;
+		}
+	}
+}
+
+static
+void
+test8(void)
+{
+	struct t8thread tts[T8_THREADS];
+	struct uthread *threads[T8_THREADS];
+	unsigned i, n;
+	int result, failed=0;
+
+	printf("Beginning malloc test 8\n");
+
+	for (i=0; i<T8_THREADS; i++) {
+		tts[i].num = i;
+		tts[i].seed = i;
+		for (n=0; n<T8_SLOTS; n++) {
+			tts[i].ptrs[n] = NULL;
+			tts[i].psizes[n] = 0;
+		}
+		tts[i].failed = 0;
+	}
+	for (i=0; i<T8_THREADS; i++) {
+		result = uthread_create(&threads[i], t8thread, &tts[i]);
+		if (result) {
+			errno = result;
+			err(1, "uthread_create");
+		}
+	}
+	for (i=0; i<T8_THREADS; i++) {
+		uthread_join(threads[i]);
+		if (tts[i].failed) {
+			printf("Thread %u failed\n", i);
+			failed = 1;
+		}
+		for (n=0; n<T8_SLOTS; n++) {
+			if (tts[i].ptrs[n] == NULL) {
+				continue;
+			}
+			if (checkblock(tts[i].ptrs[n], tts[i].psizes[n],
+				       i * T8_SLOTS + n, 0)) {
+				failed = 1;
+			}
+			free(tts[i].ptrs[n]);
+		}
+	}
+
+	if (failed) {
+		printf("FAILED malloc test 8\n");
+	}
+	else {
+		printf("Passed malloc test 8\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+
 static struct {
 	int num;
 	const char *desc;
@@ -641,6 +762,7 @@ static struct {
 	{ 5, "Stress test", test5 },
 	{ 6, "Randomized stress test", test6 },
 	{ 7, "Stress test with particular seed", test7 },
+	{ 8, "Multithreaded stress test", test8 },
 	{ -1, NULL, NULL }
 };
 
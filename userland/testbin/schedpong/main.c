@@ -268,6 +268,11 @@ runit(unsigned numthinkers, unsigned numgrinders,
 		printf("Pong group %u: %s\n", i, buf);
 	}
 
+	printf("--- Wakeup latency ---\n");
+	for (i=0; i<numponggroups; i++) {
+		latency_report(i+2, ponggroupsize);
+	}
+
 	closeresultsfile();
 	destroyresultsfile();
 }
@@ -281,6 +286,7 @@ usage(const char *av0)
 	warnx("  [-g grinders]         set number of grinders (default 0)");
 	warnx("  [-p ponggroups]       set number of pong groups (default 1)");
 	warnx("  [-s ponggroupsize]    set pong group size (default 6)");
+	warnx("  [-n pongloops]        set pong rounds (default 1000)");
 	warnx("Thinkers are CPU bound; grinders are memory-bound;");
 	warnx("pong groups are I/O bound.");
 	exit(1);
@@ -309,6 +315,9 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-s")) {
 			ponggroupsize = atoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i], "-n")) {
+			pongloops = atoi(argv[++i]);
+		}
 		else {
 			usage(argv[0]);
 		}
@@ -32,17 +32,21 @@
  * Semaphore pong.
  */
 
+#include <sys/types.h>
 #include <stdio.h>
 #include <err.h>
 #include <assert.h>
 
 #include "usem.h"
 #include "tasks.h"
+#include "results.h"
 
 #define MAXCOUNT 64
-#define PONGLOOPS 1000
 //#define VERBOSE_PONG
 
+/* rounds per pass; settable from the command line */
+unsigned pongloops = 1000;
+
 static struct usem sems[MAXCOUNT];
 static unsigned nsems;
 
@@ -95,9 +99,10 @@ pong_cyclic(unsigned id)
 	unsigned nextid;
 
 	nextid = (id + 1) % nsems;
-	for (i=0; i<PONGLOOPS; i++) {
+	for (i=0; i<pongloops; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			latency_wake();
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -106,10 +111,12 @@ pong_cyclic(unsigned id)
 			putchar('.');
 		}
 #endif
+		latency_post();
 		V(&sems[nextid]);
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		latency_wake();
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -134,21 +141,22 @@ pong_reciprocating(unsigned id)
 
 	if (id == 0) {
 		nextfwd = nextback = 1;
-		n = PONGLOOPS;
+		n = pongloops;
 	}
 	else if (id == nsems - 1) {
 		nextfwd = nextback = nsems - 2;
-		n = PONGLOOPS;
+		n = pongloops;
 	}
 	else {
 		nextfwd = id + 1;
 		nextback = id - 1;
-		n = PONGLOOPS * 2;
+		n = pongloops * 2;
 	}
 
 	for (i=0; i<n; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			latency_wake();
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -157,6 +165,7 @@ pong_reciprocating(unsigned id)
 			putchar('.');
 		}
 #endif
+		latency_post();
 		if (gofwd) {
 			V(&sems[nextfwd]);
 			gofwd = 0;
@@ -168,6 +177,7 @@ pong_reciprocating(unsigned id)
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		latency_wake();
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -186,14 +196,13 @@ pong(unsigned groupid, unsigned id)
 {
 	unsigned idfwd, idback;
 
-	(void)groupid;
-
 	idfwd = (id + 1) % nsems;
 	idback = (id + nsems - 1) % nsems;
 	usem_open(&sems[id]);
 	usem_open(&sems[idfwd]);
 	usem_open(&sems[idback]);
 
+	latency_start(groupid, id);
 	waitstart();
 	pong_cyclic(id);
 #ifdef VERBOSE_PONG
@@ -204,6 +213,7 @@ pong(unsigned groupid, unsigned id)
 	printf("--------------------------------\n");
 #endif
 	pong_cyclic(id);
+	latency_finish();
 
 	usem_close(&sems[id]);
 	usem_close(&sems[idfwd]);
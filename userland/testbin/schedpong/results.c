@@ -28,6 +28,9 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
@@ -35,6 +38,7 @@
 #include <assert.h>
 
 #include "results.h"
+#include "tasks.h"
 
 #define RESULTSFILE "endtimes"
 
@@ -167,3 +171,228 @@ getresult(unsigned groupid, time_t *secs, unsigned long *nsecs)
 		errx(1, "%s: read (nsecs): Unexpected EOF", RESULTSFILE);
 	}
 }
+
+////////////////////////////////////////////////////////////
+// wakeup latency
+
+/*
+ * Each pong task logs the time just before every V and just after
+ * every P returns. A pong group passes a single token around, so
+ * merging the group's logs by time gives posts and wakeups
+ * alternating, and each wakeup's latency is its time minus the post
+ * just before it. The clock is the system time of day, which all the
+ * processes share.
+ *
+ * Events are stored as nanoseconds shifted left one, with the low bit
+ * set for a wakeup, so sorting puts a post ahead of a wakeup in the
+ * same nanosecond.
+ */
+
+#define LATFILE "lat-%u-%u"
+#define NLATBUCKETS 24
+
+/* at most two events per round, 4 passes' worth of rounds */
+#define MAXLATEVENTS (8 * pongloops + 8)
+
+static uint64_t *latevents;
+static unsigned numlatevents;
+static char latfile[32];
+
+void
+latency_start(unsigned groupid, unsigned id)
+{
+	snprintf(latfile, sizeof(latfile), LATFILE, groupid, id);
+	latevents = malloc(MAXLATEVENTS * sizeof(latevents[0]));
+	if (latevents == NULL) {
+		errx(1, "%s: Out of memory", latfile);
+	}
+	numlatevents = 0;
+}
+
+static
+void
+latency_event(unsigned iswake)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (numlatevents >= MAXLATEVENTS) {
+		errx(1, "%s: Too many events", latfile);
+	}
+	__time(&secs, &nsecs);
+	latevents[numlatevents++] =
+		(((uint64_t)secs * 1000000000 + nsecs) << 1) | iswake;
+}
+
+void
+latency_wake(void)
+{
+	latency_event(1);
+}
+
+void
+latency_post(void)
+{
+	latency_event(0);
+}
+
+/*
+ * Write out the log: the count, then the events.
+ */
+void
+latency_finish(void)
+{
+	ssize_t r;
+	size_t len;
+	int fd;
+
+	fd = open(latfile, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", latfile);
+	}
+	len = numlatevents * sizeof(latevents[0]);
+	r = write(fd, &numlatevents, sizeof(numlatevents));
+	if (r == (ssize_t)sizeof(numlatevents)) {
+		r = write(fd, latevents, len);
+	}
+	if (r < 0) {
+		err(1, "%s: write", latfile);
+	}
+	if (r != (ssize_t)len && len > 0) {
+		errx(1, "%s: write: Short write", latfile);
+	}
+	close(fd);
+	free(latevents);
+}
+
+static
+int
+latency_cmp64(const void *av, const void *bv)
+{
+	uint64_t a = *(const uint64_t *)av, b = *(const uint64_t *)bv;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static
+int
+latency_cmp32(const void *av, const void *bv)
+{
+	uint32_t a = *(const uint32_t *)av, b = *(const uint32_t *)bv;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/*
+ * Read back one task's log, appending it to EVENTS.
+ */
+static
+void
+latency_load(unsigned groupid, unsigned id, uint64_t *events,
+	     unsigned *num)
+{
+	char name[32];
+	unsigned count;
+	ssize_t r;
+	int fd;
+
+	snprintf(name, sizeof(name), LATFILE, groupid, id);
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	r = read(fd, &count, sizeof(count));
+	if (r != (ssize_t)sizeof(count)) {
+		errx(1, "%s: read: Unexpected EOF", name);
+	}
+	if (count > MAXLATEVENTS) {
+		errx(1, "%s: Too many events", name);
+	}
+	r = read(fd, events + *num, count * sizeof(events[0]));
+	if (r != (ssize_t)(count * sizeof(events[0]))) {
+		errx(1, "%s: read: Unexpected EOF", name);
+	}
+	close(fd);
+	if (remove(name) == -1 && errno != ENOSYS) {
+		warn("%s: remove", name);
+	}
+	*num += count;
+}
+
+/*
+ * Merge a pong group's logs and print its wakeup latency
+ * percentiles and a histogram with power-of-two microsecond buckets.
+ */
+void
+latency_report(unsigned groupid, unsigned count)
+{
+	uint64_t *events, post;
+	uint32_t *lats;
+	unsigned numevents, numlats, i, b;
+	unsigned buckets[NLATBUCKETS];
+	int haspost;
+
+	events = malloc(count * MAXLATEVENTS * sizeof(events[0]));
+	if (events == NULL) {
+		errx(1, "latency: Out of memory");
+	}
+	numevents = 0;
+	for (i=0; i<count; i++) {
+		latency_load(groupid, i, events, &numevents);
+	}
+	if (numevents == 0) {
+		free(events);
+		return;
+	}
+	qsort(events, numevents, sizeof(events[0]), latency_cmp64);
+
+	lats = malloc(numevents * sizeof(lats[0]));
+	if (lats == NULL) {
+		errx(1, "latency: Out of memory");
+	}
+	numlats = 0;
+	haspost = 0;
+	post = 0;
+	for (i=0; i<numevents; i++) {
+		if ((events[i] & 1) == 0) {
+			post = events[i] >> 1;
+			haspost = 1;
+		}
+		else if (haspost) {
+			lats[numlats++] = (events[i] >> 1) - post;
+			haspost = 0;
+		}
+	}
+	free(events);
+	if (numlats == 0) {
+		free(lats);
+		return;
+	}
+	qsort(lats, numlats, sizeof(lats[0]), latency_cmp32);
+
+	printf("Pong group %u wakeups: %u; latency (us) "
+	       "p50 %u.%03u p95 %u.%03u p99 %u.%03u max %u.%03u\n",
+	       groupid - 2, numlats,
+	       lats[numlats/2] / 1000, lats[numlats/2] % 1000,
+	       lats[numlats*95/100] / 1000, lats[numlats*95/100] % 1000,
+	       lats[numlats*99/100] / 1000, lats[numlats*99/100] % 1000,
+	       lats[numlats-1] / 1000, lats[numlats-1] % 1000);
+
+	for (b=0; b<NLATBUCKETS; b++) {
+		buckets[b] = 0;
+	}
+	for (i=0; i<numlats; i++) {
+		b = 0;
+		while (b < NLATBUCKETS-1 && (lats[i] / 1000) >> b != 0) {
+			b++;
+		}
+		buckets[b]++;
+	}
+	for (b=0; b<NLATBUCKETS; b++) {
+		if (buckets[b] == 0) {
+			continue;
+		}
+		printf("    < %7u us: %u\n", 1U << b, buckets[b]);
+	}
+	free(lats);
+}
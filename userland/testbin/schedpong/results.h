@@ -34,3 +34,9 @@ void openresultsfile(int openflags);
 void closeresultsfile(void);
 void putresult(unsigned groupid, time_t secs, unsigned long nsecs);
 void getresult(unsigned groupid, time_t *secs, unsigned long *nsecs);
+
+void latency_start(unsigned groupid, unsigned id);
+void latency_wake(void);
+void latency_post(void);
+void latency_finish(void);
+void latency_report(unsigned groupid, unsigned count);
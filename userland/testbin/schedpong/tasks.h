@@ -36,3 +36,4 @@ void grind(unsigned groupid, unsigned id);
 void pong_prep(unsigned groupid, unsigned count);
 void pong_cleanup(unsigned groupid, unsigned count);
 void pong(unsigned groupid, unsigned id);
+extern unsigned pongloops;
@@ -98,16 +98,13 @@ static
 void
 initarray(void)
 {
-	int i;
+	struct xrandom xr;
 
 	/*
 	 * Initialize the array, with pseudo-random but deterministic contents.
 	 */
-	srandom(533);
-
-	for (i = 0; i < SIZE; i++) {
-		A[i] = random();
-	}
+	xrandom_seed(&xr, 533);
+	xrandom_fill(&xr, (__u32 *)A, SIZE);
 }
 
 static
@@ -34,6 +34,9 @@
  * and should work on SFS when the file system assignment is
  * done. Sufficiently small files should work on SFS even before that
  * assignment.
+ *
+ * Afterwards, report where SEEK_DATA and SEEK_HOLE find the first
+ * data and hole, which must be consistent with one byte at the end.
  */
 
 #include <stdlib.h>
@@ -49,6 +52,7 @@ main(int argc, char *argv[])
 	int size;
 	int fd;
 	int r;
+	off_t data, hole;
 	char byte;
 
 	if (argc != 3) {
@@ -81,6 +85,20 @@ main(int argc, char *argv[])
 		errx(1, "%s: write: Unexpected result count %d", filename, r);
 	}
 
+	data = lseek(fd, 0, SEEK_DATA);
+	if (data == -1) {
+		err(1, "%s: lseek SEEK_DATA", filename);
+	}
+	hole = lseek(fd, 0, SEEK_HOLE);
+	if (hole == -1) {
+		err(1, "%s: lseek SEEK_HOLE", filename);
+	}
+	printf("First data at %lld, first hole at %lld\n",
+	       (long long)data, (long long)hole);
+	if (data > size-1 || hole > size || (hole > 0 && data > 0)) {
+		errx(1, "%s: Inconsistent data/hole offsets", filename);
+	}
+
 	close(fd);
 
 	return 0;
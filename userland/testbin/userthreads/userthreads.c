@@ -32,17 +32,10 @@
  * forks 3 threads off 2 to functions, each of which displays a string
  * every once in a while.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * The threads come from uthread_create in libthread. The parent
+ * leaves with uthread_exit, without joining, and the children keep
+ * running; each exits by returning from the function it started
+ * in, and the process exits when the last one does.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +44,9 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <uthread.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,26 +57,31 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void ThreadRunner(void *);
+void BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    struct uthread *t;
+    int i, result;
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    result = uthread_create(&t, ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    result = uthread_create(&t, BladeRunner, NULL);
+	if (result) {
+	    errno = result;
+	    err(1, "uthread_create");
+	}
     }
 
     printf("Parent has left.\n");
-    return 0;
+    uthread_exit();
 }
 
 /* multiple threads will simply print out the global variable.
@@ -89,8 +90,9 @@ main(int argc, char *argv[])
 */
 
 void
-BladeRunner()
+BladeRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
@@ -99,8 +101,9 @@ BladeRunner()
 }
 
 void
-ThreadRunner()
+ThreadRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");